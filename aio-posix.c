@@ -18,6 +18,8 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
 #ifdef CONFIG_EPOLL
 #include <sys/epoll.h>
 #endif
@@ -27,8 +29,13 @@ struct AioHandler
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     void *opaque;
+    const char *read_name;
+    const char *write_name;
+    AioHandlerStats *read_stats;
+    AioHandlerStats *write_stats;
     bool is_external;
     QLIST_ENTRY(AioHandler) node;
 };
@@ -202,12 +209,14 @@ static AioHandler *find_aio_handler(AioContext *ctx, int fd)
     return NULL;
 }
 
-void aio_set_fd_handler(AioContext *ctx,
-                        int fd,
-                        bool is_external,
-                        IOHandler *io_read,
-                        IOHandler *io_write,
-                        void *opaque)
+void aio_set_fd_handler_full(AioContext *ctx,
+                             int fd,
+                             bool is_external,
+                             IOHandler *io_read,
+                             IOHandler *io_write,
+                             void *opaque,
+                             const char *read_name,
+                             const char *write_name)
 {
     AioHandler *node;
     bool is_new = false;
@@ -248,6 +257,10 @@ void aio_set_fd_handler(AioContext *ctx,
         node->io_write = io_write;
         node->opaque = opaque;
         node->is_external = is_external;
+        node->read_name = read_name;
+        node->write_name = write_name;
+        node->read_stats = NULL;
+        node->write_stats = NULL;
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
@@ -260,13 +273,30 @@ void aio_set_fd_handler(AioContext *ctx,
     }
 }
 
-void aio_set_event_notifier(AioContext *ctx,
-                            EventNotifier *notifier,
-                            bool is_external,
-                            EventNotifierHandler *io_read)
+void aio_set_event_notifier_full(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 bool is_external,
+                                 EventNotifierHandler *io_read,
+                                 const char *name)
 {
-    aio_set_fd_handler(ctx, event_notifier_get_fd(notifier),
-                       is_external, (IOHandler *)io_read, NULL, notifier);
+    aio_set_fd_handler_full(ctx, event_notifier_get_fd(notifier),
+                            is_external, (IOHandler *)io_read, NULL, notifier,
+                            name, NULL);
+}
+
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    AioHandler *node = find_aio_handler(ctx, fd);
+
+    assert(node);
+    node->io_poll = io_poll;
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier), io_poll);
 }
 
 bool aio_prepare(AioContext *ctx)
@@ -297,6 +327,7 @@ bool aio_dispatch(AioContext *ctx)
 {
     AioHandler *node;
     bool progress = false;
+    int64_t start;
 
     /*
      * If there are callbacks left that have been queued, we need to call them.
@@ -324,7 +355,9 @@ bool aio_dispatch(AioContext *ctx)
         if (!node->deleted &&
             (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
             node->io_read) {
+            start = aio_stats_start();
             node->io_read(node->opaque);
+            aio_stats_account(ctx, &node->read_stats, node->read_name, start);
 
             /* aio_notify() does not count as progress */
             if (node->opaque != &ctx->notifier) {
@@ -334,7 +367,10 @@ bool aio_dispatch(AioContext *ctx)
         if (!node->deleted &&
             (revents & (G_IO_OUT | G_IO_ERR)) &&
             node->io_write) {
+            start = aio_stats_start();
             node->io_write(node->opaque);
+            aio_stats_account(ctx, &node->write_stats, node->write_name,
+                              start);
             progress = true;
         }
 
@@ -350,7 +386,11 @@ bool aio_dispatch(AioContext *ctx)
     }
 
     /* Run our timers */
-    progress |= timerlistgroup_run_timers(&ctx->tlg);
+    start = aio_stats_start();
+    if (timerlistgroup_run_timers(&ctx->tlg)) {
+        aio_stats_account(ctx, &ctx->timer_stats, "timers", start);
+        progress = true;
+    }
 
     return progress;
 }
@@ -371,6 +411,86 @@ static __thread AioHandler **nodes;
 static __thread unsigned npfd, nalloc;
 static __thread Notifier pollfds_cleanup_notifier;
 
+/* Polling is only worthwhile if every source of events can be polled;
+ * otherwise an event on the others would wait for the window to end.
+ */
+static bool aio_can_poll(AioContext *ctx)
+{
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->pfd.events && !node->io_poll
+            && aio_node_check(ctx, node->is_external)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    bool progress = false;
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll
+            && aio_node_check(ctx, node->is_external)
+            && node->io_poll(node->opaque)
+            && node->opaque != &ctx->notifier) {
+            progress = true;
+        }
+    }
+    return progress;
+}
+
+/* Busy poll for up to @max_ns.  Stop early on progress, and also when
+ * aio_notify was called, since there is a bottom half to run then.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    int64_t end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+    bool progress;
+
+    assert(ctx->walking_handlers > 0);
+
+    do {
+        progress = run_poll_handlers_once(ctx);
+    } while (!progress && !atomic_read(&ctx->notified)
+             && qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    return progress;
+}
+
+static bool try_poll_mode(AioContext *ctx, bool blocking)
+{
+    int64_t max_ns;
+
+    if (!blocking || !ctx->poll_ns || !aio_can_poll(ctx)) {
+        return false;
+    }
+    /* Do not poll past the next timer */
+    max_ns = MIN((uint64_t)aio_compute_timeout(ctx), (uint64_t)ctx->poll_ns);
+    return max_ns && run_poll_handlers(ctx, max_ns);
+}
+
+/* Grow the polling window when aio_poll blocked for less than poll_max_ns,
+ * as a longer window would have caught the event, and shrink it when even
+ * the maximum window would have been too short.
+ */
+static void aio_adjust_poll_ns(AioContext *ctx, int64_t block_ns)
+{
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > ctx->poll_max_ns) {
+        ctx->poll_ns = ctx->poll_shrink ? ctx->poll_ns / ctx->poll_shrink : 0;
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : 2;
+
+        ctx->poll_ns = ctx->poll_ns ? ctx->poll_ns * grow : 4000;
+        ctx->poll_ns = MIN(ctx->poll_ns, ctx->poll_max_ns);
+    }
+}
+
 static void pollfds_cleanup(Notifier *n, void *unused)
 {
     g_assert(npfd == 0);
@@ -407,6 +527,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     int i, ret;
     bool progress;
     int64_t timeout;
+    int64_t start = 0;
 
     aio_context_acquire(ctx);
     progress = false;
@@ -426,37 +547,48 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     assert(npfd == 0);
 
-    /* fill pollfds */
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        if (!node->deleted && node->pfd.events
-            && !aio_epoll_enabled(ctx)
-            && aio_node_check(ctx, node->is_external)) {
-            add_pollfd(node);
-        }
+    if (blocking && ctx->poll_max_ns) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     }
 
-    timeout = blocking ? aio_compute_timeout(ctx) : 0;
-
-    /* wait until next event */
-    if (timeout) {
-        aio_context_release(ctx);
-    }
-    if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
-        AioHandler epoll_handler;
-
-        epoll_handler.pfd.fd = ctx->epollfd;
-        epoll_handler.pfd.events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR;
-        npfd = 0;
-        add_pollfd(&epoll_handler);
-        ret = aio_epoll(ctx, pollfds, npfd, timeout);
-    } else  {
-        ret = qemu_poll_ns(pollfds, npfd, timeout);
-    }
-    if (blocking) {
+    if (try_poll_mode(ctx, blocking)) {
+        progress = true;
+        ret = 0;
         atomic_sub(&ctx->notify_me, 2);
-    }
-    if (timeout) {
-        aio_context_acquire(ctx);
+    } else {
+        /* fill pollfds */
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (!node->deleted && node->pfd.events
+                && !aio_epoll_enabled(ctx)
+                && aio_node_check(ctx, node->is_external)) {
+                add_pollfd(node);
+            }
+        }
+
+        timeout = blocking ? aio_compute_timeout(ctx) : 0;
+
+        /* wait until next event */
+        if (timeout) {
+            aio_context_release(ctx);
+        }
+        if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
+            AioHandler epoll_handler;
+
+            epoll_handler.pfd.fd = ctx->epollfd;
+            epoll_handler.pfd.events = G_IO_IN | G_IO_OUT | G_IO_HUP |
+                                       G_IO_ERR;
+            npfd = 0;
+            add_pollfd(&epoll_handler);
+            ret = aio_epoll(ctx, pollfds, npfd, timeout);
+        } else  {
+            ret = qemu_poll_ns(pollfds, npfd, timeout);
+        }
+        if (blocking) {
+            atomic_sub(&ctx->notify_me, 2);
+        }
+        if (timeout) {
+            aio_context_acquire(ctx);
+        }
     }
 
     aio_notify_accept(ctx);
@@ -471,6 +603,10 @@ bool aio_poll(AioContext *ctx, bool blocking)
     npfd = 0;
     ctx->walking_handlers--;
 
+    if (blocking && ctx->poll_max_ns) {
+        aio_adjust_poll_ns(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
+
     /* Run dispatch even if there were no readable fds to run timers */
     if (aio_dispatch(ctx)) {
         progress = true;
@@ -493,3 +629,22 @@ void aio_context_setup(AioContext *ctx, Error **errp)
     }
 #endif
 }
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    if (max_ns < 0 || grow < 0 || shrink < 0) {
+        error_setg(errp, "polling parameters must not be negative");
+        return;
+    }
+
+    /* No thread synchronization here, it doesn't matter if an incorrect
+     * value is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
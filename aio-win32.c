@@ -20,6 +20,7 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qapi/error.h"
 
 struct AioHandler {
     EventNotifier *e;
@@ -29,16 +30,22 @@ struct AioHandler {
     GPollFD pfd;
     int deleted;
     void *opaque;
+    const char *read_name;
+    const char *write_name;
+    AioHandlerStats *read_stats;
+    AioHandlerStats *write_stats;
     bool is_external;
     QLIST_ENTRY(AioHandler) node;
 };
 
-void aio_set_fd_handler(AioContext *ctx,
-                        int fd,
-                        bool is_external,
-                        IOHandler *io_read,
-                        IOHandler *io_write,
-                        void *opaque)
+void aio_set_fd_handler_full(AioContext *ctx,
+                             int fd,
+                             bool is_external,
+                             IOHandler *io_read,
+                             IOHandler *io_write,
+                             void *opaque,
+                             const char *read_name,
+                             const char *write_name)
 {
     /* fd is a SOCKET in our case */
     AioHandler *node;
@@ -90,6 +97,10 @@ void aio_set_fd_handler(AioContext *ctx,
         node->io_read = io_read;
         node->io_write = io_write;
         node->is_external = is_external;
+        node->read_name = read_name;
+        node->write_name = write_name;
+        node->read_stats = NULL;
+        node->write_stats = NULL;
 
         event = event_notifier_get_handle(&ctx->notifier);
         WSAEventSelect(node->pfd.fd, event,
@@ -100,10 +111,11 @@ void aio_set_fd_handler(AioContext *ctx,
     aio_notify(ctx);
 }
 
-void aio_set_event_notifier(AioContext *ctx,
-                            EventNotifier *e,
-                            bool is_external,
-                            EventNotifierHandler *io_notify)
+void aio_set_event_notifier_full(AioContext *ctx,
+                                 EventNotifier *e,
+                                 bool is_external,
+                                 EventNotifierHandler *io_notify,
+                                 const char *name)
 {
     AioHandler *node;
 
@@ -145,11 +157,23 @@ void aio_set_event_notifier(AioContext *ctx,
         }
         /* Update handler with latest information */
         node->io_notify = io_notify;
+        node->read_name = name;
+        node->read_stats = NULL;
     }
 
     aio_notify(ctx);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     static struct timeval tv0;
@@ -211,6 +235,7 @@ static bool aio_dispatch_handlers(AioContext *ctx, HANDLE event)
 {
     AioHandler *node;
     bool progress = false;
+    int64_t start;
 
     /*
      * We have to walk very carefully in case aio_set_fd_handler is
@@ -227,7 +252,9 @@ static bool aio_dispatch_handlers(AioContext *ctx, HANDLE event)
             (revents || event_notifier_get_handle(node->e) == event) &&
             node->io_notify) {
             node->pfd.revents = 0;
+            start = aio_stats_start();
             node->io_notify(node->e);
+            aio_stats_account(ctx, &node->read_stats, node->read_name, start);
 
             /* aio_notify() does not count as progress */
             if (node->e != &ctx->notifier) {
@@ -239,11 +266,17 @@ static bool aio_dispatch_handlers(AioContext *ctx, HANDLE event)
             (node->io_read || node->io_write)) {
             node->pfd.revents = 0;
             if ((revents & G_IO_IN) && node->io_read) {
+                start = aio_stats_start();
                 node->io_read(node->opaque);
+                aio_stats_account(ctx, &node->read_stats, node->read_name,
+                                  start);
                 progress = true;
             }
             if ((revents & G_IO_OUT) && node->io_write) {
+                start = aio_stats_start();
                 node->io_write(node->opaque);
+                aio_stats_account(ctx, &node->write_stats, node->write_name,
+                                  start);
                 progress = true;
             }
 
@@ -271,13 +304,24 @@ static bool aio_dispatch_handlers(AioContext *ctx, HANDLE event)
     return progress;
 }
 
+static bool aio_dispatch_timers(AioContext *ctx)
+{
+    int64_t start = aio_stats_start();
+
+    if (timerlistgroup_run_timers(&ctx->tlg)) {
+        aio_stats_account(ctx, &ctx->timer_stats, "timers", start);
+        return true;
+    }
+    return false;
+}
+
 bool aio_dispatch(AioContext *ctx)
 {
     bool progress;
 
     progress = aio_bh_poll(ctx);
     progress |= aio_dispatch_handlers(ctx, INVALID_HANDLE_VALUE);
-    progress |= timerlistgroup_run_timers(&ctx->tlg);
+    progress |= aio_dispatch_timers(ctx);
     return progress;
 }
 
@@ -365,7 +409,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
         progress |= aio_dispatch_handlers(ctx, event);
     } while (count > 0);
 
-    progress |= timerlistgroup_run_timers(&ctx->tlg);
+    progress |= aio_dispatch_timers(ctx);
 
     aio_context_release(ctx);
     return progress;
@@ -374,3 +418,11 @@ bool aio_poll(AioContext *ctx, bool blocking)
 void aio_context_setup(AioContext *ctx, Error **errp)
 {
 }
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    if (max_ns) {
+        error_setg(errp, "AioContext polling is not implemented on Windows");
+    }
+}
@@ -28,21 +28,187 @@
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
 #include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "trace.h"
+
+bool aio_stats_enabled;
+int64_t aio_stats_slow_ns;
+
+static AioHandlerStats *aio_stats_lookup(AioContext *ctx, const char *name)
+{
+    AioHandlerStats *stats;
+
+    qemu_mutex_lock(&ctx->stats_lock);
+    stats = g_hash_table_lookup(ctx->stats, name);
+    if (!stats) {
+        stats = g_new0(AioHandlerStats, 1);
+        stats->name = name;
+        g_hash_table_insert(ctx->stats, (gpointer)name, stats);
+    }
+    qemu_mutex_unlock(&ctx->stats_lock);
+    return stats;
+}
+
+void aio_stats_account(AioContext *ctx, AioHandlerStats **pstats,
+                       const char *name, int64_t start)
+{
+    AioHandlerStats *stats = *pstats;
+    int64_t ns, limit;
+    int i;
+
+    if (!start) {
+        return;
+    }
+    ns = get_clock() - start;
+
+    if (!stats) {
+        stats = aio_stats_lookup(ctx, name);
+        *pstats = stats;
+    }
+
+    stats->count++;
+    stats->total_ns += ns;
+    for (i = 0, limit = 10000; i < AIO_STATS_BUCKETS - 1; i++, limit *= 10) {
+        if (ns < limit) {
+            break;
+        }
+    }
+    stats->histogram[i]++;
+
+    if (aio_stats_slow_ns && ns >= aio_stats_slow_ns) {
+        trace_aio_slow_handler(ctx, name, ns);
+        /* Only report new maximums, to avoid flooding the log */
+        if (ns > stats->max_ns) {
+            error_report("event loop handler %s took %" PRId64 " us",
+                         name, ns / 1000);
+        }
+    }
+    if (ns > stats->max_ns) {
+        stats->max_ns = ns;
+    }
+}
+
+void aio_stats_foreach(AioContext *ctx,
+                       void (*fn)(const AioHandlerStats *stats, void *opaque),
+                       void *opaque)
+{
+    GHashTableIter iter;
+    AioHandlerStats *stats, copy;
+
+    qemu_mutex_lock(&ctx->stats_lock);
+    g_hash_table_iter_init(&iter, ctx->stats);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&stats)) {
+        copy = *stats;
+        if (copy.count) {
+            fn(&copy, opaque);
+        }
+    }
+    qemu_mutex_unlock(&ctx->stats_lock);
+}
+
+void aio_stats_reset(AioContext *ctx)
+{
+    GHashTableIter iter;
+    AioHandlerStats *stats;
+
+    /* Handlers cache pointers to the entries, so keep them around */
+    qemu_mutex_lock(&ctx->stats_lock);
+    g_hash_table_iter_init(&iter, ctx->stats);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&stats)) {
+        *stats = (AioHandlerStats) { .name = stats->name };
+    }
+    qemu_mutex_unlock(&ctx->stats_lock);
+}
 
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
 
+/* QEMUBH::flags values */
+enum {
+    /* On one of the lists of the AioContext, waiting for aio_bh_poll */
+    BH_PENDING   = (1 << 0),
+    /* Invoke the callback */
+    BH_SCHEDULED = (1 << 1),
+    /* Free without invoking the callback */
+    BH_DELETED   = (1 << 2),
+    /* Scheduled with qemu_bh_schedule_idle */
+    BH_IDLE      = (1 << 3),
+};
+
 struct QEMUBH {
     AioContext *ctx;
     QEMUBHFunc *cb;
     void *opaque;
-    QEMUBH *next;
-    bool scheduled;
-    bool idle;
-    bool deleted;
+    const char *name;
+    AioHandlerStats *stats;
+    QSLIST_ENTRY(QEMUBH) next;
+    QEMUBHPriority prio;
+    unsigned flags;
 };
 
-QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
+struct BHListSlice {
+    QEMUBHList bh_list[QEMU_BH_PRIO_MAX];
+    QSIMPLEQ_ENTRY(BHListSlice) next;
+};
+
+/* Add @new_flags to the BH, and push it to the AioContext unless it is
+ * already there.  Called concurrently from any thread.
+ */
+static void aio_bh_enqueue(QEMUBH *bh, unsigned new_flags)
+{
+    AioContext *ctx = bh->ctx;
+    QEMUBHList *list = &ctx->bh_list[bh->prio];
+    QEMUBH *old_first;
+    unsigned old_flags;
+
+    /* The memory barrier implicit in atomic_fetch_or makes sure that:
+     * 1. any writes needed by the callback are done before the
+     *    locations are read in the aio_bh_poll.
+     * 2. ctx is loaded before the BH is pushed, since afterwards the
+     *    callback has a chance to execute and the BH could be freed.
+     */
+    old_flags = atomic_fetch_or(&bh->flags, BH_PENDING | new_flags);
+    if (old_flags & BH_PENDING) {
+        return;
+    }
+
+    do {
+        old_first = atomic_read(&list->slh_first);
+        bh->next.sle_next = old_first;
+    } while (atomic_cmpxchg(&list->slh_first, old_first, bh) != old_first);
+
+    /* Whoever made the list non-empty has notified the event loop, which
+     * will take this BH together with the others.
+     */
+    if (!old_first) {
+        aio_notify(ctx);
+    }
+}
+
+/* Only called by the thread that runs aio_bh_poll */
+static QEMUBH *aio_bh_dequeue(QEMUBHList *head, unsigned *flags)
+{
+    QEMUBH *bh = QSLIST_FIRST(head);
+
+    if (!bh) {
+        return NULL;
+    }
+
+    QSLIST_REMOVE_HEAD(head, next);
+
+    /* The atomic_fetch_and is paired with the one in aio_bh_enqueue.  The
+     * implicit memory barrier ensures that the callback sees all writes
+     * done by the scheduling thread.  It also ensures that the scheduling
+     * thread sees the cleared flags before bh->cb has run, and thus will
+     * push the BH again if necessary.
+     */
+    *flags = atomic_fetch_and(&bh->flags,
+                              ~(BH_PENDING | BH_SCHEDULED | BH_IDLE));
+    return bh;
+}
+
+QEMUBH *aio_bh_new_full(AioContext *ctx, QEMUBHFunc *cb, void *opaque,
+                        const char *name)
 {
     QEMUBH *bh;
     bh = g_new(QEMUBH, 1);
@@ -50,66 +216,74 @@ QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
         .ctx = ctx,
         .cb = cb,
         .opaque = opaque,
+        .name = name,
+        .prio = QEMU_BH_PRIO_NORMAL,
     };
-    qemu_mutex_lock(&ctx->bh_lock);
-    bh->next = ctx->first_bh;
-    /* Make sure that the members are ready before putting bh into list */
-    smp_wmb();
-    ctx->first_bh = bh;
-    qemu_mutex_unlock(&ctx->bh_lock);
     return bh;
 }
 
 void aio_bh_call(QEMUBH *bh)
 {
+    AioContext *ctx = bh->ctx;
+    const char *name = bh->name;
+    AioHandlerStats *stats;
+    int64_t start = aio_stats_start();
+
+    if (start && !bh->stats) {
+        bh->stats = aio_stats_lookup(ctx, name);
+    }
+    stats = bh->stats;
+
     bh->cb(bh->opaque);
+
+    /* The callback may have deleted the BH, and a nested aio_bh_poll may
+     * even have freed it already.
+     */
+    aio_stats_account(ctx, &stats, name, start);
 }
 
 /* Multiple occurrences of aio_bh_poll cannot be called concurrently */
 int aio_bh_poll(AioContext *ctx)
 {
-    QEMUBH *bh, **bhp, *next;
-    int ret;
+    BHListSlice slice;
+    BHListSlice *s;
+    QEMUBH *bh, *next;
+    unsigned flags;
+    int i, ret = 0;
+
+    /* Take the scheduled BHs, reversing the lists so that they run in
+     * the order they were scheduled.
+     */
+    for (i = 0; i < QEMU_BH_PRIO_MAX; i++) {
+        bh = atomic_xchg(&ctx->bh_list[i].slh_first, NULL);
+        QSLIST_INIT(&slice.bh_list[i]);
+        for (; bh; bh = next) {
+            next = QSLIST_NEXT(bh, next);
+            QSLIST_INSERT_HEAD(&slice.bh_list[i], bh, next);
+        }
+    }
+    QSIMPLEQ_INSERT_TAIL(&ctx->bh_slice_list, &slice, next);
+
+    while ((s = QSIMPLEQ_FIRST(&ctx->bh_slice_list))) {
+        bh = NULL;
+        for (i = 0; i < QEMU_BH_PRIO_MAX && !bh; i++) {
+            bh = aio_bh_dequeue(&s->bh_list[i], &flags);
+        }
+        if (!bh) {
+            QSIMPLEQ_REMOVE_HEAD(&ctx->bh_slice_list, next);
+            continue;
+        }
 
-    ctx->walking_bh++;
-
-    ret = 0;
-    for (bh = ctx->first_bh; bh; bh = next) {
-        /* Make sure that fetching bh happens before accessing its members */
-        smp_read_barrier_depends();
-        next = bh->next;
-        /* The atomic_xchg is paired with the one in qemu_bh_schedule.  The
-         * implicit memory barrier ensures that the callback sees all writes
-         * done by the scheduling thread.  It also ensures that the scheduling
-         * thread sees the zero before bh->cb has run, and thus will call
-         * aio_notify again if necessary.
-         */
-        if (!bh->deleted && atomic_xchg(&bh->scheduled, 0)) {
+        if ((flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
             /* Idle BHs and the notify BH don't count as progress */
-            if (!bh->idle && bh != ctx->notify_dummy_bh) {
+            if (!(flags & BH_IDLE) && bh != ctx->notify_dummy_bh) {
                 ret = 1;
             }
-            bh->idle = 0;
             aio_bh_call(bh);
         }
-    }
-
-    ctx->walking_bh--;
-
-    /* remove deleted bhs */
-    if (!ctx->walking_bh) {
-        qemu_mutex_lock(&ctx->bh_lock);
-        bhp = &ctx->first_bh;
-        while (*bhp) {
-            bh = *bhp;
-            if (bh->deleted) {
-                *bhp = bh->next;
-                g_free(bh);
-            } else {
-                bhp = &bh->next;
-            }
+        if (flags & BH_DELETED) {
+            g_free(bh);
         }
-        qemu_mutex_unlock(&ctx->bh_lock);
     }
 
     return ret;
@@ -117,57 +291,48 @@ int aio_bh_poll(AioContext *ctx)
 
 void qemu_bh_schedule_idle(QEMUBH *bh)
 {
-    bh->idle = 1;
-    /* Make sure that idle & any writes needed by the callback are done
-     * before the locations are read in the aio_bh_poll.
-     */
-    atomic_mb_set(&bh->scheduled, 1);
+    aio_bh_enqueue(bh, BH_SCHEDULED | BH_IDLE);
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
 {
-    AioContext *ctx;
-
-    ctx = bh->ctx;
-    bh->idle = 0;
-    /* The memory barrier implicit in atomic_xchg makes sure that:
-     * 1. idle & any writes needed by the callback are done before the
-     *    locations are read in the aio_bh_poll.
-     * 2. ctx is loaded before scheduled is set and the callback has a chance
-     *    to execute.
-     */
-    if (atomic_xchg(&bh->scheduled, 1) == 0) {
-        aio_notify(ctx);
-    }
+    aio_bh_enqueue(bh, BH_SCHEDULED);
 }
 
+void qemu_bh_set_priority(QEMUBH *bh, QEMUBHPriority prio)
+{
+    assert(prio < QEMU_BH_PRIO_MAX);
+    bh->prio = prio;
+}
 
 /* This func is async.
  */
 void qemu_bh_cancel(QEMUBH *bh)
 {
-    bh->scheduled = 0;
+    atomic_and(&bh->flags, ~BH_SCHEDULED);
 }
 
-/* This func is async.The bottom half will do the delete action at the finial
- * end.
+/* This func is async.  The bottom half is freed by aio_bh_poll, without
+ * running its callback.
  */
 void qemu_bh_delete(QEMUBH *bh)
 {
-    bh->scheduled = 0;
-    bh->deleted = 1;
+    aio_bh_enqueue(bh, BH_DELETED);
 }
 
-int64_t
-aio_compute_timeout(AioContext *ctx)
+/* Returns 0 if a non-idle BH is scheduled, 10 ms if only idle BHs are, or
+ * -1 if none is.
+ */
+static int64_t aio_bh_list_timeout(QEMUBHList *head, int64_t timeout)
 {
-    int64_t deadline;
-    int timeout = -1;
     QEMUBH *bh;
+    unsigned flags;
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (!bh->deleted && bh->scheduled) {
-            if (bh->idle) {
+    for (bh = atomic_rcu_read(&head->slh_first); bh;
+         bh = QSLIST_NEXT(bh, next)) {
+        flags = atomic_read(&bh->flags);
+        if ((flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
+            if (flags & BH_IDLE) {
                 /* idle bottom halves will be polled at least
                  * every 10ms */
                 timeout = 10000000;
@@ -178,6 +343,33 @@ aio_compute_timeout(AioContext *ctx)
             }
         }
     }
+    return timeout;
+}
+
+static int64_t aio_bh_timeout(AioContext *ctx)
+{
+    BHListSlice *s;
+    int64_t timeout = -1;
+    int i;
+
+    for (i = 0; i < QEMU_BH_PRIO_MAX && timeout; i++) {
+        timeout = aio_bh_list_timeout(&ctx->bh_list[i], timeout);
+        QSIMPLEQ_FOREACH(s, &ctx->bh_slice_list, next) {
+            timeout = aio_bh_list_timeout(&s->bh_list[i], timeout);
+        }
+    }
+    return timeout;
+}
+
+int64_t
+aio_compute_timeout(AioContext *ctx)
+{
+    int64_t deadline;
+    int64_t timeout = aio_bh_timeout(ctx);
+
+    if (timeout == 0) {
+        return 0;
+    }
 
     deadline = timerlistgroup_deadline_ns(&ctx->tlg);
     if (deadline == 0) {
@@ -208,15 +400,12 @@ static gboolean
 aio_ctx_check(GSource *source)
 {
     AioContext *ctx = (AioContext *) source;
-    QEMUBH *bh;
 
     atomic_and(&ctx->notify_me, ~1);
     aio_notify_accept(ctx);
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (!bh->deleted && bh->scheduled) {
-            return true;
-	}
+    if (aio_bh_timeout(ctx) != -1) {
+        return true;
     }
     return aio_pending(ctx) || (timerlistgroup_deadline_ns(&ctx->tlg) == 0);
 }
@@ -237,27 +426,33 @@ static void
 aio_ctx_finalize(GSource     *source)
 {
     AioContext *ctx = (AioContext *) source;
+    QEMUBH *bh;
+    unsigned flags;
+    int i;
 
     qemu_bh_delete(ctx->notify_dummy_bh);
     thread_pool_free(ctx->thread_pool);
 
-    qemu_mutex_lock(&ctx->bh_lock);
-    while (ctx->first_bh) {
-        QEMUBH *next = ctx->first_bh->next;
+    /* There must be no aio_bh_poll() calls going on */
+    assert(QSIMPLEQ_EMPTY(&ctx->bh_slice_list));
 
-        /* qemu_bh_delete() must have been called on BHs in this AioContext */
-        assert(ctx->first_bh->deleted);
+    for (i = 0; i < QEMU_BH_PRIO_MAX; i++) {
+        while ((bh = aio_bh_dequeue(&ctx->bh_list[i], &flags))) {
+            /* qemu_bh_delete() must have been called on BHs in this
+             * AioContext
+             */
+            assert(flags & BH_DELETED);
 
-        g_free(ctx->first_bh);
-        ctx->first_bh = next;
+            g_free(bh);
+        }
     }
-    qemu_mutex_unlock(&ctx->bh_lock);
 
     aio_set_event_notifier(ctx, &ctx->notifier, false, NULL);
     event_notifier_cleanup(&ctx->notifier);
     rfifolock_destroy(&ctx->lock);
-    qemu_mutex_destroy(&ctx->bh_lock);
     timerlistgroup_deinit(&ctx->tlg);
+    g_hash_table_destroy(ctx->stats);
+    qemu_mutex_destroy(&ctx->stats_lock);
 }
 
 static GSourceFuncs aio_source_funcs = {
@@ -283,7 +478,7 @@ ThreadPool *aio_get_thread_pool(AioContext *ctx)
 
 void aio_notify(AioContext *ctx)
 {
-    /* Write e.g. bh->scheduled before reading ctx->notify_me.  Pairs
+    /* Write e.g. bh->flags before reading ctx->notify_me.  Pairs
      * with atomic_or in aio_ctx_prepare or atomic_add in aio_poll.
      */
     smp_mb();
@@ -322,6 +517,15 @@ static void event_notifier_dummy_cb(EventNotifier *e)
 {
 }
 
+/* Polling for aio_notify; run_poll_handlers stops when it is called.  */
+static bool event_notifier_poll(void *opaque)
+{
+    EventNotifier *e = opaque;
+    AioContext *ctx = container_of(e, AioContext, notifier);
+
+    return atomic_read(&ctx->notified);
+}
+
 AioContext *aio_context_new(Error **errp)
 {
     int ret;
@@ -329,6 +533,8 @@ AioContext *aio_context_new(Error **errp)
     Error *local_err = NULL;
 
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
+    qemu_mutex_init(&ctx->stats_lock);
+    ctx->stats = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
     aio_context_setup(ctx, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -344,8 +550,9 @@ AioContext *aio_context_new(Error **errp)
                            false,
                            (EventNotifierHandler *)
                            event_notifier_dummy_cb);
+    aio_set_event_notifier_poll(ctx, &ctx->notifier, event_notifier_poll);
     ctx->thread_pool = NULL;
-    qemu_mutex_init(&ctx->bh_lock);
+    QSIMPLEQ_INIT(&ctx->bh_slice_list);
     rfifolock_init(&ctx->lock, aio_rfifolock_cb, ctx);
     timerlistgroup_init(&ctx->tlg, aio_timerlist_notify, ctx);
 
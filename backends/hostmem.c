@@ -11,6 +11,7 @@
  */
 #include "qemu/osdep.h"
 #include "sysemu/hostmem.h"
+#include "sysemu/sysemu.h"
 #include "hw/boards.h"
 #include "qapi/visitor.h"
 #include "qapi-types.h"
@@ -186,6 +187,39 @@ static void host_memory_backend_set_dump(Object *obj, bool value, Error **errp)
     }
 }
 
+static bool host_memory_backend_get_hugepages(Object *obj, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    return backend->hugepages;
+}
+
+static void host_memory_backend_set_hugepages(Object *obj, bool value,
+                                              Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    if (!memory_region_size(&backend->mr)) {
+        backend->hugepages = value;
+        return;
+    }
+
+    if (value != backend->hugepages) {
+        void *ptr = memory_region_get_ram_ptr(&backend->mr);
+        uint64_t sz = memory_region_size(&backend->mr);
+
+        qemu_madvise(ptr, sz,
+                     value ? QEMU_MADV_HUGEPAGE : QEMU_MADV_NOHUGEPAGE);
+        backend->hugepages = value;
+    }
+}
+
+/* By default, as many threads as the guest has vCPUs */
+static int host_memory_backend_prealloc_threads(HostMemoryBackend *backend)
+{
+    return backend->prealloc_threads ? backend->prealloc_threads : smp_cpus;
+}
+
 static bool host_memory_backend_get_prealloc(Object *obj, Error **errp)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -216,11 +250,45 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
         void *ptr = memory_region_get_ram_ptr(&backend->mr);
         uint64_t sz = memory_region_size(&backend->mr);
 
-        os_mem_prealloc(fd, ptr, sz);
+        os_mem_prealloc(fd, ptr, sz,
+                        host_memory_backend_prealloc_threads(backend));
         backend->prealloc = true;
     }
 }
 
+static void
+host_memory_backend_get_prealloc_threads(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    visit_type_uint32(v, name, &backend->prealloc_threads, errp);
+}
+
+static void
+host_memory_backend_set_prealloc_threads(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (!value) {
+        error_setg(&local_err, "Property '%s.%s' doesn't take value '%"
+                   PRIu32 "'", object_get_typename(obj), name, value);
+        goto out;
+    }
+    backend->prealloc_threads = value;
+out:
+    error_propagate(errp, local_err);
+}
+
 static void host_memory_backend_init(Object *obj)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -228,6 +296,7 @@ static void host_memory_backend_init(Object *obj)
 
     backend->merge = machine_mem_merge(machine);
     backend->dump = machine_dump_guest_core(machine);
+    backend->hugepages = true;
     backend->prealloc = mem_prealloc;
 
     object_property_add_bool(obj, "merge",
@@ -236,9 +305,16 @@ static void host_memory_backend_init(Object *obj)
     object_property_add_bool(obj, "dump",
                         host_memory_backend_get_dump,
                         host_memory_backend_set_dump, NULL);
+    object_property_add_bool(obj, "hugepages",
+                        host_memory_backend_get_hugepages,
+                        host_memory_backend_set_hugepages, NULL);
     object_property_add_bool(obj, "prealloc",
                         host_memory_backend_get_prealloc,
                         host_memory_backend_set_prealloc, NULL);
+    object_property_add(obj, "prealloc-threads", "uint32",
+                        host_memory_backend_get_prealloc_threads,
+                        host_memory_backend_set_prealloc_threads,
+                        NULL, NULL, NULL);
     object_property_add(obj, "size", "int",
                         host_memory_backend_get_size,
                         host_memory_backend_set_size, NULL, NULL, NULL);
@@ -282,6 +358,10 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
         if (!backend->dump) {
             qemu_madvise(ptr, sz, QEMU_MADV_DONTDUMP);
         }
+        /* RAM blocks ask for transparent huge pages by default */
+        if (!backend->hugepages) {
+            qemu_madvise(ptr, sz, QEMU_MADV_NOHUGEPAGE);
+        }
 #ifdef CONFIG_NUMA
         unsigned long lastbit = find_last_bit(backend->host_nodes, MAX_NODES);
         /* lastbit == MAX_NODES means maxnode = 0 */
@@ -326,10 +406,67 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
          * specified NUMA policy in place.
          */
         if (backend->prealloc) {
-            os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz);
+            os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz,
+                            host_memory_backend_prealloc_threads(backend));
+        }
+    }
+}
+
+#ifdef __linux__
+MemdevUsage *host_memory_backend_get_usage(HostMemoryBackend *backend)
+{
+    uintptr_t start, end;
+    MemdevUsage *usage;
+    bool in_range = false;
+    char line[256];
+    FILE *f;
+
+    if (!memory_region_size(&backend->mr)) {
+        return NULL;
+    }
+    start = (uintptr_t)memory_region_get_ram_ptr(&backend->mr);
+    end = start + memory_region_size(&backend->mr);
+
+    f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return NULL;
+    }
+
+    /* madvise() and mbind() may have split the backend into several
+     * mappings, add up all of them.
+     */
+    usage = g_new0(MemdevUsage, 1);
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long vma_start, vma_end;
+        uint64_t kb;
+
+        if (sscanf(line, "%lx-%lx ", &vma_start, &vma_end) == 2) {
+            in_range = vma_start >= start && vma_end <= end;
+        } else if (!in_range) {
+            continue;
+        } else if (sscanf(line, "Rss: %" SCNu64, &kb) == 1) {
+            usage->resident += kb << 10;
+        } else if (sscanf(line, "Shared_Clean: %" SCNu64, &kb) == 1 ||
+                   sscanf(line, "Shared_Dirty: %" SCNu64, &kb) == 1) {
+            usage->shared += kb << 10;
+        } else if (sscanf(line, "AnonHugePages: %" SCNu64, &kb) == 1) {
+            usage->anon_hugepages += kb << 10;
+        } else if (sscanf(line, "KSM: %" SCNu64, &kb) == 1) {
+            /* Only reported by recent kernels */
+            usage->merged += kb << 10;
+            usage->has_merged = true;
         }
     }
+
+    fclose(f);
+    return usage;
 }
+#else
+MemdevUsage *host_memory_backend_get_usage(HostMemoryBackend *backend)
+{
+    return NULL;
+}
+#endif
 
 static bool
 host_memory_backend_can_be_deleted(UserCreatable *uc, Error **errp)
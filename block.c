@@ -243,8 +243,12 @@ BlockDriverState *bdrv_new(void)
         QLIST_INIT(&bs->op_blockers[i]);
     }
     notifier_with_return_list_init(&bs->before_write_notifiers);
+    notifier_with_return_list_init(&bs->after_write_notifiers);
     qemu_co_queue_init(&bs->throttled_reqs[0]);
     qemu_co_queue_init(&bs->throttled_reqs[1]);
+    QSIMPLEQ_INIT(&bs->throttle_waiters[0]);
+    QSIMPLEQ_INIT(&bs->throttle_waiters[1]);
+    throttle_group_member_config_init(&bs->throttle_member_cfg);
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
@@ -2144,9 +2148,6 @@ static void bdrv_close(BlockDriverState *bs)
     bdrv_flush(bs);
     bdrv_drain(bs); /* in case flush left pending I/O */
 
-    bdrv_release_named_dirty_bitmaps(bs);
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
-
     if (bs->blk) {
         blk_dev_change_media_cb(bs->blk, false);
     }
@@ -2190,6 +2191,11 @@ static void bdrv_close(BlockDriverState *bs)
         bs->full_open_options = NULL;
     }
 
+    /* Released only after bdrv_close() so that drivers can still store
+     * persistent bitmaps there */
+    bdrv_release_named_dirty_bitmaps(bs);
+    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
+
     QLIST_FOREACH_SAFE(ban, &bs->aio_notifiers, list, ban_next) {
         g_free(ban);
     }
@@ -2304,8 +2310,12 @@ static void swap_feature_fields(BlockDriverState *bs_top,
 
     assert(!bs_new->throttle_state);
     if (bs_top->throttle_state) {
+        ThrottleGroupMemberConfig member_cfg;
+
         assert(bs_top->io_limits_enabled);
+        throttle_group_get_member_config(bs_top, &member_cfg);
         bdrv_io_limits_enable(bs_new, throttle_group_get_name(bs_top));
+        throttle_group_set_member_config(bs_new, &member_cfg);
         bdrv_io_limits_disable(bs_top);
     }
 }
@@ -2671,6 +2681,19 @@ exit:
     return ret;
 }
 
+/* Update the state of @bs after its driver changed the size to @offset */
+static int bdrv_truncated(BlockDriverState *bs, int64_t offset)
+{
+    int ret;
+
+    ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
+    bdrv_dirty_bitmap_truncate(bs);
+    if (bs->blk) {
+        blk_dev_resize_cb(bs->blk);
+    }
+    return ret;
+}
+
 /**
  * Truncate file to 'offset' bytes (needed only for file protocols)
  */
@@ -2687,11 +2710,51 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
 
     ret = drv->bdrv_truncate(bs, offset);
     if (ret == 0) {
-        ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
-        bdrv_dirty_bitmap_truncate(bs);
-        if (bs->blk) {
-            blk_dev_resize_cb(bs->blk);
-        }
+        ret = bdrv_truncated(bs, offset);
+    }
+    return ret;
+}
+
+/**
+ * Grow file to 'offset' bytes and preallocate the new area according to
+ * 'prealloc'.  With PREALLOC_MODE_OFF, this is the same as bdrv_truncate().
+ */
+int bdrv_truncate_prealloc(BlockDriverState *bs, int64_t offset,
+                           PreallocMode prealloc, Error **errp)
+{
+    BlockDriver *drv = bs->drv;
+    int64_t old_size;
+    int ret;
+
+    if (prealloc == PREALLOC_MODE_OFF) {
+        return bdrv_truncate(bs, offset);
+    }
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_truncate_prealloc) {
+        error_setg(errp, "Driver '%s' does not support preallocation when "
+                   "resizing", drv->format_name);
+        return -ENOTSUP;
+    }
+    if (bs->read_only) {
+        return -EACCES;
+    }
+
+    old_size = bdrv_getlength(bs);
+    if (old_size < 0) {
+        error_setg_errno(errp, -old_size, "Could not get the image size");
+        return old_size;
+    }
+    if (offset < old_size) {
+        error_setg(errp, "Preallocation can only be used when growing images");
+        return -ENOTSUP;
+    }
+
+    ret = drv->bdrv_truncate_prealloc(bs, offset, prealloc, errp);
+    if (ret == 0) {
+        ret = bdrv_truncated(bs, offset);
     }
     return ret;
 }
@@ -3110,6 +3173,23 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+/* Process-wide memory budget for the metadata caches of image formats */
+static uint64_t metadata_cache_budget;
+
+void bdrv_set_metadata_cache_budget(int64_t size, Error **errp)
+{
+    if (size < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER, "size");
+        return;
+    }
+    metadata_cache_budget = size;
+}
+
+uint64_t bdrv_get_metadata_cache_budget(void)
+{
+    return metadata_cache_budget;
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
@@ -23,6 +23,9 @@
 #include "qemu/bitmap.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_WORKERS 8
+/* Maximum size of a single copy, for runs of adjacent clusters */
+#define BACKUP_MAX_COPY_SIZE (1 << 20)
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct CowRequest {
@@ -45,7 +48,17 @@ typedef struct BackupBlockJob {
     uint64_t sectors_read;
     unsigned long *done_bitmap;
     int64_t cluster_size;
+    /* Try to offload cluster copies to the storage first */
+    bool use_copy_range;
+    /* Flags for writes to the target, see backup_start() */
+    BdrvRequestFlags write_flags;
     QLIST_HEAD(, CowRequest) inflight_reqs;
+    /* Coroutines copying clusters for sync=full and sync=top */
+    int workers;
+    bool waiting_for_worker;
+    int worker_ret;
+    bool worker_error_is_read;
+    int64_t retry_cluster;
 } BackupBlockJob;
 
 /* Size of a cluster in sectors, instead of bytes. */
@@ -91,6 +104,59 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+/* Copy clusters by reading them into a bounce buffer and writing them out */
+static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
+                                                      BlockDriverState *bs,
+                                                      int64_t start, int n,
+                                                      void *bounce_buffer,
+                                                      bool *error_is_read,
+                                                      bool is_write_notifier)
+{
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    int ret;
+
+    iov.iov_base = bounce_buffer;
+    iov.iov_len = n * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+    if (is_write_notifier) {
+        ret = bdrv_co_readv_no_serialising(bs,
+                                       start * sectors_per_cluster,
+                                       n, &bounce_qiov);
+    } else {
+        ret = bdrv_co_readv(bs, start * sectors_per_cluster, n,
+                            &bounce_qiov);
+    }
+    if (ret < 0) {
+        trace_backup_do_cow_read_fail(job, start, ret);
+        if (error_is_read) {
+            *error_is_read = true;
+        }
+        return ret;
+    }
+
+    if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+        ret = bdrv_co_write_zeroes(job->target,
+                                   start * sectors_per_cluster, n,
+                                   BDRV_REQ_MAY_UNMAP | job->write_flags);
+    } else {
+        ret = bdrv_co_writev_flags(job->target,
+                                   start * sectors_per_cluster, n,
+                                   &bounce_qiov, job->write_flags);
+    }
+    if (ret < 0) {
+        trace_backup_do_cow_write_fail(job, start, ret);
+        if (error_is_read) {
+            *error_is_read = false;
+        }
+        return ret;
+    }
+
+    return 0;
+}
+
 static int coroutine_fn backup_do_cow(BlockDriverState *bs,
                                       int64_t sector_num, int nb_sectors,
                                       bool *error_is_read,
@@ -98,12 +164,11 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
 {
     BackupBlockJob *job = (BackupBlockJob *)bs->job;
     CowRequest cow_request;
-    struct iovec iov;
-    QEMUIOVector bounce_qiov;
     void *bounce_buffer = NULL;
     int ret = 0;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
-    int64_t start, end;
+    int64_t max_clusters = MAX(BACKUP_MAX_COPY_SIZE / job->cluster_size, 1);
+    int64_t start, end, clusters;
     int n;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
@@ -116,59 +181,54 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    for (; start < end; start += clusters) {
         if (test_bit(start, job->done_bitmap)) {
             trace_backup_do_cow_skip(job, start);
+            clusters = 1;
             continue; /* already copied */
         }
 
         trace_backup_do_cow_process(job, start);
 
-        n = MIN(sectors_per_cluster,
+        /* A guest write that spans several clusters should not pay one
+         * read and one write per cluster: copy the whole run of clusters
+         * that are still to be copied at once. */
+        clusters = find_next_bit(job->done_bitmap,
+                                 MIN(end, start + max_clusters),
+                                 start) - start;
+        n = MIN(clusters * sectors_per_cluster,
                 job->common.len / BDRV_SECTOR_SIZE -
                 start * sectors_per_cluster);
 
-        if (!bounce_buffer) {
-            bounce_buffer = qemu_blockalign(bs, job->cluster_size);
-        }
-        iov.iov_base = bounce_buffer;
-        iov.iov_len = n * BDRV_SECTOR_SIZE;
-        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
-
-        if (is_write_notifier) {
-            ret = bdrv_co_readv_no_serialising(bs,
-                                           start * sectors_per_cluster,
-                                           n, &bounce_qiov);
-        } else {
-            ret = bdrv_co_readv(bs, start * sectors_per_cluster, n,
-                                &bounce_qiov);
-        }
-        if (ret < 0) {
-            trace_backup_do_cow_read_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = true;
+        ret = -ENOTSUP;
+        if (job->use_copy_range) {
+            ret = bdrv_co_copy_range(bs, start * sectors_per_cluster,
+                                     job->target, start * sectors_per_cluster,
+                                     n, is_write_notifier ?
+                                        BDRV_REQ_NO_SERIALISING : 0);
+            if (ret < 0) {
+                /* Don't keep retrying the offload; any real error will be
+                 * reported by the buffered copy */
+                trace_backup_do_cow_copy_range_fail(job, start, ret);
+                job->use_copy_range = false;
             }
-            goto out;
-        }
-
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
-            ret = bdrv_co_write_zeroes(job->target,
-                                       start * sectors_per_cluster,
-                                       n, BDRV_REQ_MAY_UNMAP);
-        } else {
-            ret = bdrv_co_writev(job->target,
-                                 start * sectors_per_cluster, n,
-                                 &bounce_qiov);
         }
         if (ret < 0) {
-            trace_backup_do_cow_write_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = false;
+            if (!bounce_buffer) {
+                /* Later runs cannot be longer than what is left */
+                bounce_buffer = qemu_blockalign(bs,
+                    MIN(end - start, max_clusters) * job->cluster_size);
+            }
+            ret = backup_cow_with_bounce_buffer(job, bs, start, n,
+                                                bounce_buffer,
+                                                error_is_read,
+                                                is_write_notifier);
+            if (ret < 0) {
+                goto out;
             }
-            goto out;
         }
 
-        set_bit(start, job->done_bitmap);
+        bitmap_set(job->done_bitmap, start, clusters);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
@@ -295,6 +355,8 @@ static void backup_complete(BlockJob *job, void *opaque)
 
 static bool coroutine_fn yield_and_check(BackupBlockJob *job)
 {
+    uint64_t delay_ns;
+
     if (block_job_is_cancelled(&job->common)) {
         return true;
     }
@@ -302,14 +364,10 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     /* we need to yield so that bdrv_drain_all() returns.
      * (without, VM does not reboot)
      */
-    if (job->common.speed) {
-        uint64_t delay_ns = ratelimit_calculate_delay(&job->limit,
-                                                      job->sectors_read);
-        job->sectors_read = 0;
-        block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
-    } else {
-        block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, 0);
-    }
+    delay_ns = block_job_ratelimit(&job->common, &job->limit,
+                                   job->sectors_read);
+    job->sectors_read = 0;
+    block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
 
     if (block_job_is_cancelled(&job->common)) {
         return true;
@@ -380,6 +438,139 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
     return ret;
 }
 
+/* Check to see if a cluster is allocated in the topmost image */
+static bool coroutine_fn backup_cluster_is_allocated(BackupBlockJob *job,
+                                                     int64_t cluster)
+{
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int i, n;
+    int alloced = 0;
+
+    for (i = 0; i < sectors_per_cluster;) {
+        /* bdrv_is_allocated() only returns true/false based
+         * on the first set of sectors it comes across that
+         * are are all in the same state.
+         * For that reason we must verify each sector in the
+         * backup cluster length.  We end up copying more than
+         * needed but at some point that is always the case. */
+        alloced = bdrv_is_allocated(job->common.bs,
+                                    cluster * sectors_per_cluster + i,
+                                    sectors_per_cluster - i, &n);
+        i += n;
+
+        if (alloced == 1 || n == 0) {
+            break;
+        }
+    }
+
+    /* Errors are treated as allocated, the copy will report them */
+    return alloced != 0;
+}
+
+typedef struct BackupWorker {
+    BackupBlockJob *job;
+    int64_t cluster;
+} BackupWorker;
+
+static void coroutine_fn backup_worker(void *opaque)
+{
+    BackupWorker *w = opaque;
+    BackupBlockJob *job = w->job;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    bool error_is_read = false;
+    int ret;
+
+    ret = backup_do_cow(job->common.bs, w->cluster * sectors_per_cluster,
+                        sectors_per_cluster, &error_is_read, false);
+    if (ret < 0) {
+        /* backup_run_full() decides what to do, and restarts the copy from
+         * the first cluster that failed if needed */
+        if (!job->worker_ret) {
+            job->worker_ret = ret;
+            job->worker_error_is_read = error_is_read;
+        }
+        job->retry_cluster = MIN(job->retry_cluster, w->cluster);
+    }
+    g_free(w);
+
+    job->workers--;
+    if (job->waiting_for_worker) {
+        qemu_coroutine_enter(job->common.co, NULL);
+    }
+}
+
+/* Wait until at most @max workers are still copying */
+static void coroutine_fn backup_wait_for_workers(BackupBlockJob *job, int max)
+{
+    while (job->workers > max) {
+        job->waiting_for_worker = true;
+        qemu_coroutine_yield();
+        job->waiting_for_worker = false;
+    }
+}
+
+/*
+ * Copy the whole drive (or its topmost image) with up to BACKUP_MAX_WORKERS
+ * clusters in flight.  Clusters are handed out in order, so the target is
+ * still written mostly sequentially.
+ */
+static int coroutine_fn backup_run_full(BackupBlockJob *job)
+{
+    int64_t start = 0;
+    int64_t end = DIV_ROUND_UP(job->common.len, job->cluster_size);
+    BackupWorker *w;
+    Coroutine *co;
+    int ret = 0;
+
+    job->retry_cluster = end;
+    for (;;) {
+        if (job->worker_ret < 0) {
+            /* Depending on error action, fail now or retry clusters */
+            BlockErrorAction action =
+                backup_error_action(job, job->worker_error_is_read,
+                                    -job->worker_ret);
+            if (action == BLOCK_ERROR_ACTION_REPORT) {
+                ret = job->worker_ret;
+                break;
+            }
+            /* Clusters that were copied meanwhile are skipped quickly */
+            start = job->retry_cluster;
+            job->retry_cluster = end;
+            job->worker_ret = 0;
+        }
+
+        if (start == end) {
+            if (!job->workers) {
+                break;
+            }
+            backup_wait_for_workers(job, 0);
+            continue;
+        }
+
+        if (yield_and_check(job)) {
+            break;
+        }
+
+        /* If the cluster is only in the backing file, skip this backup */
+        if (job->sync_mode == MIRROR_SYNC_MODE_TOP &&
+            !backup_cluster_is_allocated(job, start)) {
+            start++;
+            continue;
+        }
+
+        backup_wait_for_workers(job, BACKUP_MAX_WORKERS - 1);
+        w = g_new(BackupWorker, 1);
+        w->job = job;
+        w->cluster = start++;
+        job->workers++;
+        co = qemu_coroutine_create(backup_worker);
+        qemu_coroutine_enter(co, w);
+    }
+
+    backup_wait_for_workers(job, 0);
+    return ret;
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
@@ -390,14 +581,12 @@ static void coroutine_fn backup_run(void *opaque)
     NotifierWithReturn before_write = {
         .notify = backup_before_write_notify,
     };
-    int64_t start, end;
-    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t end;
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
 
-    start = 0;
     end = DIV_ROUND_UP(job->common.len, job->cluster_size);
 
     job->done_bitmap = bitmap_new(end);
@@ -422,58 +611,7 @@ static void coroutine_fn backup_run(void *opaque)
         ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-            if (yield_and_check(job)) {
-                break;
-            }
-
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < sectors_per_cluster;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * sectors_per_cluster + i,
-                                sectors_per_cluster - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(bs, start * sectors_per_cluster,
-                                sectors_per_cluster, &error_is_read, false);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
-            }
-        }
+        ret = backup_run_full(job);
     }
 
     notifier_with_return_remove(&before_write);
@@ -577,6 +715,19 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     job->on_target_error = on_target_error;
     job->target = target;
     job->sync_mode = sync_mode;
+
+    /* With image fleecing the target has the source in its backing chain
+     * and is exported (e.g. over NBD) while the job runs.  Reads from the
+     * target fall through to the source for clusters that were not copied
+     * yet, so a copy must not be written while such a read is in flight,
+     * or the reader could see data that the guest wrote after the copy.
+     * Offloaded copies cannot carry the flag, so they are not used then. */
+    if (bdrv_chain_contains(target, bs)) {
+        job->write_flags = BDRV_REQ_SERIALISING;
+        job->use_copy_range = false;
+    } else {
+        job->use_copy_range = true;
+    }
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
                        sync_bitmap : NULL;
 
@@ -696,6 +696,7 @@ BlockAIOCB *blk_abort_aio_request(BlockBackend *blk,
     acb->ret = ret;
 
     bh = aio_bh_new(blk_get_aio_context(blk), error_callback_bh, acb);
+    qemu_bh_set_priority(bh, QEMU_BH_PRIO_HIGH);
     acb->bh = bh;
     qemu_bh_schedule(bh);
 
@@ -1194,6 +1195,28 @@ void *blk_aio_get(const AIOCBInfo *aiocb_info, BlockBackend *blk,
     return qemu_aio_get(aiocb_info, blk_bs(blk), cb, opaque);
 }
 
+int coroutine_fn blk_co_readv(BlockBackend *blk, int64_t sector_num,
+                              int nb_sectors, QEMUIOVector *qiov)
+{
+    int ret = blk_check_request(blk, sector_num, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_readv(blk->bs, sector_num, nb_sectors, qiov);
+}
+
+int coroutine_fn blk_co_writev(BlockBackend *blk, int64_t sector_num,
+                               int nb_sectors, QEMUIOVector *qiov)
+{
+    int ret = blk_check_request(blk, sector_num, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_writev(blk->bs, sector_num, nb_sectors, qiov);
+}
+
 int coroutine_fn blk_co_write_zeroes(BlockBackend *blk, int64_t sector_num,
                                      int nb_sectors, BdrvRequestFlags flags)
 {
@@ -1205,6 +1228,23 @@ int coroutine_fn blk_co_write_zeroes(BlockBackend *blk, int64_t sector_num,
     return bdrv_co_write_zeroes(blk->bs, sector_num, nb_sectors, flags);
 }
 
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t in_sector,
+                                   BlockBackend *blk_out, int64_t out_sector,
+                                   int nb_sectors, BdrvRequestFlags flags)
+{
+    int ret = blk_check_request(blk_in, in_sector, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blk_check_request(blk_out, out_sector, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_copy_range(blk_in->bs, in_sector, blk_out->bs, out_sector,
+                              nb_sectors, flags);
+}
+
 int blk_write_compressed(BlockBackend *blk, int64_t sector_num,
                          const uint8_t *buf, int nb_sectors)
 {
@@ -1225,6 +1265,16 @@ int blk_truncate(BlockBackend *blk, int64_t offset)
     return bdrv_truncate(blk->bs, offset);
 }
 
+int blk_truncate_prealloc(BlockBackend *blk, int64_t offset,
+                          PreallocMode prealloc, Error **errp)
+{
+    if (!blk_is_available(blk)) {
+        return -ENOMEDIUM;
+    }
+
+    return bdrv_truncate_prealloc(blk->bs, offset, prealloc, errp);
+}
+
 int blk_discard(BlockBackend *blk, int64_t sector_num, int nb_sectors)
 {
     int ret = blk_check_request(blk, sector_num, nb_sectors);
@@ -1292,6 +1342,8 @@ void blk_update_root_state(BlockBackend *blk)
         const char *name = throttle_group_get_name(blk->bs);
         blk->root_state.throttle_group = g_strdup(name);
         blk->root_state.throttle_state = throttle_group_incref(name);
+        throttle_group_get_member_config(blk->bs,
+                                         &blk->root_state.throttle_member_cfg);
     } else {
         blk->root_state.throttle_group = NULL;
         blk->root_state.throttle_state = NULL;
@@ -1308,6 +1360,8 @@ void blk_apply_root_state(BlockBackend *blk, BlockDriverState *bs)
     bs->detect_zeroes = blk->root_state.detect_zeroes;
     if (blk->root_state.throttle_group) {
         bdrv_io_limits_enable(bs, blk->root_state.throttle_group);
+        throttle_group_set_member_config(bs,
+                                         &blk->root_state.throttle_member_cfg);
     }
 }
 
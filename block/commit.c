@@ -27,6 +27,9 @@ enum {
      * contiguous regions of the image is efficient.
      */
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /* Number of COMMIT_BUFFER_SIZE copies that can be in flight */
+    COMMIT_MAX_IN_FLIGHT = 4,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
@@ -41,6 +44,9 @@ typedef struct CommitBlockJob {
     int base_flags;
     int orig_overlay_flags;
     char *backing_file_str;
+    int in_flight;
+    bool waiting_for_io;
+    int ret;
 } CommitBlockJob;
 
 static int coroutine_fn commit_populate(BlockDriverState *bs,
@@ -63,6 +69,64 @@ static int coroutine_fn commit_populate(BlockDriverState *bs,
     return 0;
 }
 
+typedef struct CommitWorker {
+    CommitBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+} CommitWorker;
+
+static bool commit_error_is_fatal(CommitBlockJob *s, int ret)
+{
+    return s->on_error == BLOCKDEV_ON_ERROR_STOP ||
+           s->on_error == BLOCKDEV_ON_ERROR_REPORT ||
+           (s->on_error == BLOCKDEV_ON_ERROR_ENOSPC && ret == -ENOSPC);
+}
+
+static void coroutine_fn commit_worker(void *opaque)
+{
+    CommitWorker *w = opaque;
+    CommitBlockJob *s = w->s;
+    void *buf = qemu_blockalign(s->top, w->nb_sectors * BDRV_SECTOR_SIZE);
+    int ret;
+
+    for (;;) {
+        ret = commit_populate(s->top, s->base, w->sector_num, w->nb_sectors,
+                              buf);
+        if (ret >= 0 || s->ret < 0 || block_job_is_cancelled(&s->common)) {
+            break;
+        }
+        if (commit_error_is_fatal(s, ret)) {
+            s->ret = ret;
+            break;
+        }
+        /* Other errors are retried */
+        co_aio_sleep_ns(bdrv_get_aio_context(s->common.bs),
+                        QEMU_CLOCK_REALTIME, SLICE_TIME);
+    }
+    if (ret >= 0) {
+        /* Publish progress */
+        s->common.offset += w->nb_sectors * BDRV_SECTOR_SIZE;
+    }
+
+    qemu_vfree(buf);
+    g_free(w);
+
+    s->in_flight--;
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+/* Wait until at most @max copies are still in flight */
+static void coroutine_fn commit_wait_for_io(CommitBlockJob *s, int max)
+{
+    while (s->in_flight > max) {
+        s->waiting_for_io = true;
+        qemu_coroutine_yield();
+        s->waiting_for_io = false;
+    }
+}
+
 typedef struct {
     int ret;
 } CommitCompleteData;
@@ -103,11 +167,12 @@ static void coroutine_fn commit_run(void *opaque)
     CommitCompleteData *data;
     BlockDriverState *top = s->top;
     BlockDriverState *base = s->base;
-    int64_t sector_num, end;
+    int64_t end;
+    uint64_t sector_num, n;
     int ret = 0;
-    int n = 0;
-    void *buf = NULL;
-    int bytes_written = 0;
+    HBitmap *map = NULL;
+    CommitWorker *w;
+    Coroutine *co;
     int64_t base_len;
 
     ret = s->common.len = bdrv_getlength(top);
@@ -130,54 +195,63 @@ static void coroutine_fn commit_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(top, COMMIT_BUFFER_SIZE);
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
-        uint64_t delay_ns = 0;
-        bool copy;
+    /* Find everything that is allocated above the base in one go */
+    ret = bdrv_allocated_above_map(top, base, end, &map);
+    if (ret < 0) {
+        goto out;
+    }
+
+    sector_num = 0;
+    for (;;) {
+        uint64_t next = sector_num;
+        uint64_t delay_ns;
+
+        n = COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE;
+        if (!hbitmap_next_dirty_area(map, &next, end, &n)) {
+            next = end;
+            n = 0;
+        }
+
+        /* Unallocated areas count as progress too */
+        s->common.offset += (next - sector_num) * BDRV_SECTOR_SIZE;
+        sector_num = next;
+        if (sector_num == end) {
+            break;
+        }
+        trace_commit_one_iteration(s, sector_num, n, 1);
 
-wait:
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.
          */
+        delay_ns = block_job_ratelimit(&s->common, &s->limit, n);
         block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
-        if (block_job_is_cancelled(&s->common)) {
+        if (block_job_is_cancelled(&s->common) || s->ret < 0) {
             break;
         }
-        /* Copy if allocated above the base */
-        ret = bdrv_is_allocated_above(top, base, sector_num,
-                                      COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE,
-                                      &n);
-        copy = (ret == 1);
-        trace_commit_one_iteration(s, sector_num, n, ret);
-        if (copy) {
-            if (s->common.speed) {
-                delay_ns = ratelimit_calculate_delay(&s->limit, n);
-                if (delay_ns > 0) {
-                    goto wait;
-                }
-            }
-            ret = commit_populate(top, base, sector_num, n, buf);
-            bytes_written += n * BDRV_SECTOR_SIZE;
-        }
-        if (ret < 0) {
-            if (s->on_error == BLOCKDEV_ON_ERROR_STOP ||
-                s->on_error == BLOCKDEV_ON_ERROR_REPORT||
-                (s->on_error == BLOCKDEV_ON_ERROR_ENOSPC && ret == -ENOSPC)) {
-                goto out;
-            } else {
-                n = 0;
-                continue;
-            }
+
+        commit_wait_for_io(s, COMMIT_MAX_IN_FLIGHT - 1);
+        if (s->ret < 0) {
+            break;
         }
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+        w = g_new(CommitWorker, 1);
+        w->s = s;
+        w->sector_num = sector_num;
+        w->nb_sectors = n;
+        s->in_flight++;
+        co = qemu_coroutine_create(commit_worker);
+        qemu_coroutine_enter(co, w);
+
+        sector_num += n;
     }
 
-    ret = 0;
+    commit_wait_for_io(s, 0);
+    ret = s->ret;
 
 out:
-    qemu_vfree(buf);
+    if (map) {
+        hbitmap_free(map);
+    }
 
     data = g_malloc(sizeof(*data));
     data->ret = ret;
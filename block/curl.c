@@ -63,10 +63,12 @@ static CURLMcode __curl_multi_socket_action(CURLM *multi_handle,
                    CURLPROTO_FTP | CURLPROTO_FTPS | \
                    CURLPROTO_TFTP)
 
-#define CURL_NUM_STATES 8
+#define CURL_NUM_STATES 16
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
 #define READ_AHEAD_DEFAULT (256 * 1024)
+/* Sequential reads grow the read-ahead window up to this size */
+#define READ_AHEAD_MAX  (4 * 1024 * 1024)
 #define CURL_TIMEOUT_DEFAULT 5
 #define CURL_TIMEOUT_MAX 10000
 
@@ -111,6 +113,8 @@ typedef struct CURLState
     char range[128];
     char errmsg[CURL_ERROR_SIZE];
     char in_use;
+    /* The idle state with the oldest buffer is reused first */
+    uint64_t last_used;
 } CURLState;
 
 typedef struct BDRVCURLState {
@@ -120,6 +124,10 @@ typedef struct BDRVCURLState {
     CURLState states[CURL_NUM_STATES];
     char *url;
     size_t readahead_size;
+    size_t cur_readahead;
+    size_t max_readahead;
+    size_t next_start;
+    uint64_t lru_clock;
     bool sslverify;
     uint64_t timeout;
     char *cookie;
@@ -259,6 +267,7 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
         {
             char *buf = state->orig_buf + (start - state->buf_start);
 
+            state->last_used = ++s->lru_clock;
             qemu_iovec_from_buf(acb->qiov, 0, buf, len);
             acb->common.cb(acb->common.opaque, 0);
 
@@ -276,6 +285,7 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
 
             acb->start = start - state->buf_start;
             acb->end = acb->start + len;
+            state->last_used = ++s->lru_clock;
 
             for (j=0; j<CURL_NUM_ACB; j++) {
                 if (!state->acb[j]) {
@@ -397,11 +407,15 @@ static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
             if (s->states[i].in_use)
                 continue;
 
-            state = &s->states[i];
-            state->in_use = 1;
-            break;
+            /* Keep the most recently used buffers for curl_find_buf() */
+            if (!state || s->states[i].last_used < state->last_used) {
+                state = &s->states[i];
+            }
         }
-        if (!state) {
+        if (state) {
+            state->in_use = 1;
+            state->last_used = ++s->lru_clock;
+        } else {
             aio_poll(bdrv_get_aio_context(bs), true);
         }
     } while(!state);
@@ -427,6 +441,17 @@ static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
         curl_easy_setopt(state->curl, CURLOPT_NOSIGNAL, 1);
         curl_easy_setopt(state->curl, CURLOPT_ERRORBUFFER, state->errmsg);
         curl_easy_setopt(state->curl, CURLOPT_FAILONERROR, 1);
+#if LIBCURL_VERSION_NUM >= 0x071900
+        curl_easy_setopt(state->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00
+        /* Rather wait for a multiplexed HTTP/2 stream than open a connection */
+        curl_easy_setopt(state->curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072f00
+        curl_easy_setopt(state->curl, CURLOPT_HTTP_VERSION,
+                         CURL_HTTP_VERSION_2TLS);
+#endif
 
         if (s->username) {
             curl_easy_setopt(state->curl, CURLOPT_USERNAME, s->username);
@@ -514,6 +539,10 @@ static void curl_attach_aio_context(BlockDriverState *bs,
     s->multi = curl_multi_init();
     s->aio_context = new_context;
     curl_multi_setopt(s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    /* Run the parallel range requests as streams of one HTTP/2 connection */
+    curl_multi_setopt(s->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
 #ifdef NEED_CURL_TIMER_CALLBACK
     curl_multi_setopt(s->multi, CURLMOPT_TIMERDATA, s);
     curl_multi_setopt(s->multi, CURLMOPT_TIMERFUNCTION, curl_timer_cb);
@@ -607,6 +636,8 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
                    s->readahead_size);
         goto out_noclean;
     }
+    s->cur_readahead = s->readahead_size;
+    s->max_readahead = MAX(s->readahead_size, READ_AHEAD_MAX);
 
     s->timeout = qemu_opt_get_number(opts, CURL_BLOCK_OPT_TIMEOUT,
                                      CURL_TIMEOUT_DEFAULT);
@@ -719,6 +750,10 @@ static void curl_readv_bh_cb(void *p)
 
     size_t start = acb->sector_num * SECTOR_SIZE;
     size_t end;
+    bool sequential;
+
+    sequential = (start == s->next_start);
+    s->next_start = start + acb->nb_sectors * SECTOR_SIZE;
 
     // In case we have the requested data already (e.g. read-ahead),
     // we can just call the callback and be done.
@@ -743,10 +778,21 @@ static void curl_readv_bh_cb(void *p)
     acb->start = 0;
     acb->end = (acb->nb_sectors * SECTOR_SIZE);
 
+    /*
+     * Streaming reads double the read-ahead window each time they run
+     * past the buffered data, random reads go back to the configured
+     * size so that they do not download data that is never used.
+     */
+    if (sequential) {
+        s->cur_readahead = MIN(s->cur_readahead * 2, s->max_readahead);
+    } else {
+        s->cur_readahead = s->readahead_size;
+    }
+
     state->buf_off = 0;
     g_free(state->orig_buf);
     state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
+    state->buf_len = acb->end + s->cur_readahead;
     end = MIN(start + state->buf_len, s->len) - 1;
     state->orig_buf = g_try_malloc(state->buf_len);
     if (state->buf_len && state->orig_buf == NULL) {
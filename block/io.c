@@ -773,6 +773,17 @@ int bdrv_pwrite_sync(BlockDriverState *bs, int64_t offset,
     return 0;
 }
 
+static void bdrv_account_padding(BlockDriverState *bs, void *head_buf,
+                                 void *tail_buf, unsigned int align)
+{
+    if (!head_buf && !tail_buf) {
+        return;
+    }
+    atomic_inc(&bs->bounce_stats.unaligned_requests);
+    atomic_add(&bs->bounce_stats.bytes,
+               (head_buf ? align : 0) + (tail_buf ? align : 0));
+}
+
 static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
 {
@@ -808,6 +819,8 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
     }
 
     qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+    atomic_inc(&bs->bounce_stats.copy_on_read);
+    atomic_add(&bs->bounce_stats.bytes, iov.iov_len);
 
     ret = drv->bdrv_co_readv(bs, cluster_sector_num, cluster_nb_sectors,
                              &bounce_qiov);
@@ -997,6 +1010,7 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
 
         bytes = ROUND_UP(bytes, align);
     }
+    bdrv_account_padding(bs, head_buf, tail_buf, align);
 
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
     ret = bdrv_aligned_preadv(bs, &req, offset, bytes, align,
@@ -1139,8 +1153,9 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     QEMUIOVector *qiov, int flags)
 {
     BlockDriver *drv = bs->drv;
+    BdrvWriteResult result;
     bool waited;
-    int ret;
+    int ret, notify_ret;
 
     int64_t sector_num = offset >> BDRV_SECTOR_BITS;
     unsigned int nb_sectors = bytes >> BDRV_SECTOR_BITS;
@@ -1182,6 +1197,20 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
 
     bdrv_set_dirty(bs, sector_num, nb_sectors);
 
+    result = (BdrvWriteResult) {
+        .req    = req,
+        .offset = offset,
+        .bytes  = bytes,
+        .qiov   = qiov,
+        .flags  = flags,
+        .ret    = ret,
+    };
+    notify_ret = notifier_with_return_list_notify(&bs->after_write_notifiers,
+                                                  &result);
+    if (ret >= 0) {
+        ret = notify_ret;
+    }
+
     if (bs->wr_highest_offset < offset + bytes) {
         bs->wr_highest_offset = offset + bytes;
     }
@@ -1322,6 +1351,11 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
      */
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
 
+    if (flags & BDRV_REQ_SERIALISING) {
+        mark_request_serialising(&req, bdrv_get_cluster_size(bs));
+        wait_serialising_requests(&req);
+    }
+
     if (!qiov) {
         ret = bdrv_co_do_zero_pwritev(bs, offset, bytes, flags, &req);
         goto out;
@@ -1394,6 +1428,7 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
 
         bytes = ROUND_UP(bytes, align);
     }
+    bdrv_account_padding(bs, head_buf, tail_buf, align);
 
     ret = bdrv_aligned_pwritev(bs, &req, offset, bytes,
                                use_local_qiov ? &local_qiov : qiov,
@@ -1431,6 +1466,14 @@ int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
     return bdrv_co_do_writev(bs, sector_num, nb_sectors, qiov, 0);
 }
 
+int coroutine_fn bdrv_co_writev_flags(BlockDriverState *bs, int64_t sector_num,
+    int nb_sectors, QEMUIOVector *qiov, BdrvRequestFlags flags)
+{
+    trace_bdrv_co_writev(bs, sector_num, nb_sectors);
+
+    return bdrv_co_do_writev(bs, sector_num, nb_sectors, qiov, flags);
+}
+
 int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs,
                                       int64_t sector_num, int nb_sectors,
                                       BdrvRequestFlags flags)
@@ -1445,6 +1488,150 @@ int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs,
                              BDRV_REQ_ZERO_WRITE | flags);
 }
 
+static int coroutine_fn bdrv_co_copy_range_internal(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors, BdrvRequestFlags flags, bool recurse_src)
+{
+    BdrvTrackedRequest req;
+    BdrvWriteResult result;
+    int64_t bytes = (int64_t)nb_sectors << BDRV_SECTOR_BITS;
+    int ret;
+
+    if (!src->drv || !dst->drv) {
+        return -ENOMEDIUM;
+    }
+    if (dst->read_only) {
+        return -EPERM;
+    }
+    assert(!(dst->open_flags & BDRV_O_INACTIVE));
+
+    ret = bdrv_check_request(src, src_sector, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_check_request(dst, dst_sector, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+    if (nb_sectors == 0) {
+        return 0;
+    }
+
+    /* There is no read-modify-write cycle for offloaded copies, so leave
+     * unaligned requests to the fallback path */
+    if (((src_sector << BDRV_SECTOR_BITS) | bytes) &
+        (MAX(BDRV_SECTOR_SIZE, src->request_alignment) - 1) ||
+        ((dst_sector << BDRV_SECTOR_BITS) | bytes) &
+        (MAX(BDRV_SECTOR_SIZE, dst->request_alignment) - 1)) {
+        return -ENOTSUP;
+    }
+
+    if (recurse_src) {
+        if (!src->drv->bdrv_co_copy_range_from) {
+            return -ENOTSUP;
+        }
+
+        if (src->io_limits_enabled) {
+            throttle_group_co_io_limits_intercept(src, bytes, false);
+        }
+
+        tracked_request_begin(&req, src, src_sector << BDRV_SECTOR_BITS, bytes,
+                              BDRV_TRACKED_READ);
+        if (!(flags & BDRV_REQ_NO_SERIALISING)) {
+            wait_serialising_requests(&req);
+        }
+
+        ret = src->drv->bdrv_co_copy_range_from(src, src_sector,
+                                                dst, dst_sector, nb_sectors);
+    } else {
+        if (!dst->drv->bdrv_co_copy_range_to) {
+            return -ENOTSUP;
+        }
+
+        if (dst->io_limits_enabled) {
+            throttle_group_co_io_limits_intercept(dst, bytes, true);
+        }
+
+        tracked_request_begin(&req, dst, dst_sector << BDRV_SECTOR_BITS, bytes,
+                              BDRV_TRACKED_WRITE);
+        wait_serialising_requests(&req);
+
+        ret = notifier_with_return_list_notify(&dst->before_write_notifiers,
+                                               &req);
+        if (ret == 0) {
+            ret = dst->drv->bdrv_co_copy_range_to(dst, src, src_sector,
+                                                  dst_sector, nb_sectors);
+        }
+
+        if (ret == 0 && !dst->enable_write_cache) {
+            ret = bdrv_co_flush(dst);
+        }
+
+        if (ret != -ENOTSUP) {
+            bdrv_set_dirty(dst, dst_sector, nb_sectors);
+        }
+
+        result = (BdrvWriteResult) {
+            .req    = &req,
+            .offset = dst_sector << BDRV_SECTOR_BITS,
+            .bytes  = bytes,
+            .ret    = ret,
+        };
+        notifier_with_return_list_notify(&dst->after_write_notifiers, &result);
+
+        if (ret != -ENOTSUP) {
+            if (dst->wr_highest_offset < (dst_sector << BDRV_SECTOR_BITS) +
+                                         bytes) {
+                dst->wr_highest_offset = (dst_sector << BDRV_SECTOR_BITS) +
+                                         bytes;
+            }
+        }
+
+        if (ret >= 0) {
+            dst->total_sectors = MAX(dst->total_sectors,
+                                     dst_sector + nb_sectors);
+        }
+    }
+
+    tracked_request_end(&req);
+    return ret;
+}
+
+/* Copy the range from the point of view of the source node: a format driver
+ * translates the offset and forwards the request to its protocol node. */
+int coroutine_fn bdrv_co_copy_range_from(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors, BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_from(src, src_sector, dst, dst_sector,
+                                  nb_sectors, flags);
+
+    return bdrv_co_copy_range_internal(src, src_sector, dst, dst_sector,
+                                       nb_sectors, flags, true);
+}
+
+/* Once the source has been resolved to its protocol node, the destination
+ * tree is walked down in the same way until the destination protocol driver
+ * can perform the copy. */
+int coroutine_fn bdrv_co_copy_range_to(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors, BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_to(src, src_sector, dst, dst_sector,
+                                nb_sectors, flags);
+
+    return bdrv_co_copy_range_internal(src, src_sector, dst, dst_sector,
+                                       nb_sectors, flags, false);
+}
+
+int coroutine_fn bdrv_co_copy_range(BlockDriverState *src, int64_t src_sector,
+    BlockDriverState *dst, int64_t dst_sector, int nb_sectors,
+    BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_from(src, src_sector, dst, dst_sector,
+                                   nb_sectors, flags);
+}
+
 int bdrv_flush_all(void)
 {
     BlockDriverState *bs = NULL;
@@ -1728,6 +1915,65 @@ int bdrv_is_allocated_above(BlockDriverState *top,
     return 0;
 }
 
+/*
+ * Same question as bdrv_is_allocated_above(), but for all of the first
+ * @nb_sectors sectors at once.  On success, *@pmap is a new bitmap where
+ * the sectors allocated between BASE (exclusive) and TOP are set.
+ *
+ * Each image of the chain is walked only once, instead of once per chunk,
+ * so the cost is the sum of the number of extents of the images instead
+ * of the number of chunks multiplied by the length of the chain.  The
+ * bitmap granularity is the smallest cluster size in the chain.
+ */
+int bdrv_allocated_above_map(BlockDriverState *top, BlockDriverState *base,
+                             int64_t nb_sectors, HBitmap **pmap)
+{
+    BlockDriverState *intermediate;
+    BlockDriverInfo bdi;
+    int cluster_sectors = INT_MAX;
+    HBitmap *map;
+
+    for (intermediate = top; intermediate && intermediate != base;
+         intermediate = backing_bs(intermediate)) {
+        if (bdrv_get_info(intermediate, &bdi) < 0 || bdi.cluster_size <= 0) {
+            cluster_sectors = 1;
+            break;
+        }
+        cluster_sectors = MIN(cluster_sectors,
+                              bdi.cluster_size >> BDRV_SECTOR_BITS);
+    }
+    cluster_sectors = pow2floor(MAX(cluster_sectors, 1));
+    map = hbitmap_alloc(nb_sectors, ctz32(cluster_sectors));
+
+    for (intermediate = top; intermediate && intermediate != base;
+         intermediate = backing_bs(intermediate)) {
+        int64_t sector_num = 0;
+
+        while (sector_num < nb_sectors) {
+            int n = MIN(nb_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
+            int pnum;
+            int ret;
+
+            ret = bdrv_is_allocated(intermediate, sector_num, n, &pnum);
+            if (ret < 0) {
+                hbitmap_free(map);
+                return ret;
+            }
+            if (pnum == 0) {
+                /* past the end of this image */
+                break;
+            }
+            if (ret) {
+                hbitmap_set(map, sector_num, pnum);
+            }
+            sector_num += pnum;
+        }
+    }
+
+    *pmap = map;
+    return 0;
+}
+
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors)
 {
@@ -2092,6 +2338,7 @@ static BlockAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
     acb->qiov = qiov;
     acb->bounce = qemu_try_blockalign(bs, qiov->size);
     acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_aio_bh_cb, acb);
+    qemu_bh_set_priority(acb->bh, QEMU_BH_PRIO_HIGH);
 
     if (acb->bounce == NULL) {
         acb->ret = -ENOMEM;
@@ -2159,6 +2406,7 @@ static void bdrv_co_maybe_schedule_bh(BlockAIOCBCoroutine *acb)
         BlockDriverState *bs = acb->common.bs;
 
         acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
+        qemu_bh_set_priority(acb->bh, QEMU_BH_PRIO_HIGH);
         qemu_bh_schedule(acb->bh);
     }
 }
@@ -2266,12 +2514,73 @@ BlockAIOCB *bdrv_aio_discard(BlockDriverState *bs,
     return &acb->common;
 }
 
+/* Freed AIOCBs are cached in per-thread lists, one for each multiple of
+ * AIOCB_POOL_GRANULE bytes, so that requests do not go through malloc.
+ * AIOCBs are not always tied to a BlockDriverState, hence the lists are
+ * per thread rather than per AioContext.  An AIOCB freed by another thread
+ * than the one that allocated it simply moves to that thread's lists.
+ */
+#define AIOCB_POOL_GRANULE  64
+#define AIOCB_POOL_CLASSES  8
+#define AIOCB_POOL_MAX_FREE 64
+
+typedef struct AIOCBPoolEntry {
+    QSLIST_ENTRY(AIOCBPoolEntry) next;
+} AIOCBPoolEntry;
+
+typedef struct AIOCBPool {
+    QSLIST_HEAD(, AIOCBPoolEntry) free[AIOCB_POOL_CLASSES];
+    unsigned int nfree[AIOCB_POOL_CLASSES];
+    Notifier exit_notifier;
+    bool initialized;
+} AIOCBPool;
+
+static __thread AIOCBPool aiocb_pool;
+
+uint64_t qemu_aio_alloc_count;
+
+static int aiocb_pool_class(const AIOCBInfo *aiocb_info)
+{
+    return DIV_ROUND_UP(aiocb_info->aiocb_size, AIOCB_POOL_GRANULE) - 1;
+}
+
+static void aiocb_pool_cleanup(Notifier *n, void *value)
+{
+    AIOCBPool *pool = container_of(n, AIOCBPool, exit_notifier);
+    AIOCBPoolEntry *entry;
+    int i;
+
+    for (i = 0; i < AIOCB_POOL_CLASSES; i++) {
+        while ((entry = QSLIST_FIRST(&pool->free[i]))) {
+            QSLIST_REMOVE_HEAD(&pool->free[i], next);
+            g_free(entry);
+        }
+        pool->nfree[i] = 0;
+    }
+}
+
 void *qemu_aio_get(const AIOCBInfo *aiocb_info, BlockDriverState *bs,
                    BlockCompletionFunc *cb, void *opaque)
 {
-    BlockAIOCB *acb;
+    int size_class = aiocb_pool_class(aiocb_info);
+    BlockAIOCB *acb = NULL;
+
+    if (size_class < AIOCB_POOL_CLASSES) {
+        AIOCBPoolEntry *entry = QSLIST_FIRST(&aiocb_pool.free[size_class]);
+
+        if (entry) {
+            QSLIST_REMOVE_HEAD(&aiocb_pool.free[size_class], next);
+            aiocb_pool.nfree[size_class]--;
+            acb = (BlockAIOCB *)entry;
+        }
+    }
+    if (!acb) {
+        acb = g_malloc(size_class < AIOCB_POOL_CLASSES
+                       ? (size_class + 1) * AIOCB_POOL_GRANULE
+                       : aiocb_info->aiocb_size);
+        atomic_inc(&qemu_aio_alloc_count);
+    }
 
-    acb = g_malloc(aiocb_info->aiocb_size);
     acb->aiocb_info = aiocb_info;
     acb->bs = bs;
     acb->cb = cb;
@@ -2289,8 +2598,26 @@ void qemu_aio_ref(void *p)
 void qemu_aio_unref(void *p)
 {
     BlockAIOCB *acb = p;
+    int size_class;
+
     assert(acb->refcnt > 0);
-    if (--acb->refcnt == 0) {
+    if (--acb->refcnt > 0) {
+        return;
+    }
+
+    size_class = aiocb_pool_class(acb->aiocb_info);
+    if (size_class < AIOCB_POOL_CLASSES &&
+        aiocb_pool.nfree[size_class] < AIOCB_POOL_MAX_FREE) {
+        AIOCBPoolEntry *entry = p;
+
+        if (!aiocb_pool.initialized) {
+            aiocb_pool.exit_notifier.notify = aiocb_pool_cleanup;
+            qemu_thread_atexit_add(&aiocb_pool.exit_notifier);
+            aiocb_pool.initialized = true;
+        }
+        QSLIST_INSERT_HEAD(&aiocb_pool.free[size_class], entry, next);
+        aiocb_pool.nfree[size_class]++;
+    } else {
         g_free(acb);
     }
 }
@@ -2738,6 +3065,12 @@ void bdrv_add_before_write_notifier(BlockDriverState *bs,
     notifier_with_return_list_add(&bs->before_write_notifiers, notifier);
 }
 
+void bdrv_add_after_write_notifier(BlockDriverState *bs,
+                                   NotifierWithReturn *notifier)
+{
+    notifier_with_return_list_add(&bs->after_write_notifiers, notifier);
+}
+
 void bdrv_io_plug(BlockDriverState *bs)
 {
     BlockDriver *drv = bs->drv;
@@ -0,0 +1,559 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "qemu/atomic.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* The copy of asm/unistd.h in linux-headers/ may predate io_uring.  The
+ * system call numbers are the same on all architectures but Alpha.  */
+#if !defined(__NR_io_uring_setup) && !defined(__alpha__)
+#define __NR_io_uring_setup     425
+#define __NR_io_uring_enter     426
+#define __NR_io_uring_register  427
+#endif
+
+/*
+ * Submission queue size (per-device).  The kernel makes the completion
+ * queue twice as large, which bounds the number of requests in flight.
+ */
+#define MAX_ENTRIES 128
+
+typedef struct LuringAIOCB {
+    BlockAIOCB common;
+    struct LuringState *s;
+    struct io_uring_sqe sqeq;
+    ssize_t ret;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+    bool is_read;
+    int64_t offset;
+    /* Bytes transferred so far, and the rest of @qiov after a short
+     * transfer.  */
+    size_t done;
+    QEMUIOVector resubmit_qiov;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) pending;
+} LuringQueue;
+
+typedef struct LuringState {
+    int ring_fd;
+    bool sqpoll;
+    EventNotifier e;
+
+    /* Submission ring, shared with the kernel */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_khead;
+    unsigned *sq_ktail;
+    unsigned *sq_kflags;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    /* Completion ring, shared with the kernel */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_khead;
+    unsigned *cq_ktail;
+    unsigned cq_mask;
+    unsigned cq_entries;
+    struct io_uring_cqe *cqes;
+
+    /* The file that is registered with the ring, or -1 */
+    int fixed_fd;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* I/O completion processing */
+    QEMUBH *completion_bh;
+} LuringState;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ioq_submit(LuringState *s);
+
+/* Queue @luringcb again, for the next ioq_submit() */
+static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/* Unlike with O_DIRECT, buffered reads and writes can complete short in
+ * the middle of a file.  Submit the rest of the request.
+ */
+static void luring_resubmit_remainder(LuringState *s, LuringAIOCB *luringcb)
+{
+    QEMUIOVector *resubmit = &luringcb->resubmit_qiov;
+    struct io_uring_sqe *sqe = &luringcb->sqeq;
+
+    if (resubmit->iov) {
+        qemu_iovec_reset(resubmit);
+    } else {
+        qemu_iovec_init(resubmit, luringcb->qiov->niov);
+    }
+    qemu_iovec_concat(resubmit, luringcb->qiov, luringcb->done,
+                      luringcb->nbytes - luringcb->done);
+
+    sqe->addr = (uintptr_t)resubmit->iov;
+    sqe->len = resubmit->niov;
+    sqe->off = luringcb->offset + luringcb->done;
+    luring_resubmit(s, luringcb);
+}
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB), unless
+ * it has to be submitted again.
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *luringcb)
+{
+    int ret;
+
+    ret = luringcb->ret;
+    if (ret == -EINTR || ret == -EAGAIN) {
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
+    if (ret >= 0) {
+        luringcb->done += ret;
+        if (luringcb->done < luringcb->nbytes) {
+            if (ret > 0) {
+                luring_resubmit_remainder(s, luringcb);
+                return;
+            }
+            if (luringcb->is_read) {
+                /* Nothing left to read means EOF, pad with zeros. */
+                qemu_iovec_memset(luringcb->qiov, luringcb->done, 0,
+                                  luringcb->qiov->size - luringcb->done);
+            } else {
+                /* The file cannot grow any more */
+                ret = -ENOSPC;
+            }
+        }
+        if (ret > 0) {
+            ret = 0;
+        }
+    }
+    if (luringcb->resubmit_qiov.iov) {
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+    }
+    luringcb->common.cb(luringcb->common.opaque, ret);
+
+    qemu_aio_unref(luringcb);
+}
+
+/* The completion BH reaps the completion queue and invokes the callbacks.
+ *
+ * As in linux-aio.c, nested event loops are supported by rescheduling the
+ * BH while there are completions left.  Each entry is consumed before its
+ * callback runs, so that a nested invocation picks up after it.
+ */
+static void luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+    unsigned head = *s->cq_khead;
+
+    if (head == atomic_read(s->cq_ktail)) {
+        goto out;
+    }
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (head != atomic_read(s->cq_ktail)) {
+        struct io_uring_cqe *cqe;
+        LuringAIOCB *luringcb;
+
+        /* Read the entry only after seeing the tail.  */
+        smp_rmb();
+        cqe = &s->cqes[head & s->cq_mask];
+        luringcb = (LuringAIOCB *)(uintptr_t)cqe->user_data;
+        luringcb->ret = cqe->res;
+
+        /* Let the kernel reuse the entry.  */
+        head++;
+        smp_mb();
+        atomic_set(s->cq_khead, head);
+
+        s->io_q.in_flight--;
+        luring_process_completion(s, luringcb);
+        head = *s->cq_khead;
+    }
+
+out:
+    if (!s->io_q.plugged &&
+        (s->io_q.blocked || !QSIMPLEQ_EMPTY(&s->io_q.pending))) {
+        ioq_submit(s);
+    }
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+static bool luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (*s->cq_khead == atomic_read(s->cq_ktail)) {
+        return false;
+    }
+
+    luring_completion_bh(s);
+    return true;
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+};
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->pending);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+/* Move as many pending requests as possible to the submission ring, and
+ * tell the kernel about them with a single system call.  If the kernel
+ * cannot take all of them, the rest stays in the ring and is submitted
+ * again together with the next batch.
+ */
+static void ioq_submit(LuringState *s)
+{
+    unsigned tail = *s->sq_ktail;
+    unsigned to_submit;
+    int ret = 0;
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.pending) &&
+           s->io_q.in_flight < s->cq_entries &&
+           tail - atomic_read(s->sq_khead) < s->sq_entries) {
+        LuringAIOCB *luringcb = QSIMPLEQ_FIRST(&s->io_q.pending);
+        unsigned index = tail & s->sq_mask;
+
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+        s->io_q.in_queue--;
+        s->io_q.in_flight++;
+
+        s->sqes[index] = luringcb->sqeq;
+        s->sq_array[index] = index;
+        tail++;
+    }
+
+    /* Publish the entries before the new tail.  */
+    smp_wmb();
+    atomic_set(s->sq_ktail, tail);
+
+    if (s->sqpoll) {
+        /* The kernel thread only has to be woken up if it went idle.  */
+        smp_mb();
+        if (atomic_read(s->sq_kflags) & IORING_SQ_NEED_WAKEUP) {
+            io_uring_enter(s->ring_fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+        }
+        to_submit = 0;
+    } else {
+        do {
+            to_submit = tail - atomic_read(s->sq_khead);
+            if (to_submit == 0) {
+                break;
+            }
+            ret = io_uring_enter(s->ring_fd, to_submit, 0, 0);
+        } while (ret < 0 && errno == EINTR);
+        if (to_submit && ret < 0 && errno != EAGAIN && errno != EBUSY) {
+            abort();
+        }
+        to_submit = tail - atomic_read(s->sq_khead);
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0 || to_submit > 0);
+}
+
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    LuringState *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    LuringState *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return;
+    }
+
+    if (!s->io_q.blocked && !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        ioq_submit(s);
+    }
+}
+
+BlockAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    LuringState *s = aio_ctx;
+    LuringAIOCB *luringcb;
+    struct io_uring_sqe *sqe;
+
+    luringcb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    luringcb->nbytes = nb_sectors * 512;
+    luringcb->s = s;
+    luringcb->ret = -EINPROGRESS;
+    luringcb->is_read = (type == QEMU_AIO_READ);
+    luringcb->qiov = qiov;
+    luringcb->offset = sector_num * 512;
+    luringcb->done = 0;
+    luringcb->resubmit_qiov.iov = NULL;
+
+    sqe = &luringcb->sqeq;
+    memset(sqe, 0, sizeof(*sqe));
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        sqe->opcode = IORING_OP_WRITEV;
+        break;
+    case QEMU_AIO_READ:
+        sqe->opcode = IORING_OP_READV;
+        break;
+    case QEMU_AIO_FLUSH:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        qemu_aio_unref(luringcb);
+        return NULL;
+    }
+    if (qiov) {
+        sqe->addr = (uintptr_t)qiov->iov;
+        sqe->len = qiov->niov;
+        sqe->off = luringcb->offset;
+    }
+    if (fd == s->fixed_fd) {
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = fd;
+    }
+    sqe->user_data = (uintptr_t)luringcb;
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, luringcb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged || s->io_q.in_queue >= s->sq_entries)) {
+        ioq_submit(s);
+    }
+    return &luringcb->common;
+}
+
+/* Register @fd with the ring, so that the kernel need not look it up
+ * for each request.  Requests for other file descriptors still work.
+ */
+void luring_register_file(void *aio_ctx, int fd)
+{
+    LuringState *s = aio_ctx;
+
+    if (s->fixed_fd == fd) {
+        return;
+    }
+    if (s->fixed_fd != -1) {
+        io_uring_register(s->ring_fd, IORING_UNREGISTER_FILES, NULL, 0);
+        s->fixed_fd = -1;
+    }
+    if (io_uring_register(s->ring_fd, IORING_REGISTER_FILES, &fd, 1) == 0) {
+        s->fixed_fd = fd;
+    }
+}
+
+void luring_detach_aio_context(void *s_, AioContext *old_context)
+{
+    LuringState *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, false, NULL);
+    qemu_bh_delete(s->completion_bh);
+}
+
+void luring_attach_aio_context(void *s_, AioContext *new_context)
+{
+    LuringState *s = s_;
+
+    s->completion_bh = aio_bh_new(new_context, luring_completion_bh, s);
+    qemu_bh_set_priority(s->completion_bh, QEMU_BH_PRIO_HIGH);
+    aio_set_event_notifier(new_context, &s->e, false,
+                           luring_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, luring_poll_cb);
+}
+
+static void luring_unmap_rings(LuringState *s)
+{
+    if (s->sqes) {
+        munmap(s->sqes, s->sqes_size);
+    }
+    if (s->cq_ring && s->cq_ring != s->sq_ring) {
+        munmap(s->cq_ring, s->cq_ring_size);
+    }
+    if (s->sq_ring) {
+        munmap(s->sq_ring, s->sq_ring_size);
+    }
+}
+
+static int luring_map_rings(LuringState *s, struct io_uring_params *p)
+{
+    void *sq, *cq;
+
+    s->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    s->cq_ring_size = p->cq_off.cqes +
+                      p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        s->sq_ring_size = MAX(s->sq_ring_size, s->cq_ring_size);
+        s->cq_ring_size = s->sq_ring_size;
+    }
+
+    sq = mmap(NULL, s->sq_ring_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, s->ring_fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        return -errno;
+    }
+    s->sq_ring = sq;
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, s->cq_ring_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, s->ring_fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            return -errno;
+        }
+    }
+    s->cq_ring = cq;
+
+    s->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    s->sqes = mmap(NULL, s->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, s->ring_fd, IORING_OFF_SQES);
+    if (s->sqes == MAP_FAILED) {
+        s->sqes = NULL;
+        return -errno;
+    }
+
+    s->sq_khead = sq + p->sq_off.head;
+    s->sq_ktail = sq + p->sq_off.tail;
+    s->sq_kflags = sq + p->sq_off.flags;
+    s->sq_array = sq + p->sq_off.array;
+    s->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+    s->sq_entries = *(unsigned *)(sq + p->sq_off.ring_entries);
+
+    s->cq_khead = cq + p->cq_off.head;
+    s->cq_ktail = cq + p->cq_off.tail;
+    s->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+    s->cq_entries = *(unsigned *)(cq + p->cq_off.ring_entries);
+    s->cqes = cq + p->cq_off.cqes;
+    return 0;
+}
+
+/* With @sqpoll, a kernel thread polls the submission queue, so that
+ * submitting requests usually needs no system call at all; the thread
+ * consumes CPU time while the device is busy, however.
+ */
+void *luring_init(bool sqpoll)
+{
+    LuringState *s;
+    struct io_uring_params p;
+    int efd;
+
+    s = g_malloc0(sizeof(*s));
+    s->fixed_fd = -1;
+    s->sqpoll = sqpoll;
+    if (event_notifier_init(&s->e, false) < 0) {
+        goto out_free_state;
+    }
+
+    memset(&p, 0, sizeof(p));
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+    }
+    s->ring_fd = io_uring_setup(MAX_ENTRIES, &p);
+    if (s->ring_fd < 0) {
+        goto out_close_efd;
+    }
+    if (luring_map_rings(s, &p) < 0) {
+        goto out_close_ring;
+    }
+
+    efd = event_notifier_get_fd(&s->e);
+    if (io_uring_register(s->ring_fd, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+        goto out_close_ring;
+    }
+
+    ioq_init(&s->io_q);
+
+    return s;
+
+out_close_ring:
+    luring_unmap_rings(s);
+    close(s->ring_fd);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(void *s_)
+{
+    LuringState *s = s_;
+
+    event_notifier_cleanup(&s->e);
+    luring_unmap_rings(s);
+    close(s->ring_fd);
+    g_free(s);
+}
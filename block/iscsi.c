@@ -49,14 +49,29 @@
 #include <block/scsi.h>
 #endif
 
-typedef struct IscsiLun {
+/* Upper limit for the "sessions" option */
+#define ISCSI_MAX_SESSIONS 16
+
+/*
+ * A login to the target.  Reads and writes are spread over all the
+ * sessions of a LUN, everything else goes through the first one.
+ */
+typedef struct IscsiSession {
     struct iscsi_context *iscsi;
+    struct IscsiLun *iscsilun;
+    int events;
+    int in_flight;
+} IscsiSession;
+
+typedef struct IscsiLun {
+    struct iscsi_context *iscsi;    /* sessions[0].iscsi */
+    IscsiSession sessions[ISCSI_MAX_SESSIONS];
+    int num_sessions;
     AioContext *aio_context;
     int lun;
     enum scsi_inquiry_peripheral_device_type type;
     int block_size;
     uint64_t num_blocks;
-    int events;
     QEMUTimer *nop_timer;
     QEMUTimer *event_timer;
     struct scsi_inquiry_logical_block_provisioning lbp;
@@ -340,31 +355,47 @@ static void iscsi_process_read(void *arg);
 static void iscsi_process_write(void *arg);
 
 static void
-iscsi_set_events(IscsiLun *iscsilun)
+iscsi_session_set_events(IscsiSession *session)
 {
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    struct iscsi_context *iscsi = session->iscsi;
     int ev = iscsi_which_events(iscsi);
 
-    if (ev != iscsilun->events) {
-        aio_set_fd_handler(iscsilun->aio_context, iscsi_get_fd(iscsi),
+    if (ev != session->events) {
+        aio_set_fd_handler(session->iscsilun->aio_context,
+                           iscsi_get_fd(iscsi),
                            false,
                            (ev & POLLIN) ? iscsi_process_read : NULL,
                            (ev & POLLOUT) ? iscsi_process_write : NULL,
-                           iscsilun);
-        iscsilun->events = ev;
+                           session);
+        session->events = ev;
+    }
+}
+
+static void
+iscsi_set_events(IscsiLun *iscsilun)
+{
+    int i;
+
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        iscsi_session_set_events(&iscsilun->sessions[i]);
     }
 }
 
 static void iscsi_timed_check_events(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
     /* check for timed out requests */
-    iscsi_service(iscsilun->iscsi, 0);
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        iscsi_service(iscsilun->sessions[i].iscsi, 0);
+    }
 
     if (iscsilun->request_timed_out) {
         iscsilun->request_timed_out = false;
-        iscsi_reconnect(iscsilun->iscsi);
+        for (i = 0; i < iscsilun->num_sessions; i++) {
+            iscsi_reconnect(iscsilun->sessions[i].iscsi);
+        }
     }
 
     /* newer versions of libiscsi may return zero events. Ensure we are able
@@ -378,21 +409,19 @@ static void iscsi_timed_check_events(void *opaque)
 static void
 iscsi_process_read(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
 
-    iscsi_service(iscsi, POLLIN);
-    iscsi_set_events(iscsilun);
+    iscsi_service(session->iscsi, POLLIN);
+    iscsi_session_set_events(session);
 }
 
 static void
 iscsi_process_write(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
 
-    iscsi_service(iscsi, POLLOUT);
-    iscsi_set_events(iscsilun);
+    iscsi_service(session->iscsi, POLLOUT);
+    iscsi_session_set_events(session);
 }
 
 static int64_t sector_lun2qemu(int64_t sector, IscsiLun *iscsilun)
@@ -452,65 +481,194 @@ static void iscsi_allocationmap_clear(IscsiLun *iscsilun, int64_t sector_num,
     }
 }
 
-static int coroutine_fn iscsi_co_writev(BlockDriverState *bs,
-                                        int64_t sector_num, int nb_sectors,
-                                        QEMUIOVector *iov)
-{
-    IscsiLun *iscsilun = bs->opaque;
+/* One READ or WRITE command of a possibly split request */
+typedef struct IscsiRWChunk {
     struct IscsiTask iTask;
+    IscsiSession *session;
+    QEMUIOVector *qiov;
+    QEMUIOVector sub_qiov;
     uint64_t lba;
     uint32_t num_sectors;
-    int fua;
+    bool done;
+} IscsiRWChunk;
 
-    if (!is_request_lun_aligned(sector_num, nb_sectors, iscsilun)) {
-        return -EINVAL;
-    }
+/* Pick the session with the fewest commands in flight */
+static IscsiSession *iscsi_pick_session(IscsiLun *iscsilun)
+{
+    IscsiSession *best = &iscsilun->sessions[0];
+    int i;
 
-    if (bs->bl.max_transfer_length && nb_sectors > bs->bl.max_transfer_length) {
-        error_report("iSCSI Error: Write of %d sectors exceeds max_xfer_len "
-                     "of %d sectors", nb_sectors, bs->bl.max_transfer_length);
-        return -EINVAL;
+    for (i = 1; i < iscsilun->num_sessions; i++) {
+        if (iscsilun->sessions[i].in_flight < best->in_flight) {
+            best = &iscsilun->sessions[i];
+        }
     }
+    return best;
+}
 
-    lba = sector_qemu2lun(sector_num, iscsilun);
-    num_sectors = sector_qemu2lun(nb_sectors, iscsilun);
-    iscsi_co_init_iscsitask(iscsilun, &iTask);
-retry:
-    fua = iscsilun->dpofua && !bs->enable_write_cache;
-    iTask.force_next_flush = !fua;
-    if (iscsilun->use_16_for_rw) {
-        iTask.task = iscsi_write16_task(iscsilun->iscsi, iscsilun->lun, lba,
-                                        NULL, num_sectors * iscsilun->block_size,
-                                        iscsilun->block_size, 0, 0, fua, 0, 0,
-                                        iscsi_co_generic_cb, &iTask);
+static int iscsi_co_rw_submit(BlockDriverState *bs, IscsiRWChunk *chunk,
+                              bool is_write)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    IscsiSession *session = iscsi_pick_session(iscsilun);
+    struct iscsi_context *iscsi = session->iscsi;
+    uint32_t bytes = chunk->num_sectors * iscsilun->block_size;
+    struct scsi_task *task;
+    int fua;
+
+    if (is_write) {
+        fua = iscsilun->dpofua && !bs->enable_write_cache;
+        chunk->iTask.force_next_flush = !fua;
+        if (iscsilun->use_16_for_rw) {
+            task = iscsi_write16_task(iscsi, iscsilun->lun, chunk->lba,
+                                      NULL, bytes, iscsilun->block_size,
+                                      0, 0, fua, 0, 0,
+                                      iscsi_co_generic_cb, &chunk->iTask);
+        } else {
+            task = iscsi_write10_task(iscsi, iscsilun->lun, chunk->lba,
+                                      NULL, bytes, iscsilun->block_size,
+                                      0, 0, fua, 0, 0,
+                                      iscsi_co_generic_cb, &chunk->iTask);
+        }
     } else {
-        iTask.task = iscsi_write10_task(iscsilun->iscsi, iscsilun->lun, lba,
-                                        NULL, num_sectors * iscsilun->block_size,
-                                        iscsilun->block_size, 0, 0, fua, 0, 0,
-                                        iscsi_co_generic_cb, &iTask);
+        if (iscsilun->use_16_for_rw) {
+            task = iscsi_read16_task(iscsi, iscsilun->lun, chunk->lba,
+                                     bytes, iscsilun->block_size,
+                                     0, 0, 0, 0, 0,
+                                     iscsi_co_generic_cb, &chunk->iTask);
+        } else {
+            task = iscsi_read10_task(iscsi, iscsilun->lun, chunk->lba,
+                                     bytes, iscsilun->block_size,
+                                     0, 0, 0, 0, 0,
+                                     iscsi_co_generic_cb, &chunk->iTask);
+        }
     }
-    if (iTask.task == NULL) {
+    if (task == NULL) {
         return -ENOMEM;
     }
-    scsi_task_set_iov_out(iTask.task, (struct scsi_iovec *) iov->iov,
-                          iov->niov);
-    while (!iTask.complete) {
+    chunk->iTask.task = task;
+
+    /* libiscsi transfers straight from and to the guest buffers */
+    if (is_write) {
+        scsi_task_set_iov_out(task, (struct scsi_iovec *) chunk->qiov->iov,
+                              chunk->qiov->niov);
+    } else {
+        scsi_task_set_iov_in(task, (struct scsi_iovec *) chunk->qiov->iov,
+                             chunk->qiov->niov);
+    }
+    chunk->session = session;
+    session->in_flight++;
+    return 0;
+}
+
+/*
+ * Requests larger than the target's maximum transfer length are split.
+ * With more than one session, they are also cut at the optimal transfer
+ * length, so that the pieces are striped over the sessions.  All the
+ * pieces are in flight at the same time.
+ */
+static int coroutine_fn iscsi_co_rw(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, QEMUIOVector *iov,
+                                    bool is_write)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    IscsiRWChunk single, *chunks = &single;
+    int chunk_sectors = nb_sectors;
+    int i, n, pending = 0, ret = 0;
+
+    if (bs->bl.max_transfer_length) {
+        chunk_sectors = MIN(chunk_sectors, bs->bl.max_transfer_length);
+    }
+    if (iscsilun->num_sessions > 1 && bs->bl.opt_transfer_length) {
+        chunk_sectors = MIN(chunk_sectors, bs->bl.opt_transfer_length);
+    }
+    n = DIV_ROUND_UP(nb_sectors, chunk_sectors);
+    if (n > 1) {
+        chunks = g_new(IscsiRWChunk, n);
+    }
+
+    for (i = 0; i < n; i++) {
+        IscsiRWChunk *chunk = &chunks[i];
+        int64_t first = (int64_t)i * chunk_sectors;
+        int sectors = MIN(chunk_sectors, nb_sectors - first);
+
+        *chunk = (IscsiRWChunk) {
+            .lba         = sector_qemu2lun(sector_num + first, iscsilun),
+            .num_sectors = sector_qemu2lun(sectors, iscsilun),
+            .qiov        = iov,
+        };
+        if (n > 1) {
+            qemu_iovec_init(&chunk->sub_qiov, iov->niov);
+            qemu_iovec_concat(&chunk->sub_qiov, iov,
+                              first * BDRV_SECTOR_SIZE,
+                              sectors * BDRV_SECTOR_SIZE);
+            chunk->qiov = &chunk->sub_qiov;
+        }
+        iscsi_co_init_iscsitask(iscsilun, &chunk->iTask);
+
+        if (ret == 0) {
+            ret = iscsi_co_rw_submit(bs, chunk, is_write);
+        }
+        if (ret == 0) {
+            pending++;
+        } else {
+            chunk->done = true;
+        }
+    }
+
+    while (pending) {
         iscsi_set_events(iscsilun);
         qemu_coroutine_yield();
+
+        for (i = 0; i < n; i++) {
+            IscsiRWChunk *chunk = &chunks[i];
+
+            if (chunk->done || !chunk->iTask.complete) {
+                continue;
+            }
+            chunk->session->in_flight--;
+            if (chunk->iTask.task != NULL) {
+                scsi_free_scsi_task(chunk->iTask.task);
+                chunk->iTask.task = NULL;
+            }
+
+            if (chunk->iTask.do_retry && ret == 0) {
+                chunk->iTask.complete = 0;
+                ret = iscsi_co_rw_submit(bs, chunk, is_write);
+                if (ret == 0) {
+                    continue;
+                }
+            } else if (chunk->iTask.status != SCSI_STATUS_GOOD && ret == 0) {
+                ret = chunk->iTask.err_code;
+            }
+            chunk->done = true;
+            pending--;
+        }
     }
 
-    if (iTask.task != NULL) {
-        scsi_free_scsi_task(iTask.task);
-        iTask.task = NULL;
+    if (n > 1) {
+        for (i = 0; i < n; i++) {
+            qemu_iovec_destroy(&chunks[i].sub_qiov);
+        }
+        g_free(chunks);
     }
+    return ret;
+}
 
-    if (iTask.do_retry) {
-        iTask.complete = 0;
-        goto retry;
+static int coroutine_fn iscsi_co_writev(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors,
+                                        QEMUIOVector *iov)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    int ret;
+
+    if (!is_request_lun_aligned(sector_num, nb_sectors, iscsilun)) {
+        return -EINVAL;
     }
 
-    if (iTask.status != SCSI_STATUS_GOOD) {
-        return iTask.err_code;
+    ret = iscsi_co_rw(bs, sector_num, nb_sectors, iov, true);
+    if (ret < 0) {
+        return ret;
     }
 
     iscsi_allocationmap_set(iscsilun, sector_num, nb_sectors);
@@ -518,6 +676,9 @@ retry:
     return 0;
 }
 
+    return 0;
+}
+
 
 static bool iscsi_allocationmap_is_allocated(IscsiLun *iscsilun,
                                              int64_t sector_num, int nb_sectors)
@@ -637,20 +798,11 @@ static int coroutine_fn iscsi_co_readv(BlockDriverState *bs,
                                        QEMUIOVector *iov)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct IscsiTask iTask;
-    uint64_t lba;
-    uint32_t num_sectors;
 
     if (!is_request_lun_aligned(sector_num, nb_sectors, iscsilun)) {
         return -EINVAL;
     }
 
-    if (bs->bl.max_transfer_length && nb_sectors > bs->bl.max_transfer_length) {
-        error_report("iSCSI Error: Read of %d sectors exceeds max_xfer_len "
-                     "of %d sectors", nb_sectors, bs->bl.max_transfer_length);
-        return -EINVAL;
-    }
-
     if (iscsilun->lbprz && nb_sectors >= ISCSI_CHECKALLOC_THRES &&
         !iscsi_allocationmap_is_allocated(iscsilun, sector_num, nb_sectors)) {
         int64_t ret;
@@ -666,48 +818,7 @@ static int coroutine_fn iscsi_co_readv(BlockDriverState *bs,
         }
     }
 
-    lba = sector_qemu2lun(sector_num, iscsilun);
-    num_sectors = sector_qemu2lun(nb_sectors, iscsilun);
-
-    iscsi_co_init_iscsitask(iscsilun, &iTask);
-retry:
-    if (iscsilun->use_16_for_rw) {
-        iTask.task = iscsi_read16_task(iscsilun->iscsi, iscsilun->lun, lba,
-                                       num_sectors * iscsilun->block_size,
-                                       iscsilun->block_size, 0, 0, 0, 0, 0,
-                                       iscsi_co_generic_cb, &iTask);
-    } else {
-        iTask.task = iscsi_read10_task(iscsilun->iscsi, iscsilun->lun, lba,
-                                       num_sectors * iscsilun->block_size,
-                                       iscsilun->block_size,
-                                       0, 0, 0, 0, 0,
-                                       iscsi_co_generic_cb, &iTask);
-    }
-    if (iTask.task == NULL) {
-        return -ENOMEM;
-    }
-    scsi_task_set_iov_in(iTask.task, (struct scsi_iovec *) iov->iov, iov->niov);
-
-    while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
-        qemu_coroutine_yield();
-    }
-
-    if (iTask.task != NULL) {
-        scsi_free_scsi_task(iTask.task);
-        iTask.task = NULL;
-    }
-
-    if (iTask.do_retry) {
-        iTask.complete = 0;
-        goto retry;
-    }
-
-    if (iTask.status != SCSI_STATUS_GOOD) {
-        return iTask.err_code;
-    }
-
-    return 0;
+    return iscsi_co_rw(bs, sector_num, nb_sectors, iov, false);
 }
 
 static int coroutine_fn iscsi_co_flush(BlockDriverState *bs)
@@ -1222,16 +1333,46 @@ static int parse_timeout(const char *target)
     return 0;
 }
 
+static int parse_sessions(const char *target)
+{
+    QemuOptsList *list;
+    QemuOpts *opts;
+    const char *sessions;
+
+    list = qemu_find_opts("iscsi");
+    if (list) {
+        opts = qemu_opts_find(list, target);
+        if (!opts) {
+            opts = QTAILQ_FIRST(&list->head);
+        }
+        if (opts) {
+            sessions = qemu_opt_get(opts, "sessions");
+            if (sessions) {
+                return atoi(sessions);
+            }
+        }
+    }
+
+    return 1;
+}
+
 static void iscsi_nop_timed_event(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
-    if (iscsi_get_nops_in_flight(iscsilun->iscsi) >= MAX_NOP_FAILURES) {
-        error_report("iSCSI: NOP timeout. Reconnecting...");
-        iscsilun->request_timed_out = true;
-    } else if (iscsi_nop_out_async(iscsilun->iscsi, NULL, NULL, 0, NULL) != 0) {
-        error_report("iSCSI: failed to sent NOP-Out. Disabling NOP messages.");
-        return;
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        struct iscsi_context *iscsi = iscsilun->sessions[i].iscsi;
+
+        if (iscsi_get_nops_in_flight(iscsi) >= MAX_NOP_FAILURES) {
+            error_report("iSCSI: NOP timeout. Reconnecting...");
+            iscsilun->request_timed_out = true;
+            break;
+        } else if (iscsi_nop_out_async(iscsi, NULL, NULL, 0, NULL) != 0) {
+            error_report("iSCSI: failed to sent NOP-Out. "
+                         "Disabling NOP messages.");
+            return;
+        }
     }
 
     timer_mod(iscsilun->nop_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + NOP_INTERVAL);
@@ -1363,10 +1504,15 @@ fail_with_err:
 static void iscsi_detach_aio_context(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
+    int i;
 
-    aio_set_fd_handler(iscsilun->aio_context, iscsi_get_fd(iscsilun->iscsi),
-                       false, NULL, NULL, NULL);
-    iscsilun->events = 0;
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[i];
+
+        aio_set_fd_handler(iscsilun->aio_context, iscsi_get_fd(session->iscsi),
+                           false, NULL, NULL, NULL);
+        session->events = 0;
+    }
 
     if (iscsilun->nop_timer) {
         timer_del(iscsilun->nop_timer);
@@ -1439,57 +1585,25 @@ out:
     }
 }
 
-/*
- * We support iscsi url's on the form
- * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
- */
-static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
-                      Error **errp)
+/* Create a context and log into the LUN of @iscsi_url with it */
+static int iscsi_connect(struct iscsi_url *iscsi_url,
+                         const char *initiator_name,
+                         struct iscsi_context **piscsi, Error **errp)
 {
-    IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = NULL;
-    struct iscsi_url *iscsi_url = NULL;
-    struct scsi_task *task = NULL;
-    struct scsi_inquiry_standard *inq = NULL;
-    struct scsi_inquiry_supported_pages *inq_vpd;
-    char *initiator_name = NULL;
-    QemuOpts *opts;
+    struct iscsi_context *iscsi;
     Error *local_err = NULL;
-    const char *filename;
-    int i, ret = 0, timeout = 0;
-
-    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        ret = -EINVAL;
-        goto out;
-    }
-
-    filename = qemu_opt_get(opts, "filename");
-
-    iscsi_url = iscsi_parse_full_url(iscsi, filename);
-    if (iscsi_url == NULL) {
-        error_setg(errp, "Failed to parse URL : %s", filename);
-        ret = -EINVAL;
-        goto out;
-    }
-
-    memset(iscsilun, 0, sizeof(IscsiLun));
-
-    initiator_name = parse_initiator_name(iscsi_url->target);
+    int ret, timeout;
 
     iscsi = iscsi_create_context(initiator_name);
     if (iscsi == NULL) {
         error_setg(errp, "iSCSI: Failed to create iSCSI context.");
-        ret = -ENOMEM;
-        goto out;
+        return -ENOMEM;
     }
 
     if (iscsi_set_targetname(iscsi, iscsi_url->target)) {
         error_setg(errp, "iSCSI: Failed to set target name.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_url->user[0] != '\0') {
@@ -1498,7 +1612,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
         if (ret != 0) {
             error_setg(errp, "Failed to set initiator username and password");
             ret = -EINVAL;
-            goto out;
+            goto fail;
         }
     }
 
@@ -1507,13 +1621,13 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     if (local_err != NULL) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
         error_setg(errp, "iSCSI: Failed to set session type to normal.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
@@ -1523,7 +1637,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     if (local_err != NULL) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     /* timeout handling is broken in libiscsi before 1.15.0 */
@@ -1540,10 +1654,76 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
         error_setg(errp, "iSCSI: Failed to connect to LUN : %s",
             iscsi_get_error(iscsi));
         ret = -EINVAL;
+        goto fail;
+    }
+
+    *piscsi = iscsi;
+    return 0;
+
+fail:
+    iscsi_destroy_context(iscsi);
+    return ret;
+}
+
+/*
+ * We support iscsi url's on the form
+ * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
+ */
+static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    struct iscsi_context *iscsi = NULL;
+    struct iscsi_url *iscsi_url = NULL;
+    struct scsi_task *task = NULL;
+    struct scsi_inquiry_standard *inq = NULL;
+    struct scsi_inquiry_supported_pages *inq_vpd;
+    char *initiator_name = NULL;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *filename;
+    int i, ret = 0, num_sessions;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    filename = qemu_opt_get(opts, "filename");
+
+    iscsi_url = iscsi_parse_full_url(iscsi, filename);
+    if (iscsi_url == NULL) {
+        error_setg(errp, "Failed to parse URL : %s", filename);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    memset(iscsilun, 0, sizeof(IscsiLun));
+
+    initiator_name = parse_initiator_name(iscsi_url->target);
+
+    ret = iscsi_connect(iscsi_url, initiator_name, &iscsi, errp);
+    if (ret) {
+        goto out;
+    }
+
+    num_sessions = parse_sessions(iscsi_url->target);
+    if (num_sessions < 1 || num_sessions > ISCSI_MAX_SESSIONS) {
+        error_setg(errp, "iSCSI: sessions must be between 1 and %d",
+                   ISCSI_MAX_SESSIONS);
+        ret = -EINVAL;
         goto out;
     }
 
     iscsilun->iscsi = iscsi;
+    iscsilun->sessions[0] = (IscsiSession) {
+        .iscsi    = iscsi,
+        .iscsilun = iscsilun,
+    };
+    iscsilun->num_sessions = 1;
     iscsilun->aio_context = bdrv_get_aio_context(bs);
     iscsilun->lun   = iscsi_url->lun;
     iscsilun->has_write_same = true;
@@ -1628,6 +1808,18 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     scsi_free_scsi_task(task);
     task = NULL;
 
+    /* The additional sessions only carry reads and writes */
+    while (!bs->sg && iscsilun->num_sessions < num_sessions) {
+        IscsiSession *session = &iscsilun->sessions[iscsilun->num_sessions];
+
+        ret = iscsi_connect(iscsi_url, initiator_name, &session->iscsi, errp);
+        if (ret) {
+            goto out;
+        }
+        session->iscsilun = iscsilun;
+        iscsilun->num_sessions++;
+    }
+
     iscsi_attach_aio_context(bs, iscsilun->aio_context);
 
     /* Guess the internal cluster (page) size of the iscsi target by the means
@@ -1656,6 +1848,10 @@ out:
     }
 
     if (ret) {
+        for (i = 1; i < iscsilun->num_sessions; i++) {
+            iscsi_logout_sync(iscsilun->sessions[i].iscsi);
+            iscsi_destroy_context(iscsilun->sessions[i].iscsi);
+        }
         if (iscsi != NULL) {
             if (iscsi_is_logged_in(iscsi)) {
                 iscsi_logout_sync(iscsi);
@@ -1670,13 +1866,17 @@ out:
 static void iscsi_close(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    int i;
 
     iscsi_detach_aio_context(bs);
-    if (iscsi_is_logged_in(iscsi)) {
-        iscsi_logout_sync(iscsi);
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        struct iscsi_context *iscsi = iscsilun->sessions[i].iscsi;
+
+        if (iscsi_is_logged_in(iscsi)) {
+            iscsi_logout_sync(iscsi);
+        }
+        iscsi_destroy_context(iscsi);
     }
-    iscsi_destroy_context(iscsi);
     g_free(iscsilun->zeroblock);
     g_free(iscsilun->allocationmap);
     memset(iscsilun, 0, sizeof(IscsiLun));
@@ -1892,6 +2092,11 @@ static QemuOptsList qemu_iscsi_opts = {
             .name = "timeout",
             .type = QEMU_OPT_NUMBER,
             .help = "Request timeout in seconds (default 0 = no timeout)",
+        },{
+            .name = "sessions",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of sessions to spread reads and writes over "
+                    "(default 1)",
         },
         { /* end of list */ }
     },
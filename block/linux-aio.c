@@ -11,6 +11,7 @@
 #include "qemu-common.h"
 #include "block/aio.h"
 #include "qemu/queue.h"
+#include "qemu/atomic.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
 
@@ -153,6 +154,39 @@ static void qemu_laio_completion_cb(EventNotifier *e)
     }
 }
 
+/* The completion ring that the kernel maps at the address of the
+ * io_context_t.  Its layout is part of the ABI; libaio itself looks at
+ * it to skip the io_getevents system call when there are no events.
+ */
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+};
+
+#define AIO_RING_MAGIC 0xa10a10a1
+
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+    if (s->event_idx == s->event_max &&
+        (ring->magic != AIO_RING_MAGIC ||
+         atomic_read(&ring->head) == atomic_read(&ring->tail))) {
+        return false;
+    }
+
+    qemu_laio_completion_bh(s);
+    return true;
+}
+
 static void laio_cancel(BlockAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -297,8 +331,10 @@ void laio_attach_aio_context(void *s_, AioContext *new_context)
     struct qemu_laio_state *s = s_;
 
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
+    qemu_bh_set_priority(s->completion_bh, QEMU_BH_PRIO_HIGH);
     aio_set_event_notifier(new_context, &s->e, false,
                            qemu_laio_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_poll_cb);
 }
 
 void *laio_init(void)
@@ -22,8 +22,11 @@
 #include "qemu/error-report.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
+#define MAX_IN_FLIGHT 64
 #define DEFAULT_MIRROR_BUF_SIZE   (10 << 20)
+/* Requests are at most this fraction of the buffer, so that several of them
+ * can be in flight even when the dirty areas are large */
+#define MIN_PARALLEL_OPS 4
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -32,6 +35,16 @@ typedef struct MirrorBuffer {
     QSIMPLEQ_ENTRY(MirrorBuffer) next;
 } MirrorBuffer;
 
+/* A guest write that is being copied to the target in write-blocking mode */
+typedef struct MirrorActiveOp {
+    BdrvTrackedRequest *req;
+    int64_t offset;
+    unsigned int bytes;
+    int refcnt;                 /* aligned writes of req still running */
+    bool synced;                /* all of them were written to the target */
+    QTAILQ_ENTRY(MirrorActiveOp) next;
+} MirrorActiveOp;
+
 typedef struct MirrorBlockJob {
     BlockJob common;
     RateLimit limit;
@@ -44,6 +57,7 @@ typedef struct MirrorBlockJob {
     /* Used to block operations on the drive-mirror-replace target */
     Error *replace_blocker;
     bool is_none_mode;
+    MirrorCopyMode copy_mode;
     BlockdevOnError on_source_error, on_target_error;
     bool synced;
     bool should_complete;
@@ -62,9 +76,24 @@ typedef struct MirrorBlockJob {
     int sectors_in_flight;
     int ret;
     bool unmap;
+    bool use_copy_range;
     bool waiting_for_io;
     int target_cluster_sectors;
     int max_iov;
+
+    /* Largest request, adapted to the throughput that is measured in each
+     * SLICE_TIME */
+    int max_op_sectors;
+    bool op_size_growing;
+    uint64_t last_throughput;
+    uint64_t slice_start_offset;
+    int64_t slice_start_ns;
+
+    /* Write-blocking mode */
+    NotifierWithReturn before_write;
+    NotifierWithReturn after_write;
+    QTAILQ_HEAD(, MirrorActiveOp) active_ops;
+    CoQueue in_flight_queue;    /* waiting for in_flight_bitmap to clear */
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -119,6 +148,11 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
     qemu_iovec_destroy(&op->qiov);
     g_free(op);
 
+    /* Wake up guest writes that wait for the chunks in write-blocking mode */
+    while (qemu_co_enter_next(&s->in_flight_queue)) {
+        /* Do nothing */
+    }
+
     if (s->waiting_for_io) {
         qemu_coroutine_enter(s->common.co, NULL);
     }
@@ -160,6 +194,27 @@ static void mirror_read_complete(void *opaque, int ret)
                     mirror_write_complete, op);
 }
 
+/* Copy the chunk without passing it through op->qiov, falling back to the
+ * read/write path if the copy cannot be offloaded. */
+static void coroutine_fn mirror_co_copy_range(void *opaque)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+    int ret;
+
+    ret = bdrv_co_copy_range(s->common.bs, op->sector_num,
+                             s->target, op->sector_num, op->nb_sectors, 0);
+    if (ret == -ENOTSUP) {
+        s->use_copy_range = false;
+        ret = bdrv_co_readv(s->common.bs, op->sector_num, op->nb_sectors,
+                            &op->qiov);
+        mirror_read_complete(op, ret);
+        return;
+    }
+
+    mirror_write_complete(op, ret);
+}
+
 /* Round sector_num and/or nb_sectors to target cluster if COW is needed, and
  * return the offset of the adjusted tail sector against original. */
 static int mirror_cow_align(MirrorBlockJob *s,
@@ -263,8 +318,13 @@ static int mirror_do_read(MirrorBlockJob *s, int64_t sector_num,
     s->sectors_in_flight += nb_sectors;
     trace_mirror_one_iteration(s, sector_num, nb_sectors);
 
-    bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
-                   mirror_read_complete, op);
+    if (s->use_copy_range) {
+        Coroutine *co = qemu_coroutine_create(mirror_co_copy_range);
+        qemu_coroutine_enter(co, op);
+    } else {
+        bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
+                       mirror_read_complete, op);
+    }
     return ret;
 }
 
@@ -294,6 +354,141 @@ static void mirror_do_zero_or_discard(MirrorBlockJob *s,
     }
 }
 
+/* In write-blocking mode, a guest write owns the chunks that it touches
+ * while it is written to the source and the target, so that neither
+ * background copies nor other guest writes reorder the target writes.
+ * A request can be split into several aligned writes that all call the
+ * notifiers, the first one takes the chunks. */
+static int coroutine_fn mirror_before_write_notify(
+        NotifierWithReturn *notifier, void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, before_write);
+    BdrvTrackedRequest *req = opaque;
+    MirrorActiveOp *op;
+    int64_t start_chunk, end_chunk;
+
+    QTAILQ_FOREACH(op, &s->active_ops, next) {
+        if (op->req == req) {
+            op->refcnt++;
+            return 0;
+        }
+    }
+
+    start_chunk = req->offset / s->granularity;
+    end_chunk = DIV_ROUND_UP(req->offset + req->bytes, s->granularity);
+    end_chunk = MIN(end_chunk, DIV_ROUND_UP(s->bdev_length, s->granularity));
+    if (start_chunk >= end_chunk) {
+        return 0;
+    }
+
+    while (find_next_bit(s->in_flight_bitmap, end_chunk, start_chunk) <
+           end_chunk) {
+        qemu_co_queue_wait(&s->in_flight_queue);
+    }
+    bitmap_set(s->in_flight_bitmap, start_chunk, end_chunk - start_chunk);
+
+    op = g_new(MirrorActiveOp, 1);
+    *op = (MirrorActiveOp) {
+        .req    = req,
+        .offset = req->offset,
+        .bytes  = req->bytes,
+        .refcnt = 1,
+        .synced = true,
+    };
+    QTAILQ_INSERT_TAIL(&s->active_ops, op, next);
+    return 0;
+}
+
+static void coroutine_fn mirror_active_op_done(MirrorBlockJob *s,
+                                               MirrorActiveOp *op)
+{
+    int64_t start_chunk, end_chunk, end;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+
+    start_chunk = op->offset / s->granularity;
+    end_chunk = DIV_ROUND_UP(op->offset + op->bytes, s->granularity);
+    end_chunk = MIN(end_chunk, DIV_ROUND_UP(s->bdev_length, s->granularity));
+
+    /* Only the chunks that the write covers completely are in sync now,
+     * the others still need to be copied */
+    if (op->synced) {
+        int64_t first = DIV_ROUND_UP(op->offset, s->granularity);
+        int64_t last = (op->offset + op->bytes) / s->granularity;
+
+        end = s->bdev_length >> BDRV_SECTOR_BITS;
+        if (op->offset + op->bytes >= s->bdev_length) {
+            last = end_chunk;
+        }
+        if (last > first) {
+            bdrv_reset_dirty_bitmap(s->dirty_bitmap, first * sectors_per_chunk,
+                                    MIN(last * sectors_per_chunk, end) -
+                                    first * sectors_per_chunk);
+        }
+    }
+
+    trace_mirror_active_op_done(s, op->offset, op->bytes, op->synced);
+
+    bitmap_clear(s->in_flight_bitmap, start_chunk, end_chunk - start_chunk);
+    QTAILQ_REMOVE(&s->active_ops, op, next);
+    g_free(op);
+
+    qemu_co_queue_restart_all(&s->in_flight_queue);
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+/* Copies the data that the guest wrote to the source to the target before
+ * the guest request completes */
+static int coroutine_fn mirror_after_write_notify(
+        NotifierWithReturn *notifier, void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, after_write);
+    BdrvWriteResult *result = opaque;
+    int64_t sector_num = result->offset >> BDRV_SECTOR_BITS;
+    int nb_sectors = result->bytes >> BDRV_SECTOR_BITS;
+    MirrorActiveOp *op;
+    int ret;
+
+    QTAILQ_FOREACH(op, &s->active_ops, next) {
+        if (op->req == result->req) {
+            break;
+        }
+    }
+    if (!op) {
+        /* The write started before the job, it is in the dirty bitmap */
+        return 0;
+    }
+
+    if (result->ret < 0) {
+        ret = result->ret;
+    } else if (result->flags & BDRV_REQ_ZERO_WRITE) {
+        ret = bdrv_co_write_zeroes(s->target, sector_num, nb_sectors,
+                                   result->flags & BDRV_REQ_MAY_UNMAP);
+    } else if (result->qiov) {
+        ret = bdrv_co_writev(s->target, sector_num, nb_sectors, result->qiov);
+    } else {
+        ret = -ENOTSUP;
+    }
+
+    if (ret < 0) {
+        op->synced = false;
+        if (result->ret >= 0 && ret != -ENOTSUP) {
+            BlockErrorAction action = mirror_error_action(s, false, -ret);
+            if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
+                s->ret = ret;
+            }
+        }
+    }
+
+    if (--op->refcnt == 0) {
+        mirror_active_op_done(s, op);
+    }
+
+    /* The guest write itself succeeded, the chunk remains dirty */
+    return 0;
+}
+
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->common.bs;
@@ -312,9 +507,16 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         assert(sector_num >= 0);
     }
 
+    /* The first chunk may have been dirtied again while it was in flight,
+     * or it may be written to the target by a guest write right now */
+    while (test_bit(sector_num / sectors_per_chunk, s->in_flight_bitmap)) {
+        trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
+        mirror_wait_for_io(s);
+    }
+
     /* Find the number of consective dirty chunks following the first dirty
      * one, and wait for in flight requests in them. */
-    while (nb_chunks * sectors_per_chunk < (s->buf_size >> BDRV_SECTOR_BITS)) {
+    while (nb_chunks * sectors_per_chunk < s->max_op_sectors) {
         int64_t hbitmap_next;
         int64_t next_sector = sector_num + nb_chunks * sectors_per_chunk;
         int64_t next_chunk = next_sector / sectors_per_chunk;
@@ -393,7 +595,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         assert(io_sectors);
         sector_num += io_sectors;
         nb_chunks -= io_sectors / sectors_per_chunk;
-        delay_ns += ratelimit_calculate_delay(&s->limit, io_sectors);
+        delay_ns += block_job_ratelimit(&s->common, &s->limit, io_sectors);
     }
     return delay_ns;
 }
@@ -415,6 +617,48 @@ static void mirror_free_init(MirrorBlockJob *s)
     }
 }
 
+/* Searches the request size with the highest throughput: keep growing or
+ * shrinking it as long as the throughput improves, else turn around. */
+static void mirror_adapt_op_size(MirrorBlockJob *s, int64_t now)
+{
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int max_sectors = MAX(sectors_per_chunk,
+                          QEMU_ALIGN_DOWN((s->buf_size >> BDRV_SECTOR_BITS) /
+                                          MIN_PARALLEL_OPS,
+                                          sectors_per_chunk));
+    uint64_t throughput;
+
+    if (now - s->slice_start_ns < SLICE_TIME) {
+        return;
+    }
+
+    /* In bytes per millisecond */
+    throughput = (s->common.offset - s->slice_start_offset) * SCALE_MS /
+                 (now - s->slice_start_ns);
+    s->slice_start_offset = s->common.offset;
+    s->slice_start_ns = now;
+
+    /* Nothing to learn from an idle slice */
+    if (throughput == 0) {
+        return;
+    }
+
+    if (throughput < s->last_throughput) {
+        s->op_size_growing = !s->op_size_growing;
+    }
+    s->last_throughput = throughput;
+
+    if (s->op_size_growing) {
+        s->max_op_sectors = MIN(s->max_op_sectors * 2, max_sectors);
+    } else {
+        s->max_op_sectors = MAX(QEMU_ALIGN_DOWN(s->max_op_sectors / 2,
+                                                sectors_per_chunk),
+                                sectors_per_chunk);
+    }
+
+    trace_mirror_adapt_op_size(s, throughput, s->max_op_sectors);
+}
+
 static void mirror_drain(MirrorBlockJob *s)
 {
     while (s->in_flight > 0) {
@@ -542,7 +786,23 @@ static void coroutine_fn mirror_run(void *opaque)
 
     mirror_free_init(s);
 
+    /* Start with the largest requests that still allow parallelism */
+    s->max_op_sectors = MAX(s->granularity,
+                            QEMU_ALIGN_DOWN(s->buf_size / MIN_PARALLEL_OPS,
+                                            s->granularity))
+                        >> BDRV_SECTOR_BITS;
+    s->op_size_growing = false;
+
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        s->before_write.notify = mirror_before_write_notify;
+        s->after_write.notify = mirror_after_write_notify;
+        bdrv_add_before_write_notifier(bs, &s->before_write);
+        bdrv_add_after_write_notifier(bs, &s->after_write);
+    }
+
     last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->slice_start_ns = last_pause_ns;
+    s->slice_start_offset = s->common.offset;
     if (!s->is_none_mode) {
         /* First part, loop on the sectors and initialize the dirty bitmap.  */
         BlockDriverState *base = s->base;
@@ -672,6 +932,7 @@ static void coroutine_fn mirror_run(void *opaque)
             break;
         }
         last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        mirror_adapt_op_size(s, last_pause_ns);
     }
 
 immediate_exit:
@@ -685,6 +946,16 @@ immediate_exit:
     }
 
     assert(s->in_flight == 0);
+
+    if (s->before_write.notify) {
+        /* Let guest writes that are copied to the target finish */
+        bdrv_drained_begin(bs);
+        assert(QTAILQ_EMPTY(&s->active_ops));
+        notifier_with_return_remove(&s->before_write);
+        notifier_with_return_remove(&s->after_write);
+        bdrv_drained_end(bs);
+    }
+
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
@@ -782,7 +1053,7 @@ static const BlockJobDriver commit_active_job_driver = {
 static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
                              const char *replaces,
                              int64_t speed, uint32_t granularity,
-                             int64_t buf_size,
+                             int64_t buf_size, MirrorCopyMode copy_mode,
                              BlockdevOnError on_source_error,
                              BlockdevOnError on_target_error,
                              bool unmap,
@@ -841,10 +1112,14 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
     s->on_target_error = on_target_error;
     s->target = target;
     s->is_none_mode = is_none_mode;
+    s->copy_mode = copy_mode;
     s->base = base;
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->use_copy_range = true;
+    QTAILQ_INIT(&s->active_ops);
+    qemu_co_queue_init(&s->in_flight_queue);
 
     s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
     if (!s->dirty_bitmap) {
@@ -868,7 +1143,8 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   const char *replaces,
                   int64_t speed, uint32_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, MirrorCopyMode copy_mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap,
                   BlockCompletionFunc *cb,
@@ -884,7 +1160,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     is_none_mode = mode == MIRROR_SYNC_MODE_NONE;
     base = mode == MIRROR_SYNC_MODE_TOP ? backing_bs(bs) : NULL;
     mirror_start_job(bs, target, replaces,
-                     speed, granularity, buf_size,
+                     speed, granularity, buf_size, copy_mode,
                      on_source_error, on_target_error, unmap, cb, opaque, errp,
                      &mirror_job_driver, is_none_mode, base);
 }
@@ -932,7 +1208,7 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
     }
 
     bdrv_ref(base);
-    mirror_start_job(bs, base, NULL, speed, 0, 0,
+    mirror_start_job(bs, base, NULL, speed, 0, 0, MIRROR_COPY_MODE_BACKGROUND,
                      on_error, on_error, false, cb, opaque, &local_err,
                      &commit_active_job_driver, false, base);
     if (local_err) {
@@ -32,7 +32,7 @@
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
 
-static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
+static void nbd_recv_coroutines_enter_all(NbdClientConnection *s)
 {
     int i;
 
@@ -43,10 +43,14 @@ static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_connection_detach_aio_context(NbdClientConnection *client)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    aio_set_fd_handler(bdrv_get_aio_context(client->bs), client->sioc->fd,
+                       false, NULL, NULL, NULL);
+}
 
+static void nbd_teardown_connection(NbdClientConnection *client)
+{
     if (!client->ioc) { /* Already closed */
         return;
     }
@@ -57,7 +61,7 @@ static void nbd_teardown_connection(BlockDriverState *bs)
                          NULL);
     nbd_recv_coroutines_enter_all(client);
 
-    nbd_client_detach_aio_context(bs);
+    nbd_connection_detach_aio_context(client);
     object_unref(OBJECT(client->sioc));
     client->sioc = NULL;
     object_unref(OBJECT(client->ioc));
@@ -66,8 +70,7 @@ static void nbd_teardown_connection(BlockDriverState *bs)
 
 static void nbd_reply_ready(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdClientConnection *s = opaque;
     uint64_t i;
     int ret;
 
@@ -104,21 +107,20 @@ static void nbd_reply_ready(void *opaque)
     }
 
 fail:
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(s);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BlockDriverState *bs = opaque;
+    NbdClientConnection *s = opaque;
 
-    qemu_coroutine_enter(nbd_get_client_session(bs)->send_coroutine, NULL);
+    qemu_coroutine_enter(s->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NbdClientConnection *s,
                                struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
-    NbdClientSession *s = nbd_get_client_session(bs);
     AioContext *aio_context;
     int rc, ret, i;
 
@@ -141,10 +143,10 @@ static int nbd_co_send_request(BlockDriverState *bs,
     }
 
     s->send_coroutine = qemu_coroutine_self();
-    aio_context = bdrv_get_aio_context(bs);
+    aio_context = bdrv_get_aio_context(s->bs);
 
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, nbd_restart_write, bs);
+                       nbd_reply_ready, nbd_restart_write, s);
     if (qiov) {
         qio_channel_set_cork(s->ioc, true);
         rc = nbd_send_request(s->ioc, request);
@@ -160,27 +162,154 @@ static int nbd_co_send_request(BlockDriverState *bs,
         rc = nbd_send_request(s->ioc, request);
     }
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, NULL, bs);
+                       nbd_reply_ready, NULL, s);
     s->send_coroutine = NULL;
     qemu_co_mutex_unlock(&s->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(NbdClientSession *s,
+static int nbd_co_read(NbdClientConnection *s, void *buf, size_t len)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+    return nbd_wr_syncv(s->ioc, &iov, 1, 0, len, true) == len ? 0 : -EIO;
+}
+
+static int nbd_co_drop(NbdClientConnection *s, size_t len)
+{
+    uint8_t buf[512];
+
+    while (len > 0) {
+        size_t count = MIN(sizeof(buf), len);
+
+        if (nbd_co_read(s, buf, count) < 0) {
+            return -EIO;
+        }
+        len -= count;
+    }
+    return 0;
+}
+
+/* Consume the payload of the structured reply chunk in @reply.  Returns 0
+ * on success or a positive errno if the chunk reports an error or does not
+ * match @request.
+ */
+static int nbd_co_receive_chunk(NbdClientConnection *s,
     struct nbd_request *request, struct nbd_reply *reply,
-    QEMUIOVector *qiov, int offset)
+    QEMUIOVector *qiov, int offset, struct nbd_extent *extent)
+{
+    uint32_t len = reply->length;
+    uint8_t buf[8 + 4 + 8];
+    uint64_t chunk_offset;
+    uint32_t size;
+    int error;
+
+    switch (reply->type) {
+    case NBD_REPLY_TYPE_NONE:
+        if (len) {
+            goto invalid;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        /* [ 0 ..  7] offset, then the data */
+        if (!qiov || len < 8 || nbd_co_read(s, buf, 8) < 0) {
+            goto invalid;
+        }
+        len -= 8;
+        chunk_offset = ldq_be_p(buf);
+        if (chunk_offset < request->from ||
+            chunk_offset + len > request->from + request->len) {
+            goto invalid;
+        }
+        if (nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov,
+                         offset + chunk_offset - request->from,
+                         len, true) != len) {
+            return EIO;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        /* [ 0 ..  7] offset, [ 8 .. 11] size of the hole */
+        if (!qiov || len != 12 || nbd_co_read(s, buf, 12) < 0) {
+            goto invalid;
+        }
+        len = 0;
+        chunk_offset = ldq_be_p(buf);
+        size = ldl_be_p(buf + 8);
+        if (chunk_offset < request->from ||
+            chunk_offset + size > request->from + request->len) {
+            goto invalid;
+        }
+        qemu_iovec_memset(qiov, offset + chunk_offset - request->from,
+                          0, size);
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        /* [ 0 ..  3] context id, then (length, flags) descriptors; only
+         * the first one is of interest.
+         */
+        if (!extent || len < 12 || (len - 4) % 8 ||
+            nbd_co_read(s, buf, 12) < 0) {
+            goto invalid;
+        }
+        len -= 12;
+        if (ldl_be_p(buf) != s->ext.context_id) {
+            goto invalid;
+        }
+        extent->length = ldl_be_p(buf + 4);
+        extent->flags = ldl_be_p(buf + 8);
+        return nbd_co_drop(s, len) < 0 ? EIO : 0;
+
+    default:
+        if (!NBD_REPLY_TYPE_IS_ERR(reply->type)) {
+            goto invalid;
+        }
+        /* [ 0 ..  3] error, [ 4 ..  5] message length, then the message
+         * and any type-specific data
+         */
+        if (len < 6 || nbd_co_read(s, buf, 6) < 0) {
+            goto invalid;
+        }
+        len -= 6;
+        error = nbd_errno_to_system_errno(ldl_be_p(buf));
+        if (nbd_co_drop(s, len) < 0) {
+            return EIO;
+        }
+        return error ? error : EIO;
+    }
+
+invalid:
+    nbd_co_drop(s, len);
+    return EIO;
+}
+
+static void nbd_co_receive_reply(NbdClientConnection *s,
+    struct nbd_request *request, struct nbd_reply *reply,
+    QEMUIOVector *qiov, int offset, struct nbd_extent *extent)
 {
     int ret;
+    int error = 0;
+
+    do {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        *reply = s->reply;
+        if (reply->handle != request->handle ||
+            !s->ioc) {
+            reply->error = EIO;
+            return;
+        }
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle ||
-        !s->ioc) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
+        if (reply->magic == NBD_STRUCTURED_REPLY_MAGIC) {
+            ret = nbd_co_receive_chunk(s, request, reply, qiov, offset,
+                                       extent);
+            if (ret && !error) {
+                error = ret;
+            }
+            reply->error = error;
+        } else if (qiov && reply->error == 0) {
             ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov,
                                offset, request->len, 1);
             if (ret != request->len) {
@@ -190,10 +319,10 @@ static void nbd_co_receive_reply(NbdClientSession *s,
 
         /* Tell the read handler to read another header.  */
         s->reply.handle = 0;
-    }
+    } while (!(reply->flags & NBD_REPLY_FLAG_DONE));
 }
 
-static void nbd_coroutine_start(NbdClientSession *s,
+static void nbd_coroutine_start(NbdClientConnection *s,
    struct nbd_request *request)
 {
     /* Poor man semaphore.  The free_sema is locked when no other request
@@ -207,7 +336,7 @@ static void nbd_coroutine_start(NbdClientSession *s,
     /* s->recv_coroutine[i] is set as soon as we get the send_lock.  */
 }
 
-static void nbd_coroutine_end(NbdClientSession *s,
+static void nbd_coroutine_end(NbdClientConnection *s,
     struct nbd_request *request)
 {
     int i = HANDLE_TO_INDEX(s, request->handle);
@@ -217,11 +346,34 @@ static void nbd_coroutine_end(NbdClientSession *s,
     }
 }
 
+/* Pick the connection with the fewest requests in flight, starting the
+ * search after the last pick so that idle connections take turns.
+ */
+static NbdClientConnection *nbd_client_pick_connection(BlockDriverState *bs)
+{
+    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdClientConnection *best = NULL;
+    int i;
+
+    for (i = 0; i < s->num_conns; i++) {
+        NbdClientConnection *conn =
+            &s->conns[(s->next_conn + i) % s->num_conns];
+
+        if (conn->ioc && (!best || conn->in_flight < best->in_flight)) {
+            best = conn;
+        }
+    }
+    s->next_conn = (s->next_conn + 1) % s->num_conns;
+
+    /* If every connection is gone, nbd_co_send_request() fails */
+    return best ? best : &s->conns[0];
+}
+
 static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors, QEMUIOVector *qiov,
                           int offset)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_READ };
     struct nbd_reply reply;
     ssize_t ret;
@@ -229,14 +381,15 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    conn = nbd_client_pick_connection(bs);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov, offset);
+        nbd_co_receive_reply(conn, &request, &reply, qiov, offset, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 
 }
@@ -246,6 +399,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
                            int offset)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_WRITE };
     struct nbd_reply reply;
     ssize_t ret;
@@ -258,14 +412,15 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov, offset);
+    conn = nbd_client_pick_connection(bs);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, qiov, offset);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
@@ -310,6 +465,7 @@ int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
 int nbd_client_co_flush(BlockDriverState *bs)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_FLUSH };
     struct nbd_reply reply;
     ssize_t ret;
@@ -325,14 +481,15 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    conn = nbd_client_pick_connection(bs);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
@@ -340,6 +497,7 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_TRIM };
     struct nbd_reply reply;
     ssize_t ret;
@@ -350,30 +508,87 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    conn = nbd_client_pick_connection(bs);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 
 }
 
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum,
+                                       BlockDriverState **file)
+{
+    NbdClientConnection *conn = nbd_client_pick_connection(bs);
+    struct nbd_request request = {
+        .type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE,
+    };
+    struct nbd_reply reply;
+    struct nbd_extent extent = { 0 };
+    ssize_t ret;
+
+    if (!conn->ext.base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA;
+    }
+
+    nb_sectors = MIN(nb_sectors, UINT32_MAX / 512);
+    request.from = sector_num * 512;
+    request.len = nb_sectors * 512;
+
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, &extent);
+    }
+    nbd_coroutine_end(conn, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+    if (extent.length == 0) {
+        return -EIO;
+    }
+
+    *pnum = MIN(DIV_ROUND_UP(extent.length, 512), nb_sectors);
+    return (extent.flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
+           (extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0);
+}
+
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    aio_set_fd_handler(bdrv_get_aio_context(bs),
-                       nbd_get_client_session(bs)->sioc->fd,
-                       false, NULL, NULL, NULL);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].sioc) {
+            nbd_connection_detach_aio_context(&client->conns[i]);
+        }
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sioc->fd,
-                       false, nbd_reply_ready, NULL, bs);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        NbdClientConnection *conn = &client->conns[i];
+
+        if (conn->sioc) {
+            aio_set_fd_handler(new_context, conn->sioc->fd,
+                               false, nbd_reply_ready, NULL, conn);
+        }
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
@@ -384,56 +599,110 @@ void nbd_client_close(BlockDriverState *bs)
         .from = 0,
         .len = 0
     };
+    int i;
 
-    if (client->ioc == NULL) {
-        return;
+    for (i = 0; i < client->num_conns; i++) {
+        NbdClientConnection *conn = &client->conns[i];
+
+        if (conn->ioc == NULL) {
+            continue;
+        }
+
+        nbd_send_request(conn->ioc, &request);
+
+        nbd_teardown_connection(conn);
     }
+}
 
-    nbd_send_request(client->ioc, &request);
+/* Multiple connections are only safe if a flush on one of them covers
+ * writes completed on the others, or if there are no writes at all.
+ */
+bool nbd_client_can_multi_conn(BlockDriverState *bs)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
 
-    nbd_teardown_connection(bs);
+    return client->nbdflags & (NBD_FLAG_CAN_MULTI_CONN | NBD_FLAG_READ_ONLY);
 }
 
-int nbd_client_init(BlockDriverState *bs,
-                    QIOChannelSocket *sioc,
-                    const char *export,
-                    QCryptoTLSCreds *tlscreds,
-                    const char *hostname,
-                    Error **errp)
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sioc,
+                              const char *export,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientConnection *conn;
+    uint32_t nbdflags;
+    off_t size;
     int ret;
 
+    if (client->num_conns == NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "Too many NBD connections");
+        return -EINVAL;
+    }
+    conn = &client->conns[client->num_conns];
+
     /* NBD handshake */
     logout("session init %s\n", export);
     qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
 
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
-                                &client->nbdflags,
+                                &nbdflags,
                                 tlscreds, hostname,
-                                &client->ioc,
-                                &client->size, errp);
+                                &conn->ioc,
+                                &size, &conn->ext, errp);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         return ret;
     }
 
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_mutex_init(&client->free_sema);
-    client->sioc = sioc;
-    object_ref(OBJECT(client->sioc));
+    if (client->num_conns == 0) {
+        client->nbdflags = nbdflags;
+        client->size = size;
+    } else if (nbdflags != client->nbdflags || size != client->size) {
+        error_setg(errp, "NBD server changed the export between connections");
+        if (conn->ioc) {
+            object_unref(OBJECT(conn->ioc));
+            conn->ioc = NULL;
+        }
+        return -EINVAL;
+    }
+
+    conn->bs = bs;
+    qemu_co_mutex_init(&conn->send_mutex);
+    qemu_co_mutex_init(&conn->free_sema);
+    conn->sioc = sioc;
+    object_ref(OBJECT(conn->sioc));
 
-    if (!client->ioc) {
-        client->ioc = QIO_CHANNEL(sioc);
-        object_ref(OBJECT(client->ioc));
+    if (!conn->ioc) {
+        conn->ioc = QIO_CHANNEL(sioc);
+        object_ref(OBJECT(conn->ioc));
     }
+    client->num_conns++;
 
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
 
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    aio_set_fd_handler(bdrv_get_aio_context(bs), conn->sioc->fd,
+                       false, nbd_reply_ready, NULL, conn);
 
     logout("Established connection with NBD server\n");
     return 0;
 }
+
+int nbd_client_init(BlockDriverState *bs,
+                    QIOChannelSocket *sioc,
+                    const char *export,
+                    QCryptoTLSCreds *tlscreds,
+                    const char *hostname,
+                    Error **errp)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+
+    client->num_conns = 0;
+    client->next_conn = 0;
+    return nbd_client_add_connection(bs, sioc, export, tlscreds, hostname,
+                                     errp);
+}
@@ -17,11 +17,14 @@
 
 #define MAX_NBD_REQUESTS    16
 
-typedef struct NbdClientSession {
+/* Maximum number of connections to one export */
+#define NBD_MAX_CONNECTIONS 16
+
+typedef struct NbdClientConnection {
+    BlockDriverState *bs;
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
-    uint32_t nbdflags;
-    off_t size;
+    struct nbd_extensions ext;
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -30,6 +33,18 @@ typedef struct NbdClientSession {
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
+} NbdClientConnection;
+
+typedef struct NbdClientSession {
+    /* Requests are spread over all connections; their export flags and
+     * size are the same.
+     */
+    NbdClientConnection conns[NBD_MAX_CONNECTIONS];
+    int num_conns;
+    int next_conn;
+
+    uint32_t nbdflags;
+    off_t size;
 
     bool is_unix;
 } NbdClientSession;
@@ -42,6 +57,13 @@ int nbd_client_init(BlockDriverState *bs,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     Error **errp);
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sock,
+                              const char *export_name,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp);
+bool nbd_client_can_multi_conn(BlockDriverState *bs);
 void nbd_client_close(BlockDriverState *bs);
 
 int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -51,6 +73,10 @@ int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
                          int nb_sectors, QEMUIOVector *qiov);
 int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors, QEMUIOVector *qiov);
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum,
+                                       BlockDriverState **file);
 
 void nbd_client_detach_aio_context(BlockDriverState *bs);
 void nbd_client_attach_aio_context(BlockDriverState *bs,
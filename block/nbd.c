@@ -43,6 +43,19 @@ typedef struct BDRVNBDState {
     NbdClientSession client;
 } BDRVNBDState;
 
+static QemuOptsList nbd_runtime_opts = {
+    .name = "nbd",
+    .head = QTAILQ_HEAD_INITIALIZER(nbd_runtime_opts.head),
+    .desc = {
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open to the export",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int nbd_parse_uri(const char *filename, QDict *options)
 {
     URI *uri;
@@ -301,7 +314,25 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     const char *tlscredsid;
     QCryptoTLSCreds *tlscreds = NULL;
     const char *hostname = NULL;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t connections;
     int ret = -EINVAL;
+    int i;
+
+    opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    connections = qemu_opt_get_number(opts, "connections", 1);
+    qemu_opts_del(opts);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return -EINVAL;
+    }
+    if (connections < 1 || connections > NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   NBD_MAX_CONNECTIONS);
+        return -EINVAL;
+    }
 
     /* Pop the config into our state object. Exit if invalid. */
     saddr = nbd_config(s, options, &export, errp);
@@ -336,6 +367,33 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     /* NBD handshake */
     ret = nbd_client_init(bs, sioc, export,
                           tlscreds, hostname, errp);
+    if (ret < 0) {
+        goto error;
+    }
+
+    /* With a server that cannot keep flushes consistent across
+     * connections, stick to the first one.
+     */
+    if (!nbd_client_can_multi_conn(bs)) {
+        connections = 1;
+    }
+    for (i = 1; i < connections; i++) {
+        QIOChannelSocket *extra_sioc = nbd_establish_connection(saddr, errp);
+
+        if (!extra_sioc) {
+            nbd_client_close(bs);
+            ret = -ECONNREFUSED;
+            goto error;
+        }
+        ret = nbd_client_add_connection(bs, extra_sioc, export,
+                                        tlscreds, hostname, errp);
+        object_unref(OBJECT(extra_sioc));
+        if (ret < 0) {
+            nbd_client_close(bs);
+            goto error;
+        }
+    }
+
  error:
     if (sioc) {
         object_unref(OBJECT(sioc));
@@ -377,6 +435,15 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
     return nbd_client_co_discard(bs, sector_num, nb_sectors);
 }
 
+static int64_t coroutine_fn nbd_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file)
+{
+    return nbd_client_co_get_block_status(bs, sector_num, nb_sectors, pnum,
+                                          file);
+}
+
 static void nbd_close(BlockDriverState *bs)
 {
     nbd_client_close(bs);
@@ -408,6 +475,7 @@ static void nbd_refresh_filename(BlockDriverState *bs, QDict *options)
     const char *port   = qdict_get_try_str(options, "port");
     const char *export = qdict_get_try_str(options, "export");
     const char *tlscreds = qdict_get_try_str(options, "tls-creds");
+    QObject *connections = qdict_get(options, "connections");
 
     qdict_put_obj(opts, "driver", QOBJECT(qstring_from_str("nbd")));
 
@@ -445,6 +513,10 @@ static void nbd_refresh_filename(BlockDriverState *bs, QDict *options)
     if (tlscreds) {
         qdict_put_obj(opts, "tls-creds", QOBJECT(qstring_from_str(tlscreds)));
     }
+    if (connections) {
+        qobject_incref(connections);
+        qdict_put_obj(opts, "connections", connections);
+    }
 
     bs->full_open_options = opts;
 }
@@ -460,6 +532,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -478,6 +551,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -496,6 +570,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -0,0 +1,1151 @@
+/*
+ * NVMe block driver based on vfio
+ *
+ * The controller is driven from userspace: its registers and doorbells are
+ * mapped with VFIO, guest RAM is mapped for DMA through the IOMMU, and
+ * commands are written directly to a hardware submission queue.  The
+ * completion queue is polled from the AioContext, with the MSI-X interrupt
+ * as a fallback when the event loop goes to sleep.
+ *
+ * Usage:
+ *      -drive file=nvme://0000:01:00.0/1,if=none,id=<drive_id>
+ *
+ * where 0000:01:00.0 is the PCI address of a controller that is bound to
+ * vfio-pci, and 1 the namespace.  All of guest RAM is pinned, so the
+ * locked memory limit must be at least as large as guest RAM.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <linux/vfio.h>
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "qemu/vfio-helpers.h"
+#include "block/block_int.h"
+#include "block/nvme.h"
+#include "exec/cpu-common.h"
+#include "qemu-common.h"
+#include "trace.h"
+
+#define NVME_SQ_ENTRY_BYTES 64
+#define NVME_CQ_ENTRY_BYTES 16
+#define NVME_QUEUE_SIZE 128
+#define NVME_DOORBELL_OFFSET 0x1000
+
+/* The admin queue, and a single I/O queue */
+#define INDEX_ADMIN 0
+#define INDEX_IO    1
+#define NVME_NUM_QUEUES 2
+
+#define NVME_BLOCK_OPT_DEVICE "device"
+#define NVME_BLOCK_OPT_NAMESPACE "namespace"
+
+typedef struct {
+    int32_t head, tail;
+    uint8_t *queue;
+    uint64_t iova;
+    size_t size;
+    /* Hardware MMIO register */
+    volatile uint32_t *doorbell;
+} NVMeQueue;
+
+typedef struct {
+    BlockCompletionFunc *cb;
+    void *opaque;
+    int cid;
+    void *prp_list_page;
+    uint64_t prp_list_iova;
+    /* Next free request, or -1 */
+    int free_req_next;
+} NVMeRequest;
+
+typedef struct {
+    int index;
+    NVMeQueue sq, cq;
+    int cq_phase;
+    /* Set while completions are processed, to avoid recursion */
+    bool busy;
+
+    /* Commands written to the submission queue but not yet rung */
+    int need_kick;
+    int inflight;
+
+    uint8_t *prp_list_pages;
+    NVMeRequest reqs[NVME_QUEUE_SIZE - 1];
+    int free_req_head;
+    /* Coroutines waiting for a free request */
+    CoQueue free_req_queue;
+} NVMeQueuePair;
+
+typedef struct {
+    AioContext *aio_context;
+    QEMUVFIOState *vfio;
+    volatile NvmeBar *regs;
+    volatile uint32_t *doorbells;
+    size_t doorbell_size;
+    /* Distance between two doorbells, in units of uint32_t */
+    int doorbell_scale;
+    size_t page_size;
+    int queue_size;
+    NVMeQueuePair *queues[NVME_NUM_QUEUES];
+    EventNotifier irq_notifier;
+    bool irq_notifier_ready;
+
+    int nsid;
+    uint64_t nsze; /* Namespace size reported by identify command */
+    int blkshift;
+    size_t max_transfer;
+    bool write_cache;
+    int plugged;
+
+    /* Requests that hold DMA mappings */
+    int dma_map_count;
+    /* Coroutines waiting for temporary mappings to be released */
+    CoQueue dma_flush_queue;
+
+    RAMBlockNotifier ram_notifier;
+    bool ram_notifier_registered;
+} BDRVNVMeState;
+
+typedef struct {
+    Coroutine *co;
+    int ret;
+} NVMeCoData;
+
+static QemuOptsList runtime_opts = {
+    .name = "nvme",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = NVME_BLOCK_OPT_DEVICE,
+            .type = QEMU_OPT_STRING,
+            .help = "NVMe PCI device address",
+        },
+        {
+            .name = NVME_BLOCK_OPT_NAMESPACE,
+            .type = QEMU_OPT_NUMBER,
+            .help = "NVMe namespace",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void nvme_init_queue(BDRVNVMeState *s, NVMeQueue *q,
+                            int nentries, int entry_bytes, Error **errp)
+{
+    int r;
+
+    q->head = q->tail = 0;
+    q->size = ROUND_UP(nentries * entry_bytes, s->page_size);
+    q->queue = qemu_try_memalign(s->page_size, q->size);
+    if (!q->queue) {
+        error_setg(errp, "Cannot allocate queue");
+        return;
+    }
+    memset(q->queue, 0, q->size);
+    r = qemu_vfio_dma_map(s->vfio, q->queue, q->size, false, &q->iova);
+    if (r) {
+        error_setg(errp, "Cannot map queue");
+    }
+}
+
+static void nvme_free_queue(BDRVNVMeState *s, NVMeQueue *q)
+{
+    if (q->queue) {
+        qemu_vfio_dma_unmap(s->vfio, q->queue);
+        qemu_vfree(q->queue);
+    }
+}
+
+static void nvme_put_free_req(NVMeQueuePair *q, NVMeRequest *req)
+{
+    req->free_req_next = q->free_req_head;
+    q->free_req_head = req - q->reqs;
+}
+
+/* Outside coroutines, returns NULL if all requests are in use */
+static NVMeRequest *nvme_get_free_req(NVMeQueuePair *q)
+{
+    NVMeRequest *req;
+
+    while (q->free_req_head == -1) {
+        if (!qemu_in_coroutine()) {
+            return NULL;
+        }
+        trace_nvme_free_req_queue_wait(q);
+        qemu_co_queue_wait(&q->free_req_queue);
+    }
+
+    req = &q->reqs[q->free_req_head];
+    q->free_req_head = req->free_req_next;
+    req->free_req_next = -1;
+    return req;
+}
+
+static void nvme_free_queue_pair(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    if (q->prp_list_pages) {
+        qemu_vfio_dma_unmap(s->vfio, q->prp_list_pages);
+        qemu_vfree(q->prp_list_pages);
+    }
+    nvme_free_queue(s, &q->sq);
+    nvme_free_queue(s, &q->cq);
+    g_free(q);
+}
+
+static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s, int idx,
+                                             Error **errp)
+{
+    NVMeQueuePair *q = g_new0(NVMeQueuePair, 1);
+    size_t prp_bytes = s->page_size * (s->queue_size - 1);
+    uint64_t prp_list_iova;
+    Error *local_err = NULL;
+    int i, r;
+
+    q->index = idx;
+    q->free_req_head = -1;
+    qemu_co_queue_init(&q->free_req_queue);
+
+    q->prp_list_pages = qemu_try_memalign(s->page_size, prp_bytes);
+    if (!q->prp_list_pages) {
+        error_setg(errp, "Cannot allocate PRP lists");
+        goto fail;
+    }
+    r = qemu_vfio_dma_map(s->vfio, q->prp_list_pages, prp_bytes, false,
+                          &prp_list_iova);
+    if (r) {
+        error_setg(errp, "Cannot map PRP lists");
+        goto fail;
+    }
+    for (i = 0; i < s->queue_size - 1; i++) {
+        NVMeRequest *req = &q->reqs[i];
+
+        /* Command identifier 0 is left unused, to catch bogus completions */
+        req->cid = i + 1;
+        req->prp_list_page = q->prp_list_pages + i * s->page_size;
+        req->prp_list_iova = prp_list_iova + i * s->page_size;
+        nvme_put_free_req(q, req);
+    }
+
+    nvme_init_queue(s, &q->sq, s->queue_size, NVME_SQ_ENTRY_BYTES,
+                    &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+    q->sq.doorbell = &s->doorbells[idx * 2 * s->doorbell_scale];
+
+    nvme_init_queue(s, &q->cq, s->queue_size, NVME_CQ_ENTRY_BYTES,
+                    &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+    q->cq.doorbell = &s->doorbells[(idx * 2 + 1) * s->doorbell_scale];
+
+    return q;
+
+fail:
+    nvme_free_queue_pair(s, q);
+    return NULL;
+}
+
+/* Ring the submission doorbell, unless more commands are coming */
+static void nvme_kick(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    if (s->plugged || !q->need_kick) {
+        return;
+    }
+    trace_nvme_kick(s, q->index);
+    /* The entries must be visible to the device before the new tail */
+    smp_wmb();
+    *q->sq.doorbell = cpu_to_le32(q->sq.tail);
+    q->need_kick = 0;
+}
+
+static int nvme_translate_error(const NvmeCqe *c)
+{
+    uint16_t status = (le16_to_cpu(c->status) >> 1) & 0x7ff;
+
+    if (status) {
+        trace_nvme_error(le32_to_cpu(c->result), le16_to_cpu(c->sq_head),
+                         le16_to_cpu(c->sq_id), le16_to_cpu(c->cid), status);
+    }
+    switch (status) {
+    case NVME_SUCCESS:
+        return 0;
+    case NVME_INVALID_OPCODE:
+        return -ENOTSUP;
+    case NVME_INVALID_FIELD:
+    case NVME_LBA_RANGE:
+        return -EINVAL;
+    default:
+        return -EIO;
+    }
+}
+
+static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    bool progress = false;
+    NvmeCqe *c;
+
+    if (q->busy) {
+        return false;
+    }
+    q->busy = true;
+    trace_nvme_process_completion(s, q->index, q->inflight);
+
+    while (q->inflight) {
+        NVMeRequest *req;
+        int cid, ret;
+
+        c = (NvmeCqe *)&q->cq.queue[q->cq.head * NVME_CQ_ENTRY_BYTES];
+        if ((le16_to_cpu(c->status) & 0x1) == q->cq_phase) {
+            break;
+        }
+        /* Read the rest of the entry only after seeing the phase bit */
+        smp_rmb();
+
+        q->cq.head = (q->cq.head + 1) % s->queue_size;
+        if (!q->cq.head) {
+            q->cq_phase = !q->cq_phase;
+        }
+        progress = true;
+
+        cid = le16_to_cpu(c->cid);
+        if (cid == 0 || cid >= s->queue_size) {
+            error_report("nvme: unexpected command identifier %d "
+                         "in completion", cid);
+            continue;
+        }
+        req = &q->reqs[cid - 1];
+        assert(req->cb);
+        trace_nvme_complete_command(s, q->index, cid);
+        ret = nvme_translate_error(c);
+        q->inflight--;
+
+        /* The callback may submit more commands to this queue pair */
+        req->cb(req->opaque, ret);
+    }
+
+    if (progress) {
+        /* Let the device reuse the entries */
+        *q->cq.doorbell = cpu_to_le32(q->cq.head);
+    }
+    q->busy = false;
+    return progress;
+}
+
+static void nvme_submit_command(BDRVNVMeState *s, NVMeQueuePair *q,
+                                NVMeRequest *req, NvmeCmd *cmd,
+                                BlockCompletionFunc cb, void *opaque)
+{
+    req->cb = cb;
+    req->opaque = opaque;
+    cmd->cid = cpu_to_le16(req->cid);
+
+    trace_nvme_submit_command(s, q->index, req->cid);
+    memcpy(&q->sq.queue[q->sq.tail * NVME_SQ_ENTRY_BYTES], cmd, sizeof(*cmd));
+    q->sq.tail = (q->sq.tail + 1) % s->queue_size;
+    q->need_kick++;
+    q->inflight++;
+    nvme_kick(s, q);
+}
+
+static void nvme_cmd_sync_cb(void *opaque, int ret)
+{
+    int *pret = opaque;
+
+    *pret = ret;
+}
+
+/* Submit @cmd and wait for it, outside coroutine context */
+static int nvme_cmd_sync(BDRVNVMeState *s, NVMeQueuePair *q, NvmeCmd *cmd)
+{
+    NVMeRequest *req;
+    int ret = -EINPROGRESS;
+
+    req = nvme_get_free_req(q);
+    if (!req) {
+        return -EBUSY;
+    }
+    nvme_submit_command(s, q, req, cmd, nvme_cmd_sync_cb, &ret);
+
+    while (ret == -EINPROGRESS) {
+        aio_poll(s->aio_context, true);
+    }
+    nvme_put_free_req(q, req);
+    return ret;
+}
+
+static bool nvme_poll_queues(BDRVNVMeState *s)
+{
+    bool progress = false;
+    int i;
+
+    for (i = 0; i < NVME_NUM_QUEUES; i++) {
+        NVMeQueuePair *q = s->queues[i];
+        NvmeCqe *c;
+
+        if (!q) {
+            continue;
+        }
+        /* Peek at the phase bit first, this is the common case */
+        c = (NvmeCqe *)&q->cq.queue[q->cq.head * NVME_CQ_ENTRY_BYTES];
+        if ((le16_to_cpu(c->status) & 0x1) == q->cq_phase) {
+            continue;
+        }
+        progress |= nvme_process_completion(s, q);
+    }
+    return progress;
+}
+
+static void nvme_handle_event(EventNotifier *n)
+{
+    BDRVNVMeState *s = container_of(n, BDRVNVMeState, irq_notifier);
+
+    event_notifier_test_and_clear(n);
+    nvme_poll_queues(s);
+}
+
+static bool nvme_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    BDRVNVMeState *s = container_of(e, BDRVNVMeState, irq_notifier);
+
+    return nvme_poll_queues(s);
+}
+
+static int nvme_identify(BDRVNVMeState *s, int namespace, Error **errp)
+{
+    NvmeIdCtrl *idctrl;
+    NvmeIdNs *idns;
+    NvmeLBAF *lbaf;
+    uint8_t *id;
+    uint64_t iova;
+    uint64_t cap = le64_to_cpu(s->regs->cap);
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_IDENTIFY,
+        .cdw10 = cpu_to_le32(NVME_ID_CNS_CTRL),
+    };
+    size_t id_size = ROUND_UP(sizeof(NvmeIdCtrl), s->page_size);
+    int r = -EIO;
+
+    id = qemu_try_memalign(s->page_size, id_size);
+    if (!id) {
+        error_setg(errp, "Cannot allocate buffer for identify response");
+        return -ENOMEM;
+    }
+    idctrl = (NvmeIdCtrl *)id;
+    idns = (NvmeIdNs *)id;
+    if (qemu_vfio_dma_map(s->vfio, id, id_size, true, &iova)) {
+        error_setg(errp, "Cannot map buffer for DMA");
+        goto out;
+    }
+    cmd.prp1 = cpu_to_le64(iova);
+
+    memset(id, 0, sizeof(NvmeIdCtrl));
+    if (nvme_cmd_sync(s, s->queues[INDEX_ADMIN], &cmd)) {
+        error_setg(errp, "Failed to identify controller");
+        goto out;
+    }
+    if (le32_to_cpu(idctrl->nn) < namespace) {
+        error_setg(errp, "Invalid namespace");
+        goto out;
+    }
+    s->write_cache = idctrl->vwc & 0x1;
+    s->max_transfer = (s->page_size / sizeof(uint64_t) - 1) * s->page_size;
+    if (idctrl->mdts) {
+        /* In units of the minimum memory page size */
+        uint64_t mdts = (1ULL << idctrl->mdts) << (12 + NVME_CAP_MPSMIN(cap));
+
+        s->max_transfer = MIN(s->max_transfer, mdts);
+    }
+
+    memset(id, 0, sizeof(NvmeIdNs));
+    cmd.cdw10 = cpu_to_le32(NVME_ID_CNS_NS);
+    cmd.nsid = cpu_to_le32(namespace);
+    if (nvme_cmd_sync(s, s->queues[INDEX_ADMIN], &cmd)) {
+        error_setg(errp, "Failed to identify namespace");
+        goto out;
+    }
+
+    s->nsze = le64_to_cpu(idns->nsze);
+    lbaf = &idns->lbaf[NVME_ID_NS_FLBAS_INDEX(idns->flbas)];
+    if (lbaf->ms) {
+        error_setg(errp, "Namespaces with metadata are not yet supported");
+        goto out;
+    }
+    if (lbaf->ds < BDRV_SECTOR_BITS || lbaf->ds > 12 ||
+        (1 << lbaf->ds) > s->page_size) {
+        error_setg(errp, "Namespace has unsupported block size (2^%d)",
+                   lbaf->ds);
+        goto out;
+    }
+    s->blkshift = lbaf->ds;
+    r = 0;
+
+out:
+    qemu_vfio_dma_reset_temporary(s->vfio);
+    qemu_vfree(id);
+    return r;
+}
+
+static int nvme_add_io_queue(BDRVNVMeState *s, Error **errp)
+{
+    NVMeQueuePair *q;
+    NvmeCmd cmd;
+    int queue_size = s->queue_size;
+
+    q = nvme_create_queue_pair(s, INDEX_IO, errp);
+    if (!q) {
+        return -EIO;
+    }
+
+    /* Physically contiguous, interrupts enabled on vector 0 */
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_CREATE_CQ,
+        .prp1 = cpu_to_le64(q->cq.iova),
+        .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | INDEX_IO),
+        .cdw11 = cpu_to_le32(0x3),
+    };
+    if (nvme_cmd_sync(s, s->queues[INDEX_ADMIN], &cmd)) {
+        error_setg(errp, "Failed to create I/O completion queue");
+        goto fail;
+    }
+
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_CREATE_SQ,
+        .prp1 = cpu_to_le64(q->sq.iova),
+        .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | INDEX_IO),
+        .cdw11 = cpu_to_le32((INDEX_IO << 16) | 0x1),
+    };
+    if (nvme_cmd_sync(s, s->queues[INDEX_ADMIN], &cmd)) {
+        error_setg(errp, "Failed to create I/O submission queue");
+        goto fail;
+    }
+
+    s->queues[INDEX_IO] = q;
+    return 0;
+
+fail:
+    nvme_free_queue_pair(s, q);
+    return -EIO;
+}
+
+static void nvme_ram_block_added(RAMBlockNotifier *n, void *host,
+                                 size_t size)
+{
+    BDRVNVMeState *s = container_of(n, BDRVNVMeState, ram_notifier);
+    uint64_t iova;
+    int r;
+
+    r = qemu_vfio_dma_map(s->vfio, host, size, false, &iova);
+    if (r) {
+        /* Not fatal, requests to this memory use temporary mappings */
+        error_report("nvme: cannot map guest RAM for DMA: %s",
+                     strerror(-r));
+    }
+}
+
+static void nvme_ram_block_removed(RAMBlockNotifier *n, void *host,
+                                   size_t size)
+{
+    BDRVNVMeState *s = container_of(n, BDRVNVMeState, ram_notifier);
+
+    qemu_vfio_dma_unmap(s->vfio, host);
+}
+
+/* Wait for the controller to reach @ready, or time out after @timeout_ms */
+static int nvme_wait_ready(BDRVNVMeState *s, bool ready, int timeout_ms)
+{
+    int64_t deadline = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + timeout_ms;
+
+    while (NVME_CSTS_RDY(le32_to_cpu(s->regs->csts)) != ready) {
+        if (qemu_clock_get_ms(QEMU_CLOCK_REALTIME) > deadline) {
+            return -ETIMEDOUT;
+        }
+        g_usleep(1000);
+    }
+    return 0;
+}
+
+static void nvme_shutdown(BDRVNVMeState *s)
+{
+    int64_t deadline = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + 5000;
+    uint32_t cc = le32_to_cpu(s->regs->cc);
+
+    if (!NVME_CC_EN(cc)) {
+        return;
+    }
+
+    /* Normal shutdown, so that the volatile write cache is written back */
+    cc = (cc & ~(CC_SHN_MASK << CC_SHN_SHIFT)) | (1 << CC_SHN_SHIFT);
+    s->regs->cc = cpu_to_le32(cc);
+    while ((le32_to_cpu(s->regs->csts) & (CSTS_SHST_MASK << CSTS_SHST_SHIFT))
+           != NVME_CSTS_SHST_COMPLETE) {
+        if (qemu_clock_get_ms(QEMU_CLOCK_REALTIME) > deadline) {
+            error_report("nvme: timeout waiting for controller shutdown");
+            break;
+        }
+        g_usleep(1000);
+    }
+}
+
+static void nvme_cleanup(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int i;
+
+    if (s->ram_notifier_registered) {
+        ram_block_notifier_remove(&s->ram_notifier);
+    }
+    if (s->regs) {
+        nvme_shutdown(s);
+    }
+    for (i = 0; i < NVME_NUM_QUEUES; i++) {
+        if (s->queues[i]) {
+            nvme_free_queue_pair(s, s->queues[i]);
+            s->queues[i] = NULL;
+        }
+    }
+    if (s->irq_notifier_ready) {
+        aio_set_event_notifier(s->aio_context, &s->irq_notifier, false,
+                               NULL);
+        event_notifier_cleanup(&s->irq_notifier);
+    }
+    if (s->vfio) {
+        qemu_vfio_pci_unmap_bar(s->vfio, 0, (void *)s->doorbells,
+                                NVME_DOORBELL_OFFSET, s->doorbell_size);
+        qemu_vfio_pci_unmap_bar(s->vfio, 0, (void *)s->regs, 0,
+                                s->page_size);
+        qemu_vfio_close(s->vfio);
+    }
+}
+
+static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
+                     Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    uint64_t cap;
+    int page_shift = ctz32(getpagesize());
+    int timeout_ms, ret;
+
+    s->nsid = namespace;
+    s->page_size = getpagesize();
+    s->aio_context = bdrv_get_aio_context(bs);
+    qemu_co_queue_init(&s->dma_flush_queue);
+
+    s->vfio = qemu_vfio_open_pci(device, errp);
+    if (!s->vfio) {
+        return -EINVAL;
+    }
+
+    s->regs = qemu_vfio_pci_map_bar(s->vfio, 0, 0, s->page_size, errp);
+    if (!s->regs) {
+        return -EINVAL;
+    }
+
+    /* Only the NVM command set and the host page size are supported */
+    cap = le64_to_cpu(s->regs->cap);
+    if (!(NVME_CAP_CSS(cap) & 1)) {
+        error_setg(errp, "Device doesn't support NVMe command set");
+        return -EINVAL;
+    }
+    if (page_shift < 12 + NVME_CAP_MPSMIN(cap) ||
+        page_shift > 12 + NVME_CAP_MPSMAX(cap)) {
+        error_setg(errp, "Device doesn't support the host page size");
+        return -EINVAL;
+    }
+    s->queue_size = MIN(NVME_QUEUE_SIZE, NVME_CAP_MQES(cap) + 1);
+    s->doorbell_scale = (4 << NVME_CAP_DSTRD(cap)) / sizeof(uint32_t);
+    timeout_ms = MIN(500 * NVME_CAP_TO(cap), 30000);
+
+    s->doorbell_size = ROUND_UP(NVME_NUM_QUEUES * 2 *
+                                (4 << NVME_CAP_DSTRD(cap)), s->page_size);
+    s->doorbells = qemu_vfio_pci_map_bar(s->vfio, 0, NVME_DOORBELL_OFFSET,
+                                         s->doorbell_size, errp);
+    if (!s->doorbells) {
+        return -EINVAL;
+    }
+
+    /* Reset the controller */
+    s->regs->cc = cpu_to_le32(le32_to_cpu(s->regs->cc) &
+                              ~(CC_EN_MASK << CC_EN_SHIFT));
+    if (nvme_wait_ready(s, false, timeout_ms) < 0) {
+        error_setg(errp, "Timeout while waiting for device to reset (%d ms)",
+                   timeout_ms);
+        return -ETIMEDOUT;
+    }
+
+    s->queues[INDEX_ADMIN] = nvme_create_queue_pair(s, INDEX_ADMIN, errp);
+    if (!s->queues[INDEX_ADMIN]) {
+        return -EINVAL;
+    }
+    s->regs->aqa = cpu_to_le32(((s->queue_size - 1) << AQA_ACQS_SHIFT) |
+                               ((s->queue_size - 1) << AQA_ASQS_SHIFT));
+    s->regs->asq = cpu_to_le64(s->queues[INDEX_ADMIN]->sq.iova);
+    s->regs->acq = cpu_to_le64(s->queues[INDEX_ADMIN]->cq.iova);
+
+    /* After setting up the admin queue, enable the controller */
+    s->regs->cc = cpu_to_le32((ctz32(NVME_CQ_ENTRY_BYTES) << CC_IOCQES_SHIFT) |
+                              (ctz32(NVME_SQ_ENTRY_BYTES) << CC_IOSQES_SHIFT) |
+                              ((page_shift - 12) << CC_MPS_SHIFT) |
+                              (1 << CC_EN_SHIFT));
+    if (nvme_wait_ready(s, true, timeout_ms) < 0) {
+        error_setg(errp, "Timeout while waiting for device to start (%d ms)",
+                   timeout_ms);
+        return -ETIMEDOUT;
+    }
+    if (NVME_CSTS_CFS(le32_to_cpu(s->regs->csts))) {
+        error_setg(errp, "Controller reported a fatal error");
+        return -EIO;
+    }
+
+    ret = event_notifier_init(&s->irq_notifier, 0);
+    if (ret) {
+        error_setg_errno(errp, -ret, "Failed to init event notifier");
+        return ret;
+    }
+    s->irq_notifier_ready = true;
+    ret = qemu_vfio_pci_init_irq(s->vfio, &s->irq_notifier,
+                                 VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    if (ret) {
+        return ret;
+    }
+    aio_set_event_notifier(s->aio_context, &s->irq_notifier, false,
+                           nvme_handle_event);
+    aio_set_event_notifier_poll(s->aio_context, &s->irq_notifier,
+                                nvme_poll_cb);
+
+    ret = nvme_identify(s, namespace, errp);
+    if (ret) {
+        return ret;
+    }
+
+    ret = nvme_add_io_queue(s, errp);
+    if (ret) {
+        return ret;
+    }
+
+    s->ram_notifier.ram_block_added = nvme_ram_block_added;
+    s->ram_notifier.ram_block_removed = nvme_ram_block_removed;
+    ram_block_notifier_add(&s->ram_notifier);
+    s->ram_notifier_registered = true;
+
+    bs->request_alignment = 1 << s->blkshift;
+    return 0;
+}
+
+/* Parse a filename in the format of nvme://XXXX:XX:XX.X/X */
+static void nvme_parse_filename(const char *filename, QDict *options,
+                                Error **errp)
+{
+    const char *tmp, *slash, *namespace;
+    char *device;
+    unsigned long ns;
+
+    if (!strstart(filename, "nvme://", &tmp)) {
+        error_setg(errp, "File name string for NVMe must start with "
+                   "'nvme://'");
+        return;
+    }
+
+    slash = strchr(tmp, '/');
+    if (!slash) {
+        qdict_put(options, NVME_BLOCK_OPT_DEVICE, qstring_from_str(tmp));
+        return;
+    }
+
+    device = g_strndup(tmp, slash - tmp);
+    qdict_put(options, NVME_BLOCK_OPT_DEVICE, qstring_from_str(device));
+    g_free(device);
+
+    namespace = slash + 1;
+    if (*namespace && (qemu_strtoul(namespace, NULL, 10, &ns) || !ns)) {
+        error_setg(errp, "Invalid namespace '%s', positive number expected",
+                   namespace);
+        return;
+    }
+    qdict_put(options, NVME_BLOCK_OPT_NAMESPACE,
+              qstring_from_str(*namespace ? namespace : "1"));
+}
+
+static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    const char *device;
+    QemuOpts *opts;
+    int namespace;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &error_abort);
+    device = qemu_opt_get(opts, NVME_BLOCK_OPT_DEVICE);
+    if (!device) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_DEVICE "' option is required");
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+
+    namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
+    ret = nvme_init(bs, device, namespace, errp);
+    qemu_opts_del(opts);
+    if (ret) {
+        nvme_cleanup(bs);
+    }
+    return ret;
+}
+
+static void nvme_close(BlockDriverState *bs)
+{
+    nvme_cleanup(bs);
+}
+
+static int64_t nvme_getlength(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    return s->nsze << s->blkshift;
+}
+
+/*
+ * The PRP list of a command describes its buffer page by page, so all the
+ * iovec elements but the first must start on a page boundary, and all but
+ * the last must end on one.
+ */
+static bool nvme_qiov_aligned(BDRVNVMeState *s, const QEMUIOVector *qiov)
+{
+    int i;
+
+    for (i = 0; i < qiov->niov; i++) {
+        uintptr_t start = (uintptr_t)qiov->iov[i].iov_base;
+        uintptr_t end = start + qiov->iov[i].iov_len;
+
+        if ((start & 3) ||
+            (i > 0 && (start & (s->page_size - 1))) ||
+            (i < qiov->niov - 1 && (end & (s->page_size - 1)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static coroutine_fn int nvme_cmd_map_qiov(BDRVNVMeState *s, NvmeCmd *cmd,
+                                          NVMeRequest *req,
+                                          QEMUIOVector *qiov)
+{
+    uint64_t *pagelist = req->prp_list_page;
+    int max_entries = s->page_size / sizeof(uint64_t);
+    bool retry = true;
+    int i, entries, r;
+
+try_map:
+    entries = 0;
+    for (i = 0; i < qiov->niov; i++) {
+        uintptr_t base = (uintptr_t)qiov->iov[i].iov_base;
+        size_t len = qiov->iov[i].iov_len;
+        uintptr_t page = base & ~(s->page_size - 1);
+        uint64_t iova;
+
+        r = qemu_vfio_dma_map(s->vfio, (void *)page,
+                              ROUND_UP(base + len - page, s->page_size),
+                              true, &iova);
+        if (r == -ENOMEM && retry) {
+            /*
+             * The IOVA space is full of temporary mappings.  Wait for the
+             * requests that use them, then start over.
+             */
+            retry = false;
+            if (s->dma_map_count) {
+                trace_nvme_dma_flush_queue_wait(s);
+                qemu_co_queue_wait(&s->dma_flush_queue);
+            } else {
+                qemu_vfio_dma_reset_temporary(s->vfio);
+            }
+            goto try_map;
+        }
+        if (r) {
+            return r;
+        }
+
+        iova += base - page;
+        while (len > 0) {
+            size_t chunk = MIN(len, s->page_size - (iova & (s->page_size - 1)));
+
+            if (entries == max_entries) {
+                return -EINVAL;
+            }
+            pagelist[entries++] = cpu_to_le64(iova);
+            iova += chunk;
+            len -= chunk;
+        }
+    }
+
+    /* The first entry goes in prp1, the list in prp2 holds the others */
+    cmd->prp1 = pagelist[0];
+    if (entries == 1) {
+        cmd->prp2 = 0;
+    } else if (entries == 2) {
+        cmd->prp2 = pagelist[1];
+    } else {
+        cmd->prp2 = cpu_to_le64(req->prp_list_iova + sizeof(uint64_t));
+    }
+    s->dma_map_count++;
+    return 0;
+}
+
+static coroutine_fn void nvme_dma_map_done(BDRVNVMeState *s)
+{
+    if (--s->dma_map_count == 0 &&
+        !qemu_co_queue_empty(&s->dma_flush_queue)) {
+        qemu_vfio_dma_reset_temporary(s->vfio);
+        qemu_co_queue_restart_all(&s->dma_flush_queue);
+    }
+}
+
+static void nvme_co_cb(void *opaque, int ret)
+{
+    NVMeCoData *data = opaque;
+
+    data->ret = ret;
+    qemu_coroutine_enter(data->co, NULL);
+}
+
+/* Submit @cmd on the I/O queue and wait for its completion */
+static coroutine_fn int nvme_co_cmd(BDRVNVMeState *s, NvmeCmd *cmd,
+                                    QEMUIOVector *qiov)
+{
+    NVMeQueuePair *ioq = s->queues[INDEX_IO];
+    NVMeRequest *req;
+    NVMeCoData data = {
+        .co = qemu_coroutine_self(),
+        .ret = -EINPROGRESS,
+    };
+    int r;
+
+    req = nvme_get_free_req(ioq);
+    if (qiov) {
+        r = nvme_cmd_map_qiov(s, cmd, req, qiov);
+        if (r) {
+            nvme_put_free_req(ioq, req);
+            qemu_co_queue_next(&ioq->free_req_queue);
+            return r;
+        }
+    }
+    nvme_submit_command(s, ioq, req, cmd, nvme_co_cb, &data);
+
+    while (data.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+
+    nvme_put_free_req(ioq, req);
+    qemu_co_queue_next(&ioq->free_req_queue);
+    if (qiov) {
+        nvme_dma_map_done(s);
+    }
+    return data.ret;
+}
+
+static coroutine_fn int nvme_co_prw_aligned(BDRVNVMeState *s,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov,
+                                            bool is_write)
+{
+    uint64_t lba = offset >> s->blkshift;
+    NvmeCmd cmd = {
+        .opcode = is_write ? NVME_CMD_WRITE : NVME_CMD_READ,
+        .nsid = cpu_to_le32(s->nsid),
+        .cdw10 = cpu_to_le32(lba & 0xffffffff),
+        .cdw11 = cpu_to_le32(lba >> 32),
+        .cdw12 = cpu_to_le32(((bytes >> s->blkshift) - 1) & 0xffff),
+    };
+
+    trace_nvme_prw_aligned(s, is_write, offset, bytes, qiov->niov);
+    return nvme_co_cmd(s, &cmd, qiov);
+}
+
+/* Transfer at most s->max_transfer bytes, bouncing unaligned buffers */
+static coroutine_fn int nvme_co_prw_one(BlockDriverState *bs,
+                                        uint64_t offset, uint64_t bytes,
+                                        QEMUIOVector *qiov, bool is_write)
+{
+    BDRVNVMeState *s = bs->opaque;
+    QEMUIOVector local_qiov;
+    uint8_t *buf;
+    int r;
+
+    if (nvme_qiov_aligned(s, qiov)) {
+        return nvme_co_prw_aligned(s, offset, bytes, qiov, is_write);
+    }
+
+    trace_nvme_prw_buffered(s, offset, bytes, qiov->niov, is_write);
+    buf = qemu_try_memalign(s->page_size, bytes);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    qemu_iovec_init(&local_qiov, 1);
+    if (is_write) {
+        qemu_iovec_to_buf(qiov, 0, buf, bytes);
+    }
+    qemu_iovec_add(&local_qiov, buf, bytes);
+    r = nvme_co_prw_aligned(s, offset, bytes, &local_qiov, is_write);
+    qemu_iovec_destroy(&local_qiov);
+    if (!r && !is_write) {
+        qemu_iovec_from_buf(qiov, 0, buf, bytes);
+    }
+    qemu_vfree(buf);
+    return r;
+}
+
+static coroutine_fn int nvme_co_prw(BlockDriverState *bs,
+                                    int64_t sector_num, int nb_sectors,
+                                    QEMUIOVector *qiov, bool is_write)
+{
+    BDRVNVMeState *s = bs->opaque;
+    uint64_t offset = sector_num << BDRV_SECTOR_BITS;
+    uint64_t bytes = (uint64_t)nb_sectors << BDRV_SECTOR_BITS;
+    QEMUIOVector local_qiov;
+    uint64_t done = 0;
+    int r = 0;
+
+    if (bytes <= s->max_transfer) {
+        return nvme_co_prw_one(bs, offset, bytes, qiov, is_write);
+    }
+
+    /* The block layer does not split requests for us */
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    while (done < bytes && !r) {
+        uint64_t len = MIN(bytes - done, s->max_transfer);
+
+        qemu_iovec_reset(&local_qiov);
+        qemu_iovec_concat(&local_qiov, qiov, done, len);
+        r = nvme_co_prw_one(bs, offset + done, len, &local_qiov, is_write);
+        done += len;
+    }
+    qemu_iovec_destroy(&local_qiov);
+    return r;
+}
+
+static coroutine_fn int nvme_co_readv(BlockDriverState *bs,
+                                      int64_t sector_num, int nb_sectors,
+                                      QEMUIOVector *qiov)
+{
+    return nvme_co_prw(bs, sector_num, nb_sectors, qiov, false);
+}
+
+static coroutine_fn int nvme_co_writev(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
+{
+    return nvme_co_prw(bs, sector_num, nb_sectors, qiov, true);
+}
+
+static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NvmeCmd cmd = {
+        .opcode = NVME_CMD_FLUSH,
+        .nsid = cpu_to_le32(s->nsid),
+    };
+
+    if (!s->write_cache) {
+        return 0;
+    }
+    return nvme_co_cmd(s, &cmd, NULL);
+}
+
+static int nvme_reopen_prepare(BDRVReopenState *reopen_state,
+                               BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static void nvme_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    bs->bl.min_mem_alignment = s->page_size;
+    bs->bl.opt_mem_alignment = s->page_size;
+    bs->bl.max_transfer_length = s->max_transfer >> BDRV_SECTOR_BITS;
+}
+
+static void nvme_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    aio_set_event_notifier(s->aio_context, &s->irq_notifier, false, NULL);
+}
+
+static void nvme_attach_aio_context(BlockDriverState *bs,
+                                    AioContext *new_context)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    s->aio_context = new_context;
+    aio_set_event_notifier(new_context, &s->irq_notifier, false,
+                           nvme_handle_event);
+    aio_set_event_notifier_poll(new_context, &s->irq_notifier,
+                                nvme_poll_cb);
+}
+
+static void nvme_io_plug(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    s->plugged++;
+}
+
+static void nvme_io_unplug(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int i;
+
+    assert(s->plugged);
+    if (--s->plugged) {
+        return;
+    }
+    for (i = 0; i < NVME_NUM_QUEUES; i++) {
+        NVMeQueuePair *q = s->queues[i];
+
+        nvme_kick(s, q);
+        nvme_process_completion(s, q);
+    }
+}
+
+static BlockDriver bdrv_nvme = {
+    .format_name              = "nvme",
+    .protocol_name            = "nvme",
+    .instance_size            = sizeof(BDRVNVMeState),
+
+    .bdrv_parse_filename      = nvme_parse_filename,
+    .bdrv_file_open           = nvme_file_open,
+    .bdrv_close               = nvme_close,
+    .bdrv_getlength           = nvme_getlength,
+
+    .bdrv_co_readv            = nvme_co_readv,
+    .bdrv_co_writev           = nvme_co_writev,
+    .bdrv_co_flush_to_disk    = nvme_co_flush,
+    .bdrv_reopen_prepare      = nvme_reopen_prepare,
+
+    .bdrv_refresh_limits      = nvme_refresh_limits,
+
+    .bdrv_detach_aio_context  = nvme_detach_aio_context,
+    .bdrv_attach_aio_context  = nvme_attach_aio_context,
+
+    .bdrv_io_plug             = nvme_io_plug,
+    .bdrv_io_unplug           = nvme_io_unplug,
+};
+
+static void bdrv_nvme_init(void)
+{
+    bdrv_register(&bdrv_nvme);
+}
+
+block_init(bdrv_nvme_init);
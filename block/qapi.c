@@ -67,6 +67,7 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs, Error **errp)
 
     if (bs->throttle_state) {
         ThrottleConfig cfg;
+        ThrottleGroupMemberConfig member_cfg;
 
         throttle_group_get_config(bs, &cfg);
 
@@ -117,6 +118,14 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs, Error **errp)
 
         info->has_group = true;
         info->group = g_strdup(throttle_group_get_name(bs));
+
+        throttle_group_get_member_config(bs, &member_cfg);
+        info->has_weight         = true;
+        info->weight             = member_cfg.weight;
+        info->has_latency_target = true;
+        info->latency_target     = member_cfg.latency_target;
+        info->has_burst_credit   = true;
+        info->burst_credit       = member_cfg.burst_credit;
     }
 
     info->write_threshold = bdrv_write_threshold_get(bs);
@@ -359,10 +368,39 @@ static BlockStats *bdrv_query_stats(BlockBackend *blk,
                                     const BlockDriverState *bs,
                                     bool query_backing);
 
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_info(BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info;
+    uint64List **boundaries, **bins;
+    int i;
+
+    if (!hist->bins) {
+        return NULL;
+    }
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    boundaries = &info->boundaries;
+    bins = &info->bins;
+    for (i = 0; i < hist->nbins; i++) {
+        if (i < hist->nbins - 1) {
+            *boundaries = g_new0(uint64List, 1);
+            (*boundaries)->value = hist->boundaries[i];
+            boundaries = &(*boundaries)->next;
+        }
+        *bins = g_new0(uint64List, 1);
+        (*bins)->value = hist->bins[i];
+        bins = &(*bins)->next;
+    }
+
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockStats *s, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
     BlockAcctTimedStats *ts = NULL;
+    BlockLatencyHistogram *hist;
 
     s->has_device = true;
     s->device = g_strdup(blk_name(blk));
@@ -396,6 +434,18 @@ static void bdrv_query_blk_stats(BlockStats *s, BlockBackend *blk)
     s->stats->account_invalid = stats->account_invalid;
     s->stats->account_failed = stats->account_failed;
 
+    hist = stats->latency_histogram;
+    s->stats->rd_latency_histogram =
+        bdrv_latency_histogram_info(&hist[BLOCK_ACCT_READ]);
+    s->stats->has_rd_latency_histogram = !!s->stats->rd_latency_histogram;
+    s->stats->wr_latency_histogram =
+        bdrv_latency_histogram_info(&hist[BLOCK_ACCT_WRITE]);
+    s->stats->has_wr_latency_histogram = !!s->stats->wr_latency_histogram;
+    s->stats->flush_latency_histogram =
+        bdrv_latency_histogram_info(&hist[BLOCK_ACCT_FLUSH]);
+    s->stats->has_flush_latency_histogram =
+        !!s->stats->flush_latency_histogram;
+
     while ((ts = block_acct_interval_next(stats, ts))) {
         BlockDeviceTimedStatsList *timed_stats =
             g_malloc0(sizeof(*timed_stats));
@@ -439,6 +489,13 @@ static void bdrv_query_bds_stats(BlockStats *s, const BlockDriverState *bs,
 
     s->stats->wr_highest_offset = bs->wr_highest_offset;
 
+    s->stats->has_bounce = true;
+    s->stats->bounce = g_memdup(&bs->bounce_stats, sizeof(BlockBounceStats));
+
+    if (bs->drv && bs->drv->bdrv_get_cache_stats) {
+        bs->drv->bdrv_get_cache_stats((BlockDriverState *)bs, s->stats);
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(NULL, bs->file->bs, query_backing);
@@ -0,0 +1,1020 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "qemu/error-report.h"
+#include "trace.h"
+
+/* Limits, see docs/specs/qcow2.txt */
+#define BME_MAX_TABLE_SIZE              0x8000000
+#define BME_MAX_PHYS_SIZE               0x20000000 /* restrict BdrvDirtyBitmap
+                                                    * size in RAM */
+#define BME_MAX_GRANULARITY_BITS        31
+#define BME_MIN_GRANULARITY_BITS        9
+#define BME_MAX_NAME_SIZE               1023
+
+/* Bitmap directory entry flags */
+#define BME_RESERVED_FLAGS              0xfffffff8U
+#define BME_FLAG_IN_USE                 (1U << 0)
+#define BME_FLAG_AUTO                   (1U << 1)
+#define BME_FLAG_EXTRA_DATA_COMPATIBLE  (1U << 2)
+
+/* Bitmap table entries */
+#define BME_TABLE_ENTRY_RESERVED_MASK   0xff000000000001feULL
+#define BME_TABLE_ENTRY_FLAG_ALL_ONES   (1ULL << 0)
+
+/* Bitmap types */
+#define BT_DIRTY_TRACKING_BITMAP        1
+
+typedef struct QEMU_PACKED Qcow2BitmapDirEntry {
+    /* header is 8 byte aligned */
+    uint64_t bitmap_table_offset;
+
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* extra data follows */
+    /* name follows */
+} Qcow2BitmapDirEntry;
+
+static inline uint64_t dir_entry_size(size_t name_size,
+                                      size_t extra_data_size)
+{
+    return align_offset(sizeof(Qcow2BitmapDirEntry) +
+                        name_size + extra_data_size, 8);
+}
+
+/* Number of sectors covered by one cluster of bitmap data */
+static uint64_t sectors_covered_by_bitmap_cluster(BDRVQcow2State *s,
+                                                  int granularity_bits)
+{
+    return ((uint64_t)s->cluster_size * 8) <<
+           (granularity_bits - BDRV_SECTOR_BITS);
+}
+
+static uint64_t bitmap_table_size(BDRVQcow2State *s, int64_t nb_sectors,
+                                  int granularity_bits)
+{
+    return DIV_ROUND_UP(nb_sectors,
+                        sectors_covered_by_bitmap_cluster(s,
+                                                          granularity_bits));
+}
+
+static void free_bitmap_list(Qcow2BitmapList *bm_list)
+{
+    Qcow2Bitmap *bm, *next;
+
+    QTAILQ_FOREACH_SAFE(bm, bm_list, next, next) {
+        QTAILQ_REMOVE(bm_list, bm, next);
+        g_free(bm->name);
+        g_free(bm->extra_data);
+        g_free(bm);
+    }
+}
+
+static Qcow2Bitmap *copy_bitmap(const Qcow2Bitmap *bm)
+{
+    Qcow2Bitmap *copy = g_memdup(bm, sizeof(*bm));
+
+    copy->name = g_strdup(bm->name);
+    copy->extra_data = g_memdup(bm->extra_data, bm->extra_data_size);
+    return copy;
+}
+
+static Qcow2Bitmap *find_bitmap_by_name(Qcow2BitmapList *bm_list,
+                                        const char *name)
+{
+    Qcow2Bitmap *bm;
+
+    QTAILQ_FOREACH(bm, bm_list, next) {
+        if (!strcmp(bm->name, name)) {
+            return bm;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Bitmaps of an unknown type or with unknown flags or extra data are not
+ * loaded, but must be kept in the image as they are.
+ */
+static bool bitmap_is_foreign(const Qcow2Bitmap *bm)
+{
+    return bm->type != BT_DIRTY_TRACKING_BITMAP ||
+           (bm->flags & BME_RESERVED_FLAGS) ||
+           (bm->extra_data_size != 0 &&
+            !(bm->flags & BME_FLAG_EXTRA_DATA_COMPATIBLE));
+}
+
+void qcow2_free_bitmap_directory(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    free_bitmap_list(&s->bitmaps);
+}
+
+/*
+ * Reads the bitmap table of @bm into a newly allocated array in host byte
+ * order, and checks that its entries are valid.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+int qcow2_read_bitmap_table(BlockDriverState *bs, const Qcow2Bitmap *bm,
+                            uint64_t **bitmap_table)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *table;
+    uint32_t i;
+    int ret;
+
+    assert(bm->table_size != 0 && bm->table_size <= BME_MAX_TABLE_SIZE);
+
+    table = g_try_new(uint64_t, bm->table_size);
+    if (table == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file->bs, bm->table_offset, table,
+                     bm->table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < bm->table_size; i++) {
+        uint64_t entry = be64_to_cpu(table[i]);
+        uint64_t offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        /* An all-ones entry has no cluster; the offset of a data cluster must
+         * be cluster aligned */
+        if ((entry & BME_TABLE_ENTRY_RESERVED_MASK) ||
+            offset_into_cluster(s, offset) ||
+            (offset && (entry & BME_TABLE_ENTRY_FLAG_ALL_ONES))) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        table[i] = entry;
+    }
+
+    *bitmap_table = table;
+    return 0;
+
+fail:
+    g_free(table);
+    return ret;
+}
+
+static void free_bitmap_clusters(BlockDriverState *bs, const Qcow2Bitmap *bm,
+                                 const uint64_t *table)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t i;
+
+    for (i = 0; i < bm->table_size; i++) {
+        uint64_t offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (offset) {
+            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    qcow2_free_clusters(bs, bm->table_offset,
+                        bm->table_size * sizeof(uint64_t),
+                        QCOW2_DISCARD_OTHER);
+}
+
+/* Frees the data clusters and the table of a stored bitmap */
+static void free_stored_bitmap(BlockDriverState *bs, const Qcow2Bitmap *bm)
+{
+    uint64_t *table;
+    int ret;
+
+    ret = qcow2_read_bitmap_table(bs, bm, &table);
+    if (ret < 0) {
+        /* Leaks the data clusters, but that is harmless */
+        error_report("Could not read the table of bitmap '%s': %s",
+                     bm->name, strerror(-ret));
+        return;
+    }
+
+    free_bitmap_clusters(bs, bm, table);
+    g_free(table);
+}
+
+/*
+ * Reads the bitmap directory described by the header extension into
+ * s->bitmaps.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+int qcow2_read_bitmap_directory(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *dir, *dir_end, *p;
+    uint32_t i;
+    int ret;
+
+    QTAILQ_INIT(&s->bitmaps);
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    dir = g_try_malloc(s->bitmap_directory_size);
+    if (dir == NULL) {
+        error_setg(errp, "Could not allocate the bitmap directory");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file->bs, s->bitmap_directory_offset, dir,
+                     s->bitmap_directory_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the bitmap directory");
+        goto fail;
+    }
+
+    p = dir;
+    dir_end = dir + s->bitmap_directory_size;
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2BitmapDirEntry e;
+        Qcow2Bitmap *bm;
+
+        if (dir_end - p < sizeof(e)) {
+            goto invalid;
+        }
+        memcpy(&e, p, sizeof(e));
+        be64_to_cpus(&e.bitmap_table_offset);
+        be32_to_cpus(&e.bitmap_table_size);
+        be32_to_cpus(&e.flags);
+        be16_to_cpus(&e.name_size);
+        be32_to_cpus(&e.extra_data_size);
+
+        if (e.name_size == 0 || e.name_size > BME_MAX_NAME_SIZE ||
+            dir_entry_size(e.name_size, e.extra_data_size) > dir_end - p ||
+            e.bitmap_table_size == 0 ||
+            e.bitmap_table_size > BME_MAX_TABLE_SIZE ||
+            offset_into_cluster(s, e.bitmap_table_offset) ||
+            e.bitmap_table_offset == 0)
+        {
+            goto invalid;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->name = g_strndup((char *)p + sizeof(e) + e.extra_data_size,
+                             e.name_size);
+        bm->table_offset = e.bitmap_table_offset;
+        bm->table_size = e.bitmap_table_size;
+        bm->flags = e.flags;
+        bm->type = e.type;
+        bm->granularity_bits = e.granularity_bits;
+        bm->extra_data_size = e.extra_data_size;
+        bm->extra_data = g_memdup(p + sizeof(e), e.extra_data_size);
+        QTAILQ_INSERT_TAIL(&s->bitmaps, bm, next);
+
+        p += dir_entry_size(e.name_size, e.extra_data_size);
+    }
+
+    g_free(dir);
+    return 0;
+
+invalid:
+    error_setg(errp, "Invalid bitmap directory");
+    ret = -EINVAL;
+fail:
+    free_bitmap_list(&s->bitmaps);
+    g_free(dir);
+    return ret;
+}
+
+/*
+ * Writes @bm_list as the new bitmap directory and points the image header to
+ * it.  On success, @bm_list becomes s->bitmaps and the old list is freed;
+ * the clusters used by bitmaps that are no longer in the directory must be
+ * freed by the caller.  On failure nothing changes.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+static int update_bitmap_directory(BlockDriverState *bs,
+                                   Qcow2BitmapList *bm_list)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Bitmap *bm;
+    uint64_t old_offset = s->bitmap_directory_offset;
+    uint64_t old_size = s->bitmap_directory_size;
+    uint32_t old_nb = s->nb_bitmaps;
+    uint64_t old_autoclear = s->autoclear_features;
+    int64_t dir_offset = 0;
+    uint64_t dir_size = 0;
+    uint32_t nb_bitmaps = 0;
+    bool in_use = true;
+    uint8_t *dir = NULL, *p;
+    int ret;
+
+    QTAILQ_FOREACH(bm, bm_list, next) {
+        dir_size += dir_entry_size(strlen(bm->name), bm->extra_data_size);
+        nb_bitmaps++;
+        if (!bitmap_is_foreign(bm)) {
+            in_use &= !!(bm->flags & BME_FLAG_IN_USE);
+        }
+    }
+
+    if (nb_bitmaps > QCOW2_MAX_BITMAPS ||
+        dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        return -EFBIG;
+    }
+
+    if (nb_bitmaps > 0) {
+        dir = g_try_malloc0(dir_size);
+        if (dir == NULL) {
+            return -ENOMEM;
+        }
+
+        p = dir;
+        QTAILQ_FOREACH(bm, bm_list, next) {
+            size_t name_size = strlen(bm->name);
+            Qcow2BitmapDirEntry e = {
+                .bitmap_table_offset = cpu_to_be64(bm->table_offset),
+                .bitmap_table_size = cpu_to_be32(bm->table_size),
+                .flags = cpu_to_be32(bm->flags),
+                .type = bm->type,
+                .granularity_bits = bm->granularity_bits,
+                .name_size = cpu_to_be16(name_size),
+                .extra_data_size = cpu_to_be32(bm->extra_data_size),
+            };
+
+            memcpy(p, &e, sizeof(e));
+            memcpy(p + sizeof(e), bm->extra_data, bm->extra_data_size);
+            memcpy(p + sizeof(e) + bm->extra_data_size, bm->name, name_size);
+            p += dir_entry_size(name_size, bm->extra_data_size);
+        }
+
+        dir_offset = qcow2_alloc_clusters(bs, dir_size);
+        if (dir_offset < 0) {
+            ret = dir_offset;
+            goto fail;
+        }
+
+        /* The directory position has not yet been updated, so these
+         * clusters must indeed be completely free */
+        ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file->bs, dir_offset, dir, dir_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* Bitmap data, tables and the directory, and their refcounts, must be
+     * stable on disk before the header points to them.  bdrv_flush(bs)
+     * cannot be used because the caller may hold s->lock. */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    s->nb_bitmaps = nb_bitmaps;
+    if (nb_bitmaps > 0) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret == 0) {
+        ret = bdrv_flush(bs->file->bs);
+    }
+    if (ret < 0) {
+        s->bitmap_directory_offset = old_offset;
+        s->bitmap_directory_size = old_size;
+        s->nb_bitmaps = old_nb;
+        s->autoclear_features = old_autoclear;
+        goto fail;
+    }
+
+    if (old_size > 0) {
+        qcow2_free_clusters(bs, old_offset, old_size, QCOW2_DISCARD_OTHER);
+    }
+
+    free_bitmap_list(&s->bitmaps);
+    while ((bm = QTAILQ_FIRST(bm_list)) != NULL) {
+        QTAILQ_REMOVE(bm_list, bm, next);
+        QTAILQ_INSERT_TAIL(&s->bitmaps, bm, next);
+    }
+    s->bitmaps_in_use = in_use;
+
+    g_free(dir);
+    return 0;
+
+fail:
+    if (dir_offset > 0) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+    }
+    g_free(dir);
+    return ret;
+}
+
+/*
+ * Loads the data of a stored bitmap into @bitmap.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+static int load_bitmap_data(BlockDriverState *bs, const Qcow2Bitmap *bm,
+                            BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t sectors_per_cluster =
+        sectors_covered_by_bitmap_cluster(s, bm->granularity_bits);
+    uint64_t nb_sectors = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t *table;
+    uint8_t *buf = NULL;
+    uint32_t i;
+    int ret;
+
+    ret = qcow2_read_bitmap_table(bs, bm, &table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    if (buf == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (i = 0; i < bm->table_size; i++) {
+        uint64_t start = i * sectors_per_cluster;
+        uint64_t count = MIN(nb_sectors - start, sectors_per_cluster);
+        uint64_t offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (offset) {
+            ret = bdrv_pread(bs->file->bs, offset, buf, s->cluster_size);
+            if (ret < 0) {
+                goto out;
+            }
+            bdrv_dirty_bitmap_deserialize_part(bitmap, buf, start, count,
+                                               false);
+        } else if (table[i] & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+            bdrv_dirty_bitmap_deserialize_ones(bitmap, start, count, false);
+        } else {
+            bdrv_dirty_bitmap_deserialize_zeroes(bitmap, start, count, false);
+        }
+    }
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+    ret = 0;
+
+out:
+    qemu_vfree(buf);
+    g_free(table);
+    return ret;
+}
+
+/* Returns why a stored bitmap cannot be loaded, or NULL if it can */
+static const char *bitmap_unusable_reason(BlockDriverState *bs,
+                                          const Qcow2Bitmap *bm)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (bm->flags & BME_FLAG_IN_USE) {
+        return "it was not stored correctly";
+    }
+    if (bm->granularity_bits < BME_MIN_GRANULARITY_BITS ||
+        bm->granularity_bits > BME_MAX_GRANULARITY_BITS) {
+        return "its granularity is invalid";
+    }
+    if (bm->table_size != bitmap_table_size(s, bs->total_sectors,
+                                            bm->granularity_bits)) {
+        return "its size does not match the image";
+    }
+    if (bdrv_find_dirty_bitmap(bs, bm->name)) {
+        return "its name is already taken";
+    }
+    return NULL;
+}
+
+/*
+ * Creates the in-memory dirty bitmaps for the bitmaps stored in the image.
+ * Bitmaps that are marked in use were not stored after their last change and
+ * are dropped.  If the image is writable, the loaded bitmaps are then marked
+ * in use, and the dropped ones are removed from the image.  Foreign bitmaps
+ * are left alone.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+int qcow2_load_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList kept = QTAILQ_HEAD_INITIALIZER(kept);
+    Qcow2BitmapList dropped = QTAILQ_HEAD_INITIALIZER(dropped);
+    Qcow2Bitmap *bm;
+    bool changed = false;
+    int ret;
+
+    if (QTAILQ_EMPTY(&s->bitmaps)) {
+        s->bitmaps_loaded = true;
+        return 0;
+    }
+
+    QTAILQ_FOREACH(bm, &s->bitmaps, next) {
+        const char *reason;
+        BdrvDirtyBitmap *bitmap;
+        Qcow2Bitmap *copy;
+
+        if (bitmap_is_foreign(bm)) {
+            QTAILQ_INSERT_TAIL(&kept, copy_bitmap(bm), next);
+            continue;
+        }
+
+        reason = bitmap_unusable_reason(bs, bm);
+        if (reason) {
+            error_report("Dropping persistent dirty bitmap '%s' because %s",
+                         bm->name, reason);
+            QTAILQ_INSERT_TAIL(&dropped, copy_bitmap(bm), next);
+            changed = true;
+            continue;
+        }
+
+        bitmap = bdrv_create_dirty_bitmap(bs, 1U << bm->granularity_bits,
+                                          bm->name, errp);
+        if (bitmap == NULL) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+        bdrv_dirty_bitmap_set_persistance(bitmap, true);
+
+        ret = load_bitmap_data(bs, bm, bitmap);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not load bitmap '%s'",
+                             bm->name);
+            goto fail;
+        }
+        if (!(bm->flags & BME_FLAG_AUTO)) {
+            bdrv_disable_dirty_bitmap(bitmap);
+        }
+
+        copy = copy_bitmap(bm);
+        copy->flags |= BME_FLAG_IN_USE;
+        QTAILQ_INSERT_TAIL(&kept, copy, next);
+        changed = true;
+    }
+
+    if (changed && !bs->read_only && !(s->flags & BDRV_O_INACTIVE)) {
+        ret = update_bitmap_directory(bs, &kept);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not mark bitmaps in use");
+            goto fail;
+        }
+        QTAILQ_FOREACH(bm, &dropped, next) {
+            free_stored_bitmap(bs, bm);
+        }
+    }
+
+    s->bitmaps_loaded = true;
+    free_bitmap_list(&kept);
+    free_bitmap_list(&dropped);
+    return 0;
+
+fail:
+    qcow2_release_persistent_dirty_bitmaps(bs);
+    free_bitmap_list(&kept);
+    free_bitmap_list(&dropped);
+    return ret;
+}
+
+/*
+ * Writes the data and the table of @bitmap to newly allocated clusters and
+ * fills in @bm accordingly.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+static int store_bitmap_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                             Qcow2Bitmap *bm, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t nb_sectors = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t sectors_per_cluster;
+    uint64_t table_size;
+    uint64_t *table = NULL;
+    int64_t table_offset = -1;
+    uint8_t *buf = NULL;
+    HBitmapIter hbi;
+    uint32_t i;
+    int ret;
+
+    bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+    sectors_per_cluster =
+        sectors_covered_by_bitmap_cluster(s, bm->granularity_bits);
+    table_size = bitmap_table_size(s, nb_sectors, bm->granularity_bits);
+    if (table_size == 0 || table_size > BME_MAX_TABLE_SIZE) {
+        error_setg(errp, "Bitmap '%s' is too large to be stored",
+                   bdrv_dirty_bitmap_name(bitmap));
+        return -EFBIG;
+    }
+    bm->table_size = table_size;
+
+    table = g_try_new0(uint64_t, table_size);
+    buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    if (table == NULL || buf == NULL) {
+        error_setg(errp, "Could not allocate memory for bitmap '%s'",
+                   bdrv_dirty_bitmap_name(bitmap));
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    /* Only clusters with dirty bits in them are written */
+    bdrv_dirty_iter_init(bitmap, &hbi);
+    for (i = 0; i < table_size; i++) {
+        uint64_t start = i * sectors_per_cluster;
+        uint64_t count = MIN(nb_sectors - start, sectors_per_cluster);
+        int64_t next_dirty, offset;
+
+        bdrv_set_dirty_iter(&hbi, start);
+        next_dirty = hbitmap_iter_next(&hbi);
+        if (next_dirty < 0) {
+            break;
+        }
+        if (next_dirty >= start + count) {
+            continue;
+        }
+
+        memset(buf, 0, s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, start, count);
+
+        offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (offset < 0) {
+            ret = offset;
+            goto write_fail;
+        }
+        table[i] = offset;
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
+        if (ret < 0) {
+            goto write_fail;
+        }
+        ret = bdrv_pwrite(bs->file->bs, offset, buf, s->cluster_size);
+        if (ret < 0) {
+            goto write_fail;
+        }
+    }
+
+    table_offset = qcow2_alloc_clusters(bs, table_size * sizeof(uint64_t));
+    if (table_offset < 0) {
+        ret = table_offset;
+        goto write_fail;
+    }
+    bm->table_offset = table_offset;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, table_offset,
+                                        table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto write_fail;
+    }
+
+    for (i = 0; i < table_size; i++) {
+        cpu_to_be64s(&table[i]);
+    }
+    ret = bdrv_pwrite(bs->file->bs, table_offset, table,
+                      table_size * sizeof(uint64_t));
+    for (i = 0; i < table_size; i++) {
+        be64_to_cpus(&table[i]);
+    }
+    if (ret < 0) {
+        goto write_fail;
+    }
+
+    qemu_vfree(buf);
+    g_free(table);
+    return 0;
+
+write_fail:
+    error_setg_errno(errp, -ret, "Could not write bitmap '%s'",
+                     bdrv_dirty_bitmap_name(bitmap));
+    for (i = 0; i < table_size; i++) {
+        if (table[i]) {
+            qcow2_free_clusters(bs, table[i], s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    if (table_offset > 0) {
+        qcow2_free_clusters(bs, table_offset, table_size * sizeof(uint64_t),
+                            QCOW2_DISCARD_OTHER);
+    }
+fail:
+    qemu_vfree(buf);
+    g_free(table);
+    return ret;
+}
+
+/*
+ * Stores all persistent dirty bitmaps of @bs, replacing the bitmaps stored
+ * in the image.  Frozen bitmaps lack the bits recorded by their successor,
+ * so they are stored marked in use and will not be loaded again.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+int qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList new_list = QTAILQ_HEAD_INITIALIZER(new_list);
+    Qcow2BitmapList old_list = QTAILQ_HEAD_INITIALIZER(old_list);
+    Qcow2BitmapList foreign_list = QTAILQ_HEAD_INITIALIZER(foreign_list);
+    BdrvDirtyBitmap *bitmap;
+    Qcow2Bitmap *bm, *old_bm;
+    int ret;
+
+    /* Without the in-memory bitmaps, the stored ones are still current */
+    if (bs->read_only || (s->flags & BDRV_O_INACTIVE) || !s->bitmaps_loaded) {
+        return 0;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        if (!bdrv_dirty_bitmap_get_persistance(bitmap)) {
+            continue;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->name = g_strdup(bdrv_dirty_bitmap_name(bitmap));
+        bm->type = BT_DIRTY_TRACKING_BITMAP;
+
+        /* Compatible extra data is passed on unchanged */
+        old_bm = find_bitmap_by_name(&s->bitmaps, bm->name);
+        if (old_bm && !bitmap_is_foreign(old_bm) && old_bm->extra_data_size) {
+            bm->flags |= BME_FLAG_EXTRA_DATA_COMPATIBLE;
+            bm->extra_data_size = old_bm->extra_data_size;
+            bm->extra_data = g_memdup(old_bm->extra_data,
+                                      old_bm->extra_data_size);
+        }
+
+        if (bdrv_dirty_bitmap_frozen(bitmap)) {
+            bm->flags |= BME_FLAG_IN_USE;
+        }
+        if (bdrv_dirty_bitmap_status(bitmap) != DIRTY_BITMAP_STATUS_DISABLED) {
+            bm->flags |= BME_FLAG_AUTO;
+        }
+
+        ret = store_bitmap_data(bs, bitmap, bm, errp);
+        if (ret < 0) {
+            g_free(bm->name);
+            g_free(bm->extra_data);
+            g_free(bm);
+            goto fail;
+        }
+        QTAILQ_INSERT_TAIL(&new_list, bm, next);
+    }
+
+    if (QTAILQ_EMPTY(&new_list) && QTAILQ_EMPTY(&s->bitmaps)) {
+        return 0;
+    }
+
+    QTAILQ_FOREACH(bm, &s->bitmaps, next) {
+        if (bitmap_is_foreign(bm)) {
+            QTAILQ_INSERT_TAIL(&foreign_list, copy_bitmap(bm), next);
+        } else {
+            QTAILQ_INSERT_TAIL(&old_list, copy_bitmap(bm), next);
+        }
+    }
+    /* The foreign entries are kept as the first ones in the directory, they
+     * are not freed in error cases because their clusters are not ours */
+    while ((bm = QTAILQ_LAST(&foreign_list, Qcow2BitmapList)) != NULL) {
+        QTAILQ_REMOVE(&foreign_list, bm, next);
+        QTAILQ_INSERT_HEAD(&new_list, bm, next);
+    }
+
+    ret = update_bitmap_directory(bs, &new_list);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the bitmap directory");
+        goto fail;
+    }
+
+    QTAILQ_FOREACH(bm, &old_list, next) {
+        free_stored_bitmap(bs, bm);
+    }
+    free_bitmap_list(&old_list);
+
+    trace_qcow2_store_bitmaps(bs, s->nb_bitmaps);
+    return 0;
+
+fail:
+    QTAILQ_FOREACH(bm, &new_list, next) {
+        if (!bitmap_is_foreign(bm)) {
+            free_stored_bitmap(bs, bm);
+        }
+    }
+    free_bitmap_list(&new_list);
+    free_bitmap_list(&old_list);
+    return ret;
+}
+
+/*
+ * Called with s->lock held before guest data is modified.  Makes sure that
+ * the bitmaps stored in the image are marked in use, so that they are not
+ * trusted if QEMU crashes before storing them again, and sets the range in
+ * the persistent bitmaps right away, so that a checkpoint that runs while
+ * the request is in flight already includes it.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+int qcow2_bitmaps_before_write(BlockDriverState *bs, int64_t sector_num,
+                               int nb_sectors)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    int ret;
+
+    if (!s->bitmaps_in_use && !QTAILQ_EMPTY(&s->bitmaps)) {
+        Qcow2BitmapList new_list = QTAILQ_HEAD_INITIALIZER(new_list);
+        Qcow2Bitmap *bm;
+
+        QTAILQ_FOREACH(bm, &s->bitmaps, next) {
+            Qcow2Bitmap *copy = copy_bitmap(bm);
+
+            if (!bitmap_is_foreign(copy)) {
+                copy->flags |= BME_FLAG_IN_USE;
+            }
+            QTAILQ_INSERT_TAIL(&new_list, copy, next);
+        }
+
+        ret = update_bitmap_directory(bs, &new_list);
+        if (ret < 0) {
+            free_bitmap_list(&new_list);
+            return ret;
+        }
+        trace_qcow2_bitmaps_mark_in_use(bs);
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        if (bdrv_dirty_bitmap_get_persistance(bitmap) &&
+            bdrv_dirty_bitmap_enabled(bitmap)) {
+            bdrv_set_dirty_bitmap(bitmap, sector_num, nb_sectors);
+        }
+    }
+
+    return 0;
+}
+
+/* Releases the in-memory copies of the persistent bitmaps of @bs */
+void qcow2_release_persistent_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap, *next;
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap; bitmap = next) {
+        next = bdrv_dirty_bitmap_next(bs, bitmap);
+        if (bdrv_dirty_bitmap_get_persistance(bitmap) &&
+            !bdrv_dirty_bitmap_frozen(bitmap)) {
+            bdrv_release_dirty_bitmap(bs, bitmap);
+        }
+    }
+}
+
+bool qcow2_has_persistent_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+
+    if (!QTAILQ_EMPTY(&s->bitmaps)) {
+        return true;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        if (bdrv_dirty_bitmap_get_persistance(bitmap)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                      uint32_t granularity, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2Bitmap *bm;
+    int granularity_bits = ctz32(granularity);
+    uint64_t table_size;
+    uint32_t nb_bitmaps = 0;
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "Persistent bitmaps require a qcow2 image with at "
+                   "least qemu 1.1 compatibility level");
+        return false;
+    }
+
+    if (bs->read_only) {
+        error_setg(errp, "Can't store persistent bitmaps to a read-only "
+                   "image");
+        return false;
+    }
+
+    if (strlen(name) > BME_MAX_NAME_SIZE) {
+        error_setg(errp, "Bitmap name is longer than %d bytes",
+                   BME_MAX_NAME_SIZE);
+        return false;
+    }
+
+    if (granularity_bits < BME_MIN_GRANULARITY_BITS ||
+        granularity_bits > BME_MAX_GRANULARITY_BITS) {
+        error_setg(errp, "Granularity must be between %llu and %llu bytes",
+                   1ULL << BME_MIN_GRANULARITY_BITS,
+                   1ULL << BME_MAX_GRANULARITY_BITS);
+        return false;
+    }
+
+    table_size = bitmap_table_size(s, bs->total_sectors, granularity_bits);
+    if (table_size > BME_MAX_TABLE_SIZE ||
+        (bs->total_sectors >> (granularity_bits - BDRV_SECTOR_BITS)) / 8 >
+        BME_MAX_PHYS_SIZE) {
+        error_setg(errp, "Bitmap is too large for this image; use a larger "
+                   "granularity");
+        return false;
+    }
+
+    QTAILQ_FOREACH(bm, &s->bitmaps, next) {
+        if (bitmap_is_foreign(bm)) {
+            if (!strcmp(bm->name, name)) {
+                error_setg(errp, "The image already contains a bitmap named "
+                           "'%s'", name);
+                return false;
+            }
+            nb_bitmaps++;
+        }
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        if (bdrv_dirty_bitmap_get_persistance(bitmap)) {
+            nb_bitmaps++;
+        }
+    }
+    if (nb_bitmaps >= QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Too many persistent bitmaps in this image");
+        return false;
+    }
+
+    return true;
+}
+
+void qcow2_remove_persistent_dirty_bitmap(BlockDriverState *bs,
+                                          const char *name,
+                                          Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList new_list = QTAILQ_HEAD_INITIALIZER(new_list);
+    Qcow2Bitmap *bm, *removed = NULL;
+    int ret;
+
+    QTAILQ_FOREACH(bm, &s->bitmaps, next) {
+        if (!removed && !bitmap_is_foreign(bm) && !strcmp(bm->name, name)) {
+            removed = copy_bitmap(bm);
+        } else {
+            QTAILQ_INSERT_TAIL(&new_list, copy_bitmap(bm), next);
+        }
+    }
+
+    /* Never stored, nothing to do in the image */
+    if (removed == NULL) {
+        free_bitmap_list(&new_list);
+        return;
+    }
+
+    /* Called from the monitor; no request may hold s->lock meanwhile */
+    bdrv_drained_begin(bs);
+    ret = update_bitmap_directory(bs, &new_list);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not remove bitmap '%s' from the "
+                         "image", name);
+        free_bitmap_list(&new_list);
+    } else {
+        free_stored_bitmap(bs, removed);
+    }
+    bdrv_drained_end(bs);
+
+    g_free(removed->name);
+    g_free(removed->extra_data);
+    g_free(removed);
+}
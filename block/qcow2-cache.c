@@ -31,51 +31,137 @@
 
 #include "block/block_int.h"
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
+#include "qemu/queue.h"
+#include "qemu/timer.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/* Period of the rebalancing of the metadata cache budget, in milliseconds */
+#define CACHE_BUDGET_PERIOD_MS 1000
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    /* Next entry in the same hash bucket, or -1 */
+    int      hash_next;
+    /* Only entries with ref == 0 are on the LRU list */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_entry;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
     int                     size;
+    int                     table_size;
     bool                    depends_on_flush;
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Hash index from table offset to entry, chained through hash_next */
+    int                    *buckets;
+    unsigned int            nb_buckets;
+
+    /* Unused entries that hold a table, least recently used first */
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
+    /* Entries that do not hold any table; they are reused first */
+    QTAILQ_HEAD(, Qcow2CachedTable) free;
+
+    /* Number of entries that hold a table, and how many may do so.  The
+     * limit is lowered by the metadata cache budget. */
+    int                     nb_used;
+    int                     limit;
+
+    uint64_t                hits;
+    uint64_t                misses;
+
+    /* Metadata cache budget state, only used from the main loop */
+    BlockDriverState       *budget_bs;
+    uint64_t                budget_misses;
+    uint64_t                budget_lru_counter;
+    uint64_t                budget_demand;
+    QLIST_ENTRY(Qcow2Cache) budget_entry;
 };
 
+static QLIST_HEAD(, Qcow2Cache) budget_caches =
+    QLIST_HEAD_INITIALIZER(budget_caches);
+static QEMUTimer *budget_timer;
+static bool budget_active;
+
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
                     Qcow2Cache *c, int table)
 {
-    BDRVQcow2State *s = bs->opaque;
-    return (uint8_t *) c->table_array + (size_t) table * s->cluster_size;
+    return (uint8_t *) c->table_array + (size_t) table * c->table_size;
 }
 
 static inline int qcow2_cache_get_table_idx(BlockDriverState *bs,
                   Qcow2Cache *c, void *table)
 {
-    BDRVQcow2State *s = bs->opaque;
     ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
-    int idx = table_offset / s->cluster_size;
-    assert(idx >= 0 && idx < c->size && table_offset % s->cluster_size == 0);
+    int idx = table_offset / c->table_size;
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
     return idx;
 }
 
+static inline unsigned int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return (offset / c->table_size) & (c->nb_buckets - 1);
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i = c->buckets[qcow2_cache_hash(c, offset)];
+
+    while (i != -1 && c->entries[i].offset != offset) {
+        i = c->entries[i].hash_next;
+    }
+    return i;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    int *bucket = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    c->entries[i].hash_next = *bucket;
+    *bucket = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p != -1);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+/* Drop the table held by unused entry i and make it the next one reused */
+static void qcow2_cache_entry_discard(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 0 && t->offset);
+    qcow2_cache_hash_remove(c, i);
+    t->offset = 0;
+    t->lru_counter = 0;
+    c->nb_used--;
+    QTAILQ_REMOVE(&c->lru, t, lru_entry);
+    QTAILQ_INSERT_HEAD(&c->free, t, lru_entry);
+}
+
 static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
                                       int i, int num_tables)
 {
 #if QEMU_MADV_DONTNEED != QEMU_MADV_INVALID
-    BDRVQcow2State *s = bs->opaque;
     void *t = qcow2_cache_get_table_addr(bs, c, i);
     int align = getpagesize();
-    size_t mem_size = (size_t) s->cluster_size * num_tables;
+    size_t mem_size = (size_t) c->table_size * num_tables;
     size_t offset = QEMU_ALIGN_UP((uintptr_t) t, align) - (uintptr_t) t;
     size_t length = QEMU_ALIGN_DOWN(mem_size - offset, align);
     if (length > 0) {
@@ -104,8 +190,7 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_discard(c, i);
             i++;
             to_clean++;
         }
@@ -118,24 +203,56 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
     c->cache_clean_lru_counter = c->lru_counter;
 }
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+static void qcow2_cache_reset(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->nb_buckets; i++) {
+        c->buckets[i] = -1;
+    }
+
+    QTAILQ_INIT(&c->lru);
+    QTAILQ_INIT(&c->free);
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].offset = 0;
+        c->entries[i].lru_counter = 0;
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->free, &c->entries[i], lru_entry);
+    }
+
+    c->nb_used = 0;
+    c->lru_counter = 0;
+    c->budget_lru_counter = 0;
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size)
 {
-    BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
 
+    assert(num_tables > 0);
+    assert(is_power_of_2(table_size));
+
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->limit = num_tables;
+    c->table_size = table_size;
+    c->nb_buckets = pow2ceil(num_tables);
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->buckets = g_try_new(int, c->nb_buckets);
     c->table_array = qemu_try_blockalign(bs->file->bs,
-                                         (size_t) num_tables * s->cluster_size);
+                                         (size_t) num_tables * table_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->buckets || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
     }
 
+    qcow2_cache_reset(c);
+
     return c;
 }
 
@@ -147,7 +264,15 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
         assert(c->entries[i].ref == 0);
     }
 
+    if (c->budget_bs) {
+        QLIST_REMOVE(c, budget_entry);
+        if (QLIST_EMPTY(&budget_caches)) {
+            timer_del(budget_timer);
+        }
+    }
+
     qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -181,6 +306,12 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     trace_qcow2_cache_entry_flush(qemu_coroutine_self(),
                                   c == s->l2_table_cache, i);
 
+    /* The journal writes all dirty tables of both caches at once, so that
+     * there is no need to order their updates */
+    if (s->journal_active) {
+        return qcow2_journal_commit(bs);
+    }
+
     if (c->depends) {
         ret = qcow2_cache_flush_dependency(bs, c);
     } else if (c->depends_on_flush) {
@@ -196,13 +327,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -216,7 +347,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     }
 
     ret = bdrv_pwrite(bs->file->bs, c->entries[i].offset,
-                      qcow2_cache_get_table_addr(bs, c, i), s->cluster_size);
+                      qcow2_cache_get_table_addr(bs, c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -235,6 +366,10 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
 
     trace_qcow2_cache_flush(qemu_coroutine_self(), c == s->l2_table_cache);
 
+    if (s->journal_active) {
+        return qcow2_journal_commit(bs);
+    }
+
     for (i = 0; i < c->size; i++) {
         ret = qcow2_cache_entry_flush(bs, c, i);
         if (ret < 0 && result != -ENOSPC) {
@@ -255,8 +390,13 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency)
 {
+    BDRVQcow2State *s = bs->opaque;
     int ret;
 
+    if (s->journal_active) {
+        return 0;
+    }
+
     if (dependency->depends) {
         ret = qcow2_cache_flush_dependency(bs, dependency);
         if (ret < 0) {
@@ -280,6 +420,35 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
     c->depends_on_flush = true;
 }
 
+int qcow2_cache_num_tables(Qcow2Cache *c)
+{
+    return c->size;
+}
+
+int qcow2_cache_table_size(Qcow2Cache *c)
+{
+    return c->table_size;
+}
+
+/* Returns the table of entry i and its offset if it is dirty, else NULL */
+void *qcow2_cache_dirty_table(BlockDriverState *bs, Qcow2Cache *c, int i,
+                              uint64_t *offset)
+{
+    if (!c->entries[i].dirty || !c->entries[i].offset) {
+        return NULL;
+    }
+
+    *offset = c->entries[i].offset;
+    return qcow2_cache_get_table_addr(bs, c, i);
+}
+
+void qcow2_cache_entry_mark_clean(BlockDriverState *bs, Qcow2Cache *c,
+                                  void *table)
+{
+    int i = qcow2_cache_get_table_idx(bs, c, table);
+    c->entries[i].dirty = false;
+}
+
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret, i;
@@ -291,14 +460,11 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
     }
 
+    qcow2_cache_reset(c);
     qcow2_cache_table_release(bs, c, 0, c->size);
 
-    c->lru_counter = 0;
-
     return 0;
 }
 
@@ -306,50 +472,70 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
+    assert(offset != 0 && offset % c->table_size == 0);
+
     /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
+    i = qcow2_cache_lookup(c, offset);
+    if (i != -1) {
+        t = &c->entries[i];
+        if (t->ref == 0) {
+            QTAILQ_REMOVE(&c->lru, t, lru_entry);
         }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
-
-    if (min_lru_index == -1) {
+        t->ref++;
+        c->hits++;
+        goto found;
+    }
+    c->misses++;
+
+    /* Use a free entry while below the limit, else replace the least
+     * recently used table.  The limit is exceeded only if all the tables
+     * are in use. */
+    t = NULL;
+    if (c->nb_used < c->limit || QTAILQ_EMPTY(&c->lru)) {
+        t = QTAILQ_FIRST(&c->free);
+    }
+    if (t == NULL) {
+        t = QTAILQ_FIRST(&c->lru);
+    }
+    if (t == NULL) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
-    /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    /* Cache miss: write a table back and replace it.  Take a reference
+     * while doing so, so the entry can neither be picked by someone else
+     * nor cleaned when we yield for I/O. */
+    i = t - c->entries;
+    if (t->offset) {
+        QTAILQ_REMOVE(&c->lru, t, lru_entry);
+    } else {
+        QTAILQ_REMOVE(&c->free, t, lru_entry);
+    }
+    t->ref++;
+
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
     ret = qcow2_cache_entry_flush(bs, c, i);
     if (ret < 0) {
-        return ret;
+        goto fail;
     }
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (t->offset) {
+        qcow2_cache_hash_remove(c, i);
+        c->nb_used--;
+    }
+    t->offset = 0;
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -357,23 +543,33 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
         ret = bdrv_pread(bs->file->bs, offset,
                          qcow2_cache_get_table_addr(bs, c, i),
-                         s->cluster_size);
+                         c->table_size);
         if (ret < 0) {
-            return ret;
+            goto fail;
         }
     }
 
-    c->entries[i].offset = offset;
+    t->offset = offset;
+    c->nb_used++;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
     *table = qcow2_cache_get_table_addr(bs, c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
 
     return 0;
+
+fail:
+    t->ref--;
+    if (t->offset) {
+        QTAILQ_INSERT_HEAD(&c->lru, t, lru_entry);
+    } else {
+        QTAILQ_INSERT_HEAD(&c->free, t, lru_entry);
+    }
+    return ret;
 }
 
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
@@ -397,11 +593,130 @@ void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_entry);
     }
 
     assert(c->entries[i].ref >= 0);
 }
 
+BlockMetadataCacheStats *qcow2_cache_get_stats(Qcow2Cache *c)
+{
+    BlockMetadataCacheStats *stats = g_new0(BlockMetadataCacheStats, 1);
+
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+    stats->size = (int64_t) c->limit * c->table_size;
+    stats->max_size = (int64_t) c->size * c->table_size;
+    stats->used = (int64_t) c->nb_used * c->table_size;
+    return stats;
+}
+
+/* Lower or raise the number of tables that c may hold, and drop the least
+ * recently used clean tables above the new limit. */
+static void qcow2_cache_set_limit(BlockDriverState *bs, Qcow2Cache *c,
+                                  int limit)
+{
+    Qcow2CachedTable *t, *next;
+
+    c->limit = MAX(MIN(limit, c->size), MIN_L2_CACHE_SIZE);
+
+    QTAILQ_FOREACH_SAFE(t, &c->lru, lru_entry, next) {
+        int i = t - c->entries;
+
+        if (c->nb_used <= c->limit) {
+            break;
+        }
+        if (!t->dirty) {
+            qcow2_cache_entry_discard(c, i);
+            qcow2_cache_table_release(bs, c, i, 1);
+        }
+    }
+}
+
+/*
+ * Share the metadata cache budget between the registered caches.  The
+ * demand of a cache over the last period is the number of tables it used
+ * plus the number of misses it had, so that a cache that keeps missing
+ * grows and one that is idle shrinks to its minimum.  The budget is split
+ * in proportion to the demand.
+ */
+static void qcow2_cache_budget_rebalance(void *opaque)
+{
+    uint64_t budget = bdrv_get_metadata_cache_budget();
+    uint64_t total_demand = 0;
+    AioContext *ctx;
+    Qcow2Cache *c;
+    int i;
+
+    if (!budget) {
+        if (budget_active) {
+            QLIST_FOREACH(c, &budget_caches, budget_entry) {
+                ctx = bdrv_get_aio_context(c->budget_bs);
+                aio_context_acquire(ctx);
+                c->limit = c->size;
+                aio_context_release(ctx);
+            }
+            budget_active = false;
+        }
+        goto out;
+    }
+    budget_active = true;
+
+    QLIST_FOREACH(c, &budget_caches, budget_entry) {
+        uint64_t demand = 0;
+
+        ctx = bdrv_get_aio_context(c->budget_bs);
+        aio_context_acquire(ctx);
+        for (i = 0; i < c->size; i++) {
+            Qcow2CachedTable *t = &c->entries[i];
+
+            if (t->ref > 0 ||
+                (t->offset && t->lru_counter > c->budget_lru_counter)) {
+                demand++;
+            }
+        }
+        demand += c->misses - c->budget_misses;
+        c->budget_misses = c->misses;
+        c->budget_lru_counter = c->lru_counter;
+        aio_context_release(ctx);
+
+        c->budget_demand = MAX(demand, MIN_L2_CACHE_SIZE) * c->table_size;
+        total_demand += c->budget_demand;
+    }
+
+    QLIST_FOREACH(c, &budget_caches, budget_entry) {
+        double share = (double) budget * c->budget_demand / total_demand;
+
+        ctx = bdrv_get_aio_context(c->budget_bs);
+        aio_context_acquire(ctx);
+        qcow2_cache_set_limit(c->budget_bs, c,
+                              MIN(share / c->table_size, INT_MAX));
+        aio_context_release(ctx);
+    }
+
+out:
+    timer_mod(budget_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + CACHE_BUDGET_PERIOD_MS);
+}
+
+/* Let c be resized by the metadata cache budget.  Must be called from the
+ * main loop. */
+void qcow2_cache_budget_register(BlockDriverState *bs, Qcow2Cache *c)
+{
+    assert(!c->budget_bs);
+    c->budget_bs = bs;
+    QLIST_INSERT_HEAD(&budget_caches, c, budget_entry);
+
+    if (!budget_timer) {
+        budget_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                    qcow2_cache_budget_rebalance, NULL);
+    }
+    if (!timer_pending(budget_timer)) {
+        timer_mod(budget_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  CACHE_BUDGET_PERIOD_MS);
+    }
+}
+
 void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
      void *table)
 {
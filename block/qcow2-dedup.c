@@ -0,0 +1,329 @@
+/*
+ * Deduplication index for the QCOW version 2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Writes of whole clusters are hashed, and the hash is recorded in a
+ * fixed-size index together with the host and guest offset of the cluster.
+ * When a later write of a whole cluster finds an entry with the same hash
+ * and the data in the host cluster is identical, the guest cluster is
+ * pointed at the existing host cluster and its refcount is increased
+ * instead of writing the data again.
+ *
+ * The index is only a hint: entries are checked against the L2 table of
+ * their guest cluster and the data is compared before an entry is used, so
+ * it can be written back lazily and in any order.  The on-disk format is
+ * described in docs/specs/qcow2.txt.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "qemu/bitmap.h"
+#include "qemu/bitops.h"
+#include "trace.h"
+
+/* Granularity at which modified parts of the index are written back */
+#define DEDUP_PAGE_SIZE 4096
+
+#define DEDUP_HASH_PRIME1 0x9e3779b185ebca87ULL
+#define DEDUP_HASH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define DEDUP_HASH_PRIME3 0x85ebca77c2b2ae63ULL
+
+/*
+ * A fast 64-bit hash of the cluster data.  It does not need to be
+ * collision resistant because the data is compared before it is shared,
+ * but it must be the same on every host because it is stored in the image.
+ * 0 marks free index entries and is never returned.
+ */
+static uint64_t dedup_hash(const uint8_t *buf, size_t len)
+{
+    const uint64_t *p = (const uint64_t *) buf;
+    uint64_t h = len * DEDUP_HASH_PRIME3;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(uint64_t); i++) {
+        h ^= rol64(le64_to_cpu(p[i]) * DEDUP_HASH_PRIME2, 31) *
+             DEDUP_HASH_PRIME1;
+        h = rol64(h, 27) * DEDUP_HASH_PRIME1 + DEDUP_HASH_PRIME3;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h ? h : 1;
+}
+
+static uint64_t dedup_nb_entries(BDRVQcow2State *s)
+{
+    return s->dedup_index_size / sizeof(Qcow2DedupEntry);
+}
+
+static uint64_t dedup_nb_pages(BDRVQcow2State *s)
+{
+    return DIV_ROUND_UP(s->dedup_index_size, DEDUP_PAGE_SIZE);
+}
+
+static Qcow2DedupEntry *dedup_lookup(BDRVQcow2State *s, uint64_t hash)
+{
+    return &s->dedup_index[hash % dedup_nb_entries(s)];
+}
+
+/*
+ * Returns true if a write request is writing data in place to the host
+ * clusters between @offset and @offset + @bytes.
+ */
+bool qcow2_write_in_flight(BlockDriverState *bs, uint64_t offset,
+                           uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2InFlightWrite *w;
+
+    QLIST_FOREACH(w, &s->inflight_writes, next) {
+        if (w->offset < offset + bytes && offset < w->offset + w->bytes) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Tries to deduplicate a write of the whole guest cluster at @guest_offset,
+ * whose data is at @qiov_offset in @qiov.  The hash of the data is stored in
+ * @hash, so that the cluster can be added to the index once it is written.
+ *
+ * Returns 1 if the guest cluster now shares an existing host cluster with
+ * the same data and nothing needs to be written, 0 if the data must be
+ * written as usual, and -errno on failure.
+ */
+int qcow2_dedup_write(BlockDriverState *bs, uint64_t guest_offset,
+                      QEMUIOVector *qiov, size_t qiov_offset, uint64_t *hash)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *data = s->dedup_buf;
+    uint8_t *old_data = s->dedup_buf + s->cluster_size;
+    Qcow2DedupEntry *entry;
+    QCowL2Meta *m;
+    uint64_t host_offset, src_guest_offset;
+    int ret;
+
+    qemu_iovec_to_buf(qiov, qiov_offset, data, s->cluster_size);
+    *hash = dedup_hash(data, s->cluster_size);
+
+    entry = dedup_lookup(s, *hash);
+    if (be64_to_cpu(entry->hash) != *hash) {
+        return 0;
+    }
+
+    host_offset = be64_to_cpu(entry->host_offset);
+    src_guest_offset = be64_to_cpu(entry->guest_offset);
+    if (host_offset == 0 || offset_into_cluster(s, host_offset) ||
+        offset_into_cluster(s, src_guest_offset) ||
+        src_guest_offset >= bs->total_sectors * BDRV_SECTOR_SIZE) {
+        return 0;
+    }
+
+    /* Allocating writes to the guest cluster must be linked first */
+    QLIST_FOREACH(m, &s->cluster_allocs, next_in_flight) {
+        uint64_t end = m->offset + (m->nb_clusters << s->cluster_bits);
+
+        if (guest_offset < end && m->offset < guest_offset + s->cluster_size) {
+            return 0;
+        }
+    }
+
+    /* While s->lock is held, no new write to the host cluster can start, so
+     * its data stays the same once no write is in flight */
+    if (qcow2_write_in_flight(bs, host_offset, s->cluster_size)) {
+        return 0;
+    }
+
+    ret = bdrv_pread(bs->file->bs, host_offset, old_data, s->cluster_size);
+    if (ret < 0) {
+        return ret;
+    }
+    if (memcmp(data, old_data, s->cluster_size)) {
+        return 0;
+    }
+
+    ret = qcow2_share_cluster(bs, guest_offset, host_offset,
+                              src_guest_offset);
+    if (ret > 0) {
+        trace_qcow2_dedup_hit(bs, guest_offset, host_offset);
+    }
+
+    return ret;
+}
+
+/*
+ * Records that the host cluster at @host_offset, which holds the data of
+ * the guest cluster at @guest_offset, has the given @hash.  Older entries
+ * with the same index slot are replaced.
+ */
+void qcow2_dedup_insert(BlockDriverState *bs, uint64_t hash,
+                        uint64_t host_offset, uint64_t guest_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupEntry *entry = dedup_lookup(s, hash);
+    uint64_t pos = (uint8_t *) entry - (uint8_t *) s->dedup_index;
+
+    *entry = (Qcow2DedupEntry) {
+        .hash           = cpu_to_be64(hash),
+        .host_offset    = cpu_to_be64(host_offset),
+        .guest_offset   = cpu_to_be64(guest_offset),
+    };
+
+    set_bit(pos / DEDUP_PAGE_SIZE, s->dedup_dirty);
+}
+
+/*
+ * Writes the modified parts of the index back to the image.
+ */
+int qcow2_dedup_flush(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t nb_pages, start, end, offset, len;
+    int n = 0;
+    int ret;
+
+    if (!s->dedup_index) {
+        return 0;
+    }
+
+    nb_pages = dedup_nb_pages(s);
+    start = find_first_bit(s->dedup_dirty, nb_pages);
+    while (start < nb_pages) {
+        end = find_next_zero_bit(s->dedup_dirty, nb_pages, start);
+
+        offset = start * DEDUP_PAGE_SIZE;
+        len = MIN(end * DEDUP_PAGE_SIZE, s->dedup_index_size) - offset;
+        ret = bdrv_pwrite(bs->file->bs, s->dedup_index_offset + offset,
+                          (uint8_t *) s->dedup_index + offset, len);
+        if (ret < 0) {
+            return ret;
+        }
+
+        bitmap_clear(s->dedup_dirty, start, end - start);
+        n += end - start;
+        start = find_next_bit(s->dedup_dirty, nb_pages, end);
+    }
+
+    if (n) {
+        trace_qcow2_dedup_flush(bs, n);
+    }
+    return 0;
+}
+
+/*
+ * Loads the index of an image that has one.  If the image was modified by a
+ * program that does not maintain the index, the index is emptied.
+ */
+int qcow2_dedup_open(BlockDriverState *bs, int flags, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->dedup_index_size) {
+        return 0;
+    }
+
+    s->dedup_index = qemu_try_blockalign(bs->file->bs, s->dedup_index_size);
+    s->dedup_buf = qemu_try_blockalign(bs->file->bs, 2 * s->cluster_size);
+    if (s->dedup_index == NULL || s->dedup_buf == NULL) {
+        error_setg(errp, "Could not allocate deduplication index");
+        ret = -ENOMEM;
+        goto fail;
+    }
+    s->dedup_dirty = bitmap_new(dedup_nb_pages(s));
+
+    if (s->autoclear_features & QCOW2_AUTOCLEAR_DEDUP) {
+        ret = bdrv_pread(bs->file->bs, s->dedup_index_offset, s->dedup_index,
+                         s->dedup_index_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read deduplication index");
+            goto fail;
+        }
+        return 0;
+    }
+
+    memset(s->dedup_index, 0, s->dedup_index_size);
+    if (!bs->read_only && !(flags & BDRV_O_INACTIVE)) {
+        ret = bdrv_write_zeroes(bs->file->bs,
+                                s->dedup_index_offset >> BDRV_SECTOR_BITS,
+                                s->dedup_index_size >> BDRV_SECTOR_BITS, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not reset deduplication index");
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    qcow2_dedup_close(bs);
+    return ret;
+}
+
+void qcow2_dedup_close(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    qemu_vfree(s->dedup_index);
+    s->dedup_index = NULL;
+    g_free(s->dedup_dirty);
+    s->dedup_dirty = NULL;
+    qemu_vfree(s->dedup_buf);
+    s->dedup_buf = NULL;
+}
+
+/*
+ * Adds an empty index of @size bytes to the image.
+ */
+int qcow2_dedup_create(BlockDriverState *bs, uint64_t size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t offset;
+    int ret;
+
+    size = ROUND_UP(size, s->cluster_size);
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        return offset;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_write_zeroes(bs->file->bs, offset >> BDRV_SECTOR_BITS,
+                            size >> BDRV_SECTOR_BITS, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->dedup_index_offset = offset;
+    s->dedup_index_size = size;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_DEDUP;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->dedup_index_offset = 0;
+        s->dedup_index_size = 0;
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_DEDUP;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_NEVER);
+    return ret;
+}
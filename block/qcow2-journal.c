@@ -0,0 +1,598 @@
+/*
+ * Metadata journal for the QCOW version 2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Dirty L2 tables and refcount blocks are written as one transaction to a
+ * circular journal area before they are written back to their location in
+ * the image.  This makes the update of all cached metadata atomic, so the
+ * caches need neither be flushed in a specific order nor with a flush in
+ * between, and many cluster allocations can be committed with a single
+ * sequential write.  When the image is opened, transactions that are still
+ * in the journal are replayed.  The on-disk format is described in
+ * docs/specs/qcow2.txt.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "qemu/crc32c.h"
+#include "qemu/error-report.h"
+#include "trace.h"
+
+#define QCOW2_JOURNAL_MAGIC        0x716a6e6c /* "qjnl" */
+#define QCOW2_JOURNAL_TXN_MAGIC    0x716a7478 /* "qjtx" */
+
+/* The journal header occupies the first sector of the journal */
+#define QCOW2_JOURNAL_HEADER_SIZE  BDRV_SECTOR_SIZE
+
+typedef struct QEMU_PACKED Qcow2JournalHeader {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t seq;           /* sequence number of the first transaction */
+} Qcow2JournalHeader;
+
+typedef struct QEMU_PACKED Qcow2JournalTxn {
+    uint32_t magic;
+    uint32_t crc;           /* CRC32C of the transaction, this field zeroed */
+    uint64_t seq;
+    uint32_t length;        /* in bytes, including this descriptor */
+    uint32_t nb_entries;
+    /* nb_entries Qcow2JournalEntry follow */
+} Qcow2JournalTxn;
+
+typedef struct QEMU_PACKED Qcow2JournalEntry {
+    uint64_t offset;        /* in the image file */
+    uint32_t length;
+    uint32_t reserved;
+} Qcow2JournalEntry;
+
+/* Size of a transaction descriptor, the table data follows it */
+static uint64_t journal_desc_size(uint64_t nb_entries)
+{
+    return ROUND_UP(sizeof(Qcow2JournalTxn) +
+                    nb_entries * sizeof(Qcow2JournalEntry),
+                    BDRV_SECTOR_SIZE);
+}
+
+/*
+ * Returns true if a transaction holding every table of both caches fits
+ * into an empty journal.  Commits can only be atomic if this is the case.
+ */
+bool qcow2_journal_fits(BlockDriverState *bs, Qcow2Cache *l2_table_cache,
+                        Qcow2Cache *refcount_block_cache)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l2_tables = qcow2_cache_num_tables(l2_table_cache);
+    uint64_t refblocks = qcow2_cache_num_tables(refcount_block_cache);
+    uint64_t len;
+
+    len = journal_desc_size(l2_tables + refblocks) +
+          l2_tables * qcow2_cache_table_size(l2_table_cache) +
+          refblocks * qcow2_cache_table_size(refcount_block_cache);
+
+    return len <= s->journal_size - QCOW2_JOURNAL_HEADER_SIZE;
+}
+
+static int journal_write_header(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2JournalHeader *header;
+    int ret;
+
+    header = qemu_try_blockalign0(bs->file->bs, QCOW2_JOURNAL_HEADER_SIZE);
+    if (header == NULL) {
+        return -ENOMEM;
+    }
+
+    header->magic = cpu_to_be32(QCOW2_JOURNAL_MAGIC);
+    header->seq = cpu_to_be64(s->journal_seq);
+
+    ret = bdrv_pwrite(bs->file->bs, s->journal_offset, header,
+                      QCOW2_JOURNAL_HEADER_SIZE);
+    qemu_vfree(header);
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Empties the journal.  The tables of the committed transactions have
+ * already been written back, so it is enough to make them stable and to
+ * start the journal over with the next sequence number.
+ */
+int qcow2_journal_checkpoint(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->journal_size || s->journal_pos == QCOW2_JOURNAL_HEADER_SIZE) {
+        s->journal_needs_checkpoint = false;
+        return 0;
+    }
+
+    trace_qcow2_journal_checkpoint(bs, s->journal_seq);
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = journal_write_header(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* New transactions must not overwrite old ones that are still valid */
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->journal_pos = QCOW2_JOURNAL_HEADER_SIZE;
+    s->journal_needs_checkpoint = false;
+    return 0;
+}
+
+/*
+ * Writes all dirty tables of the L2 table and refcount block caches to the
+ * journal as a single transaction, and then back to their place in the
+ * image.  Unlike a cache flush this does not need to flush the tables
+ * after writing them back, because the journal makes them stable already.
+ */
+int qcow2_journal_commit(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Cache *caches[] = { s->refcount_block_cache, s->l2_table_cache };
+    Qcow2JournalTxn *txn = NULL;
+    Qcow2JournalEntry *entries;
+    QEMUIOVector qiov;
+    void **tables;
+    uint64_t *offsets;
+    int *table_cache;
+    uint64_t desc_size, len;
+    uint32_t crc;
+    int nb_tables = 0, max_tables;
+    int c, i, ret;
+
+    assert(s->journal_active);
+
+    max_tables = qcow2_cache_num_tables(caches[0]) +
+                 qcow2_cache_num_tables(caches[1]);
+    tables = g_new(void *, max_tables);
+    offsets = g_new(uint64_t, max_tables);
+    table_cache = g_new(int, max_tables);
+    qemu_iovec_init(&qiov, max_tables + 1);
+
+    len = 0;
+    for (c = 0; c < ARRAY_SIZE(caches); c++) {
+        int ign = c == 0 ? QCOW2_OL_REFCOUNT_BLOCK : QCOW2_OL_ACTIVE_L2;
+
+        for (i = 0; i < qcow2_cache_num_tables(caches[c]); i++) {
+            void *table = qcow2_cache_dirty_table(bs, caches[c], i,
+                                                  &offsets[nb_tables]);
+            if (table == NULL) {
+                continue;
+            }
+
+            ret = qcow2_pre_write_overlap_check(bs, ign, offsets[nb_tables],
+                                                qcow2_cache_table_size(
+                                                    caches[c]));
+            if (ret < 0) {
+                goto out;
+            }
+
+            tables[nb_tables] = table;
+            table_cache[nb_tables] = c;
+            len += qcow2_cache_table_size(caches[c]);
+            nb_tables++;
+        }
+    }
+
+    if (nb_tables == 0) {
+        ret = bdrv_flush(bs->file->bs);
+        goto out;
+    }
+
+    desc_size = journal_desc_size(nb_tables);
+    len += desc_size;
+    assert(len <= s->journal_size - QCOW2_JOURNAL_HEADER_SIZE);
+
+    if (s->journal_pos + len > s->journal_size) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    /* The new tables may point to data and other metadata that was just
+     * written; it must be stable before the transaction can be */
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    txn = qemu_try_blockalign0(bs->file->bs, desc_size);
+    if (txn == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    *txn = (Qcow2JournalTxn) {
+        .magic      = cpu_to_be32(QCOW2_JOURNAL_TXN_MAGIC),
+        .seq        = cpu_to_be64(s->journal_seq),
+        .length     = cpu_to_be32(len),
+        .nb_entries = cpu_to_be32(nb_tables),
+    };
+    entries = (Qcow2JournalEntry *)(txn + 1);
+    for (i = 0; i < nb_tables; i++) {
+        entries[i].offset = cpu_to_be64(offsets[i]);
+        entries[i].length =
+            cpu_to_be32(qcow2_cache_table_size(caches[table_cache[i]]));
+    }
+
+    qemu_iovec_add(&qiov, txn, desc_size);
+    crc = crc32c(0xffffffff, (uint8_t *)txn, desc_size);
+    for (i = 0; i < nb_tables; i++) {
+        int size = qcow2_cache_table_size(caches[table_cache[i]]);
+
+        qemu_iovec_add(&qiov, tables[i], size);
+        /* crc32c() inverts its result, undo that to continue the CRC */
+        crc = crc32c(crc ^ 0xffffffff, tables[i], size);
+    }
+    txn->crc = cpu_to_be32(crc);
+
+    trace_qcow2_journal_commit(bs, s->journal_seq, nb_tables, len);
+
+    ret = bdrv_pwritev(bs->file->bs, s->journal_offset + s->journal_pos,
+                       &qiov);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    s->journal_pos += len;
+    s->journal_seq++;
+
+    /* The tables are safe now, write them back */
+    for (i = 0; i < nb_tables; i++) {
+        Qcow2Cache *cache = caches[table_cache[i]];
+
+        if (table_cache[i] == 0) {
+            BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE_PART);
+        } else {
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
+        }
+
+        ret = bdrv_pwrite(bs->file->bs, offsets[i], tables[i],
+                          qcow2_cache_table_size(cache));
+        if (ret < 0) {
+            goto out;
+        }
+        qcow2_cache_entry_mark_clean(bs, cache, tables[i]);
+    }
+
+    ret = 0;
+out:
+    qemu_iovec_destroy(&qiov);
+    qemu_vfree(txn);
+    g_free(tables);
+    g_free(offsets);
+    g_free(table_cache);
+    return ret;
+}
+
+/*
+ * Reads the transaction at @pos into a newly allocated buffer.  Returns 1
+ * and the transaction if there is a complete one with sequence number @seq,
+ * 0 if the journal ends at @pos, or -errno.
+ */
+static int journal_read_txn(BlockDriverState *bs, uint64_t pos, uint64_t seq,
+                            Qcow2JournalTxn **ptxn, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2JournalTxn *txn;
+    Qcow2JournalEntry *entries;
+    uint32_t length, nb_entries, crc;
+    uint64_t data_len;
+    int i, ret;
+
+    if (pos + BDRV_SECTOR_SIZE > s->journal_size) {
+        return 0;
+    }
+
+    txn = qemu_try_blockalign(bs->file->bs, BDRV_SECTOR_SIZE);
+    if (txn == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file->bs, s->journal_offset + pos, txn,
+                     BDRV_SECTOR_SIZE);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read journal transaction");
+        goto fail;
+    }
+
+    length = be32_to_cpu(txn->length);
+    nb_entries = be32_to_cpu(txn->nb_entries);
+
+    /* Anything that is not the next complete transaction ends the journal;
+     * it is stale or was torn by a crash before it was committed */
+    if (be32_to_cpu(txn->magic) != QCOW2_JOURNAL_TXN_MAGIC ||
+        be64_to_cpu(txn->seq) != seq ||
+        length % BDRV_SECTOR_SIZE || length > s->journal_size - pos ||
+        nb_entries == 0 || journal_desc_size(nb_entries) >= length)
+    {
+        ret = 0;
+        goto fail;
+    }
+
+    qemu_vfree(txn);
+    txn = qemu_try_blockalign(bs->file->bs, length);
+    if (txn == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file->bs, s->journal_offset + pos, txn, length);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read journal transaction");
+        goto fail;
+    }
+
+    crc = be32_to_cpu(txn->crc);
+    txn->crc = 0;
+    if (crc32c(0xffffffff, (uint8_t *)txn, length) != crc) {
+        ret = 0;
+        goto fail;
+    }
+
+    /* The transaction is complete, so its contents must be valid */
+    entries = (Qcow2JournalEntry *)(txn + 1);
+    data_len = 0;
+    for (i = 0; i < nb_entries; i++) {
+        uint64_t offset = be64_to_cpu(entries[i].offset);
+        uint32_t len = be32_to_cpu(entries[i].length);
+
+        if (len == 0 || len % BDRV_SECTOR_SIZE || len > s->cluster_size ||
+            offset % BDRV_SECTOR_SIZE || offset < s->cluster_size ||
+            (offset < s->journal_offset + s->journal_size &&
+             offset + len > s->journal_offset))
+        {
+            error_setg(errp, "Invalid entry in journal transaction %" PRIu64,
+                       seq);
+            ret = -EINVAL;
+            goto fail;
+        }
+        data_len += len;
+    }
+
+    if (journal_desc_size(nb_entries) + data_len != length) {
+        error_setg(errp, "Invalid length of journal transaction %" PRIu64,
+                   seq);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    *ptxn = txn;
+    return 1;
+
+fail:
+    qemu_vfree(txn);
+    return ret;
+}
+
+static int journal_replay_txn(BlockDriverState *bs, Qcow2JournalTxn *txn,
+                              Error **errp)
+{
+    Qcow2JournalEntry *entries = (Qcow2JournalEntry *)(txn + 1);
+    uint32_t nb_entries = be32_to_cpu(txn->nb_entries);
+    uint8_t *data = (uint8_t *)txn + journal_desc_size(nb_entries);
+    int i, ret;
+
+    for (i = 0; i < nb_entries; i++) {
+        uint64_t offset = be64_to_cpu(entries[i].offset);
+        uint32_t len = be32_to_cpu(entries[i].length);
+
+        ret = bdrv_pwrite(bs->file->bs, offset, data, len);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not replay journal "
+                             "transaction %" PRIu64, be64_to_cpu(txn->seq));
+            return ret;
+        }
+        data += len;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads the journal header and replays the journal if the image was not
+ * closed cleanly.  s->journal_offset and s->journal_size come from the
+ * header extension, and the metadata caches must exist already.
+ */
+int qcow2_journal_open(BlockDriverState *bs, int flags, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2JournalHeader *header;
+    Qcow2JournalTxn *txn;
+    uint64_t pos, seq;
+    int ret;
+
+    if (!s->journal_size) {
+        return 0;
+    }
+
+    header = qemu_try_blockalign(bs->file->bs, QCOW2_JOURNAL_HEADER_SIZE);
+    if (header == NULL) {
+        error_setg(errp, "Could not allocate journal header");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file->bs, s->journal_offset, header,
+                     QCOW2_JOURNAL_HEADER_SIZE);
+    if (ret < 0) {
+        qemu_vfree(header);
+        error_setg_errno(errp, -ret, "Could not read journal header");
+        return ret;
+    }
+
+    if (be32_to_cpu(header->magic) != QCOW2_JOURNAL_MAGIC) {
+        qemu_vfree(header);
+        error_setg(errp, "Invalid journal header");
+        return -EINVAL;
+    }
+
+    s->journal_seq = be64_to_cpu(header->seq);
+    s->journal_pos = QCOW2_JOURNAL_HEADER_SIZE;
+    qemu_vfree(header);
+
+    /* While migrating, the source still owns the journal */
+    if (flags & BDRV_O_INACTIVE) {
+        goto done;
+    }
+
+    pos = s->journal_pos;
+    seq = s->journal_seq;
+    while ((ret = journal_read_txn(bs, pos, seq, &txn, errp)) > 0) {
+        if (bs->read_only) {
+            qemu_vfree(txn);
+            error_setg(errp, "qcow2 image has a metadata journal that must be "
+                       "replayed; open it read-write first");
+            return -EPERM;
+        }
+
+        trace_qcow2_journal_replay(bs, seq, pos);
+        ret = journal_replay_txn(bs, txn, errp);
+        pos += be32_to_cpu(txn->length);
+        qemu_vfree(txn);
+        if (ret < 0) {
+            return ret;
+        }
+        seq++;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (seq != s->journal_seq) {
+        s->journal_pos = pos;
+        s->journal_seq = seq;
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not empty the journal");
+            return ret;
+        }
+    }
+
+done:
+    s->journal_active = qcow2_journal_fits(bs, s->l2_table_cache,
+                                           s->refcount_block_cache);
+    if (!s->journal_active && !bs->read_only) {
+        error_report("WARNING: the metadata caches of '%s' are larger than "
+                     "its journal, metadata updates will not be journaled",
+                     bs->filename);
+    }
+
+    return 0;
+}
+
+/*
+ * Allocates and initialises a journal of @size bytes for a newly created
+ * image.
+ */
+int qcow2_journal_create(BlockDriverState *bs, uint64_t size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t offset;
+    int ret;
+
+    size = ROUND_UP(size, s->cluster_size);
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        return offset;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* A zeroed first transaction descriptor prevents any old data from
+     * being taken for a transaction */
+    ret = bdrv_write_zeroes(bs->file->bs, offset >> BDRV_SECTOR_BITS,
+                            (QCOW2_JOURNAL_HEADER_SIZE + BDRV_SECTOR_SIZE) >>
+                            BDRV_SECTOR_BITS, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->journal_offset = offset;
+    s->journal_size = size;
+    s->journal_seq = 1;
+    s->journal_pos = QCOW2_JOURNAL_HEADER_SIZE;
+
+    ret = journal_write_header(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->incompatible_features |= QCOW2_INCOMPAT_JOURNAL;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->incompatible_features &= ~QCOW2_INCOMPAT_JOURNAL;
+        goto fail;
+    }
+
+    s->journal_active = qcow2_journal_fits(bs, s->l2_table_cache,
+                                           s->refcount_block_cache);
+    return 0;
+
+fail:
+    s->journal_offset = 0;
+    s->journal_size = 0;
+    return ret;
+}
+
+/*
+ * Commits and empties the journal and stops using it, for operations that
+ * write metadata directly instead of through the caches.  Replaying the
+ * journal later must not undo what they wrote.
+ */
+int qcow2_journal_suspend(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->journal_active) {
+        return 0;
+    }
+
+    ret = qcow2_journal_commit(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->journal_active = false;
+    return 0;
+}
+
+void qcow2_journal_resume(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->journal_size) {
+        s->journal_active = qcow2_journal_fits(bs, s->l2_table_cache,
+                                               s->refcount_block_cache);
+    }
+}
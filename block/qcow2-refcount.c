@@ -753,6 +753,9 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
             s->free_cluster_index = cluster_index;
         }
+        if (refcount == 0 && s->journal_size) {
+            s->journal_needs_checkpoint = true;
+        }
         s->set_refcount(refcount_block, block_index, refcount);
 
         if (refcount == 0 && s->discard_passthrough[type]) {
@@ -829,6 +832,14 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
         qcow2_process_discards(bs, 0);
     }
 
+    /* Nor if replaying the journal could still overwrite them */
+    if (s->journal_needs_checkpoint) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     nb_clusters = size_to_clusters(s, size);
 retry:
     for(i = 0; i < nb_clusters; i++) {
@@ -893,6 +904,13 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
         return 0;
     }
 
+    if (s->journal_needs_checkpoint) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     do {
         /* Check how many clusters there are free */
         cluster_index = offset >> s->cluster_bits;
@@ -1048,17 +1066,20 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, refcount;
+    uint64_t *l1_table, *l2_slice, l2_offset, offset, l1_size2, refcount;
     bool l1_allocated = false;
     int64_t old_offset, old_l2_offset;
+    unsigned slice, slice_size2, n_slices;
     int i, j, l1_modified = 0, nb_csectors;
     int ret;
 
     assert(addend >= -1 && addend <= 1);
 
-    l2_table = NULL;
+    l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
 
@@ -1100,93 +1121,99 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
+            for (slice = 0; slice < n_slices; slice++) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                      l2_offset + slice * slice_size2,
+                                      (void **) &l2_slice);
+                if (ret < 0) {
+                    goto fail;
+                }
 
-            for(j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
-
-                offset = be64_to_cpu(l2_table[j]);
-                old_offset = offset;
-                offset &= ~QCOW_OFLAG_COPIED;
-
-                switch (qcow2_get_cluster_type(offset)) {
-                    case QCOW2_CLUSTER_COMPRESSED:
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
+                for (j = 0; j < s->l2_slice_size; j++) {
+                    uint64_t cluster_index;
+
+                    offset = get_l2_entry(s, l2_slice, j);
+                    old_offset = offset;
+                    offset &= ~QCOW_OFLAG_COPIED;
+
+                    switch (qcow2_get_cluster_type(offset)) {
+                        case QCOW2_CLUSTER_COMPRESSED:
+                            nb_csectors = ((offset >> s->csize_shift) &
+                                           s->csize_mask) + 1;
+                            if (addend != 0) {
+                                ret = update_refcount(bs,
+                                    (offset & s->cluster_offset_mask) & ~511,
+                                    nb_csectors * 512, abs(addend), addend < 0,
+                                    QCOW2_DISCARD_SNAPSHOT);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
+                            }
+                            /* compressed clusters are never modified */
+                            refcount = 2;
+                            break;
+
+                        case QCOW2_CLUSTER_NORMAL:
+                        case QCOW2_CLUSTER_ZERO:
+                            if (offset_into_cluster(s,
+                                                    offset & L2E_OFFSET_MASK)) {
+                                qcow2_signal_corruption(
+                                    bs, true, -1, -1, "Data cluster offset "
+                                    "%#llx unaligned (L2 offset: %#" PRIx64
+                                    ", L2 index: %#x)",
+                                    offset & L2E_OFFSET_MASK, l2_offset,
+                                    slice * s->l2_slice_size + j);
+                                ret = -EIO;
                                 goto fail;
                             }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                        break;
-
-                    case QCOW2_CLUSTER_NORMAL:
-                    case QCOW2_CLUSTER_ZERO:
-                        if (offset_into_cluster(s, offset & L2E_OFFSET_MASK)) {
-                            qcow2_signal_corruption(bs, true, -1, -1, "Data "
-                                                    "cluster offset %#llx "
-                                                    "unaligned (L2 offset: %#"
-                                                    PRIx64 ", L2 index: %#x)",
-                                                    offset & L2E_OFFSET_MASK,
-                                                    l2_offset, j);
-                            ret = -EIO;
-                            goto fail;
-                        }
 
-                        cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (!cluster_index) {
-                            /* unallocated */
-                            refcount = 0;
-                            break;
-                        }
-                        if (addend != 0) {
-                            ret = qcow2_update_cluster_refcount(bs,
-                                    cluster_index, abs(addend), addend < 0,
-                                    QCOW2_DISCARD_SNAPSHOT);
+                            cluster_index = (offset & L2E_OFFSET_MASK)
+                                            >> s->cluster_bits;
+                            if (!cluster_index) {
+                                /* unallocated */
+                                refcount = 0;
+                                break;
+                            }
+                            if (addend != 0) {
+                                ret = qcow2_update_cluster_refcount(bs,
+                                        cluster_index, abs(addend), addend < 0,
+                                        QCOW2_DISCARD_SNAPSHOT);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
+                            }
+
+                            ret = qcow2_get_refcount(bs, cluster_index,
+                                                     &refcount);
                             if (ret < 0) {
                                 goto fail;
                             }
-                        }
-
-                        ret = qcow2_get_refcount(bs, cluster_index, &refcount);
-                        if (ret < 0) {
-                            goto fail;
-                        }
-                        break;
+                            break;
 
-                    case QCOW2_CLUSTER_UNALLOCATED:
-                        refcount = 0;
-                        break;
+                        case QCOW2_CLUSTER_UNALLOCATED:
+                            refcount = 0;
+                            break;
 
-                    default:
-                        abort();
-                }
+                        default:
+                            abort();
+                    }
 
-                if (refcount == 1) {
-                    offset |= QCOW_OFLAG_COPIED;
-                }
-                if (offset != old_offset) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
+                    if (refcount == 1) {
+                        offset |= QCOW_OFLAG_COPIED;
+                    }
+                    if (offset != old_offset) {
+                        if (addend > 0) {
+                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                s->refcount_block_cache);
+                        }
+                        set_l2_entry(s, l2_slice, j, offset);
+                        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                     l2_slice);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
-                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
-                                                 l2_table);
                 }
-            }
 
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+            }
 
             if (addend != 0) {
                 ret = qcow2_update_cluster_refcount(bs, l2_offset >>
@@ -1213,8 +1240,8 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
     ret = bdrv_flush(bs);
 fail:
-    if (l2_table) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    if (l2_slice) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
     }
 
     s->cache_discards = false;
@@ -1365,36 +1392,39 @@ enum {
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table, which has already been read from disk. While
+ * doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
-                              int64_t *refcount_table_size, int64_t l2_offset,
-                              int flags)
+                              int64_t *refcount_table_size,
+                              uint64_t *l2_table, int flags)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    ret = bdrv_pread(bs->file->bs, l2_offset, l2_table, l2_size);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        goto fail;
-    }
+    int i, nb_csectors, ret;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+
+        if (has_subclusters(s) &&
+            qcow2_get_cluster_type(l2_entry) != QCOW2_CLUSTER_COMPRESSED) {
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, i);
+
+            if ((l2_bitmap & (l2_bitmap >> 32) & QCOW_L2_BITMAP_ALL_ALLOC) ||
+                (!(l2_entry & L2E_OFFSET_MASK) &&
+                 (l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC))) {
+                fprintf(stderr, "ERROR: L2 entry %#" PRIx64 " has an invalid "
+                        "subcluster bitmap %#" PRIx64 "\n", l2_entry,
+                        l2_bitmap);
+                res->corruptions++;
+            }
+        }
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1414,7 +1444,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
                                 l2_entry & ~511, nb_csectors * 512);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1453,7 +1483,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
                                 offset, s->cluster_size);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             /* Correct offsets are cluster aligned */
@@ -1473,12 +1503,66 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
+}
 
-fail:
-    g_free(l2_table);
-    return ret;
+/* Number of L2 tables read at the same time by check_refcounts_l1() */
+#define CHECK_L2_BATCH 16
+
+typedef struct CheckL2Read {
+    uint64_t l2_offset;
+    uint64_t *l2_table;
+    int ret;
+    int *in_flight;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} CheckL2Read;
+
+static void check_l2_read_cb(void *opaque, int ret)
+{
+    CheckL2Read *req = opaque;
+
+    req->ret = ret;
+    (*req->in_flight)--;
+}
+
+/*
+ * Reads the first @n L2 tables of @reqs.  The reads are submitted together
+ * so that checking a large image does not pay one round trip per table;
+ * unaligned offsets (which are reported as corruptions by the caller) and
+ * callers in coroutine context use synchronous reads instead.
+ */
+static void check_read_l2_tables(BlockDriverState *bs, CheckL2Read *reqs,
+                                 int n)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int l2_size = s->l2_size * l2_entry_size(s);
+    int in_flight = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        CheckL2Read *req = &reqs[i];
+
+        if (qemu_in_coroutine() || (req->l2_offset & ~BDRV_SECTOR_MASK) ||
+            (l2_size & ~BDRV_SECTOR_MASK)) {
+            req->ret = bdrv_pread(bs->file->bs, req->l2_offset, req->l2_table,
+                                  l2_size);
+            continue;
+        }
+
+        req->in_flight = &in_flight;
+        req->iov.iov_base = req->l2_table;
+        req->iov.iov_len = l2_size;
+        qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+
+        in_flight++;
+        bdrv_aio_readv(bs->file->bs, req->l2_offset >> BDRV_SECTOR_BITS,
+                       &req->qiov, l2_size >> BDRV_SECTOR_BITS,
+                       check_l2_read_cb, req);
+    }
+    while (in_flight > 0) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
 }
 
 /*
@@ -1498,7 +1582,9 @@ static int check_refcounts_l1(BlockDriverState *bs,
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l1_table = NULL, l2_offset, l1_size2;
-    int i, ret;
+    CheckL2Read reqs[CHECK_L2_BATCH];
+    uint8_t *l2_buf = NULL;
+    int i, j, n, l2_size, ret;
 
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -1527,12 +1613,24 @@ static int check_refcounts_l1(BlockDriverState *bs,
             be64_to_cpus(&l1_table[i]);
     }
 
-    /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
+    l2_size = s->l2_size * l2_entry_size(s);
+    l2_buf = g_malloc(CHECK_L2_BATCH * l2_size);
+    for (j = 0; j < CHECK_L2_BATCH; j++) {
+        reqs[j].l2_table = (uint64_t *)(l2_buf + j * l2_size);
+    }
+
+    /* Do the actual checks, reading a batch of L2 tables at a time */
+    for (i = 0; i < l1_size; ) {
+        for (n = 0; i < l1_size && n < CHECK_L2_BATCH; i++) {
+            if (l1_table[i]) {
+                reqs[n++].l2_offset = l1_table[i] & L1E_OFFSET_MASK;
+            }
+        }
+        check_read_l2_tables(bs, reqs, n);
+
+        for (j = 0; j < n; j++) {
             /* Mark L2 table as used */
-            l2_offset &= L1E_OFFSET_MASK;
+            l2_offset = reqs[j].l2_offset;
             ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
                                 l2_offset, s->cluster_size);
             if (ret < 0) {
@@ -1546,18 +1644,28 @@ static int check_refcounts_l1(BlockDriverState *bs,
                 res->corruptions++;
             }
 
+            if (reqs[j].ret < 0) {
+                fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+                res->check_errors++;
+                ret = reqs[j].ret;
+                goto fail;
+            }
+
             /* Process and check L2 entries */
             ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags);
+                                     refcount_table_size, reqs[j].l2_table,
+                                     flags);
             if (ret < 0) {
                 goto fail;
             }
         }
     }
+    g_free(l2_buf);
     g_free(l1_table);
     return 0;
 
 fail:
+    g_free(l2_buf);
     g_free(l1_table);
     return ret;
 }
@@ -1616,7 +1724,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         ret = bdrv_pread(bs->file->bs, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+                         s->l2_size * l2_entry_size(s));
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1625,7 +1733,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             int cluster_type = qcow2_get_cluster_type(l2_entry);
 
@@ -1638,16 +1746,26 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                     /* don't print message nor increment check_errors */
                     continue;
                 }
-                if ((refcount == 1) != ((l2_entry & QCOW_OFLAG_COPIED) != 0)) {
+                /* Deduplicated clusters keep the flag cleared when all but
+                 * one of their references are gone; that only costs a COW */
+                if (s->dedup_index_size && refcount == 1 &&
+                    !(l2_entry & QCOW_OFLAG_COPIED)) {
+                    if (fix & BDRV_FIX_ERRORS) {
+                        set_l2_entry(s, l2_table, j,
+                                     l2_entry | QCOW_OFLAG_COPIED);
+                        l2_dirty = true;
+                    }
+                } else if ((refcount == 1) !=
+                           ((l2_entry & QCOW_OFLAG_COPIED) != 0)) {
                     fprintf(stderr, "%s OFLAG_COPIED data cluster: "
                             "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
                             fix & BDRV_FIX_ERRORS ? "Repairing" :
                                                     "ERROR",
                             l2_entry, refcount);
                     if (fix & BDRV_FIX_ERRORS) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j, refcount == 1
+                                     ? l2_entry |  QCOW_OFLAG_COPIED
+                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty = true;
                         res->corruptions_fixed++;
                     } else {
@@ -1789,6 +1907,67 @@ resize_fail:
     return 0;
 }
 
+/*
+ * Increases the refcount in the given refcount table for the bitmap directory
+ * and for the clusters used by each persistent bitmap (its bitmap table and
+ * the data clusters referenced from there).
+ */
+static int check_refcounts_bitmaps(BlockDriverState *bs, BdrvCheckResult *res,
+                                   void **refcount_table,
+                                   int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Bitmap *bm;
+    uint64_t *bitmap_table;
+    uint32_t i;
+    int ret;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                        s->bitmap_directory_offset,
+                        s->bitmap_directory_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    QTAILQ_FOREACH(bm, &s->bitmaps, next) {
+        ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                            bm->table_offset,
+                            bm->table_size * sizeof(uint64_t));
+        if (ret < 0) {
+            return ret;
+        }
+
+        ret = qcow2_read_bitmap_table(bs, bm, &bitmap_table);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: Could not read bitmap table of bitmap "
+                    "'%s': %s\n", bm->name, strerror(-ret));
+            res->corruptions++;
+            continue;
+        }
+
+        for (i = 0; i < bm->table_size; i++) {
+            uint64_t offset = bitmap_table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+            if (offset == 0) {
+                continue;
+            }
+
+            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                                offset, s->cluster_size);
+            if (ret < 0) {
+                g_free(bitmap_table);
+                return ret;
+            }
+        }
+        g_free(bitmap_table);
+    }
+
+    return 0;
+}
+
 /*
  * Calculates an in-memory refcount table.
  */
@@ -1840,6 +2019,26 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* persistent bitmaps */
+    ret = check_refcounts_bitmaps(bs, res, refcount_table, nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* metadata journal */
+    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+                        s->journal_offset, s->journal_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* deduplication index */
+    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+                        s->dedup_index_offset, s->dedup_index_size);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* refcount data */
     ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
                         s->refcount_table_offset,
@@ -347,6 +347,11 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     uint64_t *l1_table = NULL;
     int64_t l1_table_offset;
 
+    /* The data file is not copied on write, so it cannot be snapshotted */
+    if (has_data_file(s)) {
+        return -ENOTSUP;
+    }
+
     if (s->nb_snapshots >= QCOW_MAX_SNAPSHOTS) {
         return -EFBIG;
     }
@@ -0,0 +1,308 @@
+/*
+ * Compression and encryption of clusters for the QCOW version 2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Compressing, decompressing and encrypting clusters is CPU bound, so it
+ * is done in the thread pool of the AioContext of the image when called
+ * from a coroutine.  The compression type of an image is recorded in its
+ * header; compressed clusters contain the raw compressed stream without any
+ * header, which may be followed by padding up to the next sector boundary.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "block/thread-pool.h"
+
+typedef ssize_t Qcow2CompressFunc(void *dest, size_t dest_size,
+                                  const void *src, size_t src_size);
+
+/*
+ * Compresses @src_size bytes from @src into @dest.
+ *
+ * Returns the size of the compressed data, -ENOMEM if it does not fit into
+ * @dest_size bytes, or -EIO on other errors.
+ */
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (void *) src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK) ? -ENOMEM : -EIO;
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+/*
+ * Decompresses @src into exactly @dest_size bytes at @dest.  @src may
+ * contain padding after the compressed stream.
+ *
+ * Returns 0 on success and -EIO on failure.
+ */
+static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret = 0;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.next_in = (void *) src;
+    strm.avail_in = src_size;
+    strm.next_out = dest;
+    strm.avail_out = dest_size;
+
+    if (inflateInit2(&strm, -12) != Z_OK) {
+        return -EIO;
+    }
+
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || strm.avail_out != 0) {
+        ret = -EIO;
+    } else {
+        ret = 0;
+    }
+
+    inflateEnd(&strm);
+    return ret;
+}
+
+#ifdef CONFIG_ZSTD
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    size_t ret;
+
+    ret = ZSTD_compress(dest, dest_size, src, src_size, ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(ret)) {
+        return ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall
+               ? -ENOMEM : -EIO;
+    }
+
+    return ret;
+}
+
+static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer input = { src, src_size, 0 };
+    ZSTD_outBuffer output = { dest, dest_size, 0 };
+    ssize_t ret = 0;
+    size_t zret;
+
+    dctx = ZSTD_createDCtx();
+    if (!dctx) {
+        return -EIO;
+    }
+
+    /* Decode a single frame; the padding after it is ignored */
+    do {
+        zret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(zret)) {
+            ret = -EIO;
+            break;
+        }
+    } while (zret != 0 && output.pos < output.size &&
+             input.pos < input.size);
+
+    if (ret == 0 && output.pos != dest_size) {
+        ret = -EIO;
+    }
+
+    ZSTD_freeDCtx(dctx);
+    return ret;
+}
+#endif
+
+static Qcow2CompressFunc *qcow2_compress_func(BDRVQcow2State *s)
+{
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return qcow2_zlib_compress;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return qcow2_zstd_compress;
+#endif
+    default:
+        abort();
+    }
+}
+
+static Qcow2CompressFunc *qcow2_decompress_func(BDRVQcow2State *s)
+{
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return qcow2_zlib_decompress;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return qcow2_zstd_decompress;
+#endif
+    default:
+        abort();
+    }
+}
+
+/*
+ * Returns true if this build can read and write clusters compressed with
+ * @type.
+ */
+bool qcow2_compression_type_supported(Qcow2CompressionType type)
+{
+    switch (type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return true;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+typedef struct Qcow2CompressData {
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    Qcow2CompressFunc *func;
+    ssize_t ret;
+} Qcow2CompressData;
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size);
+    return 0;
+}
+
+static ssize_t coroutine_fn
+qcow2_co_do_compress(BlockDriverState *bs, Qcow2CompressFunc *func,
+                     void *dest, size_t dest_size,
+                     const void *src, size_t src_size)
+{
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CompressData data = {
+        .dest       = dest,
+        .dest_size  = dest_size,
+        .src        = src,
+        .src_size   = src_size,
+        .func       = func,
+    };
+
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &data);
+    return data.ret;
+}
+
+/*
+ * Compresses one cluster in a worker thread.  See qcow2_zlib_compress() for
+ * the return value.
+ */
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size)
+{
+    return qcow2_co_do_compress(bs, qcow2_compress_func(bs->opaque),
+                                dest, dest_size, src, src_size);
+}
+
+/*
+ * Decompresses one cluster, in a worker thread if called from a coroutine.
+ * Returns 0 on success and -EIO if the data is corrupted.
+ */
+int qcow2_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                     const void *src, size_t src_size)
+{
+    Qcow2CompressFunc *func = qcow2_decompress_func(bs->opaque);
+
+    if (qemu_in_coroutine()) {
+        return qcow2_co_do_compress(bs, func, dest, dest_size, src, src_size);
+    }
+    return func(dest, dest_size, src, src_size);
+}
+
+/* Below this, handing the work to a thread costs more than it saves */
+#define QCOW2_CRYPT_THREAD_MIN_SECTORS 16
+
+typedef struct Qcow2CryptData {
+    BDRVQcow2State *s;
+    int64_t sector_num;
+    uint8_t *out_buf;
+    const uint8_t *in_buf;
+    int nb_sectors;
+    bool enc;
+    Error **errp;
+    int ret;
+} Qcow2CryptData;
+
+static int qcow2_crypt_pool_func(void *opaque)
+{
+    Qcow2CryptData *data = opaque;
+
+    data->ret = qcow2_encrypt_sectors(data->s, data->sector_num,
+                                      data->out_buf, data->in_buf,
+                                      data->nb_sectors, data->enc,
+                                      data->errp);
+    return 0;
+}
+
+/*
+ * Encrypts or decrypts sectors with qcow2_encrypt_sectors(), in a worker
+ * thread if called from a coroutine.  The caller holds s->lock, which also
+ * serializes the uses of the IV of s->cipher.
+ */
+int qcow2_crypt_sectors(BlockDriverState *bs, int64_t sector_num,
+                        uint8_t *out_buf, const uint8_t *in_buf,
+                        int nb_sectors, bool enc, Error **errp)
+{
+    ThreadPool *pool;
+    Qcow2CryptData data = {
+        .s          = bs->opaque,
+        .sector_num = sector_num,
+        .out_buf    = out_buf,
+        .in_buf     = in_buf,
+        .nb_sectors = nb_sectors,
+        .enc        = enc,
+        .errp       = errp,
+    };
+
+    if (!qemu_in_coroutine() || nb_sectors < QCOW2_CRYPT_THREAD_MIN_SECTORS) {
+        qcow2_crypt_pool_func(&data);
+        return data.ret;
+    }
+
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    thread_pool_submit_co(pool, qcow2_crypt_pool_func, &data);
+    return data.ret;
+}
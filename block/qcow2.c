@@ -26,7 +26,6 @@
 #include "block/block_int.h"
 #include "sysemu/block-backend.h"
 #include "qemu/module.h"
-#include <zlib.h>
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
@@ -62,6 +61,10 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
+#define  QCOW2_EXT_MAGIC_JOURNAL 0x6a726e6c
+#define  QCOW2_EXT_MAGIC_DEDUP 0x64647570
+#define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -91,6 +94,9 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
     QCowExtension ext;
     uint64_t offset;
     int ret;
+    Qcow2BitmapHeaderExt bitmaps_ext;
+    Qcow2JournalHeaderExt journal_ext;
+    Qcow2DedupHeaderExt dedup_ext;
 
 #ifdef DEBUG_EXT
     printf("qcow2_read_extensions: start=%ld end=%ld\n", start_offset, end_offset);
@@ -161,6 +167,156 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_BITMAPS:
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_setg(errp, "ERROR: bitmaps_ext: Invalid extension "
+                           "length");
+                return -EINVAL;
+            }
+
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                error_report("WARNING: a program lacking bitmap support "
+                             "modified this file, so all bitmaps are now "
+                             "considered inconsistent");
+                break;
+            }
+
+            ret = bdrv_pread(bs->file->bs, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: bitmaps_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            be32_to_cpus(&bitmaps_ext.nb_bitmaps);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_size);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_offset);
+
+            if (bitmaps_ext.reserved32 != 0) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Reserved field is not zero");
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.nb_bitmaps == 0 ||
+                bitmaps_ext.nb_bitmaps > QCOW2_MAX_BITMAPS) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Invalid number of bitmaps %" PRIu32,
+                           bitmaps_ext.nb_bitmaps);
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.bitmap_directory_size == 0 ||
+                bitmaps_ext.bitmap_directory_size >
+                QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Invalid bitmap directory size");
+                return -EINVAL;
+            }
+
+            if (offset_into_cluster(s, bitmaps_ext.bitmap_directory_offset)) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Invalid bitmap directory offset");
+                return -EINVAL;
+            }
+
+            s->nb_bitmaps = bitmaps_ext.nb_bitmaps;
+            s->bitmap_directory_offset =
+                    bitmaps_ext.bitmap_directory_offset;
+            s->bitmap_directory_size =
+                    bitmaps_ext.bitmap_directory_size;
+            break;
+
+        case QCOW2_EXT_MAGIC_JOURNAL:
+            if (ext.len != sizeof(journal_ext)) {
+                error_setg(errp, "ERROR: journal_ext: Invalid extension "
+                           "length");
+                return -EINVAL;
+            }
+
+            ret = bdrv_pread(bs->file->bs, offset, &journal_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: journal_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            be64_to_cpus(&journal_ext.journal_offset);
+            be64_to_cpus(&journal_ext.journal_size);
+
+            if (journal_ext.journal_size < QCOW2_MIN_JOURNAL_SIZE ||
+                journal_ext.journal_size > QCOW2_MAX_JOURNAL_SIZE ||
+                offset_into_cluster(s, journal_ext.journal_size)) {
+                error_setg(errp, "ERROR: journal_ext: "
+                           "Invalid journal size");
+                return -EINVAL;
+            }
+
+            if (journal_ext.journal_offset == 0 ||
+                offset_into_cluster(s, journal_ext.journal_offset) ||
+                journal_ext.journal_offset > INT64_MAX -
+                                             journal_ext.journal_size) {
+                error_setg(errp, "ERROR: journal_ext: "
+                           "Invalid journal offset");
+                return -EINVAL;
+            }
+
+            s->journal_offset = journal_ext.journal_offset;
+            s->journal_size = journal_ext.journal_size;
+            break;
+
+        case QCOW2_EXT_MAGIC_DEDUP:
+            if (ext.len != sizeof(dedup_ext)) {
+                error_setg(errp, "ERROR: dedup_ext: Invalid extension length");
+                return -EINVAL;
+            }
+
+            ret = bdrv_pread(bs->file->bs, offset, &dedup_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: dedup_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            be64_to_cpus(&dedup_ext.index_offset);
+            be64_to_cpus(&dedup_ext.index_size);
+
+            if (dedup_ext.index_size == 0 ||
+                dedup_ext.index_size > QCOW2_MAX_DEDUP_INDEX_SIZE ||
+                offset_into_cluster(s, dedup_ext.index_size)) {
+                error_setg(errp, "ERROR: dedup_ext: Invalid index size");
+                return -EINVAL;
+            }
+
+            if (dedup_ext.index_offset == 0 ||
+                offset_into_cluster(s, dedup_ext.index_offset) ||
+                dedup_ext.index_offset > INT64_MAX - dedup_ext.index_size) {
+                error_setg(errp, "ERROR: dedup_ext: Invalid index offset");
+                return -EINVAL;
+            }
+
+            s->dedup_index_offset = dedup_ext.index_offset;
+            s->dedup_index_size = dedup_ext.index_size;
+            break;
+
+        case QCOW2_EXT_MAGIC_DATA_FILE:
+            if (ext.len == 0 || ext.len >= PATH_MAX) {
+                error_setg(errp, "ERROR: data_file_ext: Invalid file name "
+                           "length");
+                return -EINVAL;
+            }
+
+            g_free(s->image_data_file);
+            s->image_data_file = g_malloc0(ext.len + 1);
+            ret = bdrv_pread(bs->file->bs, offset, s->image_data_file,
+                             ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: data_file_ext: "
+                                 "Could not read file name");
+                return ret;
+            }
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -335,17 +491,33 @@ int qcow2_mark_consistent(BlockDriverState *bs)
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    int ret;
+
+    /* Repairs write some metadata directly, which replaying the journal
+     * must not undo */
+    if (fix) {
+        ret = qcow2_journal_suspend(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = qcow2_check_refcounts(bs, result, fix);
     if (ret < 0) {
-        return ret;
+        goto out;
     }
 
     if (fix && result->check_errors == 0 && result->corruptions == 0) {
         ret = qcow2_mark_clean(bs);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
-        return qcow2_mark_consistent(bs);
+        ret = qcow2_mark_consistent(bs);
+    }
+
+out:
+    if (fix) {
+        qcow2_journal_resume(bs);
     }
     return ret;
 }
@@ -464,6 +636,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum L2 table cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
         {
             .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -474,6 +651,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_BITMAP_CHECKPOINT_INTERVAL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Store persistent dirty bitmaps after this time "
+                    "(in seconds)",
+        },
         { /* end of list */ }
     },
 };
@@ -521,19 +704,95 @@ static void cache_clean_timer_del(BlockDriverState *bs)
     }
 }
 
+static void coroutine_fn bitmap_checkpoint_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    Error *local_err = NULL;
+
+    qemu_co_mutex_lock(&s->lock);
+    qcow2_store_persistent_dirty_bitmaps(bs, &local_err);
+    qemu_co_mutex_unlock(&s->lock);
+    if (local_err) {
+        error_report_err(local_err);
+    }
+
+    s->bitmap_checkpoint_co = NULL;
+}
+
+static void bitmap_checkpoint_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+
+    /* Stored bitmaps that are not marked in use are still up to date */
+    if (!s->bitmap_checkpoint_co && qcow2_has_persistent_dirty_bitmaps(bs) &&
+        (s->bitmaps_in_use || QTAILQ_EMPTY(&s->bitmaps))) {
+        s->bitmap_checkpoint_co = qemu_coroutine_create(bitmap_checkpoint_entry);
+        qemu_coroutine_enter(s->bitmap_checkpoint_co, bs);
+    }
+    timer_mod(s->bitmap_checkpoint_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+              (int64_t) s->bitmap_checkpoint_interval * 1000);
+}
+
+static void bitmap_checkpoint_timer_init(BlockDriverState *bs,
+                                         AioContext *context)
+{
+    BDRVQcow2State *s = bs->opaque;
+    if (s->bitmap_checkpoint_interval > 0) {
+        s->bitmap_checkpoint_timer =
+            aio_timer_new(context, QEMU_CLOCK_VIRTUAL, SCALE_MS,
+                          bitmap_checkpoint_timer_cb, bs);
+        timer_mod(s->bitmap_checkpoint_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+                  (int64_t) s->bitmap_checkpoint_interval * 1000);
+    }
+}
+
+/* Stops the checkpoint timer and waits for a running checkpoint */
+static void bitmap_checkpoint_timer_del(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    if (s->bitmap_checkpoint_timer) {
+        timer_del(s->bitmap_checkpoint_timer);
+        timer_free(s->bitmap_checkpoint_timer);
+        s->bitmap_checkpoint_timer = NULL;
+    }
+    while (s->bitmap_checkpoint_co) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+}
+
 static void qcow2_detach_aio_context(BlockDriverState *bs)
 {
+    BDRVQcow2State *s = bs->opaque;
+
     cache_clean_timer_del(bs);
+    bitmap_checkpoint_timer_del(bs);
+
+    /* block.c only knows about bs->file and the backing file */
+    if (has_data_file(s)) {
+        bdrv_detach_aio_context(s->data_file->bs);
+    }
 }
 
 static void qcow2_attach_aio_context(BlockDriverState *bs,
                                      AioContext *new_context)
 {
+    BDRVQcow2State *s = bs->opaque;
+
+    if (has_data_file(s)) {
+        bdrv_attach_aio_context(s->data_file->bs, new_context);
+    }
+
     cache_clean_timer_init(bs, new_context);
+    bitmap_checkpoint_timer_init(bs, new_context);
 }
 
 static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
                              uint64_t *l2_cache_size,
+                             uint64_t *l2_cache_entry_size,
                              uint64_t *refcount_cache_size, Error **errp)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -549,6 +808,17 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     *refcount_cache_size = qemu_opt_get_size(opts,
                                              QCOW2_OPT_REFCOUNT_CACHE_SIZE, 0);
 
+    *l2_cache_entry_size = qemu_opt_get_size(
+        opts, QCOW2_OPT_L2_CACHE_ENTRY_SIZE, s->cluster_size);
+    if (*l2_cache_entry_size < MIN_L2_CACHE_ENTRY_SIZE ||
+        *l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(*l2_cache_entry_size)) {
+        error_setg(errp, QCOW2_OPT_L2_CACHE_ENTRY_SIZE " must be a power of "
+                   "two between %d and the cluster size (%d)",
+                   MIN_L2_CACHE_ENTRY_SIZE, s->cluster_size);
+        return;
+    }
+
     if (combined_cache_size_set) {
         if (l2_cache_size_set && refcount_cache_size_set) {
             error_setg(errp, QCOW2_OPT_CACHE_SIZE ", " QCOW2_OPT_L2_CACHE_SIZE
@@ -594,10 +864,13 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
 typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    int l2_slice_size; /* number of L2 entries per L2 cache entry */
     bool use_lazy_refcounts;
+    bool journal_active;
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t bitmap_checkpoint_interval;
 } Qcow2ReopenState;
 
 static int qcow2_update_options_prepare(BlockDriverState *bs,
@@ -609,7 +882,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     QemuOpts *opts = NULL;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
     int i;
     Error *local_err = NULL;
     int ret;
@@ -623,15 +896,15 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     }
 
     /* get L2 table/refcount block cache size from command line options */
-    read_cache_sizes(bs, opts, &l2_cache_size, &refcount_cache_size,
-                     &local_err);
+    read_cache_sizes(bs, opts, &l2_cache_size, &l2_cache_entry_size,
+                     &refcount_cache_size, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
+    l2_cache_size /= l2_cache_entry_size;
     if (l2_cache_size < MIN_L2_CACHE_SIZE) {
         l2_cache_size = MIN_L2_CACHE_SIZE;
     }
@@ -669,14 +942,29 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
+    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (r->l2_table_cache == NULL || r->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
         goto fail;
     }
 
+    /* Caches that are too big for the journal are flushed in the usual
+     * ordered way, and that must not be undone by replaying the journal */
+    r->journal_active = s->journal_size &&
+        qcow2_journal_fits(bs, r->l2_table_cache, r->refcount_block_cache);
+    if (s->journal_active && !r->journal_active) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to empty the journal");
+            goto fail;
+        }
+    }
+
     /* New interval for cache cleanup timer */
     r->cache_clean_interval =
         qemu_opt_get_number(opts, QCOW2_OPT_CACHE_CLEAN_INTERVAL,
@@ -687,6 +975,16 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* New interval for the bitmap checkpoint timer */
+    r->bitmap_checkpoint_interval =
+        qemu_opt_get_number(opts, QCOW2_OPT_BITMAP_CHECKPOINT_INTERVAL,
+                            s->bitmap_checkpoint_interval);
+    if (r->bitmap_checkpoint_interval > UINT_MAX) {
+        error_setg(errp, "Bitmap checkpoint interval too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -777,6 +1075,9 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
+    s->l2_slice_size = r->l2_slice_size;
+    qcow2_cache_budget_register(bs, s->l2_table_cache);
+    s->journal_active = r->journal_active;
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
@@ -790,6 +1091,12 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         s->cache_clean_interval = r->cache_clean_interval;
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
+
+    if (s->bitmap_checkpoint_interval != r->bitmap_checkpoint_interval) {
+        bitmap_checkpoint_timer_del(bs);
+        s->bitmap_checkpoint_interval = r->bitmap_checkpoint_interval;
+        bitmap_checkpoint_timer_init(bs, bdrv_get_aio_context(bs));
+    }
 }
 
 static void qcow2_update_options_abort(BlockDriverState *bs,
@@ -819,6 +1126,66 @@ static int qcow2_update_options(BlockDriverState *bs, QDict *options,
     return ret;
 }
 
+/* Check whether the data file is given in the runtime options */
+static bool qcow2_has_data_file_option(QDict *options)
+{
+    const QDictEntry *e;
+
+    for (e = qdict_first(options); e; e = qdict_next(options, e)) {
+        if (!strcmp(e->key, QCOW2_OPT_DATA_FILE) ||
+            strstart(e->key, QCOW2_OPT_DATA_FILE ".", NULL)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Open the external data file, either as given in the runtime options or
+ * with the file name stored in the image.  Relative file names in the image
+ * are relative to the image file.
+ */
+static int qcow2_open_data_file(BlockDriverState *bs, QDict *options,
+                                Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    char *filename = NULL;
+    Error *local_err = NULL;
+
+    if (s->crypt_method_header) {
+        error_setg(errp, "Encryption is not supported with an external data "
+                   "file");
+        return -ENOTSUP;
+    }
+    if (s->image_backing_file) {
+        error_setg(errp, "Backing files are not supported with an external "
+                   "data file");
+        return -ENOTSUP;
+    }
+
+    if (s->image_data_file && !qcow2_has_data_file_option(options)) {
+        filename = g_malloc0(PATH_MAX);
+        bdrv_get_full_backing_filename_from_filename(bs->filename,
+                                                     s->image_data_file,
+                                                     filename, PATH_MAX,
+                                                     &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            g_free(filename);
+            return -EINVAL;
+        }
+    }
+
+    s->data_file = bdrv_open_child(filename, options, QCOW2_OPT_DATA_FILE,
+                                   bs, &child_file, false, &local_err);
+    g_free(filename);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return -EINVAL;
+    }
+    return 0;
+}
+
 static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
                       Error **errp)
 {
@@ -829,6 +1196,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     Error *local_err = NULL;
     uint64_t ext_end;
     uint64_t l1_vm_state_index;
+    uint64_t autoclear_features;
 
     ret = bdrv_pread(bs->file->bs, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -902,6 +1270,12 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    if (header.header_length > offsetof(QCowHeader, compression_type)) {
+        s->compression_type = header.compression_type;
+    } else {
+        s->compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    }
+
     if (header.header_length > sizeof(header)) {
         s->unknown_header_fields_size = header.header_length - sizeof(header);
         s->unknown_header_fields = g_malloc(s->unknown_header_fields_size);
@@ -955,6 +1329,21 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Check support for various header values */
+    if (!!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION) !=
+        (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB)) {
+        error_setg(errp, "Compression type bit and compression type do not "
+                   "match");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (s->compression_type >= QCOW2_COMPRESSION_TYPE__MAX ||
+        !qcow2_compression_type_supported(s->compression_type)) {
+        report_unsupported(bs, errp, "Compression type %d",
+                           s->compression_type);
+        ret = -ENOTSUP;
+        goto fail;
+    }
+
     if (header.refcount_order > 6) {
         error_setg(errp, "Reference count entry width too large; may not "
                    "exceed 64 bits");
@@ -982,7 +1371,23 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         bs->encrypted = 1;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    if (has_subclusters(s)) {
+        if (s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+            error_setg(errp, "Extended L2 entries need a cluster size of at "
+                       "least %d bytes", 1 << MIN_EXTL2_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->subclusters_per_cluster = QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER;
+    } else {
+        s->subclusters_per_cluster = 1;
+    }
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_sectors = s->subcluster_size >> BDRV_SECTOR_BITS;
+    s->subcluster_bits = ctz32(s->subcluster_size);
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
@@ -1103,6 +1508,8 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     QLIST_INIT(&s->cluster_allocs);
     QTAILQ_INIT(&s->discards);
+    QTAILQ_INIT(&s->bitmaps);
+    QLIST_INIT(&s->inflight_writes);
 
     /* read qcow2 extensions */
     if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL,
@@ -1112,6 +1519,20 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* Replay the metadata journal before anything else reads metadata */
+    if (!!(s->incompatible_features & QCOW2_INCOMPAT_JOURNAL) !=
+        !!s->journal_size) {
+        error_setg(errp, "Journal feature bit and journal extension do not "
+                   "match");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    ret = qcow2_journal_open(bs, flags, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
     /* read the backing file name */
     if (header.backing_file_offset != 0) {
         len = header.backing_file_size;
@@ -1131,6 +1552,21 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         s->image_backing_file = g_strdup(bs->backing_file);
     }
 
+    /* Guest data lives either in the image file or in a data file */
+    if (has_data_file(s)) {
+        ret = qcow2_open_data_file(bs, options, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    } else if (qcow2_has_data_file_option(options)) {
+        error_setg(errp, "'%s' can only be used with images that have an "
+                   "external data file", QCOW2_OPT_DATA_FILE);
+        ret = -EINVAL;
+        goto fail;
+    } else {
+        s->data_file = bs->file;
+    }
+
     /* Internal snapshots */
     s->snapshots_offset = header.snapshots_offset;
     s->nb_snapshots = header.nb_snapshots;
@@ -1141,9 +1577,38 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    /* Persistent dirty bitmaps; the directory must be known before a dirty
+     * image is repaired, so that the bitmap clusters are not leaked */
+    ret = qcow2_read_bitmap_directory(bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* The deduplication index is not used for encrypted images or with a
+     * data file; it is emptied if the autoclear bit shows that it may be
+     * stale */
+    if (!s->crypt_method_header && !has_data_file(s)) {
+        ret = qcow2_dedup_open(bs, flags, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* Clear unknown autoclear feature bits, and the bitmaps bit if there is
+     * no valid bitmap extension.  The deduplication bit is set as soon as
+     * the index is maintained. */
+    autoclear_features = s->autoclear_features & QCOW2_AUTOCLEAR_MASK;
+    if (s->nb_bitmaps == 0) {
+        autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+    if (s->dedup_index) {
+        autoclear_features |= QCOW2_AUTOCLEAR_DEDUP;
+    } else {
+        autoclear_features &= ~QCOW2_AUTOCLEAR_DEDUP;
+    }
+    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) &&
+        s->autoclear_features != autoclear_features) {
+        s->autoclear_features = autoclear_features;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -1166,6 +1631,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    /* The bitmaps belong to the source while migrating, they are loaded
+     * by qcow2_invalidate_cache().  'qemu-img check' leaves them alone. */
+    if (!(flags & (BDRV_O_INACTIVE | BDRV_O_CHECK))) {
+        ret = qcow2_load_persistent_dirty_bitmaps(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1175,14 +1649,23 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     return ret;
 
  fail:
+    if (has_data_file(s) && s->data_file) {
+        bdrv_unref_child(bs, s->data_file);
+    }
+    s->data_file = NULL;
+    g_free(s->image_data_file);
+    s->image_data_file = NULL;
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
+    qcow2_free_bitmap_directory(bs);
+    qcow2_dedup_close(bs);
     qcow2_refcount_close(bs);
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
     cache_clean_timer_del(bs);
+    bitmap_checkpoint_timer_del(bs);
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
@@ -1198,6 +1681,18 @@ static void qcow2_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     BDRVQcow2State *s = bs->opaque;
 
+    if (has_data_file(s)) {
+        BlockDriverState *data_bs = s->data_file->bs;
+
+        /* Guest requests are passed through to the data file unchanged */
+        bs->bl.min_mem_alignment = MAX(bs->bl.min_mem_alignment,
+                                       data_bs->bl.min_mem_alignment);
+        bs->bl.opt_mem_alignment = MAX(bs->bl.opt_mem_alignment,
+                                       data_bs->bl.opt_mem_alignment);
+        bs->bl.write_zeroes_alignment = data_bs->bl.write_zeroes_alignment;
+        return;
+    }
+
     bs->bl.write_zeroes_alignment = s->cluster_sectors;
 }
 
@@ -1253,6 +1748,11 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
 
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        ret = qcow2_store_persistent_dirty_bitmaps(state->bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -1339,6 +1839,13 @@ static int64_t coroutine_fn qcow2_co_get_block_status(BlockDriverState *bs,
     int64_t status = 0;
 
     *pnum = nb_sectors;
+    if (has_data_file(s)) {
+        /* The whole image is allocated, at identity offsets */
+        *file = s->data_file->bs;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+               (sector_num << BDRV_SECTOR_BITS);
+    }
+
     qemu_co_mutex_lock(&s->lock);
     ret = qcow2_get_cluster_offset(bs, sector_num << 9, pnum, &cluster_offset);
     qemu_co_mutex_unlock(&s->lock);
@@ -1390,6 +1897,13 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     QEMUIOVector hd_qiov;
     uint8_t *cluster_data = NULL;
 
+    /* Guest data is at identity offsets, the L2 tables are not needed */
+    if (has_data_file(s)) {
+        BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
+        return bdrv_co_readv(s->data_file->bs, sector_num, remaining_sectors,
+                             qiov);
+    }
+
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
     qemu_co_mutex_lock(&s->lock);
@@ -1506,9 +2020,9 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             if (bs->encrypted) {
                 assert(s->cipher);
                 Error *err = NULL;
-                if (qcow2_encrypt_sectors(s, sector_num,  cluster_data,
-                                          cluster_data, cur_nr_sectors, false,
-                                          &err) < 0) {
+                if (qcow2_crypt_sectors(bs, sector_num, cluster_data,
+                                        cluster_data, cur_nr_sectors, false,
+                                        &err) < 0) {
                     error_free(err);
                     ret = -EIO;
                     goto fail;
@@ -1553,16 +2067,38 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     uint64_t bytes_done = 0;
     uint8_t *cluster_data = NULL;
     QCowL2Meta *l2meta = NULL;
+    Qcow2InFlightWrite inflight;
+    uint64_t hash = 0;
+    bool dedup;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), sector_num,
                                  remaining_sectors);
 
+    /* Only the bitmaps need an update before writing to the data file */
+    if (has_data_file(s)) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_bitmaps_before_write(bs, sector_num, remaining_sectors);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret == 0) {
+            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+            ret = bdrv_co_writev(s->data_file->bs, sector_num,
+                                 remaining_sectors, qiov);
+        }
+        trace_qcow2_writev_done_req(qemu_coroutine_self(), ret);
+        return ret;
+    }
+
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
 
     qemu_co_mutex_lock(&s->lock);
 
+    ret = qcow2_bitmaps_before_write(bs, sector_num, remaining_sectors);
+    if (ret < 0) {
+        goto fail;
+    }
+
     while (remaining_sectors != 0) {
 
         l2meta = NULL;
@@ -1577,6 +2113,20 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                 QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors - index_in_cluster;
         }
 
+        /* Whole clusters may already be stored elsewhere in the image */
+        dedup = s->dedup_index && index_in_cluster == 0 &&
+                cur_nr_sectors >= s->cluster_sectors;
+        if (dedup) {
+            cur_nr_sectors = s->cluster_sectors;
+            ret = qcow2_dedup_write(bs, sector_num << 9, qiov, bytes_done,
+                                    &hash);
+            if (ret < 0) {
+                goto fail;
+            } else if (ret > 0) {
+                goto next;
+            }
+        }
+
         ret = qcow2_alloc_cluster_offset(bs, sector_num << 9,
             &cur_nr_sectors, &cluster_offset, &l2meta);
         if (ret < 0) {
@@ -1606,9 +2156,9 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                    QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
             qemu_iovec_to_buf(&hd_qiov, 0, cluster_data, hd_qiov.size);
 
-            if (qcow2_encrypt_sectors(s, sector_num, cluster_data,
-                                      cluster_data, cur_nr_sectors,
-                                      true, &err) < 0) {
+            if (qcow2_crypt_sectors(bs, sector_num, cluster_data,
+                                    cluster_data, cur_nr_sectors,
+                                    true, &err) < 0) {
                 error_free(err);
                 ret = -EIO;
                 goto fail;
@@ -1626,6 +2176,15 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             goto fail;
         }
 
+        /* Deduplication must not compare against data that is changing */
+        if (s->dedup_index && l2meta == NULL) {
+            inflight = (Qcow2InFlightWrite) {
+                .offset = cluster_offset + index_in_cluster * BDRV_SECTOR_SIZE,
+                .bytes  = cur_nr_sectors * BDRV_SECTOR_SIZE,
+            };
+            QLIST_INSERT_HEAD(&s->inflight_writes, &inflight, next);
+        }
+
         qemu_co_mutex_unlock(&s->lock);
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
         trace_qcow2_writev_data(qemu_coroutine_self(),
@@ -1634,6 +2193,9 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                              (cluster_offset >> 9) + index_in_cluster,
                              cur_nr_sectors, &hd_qiov);
         qemu_co_mutex_lock(&s->lock);
+        if (s->dedup_index && l2meta == NULL) {
+            QLIST_REMOVE(&inflight, next);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -1658,6 +2220,11 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             l2meta = next;
         }
 
+        if (dedup && cur_nr_sectors == s->cluster_sectors) {
+            qcow2_dedup_insert(bs, hash, cluster_offset, sector_num << 9);
+        }
+
+next:
         remaining_sectors -= cur_nr_sectors;
         sector_num += cur_nr_sectors;
         bytes_done += cur_nr_sectors * 512;
@@ -1691,8 +2258,20 @@ fail:
 static int qcow2_inactivate(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
+    Error *local_err = NULL;
     int ret, result = 0;
 
+    bitmap_checkpoint_timer_del(bs);
+
+    ret = qcow2_store_persistent_dirty_bitmaps(bs, &local_err);
+    if (ret) {
+        result = ret;
+        error_report_err(local_err);
+    } else {
+        /* Whoever activates the image next loads them again */
+        qcow2_release_persistent_dirty_bitmaps(bs);
+    }
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -1708,7 +2287,22 @@ static int qcow2_inactivate(BlockDriverState *bs)
     }
 
     if (result == 0) {
-        qcow2_mark_clean(bs);
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret) {
+            result = ret;
+            error_report("Failed to empty the journal: %s", strerror(-ret));
+        }
+    }
+
+    ret = qcow2_dedup_flush(bs);
+    if (ret) {
+        result = ret;
+        error_report("Failed to write the deduplication index: %s",
+                     strerror(-ret));
+    }
+
+    if (result == 0) {
+        qcow2_mark_clean(bs);
     }
 
     return result;
@@ -1717,15 +2311,19 @@ static int qcow2_inactivate(BlockDriverState *bs)
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
-    qemu_vfree(s->l1_table);
-    /* else pre-write overlap checks in cache_destroy may crash */
-    s->l1_table = NULL;
 
+    /* Storing the bitmaps allocates clusters, so the L1 table is still
+     * needed for the overlap checks */
     if (!(s->flags & BDRV_O_INACTIVE)) {
         qcow2_inactivate(bs);
     }
 
+    qemu_vfree(s->l1_table);
+    /* else pre-write overlap checks in cache_destroy may crash */
+    s->l1_table = NULL;
+
     cache_clean_timer_del(bs);
+    bitmap_checkpoint_timer_del(bs);
     qcow2_cache_destroy(bs, s->l2_table_cache);
     qcow2_cache_destroy(bs, s->refcount_block_cache);
 
@@ -1738,10 +2336,18 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->image_backing_file);
     g_free(s->image_backing_format);
 
+    if (has_data_file(s)) {
+        bdrv_unref_child(bs, s->data_file);
+    }
+    s->data_file = NULL;
+    g_free(s->image_data_file);
+
     g_free(s->cluster_cache);
     qemu_vfree(s->cluster_data);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
+    qcow2_free_bitmap_directory(bs);
+    qcow2_dedup_close(bs);
 }
 
 static void qcow2_invalidate_cache(BlockDriverState *bs, Error **errp)
@@ -1839,7 +2445,13 @@ int qcow2_update_header(BlockDriverState *bs)
         goto fail;
     }
 
-    header_length = sizeof(*header) + s->unknown_header_fields_size;
+    /* The compression type may be omitted for zlib */
+    if (s->compression_type == QCOW2_COMPRESSION_TYPE_ZLIB &&
+        !s->unknown_header_fields_size) {
+        header_length = offsetof(QCowHeader, compression_type);
+    } else {
+        header_length = sizeof(*header) + s->unknown_header_fields_size;
+    }
     total_size = bs->total_sectors * BDRV_SECTOR_SIZE;
     refcount_table_clusters = s->refcount_table_size >> (s->cluster_bits - 3);
 
@@ -1865,6 +2477,7 @@ int qcow2_update_header(BlockDriverState *bs)
         .autoclear_features     = cpu_to_be64(s->autoclear_features),
         .refcount_order         = cpu_to_be32(s->refcount_order),
         .header_length          = cpu_to_be32(header_length),
+        .compression_type       = s->compression_type,
     };
 
     /* For older versions, write a shorter header */
@@ -1873,7 +2486,7 @@ int qcow2_update_header(BlockDriverState *bs)
         ret = offsetof(QCowHeader, incompatible_features);
         break;
     case 3:
-        ret = sizeof(*header);
+        ret = header_length - s->unknown_header_fields_size;
         break;
     default:
         ret = -EINVAL;
@@ -1923,11 +2536,41 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
                 .name = "corrupt bit",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_DATA_FILE_BITNR,
+                .name = "external data file",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
+                .name = "compression type",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_JOURNAL_BITNR,
+                .name = "metadata journal",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
                 .name = "lazy refcounts",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+                .name = "bitmaps",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_DEDUP_BITNR,
+                .name = "deduplication index",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1939,6 +2582,71 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Bitmap directory */
+    if (s->nb_bitmaps > 0) {
+        Qcow2BitmapHeaderExt bitmaps_header = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size =
+                cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                cpu_to_be64(s->bitmap_directory_offset),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS,
+                             &bitmaps_header, sizeof(bitmaps_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
+    /* Metadata journal */
+    if (s->journal_size) {
+        Qcow2JournalHeaderExt journal_header = {
+            .journal_offset = cpu_to_be64(s->journal_offset),
+            .journal_size   = cpu_to_be64(s->journal_size),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_JOURNAL,
+                             &journal_header, sizeof(journal_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
+    /* Deduplication index */
+    if (s->dedup_index_size) {
+        Qcow2DedupHeaderExt dedup_header = {
+            .index_offset   = cpu_to_be64(s->dedup_index_offset),
+            .index_size     = cpu_to_be64(s->dedup_index_size),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DEDUP,
+                             &dedup_header, sizeof(dedup_header), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
+    /* External data file name */
+    if (s->image_data_file) {
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DATA_FILE,
+                             s->image_data_file, strlen(s->image_data_file),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -1992,6 +2700,10 @@ static int qcow2_change_backing_file(BlockDriverState *bs,
 {
     BDRVQcow2State *s = bs->opaque;
 
+    if (has_data_file(s) && backing_file) {
+        return -ENOTSUP;
+    }
+
     pstrcpy(bs->backing_file, sizeof(bs->backing_file), backing_file ?: "");
     pstrcpy(bs->backing_format, sizeof(bs->backing_format), backing_fmt ?: "");
 
@@ -2004,17 +2716,64 @@ static int qcow2_change_backing_file(BlockDriverState *bs,
     return qcow2_update_header(bs);
 }
 
-static int preallocate(BlockDriverState *bs)
+/*
+ * Allocate space in the image file for @nb_sectors of guest data starting at
+ * @host_offset, according to @prealloc.
+ */
+static int preallocate_data(BlockDriverState *bs, uint64_t host_offset,
+                            int nb_sectors, PreallocMode prealloc)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockDriverState *data_bs = s->data_file->bs;
+    const int buf_sectors = (1 << 20) >> BDRV_SECTOR_BITS;
+    uint8_t *buf;
+    int num;
+    int ret = 0;
+
+    switch (prealloc) {
+    case PREALLOC_MODE_FALLOC:
+        /* Without BDRV_REQ_MAY_UNMAP the space is allocated, not discarded */
+        return bdrv_write_zeroes(data_bs, host_offset >> BDRV_SECTOR_BITS,
+                                 nb_sectors, 0);
+    case PREALLOC_MODE_FULL:
+        buf = qemu_blockalign0(data_bs, buf_sectors << BDRV_SECTOR_BITS);
+        while (nb_sectors) {
+            num = MIN(nb_sectors, buf_sectors);
+            ret = bdrv_write(data_bs, host_offset >> BDRV_SECTOR_BITS,
+                             buf, num);
+            if (ret < 0) {
+                break;
+            }
+            nb_sectors -= num;
+            host_offset += num << BDRV_SECTOR_BITS;
+        }
+        qemu_vfree(buf);
+        return ret;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Allocate the host clusters that back the guest data between @offset and
+ * @new_length, which are not allocated yet.  With PREALLOC_MODE_FALLOC or
+ * PREALLOC_MODE_FULL, the space for the data is allocated in the image file
+ * as well.
+ *
+ * The L2 tables and refcount blocks are only updated in the metadata caches,
+ * one run of contiguous clusters at a time, so they get written out in
+ * batches when the caches are flushed rather than once per cluster.
+ */
+static int preallocate(BlockDriverState *bs, uint64_t offset,
+                       uint64_t new_length, PreallocMode prealloc)
 {
     uint64_t nb_sectors;
-    uint64_t offset;
     uint64_t host_offset = 0;
     int num;
     int ret;
     QCowL2Meta *meta;
 
-    nb_sectors = bdrv_nb_sectors(bs);
-    offset = 0;
+    nb_sectors = (new_length - offset) >> BDRV_SECTOR_BITS;
 
     while (nb_sectors) {
         num = MIN(nb_sectors, INT_MAX >> BDRV_SECTOR_BITS);
@@ -2029,8 +2788,11 @@ static int preallocate(BlockDriverState *bs)
 
             ret = qcow2_alloc_cluster_link_l2(bs, meta);
             if (ret < 0) {
-                qcow2_free_any_clusters(bs, meta->alloc_offset,
-                                        meta->nb_clusters, QCOW2_DISCARD_NEVER);
+                if (!meta->keep_old_clusters) {
+                    qcow2_free_any_clusters(bs, meta->alloc_offset,
+                                            meta->nb_clusters,
+                                            QCOW2_DISCARD_NEVER);
+                }
                 return ret;
             }
 
@@ -2042,7 +2804,10 @@ static int preallocate(BlockDriverState *bs)
             meta = next;
         }
 
-        /* TODO Preallocate data if requested */
+        ret = preallocate_data(bs, host_offset, num, prealloc);
+        if (ret < 0) {
+            return ret;
+        }
 
         nb_sectors -= num;
         offset += num << BDRV_SECTOR_BITS;
@@ -2071,7 +2836,9 @@ static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, PreallocMode prealloc,
                          QemuOpts *opts, int version, int refcount_order,
-                         Error **errp)
+                         uint64_t journal_size, uint64_t dedup_index_size,
+                         Qcow2CompressionType compression_type,
+                         const char *data_file, Error **errp)
 {
     int cluster_bits;
     QDict *options;
@@ -2086,6 +2853,12 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         return -EINVAL;
     }
 
+    if ((flags & BLOCK_FLAG_EXTL2) && cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+        error_setg(errp, "Extended L2 entries need a cluster size of at "
+                   "least %dk", 1 << (MIN_EXTL2_CLUSTER_BITS - 10));
+        return -EINVAL;
+    }
+
     /*
      * Open the image file and write a minimal qcow2 header.
      *
@@ -2104,6 +2877,24 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     Error *local_err = NULL;
     int ret;
 
+    if (data_file) {
+        /* Guest data goes to the data file, so preallocate that one only */
+        qemu_opt_set_number(opts, BLOCK_OPT_SIZE, total_size, &error_abort);
+        qemu_opt_set(opts, BLOCK_OPT_PREALLOC,
+                     PreallocMode_lookup[prealloc == PREALLOC_MODE_METADATA ?
+                                         PREALLOC_MODE_OFF : prealloc],
+                     &error_abort);
+        ret = bdrv_create_file(data_file, opts, &local_err);
+        if (ret < 0) {
+            error_propagate(errp, local_err);
+            return ret;
+        }
+        /* The qcow2 file itself starts out empty */
+        prealloc = PREALLOC_MODE_OFF;
+        qemu_opt_get_size_del(opts, BLOCK_OPT_SIZE, 0);
+        g_free(qemu_opt_get_del(opts, BLOCK_OPT_PREALLOC));
+    }
+
     if (prealloc == PREALLOC_MODE_FULL || prealloc == PREALLOC_MODE_FALLOC) {
         /* Note: The following calculation does not need to be exact; if it is a
          * bit off, either some bytes will be "leaked" (which is fine) or we
@@ -2116,6 +2907,9 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         int refblock_bits, refblock_size;
         /* refcount entry size in bytes */
         double rces = (1 << refcount_order) / 8.;
+        /* L2 entry size in bytes */
+        size_t l2es = (flags & BLOCK_FLAG_EXTL2) ? L2E_SIZE_EXTENDED
+                                                 : L2E_SIZE_NORMAL;
 
         /* see qcow2_open() */
         refblock_bits = cluster_bits - (refcount_order - 3);
@@ -2124,13 +2918,19 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         /* header: 1 cluster */
         meta_size += cluster_size;
 
+        /* metadata journal */
+        meta_size += align_offset(journal_size, cluster_size);
+
+        /* deduplication index */
+        meta_size += align_offset(dedup_index_size, cluster_size);
+
         /* total size of L2 tables */
         nl2e = aligned_total_size / cluster_size;
-        nl2e = align_offset(nl2e, cluster_size / sizeof(uint64_t));
-        meta_size += nl2e * sizeof(uint64_t);
+        nl2e = align_offset(nl2e, cluster_size / l2es);
+        meta_size += nl2e * l2es;
 
         /* total size of L1 tables */
-        nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+        nl1e = nl2e * l2es / cluster_size;
         nl1e = align_offset(nl1e, cluster_size / sizeof(uint64_t));
         meta_size += nl1e * sizeof(uint64_t);
 
@@ -2196,9 +2996,17 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         .refcount_table_offset      = cpu_to_be64(cluster_size),
         .refcount_table_clusters    = cpu_to_be32(1),
         .refcount_order             = cpu_to_be32(refcount_order),
-        .header_length              = cpu_to_be32(sizeof(*header)),
+        .header_length              = cpu_to_be32(offsetof(QCowHeader,
+                                                           compression_type)),
     };
 
+    if (compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        header->header_length = cpu_to_be32(sizeof(*header));
+        header->compression_type = compression_type;
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_COMPRESSION);
+    }
+
     if (flags & BLOCK_FLAG_ENCRYPT) {
         header->crypt_method = cpu_to_be32(QCOW_CRYPT_AES);
     } else {
@@ -2210,6 +3018,16 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (flags & BLOCK_FLAG_EXTL2) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
+    if (data_file) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_DATA_FILE);
+    }
+
     ret = blk_pwrite(blk, 0, header, cluster_size);
     g_free(header);
     if (ret < 0) {
@@ -2238,6 +3056,10 @@ static int qcow2_create2(const char *filename, int64_t total_size,
      */
     options = qdict_new();
     qdict_put(options, "driver", qstring_from_str("qcow2"));
+    if (data_file) {
+        /* The header extension with the file name is not written yet */
+        qdict_put(options, "data-file.filename", qstring_from_str(data_file));
+    }
     blk = blk_new_open("image-qcow2", filename, NULL, options,
                        BDRV_O_RDWR | BDRV_O_CACHE_WB | BDRV_O_NO_FLUSH,
                        &local_err);
@@ -2258,6 +3080,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         abort();
     }
 
+    if (data_file) {
+        BDRVQcow2State *s = blk_bs(blk)->opaque;
+        s->image_data_file = g_strdup(data_file);
+    }
+
     /* Create a full header (including things like feature table) */
     ret = qcow2_update_header(blk_bs(blk));
     if (ret < 0) {
@@ -2265,6 +3092,23 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         goto out;
     }
 
+    if (journal_size) {
+        ret = qcow2_journal_create(blk_bs(blk), journal_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not create metadata journal");
+            goto out;
+        }
+    }
+
+    if (dedup_index_size) {
+        ret = qcow2_dedup_create(blk_bs(blk), dedup_index_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret,
+                             "Could not create deduplication index");
+            goto out;
+        }
+    }
+
     /* Okay, now that we have a valid image, let's give it the right size */
     ret = blk_truncate(blk, total_size);
     if (ret < 0) {
@@ -2286,7 +3130,8 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     if (prealloc != PREALLOC_MODE_OFF) {
         BDRVQcow2State *s = blk_bs(blk)->opaque;
         qemu_co_mutex_lock(&s->lock);
-        ret = preallocate(blk_bs(blk));
+        ret = preallocate(blk_bs(blk), 0, bdrv_getlength(blk_bs(blk)),
+                          PREALLOC_MODE_METADATA);
         qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not preallocate metadata");
@@ -2300,6 +3145,9 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     /* Reopen the image without BDRV_O_NO_FLUSH to flush it before returning */
     options = qdict_new();
     qdict_put(options, "driver", qstring_from_str("qcow2"));
+    if (data_file) {
+        qdict_put(options, "data-file.filename", qstring_from_str(data_file));
+    }
     blk = blk_new_open("image-flush", filename, NULL, options,
                        BDRV_O_RDWR | BDRV_O_CACHE_WB | BDRV_O_NO_BACKING,
                        &local_err);
@@ -2321,6 +3169,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
 {
     char *backing_file = NULL;
     char *backing_fmt = NULL;
+    char *data_file = NULL;
     char *buf = NULL;
     uint64_t size = 0;
     int flags = 0;
@@ -2329,6 +3178,9 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
     int version = 3;
     uint64_t refcount_bits = 16;
     int refcount_order;
+    uint64_t journal_size;
+    uint64_t dedup_index_size;
+    Qcow2CompressionType compression_type;
     Error *local_err = NULL;
     int ret;
 
@@ -2369,6 +3221,10 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         flags |= BLOCK_FLAG_LAZY_REFCOUNTS;
     }
 
+    if (qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false)) {
+        flags |= BLOCK_FLAG_EXTL2;
+    }
+
     if (backing_file && prealloc != PREALLOC_MODE_OFF) {
         error_setg(errp, "Backing file and preallocation cannot be used at "
                    "the same time");
@@ -2383,6 +3239,52 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         goto finish;
     }
 
+    if (version < 3 && (flags & BLOCK_FLAG_EXTL2)) {
+        error_setg(errp, "Extended L2 entries only supported with "
+                   "compatibility level 1.1 and above (use compat=1.1 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
+    journal_size = qemu_opt_get_size_del(opts, BLOCK_OPT_JOURNAL_SIZE, 0);
+    if (journal_size && version < 3) {
+        error_setg(errp, "A metadata journal is only supported with "
+                   "compatibility level 1.1 and above (use compat=1.1 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+    if (journal_size && (journal_size < QCOW2_MIN_JOURNAL_SIZE ||
+                         journal_size > QCOW2_MAX_JOURNAL_SIZE)) {
+        error_setg(errp, "Journal size must be between %d MB and %d MB",
+                   QCOW2_MIN_JOURNAL_SIZE >> 20, QCOW2_MAX_JOURNAL_SIZE >> 20);
+        ret = -EINVAL;
+        goto finish;
+    }
+
+    dedup_index_size = qemu_opt_get_size_del(opts, BLOCK_OPT_DEDUP_INDEX_SIZE,
+                                             0);
+    if (dedup_index_size && version < 3) {
+        error_setg(errp, "A deduplication index is only supported with "
+                   "compatibility level 1.1 and above (use compat=1.1 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+    if (dedup_index_size && (flags & BLOCK_FLAG_ENCRYPT)) {
+        error_setg(errp, "Deduplication is not supported for encrypted "
+                   "images");
+        ret = -EINVAL;
+        goto finish;
+    }
+    if (dedup_index_size > QCOW2_MAX_DEDUP_INDEX_SIZE) {
+        error_setg(errp, "Deduplication index size may not exceed %d MB",
+                   QCOW2_MAX_DEDUP_INDEX_SIZE >> 20);
+        ret = -EINVAL;
+        goto finish;
+    }
+
     refcount_bits = qemu_opt_get_number_del(opts, BLOCK_OPT_REFCOUNT_BITS,
                                             refcount_bits);
     if (refcount_bits > 64 || !is_power_of_2(refcount_bits)) {
@@ -2402,9 +3304,50 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
 
     refcount_order = ctz32(refcount_bits);
 
+    g_free(buf);
+    buf = qemu_opt_get_del(opts, BLOCK_OPT_COMPRESSION_TYPE);
+    compression_type = qapi_enum_parse(Qcow2CompressionType_lookup, buf,
+                                       QCOW2_COMPRESSION_TYPE__MAX,
+                                       QCOW2_COMPRESSION_TYPE_ZLIB,
+                                       &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto finish;
+    }
+    if (!qcow2_compression_type_supported(compression_type)) {
+        error_setg(errp, "Compression type '%s' is not supported by this "
+                   "build", Qcow2CompressionType_lookup[compression_type]);
+        ret = -ENOTSUP;
+        goto finish;
+    }
+    if (version < 3 && compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_setg(errp, "Non-zlib compression types require compatibility "
+                   "level 1.1 or above (use compat=1.1 or greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
+    data_file = qemu_opt_get_del(opts, BLOCK_OPT_DATA_FILE);
+    if (data_file && version < 3) {
+        error_setg(errp, "An external data file is only supported with "
+                   "compatibility level 1.1 and above (use compat=1.1 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+    if (data_file && (backing_file || (flags & BLOCK_FLAG_ENCRYPT) ||
+                      dedup_index_size)) {
+        error_setg(errp, "An external data file cannot be combined with a "
+                   "backing file, encryption or deduplication");
+        ret = -EINVAL;
+        goto finish;
+    }
+
     ret = qcow2_create2(filename, size, backing_file, backing_fmt, flags,
                         cluster_size, prealloc, opts, version, refcount_order,
-                        &local_err);
+                        journal_size, dedup_index_size, compression_type,
+                        data_file, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
     }
@@ -2412,6 +3355,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
 finish:
     g_free(backing_file);
     g_free(backing_fmt);
+    g_free(data_file);
     g_free(buf);
     return ret;
 }
@@ -2422,6 +3366,18 @@ static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
     int ret;
     BDRVQcow2State *s = bs->opaque;
 
+    /* Zero clusters would leave stale data in the data file */
+    if (has_data_file(s)) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_bitmaps_before_write(bs, sector_num, nb_sectors);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            return ret;
+        }
+        return bdrv_co_write_zeroes(s->data_file->bs, sector_num, nb_sectors,
+                                    flags);
+    }
+
     /* Emulate misaligned zero writes */
     if (sector_num % s->cluster_sectors || nb_sectors % s->cluster_sectors) {
         return -ENOTSUP;
@@ -2429,8 +3385,11 @@ static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
 
     /* Whatever is left can use real zero clusters */
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
-        nb_sectors);
+    ret = qcow2_bitmaps_before_write(bs, sector_num, nb_sectors);
+    if (ret == 0) {
+        ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
+            nb_sectors);
+    }
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -2443,9 +3402,17 @@ static coroutine_fn int qcow2_co_discard(BlockDriverState *bs,
     BDRVQcow2State *s = bs->opaque;
 
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_discard_clusters(bs, sector_num << BDRV_SECTOR_BITS,
-        nb_sectors, QCOW2_DISCARD_REQUEST, false);
+    ret = qcow2_bitmaps_before_write(bs, sector_num, nb_sectors);
+    if (ret == 0 && !has_data_file(s)) {
+        ret = qcow2_discard_clusters(bs, sector_num << BDRV_SECTOR_BITS,
+            nb_sectors, QCOW2_DISCARD_REQUEST, false);
+    }
     qemu_co_mutex_unlock(&s->lock);
+
+    if (ret == 0 && has_data_file(s) &&
+        s->discard_passthrough[QCOW2_DISCARD_REQUEST]) {
+        ret = bdrv_co_discard(s->data_file->bs, sector_num, nb_sectors);
+    }
     return ret;
 }
 
@@ -2466,6 +3433,12 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
         return -ENOTSUP;
     }
 
+    /* the stored bitmaps would no longer match the image size */
+    if (qcow2_has_persistent_dirty_bitmaps(bs)) {
+        error_report("Can't resize an image which has persistent bitmaps");
+        return -ENOTSUP;
+    }
+
     /* shrinking is currently not supported */
     if (offset < bs->total_sectors * 512) {
         error_report("qcow2 doesn't support shrinking images yet");
@@ -2478,6 +3451,13 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
         return ret;
     }
 
+    if (has_data_file(s)) {
+        ret = bdrv_truncate(s->data_file->bs, offset);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* write updated header.size */
     offset = cpu_to_be64(offset);
     ret = bdrv_pwrite_sync(bs->file->bs, offsetof(QCowHeader, size),
@@ -2490,16 +3470,210 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+static int qcow2_truncate_prealloc(BlockDriverState *bs, int64_t offset,
+                                   PreallocMode prealloc, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t old_length = bs->total_sectors * BDRV_SECTOR_SIZE;
+    int ret;
+
+    if (bs->backing) {
+        error_setg(errp, "Preallocation is not supported for images with a "
+                   "backing file");
+        return -ENOTSUP;
+    }
+
+    ret = qcow2_truncate(bs, offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* There is no metadata to preallocate for a data file */
+    if (has_data_file(s)) {
+        while (old_length < offset) {
+            int num = MIN((offset - old_length) >> BDRV_SECTOR_BITS,
+                          BDRV_REQUEST_MAX_SECTORS);
+
+            ret = preallocate_data(bs, old_length, num, prealloc);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret,
+                                 "Could not preallocate the new area");
+                return ret;
+            }
+            old_length += (int64_t)num << BDRV_SECTOR_BITS;
+        }
+        return 0;
+    }
+
+    /* Leave a partial last cluster alone, it may contain guest data */
+    old_length = align_offset(old_length, s->cluster_size);
+    if (old_length >= offset) {
+        return 0;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = preallocate(bs, old_length, offset, prealloc);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret == 0) {
+        /* Write out the L2 tables and refcount blocks in one go */
+        ret = bdrv_flush(bs);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not preallocate the new area");
+        return ret;
+    }
+
+    return 0;
+}
+
+/* Number of clusters that are compressed in parallel */
+#define QCOW2_COMPRESS_WORKERS 8
+
+typedef struct Qcow2CompressJob {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int nb_clusters;
+    int next_cluster;       /* next cluster to be taken by a worker */
+    int nb_workers;         /* number of running workers */
+    Coroutine *waiting_co;
+    int ret;
+} Qcow2CompressJob;
+
+/* Compresses a single cluster and writes it to the image */
+static int coroutine_fn qcow2_co_write_compressed_cluster(BlockDriverState *bs,
+                                                          int64_t sector_num,
+                                                          const uint8_t *buf,
+                                                          uint8_t *out_buf)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cluster_offset;
+    ssize_t out_len;
+    int ret;
+
+    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                                buf, s->cluster_size);
+    if (out_len == -ENOMEM) {
+        /* could not compress: write normal cluster */
+        return bdrv_write(bs, sector_num, buf, s->cluster_sectors);
+    } else if (out_len < 0) {
+        return -EINVAL;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, out_len);
+    if (!cluster_offset) {
+        ret = -EIO;
+        goto fail;
+    }
+    cluster_offset &= s->cluster_offset_mask;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwrite(bs->file->bs, cluster_offset, out_buf, out_len);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = 0;
+fail:
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
+static void coroutine_fn qcow2_compress_worker(void *opaque)
+{
+    Qcow2CompressJob *job = opaque;
+    BDRVQcow2State *s = job->bs->opaque;
+    uint8_t *out_buf = g_malloc(s->cluster_size);
+    int i, ret;
+
+    while (job->ret == 0 && job->next_cluster < job->nb_clusters) {
+        i = job->next_cluster++;
+        ret = qcow2_co_write_compressed_cluster(job->bs,
+            job->sector_num + (int64_t) i * s->cluster_sectors,
+            job->buf + (size_t) i * s->cluster_size, out_buf);
+        if (ret < 0 && job->ret == 0) {
+            job->ret = ret;
+        }
+    }
+
+    g_free(out_buf);
+
+    if (--job->nb_workers == 0 && job->waiting_co) {
+        qemu_coroutine_enter(job->waiting_co, NULL);
+    }
+}
+
+/*
+ * Compresses and writes @nb_clusters whole clusters.  The clusters are
+ * compressed in the thread pool, several of them at the same time, and
+ * each one is written as soon as it is compressed.
+ */
+static int coroutine_fn qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  const uint8_t *buf,
+                                                  int nb_clusters)
+{
+    Qcow2CompressJob job = {
+        .bs             = bs,
+        .sector_num     = sector_num,
+        .buf            = buf,
+        .nb_clusters    = nb_clusters,
+    };
+    Coroutine *co;
+    int i;
+
+    for (i = 0; i < MIN(nb_clusters, QCOW2_COMPRESS_WORKERS); i++) {
+        co = qemu_coroutine_create(qcow2_compress_worker);
+        job.nb_workers++;
+        qemu_coroutine_enter(co, &job);
+    }
+
+    if (job.nb_workers > 0) {
+        job.waiting_co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+
+    return job.ret;
+}
+
+typedef struct Qcow2WriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int nb_clusters;
+    int ret;
+} Qcow2WriteCompressedCo;
+
+static void coroutine_fn qcow2_write_compressed_entry(void *opaque)
+{
+    Qcow2WriteCompressedCo *data = opaque;
+
+    data->ret = qcow2_co_write_compressed(data->bs, data->sector_num,
+                                          data->buf, data->nb_clusters);
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcow2State *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
-    uint8_t *out_buf;
+    Qcow2WriteCompressedCo data;
+    uint8_t *pad_buf = NULL;
     uint64_t cluster_offset;
+    int nb_clusters;
+    int ret;
+
+    if (has_data_file(s)) {
+        return -ENOTSUP;
+    }
 
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
@@ -2508,79 +3682,47 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return bdrv_truncate(bs->file->bs, cluster_offset);
     }
 
-    if (nb_sectors != s->cluster_sectors) {
-        ret = -EINVAL;
-
+    nb_clusters = DIV_ROUND_UP(nb_sectors, s->cluster_sectors);
+    if (nb_sectors % s->cluster_sectors) {
         /* Zero-pad last write if image size is not cluster aligned */
-        if (sector_num + nb_sectors == bs->total_sectors &&
-            nb_sectors < s->cluster_sectors) {
-            uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
-            memset(pad_buf, 0, s->cluster_size);
-            memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
-            qemu_vfree(pad_buf);
+        if (sector_num + nb_sectors != bs->total_sectors) {
+            return -EINVAL;
         }
-        return ret;
+        pad_buf = qemu_blockalign(bs, nb_clusters * s->cluster_size);
+        memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
+        memset(pad_buf + nb_sectors * BDRV_SECTOR_SIZE, 0,
+               nb_clusters * s->cluster_size - nb_sectors * BDRV_SECTOR_SIZE);
+        buf = pad_buf;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
+    ret = qcow2_bitmaps_before_write(bs, sector_num, nb_sectors);
+    if (ret < 0) {
+        goto out;
     }
-    out_len = strm.next_out - out_buf;
 
-    deflateEnd(&strm);
+    data = (Qcow2WriteCompressedCo) {
+        .bs             = bs,
+        .sector_num     = sector_num,
+        .buf            = buf,
+        .nb_clusters    = nb_clusters,
+        .ret            = -EINPROGRESS,
+    };
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
-        }
+    if (qemu_in_coroutine()) {
+        qcow2_write_compressed_entry(&data);
     } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
-        }
-        cluster_offset &= s->cluster_offset_mask;
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+        Coroutine *co = qemu_coroutine_create(qcow2_write_compressed_entry);
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
-
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file->bs, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
+        qemu_coroutine_enter(co, &data);
+        while (data.ret == -EINPROGRESS) {
+            aio_poll(aio_context, true);
         }
     }
+    ret = data.ret;
 
-    ret = 0;
-fail:
-    g_free(out_buf);
+out:
+    qemu_vfree(pad_buf);
     return ret;
 }
 
@@ -2739,15 +3881,22 @@ static int qcow2_make_empty(BlockDriverState *bs)
     int sector_step = INT_MAX / BDRV_SECTOR_SIZE;
     int l1_clusters, ret = 0;
 
+    /* Discarding the data file would not give back any guest data */
+    if (has_data_file(s)) {
+        return -ENOTSUP;
+    }
+
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
 
     if (s->qcow_version >= 3 && !s->snapshots &&
+        QTAILQ_EMPTY(&s->bitmaps) &&
         3 + l1_clusters <= s->refcount_block_size) {
         /* The following function only works for qcow2 v3 images (it requires
-         * the dirty flag) and only as long as there are no snapshots (because
-         * it completely empties the image). Furthermore, the L1 table and three
-         * additional clusters (image header, refcount table, one refcount
-         * block) have to fit inside one refcount block. */
+         * the dirty flag) and only as long as there are no snapshots or
+         * stored bitmaps (because it completely empties the image).
+         * Furthermore, the L1 table and three additional clusters (image
+         * header, refcount table, one refcount block) have to fit inside one
+         * refcount block. */
         return make_completely_empty(bs);
     }
 
@@ -2792,9 +3941,16 @@ static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
             return ret;
         }
     }
+
+    ret = qcow2_dedup_flush(bs);
     qemu_co_mutex_unlock(&s->lock);
 
-    return 0;
+    /* bdrv_co_flush() only recurses into bs->file and the backing file */
+    if (ret == 0 && has_data_file(s)) {
+        ret = bdrv_co_flush(s->data_file->bs);
+    }
+
+    return ret;
 }
 
 static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -2807,6 +3963,17 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static void qcow2_get_cache_stats(BlockDriverState *bs,
+                                  BlockDeviceStats *stats)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    stats->has_l2_cache = true;
+    stats->l2_cache = qcow2_cache_get_stats(s->l2_table_cache);
+    stats->has_refcount_cache = true;
+    stats->refcount_cache = qcow2_cache_get_stats(s->refcount_block_cache);
+}
+
 static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -2831,6 +3998,17 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
                                   QCOW2_INCOMPAT_CORRUPT,
             .has_corrupt        = true,
             .refcount_bits      = s->refcount_bits,
+            .extended_l2        = has_subclusters(s),
+            .has_extended_l2    = has_subclusters(s),
+            .journal_size       = s->journal_size,
+            .has_journal_size   = s->journal_size != 0,
+            .dedup_index_size   = s->dedup_index_size,
+            .has_dedup_index_size = s->dedup_index_size != 0,
+            .compression_type   = s->compression_type,
+            .has_compression_type =
+                s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB,
+            .data_file          = g_strdup(s->image_data_file),
+            .has_data_file      = s->image_data_file != NULL,
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -2870,6 +4048,11 @@ static int qcow2_save_vmstate(BlockDriverState *bs, QEMUIOVector *qiov,
     bool zero_beyond_eof = bs->zero_beyond_eof;
     int ret;
 
+    /* The VM state would end up past the end of the data file */
+    if (has_data_file(s)) {
+        return -ENOTSUP;
+    }
+
     BLKDBG_EVENT(bs->file, BLKDBG_VMSTATE_SAVE);
     bs->zero_beyond_eof = false;
     ret = bdrv_pwritev(bs, qcow2_vm_state_offset(s) + pos, qiov);
@@ -2890,6 +4073,10 @@ static int qcow2_load_vmstate(BlockDriverState *bs, uint8_t *buf,
     bool zero_beyond_eof = bs->zero_beyond_eof;
     int ret;
 
+    if (has_data_file(s)) {
+        return -ENOTSUP;
+    }
+
     BLKDBG_EVENT(bs->file, BLKDBG_VMSTATE_LOAD);
     bs->zero_beyond_eof = false;
     ret = bdrv_pread(bs, qcow2_vm_state_offset(s) + pos, buf, size);
@@ -2922,6 +4109,11 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (qcow2_has_persistent_dirty_bitmaps(bs)) {
+        error_report("compat=0.10 does not support persistent bitmaps");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -3104,6 +4296,41 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                              "not exceed 64 bits");
                 return -EINVAL;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            if (qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2, has_subclusters(s))
+                != has_subclusters(s)) {
+                error_report("Changing the L2 entry size is not supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_JOURNAL_SIZE)) {
+            if (qemu_opt_get_size(opts, BLOCK_OPT_JOURNAL_SIZE,
+                                  s->journal_size) != s->journal_size) {
+                error_report("Changing the journal size is not supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_TYPE)) {
+            const char *type = qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_TYPE);
+            if (type &&
+                strcmp(type, Qcow2CompressionType_lookup[s->compression_type])) {
+                error_report("Changing the compression type is not "
+                             "supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_DEDUP_INDEX_SIZE)) {
+            if (qemu_opt_get_size(opts, BLOCK_OPT_DEDUP_INDEX_SIZE,
+                                  s->dedup_index_size) !=
+                s->dedup_index_size) {
+                error_report("Changing the deduplication index size is not "
+                             "supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_DATA_FILE)) {
+            const char *data_file = qemu_opt_get(opts, BLOCK_OPT_DATA_FILE);
+            if (g_strcmp0(data_file, s->image_data_file)) {
+                error_report("Changing the external data file is not "
+                             "supported");
+                return -ENOTSUP;
+            }
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -3113,6 +4340,37 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         desc++;
     }
 
+    if (new_version < 3 && has_subclusters(s)) {
+        error_report("Extended L2 entries require compatibility level 1.1 "
+                     "or above");
+        return -ENOTSUP;
+    }
+
+    if (new_version < 3 && s->journal_size) {
+        error_report("A metadata journal requires compatibility level 1.1 "
+                     "or above");
+        return -ENOTSUP;
+    }
+
+    if (new_version < 3 &&
+        s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_report("Non-zlib compression types require compatibility level "
+                     "1.1 or above");
+        return -ENOTSUP;
+    }
+
+    if (new_version < 3 && s->dedup_index_size) {
+        error_report("A deduplication index requires compatibility level 1.1 "
+                     "or above");
+        return -ENOTSUP;
+    }
+
+    if (new_version < 3 && has_data_file(s)) {
+        error_report("An external data file requires compatibility level 1.1 "
+                     "or above");
+        return -ENOTSUP;
+    }
+
     helper_cb_info = (Qcow2AmendHelperCBInfo){
         .original_status_cb = status_cb,
         .original_cb_opaque = cb_opaque,
@@ -3141,10 +4399,17 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
             return -EINVAL;
         }
 
+        /* The new refcount structures are written directly */
+        ret = qcow2_journal_suspend(bs);
+        if (ret < 0) {
+            return ret;
+        }
+
         helper_cb_info.current_operation = QCOW2_CHANGING_REFCOUNT_ORDER;
         ret = qcow2_change_refcount_order(bs, refcount_order,
                                           &qcow2_amend_helper_cb,
                                           &helper_cb_info, &local_error);
+        qcow2_journal_resume(bs);
         if (ret < 0) {
             error_report_err(local_error);
             return ret;
@@ -3315,6 +4580,32 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Use extended L2 entries with 32 subclusters per cluster",
+        },
+        {
+            .name = BLOCK_OPT_JOURNAL_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the metadata journal (0 for none)",
+        },
+        {
+            .name = BLOCK_OPT_DEDUP_INDEX_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the deduplication index (0 for none)",
+        },
+        {
+            .name = BLOCK_OPT_DATA_FILE,
+            .type = QEMU_OPT_STRING,
+            .help = "File name of an external data file for the guest data",
+        },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Compression method for compressed clusters (zlib, "
+                    "zstd)",
+        },
         { /* end of list */ }
     }
 };
@@ -3341,6 +4632,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
+    .bdrv_truncate_prealloc = qcow2_truncate_prealloc,
     .bdrv_write_compressed  = qcow2_write_compressed,
     .bdrv_make_empty        = qcow2_make_empty,
 
@@ -3351,6 +4643,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp = qcow2_snapshot_load_tmp,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_cache_stats   = qcow2_get_cache_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -3362,6 +4655,9 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
     .bdrv_inactivate            = qcow2_inactivate,
 
+    .bdrv_can_store_new_dirty_bitmap = qcow2_can_store_new_dirty_bitmap,
+    .bdrv_remove_persistent_dirty_bitmap = qcow2_remove_persistent_dirty_bitmap,
+
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
     .bdrv_amend_options  = qcow2_amend_options,
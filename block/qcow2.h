@@ -52,6 +52,18 @@
  * space for snapshot names and IDs */
 #define QCOW_MAX_SNAPSHOTS_SIZE (1024 * QCOW_MAX_SNAPSHOTS)
 
+/* Bitmap header extension limits, the directory allows for an average of
+ * 1k per entry as well */
+#define QCOW2_MAX_BITMAPS 65535
+#define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
+
+/* Metadata journal size limits */
+#define QCOW2_MIN_JOURNAL_SIZE (1024 * 1024)
+#define QCOW2_MAX_JOURNAL_SIZE (1024 * 1024 * 1024)
+
+/* Deduplication index size limit, 32M entries */
+#define QCOW2_MAX_DEDUP_INDEX_SIZE (1024 * 1024 * 1024)
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -59,11 +71,39 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/* Size of normal and extended L2 entries */
+#define L2E_SIZE_NORMAL   (sizeof(uint64_t))
+#define L2E_SIZE_EXTENDED (sizeof(uint64_t) * 2)
+
+/* Each cluster of an image with extended L2 entries has 32 subclusters */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+
+/* Extended L2 entries need subclusters of at least 512 bytes */
+#define MIN_EXTL2_CLUSTER_BITS 14
+
+/* The subcluster X [0..31] is allocated */
+#define QCOW_OFLAG_SUB_ALLOC(X)   (1ULL << (X))
+/* The subcluster X [0..31] reads as zeroes */
+#define QCOW_OFLAG_SUB_ZERO(X)    (QCOW_OFLAG_SUB_ALLOC(X) << 32)
+/* Subclusters [X, Y) (0 <= X <= Y <= 32) are allocated */
+#define QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC(Y) - QCOW_OFLAG_SUB_ALLOC(X))
+/* Subclusters [X, Y) (0 <= X <= Y <= 32) read as zeroes */
+#define QCOW_OFLAG_SUB_ZERO_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) << 32)
+/* L2 entry bitmap with all allocation bits set */
+#define QCOW_L2_BITMAP_ALL_ALLOC  (QCOW_OFLAG_SUB_ALLOC_RANGE(0, 32))
+/* L2 entry bitmap with all "read as zeroes" bits set */
+#define QCOW_L2_BITMAP_ALL_ZEROES (QCOW_OFLAG_SUB_ZERO_RANGE(0, 32))
+
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
 /* Must be at least 2 to cover COW */
-#define MIN_L2_CACHE_SIZE 2 /* clusters */
+#define MIN_L2_CACHE_SIZE 2 /* cache entries */
+
+/* L2 tables are cached in slices of between 512 bytes and one cluster */
+#define MIN_L2_CACHE_ENTRY_SIZE 512 /* bytes */
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define MIN_REFCOUNT_CACHE_SIZE 4 /* clusters */
@@ -95,8 +135,11 @@
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_BITMAP_CHECKPOINT_INTERVAL "bitmap-checkpoint-interval"
+#define QCOW2_OPT_DATA_FILE "data-file"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -120,6 +163,11 @@ typedef struct QCowHeader {
 
     uint32_t refcount_order;
     uint32_t header_length;
+
+    /* Only present if header_length is large enough; images that use zlib
+     * compression may omit them */
+    uint8_t compression_type;
+    uint8_t padding[7];
 } QEMU_PACKED QCowHeader;
 
 typedef struct QEMU_PACKED QCowSnapshotHeader {
@@ -180,11 +228,23 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_DATA_FILE_BITNR = 2,
+    QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 4,
+    QCOW2_INCOMPAT_JOURNAL_BITNR = 5,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_DATA_FILE     = 1 << QCOW2_INCOMPAT_DATA_FILE_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION   = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+    QCOW2_INCOMPAT_JOURNAL       = 1 << QCOW2_INCOMPAT_JOURNAL_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_DATA_FILE
+                                 | QCOW2_INCOMPAT_COMPRESSION
+                                 | QCOW2_INCOMPAT_EXTL2
+                                 | QCOW2_INCOMPAT_JOURNAL,
 };
 
 /* Compatible feature bits */
@@ -195,6 +255,18 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_BITMAPS_BITNR = 0,
+    /* Bit 1 is the raw external data bit of the upstream spec */
+    QCOW2_AUTOCLEAR_DEDUP_BITNR   = 2,
+    QCOW2_AUTOCLEAR_BITMAPS       = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+    QCOW2_AUTOCLEAR_DEDUP         = 1 << QCOW2_AUTOCLEAR_DEDUP_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK          = QCOW2_AUTOCLEAR_BITMAPS
+                                  | QCOW2_AUTOCLEAR_DEDUP,
+};
+
 enum qcow2_discard_type {
     QCOW2_DISCARD_NEVER = 0,
     QCOW2_DISCARD_ALWAYS,
@@ -210,6 +282,52 @@ typedef struct Qcow2Feature {
     char    name[46];
 } QEMU_PACKED Qcow2Feature;
 
+typedef struct Qcow2BitmapHeaderExt {
+    uint32_t nb_bitmaps;
+    uint32_t reserved32;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+} QEMU_PACKED Qcow2BitmapHeaderExt;
+
+typedef struct Qcow2JournalHeaderExt {
+    uint64_t journal_offset;
+    uint64_t journal_size;
+} QEMU_PACKED Qcow2JournalHeaderExt;
+
+typedef struct Qcow2DedupHeaderExt {
+    uint64_t index_offset;
+    uint64_t index_size;
+} QEMU_PACKED Qcow2DedupHeaderExt;
+
+/* An entry of the deduplication index, as stored in the image */
+typedef struct Qcow2DedupEntry {
+    uint64_t hash;
+    uint64_t host_offset;
+    uint64_t guest_offset;
+    uint64_t reserved;
+} QEMU_PACKED Qcow2DedupEntry;
+
+/* A write request that writes data to allocated clusters in place */
+typedef struct Qcow2InFlightWrite {
+    uint64_t offset;
+    uint64_t bytes;
+    QLIST_ENTRY(Qcow2InFlightWrite) next;
+} Qcow2InFlightWrite;
+
+/* A bitmap directory entry, as stored in the image */
+typedef struct Qcow2Bitmap {
+    char *name;
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint32_t flags;
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint32_t extra_data_size;
+    uint8_t *extra_data;
+    QTAILQ_ENTRY(Qcow2Bitmap) next;
+} Qcow2Bitmap;
+typedef QTAILQ_HEAD(Qcow2BitmapList, Qcow2Bitmap) Qcow2BitmapList;
+
 typedef struct Qcow2DiscardRegion {
     BlockDriverState *bs;
     uint64_t offset;
@@ -228,6 +346,11 @@ typedef struct BDRVQcow2State {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_size; /* number of L2 entries per L2 cache entry */
+    int subclusters_per_cluster;
+    int subcluster_size;
+    int subcluster_sectors;
+    int subcluster_bits;
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -243,6 +366,33 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
+    uint32_t nb_bitmaps;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+    Qcow2BitmapList bitmaps;    /* the bitmap directory in the image */
+    bool bitmaps_loaded;        /* persistent bitmaps were created from
+                                 * the stored ones */
+    bool bitmaps_in_use;        /* all stored bitmaps are marked in use */
+    QEMUTimer *bitmap_checkpoint_timer;
+    unsigned bitmap_checkpoint_interval;
+    Coroutine *bitmap_checkpoint_co;
+
+    uint64_t journal_offset;
+    uint64_t journal_size;
+    uint64_t journal_seq;       /* sequence number of the next transaction */
+    uint64_t journal_pos;       /* journal offset of the next transaction */
+    bool journal_active;        /* cached metadata is written via the journal */
+    bool journal_needs_checkpoint; /* clusters that may be described in the
+                                    * journal were freed */
+
+    uint64_t dedup_index_offset;
+    uint64_t dedup_index_size;
+    Qcow2DedupEntry *dedup_index;   /* in image byte order */
+    unsigned long *dedup_dirty;     /* pages of the index to write back */
+    uint8_t *dedup_buf;             /* two clusters for comparing data */
+    QLIST_HEAD(, Qcow2InFlightWrite) inflight_writes;
+
+    Qcow2CompressionType compression_type;
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
@@ -293,6 +443,11 @@ typedef struct BDRVQcow2State {
      * override) */
     char *image_backing_file;
     char *image_backing_format;
+
+    /* Where guest data is stored; bs->file unless the image has an external
+     * data file, which holds the guest data at identity offsets */
+    BdrvChild *data_file;
+    char *image_data_file;      /* data file name as stored in the image */
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
@@ -327,6 +482,13 @@ typedef struct QCowL2Meta
     /** Number of newly allocated clusters */
     int nb_clusters;
 
+    /**
+     * True if the write goes to an existing cluster whose subclusters are
+     * only partially allocated (extended L2 entries only). alloc_offset then
+     * points to the old cluster, which must not be freed.
+     */
+    bool keep_old_clusters;
+
     /**
      * Requests that overlap with this allocation and wait to be restarted
      * when the allocating request has completed.
@@ -403,6 +565,56 @@ typedef enum QCow2MetadataOverlap {
 
 #define REFT_OFFSET_MASK 0xfffffffffffffe00ULL
 
+#define BME_TABLE_ENTRY_OFFSET_MASK 0x00fffffffffffe00ULL
+
+static inline bool has_subclusters(BDRVQcow2State *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+static inline bool has_data_file(BDRVQcow2State *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_DATA_FILE;
+}
+
+static inline size_t l2_entry_size(BDRVQcow2State *s)
+{
+    return has_subclusters(s) ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
+}
+
+static inline uint64_t get_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
+                                    int idx)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    return be64_to_cpu(l2_slice[idx]);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
+                                     int idx)
+{
+    if (has_subclusters(s)) {
+        idx *= l2_entry_size(s) / sizeof(uint64_t);
+        return be64_to_cpu(l2_slice[idx + 1]);
+    } else {
+        return 0; /* For convenience only; this value has no meaning. */
+    }
+}
+
+static inline void set_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
+                                int idx, uint64_t entry)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx] = cpu_to_be64(entry);
+}
+
+static inline void set_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
+                                 int idx, uint64_t bitmap)
+{
+    assert(has_subclusters(s));
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx + 1] = cpu_to_be64(bitmap);
+}
+
 static inline int64_t start_of_cluster(BDRVQcow2State *s, int64_t offset)
 {
     return offset & ~(s->cluster_size - 1);
@@ -413,6 +625,11 @@ static inline int64_t offset_into_cluster(BDRVQcow2State *s, int64_t offset)
     return offset & (s->cluster_size - 1);
 }
 
+static inline int offset_to_sc_index(BDRVQcow2State *s, int64_t offset)
+{
+    return offset_into_cluster(s, offset) >> s->subcluster_bits;
+}
+
 static inline uint64_t size_to_clusters(BDRVQcow2State *s, uint64_t size)
 {
     return (size + (s->cluster_size - 1)) >> s->cluster_bits;
@@ -429,6 +646,11 @@ static inline int offset_to_l2_index(BDRVQcow2State *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline int offset_to_l2_slice_index(BDRVQcow2State *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -458,6 +680,34 @@ static inline int qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * Returns the type (QCOW2_CLUSTER_*) of subcluster sc_index in a cluster with
+ * the given extended L2 entry and subcluster bitmap, or -EIO if the entry is
+ * invalid.
+ */
+static inline int qcow2_get_subcluster_type(uint64_t l2_entry,
+                                            uint64_t l2_bitmap, int sc_index)
+{
+    int type = qcow2_get_cluster_type(l2_entry);
+
+    if (type == QCOW2_CLUSTER_COMPRESSED) {
+        return type;
+    } else if (type == QCOW2_CLUSTER_ZERO) {
+        /* The zero flag is reserved with extended L2 entries */
+        return -EIO;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_index)) {
+        if (type == QCOW2_CLUSTER_UNALLOCATED ||
+            (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index))) {
+            return -EIO;
+        }
+        return QCOW2_CLUSTER_NORMAL;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index)) {
+        return QCOW2_CLUSTER_ZERO;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcow2State *s)
 {
@@ -555,6 +805,8 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors, enum qcow2_discard_type type, bool full_discard);
 int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors);
+int qcow2_share_cluster(BlockDriverState *bs, uint64_t guest_offset,
+                        uint64_t host_offset, uint64_t src_guest_offset);
 
 int qcow2_expand_zero_clusters(BlockDriverState *bs,
                                BlockDriverAmendStatusCB *status_cb,
@@ -576,8 +828,59 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_read_bitmap_directory(BlockDriverState *bs, Error **errp);
+void qcow2_free_bitmap_directory(BlockDriverState *bs);
+int qcow2_read_bitmap_table(BlockDriverState *bs, const Qcow2Bitmap *bm,
+                            uint64_t **bitmap_table);
+int qcow2_load_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp);
+int qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp);
+void qcow2_release_persistent_dirty_bitmaps(BlockDriverState *bs);
+bool qcow2_has_persistent_dirty_bitmaps(BlockDriverState *bs);
+int qcow2_bitmaps_before_write(BlockDriverState *bs, int64_t sector_num,
+                               int nb_sectors);
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                      uint32_t granularity, Error **errp);
+void qcow2_remove_persistent_dirty_bitmap(BlockDriverState *bs,
+                                          const char *name,
+                                          Error **errp);
+
+/* qcow2-journal.c functions */
+int qcow2_journal_open(BlockDriverState *bs, int flags, Error **errp);
+int qcow2_journal_create(BlockDriverState *bs, uint64_t size);
+bool qcow2_journal_fits(BlockDriverState *bs, Qcow2Cache *l2_table_cache,
+                        Qcow2Cache *refcount_block_cache);
+int qcow2_journal_commit(BlockDriverState *bs);
+int qcow2_journal_checkpoint(BlockDriverState *bs);
+int qcow2_journal_suspend(BlockDriverState *bs);
+void qcow2_journal_resume(BlockDriverState *bs);
+
+/* qcow2-dedup.c functions */
+int qcow2_dedup_open(BlockDriverState *bs, int flags, Error **errp);
+int qcow2_dedup_create(BlockDriverState *bs, uint64_t size);
+int qcow2_dedup_flush(BlockDriverState *bs);
+void qcow2_dedup_close(BlockDriverState *bs);
+int qcow2_dedup_write(BlockDriverState *bs, uint64_t guest_offset,
+                      QEMUIOVector *qiov, size_t qiov_offset, uint64_t *hash);
+void qcow2_dedup_insert(BlockDriverState *bs, uint64_t hash,
+                        uint64_t host_offset, uint64_t guest_offset);
+bool qcow2_write_in_flight(BlockDriverState *bs, uint64_t offset,
+                           uint64_t bytes);
+
+/* qcow2-threads.c functions */
+bool qcow2_compression_type_supported(Qcow2CompressionType type);
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size);
+int qcow2_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                     const void *src, size_t src_size);
+int qcow2_crypt_sectors(BlockDriverState *bs, int64_t sector_num,
+                        uint8_t *out_buf, const uint8_t *in_buf,
+                        int nb_sectors, bool enc, Error **errp);
+
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
 
 void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
@@ -586,8 +889,16 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency);
 void qcow2_cache_depends_on_flush(Qcow2Cache *c);
+int qcow2_cache_num_tables(Qcow2Cache *c);
+int qcow2_cache_table_size(Qcow2Cache *c);
+void *qcow2_cache_dirty_table(BlockDriverState *bs, Qcow2Cache *c, int i,
+                              uint64_t *offset);
+void qcow2_cache_entry_mark_clean(BlockDriverState *bs, Qcow2Cache *c,
+                                  void *table);
 
 void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c);
+BlockMetadataCacheStats *qcow2_cache_get_stats(Qcow2Cache *c);
+void qcow2_cache_budget_register(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c);
 
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
@@ -31,6 +31,7 @@
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/iov.h"
+#include "qemu/sockets.h"
 #include "raw-aio.h"
 #include "qapi/util.h"
 #include "qapi/qmp/qstring.h"
@@ -59,6 +60,7 @@
 #include <linux/fs.h>
 #include <linux/hdreg.h>
 #include <scsi/sg.h>
+#include <sys/syscall.h>
 #ifdef __s390__
 #include <asm/dasd.h>
 #endif
@@ -139,6 +141,11 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_io_uring;
+    bool io_uring_sqpoll;
+    void *io_uring_ctx;
+#endif
 #ifdef CONFIG_XFS
     bool is_xfs:1;
 #endif
@@ -146,7 +153,12 @@ typedef struct BDRVRawState {
     bool has_write_zeroes:1;
     bool discard_zeroes:1;
     bool has_fallocate;
+    bool has_copy_range;
     bool needs_alignment;
+#if defined(__linux__)
+    /* SG_IO requests are submitted with write(2) and reaped with read(2) */
+    bool sg_async;
+#endif
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -155,10 +167,17 @@ typedef struct BDRVRawReopenState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_io_uring;
+#endif
 } BDRVRawReopenState;
 
 static int fd_open(BlockDriverState *bs);
 static int64_t raw_getlength(BlockDriverState *bs);
+#if defined(__linux__)
+static void hdev_sg_set_handler(BlockDriverState *bs, AioContext *ctx,
+                                bool enable);
+#endif
 
 typedef struct RawPosixAIOData {
     BlockDriverState *bs;
@@ -172,6 +191,9 @@ typedef struct RawPosixAIOData {
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
     off_t aio_offset;
     int aio_type;
+    /* Destination for QEMU_AIO_COPY_RANGE */
+    int aio_fd2;
+    off_t aio_offset2;
 } RawPosixAIOData;
 
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -374,25 +396,47 @@ static void raw_parse_flags(int bdrv_flags, int *open_flags)
 
 static void raw_detach_aio_context(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
 
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_detach_aio_context(s->io_uring_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
+#if defined(__linux__)
+    if (s->sg_async) {
+        hdev_sg_set_handler(bs, bdrv_get_aio_context(bs), false);
+    }
+#endif
 }
 
 static void raw_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-#ifdef CONFIG_LINUX_AIO
     BDRVRawState *s = bs->opaque;
 
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_attach_aio_context(s->aio_ctx, new_context);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_attach_aio_context(s->io_uring_ctx, new_context);
+    }
+#endif
+#if defined(__linux__)
+    if (s->sg_async) {
+        hdev_sg_set_handler(bs, new_context, true);
+    }
+#endif
 }
 
 #ifdef CONFIG_LINUX_AIO
@@ -427,6 +471,27 @@ error:
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+static int raw_set_io_uring(void **io_uring_ctx, bool *use_io_uring,
+                            bool sqpoll, int bdrv_flags)
+{
+    /* io_uring works with and without O_DIRECT */
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        /* if non-NULL, luring_init() has already been run */
+        if (*io_uring_ctx == NULL) {
+            *io_uring_ctx = luring_init(sqpoll);
+            if (!*io_uring_ctx) {
+                return -1;
+            }
+        }
+        *use_io_uring = true;
+    } else {
+        *use_io_uring = false;
+    }
+    return 0;
+}
+#endif
+
 static void raw_parse_filename(const char *filename, QDict *options,
                                Error **errp)
 {
@@ -447,6 +512,11 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "File name of the image",
         },
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "Poll the io_uring submission queue in a kernel thread",
+        },
         { /* end of list */ }
     },
 };
@@ -513,6 +583,27 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+#ifdef CONFIG_LINUX_IO_URING
+    s->io_uring_sqpoll = qemu_opt_get_bool(opts, "io-uring-sqpoll", false);
+    if (raw_set_io_uring(&s->io_uring_ctx, &s->use_io_uring,
+                         s->io_uring_sqpoll, bdrv_flags)) {
+        qemu_close(fd);
+        ret = -EINVAL;
+        error_setg(errp, "Could not set up io_uring");
+        goto fail;
+    }
+    if (s->use_io_uring) {
+        luring_register_file(s->io_uring_ctx, s->fd);
+    }
+#else
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        error_setg(errp, "aio=io_uring was specified, but is not supported "
+                         "in this build.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#endif /* !defined(CONFIG_LINUX_IO_URING) */
+
     s->has_discard = true;
     s->has_write_zeroes = true;
     if ((bs->open_flags & BDRV_O_NOCACHE) != 0) {
@@ -527,6 +618,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     if (S_ISREG(st.st_mode)) {
         s->discard_zeroes = true;
         s->has_fallocate = true;
+        s->has_copy_range = true;
     }
     if (S_ISBLK(st.st_mode)) {
 #ifdef BLKDISCARDZEROES
@@ -617,6 +709,13 @@ static int raw_reopen_prepare(BDRVReopenState *state,
         return -1;
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (raw_set_io_uring(&s->io_uring_ctx, &raw_s->use_io_uring,
+                         s->io_uring_sqpoll, state->flags)) {
+        error_setg(errp, "Could not set up io_uring");
+        return -1;
+    }
+#endif
 
     if (s->type == FTYPE_CD) {
         raw_s->open_flags |= O_NONBLOCK;
@@ -698,11 +797,30 @@ static void raw_reopen_commit(BDRVReopenState *state)
 
     s->open_flags = raw_s->open_flags;
 
+#if defined(__linux__)
+    if (s->sg_async) {
+        hdev_sg_set_handler(state->bs, bdrv_get_aio_context(state->bs),
+                            false);
+    }
+#endif
     qemu_close(s->fd);
     s->fd = raw_s->fd;
+#if defined(__linux__)
+    if (s->sg_async) {
+        qemu_set_nonblock(s->fd);
+        hdev_sg_set_handler(state->bs, bdrv_get_aio_context(state->bs),
+                            true);
+    }
+#endif
 #ifdef CONFIG_LINUX_AIO
     s->use_aio = raw_s->use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_io_uring = raw_s->use_io_uring;
+    if (s->use_io_uring) {
+        luring_register_file(s->io_uring_ctx, s->fd);
+    }
+#endif
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -934,6 +1052,144 @@ static ssize_t handle_aiocb_rw_linear(RawPosixAIOData *aiocb, char *buf)
     return offset;
 }
 
+/*
+ * Read/writes the data of a request with misaligned buffers, passing the
+ * aligned parts of each buffer directly to preadv/pwritev.  Only the
+ * misaligned head and tail of a buffer are copied through a bounce buffer;
+ * buffers whose memory is shifted relative to the file offset are copied
+ * completely.
+ *
+ * Returns -ENOTSUP if nothing could be passed directly, in which case the
+ * caller should copy the whole request.
+ */
+static ssize_t handle_aiocb_rw_split(RawPosixAIOData *aiocb)
+{
+    BDRVRawState *s = aiocb->bs->opaque;
+    size_t align = MAX(s->buf_align, aiocb->bs->request_alignment);
+    struct iovec *pieces, *iov, *orig_iov;
+    bool *direct;
+    int npieces = 0, niov = 0, orig_niov;
+    bool have_direct = false;
+    size_t pos = 0, bounce_bytes = 0, buf_size = 0, off;
+    ssize_t nbytes;
+    char *buf;
+    int i;
+
+    pieces = g_new(struct iovec, aiocb->aio_niov * 3);
+    direct = g_new(bool, aiocb->aio_niov * 3);
+
+    for (i = 0; i < aiocb->aio_niov; i++) {
+        char *base = aiocb->aio_iov[i].iov_base;
+        size_t len = aiocb->aio_iov[i].iov_len;
+        size_t head = -(uintptr_t)base & (align - 1);
+        size_t mid = 0;
+
+        if (((uintptr_t)base & (align - 1)) == (pos & (align - 1)) &&
+            head < len) {
+            mid = (len - head) & ~(align - 1);
+        }
+
+        if (mid == 0) {
+            head = len;
+        }
+        if (head) {
+            pieces[npieces] = (struct iovec) { base, head };
+            direct[npieces++] = false;
+        }
+        if (mid) {
+            pieces[npieces] = (struct iovec) { base + head, mid };
+            direct[npieces++] = true;
+            have_direct = true;
+            if (len - head - mid) {
+                pieces[npieces] = (struct iovec) { base + head + mid,
+                                                   len - head - mid };
+                direct[npieces++] = false;
+            }
+        }
+        pos += len;
+    }
+
+    /* Count the output vector; consecutive bounced pieces share one
+     * aligned chunk of the bounce buffer */
+    for (i = 0; i < npieces; i++) {
+        if (direct[i]) {
+            niov++;
+        } else {
+            if (i == 0 || direct[i - 1]) {
+                niov++;
+                buf_size = ROUND_UP(buf_size, align);
+            }
+            buf_size += pieces[i].iov_len;
+            bounce_bytes += pieces[i].iov_len;
+        }
+    }
+
+    if (!have_direct || niov > IOV_MAX) {
+        nbytes = -ENOTSUP;
+        goto out;
+    }
+
+    buf = qemu_try_blockalign(aiocb->bs, buf_size);
+    if (buf == NULL) {
+        nbytes = -ENOMEM;
+        goto out;
+    }
+
+    iov = g_new(struct iovec, niov);
+    niov = 0;
+    off = 0;
+    for (i = 0; i < npieces; i++) {
+        if (direct[i]) {
+            iov[niov++] = pieces[i];
+            continue;
+        }
+        if (i == 0 || direct[i - 1]) {
+            off = ROUND_UP(off, align);
+            iov[niov++] = (struct iovec) { buf + off, 0 };
+        }
+        if (aiocb->aio_type & QEMU_AIO_WRITE) {
+            memcpy(buf + off, pieces[i].iov_base, pieces[i].iov_len);
+        }
+        iov[niov - 1].iov_len += pieces[i].iov_len;
+        off += pieces[i].iov_len;
+    }
+
+    orig_iov = aiocb->aio_iov;
+    orig_niov = aiocb->aio_niov;
+    aiocb->aio_iov = iov;
+    aiocb->aio_niov = niov;
+    nbytes = handle_aiocb_rw_vector(aiocb);
+    aiocb->aio_iov = orig_iov;
+    aiocb->aio_niov = orig_niov;
+
+    if (nbytes > 0 && !(aiocb->aio_type & QEMU_AIO_WRITE)) {
+        /* Anything beyond a short read is zeroed by the caller afterwards */
+        off = 0;
+        for (i = 0; i < npieces; i++) {
+            if (direct[i]) {
+                continue;
+            }
+            if (i == 0 || direct[i - 1]) {
+                off = ROUND_UP(off, align);
+            }
+            memcpy(pieces[i].iov_base, buf + off, pieces[i].iov_len);
+            off += pieces[i].iov_len;
+        }
+    }
+
+    if (nbytes == aiocb->aio_nbytes) {
+        atomic_inc(&aiocb->bs->bounce_stats.split_buffers);
+        atomic_add(&aiocb->bs->bounce_stats.bytes, bounce_bytes);
+    }
+
+    g_free(iov);
+    qemu_vfree(buf);
+out:
+    g_free(pieces);
+    g_free(direct);
+    return nbytes;
+}
+
 static ssize_t handle_aiocb_rw(RawPosixAIOData *aiocb)
 {
     ssize_t nbytes;
@@ -967,6 +1223,19 @@ static ssize_t handle_aiocb_rw(RawPosixAIOData *aiocb)
          * using these interfaces.  For now retry using plain
          * pread/pwrite?
          */
+    } else if (preadv_present) {
+        /*
+         * Some buffers are misaligned.  Bounce only the parts of them
+         * that have to be, and pass the rest through.
+         */
+        nbytes = handle_aiocb_rw_split(aiocb);
+        if (nbytes == aiocb->aio_nbytes ||
+            (nbytes < 0 && nbytes != -ENOSYS && nbytes != -ENOTSUP)) {
+            return nbytes;
+        }
+        if (nbytes == -ENOSYS) {
+            preadv_present = false;
+        }
     }
 
     /*
@@ -977,6 +1246,8 @@ static ssize_t handle_aiocb_rw(RawPosixAIOData *aiocb)
     if (buf == NULL) {
         return -ENOMEM;
     }
+    atomic_inc(&aiocb->bs->bounce_stats.misaligned_buffers);
+    atomic_add(&aiocb->bs->bounce_stats.bytes, aiocb->aio_nbytes);
 
     if (aiocb->aio_type & QEMU_AIO_WRITE) {
         char *p = buf;
@@ -1198,6 +1469,59 @@ static ssize_t handle_aiocb_discard(RawPosixAIOData *aiocb)
     return ret;
 }
 
+#ifndef CONFIG_COPY_FILE_RANGE
+static ssize_t copy_file_range(int in_fd, off_t *in_off, int out_fd,
+                               off_t *out_off, size_t len, unsigned int flags)
+{
+#ifdef __NR_copy_file_range
+    return syscall(__NR_copy_file_range, in_fd, in_off, out_fd,
+                   out_off, len, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+#endif
+
+static ssize_t handle_aiocb_copy_range(RawPosixAIOData *aiocb)
+{
+    BDRVRawState *s = aiocb->bs->opaque;
+    uint64_t bytes = aiocb->aio_nbytes;
+    off_t in_off = aiocb->aio_offset;
+    off_t out_off = aiocb->aio_offset2;
+
+    while (bytes) {
+        ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
+                                      aiocb->aio_fd2, &out_off, bytes, 0);
+        if (ret == 0) {
+            /* The source ended before the request did; let the fallback
+             * path read (and zero-fill) the rest */
+            return -ENOTSUP;
+        }
+        if (ret < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case ENOSYS:
+                s->has_copy_range = false;
+                return -ENOTSUP;
+            case ENOTSUP:
+            case EXDEV:
+            case EINVAL:
+            case EBADF:
+                /* Not possible between these two files (e.g. they are on
+                 * different file systems), but maybe for others */
+                return -ENOTSUP;
+            default:
+                return -errno;
+            }
+        }
+        bytes -= ret;
+    }
+
+    return 0;
+}
+
 static int aio_worker(void *arg)
 {
     RawPosixAIOData *aiocb = arg;
@@ -1238,6 +1562,9 @@ static int aio_worker(void *arg)
     case QEMU_AIO_WRITE_ZEROES:
         ret = handle_aiocb_write_zeroes(aiocb);
         break;
+    case QEMU_AIO_COPY_RANGE:
+        ret = handle_aiocb_copy_range(aiocb);
+        break;
     default:
         fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
         ret = -EINVAL;
@@ -1323,6 +1650,12 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
 #endif
         }
     }
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring && !(type & QEMU_AIO_MISALIGNED)) {
+        return luring_submit(bs, s->io_uring_ctx, s->fd, sector_num, qiov,
+                             nb_sectors, cb, opaque, type);
+    }
+#endif
 
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
@@ -1330,32 +1663,53 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_plug(bs, s->aio_ctx);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_io_plug(bs, s->io_uring_ctx);
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, true);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_io_unplug(bs, s->io_uring_ctx, true);
+    }
+#endif
 }
 
 static void raw_aio_flush_io_queue(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, false);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_io_unplug(bs, s->io_uring_ctx, false);
+    }
+#endif
 }
 
 static BlockAIOCB *raw_aio_readv(BlockDriverState *bs,
@@ -1382,6 +1736,12 @@ static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        return luring_submit(bs, s->io_uring_ctx, s->fd, 0, NULL, 0,
+                             cb, opaque, QEMU_AIO_FLUSH);
+    }
+#endif
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
@@ -1395,6 +1755,11 @@ static void raw_close(BlockDriverState *bs)
     if (s->use_aio) {
         laio_cleanup(s->aio_ctx);
     }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring_ctx) {
+        luring_cleanup(s->io_uring_ctx);
+    }
 #endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
@@ -1402,6 +1767,65 @@ static void raw_close(BlockDriverState *bs)
     }
 }
 
+/*
+ * Allocate host space for the bytes between @start and @end of the file
+ * that @fd refers to, which must already be at least @end bytes long.
+ */
+static int raw_preallocate(int fd, int64_t start, int64_t end,
+                           PreallocMode prealloc, Error **errp)
+{
+    int result = 0;
+
+    switch (prealloc) {
+#ifdef CONFIG_POSIX_FALLOCATE
+    case PREALLOC_MODE_FALLOC:
+        /* posix_fallocate() doesn't set errno. */
+        result = -posix_fallocate(fd, start, end - start);
+        if (result != 0) {
+            error_setg_errno(errp, -result,
+                             "Could not preallocate data for the new file");
+        }
+        break;
+#endif
+    case PREALLOC_MODE_FULL:
+    {
+        int64_t num = 0, left = end - start;
+        char *buf = g_malloc0(65536);
+
+        while (left > 0) {
+            num = MIN(left, 65536);
+            result = pwrite(fd, buf, num, end - left);
+            if (result < 0) {
+                result = -errno;
+                error_setg_errno(errp, -result,
+                                 "Could not write to the new file");
+                break;
+            }
+            left -= result;
+        }
+        if (result >= 0) {
+            result = fsync(fd);
+            if (result < 0) {
+                result = -errno;
+                error_setg_errno(errp, -result,
+                                 "Could not flush new file to disk");
+            }
+        }
+        g_free(buf);
+        break;
+    }
+    case PREALLOC_MODE_OFF:
+        break;
+    default:
+        result = -EINVAL;
+        error_setg(errp, "Unsupported preallocation mode: %s",
+                   PreallocMode_lookup[prealloc]);
+        break;
+    }
+
+    return result;
+}
+
 static int raw_truncate(BlockDriverState *bs, int64_t offset)
 {
     BDRVRawState *s = bs->opaque;
@@ -1426,6 +1850,34 @@ static int raw_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+static int raw_truncate_prealloc(BlockDriverState *bs, int64_t offset,
+                                 PreallocMode prealloc, Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+    struct stat st;
+
+    if (fstat(s->fd, &st)) {
+        return -errno;
+    }
+
+    /* Host devices cannot be preallocated any further */
+    if (!S_ISREG(st.st_mode)) {
+        return raw_truncate(bs, offset);
+    }
+
+    if (prealloc == PREALLOC_MODE_METADATA) {
+        error_setg(errp, "Unsupported preallocation mode: %s",
+                   PreallocMode_lookup[prealloc]);
+        return -ENOTSUP;
+    }
+
+    if (ftruncate(s->fd, offset) < 0) {
+        return -errno;
+    }
+
+    return raw_preallocate(s->fd, st.st_size, offset, prealloc, errp);
+}
+
 #ifdef __OpenBSD__
 static int64_t raw_getlength(BlockDriverState *bs)
 {
@@ -1662,52 +2114,7 @@ static int raw_create(const char *filename, QemuOpts *opts, Error **errp)
         goto out_close;
     }
 
-    switch (prealloc) {
-#ifdef CONFIG_POSIX_FALLOCATE
-    case PREALLOC_MODE_FALLOC:
-        /* posix_fallocate() doesn't set errno. */
-        result = -posix_fallocate(fd, 0, total_size);
-        if (result != 0) {
-            error_setg_errno(errp, -result,
-                             "Could not preallocate data for the new file");
-        }
-        break;
-#endif
-    case PREALLOC_MODE_FULL:
-    {
-        int64_t num = 0, left = total_size;
-        buf = g_malloc0(65536);
-
-        while (left > 0) {
-            num = MIN(left, 65536);
-            result = write(fd, buf, num);
-            if (result < 0) {
-                result = -errno;
-                error_setg_errno(errp, -result,
-                                 "Could not write to the new file");
-                break;
-            }
-            left -= result;
-        }
-        if (result >= 0) {
-            result = fsync(fd);
-            if (result < 0) {
-                result = -errno;
-                error_setg_errno(errp, -result,
-                                 "Could not flush new file to disk");
-            }
-        }
-        g_free(buf);
-        break;
-    }
-    case PREALLOC_MODE_OFF:
-        break;
-    default:
-        result = -EINVAL;
-        error_setg(errp, "Unsupported preallocation mode: %s",
-                   PreallocMode_lookup[prealloc]);
-        break;
-    }
+    result = raw_preallocate(fd, 0, total_size, prealloc, errp);
 
 out_close:
     if (qemu_close(fd) != 0 && result == 0) {
@@ -1891,6 +2298,52 @@ static int coroutine_fn raw_co_write_zeroes(
     return -ENOTSUP;
 }
 
+static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
+                                               int64_t src_sector,
+                                               BlockDriverState *dst,
+                                               int64_t dst_sector,
+                                               int nb_sectors)
+{
+    return bdrv_co_copy_range_to(bs, src_sector, dst, dst_sector,
+                                 nb_sectors, 0);
+}
+
+static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
+                                             BlockDriverState *src,
+                                             int64_t src_sector,
+                                             int64_t dst_sector,
+                                             int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+    BDRVRawState *src_s;
+    RawPosixAIOData *acb;
+    ThreadPool *pool;
+
+    /* copy_file_range() needs file descriptors on both ends */
+    if (!s->has_copy_range ||
+        src->drv->bdrv_co_copy_range_to != raw_co_copy_range_to) {
+        return -ENOTSUP;
+    }
+
+    src_s = src->opaque;
+    if (fd_open(src) < 0 || fd_open(bs) < 0) {
+        return -EIO;
+    }
+
+    acb = g_new(RawPosixAIOData, 1);
+    acb->bs = bs;
+    acb->aio_type = QEMU_AIO_COPY_RANGE;
+    acb->aio_fildes = src_s->fd;
+    acb->aio_offset = src_sector * BDRV_SECTOR_SIZE;
+    acb->aio_fd2 = s->fd;
+    acb->aio_offset2 = dst_sector * BDRV_SECTOR_SIZE;
+    acb->aio_nbytes = nb_sectors * BDRV_SECTOR_SIZE;
+
+    trace_paio_submit_copy_range(src_sector, dst_sector, nb_sectors);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_co(pool, aio_worker, acb);
+}
+
 static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVRawState *s = bs->opaque;
@@ -1939,6 +2392,8 @@ BlockDriver bdrv_file = {
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_get_block_status = raw_co_get_block_status,
     .bdrv_co_write_zeroes = raw_co_write_zeroes,
+    .bdrv_co_copy_range_from = raw_co_copy_range_from,
+    .bdrv_co_copy_range_to = raw_co_copy_range_to,
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
@@ -1950,6 +2405,7 @@ BlockDriver bdrv_file = {
     .bdrv_flush_io_queue = raw_aio_flush_io_queue,
 
     .bdrv_truncate = raw_truncate,
+    .bdrv_truncate_prealloc = raw_truncate_prealloc,
     .bdrv_getlength = raw_getlength,
     .bdrv_get_info = raw_get_info,
     .bdrv_get_allocated_file_size
@@ -2155,6 +2611,17 @@ static int hdev_open(BlockDriverState *bs, QDict *options, int flags,
     /* Since this does ioctl the device must be already opened */
     bs->sg = hdev_is_sg(bs);
 
+#if defined(__linux__)
+    /* The asynchronous sg interface needs a writable character device;
+     * SG_IO on block devices keeps going through the thread pool.
+     */
+    if (bs->sg && (s->open_flags & O_ACCMODE) == O_RDWR) {
+        s->sg_async = true;
+        qemu_set_nonblock(s->fd);
+        hdev_sg_set_handler(bs, bdrv_get_aio_context(bs), true);
+    }
+#endif
+
     if (flags & BDRV_O_RDWR) {
         ret = check_hdev_writable(s);
         if (ret < 0) {
@@ -2169,6 +2636,68 @@ static int hdev_open(BlockDriverState *bs, QDict *options, int flags,
 
 #if defined(__linux__)
 
+typedef struct SgAIOCB {
+    BlockAIOCB common;
+    sg_io_hdr_t *hdr;
+    void *usr_ptr;
+} SgAIOCB;
+
+static const AIOCBInfo sg_aiocb_info = {
+    .aiocb_size         = sizeof(SgAIOCB),
+};
+
+/* Reap the SG_IO requests that were submitted with hdev_sg_submit.  The
+ * kernel hands back a copy of the header with the status filled in.
+ */
+static void hdev_sg_read(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVRawState *s = bs->opaque;
+    sg_io_hdr_t hdr;
+    SgAIOCB *acb;
+
+    while (read(s->fd, &hdr, sizeof(hdr)) == sizeof(hdr)) {
+        acb = hdr.usr_ptr;
+        hdr.usr_ptr = acb->usr_ptr;
+        *acb->hdr = hdr;
+        acb->common.cb(acb->common.opaque, 0);
+        qemu_aio_unref(acb);
+    }
+}
+
+static void hdev_sg_set_handler(BlockDriverState *bs, AioContext *ctx,
+                                bool enable)
+{
+    BDRVRawState *s = bs->opaque;
+
+    aio_set_fd_handler(ctx, s->fd, false,
+                       enable ? hdev_sg_read : NULL, NULL, bs);
+}
+
+/* Queue @hdr to the sg driver without waiting for it.  Returns NULL if
+ * the driver does not take the request (e.g. its queue is full), in
+ * which case the caller falls back to a blocking SG_IO.
+ */
+static BlockAIOCB *hdev_sg_submit(BlockDriverState *bs, sg_io_hdr_t *hdr,
+                                  BlockCompletionFunc *cb, void *opaque)
+{
+    BDRVRawState *s = bs->opaque;
+    SgAIOCB *acb;
+    ssize_t ret;
+
+    acb = qemu_aio_get(&sg_aiocb_info, bs, cb, opaque);
+    acb->hdr = hdr;
+    acb->usr_ptr = hdr->usr_ptr;
+    hdr->usr_ptr = acb;
+    ret = write(s->fd, hdr, sizeof(*hdr));
+    hdr->usr_ptr = acb->usr_ptr;
+    if (ret != sizeof(*hdr)) {
+        qemu_aio_unref(acb);
+        return NULL;
+    }
+    return &acb->common;
+}
+
 static BlockAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
         unsigned long int req, void *buf,
         BlockCompletionFunc *cb, void *opaque)
@@ -2180,6 +2709,13 @@ static BlockAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+    if (s->sg_async && req == SG_IO) {
+        BlockAIOCB *sg_acb = hdev_sg_submit(bs, buf, cb, opaque);
+        if (sg_acb) {
+            return sg_acb;
+        }
+    }
+
     acb = g_new(RawPosixAIOData, 1);
     acb->bs = bs;
     acb->aio_type = QEMU_AIO_IOCTL;
@@ -131,6 +131,31 @@ static int coroutine_fn raw_co_write_zeroes(BlockDriverState *bs,
     return bdrv_co_write_zeroes(bs->file->bs, sector_num, nb_sectors, flags);
 }
 
+static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
+                                               int64_t src_sector,
+                                               BlockDriverState *dst,
+                                               int64_t dst_sector,
+                                               int nb_sectors)
+{
+    return bdrv_co_copy_range_from(bs->file->bs, src_sector, dst, dst_sector,
+                                   nb_sectors, 0);
+}
+
+static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
+                                             BlockDriverState *src,
+                                             int64_t src_sector,
+                                             int64_t dst_sector,
+                                             int nb_sectors)
+{
+    if (bs->probed && dst_sector == 0) {
+        /* Let raw_co_writev() check the data written to the probe buffer */
+        return -ENOTSUP;
+    }
+
+    return bdrv_co_copy_range_to(src, src_sector, bs->file->bs, dst_sector,
+                                 nb_sectors, 0);
+}
+
 static int coroutine_fn raw_co_discard(BlockDriverState *bs,
                                        int64_t sector_num, int nb_sectors)
 {
@@ -157,6 +182,12 @@ static int raw_truncate(BlockDriverState *bs, int64_t offset)
     return bdrv_truncate(bs->file->bs, offset);
 }
 
+static int raw_truncate_prealloc(BlockDriverState *bs, int64_t offset,
+                                 PreallocMode prealloc, Error **errp)
+{
+    return bdrv_truncate_prealloc(bs->file->bs, offset, prealloc, errp);
+}
+
 static int raw_media_changed(BlockDriverState *bs)
 {
     return bdrv_media_changed(bs->file->bs);
@@ -249,8 +280,11 @@ BlockDriver bdrv_raw = {
     .bdrv_co_writev       = &raw_co_writev,
     .bdrv_co_write_zeroes = &raw_co_write_zeroes,
     .bdrv_co_discard      = &raw_co_discard,
+    .bdrv_co_copy_range_from = &raw_co_copy_range_from,
+    .bdrv_co_copy_range_to  = &raw_co_copy_range_to,
     .bdrv_co_get_block_status = &raw_co_get_block_status,
     .bdrv_truncate        = &raw_truncate,
+    .bdrv_truncate_prealloc = &raw_truncate_prealloc,
     .bdrv_getlength       = &raw_getlength,
     .has_variable_length  = true,
     .bdrv_get_info        = &raw_get_info,
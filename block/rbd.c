@@ -17,6 +17,8 @@
 #include "qemu/error-report.h"
 #include "block/block_int.h"
 #include "crypto/secret.h"
+#include "qemu/thread.h"
+#include "qemu/event_notifier.h"
 
 #include <rbd/librbd.h>
 
@@ -52,6 +54,16 @@
 #undef LIBRBD_SUPPORTS_DISCARD
 #endif
 
+/*
+ * LIBRBD_SUPPORTS_IOVEC (rbd_aio_readv and _writev) and
+ * LIBRBD_SUPPORTS_WRITE_ZEROES come from librbd.h itself.  The fast-diff
+ * object map lets rbd_diff_iterate2 answer block status queries without
+ * listing the objects.
+ */
+#ifdef RBD_FLAG_FAST_DIFF_INVALID
+#define LIBRBD_SUPPORTS_FAST_DIFF
+#endif
+
 #define OBJ_MAX_SIZE (1UL << OBJ_DEFAULT_OBJ_ORDER)
 
 #define RBD_MAX_CONF_NAME_SIZE 128
@@ -65,12 +77,12 @@ typedef enum {
     RBD_AIO_READ,
     RBD_AIO_WRITE,
     RBD_AIO_DISCARD,
-    RBD_AIO_FLUSH
+    RBD_AIO_FLUSH,
+    RBD_AIO_WRITE_ZEROES
 } RBDAIOCmd;
 
 typedef struct RBDAIOCB {
     BlockAIOCB common;
-    QEMUBH *bh;
     int64_t ret;
     QEMUIOVector *qiov;
     char *bounce;
@@ -85,6 +97,7 @@ typedef struct RADOSCB {
     int64_t size;
     char *buf;
     int64_t ret;
+    QSIMPLEQ_ENTRY(RADOSCB) next;
 } RADOSCB;
 
 typedef struct BDRVRBDState {
@@ -93,6 +106,14 @@ typedef struct BDRVRBDState {
     rbd_image_t image;
     char name[RBD_MAX_IMAGE_NAME_SIZE];
     char *snap;
+
+    /*
+     * librbd completes requests in its own threads.  They are queued
+     * here and the AioContext is woken up once for each batch.
+     */
+    EventNotifier e;
+    QemuMutex completion_lock;
+    QSIMPLEQ_HEAD(, RADOSCB) completed;
 } BDRVRBDState;
 
 static int qemu_rbd_next_tok(char *dst, int dst_len,
@@ -399,9 +420,21 @@ static int qemu_rbd_create(const char *filename, QemuOpts *opts, Error **errp)
     return ret;
 }
 
+/* Zero the part of a read request after OFFS */
+static void qemu_rbd_memset(RADOSCB *rcb, int64_t offs)
+{
+    RBDAIOCB *acb = rcb->acb;
+
+    if (acb->bounce) {
+        memset(rcb->buf + offs, 0, rcb->size - offs);
+    } else {
+        qemu_iovec_memset(acb->qiov, offs, 0, rcb->size - offs);
+    }
+}
+
 /*
- * This aio completion is being called from rbd_finish_bh() and runs in qemu
- * BH context.
+ * This aio completion is being called from qemu_rbd_completion_cb() and
+ * runs in the AioContext of the BlockDriverState.
  */
 static void qemu_rbd_complete_aio(RADOSCB *rcb)
 {
@@ -419,11 +452,11 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
         }
     } else {
         if (r < 0) {
-            memset(rcb->buf, 0, rcb->size);
+            qemu_rbd_memset(rcb, 0);
             acb->ret = r;
             acb->error = 1;
         } else if (r < rcb->size) {
-            memset(rcb->buf + r, 0, rcb->size - r);
+            qemu_rbd_memset(rcb, r);
             if (!acb->error) {
                 acb->ret = rcb->size;
             }
@@ -434,7 +467,7 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
 
     g_free(rcb);
 
-    if (acb->cmd == RBD_AIO_READ) {
+    if (acb->cmd == RBD_AIO_READ && acb->bounce) {
         qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
     }
     qemu_vfree(acb->bounce);
@@ -443,6 +476,67 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
     qemu_aio_unref(acb);
 }
 
+static void qemu_rbd_completion_cb(EventNotifier *e)
+{
+    BDRVRBDState *s = container_of(e, BDRVRBDState, e);
+    QSIMPLEQ_HEAD(, RADOSCB) completed = QSIMPLEQ_HEAD_INITIALIZER(completed);
+    RADOSCB *rcb;
+
+    event_notifier_test_and_clear(e);
+
+    qemu_mutex_lock(&s->completion_lock);
+    QSIMPLEQ_CONCAT(&completed, &s->completed);
+    qemu_mutex_unlock(&s->completion_lock);
+
+    while ((rcb = QSIMPLEQ_FIRST(&completed)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&completed, next);
+        qemu_rbd_complete_aio(rcb);
+    }
+}
+
+/*
+ * This is the callback function for rbd_aio_read and _write
+ *
+ * Note: this function is being called from a non qemu thread so
+ * we need to be careful about what we do here. Generally we only
+ * queue the request, and do the rest of the io completion handling
+ * from qemu_rbd_completion_cb() which runs in a qemu context.  Only
+ * the first request of a batch needs to wake up the AioContext.
+ */
+static void rbd_finish_aiocb(rbd_completion_t c, RADOSCB *rcb)
+{
+    BDRVRBDState *s = rcb->s;
+    bool notify;
+
+    rcb->ret = rbd_aio_get_return_value(c);
+    rbd_aio_release(c);
+
+    qemu_mutex_lock(&s->completion_lock);
+    notify = QSIMPLEQ_EMPTY(&s->completed);
+    QSIMPLEQ_INSERT_TAIL(&s->completed, rcb, next);
+    qemu_mutex_unlock(&s->completion_lock);
+
+    if (notify) {
+        event_notifier_set(&s->e);
+    }
+}
+
+static void qemu_rbd_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVRBDState *s = bs->opaque;
+
+    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->e, false, NULL);
+}
+
+static void qemu_rbd_attach_aio_context(BlockDriverState *bs,
+                                        AioContext *new_context)
+{
+    BDRVRBDState *s = bs->opaque;
+
+    aio_set_event_notifier(new_context, &s->e, false,
+                           qemu_rbd_completion_cb);
+}
+
 /* TODO Convert to fine grained options */
 static QemuOptsList runtime_opts = {
     .name = "rbd",
@@ -561,11 +655,22 @@ static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
         goto failed_open;
     }
 
+    r = event_notifier_init(&s->e, false);
+    if (r < 0) {
+        error_setg_errno(errp, -r, "failed to initialize event notifier");
+        goto failed_notifier;
+    }
+    qemu_mutex_init(&s->completion_lock);
+    QSIMPLEQ_INIT(&s->completed);
+    qemu_rbd_attach_aio_context(bs, bdrv_get_aio_context(bs));
+
     bs->read_only = (s->snap != NULL);
 
     qemu_opts_del(opts);
     return 0;
 
+failed_notifier:
+    rbd_close(s->image);
 failed_open:
     rados_ioctx_destroy(s->io_ctx);
 failed_shutdown:
@@ -580,6 +685,10 @@ static void qemu_rbd_close(BlockDriverState *bs)
 {
     BDRVRBDState *s = bs->opaque;
 
+    qemu_rbd_detach_aio_context(bs);
+    event_notifier_cleanup(&s->e);
+    qemu_mutex_destroy(&s->completion_lock);
+
     rbd_close(s->image);
     rados_ioctx_destroy(s->io_ctx);
     g_free(s->snap);
@@ -590,33 +699,6 @@ static const AIOCBInfo rbd_aiocb_info = {
     .aiocb_size = sizeof(RBDAIOCB),
 };
 
-static void rbd_finish_bh(void *opaque)
-{
-    RADOSCB *rcb = opaque;
-    qemu_bh_delete(rcb->acb->bh);
-    qemu_rbd_complete_aio(rcb);
-}
-
-/*
- * This is the callback function for rbd_aio_read and _write
- *
- * Note: this function is being called from a non qemu thread so
- * we need to be careful about what we do here. Generally we only
- * schedule a BH, and do the rest of the io completion handling
- * from rbd_finish_bh() which runs in a qemu context.
- */
-static void rbd_finish_aiocb(rbd_completion_t c, RADOSCB *rcb)
-{
-    RBDAIOCB *acb = rcb->acb;
-
-    rcb->ret = rbd_aio_get_return_value(c);
-    rbd_aio_release(c);
-
-    acb->bh = aio_bh_new(bdrv_get_aio_context(acb->common.bs),
-                         rbd_finish_bh, rcb);
-    qemu_bh_schedule(acb->bh);
-}
-
 static int rbd_aio_discard_wrapper(rbd_image_t image,
                                    uint64_t off,
                                    uint64_t len,
@@ -629,6 +711,18 @@ static int rbd_aio_discard_wrapper(rbd_image_t image,
 #endif
 }
 
+static int rbd_aio_write_zeroes_wrapper(rbd_image_t image,
+                                        uint64_t off,
+                                        uint64_t len,
+                                        rbd_completion_t comp)
+{
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+    return rbd_aio_write_zeroes(image, off, len, comp, 0, 0);
+#else
+    return -ENOTSUP;
+#endif
+}
+
 static int rbd_aio_flush_wrapper(rbd_image_t image,
                                  rbd_completion_t comp)
 {
@@ -659,20 +753,20 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb = qemu_aio_get(&rbd_aiocb_info, bs, cb, opaque);
     acb->cmd = cmd;
     acb->qiov = qiov;
-    if (cmd == RBD_AIO_DISCARD || cmd == RBD_AIO_FLUSH) {
-        acb->bounce = NULL;
-    } else {
+    acb->bounce = NULL;
+#ifndef LIBRBD_SUPPORTS_IOVEC
+    if (cmd == RBD_AIO_READ || cmd == RBD_AIO_WRITE) {
         acb->bounce = qemu_try_blockalign(bs, qiov->size);
         if (acb->bounce == NULL) {
             goto failed;
         }
     }
+#endif
     acb->ret = 0;
     acb->error = 0;
     acb->s = s;
-    acb->bh = NULL;
 
-    if (cmd == RBD_AIO_WRITE) {
+    if (cmd == RBD_AIO_WRITE && acb->bounce) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
     }
 
@@ -693,14 +787,25 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
 
     switch (cmd) {
     case RBD_AIO_WRITE:
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_writev(s->image, qiov->iov, qiov->niov, off, c);
+#else
         r = rbd_aio_write(s->image, off, size, buf, c);
+#endif
         break;
     case RBD_AIO_READ:
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_readv(s->image, qiov->iov, qiov->niov, off, c);
+#else
         r = rbd_aio_read(s->image, off, size, buf, c);
+#endif
         break;
     case RBD_AIO_DISCARD:
         r = rbd_aio_discard_wrapper(s->image, off, size, c);
         break;
+    case RBD_AIO_WRITE_ZEROES:
+        r = rbd_aio_write_zeroes_wrapper(s->image, off, size, c);
+        break;
     case RBD_AIO_FLUSH:
         r = rbd_aio_flush_wrapper(s->image, c);
         break;
@@ -723,6 +828,43 @@ failed:
     return NULL;
 }
 
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+typedef struct RBDCoRequest {
+    Coroutine *co;
+    int ret;
+} RBDCoRequest;
+
+static void qemu_rbd_co_complete(void *opaque, int ret)
+{
+    RBDCoRequest *req = opaque;
+
+    req->ret = ret;
+    qemu_coroutine_enter(req->co, NULL);
+}
+
+static int coroutine_fn qemu_rbd_co_write_zeroes(BlockDriverState *bs,
+                                                 int64_t sector_num,
+                                                 int nb_sectors,
+                                                 BdrvRequestFlags flags)
+{
+    RBDCoRequest req = {
+        .co = qemu_coroutine_self(),
+    };
+
+    /* librbd deallocates the objects that are zeroed entirely */
+    if (!(flags & BDRV_REQ_MAY_UNMAP)) {
+        return -ENOTSUP;
+    }
+
+    if (!rbd_start_aio(bs, sector_num, NULL, nb_sectors,
+                       qemu_rbd_co_complete, &req, RBD_AIO_WRITE_ZEROES)) {
+        return -EIO;
+    }
+    qemu_coroutine_yield();
+    return req.ret;
+}
+#endif
+
 static BlockAIOCB *qemu_rbd_aio_readv(BlockDriverState *bs,
                                       int64_t sector_num,
                                       QEMUIOVector *qiov,
@@ -935,6 +1077,86 @@ static BlockAIOCB* qemu_rbd_aio_discard(BlockDriverState *bs,
 }
 #endif
 
+#ifdef LIBRBD_SUPPORTS_FAST_DIFF
+#define QEMU_RBD_EXIT_DIFF_ITERATE2 -9000
+
+typedef struct RBDDiffIterateReq {
+    uint64_t offs;
+    uint64_t end;       /* end of the run of bytes that share offs' status */
+    bool found;
+    bool exists;
+} RBDDiffIterateReq;
+
+/* Called for each allocated extent, in order, by rbd_diff_iterate2 */
+static int qemu_rbd_diff_iterate_cb(uint64_t offs, size_t len,
+                                    int exists, void *opaque)
+{
+    RBDDiffIterateReq *req = opaque;
+
+    if (!exists) {
+        return 0;
+    }
+    if (!req->found) {
+        req->found = true;
+        if (offs > req->offs) {
+            /* The query starts in a hole */
+            req->end = offs;
+            return QEMU_RBD_EXIT_DIFF_ITERATE2;
+        }
+        req->exists = true;
+    } else if (offs > req->end) {
+        /* The allocated run ends before the next extent */
+        return QEMU_RBD_EXIT_DIFF_ITERATE2;
+    }
+    req->end = offs + len;
+    return 0;
+}
+
+static int64_t coroutine_fn qemu_rbd_co_get_block_status(
+    BlockDriverState *bs, int64_t sector_num, int nb_sectors, int *pnum,
+    BlockDriverState **file)
+{
+    BDRVRBDState *s = bs->opaque;
+    RBDDiffIterateReq req = {
+        .offs = sector_num * BDRV_SECTOR_SIZE,
+    };
+    uint64_t features, flags;
+    int64_t ret = BDRV_BLOCK_DATA;
+    int r;
+
+    *pnum = nb_sectors;
+    *file = bs;
+
+    /* Without a valid object map, every object would have to be listed */
+    r = rbd_get_features(s->image, &features);
+    if (r < 0 || !(features & RBD_FEATURE_FAST_DIFF)) {
+        goto out;
+    }
+    r = rbd_get_flags(s->image, &flags);
+    if (r < 0 || (flags & RBD_FLAG_FAST_DIFF_INVALID)) {
+        goto out;
+    }
+
+    r = rbd_diff_iterate2(s->image, NULL, req.offs,
+                          (uint64_t)nb_sectors * BDRV_SECTOR_SIZE,
+                          true, true, qemu_rbd_diff_iterate_cb, &req);
+    if (r < 0 && r != QEMU_RBD_EXIT_DIFF_ITERATE2) {
+        goto out;
+    }
+
+    if (!req.found) {
+        ret = BDRV_BLOCK_ZERO;
+    } else {
+        ret = req.exists ? BDRV_BLOCK_DATA : BDRV_BLOCK_ZERO;
+        *pnum = MIN(nb_sectors,
+                    DIV_ROUND_UP(req.end - req.offs, BDRV_SECTOR_SIZE));
+    }
+
+out:
+    return ret | BDRV_BLOCK_OFFSET_VALID | req.offs;
+}
+#endif
+
 #ifdef LIBRBD_SUPPORTS_INVALIDATE
 static void qemu_rbd_invalidate_cache(BlockDriverState *bs,
                                       Error **errp)
@@ -996,6 +1218,15 @@ static BlockDriver bdrv_rbd = {
 #ifdef LIBRBD_SUPPORTS_DISCARD
     .bdrv_aio_discard       = qemu_rbd_aio_discard,
 #endif
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+    .bdrv_co_write_zeroes   = qemu_rbd_co_write_zeroes,
+#endif
+#ifdef LIBRBD_SUPPORTS_FAST_DIFF
+    .bdrv_co_get_block_status = qemu_rbd_co_get_block_status,
+#endif
+
+    .bdrv_detach_aio_context  = qemu_rbd_detach_aio_context,
+    .bdrv_attach_aio_context  = qemu_rbd_attach_aio_context,
 
     .bdrv_snapshot_create   = qemu_rbd_snap_create,
     .bdrv_snapshot_delete   = qemu_rbd_snap_remove,
@@ -0,0 +1,696 @@
+/*
+ * Shared read cache filter for block devices
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qint.h"
+#include "qapi/qmp/qstring.h"
+#include "qapi/util.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "trace.h"
+
+/* Data is cached in chunks of this size, aligned to the chunk size */
+#define READ_CACHE_CHUNK_SIZE       (64 * 1024)
+#define READ_CACHE_CHUNK_SECTORS    (READ_CACHE_CHUNK_SIZE >> BDRV_SECTOR_BITS)
+
+#define READ_CACHE_DEFAULT_SIZE     (64 * 1024 * 1024)
+#define READ_CACHE_DEFAULT_GROUP    "default"
+
+#define READ_CACHE_OPT_GROUP        "group"
+#define READ_CACHE_OPT_SIZE         "size"
+#define READ_CACHE_OPT_EVICTION     "eviction"
+
+typedef struct ReadCacheKey {
+    const char *image;          /* points to ReadCacheEntry.image */
+    uint64_t chunk;
+} ReadCacheKey;
+
+typedef struct ReadCacheEntry {
+    ReadCacheKey key;
+    char *image;
+    uint8_t *data;
+    int bytes;                  /* the last chunk of an image may be short */
+    QTAILQ_ENTRY(ReadCacheEntry) next;
+} ReadCacheEntry;
+
+typedef struct BDRVReadCacheState BDRVReadCacheState;
+
+/* The ReadCacheGroup is shared among all read-cache nodes with the same group
+ * name, independent of their AioContext, so it needs its own locking.  Cached
+ * data is keyed by the filename of the image below the filter, so that nodes
+ * opened separately on the same image share it. */
+typedef struct ReadCacheGroup {
+    char *name;                 /* This is constant during the lifetime of the
+                                 * group */
+    ReadCacheEviction eviction; /* Likewise */
+
+    QemuMutex lock;             /* This lock protects the following fields */
+    GHashTable *entries;
+    QTAILQ_HEAD(, ReadCacheEntry) lru;  /* least recently used first (or
+                                         * oldest first with FIFO eviction) */
+    uint64_t size;              /* largest size requested by the members */
+    uint64_t used;
+    uint64_t generation;        /* incremented whenever data is invalidated */
+    QLIST_HEAD(, BDRVReadCacheState) members;
+
+    /* These two are protected by the global read_cache_groups_lock */
+    unsigned refcount;
+    QTAILQ_ENTRY(ReadCacheGroup) list;
+} ReadCacheGroup;
+
+struct BDRVReadCacheState {
+    ReadCacheGroup *group;
+    char *image;
+    uint64_t size;
+    QLIST_ENTRY(BDRVReadCacheState) next;
+};
+
+static QemuMutex read_cache_groups_lock;
+static QTAILQ_HEAD(, ReadCacheGroup) read_cache_groups =
+    QTAILQ_HEAD_INITIALIZER(read_cache_groups);
+
+static guint read_cache_key_hash(gconstpointer p)
+{
+    const ReadCacheKey *key = p;
+
+    return g_str_hash(key->image) ^ g_int64_hash(&key->chunk);
+}
+
+static gboolean read_cache_key_equal(gconstpointer a, gconstpointer b)
+{
+    const ReadCacheKey *ka = a;
+    const ReadCacheKey *kb = b;
+
+    return ka->chunk == kb->chunk && !strcmp(ka->image, kb->image);
+}
+
+/* Called with group->lock held */
+static void read_cache_remove_entry(ReadCacheGroup *group,
+                                    ReadCacheEntry *entry)
+{
+    QTAILQ_REMOVE(&group->lru, entry, next);
+    g_hash_table_remove(group->entries, &entry->key);
+    group->used -= READ_CACHE_CHUNK_SIZE;
+
+    qemu_vfree(entry->data);
+    g_free(entry->image);
+    g_free(entry);
+}
+
+/* Called with group->lock held */
+static void read_cache_evict(ReadCacheGroup *group, uint64_t size)
+{
+    ReadCacheEntry *entry;
+
+    while (group->used > size && (entry = QTAILQ_FIRST(&group->lru))) {
+        read_cache_remove_entry(group, entry);
+    }
+}
+
+/* Called with group->lock held */
+static void read_cache_update_size(ReadCacheGroup *group)
+{
+    BDRVReadCacheState *s;
+
+    group->size = 0;
+    QLIST_FOREACH(s, &group->members, next) {
+        group->size = MAX(group->size, s->size);
+    }
+    read_cache_evict(group, group->size);
+}
+
+/* Drops the cached data of @image in the chunks [@first, @last].  Called with
+ * group->lock held. */
+static void read_cache_invalidate(ReadCacheGroup *group, const char *image,
+                                  uint64_t first, uint64_t last)
+{
+    ReadCacheEntry *entry, *next;
+
+    group->generation++;
+
+    if (last - first >= g_hash_table_size(group->entries)) {
+        QTAILQ_FOREACH_SAFE(entry, &group->lru, next, next) {
+            if (entry->key.chunk >= first && entry->key.chunk <= last &&
+                !strcmp(entry->image, image)) {
+                read_cache_remove_entry(group, entry);
+            }
+        }
+    } else {
+        ReadCacheKey key = { .image = image };
+
+        for (key.chunk = first; key.chunk <= last; key.chunk++) {
+            entry = g_hash_table_lookup(group->entries, &key);
+            if (entry) {
+                read_cache_remove_entry(group, entry);
+            }
+        }
+    }
+}
+
+/* Adds @s to the ReadCacheGroup called @name, creating the group if it does
+ * not exist yet. */
+static int read_cache_group_join(BDRVReadCacheState *s, const char *name,
+                                 ReadCacheEviction eviction, Error **errp)
+{
+    ReadCacheGroup *group = NULL;
+    ReadCacheGroup *iter;
+
+    qemu_mutex_lock(&read_cache_groups_lock);
+
+    /* Look for an existing group with that name */
+    QTAILQ_FOREACH(iter, &read_cache_groups, list) {
+        if (!strcmp(name, iter->name)) {
+            group = iter;
+            break;
+        }
+    }
+
+    if (group && group->eviction != eviction) {
+        error_setg(errp, "Read cache group '%s' already uses eviction "
+                   "policy '%s'", name,
+                   ReadCacheEviction_lookup[group->eviction]);
+        qemu_mutex_unlock(&read_cache_groups_lock);
+        return -EINVAL;
+    }
+
+    /* Create a new one if not found */
+    if (!group) {
+        group = g_new0(ReadCacheGroup, 1);
+        group->name = g_strdup(name);
+        group->eviction = eviction;
+        qemu_mutex_init(&group->lock);
+        group->entries = g_hash_table_new(read_cache_key_hash,
+                                          read_cache_key_equal);
+        QTAILQ_INIT(&group->lru);
+        QLIST_INIT(&group->members);
+
+        QTAILQ_INSERT_TAIL(&read_cache_groups, group, list);
+    }
+
+    group->refcount++;
+    s->group = group;
+
+    qemu_mutex_lock(&group->lock);
+    QLIST_INSERT_HEAD(&group->members, s, next);
+    read_cache_update_size(group);
+    qemu_mutex_unlock(&group->lock);
+
+    qemu_mutex_unlock(&read_cache_groups_lock);
+
+    return 0;
+}
+
+/* Removes @s from its ReadCacheGroup.  The cached data of its image is dropped
+ * when no other member uses the image, because the image file may change
+ * before it is opened again.  The group is destroyed with its last member. */
+static void read_cache_group_leave(BDRVReadCacheState *s)
+{
+    ReadCacheGroup *group = s->group;
+    BDRVReadCacheState *iter;
+    bool image_in_use = false;
+
+    qemu_mutex_lock(&read_cache_groups_lock);
+
+    qemu_mutex_lock(&group->lock);
+    QLIST_REMOVE(s, next);
+    QLIST_FOREACH(iter, &group->members, next) {
+        if (!strcmp(iter->image, s->image)) {
+            image_in_use = true;
+            break;
+        }
+    }
+    if (!image_in_use) {
+        read_cache_invalidate(group, s->image, 0, UINT64_MAX);
+    }
+    read_cache_update_size(group);
+    qemu_mutex_unlock(&group->lock);
+
+    if (--group->refcount == 0) {
+        assert(group->used == 0);
+        QTAILQ_REMOVE(&read_cache_groups, group, list);
+        g_hash_table_destroy(group->entries);
+        qemu_mutex_destroy(&group->lock);
+        g_free(group->name);
+        g_free(group);
+    }
+
+    qemu_mutex_unlock(&read_cache_groups_lock);
+    s->group = NULL;
+}
+
+/* Valid read-cache filenames look like read-cache:path/to/image */
+static void read_cache_parse_filename(const char *filename, QDict *options,
+                                      Error **errp)
+{
+    /* Parse the read-cache: prefix */
+    if (!strstart(filename, "read-cache:", &filename)) {
+        /* There was no prefix; therefore, all options have to be already
+           present in the QDict (except for the filename) */
+        qdict_put(options, "x-image", qstring_from_str(filename));
+        return;
+    }
+
+    qdict_put(options, "x-image", qstring_from_str(filename));
+}
+
+static QemuOptsList runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "x-image",
+            .type = QEMU_OPT_STRING,
+            .help = "[internal use only, will be removed]",
+        },
+        {
+            .name = READ_CACHE_OPT_GROUP,
+            .type = QEMU_OPT_STRING,
+            .help = "Name of the cache shared with other read-cache nodes",
+        },
+        {
+            .name = READ_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the shared cache (in bytes)",
+        },
+        {
+            .name = READ_CACHE_OPT_EVICTION,
+            .type = QEMU_OPT_STRING,
+            .help = "Eviction policy of the shared cache (lru, fifo)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    ReadCacheEviction eviction;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->size = qemu_opt_get_size(opts, READ_CACHE_OPT_SIZE,
+                                READ_CACHE_DEFAULT_SIZE);
+
+    eviction = qapi_enum_parse(ReadCacheEviction_lookup,
+                               qemu_opt_get(opts, READ_CACHE_OPT_EVICTION),
+                               READ_CACHE_EVICTION__MAX,
+                               READ_CACHE_EVICTION_LRU, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* Open the cached image */
+    bs->file = bdrv_open_child(qemu_opt_get(opts, "x-image"), options, "image",
+                               bs, &child_format, false, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    s->image = g_strdup(bs->file->bs->filename);
+
+    ret = read_cache_group_join(s,
+                                qemu_opt_get(opts, READ_CACHE_OPT_GROUP) ?:
+                                READ_CACHE_DEFAULT_GROUP,
+                                eviction, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = 0;
+fail:
+    if (ret < 0) {
+        g_free(s->image);
+        s->image = NULL;
+        bdrv_unref_child(bs, bs->file);
+        bs->file = NULL;
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    read_cache_group_leave(s);
+    g_free(s->image);
+    s->image = NULL;
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+/* Copies the cached chunks of [@sector_num, @sector_num + @nb_sectors) into
+ * @qiov and returns the number of sectors that were copied before the first
+ * chunk that is not in the cache. */
+static int read_cache_lookup(BlockDriverState *bs, int64_t sector_num,
+                             int nb_sectors, QEMUIOVector *qiov,
+                             size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheGroup *group = s->group;
+    ReadCacheKey key = { .image = s->image };
+    int done = 0;
+
+    qemu_mutex_lock(&group->lock);
+    while (done < nb_sectors) {
+        int64_t sector = sector_num + done;
+        int offset_in_chunk = sector % READ_CACHE_CHUNK_SECTORS;
+        int n = MIN(nb_sectors - done,
+                    READ_CACHE_CHUNK_SECTORS - offset_in_chunk);
+        ReadCacheEntry *entry;
+
+        key.chunk = sector / READ_CACHE_CHUNK_SECTORS;
+        entry = g_hash_table_lookup(group->entries, &key);
+        if (!entry ||
+            entry->bytes < (offset_in_chunk + n) * BDRV_SECTOR_SIZE) {
+            break;
+        }
+
+        qemu_iovec_from_buf(qiov, qiov_offset + done * BDRV_SECTOR_SIZE,
+                            entry->data + offset_in_chunk * BDRV_SECTOR_SIZE,
+                            n * BDRV_SECTOR_SIZE);
+        if (group->eviction == READ_CACHE_EVICTION_LRU) {
+            QTAILQ_REMOVE(&group->lru, entry, next);
+            QTAILQ_INSERT_TAIL(&group->lru, entry, next);
+        }
+        done += n;
+    }
+    qemu_mutex_unlock(&group->lock);
+
+    return done;
+}
+
+/* Inserts the chunks contained in @buf, which starts at @first_chunk, into
+ * the cache unless data was invalidated since @generation. */
+static void read_cache_insert(BlockDriverState *bs, uint64_t first_chunk,
+                              uint8_t *buf, size_t bytes, uint64_t generation)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheGroup *group = s->group;
+    size_t offset;
+
+    qemu_mutex_lock(&group->lock);
+    if (group->generation != generation) {
+        goto out;
+    }
+
+    for (offset = 0; offset < bytes; offset += READ_CACHE_CHUNK_SIZE) {
+        ReadCacheKey key = {
+            .image = s->image,
+            .chunk = first_chunk + offset / READ_CACHE_CHUNK_SIZE,
+        };
+        ReadCacheEntry *entry;
+
+        if (group->size < READ_CACHE_CHUNK_SIZE) {
+            break;
+        }
+        if (g_hash_table_lookup(group->entries, &key)) {
+            /* Another request was faster */
+            continue;
+        }
+
+        entry = g_new0(ReadCacheEntry, 1);
+        entry->data = qemu_try_blockalign(bs->file->bs, READ_CACHE_CHUNK_SIZE);
+        if (entry->data == NULL) {
+            g_free(entry);
+            break;
+        }
+
+        read_cache_evict(group, group->size - READ_CACHE_CHUNK_SIZE);
+
+        entry->image = g_strdup(s->image);
+        entry->key.image = entry->image;
+        entry->key.chunk = key.chunk;
+        entry->bytes = MIN(bytes - offset, READ_CACHE_CHUNK_SIZE);
+        memcpy(entry->data, buf + offset, entry->bytes);
+
+        g_hash_table_insert(group->entries, &entry->key, entry);
+        QTAILQ_INSERT_TAIL(&group->lru, entry, next);
+        group->used += READ_CACHE_CHUNK_SIZE;
+    }
+
+out:
+    qemu_mutex_unlock(&group->lock);
+}
+
+/* Reads the chunks covering [@sector_num, @sector_num + @nb_sectors) from the
+ * image, copies the requested part into @qiov and inserts the chunks into the
+ * cache. */
+static int coroutine_fn read_cache_fill(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors,
+                                        QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t first_chunk = sector_num / READ_CACHE_CHUNK_SECTORS;
+    int64_t start = first_chunk * READ_CACHE_CHUNK_SECTORS;
+    int64_t end = MIN(QEMU_ALIGN_UP(sector_num + nb_sectors,
+                                    READ_CACHE_CHUNK_SECTORS),
+                      bs->total_sectors);
+    QEMUIOVector local_qiov;
+    struct iovec iov;
+    uint64_t generation;
+    int ret;
+
+    iov.iov_len = (end - start) * BDRV_SECTOR_SIZE;
+    iov.iov_base = qemu_try_blockalign(bs->file->bs, iov.iov_len);
+    if (iov.iov_base == NULL) {
+        return bdrv_co_readv(bs->file->bs, sector_num, nb_sectors, qiov);
+    }
+    qemu_iovec_init_external(&local_qiov, &iov, 1);
+
+    qemu_mutex_lock(&s->group->lock);
+    generation = s->group->generation;
+    qemu_mutex_unlock(&s->group->lock);
+
+    ret = bdrv_co_readv(bs->file->bs, start, end - start, &local_qiov);
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset,
+                        iov.iov_base + (sector_num - start) * BDRV_SECTOR_SIZE,
+                        nb_sectors * BDRV_SECTOR_SIZE);
+    read_cache_insert(bs, first_chunk, iov.iov_base, iov.iov_len, generation);
+
+out:
+    qemu_vfree(iov.iov_base);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_readv(BlockDriverState *bs,
+                                            int64_t sector_num, int nb_sectors,
+                                            QEMUIOVector *qiov)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int done = 0;
+    int ret;
+
+    /* Requests larger than the cache would only evict everything else */
+    if ((uint64_t)nb_sectors * BDRV_SECTOR_SIZE > s->size / 2) {
+        trace_read_cache_bypass(bs, sector_num, nb_sectors);
+        return bdrv_co_readv(bs->file->bs, sector_num, nb_sectors, qiov);
+    }
+
+    while (done < nb_sectors) {
+        int n, miss;
+
+        n = read_cache_lookup(bs, sector_num + done, nb_sectors - done, qiov,
+                              done * BDRV_SECTOR_SIZE);
+        if (n) {
+            trace_read_cache_hit(bs, sector_num + done, n);
+        }
+        done += n;
+        if (done == nb_sectors) {
+            break;
+        }
+
+        /* Read everything that is left at once instead of chunk by chunk;
+         * chunks that are already cached are simply not inserted again */
+        miss = nb_sectors - done;
+        trace_read_cache_miss(bs, sector_num + done, miss);
+        ret = read_cache_fill(bs, sector_num + done, miss, qiov,
+                              done * BDRV_SECTOR_SIZE);
+        if (ret < 0) {
+            return ret;
+        }
+        done += miss;
+    }
+
+    return 0;
+}
+
+static void read_cache_invalidate_range(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    if (nb_sectors <= 0) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->group->lock);
+    read_cache_invalidate(s->group, s->image,
+                          sector_num / READ_CACHE_CHUNK_SECTORS,
+                          (sector_num + nb_sectors - 1) /
+                          READ_CACHE_CHUNK_SECTORS);
+    qemu_mutex_unlock(&s->group->lock);
+}
+
+/* Cached data is invalidated once the image has been modified; this also
+ * keeps reads that overlapped with the request from inserting the old data,
+ * because they see a new generation. */
+static int coroutine_fn read_cache_co_writev(BlockDriverState *bs,
+                                             int64_t sector_num, int nb_sectors,
+                                             QEMUIOVector *qiov)
+{
+    int ret;
+
+    ret = bdrv_co_writev(bs->file->bs, sector_num, nb_sectors, qiov);
+    read_cache_invalidate_range(bs, sector_num, nb_sectors);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_write_zeroes(BlockDriverState *bs,
+                                                   int64_t sector_num,
+                                                   int nb_sectors,
+                                                   BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = bdrv_co_write_zeroes(bs->file->bs, sector_num, nb_sectors, flags);
+    read_cache_invalidate_range(bs, sector_num, nb_sectors);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_discard(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors)
+{
+    int ret;
+
+    ret = bdrv_co_discard(bs->file->bs, sector_num, nb_sectors);
+    read_cache_invalidate_range(bs, sector_num, nb_sectors);
+
+    return ret;
+}
+
+static int64_t coroutine_fn read_cache_co_get_block_status(
+    BlockDriverState *bs, int64_t sector_num, int nb_sectors, int *pnum,
+    BlockDriverState **file)
+{
+    *pnum = nb_sectors;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID | BDRV_BLOCK_DATA |
+           (sector_num << BDRV_SECTOR_BITS);
+}
+
+static int read_cache_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    return bdrv_get_info(bs->file->bs, bdi);
+}
+
+static void read_cache_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    bs->bl = bs->file->bs->bl;
+}
+
+static int read_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                     BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static bool read_cache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                   BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static void read_cache_refresh_filename(BlockDriverState *bs, QDict *options)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    /* bs->file->bs has already been refreshed */
+
+    if (bs->file->bs->full_open_options) {
+        QDict *opts = qdict_new();
+        qdict_put_obj(opts, "driver", QOBJECT(qstring_from_str("read-cache")));
+
+        QINCREF(bs->file->bs->full_open_options);
+        qdict_put_obj(opts, "image", QOBJECT(bs->file->bs->full_open_options));
+        qdict_put_obj(opts, READ_CACHE_OPT_GROUP,
+                      QOBJECT(qstring_from_str(s->group->name)));
+        qdict_put_obj(opts, READ_CACHE_OPT_SIZE,
+                      QOBJECT(qint_from_int(s->size)));
+        qdict_put_obj(opts, READ_CACHE_OPT_EVICTION,
+                      QOBJECT(qstring_from_str(
+                          ReadCacheEviction_lookup[s->group->eviction])));
+
+        bs->full_open_options = opts;
+    }
+
+    if (bs->file->bs->exact_filename[0]) {
+        pstrcpy(bs->exact_filename, sizeof(bs->exact_filename), "read-cache:");
+        pstrcat(bs->exact_filename, sizeof(bs->exact_filename),
+                bs->file->bs->exact_filename);
+    }
+}
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                      = "read-cache",
+    .protocol_name                    = "read-cache",
+    .instance_size                    = sizeof(BDRVReadCacheState),
+
+    .bdrv_parse_filename              = read_cache_parse_filename,
+    .bdrv_file_open                   = read_cache_open,
+    .bdrv_close                       = read_cache_close,
+    .bdrv_reopen_prepare              = read_cache_reopen_prepare,
+    .bdrv_getlength                   = read_cache_getlength,
+    .bdrv_get_info                    = read_cache_get_info,
+    .bdrv_refresh_limits              = read_cache_refresh_limits,
+    .bdrv_refresh_filename            = read_cache_refresh_filename,
+
+    .bdrv_co_readv                    = read_cache_co_readv,
+    .bdrv_co_writev                   = read_cache_co_writev,
+    .bdrv_co_write_zeroes             = read_cache_co_write_zeroes,
+    .bdrv_co_discard                  = read_cache_co_discard,
+    .bdrv_co_get_block_status         = read_cache_co_get_block_status,
+
+    .is_filter                        = true,
+    .bdrv_recurse_is_first_non_filter = read_cache_recurse_is_first_non_filter,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    qemu_mutex_init(&read_cache_groups_lock);
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
@@ -26,6 +26,9 @@ enum {
      * contiguous regions of the image is efficient.
      */
     STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /* Number of STREAM_BUFFER_SIZE copies that can be in flight */
+    STREAM_MAX_IN_FLIGHT = 4,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
@@ -36,6 +39,10 @@ typedef struct StreamBlockJob {
     BlockDriverState *base;
     BlockdevOnError on_error;
     char *backing_file_str;
+    int in_flight;
+    bool waiting_for_io;
+    int worker_ret;
+    int64_t retry_sector;
 } StreamBlockJob;
 
 static int coroutine_fn stream_populate(BlockDriverState *bs,
@@ -54,6 +61,49 @@ static int coroutine_fn stream_populate(BlockDriverState *bs,
     return bdrv_co_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
 }
 
+typedef struct StreamWorker {
+    StreamBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+} StreamWorker;
+
+static void coroutine_fn stream_worker(void *opaque)
+{
+    StreamWorker *w = opaque;
+    StreamBlockJob *s = w->s;
+    BlockDriverState *bs = s->common.bs;
+    void *buf = qemu_blockalign(bs, w->nb_sectors * BDRV_SECTOR_SIZE);
+    int ret;
+
+    ret = stream_populate(bs, w->sector_num, w->nb_sectors, buf);
+    if (ret < 0) {
+        /* stream_run() applies the error action, and restarts from the
+         * first area that failed if needed */
+        if (!s->worker_ret) {
+            s->worker_ret = ret;
+        }
+        s->retry_sector = MIN(s->retry_sector, w->sector_num);
+    }
+
+    qemu_vfree(buf);
+    g_free(w);
+
+    s->in_flight--;
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+/* Wait until at most @max copies are still in flight */
+static void coroutine_fn stream_wait_for_io(StreamBlockJob *s, int max)
+{
+    while (s->in_flight > max) {
+        s->waiting_for_io = true;
+        qemu_coroutine_yield();
+        s->waiting_for_io = false;
+    }
+}
+
 typedef struct {
     int ret;
     bool reached_end;
@@ -89,11 +139,15 @@ static void coroutine_fn stream_run(void *opaque)
     StreamCompleteData *data;
     BlockDriverState *bs = s->common.bs;
     BlockDriverState *base = s->base;
-    int64_t sector_num, end;
+    int64_t end;
+    uint64_t sector_num = 0, n;
     int error = 0;
     int ret = 0;
-    int n = 0;
-    void *buf;
+    int pnum;
+    bool reached_end = false;
+    HBitmap *map = NULL;
+    StreamWorker *w;
+    Coroutine *co;
 
     if (!bs->backing) {
         block_job_completed(&s->common, 0);
@@ -107,7 +161,16 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
+
+    /* Find everything that is allocated in the intermediate images in one
+     * go, instead of walking the backing chain again for each chunk.  The
+     * intermediate images are read-only while the job runs.
+     */
+    ret = bdrv_allocated_above_map(backing_bs(bs), base, end, &map);
+    if (ret < 0) {
+        error = ret;
+        goto out;
+    }
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -118,82 +181,105 @@ static void coroutine_fn stream_run(void *opaque)
         bdrv_enable_copy_on_read(bs);
     }
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
-        uint64_t delay_ns = 0;
-        bool copy;
-
-wait:
-        /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
-         */
-        block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
-        if (block_job_is_cancelled(&s->common)) {
-            break;
-        }
-
-        copy = false;
+    s->retry_sector = end;
+    for (;;) {
+        uint64_t next = sector_num;
+        uint64_t delay_ns;
 
-        ret = bdrv_is_allocated(bs, sector_num,
-                                STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
-        if (ret == 1) {
-            /* Allocated in the top, no need to copy.  */
-        } else if (ret >= 0) {
-            /* Copy if allocated in the intermediate images.  Limit to the
-             * known-unallocated area [sector_num, sector_num+n).  */
-            ret = bdrv_is_allocated_above(backing_bs(bs), base,
-                                          sector_num, n, &n);
-
-            /* Finish early if end of backing file has been reached */
-            if (ret == 0 && n == 0) {
-                n = end - sector_num;
-            }
-
-            copy = (ret == 1);
-        }
-        trace_stream_one_iteration(s, sector_num, n, ret);
-        if (copy) {
-            if (s->common.speed) {
-                delay_ns = ratelimit_calculate_delay(&s->limit, n);
-                if (delay_ns > 0) {
-                    goto wait;
-                }
-            }
-            ret = stream_populate(bs, sector_num, n, buf);
-        }
-        if (ret < 0) {
+        if (s->worker_ret < 0) {
             BlockErrorAction action =
                 block_job_error_action(&s->common, s->common.bs, s->on_error,
-                                       true, -ret);
+                                       true, -s->worker_ret);
             if (action == BLOCK_ERROR_ACTION_STOP) {
-                n = 0;
-                continue;
-            }
-            if (error == 0) {
-                error = ret;
+                /* Areas that were copied meanwhile are skipped below */
+                sector_num = s->retry_sector;
+            } else if (error == 0) {
+                error = s->worker_ret;
             }
+            s->worker_ret = 0;
+            s->retry_sector = end;
             if (action == BLOCK_ERROR_ACTION_REPORT) {
                 break;
             }
+            continue;
+        }
+
+        n = STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE;
+        if (!hbitmap_next_dirty_area(map, &next, end, &n)) {
+            next = end;
+        }
+        sector_num = next;
+        if (sector_num == end) {
+            if (!s->in_flight) {
+                reached_end = true;
+                break;
+            }
+            stream_wait_for_io(s, 0);
+            continue;
         }
-        ret = 0;
+
+        ret = bdrv_is_allocated(bs, sector_num, n, &pnum);
+        trace_stream_one_iteration(s, sector_num, n, ret);
+        if (ret < 0) {
+            /* Handled like a failed copy of the area */
+            s->worker_ret = ret;
+            s->retry_sector = MIN(s->retry_sector, sector_num);
+            sector_num += n;
+            continue;
+        } else if (ret == 1) {
+            /* Allocated in the top, no need to copy.  */
+            sector_num += pnum;
+            s->common.offset = MAX(s->common.offset,
+                                   sector_num * BDRV_SECTOR_SIZE);
+            continue;
+        }
+        n = pnum;
+
+        /* Note that even when no rate limit is applied we need to yield
+         * here so that bdrv_drain_all() returns.
+         */
+        delay_ns = block_job_ratelimit(&s->common, &s->limit, n);
+        block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
+        if (block_job_is_cancelled(&s->common)) {
+            break;
+        }
+
+        stream_wait_for_io(s, STREAM_MAX_IN_FLIGHT - 1);
+        w = g_new(StreamWorker, 1);
+        w->s = s;
+        w->sector_num = sector_num;
+        w->nb_sectors = n;
+        s->in_flight++;
+        co = qemu_coroutine_create(stream_worker);
+        qemu_coroutine_enter(co, w);
 
         /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+        sector_num += n;
+        s->common.offset = MAX(s->common.offset,
+                               sector_num * BDRV_SECTOR_SIZE);
+    }
+
+    stream_wait_for_io(s, 0);
+    if (reached_end) {
+        s->common.offset = MAX(s->common.offset, end * BDRV_SECTOR_SIZE);
     }
 
     if (!base) {
         bdrv_disable_copy_on_read(bs);
     }
 
+out:
+    if (map) {
+        hbitmap_free(map);
+    }
+
     /* Do not remove the backing file if an error was there but ignored.  */
     ret = error;
 
-    qemu_vfree(buf);
-
     /* Modify backing chain and close BDSes in main loop */
     data = g_malloc(sizeof(*data));
     data->ret = ret;
-    data->reached_end = sector_num == end;
+    data->reached_end = reached_end;
     block_job_defer_to_main_loop(&s->common, stream_complete, data);
 }
 
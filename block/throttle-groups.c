@@ -24,10 +24,16 @@
 
 #include "qemu/osdep.h"
 #include "block/throttle-groups.h"
+#include "qapi/error.h"
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "sysemu/qtest.h"
 
+/* Every request costs this many bytes in addition to its size when the
+ * group is shared between its members, so that small requests are not
+ * free */
+#define THROTTLE_GROUP_REQ_COST 4096
+
 /* The ThrottleGroup structure (with its ThrottleState) is shared
  * among different BlockDriverState and it's independent from
  * AioContext, so in order to use it from different threads it needs
@@ -51,15 +57,25 @@
  * bdrv_set_aio_context()). Therefore in this file a thread will
  * access some other BDS's timers only after verifying that that BDS
  * has throttled requests in the queue.
+ *
+ * The members share the limits of the group in proportion to their
+ * weights, using start-time fair queuing: each member has a virtual time
+ * that advances by the cost of its requests divided by its weight, and
+ * the member with pending requests and the lowest virtual time gets the
+ * next request.  The virtual time of the group is that of the last
+ * request that was let through; members that were idle are brought
+ * forward to it (minus their burst credit) so that they cannot starve
+ * the others with the service that they did not use.
  */
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following five fields */
     ThrottleState ts;
     QLIST_HEAD(, BlockDriverState) head;
     BlockDriverState *tokens[2];
     bool any_timer_armed[2];
+    uint64_t vtime[2];
 
     /* These two are protected by the global throttle_groups_lock */
     unsigned refcount;
@@ -166,8 +182,33 @@ static BlockDriverState *throttle_group_next_bs(BlockDriverState *bs)
     return next;
 }
 
-/* Return the next BlockDriverState in the round-robin sequence with
- * pending I/O requests.
+/* Return how long the oldest throttled request of a BlockDriverState
+ * has waited beyond its latency target.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @bs:        the BlockDriverState
+ * @is_write:  the type of operation (read/write)
+ * @now:       the current time, in ns
+ * @ret:       the time beyond the target in ns, or 0
+ */
+static int64_t throttle_group_overdue(BlockDriverState *bs, bool is_write,
+                                      int64_t now)
+{
+    ThrottleGroupWaiter *oldest = QSIMPLEQ_FIRST(&bs->throttle_waiters[is_write]);
+    int64_t target = bs->throttle_member_cfg.latency_target * SCALE_MS;
+
+    if (!target || !oldest) {
+        return 0;
+    }
+
+    return MAX(now - oldest->start - target, 0);
+}
+
+/* Return the BlockDriverState with pending I/O requests that should be
+ * served next: the one that is the furthest beyond its latency target,
+ * else the one with the lowest virtual time.  Ties are broken in
+ * round-robin order.
  *
  * This assumes that tg->lock is held.
  *
@@ -180,25 +221,55 @@ static BlockDriverState *next_throttle_token(BlockDriverState *bs,
                                              bool is_write)
 {
     ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
-    BlockDriverState *token, *start;
+    BlockDriverState *token, *start, *best = NULL;
+    int64_t now = qemu_clock_get_ns(bs->throttle_timers.clock_type);
+    int64_t overdue, best_overdue = 0;
 
     start = token = tg->tokens[is_write];
 
-    /* get next bs round in round robin style */
-    token = throttle_group_next_bs(token);
-    while (token != start && !token->pending_reqs[is_write]) {
+    do {
         token = throttle_group_next_bs(token);
-    }
+        if (!token->pending_reqs[is_write]) {
+            continue;
+        }
+
+        overdue = throttle_group_overdue(token, is_write, now);
+        if (overdue > best_overdue) {
+            best = token;
+            best_overdue = overdue;
+        } else if (!best_overdue &&
+                   (!best || token->throttle_vtime[is_write] <
+                             best->throttle_vtime[is_write])) {
+            best = token;
+        }
+    } while (token != start);
 
-    /* If no IO are queued for scheduling on the next round robin token
-     * then decide the token is the current bs because chances are
-     * the current bs get the current request queued.
+    /* If no IO are queued for scheduling then decide the token is the
+     * current bs because chances are the current bs get the current
+     * request queued.
      */
-    if (token == start && !token->pending_reqs[is_write]) {
-        token = bs;
-    }
+    return best ? best : bs;
+}
+
+/* Bring the virtual time of a BlockDriverState that did not use its
+ * share forward, so that it only keeps its burst credit.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @bs:        the BlockDriverState
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_catch_up(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+    ThrottleGroupMemberConfig *cfg = &bs->throttle_member_cfg;
+    uint64_t credit;
 
-    return token;
+    credit = cfg->burst_credit * THROTTLE_GROUP_DEFAULT_WEIGHT / cfg->weight;
+    if (tg->vtime[is_write] > credit) {
+        bs->throttle_vtime[is_write] = MAX(bs->throttle_vtime[is_write],
+                                           tg->vtime[is_write] - credit);
+    }
 }
 
 /* Check if the next I/O request for a BlockDriverState needs to be
@@ -259,10 +330,10 @@ static void schedule_next_request(BlockDriverState *bs, bool is_write)
 
     /* If it doesn't have to wait, queue it for immediate execution */
     if (!must_wait) {
-        /* Give preference to requests from the current bs */
-        if (qemu_in_coroutine() &&
+        /* Run requests from the current bs directly if it is its turn */
+        if (token == bs && qemu_in_coroutine() &&
             qemu_co_queue_next(&bs->throttled_reqs[is_write])) {
-            token = bs;
+            /* Nothing to do */
         } else {
             ThrottleTimers *tt = &token->throttle_timers;
             int64_t now = qemu_clock_get_ns(tt->clock_type);
@@ -287,25 +358,42 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
 {
     bool must_wait;
     BlockDriverState *token;
+    ThrottleGroupMemberConfig *member_cfg = &bs->throttle_member_cfg;
 
     ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
 
+    if (!bs->pending_reqs[is_write]) {
+        throttle_group_catch_up(bs, is_write);
+    }
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(bs, is_write);
     must_wait = throttle_group_schedule_timer(token, is_write);
 
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || bs->pending_reqs[is_write]) {
+        ThrottleGroupWaiter waiter = {
+            .start = qemu_clock_get_ns(bs->throttle_timers.clock_type),
+        };
+
         bs->pending_reqs[is_write]++;
+        QSIMPLEQ_INSERT_TAIL(&bs->throttle_waiters[is_write], &waiter, next);
         qemu_mutex_unlock(&tg->lock);
         qemu_co_queue_wait(&bs->throttled_reqs[is_write]);
         qemu_mutex_lock(&tg->lock);
+        QSIMPLEQ_REMOVE(&bs->throttle_waiters[is_write], &waiter,
+                        ThrottleGroupWaiter, next);
         bs->pending_reqs[is_write]--;
     }
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(bs->throttle_state, is_write, bytes);
+    tg->vtime[is_write] = MAX(tg->vtime[is_write],
+                              bs->throttle_vtime[is_write]);
+    bs->throttle_vtime[is_write] +=
+        (uint64_t)(bytes + THROTTLE_GROUP_REQ_COST) *
+        THROTTLE_GROUP_DEFAULT_WEIGHT / member_cfg->weight;
 
     /* Schedule the next request */
     schedule_next_request(bs, is_write);
@@ -353,6 +441,77 @@ void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg)
     qemu_mutex_unlock(&tg->lock);
 }
 
+/* Initialize the settings of a group member with the defaults.
+ *
+ * @cfg: the settings to initialize
+ */
+void throttle_group_member_config_init(ThrottleGroupMemberConfig *cfg)
+{
+    *cfg = (ThrottleGroupMemberConfig) {
+        .weight = THROTTLE_GROUP_DEFAULT_WEIGHT,
+    };
+}
+
+/* Check if the settings of a group member are valid.
+ *
+ * @cfg:  the settings to check
+ * @errp: error object
+ * @ret:  true if they are valid
+ */
+bool throttle_group_member_config_is_valid(ThrottleGroupMemberConfig *cfg,
+                                           Error **errp)
+{
+    if (cfg->weight < 1 || cfg->weight > THROTTLE_GROUP_MAX_WEIGHT) {
+        error_setg(errp, "throttle weight must be between 1 and %d",
+                   THROTTLE_GROUP_MAX_WEIGHT);
+        return false;
+    }
+
+    if (cfg->latency_target > THROTTLE_VALUE_MAX / SCALE_MS) {
+        error_setg(errp, "throttle latency target must be %lld ms or less",
+                   THROTTLE_VALUE_MAX / SCALE_MS);
+        return false;
+    }
+
+    if (cfg->burst_credit > THROTTLE_VALUE_MAX) {
+        error_setg(errp, "throttle burst credit must be %lld bytes or less",
+                   THROTTLE_VALUE_MAX);
+        return false;
+    }
+
+    return true;
+}
+
+/* Change how a member shares the limits of its group.
+ *
+ * @bs:  a BlockDriverState that is member of a group
+ * @cfg: the settings to use
+ */
+void throttle_group_set_member_config(BlockDriverState *bs,
+                                      ThrottleGroupMemberConfig *cfg)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+
+    qemu_mutex_lock(&tg->lock);
+    bs->throttle_member_cfg = *cfg;
+    qemu_mutex_unlock(&tg->lock);
+}
+
+/* Get how a member shares the limits of its group.
+ *
+ * @bs:  a BlockDriverState that is member of a group
+ * @cfg: the settings will be written here
+ */
+void throttle_group_get_member_config(BlockDriverState *bs,
+                                      ThrottleGroupMemberConfig *cfg)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+
+    qemu_mutex_lock(&tg->lock);
+    *cfg = bs->throttle_member_cfg;
+    qemu_mutex_unlock(&tg->lock);
+}
+
 /* ThrottleTimers callback. This wakes up a request that was waiting
  * because it had been throttled.
  *
@@ -424,6 +583,10 @@ void throttle_group_register_bs(BlockDriverState *bs, const char *groupname)
 
     QLIST_INSERT_HEAD(&tg->head, bs, round_robin);
 
+    /* New members start with the current virtual time of the group */
+    bs->throttle_vtime[0] = tg->vtime[0];
+    bs->throttle_vtime[1] = tg->vtime[1];
+
     throttle_timers_init(&bs->throttle_timers,
                          bdrv_get_aio_context(bs),
                          clock_type,
@@ -86,7 +86,8 @@ typedef struct {
     uint16_t compressAlgorithm;
 } QEMU_PACKED VMDK4Header;
 
-#define L2_CACHE_SIZE 16
+/* Upper bound for the number of grain tables cached per extent */
+#define L2_CACHE_SIZE_MAX 512
 
 typedef struct VmdkExtent {
     BdrvChild *file;
@@ -106,9 +107,12 @@ typedef struct VmdkExtent {
     uint32_t l1_entry_sectors;
 
     unsigned int l2_size;
+    unsigned int l2_cache_size;
     uint32_t *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    uint32_t *l2_cache_offsets;
+    uint32_t *l2_cache_counts;
+    /* Maps the offset of a cached grain table to its cache slot plus one */
+    GHashTable *l2_cache_index;
 
     int64_t cluster_sectors;
     int64_t next_cluster_sector;
@@ -221,6 +225,11 @@ static void vmdk_free_extents(BlockDriverState *bs)
         e = &s->extents[i];
         g_free(e->l1_table);
         g_free(e->l2_cache);
+        g_free(e->l2_cache_offsets);
+        g_free(e->l2_cache_counts);
+        if (e->l2_cache_index) {
+            g_hash_table_destroy(e->l2_cache_index);
+        }
         g_free(e->l1_backup_table);
         g_free(e->type);
         if (e->file != bs->file) {
@@ -439,6 +448,87 @@ static int vmdk_add_extent(BlockDriverState *bs,
     return 0;
 }
 
+static void vmdk_l2_cache_set(VmdkExtent *extent, unsigned int slot,
+                              uint32_t l2_offset)
+{
+    if (extent->l2_cache_offsets[slot]) {
+        g_hash_table_remove(extent->l2_cache_index,
+                            GUINT_TO_POINTER(extent->l2_cache_offsets[slot]));
+    }
+    extent->l2_cache_offsets[slot] = l2_offset;
+    extent->l2_cache_counts[slot] = l2_offset ? 1 : 0;
+    if (l2_offset) {
+        g_hash_table_insert(extent->l2_cache_index,
+                            GUINT_TO_POINTER(l2_offset),
+                            GUINT_TO_POINTER(slot + 1));
+    }
+}
+
+typedef struct VmdkPrefetchReq {
+    VmdkExtent *extent;
+    unsigned int slot;
+    int *in_flight;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} VmdkPrefetchReq;
+
+static void vmdk_prefetch_l2_cb(void *opaque, int ret)
+{
+    VmdkPrefetchReq *req = opaque;
+
+    if (ret < 0) {
+        /* Not fatal, the table is simply read again on first use */
+        vmdk_l2_cache_set(req->extent, req->slot, 0);
+    }
+    (*req->in_flight)--;
+}
+
+/*
+ * Fill the grain table cache with the first tables of the extent.  All reads
+ * are submitted at once and then waited for, so that opening an image with
+ * many grain tables does not pay one round trip per table.
+ */
+static void vmdk_prefetch_l2_tables(BlockDriverState *bs, VmdkExtent *extent)
+{
+    size_t l2_bytes = extent->l2_size * sizeof(uint32_t);
+    VmdkPrefetchReq *reqs;
+    unsigned int i, n = 0;
+    int in_flight = 0;
+
+    if (l2_bytes % BDRV_SECTOR_SIZE) {
+        return;
+    }
+
+    reqs = g_new0(VmdkPrefetchReq, extent->l2_cache_size);
+    for (i = 0; i < extent->l1_size && n < extent->l2_cache_size; i++) {
+        uint32_t l2_offset = extent->l1_table[i];
+        VmdkPrefetchReq *req = &reqs[n];
+
+        if (!l2_offset ||
+            g_hash_table_lookup(extent->l2_cache_index,
+                                GUINT_TO_POINTER(l2_offset))) {
+            continue;
+        }
+        req->extent = extent;
+        req->slot = n;
+        req->in_flight = &in_flight;
+        req->iov.iov_base = extent->l2_cache + n * extent->l2_size;
+        req->iov.iov_len = l2_bytes;
+        qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+        vmdk_l2_cache_set(extent, n, l2_offset);
+
+        in_flight++;
+        bdrv_aio_readv(extent->file->bs, l2_offset, &req->qiov,
+                       l2_bytes >> BDRV_SECTOR_BITS,
+                       vmdk_prefetch_l2_cb, req);
+        n++;
+    }
+    while (in_flight > 0) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+    g_free(reqs);
+}
+
 static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent,
                             Error **errp)
 {
@@ -488,8 +578,13 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent,
         }
     }
 
+    extent->l2_cache_size = MAX(MIN(extent->l1_size, L2_CACHE_SIZE_MAX), 1);
     extent->l2_cache =
-        g_new(uint32_t, extent->l2_size * L2_CACHE_SIZE);
+        g_new(uint32_t, extent->l2_size * extent->l2_cache_size);
+    extent->l2_cache_offsets = g_new0(uint32_t, extent->l2_cache_size);
+    extent->l2_cache_counts = g_new0(uint32_t, extent->l2_cache_size);
+    extent->l2_cache_index = g_hash_table_new(NULL, NULL);
+    vmdk_prefetch_l2_tables(bs, extent);
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -1147,8 +1242,8 @@ static int get_cluster_offset(BlockDriverState *bs,
                               uint64_t skip_start_sector,
                               uint64_t skip_end_sector)
 {
-    unsigned int l1_index, l2_offset, l2_index;
-    int min_index, i, j;
+    unsigned int l1_index, l2_offset, l2_index, slot;
+    unsigned int min_index, i, j;
     uint32_t min_count, *l2_table;
     bool zeroed = false;
     int64_t ret;
@@ -1171,27 +1266,30 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return VMDK_UNALLOC;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == extent->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
-                    extent->l2_cache_counts[j] >>= 1;
-                }
+    slot = GPOINTER_TO_UINT(g_hash_table_lookup(extent->l2_cache_index,
+                                                GUINT_TO_POINTER(l2_offset)));
+    if (slot) {
+        i = slot - 1;
+        /* increment the hit count */
+        if (++extent->l2_cache_counts[i] == 0xffffffff) {
+            for (j = 0; j < extent->l2_cache_size; j++) {
+                extent->l2_cache_counts[j] >>= 1;
             }
-            l2_table = extent->l2_cache + (i * extent->l2_size);
-            goto found;
         }
+        l2_table = extent->l2_cache + (i * extent->l2_size);
+        goto found;
     }
     /* not found: load a new entry in the least used one */
     min_index = 0;
     min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
+    for (i = 0; i < extent->l2_cache_size; i++) {
         if (extent->l2_cache_counts[i] < min_count) {
             min_count = extent->l2_cache_counts[i];
             min_index = i;
         }
     }
+    /* drop the old entry first, the read below may fail half way */
+    vmdk_l2_cache_set(extent, min_index, 0);
     l2_table = extent->l2_cache + (min_index * extent->l2_size);
     if (bdrv_pread(
                 extent->file->bs,
@@ -1202,8 +1300,7 @@ static int get_cluster_offset(BlockDriverState *bs,
         return VMDK_ERROR;
     }
 
-    extent->l2_cache_offsets[min_index] = l2_offset;
-    extent->l2_cache_counts[min_index] = 1;
+    vmdk_l2_cache_set(extent, min_index, l2_offset);
  found:
     l2_index = ((offset >> 9) / extent->cluster_sectors) % extent->l2_size;
     cluster_sector = le32_to_cpu(l2_table[l2_index]);
@@ -50,6 +50,7 @@
 #include "qmp-commands.h"
 #include "trace.h"
 #include "sysemu/arch_init.h"
+#include "sysemu/stats.h"
 
 static QTAILQ_HEAD(, BlockDriverState) monitor_bdrv_states =
     QTAILQ_HEAD_INITIALIZER(monitor_bdrv_states);
@@ -348,6 +349,7 @@ typedef enum { MEDIA_DISK, MEDIA_CDROM } DriveMediaType;
 /* All parameters but @opts are optional and may be set to NULL. */
 static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
     const char **throttling_group, ThrottleConfig *throttle_cfg,
+    ThrottleGroupMemberConfig *member_cfg,
     BlockdevDetectZeroesOptions *detect_zeroes, Error **errp)
 {
     const char *discard;
@@ -372,6 +374,8 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
         if ((aio = qemu_opt_get(opts, "aio")) != NULL) {
             if (!strcmp(aio, "native")) {
                 *bdrv_flags |= BDRV_O_NATIVE_AIO;
+            } else if (!strcmp(aio, "io_uring")) {
+                *bdrv_flags |= BDRV_O_IO_URING;
             } else if (!strcmp(aio, "threads")) {
                 /* this is the default */
             } else {
@@ -435,6 +439,21 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
         }
     }
 
+    if (member_cfg) {
+        throttle_group_member_config_init(member_cfg);
+        member_cfg->weight =
+            qemu_opt_get_number(opts, "throttling.weight",
+                                THROTTLE_GROUP_DEFAULT_WEIGHT);
+        member_cfg->latency_target =
+            qemu_opt_get_number(opts, "throttling.latency-target", 0);
+        member_cfg->burst_credit =
+            qemu_opt_get_number(opts, "throttling.burst-credit", 0);
+
+        if (!throttle_group_member_config_is_valid(member_cfg, errp)) {
+            return;
+        }
+    }
+
     if (detect_zeroes) {
         *detect_zeroes =
             qapi_enum_parse(BlockdevDetectZeroesOptions_lookup,
@@ -469,6 +488,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     BlockBackend *blk;
     BlockDriverState *bs;
     ThrottleConfig cfg;
+    ThrottleGroupMemberConfig member_cfg;
     int snapshot = 0;
     Error *error = NULL;
     QemuOpts *opts;
@@ -514,7 +534,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     }
 
     extract_common_blockdev_options(opts, &bdrv_flags, &throttling_group, &cfg,
-                                    &detect_zeroes, &error);
+                                    &member_cfg, &detect_zeroes, &error);
     if (error) {
         error_propagate(errp, error);
         goto early_err;
@@ -578,6 +598,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
             blk_rs->throttle_group = g_strdup(throttling_group);
             blk_rs->throttle_state = throttle_group_incref(throttling_group);
             blk_rs->throttle_state->cfg = cfg;
+            blk_rs->throttle_member_cfg = member_cfg;
         }
 
         QDECREF(bs_opts);
@@ -613,6 +634,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
             }
             bdrv_io_limits_enable(bs, throttling_group);
             bdrv_set_io_limits(bs, &cfg);
+            throttle_group_set_member_config(bs, &member_cfg);
         }
 
         if (bdrv_key_required(bs)) {
@@ -668,7 +690,7 @@ static BlockDriverState *bds_tree_init(QDict *bs_opts, Error **errp)
         goto fail;
     }
 
-    extract_common_blockdev_options(opts, &bdrv_flags, NULL, NULL,
+    extract_common_blockdev_options(opts, &bdrv_flags, NULL, NULL, NULL,
                                     &detect_zeroes, &local_error);
     if (local_error) {
         error_propagate(errp, local_error);
@@ -2020,6 +2042,7 @@ static void block_dirty_bitmap_add_prepare(BlkActionState *common,
     /* AIO context taken and released within qmp_block_dirty_bitmap_add */
     qmp_block_dirty_bitmap_add(action->node, action->name,
                                action->has_granularity, action->granularity,
+                               action->has_persistent, action->persistent,
                                &local_err);
 
     if (!local_err) {
@@ -2623,9 +2646,16 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                bool has_iops_size,
                                int64_t iops_size,
                                bool has_group,
-                               const char *group, Error **errp)
+                               const char *group,
+                               bool has_weight,
+                               int64_t weight,
+                               bool has_latency_target,
+                               int64_t latency_target,
+                               bool has_burst_credit,
+                               int64_t burst_credit, Error **errp)
 {
     ThrottleConfig cfg;
+    ThrottleGroupMemberConfig member_cfg;
     BlockDriverState *bs;
     BlockBackend *blk;
     AioContext *aio_context;
@@ -2701,6 +2731,37 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         goto out;
     }
 
+    if (bs->throttle_state) {
+        throttle_group_get_member_config(bs, &member_cfg);
+    } else {
+        throttle_group_member_config_init(&member_cfg);
+    }
+    if (has_weight) {
+        if (weight < 1 || weight > THROTTLE_GROUP_MAX_WEIGHT) {
+            error_setg(errp, "throttle weight must be between 1 and %d",
+                       THROTTLE_GROUP_MAX_WEIGHT);
+            goto out;
+        }
+        member_cfg.weight = weight;
+    }
+    if (has_latency_target) {
+        if (latency_target < 0) {
+            error_setg(errp, "throttle latency target must be positive");
+            goto out;
+        }
+        member_cfg.latency_target = latency_target;
+    }
+    if (has_burst_credit) {
+        if (burst_credit < 0) {
+            error_setg(errp, "throttle burst credit must be positive");
+            goto out;
+        }
+        member_cfg.burst_credit = burst_credit;
+    }
+    if (!throttle_group_member_config_is_valid(&member_cfg, errp)) {
+        goto out;
+    }
+
     if (throttle_enabled(&cfg)) {
         /* Enable I/O limits if they're not enabled yet, otherwise
          * just update the throttling group. */
@@ -2711,6 +2772,7 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         }
         /* Set the new throttling configuration */
         bdrv_set_io_limits(bs, &cfg);
+        throttle_group_set_member_config(bs, &member_cfg);
     } else if (bs->throttle_state) {
         /* If all throttling settings are set to 0, disable I/O limits */
         bdrv_io_limits_disable(bs);
@@ -2720,12 +2782,91 @@ out:
     aio_context_release(aio_context);
 }
 
+/* 10us to 10s in steps of 1, 2 and 5 per decade */
+static const uint64_t block_latency_default_boundaries[] = {
+    10000ULL, 20000ULL, 50000ULL,
+    100000ULL, 200000ULL, 500000ULL,
+    1000000ULL, 2000000ULL, 5000000ULL,
+    10000000ULL, 20000000ULL, 50000000ULL,
+    100000000ULL, 200000000ULL, 500000000ULL,
+    1000000000ULL, 2000000000ULL, 5000000000ULL,
+    10000000000ULL,
+};
+
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     bool has_clear, bool clear,
+                                     Error **errp)
+{
+    BlockBackend *blk;
+    BlockAcctStats *stats;
+    AioContext *aio_context;
+    uint64List *defaults = NULL;
+    int i;
+
+    blk = blk_by_name(device);
+    if (!blk) {
+        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                  "Device '%s' not found", device);
+        return;
+    }
+
+    if (has_clear && clear) {
+        if (has_boundaries || has_boundaries_read || has_boundaries_write ||
+            has_boundaries_flush) {
+            error_setg(errp, "'clear' cannot be used together with "
+                       "boundaries");
+            return;
+        }
+    } else if (!has_boundaries) {
+        for (i = ARRAY_SIZE(block_latency_default_boundaries) - 1;
+             i >= 0; i--) {
+            uint64List *entry = g_new0(uint64List, 1);
+
+            entry->value = block_latency_default_boundaries[i];
+            entry->next = defaults;
+            defaults = entry;
+        }
+        boundaries = defaults;
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+
+    stats = blk_get_stats(blk);
+    if (has_clear && clear) {
+        block_latency_histograms_clear(stats);
+    } else if (block_latency_histogram_set(stats, BLOCK_ACCT_READ,
+                   has_boundaries_read ? boundaries_read : boundaries) ||
+               block_latency_histogram_set(stats, BLOCK_ACCT_WRITE,
+                   has_boundaries_write ? boundaries_write : boundaries) ||
+               block_latency_histogram_set(stats, BLOCK_ACCT_FLUSH,
+                   has_boundaries_flush ? boundaries_flush : boundaries)) {
+        /* Don't leave the histograms half updated */
+        block_latency_histograms_clear(stats);
+        error_setg(errp, "Latency histogram boundaries must be positive "
+                   "and in increasing order");
+    }
+
+    aio_context_release(aio_context);
+    qapi_free_uint64List(defaults);
+}
+
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2751,7 +2892,15 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (has_persistent && persistent &&
+        !bdrv_can_store_new_dirty_bitmap(bs, name, granularity, errp)) {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap && has_persistent) {
+        bdrv_dirty_bitmap_set_persistance(bitmap, persistent);
+    }
 
  out:
     aio_context_release(aio_context);
@@ -2775,6 +2924,17 @@ void qmp_block_dirty_bitmap_remove(const char *node, const char *name,
                    name);
         goto out;
     }
+
+    if (bdrv_dirty_bitmap_get_persistance(bitmap)) {
+        Error *local_err = NULL;
+
+        bdrv_remove_persistent_dirty_bitmap(bs, name, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            goto out;
+        }
+    }
+
     bdrv_dirty_bitmap_make_anon(bitmap);
     bdrv_release_dirty_bitmap(bs, bitmap);
 
@@ -2878,7 +3038,8 @@ void hmp_drive_del(Monitor *mon, const QDict *qdict)
 
 void qmp_block_resize(bool has_device, const char *device,
                       bool has_node_name, const char *node_name,
-                      int64_t size, Error **errp)
+                      int64_t size, bool has_preallocation,
+                      PreallocMode preallocation, Error **errp)
 {
     Error *local_err = NULL;
     BlockDriverState *bs;
@@ -2914,7 +3075,16 @@ void qmp_block_resize(bool has_device, const char *device,
     /* complete all in-flight operations before resizing the device */
     bdrv_drain_all();
 
-    ret = bdrv_truncate(bs, size);
+    if (!has_preallocation) {
+        preallocation = PREALLOC_MODE_OFF;
+    }
+
+    ret = bdrv_truncate_prealloc(bs, size, preallocation, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto out;
+    }
+
     switch (ret) {
     case 0:
         break;
@@ -3396,6 +3566,8 @@ static void blockdev_mirror_common(BlockDriverState *bs,
                                    bool has_on_target_error,
                                    BlockdevOnError on_target_error,
                                    bool has_unmap, bool unmap,
+                                   bool has_copy_mode,
+                                   MirrorCopyMode copy_mode,
                                    Error **errp)
 {
 
@@ -3417,6 +3589,9 @@ static void blockdev_mirror_common(BlockDriverState *bs,
     if (!has_unmap) {
         unmap = true;
     }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
@@ -3449,7 +3624,7 @@ static void blockdev_mirror_common(BlockDriverState *bs,
      */
     mirror_start(bs, target,
                  has_replaces ? replaces : NULL,
-                 speed, granularity, buf_size, sync,
+                 speed, granularity, buf_size, sync, copy_mode,
                  on_source_error, on_target_error, unmap,
                  block_job_cb, bs, errp);
 }
@@ -3466,6 +3641,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
                       bool has_unmap, bool unmap,
+                      bool has_copy_mode, MirrorCopyMode copy_mode,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -3603,6 +3779,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
                            has_unmap, unmap,
+                           has_copy_mode, copy_mode,
                            &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -3622,6 +3799,7 @@ void qmp_blockdev_mirror(const char *device, const char *target,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_copy_mode, MirrorCopyMode copy_mode,
                          Error **errp)
 {
     BlockDriverState *bs;
@@ -3661,6 +3839,7 @@ void qmp_blockdev_mirror(const char *device, const char *target,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
                            true, true,
+                           has_copy_mode, copy_mode,
                            &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -3721,6 +3900,16 @@ void qmp_block_job_set_speed(const char *device, int64_t speed, Error **errp)
     aio_context_release(aio_context);
 }
 
+void qmp_block_job_set_global_speed(int64_t speed, Error **errp)
+{
+    block_job_set_global_speed(speed, errp);
+}
+
+void qmp_block_set_metadata_cache_budget(int64_t size, Error **errp)
+{
+    bdrv_set_metadata_cache_budget(size, errp);
+}
+
 void qmp_block_job_cancel(const char *device,
                           bool has_force, bool force, Error **errp)
 {
@@ -4196,6 +4385,19 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.group",
             .type = QEMU_OPT_STRING,
             .help = "name of the block throttling group",
+        },{
+            .name = "throttling.weight",
+            .type = QEMU_OPT_NUMBER,
+            .help = "share of the group limits relative to the other members",
+        },{
+            .name = "throttling.latency-target",
+            .type = QEMU_OPT_NUMBER,
+            .help = "time in ms after which throttled requests get priority",
+        },{
+            .name = "throttling.burst-credit",
+            .type = QEMU_OPT_NUMBER,
+            .help = "bytes that can be submitted ahead of the share after "
+                    "being idle",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
@@ -4259,3 +4461,33 @@ QemuOptsList qemu_drive_opts = {
         { /* end of list */ }
     },
 };
+
+static void blockdev_stats_collect(StatsSampler *s, void *opaque)
+{
+    BlockBackend *blk;
+
+    /* Plain reads of counters updated in I/O threads; may be stale */
+    for (blk = blk_next(NULL); blk; blk = blk_next(blk)) {
+        BlockAcctStats *stats = blk_get_stats(blk);
+        const char *name = blk_name(blk);
+
+        stats_add(s, stats->nr_bytes[BLOCK_ACCT_READ], "%s.rd_bytes", name);
+        stats_add(s, stats->nr_bytes[BLOCK_ACCT_WRITE], "%s.wr_bytes", name);
+        stats_add(s, stats->nr_ops[BLOCK_ACCT_READ], "%s.rd_ops", name);
+        stats_add(s, stats->nr_ops[BLOCK_ACCT_WRITE], "%s.wr_ops", name);
+        stats_add(s, stats->nr_ops[BLOCK_ACCT_FLUSH], "%s.flush_ops", name);
+        stats_add(s, stats->total_time_ns[BLOCK_ACCT_READ],
+                  "%s.rd_total_time_ns", name);
+        stats_add(s, stats->total_time_ns[BLOCK_ACCT_WRITE],
+                  "%s.wr_total_time_ns", name);
+        stats_add(s, stats->failed_ops[BLOCK_ACCT_READ] +
+                     stats->failed_ops[BLOCK_ACCT_WRITE] +
+                     stats->failed_ops[BLOCK_ACCT_FLUSH],
+                  "%s.failed_ops", name);
+    }
+}
+
+static void __attribute__((constructor)) blockdev_stats_init(void)
+{
+    stats_register_provider("block", blockdev_stats_collect, NULL);
+}
@@ -37,6 +37,12 @@
 #include "qemu/timer.h"
 #include "qapi-event.h"
 
+#define SLICE_TIME 100000000ULL /* ns */
+
+/* Bandwidth budget shared by all block jobs, see block_job_ratelimit() */
+static RateLimit global_limit;
+static int64_t global_speed;
+
 /* Transactional group of block jobs */
 struct BlockJobTxn {
 
@@ -221,6 +227,29 @@ void block_job_set_speed(BlockJob *job, int64_t speed, Error **errp)
     job->speed = speed;
 }
 
+void block_job_set_global_speed(int64_t speed, Error **errp)
+{
+    if (speed < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER, "speed");
+        return;
+    }
+    ratelimit_set_speed(&global_limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+    global_speed = speed;
+}
+
+int64_t block_job_ratelimit(BlockJob *job, RateLimit *limit, uint64_t n)
+{
+    int64_t delay_ns = 0;
+
+    if (job->speed) {
+        delay_ns = ratelimit_calculate_delay(limit, n);
+    }
+    if (global_speed) {
+        delay_ns = MAX(delay_ns, ratelimit_calculate_delay(&global_limit, n));
+    }
+    return delay_ns;
+}
+
 void block_job_complete(BlockJob *job, Error **errp)
 {
     if (job->pause_count || job->cancelled || !job->driver->complete) {
@@ -0,0 +1,138 @@
+/*
+ * Message rings in ivshmem shared memory
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#ifndef _IVSHMEM_RING_H_
+#define _IVSHMEM_RING_H_
+
+/**
+ * A ring carries messages in one direction, from a single producer to a
+ * single consumer, which can be in different guests or on the host.  It
+ * is placed anywhere in the shared memory, and only has 32-bit fields in
+ * the byte order of the host, so a guest driver can implement it too.
+ *
+ * The producer copies a message into the slot at prod, then increments
+ * prod; the consumer copies it out of the slot at cons, then increments
+ * cons.  The two indexes are in different cache lines, and each one is
+ * only written by one side, so the peers never wait for each other: the
+ * consumer can busy-poll prod, or wait for an ivshmem doorbell.
+ *
+ * Each slot starts with the length of the message, as a 32-bit value.
+ */
+
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+
+#define IVSHMEM_RING_MAGIC      0x676e6972  /* "ring" */
+
+typedef struct IvshmemRing {
+    uint32_t magic;
+    uint32_t nr_slots;          /**< number of slots, a power of 2 */
+    uint32_t slot_size;         /**< bytes per slot, including the length */
+    uint32_t pad0[13];
+    uint32_t prod;              /**< written by the producer only */
+    uint32_t pad1[15];
+    uint32_t cons;              /**< written by the consumer only */
+    uint32_t pad2[15];
+    uint8_t slots[];
+} IvshmemRing;
+
+/**
+ * Size of a ring, including its slots
+ */
+static inline size_t ivshmem_ring_size(uint32_t nr_slots, uint32_t slot_size)
+{
+    return sizeof(IvshmemRing) + (size_t)nr_slots * slot_size;
+}
+
+/**
+ * Initialize an empty ring, which must not be in use by any peer
+ */
+static inline void ivshmem_ring_init(IvshmemRing *ring, uint32_t nr_slots,
+                                     uint32_t slot_size)
+{
+    assert(is_power_of_2(nr_slots) && slot_size > sizeof(uint32_t));
+
+    ring->nr_slots = nr_slots;
+    ring->slot_size = slot_size;
+    ring->prod = 0;
+    ring->cons = 0;
+    smp_wmb();
+    atomic_set(&ring->magic, IVSHMEM_RING_MAGIC);
+}
+
+/**
+ * Check that a ring has been initialized by a peer
+ */
+static inline bool ivshmem_ring_valid(IvshmemRing *ring)
+{
+    return atomic_mb_read(&ring->magic) == IVSHMEM_RING_MAGIC &&
+           is_power_of_2(ring->nr_slots) &&
+           ring->slot_size > sizeof(uint32_t);
+}
+
+static inline uint8_t *ivshmem_ring_slot(IvshmemRing *ring, uint32_t idx)
+{
+    return ring->slots + (size_t)(idx & (ring->nr_slots - 1)) *
+                         ring->slot_size;
+}
+
+/**
+ * Add a message to a ring, from the producer
+ *
+ * Returns: true on success, false if the ring is full
+ */
+static inline bool ivshmem_ring_push(IvshmemRing *ring, const void *buf,
+                                     uint32_t len)
+{
+    uint32_t prod = ring->prod;
+    uint8_t *slot;
+
+    assert(len <= ring->slot_size - sizeof(uint32_t));
+    if (prod - atomic_read(&ring->cons) == ring->nr_slots) {
+        return false;
+    }
+    /* Do not overwrite the slot before the consumer is done with it */
+    smp_mb();
+
+    slot = ivshmem_ring_slot(ring, prod);
+    stl_he_p(slot, len);
+    memcpy(slot + sizeof(uint32_t), buf, len);
+    smp_wmb();
+    atomic_set(&ring->prod, prod + 1);
+    return true;
+}
+
+/**
+ * Remove a message from a ring, from the consumer
+ *
+ * @buf:    Buffer of at least slot_size - 4 bytes
+ *
+ * Returns: the length of the message, or -1 if the ring is empty
+ */
+static inline int ivshmem_ring_pop(IvshmemRing *ring, void *buf)
+{
+    uint32_t cons = ring->cons;
+    uint32_t len;
+    uint8_t *slot;
+
+    if (atomic_read(&ring->prod) == cons) {
+        return -1;
+    }
+    smp_rmb();
+
+    slot = ivshmem_ring_slot(ring, cons);
+    len = ldl_he_p(slot);
+    len = MIN(len, ring->slot_size - sizeof(uint32_t));
+    memcpy(buf, slot + sizeof(uint32_t), len);
+    smp_mb();
+    atomic_set(&ring->cons, cons + 1);
+    return len;
+}
+
+#endif /* _IVSHMEM_RING_H_ */
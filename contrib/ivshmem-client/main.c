@@ -10,13 +10,26 @@
 #include "qemu-common.h"
 
 #include "ivshmem-client.h"
+#include "ivshmem-ring.h"
+
+#include <poll.h>
+#include <sys/mman.h>
 
 #define IVSHMEM_CLIENT_DEFAULT_VERBOSE        0
 #define IVSHMEM_CLIENT_DEFAULT_UNIX_SOCK_PATH "/tmp/ivshmem_socket"
 
+/* rings used by the echo and benchmark modes */
+#define IVSHMEM_CLIENT_RING_SLOTS             256
+#define IVSHMEM_CLIENT_RING_SLOT_SIZE         128
+#define IVSHMEM_CLIENT_RING_MSG_SIZE          64
+
 typedef struct IvshmemClientArgs {
     bool verbose;
     const char *unix_sock_path;
+    bool ring_echo;
+    uint64_t ring_bench;
+    bool ring_poll;
+    uint64_t ring_offset;
 } IvshmemClientArgs;
 
 /* show ivshmem_client_usage and exit with given error code */
@@ -29,6 +42,14 @@ ivshmem_client_usage(const char *name, int code)
     fprintf(stderr, "  -S <unix_sock_path>: path to the unix socket\n"
                     "     to connect to.\n"
                     "     default=%s\n", IVSHMEM_CLIENT_DEFAULT_UNIX_SOCK_PATH);
+    fprintf(stderr, "  -e: echo the messages of a ring back to the peer\n");
+    fprintf(stderr, "  -b <count>: send <count> messages to a peer running\n"
+                    "     with -e, and show the latency and throughput\n");
+    fprintf(stderr, "  -p: with -e or -b, busy-poll the rings instead of\n"
+                    "     waiting for doorbells\n");
+    fprintf(stderr, "  -o <offset>: offset of the rings in the shared "
+                    "memory\n"
+                    "     default=0\n");
     exit(code);
 }
 
@@ -42,6 +63,10 @@ ivshmem_client_parse_args(IvshmemClientArgs *args, int argc, char *argv[])
                        "h"  /* help */
                        "v"  /* verbose */
                        "S:" /* unix_sock_path */
+                       "e"  /* ring_echo */
+                       "b:" /* ring_bench */
+                       "p"  /* ring_poll */
+                       "o:" /* ring_offset */
                       )) != -1) {
 
         switch (c) {
@@ -57,11 +82,39 @@ ivshmem_client_parse_args(IvshmemClientArgs *args, int argc, char *argv[])
             args->unix_sock_path = optarg;
             break;
 
+        case 'e': /* ring_echo */
+            args->ring_echo = true;
+            break;
+
+        case 'b': /* ring_bench */
+            if (qemu_strtoull(optarg, NULL, 0, &args->ring_bench) < 0 ||
+                args->ring_bench == 0) {
+                fprintf(stderr, "cannot parse message count\n");
+                ivshmem_client_usage(argv[0], 1);
+            }
+            break;
+
+        case 'p': /* ring_poll */
+            args->ring_poll = true;
+            break;
+
+        case 'o': /* ring_offset */
+            if (qemu_strtoull(optarg, NULL, 0, &args->ring_offset) < 0) {
+                fprintf(stderr, "cannot parse ring offset\n");
+                ivshmem_client_usage(argv[0], 1);
+            }
+            break;
+
         default:
             ivshmem_client_usage(argv[0], 1);
             break;
         }
     }
+
+    if (args->ring_echo && args->ring_bench) {
+        fprintf(stderr, "-e and -b cannot be used together\n");
+        ivshmem_client_usage(argv[0], 1);
+    }
 }
 
 /* show command line help */
@@ -184,6 +237,231 @@ ivshmem_client_notification_cb(const IvshmemClient *client,
            peer->id, vect);
 }
 
+static int64_t
+ivshmem_client_ring_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* handle the messages of the server until a peer is connected */
+static IvshmemClientPeer *
+ivshmem_client_ring_wait_peer(IvshmemClient *client)
+{
+    fd_set fds;
+    int ret, maxfd;
+
+    while (QTAILQ_EMPTY(&client->peer_list)) {
+        FD_ZERO(&fds);
+        maxfd = 0;
+        ivshmem_client_get_fds(client, &fds, &maxfd);
+
+        ret = select(maxfd, &fds, NULL, NULL, NULL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "select error: %s\n", strerror(errno));
+            return NULL;
+        }
+        if (ivshmem_client_handle_fds(client, &fds, maxfd) < 0) {
+            fprintf(stderr, "ivshmem_client_handle_fds() failed\n");
+            return NULL;
+        }
+    }
+
+    return QTAILQ_FIRST(&client->peer_list);
+}
+
+/* get the next message of a ring, waiting for the doorbell of vector 0
+ * or spinning if it is empty */
+static int
+ivshmem_client_ring_recv(IvshmemClient *client, IvshmemRing *ring,
+                         void *buf, bool poll_ring)
+{
+    struct pollfd pfd = {
+        .fd = client->local.vectors[0],
+        .events = POLLIN,
+    };
+    uint64_t val;
+    int len;
+
+    while ((len = ivshmem_ring_pop(ring, buf)) < 0) {
+        if (poll_ring) {
+            continue;
+        }
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "poll error: %s\n", strerror(errno));
+            return -1;
+        }
+        if (read(pfd.fd, &val, sizeof(val)) < 0 && errno != EAGAIN &&
+            errno != EINTR) {
+            fprintf(stderr, "cannot read eventfd: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    return len;
+}
+
+/* send back every message received, forever */
+static int
+ivshmem_client_ring_echo(IvshmemClient *client, IvshmemClientPeer *peer,
+                         IvshmemRing *rx, IvshmemRing *tx, bool poll_ring)
+{
+    uint8_t buf[IVSHMEM_CLIENT_RING_SLOT_SIZE];
+    int len;
+
+    printf("echoing messages to peer_id=%" PRId64 "\n", peer->id);
+    while ((len = ivshmem_client_ring_recv(client, rx, buf, poll_ring)) >= 0) {
+        do {
+            while (!ivshmem_ring_push(tx, buf, len)) {
+                /* wait for the peer to read the replies */
+            }
+        } while ((len = ivshmem_ring_pop(rx, buf)) >= 0);
+
+        if (!poll_ring) {
+            ivshmem_client_notify(client, peer, 0);
+        }
+    }
+
+    return -1;
+}
+
+/* measure the round-trip time of one message, then the throughput with
+ * the ring kept full */
+static int
+ivshmem_client_ring_bench(IvshmemClient *client, IvshmemClientPeer *peer,
+                          IvshmemRing *rx, IvshmemRing *tx, uint64_t count,
+                          bool poll_ring)
+{
+    uint8_t buf[IVSHMEM_CLIENT_RING_SLOT_SIZE];
+    int64_t start, lat, lat_min = INT64_MAX, lat_max = 0, lat_total = 0;
+    uint64_t i, sent, received;
+    bool pushed;
+
+    memset(buf, 0, sizeof(buf));
+    for (i = 0; i < count; i++) {
+        start = ivshmem_client_ring_now();
+        while (!ivshmem_ring_push(tx, buf, IVSHMEM_CLIENT_RING_MSG_SIZE)) {
+            /* only with stale messages from a previous run */
+        }
+        if (!poll_ring) {
+            ivshmem_client_notify(client, peer, 0);
+        }
+        if (ivshmem_client_ring_recv(client, rx, buf, poll_ring) < 0) {
+            return -1;
+        }
+        lat = ivshmem_client_ring_now() - start;
+        lat_min = MIN(lat_min, lat);
+        lat_max = MAX(lat_max, lat);
+        lat_total += lat;
+    }
+    printf("round trip: min %" PRId64 " ns, avg %" PRId64 " ns, "
+           "max %" PRId64 " ns\n", lat_min, lat_total / (int64_t)count,
+           lat_max);
+
+    sent = received = 0;
+    start = ivshmem_client_ring_now();
+    while (received < count) {
+        pushed = false;
+        while (sent < count &&
+               ivshmem_ring_push(tx, buf, IVSHMEM_CLIENT_RING_MSG_SIZE)) {
+            sent++;
+            pushed = true;
+        }
+        if (pushed && !poll_ring) {
+            ivshmem_client_notify(client, peer, 0);
+        }
+        if (ivshmem_client_ring_recv(client, rx, buf, poll_ring) < 0) {
+            return -1;
+        }
+        received++;
+        while (received < sent && ivshmem_ring_pop(rx, buf) >= 0) {
+            received++;
+        }
+    }
+    lat = MAX(ivshmem_client_ring_now() - start, 1);
+    printf("throughput: %" PRIu64 " messages/s, %" PRIu64 " MB/s "
+           "(%d-byte messages, echoed)\n",
+           (uint64_t)(count * 1e9 / lat),
+           (uint64_t)(count * IVSHMEM_CLIENT_RING_MSG_SIZE * 1e3 / lat),
+           IVSHMEM_CLIENT_RING_MSG_SIZE);
+
+    return 0;
+}
+
+/* map the rings at the given offset of the shared memory and run the echo
+ * or benchmark mode; the echo side initializes the rings */
+static int
+ivshmem_client_ring_run(IvshmemClient *client, const IvshmemClientArgs *args)
+{
+    size_t ring_size = ivshmem_ring_size(IVSHMEM_CLIENT_RING_SLOTS,
+                                         IVSHMEM_CLIENT_RING_SLOT_SIZE);
+    IvshmemClientPeer *peer;
+    IvshmemRing *ring[2];
+    struct stat st;
+    uint8_t *shm;
+    int ret;
+
+    if (fstat(client->shm_fd, &st) < 0) {
+        fprintf(stderr, "cannot stat shm: %s\n", strerror(errno));
+        return -1;
+    }
+    if (args->ring_offset > st.st_size ||
+        st.st_size - args->ring_offset < 2 * ring_size) {
+        fprintf(stderr, "the rings need %zu bytes at offset %" PRIu64
+                ", but the shared memory is only %" PRIu64 " bytes\n",
+                2 * ring_size, args->ring_offset, (uint64_t)st.st_size);
+        return -1;
+    }
+    shm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               client->shm_fd, 0);
+    if (shm == MAP_FAILED) {
+        fprintf(stderr, "cannot map shm: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* ring[0] goes from the benchmark to the echo side, ring[1] back */
+    ring[0] = (IvshmemRing *)(shm + args->ring_offset);
+    ring[1] = (IvshmemRing *)(shm + args->ring_offset + ring_size);
+    if (args->ring_echo) {
+        ivshmem_ring_init(ring[0], IVSHMEM_CLIENT_RING_SLOTS,
+                          IVSHMEM_CLIENT_RING_SLOT_SIZE);
+        ivshmem_ring_init(ring[1], IVSHMEM_CLIENT_RING_SLOTS,
+                          IVSHMEM_CLIENT_RING_SLOT_SIZE);
+    } else if (!ivshmem_ring_valid(ring[0]) || !ivshmem_ring_valid(ring[1]) ||
+               ring[0]->slot_size != IVSHMEM_CLIENT_RING_SLOT_SIZE ||
+               ring[1]->slot_size != IVSHMEM_CLIENT_RING_SLOT_SIZE) {
+        fprintf(stderr, "no rings at offset %" PRIu64 ", start the peer "
+                "with -e first\n", args->ring_offset);
+        munmap(shm, st.st_size);
+        return -1;
+    }
+
+    peer = ivshmem_client_ring_wait_peer(client);
+    if (!peer) {
+        ret = -1;
+    } else if (!args->ring_poll && client->local.vectors_count == 0) {
+        fprintf(stderr, "no doorbell vector, use -p\n");
+        ret = -1;
+    } else if (args->ring_echo) {
+        ret = ivshmem_client_ring_echo(client, peer, ring[0], ring[1],
+                                       args->ring_poll);
+    } else {
+        ret = ivshmem_client_ring_bench(client, peer, ring[1], ring[0],
+                                        args->ring_bench, args->ring_poll);
+    }
+
+    munmap(shm, st.st_size);
+    return ret;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -207,9 +485,11 @@ main(int argc, char *argv[])
         return 1;
     }
 
-    ivshmem_client_cmdline_help();
-    printf("cmd> ");
-    fflush(stdout);
+    if (!args.ring_echo && !args.ring_bench) {
+        ivshmem_client_cmdline_help();
+        printf("cmd> ");
+        fflush(stdout);
+    }
 
     if (ivshmem_client_init(&client, args.unix_sock_path,
                             ivshmem_client_notification_cb, NULL,
@@ -227,6 +507,13 @@ main(int argc, char *argv[])
 
         fprintf(stdout, "listen on server socket %d\n", client.sock_fd);
 
+        if (args.ring_echo || args.ring_bench) {
+            int ret = ivshmem_client_ring_run(&client, &args);
+
+            ivshmem_client_close(&client);
+            return ret < 0;
+        }
+
         if (ivshmem_client_poll_events(&client) == 0) {
             continue;
         }
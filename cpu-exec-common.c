@@ -80,3 +80,13 @@ void cpu_loop_exit_restore(CPUState *cpu, uintptr_t pc)
     cpu->current_tb = NULL;
     siglongjmp(cpu->jmp_env, 1);
 }
+
+/* Give up on executing the current instruction with parallel_cpus set,
+ * and ask the caller of cpu_exec to run it again with all other vCPUs
+ * stopped (see cpu_exec_step_atomic).
+ */
+void cpu_loop_exit_atomic(CPUState *cpu, uintptr_t pc)
+{
+    cpu->exception_index = EXCP_ATOMIC;
+    cpu_loop_exit_restore(cpu, pc);
+}
@@ -21,6 +21,7 @@
 #include "trace.h"
 #include "disas/disas.h"
 #include "tcg.h"
+#include "exec/helper-proto.h"
 #include "qemu/atomic.h"
 #include "sysemu/qtest.h"
 #include "qemu/timer.h"
@@ -32,6 +33,7 @@
 #include "hw/i386/apic.h"
 #endif
 #include "sysemu/replay.h"
+#include "qemu/main-loop.h"
 
 /* -icount align implementation. */
 
@@ -185,9 +187,19 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, uint8_t *tb_ptr)
 
 /* Execute the code without caching the generated code. An interpreter
    could be used if available. */
+/* Changes whenever translation blocks may have been freed and their
+ * descriptors reused, i.e. on a flush or on the eviction of a region.
+ */
+static inline unsigned tb_generation(void)
+{
+    return atomic_read(&tcg_ctx.tb_ctx.tb_flush_count) +
+           atomic_read(&tcg_ctx.tb_ctx.tb_evict_count);
+}
+
 static void cpu_exec_nocache(CPUState *cpu, int max_cycles,
                              TranslationBlock *orig_tb, bool ignore_icount)
 {
+    unsigned tb_gen = tb_generation();
     TranslationBlock *tb;
 
     /* Should never happen.
@@ -195,68 +207,132 @@ static void cpu_exec_nocache(CPUState *cpu, int max_cycles,
     if (max_cycles > CF_COUNT_MASK)
         max_cycles = CF_COUNT_MASK;
 
+    tb_lock();
     tb = tb_gen_code(cpu, orig_tb->pc, orig_tb->cs_base, orig_tb->flags,
                      max_cycles | CF_NOCACHE
                          | (ignore_icount ? CF_IGNORE_ICOUNT : 0));
-    tb->orig_tb = tcg_ctx.tb_ctx.tb_invalidated_flag ? NULL : orig_tb;
+    if (tb_generation() != tb_gen || (orig_tb->cflags & CF_INVALID)) {
+        orig_tb = NULL;
+    }
+    tb->orig_tb = orig_tb;
+    tb_unlock();
     cpu->current_tb = tb;
     /* execute the generated code */
     trace_exec_tb_nocache(tb, tb->pc);
     cpu_tb_exec(cpu, tb->tc_ptr);
     cpu->current_tb = NULL;
+    tb_lock();
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
+    tb_unlock();
 }
 
-static TranslationBlock *tb_find_physical(CPUState *cpu,
-                                          target_ulong pc,
-                                          target_ulong cs_base,
-                                          uint64_t flags)
+/* Execute the one instruction that raised EXCP_ATOMIC.  The caller has
+ * stopped all other vCPUs, so the instruction is translated with
+ * parallel_cpus cleared and plain loads and stores are enough.
+ */
+void cpu_exec_step_atomic(CPUState *cpu)
 {
+    CPUClass *cc = CPU_GET_CLASS(cpu);
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
-
-    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
-
-    /* find translated block using physical mappings */
-    phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb) {
-            return NULL;
-        }
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2) {
-                    break;
-                }
-            } else {
-                break;
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    /* Since we got here, we know that parallel_cpus must be true.  */
+    parallel_cpus = false;
+    rcu_read_lock();
+    cc->cpu_exec_enter(cpu);
+
+    if (sigsetjmp(cpu->jmp_env, 0) == 0) {
+        cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+        tb_lock();
+        tb = tb_gen_code(cpu, pc, cs_base, flags,
+                         1 | CF_NOCACHE | CF_IGNORE_ICOUNT);
+        tb->orig_tb = NULL;
+        tb_unlock();
+        cpu->current_tb = tb;
+        trace_exec_tb_nocache(tb, pc);
+        cpu_tb_exec(cpu, tb->tc_ptr);
+        cpu->current_tb = NULL;
+        tb_lock();
+        tb_phys_invalidate(tb, -1);
+        tb_free(tb);
+        tb_unlock();
+    } else {
+        /* A fault was raised; cpu_restore_state has already freed the
+         * one-shot TB and the exception is left pending for cpu_exec.
+         */
+        tb_lock_reset();
+    }
+
+    cc->cpu_exec_exit(cpu);
+    rcu_read_unlock();
+    parallel_cpus = true;
+}
+
+struct tb_desc {
+    target_ulong pc;
+    target_ulong cs_base;
+    CPUArchState *env;
+    tb_page_addr_t phys_page1;
+    uint64_t flags;
+    uint32_t cflags;
+    uint32_t cflags_mask;
+};
+
+static bool tb_cmp(const void *p, const void *d)
+{
+    const TranslationBlock *tb = p;
+    const struct tb_desc *desc = d;
+
+    if (tb->pc == desc->pc &&
+        tb->page_addr[0] == desc->phys_page1 &&
+        tb->cs_base == desc->cs_base &&
+        tb->flags == desc->flags &&
+        (tb->cflags & desc->cflags_mask) == desc->cflags) {
+        /* check next page if needed */
+        if (tb->page_addr[1] == -1) {
+            return true;
+        } else {
+            tb_page_addr_t phys_page2;
+            target_ulong virt_page2;
+
+            virt_page2 = (desc->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            phys_page2 = get_page_addr_code(desc->env, virt_page2);
+            if (tb->page_addr[1] == phys_page2) {
+                return true;
             }
         }
-        ptb1 = &tb->phys_hash_next;
     }
+    return false;
+}
 
-    /* Move the TB to the head of the list */
-    *ptb1 = tb->phys_hash_next;
-    tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
-    return tb;
+/* The TB hash is looked up without holding tb_lock; callers only need
+ * to be within an RCU read-side critical section, as cpu_exec is.
+ * @cflags is 0 for the normal blocks, or the CF_PARTIAL flag and
+ * instruction count of a truncated one.
+ */
+static TranslationBlock *tb_find_physical(CPUState *cpu,
+                                          target_ulong pc,
+                                          target_ulong cs_base,
+                                          uint64_t flags,
+                                          uint32_t cflags)
+{
+    tb_page_addr_t phys_pc;
+    struct tb_desc desc;
+    uint32_t h;
+
+    desc.env = (CPUArchState *)cpu->env_ptr;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+    desc.cflags = cflags;
+    desc.cflags_mask = cflags ? CF_PARTIAL | CF_COUNT_MASK : CF_PARTIAL;
+    desc.pc = pc;
+    phys_pc = get_page_addr_code(desc.env, pc);
+    desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    h = tb_hash_func(phys_pc, pc, flags);
+    return qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc, h);
 }
 
 static TranslationBlock *tb_find_slow(CPUState *cpu,
@@ -266,40 +342,72 @@ static TranslationBlock *tb_find_slow(CPUState *cpu,
 {
     TranslationBlock *tb;
 
-    tb = tb_find_physical(cpu, pc, cs_base, flags);
-    if (tb) {
-        goto found;
-    }
-
-#ifdef CONFIG_USER_ONLY
-    /* mmap_lock is needed by tb_gen_code, and mmap_lock must be
-     * taken outside tb_lock.  Since we're momentarily dropping
-     * tb_lock, there's a chance that our desired tb has been
-     * translated.
-     */
-    tb_unlock();
-    mmap_lock();
-    tb_lock();
-    tb = tb_find_physical(cpu, pc, cs_base, flags);
-    if (tb) {
+    tb = tb_find_physical(cpu, pc, cs_base, flags, 0);
+    if (!tb) {
+        /* mmap_lock is needed by tb_gen_code, and mmap_lock must be
+         * taken outside tb_lock.  Another thread may have translated
+         * the block while we were waiting for the locks, so look it
+         * up again first.
+         */
+        mmap_lock();
+        tb_lock();
+        tb = tb_find_physical(cpu, pc, cs_base, flags, 0);
+        if (!tb) {
+            /* if no translated code available, then translate it now */
+            tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
+        }
+        tb_unlock();
         mmap_unlock();
-        goto found;
     }
-#endif
-
-    /* if no translated code available, then translate it now */
-    tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
-
-#ifdef CONFIG_USER_ONLY
-    mmap_unlock();
-#endif
 
-found:
     /* we add the TB in the virtual pc hash table */
-    cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
     return tb;
 }
 
+/* Execute the first @max_cycles instructions of @orig_tb, when the
+ * icount budget ends in the middle of it.  The truncated block is kept
+ * in the hash table under its instruction count, so that a budget that
+ * keeps running out at the same place does not retranslate it.  It is
+ * never chained to, nor stored in tb_jmp_cache.
+ */
+static void cpu_exec_partial(CPUState *cpu, int max_cycles,
+                             TranslationBlock *orig_tb)
+{
+    target_ulong pc = orig_tb->pc;
+    target_ulong cs_base = orig_tb->cs_base;
+    uint64_t flags = orig_tb->flags;
+    uint32_t cflags;
+    TranslationBlock *tb;
+
+    /* Should never happen.
+       We only end up here when an existing TB is too long.  */
+    if (max_cycles > CF_COUNT_MASK) {
+        max_cycles = CF_COUNT_MASK;
+    }
+    cflags = max_cycles | CF_PARTIAL;
+
+    tb = tb_find_physical(cpu, pc, cs_base, flags, cflags);
+    if (!tb) {
+        mmap_lock();
+        tb_lock();
+        tb = tb_find_physical(cpu, pc, cs_base, flags, cflags);
+        if (!tb) {
+            tb = tb_gen_code(cpu, pc, cs_base, flags, cflags);
+        }
+        tb_unlock();
+        mmap_unlock();
+    }
+
+    cpu->current_tb = tb;
+    trace_exec_tb(tb, tb->pc);
+    cpu_tb_exec(cpu, tb->tc_ptr);
+    cpu->current_tb = NULL;
+}
+
+/* Lookups are lock-free, and tb_lock is only taken to translate a
+ * block that is not in the hash table yet.
+ */
 static inline TranslationBlock *tb_find_fast(CPUState *cpu)
 {
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
@@ -311,7 +419,7 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu)
        always be the same before a given translated block
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-    tb = cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    tb = atomic_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
         tb = tb_find_slow(cpu, pc, cs_base, flags);
@@ -319,6 +427,85 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu)
     return tb;
 }
 
+/* Patch @last_tb to jump directly to @tb.  Both were looked up without
+ * tb_lock, so check under the lock that neither has been invalidated and
+ * that the code buffer was not recycled since @tb_gen was read, before
+ * @last_tb was executed.
+ */
+static void tb_chain(TranslationBlock *last_tb, int n, TranslationBlock *tb,
+                     unsigned tb_gen)
+{
+    tb_lock();
+    if (tb_generation() == tb_gen &&
+        !((last_tb->cflags | tb->cflags) & CF_INVALID)) {
+        tb_add_jump(last_tb, n, tb);
+    }
+    tb_unlock();
+}
+
+/* Called from generated code at the end of a TB that jumps to a computed
+ * address (see tcg_gen_lookup_and_goto_ptr).  Only the jump cache is
+ * probed: looking up the hash table may need to fill the TLB for the
+ * physical address, which cannot be done here.  On a miss we return
+ * to cpu_exec through the epilogue and let tb_find_fast handle it.
+ */
+void *HELPER(lookup_tb_ptr)(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = atomic_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
+        qemu_log("Trace %p [" TARGET_FMT_lx "] %s\n",
+                 tb->tc_ptr, tb->pc, lookup_symbol(tb->pc));
+    }
+    return tb->tc_ptr;
+}
+
+/* Called from generated code for atomic operations that have no host
+ * equivalent, such as a 16-byte compare-and-swap.
+ */
+void HELPER(exit_atomic)(CPUArchState *env)
+{
+    cpu_loop_exit_atomic(ENV_GET_CPU(env), GETPC());
+}
+
+#ifndef CONFIG_USER_ONLY
+/* With multi-threaded TCG, cpu_exec() is entered without the iothread
+ * lock.  Interrupt delivery may touch interrupt controller and other
+ * device state, so take the lock for the duration of that work.  In
+ * round-robin mode the vCPU thread already holds it.
+ */
+static inline void cpu_exec_lock_iothread(void)
+{
+    if (qemu_tcg_mttcg_enabled() && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+    }
+}
+
+static inline void cpu_exec_unlock_iothread(void)
+{
+    if (qemu_tcg_mttcg_enabled() && qemu_mutex_iothread_locked()) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+#else
+static inline void cpu_exec_lock_iothread(void)
+{
+}
+
+static inline void cpu_exec_unlock_iothread(void)
+{
+}
+#endif
+
 static void cpu_handle_debug_exception(CPUState *cpu)
 {
     CPUClass *cc = CPU_GET_CLASS(cpu);
@@ -346,6 +533,7 @@ int cpu_exec(CPUState *cpu)
     TranslationBlock *tb;
     uint8_t *tc_ptr;
     uintptr_t next_tb;
+    unsigned tb_gen, last_tb_gen = 0;
     SyncClocks sc;
 
     /* replay_interrupt may need current_cpu */
@@ -355,8 +543,10 @@ int cpu_exec(CPUState *cpu)
 #if defined(TARGET_I386) && !defined(CONFIG_USER_ONLY)
         if ((cpu->interrupt_request & CPU_INTERRUPT_POLL)
             && replay_interrupt()) {
+            cpu_exec_lock_iothread();
             apic_poll_irq(x86_cpu->apic_state);
             cpu_reset_interrupt(cpu, CPU_INTERRUPT_POLL);
+            cpu_exec_unlock_iothread();
         }
 #endif
         if (!cpu_has_work(cpu)) {
@@ -409,7 +599,9 @@ int cpu_exec(CPUState *cpu)
                     break;
 #else
                     if (replay_exception()) {
+                        cpu_exec_lock_iothread();
                         cc->do_interrupt(cpu);
+                        cpu_exec_unlock_iothread();
                         cpu->exception_index = -1;
                     } else if (!replay_has_interrupt()) {
                         /* give a chance to iothread in replay mode */
@@ -430,6 +622,7 @@ int cpu_exec(CPUState *cpu)
             for(;;) {
                 interrupt_request = cpu->interrupt_request;
                 if (unlikely(interrupt_request)) {
+                    cpu_exec_lock_iothread();
                     if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -482,6 +675,7 @@ int cpu_exec(CPUState *cpu)
                            the program flow was changed */
                         next_tb = 0;
                     }
+                    cpu_exec_unlock_iothread();
                 }
                 if (unlikely(cpu->exit_request
                              || replay_has_interrupt())) {
@@ -489,17 +683,8 @@ int cpu_exec(CPUState *cpu)
                     cpu->exception_index = EXCP_INTERRUPT;
                     cpu_loop_exit(cpu);
                 }
-                tb_lock();
+                tb_gen = tb_generation();
                 tb = tb_find_fast(cpu);
-                /* Note: we do it here to avoid a gcc bug on Mac OS X when
-                   doing it in tb_find_slow */
-                if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
-                    /* as some TB could have been invalidated because
-                       of memory exceptions while generating the code, we
-                       must recompute the hash index here */
-                    next_tb = 0;
-                    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
-                }
                 if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
                     qemu_log("Trace %p [" TARGET_FMT_lx "] %s\n",
                              tb->tc_ptr, tb->pc, lookup_symbol(tb->pc));
@@ -509,10 +694,10 @@ int cpu_exec(CPUState *cpu)
                    jump. */
                 if (next_tb != 0 && tb->page_addr[1] == -1
                     && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
-                                next_tb & TB_EXIT_MASK, tb);
+                    tb_chain((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
+                             next_tb & TB_EXIT_MASK, tb, last_tb_gen);
                 }
-                tb_unlock();
+                last_tb_gen = tb_gen;
                 if (likely(!cpu->exit_request)) {
                     trace_exec_tb(tb, tb->pc);
                     tc_ptr = tb->tc_ptr;
@@ -533,6 +718,12 @@ int cpu_exec(CPUState *cpu)
                          * or cpu->interrupt_request.
                          */
                         smp_rmb();
+                        /* Or the TB has become hot (see gen_tb_start).  */
+                        tb = (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
+                        if ((tb->cflags & CF_TIER0)
+                            && atomic_read(&tb->tier_countdown) < 0) {
+                            tb_tier_up(cpu, tb);
+                        }
                         next_tb = 0;
                         break;
                     case TB_EXIT_ICOUNT_EXPIRED:
@@ -549,7 +740,7 @@ int cpu_exec(CPUState *cpu)
                             if (insns_left > 0) {
                                 /* Execute remaining instructions.  */
                                 tb = (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
-                                cpu_exec_nocache(cpu, insns_left, tb, false);
+                                cpu_exec_partial(cpu, insns_left, tb);
                                 align_clocks(&sc, cpu);
                             }
                             cpu->exception_index = EXCP_INTERRUPT;
@@ -591,6 +782,7 @@ int cpu_exec(CPUState *cpu)
 #endif /* buggy compiler */
             cpu->can_do_io = 1;
             tb_lock_reset();
+            cpu_exec_unlock_iothread();
         }
     } /* for(;;) */
 
@@ -0,0 +1,125 @@
+/*
+ * Single AES rounds using the AES instructions of the host
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "crypto/aes.h"
+#if defined(__x86_64__) && QEMU_GNUC_PREREQ(4, 9)
+#include "qemu/cpuid.h"
+#endif
+#if defined(CONFIG_ARM_AES_OPT) && defined(CONFIG_LINUX)
+#include <sys/auxv.h>
+#endif
+
+const AESHostFuncs *aes_host_funcs;
+
+#if defined(__x86_64__) && QEMU_GNUC_PREREQ(4, 9)
+#pragma GCC push_options
+#pragma GCC target("aes")
+#include <wmmintrin.h>
+
+static void aes_host_enc_aesni(uint8_t *st, const uint8_t *rk, bool last)
+{
+    __m128i s = _mm_loadu_si128((const __m128i *)st);
+    __m128i k = _mm_loadu_si128((const __m128i *)rk);
+
+    s = last ? _mm_aesenclast_si128(s, k) : _mm_aesenc_si128(s, k);
+    _mm_storeu_si128((__m128i *)st, s);
+}
+
+static void aes_host_dec_aesni(uint8_t *st, const uint8_t *rk, bool last)
+{
+    __m128i s = _mm_loadu_si128((const __m128i *)st);
+    __m128i k = _mm_loadu_si128((const __m128i *)rk);
+
+    s = last ? _mm_aesdeclast_si128(s, k) : _mm_aesdec_si128(s, k);
+    _mm_storeu_si128((__m128i *)st, s);
+}
+
+static void aes_host_imc_aesni(uint8_t *st)
+{
+    __m128i s = _mm_loadu_si128((const __m128i *)st);
+
+    _mm_storeu_si128((__m128i *)st, _mm_aesimc_si128(s));
+}
+#pragma GCC pop_options
+
+static const AESHostFuncs aes_host_aesni = {
+    .enc = aes_host_enc_aesni,
+    .dec = aes_host_dec_aesni,
+    .imc = aes_host_imc_aesni,
+};
+#endif
+
+#if defined(CONFIG_ARM_AES_OPT) && defined(CONFIG_LINUX)
+#pragma GCC push_options
+#pragma GCC target("+crypto")
+#include <arm_neon.h>
+
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+
+/* AESE/AESD add the round key first and do no MixColumns, so pass a zero
+   key to them and add the real one at the end.  */
+static void aes_host_enc_armv8(uint8_t *st, const uint8_t *rk, bool last)
+{
+    uint8x16_t s = vaeseq_u8(vld1q_u8(st), vdupq_n_u8(0));
+
+    if (!last) {
+        s = vaesmcq_u8(s);
+    }
+    vst1q_u8(st, veorq_u8(s, vld1q_u8(rk)));
+}
+
+static void aes_host_dec_armv8(uint8_t *st, const uint8_t *rk, bool last)
+{
+    uint8x16_t s = vaesdq_u8(vld1q_u8(st), vdupq_n_u8(0));
+
+    if (!last) {
+        s = vaesimcq_u8(s);
+    }
+    vst1q_u8(st, veorq_u8(s, vld1q_u8(rk)));
+}
+
+static void aes_host_imc_armv8(uint8_t *st)
+{
+    vst1q_u8(st, vaesimcq_u8(vld1q_u8(st)));
+}
+#pragma GCC pop_options
+
+static const AESHostFuncs aes_host_armv8 = {
+    .enc = aes_host_enc_armv8,
+    .dec = aes_host_dec_armv8,
+    .imc = aes_host_imc_armv8,
+};
+#endif
+
+static void __attribute__((constructor)) aes_host_init(void)
+{
+#if defined(__x86_64__) && QEMU_GNUC_PREREQ(4, 9)
+    if (host_has_aes()) {
+        aes_host_funcs = &aes_host_aesni;
+    }
+#endif
+#if defined(CONFIG_ARM_AES_OPT) && defined(CONFIG_LINUX)
+    if (getauxval(AT_HWCAP) & HWCAP_AES) {
+        aes_host_funcs = &aes_host_armv8;
+    }
+#endif
+}
@@ -19,14 +19,25 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/bswap.h"
 #include "crypto/aes.h"
 #include "crypto/desrfb.h"
+#if defined(__x86_64__) && QEMU_GNUC_PREREQ(4, 9)
+#include "qemu/cpuid.h"
+#endif
+#if defined(CONFIG_ARM_AES_OPT) && defined(CONFIG_LINUX)
+#include <sys/auxv.h>
+#endif
 
 typedef struct QCryptoCipherBuiltinAES QCryptoCipherBuiltinAES;
 struct QCryptoCipherBuiltinAES {
     AES_KEY encrypt_key;
     AES_KEY decrypt_key;
     uint8_t iv[AES_BLOCK_SIZE];
+    /* Round keys in the byte order used by the AES instructions */
+    uint8_t enc_rk[AES_MAXNR + 1][AES_BLOCK_SIZE];
+    uint8_t dec_rk[AES_MAXNR + 1][AES_BLOCK_SIZE];
 };
 typedef struct QCryptoCipherBuiltinDESRFB QCryptoCipherBuiltinDESRFB;
 struct QCryptoCipherBuiltinDESRFB {
@@ -58,6 +69,158 @@ struct QCryptoCipherBuiltin {
 };
 
 
+/*
+ * Encrypt or decrypt @nblocks whole blocks with the AES instructions of the
+ * host, in ECB or CBC mode.  The decryption round keys are those of
+ * AES_set_decrypt_key, i.e. for the equivalent inverse cipher, which is
+ * also what the instructions expect.
+ */
+typedef void QCryptoAESAccelFunc(QCryptoCipherBuiltinAES *aes,
+                                 bool encrypt, bool cbc,
+                                 const uint8_t *in, uint8_t *out,
+                                 size_t nblocks);
+
+#if defined(__x86_64__) && QEMU_GNUC_PREREQ(4, 9)
+#pragma GCC push_options
+#pragma GCC target("aes")
+#include <wmmintrin.h>
+
+static void qcrypto_aes_crypt_aesni(QCryptoCipherBuiltinAES *aes,
+                                    bool encrypt, bool cbc,
+                                    const uint8_t *in, uint8_t *out,
+                                    size_t nblocks)
+{
+    const uint8_t (*rk)[AES_BLOCK_SIZE] = encrypt ? aes->enc_rk : aes->dec_rk;
+    int rounds = aes->encrypt_key.rounds;
+    __m128i iv = _mm_loadu_si128((const __m128i *)aes->iv);
+    __m128i k[AES_MAXNR + 1];
+    int r;
+
+    for (r = 0; r <= rounds; r++) {
+        k[r] = _mm_loadu_si128((const __m128i *)rk[r]);
+    }
+
+    for (; nblocks; nblocks--, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE) {
+        __m128i c = _mm_loadu_si128((const __m128i *)in);
+        __m128i b = c;
+
+        if (encrypt) {
+            if (cbc) {
+                b = _mm_xor_si128(b, iv);
+            }
+            b = _mm_xor_si128(b, k[0]);
+            for (r = 1; r < rounds; r++) {
+                b = _mm_aesenc_si128(b, k[r]);
+            }
+            b = _mm_aesenclast_si128(b, k[rounds]);
+            iv = b;
+        } else {
+            /* Each block only depends on the previous ciphertext, so the
+               CPU can overlap the decryption of consecutive blocks.  */
+            b = _mm_xor_si128(b, k[0]);
+            for (r = 1; r < rounds; r++) {
+                b = _mm_aesdec_si128(b, k[r]);
+            }
+            b = _mm_aesdeclast_si128(b, k[rounds]);
+            if (cbc) {
+                b = _mm_xor_si128(b, iv);
+            }
+            iv = c;
+        }
+        _mm_storeu_si128((__m128i *)out, b);
+    }
+
+    if (cbc) {
+        _mm_storeu_si128((__m128i *)aes->iv, iv);
+    }
+}
+#pragma GCC pop_options
+#endif
+
+#if defined(CONFIG_ARM_AES_OPT) && defined(CONFIG_LINUX)
+#pragma GCC push_options
+#pragma GCC target("+crypto")
+#include <arm_neon.h>
+
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+
+static void qcrypto_aes_crypt_armv8(QCryptoCipherBuiltinAES *aes,
+                                    bool encrypt, bool cbc,
+                                    const uint8_t *in, uint8_t *out,
+                                    size_t nblocks)
+{
+    const uint8_t (*rk)[AES_BLOCK_SIZE] = encrypt ? aes->enc_rk : aes->dec_rk;
+    int rounds = aes->encrypt_key.rounds;
+    uint8x16_t iv = vld1q_u8(aes->iv);
+    uint8x16_t k[AES_MAXNR + 1];
+    int r;
+
+    for (r = 0; r <= rounds; r++) {
+        k[r] = vld1q_u8(rk[r]);
+    }
+
+    for (; nblocks; nblocks--, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE) {
+        uint8x16_t c = vld1q_u8(in);
+        uint8x16_t b = c;
+
+        if (encrypt) {
+            if (cbc) {
+                b = veorq_u8(b, iv);
+            }
+            for (r = 0; r < rounds - 1; r++) {
+                b = vaesmcq_u8(vaeseq_u8(b, k[r]));
+            }
+            b = veorq_u8(vaeseq_u8(b, k[rounds - 1]), k[rounds]);
+            iv = b;
+        } else {
+            for (r = 0; r < rounds - 1; r++) {
+                b = vaesimcq_u8(vaesdq_u8(b, k[r]));
+            }
+            b = veorq_u8(vaesdq_u8(b, k[rounds - 1]), k[rounds]);
+            if (cbc) {
+                b = veorq_u8(b, iv);
+            }
+            iv = c;
+        }
+        vst1q_u8(out, b);
+    }
+
+    if (cbc) {
+        vst1q_u8(aes->iv, iv);
+    }
+}
+#pragma GCC pop_options
+#endif
+
+static QCryptoAESAccelFunc *qcrypto_aes_accel;
+
+static void __attribute__((constructor)) qcrypto_aes_accel_init(void)
+{
+#if defined(__x86_64__) && QEMU_GNUC_PREREQ(4, 9)
+    if (host_has_aes()) {
+        qcrypto_aes_accel = qcrypto_aes_crypt_aesni;
+    }
+#endif
+#if defined(CONFIG_ARM_AES_OPT) && defined(CONFIG_LINUX)
+    if (getauxval(AT_HWCAP) & HWCAP_AES) {
+        qcrypto_aes_accel = qcrypto_aes_crypt_armv8;
+    }
+#endif
+}
+
+static void qcrypto_aes_key_bytes(const AES_KEY *key,
+                                  uint8_t rk[][AES_BLOCK_SIZE])
+{
+    int i;
+
+    for (i = 0; i < 4 * (key->rounds + 1); i++) {
+        stl_be_p(rk[i / 4] + (i % 4) * 4, key->rd_key[i]);
+    }
+}
+
+
 static void qcrypto_cipher_free_aes(QCryptoCipher *cipher)
 {
     QCryptoCipherBuiltin *ctxt = cipher->opaque;
@@ -75,6 +238,13 @@ static int qcrypto_cipher_encrypt_aes(QCryptoCipher *cipher,
 {
     QCryptoCipherBuiltin *ctxt = cipher->opaque;
 
+    if (qcrypto_aes_accel && len % AES_BLOCK_SIZE == 0) {
+        qcrypto_aes_accel(&ctxt->state.aes, true,
+                          cipher->mode == QCRYPTO_CIPHER_MODE_CBC,
+                          in, out, len / AES_BLOCK_SIZE);
+        return 0;
+    }
+
     if (cipher->mode == QCRYPTO_CIPHER_MODE_ECB) {
         const uint8_t *inptr = in;
         uint8_t *outptr = out;
@@ -112,6 +282,13 @@ static int qcrypto_cipher_decrypt_aes(QCryptoCipher *cipher,
 {
     QCryptoCipherBuiltin *ctxt = cipher->opaque;
 
+    if (qcrypto_aes_accel && len % AES_BLOCK_SIZE == 0) {
+        qcrypto_aes_accel(&ctxt->state.aes, false,
+                          cipher->mode == QCRYPTO_CIPHER_MODE_CBC,
+                          in, out, len / AES_BLOCK_SIZE);
+        return 0;
+    }
+
     if (cipher->mode == QCRYPTO_CIPHER_MODE_ECB) {
         const uint8_t *inptr = in;
         uint8_t *outptr = out;
@@ -183,6 +360,13 @@ static int qcrypto_cipher_init_aes(QCryptoCipher *cipher,
         goto error;
     }
 
+    if (qcrypto_aes_accel) {
+        qcrypto_aes_key_bytes(&ctxt->state.aes.encrypt_key,
+                              ctxt->state.aes.enc_rk);
+        qcrypto_aes_key_bytes(&ctxt->state.aes.decrypt_key,
+                              ctxt->state.aes.dec_rk);
+    }
+
     ctxt->blocksize = AES_BLOCK_SIZE;
     ctxt->free = qcrypto_cipher_free_aes;
     ctxt->setiv = qcrypto_cipher_setiv_aes;
@@ -29,6 +29,17 @@
 
 
 #include <gnutls/x509.h>
+#ifdef CONFIG_GNUTLS_KTLS
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
 
 
 struct QCryptoTLSSession {
@@ -481,6 +492,109 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *session)
 }
 
 
+#ifdef CONFIG_GNUTLS_KTLS
+/*
+ * Pass the keys and the record sequence number of one direction to the
+ * kernel.  For TLS 1.2 AES-GCM the explicit part of the nonce is the
+ * sequence number, the implicit part (salt) is the IV of the session.
+ */
+static bool
+qcrypto_tls_session_ktls_set_state(QCryptoTLSSession *session,
+                                   int fd, bool tx)
+{
+    gnutls_datum_t mac_key, iv, cipher_key;
+    unsigned char seq[8];
+    union {
+        struct tls12_crypto_info_aes_gcm_128 gcm128;
+#ifdef TLS_CIPHER_AES_GCM_256
+        struct tls12_crypto_info_aes_gcm_256 gcm256;
+#endif
+    } info;
+    socklen_t len;
+    bool ret;
+
+    if (gnutls_record_get_state(session->handle, !tx, &mac_key, &iv,
+                                &cipher_key, seq) < 0) {
+        return false;
+    }
+
+    memset(&info, 0, sizeof(info));
+    switch (gnutls_cipher_get(session->handle)) {
+    case GNUTLS_CIPHER_AES_128_GCM:
+        if (cipher_key.size != TLS_CIPHER_AES_GCM_128_KEY_SIZE ||
+            iv.size < TLS_CIPHER_AES_GCM_128_SALT_SIZE) {
+            return false;
+        }
+        info.gcm128.info.version = TLS_1_2_VERSION;
+        info.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(info.gcm128.key, cipher_key.data, cipher_key.size);
+        memcpy(info.gcm128.salt, iv.data, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+        memcpy(info.gcm128.iv, seq, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+        memcpy(info.gcm128.rec_seq, seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+        len = sizeof(info.gcm128);
+        break;
+#ifdef TLS_CIPHER_AES_GCM_256
+    case GNUTLS_CIPHER_AES_256_GCM:
+        if (cipher_key.size != TLS_CIPHER_AES_GCM_256_KEY_SIZE ||
+            iv.size < TLS_CIPHER_AES_GCM_256_SALT_SIZE) {
+            return false;
+        }
+        info.gcm256.info.version = TLS_1_2_VERSION;
+        info.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(info.gcm256.key, cipher_key.data, cipher_key.size);
+        memcpy(info.gcm256.salt, iv.data, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+        memcpy(info.gcm256.iv, seq, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+        memcpy(info.gcm256.rec_seq, seq, TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+        len = sizeof(info.gcm256);
+        break;
+#endif
+    default:
+        return false;
+    }
+
+    ret = setsockopt(fd, SOL_TLS, tx ? TLS_TX : TLS_RX, &info, len) == 0;
+    memset(&info, 0, sizeof(info));
+    return ret;
+}
+
+
+void
+qcrypto_tls_session_enable_ktls(QCryptoTLSSession *session, int fd,
+                                bool *tx, bool *rx)
+{
+    *tx = *rx = false;
+
+    /* TLS 1.3 has post-handshake messages (session tickets, key updates)
+     * that gnutls would have to process after the kernel took over.
+     */
+    if (!session->handshakeComplete ||
+        gnutls_protocol_get_version(session->handle) != GNUTLS_TLS1_2) {
+        return;
+    }
+
+    /* Data that gnutls already decrypted can only be read through it */
+    if (gnutls_record_check_pending(session->handle)) {
+        return;
+    }
+
+    if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+        return;
+    }
+
+    *tx = qcrypto_tls_session_ktls_set_state(session, fd, true);
+    *rx = qcrypto_tls_session_ktls_set_state(session, fd, false);
+}
+#else
+void
+qcrypto_tls_session_enable_ktls(QCryptoTLSSession *session,
+                                int fd G_GNUC_UNUSED,
+                                bool *tx, bool *rx)
+{
+    *tx = *rx = false;
+}
+#endif
+
+
 #else /* ! CONFIG_GNUTLS */
 
 
@@ -572,4 +686,13 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess)
     return NULL;
 }
 
+
+void
+qcrypto_tls_session_enable_ktls(QCryptoTLSSession *sess G_GNUC_UNUSED,
+                                int fd G_GNUC_UNUSED,
+                                bool *tx, bool *rx)
+{
+    *tx = *rx = false;
+}
+
 #endif
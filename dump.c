@@ -23,6 +23,8 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/memory_mapping.h"
 #include "sysemu/cpus.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
 #include "qapi/qmp/qerror.h"
 #include "qmp-commands.h"
 #include "qapi-event.h"
@@ -1183,20 +1185,218 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
+/* Pages that the compression threads work on at a time */
+#define DUMP_COMPRESS_BATCH         256
+#define DUMP_COMPRESS_THREADS_MAX   8
+
+typedef struct DumpPage {
+    uint8_t *buf;       /* the guest page */
+    uint8_t *out;       /* buffer for the compressed page */
+    size_t size_out;    /* size of the page in the vmcore */
+    uint32_t flags;     /* compression format, 0 if written as is */
+    bool zero;
+} DumpPage;
+
+/*
+ * The pages are compressed by batches, by the worker threads and the
+ * dump thread together, and then written in order by the dump thread.
+ */
+typedef struct DumpCompressPool {
+    DumpState *s;
+    size_t len_buf_out;
+    uint8_t *buf_out;
+    DumpPage pages[DUMP_COMPRESS_BATCH];
+    int nr_pages;
+    int next_page;      /* next page of the batch to compress */
+
+    QemuMutex lock;
+    QemuCond start_cond;
+    QemuCond done_cond;
+    unsigned batch;     /* incremented to start a batch */
+    int busy;           /* workers still compressing the batch */
+    bool quit;
+    int nr_threads;
+    QemuThread *threads;
+} DumpCompressPool;
+
+static void dump_compress_page(DumpCompressPool *pool, DumpPage *page,
+                               void *wrkmem)
+{
+    DumpState *s = pool->s;
+    size_t page_size = s->dump_info.page_size;
+    size_t size_out = pool->len_buf_out;
+
+    page->flags = 0;
+    page->size_out = page_size;
+
+    /* check zero page */
+    page->zero = is_zero_page(page->buf, page_size);
+    if (page->zero) {
+        return;
+    }
+
+    /*
+     * only one compression format will be used here, for
+     * s->flag_compress is set. But when compression fails to work,
+     * we fall back to save in plaintext.
+     */
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
+            (compress2(page->out, (uLongf *)&size_out, page->buf,
+                       page_size, Z_BEST_SPEED) == Z_OK) &&
+            (size_out < page_size)) {
+        page->flags = DUMP_DH_COMPRESSED_ZLIB;
+#ifdef CONFIG_LZO
+    } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
+            (lzo1x_1_compress(page->buf, page_size, page->out,
+            (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
+            (size_out < page_size)) {
+        page->flags = DUMP_DH_COMPRESSED_LZO;
+#endif
+#ifdef CONFIG_SNAPPY
+    } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
+            (snappy_compress((char *)page->buf, page_size,
+            (char *)page->out, &size_out) == SNAPPY_OK) &&
+            (size_out < page_size)) {
+        page->flags = DUMP_DH_COMPRESSED_SNAPPY;
+#endif
+    }
+
+    if (page->flags) {
+        page->size_out = size_out;
+    }
+}
+
+static void dump_compress_pages(DumpCompressPool *pool, void *wrkmem)
+{
+    int i;
+
+    while ((i = atomic_fetch_inc(&pool->next_page)) < pool->nr_pages) {
+        dump_compress_page(pool, &pool->pages[i], wrkmem);
+    }
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompressPool *pool = opaque;
+    unsigned batch = 0;
+    void *wrkmem = NULL;
+
+#ifdef CONFIG_LZO
+    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+
+    qemu_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->batch == batch && !pool->quit) {
+            qemu_cond_wait(&pool->start_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        batch = pool->batch;
+        qemu_mutex_unlock(&pool->lock);
+
+        dump_compress_pages(pool, wrkmem);
+
+        qemu_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) {
+            qemu_cond_signal(&pool->done_cond);
+        }
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    g_free(wrkmem);
+    return NULL;
+}
+
+static DumpCompressPool *dump_compress_pool_new(DumpState *s,
+                                                size_t len_buf_out)
+{
+    DumpCompressPool *pool = g_new0(DumpCompressPool, 1);
+#ifdef _SC_NPROCESSORS_ONLN
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    long nr_cpus = 1;
+#endif
+    int i;
+
+    pool->s = s;
+    pool->len_buf_out = len_buf_out;
+    pool->buf_out = g_malloc(DUMP_COMPRESS_BATCH * len_buf_out);
+    for (i = 0; i < DUMP_COMPRESS_BATCH; i++) {
+        pool->pages[i].out = pool->buf_out + i * len_buf_out;
+    }
+
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->start_cond);
+    qemu_cond_init(&pool->done_cond);
+
+    /* The dump thread compresses pages too */
+    pool->nr_threads = MAX(1, MIN(nr_cpus, DUMP_COMPRESS_THREADS_MAX)) - 1;
+    pool->threads = g_new0(QemuThread, pool->nr_threads);
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_thread_create(&pool->threads[i], "dump_compress",
+                           dump_compress_thread, pool, QEMU_THREAD_JOINABLE);
+    }
+
+    return pool;
+}
+
+static void dump_compress_pool_free(DumpCompressPool *pool)
+{
+    int i;
+
+    qemu_mutex_lock(&pool->lock);
+    pool->quit = true;
+    qemu_cond_broadcast(&pool->start_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_thread_join(&pool->threads[i]);
+    }
+    g_free(pool->threads);
+
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->start_cond);
+    qemu_mutex_destroy(&pool->lock);
+    g_free(pool->buf_out);
+    g_free(pool);
+}
+
+/* Compress pool->nr_pages pages, and wait until all of them are done */
+static void dump_compress_batch(DumpCompressPool *pool, void *wrkmem)
+{
+    pool->next_page = 0;
+
+    qemu_mutex_lock(&pool->lock);
+    pool->busy = pool->nr_threads;
+    pool->batch++;
+    qemu_cond_broadcast(&pool->start_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    dump_compress_pages(pool, wrkmem);
+
+    qemu_mutex_lock(&pool->lock);
+    while (pool->busy) {
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    qemu_mutex_unlock(&pool->lock);
+}
+
 static void write_dump_pages(DumpState *s, Error **errp)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    size_t len_buf_out;
+    void *wrkmem = NULL;
+    DumpCompressPool *pool;
     off_t offset_desc, offset_data;
     PageDescriptor pd, pd_zero;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    bool more = true;
+    int i;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
@@ -1205,7 +1405,7 @@ static void write_dump_pages(DumpState *s, Error **errp)
     prepare_data_cache(&page_desc, s, offset_desc);
     prepare_data_cache(&page_data, s, offset_data);
 
-    /* prepare buffer to store compressed data */
+    /* prepare buffers to store compressed data */
     len_buf_out = get_len_buf_out(s->dump_info.page_size, s->flag_compress);
     assert(len_buf_out != 0);
 
@@ -1213,7 +1413,7 @@ static void write_dump_pages(DumpState *s, Error **errp)
     wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
 #endif
 
-    buf_out = g_malloc(len_buf_out);
+    pool = dump_compress_pool_new(s, len_buf_out);
 
     /*
      * init zero page's page_desc and page_data, because every zero page
@@ -1237,97 +1437,60 @@ static void write_dump_pages(DumpState *s, Error **errp)
      * dump memory to vmcore page by page. zero page will all be resided in the
      * first page of page section
      */
-    while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, s->dump_info.page_size)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
+    while (more) {
+        pool->nr_pages = 0;
+        while (pool->nr_pages < DUMP_COMPRESS_BATCH &&
+               (more = get_next_page(&block_iter, &pfn_iter, &buf, s))) {
+            pool->pages[pool->nr_pages++].buf = buf;
+        }
+        if (!pool->nr_pages) {
+            break;
+        }
+
+        dump_compress_batch(pool, wrkmem);
+
+        for (i = 0; i < pool->nr_pages; i++) {
+            DumpPage *page = &pool->pages[i];
+
+            if (page->zero) {
+                ret = write_cache(&page_desc, &pd_zero,
+                                  sizeof(PageDescriptor), false);
+                if (ret < 0) {
+                    error_setg(errp, "dump: failed to write page desc");
+                    goto out;
+                }
+                s->written_size += s->dump_info.page_size;
+                continue;
             }
-        } else {
+
             /*
              * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
+             * 1. write the compressed page, or the page itself if it
+             *    could not be compressed, into the cache of page_data
+             * 2. get page desc of the page and write it into the cache
+             *    of page_desc
              */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, s->dump_info.page_size,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned the target's page size
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = s->dump_info.page_size;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf,
-                                  s->dump_info.page_size, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
+            pd.flags = cpu_to_dump32(s, page->flags);
+            pd.size = cpu_to_dump32(s, page->size_out);
+            ret = write_cache(&page_data, page->flags ? page->out : page->buf,
+                              page->size_out, false);
+            if (ret < 0) {
+                error_setg(errp, "dump: failed to write page data");
+                goto out;
             }
 
             /* get and write page desc here */
             pd.page_flags = cpu_to_dump64(s, 0);
             pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
+            offset_data += page->size_out;
 
             ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
             if (ret < 0) {
                 error_setg(errp, "dump: failed to write page desc");
                 goto out;
             }
+            s->written_size += s->dump_info.page_size;
         }
-        s->written_size += s->dump_info.page_size;
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
@@ -1344,12 +1507,8 @@ static void write_dump_pages(DumpState *s, Error **errp)
 out:
     free_data_cache(&page_desc);
     free_data_cache(&page_data);
-
-#ifdef CONFIG_LZO
+    dump_compress_pool_free(pool);
     g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
@@ -58,6 +58,9 @@
 #ifndef _WIN32
 #include "qemu/mmap-alloc.h"
 #endif
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+#include <linux/falloc.h>
+#endif
 
 //#define DEBUG_SUBPAGE
 
@@ -141,7 +144,13 @@ struct AddressSpaceDispatch {
      */
     PhysPageEntry phys_map;
     PhysPageMap map;
+    /* The address space that built the map.  Others with the same
+     * FlatView share it; each of them holds a reference.
+     */
     AddressSpace *as;
+    FlatView *view;
+    int ref;
+    bool compacted;
 };
 
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
@@ -411,14 +420,15 @@ address_space_translate_internal(AddressSpaceDispatch *d, hwaddr addr, hwaddr *x
 }
 
 /* Called from RCU critical section */
-MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
-                                      hwaddr *xlat, hwaddr *plen,
-                                      bool is_write)
+static MemoryRegion *address_space_do_translate(AddressSpace *as, hwaddr addr,
+                                                hwaddr *xlat, hwaddr *plen,
+                                                bool is_write, bool *iommu)
 {
     IOMMUTLBEntry iotlb;
     MemoryRegionSection *section;
     MemoryRegion *mr;
 
+    *iommu = false;
     for (;;) {
         AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
         section = address_space_translate_internal(d, addr, &addr, plen, true);
@@ -428,6 +438,7 @@ MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
             break;
         }
 
+        *iommu = true;
         iotlb = mr->iommu_ops->translate(mr, addr, is_write);
         addr = ((iotlb.translated_addr & ~iotlb.addr_mask)
                 | (addr & iotlb.addr_mask));
@@ -449,6 +460,61 @@ MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
     return mr;
 }
 
+/* Called from RCU critical section */
+MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
+                                      hwaddr *xlat, hwaddr *plen,
+                                      bool is_write)
+{
+    bool iommu;
+
+    return address_space_do_translate(as, addr, xlat, plen, is_write, &iommu);
+}
+
+/* Called from RCU critical section */
+IOMMUTLBEntry address_space_get_iotlb_entry(AddressSpace *as, hwaddr addr,
+                                            bool is_write)
+{
+    IOMMUTLBEntry iotlb;
+    MemoryRegionSection *section;
+    MemoryRegion *mr;
+    hwaddr iova = addr, xlat, plen = (hwaddr)-1;
+    hwaddr mask = ~TARGET_PAGE_MASK;
+    IOMMUAccessFlags perm = IOMMU_RW;
+    bool iommu = false;
+
+    for (;;) {
+        AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
+        section = address_space_translate_internal(d, addr, &xlat, &plen,
+                                                   true);
+        mr = section->mr;
+
+        if (!mr->iommu_ops) {
+            break;
+        }
+
+        iotlb = mr->iommu_ops->translate(mr, xlat, is_write);
+        if (!(iotlb.perm & (1 << is_write))) {
+            iotlb.target_as = NULL;
+            return iotlb;
+        }
+
+        /* Nested IOMMUs: the smallest page size wins */
+        mask = iommu ? MIN(mask, iotlb.addr_mask) : iotlb.addr_mask;
+        perm &= iotlb.perm;
+        iommu = true;
+        addr = ((iotlb.translated_addr & ~iotlb.addr_mask)
+                | (xlat & iotlb.addr_mask));
+        as = iotlb.target_as;
+    }
+
+    iotlb.target_as = as;
+    iotlb.iova = iova & ~mask;
+    iotlb.translated_addr = addr & ~mask;
+    iotlb.addr_mask = mask;
+    iotlb.perm = perm;
+    return iotlb;
+}
+
 /* Called from RCU critical section */
 MemoryRegionSection *
 address_space_translate_for_iotlb(CPUState *cpu, int asidx, hwaddr addr,
@@ -611,6 +677,8 @@ static int cpu_get_free_index(Error **errp)
 
 void cpu_exec_exit(CPUState *cpu)
 {
+    tlb_destroy(cpu);
+
     if (cpu->cpu_index == -1) {
         /* cpu_index was never allocated by this @cpu or was already freed. */
         return;
@@ -648,6 +716,7 @@ void cpu_exec_init(CPUState *cpu, Error **errp)
 
 #ifndef CONFIG_USER_ONLY
     cpu->thread_id = qemu_get_thread_id();
+    tlb_init(cpu);
 
     /* This is a softmmu CPU object, so create a property for it
      * so users can wire up its memory. (This can't go in qom/cpu.c
@@ -1178,6 +1247,8 @@ static void register_multipage(AddressSpaceDispatch *d,
     phys_page_set(d, start_addr >> TARGET_PAGE_BITS, num_pages, section_index);
 }
 
+static void address_space_dispatch_free(AddressSpaceDispatch *d);
+
 static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
 {
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
@@ -1185,6 +1256,25 @@ static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
     MemoryRegionSection now = *section, remain = *section;
     Int128 page_size = int128_make64(TARGET_PAGE_SIZE);
 
+    if (!d->view) {
+        FlatView *view = as->next_map ? as->next_map : as->current_map;
+        AddressSpaceDispatch *shared = flatview_get_dispatch(view);
+
+        if (shared) {
+            /* Nothing was added to ours yet, and nobody else can see it */
+            address_space_dispatch_free(d);
+            shared->ref++;
+            as->next_dispatch = d = shared;
+        } else {
+            d->view = view;
+            flatview_set_dispatch(view, d);
+        }
+    }
+    if (d->as != as) {
+        /* The owner of the shared tree adds the section */
+        return;
+    }
+
     if (now.offset_within_address_space & ~TARGET_PAGE_MASK) {
         uint64_t left = TARGET_PAGE_ALIGN(now.offset_within_address_space)
                        - now.offset_within_address_space;
@@ -1325,7 +1415,7 @@ static void *file_ram_alloc(RAMBlock *block,
     }
 
     if (mem_prealloc) {
-        os_mem_prealloc(fd, area, memory);
+        os_mem_prealloc(fd, area, memory, smp_cpus);
     }
 
     block->fd = fd;
@@ -1570,6 +1660,47 @@ static void dirty_memory_extend(ram_addr_t old_ram_size,
     }
 }
 
+static QLIST_HEAD(, RAMBlockNotifier) ram_block_notifiers =
+    QLIST_HEAD_INITIALIZER(ram_block_notifiers);
+
+void ram_block_notifier_add(RAMBlockNotifier *n)
+{
+    RAMBlock *block;
+
+    QLIST_INSERT_HEAD(&ram_block_notifiers, n, next);
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (block->host) {
+            n->ram_block_added(n, block->host, block->max_length);
+        }
+    }
+    rcu_read_unlock();
+}
+
+void ram_block_notifier_remove(RAMBlockNotifier *n)
+{
+    QLIST_REMOVE(n, next);
+}
+
+static void ram_block_notify_add(void *host, size_t size)
+{
+    RAMBlockNotifier *n;
+
+    QLIST_FOREACH(n, &ram_block_notifiers, next) {
+        n->ram_block_added(n, host, size);
+    }
+}
+
+static void ram_block_notify_remove(void *host, size_t size)
+{
+    RAMBlockNotifier *n;
+
+    QLIST_FOREACH(n, &ram_block_notifiers, next) {
+        n->ram_block_removed(n, host, size);
+    }
+}
+
 static void ram_block_add(RAMBlock *new_block, Error **errp)
 {
     RAMBlock *block;
@@ -1646,6 +1777,7 @@ static void ram_block_add(RAMBlock *new_block, Error **errp)
         if (kvm_enabled()) {
             kvm_setup_guest_memory(new_block->host, new_block->max_length);
         }
+        ram_block_notify_add(new_block->host, new_block->max_length);
     }
 }
 
@@ -1771,6 +1903,10 @@ static void reclaim_ramblock(RAMBlock *block)
 
 void qemu_ram_free(RAMBlock *block)
 {
+    if (block->host) {
+        ram_block_notify_remove(block->host, block->max_length);
+    }
+
     qemu_mutex_lock_ramlist();
     QLIST_REMOVE_RCU(block, next);
     ram_list.mru_block = NULL;
@@ -1992,6 +2128,60 @@ found:
     return block;
 }
 
+/* The size of the host pages that back the block */
+bool qemu_ram_is_shared(RAMBlock *rb)
+{
+    return rb->flags & RAM_SHARED;
+}
+
+size_t qemu_ram_pagesize(RAMBlock *rb)
+{
+    /* Set for file backed memory, e.g. on hugetlbfs */
+    return rb->mr->align ? rb->mr->align : qemu_real_host_page_size;
+}
+
+/*
+ * Give the host memory of a range of the block back, so that it reads as
+ * zeroes the next time it is accessed.  The range must be aligned to the
+ * host page size of the block.
+ */
+int qemu_ram_discard_range(RAMBlock *rb, uint64_t start, size_t length)
+{
+    int ret = 0;
+
+    if (start + length > rb->used_length ||
+        (start | length) & (qemu_ram_pagesize(rb) - 1)) {
+        error_report("%s: bad range 0x%" PRIx64 "+0x%zx in %s", __func__,
+                     start, length, rb->idstr);
+        return -EINVAL;
+    }
+
+    if (rb->fd >= 0) {
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+        /* The pages of file backed memory stay in the file otherwise */
+        if (fallocate(rb->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      start, length)) {
+            ret = -errno;
+            error_report("%s: cannot punch hole in %s: %s", __func__,
+                         rb->idstr, strerror(-ret));
+            return ret;
+        }
+#else
+        return -ENOSYS;
+#endif
+    }
+
+    /* Punching a hole does not drop private copies of the pages */
+    if (rb->fd < 0 || !(rb->flags & RAM_SHARED)) {
+        if (qemu_madvise(rb->host + start, length, QEMU_MADV_DONTNEED)) {
+            ret = -errno;
+            error_report("%s: cannot discard memory of %s: %s", __func__,
+                         rb->idstr, strerror(-ret));
+        }
+    }
+    return ret;
+}
+
 /*
  * Finds the named RAMBlock
  *
@@ -2033,7 +2223,9 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
                                uint64_t val, unsigned size)
 {
     if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
+        tb_lock();
         tb_invalidate_phys_page_fast(ram_addr, size);
+        tb_unlock();
     }
     switch (size) {
     case 1:
@@ -2113,6 +2305,10 @@ static void check_watchpoint(int offset, int len, MemTxAttrs attrs, int flags)
                     cpu->exception_index = EXCP_DEBUG;
                     cpu_loop_exit(cpu);
                 } else {
+                    /* Released by tb_lock_reset() in cpu_exec() once
+                     * cpu_resume_from_signal() has jumped back there.
+                     */
+                    tb_lock();
                     cpu_get_tb_cpu_state(env, &pc, &cs_base, &cpu_flags);
                     tb_gen_code(cpu, pc, cs_base, cpu_flags, 1);
                     cpu_resume_from_signal(cpu, NULL);
@@ -2341,8 +2537,13 @@ static void io_mem_init(void)
     memory_region_init_io(&io_mem_rom, NULL, &unassigned_mem_ops, NULL, NULL, UINT64_MAX);
     memory_region_init_io(&io_mem_unassigned, NULL, &unassigned_mem_ops, NULL,
                           NULL, UINT64_MAX);
+    /* io_mem_notdirty calls tb_invalidate_phys_page_fast,
+     * which can be called without the iothread mutex.
+     */
     memory_region_init_io(&io_mem_notdirty, NULL, &notdirty_mem_ops, NULL,
                           NULL, UINT64_MAX);
+    memory_region_clear_global_locking(&io_mem_notdirty);
+
     memory_region_init_io(&io_mem_watch, NULL, &watch_mem_ops, NULL,
                           NULL, UINT64_MAX);
 }
@@ -2364,6 +2565,7 @@ static void mem_begin(MemoryListener *listener)
 
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
     d->as = as;
+    d->ref = 1;
     as->next_dispatch = d;
 }
 
@@ -2373,17 +2575,31 @@ static void address_space_dispatch_free(AddressSpaceDispatch *d)
     g_free(d);
 }
 
+/* Called with the iothread lock held */
+static void address_space_dispatch_unref(AddressSpaceDispatch *d)
+{
+    if (!--d->ref) {
+        call_rcu(d, address_space_dispatch_free, rcu);
+    }
+}
+
 static void mem_commit(MemoryListener *listener)
 {
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
     AddressSpaceDispatch *cur = as->dispatch;
     AddressSpaceDispatch *next = as->next_dispatch;
 
-    phys_page_compact_all(next, next->map.nodes_nb);
+    /* A shared tree is compacted by whichever user commits first, before
+     * anybody can see it.
+     */
+    if (!next->compacted) {
+        phys_page_compact_all(next, next->map.nodes_nb);
+        next->compacted = true;
+    }
 
     atomic_rcu_set(&as->dispatch, next);
     if (cur) {
-        call_rcu(cur, address_space_dispatch_free, rcu);
+        address_space_dispatch_unref(cur);
     }
 }
 
@@ -2429,7 +2645,7 @@ void address_space_destroy_dispatch(AddressSpace *as)
 
     atomic_rcu_set(&as->dispatch, NULL);
     if (d) {
-        call_rcu(d, address_space_dispatch_free, rcu);
+        address_space_dispatch_unref(d);
     }
 }
 
@@ -2558,13 +2774,8 @@ static bool prepare_mmio_access(MemoryRegion *mr)
         release_lock = true;
     }
     if (mr->flush_coalesced_mmio) {
-        if (unlocked) {
-            qemu_mutex_lock_iothread();
-        }
+        /* Takes the iothread lock itself, only if there is anything to do */
         qemu_flush_coalesced_mmio_buffer();
-        if (unlocked) {
-            qemu_mutex_unlock_iothread();
-        }
     }
 
     return release_lock;
@@ -3047,6 +3258,72 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
     cpu_notify_map_clients();
 }
 
+bool address_space_cache_init(MemoryRegionCache *cache, AddressSpace *as,
+                              hwaddr addr, hwaddr len, bool is_write)
+{
+    MemoryRegion *mr;
+    hwaddr l = len, xlat;
+    bool iommu;
+
+    cache->ptr = NULL;
+    cache->mr = NULL;
+    cache->as = as;
+    cache->addr = addr;
+    cache->len = len;
+    cache->is_write = is_write;
+
+    /* Xen's map cache may drop the mapping behind our back */
+    if (len == 0 || xen_enabled()) {
+        return false;
+    }
+
+    rcu_read_lock();
+    mr = address_space_do_translate(as, addr, &xlat, &l, is_write, &iommu);
+    /* The guest can change IOMMU mappings without a memory transaction,
+     * so a pointer looked up through an IOMMU could go stale.
+     */
+    if (!iommu && l == len && memory_access_is_direct(mr, is_write)) {
+        memory_region_ref(mr);
+        cache->mr = mr;
+        cache->ram_addr = memory_region_get_ram_addr(mr) + xlat;
+        cache->ptr = qemu_get_ram_ptr(mr->ram_block, cache->ram_addr);
+    }
+    rcu_read_unlock();
+
+    return cache->ptr != NULL;
+}
+
+void address_space_cache_destroy(MemoryRegionCache *cache)
+{
+    if (cache->mr) {
+        memory_region_unref(cache->mr);
+    }
+    cache->mr = NULL;
+    cache->ptr = NULL;
+}
+
+void address_space_cache_invalidate(MemoryRegionCache *cache, hwaddr addr,
+                                    hwaddr access_len)
+{
+    assert(cache->is_write);
+    invalidate_and_set_dirty(cache->mr, cache->ram_addr + addr, access_len);
+}
+
+void address_space_read_cached_slow(MemoryRegionCache *cache, hwaddr addr,
+                                    void *buf, int len)
+{
+    address_space_read(cache->as, cache->addr + addr, MEMTXATTRS_UNSPECIFIED,
+                       buf, len);
+}
+
+void address_space_write_cached_slow(MemoryRegionCache *cache, hwaddr addr,
+                                     const void *buf, int len)
+{
+    assert(cache->is_write);
+    address_space_write(cache->as, cache->addr + addr, MEMTXATTRS_UNSPECIFIED,
+                        buf, len);
+}
+
 void *cpu_physical_memory_map(hwaddr addr,
                               hwaddr *plen,
                               int is_write)
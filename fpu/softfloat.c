@@ -83,6 +83,8 @@ this code that are retained.
  * target-dependent and needs the TARGET_* macros.
  */
 #include "qemu/osdep.h"
+#include <math.h>
+#include <float.h>
 
 #include "fpu/softfloat.h"
 
@@ -2158,6 +2160,108 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path.  When the inexact flag is already raised and the rounding
+| mode is nearest-even, an operation on zero or normal operands whose result
+| is normal and finite cannot change any exception flag, so the host FPU gives
+| exactly the same answer as the code below.  Everything else (denormals,
+| infinities, NaNs, tiny or overflowing results, other rounding modes) is left
+| to softfloat.  Hosts that evaluate in excess precision (x87) would round
+| twice, so the fast path is only compiled where FLT_EVAL_METHOD is 0.
+*----------------------------------------------------------------------------*/
+
+#if defined(__FLT_EVAL_METHOD__) && __FLT_EVAL_METHOD__ == 0
+#define QEMU_HARDFLOAT 1
+#else
+#define QEMU_HARDFLOAT 0
+#endif
+
+typedef union {
+    uint32_t s;
+    float h;
+} Float32Host;
+
+typedef union {
+    uint64_t s;
+    double h;
+} Float64Host;
+
+static inline bool can_use_fpu(const float_status *status)
+{
+    return QEMU_HARDFLOAT &&
+           likely(status->float_exception_flags & float_flag_inexact) &&
+           likely(status->float_rounding_mode == float_round_nearest_even);
+}
+
+static inline bool float32_is_zero_or_normal_bits(float32 a)
+{
+    int exp = extractFloat32Exp(a);
+
+    return exp ? exp != 0xFF : !extractFloat32Frac(a);
+}
+
+static inline bool float64_is_zero_or_normal_bits(float64 a)
+{
+    int exp = extractFloat64Exp(a);
+
+    return exp ? exp != 0x7FF : !extractFloat64Frac(a);
+}
+
+static inline bool float32_hard_args_ok(float32 a, float32 b,
+                                        const float_status *status)
+{
+    return can_use_fpu(status) &&
+           float32_is_zero_or_normal_bits(a) &&
+           float32_is_zero_or_normal_bits(b);
+}
+
+static inline bool float64_hard_args_ok(float64 a, float64 b,
+                                        const float_status *status)
+{
+    return can_use_fpu(status) &&
+           float64_is_zero_or_normal_bits(a) &&
+           float64_is_zero_or_normal_bits(b);
+}
+
+static inline float float32_to_host(float32 a)
+{
+    Float32Host u = { .s = float32_val(a) };
+    return u.h;
+}
+
+static inline float32 float32_from_host(float h)
+{
+    Float32Host u = { .h = h };
+    return make_float32(u.s);
+}
+
+static inline double float64_to_host(float64 a)
+{
+    Float64Host u = { .s = float64_val(a) };
+    return u.h;
+}
+
+static inline float64 float64_from_host(double h)
+{
+    Float64Host u = { .h = h };
+    return make_float64(u.s);
+}
+
+/* A zero result may hide an underflow, so only strictly normal results
+ * are taken; exact zeros just go the slow way.
+ */
+static inline bool float32_hard_result_ok(float r)
+{
+    float ar = fabsf(r);
+    return likely(ar > FLT_MIN && ar <= FLT_MAX);
+}
+
+static inline bool float64_hard_result_ok(double r)
+{
+    double ar = fabs(r);
+    return likely(ar > DBL_MIN && ar <= DBL_MAX);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the single-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
@@ -2170,6 +2274,13 @@ float32 float32_add(float32 a, float32 b, float_status *status)
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
+    if (float32_hard_args_ok(a, b, status)) {
+        float r = float32_to_host(a) + float32_to_host(b);
+        if (float32_hard_result_ok(r)) {
+            return float32_from_host(r);
+        }
+    }
+
     aSign = extractFloat32Sign( a );
     bSign = extractFloat32Sign( b );
     if ( aSign == bSign ) {
@@ -2193,6 +2304,13 @@ float32 float32_sub(float32 a, float32 b, float_status *status)
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
+    if (float32_hard_args_ok(a, b, status)) {
+        float r = float32_to_host(a) - float32_to_host(b);
+        if (float32_hard_result_ok(r)) {
+            return float32_from_host(r);
+        }
+    }
+
     aSign = extractFloat32Sign( a );
     bSign = extractFloat32Sign( b );
     if ( aSign == bSign ) {
@@ -2221,6 +2339,13 @@ float32 float32_mul(float32 a, float32 b, float_status *status)
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
+    if (float32_hard_args_ok(a, b, status)) {
+        float r = float32_to_host(a) * float32_to_host(b);
+        if (float32_hard_result_ok(r)) {
+            return float32_from_host(r);
+        }
+    }
+
     aSig = extractFloat32Frac( a );
     aExp = extractFloat32Exp( a );
     aSign = extractFloat32Sign( a );
@@ -2283,6 +2408,13 @@ float32 float32_div(float32 a, float32 b, float_status *status)
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
+    if (float32_hard_args_ok(a, b, status)) {
+        float r = float32_to_host(a) / float32_to_host(b);
+        if (float32_hard_result_ok(r)) {
+            return float32_from_host(r);
+        }
+    }
+
     aSig = extractFloat32Frac( a );
     aExp = extractFloat32Exp( a );
     aSign = extractFloat32Sign( a );
@@ -2681,6 +2813,11 @@ float32 float32_sqrt(float32 a, float_status *status)
     uint64_t rem, term;
     a = float32_squash_input_denormal(a, status);
 
+    if (can_use_fpu(status) && !extractFloat32Sign(a) &&
+        extractFloat32Exp(a) != 0 && extractFloat32Exp(a) != 0xFF) {
+        return float32_from_host(sqrtf(float32_to_host(a)));
+    }
+
     aSig = extractFloat32Frac( a );
     aExp = extractFloat32Exp( a );
     aSign = extractFloat32Sign( a );
@@ -3961,6 +4098,13 @@ float64 float64_add(float64 a, float64 b, float_status *status)
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
+    if (float64_hard_args_ok(a, b, status)) {
+        double r = float64_to_host(a) + float64_to_host(b);
+        if (float64_hard_result_ok(r)) {
+            return float64_from_host(r);
+        }
+    }
+
     aSign = extractFloat64Sign( a );
     bSign = extractFloat64Sign( b );
     if ( aSign == bSign ) {
@@ -3984,6 +4128,13 @@ float64 float64_sub(float64 a, float64 b, float_status *status)
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
+    if (float64_hard_args_ok(a, b, status)) {
+        double r = float64_to_host(a) - float64_to_host(b);
+        if (float64_hard_result_ok(r)) {
+            return float64_from_host(r);
+        }
+    }
+
     aSign = extractFloat64Sign( a );
     bSign = extractFloat64Sign( b );
     if ( aSign == bSign ) {
@@ -4010,6 +4161,13 @@ float64 float64_mul(float64 a, float64 b, float_status *status)
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
+    if (float64_hard_args_ok(a, b, status)) {
+        double r = float64_to_host(a) * float64_to_host(b);
+        if (float64_hard_result_ok(r)) {
+            return float64_from_host(r);
+        }
+    }
+
     aSig = extractFloat64Frac( a );
     aExp = extractFloat64Exp( a );
     aSign = extractFloat64Sign( a );
@@ -4074,6 +4232,13 @@ float64 float64_div(float64 a, float64 b, float_status *status)
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
+    if (float64_hard_args_ok(a, b, status)) {
+        double r = float64_to_host(a) / float64_to_host(b);
+        if (float64_hard_result_ok(r)) {
+            return float64_from_host(r);
+        }
+    }
+
     aSig = extractFloat64Frac( a );
     aExp = extractFloat64Exp( a );
     aSign = extractFloat64Sign( a );
@@ -4485,6 +4650,11 @@ float64 float64_sqrt(float64 a, float_status *status)
     uint64_t rem0, rem1, term0, term1;
     a = float64_squash_input_denormal(a, status);
 
+    if (can_use_fpu(status) && !extractFloat64Sign(a) &&
+        extractFloat64Exp(a) != 0 && extractFloat64Exp(a) != 0x7FF) {
+        return float64_from_host(sqrt(float64_to_host(a)));
+    }
+
     aSig = extractFloat64Frac( a );
     aExp = extractFloat64Exp( a );
     aSign = extractFloat64Sign( a );
@@ -26,9 +26,11 @@
 #include "sysemu/char.h"
 #include "sysemu/sysemu.h"
 #include "exec/gdbstub.h"
+#include "exec/address-spaces.h"
 #endif
 
-#define MAX_PACKET_LENGTH 4096
+/* Large enough for gdb to move whole pages of memory in one packet */
+#define MAX_PACKET_LENGTH 16384
 
 #include "cpu.h"
 #include "qemu/sockets.h"
@@ -447,6 +449,23 @@ static void hextomem(uint8_t *mem, const char *buf, int len)
     }
 }
 
+/* Decode data sent with the escapes of the 'X' packet, return its length */
+static int xtomem(uint8_t *mem, const char *buf, int len)
+{
+    uint8_t *q = mem;
+    char c;
+
+    while (len-- > 0) {
+        c = *(buf++);
+        if (c == '}' && len > 0) {
+            c = *(buf++) ^ 0x20;
+            len--;
+        }
+        *(q++) = c;
+    }
+    return q - mem;
+}
+
 /* return -1 if error, 0 if OK */
 static int put_packet_binary(GDBState *s, const char *buf, int len)
 {
@@ -513,6 +532,108 @@ static int memtox(char *buf, const char *mem, int len)
     return p - buf;
 }
 
+/* Reply to a qXfer read of LEN bytes at ADDR in DATA.  */
+static void put_packet_xfer(GDBState *s, char *buf, const char *data,
+                            target_ulong total_len, target_ulong addr,
+                            target_ulong len)
+{
+    if (addr > total_len) {
+        put_packet(s, "E00");
+        return;
+    }
+    /* memtox() at most doubles the required space */
+    if (len > (MAX_PACKET_LENGTH - 5) / 2) {
+        len = (MAX_PACKET_LENGTH - 5) / 2;
+    }
+    if (len < total_len - addr) {
+        buf[0] = 'm';
+        len = memtox(buf + 1, data + addr, len);
+    } else {
+        buf[0] = 'l';
+        len = memtox(buf + 1, data + addr, total_len - addr);
+    }
+    put_packet_binary(s, buf, len + 1);
+}
+
+#ifndef CONFIG_USER_ONLY
+/* Highest address that gdb can name on this target */
+#define GDB_MEMORY_MAP_LAST ((uint64_t)(target_ulong)-1)
+
+typedef struct GDBMemoryMap {
+    MemoryListener listener;
+    GString *xml;
+    uint64_t next;
+} GDBMemoryMap;
+
+static void gdb_memory_map_add(GDBMemoryMap *map, const char *type,
+                               uint64_t start, uint64_t length)
+{
+    g_string_append_printf(map->xml,
+                           "<memory type=\"%s\" start=\"0x%" PRIx64
+                           "\" length=\"0x%" PRIx64 "\"/>",
+                           type, start, length);
+}
+
+static void gdb_memory_map_region_add(MemoryListener *listener,
+                                      MemoryRegionSection *section)
+{
+    GDBMemoryMap *map = container_of(listener, GDBMemoryMap, listener);
+    MemoryRegion *mr = section->mr;
+    uint64_t start = section->offset_within_address_space;
+    uint64_t last;
+    bool rom;
+
+    if (!memory_region_is_ram(mr) && !memory_region_is_romd(mr)) {
+        return;
+    }
+    if (start > GDB_MEMORY_MAP_LAST) {
+        return;
+    }
+    last = MIN(start + int128_get64(section->size) - 1, GDB_MEMORY_MAP_LAST);
+    rom = section->readonly || memory_region_is_rom(mr) ||
+          memory_region_is_romd(mr);
+
+    /* The map must not hide MMIO, so list the holes as plain RAM */
+    if (start > map->next) {
+        gdb_memory_map_add(map, "ram", map->next, start - map->next);
+    }
+    gdb_memory_map_add(map, rom ? "rom" : "ram", start, last - start + 1);
+    map->next = last + 1;
+}
+
+/*
+ * Build the target memory map from the RAM and ROM regions of the
+ * system address space.  gdb uses it to place hardware breakpoints in
+ * ROM and to avoid reading ahead into memory that does not exist.
+ * Returns NULL if there is no memory to describe.
+ */
+static GString *gdb_memory_map_xml(void)
+{
+    GDBMemoryMap map = {
+        .listener.region_add = gdb_memory_map_region_add,
+    };
+
+    map.xml = g_string_new("<?xml version=\"1.0\"?>"
+                           "<!DOCTYPE memory-map PUBLIC "
+                           "\"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\" "
+                           "\"http://sourceware.org/gdb/gdb-memory-map.dtd\">"
+                           "<memory-map>");
+    memory_listener_register(&map.listener, &address_space_memory);
+    memory_listener_unregister(&map.listener);
+
+    if (map.next == 0) {
+        g_string_free(map.xml, true);
+        return NULL;
+    }
+    if (map.next <= GDB_MEMORY_MAP_LAST) {
+        gdb_memory_map_add(&map, "ram", map.next,
+                           GDB_MEMORY_MAP_LAST - map.next + 1);
+    }
+    g_string_append(map.xml, "</memory-map>");
+    return map.xml;
+}
+#endif
+
 static const char *get_feature_xml(const char *p, const char **newp,
                                    CPUClass *cc)
 {
@@ -780,7 +901,7 @@ static int is_query_packet(const char *p, const char *query, char separator)
         (p[query_len] == '\0' || p[query_len] == separator);
 }
 
-static int gdb_handle_packet(GDBState *s, const char *line_buf)
+static int gdb_handle_packet(GDBState *s, const char *line_buf, int line_len)
 {
     CPUState *cpu;
     CPUClass *cc;
@@ -957,8 +1078,8 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             p++;
         len = strtoull(p, NULL, 16);
 
-        /* memtohex() doubles the required space */
-        if (len > MAX_PACKET_LENGTH / 2) {
+        /* memtohex() doubles the required space, plus the terminator */
+        if (len > (MAX_PACKET_LENGTH - 1) / 2) {
             put_packet (s, "E22");
             break;
         }
@@ -991,6 +1112,29 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             put_packet(s, "OK");
         }
         break;
+    case 'X':
+        /* Like 'M', but the data is binary, with '}' escapes */
+        addr = strtoull(p, (char **)&p, 16);
+        if (*p == ',')
+            p++;
+        len = strtoull(p, (char **)&p, 16);
+        if (*p != ':') {
+            put_packet(s, "E22");
+            break;
+        }
+        p++;
+        if (xtomem(mem_buf, p, line_buf + line_len - p) != len) {
+            put_packet(s, "E22");
+            break;
+        }
+        /* A zero length write is how gdb probes for 'X' support */
+        if (len && target_memory_rw_debug(s->g_cpu, addr, mem_buf, len,
+                                          true) != 0) {
+            put_packet(s, "E14");
+        } else {
+            put_packet(s, "OK");
+        }
+        break;
     case 'p':
         /* Older gdb are really dumb, and don't use 'g' if 'p' is avaialable.
            This works, but can be very slow.  Anything new enough to
@@ -1164,12 +1308,14 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             if (cc->gdb_core_xml_file != NULL) {
                 pstrcat(buf, sizeof(buf), ";qXfer:features:read+");
             }
+#ifndef CONFIG_USER_ONLY
+            pstrcat(buf, sizeof(buf), ";qXfer:memory-map:read+");
+#endif
             put_packet(s, buf);
             break;
         }
         if (strncmp(p, "Xfer:features:read:", 19) == 0) {
             const char *xml;
-            target_ulong total_len;
 
             cc = CPU_GET_CLASS(first_cpu);
             if (cc->gdb_core_xml_file == NULL) {
@@ -1192,24 +1338,29 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
                 p++;
             len = strtoul(p, (char **)&p, 16);
 
-            total_len = strlen(xml);
-            if (addr > total_len) {
-                snprintf(buf, sizeof(buf), "E00");
-                put_packet(s, buf);
+            put_packet_xfer(s, buf, xml, strlen(xml), addr, len);
+            break;
+        }
+#ifndef CONFIG_USER_ONLY
+        if (strncmp(p, "Xfer:memory-map:read::", 22) == 0) {
+            GString *xml = gdb_memory_map_xml();
+
+            if (!xml) {
+                put_packet(s, "E00");
                 break;
             }
-            if (len > (MAX_PACKET_LENGTH - 5) / 2)
-                len = (MAX_PACKET_LENGTH - 5) / 2;
-            if (len < total_len - addr) {
-                buf[0] = 'm';
-                len = memtox(buf + 1, xml + addr, len);
-            } else {
-                buf[0] = 'l';
-                len = memtox(buf + 1, xml + addr, total_len - addr);
+            p += 22;
+            addr = strtoul(p, (char **)&p, 16);
+            if (*p == ',') {
+                p++;
             }
-            put_packet_binary(s, buf, len + 1);
+            len = strtoul(p, (char **)&p, 16);
+
+            put_packet_xfer(s, buf, xml->str, xml->len, addr, len);
+            g_string_free(xml, true);
             break;
         }
+#endif
         if (is_query_packet(p, "Attached", ':')) {
             put_packet(s, GDB_ATTACHED);
             break;
@@ -1453,7 +1604,8 @@ static void gdb_read_byte(GDBState *s, int ch)
             } else {
                 reply = '+';
                 put_buffer(s, &reply, 1);
-                s->state = gdb_handle_packet(s, s->line_buf);
+                s->state = gdb_handle_packet(s, s->line_buf,
+                                             s->line_buf_index);
             }
             break;
         default:
@@ -294,7 +294,7 @@ STEXI
 changes status of a trace event
 ETEXI
 
-#if defined(CONFIG_TRACE_SIMPLE)
+#if defined(CONFIG_TRACE_SIMPLE) || defined(CONFIG_TRACE_RING)
     {
         .name       = "trace-file",
         .args_type  = "op:s?,arg:F?",
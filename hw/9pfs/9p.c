@@ -1618,13 +1618,11 @@ static int v9fs_xattr_read(V9fsState *s, V9fsPDU *pdu, V9fsFidState *fidp,
 static int v9fs_do_readdir_with_stat(V9fsPDU *pdu,
                                      V9fsFidState *fidp, uint32_t max_count)
 {
-    V9fsPath path;
     V9fsStat v9stat;
     int len, err = 0;
     int32_t count = 0;
-    struct stat stbuf;
     off_t saved_dir_pos;
-    struct dirent *dent, *result;
+    V9fsDirEnt *entries, *e;
 
     /* save the directory position */
     saved_dir_pos = v9fs_co_telldir(pdu, fidp);
@@ -1632,44 +1630,33 @@ static int v9fs_do_readdir_with_stat(V9fsPDU *pdu,
         return saved_dir_pos;
     }
 
-    dent = g_malloc(sizeof(struct dirent));
+    /*
+     * A 9P2000.u entry is larger than a 9P2000.L one, so this reads and
+     * stats at least all the entries that fit in the reply.
+     */
+    err = v9fs_co_readdir_many(pdu, fidp, &entries, max_count, true);
+    if (err < 0) {
+        goto out;
+    }
 
-    while (1) {
-        v9fs_path_init(&path);
-        err = v9fs_co_readdir_r(pdu, fidp, dent, &result);
-        if (err || !result) {
-            break;
-        }
-        err = v9fs_co_name_to_path(pdu, &fidp->path, dent->d_name, &path);
-        if (err < 0) {
-            goto out;
-        }
-        err = v9fs_co_lstat(pdu, &path, &stbuf);
-        if (err < 0) {
-            goto out;
-        }
-        err = stat_to_v9stat(pdu, &path, &stbuf, &v9stat);
+    for (e = entries; e; e = e->next) {
+        err = stat_to_v9stat(pdu, &e->path, e->st, &v9stat);
         if (err < 0) {
             goto out;
         }
         /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
         len = pdu_marshal(pdu, 11 + count, "S", &v9stat);
+        v9fs_stat_free(&v9stat);
         if ((len != (v9stat.size + 2)) || ((count + len) > max_count)) {
             /* Ran out of buffer. Set dir back to old position and return */
             v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_stat_free(&v9stat);
-            v9fs_path_free(&path);
-            g_free(dent);
-            return count;
+            break;
         }
         count += len;
-        v9fs_stat_free(&v9stat);
-        v9fs_path_free(&path);
-        saved_dir_pos = dent->d_off;
+        saved_dir_pos = e->dent->d_off;
     }
 out:
-    g_free(dent);
-    v9fs_path_free(&path);
+    v9fs_free_dirents(entries);
     if (err < 0) {
         return err;
     }
@@ -1786,13 +1773,13 @@ out_nofid:
     pdu_complete(pdu, err);
 }
 
-static size_t v9fs_readdir_data_size(V9fsString *name)
+size_t v9fs_readdir_data_size(const char *name)
 {
     /*
      * Size of each dirent on the wire: size of qid (13) + size of offset (8)
      * size of type (1) + size of name.size (2) + strlen(name.data)
      */
-    return 24 + v9fs_string_size(name);
+    return 24 + strlen(name);
 }
 
 static int v9fs_do_readdir(V9fsPDU *pdu,
@@ -1803,31 +1790,19 @@ static int v9fs_do_readdir(V9fsPDU *pdu,
     V9fsString name;
     int len, err = 0;
     int32_t count = 0;
-    off_t saved_dir_pos;
-    struct dirent *dent, *result;
+    struct dirent *dent;
+    V9fsDirEnt *entries, *e;
 
-    /* save the directory position */
-    saved_dir_pos = v9fs_co_telldir(pdu, fidp);
-    if (saved_dir_pos < 0) {
-        return saved_dir_pos;
+    /* Only the entries that fit in the reply are read */
+    err = v9fs_co_readdir_many(pdu, fidp, &entries, max_count, false);
+    if (err < 0) {
+        goto out;
     }
 
-    dent = g_malloc(sizeof(struct dirent));
-
-    while (1) {
-        err = v9fs_co_readdir_r(pdu, fidp, dent, &result);
-        if (err || !result) {
-            break;
-        }
+    for (e = entries; e; e = e->next) {
+        dent = e->dent;
         v9fs_string_init(&name);
         v9fs_string_sprintf(&name, "%s", dent->d_name);
-        if ((count + v9fs_readdir_data_size(&name)) > max_count) {
-            /* Ran out of buffer. Set dir back to old position and return */
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
-            return count;
-        }
         /*
          * Fill up just the path field of qid because the client uses
          * only that. To fill the entire qid structure we will have
@@ -1843,17 +1818,16 @@ static int v9fs_do_readdir(V9fsPDU *pdu,
         len = pdu_marshal(pdu, 11 + count, "Qqbs",
                           &qid, dent->d_off,
                           dent->d_type, &name);
+        v9fs_string_free(&name);
         if (len < 0) {
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
-            return len;
+            /* The next Treaddir seeks to its own offset anyway */
+            err = len;
+            goto out;
         }
         count += len;
-        v9fs_string_free(&name);
-        saved_dir_pos = dent->d_off;
     }
-    g_free(dent);
+out:
+    v9fs_free_dirents(entries);
     if (err < 0) {
         return err;
     }
@@ -201,6 +201,15 @@ struct V9fsFidState
     V9fsFidState *rclm_lst;
 };
 
+/* A directory entry returned by v9fs_co_readdir_many() */
+typedef struct V9fsDirEnt {
+    struct dirent *dent;
+    /* Only filled in when the entries were requested with their stat */
+    struct stat *st;
+    V9fsPath path;
+    struct V9fsDirEnt *next;
+} V9fsDirEnt;
+
 typedef struct V9fsState
 {
     QLIST_HEAD(, V9fsPDU) free_list;
@@ -312,6 +321,7 @@ extern void v9fs_path_free(V9fsPath *path);
 extern void v9fs_path_copy(V9fsPath *lhs, V9fsPath *rhs);
 extern int v9fs_name_to_path(V9fsState *s, V9fsPath *dirpath,
                              const char *name, V9fsPath *path);
+extern size_t v9fs_readdir_data_size(const char *name);
 extern int v9fs_device_realize_common(V9fsState *s, Error **errp);
 extern void v9fs_device_unrealize_common(V9fsState *s, Error **errp);
 
@@ -40,6 +40,98 @@ int v9fs_co_readdir_r(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent *dent,
     return err;
 }
 
+/*
+ * Read as many entries of @fidp as fit in @maxsize bytes of a 9P2000.L
+ * readdir reply, with a single trip to the worker threads.  With @dostat
+ * each entry is also lstat'ed there.  The directory is left positioned
+ * after the last returned entry.  Returns the number of entries or a
+ * negative errno; in both cases @entries must be freed with
+ * v9fs_free_dirents().
+ */
+int v9fs_co_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp,
+                         V9fsDirEnt **entries, int32_t maxsize, bool dostat)
+{
+    int err = 0;
+    int count = 0;
+    V9fsState *s = pdu->s;
+
+    *entries = NULL;
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    v9fs_path_read_lock(s);
+    v9fs_co_run_in_worker(
+        {
+            V9fsDirEnt **tail = entries;
+            struct dirent *dent, *result;
+            size_t size = 0;
+            off_t pos;
+
+            /*
+             * No break at this level, it would skip the switch back
+             * to the main thread in v9fs_co_run_in_worker().
+             */
+            pos = s->ops->telldir(&s->ctx, &fidp->fs);
+            if (pos < 0) {
+                err = -errno;
+            }
+            while (pos >= 0) {
+                V9fsDirEnt *e;
+
+                dent = g_malloc(sizeof(struct dirent));
+                errno = 0;
+                s->ops->readdir_r(&s->ctx, &fidp->fs, dent, &result);
+                if (!result) {
+                    err = errno ? -errno : 0;
+                    g_free(dent);
+                    break;
+                }
+                size += v9fs_readdir_data_size(dent->d_name);
+                if (size > (size_t)maxsize) {
+                    /* Leave this entry for the next request */
+                    s->ops->seekdir(&s->ctx, &fidp->fs, pos);
+                    g_free(dent);
+                    break;
+                }
+
+                e = g_new0(V9fsDirEnt, 1);
+                e->dent = dent;
+                v9fs_path_init(&e->path);
+                *tail = e;
+                tail = &e->next;
+                count++;
+
+                if (dostat) {
+                    e->st = g_new0(struct stat, 1);
+                    err = v9fs_name_to_path(s, &fidp->path, dent->d_name,
+                                            &e->path);
+                    if (!err && s->ops->lstat(&s->ctx, &e->path, e->st)) {
+                        err = -errno;
+                    }
+                    if (err < 0) {
+                        break;
+                    }
+                }
+                pos = dent->d_off;
+            }
+        });
+    v9fs_path_unlock(s);
+    return err < 0 ? err : count;
+}
+
+void v9fs_free_dirents(V9fsDirEnt *e)
+{
+    while (e) {
+        V9fsDirEnt *next = e->next;
+
+        g_free(e->dent);
+        g_free(e->st);
+        v9fs_path_free(&e->path);
+        g_free(e);
+        e = next;
+    }
+}
+
 off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     off_t err;
@@ -54,6 +54,9 @@ extern int v9fs_co_readdir_r(V9fsPDU *, V9fsFidState *,
 extern off_t v9fs_co_telldir(V9fsPDU *, V9fsFidState *);
 extern void v9fs_co_seekdir(V9fsPDU *, V9fsFidState *, off_t);
 extern void v9fs_co_rewinddir(V9fsPDU *, V9fsFidState *);
+extern int v9fs_co_readdir_many(V9fsPDU *, V9fsFidState *, V9fsDirEnt **,
+                                int32_t, bool);
+extern void v9fs_free_dirents(V9fsDirEnt *);
 extern int v9fs_co_statfs(V9fsPDU *, V9fsPath *, struct statfs *);
 extern int v9fs_co_lstat(V9fsPDU *, V9fsPath *, struct stat *);
 extern int v9fs_co_chmod(V9fsPDU *, V9fsPath *, mode_t);
@@ -18,6 +18,14 @@
  * Usage: add options:
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
+ *
+ * The drive property is optional and provides namespace 1.  More
+ * namespaces, each backed by its own drive, are added with:
+ *      -device nvme-ns,drive=<drive_id>,bus=<id>,nsid=<nsid[optional]>
+ *
+ * With iothread=<iothread_id> the I/O submission and completion queues
+ * are processed in the IOThread's AioContext; the admin queue always
+ * runs in the main loop.
  */
 
 #include "qemu/osdep.h"
@@ -28,10 +36,13 @@
 #include "sysemu/sysemu.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
+#include "qapi/error.h"
 
 #include "nvme.h"
 
 static void nvme_process_sq(void *opaque);
+static void nvme_post_cqes(void *opaque);
 
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
 {
@@ -57,14 +68,29 @@ static void nvme_inc_sq_head(NvmeSQueue *sq)
     sq->head = (sq->head + 1) % sq->size;
 }
 
+/* The head of a CQ and the tail of a SQ are written by the vCPU thread.  */
 static uint8_t nvme_cq_full(NvmeCQueue *cq)
 {
-    return (cq->tail + 1) % cq->size == cq->head;
+    return (cq->tail + 1) % cq->size == atomic_read(&cq->head);
 }
 
 static uint8_t nvme_sq_empty(NvmeSQueue *sq)
 {
-    return sq->head == sq->tail;
+    return sq->head == atomic_read(&sq->tail);
+}
+
+/* The admin queues always live in the main loop, I/O queues in n->ctx */
+static AioContext *nvme_queue_ctx(NvmeCtrl *n, uint16_t qid)
+{
+    return qid ? n->ctx : qemu_get_aio_context();
+}
+
+static NvmeNamespace *nvme_ns(NvmeCtrl *n, uint32_t nsid)
+{
+    if (nsid == 0 || nsid > n->num_namespaces) {
+        return NULL;
+    }
+    return n->namespaces[nsid - 1];
 }
 
 static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
@@ -78,6 +104,71 @@ static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+static void nvme_irq_bh(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    nvme_isr_notify(cq->ctrl, cq);
+}
+
+/*
+ * Interrupts are raised under the global mutex.  An IOThread cannot take
+ * it while holding its AioContext, so it defers the job to the main loop.
+ */
+static void nvme_cq_notify(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (qemu_mutex_iothread_locked()) {
+        nvme_isr_notify(n, cq);
+    } else {
+        qemu_bh_schedule(cq->irq_bh);
+    }
+}
+
+/*
+ * Shadow doorbells.  Once the host has set up the Doorbell Buffer Config,
+ * the values in the shadow doorbell buffer are authoritative for I/O
+ * queues, and the host only writes the MMIO doorbell when the new value
+ * crosses the EventIdx that the controller publishes.
+ */
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t tail;
+
+    pci_dma_read(&sq->ctrl->parent_obj, sq->db_addr, &tail, sizeof(tail));
+    tail = le32_to_cpu(tail);
+    if (tail < sq->size) {
+        atomic_set(&sq->tail, tail);
+    }
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    uint32_t ei = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&sq->ctrl->parent_obj, sq->ei_addr, &ei, sizeof(ei));
+    /* Order the EventIdx update before the next read of the shadow tail */
+    smp_mb();
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t head;
+
+    pci_dma_read(&cq->ctrl->parent_obj, cq->db_addr, &head, sizeof(head));
+    head = le32_to_cpu(head);
+    if (head < cq->size) {
+        atomic_set(&cq->head, head);
+    }
+}
+
+static void nvme_update_cq_eventidx(NvmeCQueue *cq)
+{
+    uint32_t ei = cpu_to_le32(cq->head);
+
+    pci_dma_write(&cq->ctrl->parent_obj, cq->ei_addr, &ei, sizeof(ei));
+    smp_mb();
+}
+
 static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     uint32_t len, NvmeCtrl *n)
 {
@@ -143,6 +234,154 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     return NVME_INVALID_FIELD | NVME_DNR;
 }
 
+/* Upper bound on the number of SGL segments, to stop looping chains */
+#define NVME_MAX_SGL_SEGMENTS 1024
+
+static uint16_t nvme_map_sgl(QEMUSGList *qsg, NvmeSglDescriptor *dptr,
+    uint32_t len, NvmeCtrl *n)
+{
+    NvmeSglDescriptor segment[256], desc = *dptr;
+    uint32_t nsgld, chunk, i;
+    uint64_t seg_addr;
+    uint16_t status;
+    bool last;
+    int nseg = 0;
+
+    pci_dma_sglist_init(qsg, &n->parent_obj, 1);
+
+    for (;;) {
+        switch (NVME_SGL_TYPE(desc.type)) {
+        case NVME_SGL_DESCR_TYPE_DATA_BLOCK:
+            /* A data block in the command is the only descriptor */
+            if (len && le32_to_cpu(desc.len)) {
+                uint32_t trans_len = MIN(len, le32_to_cpu(desc.len));
+                qemu_sglist_add(qsg, le64_to_cpu(desc.addr), trans_len);
+                len -= trans_len;
+            }
+            goto out;
+        case NVME_SGL_DESCR_TYPE_SEGMENT:
+        case NVME_SGL_DESCR_TYPE_LAST_SEGMENT:
+            break;
+        default:
+            status = NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+            goto unmap;
+        }
+
+        last = NVME_SGL_TYPE(desc.type) == NVME_SGL_DESCR_TYPE_LAST_SEGMENT;
+        seg_addr = le64_to_cpu(desc.addr);
+        nsgld = le32_to_cpu(desc.len) / sizeof(NvmeSglDescriptor);
+        if (!nsgld || le32_to_cpu(desc.len) % sizeof(NvmeSglDescriptor) ||
+            ++nseg > NVME_MAX_SGL_SEGMENTS) {
+            status = NVME_INVALID_SGL_SEG_DESCR | NVME_DNR;
+            goto unmap;
+        }
+
+        while (nsgld) {
+            chunk = MIN(nsgld, ARRAY_SIZE(segment));
+            pci_dma_read(&n->parent_obj, seg_addr, segment,
+                chunk * sizeof(NvmeSglDescriptor));
+            seg_addr += chunk * sizeof(NvmeSglDescriptor);
+            nsgld -= chunk;
+
+            for (i = 0; i < chunk; i++) {
+                desc = segment[i];
+
+                /* The last descriptor of a segment points to the next one */
+                if (!nsgld && i == chunk - 1 && !last) {
+                    break;
+                }
+                if (NVME_SGL_TYPE(desc.type) !=
+                    NVME_SGL_DESCR_TYPE_DATA_BLOCK) {
+                    status = NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+                    goto unmap;
+                }
+                if (len && le32_to_cpu(desc.len)) {
+                    uint32_t trans_len = MIN(len, le32_to_cpu(desc.len));
+                    qemu_sglist_add(qsg, le64_to_cpu(desc.addr), trans_len);
+                    len -= trans_len;
+                }
+            }
+        }
+        if (last) {
+            break;
+        }
+    }
+
+ out:
+    if (len) {
+        status = NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+        goto unmap;
+    }
+    return NVME_SUCCESS;
+
+ unmap:
+    qemu_sglist_destroy(qsg);
+    return status;
+}
+
+/* Map the data pointer of an I/O command, which is either PRPs or an SGL */
+static uint16_t nvme_map_dptr(QEMUSGList *qsg, NvmeCmd *cmd, uint32_t len,
+    NvmeCtrl *n)
+{
+    NvmeSglDescriptor sgl;
+
+    switch (NVME_CMD_FLAGS_PSDT(cmd->flags)) {
+    case NVME_PSDT_PRP:
+        return nvme_map_prp(qsg, le64_to_cpu(cmd->prp1),
+            le64_to_cpu(cmd->prp2), len, n);
+    case NVME_PSDT_SGL_MPTR_CONTIGUOUS:
+    case NVME_PSDT_SGL_MPTR_SGL:
+        QEMU_BUILD_BUG_ON(sizeof(sgl) != 2 * sizeof(cmd->prp1));
+        memcpy(&sgl, &cmd->prp1, sizeof(sgl));
+        return nvme_map_sgl(qsg, &sgl, len, n);
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+}
+
+static void nvme_unmap_iov(NvmeRequest *req, DMADirection dir, bool done)
+{
+    int i;
+
+    for (i = 0; i < req->iov.niov; i++) {
+        dma_memory_unmap(req->qsg.as, req->iov.iov[i].iov_base,
+                         req->iov.iov[i].iov_len, dir,
+                         done ? req->iov.iov[i].iov_len : 0);
+    }
+    qemu_iovec_destroy(&req->iov);
+}
+
+/*
+ * Map the whole request so that it can be submitted with a single call
+ * into the block layer.  This fails if part of the request is not RAM,
+ * in which case the caller goes through the bounce buffer in dma_blk_io.
+ */
+static bool nvme_map_iov(NvmeRequest *req, DMADirection dir)
+{
+    QEMUSGList *qsg = &req->qsg;
+    dma_addr_t base, len, cur_len;
+    void *mem;
+    int i;
+
+    qemu_iovec_init(&req->iov, qsg->nsg);
+    for (i = 0; i < qsg->nsg; i++) {
+        base = qsg->sg[i].base;
+        len = qsg->sg[i].len;
+        while (len) {
+            cur_len = len;
+            mem = dma_memory_map(qsg->as, base, &cur_len, dir);
+            if (!mem) {
+                nvme_unmap_iov(req, dir, false);
+                return false;
+            }
+            qemu_iovec_add(&req->iov, mem, cur_len);
+            base += cur_len;
+            len -= cur_len;
+        }
+    }
+    return true;
+}
+
 static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     uint64_t prp1, uint64_t prp2)
 {
@@ -164,6 +403,13 @@ static void nvme_post_cqes(void *opaque)
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
+    NvmeSQueue *sq;
+    bool posted = false;
+
+    if (cq->db_addr) {
+        nvme_update_cq_eventidx(cq);
+        nvme_update_cq_head(cq);
+    }
 
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
@@ -183,8 +429,20 @@ static void nvme_post_cqes(void *opaque)
         pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
             sizeof(req->cqe));
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        posted = true;
+    }
+
+    /* Submission queues may have stalled for lack of free requests */
+    if (posted) {
+        QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+            if (!nvme_sq_empty(sq)) {
+                qemu_bh_schedule(sq->bh);
+            }
+        }
+    }
+    if (cq->tail != atomic_read(&cq->head)) {
+        nvme_cq_notify(n, cq);
     }
-    nvme_isr_notify(n, cq);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -192,7 +450,7 @@ static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
     assert(cq->cqid == req->sq->cqid);
     QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
     QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
-    timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    qemu_bh_schedule(cq->bh);
 }
 
 static void nvme_rw_cb(void *opaque, int ret)
@@ -203,12 +461,16 @@ static void nvme_rw_cb(void *opaque, int ret)
     NvmeCQueue *cq = n->cq[sq->cqid];
 
     if (!ret) {
-        block_acct_done(blk_get_stats(n->conf.blk), &req->acct);
+        block_acct_done(blk_get_stats(req->ns->blk), &req->acct);
         req->status = NVME_SUCCESS;
     } else {
-        block_acct_failed(blk_get_stats(n->conf.blk), &req->acct);
+        block_acct_failed(blk_get_stats(req->ns->blk), &req->acct);
         req->status = NVME_INTERNAL_DEV_ERROR;
     }
+    if (req->has_iov) {
+        nvme_unmap_iov(req, req->is_write ? DMA_DIRECTION_TO_DEVICE :
+                                            DMA_DIRECTION_FROM_DEVICE, true);
+    }
     if (req->has_sg) {
         qemu_sglist_destroy(&req->qsg);
     }
@@ -219,9 +481,11 @@ static uint16_t nvme_flush(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     NvmeRequest *req)
 {
     req->has_sg = false;
-    block_acct_start(blk_get_stats(n->conf.blk), &req->acct, 0,
+    req->has_iov = false;
+    req->ns = ns;
+    block_acct_start(blk_get_stats(ns->blk), &req->acct, 0,
          BLOCK_ACCT_FLUSH);
-    req->aiocb = blk_aio_flush(n->conf.blk, nvme_rw_cb, req);
+    req->aiocb = blk_aio_flush(ns->blk, nvme_rw_cb, req);
 
     return NVME_NO_COMPLETE;
 }
@@ -230,10 +494,8 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     NvmeRequest *req)
 {
     NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
-    uint32_t nlb  = le32_to_cpu(rw->nlb) + 1;
+    uint32_t nlb  = le16_to_cpu(rw->nlb) + 1;
     uint64_t slba = le64_to_cpu(rw->slba);
-    uint64_t prp1 = le64_to_cpu(rw->prp1);
-    uint64_t prp2 = le64_to_cpu(rw->prp2);
 
     uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
     uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
@@ -241,54 +503,295 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     uint64_t aio_slba  = slba << (data_shift - BDRV_SECTOR_BITS);
     int is_write = rw->opcode == NVME_CMD_WRITE ? 1 : 0;
     enum BlockAcctType acct = is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ;
+    DMADirection dir = is_write ? DMA_DIRECTION_TO_DEVICE :
+                                  DMA_DIRECTION_FROM_DEVICE;
+    uint16_t status;
 
-    if ((slba + nlb) > ns->id_ns.nsze) {
-        block_acct_invalid(blk_get_stats(n->conf.blk), acct);
+    if ((slba + nlb) > le64_to_cpu(ns->id_ns.nsze)) {
+        block_acct_invalid(blk_get_stats(ns->blk), acct);
         return NVME_LBA_RANGE | NVME_DNR;
     }
 
-    if (nvme_map_prp(&req->qsg, prp1, prp2, data_size, n)) {
-        block_acct_invalid(blk_get_stats(n->conf.blk), acct);
-        return NVME_INVALID_FIELD | NVME_DNR;
+    status = nvme_map_dptr(&req->qsg, cmd, data_size, n);
+    if (status) {
+        block_acct_invalid(blk_get_stats(ns->blk), acct);
+        return status;
     }
 
     assert((nlb << data_shift) == req->qsg.size);
 
     req->has_sg = true;
-    dma_acct_start(n->conf.blk, &req->acct, &req->qsg, acct);
-    req->aiocb = is_write ?
-        dma_blk_write(n->conf.blk, &req->qsg, aio_slba, nvme_rw_cb, req) :
-        dma_blk_read(n->conf.blk, &req->qsg, aio_slba, nvme_rw_cb, req);
+    req->is_write = is_write;
+    req->ns = ns;
+    dma_acct_start(ns->blk, &req->acct, &req->qsg, acct);
+
+    req->has_iov = nvme_map_iov(req, dir);
+    if (req->has_iov) {
+        req->aiocb = is_write ?
+            blk_aio_writev(ns->blk, aio_slba, &req->iov, nlb <<
+                (data_shift - BDRV_SECTOR_BITS), nvme_rw_cb, req) :
+            blk_aio_readv(ns->blk, aio_slba, &req->iov, nlb <<
+                (data_shift - BDRV_SECTOR_BITS), nvme_rw_cb, req);
+    } else {
+        req->aiocb = is_write ?
+            dma_blk_write(ns->blk, &req->qsg, aio_slba, nvme_rw_cb, req) :
+            dma_blk_read(ns->blk, &req->qsg, aio_slba, nvme_rw_cb, req);
+    }
+
+    return NVME_NO_COMPLETE;
+}
+
+static uint16_t nvme_write_zeroes(NvmeCtrl *n, NvmeNamespace *ns,
+    NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
+    uint32_t nlb  = le16_to_cpu(rw->nlb) + 1;
+    uint64_t slba = le64_to_cpu(rw->slba);
+    uint16_t control = le16_to_cpu(rw->control);
+
+    uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+    uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
+    uint64_t aio_slba  = slba << (data_shift - BDRV_SECTOR_BITS);
+    int nb_sectors = nlb << (data_shift - BDRV_SECTOR_BITS);
+
+    if ((slba + nlb) > le64_to_cpu(ns->id_ns.nsze)) {
+        block_acct_invalid(blk_get_stats(ns->blk), BLOCK_ACCT_WRITE);
+        return NVME_LBA_RANGE | NVME_DNR;
+    }
+
+    req->has_sg = false;
+    req->has_iov = false;
+    req->ns = ns;
+    block_acct_start(blk_get_stats(ns->blk), &req->acct, 0,
+        BLOCK_ACCT_WRITE);
+    req->aiocb = blk_aio_write_zeroes(ns->blk, aio_slba, nb_sectors,
+        control & NVME_RW_DEAC ? BDRV_REQ_MAY_UNMAP : 0, nvme_rw_cb, req);
+
+    return NVME_NO_COMPLETE;
+}
+
+/* Deallocate the ranges of a DSM command one at a time */
+static void nvme_dsm_cb(void *opaque, int ret)
+{
+    NvmeRequest *req = opaque;
+    NvmeSQueue *sq = req->sq;
+    NvmeCtrl *n = sq->ctrl;
+    NvmeNamespace *ns = req->ns;
+    uint8_t data_shift;
+    NvmeDsmRange *range;
+
+    if (ret) {
+        req->status = NVME_INTERNAL_DEV_ERROR;
+    }
+
+    data_shift = ns->id_ns.lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds;
+    while (!ret && req->dsm_cur < req->dsm_nr) {
+        range = &req->dsm_ranges[req->dsm_cur++];
+        if (range->nlb) {
+            req->aiocb = blk_aio_discard(ns->blk,
+                le64_to_cpu(range->slba) << (data_shift - BDRV_SECTOR_BITS),
+                le32_to_cpu(range->nlb) << (data_shift - BDRV_SECTOR_BITS),
+                nvme_dsm_cb, req);
+            return;
+        }
+    }
+
+    g_free(req->dsm_ranges);
+    req->dsm_ranges = NULL;
+    nvme_enqueue_req_completion(n->cq[sq->cqid], req);
+}
+
+static uint16_t nvme_dsm(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+    NvmeRequest *req)
+{
+    NvmeDsmCmd *dsm = (NvmeDsmCmd *)cmd;
+    uint32_t nr = (le32_to_cpu(dsm->nr) & 0xff) + 1;
+    uint64_t nsze = le64_to_cpu(ns->id_ns.nsze);
+    NvmeDsmRange *ranges;
+    uint16_t status;
+    uint32_t i;
+
+    /* Only deallocation has an effect, the other attributes are hints */
+    if (!(le32_to_cpu(dsm->attributes) & NVME_DSMGMT_AD)) {
+        return NVME_SUCCESS;
+    }
+
+    status = nvme_map_dptr(&req->qsg, cmd, nr * sizeof(NvmeDsmRange), n);
+    if (status) {
+        return status;
+    }
+    ranges = g_new(NvmeDsmRange, nr);
+    if (dma_buf_read((uint8_t *)ranges, nr * sizeof(NvmeDsmRange),
+                     &req->qsg)) {
+        qemu_sglist_destroy(&req->qsg);
+        g_free(ranges);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    qemu_sglist_destroy(&req->qsg);
+
+    for (i = 0; i < nr; i++) {
+        uint64_t slba = le64_to_cpu(ranges[i].slba);
+        uint32_t nlb = le32_to_cpu(ranges[i].nlb);
+
+        if (slba + nlb > nsze || slba + nlb < slba) {
+            g_free(ranges);
+            return NVME_LBA_RANGE | NVME_DNR;
+        }
+    }
+
+    req->has_sg = false;
+    req->has_iov = false;
+    req->ns = ns;
+    req->status = NVME_SUCCESS;
+    req->dsm_ranges = ranges;
+    req->dsm_cur = 0;
+    req->dsm_nr = nr;
+    req->aiocb = NULL;
+    nvme_dsm_cb(req, 0);
 
     return NVME_NO_COMPLETE;
 }
 
 static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
-    NvmeNamespace *ns;
-    uint32_t nsid = le32_to_cpu(cmd->nsid);
+    NvmeNamespace *ns = nvme_ns(n, le32_to_cpu(cmd->nsid));
 
-    if (nsid == 0 || nsid > n->num_namespaces) {
+    if (!ns) {
         return NVME_INVALID_NSID | NVME_DNR;
     }
 
-    ns = &n->namespaces[nsid - 1];
     switch (cmd->opcode) {
     case NVME_CMD_FLUSH:
         return nvme_flush(n, ns, cmd, req);
     case NVME_CMD_WRITE:
     case NVME_CMD_READ:
         return nvme_rw(n, ns, cmd, req);
+    case NVME_CMD_WRITE_ZEROS:
+        return nvme_write_zeroes(n, ns, cmd, req);
+    case NVME_CMD_DSM:
+        return nvme_dsm(n, ns, cmd, req);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
 }
 
+/*
+ * With shadow doorbells the value written to the MMIO doorbell is not
+ * needed, so an IOThread can pick up doorbell writes through an ioeventfd
+ * without a trip through the vCPU thread.
+ */
+static hwaddr nvme_db_offset(uint16_t qid, bool cq)
+{
+    return 0x1000 + ((qid << 1) + cq) * 4;
+}
+
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+static bool nvme_sq_poll(void *opaque)
+{
+    EventNotifier *e = opaque;
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    nvme_update_sq_tail(sq);
+    if (nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list)) {
+        return false;
+    }
+    nvme_process_sq(sq);
+    return true;
+}
+
+static void nvme_cq_notifier(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_post_cqes(cq);
+    }
+}
+
+static void nvme_init_sq_ioeventfd(NvmeSQueue *sq)
+{
+    NvmeCtrl *n = sq->ctrl;
+
+    if (!n->iothread || sq->ioeventfd_enabled ||
+        event_notifier_init(&sq->notifier, 0)) {
+        return;
+    }
+    memory_region_add_eventfd(&n->iomem, nvme_db_offset(sq->sqid, false), 4,
+                              false, 0, &sq->notifier);
+    aio_set_event_notifier(n->ctx, &sq->notifier, true, nvme_sq_notifier);
+    aio_set_event_notifier_poll(n->ctx, &sq->notifier, nvme_sq_poll);
+    sq->ioeventfd_enabled = true;
+}
+
+static void nvme_init_cq_ioeventfd(NvmeCQueue *cq)
+{
+    NvmeCtrl *n = cq->ctrl;
+
+    if (!n->iothread || cq->ioeventfd_enabled ||
+        event_notifier_init(&cq->notifier, 0)) {
+        return;
+    }
+    memory_region_add_eventfd(&n->iomem, nvme_db_offset(cq->cqid, true), 4,
+                              false, 0, &cq->notifier);
+    aio_set_event_notifier(n->ctx, &cq->notifier, true, nvme_cq_notifier);
+    cq->ioeventfd_enabled = true;
+}
+
+static void nvme_cleanup_ioeventfd(NvmeCtrl *n, EventNotifier *e, hwaddr addr)
+{
+    aio_set_event_notifier(n->ctx, e, true, NULL);
+    memory_region_del_eventfd(&n->iomem, addr, 4, false, 0, e);
+    event_notifier_cleanup(e);
+}
+
+static void nvme_sq_set_dbbuf(NvmeSQueue *sq)
+{
+    NvmeCtrl *n = sq->ctrl;
+    uint32_t tail = cpu_to_le32(sq->tail);
+
+    /*
+     * Linux does not shadow the admin queue doorbells, so keep using the
+     * MMIO doorbells for it.
+     */
+    if (!sq->sqid) {
+        return;
+    }
+    sq->db_addr = n->dbbuf_dbs + nvme_db_offset(sq->sqid, false) - 0x1000;
+    sq->ei_addr = n->dbbuf_eis + nvme_db_offset(sq->sqid, false) - 0x1000;
+    pci_dma_write(&n->parent_obj, sq->db_addr, &tail, sizeof(tail));
+    nvme_init_sq_ioeventfd(sq);
+}
+
+static void nvme_cq_set_dbbuf(NvmeCQueue *cq)
+{
+    NvmeCtrl *n = cq->ctrl;
+    uint32_t head = cpu_to_le32(cq->head);
+
+    if (!cq->cqid) {
+        return;
+    }
+    cq->db_addr = n->dbbuf_dbs + nvme_db_offset(cq->cqid, true) - 0x1000;
+    cq->ei_addr = n->dbbuf_eis + nvme_db_offset(cq->cqid, true) - 0x1000;
+    pci_dma_write(&n->parent_obj, cq->db_addr, &head, sizeof(head));
+    nvme_init_cq_ioeventfd(cq);
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     n->sq[sq->sqid] = NULL;
-    timer_del(sq->timer);
-    timer_free(sq->timer);
+    if (sq->ioeventfd_enabled) {
+        nvme_cleanup_ioeventfd(n, &sq->notifier,
+                               nvme_db_offset(sq->sqid, false));
+    }
+    qemu_bh_delete(sq->bh);
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
@@ -350,7 +853,10 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    sq->bh = aio_bh_new(nvme_queue_ctx(n, sqid), nvme_process_sq, sq);
+    if (n->dbbuf_enabled) {
+        nvme_sq_set_dbbuf(sq);
+    }
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
@@ -392,8 +898,12 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     n->cq[cq->cqid] = NULL;
-    timer_del(cq->timer);
-    timer_free(cq->timer);
+    if (cq->ioeventfd_enabled) {
+        nvme_cleanup_ioeventfd(n, &cq->notifier,
+                               nvme_db_offset(cq->cqid, true));
+    }
+    qemu_bh_delete(cq->bh);
+    qemu_bh_delete(cq->irq_bh);
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -433,7 +943,11 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    cq->bh = aio_bh_new(nvme_queue_ctx(n, cqid), nvme_post_cqes, cq);
+    cq->irq_bh = qemu_bh_new(nvme_irq_bh, cq);
+    if (n->dbbuf_enabled) {
+        nvme_cq_set_dbbuf(cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -468,36 +982,102 @@ static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
     return NVME_SUCCESS;
 }
 
-static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd)
+static uint16_t nvme_identify_ns(NvmeCtrl *n, uint32_t nsid, uint64_t prp1,
+    uint64_t prp2)
 {
+    static const NvmeIdNs inactive;
     NvmeNamespace *ns;
+
+    if (nsid == 0 || nsid > n->num_namespaces) {
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+
+    /* Inactive namespaces return a zero filled data structure */
+    ns = nvme_ns(n, nsid);
+    return nvme_dma_read_prp(n, (uint8_t *)(ns ? &ns->id_ns : &inactive),
+        sizeof(NvmeIdNs), prp1, prp2);
+}
+
+static uint16_t nvme_identify_ns_list(NvmeCtrl *n, uint32_t nsid,
+    uint64_t prp1, uint64_t prp2)
+{
+    uint32_t list[1024] = { 0 };
+    uint32_t i, j = 0;
+
+    if (nsid >= 0xfffffffe) {
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+
+    for (i = nsid; i < n->num_namespaces && j < ARRAY_SIZE(list); i++) {
+        if (n->namespaces[i]) {
+            list[j++] = cpu_to_le32(i + 1);
+        }
+    }
+    return nvme_dma_read_prp(n, (uint8_t *)list, sizeof(list), prp1, prp2);
+}
+
+static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd)
+{
     NvmeIdentify *c = (NvmeIdentify *)cmd;
     uint32_t cns  = le32_to_cpu(c->cns);
     uint32_t nsid = le32_to_cpu(c->nsid);
     uint64_t prp1 = le64_to_cpu(c->prp1);
     uint64_t prp2 = le64_to_cpu(c->prp2);
 
-    if (cns) {
+    switch (cns) {
+    case NVME_ID_CNS_NS:
+        return nvme_identify_ns(n, nsid, prp1, prp2);
+    case NVME_ID_CNS_CTRL:
         return nvme_dma_read_prp(n, (uint8_t *)&n->id_ctrl, sizeof(n->id_ctrl),
             prp1, prp2);
+    case NVME_ID_CNS_NS_ACTIVE_LIST:
+        return nvme_identify_ns_list(n, nsid, prp1, prp2);
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
     }
-    if (nsid == 0 || nsid > n->num_namespaces) {
-        return NVME_INVALID_NSID | NVME_DNR;
+}
+
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    /* Both buffers are a single memory page */
+    if (!dbs_addr || !eis_addr ||
+        dbs_addr & (n->page_size - 1) || eis_addr & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
     }
 
-    ns = &n->namespaces[nsid - 1];
-    return nvme_dma_read_prp(n, (uint8_t *)&ns->id_ns, sizeof(ns->id_ns),
-        prp1, prp2);
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i]) {
+            nvme_sq_set_dbbuf(n->sq[i]);
+        }
+        if (n->cq[i]) {
+            nvme_cq_set_dbbuf(n->cq[i]);
+        }
+    }
+    return NVME_SUCCESS;
 }
 
 static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     uint32_t dw10 = le32_to_cpu(cmd->cdw10);
-    uint32_t result;
+    uint32_t result = 0;
+    int i;
 
     switch (dw10) {
     case NVME_VOLATILE_WRITE_CACHE:
-        result = blk_enable_write_cache(n->conf.blk);
+        for (i = 0; i < n->num_namespaces; i++) {
+            if (n->namespaces[i]) {
+                result = blk_enable_write_cache(n->namespaces[i]->blk);
+                break;
+            }
+        }
         break;
     case NVME_NUMBER_OF_QUEUES:
         result = cpu_to_le32((n->num_queues - 1) | ((n->num_queues - 1) << 16));
@@ -514,10 +1094,15 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     uint32_t dw10 = le32_to_cpu(cmd->cdw10);
     uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+    int i;
 
     switch (dw10) {
     case NVME_VOLATILE_WRITE_CACHE:
-        blk_set_enable_write_cache(n->conf.blk, dw11 & 1);
+        for (i = 0; i < n->num_namespaces; i++) {
+            if (n->namespaces[i]) {
+                blk_set_enable_write_cache(n->namespaces[i]->blk, dw11 & 1);
+            }
+        }
         break;
     case NVME_NUMBER_OF_QUEUES:
         req->cqe.result =
@@ -529,7 +1114,8 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
-static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+static uint16_t nvme_do_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd,
+    NvmeRequest *req)
 {
     switch (cmd->opcode) {
     case NVME_ADM_CMD_DELETE_SQ:
@@ -546,11 +1132,24 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
 }
 
+/* Admin commands run in the main loop but may touch the I/O queues */
+static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    uint16_t status;
+
+    aio_context_acquire(n->ctx);
+    status = nvme_do_admin_cmd(n, cmd, req);
+    aio_context_release(n->ctx);
+    return status;
+}
+
 static void nvme_process_sq(void *opaque)
 {
     NvmeSQueue *sq = opaque;
@@ -562,6 +1161,10 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    if (sq->db_addr) {
+        nvme_update_sq_tail(sq);
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
         pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
@@ -579,13 +1182,29 @@ static void nvme_process_sq(void *opaque)
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+
+        if (sq->db_addr) {
+            nvme_update_sq_eventidx(sq);
+            nvme_update_sq_tail(sq);
+        }
     }
 }
 
 static void nvme_clear_ctrl(NvmeCtrl *n)
 {
+    NvmeNamespace *ns;
     int i;
 
+    aio_context_acquire(n->ctx);
+
+    /* Complete the outstanding requests before freeing the queues */
+    for (i = 0; i < n->num_namespaces; i++) {
+        ns = n->namespaces[i];
+        if (ns) {
+            blk_drain(ns->blk);
+        }
+    }
+
     for (i = 0; i < n->num_queues; i++) {
         if (n->sq[i] != NULL) {
             nvme_free_sq(n->sq[i], n);
@@ -596,8 +1215,18 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
             nvme_free_cq(n->cq[i], n);
         }
     }
+    n->dbbuf_enabled = false;
 
-    blk_flush(n->conf.blk);
+    /* Flush and switch the namespaces back to the QEMU main loop */
+    for (i = 0; i < n->num_namespaces; i++) {
+        ns = n->namespaces[i];
+        if (ns) {
+            blk_flush(ns->blk);
+            blk_set_aio_context(ns->blk, qemu_get_aio_context());
+        }
+    }
+
+    aio_context_release(n->ctx);
     n->bar.cc = 0;
 }
 
@@ -605,6 +1234,7 @@ static int nvme_start_ctrl(NvmeCtrl *n)
 {
     uint32_t page_bits = NVME_CC_MPS(n->bar.cc) + 12;
     uint32_t page_size = 1 << page_bits;
+    int i;
 
     if (n->cq[0] || n->sq[0] || !n->bar.asq || !n->bar.acq ||
             n->bar.asq & (page_size - 1) || n->bar.acq & (page_size - 1) ||
@@ -628,6 +1258,11 @@ static int nvme_start_ctrl(NvmeCtrl *n)
     nvme_init_sq(&n->admin_sq, n, n->bar.asq, 0, 0,
         NVME_AQA_ASQS(n->bar.aqa) + 1);
 
+    for (i = 0; i < n->num_namespaces; i++) {
+        if (n->namespaces[i]) {
+            blk_set_aio_context(n->namespaces[i]->blk, n->ctx);
+        }
+    }
     return 0;
 }
 
@@ -713,7 +1348,6 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 
     if (((addr - 0x1000) >> 2) & 1) {
         uint16_t new_head = val & 0xffff;
-        int start_sqs;
         NvmeCQueue *cq;
 
         qid = (addr - (0x1000 + (1 << 2))) >> 3;
@@ -726,19 +1360,16 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             return;
         }
 
-        start_sqs = nvme_cq_full(cq) ? 1 : 0;
-        cq->head = new_head;
-        if (start_sqs) {
-            NvmeSQueue *sq;
-            QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
-            }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
-        }
-
-        if (cq->tail != cq->head) {
-            nvme_isr_notify(n, cq);
+        /*
+         * The queue is serviced in its own AioContext, which posts the
+         * pending completions, restarts the submission queues and raises
+         * the interrupt again if entries are left.  With shadow doorbells
+         * it reads the head from the shadow buffer instead.
+         */
+        if (!cq->db_addr) {
+            atomic_set(&cq->head, new_head);
         }
+        qemu_bh_schedule(cq->bh);
     } else {
         uint16_t new_tail = val & 0xffff;
         NvmeSQueue *sq;
@@ -753,8 +1384,10 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             return;
         }
 
-        sq->tail = new_tail;
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        if (!sq->db_addr) {
+            atomic_set(&sq->tail, new_tail);
+        }
+        qemu_bh_schedule(sq->bh);
     }
 }
 
@@ -779,29 +1412,79 @@ static const MemoryRegionOps nvme_mmio_ops = {
     },
 };
 
-static int nvme_init(PCIDevice *pci_dev)
+static int nvme_ns_init(NvmeCtrl *n, NvmeNamespace *ns, BlockConf *conf,
+    Error **errp)
 {
-    NvmeCtrl *n = NVME(pci_dev);
-    NvmeIdCtrl *id = &n->id_ctrl;
-
-    int i;
+    NvmeIdNs *id_ns = &ns->id_ns;
     int64_t bs_size;
-    uint8_t *pci_conf;
+    uint32_t nsid = ns->nsid;
 
-    if (!n->conf.blk) {
+    if (!conf->blk) {
+        error_setg(errp, "drive property not set");
         return -1;
     }
-
-    bs_size = blk_getlength(n->conf.blk);
+    bs_size = blk_getlength(conf->blk);
     if (bs_size < 0) {
+        error_setg_errno(errp, -bs_size, "could not get drive size");
         return -1;
     }
 
-    blkconf_serial(&n->conf, &n->serial);
+    if (!nsid) {
+        for (nsid = 1; nsid <= n->num_namespaces; nsid++) {
+            if (!nvme_ns(n, nsid)) {
+                break;
+            }
+        }
+    }
+    if (nsid > n->num_namespaces) {
+        error_setg(errp, "invalid namespace id (must be 1..%u)",
+                   n->num_namespaces);
+        return -1;
+    }
+    if (nvme_ns(n, nsid)) {
+        error_setg(errp, "namespace id %u is already in use", nsid);
+        return -1;
+    }
+
+    blkconf_blocksizes(conf);
+    ns->blk = conf->blk;
+    ns->nsid = nsid;
+    id_ns->nsfeat = 0;
+    id_ns->nlbaf = 0;
+    id_ns->flbas = 0;
+    id_ns->mc = 0;
+    id_ns->dpc = 0;
+    id_ns->dps = 0;
+    id_ns->lbaf[0].ds = ctz32(conf->logical_block_size);
+    id_ns->ncap  = id_ns->nuse = id_ns->nsze =
+        cpu_to_le64(bs_size >>
+            id_ns->lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds);
+
+    n->namespaces[nsid - 1] = ns;
+    if (nsid > le32_to_cpu(n->id_ctrl.nn)) {
+        n->id_ctrl.nn = cpu_to_le32(nsid);
+    }
+    if (blk_enable_write_cache(ns->blk)) {
+        n->id_ctrl.vwc = 1;
+    }
+    return 0;
+}
+
+static int nvme_init(PCIDevice *pci_dev)
+{
+    NvmeCtrl *n = NVME(pci_dev);
+    NvmeIdCtrl *id = &n->id_ctrl;
+    DeviceState *dev = DEVICE(pci_dev);
+    Error *local_err = NULL;
+
+    uint8_t *pci_conf;
+
+    if (n->conf.blk) {
+        blkconf_serial(&n->conf, &n->serial);
+    }
     if (!n->serial) {
         return -1;
     }
-    blkconf_blocksizes(&n->conf);
 
     pci_conf = pci_dev->config;
     pci_conf[PCI_INTERRUPT_PIN] = 1;
@@ -809,15 +1492,18 @@ static int nvme_init(PCIDevice *pci_dev)
     pci_config_set_class(pci_dev->config, PCI_CLASS_STORAGE_EXPRESS);
     pcie_endpoint_cap_init(&n->parent_obj, 0x80);
 
-    n->num_namespaces = 1;
+    n->num_namespaces = NVME_MAX_NAMESPACES;
     n->num_queues = 64;
     n->reg_size = pow2ceil(0x1004 + 2 * (n->num_queues + 1) * 4);
-    n->ns_size = bs_size / (uint64_t)n->num_namespaces;
+    n->ctx = n->iothread ? iothread_get_aio_context(n->iothread) :
+                           qemu_get_aio_context();
 
-    n->namespaces = g_new0(NvmeNamespace, n->num_namespaces);
+    n->namespaces = g_new0(NvmeNamespace *, n->num_namespaces);
     n->sq = g_new0(NvmeSQueue *, n->num_queues);
     n->cq = g_new0(NvmeCQueue *, n->num_queues);
 
+    qbus_create_inplace(&n->bus, sizeof(n->bus), TYPE_NVME_BUS, dev, dev->id);
+
     memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n,
                           "nvme", n->reg_size);
     pci_register_bar(&n->parent_obj, 0,
@@ -834,18 +1520,17 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
     id->cqes = (0x4 << 4) | 0x4;
-    id->nn = cpu_to_le32(n->num_namespaces);
+    id->nn = cpu_to_le32(0);
+    id->oncs = cpu_to_le16(NVME_ONCS_WRITE_ZEROS | NVME_ONCS_DSM);
+    id->sgls = cpu_to_le32(NVME_SGLS_SUPPORTED);
     id->psd[0].mp = cpu_to_le16(0x9c4);
     id->psd[0].enlat = cpu_to_le32(0x10);
     id->psd[0].exlat = cpu_to_le32(0x4);
-    if (blk_enable_write_cache(n->conf.blk)) {
-        id->vwc = 1;
-    }
 
     n->bar.cap = 0;
     NVME_CAP_SET_MQES(n->bar.cap, 0x7ff);
@@ -858,19 +1543,13 @@ static int nvme_init(PCIDevice *pci_dev)
     n->bar.vs = 0x00010100;
     n->bar.intmc = n->bar.intms = 0;
 
-    for (i = 0; i < n->num_namespaces; i++) {
-        NvmeNamespace *ns = &n->namespaces[i];
-        NvmeIdNs *id_ns = &ns->id_ns;
-        id_ns->nsfeat = 0;
-        id_ns->nlbaf = 0;
-        id_ns->flbas = 0;
-        id_ns->mc = 0;
-        id_ns->dpc = 0;
-        id_ns->dps = 0;
-        id_ns->lbaf[0].ds = BDRV_SECTOR_BITS;
-        id_ns->ncap  = id_ns->nuse = id_ns->nsze =
-            cpu_to_le64(n->ns_size >>
-                id_ns->lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds);
+    /* The drive property of the controller provides namespace 1 */
+    if (n->conf.blk) {
+        n->ns.nsid = 1;
+        if (nvme_ns_init(n, &n->ns, &n->conf, &local_err)) {
+            error_report_err(local_err);
+            return -1;
+        }
     }
     return 0;
 }
@@ -886,6 +1565,53 @@ static void nvme_exit(PCIDevice *pci_dev)
     msix_uninit_exclusive_bar(pci_dev);
 }
 
+static void nvme_ns_realize(DeviceState *dev, Error **errp)
+{
+    NvmeNsDevice *s = NVME_NS(dev);
+    NvmeCtrl *n = NVME(qdev_get_parent_bus(dev)->parent);
+
+    nvme_ns_init(n, &s->ns, &s->conf, errp);
+}
+
+static void nvme_ns_unrealize(DeviceState *dev, Error **errp)
+{
+    NvmeNsDevice *s = NVME_NS(dev);
+    NvmeCtrl *n = NVME(qdev_get_parent_bus(dev)->parent);
+
+    n->namespaces[s->ns.nsid - 1] = NULL;
+}
+
+static Property nvme_ns_props[] = {
+    DEFINE_BLOCK_PROPERTIES(NvmeNsDevice, conf),
+    DEFINE_PROP_UINT32("nsid", NvmeNsDevice, ns.nsid, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nvme_ns_class_init(ObjectClass *oc, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(oc);
+
+    dc->bus_type = TYPE_NVME_BUS;
+    dc->realize = nvme_ns_realize;
+    dc->unrealize = nvme_ns_unrealize;
+    set_bit(DEVICE_CATEGORY_STORAGE, dc->categories);
+    dc->desc = "NVMe namespace";
+    dc->props = nvme_ns_props;
+}
+
+static const TypeInfo nvme_ns_info = {
+    .name          = TYPE_NVME_NS,
+    .parent        = TYPE_DEVICE,
+    .instance_size = sizeof(NvmeNsDevice),
+    .class_init    = nvme_ns_class_init,
+};
+
+static const TypeInfo nvme_bus_info = {
+    .name          = TYPE_NVME_BUS,
+    .parent        = TYPE_BUS,
+    .instance_size = sizeof(NvmeBus),
+};
+
 static Property nvme_props[] = {
     DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
@@ -920,13 +1646,17 @@ static void nvme_instance_init(Object *obj)
 {
     NvmeCtrl *s = NVME(obj);
 
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&s->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
     device_add_bootindex_property(obj, &s->conf.bootindex,
                                   "bootindex", "/namespace@1,0",
                                   DEVICE(obj), &error_abort);
 }
 
 static const TypeInfo nvme_info = {
-    .name          = "nvme",
+    .name          = TYPE_NVME,
     .parent        = TYPE_PCI_DEVICE,
     .instance_size = sizeof(NvmeCtrl),
     .class_init    = nvme_class_init,
@@ -936,6 +1666,8 @@ static const TypeInfo nvme_info = {
 static void nvme_register_types(void)
 {
     type_register_static(&nvme_info);
+    type_register_static(&nvme_bus_info);
+    type_register_static(&nvme_ns_info);
 }
 
 type_init(nvme_register_types)
@@ -131,6 +131,123 @@ static void discard_vq_data(VirtQueue *vq, VirtIODevice *vdev)
     virtio_notify(vdev, vq);
 }
 
+/* Limits of the data handed at once to have_datav */
+#define VIRTIO_SERIAL_FLUSH_ELEMS   64
+#define VIRTIO_SERIAL_FLUSH_IOVS    256
+
+/* Move *idx and *offset forward by len bytes in sg */
+static void iov_advance(const struct iovec *sg, uint32_t *idx,
+                        uint64_t *offset, size_t len)
+{
+    while (len) {
+        size_t l = MIN(len, sg[*idx].iov_len - *offset);
+
+        *offset += l;
+        len -= l;
+        if (*offset == sg[*idx].iov_len) {
+            (*idx)++;
+            *offset = 0;
+        }
+    }
+}
+
+/*
+ * Hand the data of as many elements as possible to have_datav in one
+ * call, so that the backend can write them with a single system call.
+ * Elements that were popped but not consumed go back to the virtqueue,
+ * except for a partly consumed one that stays in port->elem as usual.
+ */
+static void do_flush_queued_data_batch(VirtIOSerialPort *port, VirtQueue *vq,
+                                       VirtIOSerialPortClass *vsc)
+{
+    VirtQueueElement *elems[VIRTIO_SERIAL_FLUSH_ELEMS];
+    struct iovec iov[VIRTIO_SERIAL_FLUSH_IOVS];
+    unsigned int nelems, niov, i, j;
+    size_t first_len, len;
+    bool first_whole;
+    ssize_t ret;
+
+    while (!port->throttled) {
+        if (!port->elem) {
+            port->elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+            if (!port->elem) {
+                break;
+            }
+            port->iov_idx = 0;
+            port->iov_offset = 0;
+        }
+
+        /* the rest of the element that was left off mid-way comes first */
+        niov = 0;
+        for (i = port->iov_idx; i < port->elem->out_num &&
+                                niov < VIRTIO_SERIAL_FLUSH_IOVS; i++) {
+            iov[niov] = port->elem->out_sg[i];
+            if (i == port->iov_idx) {
+                iov[niov].iov_base += port->iov_offset;
+                iov[niov].iov_len -= port->iov_offset;
+            }
+            niov++;
+        }
+        first_len = iov_size(iov, niov);
+        first_whole = i == port->elem->out_num;
+        elems[0] = port->elem;
+        nelems = 1;
+
+        while (first_whole && nelems < VIRTIO_SERIAL_FLUSH_ELEMS) {
+            VirtQueueElement *elem = virtqueue_pop(vq,
+                                                   sizeof(VirtQueueElement));
+
+            if (!elem) {
+                break;
+            }
+            if (niov + elem->out_num > VIRTIO_SERIAL_FLUSH_IOVS) {
+                virtqueue_discard(vq, elem, 0);
+                g_free(elem);
+                break;
+            }
+            memcpy(&iov[niov], elem->out_sg,
+                   elem->out_num * sizeof(struct iovec));
+            niov += elem->out_num;
+            elems[nelems++] = elem;
+        }
+
+        ret = vsc->have_datav(port, iov, niov);
+        if (!port->throttled) {
+            /* as with have_data, what was not written is dropped */
+            ret = iov_size(iov, niov);
+        } else if (ret < 0) {
+            ret = 0;
+        }
+
+        /* complete the elements that were consumed */
+        for (j = 0; j < nelems; j++) {
+            len = j ? iov_size(elems[j]->out_sg, elems[j]->out_num)
+                    : first_len;
+            if (ret < len || (j == 0 && !first_whole)) {
+                break;
+            }
+            ret -= len;
+            virtqueue_push(vq, elems[j], 0);
+            g_free(elems[j]);
+        }
+        port->elem = NULL;
+        if (j < nelems) {
+            /* give back the ones that were not started, in reverse order */
+            for (i = nelems - 1; i > j; i--) {
+                virtqueue_discard(vq, elems[i], 0);
+                g_free(elems[i]);
+            }
+            if (j) {
+                port->iov_idx = 0;
+                port->iov_offset = 0;
+            }
+            port->elem = elems[j];
+            iov_advance(port->elem->out_sg, &port->iov_idx, &port->iov_offset,
+                        ret);
+        }
+    }
+}
+
 static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
                                  VirtIODevice *vdev)
 {
@@ -141,6 +258,12 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
 
     vsc = VIRTIO_SERIAL_PORT_GET_CLASS(port);
 
+    if (vsc->have_datav) {
+        do_flush_queued_data_batch(port, vq, vsc);
+        virtio_notify(vdev, vq);
+        return;
+    }
+
     while (!port->throttled) {
         unsigned int i;
 
@@ -646,7 +769,7 @@ static void virtio_serial_save_device(VirtIODevice *vdev, QEMUFile *f)
         if (elem_popped) {
             qemu_put_be32s(f, &port->iov_idx);
             qemu_put_be64s(f, &port->iov_offset);
-            qemu_put_virtqueue_element(f, port->elem);
+            qemu_put_virtqueue_element(vdev, f, port->elem);
         }
     }
 }
@@ -722,7 +845,8 @@ static int fetch_active_ports_list(QEMUFile *f, int version_id,
                 qemu_get_be64s(f, &port->iov_offset);
 
                 port->elem =
-                    qemu_get_virtqueue_element(f, sizeof(VirtQueueElement));
+                    qemu_get_virtqueue_element(VIRTIO_DEVICE(s), f,
+                                               sizeof(VirtQueueElement));
 
                 /*
                  *  Port was throttled on source machine.  Let's
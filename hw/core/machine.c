@@ -95,6 +95,71 @@ static void machine_set_kvm_shadow_mem(Object *obj, Visitor *v,
     ms->kvm_shadow_mem = value;
 }
 
+static void machine_get_kvm_dirty_ring_size(Object *obj, Visitor *v,
+                                            const char *name, void *opaque,
+                                            Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+    uint32_t value = ms->kvm_dirty_ring_size;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void machine_set_kvm_dirty_ring_size(Object *obj, Visitor *v,
+                                            const char *name, void *opaque,
+                                            Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+    Error *error = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &error);
+    if (error) {
+        error_propagate(errp, error);
+        return;
+    }
+
+    if (value & (value - 1)) {
+        error_setg(errp, "kvm-dirty-ring-size must be a power of two");
+        return;
+    }
+
+    ms->kvm_dirty_ring_size = value;
+}
+
+static void machine_get_kvm_halt_poll_ns(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+    int64_t value = ms->kvm_halt_poll_ns;
+
+    visit_type_int(v, name, &value, errp);
+}
+
+static void machine_set_kvm_halt_poll_ns(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+    Error *error = NULL;
+    int64_t value;
+
+    visit_type_int(v, name, &value, &error);
+    if (error) {
+        error_propagate(errp, error);
+        return;
+    }
+
+    if (value < -1 || value > UINT32_MAX) {
+        error_setg(errp, "kvm-halt-poll-ns must be between 0 and %" PRIu32
+                   ", or -1 for the host default", UINT32_MAX);
+        return;
+    }
+
+    ms->kvm_halt_poll_ns = value;
+}
+
 static char *machine_get_kernel(Object *obj, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -378,6 +443,7 @@ static void machine_initfn(Object *obj)
 
     ms->kernel_irqchip_allowed = true;
     ms->kvm_shadow_mem = -1;
+    ms->kvm_halt_poll_ns = -1;
     ms->dump_guest_core = true;
     ms->mem_merge = true;
 
@@ -400,6 +466,22 @@ static void machine_initfn(Object *obj)
     object_property_set_description(obj, "kvm-shadow-mem",
                                     "KVM shadow MMU size",
                                     NULL);
+    object_property_add(obj, "kvm-dirty-ring-size", "uint32",
+                        machine_get_kvm_dirty_ring_size,
+                        machine_set_kvm_dirty_ring_size,
+                        NULL, NULL, NULL);
+    object_property_set_description(obj, "kvm-dirty-ring-size",
+                                    "Number of entries in the KVM dirty ring "
+                                    "of each vCPU (0 to use the dirty bitmap)",
+                                    NULL);
+    object_property_add(obj, "kvm-halt-poll-ns", "int",
+                        machine_get_kvm_halt_poll_ns,
+                        machine_set_kvm_halt_poll_ns,
+                        NULL, NULL, NULL);
+    object_property_set_description(obj, "kvm-halt-poll-ns",
+                                    "Longest time in ns that KVM polls a "
+                                    "halted vCPU (-1 for the host default)",
+                                    NULL);
     object_property_add_str(obj, "kernel",
                             machine_get_kernel, machine_set_kernel, NULL);
     object_property_set_description(obj, "kernel",
@@ -533,6 +615,16 @@ int machine_kvm_shadow_mem(MachineState *machine)
     return machine->kvm_shadow_mem;
 }
 
+uint32_t machine_kvm_dirty_ring_size(MachineState *machine)
+{
+    return machine->kvm_dirty_ring_size;
+}
+
+int64_t machine_kvm_halt_poll_ns(MachineState *machine)
+{
+    return machine->kvm_halt_poll_ns;
+}
+
 int machine_phandle_start(MachineState *machine)
 {
     return machine->phandle_start;
@@ -40,6 +40,8 @@
 int qdev_hotplug = 0;
 static bool qdev_hot_added = false;
 static bool qdev_hot_removed = false;
+/* Number of devices realized or unrealized after machine creation */
+static unsigned int qdev_hotplug_gen;
 
 const VMStateDescription *qdev_get_vmsd(DeviceState *dev)
 {
@@ -219,6 +221,20 @@ void device_listener_unregister(DeviceListener *listener)
     QTAILQ_REMOVE(&device_listeners, listener, link);
 }
 
+bool qdev_should_hide_device(QemuOpts *opts)
+{
+    DeviceListener *listener;
+
+    QTAILQ_FOREACH(listener, &device_listeners, link) {
+        if (listener->should_be_hidden &&
+            listener->should_be_hidden(listener, opts)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static void device_realize(DeviceState *dev, Error **errp)
 {
     DeviceClass *dc = DEVICE_GET_CLASS(dev);
@@ -390,6 +406,15 @@ bool qdev_machine_modified(void)
     return qdev_hot_added || qdev_hot_removed;
 }
 
+/*
+ * Returns a number that changes whenever a device is plugged or unplugged,
+ * so that state derived from the set of devices can tell when it is stale.
+ */
+unsigned int qdev_hotplug_generation(void)
+{
+    return qdev_hotplug_gen;
+}
+
 BusState *qdev_get_parent_bus(DeviceState *dev)
 {
     return dev->parent_bus;
@@ -1120,6 +1145,9 @@ static void device_set_realized(Object *obj, bool value, Error **errp)
         goto fail;
     }
 
+    if (qdev_hotplug && value != dev->realized) {
+        qdev_hotplug_gen++;
+    }
     dev->realized = value;
     return;
 
@@ -1423,6 +1423,33 @@ void vga_dirty_log_stop(VGACommonState *s)
     memory_region_set_log(&s->vram, false, DIRTY_MEMORY_VGA);
 }
 
+/*
+ * Return whether anything in the displayed part of VRAM may have changed
+ * since the last redraw.  Only linear layouts are checked precisely; CGA
+ * style addressing and split screens always report a change.
+ */
+static bool vga_scanout_dirty(VGACommonState *s, int height, int bwidth)
+{
+    ram_addr_t start = s->start_addr * 4;
+    ram_addr_t size;
+    int i;
+
+    for (i = 0; i < (height + 31) >> 5; i++) {
+        if (s->invalidated_y_table[i]) {
+            return true;
+        }
+    }
+
+    if ((s->cr[VGA_CRTC_MODE] & 3) != 3 || s->line_compare < height ||
+        height <= 0 || start >= s->vram_size) {
+        return true;
+    }
+
+    size = (ram_addr_t)(height - 1) * s->line_offset + bwidth;
+    size = MIN(size, s->vram_size - start);
+    return memory_region_get_dirty(&s->vram, start, size, DIRTY_MEMORY_VGA);
+}
+
 /*
  * graphic modes
  */
@@ -1598,6 +1625,11 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
 #endif
     addr1 = (s->start_addr * 4);
     bwidth = (width * bits + 7) / 8;
+
+    /* Idle screen: skip the per-scanline dirty checks altogether */
+    if (!full_update && !vga_scanout_dirty(s, height, bwidth)) {
+        return;
+    }
     y_start = -1;
     page_min = -1;
     page_max = 0;
@@ -2087,10 +2119,32 @@ const VMStateDescription vmstate_vga_common = {
     }
 };
 
+/*
+ * Stop dirty logging of VRAM while no display listener wants refreshes,
+ * and redraw everything once they do again.
+ */
+static void vga_update_interval(void *opaque, uint64_t interval)
+{
+    VGACommonState *s = opaque;
+    bool idle = interval == GUI_REFRESH_INTERVAL_OFF;
+
+    if (idle == s->display_idle) {
+        return;
+    }
+    s->display_idle = idle;
+    if (idle) {
+        vga_dirty_log_stop(s);
+    } else {
+        vga_dirty_log_start(s);
+        vga_invalidate_display(s);
+    }
+}
+
 static const GraphicHwOps vga_ops = {
     .invalidate  = vga_invalidate_display,
     .gfx_update  = vga_update_display,
     .text_update = vga_update_text,
+    .update_interval = vga_update_interval,
 };
 
 static inline uint32_t uint_clamp(uint32_t val, uint32_t vmin, uint32_t vmax)
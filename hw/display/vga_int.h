@@ -158,6 +158,8 @@ typedef struct VGACommonState {
     const GraphicHwOps *hw_ops;
     bool full_update_text;
     bool full_update_gfx;
+    /* No display listener refreshes, VRAM dirty logging is off */
+    bool display_idle;
     bool big_endian_fb;
     bool default_endian_fb;
     /* hardware mouse cursor support */
@@ -405,6 +405,11 @@ static void virtio_gpu_transfer_to_host_2d(VirtIOGPU *g,
         return;
     }
 
+    if (res->guest_backed) {
+        /* The image is the backing, there is nothing to copy */
+        return;
+    }
+
     format = pixman_image_get_format(res->image);
     bpp = (PIXMAN_FORMAT_BPP(format) + 7) / 8;
     stride = pixman_image_get_stride(res->image);
@@ -493,14 +498,46 @@ static void virtio_gpu_resource_flush(VirtIOGPU *g,
     pixman_region_fini(&flush_region);
 }
 
+/*
+ * Points the surface of a scanout at a rectangle of the resource image.
+ * The surface shares the pixels of the image, so flushes do not copy.
+ */
+static bool
+virtio_gpu_update_scanout_surface(VirtIOGPU *g, uint32_t scanout_id,
+                                  struct virtio_gpu_simple_resource *res,
+                                  uint32_t x, uint32_t y,
+                                  uint32_t width, uint32_t height)
+{
+    struct virtio_gpu_scanout *scanout = &g->scanout[scanout_id];
+    pixman_format_code_t format;
+    uint32_t offset;
+    int bpp;
+
+    format = pixman_image_get_format(res->image);
+    bpp = (PIXMAN_FORMAT_BPP(format) + 7) / 8;
+    offset = (x * bpp) + y * pixman_image_get_stride(res->image);
+    if (!scanout->ds || surface_data(scanout->ds)
+        != ((uint8_t *)pixman_image_get_data(res->image) + offset) ||
+        scanout->width != width ||
+        scanout->height != height) {
+        /* realloc the surface ptr */
+        scanout->ds = qemu_create_displaysurface_from
+            (width, height, format,
+             pixman_image_get_stride(res->image),
+             (uint8_t *)pixman_image_get_data(res->image) + offset);
+        if (!scanout->ds) {
+            return false;
+        }
+        dpy_gfx_replace_surface(scanout->con, scanout->ds);
+    }
+    return true;
+}
+
 static void virtio_gpu_set_scanout(VirtIOGPU *g,
                                    struct virtio_gpu_ctrl_command *cmd)
 {
     struct virtio_gpu_simple_resource *res;
     struct virtio_gpu_scanout *scanout;
-    pixman_format_code_t format;
-    uint32_t offset;
-    int bpp;
     struct virtio_gpu_set_scanout ss;
 
     VIRTIO_GPU_FILL_CMD(ss);
@@ -564,23 +601,10 @@ static void virtio_gpu_set_scanout(VirtIOGPU *g,
 
     scanout = &g->scanout[ss.scanout_id];
 
-    format = pixman_image_get_format(res->image);
-    bpp = (PIXMAN_FORMAT_BPP(format) + 7) / 8;
-    offset = (ss.r.x * bpp) + ss.r.y * pixman_image_get_stride(res->image);
-    if (!scanout->ds || surface_data(scanout->ds)
-        != ((uint8_t *)pixman_image_get_data(res->image) + offset) ||
-        scanout->width != ss.r.width ||
-        scanout->height != ss.r.height) {
-        /* realloc the surface ptr */
-        scanout->ds = qemu_create_displaysurface_from
-            (ss.r.width, ss.r.height, format,
-             pixman_image_get_stride(res->image),
-             (uint8_t *)pixman_image_get_data(res->image) + offset);
-        if (!scanout->ds) {
-            cmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-            return;
-        }
-        dpy_gfx_replace_surface(g->scanout[ss.scanout_id].con, scanout->ds);
+    if (!virtio_gpu_update_scanout_surface(g, ss.scanout_id, res, ss.r.x,
+                                           ss.r.y, ss.r.width, ss.r.height)) {
+        cmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+        return;
     }
 
     res->scanout_bitmask |= (1 << ss.scanout_id);
@@ -655,6 +679,102 @@ static void virtio_gpu_cleanup_mapping(struct virtio_gpu_simple_resource *res)
     res->iov_cnt = 0;
 }
 
+/* Switches the pixels of a resource to @image, and its scanouts with them */
+static void
+virtio_gpu_resource_set_image(VirtIOGPU *g,
+                              struct virtio_gpu_simple_resource *res,
+                              pixman_image_t *image)
+{
+    int i;
+
+    pixman_image_unref(res->image);
+    res->image = image;
+
+    for (i = 0; i < g->conf.max_outputs; i++) {
+        struct virtio_gpu_scanout *scanout = &g->scanout[i];
+
+        if (!(res->scanout_bitmask & (1 << i))) {
+            continue;
+        }
+        if (virtio_gpu_update_scanout_surface(g, i, res, scanout->x,
+                                              scanout->y, scanout->width,
+                                              scanout->height)) {
+            dpy_gfx_update(scanout->con, 0, 0,
+                           scanout->width, scanout->height);
+        }
+    }
+}
+
+/*
+ * Guests lay out the backing of a resource like the image, with no
+ * padding between the lines.  If the guest pages are also contiguous in
+ * our address space, which is the common case for a framebuffer that the
+ * guest allocated in one go, the image can wrap the backing directly.
+ * Transfers to the host are then free, and the scanout surfaces show the
+ * guest memory without any copy.
+ */
+static void
+virtio_gpu_resource_use_backing(VirtIOGPU *g,
+                                struct virtio_gpu_simple_resource *res)
+{
+    uint8_t *base = res->iov[0].iov_base;
+    size_t size = 0;
+    pixman_image_t *image;
+    int stride = pixman_image_get_stride(res->image);
+    unsigned int i;
+
+    if (!virtio_gpu_zero_copy_enabled(g->conf) ||
+        ((uintptr_t)base & (sizeof(uint32_t) - 1))) {
+        return;
+    }
+
+    for (i = 0; i < res->iov_cnt; i++) {
+        if (res->iov[i].iov_base != base + size) {
+            return;
+        }
+        size += res->iov[i].iov_len;
+    }
+    if (size < (size_t)stride * res->height) {
+        return;
+    }
+
+    image = pixman_image_create_bits(pixman_image_get_format(res->image),
+                                     res->width, res->height,
+                                     (uint32_t *)base, stride);
+    if (!image) {
+        return;
+    }
+    virtio_gpu_resource_set_image(g, res, image);
+    res->guest_backed = true;
+}
+
+/* Gives the resource pixels of its own again, before the backing goes */
+static void
+virtio_gpu_resource_drop_backing(VirtIOGPU *g,
+                                 struct virtio_gpu_simple_resource *res)
+{
+    pixman_image_t *image;
+
+    image = pixman_image_create_bits(pixman_image_get_format(res->image),
+                                     res->width, res->height, NULL, 0);
+    if (image) {
+        memcpy(pixman_image_get_data(image), pixman_image_get_data(res->image),
+               pixman_image_get_stride(image) * res->height);
+        virtio_gpu_resource_set_image(g, res, image);
+    } else {
+        /* Out of memory: at least stop showing the guest memory */
+        while (res->scanout_bitmask) {
+            int i = ctz32(res->scanout_bitmask);
+
+            res->scanout_bitmask &= ~(1 << i);
+            dpy_gfx_replace_surface(g->scanout[i].con, NULL);
+            g->scanout[i].ds = NULL;
+            g->scanout[i].resource_id = 0;
+        }
+    }
+    res->guest_backed = false;
+}
+
 static void
 virtio_gpu_resource_attach_backing(VirtIOGPU *g,
                                    struct virtio_gpu_ctrl_command *cmd)
@@ -681,6 +801,7 @@ virtio_gpu_resource_attach_backing(VirtIOGPU *g,
     }
 
     res->iov_cnt = ab.nr_entries;
+    virtio_gpu_resource_use_backing(g, res);
 }
 
 static void
@@ -700,6 +821,9 @@ virtio_gpu_resource_detach_backing(VirtIOGPU *g,
         cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
         return;
     }
+    if (res->guest_backed) {
+        virtio_gpu_resource_drop_backing(g, res);
+    }
     virtio_gpu_cleanup_mapping(res);
 }
 
@@ -1024,6 +1148,8 @@ static Property virtio_gpu_properties[] = {
                     VIRTIO_GPU_FLAG_VIRGL_ENABLED, true),
     DEFINE_PROP_BIT("stats", VirtIOGPU, conf.flags,
                     VIRTIO_GPU_FLAG_STATS_ENABLED, false),
+    DEFINE_PROP_BIT("zero-copy", VirtIOGPU, conf.flags,
+                    VIRTIO_GPU_FLAG_ZERO_COPY_ENABLED, true),
 #endif
     DEFINE_PROP_END_OF_LIST(),
 };
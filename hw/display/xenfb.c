@@ -756,6 +756,10 @@ static void xenfb_update_interval(void *opaque, uint64_t interval)
         if (xenfb_queue_full(xenfb)) {
             return;
         }
+        if (interval == GUI_REFRESH_INTERVAL_OFF) {
+            /* Nobody is watching, the frontend need not send updates */
+            interval = XENFB_NO_REFRESH;
+        }
         xenfb_send_refresh_period(xenfb, interval);
 #endif
     }
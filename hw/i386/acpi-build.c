@@ -2621,6 +2621,8 @@ struct AcpiBuildState {
     void *rsdp;
     MemoryRegion *rsdp_mr;
     MemoryRegion *linker_mr;
+    /* What the tables in RAM were built from, see acpi_build_key() */
+    GArray *key;
 } AcpiBuildState;
 
 static bool acpi_get_mcfg(AcpiMcfgInfo *mcfg)
@@ -2817,10 +2819,73 @@ static void acpi_ram_update(MemoryRegion *mr, GArray *data)
     memory_region_set_dirty(mr, 0, size);
 }
 
+static void acpi_build_key_add_bus(PCIBus *bus, void *opaque)
+{
+    GArray *key = opaque;
+    uint64_t val;
+    int devfn, i;
+
+    val = pci_bus_num(bus);
+    g_array_append_val(key, val);
+
+    for (devfn = 0; devfn < ARRAY_SIZE(bus->devices); devfn++) {
+        PCIDevice *dev = bus->devices[devfn];
+
+        if (!dev) {
+            continue;
+        }
+        val = devfn;
+        g_array_append_val(key, val);
+        for (i = 0; i < PCI_NUM_REGIONS; i++) {
+            g_array_append_val(key, dev->io_regions[i].addr);
+        }
+        if (PCI_DEVICE_GET_CLASS(dev)->is_bridge) {
+            /* Bus numbers and windows, up to PCI_IO_LIMIT_UPPER16 */
+            uint64_t cfg[3];
+
+            memcpy(cfg, dev->config + PCI_PRIMARY_BUS, sizeof(cfg));
+            g_array_append_vals(key, cfg, ARRAY_SIZE(cfg));
+        }
+    }
+}
+
+/*
+ * Besides the configuration, the tables depend on the plugged devices and
+ * on the PCI bus numbers and resources that the firmware assigns.  This
+ * collects all of that; as long as it does not change, the tables that
+ * were built last are still up to date.
+ */
+static GArray *acpi_build_key(void)
+{
+    GArray *key = g_array_new(false, false, sizeof(uint64_t));
+    PCIHostState *host = PCI_HOST_BRIDGE(acpi_get_i386_pci_host());
+    PcPciInfo pci;
+    uint64_t val;
+
+    val = qdev_hotplug_generation();
+    g_array_append_val(key, val);
+
+    acpi_get_pci_info(&pci);
+    g_array_append_vals(key, &pci.w32.begin, 1);
+    g_array_append_vals(key, &pci.w32.end, 1);
+    g_array_append_vals(key, &pci.w64.begin, 1);
+    g_array_append_vals(key, &pci.w64.end, 1);
+
+    pci_for_each_bus(host->bus, acpi_build_key_add_bus, key);
+    return key;
+}
+
+static bool acpi_build_key_equal(GArray *a, GArray *b)
+{
+    return a && b && a->len == b->len &&
+           !memcmp(a->data, b->data, a->len * sizeof(uint64_t));
+}
+
 static void acpi_build_update(void *build_opaque)
 {
     AcpiBuildState *build_state = build_opaque;
     AcpiBuildTables tables;
+    GArray *key;
 
     /* No state to update or already patched? Nothing to do. */
     if (!build_state || build_state->patched) {
@@ -2828,6 +2893,18 @@ static void acpi_build_update(void *build_opaque)
     }
     build_state->patched = 1;
 
+    /* Tables in RAM still up to date?  Then they need not be built again. */
+    key = acpi_build_key();
+    if (acpi_build_key_equal(key, build_state->key)) {
+        ACPI_BUILD_DPRINTF("Tables up to date, not rebuilding.\n");
+        g_array_free(key, true);
+        return;
+    }
+    if (build_state->key) {
+        g_array_free(build_state->key, true);
+    }
+    build_state->key = key;
+
     acpi_build_tables_init(&tables);
 
     acpi_build(&tables, MACHINE(qdev_get_machine()));
@@ -2858,10 +2935,23 @@ static MemoryRegion *acpi_add_rom_blob(AcpiBuildState *build_state,
                         name, acpi_build_update, build_state);
 }
 
+static int acpi_build_post_load(void *opaque, int version_id)
+{
+    AcpiBuildState *build_state = opaque;
+
+    /* The tables in RAM come from the source, always rebuild them */
+    if (build_state->key) {
+        g_array_free(build_state->key, true);
+        build_state->key = NULL;
+    }
+    return 0;
+}
+
 static const VMStateDescription vmstate_acpi_build = {
     .name = "acpi_build",
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = acpi_build_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_UINT8(patched, AcpiBuildState),
         VMSTATE_END_OF_LIST()
@@ -2895,6 +2985,7 @@ void acpi_setup(void)
     acpi_set_pci_info();
 
     acpi_build_tables_init(&tables);
+    build_state->key = acpi_build_key();
     acpi_build(&tables, MACHINE(pcms));
 
     /* Now expose it all to Guest */
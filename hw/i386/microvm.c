@@ -0,0 +1,525 @@
+/*
+ * microvm: a minimal x86 machine for short-lived guests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The machine has no PCI, no firmware and no legacy devices besides one
+ * serial port.  The kernel is booted directly in 32-bit protected mode,
+ * following the Linux boot protocol (Documentation/x86/boot.txt), and the
+ * devices sit on virtio-mmio transports that are passed to the kernel on
+ * its command line.  The interrupt controllers are emulated by KVM; the
+ * CPUs and the interrupt routing are described to the guest by an MP
+ * table, there is no ACPI.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+
+#include "hw/hw.h"
+#include "hw/loader.h"
+#include "hw/i386/pc.h"
+#include "hw/boards.h"
+#include "hw/sysbus.h"
+#include "hw/char/serial.h"
+#include "hw/kvm/clock.h"
+#include "sysemu/kvm.h"
+#include "sysemu/sysemu.h"
+#include "exec/address-spaces.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "cpu.h"
+
+#define TYPE_MICROVM_MACHINE   MACHINE_TYPE_NAME("microvm")
+#define MICROVM_MACHINE(obj) \
+    OBJECT_CHECK(MicrovmMachineState, (obj), TYPE_MICROVM_MACHINE)
+
+/* Guest memory layout */
+#define MICROVM_GDT_ADDR        0x500
+#define MICROVM_BOOT_PARAMS     0x7000
+#define MICROVM_CMDLINE_ADDR    0x20000
+#define MICROVM_MPTABLE_ADDR    0x9fc00     /* last KB of base memory */
+#define MICROVM_KERNEL_ADDR     0x100000
+#define MICROVM_MAX_LOWMEM      0xc0000000
+
+/* virtio-mmio transports, one per legacy IRQ that nothing else uses */
+#define MICROVM_MMIO_BASE       0xfeb00000
+#define MICROVM_MMIO_SIZE       0x200
+#define MICROVM_MMIO_NUM        8
+#define MICROVM_MMIO_IRQ_BASE   5
+
+/* Boot selectors that the kernel expects in its 32-bit entry point */
+#define MICROVM_BOOT_CS         0x10
+#define MICROVM_BOOT_DS         0x18
+
+/* Offsets in struct boot_params, see arch/x86/include/uapi/asm/bootparam.h */
+#define BP_E820_ENTRIES         0x1e8
+#define BP_SETUP_SECTS          0x1f1
+#define BP_JUMP                 0x200
+#define BP_HEADER_MAGIC         0x202
+#define BP_VERSION              0x206
+#define BP_TYPE_OF_LOADER       0x210
+#define BP_LOADFLAGS            0x211
+#define BP_RAMDISK_IMAGE        0x218
+#define BP_RAMDISK_SIZE         0x21c
+#define BP_CMD_LINE_PTR         0x228
+#define BP_INITRD_ADDR_MAX      0x22c
+#define BP_CMDLINE_SIZE         0x238
+#define BP_E820_TABLE           0x2d0
+#define BP_E820_MAX             128
+#define BP_SIZE                 0x1000
+
+#define LOADED_HIGH             0x01
+
+typedef struct MicrovmMachineState {
+    PCMachineState parent_obj;
+
+    /* Where the BSP starts, and where it finds the boot_params */
+    uint32_t entry;
+    uint32_t boot_params;
+} MicrovmMachineState;
+
+/*
+ * MP table, see the Intel MultiProcessor Specification 1.4.  It is the
+ * simplest way to describe the CPUs and the IOAPIC without firmware.
+ */
+typedef struct QEMU_PACKED MPFloatingPointer {
+    char signature[4];
+    uint32_t physptr;
+    uint8_t length;
+    uint8_t spec_rev;
+    uint8_t checksum;
+    uint8_t feature[5];
+} MPFloatingPointer;
+
+typedef struct QEMU_PACKED MPConfigTable {
+    char signature[4];
+    uint16_t length;
+    uint8_t spec_rev;
+    uint8_t checksum;
+    char oem_id[8];
+    char product_id[12];
+    uint32_t oem_table;
+    uint16_t oem_table_size;
+    uint16_t entry_count;
+    uint32_t lapic_addr;
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} MPConfigTable;
+
+typedef struct QEMU_PACKED MPProcessorEntry {
+    uint8_t type;
+    uint8_t apic_id;
+    uint8_t apic_version;
+    uint8_t flags;
+    uint32_t signature;
+    uint32_t features;
+    uint32_t reserved[2];
+} MPProcessorEntry;
+
+typedef struct QEMU_PACKED MPBusEntry {
+    uint8_t type;
+    uint8_t bus_id;
+    char bus_type[6];
+} MPBusEntry;
+
+typedef struct QEMU_PACKED MPIOAPICEntry {
+    uint8_t type;
+    uint8_t apic_id;
+    uint8_t apic_version;
+    uint8_t flags;
+    uint32_t addr;
+} MPIOAPICEntry;
+
+typedef struct QEMU_PACKED MPIntEntry {
+    uint8_t type;
+    uint8_t irq_type;
+    uint16_t irq_flags;
+    uint8_t src_bus;
+    uint8_t src_irq;
+    uint8_t dst_apic;
+    uint8_t dst_irq;
+} MPIntEntry;
+
+#define MP_PROCESSOR            0
+#define MP_BUS                  1
+#define MP_IOAPIC               2
+#define MP_INTSRC               3
+#define MP_LINTSRC              4
+
+#define MP_CPU_ENABLED          0x01
+#define MP_CPU_BSP              0x02
+
+#define MP_INT                  0
+#define MP_NMI                  1
+#define MP_EXTINT               3
+
+/* Active high, level triggered */
+#define MP_IRQ_LEVEL_HIGH       0x0d
+
+#define MP_IOAPIC_ID            0
+#define MP_ALL_LAPICS           0xff
+
+static uint8_t microvm_checksum(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    uint8_t sum = 0;
+
+    while (len--) {
+        sum += *p++;
+    }
+    return -sum;
+}
+
+static void microvm_add_int(GArray *table, uint8_t type, uint8_t irq_type,
+                            uint16_t irq_flags, uint8_t src_irq,
+                            uint8_t dst_apic, uint8_t dst_irq)
+{
+    MPIntEntry e = {
+        .type = type,
+        .irq_type = irq_type,
+        .irq_flags = cpu_to_le16(irq_flags),
+        .src_bus = 0,
+        .src_irq = src_irq,
+        .dst_apic = dst_apic,
+        .dst_irq = dst_irq,
+    };
+
+    g_array_append_vals(table, &e, sizeof(e));
+}
+
+static GArray *microvm_build_mptable(uint32_t addr)
+{
+    GArray *table = g_array_new(false, true, 1);
+    MPFloatingPointer *mpf;
+    MPConfigTable *mpc;
+    MPBusEntry bus = { .type = MP_BUS, .bus_type = "ISA   " };
+    MPIOAPICEntry ioapic = {
+        .type = MP_IOAPIC,
+        .apic_id = MP_IOAPIC_ID,
+        .apic_version = 0x11,
+        .flags = MP_CPU_ENABLED,
+        .addr = cpu_to_le32(IO_APIC_DEFAULT_ADDRESS),
+    };
+    CPUState *cs;
+    int entries = 0, irq;
+
+    g_array_set_size(table, sizeof(*mpf) + sizeof(*mpc));
+
+    CPU_FOREACH(cs) {
+        X86CPU *cpu = X86_CPU(cs);
+        MPProcessorEntry e = {
+            .type = MP_PROCESSOR,
+            .apic_id = cpu->apic_id,
+            .apic_version = 0x14,
+            .flags = MP_CPU_ENABLED | (cs == first_cpu ? MP_CPU_BSP : 0),
+            .signature = cpu_to_le32(cpu->env.cpuid_version),
+            .features = cpu_to_le32(cpu->env.features[FEAT_1_EDX]),
+        };
+
+        g_array_append_vals(table, &e, sizeof(e));
+        entries++;
+    }
+
+    g_array_append_vals(table, &bus, sizeof(bus));
+    g_array_append_vals(table, &ioapic, sizeof(ioapic));
+    entries += 2;
+
+    /* The ISA IRQs are wired like KVM routes them, IRQ 0 goes to pin 2 */
+    microvm_add_int(table, MP_INTSRC, MP_EXTINT, 0, 0, MP_IOAPIC_ID, 0);
+    entries++;
+    for (irq = 0; irq < ISA_NUM_IRQS; irq++) {
+        bool virtio = irq >= MICROVM_MMIO_IRQ_BASE &&
+                      irq < MICROVM_MMIO_IRQ_BASE + MICROVM_MMIO_NUM;
+
+        if (irq == 2) {
+            continue;
+        }
+        microvm_add_int(table, MP_INTSRC, MP_INT,
+                        virtio ? MP_IRQ_LEVEL_HIGH : 0, irq,
+                        MP_IOAPIC_ID, irq ? irq : 2);
+        entries++;
+    }
+    microvm_add_int(table, MP_LINTSRC, MP_EXTINT, 0, 0, MP_ALL_LAPICS, 0);
+    microvm_add_int(table, MP_LINTSRC, MP_NMI, 0, 0, MP_ALL_LAPICS, 1);
+    entries += 2;
+
+    mpf = (MPFloatingPointer *)table->data;
+    memcpy(mpf->signature, "_MP_", 4);
+    mpf->physptr = cpu_to_le32(addr + sizeof(*mpf));
+    mpf->length = 1;
+    mpf->spec_rev = 4;
+    mpf->checksum = microvm_checksum(mpf, sizeof(*mpf));
+
+    mpc = (MPConfigTable *)(table->data + sizeof(*mpf));
+    memcpy(mpc->signature, "PCMP", 4);
+    mpc->length = cpu_to_le16(table->len - sizeof(*mpf));
+    mpc->spec_rev = 4;
+    memcpy(mpc->oem_id, "QEMU    ", 8);
+    memcpy(mpc->product_id, "microvm     ", 12);
+    mpc->entry_count = cpu_to_le16(entries);
+    mpc->lapic_addr = cpu_to_le32(APIC_DEFAULT_ADDRESS);
+    mpc->checksum = microvm_checksum(mpc, table->len - sizeof(*mpf));
+
+    return table;
+}
+
+static void microvm_add_e820(uint8_t *boot_params, uint64_t addr,
+                             uint64_t size, uint32_t type)
+{
+    int n = boot_params[BP_E820_ENTRIES];
+    uint8_t *e = boot_params + BP_E820_TABLE + n * 20;
+
+    assert(n < BP_E820_MAX);
+    stq_le_p(e, addr);
+    stq_le_p(e + 8, size);
+    stl_le_p(e + 16, type);
+    boot_params[BP_E820_ENTRIES] = n + 1;
+}
+
+/* Loads a bzImage and sets up everything that the kernel needs to start */
+static void microvm_load_linux(MicrovmMachineState *mms, const char *cmdline)
+{
+    PCMachineState *pcms = PC_MACHINE(mms);
+    MachineState *machine = MACHINE(mms);
+    uint8_t *kernel, *initrd = NULL, *boot_params;
+    gsize kernel_size, initrd_size = 0;
+    uint32_t setup_size, cmdline_size, initrd_max, initrd_addr = 0;
+    uint16_t protocol;
+    uint64_t gdt[4] = {
+        0, 0,
+        cpu_to_le64(0x00cf9b000000ffffULL),     /* MICROVM_BOOT_CS */
+        cpu_to_le64(0x00cf93000000ffffULL),     /* MICROVM_BOOT_DS */
+    };
+    GArray *mptable;
+    GError *gerr = NULL;
+
+    if (!g_file_get_contents(machine->kernel_filename, (gchar **)&kernel,
+                             &kernel_size, &gerr)) {
+        error_report("microvm: cannot load kernel '%s': %s",
+                     machine->kernel_filename, gerr->message);
+        exit(1);
+    }
+
+    protocol = kernel_size > BP_CMDLINE_SIZE + 4 &&
+               ldl_le_p(kernel + BP_HEADER_MAGIC) == 0x53726448 /* HdrS */
+               ? lduw_le_p(kernel + BP_VERSION) : 0;
+    if (protocol < 0x206 || !(kernel[BP_LOADFLAGS] & LOADED_HIGH)) {
+        error_report("microvm: '%s' is not a bzImage of boot protocol 2.06 "
+                     "or newer", machine->kernel_filename);
+        exit(1);
+    }
+
+    setup_size = ((kernel[BP_SETUP_SECTS] ? kernel[BP_SETUP_SECTS] : 4) + 1)
+                 * 512;
+    if (setup_size >= kernel_size ||
+        MICROVM_KERNEL_ADDR + kernel_size - setup_size >
+        pcms->below_4g_mem_size) {
+        error_report("microvm: kernel '%s' does not fit in memory",
+                     machine->kernel_filename);
+        exit(1);
+    }
+
+    cmdline_size = ldl_le_p(kernel + BP_CMDLINE_SIZE);
+    if (strlen(cmdline) > cmdline_size) {
+        error_report("microvm: kernel command line is longer than the "
+                     "%" PRIu32 " bytes supported by the kernel", cmdline_size);
+        exit(1);
+    }
+
+    if (machine->initrd_filename) {
+        if (!g_file_get_contents(machine->initrd_filename, (gchar **)&initrd,
+                                 &initrd_size, &gerr)) {
+            error_report("microvm: cannot load initrd '%s': %s",
+                         machine->initrd_filename, gerr->message);
+            exit(1);
+        }
+        initrd_max = MIN(ldl_le_p(kernel + BP_INITRD_ADDR_MAX),
+                         pcms->below_4g_mem_size - 1);
+        initrd_addr = (initrd_max + 1 - initrd_size) & TARGET_PAGE_MASK;
+        if (initrd_size > initrd_max ||
+            initrd_addr < MICROVM_KERNEL_ADDR + kernel_size - setup_size) {
+            error_report("microvm: initrd '%s' does not fit in memory",
+                         machine->initrd_filename);
+            exit(1);
+        }
+    }
+
+    /* The zero page holds the setup header of the kernel */
+    boot_params = g_malloc0(BP_SIZE);
+    memcpy(boot_params + BP_SETUP_SECTS, kernel + BP_SETUP_SECTS,
+           BP_HEADER_MAGIC + kernel[BP_JUMP + 1] - BP_SETUP_SECTS);
+    boot_params[BP_TYPE_OF_LOADER] = 0xff;
+    stl_le_p(boot_params + BP_CMD_LINE_PTR, MICROVM_CMDLINE_ADDR);
+    stl_le_p(boot_params + BP_RAMDISK_IMAGE, initrd_addr);
+    stl_le_p(boot_params + BP_RAMDISK_SIZE, initrd_size);
+
+    microvm_add_e820(boot_params, 0, MICROVM_MPTABLE_ADDR, E820_RAM);
+    microvm_add_e820(boot_params, MICROVM_MPTABLE_ADDR,
+                     0xa0000 - MICROVM_MPTABLE_ADDR, E820_RESERVED);
+    microvm_add_e820(boot_params, MICROVM_KERNEL_ADDR,
+                     pcms->below_4g_mem_size - MICROVM_KERNEL_ADDR, E820_RAM);
+    if (pcms->above_4g_mem_size) {
+        microvm_add_e820(boot_params, 0x100000000ULL,
+                         pcms->above_4g_mem_size, E820_RAM);
+    }
+
+    mptable = microvm_build_mptable(MICROVM_MPTABLE_ADDR);
+
+    /* ROM blobs are copied to guest memory again on every reset */
+    rom_add_blob_fixed("microvm.gdt", gdt, sizeof(gdt), MICROVM_GDT_ADDR);
+    rom_add_blob_fixed("microvm.boot_params", boot_params, BP_SIZE,
+                       MICROVM_BOOT_PARAMS);
+    rom_add_blob_fixed("microvm.cmdline", cmdline, strlen(cmdline) + 1,
+                       MICROVM_CMDLINE_ADDR);
+    rom_add_blob_fixed("microvm.mptable", mptable->data, mptable->len,
+                       MICROVM_MPTABLE_ADDR);
+    rom_add_blob_fixed("microvm.kernel", kernel + setup_size,
+                       kernel_size - setup_size, MICROVM_KERNEL_ADDR);
+    if (initrd) {
+        rom_add_blob_fixed("microvm.initrd", initrd, initrd_size,
+                           initrd_addr);
+    }
+
+    mms->entry = MICROVM_KERNEL_ADDR;
+    mms->boot_params = MICROVM_BOOT_PARAMS;
+
+    g_array_free(mptable, true);
+    g_free(boot_params);
+    g_free(initrd);
+    g_free(kernel);
+}
+
+/* Runs after the CPU reset, puts the BSP at the 32-bit kernel entry */
+static void microvm_cpu_reset(void *opaque)
+{
+    MicrovmMachineState *mms = opaque;
+    CPUX86State *env = &X86_CPU(first_cpu)->env;
+    uint32_t code = DESC_G_MASK | DESC_B_MASK | DESC_P_MASK | DESC_S_MASK |
+                    DESC_CS_MASK | DESC_R_MASK | DESC_A_MASK;
+    uint32_t data = DESC_G_MASK | DESC_B_MASK | DESC_P_MASK | DESC_S_MASK |
+                    DESC_W_MASK | DESC_A_MASK;
+
+    env->gdt.base = MICROVM_GDT_ADDR;
+    env->gdt.limit = 4 * 8 - 1;
+    cpu_x86_update_cr0(env, CR0_PE_MASK | CR0_ET_MASK);
+    cpu_x86_load_seg_cache(env, R_CS, MICROVM_BOOT_CS, 0, 0xffffffff, code);
+    cpu_x86_load_seg_cache(env, R_DS, MICROVM_BOOT_DS, 0, 0xffffffff, data);
+    cpu_x86_load_seg_cache(env, R_ES, MICROVM_BOOT_DS, 0, 0xffffffff, data);
+    cpu_x86_load_seg_cache(env, R_SS, MICROVM_BOOT_DS, 0, 0xffffffff, data);
+    cpu_x86_load_seg_cache(env, R_FS, MICROVM_BOOT_DS, 0, 0xffffffff, data);
+    cpu_x86_load_seg_cache(env, R_GS, MICROVM_BOOT_DS, 0, 0xffffffff, data);
+
+    env->eip = mms->entry;
+    env->regs[R_ESI] = mms->boot_params;
+}
+
+static void microvm_machine_init(MachineState *machine)
+{
+    MicrovmMachineState *mms = MICROVM_MACHINE(machine);
+    PCMachineState *pcms = PC_MACHINE(machine);
+    MemoryRegion *system_memory = get_system_memory();
+    MemoryRegion *ram, *ram_below_4g, *ram_above_4g;
+    GSIState *gsi_state;
+    qemu_irq *gsi, *i8259;
+    ISABus *isa_bus;
+    GString *cmdline;
+    int i;
+
+    if (!kvm_enabled() || !kvm_ioapic_in_kernel()) {
+        error_report("microvm: needs KVM with kernel_irqchip=on");
+        exit(1);
+    }
+    if (!machine->kernel_filename) {
+        error_report("microvm: there is no firmware, a kernel is needed "
+                     "(-kernel)");
+        exit(1);
+    }
+
+    pcms->below_4g_mem_size = MIN(machine->ram_size, MICROVM_MAX_LOWMEM);
+    pcms->above_4g_mem_size = machine->ram_size - pcms->below_4g_mem_size;
+
+    pc_cpus_init(pcms);
+    kvmclock_create();
+
+    ram = g_new(MemoryRegion, 1);
+    memory_region_allocate_system_memory(ram, NULL, "microvm.ram",
+                                         machine->ram_size);
+    ram_below_4g = g_new(MemoryRegion, 1);
+    memory_region_init_alias(ram_below_4g, NULL, "ram-below-4g", ram,
+                             0, pcms->below_4g_mem_size);
+    memory_region_add_subregion(system_memory, 0, ram_below_4g);
+    if (pcms->above_4g_mem_size) {
+        ram_above_4g = g_new(MemoryRegion, 1);
+        memory_region_init_alias(ram_above_4g, NULL, "ram-above-4g", ram,
+                                 pcms->below_4g_mem_size,
+                                 pcms->above_4g_mem_size);
+        memory_region_add_subregion(system_memory, 0x100000000ULL,
+                                    ram_above_4g);
+    }
+
+    /* KVM forwards the ISA IRQs to both the PIC and the IOAPIC */
+    gsi_state = g_malloc0(sizeof(*gsi_state));
+    kvm_pc_setup_irq_routing(true);
+    gsi = qemu_allocate_irqs(kvm_pc_gsi_handler, gsi_state, GSI_NUM_PINS);
+
+    isa_bus = isa_bus_new(NULL, system_memory, get_system_io(),
+                          &error_abort);
+    isa_bus_irqs(isa_bus, gsi);
+    i8259 = kvm_i8259_init(isa_bus);
+    for (i = 0; i < ISA_NUM_IRQS; i++) {
+        gsi_state->i8259_irq[i] = i8259[i];
+    }
+    g_free(i8259);
+    ioapic_init_gsi(gsi_state, NULL);
+
+    serial_hds_isa_init(isa_bus, 1);
+
+    cmdline = g_string_new(machine->kernel_cmdline);
+    for (i = 0; i < MICROVM_MMIO_NUM; i++) {
+        hwaddr base = MICROVM_MMIO_BASE + i * MICROVM_MMIO_SIZE;
+        int irq = MICROVM_MMIO_IRQ_BASE + i;
+
+        sysbus_create_simple("virtio-mmio", base, gsi[irq]);
+        g_string_append_printf(cmdline, " virtio_mmio.device=%d@0x%"
+                               HWADDR_PRIx ":%d", MICROVM_MMIO_SIZE, base, irq);
+    }
+
+    microvm_load_linux(mms, cmdline->str);
+    g_string_free(cmdline, true);
+
+    qemu_register_reset(microvm_cpu_reset, mms);
+}
+
+static void microvm_machine_class_init(ObjectClass *oc, void *data)
+{
+    MachineClass *mc = MACHINE_CLASS(oc);
+    PCMachineClass *pcmc = PC_MACHINE_CLASS(oc);
+
+    mc->desc = "microvm (no firmware, no PCI, virtio-mmio devices)";
+    mc->init = microvm_machine_init;
+    mc->hot_add_cpu = NULL;
+    mc->no_floppy = 1;
+    mc->no_cdrom = 1;
+    mc->no_parallel = 1;
+    mc->no_sdcard = 1;
+    pcmc->pci_enabled = false;
+    pcmc->has_acpi_build = false;
+    pcmc->smbios_defaults = false;
+    pcmc->has_reserved_memory = false;
+}
+
+static const TypeInfo microvm_machine_info = {
+    .name = TYPE_MICROVM_MACHINE,
+    .parent = TYPE_PC_MACHINE,
+    .instance_size = sizeof(MicrovmMachineState),
+    .class_init = microvm_machine_class_init,
+};
+
+static void microvm_machine_register_types(void)
+{
+    type_register_static(&microvm_machine_info);
+}
+
+type_init(microvm_machine_register_types)
@@ -64,6 +64,8 @@
 #include "hw/pci/pci_host.h"
 #include "acpi-build.h"
 #include "hw/mem/pc-dimm.h"
+#include "hw/virtio/vhost.h"
+#include "hw/virtio/virtio-mem.h"
 #include "qapi/visitor.h"
 #include "qapi-visit.h"
 #include "qom/cpu.h"
@@ -1620,6 +1622,60 @@ out:
     error_propagate(errp, local_err);
 }
 
+static void pc_virtio_mem_plug(HotplugHandler *hotplug_dev,
+                               DeviceState *dev, Error **errp)
+{
+    PCMachineState *pcms = PC_MACHINE(hotplug_dev);
+    MachineState *machine = MACHINE(pcms);
+    MemoryHotplugState *hpms = &pcms->hotplug_memory;
+    VirtIOMEM *vmem = VIRTIO_MEM(dev);
+    MemoryRegion *mr = host_memory_backend_get_memory(vmem->memdev,
+                                                      &error_abort);
+    uint64_t size = memory_region_size(mr);
+    Error *local_err = NULL;
+    uint64_t capacity, addr;
+
+    if (memory_region_is_mapped(mr)) {
+        error_setg(&local_err, "memdev is already in use");
+        goto out;
+    }
+
+    /* Blocks must be aligned in guest physical memory */
+    addr = pc_dimm_get_free_addr(hpms->base, memory_region_size(&hpms->mr),
+                                 vmem->addr ? &vmem->addr : NULL,
+                                 vmem->block_size, size, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    capacity = pc_existing_dimms_capacity(&local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (capacity + size > machine->maxram_size - machine->ram_size) {
+        error_setg(&local_err, "not enough space, currently 0x%" PRIx64
+                   " in use of total hot pluggable 0x" RAM_ADDR_FMT,
+                   capacity, machine->maxram_size - machine->ram_size);
+        goto out;
+    }
+
+    if (kvm_enabled() && !kvm_has_free_slot(machine)) {
+        error_setg(&local_err, "hypervisor has no free memory slots left");
+        goto out;
+    }
+    if (!vhost_has_free_slot()) {
+        error_setg(&local_err, "a used vhost backend has no free"
+                               " memory slots left");
+        goto out;
+    }
+
+    vmem->addr = addr;
+    memory_region_add_subregion(&hpms->mr, addr - hpms->base, mr);
+    numa_set_mem_node_id(addr, size, vmem->node);
+out:
+    error_propagate(errp, local_err);
+}
+
 static void pc_dimm_unplug_request(HotplugHandler *hotplug_dev,
                                    DeviceState *dev, Error **errp)
 {
@@ -1717,6 +1773,8 @@ static void pc_machine_device_plug_cb(HotplugHandler *hotplug_dev,
         pc_dimm_plug(hotplug_dev, dev, errp);
     } else if (object_dynamic_cast(OBJECT(dev), TYPE_CPU)) {
         pc_cpu_plug(hotplug_dev, dev, errp);
+    } else if (object_dynamic_cast(OBJECT(dev), TYPE_VIRTIO_MEM)) {
+        pc_virtio_mem_plug(hotplug_dev, dev, errp);
     }
 }
 
@@ -1748,7 +1806,8 @@ static HotplugHandler *pc_get_hotpug_handler(MachineState *machine,
     PCMachineClass *pcmc = PC_MACHINE_GET_CLASS(machine);
 
     if (object_dynamic_cast(OBJECT(dev), TYPE_PC_DIMM) ||
-        object_dynamic_cast(OBJECT(dev), TYPE_CPU)) {
+        object_dynamic_cast(OBJECT(dev), TYPE_CPU) ||
+        object_dynamic_cast(OBJECT(dev), TYPE_VIRTIO_MEM)) {
         return HOTPLUG_HANDLER(machine);
     }
 
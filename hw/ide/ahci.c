@@ -54,6 +54,8 @@ static bool ahci_map_clb_address(AHCIDevice *ad);
 static bool ahci_map_fis_address(AHCIDevice *ad);
 static void ahci_unmap_clb_address(AHCIDevice *ad);
 static void ahci_unmap_fis_address(AHCIDevice *ad);
+static void ahci_port_flush_doorbells(AHCIState *s, int port);
+static uint32_t ahci_port_take_doorbells(AHCIDevice *ad);
 
 
 static uint32_t  ahci_port_read(AHCIState *s, int port, int offset)
@@ -108,6 +110,7 @@ static uint32_t  ahci_port_read(AHCIState *s, int port, int offset)
         val = pr->scr_act;
         break;
     case PORT_CMD_ISSUE:
+        ahci_port_flush_doorbells(s, port);
         val = pr->cmd_issue;
         break;
     case PORT_RESERVED:
@@ -269,6 +272,7 @@ static void  ahci_port_write(AHCIState *s, int port, int offset, uint32_t val)
              * is done. We don't support ICC state changes, therefore always
              * force the ICC bits to zero.
              */
+            ahci_port_flush_doorbells(s, port);
             pr->cmd = (pr->cmd & PORT_CMD_RO_MASK) |
                       (val & ~(PORT_CMD_RO_MASK|PORT_CMD_ICC_MASK));
 
@@ -310,7 +314,7 @@ static void  ahci_port_write(AHCIState *s, int port, int offset, uint32_t val)
             pr->scr_act |= val;
             break;
         case PORT_CMD_ISSUE:
-            pr->cmd_issue |= val;
+            pr->cmd_issue |= val | ahci_port_take_doorbells(&s->dev[port]);
             check_cmd(s, port);
             break;
         default:
@@ -502,15 +506,110 @@ static void ahci_reg_init(AHCIState *s)
 static void check_cmd(AHCIState *s, int port)
 {
     AHCIPortRegs *pr = &s->dev[port].port_regs;
+    BlockBackend *blk = s->dev[port].port.ifs[0].blk;
     uint8_t slot;
 
     if ((pr->cmd & PORT_CMD_START) && pr->cmd_issue) {
+        /* Submit all the commands that were issued together as one batch */
+        if (blk) {
+            blk_io_plug(blk);
+        }
         for (slot = 0; (slot < 32) && pr->cmd_issue; slot++) {
             if ((pr->cmd_issue & (1U << slot)) &&
                 !handle_cmd(s, port, slot)) {
                 pr->cmd_issue &= ~(1U << slot);
             }
         }
+        if (blk) {
+            blk_io_unplug(blk);
+        }
+    }
+}
+
+/*
+ * Most drivers issue each command with a PxCI write of a single bit.
+ * When the ioeventfd property is set, such writes signal an ioeventfd
+ * that matches the written value, and are processed by the main loop
+ * instead of the vCPU thread.  Other PxCI writes still trap.
+ */
+static uint32_t ahci_port_take_doorbells(AHCIDevice *ad)
+{
+    uint32_t mask = 0;
+    int i;
+
+    if (!ad->doorbells) {
+        return 0;
+    }
+    for (i = 0; i < AHCI_MAX_CMDS; i++) {
+        if (event_notifier_test_and_clear(&ad->doorbells[i].notifier)) {
+            mask |= 1U << i;
+        }
+    }
+    return mask;
+}
+
+/*
+ * Apply the doorbells that the main loop has not seen yet, so that
+ * accesses to the port registers observe them in the right order.
+ */
+static void ahci_port_flush_doorbells(AHCIState *s, int port)
+{
+    uint32_t mask = ahci_port_take_doorbells(&s->dev[port]);
+
+    if (mask) {
+        s->dev[port].port_regs.cmd_issue |= mask;
+        check_cmd(s, port);
+    }
+}
+
+static void ahci_doorbell_notify(EventNotifier *e)
+{
+    AHCIDoorbell *db = container_of(e, AHCIDoorbell, notifier);
+
+    /* Picks up this doorbell and any other that is pending on the port */
+    ahci_port_flush_doorbells(db->ad->hba, db->ad->port_no);
+}
+
+static hwaddr ahci_doorbell_addr(AHCIDevice *ad)
+{
+    return AHCI_PORT_REGS_START_ADDR +
+           ad->port_no * AHCI_PORT_ADDR_OFFSET_LEN + PORT_CMD_ISSUE;
+}
+
+/* Tear down the first @n doorbells of the port */
+static void ahci_free_doorbells(AHCIState *s, AHCIDevice *ad, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        memory_region_del_eventfd(&s->mem, ahci_doorbell_addr(ad), 4, true,
+                                  1U << i, &ad->doorbells[i].notifier);
+        event_notifier_set_handler(&ad->doorbells[i].notifier, NULL);
+        event_notifier_cleanup(&ad->doorbells[i].notifier);
+    }
+    g_free(ad->doorbells);
+    ad->doorbells = NULL;
+}
+
+static void ahci_init_doorbells(AHCIState *s, AHCIDevice *ad)
+{
+    int i;
+
+    ad->doorbells = g_new0(AHCIDoorbell, AHCI_MAX_CMDS);
+    for (i = 0; i < AHCI_MAX_CMDS; i++) {
+        AHCIDoorbell *db = &ad->doorbells[i];
+
+        db->ad = ad;
+        db->slot = i;
+        if (event_notifier_init(&db->notifier, 0) < 0) {
+            error_report("ahci: failed to create ioeventfd, "
+                         "falling back to MMIO doorbells");
+            ahci_free_doorbells(s, ad, i);
+            return;
+        }
+        event_notifier_set_handler(&db->notifier, ahci_doorbell_notify);
+        memory_region_add_eventfd(&s->mem, ahci_doorbell_addr(ad), 4, true,
+                                  1U << i, &db->notifier);
     }
 }
 
@@ -581,6 +680,9 @@ static void ahci_reset_port(AHCIState *s, int port)
     pr->sig = 0xFFFFFFFF;
     d->busy_slot = -1;
     d->init_d2h_sent = false;
+    ahci_port_take_doorbells(d);
+    qemu_bh_cancel(d->sdb_bh);
+    d->sdb_pending = false;
 
     ide_state = &s->dev[port].port.ifs[0];
     if (!ide_state->blk) {
@@ -691,9 +793,8 @@ static void ahci_unmap_clb_address(AHCIDevice *ad)
     ad->lst = NULL;
 }
 
-static void ahci_write_fis_sdb(AHCIState *s, NCQTransferState *ncq_tfs)
+static void ahci_write_fis_sdb(AHCIState *s, AHCIDevice *ad)
 {
-    AHCIDevice *ad = ncq_tfs->drive;
     AHCIPortRegs *pr = &ad->port_regs;
     IDEState *ide_state;
     SDBFIS *sdb_fis;
@@ -727,6 +828,19 @@ static void ahci_write_fis_sdb(AHCIState *s, NCQTransferState *ncq_tfs)
     }
 }
 
+/*
+ * NCQ commands that complete together are reported with a single Set
+ * Device Bits FIS, whose SActive field carries all of their tags, and
+ * a single interrupt.
+ */
+static void ahci_sdb_bh(void *opaque)
+{
+    AHCIDevice *ad = opaque;
+
+    ad->sdb_pending = false;
+    ahci_write_fis_sdb(ad->hba, ad);
+}
+
 static void ahci_write_fis_pio(AHCIDevice *ad, uint16_t len)
 {
     AHCIPortRegs *pr = &ad->port_regs;
@@ -931,7 +1045,8 @@ static void ncq_finish(NCQTransferState *ncq_tfs)
         ncq_tfs->drive->finished |= (1 << ncq_tfs->tag);
     }
 
-    ahci_write_fis_sdb(ncq_tfs->drive->hba, ncq_tfs);
+    ncq_tfs->drive->sdb_pending = true;
+    qemu_bh_schedule(ncq_tfs->drive->sdb_bh);
 
     DPRINTF(ncq_tfs->drive->port_no, "NCQ transfer tag %d finished\n",
             ncq_tfs->tag);
@@ -1474,12 +1589,24 @@ void ahci_realize(AHCIState *s, DeviceState *qdev, AddressSpace *as, int ports)
         ad->port_no = i;
         ad->port.dma = &ad->dma;
         ad->port.dma->ops = &ahci_dma_ops;
+        ad->sdb_bh = qemu_bh_new(ahci_sdb_bh, ad);
         ide_register_restart_cb(&ad->port);
+        if (s->ioeventfd) {
+            ahci_init_doorbells(s, ad);
+        }
     }
 }
 
 void ahci_uninit(AHCIState *s)
 {
+    int i;
+
+    for (i = 0; i < s->ports; i++) {
+        if (s->dev[i].doorbells) {
+            ahci_free_doorbells(s, &s->dev[i], AHCI_MAX_CMDS);
+        }
+        qemu_bh_delete(s->dev[i].sdb_bh);
+    }
     g_free(s->dev);
 }
 
@@ -1524,6 +1651,24 @@ static const VMStateDescription vmstate_ncq_tfs = {
     },
 };
 
+static bool ahci_sdb_pending_needed(void *opaque)
+{
+    AHCIDevice *ad = opaque;
+
+    return ad->sdb_pending;
+}
+
+static const VMStateDescription vmstate_ahci_device_sdb_pending = {
+    .name = "ahci port/sdb_pending",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = ahci_sdb_pending_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(sdb_pending, AHCIDevice),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_ahci_device = {
     .name = "ahci port",
     .version_id = 1,
@@ -1553,6 +1698,10 @@ static const VMStateDescription vmstate_ahci_device = {
                              1, vmstate_ncq_tfs, NCQTransferState),
         VMSTATE_END_OF_LIST()
     },
+    .subsections = (const VMStateDescription*[]) {
+        &vmstate_ahci_device_sdb_pending,
+        NULL
+    }
 };
 
 static int ahci_state_post_load(void *opaque, int version_id)
@@ -1585,6 +1734,11 @@ static int ahci_state_post_load(void *opaque, int version_id)
             return -1;
         }
 
+        /* Deliver the completions that the source did not report yet */
+        if (ad->sdb_pending) {
+            qemu_bh_schedule(ad->sdb_bh);
+        }
+
         for (j = 0; j < AHCI_MAX_CMDS; j++) {
             ncq_tfs = &ad->ncq_tfs[j];
             ncq_tfs->drive = ad;
@@ -25,6 +25,7 @@
 #define HW_IDE_AHCI_H
 
 #include <hw/sysbus.h>
+#include "qemu/event_notifier.h"
 
 #define AHCI_MEM_BAR_SIZE         0x1000
 #define AHCI_MAX_PORTS            32
@@ -268,6 +269,13 @@ typedef struct NCQTransferState {
     bool halt;
 } NCQTransferState;
 
+/* An ioeventfd for the PxCI writes that issue a single command slot */
+typedef struct AHCIDoorbell {
+    EventNotifier notifier;
+    struct AHCIDevice *ad;
+    uint8_t slot;
+} AHCIDoorbell;
+
 struct AHCIDevice {
     IDEDMA dma;
     IDEBus port;
@@ -277,6 +285,9 @@ struct AHCIDevice {
     AHCIPortRegs port_regs;
     struct AHCIState *hba;
     QEMUBH *check_bh;
+    QEMUBH *sdb_bh;         /* Coalesces the Set Device Bits FIS */
+    bool sdb_pending;
+    AHCIDoorbell *doorbells;
     uint8_t *lst;
     uint8_t *res_fis;
     bool done_atapi_packet;
@@ -298,6 +309,7 @@ typedef struct AHCIState {
     int32_t ports;
     qemu_irq irq;
     AddressSpace *as;
+    bool ioeventfd;
 } AHCIState;
 
 typedef struct AHCIPCIState {
@@ -27,6 +27,7 @@
 #include "sysemu/kvm.h"
 #include "trace.h"
 #include "hw/virtio/vhost.h"
+#include "hw/virtio/virtio-mem.h"
 
 typedef struct pc_dimms_capacity {
      uint64_t size;
@@ -121,17 +122,42 @@ void pc_dimm_memory_unplug(DeviceState *dev, MemoryHotplugState *hpms,
     vmstate_unregister_ram(mr, dev);
 }
 
+/* virtio-mem devices take a range of the hotplug memory area, too */
+static bool pc_dimm_is_memory_device(Object *obj)
+{
+    return object_dynamic_cast(obj, TYPE_PC_DIMM) ||
+           object_dynamic_cast(obj, TYPE_VIRTIO_MEM);
+}
+
+static uint64_t pc_dimm_device_addr(Object *obj)
+{
+    if (object_dynamic_cast(obj, TYPE_VIRTIO_MEM)) {
+        return VIRTIO_MEM(obj)->addr;
+    }
+    return PC_DIMM(obj)->addr;
+}
+
+static uint64_t pc_dimm_device_size(Object *obj, Error **errp)
+{
+    if (object_dynamic_cast(obj, TYPE_VIRTIO_MEM)) {
+        VirtIOMEM *vmem = VIRTIO_MEM(obj);
+
+        return memory_region_size(host_memory_backend_get_memory(vmem->memdev,
+                                                                 errp));
+    }
+    return object_property_get_int(obj, PC_DIMM_SIZE_PROP, errp);
+}
+
 static int pc_existing_dimms_capacity_internal(Object *obj, void *opaque)
 {
     pc_dimms_capacity *cap = opaque;
     uint64_t *size = &cap->size;
 
-    if (object_dynamic_cast(obj, TYPE_PC_DIMM)) {
+    if (pc_dimm_is_memory_device(obj)) {
         DeviceState *dev = DEVICE(obj);
 
         if (dev->realized) {
-            (*size) += object_property_get_int(obj, PC_DIMM_SIZE_PROP,
-                cap->errp);
+            (*size) += pc_dimm_device_size(obj, cap->errp);
         }
 
         if (cap->errp && *cap->errp) {
@@ -186,6 +212,36 @@ int qmp_pc_dimm_device_list(Object *obj, void *opaque)
             **prev = elem;
             *prev = &elem->next;
         }
+    } else if (object_dynamic_cast(obj, TYPE_VIRTIO_MEM)) {
+        DeviceState *dev = DEVICE(obj);
+
+        if (dev->realized) {
+            MemoryDeviceInfoList *elem = g_new0(MemoryDeviceInfoList, 1);
+            MemoryDeviceInfo *info = g_new0(MemoryDeviceInfo, 1);
+            VirtioMEMDeviceInfo *vi = g_new0(VirtioMEMDeviceInfo, 1);
+            VirtIOMEM *vmem = VIRTIO_MEM(obj);
+            /* The id is the one of the proxy device */
+            DeviceState *proxy = DEVICE(object_get_parent(obj));
+
+            if (proxy->id) {
+                vi->has_id = true;
+                vi->id = g_strdup(proxy->id);
+            }
+            vi->memaddr = vmem->addr;
+            vi->node = vmem->node;
+            vi->requested_size = vmem->requested_size;
+            vi->size = vmem->size;
+            vi->max_size = pc_dimm_device_size(obj, &error_abort);
+            vi->block_size = vmem->block_size;
+            vi->memdev = object_get_canonical_path(OBJECT(vmem->memdev));
+
+            info->type = MEMORY_DEVICE_INFO_KIND_VIRTIO_MEM;
+            info->u.virtio_mem = vi;
+            elem->value = info;
+            elem->next = NULL;
+            **prev = elem;
+            *prev = &elem->next;
+        }
     }
 
     object_child_foreach(obj, qmp_pc_dimm_device_list, opaque);
@@ -240,9 +296,8 @@ out:
 
 static gint pc_dimm_addr_sort(gconstpointer a, gconstpointer b)
 {
-    PCDIMMDevice *x = PC_DIMM(a);
-    PCDIMMDevice *y = PC_DIMM(b);
-    Int128 diff = int128_sub(int128_make64(x->addr), int128_make64(y->addr));
+    Int128 diff = int128_sub(int128_make64(pc_dimm_device_addr(OBJECT(a))),
+                             int128_make64(pc_dimm_device_addr(OBJECT(b))));
 
     if (int128_lt(diff, int128_zero())) {
         return -1;
@@ -256,7 +311,7 @@ static int pc_dimm_built_list(Object *obj, void *opaque)
 {
     GSList **list = opaque;
 
-    if (object_dynamic_cast(obj, TYPE_PC_DIMM)) {
+    if (pc_dimm_is_memory_device(obj)) {
         DeviceState *dev = DEVICE(obj);
         if (dev->realized) { /* only realized DIMMs matter */
             *list = g_slist_insert_sorted(*list, dev, pc_dimm_addr_sort);
@@ -307,21 +362,20 @@ uint64_t pc_dimm_get_free_addr(uint64_t address_space_start,
 
     /* find address range that will fit new DIMM */
     for (item = list; item; item = g_slist_next(item)) {
-        PCDIMMDevice *dimm = item->data;
-        uint64_t dimm_size = object_property_get_int(OBJECT(dimm),
-                                                     PC_DIMM_SIZE_PROP,
-                                                     errp);
+        Object *dimm = item->data;
+        uint64_t dimm_addr = pc_dimm_device_addr(dimm);
+        uint64_t dimm_size = pc_dimm_device_size(dimm, errp);
         if (errp && *errp) {
             goto out;
         }
 
-        if (ranges_overlap(dimm->addr, dimm_size, new_addr, size)) {
+        if (ranges_overlap(dimm_addr, dimm_size, new_addr, size)) {
             if (hint) {
                 DeviceState *d = DEVICE(dimm);
                 error_setg(errp, "address range conflicts with '%s'", d->id);
                 goto out;
             }
-            new_addr = QEMU_ALIGN_UP(dimm->addr + dimm_size, align);
+            new_addr = QEMU_ALIGN_UP(dimm_addr + dimm_size, align);
         }
     }
     ret = new_addr;
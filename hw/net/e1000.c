@@ -38,6 +38,9 @@
 
 #include "e1000_regs.h"
 
+/* Number of descriptors fetched with a single DMA */
+#define E1000_DESC_BATCH 16
+
 static const uint8_t bcast[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
 #define E1000_DEBUG
@@ -135,6 +138,21 @@ typedef struct E1000State_st {
     bool mit_irq_level;        /* Tracks interrupt pin level. */
     uint32_t mit_ide;          /* Tracks E1000_TXD_CMD_IDE bit. */
 
+    /* Packet delay timers (RDTR/RADV and TIDV/TADV) */
+    QEMUTimer *rx_delay_timer;
+    QEMUTimer *tx_delay_timer;
+    int64_t rx_abs_deadline;   /* 0 if RADV is not running */
+    int64_t tx_abs_deadline;   /* 0 if TADV is not running */
+
+    /* Receive descriptors prefetched from the ring, starting at RDH */
+    struct e1000_rx_desc rx_desc_cache[E1000_DESC_BATCH];
+    uint32_t rx_cache_index;   /* Ring index of rx_desc_cache[rx_cache_pos] */
+    uint32_t rx_cache_pos;
+    uint32_t rx_cache_len;
+
+    QEMUBH *tx_bh;
+    VMChangeStateEntry *vmstate;
+
 /* Compatibility flags for migration to/from qemu 1.3.0 and older */
 #define E1000_FLAG_AUTONEG_BIT 0
 #define E1000_FLAG_MIT_BIT 1
@@ -191,7 +209,7 @@ enum {
     defreg(TSCTC),   defreg(PRC64),   defreg(PRC127),  defreg(PRC255),
     defreg(PRC511),  defreg(PRC1023), defreg(PRC1522), defreg(PTC64),
     defreg(PTC127),  defreg(PTC255),  defreg(PTC511),  defreg(PTC1023),
-    defreg(PTC1522), defreg(MPTC),    defreg(BPTC)
+    defreg(PTC1522), defreg(MPTC),    defreg(BPTC),    defreg(TIDV)
 };
 
 static void
@@ -333,28 +351,15 @@ set_interrupt_cause(E1000State *s, int index, uint32_t val)
          * Here we detect a potential raising edge. We postpone raising the
          * interrupt line if we are inside the mitigation delay window
          * (s->mit_timer_on == 1).
-         * We provide a partial implementation of interrupt mitigation,
-         * emulating only RADV, TADV and ITR (lower 16 bits, 1024ns units for
-         * RADV and TADV, 256ns units for ITR). RDTR is only used to enable
-         * RADV; relative timers based on TIDV and RDTR are not implemented.
+         * ITR (lower 16 bits, 256ns units) is the minimum interval between
+         * two interrupts.  The RDTR/RADV and TIDV/TADV packet timers delay
+         * the RXT0 and TXDW causes themselves; see e1000_delay_cause.
          */
         if (s->mit_timer_on) {
             return;
         }
         if (chkflag(MIT)) {
-            /* Compute the next mitigation delay according to pending
-             * interrupts and the current values of RADV (provided
-             * RDTR!=0), TADV and ITR.
-             * Then rearm the timer.
-             */
             mit_delay = 0;
-            if (s->mit_ide &&
-                    (pending_ints & (E1000_ICR_TXQE | E1000_ICR_TXDW))) {
-                mit_update_delay(&mit_delay, s->mac_reg[TADV] * 4);
-            }
-            if (s->mac_reg[RDTR] && (pending_ints & E1000_ICS_RXT0)) {
-                mit_update_delay(&mit_delay, s->mac_reg[RADV] * 4);
-            }
             mit_update_delay(&mit_delay, s->mac_reg[ITR]);
 
             if (mit_delay) {
@@ -362,7 +367,6 @@ set_interrupt_cause(E1000State *s, int index, uint32_t val)
                 timer_mod(s->mit_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
                           mit_delay * 256);
             }
-            s->mit_ide = 0;
         }
     }
 
@@ -380,6 +384,61 @@ e1000_mit_timer(void *opaque)
     set_interrupt_cause(s, 0, s->mac_reg[ICR]);
 }
 
+/* Post @cause after the relative delay @rel, or at the latest @abs after
+ * the first delayed event (both in 1.024us units).  A new event restarts
+ * the relative timer but not the absolute one.
+ */
+static void
+e1000_delay_cause(QEMUTimer *timer, int64_t *abs_deadline,
+                  uint32_t rel, uint32_t abs)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t expire = now + rel * 1024;
+
+    if (abs) {
+        if (!*abs_deadline) {
+            *abs_deadline = now + abs * 1024;
+        }
+        expire = MIN(expire, *abs_deadline);
+    }
+    timer_mod(timer, expire);
+}
+
+static void
+set_ics(E1000State *s, int index, uint32_t val);
+
+static void
+e1000_rx_delay_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    s->rx_abs_deadline = 0;
+    set_ics(s, 0, E1000_ICS_RXT0);
+}
+
+static void
+e1000_tx_delay_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    s->tx_abs_deadline = 0;
+    set_ics(s, 0, E1000_ICS_TXDW);
+}
+
+/* Post the causes that the packet timers are holding back right away */
+static void
+e1000_flush_delayed_causes(E1000State *s)
+{
+    if (timer_pending(s->rx_delay_timer)) {
+        timer_del(s->rx_delay_timer);
+        e1000_rx_delay_timer(s);
+    }
+    if (timer_pending(s->tx_delay_timer)) {
+        timer_del(s->tx_delay_timer);
+        e1000_tx_delay_timer(s);
+    }
+}
+
 static void
 set_ics(E1000State *s, int index, uint32_t val)
 {
@@ -433,9 +492,15 @@ static void e1000_reset(void *opaque)
 
     timer_del(d->autoneg_timer);
     timer_del(d->mit_timer);
+    timer_del(d->rx_delay_timer);
+    timer_del(d->tx_delay_timer);
+    qemu_bh_cancel(d->tx_bh);
     d->mit_timer_on = 0;
     d->mit_irq_level = 0;
     d->mit_ide = 0;
+    d->rx_abs_deadline = 0;
+    d->tx_abs_deadline = 0;
+    d->rx_cache_len = 0;
     memset(d->phy_reg, 0, sizeof d->phy_reg);
     memmove(d->phy_reg, phy_reg_init, sizeof phy_reg_init);
     d->phy_reg[PHY_ID2] = edc->phy_id2;
@@ -853,10 +918,10 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     tp->cptse = 0;
 }
 
+/* Update the status of @dp; the caller writes it back to the ring */
 static uint32_t
-txdesc_writeback(E1000State *s, dma_addr_t base, struct e1000_tx_desc *dp)
+txdesc_writeback(E1000State *s, struct e1000_tx_desc *dp)
 {
-    PCIDevice *d = PCI_DEVICE(s);
     uint32_t txd_upper, txd_lower = le32_to_cpu(dp->lower.data);
 
     if (!(txd_lower & (E1000_TXD_CMD_RS|E1000_TXD_CMD_RPS)))
@@ -864,8 +929,6 @@ txdesc_writeback(E1000State *s, dma_addr_t base, struct e1000_tx_desc *dp)
     txd_upper = (le32_to_cpu(dp->upper.data) | E1000_TXD_STAT_DD) &
                 ~(E1000_TXD_STAT_EC | E1000_TXD_STAT_LC | E1000_TXD_STAT_TU);
     dp->upper.data = cpu_to_le32(txd_upper);
-    pci_dma_write(d, base + ((char *)&dp->upper - (char *)dp),
-                  &dp->upper, sizeof(dp->upper));
     return E1000_ICR_TXDW;
 }
 
@@ -877,48 +940,114 @@ static uint64_t tx_desc_base(E1000State *s)
     return (bah << 32) + bal;
 }
 
+/* Number of descriptors that can be fetched at once starting at @head,
+ * without going past @tail or the end of the ring.
+ */
+static uint32_t
+desc_batch_size(uint32_t head, uint32_t tail, uint32_t ring_size)
+{
+    uint32_t end = tail > head ? MIN(tail, ring_size) : ring_size;
+
+    if (head >= ring_size || head == tail) {
+        return 1;
+    }
+    return MIN(end - head, E1000_DESC_BATCH);
+}
+
 static void
 start_xmit(E1000State *s)
 {
     PCIDevice *d = PCI_DEVICE(s);
     dma_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc desc[E1000_DESC_BATCH];
     uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE;
+    uint32_t ring_size = s->mac_reg[TDLEN] / sizeof(desc[0]);
+    int i, n, wb_first, wb_last;
+    bool wrapped = false;
 
     if (!(s->mac_reg[TCTL] & E1000_TCTL_EN)) {
         DBGOUT(TX, "tx disabled\n");
         return;
     }
 
-    while (s->mac_reg[TDH] != s->mac_reg[TDT]) {
+    while (s->mac_reg[TDH] != s->mac_reg[TDT] && !wrapped) {
+        n = desc_batch_size(s->mac_reg[TDH], s->mac_reg[TDT], ring_size);
         base = tx_desc_base(s) +
                sizeof(struct e1000_tx_desc) * s->mac_reg[TDH];
-        pci_dma_read(d, base, &desc, sizeof(desc));
-
-        DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
-               (void *)(intptr_t)desc.buffer_addr, desc.lower.data,
-               desc.upper.data);
+        pci_dma_read(d, base, desc, n * sizeof(desc[0]));
+
+        wb_first = wb_last = -1;
+        for (i = 0; i < n; i++) {
+            DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
+                   (void *)(intptr_t)desc[i].buffer_addr, desc[i].lower.data,
+                   desc[i].upper.data);
+
+            process_tx_desc(s, &desc[i]);
+            if (txdesc_writeback(s, &desc[i])) {
+                cause |= E1000_ICR_TXDW;
+                if (wb_first < 0) {
+                    wb_first = i;
+                }
+                wb_last = i;
+            }
 
-        process_tx_desc(s, &desc);
-        cause |= txdesc_writeback(s, base, &desc);
+            if (++s->mac_reg[TDH] * sizeof(desc[0]) >= s->mac_reg[TDLEN])
+                s->mac_reg[TDH] = 0;
+            /*
+             * the following could happen only if guest sw assigns
+             * bogus values to TDT/TDLEN.
+             * there's nothing too intelligent we could do about this.
+             */
+            if (s->mac_reg[TDH] == tdh_start ||
+                tdh_start >= ring_size) {
+                DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
+                       tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
+                wrapped = true;
+                break;
+            }
+        }
 
-        if (++s->mac_reg[TDH] * sizeof(desc) >= s->mac_reg[TDLEN])
-            s->mac_reg[TDH] = 0;
-        /*
-         * the following could happen only if guest sw assigns
-         * bogus values to TDT/TDLEN.
-         * there's nothing too intelligent we could do about this.
+        /* Write back the status of the whole batch at once; descriptors
+         * in between that did not ask for it are written back unchanged.
          */
-        if (s->mac_reg[TDH] == tdh_start ||
-            tdh_start >= s->mac_reg[TDLEN] / sizeof(desc)) {
-            DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
-                   tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
-            break;
+        if (wb_first >= 0) {
+            pci_dma_write(d, base + wb_first * sizeof(desc[0]),
+                          &desc[wb_first],
+                          (wb_last - wb_first + 1) * sizeof(desc[0]));
         }
     }
+
+    if (chkflag(MIT) && s->mit_ide && s->mac_reg[TIDV] &&
+        (cause & E1000_ICR_TXDW)) {
+        cause &= ~E1000_ICR_TXDW;
+        e1000_delay_cause(s->tx_delay_timer, &s->tx_abs_deadline,
+                          s->mac_reg[TIDV], s->mac_reg[TADV]);
+    }
+    s->mit_ide = 0;
     set_ics(s, 0, cause);
 }
 
+static void
+e1000_tx_bh(void *opaque)
+{
+    E1000State *s = opaque;
+
+    if (!runstate_is_running()) {
+        return;
+    }
+    start_xmit(s);
+}
+
+static void
+e1000_vm_state_change(void *opaque, int running, RunState state)
+{
+    E1000State *s = opaque;
+
+    if (running && s->mac_reg[TDH] != s->mac_reg[TDT]) {
+        qemu_bh_schedule(s->tx_bh);
+    }
+}
+
 static int
 receive_filter(E1000State *s, const uint8_t *buf, int size)
 {
@@ -1031,6 +1160,29 @@ e1000_can_receive(NetClientState *nc)
         e1000_has_rxbufs(s, 1);
 }
 
+/* Descriptors between RDH and RDT belong to the device and cannot change
+ * under our feet, so they are fetched several at a time and consumed from
+ * rx_desc_cache.
+ */
+static void
+e1000_fetch_rx_desc(E1000State *s, dma_addr_t base,
+                    struct e1000_rx_desc *desc)
+{
+    uint32_t rdh = s->mac_reg[RDH];
+    uint32_t n;
+
+    if (s->rx_cache_pos >= s->rx_cache_len || s->rx_cache_index != rdh) {
+        n = desc_batch_size(rdh, s->mac_reg[RDT],
+                            s->mac_reg[RDLEN] / sizeof(*desc));
+        pci_dma_read(PCI_DEVICE(s), base, s->rx_desc_cache, n * sizeof(*desc));
+        s->rx_cache_index = rdh;
+        s->rx_cache_pos = 0;
+        s->rx_cache_len = n;
+    }
+    *desc = s->rx_desc_cache[s->rx_cache_pos++];
+    s->rx_cache_index++;
+}
+
 static uint64_t rx_desc_base(E1000State *s)
 {
     uint64_t bah = s->mac_reg[RDBAH];
@@ -1127,7 +1279,7 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
             desc_size = s->rxbuf_size;
         }
         base = rx_desc_base(s) + sizeof(desc) * s->mac_reg[RDH];
-        pci_dma_read(d, base, &desc, sizeof(desc));
+        e1000_fetch_rx_desc(s, base, &desc);
         desc.special = vlan_special;
         desc.status |= (vlan_status | E1000_RXD_STAT_DD);
         if (desc.buffer_addr) {
@@ -1195,6 +1347,12 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
         s->rxbuf_min_shift)
         n |= E1000_ICS_RXDMT0;
 
+    if (chkflag(MIT) && s->mac_reg[RDTR]) {
+        n &= ~E1000_ICS_RXT0;
+        e1000_delay_cause(s->rx_delay_timer, &s->rx_abs_deadline,
+                          s->mac_reg[RDTR], s->mac_reg[RADV]);
+    }
+
     set_ics(s, 0, n);
 
     return size;
@@ -1310,7 +1468,33 @@ set_tctl(E1000State *s, int index, uint32_t val)
 {
     s->mac_reg[index] = val;
     s->mac_reg[TDT] &= 0xffff;
-    start_xmit(s);
+    /* Let the vCPU go back to the guest; several TDT writes in a row
+     * are then handled by a single pass over the ring.
+     */
+    qemu_bh_schedule(s->tx_bh);
+}
+
+static void
+set_rx_ring(E1000State *s, int index, uint32_t val)
+{
+    s->rx_cache_len = 0;
+    if (index == RDLEN) {
+        set_dlen(s, index, val);
+    } else if (index == RDH) {
+        set_16bit(s, index, val);
+    } else {
+        mac_writereg(s, index, val);
+    }
+}
+
+static void
+set_rdtr(E1000State *s, int index, uint32_t val)
+{
+    s->mac_reg[index] = val & 0xffff;
+    if ((val & E1000_RDTR_FPD) && timer_pending(s->rx_delay_timer)) {
+        timer_del(s->rx_delay_timer);
+        e1000_rx_delay_timer(s);
+    }
 }
 
 static void
@@ -1344,6 +1528,7 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(TDBAL),    getreg(TDBAH),    getreg(RDBAH),    getreg(RDBAL),
     getreg(TDLEN),    getreg(RDLEN),    getreg(RDTR),     getreg(RADV),
     getreg(TADV),     getreg(ITR),      getreg(FCRUC),    getreg(IPAV),
+    getreg(TIDV),
     getreg(WUC),      getreg(WUS),      getreg(SCC),      getreg(ECOL),
     getreg(MCC),      getreg(LATECOL),  getreg(COLC),     getreg(DC),
     getreg(TNCRS),    getreg(SEC),      getreg(CEXTERR),  getreg(RLEC),
@@ -1392,20 +1577,21 @@ enum { NREADOPS = ARRAY_SIZE(macreg_readops) };
 #define putreg(x)    [x] = mac_writereg
 static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     putreg(PBA),      putreg(EERD),     putreg(SWSM),     putreg(WUFC),
-    putreg(TDBAL),    putreg(TDBAH),    putreg(TXDCTL),   putreg(RDBAH),
-    putreg(RDBAL),    putreg(LEDCTL),   putreg(VET),      putreg(FCRUC),
+    putreg(TDBAL),    putreg(TDBAH),    putreg(TXDCTL),   putreg(LEDCTL),
+    putreg(VET),      putreg(FCRUC),
     putreg(TDFH),     putreg(TDFT),     putreg(TDFHS),    putreg(TDFTS),
     putreg(TDFPC),    putreg(RDFH),     putreg(RDFT),     putreg(RDFHS),
     putreg(RDFTS),    putreg(RDFPC),    putreg(IPAV),     putreg(WUC),
     putreg(WUS),      putreg(AIT),
 
-    [TDLEN]  = set_dlen,   [RDLEN]  = set_dlen,       [TCTL] = set_tctl,
+    [TDLEN]  = set_dlen,   [RDLEN]  = set_rx_ring,    [TCTL] = set_tctl,
     [TDT]    = set_tctl,   [MDIC]   = set_mdic,       [ICS]  = set_ics,
-    [TDH]    = set_16bit,  [RDH]    = set_16bit,      [RDT]  = set_rdt,
+    [TDH]    = set_16bit,  [RDH]    = set_rx_ring,    [RDT]  = set_rdt,
     [IMC]    = set_imc,    [IMS]    = set_ims,        [ICR]  = set_icr,
     [EECD]   = set_eecd,   [RCTL]   = set_rx_control, [CTRL] = set_ctrl,
-    [RDTR]   = set_16bit,  [RADV]   = set_16bit,      [TADV] = set_16bit,
-    [ITR]    = set_16bit,
+    [RDTR]   = set_rdtr,   [RADV]   = set_16bit,      [TADV] = set_16bit,
+    [ITR]    = set_16bit,  [TIDV]   = set_16bit,
+    [RDBAL]  = set_rx_ring, [RDBAH] = set_rx_ring,
 
     [IP6AT ... IP6AT+3] = &mac_writereg, [IP4AT ... IP4AT+6] = &mac_writereg,
     [FFLT ... FFLT+6]   = &mac_writereg,
@@ -1429,6 +1615,7 @@ enum { MAC_ACCESS_PARTIAL = 1, MAC_ACCESS_FLAG_NEEDED = 2 };
 static const uint8_t mac_reg_access[0x8000] = {
     [RDTR]    = markflag(MIT),    [TADV]    = markflag(MIT),
     [RADV]    = markflag(MIT),    [ITR]     = markflag(MIT),
+    [TIDV]    = markflag(MIT),
 
     [IPAV]    = markflag(MAC),    [WUC]     = markflag(MAC),
     [IP6AT]   = markflag(MAC),    [IP4AT]   = markflag(MAC),
@@ -1567,7 +1754,10 @@ static void e1000_pre_save(void *opaque)
     E1000State *s = opaque;
     NetClientState *nc = qemu_get_queue(s->nic);
 
-    /* If the mitigation timer is active, emulate a timeout now. */
+    /* Post the causes held back by the packet timers, and if the
+     * mitigation timer is active, emulate a timeout now.
+     */
+    e1000_flush_delayed_causes(s);
     if (s->mit_timer_on) {
         e1000_mit_timer(s);
     }
@@ -1589,11 +1779,14 @@ static int e1000_post_load(void *opaque, int version_id)
 
     if (!chkflag(MIT)) {
         s->mac_reg[ITR] = s->mac_reg[RDTR] = s->mac_reg[RADV] =
-            s->mac_reg[TADV] = 0;
+            s->mac_reg[TADV] = s->mac_reg[TIDV] = 0;
         s->mit_irq_level = false;
     }
     s->mit_ide = 0;
     s->mit_timer_on = false;
+    s->rx_abs_deadline = 0;
+    s->tx_abs_deadline = 0;
+    s->rx_cache_len = 0;
 
     /* nc.link_down can't be migrated, so infer link_down according
      * to link status bit in mac_reg[STATUS].
@@ -1617,6 +1810,13 @@ static bool e1000_mit_state_needed(void *opaque)
     return chkflag(MIT);
 }
 
+static bool e1000_tidv_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    return chkflag(MIT) && s->mac_reg[TIDV];
+}
+
 static bool e1000_full_mac_needed(void *opaque)
 {
     E1000State *s = opaque;
@@ -1639,6 +1839,17 @@ static const VMStateDescription vmstate_e1000_mit_state = {
     }
 };
 
+static const VMStateDescription vmstate_e1000_tidv = {
+    .name = "e1000/tidv",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = e1000_tidv_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(mac_reg[TIDV], E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_e1000_full_mac_state = {
     .name = "e1000/full_mac_state",
     .version_id = 1,
@@ -1729,6 +1940,7 @@ static const VMStateDescription vmstate_e1000 = {
     },
     .subsections = (const VMStateDescription*[]) {
         &vmstate_e1000_mit_state,
+        &vmstate_e1000_tidv,
         &vmstate_e1000_full_mac_state,
         NULL
     }
@@ -1778,6 +1990,12 @@ pci_e1000_uninit(PCIDevice *dev)
     timer_free(d->autoneg_timer);
     timer_del(d->mit_timer);
     timer_free(d->mit_timer);
+    timer_del(d->rx_delay_timer);
+    timer_free(d->rx_delay_timer);
+    timer_del(d->tx_delay_timer);
+    timer_free(d->tx_delay_timer);
+    qemu_bh_delete(d->tx_bh);
+    qemu_del_vm_change_state_handler(d->vmstate);
     qemu_del_nic(d->nic);
 }
 
@@ -1848,6 +2066,12 @@ static void pci_e1000_realize(PCIDevice *pci_dev, Error **errp)
 
     d->autoneg_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, e1000_autoneg_timer, d);
     d->mit_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, e1000_mit_timer, d);
+    d->rx_delay_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                     e1000_rx_delay_timer, d);
+    d->tx_delay_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                     e1000_tx_delay_timer, d);
+    d->tx_bh = qemu_bh_new(e1000_tx_bh, d);
+    d->vmstate = qemu_add_vm_change_state_handler(e1000_vm_state_change, d);
 }
 
 static void qdev_e1000_reset(DeviceState *dev)
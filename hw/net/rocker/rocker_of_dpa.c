@@ -34,6 +34,7 @@ static const MACAddr ff_mac =   { .a = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff } };
 typedef struct of_dpa {
     World *world;
     GHashTable *flow_tbl;
+    GHashTable *flow_cache;
     GHashTable *group_tbl;
     unsigned int flow_tbl_max_size;
     unsigned int group_tbl_max_size;
@@ -336,13 +337,63 @@ static void _of_dpa_flow_match(void *key, void *value, void *user_data)
     }
 }
 
+/* Exact-match cache of of_dpa_flow_match() results, keyed on the match
+ * value.  Lookups that missed are cached too, with a NULL flow.  The
+ * cache is flushed whenever a flow is added, modified or deleted.
+ */
+
+#define OF_DPA_FLOW_CACHE_MAX_SIZE 4096
+
+static guint of_dpa_flow_cache_hash(gconstpointer v)
+{
+    const OfDpaFlowKey *key = v;
+    const uint64_t *k = v;
+    uint64_t h = key->width;
+    int i;
+
+    for (i = 0; i < key->width; i++) {
+        h = (h ^ k[i]) * 0x100000001b3ULL;
+    }
+
+    return (guint)(h ^ (h >> 32));
+}
+
+static gboolean of_dpa_flow_cache_equal(gconstpointer v1, gconstpointer v2)
+{
+    const OfDpaFlowKey *key1 = v1;
+    const OfDpaFlowKey *key2 = v2;
+
+    return key1->width == key2->width &&
+           !memcmp(key1, key2, key1->width * sizeof(uint64_t));
+}
+
+static void of_dpa_flow_cache_flush(OfDpa *of_dpa)
+{
+    g_hash_table_remove_all(of_dpa->flow_cache);
+}
+
 static OfDpaFlow *of_dpa_flow_match(OfDpa *of_dpa, OfDpaFlowMatch *match)
 {
+    gpointer flow;
+
+    if (g_hash_table_lookup_extended(of_dpa->flow_cache, &match->value,
+                                     NULL, &flow)) {
+        match->best = flow;
+        return match->best;
+    }
+
     DPRINTF("\nnew search\n");
     of_dpa_flow_key_dump(&match->value, NULL);
 
     g_hash_table_foreach(of_dpa->flow_tbl, _of_dpa_flow_match, match);
 
+    if (g_hash_table_size(of_dpa->flow_cache) >= OF_DPA_FLOW_CACHE_MAX_SIZE) {
+        of_dpa_flow_cache_flush(of_dpa);
+    }
+    g_hash_table_insert(of_dpa->flow_cache,
+                        g_memdup(&match->value, sizeof(match->value)),
+                        match->best);
+
     return match->best;
 }
 
@@ -353,6 +404,7 @@ static OfDpaFlow *of_dpa_flow_find(OfDpa *of_dpa, uint64_t cookie)
 
 static int of_dpa_flow_add(OfDpa *of_dpa, OfDpaFlow *flow)
 {
+    of_dpa_flow_cache_flush(of_dpa);
     g_hash_table_insert(of_dpa->flow_tbl, &flow->cookie, flow);
 
     return ROCKER_OK;
@@ -360,6 +412,7 @@ static int of_dpa_flow_add(OfDpa *of_dpa, OfDpaFlow *flow)
 
 static void of_dpa_flow_del(OfDpa *of_dpa, OfDpaFlow *flow)
 {
+    of_dpa_flow_cache_flush(of_dpa);
     g_hash_table_remove(of_dpa->flow_tbl, &flow->cookie);
 }
 
@@ -1890,6 +1943,8 @@ static int of_dpa_cmd_flow_mod(OfDpa *of_dpa, uint64_t cookie,
         return -ROCKER_ENOENT;
     }
 
+    of_dpa_flow_cache_flush(of_dpa);
+
     return of_dpa_cmd_flow_add_mod(of_dpa, flow, flow_tlvs);
 }
 
@@ -2280,6 +2335,13 @@ static int of_dpa_init(World *world)
         return -ENOMEM;
     }
 
+    of_dpa->flow_cache = g_hash_table_new_full(of_dpa_flow_cache_hash,
+                                               of_dpa_flow_cache_equal,
+                                               g_free, NULL);
+    if (!of_dpa->flow_cache) {
+        goto err_flow_cache;
+    }
+
     of_dpa->group_tbl = g_hash_table_new_full(g_int_hash, g_int_equal,
                                               NULL, g_free);
     if (!of_dpa->group_tbl) {
@@ -2293,6 +2355,8 @@ static int of_dpa_init(World *world)
     return 0;
 
 err_group_tbl:
+    g_hash_table_destroy(of_dpa->flow_cache);
+err_flow_cache:
     g_hash_table_destroy(of_dpa->flow_tbl);
     return -ENOMEM;
 }
@@ -2302,6 +2366,7 @@ static void of_dpa_uninit(World *world)
     OfDpa *of_dpa = world_private(world);
 
     g_hash_table_destroy(of_dpa->group_tbl);
+    g_hash_table_destroy(of_dpa->flow_cache);
     g_hash_table_destroy(of_dpa->flow_tbl);
 }
 
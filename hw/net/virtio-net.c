@@ -17,9 +17,13 @@
 #include "net/net.h"
 #include "net/checksum.h"
 #include "net/tap.h"
+#include "net/eth.h"
+#include "net/gso.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
 #include "hw/virtio/virtio-net.h"
+#include "migration/migration.h"
+#include "monitor/qdev.h"
 #include "net/vhost_net.h"
 #include "hw/virtio/virtio-bus.h"
 #include "qapi/qmp/qjson.h"
@@ -39,20 +43,32 @@
     (offsetof(container, field) + sizeof(((container *)0)->field))
 
 typedef struct VirtIOFeature {
-    uint32_t flags;
+    uint64_t flags;
     size_t end;
 } VirtIOFeature;
 
 static VirtIOFeature feature_sizes[] = {
-    {.flags = 1 << VIRTIO_NET_F_MAC,
+    {.flags = 1ULL << VIRTIO_NET_F_MAC,
      .end = endof(struct virtio_net_config, mac)},
-    {.flags = 1 << VIRTIO_NET_F_STATUS,
+    {.flags = 1ULL << VIRTIO_NET_F_STATUS,
      .end = endof(struct virtio_net_config, status)},
-    {.flags = 1 << VIRTIO_NET_F_MQ,
+    {.flags = 1ULL << VIRTIO_NET_F_MQ,
      .end = endof(struct virtio_net_config, max_virtqueue_pairs)},
+    {.flags = 1ULL << VIRTIO_NET_F_RSS,
+     .end = endof(struct virtio_net_config, supported_hash_types)},
+    {.flags = 1ULL << VIRTIO_NET_F_HASH_REPORT,
+     .end = endof(struct virtio_net_config, supported_hash_types)},
     {}
 };
 
+/* The hash types that virtio_net_rss_input() knows about */
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv6)
+
 static VirtIONetQueue *virtio_net_get_subqueue(NetClientState *nc)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
@@ -72,11 +88,16 @@ static int vq2q(int queue_index)
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
-    struct virtio_net_config netcfg;
+    struct virtio_net_config netcfg = {};
 
     virtio_stw_p(vdev, &netcfg.status, n->status);
     virtio_stw_p(vdev, &netcfg.max_virtqueue_pairs, n->max_queues);
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
+    netcfg.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    virtio_stw_p(vdev, &netcfg.rss_max_indirection_table_length,
+                 VIRTIO_NET_RSS_MAX_TABLE_LEN);
+    virtio_stl_p(vdev, &netcfg.supported_hash_types,
+                 VIRTIO_NET_RSS_SUPPORTED_HASHES);
     memcpy(config, &netcfg, n->config_size);
 }
 
@@ -213,6 +234,32 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static void failover_add_primary(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    DeviceState *dev;
+    Error *err = NULL;
+
+    if (n->primary_dev || !n->primary_opts ||
+        !virtio_vdev_has_feature(vdev, VIRTIO_NET_F_STANDBY)) {
+        return;
+    }
+
+    /* Not while an incoming migration is still loading device state */
+    if (!vdev->vm_running) {
+        n->primary_pending = true;
+        return;
+    }
+    n->primary_pending = false;
+
+    dev = qdev_device_add(n->primary_opts, &err);
+    if (!dev) {
+        error_report_err(err);
+        return;
+    }
+    object_unref(OBJECT(dev));
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -223,6 +270,10 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
+    if (n->primary_pending && vdev->vm_running) {
+        failover_add_primary(n);
+    }
+
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
         bool queue_started;
@@ -380,9 +431,81 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
     return info;
 }
 
+static void virtio_net_coal_fire(VirtIONetCoal *c)
+{
+    timer_del(c->timer);
+    c->pending = 0;
+    c->last = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    virtio_notify(VIRTIO_DEVICE(c->n), c->vq);
+}
+
+static void virtio_net_coal_timer(void *opaque)
+{
+    VirtIONetCoal *c = opaque;
+
+    if (c->pending) {
+        virtio_net_coal_fire(c);
+    }
+}
+
+/*
+ * Notify the guest of @used new buffers in the used ring, or delay the
+ * notification as the coalescing parameters allow.  A queue that has
+ * been quiet for longer than usecs notifies at once, so that coalescing
+ * only adds latency under load.
+ */
+static void virtio_net_coal_notify(VirtIONetCoal *c, unsigned int used)
+{
+    const VirtIONetCoalParams *p = c->params;
+    int64_t now;
+
+    if (!p->usecs) {
+        virtio_notify(VIRTIO_DEVICE(c->n), c->vq);
+        return;
+    }
+
+    c->pending += used;
+    if (p->frames && c->pending >= p->frames) {
+        virtio_net_coal_fire(c);
+        return;
+    }
+
+    if (timer_pending(c->timer)) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    if (now - c->last >= (int64_t)p->usecs * SCALE_US) {
+        virtio_net_coal_fire(c);
+    } else {
+        timer_mod(c->timer, c->last + (int64_t)p->usecs * SCALE_US);
+    }
+}
+
+/* Send the notifications that are being delayed */
+static void virtio_net_coal_flush(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        virtio_net_coal_timer(&n->vqs[i].rx_coal);
+        virtio_net_coal_timer(&n->vqs[i].tx_coal);
+    }
+}
+
+static void virtio_net_disable_rss(VirtIONet *n)
+{
+    g_free(n->rss.indirections_table);
+    n->rss.indirections_table = NULL;
+    n->rss.indirections_len = 0;
+    n->rss.redirect = false;
+    n->rss.hash_types = 0;
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    int i;
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -396,6 +519,15 @@ static void virtio_net_reset(VirtIODevice *vdev)
     timer_del(n->announce_timer);
     n->announce_counter = 0;
     n->status &= ~VIRTIO_NET_S_ANNOUNCE;
+    virtio_net_disable_rss(n);
+    n->rx_coal = n->net_conf.rx_coal;
+    n->tx_coal = n->net_conf.tx_coal;
+    for (i = 0; i < n->max_queues; i++) {
+        timer_del(n->vqs[i].rx_coal.timer);
+        n->vqs[i].rx_coal.pending = 0;
+        timer_del(n->vqs[i].tx_coal.timer);
+        n->vqs[i].tx_coal.pending = 0;
+    }
 
     /* Flush any MAC and VLAN filter table state */
     n->mac_table.in_use = 0;
@@ -434,15 +566,19 @@ static int peer_has_ufo(VirtIONet *n)
 }
 
 static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs,
-                                       int version_1)
+                                       int version_1, int hash_report)
 {
     int i;
     NetClientState *nc;
 
     n->mergeable_rx_bufs = mergeable_rx_bufs;
+    /* The longer header only exists in VIRTIO 1.0 */
+    n->rss.populate_hash = version_1 && hash_report;
 
     if (version_1) {
-        n->guest_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+        n->guest_hdr_len = hash_report ?
+            sizeof(struct virtio_net_hdr_v1_hash) :
+            sizeof(struct virtio_net_hdr_mrg_rxbuf);
     } else {
         n->guest_hdr_len = n->mergeable_rx_bufs ?
             sizeof(struct virtio_net_hdr_mrg_rxbuf) :
@@ -528,10 +664,13 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
     virtio_add_feature(&features, VIRTIO_NET_F_MAC);
 
     if (!peer_has_vnet_hdr(n)) {
-        virtio_clear_feature(&features, VIRTIO_NET_F_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO4);
-        virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
-        virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
+        /* Without sw_gso, the backend would get the packets as is */
+        if (!n->net_conf.sw_gso) {
+            virtio_clear_feature(&features, VIRTIO_NET_F_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO4);
+            virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
+            virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
+        }
 
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
@@ -544,9 +683,20 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_UFO);
     }
 
+    if (!virtio_has_feature(features, VIRTIO_NET_F_CTRL_VQ)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_NOTF_COAL);
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+        virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
+    }
+
     if (!get_vhost_net(nc->peer)) {
         return features;
     }
+
+    /* vhost sends the notifications and picks the queues itself */
+    virtio_clear_feature(&features, VIRTIO_NET_F_NOTF_COAL);
+    virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
     return vhost_net_get_features(get_vhost_net(nc->peer), features);
 }
 
@@ -605,7 +755,9 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
                                virtio_has_feature(features,
                                                   VIRTIO_NET_F_MRG_RXBUF),
                                virtio_has_feature(features,
-                                                  VIRTIO_F_VERSION_1));
+                                                  VIRTIO_F_VERSION_1),
+                               virtio_has_feature(features,
+                                                  VIRTIO_NET_F_HASH_REPORT));
 
     if (n->has_vnet_hdr) {
         n->curr_guest_offloads =
@@ -627,6 +779,11 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
     } else {
         memset(n->vlans, 0xff, MAX_VLAN >> 3);
     }
+
+    if (virtio_has_feature(features, VIRTIO_NET_F_STANDBY)) {
+        qapi_event_send_failover_negotiated(n->netclient_name, &error_abort);
+        failover_add_primary(n);
+    }
 }
 
 static int virtio_net_handle_rx_mode(VirtIONet *n, uint8_t cmd,
@@ -699,6 +856,42 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
     }
 }
 
+static int virtio_net_handle_coal(VirtIONet *n, uint8_t cmd,
+                                  struct iovec *iov, unsigned int iov_cnt)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct virtio_net_ctrl_coal_rx rx;
+    struct virtio_net_ctrl_coal_tx tx;
+    size_t s;
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_NOTF_COAL)) {
+        return VIRTIO_NET_ERR;
+    }
+
+    if (cmd == VIRTIO_NET_CTRL_NOTF_COAL_RX_SET) {
+        s = iov_to_buf(iov, iov_cnt, 0, &rx, sizeof(rx));
+        if (s != sizeof(rx)) {
+            return VIRTIO_NET_ERR;
+        }
+        n->rx_coal.frames = le32_to_cpu(rx.rx_max_packets);
+        n->rx_coal.usecs = le32_to_cpu(rx.rx_usecs);
+    } else if (cmd == VIRTIO_NET_CTRL_NOTF_COAL_TX_SET) {
+        s = iov_to_buf(iov, iov_cnt, 0, &tx, sizeof(tx));
+        if (s != sizeof(tx)) {
+            return VIRTIO_NET_ERR;
+        }
+        n->tx_coal.frames = le32_to_cpu(tx.tx_max_packets);
+        n->tx_coal.usecs = le32_to_cpu(tx.tx_usecs);
+    } else {
+        return VIRTIO_NET_ERR;
+    }
+
+    /* Do not keep the guest waiting on the old parameters */
+    virtio_net_coal_flush(n);
+
+    return VIRTIO_NET_OK;
+}
+
 static int virtio_net_handle_mac(VirtIONet *n, uint8_t cmd,
                                  struct iovec *iov, unsigned int iov_cnt)
 {
@@ -841,6 +1034,98 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+/*
+ * VIRTIO_NET_CTRL_MQ_RSS_CONFIG if @do_rss, VIRTIO_NET_CTRL_MQ_HASH_CONFIG
+ * otherwise.  The latter has the same layout, with a single entry in the
+ * indirection table and no max_tx_vq, and only sets the hash parameters.
+ */
+static int virtio_net_handle_rss(VirtIONet *n, struct iovec *iov,
+                                 unsigned int iov_cnt, bool do_rss)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct virtio_net_rss_config cfg;
+    struct {
+        uint16_t max_tx_vq;
+        uint8_t hash_key_length;
+    } QEMU_PACKED tail;
+    uint16_t *table = NULL;
+    uint16_t table_len, default_queue, queues, i;
+    size_t s, offset;
+
+    offset = offsetof(struct virtio_net_rss_config, indirection_table);
+    s = iov_to_buf(iov, iov_cnt, 0, &cfg, offset);
+    if (s != offset) {
+        goto error;
+    }
+
+    if (do_rss) {
+        table_len = virtio_lduw_p(vdev, &cfg.indirection_table_mask) + 1;
+        default_queue = virtio_lduw_p(vdev, &cfg.unclassified_queue);
+    } else {
+        table_len = 1;
+        default_queue = 0;
+    }
+    if (table_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        (table_len & (table_len - 1))) {
+        goto error;
+    }
+
+    table = g_new(uint16_t, table_len);
+    s = iov_to_buf(iov, iov_cnt, offset, table, table_len * sizeof(*table));
+    if (s != table_len * sizeof(*table)) {
+        goto error;
+    }
+    offset += s;
+
+    s = iov_to_buf(iov, iov_cnt, offset, &tail, sizeof(tail));
+    if (s != sizeof(tail)) {
+        goto error;
+    }
+    offset += s;
+
+    queues = do_rss ? virtio_lduw_p(vdev, &tail.max_tx_vq) : n->curr_queues;
+    if (queues == 0 || queues > n->max_queues || default_queue >= queues) {
+        goto error;
+    }
+    for (i = 0; i < table_len; i++) {
+        table[i] = do_rss ? virtio_lduw_p(vdev, &table[i]) : 0;
+        if (table[i] >= queues) {
+            goto error;
+        }
+    }
+
+    n->rss.hash_types = virtio_ldl_p(vdev, &cfg.hash_types) &
+                        VIRTIO_NET_RSS_SUPPORTED_HASHES;
+    if (tail.hash_key_length > VIRTIO_NET_RSS_MAX_KEY_SIZE ||
+        (n->rss.hash_types && !tail.hash_key_length)) {
+        goto error;
+    }
+    memset(n->rss.key, 0, sizeof(n->rss.key));
+    s = iov_to_buf(iov, iov_cnt, offset, n->rss.key, tail.hash_key_length);
+    if (s != tail.hash_key_length) {
+        goto error;
+    }
+
+    g_free(n->rss.indirections_table);
+    n->rss.indirections_table = table;
+    n->rss.indirections_len = table_len;
+    n->rss.default_queue = default_queue;
+    n->rss.redirect = do_rss;
+
+    if (queues != n->curr_queues) {
+        n->curr_queues = queues;
+        virtio_net_set_status(vdev, vdev->status);
+        virtio_net_set_queues(n);
+    }
+
+    return VIRTIO_NET_OK;
+
+error:
+    g_free(table);
+    virtio_net_disable_rss(n);
+    return VIRTIO_NET_ERR;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
@@ -849,6 +1134,15 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     size_t s;
     uint16_t queues;
 
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG &&
+        virtio_vdev_has_feature(vdev, VIRTIO_NET_F_RSS)) {
+        return virtio_net_handle_rss(n, iov, iov_cnt, true);
+    }
+    if (cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG &&
+        virtio_vdev_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT)) {
+        return virtio_net_handle_rss(n, iov, iov_cnt, false);
+    }
+
     s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
     if (s != sizeof(mq)) {
         return VIRTIO_NET_ERR;
@@ -867,6 +1161,9 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
         return VIRTIO_NET_ERR;
     }
 
+    /* Back to the queue that the backend picks */
+    virtio_net_disable_rss(n);
+
     n->curr_queues = queues;
     /* stop the backend before changing the number of queues to avoid handling a
      * disabled queue */
@@ -914,6 +1211,8 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             status = virtio_net_handle_mq(n, ctrl.cmd, iov, iov_cnt);
         } else if (ctrl.class == VIRTIO_NET_CTRL_GUEST_OFFLOADS) {
             status = virtio_net_handle_offloads(n, ctrl.cmd, iov, iov_cnt);
+        } else if (ctrl.class == VIRTIO_NET_CTRL_NOTF_COAL) {
+            status = virtio_net_handle_coal(n, ctrl.cmd, iov, iov_cnt);
         }
 
         s = iov_from_buf(elem->in_sg, elem->in_num, 0, &status, sizeof(status));
@@ -932,6 +1231,15 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    int i;
+
+    if (n->rss.redirect) {
+        /* Packets for this queue may be waiting in any of the backends */
+        for (i = 0; i < n->curr_queues; i++) {
+            qemu_flush_queued_packets(qemu_get_subqueue(n->nic, i));
+        }
+        return;
+    }
 
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 }
@@ -1089,7 +1397,119 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/*
+ * Build in @input the Toeplitz input for the packet at @pkt, from the
+ * header fields that @hash_types selects, and return the
+ * VIRTIO_NET_HASH_REPORT_* type of the hash.  The ports are only hashed
+ * when the L4 header directly follows the IP header, i.e. not for IPv4
+ * fragments nor for IPv6 packets with extension headers.
+ */
+static uint16_t virtio_net_rss_input(uint32_t hash_types, const uint8_t *pkt,
+                                     size_t size, uint8_t *input,
+                                     size_t *input_len)
+{
+    const struct ip_header *ip;
+    struct iovec iov = {
+        .iov_base = (void *)pkt,
+        .iov_len = size,
+    };
+    size_t l2len, l3len;
+    uint8_t l4proto;
+    bool ports;
+
+    if (size < ETH_MAX_L2_HDR_LEN) {
+        return VIRTIO_NET_HASH_REPORT_NONE;
+    }
+    l2len = eth_get_l2_hdr_length(pkt);
+
+    switch (eth_get_l3_proto(pkt, l2len)) {
+    case ETH_P_IP:
+        ip = (const struct ip_header *)(pkt + l2len);
+        if (size < l2len + sizeof(*ip) ||
+            IP_HEADER_VERSION(ip) != IP_HEADER_VERSION_4) {
+            return VIRTIO_NET_HASH_REPORT_NONE;
+        }
+        l3len = IP_HDR_GET_LEN(ip);
+        ports = !(be16_to_cpu(ip->ip_off) & (IP_MF | IP_OFFMASK)) &&
+                size >= l2len + l3len + 2 * sizeof(uint16_t);
+
+        /* Source and destination addresses, then ports */
+        memcpy(input, &ip->ip_src, 2 * sizeof(uint32_t));
+        memcpy(input + 8, pkt + l2len + l3len, ports ? 4 : 0);
+        *input_len = ports ? 12 : 8;
+
+        if (ports && ip->ip_p == IP_PROTO_TCP &&
+            (hash_types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) {
+            return VIRTIO_NET_HASH_REPORT_TCPv4;
+        }
+        if (ports && ip->ip_p == IP_PROTO_UDP &&
+            (hash_types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)) {
+            return VIRTIO_NET_HASH_REPORT_UDPv4;
+        }
+        *input_len = 8;
+        return hash_types & VIRTIO_NET_RSS_HASH_TYPE_IPv4 ?
+               VIRTIO_NET_HASH_REPORT_IPv4 : VIRTIO_NET_HASH_REPORT_NONE;
+
+    case ETH_P_IPV6:
+        if (!eth_parse_ipv6_hdr(&iov, 1, l2len, &l4proto, &l3len)) {
+            return VIRTIO_NET_HASH_REPORT_NONE;
+        }
+        ports = l3len == sizeof(struct ip6_header) &&
+                size >= l2len + l3len + 2 * sizeof(uint16_t);
+
+        memcpy(input, pkt + l2len + offsetof(struct ip6_header, ip6_src),
+               2 * sizeof(struct in6_address));
+        memcpy(input + 32, pkt + l2len + l3len, ports ? 4 : 0);
+        *input_len = ports ? 36 : 32;
+
+        if (ports && l4proto == IP_PROTO_TCP &&
+            (hash_types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6)) {
+            return VIRTIO_NET_HASH_REPORT_TCPv6;
+        }
+        if (ports && l4proto == IP_PROTO_UDP &&
+            (hash_types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6)) {
+            return VIRTIO_NET_HASH_REPORT_UDPv6;
+        }
+        *input_len = 32;
+        return hash_types & VIRTIO_NET_RSS_HASH_TYPE_IPv6 ?
+               VIRTIO_NET_HASH_REPORT_IPv6 : VIRTIO_NET_HASH_REPORT_NONE;
+
+    default:
+        return VIRTIO_NET_HASH_REPORT_NONE;
+    }
+}
+
+/*
+ * Hash the packet in @buf as the guest asked, fill @hash with what to
+ * report in the vnet header and return the receive queue to use.
+ */
+static int virtio_net_process_rss(VirtIONet *n, const uint8_t *buf,
+                                  size_t size,
+                                  struct virtio_net_hdr_v1_hash *hash)
+{
+    uint8_t input[2 * sizeof(struct in6_address) + 2 * sizeof(uint16_t)];
+    size_t input_len;
+    uint32_t value;
+    uint16_t report;
+
+    report = virtio_net_rss_input(n->rss.hash_types, buf + n->host_hdr_len,
+                                  size - n->host_hdr_len, input, &input_len);
+    if (report == VIRTIO_NET_HASH_REPORT_NONE) {
+        return n->rss.default_queue;
+    }
+
+    value = eth_toeplitz_hash(n->rss.key, sizeof(n->rss.key),
+                              input, input_len);
+    hash->hash_value = cpu_to_le32(value);
+    hash->hash_report = cpu_to_le16(report);
+
+    return n->rss.indirections_table[value & (n->rss.indirections_len - 1)];
+}
+
+static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
+                                     size_t size,
+                                     const struct virtio_net_hdr_v1_hash *hash,
+                                     bool batch)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1150,6 +1570,12 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
             }
 
             receive_header(n, sg, elem->in_num, buf, size);
+            if (n->rss.populate_hash) {
+                offset = offsetof(struct virtio_net_hdr_v1_hash, hash_value);
+                iov_from_buf(sg, elem->in_num, offset,
+                             (uint8_t *)hash + offset,
+                             sizeof(*hash) - offset);
+            }
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1167,13 +1593,13 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
          * Otherwise, drop it. */
         if (!n->mergeable_rx_bufs && offset < size) {
             virtqueue_discard(q->rx_vq, elem, total);
-            g_free(elem);
+            virtqueue_free_element(q->rx_vq, elem);
             return size;
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, elem, total, i++);
-        g_free(elem);
+        virtqueue_fill(q->rx_vq, elem, total, q->rx_pending + i++);
+        virtqueue_free_element(q->rx_vq, elem);
     }
 
     if (mhdr_cnt) {
@@ -1183,24 +1609,60 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (batch) {
+        /* Published by virtio_net_flush_batch() */
+        q->rx_pending += i;
+    } else {
+        virtqueue_flush(q->rx_vq, i);
+        virtio_net_coal_notify(&q->rx_coal, i);
+    }
 
     return size;
 }
 
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    struct virtio_net_hdr_v1_hash hash = {};
+    int index;
+
+    if (n->rss.redirect || n->rss.populate_hash) {
+        index = virtio_net_process_rss(n, buf, size, &hash);
+        if (n->rss.redirect && index != nc->queue_index) {
+            /*
+             * The batch of @nc only flushes its own queue, so this
+             * packet is published right away.
+             */
+            return virtio_net_do_receive(qemu_get_subqueue(n->nic, index),
+                                         buf, size, &hash, false);
+        }
+    }
+
+    return virtio_net_do_receive(nc, buf, size, &hash, nc->receive_batch);
+}
+
+static void virtio_net_flush_batch(NetClientState *nc)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (q->rx_pending) {
+        virtqueue_flush(q->rx_vq, q->rx_pending);
+        virtio_net_coal_notify(&q->rx_coal, q->rx_pending);
+        q->rx_pending = 0;
+    }
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
-    VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_coal_notify(&q->tx_coal, 1);
 
-    g_free(q->async_tx.elem);
+    virtqueue_free_element(q->tx_vq, q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
@@ -1212,7 +1674,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
+    VirtQueueElement *elem, *batch[VIRTIO_NET_TX_BATCH];
+    unsigned int batch_len = 0, batch_pos = 0, used = 0;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -1230,10 +1693,17 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
         struct virtio_net_hdr_mrg_rxbuf mhdr;
 
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
-            break;
+        if (batch_pos == batch_len) {
+            batch_len = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                            (void **)batch,
+                                            MIN(VIRTIO_NET_TX_BATCH,
+                                                n->tx_burst - num_packets));
+            batch_pos = 0;
+            if (!batch_len) {
+                break;
+            }
         }
+        elem = batch[batch_pos++];
 
         out_num = elem->out_num;
         out_sg = elem->out_sg;
@@ -1261,6 +1731,14 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
                 out_num += 1;
                 out_sg = sg2;
 	    }
+        } else if (n->net_conf.sw_gso) {
+            /* Segmented in software, see net_gso_sendv_packet_async() */
+            if (iov_to_buf(out_sg, out_num, 0, &mhdr, sizeof(mhdr.hdr)) <
+                sizeof(mhdr.hdr)) {
+                error_report("virtio-net header incorrect");
+                exit(1);
+            }
+            virtio_net_hdr_swap(vdev, &mhdr.hdr);
         }
         /*
          * If host wants to see the guest header as is, we can
@@ -1279,23 +1757,42 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             out_sg = sg;
         }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
+        if (!n->has_vnet_hdr && n->net_conf.sw_gso) {
+            ret = net_gso_sendv_packet_async(
+                      qemu_get_subqueue(n->nic, queue_index), &mhdr.hdr,
+                      out_sg, out_num, virtio_net_tx_complete);
+        } else {
+            ret = qemu_sendv_packet_async(
+                      qemu_get_subqueue(n->nic, queue_index),
+                      out_sg, out_num, virtio_net_tx_complete);
+        }
         if (ret == 0) {
+            /* Give back the rest of the batch, last popped first */
+            while (batch_len > batch_pos) {
+                elem = batch[--batch_len];
+                virtqueue_discard(q->tx_vq, elem, 0);
+                virtqueue_free_element(q->tx_vq, elem);
+            }
             virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            return -EBUSY;
+            q->async_tx.elem = batch[batch_pos - 1];
+            num_packets = -EBUSY;
+            break;
         }
 
 drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+        /* The used entries are published once, after the loop */
+        virtqueue_fill(q->tx_vq, elem, 0, used++);
+        virtqueue_free_element(q->tx_vq, elem);
 
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+
+    if (used) {
+        virtqueue_flush(q->tx_vq, used);
+        virtio_net_coal_notify(&q->tx_coal, used);
+    }
     return num_packets;
 }
 
@@ -1427,6 +1924,19 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
 
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
+
+    n->vqs[index].rx_coal.vq = n->vqs[index].rx_vq;
+    n->vqs[index].rx_coal.params = &n->rx_coal;
+    n->vqs[index].rx_coal.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                               virtio_net_coal_timer,
+                                               &n->vqs[index].rx_coal);
+    n->vqs[index].rx_coal.n = n;
+    n->vqs[index].tx_coal.vq = n->vqs[index].tx_vq;
+    n->vqs[index].tx_coal.params = &n->tx_coal;
+    n->vqs[index].tx_coal.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                               virtio_net_coal_timer,
+                                               &n->vqs[index].tx_coal);
+    n->vqs[index].tx_coal.n = n;
 }
 
 static void virtio_net_del_queue(VirtIONet *n, int index)
@@ -1437,6 +1947,11 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
 
     qemu_purge_queued_packets(nc);
 
+    timer_del(q->rx_coal.timer);
+    timer_free(q->rx_coal.timer);
+    timer_del(q->tx_coal.timer);
+    timer_free(q->tx_coal.timer);
+
     virtio_del_queue(vdev, index * 2);
     if (q->tx_timer) {
         timer_del(q->tx_timer);
@@ -1508,6 +2023,9 @@ static void virtio_net_save_device(VirtIODevice *vdev, QEMUFile *f)
     VirtIONet *n = VIRTIO_NET(vdev);
     int i;
 
+    /* Delayed notifications are not migrated, send them now */
+    virtio_net_coal_flush(n);
+
     qemu_put_buffer(f, n->mac, ETH_ALEN);
     qemu_put_be32(f, n->vqs[0].tx_waiting);
     qemu_put_be32(f, n->mergeable_rx_bufs);
@@ -1536,6 +2054,25 @@ static void virtio_net_save_device(VirtIODevice *vdev, QEMUFile *f)
     if (virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_GUEST_OFFLOADS)) {
         qemu_put_be64(f, n->curr_guest_offloads);
     }
+
+    if (virtio_host_has_feature(vdev, VIRTIO_NET_F_NOTF_COAL)) {
+        qemu_put_be32(f, n->rx_coal.usecs);
+        qemu_put_be32(f, n->rx_coal.frames);
+        qemu_put_be32(f, n->tx_coal.usecs);
+        qemu_put_be32(f, n->tx_coal.frames);
+    }
+
+    if (virtio_host_has_feature(vdev, VIRTIO_NET_F_RSS) ||
+        virtio_host_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT)) {
+        qemu_put_byte(f, n->rss.redirect);
+        qemu_put_be32(f, n->rss.hash_types);
+        qemu_put_buffer(f, n->rss.key, sizeof(n->rss.key));
+        qemu_put_be16(f, n->rss.default_queue);
+        qemu_put_be16(f, n->rss.indirections_len);
+        for (i = 0; i < n->rss.indirections_len; i++) {
+            qemu_put_be16(f, n->rss.indirections_table[i]);
+        }
+    }
 }
 
 static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
@@ -1582,7 +2119,9 @@ static int virtio_net_load_device(VirtIODevice *vdev, QEMUFile *f,
 
     virtio_net_set_mrg_rx_bufs(n, qemu_get_be32(f),
                                virtio_vdev_has_feature(vdev,
-                                                       VIRTIO_F_VERSION_1));
+                                                       VIRTIO_F_VERSION_1),
+                               virtio_vdev_has_feature(vdev,
+                                                   VIRTIO_NET_F_HASH_REPORT));
 
     if (version_id >= 3)
         n->status = qemu_get_be16(f);
@@ -1665,6 +2204,43 @@ static int virtio_net_load_device(VirtIODevice *vdev, QEMUFile *f,
         }
     }
 
+    if (virtio_host_has_feature(vdev, VIRTIO_NET_F_NOTF_COAL)) {
+        n->rx_coal.usecs = qemu_get_be32(f);
+        n->rx_coal.frames = qemu_get_be32(f);
+        n->tx_coal.usecs = qemu_get_be32(f);
+        n->tx_coal.frames = qemu_get_be32(f);
+    }
+
+    if (virtio_host_has_feature(vdev, VIRTIO_NET_F_RSS) ||
+        virtio_host_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT)) {
+        virtio_net_disable_rss(n);
+        n->rss.redirect = qemu_get_byte(f);
+        n->rss.hash_types = qemu_get_be32(f);
+        qemu_get_buffer(f, n->rss.key, sizeof(n->rss.key));
+        n->rss.default_queue = qemu_get_be16(f);
+        n->rss.indirections_len = qemu_get_be16(f);
+        if (n->rss.indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+            (n->rss.indirections_len & (n->rss.indirections_len - 1))) {
+            error_report("virtio-net: invalid RSS indirection table length %d",
+                         n->rss.indirections_len);
+            return -1;
+        }
+        n->rss.indirections_table = g_new(uint16_t, n->rss.indirections_len);
+        for (i = 0; i < n->rss.indirections_len; i++) {
+            n->rss.indirections_table[i] = qemu_get_be16(f);
+            if (n->rss.indirections_table[i] >= n->max_queues) {
+                error_report("virtio-net: invalid RSS queue %d",
+                             n->rss.indirections_table[i]);
+                return -1;
+            }
+        }
+        if (n->rss.redirect && (!n->rss.indirections_len ||
+                                n->rss.default_queue >= n->max_queues)) {
+            error_report("virtio-net: invalid RSS configuration");
+            return -1;
+        }
+    }
+
     virtio_net_set_queues(n);
 
     /* Find the first multicast entry in the saved MAC filter */
@@ -1690,6 +2266,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .flush_batch = virtio_net_flush_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -1738,6 +2315,97 @@ void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
     n->netclient_type = g_strdup(type);
 }
 
+static bool failover_is_primary(VirtIONet *n, const char *pair_id)
+{
+    return pair_id && !strcmp(pair_id, n->netclient_name);
+}
+
+/* Until the guest acks the standby feature, it could not pair the two */
+static bool failover_hide_primary(DeviceListener *listener,
+                                  QemuOpts *device_opts)
+{
+    VirtIONet *n = container_of(listener, VirtIONet, primary_listener);
+
+    if (!failover_is_primary(n, qemu_opt_get(device_opts,
+                                             "failover_pair_id"))) {
+        return false;
+    }
+
+    n->primary_opts = device_opts;
+    return !virtio_vdev_has_feature(VIRTIO_DEVICE(n), VIRTIO_NET_F_STANDBY) ||
+           n->primary_pending;
+}
+
+static void failover_primary_realize(DeviceListener *listener,
+                                     DeviceState *dev)
+{
+    VirtIONet *n = container_of(listener, VirtIONet, primary_listener);
+    char *pair_id = object_property_get_str(OBJECT(dev), "failover_pair_id",
+                                            NULL);
+
+    if (failover_is_primary(n, pair_id)) {
+        n->primary_dev = dev;
+        n->primary_opts = dev->opts;
+    }
+    g_free(pair_id);
+}
+
+static void failover_primary_unrealize(DeviceListener *listener,
+                                       DeviceState *dev)
+{
+    VirtIONet *n = container_of(listener, VirtIONet, primary_listener);
+
+    if (dev != n->primary_dev) {
+        return;
+    }
+    n->primary_dev = NULL;
+    /* Unless unplugged for migration, the options go with the device */
+    if (dev->opts) {
+        n->primary_opts = NULL;
+    }
+}
+
+static void failover_unplug_primary(VirtIONet *n)
+{
+    DeviceState *dev = n->primary_dev;
+    Error *err = NULL;
+
+    if (!dev) {
+        return;
+    }
+
+    /* Keep the options to plug it back if migration fails */
+    dev->opts = NULL;
+    qdev_unplug(dev, &err);
+    if (err) {
+        dev->opts = n->primary_opts;
+        error_report_err(err);
+    }
+}
+
+static void failover_replug_primary(VirtIONet *n)
+{
+    if (n->primary_dev) {
+        /* The guest has not ejected it (yet) */
+        n->primary_dev->opts = n->primary_opts;
+        return;
+    }
+    failover_add_primary(n);
+}
+
+static void virtio_net_migration_state_notifier(Notifier *notifier,
+                                                void *data)
+{
+    VirtIONet *n = container_of(notifier, VirtIONet, migration_state);
+    MigrationState *s = data;
+
+    if (migration_in_setup(s)) {
+        failover_unplug_primary(n);
+    } else if (migration_has_failed(s)) {
+        failover_replug_primary(n);
+    }
+}
+
 static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -1745,6 +2413,13 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     NetClientState *nc;
     int i;
 
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_STANDBY) &&
+        !n->netclient_name) {
+        error_setg(errp, "virtio-net: failover requires the device to "
+                   "have an id");
+        return;
+    }
+
     virtio_net_set_config_size(n, n->host_features);
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
@@ -1768,6 +2443,8 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         error_report("Defaulting to \"bh\"");
     }
 
+    n->rx_coal = n->net_conf.rx_coal;
+    n->tx_coal = n->net_conf.tx_coal;
     for (i = 0; i < n->max_queues; i++) {
         virtio_net_add_queue(n, i);
     }
@@ -1804,7 +2481,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
-    virtio_net_set_mrg_rx_bufs(n, 0, 0);
+    virtio_net_set_mrg_rx_bufs(n, 0, 0, 0);
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
@@ -1817,6 +2494,15 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     n->qdev = dev;
     register_savevm(dev, "virtio-net", -1, VIRTIO_NET_VM_VERSION,
                     virtio_net_save, virtio_net_load, n);
+
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_STANDBY)) {
+        n->primary_listener.should_be_hidden = failover_hide_primary;
+        n->primary_listener.realize = failover_primary_realize;
+        n->primary_listener.unrealize = failover_primary_unrealize;
+        device_listener_register(&n->primary_listener);
+        n->migration_state.notify = virtio_net_migration_state_notifier;
+        add_migration_state_change_notifier(&n->migration_state);
+    }
 }
 
 static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
@@ -1830,6 +2516,11 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
 
     unregister_savevm(dev, "virtio-net", n);
 
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_STANDBY)) {
+        remove_migration_state_change_notifier(&n->migration_state);
+        device_listener_unregister(&n->primary_listener);
+    }
+
     g_free(n->netclient_name);
     n->netclient_name = NULL;
     g_free(n->netclient_type);
@@ -1837,6 +2528,7 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
 
     g_free(n->mac_table.macs);
     g_free(n->vlans);
+    g_free(n->rss.indirections_table);
 
     max_queues = n->multiqueue ? n->max_queues : 1;
     for (i = 0; i < max_queues; i++) {
@@ -1865,50 +2557,64 @@ static void virtio_net_instance_init(Object *obj)
 }
 
 static Property virtio_net_properties[] = {
-    DEFINE_PROP_BIT("csum", VirtIONet, host_features, VIRTIO_NET_F_CSUM, true),
-    DEFINE_PROP_BIT("guest_csum", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("csum", VirtIONet, host_features,
+                      VIRTIO_NET_F_CSUM, true),
+    DEFINE_PROP_BIT64("guest_csum", VirtIONet, host_features,
                     VIRTIO_NET_F_GUEST_CSUM, true),
-    DEFINE_PROP_BIT("gso", VirtIONet, host_features, VIRTIO_NET_F_GSO, true),
-    DEFINE_PROP_BIT("guest_tso4", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("gso", VirtIONet, host_features, VIRTIO_NET_F_GSO, true),
+    DEFINE_PROP_BIT64("guest_tso4", VirtIONet, host_features,
                     VIRTIO_NET_F_GUEST_TSO4, true),
-    DEFINE_PROP_BIT("guest_tso6", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("guest_tso6", VirtIONet, host_features,
                     VIRTIO_NET_F_GUEST_TSO6, true),
-    DEFINE_PROP_BIT("guest_ecn", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("guest_ecn", VirtIONet, host_features,
                     VIRTIO_NET_F_GUEST_ECN, true),
-    DEFINE_PROP_BIT("guest_ufo", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("guest_ufo", VirtIONet, host_features,
                     VIRTIO_NET_F_GUEST_UFO, true),
-    DEFINE_PROP_BIT("guest_announce", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("guest_announce", VirtIONet, host_features,
                     VIRTIO_NET_F_GUEST_ANNOUNCE, true),
-    DEFINE_PROP_BIT("host_tso4", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("host_tso4", VirtIONet, host_features,
                     VIRTIO_NET_F_HOST_TSO4, true),
-    DEFINE_PROP_BIT("host_tso6", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("host_tso6", VirtIONet, host_features,
                     VIRTIO_NET_F_HOST_TSO6, true),
-    DEFINE_PROP_BIT("host_ecn", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("host_ecn", VirtIONet, host_features,
                     VIRTIO_NET_F_HOST_ECN, true),
-    DEFINE_PROP_BIT("host_ufo", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("host_ufo", VirtIONet, host_features,
                     VIRTIO_NET_F_HOST_UFO, true),
-    DEFINE_PROP_BIT("mrg_rxbuf", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("mrg_rxbuf", VirtIONet, host_features,
                     VIRTIO_NET_F_MRG_RXBUF, true),
-    DEFINE_PROP_BIT("status", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("status", VirtIONet, host_features,
                     VIRTIO_NET_F_STATUS, true),
-    DEFINE_PROP_BIT("ctrl_vq", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("ctrl_vq", VirtIONet, host_features,
                     VIRTIO_NET_F_CTRL_VQ, true),
-    DEFINE_PROP_BIT("ctrl_rx", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("ctrl_rx", VirtIONet, host_features,
                     VIRTIO_NET_F_CTRL_RX, true),
-    DEFINE_PROP_BIT("ctrl_vlan", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("ctrl_vlan", VirtIONet, host_features,
                     VIRTIO_NET_F_CTRL_VLAN, true),
-    DEFINE_PROP_BIT("ctrl_rx_extra", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("ctrl_rx_extra", VirtIONet, host_features,
                     VIRTIO_NET_F_CTRL_RX_EXTRA, true),
-    DEFINE_PROP_BIT("ctrl_mac_addr", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("ctrl_mac_addr", VirtIONet, host_features,
                     VIRTIO_NET_F_CTRL_MAC_ADDR, true),
-    DEFINE_PROP_BIT("ctrl_guest_offloads", VirtIONet, host_features,
+    DEFINE_PROP_BIT64("ctrl_guest_offloads", VirtIONet, host_features,
                     VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
-    DEFINE_PROP_BIT("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("notf_coal", VirtIONet, host_features,
+                      VIRTIO_NET_F_NOTF_COAL, false),
+    DEFINE_PROP_BIT64("rss", VirtIONet, host_features,
+                      VIRTIO_NET_F_RSS, false),
+    DEFINE_PROP_BIT64("hash", VirtIONet, host_features,
+                      VIRTIO_NET_F_HASH_REPORT, false),
+    DEFINE_PROP_BIT64("failover", VirtIONet, host_features,
+                      VIRTIO_NET_F_STANDBY, false),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_BOOL("x-sw-gso", VirtIONet, net_conf.sw_gso, true),
+    DEFINE_PROP_UINT32("rx-usecs", VirtIONet, net_conf.rx_coal.usecs, 0),
+    DEFINE_PROP_UINT32("rx-frames", VirtIONet, net_conf.rx_coal.frames, 0),
+    DEFINE_PROP_UINT32("tx-usecs", VirtIONet, net_conf.tx_coal.usecs, 0),
+    DEFINE_PROP_UINT32("tx-frames", VirtIONet, net_conf.tx_coal.frames, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -24,6 +24,7 @@
 #include "sysemu/sysemu.h"
 #include "qemu-common.h"
 #include "qemu/bswap.h"
+#include "qemu/event_notifier.h"
 #include "hw/pci/msix.h"
 #include "hw/pci/msi.h"
 
@@ -37,6 +38,9 @@
 #define VMXNET3_MSIX_BAR_SIZE 0x2000
 #define MIN_BUF_SIZE 60
 
+/* Number of TX descriptors fetched from guest memory at once */
+#define VMXNET3_TX_DESC_BATCH 16
+
 /* Compatability flags for migration */
 #define VMXNET3_COMPAT_FLAG_OLD_MSI_OFFSETS_BIT 0
 #define VMXNET3_COMPAT_FLAG_OLD_MSI_OFFSETS \
@@ -251,6 +255,11 @@ typedef struct {
     uint8_t intr_idx;
     hwaddr tx_stats_pa;
     struct UPT1_TxStats txq_stats;
+
+    /* Descriptors owned by the device that were not consumed yet */
+    struct Vmxnet3_TxDesc txd_cache[VMXNET3_TX_DESC_BATCH];
+    uint32_t txd_cache_pos;
+    uint32_t txd_cache_len;
 } Vmxnet3TxqDescr;
 
 typedef struct {
@@ -267,7 +276,15 @@ typedef struct {
     bool is_asserted;
 } Vmxnet3IntState;
 
+/* An ioeventfd for the TXPROD register of one TX queue */
 typedef struct {
+    EventNotifier notifier;
+    struct VMXNET3State *s;
+    uint8_t qidx;
+    bool used;
+} Vmxnet3TxDoorbell;
+
+typedef struct VMXNET3State {
         PCIDevice parent_obj;
         NICState *nic;
         NICConf conf;
@@ -343,6 +360,10 @@ typedef struct {
 
         /* Compatability flags for migration */
         uint32_t compat_flags;
+
+        /* Whether TXPROD writes are delivered through ioeventfds */
+        bool ioeventfd;
+        Vmxnet3TxDoorbell tx_doorbells[VMXNET3_DEVICE_MAX_TX_QUEUES];
 } VMXNET3State;
 
 /* Interrupt management */
@@ -681,27 +702,76 @@ vmxnet3_on_rx_done_update_stats(VMXNET3State *s,
     }
 }
 
+/*
+ * Read the descriptors that the guest has passed to the device, starting
+ * at the current cell and up to VMXNET3_TX_DESC_BATCH of them, without
+ * going past the end of the ring.  Returns the number of descriptors
+ * fetched into the queue's cache.
+ */
+static uint32_t
+vmxnet3_fetch_tx_descrs(VMXNET3State *s, int qidx)
+{
+    Vmxnet3TxqDescr *txq = &s->txq_descr[qidx];
+    Vmxnet3Ring *ring = &txq->tx_ring;
+    hwaddr pa = vmxnet3_ring_curr_cell_pa(ring);
+    uint32_t n = MIN(VMXNET3_TX_DESC_BATCH, ring->size - ring->next);
+    uint32_t i;
+
+    txq->txd_cache_pos = txq->txd_cache_len = 0;
+    if (!n) {
+        return 0;
+    }
+
+    vmw_shmem_read(pa, txq->txd_cache, n * sizeof(txq->txd_cache[0]));
+    for (i = 0; i < n; i++) {
+        if (txq->txd_cache[i].gen != vmxnet3_ring_curr_gen(ring)) {
+            break;
+        }
+    }
+
+    if (i) {
+        /* Only read after generation field verification */
+        smp_rmb();
+        /* Re-read to be sure we got the latest version */
+        vmw_shmem_read(pa, txq->txd_cache, i * sizeof(txq->txd_cache[0]));
+    }
+
+    txq->txd_cache_len = i;
+    return i;
+}
+
 static inline bool
 vmxnet3_pop_next_tx_descr(VMXNET3State *s,
                           int qidx,
                           struct Vmxnet3_TxDesc *txd,
                           uint32_t *descr_idx)
 {
-    Vmxnet3Ring *ring = &s->txq_descr[qidx].tx_ring;
+    Vmxnet3TxqDescr *txq = &s->txq_descr[qidx];
+    Vmxnet3Ring *ring = &txq->tx_ring;
 
-    vmxnet3_ring_read_curr_cell(ring, txd);
-    if (txd->gen == vmxnet3_ring_curr_gen(ring)) {
-        /* Only read after generation field verification */
-        smp_rmb();
-        /* Re-read to be sure we got the latest version */
-        vmxnet3_ring_read_curr_cell(ring, txd);
-        VMXNET3_RING_DUMP(VMW_RIPRN, "TX", qidx, ring);
-        *descr_idx = vmxnet3_ring_curr_cell_idx(ring);
-        vmxnet3_inc_tx_consumption_counter(s, qidx);
-        return true;
+    if (txq->txd_cache_pos == txq->txd_cache_len &&
+        !vmxnet3_fetch_tx_descrs(s, qidx)) {
+        return false;
     }
 
-    return false;
+    *txd = txq->txd_cache[txq->txd_cache_pos++];
+    VMXNET3_RING_DUMP(VMW_RIPRN, "TX", qidx, ring);
+    *descr_idx = vmxnet3_ring_curr_cell_idx(ring);
+    vmxnet3_inc_tx_consumption_counter(s, qidx);
+    return true;
+}
+
+/* Number of queues of the backend, which is 1 for a single-queue peer */
+static int vmxnet3_backend_queues(VMXNET3State *s)
+{
+    return MAX(s->conf.peers.queues, 1);
+}
+
+/* TX queue @qidx sends on the backend queue with the same index */
+static NetClientState *
+vmxnet3_get_tx_queue(VMXNET3State *s, int qidx)
+{
+    return qemu_get_subqueue(s->nic, qidx % vmxnet3_backend_queues(s));
 }
 
 static bool
@@ -718,7 +788,7 @@ vmxnet3_send_packet(VMXNET3State *s, uint32_t qidx)
     vmxnet3_dump_virt_hdr(vmxnet_tx_pkt_get_vhdr(s->tx_pkt));
     vmxnet_tx_pkt_dump(s->tx_pkt);
 
-    if (!vmxnet_tx_pkt_send(s->tx_pkt, qemu_get_queue(s->nic))) {
+    if (!vmxnet_tx_pkt_send(s->tx_pkt, vmxnet3_get_tx_queue(s, qidx))) {
         status = VMXNET3_PKT_STATUS_DISCARD;
         goto func_exit;
     }
@@ -820,23 +890,22 @@ vmxnet3_revert_rxc_descr(VMXNET3State *s, int qidx)
     vmxnet3_dec_rx_completion_counter(s, qidx);
 }
 
-#define RXQ_IDX      (0)
 #define RX_HEAD_BODY_RING (0)
 #define RX_BODY_ONLY_RING (1)
 
 static bool
-vmxnet3_get_next_head_rx_descr(VMXNET3State *s,
+vmxnet3_get_next_head_rx_descr(VMXNET3State *s, int qidx,
                                struct Vmxnet3_RxDesc *descr_buf,
                                uint32_t *descr_idx,
                                uint32_t *ridx)
 {
     for (;;) {
         uint32_t ring_gen;
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING,
+        vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING,
                                    descr_buf, descr_idx);
 
         /* If no more free descriptors - return */
-        ring_gen = vmxnet3_get_rx_ring_gen(s, RXQ_IDX, RX_HEAD_BODY_RING);
+        ring_gen = vmxnet3_get_rx_ring_gen(s, qidx, RX_HEAD_BODY_RING);
         if (descr_buf->gen != ring_gen) {
             return false;
         }
@@ -844,11 +913,11 @@ vmxnet3_get_next_head_rx_descr(VMXNET3State *s,
         /* Only read after generation field verification */
         smp_rmb();
         /* Re-read to be sure we got the latest version */
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING,
+        vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING,
                                    descr_buf, descr_idx);
 
         /* Mark current descriptor as used/skipped */
-        vmxnet3_inc_rx_consumption_counter(s, RXQ_IDX, RX_HEAD_BODY_RING);
+        vmxnet3_inc_rx_consumption_counter(s, qidx, RX_HEAD_BODY_RING);
 
         /* If this is what we are looking for - return */
         if (descr_buf->btype == VMXNET3_RXD_BTYPE_HEAD) {
@@ -859,21 +928,21 @@ vmxnet3_get_next_head_rx_descr(VMXNET3State *s,
 }
 
 static bool
-vmxnet3_get_next_body_rx_descr(VMXNET3State *s,
+vmxnet3_get_next_body_rx_descr(VMXNET3State *s, int qidx,
                                struct Vmxnet3_RxDesc *d,
                                uint32_t *didx,
                                uint32_t *ridx)
 {
-    vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING, d, didx);
+    vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING, d, didx);
 
     /* Try to find corresponding descriptor in head/body ring */
-    if (d->gen == vmxnet3_get_rx_ring_gen(s, RXQ_IDX, RX_HEAD_BODY_RING)) {
+    if (d->gen == vmxnet3_get_rx_ring_gen(s, qidx, RX_HEAD_BODY_RING)) {
         /* Only read after generation field verification */
         smp_rmb();
         /* Re-read to be sure we got the latest version */
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING, d, didx);
+        vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING, d, didx);
         if (d->btype == VMXNET3_RXD_BTYPE_BODY) {
-            vmxnet3_inc_rx_consumption_counter(s, RXQ_IDX, RX_HEAD_BODY_RING);
+            vmxnet3_inc_rx_consumption_counter(s, qidx, RX_HEAD_BODY_RING);
             *ridx = RX_HEAD_BODY_RING;
             return true;
         }
@@ -883,17 +952,17 @@ vmxnet3_get_next_body_rx_descr(VMXNET3State *s,
      * If there is no free descriptors on head/body ring or next free
      * descriptor is a head descriptor switch to body only ring
      */
-    vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_BODY_ONLY_RING, d, didx);
+    vmxnet3_read_next_rx_descr(s, qidx, RX_BODY_ONLY_RING, d, didx);
 
     /* If no more free descriptors - return */
-    if (d->gen == vmxnet3_get_rx_ring_gen(s, RXQ_IDX, RX_BODY_ONLY_RING)) {
+    if (d->gen == vmxnet3_get_rx_ring_gen(s, qidx, RX_BODY_ONLY_RING)) {
         /* Only read after generation field verification */
         smp_rmb();
         /* Re-read to be sure we got the latest version */
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_BODY_ONLY_RING, d, didx);
+        vmxnet3_read_next_rx_descr(s, qidx, RX_BODY_ONLY_RING, d, didx);
         assert(d->btype == VMXNET3_RXD_BTYPE_BODY);
         *ridx = RX_BODY_ONLY_RING;
-        vmxnet3_inc_rx_consumption_counter(s, RXQ_IDX, RX_BODY_ONLY_RING);
+        vmxnet3_inc_rx_consumption_counter(s, qidx, RX_BODY_ONLY_RING);
         return true;
     }
 
@@ -901,15 +970,17 @@ vmxnet3_get_next_body_rx_descr(VMXNET3State *s,
 }
 
 static inline bool
-vmxnet3_get_next_rx_descr(VMXNET3State *s, bool is_head,
+vmxnet3_get_next_rx_descr(VMXNET3State *s, int qidx, bool is_head,
                           struct Vmxnet3_RxDesc *descr_buf,
                           uint32_t *descr_idx,
                           uint32_t *ridx)
 {
     if (is_head || !s->rx_packets_compound) {
-        return vmxnet3_get_next_head_rx_descr(s, descr_buf, descr_idx, ridx);
+        return vmxnet3_get_next_head_rx_descr(s, qidx, descr_buf,
+                                              descr_idx, ridx);
     } else {
-        return vmxnet3_get_next_body_rx_descr(s, descr_buf, descr_idx, ridx);
+        return vmxnet3_get_next_body_rx_descr(s, qidx, descr_buf,
+                                              descr_idx, ridx);
     }
 }
 
@@ -1052,7 +1123,7 @@ vmxnet3_physical_memory_writev(const struct iovec *iov,
 }
 
 static bool
-vmxnet3_indicate_packet(VMXNET3State *s)
+vmxnet3_indicate_packet(VMXNET3State *s, int qidx)
 {
     struct Vmxnet3_RxDesc rxd;
     bool is_head = true;
@@ -1078,12 +1149,13 @@ vmxnet3_indicate_packet(VMXNET3State *s)
             break;
         }
 
-        new_rxcd_pa = vmxnet3_pop_rxc_descr(s, RXQ_IDX, &new_rxcd_gen);
+        new_rxcd_pa = vmxnet3_pop_rxc_descr(s, qidx, &new_rxcd_gen);
         if (!new_rxcd_pa) {
             break;
         }
 
-        if (!vmxnet3_get_next_rx_descr(s, is_head, &rxd, &rxd_idx, &rx_ridx)) {
+        if (!vmxnet3_get_next_rx_descr(s, qidx, is_head,
+                                       &rxd, &rxd_idx, &rx_ridx)) {
             break;
         }
 
@@ -1104,7 +1176,7 @@ vmxnet3_indicate_packet(VMXNET3State *s)
         rxcd.len = chunk_size;
         rxcd.sop = is_head;
         rxcd.gen = new_rxcd_gen;
-        rxcd.rqID = RXQ_IDX + rx_ridx * s->rxq_num;
+        rxcd.rqID = qidx + rx_ridx * s->rxq_num;
 
         if (bytes_left == 0) {
             vmxnet3_rx_update_descr(s->rx_pkt, &rxcd);
@@ -1134,24 +1206,104 @@ vmxnet3_indicate_packet(VMXNET3State *s)
     }
 
     if (new_rxcd_pa != 0) {
-        vmxnet3_revert_rxc_descr(s, RXQ_IDX);
+        vmxnet3_revert_rxc_descr(s, qidx);
     }
 
-    vmxnet3_trigger_interrupt(s, s->rxq_descr[RXQ_IDX].intr_idx);
+    vmxnet3_trigger_interrupt(s, s->rxq_descr[qidx].intr_idx);
 
     if (bytes_left == 0) {
-        vmxnet3_on_rx_done_update_stats(s, RXQ_IDX, VMXNET3_PKT_STATUS_OK);
+        vmxnet3_on_rx_done_update_stats(s, qidx, VMXNET3_PKT_STATUS_OK);
         return true;
     } else if (num_frags == s->max_rx_frags) {
-        vmxnet3_on_rx_done_update_stats(s, RXQ_IDX, VMXNET3_PKT_STATUS_ERROR);
+        vmxnet3_on_rx_done_update_stats(s, qidx, VMXNET3_PKT_STATUS_ERROR);
         return false;
     } else {
-        vmxnet3_on_rx_done_update_stats(s, RXQ_IDX,
+        vmxnet3_on_rx_done_update_stats(s, qidx,
                                         VMXNET3_PKT_STATUS_OUT_OF_BUF);
         return false;
     }
 }
 
+/*
+ * Drivers only write TXPROD to kick a TX queue; the device finds the new
+ * descriptors through their generation bit, so the value is not needed.
+ * With the ioeventfd property these writes signal an eventfd instead of
+ * trapping, and the queue is processed by the main loop.
+ */
+static bool vmxnet3_tx_doorbell_take(VMXNET3State *s, int qidx)
+{
+    Vmxnet3TxDoorbell *db = &s->tx_doorbells[qidx];
+
+    return db->used && event_notifier_test_and_clear(&db->notifier) &&
+           s->device_active && qidx < s->txq_num;
+}
+
+static void vmxnet3_tx_doorbell_notify(EventNotifier *e)
+{
+    Vmxnet3TxDoorbell *db = container_of(e, Vmxnet3TxDoorbell, notifier);
+
+    if (vmxnet3_tx_doorbell_take(db->s, db->qidx)) {
+        vmxnet3_process_tx_queue(db->s, db->qidx);
+    }
+}
+
+/* Process the doorbells that the main loop has not seen yet */
+static void vmxnet3_flush_tx_doorbells(VMXNET3State *s)
+{
+    int i;
+
+    for (i = 0; i < VMXNET3_DEVICE_MAX_TX_QUEUES; i++) {
+        if (vmxnet3_tx_doorbell_take(s, i)) {
+            vmxnet3_process_tx_queue(s, i);
+        }
+    }
+}
+
+static hwaddr vmxnet3_tx_doorbell_addr(int qidx)
+{
+    return VMXNET3_REG_TXPROD + qidx * VMXNET3_REG_ALIGN;
+}
+
+static void vmxnet3_cleanup_tx_doorbells(VMXNET3State *s)
+{
+    int i;
+
+    for (i = 0; i < VMXNET3_DEVICE_MAX_TX_QUEUES; i++) {
+        Vmxnet3TxDoorbell *db = &s->tx_doorbells[i];
+
+        if (!db->used) {
+            continue;
+        }
+        memory_region_del_eventfd(&s->bar0, vmxnet3_tx_doorbell_addr(i), 4,
+                                  false, 0, &db->notifier);
+        event_notifier_set_handler(&db->notifier, NULL);
+        event_notifier_cleanup(&db->notifier);
+        db->used = false;
+    }
+}
+
+static void vmxnet3_init_tx_doorbells(VMXNET3State *s)
+{
+    int i;
+
+    for (i = 0; i < VMXNET3_DEVICE_MAX_TX_QUEUES; i++) {
+        Vmxnet3TxDoorbell *db = &s->tx_doorbells[i];
+
+        db->s = s;
+        db->qidx = i;
+        if (event_notifier_init(&db->notifier, 0) < 0) {
+            VMW_WRPRN("Failed to create ioeventfd, "
+                      "falling back to MMIO doorbells");
+            vmxnet3_cleanup_tx_doorbells(s);
+            return;
+        }
+        event_notifier_set_handler(&db->notifier, vmxnet3_tx_doorbell_notify);
+        memory_region_add_eventfd(&s->bar0, vmxnet3_tx_doorbell_addr(i), 4,
+                                  false, 0, &db->notifier);
+        db->used = true;
+    }
+}
+
 static void
 vmxnet3_io_bar0_write(void *opaque, hwaddr addr,
                       uint64_t val, unsigned size)
@@ -1164,6 +1316,7 @@ vmxnet3_io_bar0_write(void *opaque, hwaddr addr,
             VMW_MULTIREG_IDX_BY_ADDR(addr, VMXNET3_REG_TXPROD,
                                      VMXNET3_REG_ALIGN);
         assert(tx_queue_idx <= s->txq_num);
+        vmxnet3_flush_tx_doorbells(s);
         vmxnet3_process_tx_queue(s, tx_queue_idx);
         return;
     }
@@ -1391,12 +1544,16 @@ static void vmxnet3_update_features(VMXNET3State *s)
               s->lro_supported, rxcso_supported,
               s->rx_vlan_stripping);
     if (s->peer_has_vhdr) {
-        qemu_set_offload(qemu_get_queue(s->nic)->peer,
-                         rxcso_supported,
-                         s->lro_supported,
-                         s->lro_supported,
-                         0,
-                         0);
+        int i;
+
+        for (i = 0; i < vmxnet3_backend_queues(s); i++) {
+            qemu_set_offload(qemu_get_subqueue(s->nic, i)->peer,
+                             rxcso_supported,
+                             s->lro_supported,
+                             s->lro_supported,
+                             0,
+                             0);
+        }
     }
 }
 
@@ -1533,6 +1690,7 @@ static void vmxnet3_activate_device(VMXNET3State *s)
 
         vmxnet3_ring_init(&s->txq_descr[i].tx_ring, pa, size,
                           sizeof(struct Vmxnet3_TxDesc), false);
+        s->txq_descr[i].txd_cache_pos = s->txq_descr[i].txd_cache_len = 0;
         VMXNET3_RING_DUMP(VMW_CFPRN, "TX", i, &s->txq_descr[i].tx_ring);
 
         s->max_tx_frags += size;
@@ -1611,6 +1769,9 @@ static void vmxnet3_activate_device(VMXNET3State *s)
 
 static void vmxnet3_handle_command(VMXNET3State *s, uint64_t cmd)
 {
+    /* Commands must observe the TX doorbells written before them */
+    vmxnet3_flush_tx_doorbells(s);
+
     s->last_command = cmd;
 
     switch (cmd) {
@@ -2006,12 +2167,16 @@ vmxnet3_receive(NetClientState *nc, const uint8_t *buf, size_t size)
     VMXNET3State *s = qemu_get_nic_opaque(nc);
     size_t bytes_indicated;
     uint8_t min_buf[MIN_BUF_SIZE];
+    int qidx;
 
     if (!vmxnet3_can_receive(nc)) {
         VMW_PKPRN("Cannot receive now");
         return -1;
     }
 
+    /* Each backend queue feeds the RX queue with the same index */
+    qidx = nc->queue_index % s->rxq_num;
+
     if (s->peer_has_vhdr) {
         vmxnet_rx_pkt_set_vhdr(s->rx_pkt, (struct virtio_net_hdr *)buf);
         buf += sizeof(struct virtio_net_hdr);
@@ -2033,7 +2198,7 @@ vmxnet3_receive(NetClientState *nc, const uint8_t *buf, size_t size)
         vmxnet_rx_pkt_set_protocols(s->rx_pkt, buf, size);
         vmxnet3_rx_need_csum_calculate(s->rx_pkt, buf, size);
         vmxnet_rx_pkt_attach_data(s->rx_pkt, buf, size, s->rx_vlan_stripping);
-        bytes_indicated = vmxnet3_indicate_packet(s) ? size : -1;
+        bytes_indicated = vmxnet3_indicate_packet(s, qidx) ? size : -1;
         if (bytes_indicated < size) {
             VMW_PKPRN("RX: %zu of %zu bytes indicated", bytes_indicated, size);
         }
@@ -2117,10 +2282,14 @@ static void vmxnet3_net_init(VMXNET3State *s)
     s->lro_supported = false;
 
     if (s->peer_has_vhdr) {
-        qemu_set_vnet_hdr_len(qemu_get_queue(s->nic)->peer,
-            sizeof(struct virtio_net_hdr));
+        int i;
 
-        qemu_using_vnet_hdr(qemu_get_queue(s->nic)->peer, 1);
+        for (i = 0; i < vmxnet3_backend_queues(s); i++) {
+            NetClientState *peer = qemu_get_subqueue(s->nic, i)->peer;
+
+            qemu_set_vnet_hdr_len(peer, sizeof(struct virtio_net_hdr));
+            qemu_using_vnet_hdr(peer, 1);
+        }
     }
 
     qemu_format_nic_info_str(qemu_get_queue(s->nic), s->conf.macaddr.a);
@@ -2282,6 +2451,9 @@ static void vmxnet3_pci_realize(PCIDevice *pci_dev, Error **errp)
                           "vmxnet3-b0", VMXNET3_PT_REG_SIZE);
     pci_register_bar(pci_dev, VMXNET3_BAR0_IDX,
                      PCI_BASE_ADDRESS_SPACE_MEMORY, &s->bar0);
+    if (s->ioeventfd) {
+        vmxnet3_init_tx_doorbells(s);
+    }
 
     memory_region_init_io(&s->bar1, OBJECT(s), &b1_ops, s,
                           "vmxnet3-b1", VMXNET3_VD_REG_SIZE);
@@ -2340,6 +2512,8 @@ static void vmxnet3_pci_uninit(PCIDevice *pci_dev)
 
     unregister_savevm(dev, "vmxnet3-msix", s);
 
+    vmxnet3_cleanup_tx_doorbells(s);
+
     vmxnet3_net_uninit(s);
 
     vmxnet3_cleanup_msix(s);
@@ -2445,6 +2619,7 @@ static int vmxnet3_get_txq_descr(QEMUFile *f, void *pv, size_t size)
 
     vmxnet3_get_ring_from_file(f, &r->tx_ring);
     vmxnet3_get_ring_from_file(f, &r->comp_ring);
+    r->txd_cache_pos = r->txd_cache_len = 0;
     r->intr_idx = qemu_get_byte(f);
     r->tx_stats_pa = qemu_get_be64(f);
 
@@ -2537,6 +2712,7 @@ static int vmxnet3_post_load(void *opaque, int version_id)
 {
     VMXNET3State *s = opaque;
     PCIDevice *d = PCI_DEVICE(s);
+    int i;
 
     vmxnet_tx_pkt_init(&s->tx_pkt, s->max_tx_frags, s->peer_has_vhdr);
     vmxnet_rx_pkt_init(&s->rx_pkt, s->peer_has_vhdr);
@@ -2553,6 +2729,16 @@ static int vmxnet3_post_load(void *opaque, int version_id)
     vmxnet3_validate_queues(s);
     vmxnet3_validate_interrupts(s);
 
+    /*
+     * TXPROD writes that were still pending in an ioeventfd on the source
+     * are lost, so look at all TX queues once the main loop runs.
+     */
+    for (i = 0; i < s->txq_num; i++) {
+        if (s->tx_doorbells[i].used) {
+            event_notifier_set(&s->tx_doorbells[i].notifier);
+        }
+    }
+
     return 0;
 }
 
@@ -2666,6 +2852,7 @@ static Property vmxnet3_properties[] = {
                     VMXNET3_COMPAT_FLAG_OLD_MSI_OFFSETS_BIT, false),
     DEFINE_PROP_BIT("x-disable-pcie", VMXNET3State, compat_flags,
                     VMXNET3_COMPAT_FLAG_DISABLE_PCIE_BIT, false),
+    DEFINE_PROP_BOOL("ioeventfd", VMXNET3State, ioeventfd, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -21,7 +21,9 @@
 #include "qemu/osdep.h"
 #include "hw/pci/msi.h"
 #include "hw/xen/xen.h"
+#include "qemu/event_notifier.h"
 #include "qemu/range.h"
+#include "sysemu/kvm.h"
 
 /* PCI_MSI_ADDRESS_LO */
 #define PCI_MSI_ADDRESS_LO_MASK         (~0x3)
@@ -50,6 +52,12 @@
  */
 bool msi_nonbroken;
 
+typedef struct PCIMSIIrqfd {
+    MSIMessage msg;
+    EventNotifier notifier;
+    int virq;
+} PCIMSIIrqfd;
+
 /* If we get rid of cap allocator, we won't need this. */
 static inline uint8_t msi_cap_sizeof(uint16_t flags)
 {
@@ -235,6 +243,7 @@ void msi_uninit(struct PCIDevice *dev)
     cap_size = msi_cap_sizeof(flags);
     pci_del_capability(dev, PCI_CAP_ID_MSI, cap_size);
     dev->cap_present &= ~QEMU_PCI_CAP_MSI;
+    msi_irqfd_release(dev);
 
     MSI_DEV_PRINTF(dev, "uninit\n");
 }
@@ -308,7 +317,9 @@ void msi_notify(PCIDevice *dev, unsigned int vector)
                    "notify vector 0x%x"
                    " address: 0x%"PRIx64" data: 0x%"PRIx32"\n",
                    vector, msg.address, msg.data);
-    msi_send_message(dev, msg);
+    if (!msi_irqfd_send(dev, vector, msg)) {
+        msi_send_message(dev, msg);
+    }
 }
 
 void msi_send_message(PCIDevice *dev, MSIMessage msg)
@@ -320,6 +331,101 @@ void msi_send_message(PCIDevice *dev, MSIMessage msg)
                          attrs, NULL);
 }
 
+static bool msi_irqfd_setup(PCIDevice *dev, PCIMSIIrqfd *irqfd,
+                            MSIMessage msg)
+{
+    int virq;
+
+    if (event_notifier_init(&irqfd->notifier, 0) < 0) {
+        return false;
+    }
+    virq = kvm_irqchip_add_msi_route(kvm_state, msg, dev);
+    if (virq < 0) {
+        event_notifier_cleanup(&irqfd->notifier);
+        return false;
+    }
+    if (kvm_irqchip_add_irqfd_notifier_gsi(kvm_state, &irqfd->notifier,
+                                           NULL, virq) < 0) {
+        kvm_irqchip_release_virq(kvm_state, virq);
+        event_notifier_cleanup(&irqfd->notifier);
+        return false;
+    }
+    irqfd->virq = virq;
+    irqfd->msg = msg;
+    return true;
+}
+
+/*
+ * Deliver an MSI or MSI-X message of a device model through a KVM irqfd,
+ * instead of a synchronous KVM_SIGNAL_MSI from the interrupt controller's
+ * MMIO handler.  The routes are created the first time a vector fires and
+ * are only updated, and committed to KVM, when the guest has changed the
+ * message since.
+ *
+ * Returns false if the caller must send the message itself.
+ */
+bool msi_irqfd_send(PCIDevice *dev, unsigned int vector, MSIMessage msg)
+{
+    PCIMSIIrqfd *irqfd;
+
+    /* Devices that set up their own irqfds, and disabled bus mastering */
+    if (!kvm_msi_via_irqfd_enabled() || dev->msi_irqfd_failed ||
+        dev->msix_vector_use_notifier ||
+        !(pci_get_word(dev->config + PCI_COMMAND) & PCI_COMMAND_MASTER)) {
+        return false;
+    }
+
+    if (vector >= dev->msi_irqfd_nr) {
+        unsigned i, nr = MAX(vector + 1, PCI_MSI_VECTORS_MAX);
+
+        dev->msi_irqfd = g_renew(PCIMSIIrqfd, dev->msi_irqfd, nr);
+        for (i = dev->msi_irqfd_nr; i < nr; i++) {
+            dev->msi_irqfd[i].virq = -1;
+        }
+        dev->msi_irqfd_nr = nr;
+    }
+
+    irqfd = &dev->msi_irqfd[vector];
+    if (irqfd->virq < 0) {
+        if (!msi_irqfd_setup(dev, irqfd, msg)) {
+            /* Most likely out of GSIs, do not try again for every MSI */
+            dev->msi_irqfd_failed = true;
+            return false;
+        }
+    } else if (irqfd->msg.address != msg.address ||
+               irqfd->msg.data != msg.data) {
+        if (kvm_irqchip_update_msi_route(kvm_state, irqfd->virq,
+                                         msg, dev) < 0) {
+            return false;
+        }
+        irqfd->msg = msg;
+    }
+
+    event_notifier_set(&irqfd->notifier);
+    return true;
+}
+
+void msi_irqfd_release(PCIDevice *dev)
+{
+    unsigned i;
+
+    for (i = 0; i < dev->msi_irqfd_nr; i++) {
+        PCIMSIIrqfd *irqfd = &dev->msi_irqfd[i];
+
+        if (irqfd->virq < 0) {
+            continue;
+        }
+        kvm_irqchip_remove_irqfd_notifier_gsi(kvm_state, &irqfd->notifier,
+                                              irqfd->virq);
+        kvm_irqchip_release_virq(kvm_state, irqfd->virq);
+        event_notifier_cleanup(&irqfd->notifier);
+    }
+    g_free(dev->msi_irqfd);
+    dev->msi_irqfd = NULL;
+    dev->msi_irqfd_nr = 0;
+    dev->msi_irqfd_failed = false;
+}
+
 /* Normally called by pci_default_write_config(). */
 void msi_write_config(PCIDevice *dev, uint32_t addr, uint32_t val, int len)
 {
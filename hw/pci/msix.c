@@ -387,6 +387,7 @@ void msix_uninit(PCIDevice *dev, MemoryRegion *table_bar, MemoryRegion *pba_bar)
     g_free(dev->msix_entry_used);
     dev->msix_entry_used = NULL;
     dev->cap_present &= ~QEMU_PCI_CAP_MSIX;
+    msi_irqfd_release(dev);
 }
 
 void msix_uninit_exclusive_bar(PCIDevice *dev)
@@ -456,7 +457,9 @@ void msix_notify(PCIDevice *dev, unsigned vector)
 
     msg = msix_get_message(dev, vector);
 
-    msi_send_message(dev, msg);
+    if (!msi_irqfd_send(dev, vector, msg)) {
+        msi_send_message(dev, msg);
+    }
 }
 
 void msix_reset(PCIDevice *dev)
@@ -1583,21 +1583,50 @@ static inline bool check_lba_range(SCSIDiskState *s,
             sector_num + nb_sectors <= s->qdev.max_lba + 1);
 }
 
-typedef struct UnmapCBData {
+typedef struct UnmapCBData UnmapCBData;
+
+typedef struct UnmapRange {
+    UnmapCBData *data;
+    BlockAIOCB *aiocb;
+} UnmapRange;
+
+/* All the descriptors of an UNMAP command are discarded in parallel;
+ * the command completes when the last discard does.
+ */
+struct UnmapCBData {
     SCSIDiskReq *r;
-    uint8_t *inbuf;
     int count;
-} UnmapCBData;
-
-static void scsi_unmap_complete(void *opaque, int ret);
+    int inflight;
+    int ret;
+    UnmapRange ranges[];
+};
 
-static void scsi_unmap_complete_noio(UnmapCBData *data, int ret)
+static void scsi_unmap_complete(void *opaque, int ret)
 {
+    UnmapRange *range = opaque;
+    UnmapCBData *data = range->data;
     SCSIDiskReq *r = data->r;
-    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
-    uint64_t sector_num;
-    uint32_t nb_sectors;
+    int i;
 
+    assert(range->aiocb != NULL);
+    range->aiocb = NULL;
+    if (ret < 0 && !data->ret) {
+        data->ret = ret;
+    }
+
+    /* Keep r->req.aiocb pointing to a pending discard, so that
+     * scsi_req_cancel_async waits for the whole batch.
+     */
+    r->req.aiocb = NULL;
+    for (i = 0; i < data->count; i++) {
+        if (data->ranges[i].aiocb) {
+            r->req.aiocb = data->ranges[i].aiocb;
+            break;
+        }
+    }
+    if (--data->inflight > 0) {
+        return;
+    }
     assert(r->req.aiocb == NULL);
 
     if (r->req.io_canceled) {
@@ -1605,29 +1634,12 @@ static void scsi_unmap_complete_noio(UnmapCBData *data, int ret)
         goto done;
     }
 
-    if (ret < 0) {
-        if (scsi_handle_rw_error(r, -ret, false)) {
+    if (data->ret < 0) {
+        if (scsi_handle_rw_error(r, -data->ret, false)) {
             goto done;
         }
     }
 
-    if (data->count > 0) {
-        sector_num = ldq_be_p(&data->inbuf[0]);
-        nb_sectors = ldl_be_p(&data->inbuf[8]) & 0xffffffffULL;
-        if (!check_lba_range(s, sector_num, nb_sectors)) {
-            scsi_check_condition(r, SENSE_CODE(LBA_OUT_OF_RANGE));
-            goto done;
-        }
-
-        r->req.aiocb = blk_aio_discard(s->qdev.conf.blk,
-                                       sector_num * (s->qdev.blocksize / 512),
-                                       nb_sectors * (s->qdev.blocksize / 512),
-                                       scsi_unmap_complete, data);
-        data->count--;
-        data->inbuf += 16;
-        return;
-    }
-
     scsi_req_complete(&r->req, GOOD);
 
 done:
@@ -1635,23 +1647,15 @@ done:
     g_free(data);
 }
 
-static void scsi_unmap_complete(void *opaque, int ret)
-{
-    UnmapCBData *data = opaque;
-    SCSIDiskReq *r = data->r;
-
-    assert(r->req.aiocb != NULL);
-    r->req.aiocb = NULL;
-
-    scsi_unmap_complete_noio(data, ret);
-}
-
 static void scsi_disk_emulate_unmap(SCSIDiskReq *r, uint8_t *inbuf)
 {
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
     uint8_t *p = inbuf;
     int len = r->req.cmd.xfer;
     UnmapCBData *data;
+    uint64_t sector_num;
+    uint32_t nb_sectors;
+    int i, count;
 
     /* Reject ANCHOR=1.  */
     if (r->req.cmd.buf[1] & 0x1) {
@@ -1676,14 +1680,49 @@ static void scsi_disk_emulate_unmap(SCSIDiskReq *r, uint8_t *inbuf)
         return;
     }
 
-    data = g_new0(UnmapCBData, 1);
+    /* Check all descriptors before discarding anything.  */
+    count = lduw_be_p(&p[2]) >> 4;
+    data = g_malloc0(sizeof(*data) + count * sizeof(UnmapRange));
     data->r = r;
-    data->inbuf = &p[8];
-    data->count = lduw_be_p(&p[2]) >> 4;
+    for (i = 0, p += 8; i < count; i++, p += 16) {
+        sector_num = ldq_be_p(&p[0]);
+        nb_sectors = ldl_be_p(&p[8]) & 0xffffffffULL;
+        if (!check_lba_range(s, sector_num, nb_sectors)) {
+            g_free(data);
+            scsi_check_condition(r, SENSE_CODE(LBA_OUT_OF_RANGE));
+            return;
+        }
+        if (nb_sectors) {
+            data->count++;
+        }
+    }
+    if (!data->count) {
+        g_free(data);
+        scsi_req_complete(&r->req, GOOD);
+        return;
+    }
 
     /* The matching unref is in scsi_unmap_complete, before data is freed.  */
     scsi_req_ref(&r->req);
-    scsi_unmap_complete_noio(data, 0);
+    data->inflight = data->count;
+    blk_io_plug(s->qdev.conf.blk);
+    for (i = 0, p = &inbuf[8]; i < data->count; p += 16) {
+        UnmapRange *range = &data->ranges[i];
+
+        sector_num = ldq_be_p(&p[0]);
+        nb_sectors = ldl_be_p(&p[8]) & 0xffffffffULL;
+        if (!nb_sectors) {
+            continue;
+        }
+        range->data = data;
+        range->aiocb = blk_aio_discard(s->qdev.conf.blk,
+                                       sector_num * (s->qdev.blocksize / 512),
+                                       nb_sectors * (s->qdev.blocksize / 512),
+                                       scsi_unmap_complete, range);
+        r->req.aiocb = range->aiocb;
+        i++;
+    }
+    blk_io_unplug(s->qdev.conf.blk);
     return;
 
 invalid_param_len:
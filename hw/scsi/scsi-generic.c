@@ -17,6 +17,7 @@
 #include "hw/scsi/scsi.h"
 #include "sysemu/block-backend.h"
 #include "sysemu/blockdev.h"
+#include "sysemu/dma.h"
 
 #ifdef __linux__
 
@@ -53,6 +54,11 @@ typedef struct SCSIGenericReq {
     int buflen;
     int len;
     sg_io_hdr_t io_header;
+
+    /* Guest buffers mapped for zero-copy transfers */
+    struct iovec *iov;
+    int niov;
+    DMADirection dir;
 } SCSIGenericReq;
 
 static void scsi_generic_save_request(QEMUFile *f, SCSIRequest *req)
@@ -77,10 +83,82 @@ static void scsi_generic_load_request(QEMUFile *f, SCSIRequest *req)
     }
 }
 
+/* The device model looks at or patches the data of these commands, so
+ * they always go through r->buf.
+ */
+static bool scsi_generic_snoops(SCSIGenericReq *r)
+{
+    switch (r->req.cmd.buf[0]) {
+    case READ_CAPACITY_10:
+    case SERVICE_ACTION_IN_16:
+    case MODE_SENSE:
+    case MODE_SENSE_10:
+    case MODE_SELECT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void scsi_generic_unmap_sg(SCSIGenericReq *r)
+{
+    QEMUSGList *sg = r->req.sg;
+    int i;
+
+    for (i = 0; i < r->niov; i++) {
+        dma_memory_unmap(sg->as, r->iov[i].iov_base, r->iov[i].iov_len,
+                         r->dir, r->iov[i].iov_len);
+    }
+    g_free(r->iov);
+    r->iov = NULL;
+    r->niov = 0;
+}
+
+/* Map the guest buffers of the request so that the sg driver transfers
+ * data straight to and from guest memory.  Returns false if the request
+ * has to be bounced through r->buf.
+ */
+static bool scsi_generic_map_sg(SCSIGenericReq *r)
+{
+    QEMUSGList *sg = r->req.sg;
+    dma_addr_t remaining = r->req.cmd.xfer;
+    int i;
+
+    if (!sg || sg->size < remaining || scsi_generic_snoops(r)) {
+        return false;
+    }
+
+    r->dir = r->req.cmd.mode == SCSI_XFER_FROM_DEV ?
+             DMA_DIRECTION_FROM_DEVICE : DMA_DIRECTION_TO_DEVICE;
+    r->iov = g_new(struct iovec, sg->nsg);
+    for (i = 0; i < sg->nsg && remaining; i++) {
+        dma_addr_t want = MIN(sg->sg[i].len, remaining);
+        dma_addr_t len = want;
+        void *mem = dma_memory_map(sg->as, sg->sg[i].base, &len, r->dir);
+
+        if (!mem) {
+            goto fail;
+        }
+        r->iov[r->niov].iov_base = mem;
+        r->iov[r->niov].iov_len = len;
+        r->niov++;
+        if (len < want) {
+            goto fail;
+        }
+        remaining -= len;
+    }
+    return true;
+
+fail:
+    scsi_generic_unmap_sg(r);
+    return false;
+}
+
 static void scsi_free_request(SCSIRequest *req)
 {
     SCSIGenericReq *r = DO_UPCAST(SCSIGenericReq, req, req);
 
+    scsi_generic_unmap_sg(r);
     g_free(r->buf);
 }
 
@@ -91,6 +169,10 @@ static void scsi_command_complete_noio(SCSIGenericReq *r, int ret)
 
     assert(r->req.aiocb == NULL);
 
+    if (r->niov) {
+        scsi_generic_unmap_sg(r);
+        r->req.resid = r->io_header.resid;
+    }
     if (r->req.io_canceled) {
         scsi_req_cancel_complete(&r->req);
         goto done;
@@ -154,8 +236,14 @@ static int execute_command(BlockBackend *blk,
 {
     r->io_header.interface_id = 'S';
     r->io_header.dxfer_direction = direction;
-    r->io_header.dxferp = r->buf;
-    r->io_header.dxfer_len = r->buflen;
+    if (r->niov) {
+        r->io_header.iovec_count = r->niov;
+        r->io_header.dxferp = r->iov;
+        r->io_header.dxfer_len = r->req.cmd.xfer;
+    } else {
+        r->io_header.dxferp = r->buf;
+        r->io_header.dxfer_len = r->buflen;
+    }
     r->io_header.cmdp = r->req.cmd.buf;
     r->io_header.cmd_len = r->req.cmd.len;
     r->io_header.mx_sb_len = sizeof(r->req.sense);
@@ -242,7 +330,8 @@ static void scsi_read_data(SCSIRequest *req)
     }
 
     ret = execute_command(s->conf.blk, r, SG_DXFER_FROM_DEV,
-                          scsi_read_complete);
+                          r->niov ? scsi_command_complete :
+                                    scsi_read_complete);
     if (ret < 0) {
         scsi_command_complete_noio(r, ret);
     }
@@ -281,7 +370,7 @@ static void scsi_write_data(SCSIRequest *req)
     int ret;
 
     DPRINTF("scsi_write_data 0x%x\n", req->tag);
-    if (r->len == 0) {
+    if (r->len == 0 && !r->niov) {
         r->len = r->buflen;
         scsi_req_data(&r->req, r->len);
         return;
@@ -339,6 +428,18 @@ static int32_t scsi_send_command(SCSIRequest *req, uint8_t *cmd)
         return 0;
     }
 
+    if (scsi_generic_map_sg(r)) {
+        g_free(r->buf);
+        r->buflen = 0;
+        r->buf = NULL;
+        r->len = r->req.cmd.xfer;
+        if (r->req.cmd.mode == SCSI_XFER_TO_DEV) {
+            return -r->req.cmd.xfer;
+        } else {
+            return r->req.cmd.xfer;
+        }
+    }
+
     if (r->buflen != r->req.cmd.xfer) {
         g_free(r->buf);
         r->buf = g_malloc(r->req.cmd.xfer);
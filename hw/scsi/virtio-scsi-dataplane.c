@@ -19,8 +19,108 @@
 #include <block/scsi.h>
 #include <hw/virtio/virtio-bus.h>
 #include "hw/virtio/virtio-access.h"
+#include "qapi/error.h"
 #include "stdio.h"
 
+static void virtio_scsi_init_ctx(VirtIOSCSI *s, VirtIOSCSIContext *c,
+                                 AioContext *ctx)
+{
+    c->s = s;
+    c->ctx = ctx;
+    c->bh = aio_bh_new(ctx, virtio_scsi_run_forwarded, c);
+    qemu_mutex_init(&c->lock);
+    QTAILQ_INIT(&c->reqs);
+}
+
+VirtIOSCSIContext *virtio_scsi_find_ctx(VirtIOSCSI *s, AioContext *ctx)
+{
+    int i;
+
+    for (i = 0; i < s->num_ctxs; i++) {
+        if (s->ctxs[i].ctx == ctx) {
+            return &s->ctxs[i];
+        }
+    }
+    return NULL;
+}
+
+/* Command queue i runs in the i-th context modulo the number of contexts,
+ * the control and event queues run in s->ctx.
+ */
+AioContext *virtio_scsi_vq_ctx(VirtIOSCSI *s, VirtQueue *vq)
+{
+    int n = virtio_queue_get_id(vq);
+
+    if (n < 2 || !s->num_ctxs) {
+        return s->ctx;
+    }
+    return s->ctxs[(n - 2) % s->num_ctxs].ctx;
+}
+
+/* Context: QEMU global mutex held */
+AioContext *virtio_scsi_next_lun_ctx(VirtIOSCSI *s)
+{
+    return s->ctxs[s->next_lun_ctx++ % s->num_ctxs].ctx;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_set_iothreads(VirtIOSCSI *s, Error **errp)
+{
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    char **ids = g_strsplit(vs->conf.iothreads, ":", -1);
+    IOThread **iothreads;
+    int i, n = g_strv_length(ids);
+
+    iothreads = g_new(IOThread *, n);
+    for (i = 0; i < n; i++) {
+        iothreads[i] = (IOThread *)object_resolve_path_type(ids[i],
+                                                           TYPE_IOTHREAD,
+                                                           NULL);
+        if (!iothreads[i]) {
+            error_setg(errp, "Cannot find iothread '%s'", ids[i]);
+            goto out;
+        }
+    }
+    if (n == 0) {
+        error_setg(errp, "iothreads must name at least one iothread");
+        goto out;
+    }
+
+    s->ctxs = g_new0(VirtIOSCSIContext, n);
+    for (i = 0; i < n; i++) {
+        AioContext *ctx = iothread_get_aio_context(iothreads[i]);
+
+        if (!virtio_scsi_find_ctx(s, ctx)) {
+            virtio_scsi_init_ctx(s, &s->ctxs[s->num_ctxs++], ctx);
+        }
+    }
+
+    if (!vs->conf.iothread) {
+        vs->conf.iothread = iothreads[0];
+        object_ref(OBJECT(vs->conf.iothread));
+    }
+    virtio_scsi_set_iothread(s, vs->conf.iothread);
+
+out:
+    g_free(iothreads);
+    g_strfreev(ids);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_clear_iothreads(VirtIOSCSI *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_ctxs; i++) {
+        assert(QTAILQ_EMPTY(&s->ctxs[i].reqs));
+        qemu_bh_delete(s->ctxs[i].bh);
+        qemu_mutex_destroy(&s->ctxs[i].lock);
+    }
+    g_free(s->ctxs);
+    s->ctxs = NULL;
+    s->num_ctxs = 0;
+}
+
 /* Context: QEMU global mutex held */
 void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
 {
@@ -30,6 +130,11 @@ void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
 
     assert(!s->ctx);
     s->ctx = iothread_get_aio_context(vs->conf.iothread);
+    if (!s->ctxs) {
+        s->ctxs = g_new0(VirtIOSCSIContext, 1);
+        s->num_ctxs = 1;
+        virtio_scsi_init_ctx(s, &s->ctxs[0], s->ctx);
+    }
 
     /* Don't try if transport does not support notifiers. */
     if (!k->set_guest_notifiers || !k->set_host_notifier) {
@@ -43,6 +148,7 @@ static int virtio_scsi_vring_init(VirtIOSCSI *s, VirtQueue *vq, int n)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    AioContext *ctx = virtio_scsi_vq_ctx(s, vq);
     int rc;
 
     /* Set up virtqueue notify */
@@ -54,7 +160,9 @@ static int virtio_scsi_vring_init(VirtIOSCSI *s, VirtQueue *vq, int n)
         return rc;
     }
 
-    virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, true, true);
+    aio_context_acquire(ctx);
+    virtio_queue_aio_set_host_notifier_handler(vq, ctx, true, true);
+    aio_context_release(ctx);
     return 0;
 }
 
@@ -65,16 +173,37 @@ void virtio_scsi_dataplane_notify(VirtIODevice *vdev, VirtIOSCSIReq *req)
     }
 }
 
+static void virtio_scsi_clear_vq_aio(VirtIOSCSI *s, VirtQueue *vq)
+{
+    AioContext *ctx = virtio_scsi_vq_ctx(s, vq);
+
+    aio_context_acquire(ctx);
+    virtio_queue_aio_set_host_notifier_handler(vq, ctx, false, false);
+    aio_context_release(ctx);
+}
+
 /* assumes s->ctx held */
 static void virtio_scsi_clear_aio(VirtIOSCSI *s)
 {
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
     int i;
 
-    virtio_queue_aio_set_host_notifier_handler(vs->ctrl_vq, s->ctx, false, false);
-    virtio_queue_aio_set_host_notifier_handler(vs->event_vq, s->ctx, false, false);
+    virtio_scsi_clear_vq_aio(s, vs->ctrl_vq);
+    virtio_scsi_clear_vq_aio(s, vs->event_vq);
     for (i = 0; i < vs->conf.num_queues; i++) {
-        virtio_queue_aio_set_host_notifier_handler(vs->cmd_vqs[i], s->ctx, false, false);
+        virtio_scsi_clear_vq_aio(s, vs->cmd_vqs[i]);
+    }
+}
+
+/* Run the requests that were handed over but not picked up yet */
+static void virtio_scsi_flush_forwarded(VirtIOSCSI *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_ctxs; i++) {
+        aio_context_acquire(s->ctxs[i].ctx);
+        virtio_scsi_run_forwarded(&s->ctxs[i]);
+        aio_context_release(s->ctxs[i].ctx);
     }
 }
 
@@ -162,6 +291,7 @@ void virtio_scsi_dataplane_stop(VirtIOSCSI *s)
     aio_context_acquire(s->ctx);
 
     virtio_scsi_clear_aio(s);
+    virtio_scsi_flush_forwarded(s);
 
     blk_drain_all(); /* ensure there are no in-flight requests */
 
@@ -64,14 +64,17 @@ static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
     VirtIOSCSI *s = req->dev;
     VirtQueue *vq = req->vq;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    QemuMutex *lock = &s->vq_locks[virtio_queue_get_id(vq)];
 
     qemu_iovec_from_buf(&req->resp_iov, 0, &req->resp, req->resp_size);
+    qemu_mutex_lock(lock);
     virtqueue_push(vq, &req->elem, req->qsgl.size + req->resp_iov.size);
     if (s->dataplane_started) {
         virtio_scsi_dataplane_notify(vdev, req);
     } else {
         virtio_notify(vdev, vq);
     }
+    qemu_mutex_unlock(lock);
 
     if (req->sreq) {
         req->sreq->hba_private = NULL;
@@ -170,9 +173,12 @@ static int virtio_scsi_parse_req(VirtIOSCSIReq *req,
 static VirtIOSCSIReq *virtio_scsi_pop_req(VirtIOSCSI *s, VirtQueue *vq)
 {
     VirtIOSCSICommon *vs = (VirtIOSCSICommon *)s;
+    QemuMutex *lock = &s->vq_locks[virtio_queue_get_id(vq)];
     VirtIOSCSIReq *req;
 
+    qemu_mutex_lock(lock);
     req = virtqueue_pop(vq, sizeof(VirtIOSCSIReq) + vs->cdb_size);
+    qemu_mutex_unlock(lock);
     if (!req) {
         return NULL;
     }
@@ -188,7 +194,7 @@ static void virtio_scsi_save_request(QEMUFile *f, SCSIRequest *sreq)
 
     assert(n < vs->conf.num_queues);
     qemu_put_be32s(f, &n);
-    qemu_put_virtqueue_element(f, &req->elem);
+    qemu_put_virtqueue_element(VIRTIO_DEVICE(vs), f, &req->elem);
 }
 
 static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
@@ -201,7 +207,8 @@ static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
 
     qemu_get_be32s(f, &n);
     assert(n < vs->conf.num_queues);
-    req = qemu_get_virtqueue_element(f, sizeof(VirtIOSCSIReq) + vs->cdb_size);
+    req = qemu_get_virtqueue_element(VIRTIO_DEVICE(vs), f,
+                                     sizeof(VirtIOSCSIReq) + vs->cdb_size);
     virtio_scsi_init_req(s, vs->cmd_vqs[n], req);
 
     if (virtio_scsi_parse_req(req, sizeof(VirtIOSCSICmdReq) + vs->cdb_size,
@@ -235,20 +242,43 @@ static void virtio_scsi_cancel_notify(Notifier *notifier, void *data)
     g_free(n);
 }
 
+/* With dataplane, LUNs can live in a different AioContext than the
+ * control queue.  Returns the context that was acquired, if any.
+ */
+static AioContext *virtio_scsi_acquire_lun(VirtIOSCSI *s, SCSIDevice *d)
+{
+    AioContext *ctx;
+
+    if (!s->dataplane_started || !d) {
+        return NULL;
+    }
+    ctx = blk_get_aio_context(d->conf.blk);
+    if (ctx == s->ctx) {
+        return NULL;
+    }
+    aio_context_acquire(ctx);
+    return ctx;
+}
+
+static void virtio_scsi_release_lun(AioContext *ctx)
+{
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
 /* Return 0 if the request is ready to be completed and return to guest;
  * -EINPROGRESS if the request is submitted and will be completed later, in the
  *  case of async cancellation. */
-static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
+static int virtio_scsi_do_lun_tmf(VirtIOSCSI *s, SCSIDevice *d,
+                                  VirtIOSCSIReq *req)
 {
-    SCSIDevice *d = virtio_scsi_device_find(s, req->req.tmf.lun);
     SCSIRequest *r, *next;
     BusChild *kid;
+    AioContext *ctx;
     int target;
     int ret = 0;
 
-    if (s->dataplane_started && d) {
-        assert(blk_get_aio_context(d->conf.blk) == s->ctx);
-    }
     /* Here VIRTIO_SCSI_S_OK means "FUNCTION COMPLETE".  */
     req->resp.tmf.response = VIRTIO_SCSI_S_OK;
 
@@ -350,7 +380,9 @@ static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
         QTAILQ_FOREACH(kid, &s->bus.qbus.children, sibling) {
              d = SCSI_DEVICE(kid->child);
              if (d->channel == 0 && d->id == target) {
+                ctx = virtio_scsi_acquire_lun(s, d);
                 qdev_reset_all(&d->qdev);
+                virtio_scsi_release_lun(ctx);
              }
         }
         s->resetting--;
@@ -373,6 +405,17 @@ fail:
     return ret;
 }
 
+static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
+{
+    SCSIDevice *d = virtio_scsi_device_find(s, req->req.tmf.lun);
+    AioContext *ctx = virtio_scsi_acquire_lun(s, d);
+    int ret;
+
+    ret = virtio_scsi_do_lun_tmf(s, d, req);
+    virtio_scsi_release_lun(ctx);
+    return ret;
+}
+
 void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
     VirtIODevice *vdev = (VirtIODevice *)s;
@@ -530,9 +573,6 @@ bool virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req)
         virtio_scsi_complete_cmd_req(req);
         return false;
     }
-    if (s->dataplane_started) {
-        assert(blk_get_aio_context(d->conf.blk) == s->ctx);
-    }
     req->sreq = scsi_req_new(d, req->req.cmd.tag,
                              virtio_scsi_get_lun(req->req.cmd.lun),
                              req->req.cmd.cdb, req);
@@ -559,18 +599,82 @@ void virtio_scsi_handle_cmd_req_submit(VirtIOSCSI *s, VirtIOSCSIReq *req)
     scsi_req_unref(sreq);
 }
 
+/* Hand @req over to the AioContext of its LUN, if that is not the one
+ * that @vq runs in.  Returns true if the request was handed over.
+ */
+static bool virtio_scsi_forward_cmd_req(VirtIOSCSI *s, VirtQueue *vq,
+                                        VirtIOSCSIReq *req)
+{
+    uint8_t lun[8];
+    SCSIDevice *d;
+    VirtIOSCSIContext *c;
+
+    if (iov_to_buf(req->elem.out_sg, req->elem.out_num, 0,
+                   lun, sizeof(lun)) < sizeof(lun)) {
+        return false;
+    }
+    d = virtio_scsi_device_find(s, lun);
+    if (!d) {
+        return false;
+    }
+    c = virtio_scsi_find_ctx(s, blk_get_aio_context(d->conf.blk));
+    if (!c || c->ctx == virtio_scsi_vq_ctx(s, vq)) {
+        return false;
+    }
+
+    qemu_mutex_lock(&c->lock);
+    QTAILQ_INSERT_TAIL(&c->reqs, req, next);
+    qemu_mutex_unlock(&c->lock);
+    qemu_bh_schedule(c->bh);
+    return true;
+}
+
+/* Context: the AioContext of the VirtIOSCSIContext, held */
+void virtio_scsi_run_forwarded(void *opaque)
+{
+    VirtIOSCSIContext *c = opaque;
+    VirtIOSCSI *s = c->s;
+    VirtIOSCSIReq *req, *next;
+    QTAILQ_HEAD(, VirtIOSCSIReq) reqs = QTAILQ_HEAD_INITIALIZER(reqs);
+
+    for (;;) {
+        qemu_mutex_lock(&c->lock);
+        req = QTAILQ_FIRST(&c->reqs);
+        if (req) {
+            QTAILQ_REMOVE(&c->reqs, req, next);
+        }
+        qemu_mutex_unlock(&c->lock);
+        if (!req) {
+            break;
+        }
+        if (virtio_scsi_handle_cmd_req_prepare(s, req)) {
+            QTAILQ_INSERT_TAIL(&reqs, req, next);
+        }
+    }
+
+    QTAILQ_FOREACH_SAFE(req, &reqs, next, next) {
+        virtio_scsi_handle_cmd_req_submit(s, req);
+    }
+}
+
 static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
 {
     /* use non-QOM casts in the data path */
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
     VirtIOSCSIReq *req, *next;
     QTAILQ_HEAD(, VirtIOSCSIReq) reqs = QTAILQ_HEAD_INITIALIZER(reqs);
+    bool forward;
 
     if (s->ctx && !s->dataplane_started) {
         virtio_scsi_dataplane_start(s);
         return;
     }
+    forward = s->dataplane_started && !s->dataplane_fenced &&
+              s->num_ctxs > 1;
     while ((req = virtio_scsi_pop_req(s, vq))) {
+        if (forward && virtio_scsi_forward_cmd_req(s, vq, req)) {
+            continue;
+        }
         if (virtio_scsi_handle_cmd_req_prepare(s, req)) {
             QTAILQ_INSERT_TAIL(&reqs, req, next);
         }
@@ -774,14 +878,16 @@ static void virtio_scsi_hotplug(HotplugHandler *hotplug_dev, DeviceState *dev,
 
     if (s->ctx && !s->dataplane_disabled) {
         VirtIOSCSIBlkChangeNotifier *insert_notifier, *remove_notifier;
+        AioContext *ctx;
 
         if (blk_op_is_blocked(sd->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
             return;
         }
         blk_op_block_all(sd->conf.blk, s->blocker);
-        aio_context_acquire(s->ctx);
-        blk_set_aio_context(sd->conf.blk, s->ctx);
-        aio_context_release(s->ctx);
+        ctx = virtio_scsi_next_lun_ctx(s);
+        aio_context_acquire(ctx);
+        blk_set_aio_context(sd->conf.blk, ctx);
+        aio_context_release(ctx);
 
         insert_notifier = g_new0(VirtIOSCSIBlkChangeNotifier, 1);
         insert_notifier->n.notify = virtio_scsi_blk_insert_notifier;
@@ -865,6 +971,7 @@ void virtio_scsi_common_realize(DeviceState *dev, Error **errp,
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOSCSICommon *s = VIRTIO_SCSI_COMMON(dev);
+    Error *err = NULL;
     int i;
 
     virtio_init(vdev, "virtio-scsi", VIRTIO_ID_SCSI,
@@ -891,7 +998,15 @@ void virtio_scsi_common_realize(DeviceState *dev, Error **errp,
                                          cmd);
     }
 
-    if (s->conf.iothread) {
+    if (s->conf.iothreads) {
+        virtio_scsi_set_iothreads(VIRTIO_SCSI(s), &err);
+        if (err) {
+            error_propagate(errp, err);
+            g_free(s->cmd_vqs);
+            virtio_cleanup(vdev);
+            return;
+        }
+    } else if (s->conf.iothread) {
         virtio_scsi_set_iothread(VIRTIO_SCSI(s), s->conf.iothread);
     }
 }
@@ -900,8 +1015,10 @@ static void virtio_scsi_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOSCSI *s = VIRTIO_SCSI(dev);
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(dev);
     static int virtio_scsi_id;
     Error *err = NULL;
+    int i;
 
     virtio_scsi_common_realize(dev, &err, virtio_scsi_handle_ctrl,
                                virtio_scsi_handle_event,
@@ -911,6 +1028,11 @@ static void virtio_scsi_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    s->vq_locks = g_new(QemuMutex, vs->conf.num_queues + 2);
+    for (i = 0; i < vs->conf.num_queues + 2; i++) {
+        qemu_mutex_init(&s->vq_locks[i]);
+    }
+
     scsi_bus_new(&s->bus, sizeof(s->bus), dev,
                  &virtio_scsi_scsi_info, vdev->bus_name);
     /* override default SCSI bus hotplug-handler, with virtio-scsi's one */
@@ -955,8 +1077,15 @@ void virtio_scsi_common_unrealize(DeviceState *dev, Error **errp)
 static void virtio_scsi_device_unrealize(DeviceState *dev, Error **errp)
 {
     VirtIOSCSI *s = VIRTIO_SCSI(dev);
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(dev);
+    int i;
 
     error_free(s->blocker);
+    virtio_scsi_clear_iothreads(s);
+    for (i = 0; i < vs->conf.num_queues + 2; i++) {
+        qemu_mutex_destroy(&s->vq_locks[i]);
+    }
+    g_free(s->vq_locks);
 
     unregister_savevm(dev, "virtio-scsi", s);
     virtio_scsi_common_unrealize(dev, errp);
@@ -972,6 +1101,7 @@ static Property virtio_scsi_properties[] = {
                                            VIRTIO_SCSI_F_HOTPLUG, true),
     DEFINE_PROP_BIT("param_change", VirtIOSCSI, host_features,
                                                 VIRTIO_SCSI_F_CHANGE, true),
+    DEFINE_PROP_STRING("iothreads", VirtIOSCSI, parent_obj.conf.iothreads),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -366,6 +366,13 @@ static void tpm_tis_receive_bh(void *opaque)
     TPMState *s = opaque;
     TPMTISEmuState *tis = &s->s.tis;
     uint8_t locty = s->locty_number;
+    uint8_t l;
+
+    if (atomic_xchg(&tis->selftest_done, false)) {
+        for (l = 0; l < TPM_TIS_NUM_LOCALITIES; l++) {
+            tis->loc[l].sts |= TPM_TIS_STS_SELFTEST_DONE;
+        }
+    }
 
     tpm_tis_sts_set(&tis->loc[locty],
                     TPM_TIS_STS_VALID | TPM_TIS_STS_DATA_AVAILABLE);
@@ -387,19 +394,18 @@ static void tpm_tis_receive_bh(void *opaque)
 
 /*
  * Callback from the TPM to indicate that the response was received.
+ * This runs in the backend's thread without the iothread lock, so all
+ * register updates are left to the bottom half.
  */
 static void tpm_tis_receive_cb(TPMState *s, uint8_t locty,
                                bool is_selftest_done)
 {
     TPMTISEmuState *tis = &s->s.tis;
-    uint8_t l;
 
     assert(s->locty_number == locty);
 
     if (is_selftest_done) {
-        for (l = 0; l < TPM_TIS_NUM_LOCALITIES; l++) {
-            tis->loc[locty].sts |= TPM_TIS_STS_SELFTEST_DONE;
-        }
+        atomic_set(&tis->selftest_done, true);
     }
 
     qemu_bh_schedule(tis->bh);
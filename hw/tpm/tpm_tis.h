@@ -54,6 +54,8 @@ typedef struct TPMLocality {
 
 typedef struct TPMTISEmuState {
     QEMUBH *bh;
+    /* Set by the backend thread, consumed by the bottom half */
+    bool selftest_done;
     uint32_t offset;
     uint8_t buf[TPM_TIS_BUFFER_MAX];
 
@@ -779,6 +779,12 @@ void usb_ep_set_halted(USBDevice *dev, int pid, int ep, bool halted)
     uep->halted = halted;
 }
 
+void usb_ep_set_pipeline(USBDevice *dev, int pid, int ep, bool enabled)
+{
+    struct USBEndpoint *uep = usb_ep_get(dev, pid, ep);
+    uep->pipeline = enabled;
+}
+
 USBPacket *usb_ep_find_packet_by_id(USBDevice *dev, int pid, int ep,
                                     uint64_t id)
 {
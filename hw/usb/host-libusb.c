@@ -298,6 +298,10 @@ static bool usb_host_use_combining(USBEndpoint *ep)
     if (ep->pid != USB_TOKEN_IN) {
         return false;
     }
+    /* Packets of different streams must not be merged */
+    if (ep->max_streams) {
+        return false;
+    }
     type = usb_ep_get_type(ep->dev, ep->pid, ep->nr);
     if (type != USB_ENDPOINT_XFER_BULK) {
         return false;
@@ -822,6 +826,15 @@ static void usb_host_ep_update(USBHostDevice *s)
             usb_ep_set_type(udev, pid, ep, type);
             usb_ep_set_ifnum(udev, pid, ep, i);
             usb_ep_set_halted(udev, pid, ep, 0);
+            /*
+             * Bulk packets always complete asynchronously, so the host
+             * controller can keep several of them in flight, and libusb
+             * has a queue of URBs for the device instead of a single one.
+             */
+            if (type == LIBUSB_TRANSFER_TYPE_BULK &&
+                (s->options & (1 << USB_HOST_OPT_PIPELINE))) {
+                usb_ep_set_pipeline(udev, pid, ep, true);
+            }
 #ifdef HAVE_STREAMS
             if (type == LIBUSB_TRANSFER_TYPE_BULK &&
                     libusb_get_ss_endpoint_companion_descriptor(ctx, endp,
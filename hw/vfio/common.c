@@ -27,9 +27,12 @@
 #include "hw/vfio/vfio.h"
 #include "exec/address-spaces.h"
 #include "exec/memory.h"
+#include "exec/ram_addr.h"
 #include "hw/hw.h"
 #include "qemu/error-report.h"
 #include "sysemu/kvm.h"
+#include "migration/migration.h"
+#include "qmp-commands.h"
 #include "trace.h"
 
 struct vfio_group_head vfio_group_list =
@@ -299,6 +302,8 @@ static void vfio_iommu_map_notify(Notifier *n, void *data)
                          "0x%"HWADDR_PRIx", %p) = %d (%m)",
                          container, iotlb->iova,
                          iotlb->addr_mask + 1, vaddr, ret);
+        } else {
+            container->giommu_mapped += iotlb->addr_mask + 1;
         }
     } else {
         ret = vfio_dma_unmap(container, iotlb->iova, iotlb->addr_mask + 1);
@@ -307,6 +312,9 @@ static void vfio_iommu_map_notify(Notifier *n, void *data)
                          "0x%"HWADDR_PRIx") = %d (%m)",
                          container, iotlb->iova,
                          iotlb->addr_mask + 1, ret);
+        } else {
+            container->giommu_mapped -= MIN(container->giommu_mapped,
+                                            iotlb->addr_mask + 1);
         }
     }
 out:
@@ -318,13 +326,149 @@ static hwaddr vfio_container_granularity(VFIOContainer *container)
     return (hwaddr)1 << ctz64(container->iova_pgsizes);
 }
 
+static void vfio_dma_map_failed(VFIOContainer *container, int ret)
+{
+    /*
+     * On the initfn path, store the first error in the container so we
+     * can gracefully fail.  Runtime, there's not much we can do other
+     * than throw a hardware error.
+     */
+    if (!container->initialized) {
+        if (!container->error) {
+            container->error = ret;
+        }
+    } else {
+        hw_error("vfio: DMA mapping failed, unable to continue");
+    }
+}
+
+/*
+ * Guest RAM is not mapped section by section.  The sections added in a
+ * memory transaction are collected and mapped when it is committed, with
+ * neighbours that are contiguous both in IOVA and in our address space
+ * merged into one mapping.  Mapping all of RAM at startup then takes a
+ * handful of VFIO_IOMMU_MAP_DMA calls instead of one per section.
+ */
+static int vfio_dma_range_map(VFIOContainer *container, hwaddr iova,
+                              hwaddr size, void *vaddr, bool readonly)
+{
+    VFIODMARange *range;
+    int ret;
+
+    trace_vfio_dma_range_map(iova, iova + size - 1, vaddr);
+
+    ret = vfio_dma_map(container, iova, size, vaddr, readonly);
+    if (ret) {
+        error_report("vfio_dma_map(%p, 0x%"HWADDR_PRIx", "
+                     "0x%"HWADDR_PRIx", %p) = %d (%m)",
+                     container, iova, size, vaddr, ret);
+        return ret;
+    }
+
+    range = g_new0(VFIODMARange, 1);
+    range->iova = iova;
+    range->size = size;
+    range->vaddr = vaddr;
+    range->readonly = readonly;
+    QLIST_INSERT_HEAD(&container->dma_list, range, next);
+    return 0;
+}
+
+/*
+ * Unmap the guest RAM in [iova, end).  A type1v2 IOMMU cannot split a
+ * mapping, so merged mappings that extend beyond the range are unmapped
+ * whole and their remainder is mapped again.  This only happens when the
+ * layout of RAM changes, e.g. when the firmware reprograms the PAM
+ * registers, not while devices do DMA.
+ */
+static int vfio_dma_range_unmap(VFIOContainer *container, hwaddr iova,
+                                hwaddr end)
+{
+    VFIODMARange *range, *tmp;
+    int ret = 0;
+
+    QLIST_FOREACH_SAFE(range, &container->dma_list, next, tmp) {
+        hwaddr range_end = range->iova + range->size;
+        int err;
+
+        if (range_end <= iova || range->iova >= end) {
+            continue;
+        }
+
+        QLIST_REMOVE(range, next);
+        err = vfio_dma_unmap(container, range->iova, range->size);
+        if (err) {
+            ret = err;
+        } else {
+            if (range->iova < iova) {
+                err = vfio_dma_range_map(container, range->iova,
+                                         iova - range->iova, range->vaddr,
+                                         range->readonly);
+            }
+            if (!err && range_end > end) {
+                err = vfio_dma_range_map(container, end, range_end - end,
+                                         range->vaddr + (end - range->iova),
+                                         range->readonly);
+            }
+            if (err) {
+                vfio_dma_map_failed(container, err);
+            }
+        }
+        g_free(range);
+    }
+    return ret;
+}
+
+static gint vfio_dma_range_compare(gconstpointer a, gconstpointer b)
+{
+    const VFIODMARange *ra = a, *rb = b;
+
+    return ra->iova < rb->iova ? -1 : ra->iova > rb->iova;
+}
+
+static void vfio_listener_commit(MemoryListener *listener)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer, listener);
+    GArray *pending = container->pending;
+    VFIODMARange cur, *next;
+    unsigned int i;
+    int ret;
+
+    if (!pending->len) {
+        return;
+    }
+
+    g_array_sort(pending, vfio_dma_range_compare);
+    cur = g_array_index(pending, VFIODMARange, 0);
+    for (i = 1; i <= pending->len; i++) {
+        next = i < pending->len ? &g_array_index(pending, VFIODMARange, i)
+                                : NULL;
+        if (next && next->iova == cur.iova + cur.size &&
+            next->vaddr == cur.vaddr + cur.size &&
+            next->readonly == cur.readonly) {
+            cur.size += next->size;
+            continue;
+        }
+
+        ret = vfio_dma_range_map(container, cur.iova, cur.size, cur.vaddr,
+                                 cur.readonly);
+        if (ret) {
+            vfio_dma_map_failed(container, ret);
+        }
+        if (next) {
+            cur = *next;
+        }
+    }
+    g_array_set_size(pending, 0);
+}
+
 static void vfio_listener_region_add(MemoryListener *listener,
                                      MemoryRegionSection *section)
 {
     VFIOContainer *container = container_of(listener, VFIOContainer, listener);
     hwaddr iova, end;
     Int128 llend;
-    void *vaddr;
+    VFIODMARange range;
     int ret;
 
     if (vfio_listener_skipped_section(section)) {
@@ -391,35 +535,21 @@ static void vfio_listener_region_add(MemoryListener *listener,
 
     /* Here we assume that memory_region_is_ram(section->mr)==true */
 
-    vaddr = memory_region_get_ram_ptr(section->mr) +
-            section->offset_within_region +
-            (iova - section->offset_within_address_space);
-
-    trace_vfio_listener_region_add_ram(iova, end - 1, vaddr);
+    range.iova = iova;
+    range.size = end - iova;
+    range.vaddr = memory_region_get_ram_ptr(section->mr) +
+                  section->offset_within_region +
+                  (iova - section->offset_within_address_space);
+    range.readonly = section->readonly;
 
-    ret = vfio_dma_map(container, iova, end - iova, vaddr, section->readonly);
-    if (ret) {
-        error_report("vfio_dma_map(%p, 0x%"HWADDR_PRIx", "
-                     "0x%"HWADDR_PRIx", %p) = %d (%m)",
-                     container, iova, end - iova, vaddr, ret);
-        goto fail;
-    }
+    trace_vfio_listener_region_add_ram(iova, end - 1, range.vaddr);
 
+    /* Mapped by vfio_listener_commit() */
+    g_array_append_val(container->pending, range);
     return;
 
 fail:
-    /*
-     * On the initfn path, store the first error in the container so we
-     * can gracefully fail.  Runtime, there's not much we can do other
-     * than throw a hardware error.
-     */
-    if (!container->initialized) {
-        if (!container->error) {
-            container->error = ret;
-        }
-    } else {
-        hw_error("vfio: DMA mapping failed, unable to continue");
-    }
+    vfio_dma_map_failed(container, ret);
 }
 
 static void vfio_listener_region_del(MemoryListener *listener,
@@ -474,7 +604,14 @@ static void vfio_listener_region_del(MemoryListener *listener,
 
     trace_vfio_listener_region_del(iova, end - 1);
 
-    ret = vfio_dma_unmap(container, iova, end - iova);
+    if (memory_region_is_iommu(section->mr)) {
+        ret = vfio_dma_unmap(container, iova, end - iova);
+        if (QLIST_EMPTY(&container->giommu_list)) {
+            container->giommu_mapped = 0;
+        }
+    } else {
+        ret = vfio_dma_range_unmap(container, iova, end);
+    }
     memory_region_unref(section->mr);
     if (ret) {
         error_report("vfio_dma_unmap(%p, 0x%"HWADDR_PRIx", "
@@ -483,14 +620,187 @@ static void vfio_listener_region_del(MemoryListener *listener,
     }
 }
 
+/*
+ * Dirty page tracking.  While a migration runs, the host IOMMU tracks the
+ * guest RAM that the devices of a migratable container write to.  The
+ * kernel reports it by mapping, not by memory section, so it is merged
+ * into the dirty bitmap from a precopy notifier before each bitmap sync
+ * instead of from log_sync.  Without tracking, all mapped RAM is dirty.
+ */
+static bool vfio_container_migratable(VFIOContainer *container)
+{
+    VFIOGroup *group;
+    VFIODevice *vbasedev;
+
+    QLIST_FOREACH(group, &container->group_list, container_next) {
+        QLIST_FOREACH(vbasedev, &group->device_list, next) {
+            if (vbasedev->migration) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static int vfio_dirty_pages_ioctl(VFIOContainer *container, uint32_t flags)
+{
+    struct vfio_iommu_type1_dirty_bitmap dirty = {
+        .argsz = sizeof(dirty),
+        .flags = flags,
+    };
+
+    if (ioctl(container->fd, VFIO_IOMMU_DIRTY_PAGES, &dirty)) {
+        return -errno;
+    }
+    return 0;
+}
+
+static void vfio_listener_log_global_start(MemoryListener *listener)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer, listener);
+    int ret = -ENOTSUP;
+
+    if (!vfio_container_migratable(container)) {
+        return;
+    }
+
+    container->dirty_log = true;
+    if (container->iova_pgsizes & qemu_real_host_page_size) {
+        ret = vfio_dirty_pages_ioctl(container,
+                                     VFIO_IOMMU_DIRTY_PAGES_FLAG_START);
+    }
+    container->dirty_pages_started = !ret;
+    if (ret) {
+        error_report("vfio: cannot track the pages written by devices: %s, "
+                     "all mapped memory is migrated as dirty",
+                     strerror(-ret));
+    }
+    trace_vfio_dirty_log(container->fd, true, container->dirty_pages_started);
+}
+
+static void vfio_listener_log_global_stop(MemoryListener *listener)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer, listener);
+
+    if (container->dirty_pages_started) {
+        vfio_dirty_pages_ioctl(container, VFIO_IOMMU_DIRTY_PAGES_FLAG_STOP);
+    }
+    if (container->dirty_log) {
+        trace_vfio_dirty_log(container->fd, false, false);
+    }
+    container->dirty_log = false;
+    container->dirty_pages_started = false;
+}
+
+static void vfio_dma_range_set_dirty(VFIODMARange *range, hwaddr offset,
+                                     hwaddr len)
+{
+    /* A merged mapping may span several RAM blocks */
+    while (len) {
+        ram_addr_t block_offset;
+        RAMBlock *block;
+        hwaddr chunk;
+
+        block = qemu_ram_block_from_host(range->vaddr + offset, false,
+                                         &block_offset);
+        if (!block) {
+            return;
+        }
+        chunk = MIN(len, block->used_length - block_offset);
+        cpu_physical_memory_set_dirty_range(block->offset + block_offset,
+                                            chunk, DIRTY_CLIENTS_NOCODE);
+        offset += chunk;
+        len -= chunk;
+    }
+}
+
+static void vfio_dma_range_sync_dirty(VFIOContainer *container,
+                                      VFIODMARange *range)
+{
+    struct vfio_iommu_type1_dirty_bitmap *dirty;
+    struct vfio_iommu_type1_dirty_bitmap_get *get;
+    uint64_t pgsize = qemu_real_host_page_size;
+    unsigned long pages = range->size / pgsize;
+    unsigned long *bitmap;
+    unsigned long page, end;
+
+    if (!container->dirty_pages_started) {
+        vfio_dma_range_set_dirty(range, 0, range->size);
+        return;
+    }
+
+    bitmap = bitmap_new(pages);
+    dirty = g_malloc0(sizeof(*dirty) + sizeof(*get));
+    dirty->argsz = sizeof(*dirty) + sizeof(*get);
+    dirty->flags = VFIO_IOMMU_DIRTY_PAGES_FLAG_GET_BITMAP;
+    get = (struct vfio_iommu_type1_dirty_bitmap_get *)&dirty->data;
+    get->iova = range->iova;
+    get->size = range->size;
+    get->bitmap.pgsize = pgsize;
+    get->bitmap.size = BITS_TO_LONGS(pages) * sizeof(unsigned long);
+    get->bitmap.data = (__u64 *)bitmap;
+
+    if (ioctl(container->fd, VFIO_IOMMU_DIRTY_PAGES, dirty)) {
+        error_report("vfio: cannot get the dirty pages of 0x%"HWADDR_PRIx
+                     "..0x%"HWADDR_PRIx": %m", range->iova,
+                     range->iova + range->size - 1);
+        vfio_dma_range_set_dirty(range, 0, range->size);
+        goto out;
+    }
+
+    for (page = find_first_bit(bitmap, pages); page < pages;
+         page = find_next_bit(bitmap, pages, end)) {
+        end = find_next_zero_bit(bitmap, pages, page);
+        vfio_dma_range_set_dirty(range, page * pgsize, (end - page) * pgsize);
+    }
+
+out:
+    g_free(dirty);
+    g_free(bitmap);
+}
+
+static void vfio_dirty_sync_notify(Notifier *n, void *data)
+{
+    VFIOContainer *container = container_of(n, VFIOContainer,
+                                            dirty_sync_notify);
+    PrecopyNotifyReason *reason = data;
+    VFIODMARange *range;
+
+    if (*reason != PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC ||
+        !container->dirty_log) {
+        return;
+    }
+
+    trace_vfio_dirty_sync(container->fd, container->dirty_pages_started);
+    QLIST_FOREACH(range, &container->dma_list, next) {
+        /* Devices cannot write there */
+        if (!range->readonly) {
+            vfio_dma_range_sync_dirty(container, range);
+        }
+    }
+}
+
 static const MemoryListener vfio_memory_listener = {
     .region_add = vfio_listener_region_add,
     .region_del = vfio_listener_region_del,
+    .commit = vfio_listener_commit,
+    .log_global_start = vfio_listener_log_global_start,
+    .log_global_stop = vfio_listener_log_global_stop,
 };
 
 static void vfio_listener_release(VFIOContainer *container)
 {
+    VFIODMARange *range, *tmp;
+
     memory_listener_unregister(&container->listener);
+    precopy_remove_notifier(&container->dirty_sync_notify);
+
+    /* The mappings go away with the container fd */
+    QLIST_FOREACH_SAFE(range, &container->dma_list, next, tmp) {
+        QLIST_REMOVE(range, next);
+        g_free(range);
+    }
+    g_array_free(container->pending, true);
 }
 
 int vfio_region_setup(Object *obj, VFIODevice *vbasedev, VFIORegion *region,
@@ -876,6 +1186,10 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as)
     }
 
     container->listener = vfio_memory_listener;
+    container->pending = g_array_new(false, false, sizeof(VFIODMARange));
+    QLIST_INIT(&container->dma_list);
+    container->dirty_sync_notify.notify = vfio_dirty_sync_notify;
+    precopy_add_notifier(&container->dirty_sync_notify);
 
     memory_listener_register(&container->listener, container->space->as);
 
@@ -1009,6 +1323,45 @@ free_group_exit:
     return NULL;
 }
 
+VfioContainerInfoList *qmp_query_vfio(Error **errp)
+{
+    VfioContainerInfoList *head = NULL, **prev = &head;
+    VFIOAddressSpace *space;
+
+    QLIST_FOREACH(space, &vfio_address_spaces, list) {
+        VFIOContainer *container;
+
+        QLIST_FOREACH(container, &space->containers, next) {
+            VfioContainerInfoList *elem = g_new0(VfioContainerInfoList, 1);
+            VfioContainerInfo *info = g_new0(VfioContainerInfo, 1);
+            intList **group_prev = &info->groups;
+            VFIODMARange *range;
+            VFIOGroup *group;
+
+            QLIST_FOREACH(group, &container->group_list, container_next) {
+                intList *group_elem = g_new0(intList, 1);
+
+                group_elem->value = group->groupid;
+                *group_prev = group_elem;
+                group_prev = &group_elem->next;
+            }
+
+            QLIST_FOREACH(range, &container->dma_list, next) {
+                info->mapped += range->size;
+                info->mappings++;
+            }
+            info->guest_iommu = !QLIST_EMPTY(&container->giommu_list);
+            info->guest_iommu_mapped = container->giommu_mapped;
+
+            elem->value = info;
+            *prev = elem;
+            prev = &elem->next;
+        }
+    }
+
+    return head;
+}
+
 void vfio_put_group(VFIOGroup *group)
 {
     if (!group || !QLIST_EMPTY(&group->device_list)) {
@@ -1083,6 +1436,7 @@ int vfio_get_region_info(VFIODevice *vbasedev, int index,
     *info = g_malloc0(argsz);
 
     (*info)->index = index;
+retry:
     (*info)->argsz = argsz;
 
     if (ioctl(vbasedev->fd, VFIO_DEVICE_GET_REGION_INFO, *info)) {
@@ -1090,9 +1444,65 @@ int vfio_get_region_info(VFIODevice *vbasedev, int index,
         return -errno;
     }
 
+    /* The capabilities did not fit, ask again with room for them */
+    if ((*info)->argsz > argsz) {
+        argsz = (*info)->argsz;
+        *info = g_realloc(*info, argsz);
+        goto retry;
+    }
+
     return 0;
 }
 
+static struct vfio_info_cap_header *
+vfio_get_region_info_cap(struct vfio_region_info *info, uint16_t id)
+{
+    struct vfio_info_cap_header *hdr;
+    void *ptr = info;
+
+    if (!(info->flags & VFIO_REGION_INFO_FLAG_CAPS)) {
+        return NULL;
+    }
+
+    for (hdr = ptr + info->cap_offset; hdr != ptr; hdr = ptr + hdr->next) {
+        if (hdr->id == id) {
+            return hdr;
+        }
+    }
+
+    return NULL;
+}
+
+/* Find the region of a device with the given type capability */
+int vfio_get_dev_region_info(VFIODevice *vbasedev, uint32_t type,
+                             uint32_t subtype, struct vfio_region_info **info)
+{
+    int i;
+
+    for (i = 0; i < vbasedev->num_regions; i++) {
+        struct vfio_info_cap_header *hdr;
+        struct vfio_region_info_cap_type *cap_type;
+
+        if (vfio_get_region_info(vbasedev, i, info)) {
+            continue;
+        }
+
+        hdr = vfio_get_region_info_cap(*info, VFIO_REGION_INFO_CAP_TYPE);
+        if (hdr) {
+            cap_type = container_of(hdr, struct vfio_region_info_cap_type,
+                                    header);
+            if (cap_type->type == type && cap_type->subtype == subtype) {
+                return 0;
+            }
+        }
+
+        g_free(*info);
+    }
+
+    *info = NULL;
+    return -ENODEV;
+}
+
 /*
  * Interfaces for IBM EEH (Enhanced Error Handling)
  */
@@ -0,0 +1,529 @@
+/*
+ * vfio device migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * A device that exposes a migration region saves and restores its state
+ * through it, see struct vfio_device_migration_info.  The state is sent
+ * by iterative savevm handlers: while the VM runs, the device hands out
+ * what it can already (e.g. the contents of its memory), and the rest
+ * once the VM stopped.  The guest memory that devices write to is tracked
+ * by the host IOMMU, see the dirty page tracking in common.c.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/ioctl.h>
+#include <linux/vfio.h>
+
+#include "hw/qdev.h"
+#include "hw/vfio/vfio-common.h"
+#include "qemu/error-report.h"
+#include "exec/address-spaces.h"
+#include "migration/migration.h"
+#include "sysemu/sysemu.h"
+#include "trace.h"
+
+/* Markers in the stream of a device */
+#define VFIO_MIG_FLAG_END_OF_STATE      (0xffffffffef100001ULL)
+#define VFIO_MIG_FLAG_DEV_SETUP_STATE   (0xffffffffef100002ULL)
+#define VFIO_MIG_FLAG_DEV_DATA_STATE    (0xffffffffef100003ULL)
+
+/* Device data is copied through a bounce buffer of this size */
+#define VFIO_MIG_BUFFER_SIZE            (1 * 1024 * 1024)
+
+#define VFIO_MIG_FIELD(f) offsetof(struct vfio_device_migration_info, f)
+
+static int vfio_mig_access(VFIODevice *vbasedev, void *val, size_t count,
+                           off_t off, bool is_write)
+{
+    VFIORegion *region = &vbasedev->migration->region;
+    size_t done = 0;
+
+    while (done < count) {
+        ssize_t ret;
+
+        if (is_write) {
+            ret = pwrite(vbasedev->fd, val + done, count - done,
+                         region->fd_offset + off + done);
+        } else {
+            ret = pread(vbasedev->fd, val + done, count - done,
+                        region->fd_offset + off + done);
+        }
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            error_report("vfio: %s: cannot %s the migration region at "
+                         "0x%"PRIx64": %s", vbasedev->name,
+                         is_write ? "write" : "read", (uint64_t)off + done,
+                         ret ? strerror(errno) : "short access");
+            return ret ? -errno : -EINVAL;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+static int vfio_mig_read(VFIODevice *vbasedev, void *val, size_t count,
+                         off_t off)
+{
+    return vfio_mig_access(vbasedev, val, count, off, false);
+}
+
+static int vfio_mig_write(VFIODevice *vbasedev, void *val, size_t count,
+                          off_t off)
+{
+    return vfio_mig_access(vbasedev, val, count, off, true);
+}
+
+/* Keep the state bits in @mask and set those in @value */
+static int vfio_migration_set_state(VFIODevice *vbasedev, uint32_t mask,
+                                    uint32_t value)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    uint32_t device_state;
+    int ret;
+
+    ret = vfio_mig_read(vbasedev, &device_state, sizeof(device_state),
+                        VFIO_MIG_FIELD(device_state));
+    if (ret) {
+        return ret;
+    }
+
+    device_state = (device_state & mask) | value;
+    if (!VFIO_DEVICE_STATE_VALID(device_state)) {
+        return -EINVAL;
+    }
+
+    ret = vfio_mig_write(vbasedev, &device_state, sizeof(device_state),
+                         VFIO_MIG_FIELD(device_state));
+    if (ret) {
+        if (!vfio_mig_read(vbasedev, &device_state, sizeof(device_state),
+                           VFIO_MIG_FIELD(device_state)) &&
+            VFIO_DEVICE_STATE_IS_ERROR(device_state)) {
+            error_report("vfio: %s: device is in the error state, "
+                         "it must be reset", vbasedev->name);
+        }
+        return ret;
+    }
+
+    migration->device_state = device_state;
+    trace_vfio_migration_set_state(vbasedev->name, device_state);
+    return 0;
+}
+
+static int vfio_update_pending(VFIODevice *vbasedev)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    uint64_t pending_bytes = 0;
+    int ret;
+
+    ret = vfio_mig_read(vbasedev, &pending_bytes, sizeof(pending_bytes),
+                        VFIO_MIG_FIELD(pending_bytes));
+    migration->pending_bytes = ret ? 0 : pending_bytes;
+    return ret;
+}
+
+/* Send the data that the device prepared, returns its size or -errno */
+static int64_t vfio_save_buffer(QEMUFile *f, VFIODevice *vbasedev)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    uint64_t data_offset = 0, data_size = 0, done;
+    uint8_t *buf;
+    int ret;
+
+    ret = vfio_mig_read(vbasedev, &data_offset, sizeof(data_offset),
+                        VFIO_MIG_FIELD(data_offset));
+    if (!ret) {
+        ret = vfio_mig_read(vbasedev, &data_size, sizeof(data_size),
+                            VFIO_MIG_FIELD(data_size));
+    }
+    if (ret) {
+        return ret;
+    }
+    if (data_offset > migration->region.size ||
+        data_size > migration->region.size - data_offset) {
+        error_report("vfio: %s: device data is out of the migration region",
+                     vbasedev->name);
+        return -EINVAL;
+    }
+
+    qemu_put_be64(f, VFIO_MIG_FLAG_DEV_DATA_STATE);
+    qemu_put_be64(f, data_size);
+
+    buf = g_malloc(MIN(data_size, VFIO_MIG_BUFFER_SIZE));
+    for (done = 0; done < data_size; done += VFIO_MIG_BUFFER_SIZE) {
+        size_t len = MIN(data_size - done, VFIO_MIG_BUFFER_SIZE);
+
+        ret = vfio_mig_read(vbasedev, buf, len, data_offset + done);
+        if (ret) {
+            break;
+        }
+        qemu_put_buffer(f, buf, len);
+    }
+    g_free(buf);
+
+    if (!ret) {
+        ret = qemu_file_get_error(f);
+    }
+    trace_vfio_save_buffer(vbasedev->name, data_offset, data_size);
+    return ret ? ret : data_size;
+}
+
+static int vfio_load_buffer(QEMUFile *f, VFIODevice *vbasedev,
+                            uint64_t data_size)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    uint8_t *buf = g_malloc(MIN(data_size, VFIO_MIG_BUFFER_SIZE));
+    int ret = 0;
+
+    /* The device may take the data in several parts */
+    while (data_size && !ret) {
+        uint64_t data_offset, size, done;
+
+        ret = vfio_mig_read(vbasedev, &data_offset, sizeof(data_offset),
+                            VFIO_MIG_FIELD(data_offset));
+        if (ret) {
+            break;
+        }
+        if (data_offset >= migration->region.size) {
+            error_report("vfio: %s: data offset is out of the migration "
+                         "region", vbasedev->name);
+            ret = -EINVAL;
+            break;
+        }
+
+        size = MIN(data_size, migration->region.size - data_offset);
+        for (done = 0; done < size && !ret; done += VFIO_MIG_BUFFER_SIZE) {
+            size_t len = MIN(size - done, VFIO_MIG_BUFFER_SIZE);
+
+            qemu_get_buffer(f, buf, len);
+            ret = qemu_file_get_error(f);
+            if (!ret) {
+                ret = vfio_mig_write(vbasedev, buf, len, data_offset + done);
+            }
+        }
+        if (!ret) {
+            ret = vfio_mig_write(vbasedev, &size, sizeof(size),
+                                 VFIO_MIG_FIELD(data_size));
+        }
+        trace_vfio_load_buffer(vbasedev->name, data_offset, size);
+        data_size -= size;
+    }
+
+    g_free(buf);
+    return ret;
+}
+
+static int vfio_save_setup(QEMUFile *f, void *opaque)
+{
+    VFIODevice *vbasedev = opaque;
+    int ret;
+
+    if (migrate_postcopy_ram()) {
+        error_report("vfio: %s: postcopy is not supported", vbasedev->name);
+        return -ENOTSUP;
+    }
+
+    qemu_put_be64(f, VFIO_MIG_FLAG_DEV_SETUP_STATE);
+
+    qemu_mutex_lock_iothread();
+    ret = vfio_migration_set_state(vbasedev, VFIO_DEVICE_STATE_MASK,
+                                   VFIO_DEVICE_STATE_SAVING);
+    qemu_mutex_unlock_iothread();
+    if (ret) {
+        error_report("vfio: %s: cannot start saving the device state",
+                     vbasedev->name);
+        return ret;
+    }
+
+    qemu_put_be64(f, VFIO_MIG_FLAG_END_OF_STATE);
+    trace_vfio_save_setup(vbasedev->name);
+    return qemu_file_get_error(f);
+}
+
+static void vfio_save_cleanup(void *opaque)
+{
+    VFIODevice *vbasedev = opaque;
+
+    vbasedev->migration->pending_bytes = 0;
+}
+
+static void vfio_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
+                              uint64_t *non_postcopiable_pending,
+                              uint64_t *postcopiable_pending)
+{
+    VFIODevice *vbasedev = opaque;
+
+    if (vfio_update_pending(vbasedev)) {
+        return;
+    }
+    *non_postcopiable_pending += vbasedev->migration->pending_bytes;
+    trace_vfio_save_pending(vbasedev->name,
+                            vbasedev->migration->pending_bytes);
+}
+
+static int vfio_save_iterate(QEMUFile *f, void *opaque)
+{
+    VFIODevice *vbasedev = opaque;
+    VFIOMigration *migration = vbasedev->migration;
+    int64_t data_size;
+    int ret;
+
+    /* pending_bytes is not queried before each round by savevm */
+    if (!migration->pending_bytes) {
+        ret = vfio_update_pending(vbasedev);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    if (migration->pending_bytes) {
+        data_size = vfio_save_buffer(f, vbasedev);
+        if (data_size < 0) {
+            return data_size;
+        }
+    }
+    qemu_put_be64(f, VFIO_MIG_FLAG_END_OF_STATE);
+
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    /* Let the next round start with a fresh pending_bytes */
+    ret = migration->pending_bytes ? 0 : 1;
+    migration->pending_bytes = 0;
+    return ret;
+}
+
+static int vfio_save_complete_precopy(QEMUFile *f, void *opaque)
+{
+    VFIODevice *vbasedev = opaque;
+    VFIOMigration *migration = vbasedev->migration;
+    int64_t data_size;
+    int ret;
+
+    /* The VM is stopped, so is the device */
+    ret = vfio_migration_set_state(vbasedev, ~VFIO_DEVICE_STATE_RUNNING,
+                                   VFIO_DEVICE_STATE_SAVING);
+    if (ret) {
+        error_report("vfio: %s: cannot stop the device", vbasedev->name);
+        return ret;
+    }
+
+    ret = vfio_update_pending(vbasedev);
+    while (!ret && migration->pending_bytes) {
+        data_size = vfio_save_buffer(f, vbasedev);
+        if (data_size < 0) {
+            return data_size;
+        }
+        if (!data_size) {
+            break;
+        }
+        ret = vfio_update_pending(vbasedev);
+    }
+    if (ret) {
+        return ret;
+    }
+
+    qemu_put_be64(f, VFIO_MIG_FLAG_END_OF_STATE);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    ret = vfio_migration_set_state(vbasedev, ~VFIO_DEVICE_STATE_SAVING, 0);
+    trace_vfio_save_complete_precopy(vbasedev->name);
+    return ret;
+}
+
+static int vfio_load_state(QEMUFile *f, void *opaque, int version_id)
+{
+    VFIODevice *vbasedev = opaque;
+    uint64_t data;
+    int ret = 0;
+
+    data = qemu_get_be64(f);
+    while (data != VFIO_MIG_FLAG_END_OF_STATE) {
+        trace_vfio_load_state(vbasedev->name, data);
+
+        switch (data) {
+        case VFIO_MIG_FLAG_DEV_SETUP_STATE:
+            ret = vfio_migration_set_state(vbasedev, ~VFIO_DEVICE_STATE_MASK,
+                                           VFIO_DEVICE_STATE_RESUMING);
+            if (ret) {
+                error_report("vfio: %s: cannot start loading the device "
+                             "state", vbasedev->name);
+            }
+            break;
+        case VFIO_MIG_FLAG_DEV_DATA_STATE:
+            data = qemu_get_be64(f);
+            if (data) {
+                ret = vfio_load_buffer(f, vbasedev, data);
+            }
+            break;
+        default:
+            error_report("vfio: %s: unknown tag 0x%"PRIx64" in the "
+                         "stream", vbasedev->name, data);
+            return -EINVAL;
+        }
+
+        if (!ret) {
+            ret = qemu_file_get_error(f);
+        }
+        if (ret) {
+            return ret;
+        }
+        data = qemu_get_be64(f);
+    }
+
+    return qemu_file_get_error(f);
+}
+
+static SaveVMHandlers savevm_vfio_handlers = {
+    .save_live_setup = vfio_save_setup,
+    .cleanup = vfio_save_cleanup,
+    .save_live_pending = vfio_save_pending,
+    .save_live_iterate = vfio_save_iterate,
+    .save_live_complete_precopy = vfio_save_complete_precopy,
+    .load_state = vfio_load_state,
+};
+
+static void vfio_vmstate_change(void *opaque, int running, RunState state)
+{
+    VFIODevice *vbasedev = opaque;
+    uint32_t mask, value;
+    int ret;
+
+    if (running) {
+        /* After a load, or a failed migration, the device runs again */
+        mask = ~VFIO_DEVICE_STATE_MASK;
+        value = VFIO_DEVICE_STATE_RUNNING;
+    } else {
+        /* A device that is being saved gives out its last state */
+        mask = ~VFIO_DEVICE_STATE_RUNNING;
+        value = 0;
+    }
+
+    ret = vfio_migration_set_state(vbasedev, mask, value);
+    if (ret) {
+        error_report("vfio: %s: cannot %s the device", vbasedev->name,
+                     running ? "start" : "stop");
+    }
+}
+
+static void vfio_migration_state_notifier(Notifier *notifier, void *data)
+{
+    VFIOMigration *migration = container_of(notifier, VFIOMigration,
+                                            migration_state);
+    VFIODevice *vbasedev = migration->vbasedev;
+    MigrationState *s = data;
+
+    if (!migration_has_failed(s)) {
+        return;
+    }
+
+    /* The device stays here, it no longer needs to save its state */
+    migration->pending_bytes = 0;
+    if (vfio_migration_set_state(vbasedev, ~VFIO_DEVICE_STATE_SAVING,
+                                 runstate_is_running() ?
+                                 VFIO_DEVICE_STATE_RUNNING : 0)) {
+        error_report("vfio: %s: cannot stop saving the device state",
+                     vbasedev->name);
+    }
+}
+
+static int vfio_migration_init(VFIODevice *vbasedev, Object *obj,
+                               struct vfio_region_info *info)
+{
+    VFIOMigration *migration = g_new0(VFIOMigration, 1);
+    int ret;
+
+    migration->vbasedev = vbasedev;
+    migration->dev = DEVICE(obj);
+    vbasedev->migration = migration;
+
+    ret = vfio_region_setup(obj, vbasedev, &migration->region, info->index,
+                            "migration");
+    if (ret) {
+        goto err;
+    }
+    if (migration->region.size < sizeof(struct vfio_device_migration_info)) {
+        ret = -EINVAL;
+        goto err_region;
+    }
+
+    register_savevm_live(migration->dev, "vfio", -1, 1,
+                         &savevm_vfio_handlers, vbasedev);
+    migration->vm_state = qemu_add_vm_change_state_handler(vfio_vmstate_change,
+                                                           vbasedev);
+    migration->migration_state.notify = vfio_migration_state_notifier;
+    add_migration_state_change_notifier(&migration->migration_state);
+    return 0;
+
+err_region:
+    vfio_region_exit(&migration->region);
+    vfio_region_finalize(&migration->region);
+err:
+    vbasedev->migration = NULL;
+    g_free(migration);
+    return ret;
+}
+
+/*
+ * Set up the migration of a device.  Devices that cannot migrate block
+ * migration instead; returns whether the device can migrate.
+ */
+bool vfio_migration_probe(VFIODevice *vbasedev, Object *obj)
+{
+    VFIOContainer *container = vbasedev->group->container;
+    struct vfio_region_info *info;
+    const char *reason;
+
+    if (container->space->as != &address_space_memory) {
+        /* The dirty pages would be reported by IOVA */
+        reason = "is behind a guest IOMMU";
+    } else if (vfio_get_dev_region_info(vbasedev, VFIO_REGION_TYPE_MIGRATION,
+                                        VFIO_REGION_SUBTYPE_MIGRATION,
+                                        &info)) {
+        reason = "has no migration region";
+    } else {
+        int ret = vfio_migration_init(vbasedev, obj, info);
+
+        g_free(info);
+        if (!ret) {
+            trace_vfio_migration_probe(vbasedev->name);
+            return true;
+        }
+        reason = "has an invalid migration region";
+    }
+
+    error_setg(&vbasedev->migration_blocker,
+               "VFIO device %s cannot be migrated, it %s",
+               vbasedev->name, reason);
+    migrate_add_blocker(vbasedev->migration_blocker);
+    return false;
+}
+
+void vfio_migration_finalize(VFIODevice *vbasedev)
+{
+    VFIOMigration *migration = vbasedev->migration;
+
+    if (migration) {
+        remove_migration_state_change_notifier(&migration->migration_state);
+        qemu_del_vm_change_state_handler(migration->vm_state);
+        unregister_savevm(migration->dev, "vfio", vbasedev);
+        vfio_region_exit(&migration->region);
+        vfio_region_finalize(&migration->region);
+        g_free(migration);
+        vbasedev->migration = NULL;
+    }
+
+    if (vbasedev->migration_blocker) {
+        migrate_del_blocker(vbasedev->migration_blocker);
+        error_free(vbasedev->migration_blocker);
+        vbasedev->migration_blocker = NULL;
+    }
+}
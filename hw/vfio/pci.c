@@ -2389,6 +2389,66 @@ static void vfio_unregister_req_notifier(VFIOPCIDevice *vdev)
     vdev->req_enabled = false;
 }
 
+/* A failover primary is unplugged by its virtio-net standby instead */
+static bool vfio_pci_dev_unplug_pending(void *opaque)
+{
+    VFIOPCIDevice *vdev = DO_UPCAST(VFIOPCIDevice, pdev, PCI_DEVICE(opaque));
+
+    return vdev->failover_pair_id != NULL;
+}
+
+/*
+ * The device state itself is migrated by hw/vfio/migration.c, this is
+ * the config space that QEMU emulates.
+ */
+static int vfio_pci_post_load(void *opaque, int version_id)
+{
+    VFIOPCIDevice *vdev = opaque;
+    PCIDevice *pdev = &vdev->pdev;
+    uint16_t cmd;
+    int i;
+
+    /* Program the BARs before the device decodes them again */
+    cmd = pci_default_read_config(pdev, PCI_COMMAND, 2);
+    vfio_pci_write_config(pdev, PCI_COMMAND,
+                          cmd & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY), 2);
+    for (i = 0; i < PCI_ROM_SLOT; i++) {
+        uint32_t bar = pci_default_read_config(pdev,
+                                               PCI_BASE_ADDRESS_0 + i * 4, 4);
+
+        vfio_pci_write_config(pdev, PCI_BASE_ADDRESS_0 + i * 4, bar, 4);
+    }
+
+    if (msi_enabled(pdev)) {
+        vfio_msi_enable(vdev);
+    } else if (msix_enabled(pdev)) {
+        vfio_msix_enable(vdev);
+    }
+
+    vfio_pci_write_config(pdev, PCI_COMMAND, cmd, 2);
+    return 0;
+}
+
+static const VMStateDescription vfio_pci_vmstate = {
+    .name = "vfio-pci",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = vfio_pci_post_load,
+    .dev_unplug_pending = vfio_pci_dev_unplug_pending,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(pdev, VFIOPCIDevice),
+        VMSTATE_MSIX(pdev, VFIOPCIDevice),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* For the devices without a migration region */
+static const VMStateDescription vfio_pci_unmigratable_vmstate = {
+    .name = "vfio-pci",
+    .unmigratable = 1,
+    .dev_unplug_pending = vfio_pci_dev_unplug_pending,
+};
+
 static int vfio_initfn(PCIDevice *pdev)
 {
     VFIOPCIDevice *vdev = DO_UPCAST(VFIOPCIDevice, pdev, pdev);
@@ -2585,6 +2645,13 @@ static int vfio_initfn(PCIDevice *pdev)
     vfio_register_req_notifier(vdev);
     vfio_setup_resetfn_quirk(vdev);
 
+    if (vfio_migration_probe(&vdev->vbasedev, OBJECT(vdev))) {
+        vmstate_register(DEVICE(vdev), -1, &vfio_pci_vmstate, vdev);
+    } else {
+        vmstate_register(DEVICE(vdev), -1, &vfio_pci_unmigratable_vmstate,
+                         vdev);
+    }
+
     return 0;
 
 out_teardown:
@@ -2611,6 +2678,10 @@ static void vfio_exitfn(PCIDevice *pdev)
 {
     VFIOPCIDevice *vdev = DO_UPCAST(VFIOPCIDevice, pdev, pdev);
 
+    vmstate_unregister(DEVICE(vdev), vdev->vbasedev.migration ?
+                       &vfio_pci_vmstate : &vfio_pci_unmigratable_vmstate,
+                       vdev);
+    vfio_migration_finalize(&vdev->vbasedev);
     vfio_unregister_req_notifier(vdev);
     vfio_unregister_err_notifier(vdev);
     pci_device_set_intx_routing_notifier(&vdev->pdev, NULL);
@@ -2687,6 +2758,7 @@ static Property vfio_pci_dev_properties[] = {
                        sub_vendor_id, PCI_ANY_ID),
     DEFINE_PROP_UINT32("x-pci-sub-device-id", VFIOPCIDevice,
                        sub_device_id, PCI_ANY_ID),
+    DEFINE_PROP_STRING("failover_pair_id", VFIOPCIDevice, failover_pair_id),
     /*
      * TODO - support passed fds... is this necessary?
      * DEFINE_PROP_STRING("vfiofd", VFIOPCIDevice, vfiofd_name),
@@ -2695,11 +2767,6 @@ static Property vfio_pci_dev_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
-static const VMStateDescription vfio_pci_vmstate = {
-    .name = "vfio-pci",
-    .unmigratable = 1,
-};
-
 static void vfio_pci_dev_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -2707,7 +2774,6 @@ static void vfio_pci_dev_class_init(ObjectClass *klass, void *data)
 
     dc->reset = vfio_pci_reset;
     dc->props = vfio_pci_dev_properties;
-    dc->vmsd = &vfio_pci_vmstate;
     dc->desc = "VFIO-based PCI device assignment";
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
     pdc->init = vfio_initfn;
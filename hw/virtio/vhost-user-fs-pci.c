@@ -0,0 +1,97 @@
+/*
+ * vhost-user-fs PCI device
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "hw/pci/pci.h"
+#include "hw/virtio/virtio.h"
+#include "hw/virtio/virtio-bus.h"
+#include "hw/virtio/virtio-pci.h"
+#include "hw/virtio/vhost-user-fs.h"
+
+/* The DAX window has a BAR of its own; BAR 2 is free without PIO notify */
+#define VHOST_USER_FS_PCI_CACHE_BAR 2
+
+static Property vhost_user_fs_pci_properties[] = {
+    DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors,
+                       DEV_NVECTORS_UNSPECIFIED),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void vhost_user_fs_pci_realize(VirtIOPCIProxy *vpci_dev, Error **errp)
+{
+    VHostUserFSPCI *dev = VHOST_USER_FS_PCI(vpci_dev);
+    DeviceState *vdev = DEVICE(&dev->vdev);
+    Error *local_err = NULL;
+
+    if (dev->vdev.cache_size &&
+        (vpci_dev->flags & VIRTIO_PCI_FLAG_MODERN_PIO_NOTIFY)) {
+        error_setg(errp, "vhost-user-fs-pci: cache-size is incompatible "
+                   "with modern-pio-notify");
+        return;
+    }
+
+    if (vpci_dev->nvectors == DEV_NVECTORS_UNSPECIFIED) {
+        /* One for each request queue, the hiprio queue and config */
+        vpci_dev->nvectors = dev->vdev.num_request_queues + 2;
+    }
+
+    qdev_set_parent_bus(vdev, BUS(&vpci_dev->bus));
+    /* there is no legacy virtio-fs */
+    vpci_dev->flags &= ~VIRTIO_PCI_FLAG_DISABLE_MODERN;
+    vpci_dev->flags |= VIRTIO_PCI_FLAG_DISABLE_LEGACY;
+    object_property_set_bool(OBJECT(vdev), true, "realized", &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    if (dev->vdev.cache_size) {
+        pci_register_bar(&vpci_dev->pci_dev, VHOST_USER_FS_PCI_CACHE_BAR,
+                         PCI_BASE_ADDRESS_SPACE_MEMORY |
+                         PCI_BASE_ADDRESS_MEM_PREFETCH |
+                         PCI_BASE_ADDRESS_MEM_TYPE_64,
+                         &dev->vdev.cache);
+        virtio_pci_add_shm_cap(vpci_dev, VHOST_USER_FS_PCI_CACHE_BAR, 0,
+                               dev->vdev.cache_size,
+                               VIRTIO_FS_SHMCAP_ID_CACHE);
+    }
+}
+
+static void vhost_user_fs_pci_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    VirtioPCIClass *k = VIRTIO_PCI_CLASS(klass);
+    PCIDeviceClass *pcidev_k = PCI_DEVICE_CLASS(klass);
+
+    k->realize = vhost_user_fs_pci_realize;
+    set_bit(DEVICE_CATEGORY_STORAGE, dc->categories);
+    dc->props = vhost_user_fs_pci_properties;
+    pcidev_k->class_id = PCI_CLASS_STORAGE_OTHER;
+}
+
+static void vhost_user_fs_pci_instance_init(Object *obj)
+{
+    VHostUserFSPCI *dev = VHOST_USER_FS_PCI(obj);
+
+    virtio_instance_init_common(obj, &dev->vdev, sizeof(dev->vdev),
+                                TYPE_VHOST_USER_FS);
+}
+
+static const TypeInfo vhost_user_fs_pci_info = {
+    .name = TYPE_VHOST_USER_FS_PCI,
+    .parent = TYPE_VIRTIO_PCI,
+    .instance_size = sizeof(VHostUserFSPCI),
+    .instance_init = vhost_user_fs_pci_instance_init,
+    .class_init = vhost_user_fs_pci_class_init,
+};
+
+static void vhost_user_fs_pci_register_types(void)
+{
+    type_register_static(&vhost_user_fs_pci_info);
+}
+type_init(vhost_user_fs_pci_register_types)
@@ -0,0 +1,407 @@
+/*
+ * vhost-user-fs host device
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The FUSE requests are served by a vhost-user backend that runs outside
+ * of QEMU.  If the device has a DAX window, the backend can also ask QEMU
+ * to map ranges of the shared files there, so that the guest accesses
+ * them without sending any request at all.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "migration/migration.h"
+#include "hw/qdev-properties.h"
+#include "hw/virtio/vhost-user-fs.h"
+#include "hw/virtio/virtio.h"
+#include "hw/virtio/virtio-bus.h"
+#include "hw/virtio/virtio-access.h"
+
+/* Features that the backend decides on */
+static const int user_feature_bits[] = {
+    VIRTIO_F_VERSION_1,
+    VIRTIO_RING_F_INDIRECT_DESC,
+    VIRTIO_RING_F_EVENT_IDX,
+    VIRTIO_F_NOTIFY_ON_EMPTY,
+    VIRTIO_F_RING_PACKED,
+    VIRTIO_F_IOMMU_PLATFORM,
+    VHOST_INVALID_FEATURE_BIT
+};
+
+static void vhost_user_fs_get_config(VirtIODevice *vdev, uint8_t *config)
+{
+    VHostUserFS *fs = VHOST_USER_FS(vdev);
+    struct virtio_fs_config fscfg = {};
+
+    memcpy(fscfg.tag, fs->tag, strnlen(fs->tag, sizeof(fscfg.tag)));
+    virtio_stl_p(vdev, &fscfg.num_request_queues, fs->num_request_queues);
+    memcpy(config, &fscfg, sizeof(fscfg));
+}
+
+static bool vhost_user_fs_range_ok(VHostUserFS *fs, uint64_t offset,
+                                   uint64_t len)
+{
+    return len && offset < fs->cache_size && len <= fs->cache_size - offset;
+}
+
+/* Replaces a range of the window with inaccessible anonymous memory */
+static int vhost_user_fs_unmap_range(VHostUserFS *fs, uint64_t offset,
+                                     uint64_t len)
+{
+    void *p = mmap(fs->cache_ptr + offset, len, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+
+    return p == MAP_FAILED ? -errno : 0;
+}
+
+static int vhost_user_fs_map(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm,
+                             int fd)
+{
+    VHostUserFS *fs = container_of(dev, VHostUserFS, dev);
+    int i, ret;
+
+    if (!fs->cache_size) {
+        error_report("vhost-user-fs: map request without a DAX window");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < VHOST_USER_FS_SLAVE_ENTRIES; i++) {
+        int prot = 0;
+        void *p;
+
+        if (!sm->len[i]) {
+            continue;
+        }
+        if (!vhost_user_fs_range_ok(fs, sm->c_offset[i], sm->len[i])) {
+            error_report("vhost-user-fs: bad map range 0x%" PRIx64
+                         "+0x%" PRIx64, sm->c_offset[i], sm->len[i]);
+            ret = -EINVAL;
+            goto err;
+        }
+
+        if (sm->flags[i] & VHOST_USER_FS_FLAG_MAP_R) {
+            prot |= PROT_READ;
+        }
+        if (sm->flags[i] & VHOST_USER_FS_FLAG_MAP_W) {
+            prot |= PROT_WRITE;
+        }
+        p = mmap(fs->cache_ptr + sm->c_offset[i], sm->len[i], prot,
+                 MAP_SHARED | MAP_FIXED, fd, sm->fd_offset[i]);
+        if (p == MAP_FAILED) {
+            ret = -errno;
+            error_report("vhost-user-fs: map failed: %s", strerror(-ret));
+            goto err;
+        }
+    }
+    return 0;
+
+err:
+    /* Do not leave half of the request mapped */
+    while (--i >= 0) {
+        if (sm->len[i]) {
+            vhost_user_fs_unmap_range(fs, sm->c_offset[i], sm->len[i]);
+        }
+    }
+    return ret;
+}
+
+static int vhost_user_fs_unmap(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm)
+{
+    VHostUserFS *fs = container_of(dev, VHostUserFS, dev);
+    int i, ret = 0;
+
+    for (i = 0; i < VHOST_USER_FS_SLAVE_ENTRIES; i++) {
+        uint64_t offset = sm->c_offset[i];
+        uint64_t len = sm->len[i];
+        int r;
+
+        if (!len) {
+            continue;
+        }
+        /* A length of ~0 stands for the whole window */
+        if (len == ~(uint64_t)0) {
+            offset = 0;
+            len = fs->cache_size;
+        }
+        if (!vhost_user_fs_range_ok(fs, offset, len)) {
+            ret = -EINVAL;
+            continue;
+        }
+        r = vhost_user_fs_unmap_range(fs, offset, len);
+        if (r < 0) {
+            ret = r;
+        }
+    }
+    return ret;
+}
+
+static int vhost_user_fs_start(VHostUserFS *fs)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(fs);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i, ret;
+
+    if (!k->set_guest_notifiers) {
+        error_report("binding does not support guest notifiers");
+        return -ENOSYS;
+    }
+
+    ret = vhost_dev_enable_notifiers(&fs->dev, vdev);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = k->set_guest_notifiers(qbus->parent, fs->dev.nvqs, true);
+    if (ret < 0) {
+        error_report("Error binding guest notifier: %d", -ret);
+        goto err_host_notifiers;
+    }
+
+    fs->dev.acked_features = vdev->guest_features;
+    ret = vhost_dev_start(&fs->dev, vdev);
+    if (ret < 0) {
+        error_report("Error starting vhost: %d", -ret);
+        goto err_guest_notifiers;
+    }
+
+    for (i = 0; i < fs->dev.nvqs; i++) {
+        vhost_virtqueue_mask(&fs->dev, vdev, i, false);
+    }
+
+    return 0;
+
+err_guest_notifiers:
+    k->set_guest_notifiers(qbus->parent, fs->dev.nvqs, false);
+err_host_notifiers:
+    vhost_dev_disable_notifiers(&fs->dev, vdev);
+    return ret;
+}
+
+static void vhost_user_fs_stop(VHostUserFS *fs)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(fs);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int ret;
+
+    if (!k->set_guest_notifiers) {
+        return;
+    }
+
+    vhost_dev_stop(&fs->dev, vdev);
+
+    ret = k->set_guest_notifiers(qbus->parent, fs->dev.nvqs, false);
+    if (ret < 0) {
+        error_report("vhost guest notifier cleanup failed: %d", ret);
+    }
+
+    vhost_dev_disable_notifiers(&fs->dev, vdev);
+
+    /* A new driver must not see the files that the old one had mapped */
+    if (fs->cache_size) {
+        vhost_user_fs_unmap_range(fs, 0, fs->cache_size);
+    }
+}
+
+static void vhost_user_fs_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    VHostUserFS *fs = VHOST_USER_FS(vdev);
+    bool should_start = status & VIRTIO_CONFIG_S_DRIVER_OK;
+
+    if (!vdev->vm_running) {
+        should_start = false;
+    }
+
+    if (fs->dev.started == should_start) {
+        return;
+    }
+
+    if (should_start) {
+        int ret = vhost_user_fs_start(fs);
+
+        if (ret < 0) {
+            error_report("vhost-user-fs: unable to start vhost: %s",
+                         strerror(-ret));
+        }
+    } else {
+        vhost_user_fs_stop(fs);
+    }
+}
+
+static uint64_t vhost_user_fs_get_features(VirtIODevice *vdev,
+                                           uint64_t features,
+                                           Error **errp)
+{
+    VHostUserFS *fs = VHOST_USER_FS(vdev);
+
+    return vhost_get_features(&fs->dev, user_feature_bits, features);
+}
+
+static void vhost_user_fs_handle_output(VirtIODevice *vdev, VirtQueue *vq)
+{
+}
+
+static void vhost_user_fs_device_realize(DeviceState *dev, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    VHostUserFS *fs = VHOST_USER_FS(vdev);
+    int i, ret;
+
+    if (!fs->chardev) {
+        error_setg(errp, "vhost-user-fs: chardev is mandatory");
+        return;
+    }
+
+    if (!fs->tag || !*fs->tag) {
+        error_setg(errp, "vhost-user-fs: tag is mandatory");
+        return;
+    }
+    if (strlen(fs->tag) > sizeof(((struct virtio_fs_config *)0)->tag)) {
+        error_setg(errp, "vhost-user-fs: tag is longer than %zu bytes",
+                   sizeof(((struct virtio_fs_config *)0)->tag));
+        return;
+    }
+
+    /* One more queue is used for high priority requests */
+    if (!fs->num_request_queues ||
+        fs->num_request_queues > VIRTIO_QUEUE_MAX - 1) {
+        error_setg(errp, "vhost-user-fs: invalid number of request queues");
+        return;
+    }
+
+    if (!fs->queue_size || fs->queue_size > VIRTQUEUE_MAX_SIZE ||
+        (fs->queue_size & (fs->queue_size - 1))) {
+        error_setg(errp, "vhost-user-fs: queue size must be a power of 2 "
+                   "up to %d", VIRTQUEUE_MAX_SIZE);
+        return;
+    }
+
+    if (fs->cache_size & (getpagesize() - 1)) {
+        error_setg(errp, "vhost-user-fs: cache size must be a multiple "
+                   "of the page size");
+        return;
+    }
+
+    if (fs->cache_size) {
+        /* Nothing is accessible until the backend maps a file there */
+        fs->cache_ptr = mmap(NULL, fs->cache_size, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                             -1, 0);
+        if (fs->cache_ptr == MAP_FAILED) {
+            error_setg_errno(errp, errno, "vhost-user-fs: cannot allocate "
+                             "the DAX window");
+            fs->cache_ptr = NULL;
+            return;
+        }
+        memory_region_init_ram_ptr(&fs->cache, OBJECT(vdev),
+                                   "virtio-fs-cache", fs->cache_size,
+                                   fs->cache_ptr);
+    }
+
+    virtio_init(vdev, "virtio-fs", VIRTIO_ID_FS,
+                sizeof(struct virtio_fs_config));
+
+    for (i = 0; i < fs->num_request_queues + 1; i++) {
+        virtio_add_queue(vdev, fs->queue_size, vhost_user_fs_handle_output);
+    }
+
+    fs->conn = g_new0(VhostUserConn, 1);
+    fs->conn->chr = fs->chardev;
+    fs->conn->nvqs = fs->num_request_queues + 1;
+    fs->conn->inflight.fd = -1;
+    fs->conn->slave_fd = -1;
+    fs->conn->fs_map = vhost_user_fs_map;
+    fs->conn->fs_unmap = vhost_user_fs_unmap;
+
+    fs->dev.nvqs = fs->num_request_queues + 1;
+    fs->dev.vqs = g_new0(struct vhost_virtqueue, fs->dev.nvqs);
+    fs->dev.vq_index = 0;
+    fs->dev.backend_features = 0;
+
+    ret = vhost_dev_init(&fs->dev, fs->conn, VHOST_BACKEND_TYPE_USER, 0);
+    if (ret < 0) {
+        error_setg(errp, "vhost-user-fs: vhost initialization failed: %s",
+                   strerror(-ret));
+        goto virtio_err;
+    }
+
+    /* The mappings live in QEMU's address space, the guest's RAM does not */
+    error_setg(&fs->migration_blocker,
+               "vhost-user-fs does not support migration");
+    migrate_add_blocker(fs->migration_blocker);
+    return;
+
+virtio_err:
+    g_free(fs->dev.vqs);
+    g_free(fs->conn);
+    virtio_cleanup(vdev);
+    if (fs->cache_ptr) {
+        object_unparent(OBJECT(&fs->cache));
+        munmap(fs->cache_ptr, fs->cache_size);
+        fs->cache_ptr = NULL;
+    }
+}
+
+static void vhost_user_fs_device_unrealize(DeviceState *dev, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    VHostUserFS *fs = VHOST_USER_FS(dev);
+
+    migrate_del_blocker(fs->migration_blocker);
+    error_free(fs->migration_blocker);
+
+    vhost_user_fs_set_status(vdev, 0);
+    vhost_dev_cleanup(&fs->dev);
+    g_free(fs->dev.vqs);
+    vhost_user_inflight_free(&fs->conn->inflight);
+    g_free(fs->conn);
+    virtio_cleanup(vdev);
+    if (fs->cache_ptr) {
+        object_unparent(OBJECT(&fs->cache));
+        munmap(fs->cache_ptr, fs->cache_size);
+        fs->cache_ptr = NULL;
+    }
+}
+
+static Property vhost_user_fs_properties[] = {
+    DEFINE_PROP_CHR("chardev", VHostUserFS, chardev),
+    DEFINE_PROP_STRING("tag", VHostUserFS, tag),
+    DEFINE_PROP_UINT16("num-request-queues", VHostUserFS,
+                       num_request_queues, 1),
+    DEFINE_PROP_UINT32("queue-size", VHostUserFS, queue_size, 128),
+    DEFINE_PROP_SIZE("cache-size", VHostUserFS, cache_size, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void vhost_user_fs_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    VirtioDeviceClass *vdc = VIRTIO_DEVICE_CLASS(klass);
+
+    dc->props = vhost_user_fs_properties;
+    set_bit(DEVICE_CATEGORY_STORAGE, dc->categories);
+    vdc->realize = vhost_user_fs_device_realize;
+    vdc->unrealize = vhost_user_fs_device_unrealize;
+    vdc->get_config = vhost_user_fs_get_config;
+    vdc->get_features = vhost_user_fs_get_features;
+    vdc->set_status = vhost_user_fs_set_status;
+}
+
+static const TypeInfo vhost_user_fs_info = {
+    .name = TYPE_VHOST_USER_FS,
+    .parent = TYPE_VIRTIO_DEVICE,
+    .instance_size = sizeof(VHostUserFS),
+    .class_init = vhost_user_fs_class_init,
+};
+
+static void vhost_user_fs_register_types(void)
+{
+    type_register_static(&vhost_user_fs_info);
+}
+
+type_init(vhost_user_fs_register_types)
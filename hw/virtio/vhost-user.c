@@ -11,10 +11,12 @@
 #include "qemu/osdep.h"
 #include "hw/virtio/vhost.h"
 #include "hw/virtio/vhost-backend.h"
+#include "hw/virtio/vhost-user.h"
 #include "hw/virtio/virtio-net.h"
 #include "sysemu/char.h"
 #include "sysemu/kvm.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "qemu/sockets.h"
 #include "exec/ram_addr.h"
 #include "migration/migration.h"
@@ -31,11 +33,24 @@ enum VhostUserProtocolFeature {
     VHOST_USER_PROTOCOL_F_MQ = 0,
     VHOST_USER_PROTOCOL_F_LOG_SHMFD = 1,
     VHOST_USER_PROTOCOL_F_RARP = 2,
+    VHOST_USER_PROTOCOL_F_SLAVE_REQ = 5,
+    VHOST_USER_PROTOCOL_F_CONFIG = 9,
+    VHOST_USER_PROTOCOL_F_SLAVE_SEND_FD = 10,
+    VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD = 12,
+    VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS = 15,
 
     VHOST_USER_PROTOCOL_F_MAX
 };
 
-#define VHOST_USER_PROTOCOL_FEATURE_MASK ((1 << VHOST_USER_PROTOCOL_F_MAX) - 1)
+#define VHOST_USER_PROTOCOL_FEATURE_MASK \
+    ((1ULL << VHOST_USER_PROTOCOL_F_MQ) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_RARP) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_SLAVE_REQ) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_CONFIG) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_SLAVE_SEND_FD) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS))
 
 typedef enum VhostUserRequest {
     VHOST_USER_NONE = 0,
@@ -58,15 +73,24 @@ typedef enum VhostUserRequest {
     VHOST_USER_GET_QUEUE_NUM = 17,
     VHOST_USER_SET_VRING_ENABLE = 18,
     VHOST_USER_SEND_RARP = 19,
+    VHOST_USER_SET_SLAVE_REQ_FD = 21,
+    VHOST_USER_IOTLB_MSG = 22,
+    VHOST_USER_GET_CONFIG = 24,
+    VHOST_USER_GET_INFLIGHT_FD = 31,
+    VHOST_USER_SET_INFLIGHT_FD = 32,
+    VHOST_USER_GET_MAX_MEM_SLOTS = 36,
+    VHOST_USER_ADD_MEM_REG = 37,
+    VHOST_USER_REM_MEM_REG = 38,
     VHOST_USER_MAX
 } VhostUserRequest;
 
-typedef struct VhostUserMemoryRegion {
-    uint64_t guest_phys_addr;
-    uint64_t memory_size;
-    uint64_t userspace_addr;
-    uint64_t mmap_offset;
-} VhostUserMemoryRegion;
+typedef enum VhostUserSlaveRequest {
+    VHOST_USER_SLAVE_NONE = 0,
+    VHOST_USER_SLAVE_IOTLB_MSG = 1,
+    VHOST_USER_SLAVE_FS_MAP = 6,
+    VHOST_USER_SLAVE_FS_UNMAP = 7,
+    VHOST_USER_SLAVE_MAX
+} VhostUserSlaveRequest;
 
 typedef struct VhostUserMemory {
     uint32_t nregions;
@@ -74,16 +98,41 @@ typedef struct VhostUserMemory {
     VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
 } VhostUserMemory;
 
+/* Upper bound on what we accept from VHOST_USER_GET_MAX_MEM_SLOTS */
+#define VHOST_USER_MAX_RAM_SLOTS 512
+
+typedef struct VhostUserMemRegMsg {
+    uint64_t padding;
+    VhostUserMemoryRegion region;
+} VhostUserMemRegMsg;
+
 typedef struct VhostUserLog {
     uint64_t mmap_size;
     uint64_t mmap_offset;
 } VhostUserLog;
 
+#define VHOST_USER_MAX_CONFIG_SIZE 256
+
+typedef struct VhostUserConfig {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_MAX_CONFIG_SIZE];
+} VhostUserConfig;
+
+typedef struct VhostUserInflight {
+    uint64_t mmap_size;
+    uint64_t mmap_offset;
+    uint16_t num_queues;
+    uint16_t queue_size;
+} VhostUserInflight;
+
 typedef struct VhostUserMsg {
     VhostUserRequest request;
 
 #define VHOST_USER_VERSION_MASK     (0x3)
 #define VHOST_USER_REPLY_MASK       (0x1<<2)
+#define VHOST_USER_NEED_REPLY_MASK  (0x1<<3)
     uint32_t flags;
     uint32_t size; /* the following payload size */
     union {
@@ -93,7 +142,12 @@ typedef struct VhostUserMsg {
         struct vhost_vring_state state;
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
+        VhostUserMemRegMsg mem_reg;
         VhostUserLog log;
+        VhostUserConfig config;
+        VhostUserInflight inflight;
+        struct vhost_iotlb_msg iotlb;
+        VhostUserFSSlaveMsg fs;
     } payload;
 } QEMU_PACKED VhostUserMsg;
 
@@ -114,7 +168,8 @@ static bool ioeventfd_enabled(void)
 
 static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
 {
-    CharDriverState *chr = dev->opaque;
+    VhostUserConn *conn = dev->opaque;
+    CharDriverState *chr = conn->chr;
     uint8_t *p = (uint8_t *) msg;
     int r, size = VHOST_USER_HDR_SIZE;
 
@@ -165,6 +220,11 @@ static bool vhost_user_one_time_request(VhostUserRequest request)
     case VHOST_USER_RESET_OWNER:
     case VHOST_USER_SET_MEM_TABLE:
     case VHOST_USER_GET_QUEUE_NUM:
+    case VHOST_USER_GET_INFLIGHT_FD:
+    case VHOST_USER_SET_INFLIGHT_FD:
+    case VHOST_USER_GET_MAX_MEM_SLOTS:
+    case VHOST_USER_ADD_MEM_REG:
+    case VHOST_USER_REM_MEM_REG:
         return true;
     default:
         return false;
@@ -175,7 +235,8 @@ static bool vhost_user_one_time_request(VhostUserRequest request)
 static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
                             int *fds, int fd_num)
 {
-    CharDriverState *chr = dev->opaque;
+    VhostUserConn *conn = dev->opaque;
+    CharDriverState *chr = conn->chr;
     int size = VHOST_USER_HDR_SIZE + msg->size;
 
     /*
@@ -233,16 +294,16 @@ static int vhost_user_set_log_base(struct vhost_dev *dev, uint64_t base,
     return 0;
 }
 
-static int vhost_user_set_mem_table(struct vhost_dev *dev,
-                                    struct vhost_memory *mem)
+/*
+ * Fill @regions and @fds with the regions of the memory map that can be
+ * shared with the backend, and return how many there are.
+ */
+static size_t vhost_user_fill_regions(struct vhost_dev *dev,
+                                      VhostUserMemoryRegion *regions,
+                                      int *fds, size_t max)
 {
-    int fds[VHOST_MEMORY_MAX_NREGIONS];
     int i, fd;
     size_t fd_num = 0;
-    VhostUserMsg msg = {
-        .request = VHOST_USER_SET_MEM_TABLE,
-        .flags = VHOST_USER_VERSION,
-    };
 
     for (i = 0; i < dev->mem->nregions; ++i) {
         struct vhost_memory_region *reg = dev->mem->regions + i;
@@ -253,16 +314,130 @@ static int vhost_user_set_mem_table(struct vhost_dev *dev,
                                 &ram_addr);
         fd = qemu_get_ram_fd(ram_addr);
         if (fd > 0) {
-            msg.payload.memory.regions[fd_num].userspace_addr = reg->userspace_addr;
-            msg.payload.memory.regions[fd_num].memory_size  = reg->memory_size;
-            msg.payload.memory.regions[fd_num].guest_phys_addr = reg->guest_phys_addr;
-            msg.payload.memory.regions[fd_num].mmap_offset = reg->userspace_addr -
+            regions[fd_num].userspace_addr = reg->userspace_addr;
+            regions[fd_num].memory_size  = reg->memory_size;
+            regions[fd_num].guest_phys_addr = reg->guest_phys_addr;
+            regions[fd_num].mmap_offset = reg->userspace_addr -
                 (uintptr_t) qemu_get_ram_block_host_ptr(ram_addr);
-            assert(fd_num < VHOST_MEMORY_MAX_NREGIONS);
+            assert(fd_num < max);
             fds[fd_num++] = fd;
         }
     }
 
+    return fd_num;
+}
+
+static int vhost_user_send_mem_reg(struct vhost_dev *dev,
+                                   VhostUserRequest request,
+                                   VhostUserMemoryRegion *region, int fd)
+{
+    VhostUserMsg msg = {
+        .request = request,
+        .flags = VHOST_USER_VERSION,
+        .payload.mem_reg.region = *region,
+        .size = sizeof(msg.payload.mem_reg),
+    };
+
+    return vhost_user_write(dev, &msg, fd >= 0 ? &fd : NULL, fd >= 0);
+}
+
+static bool vhost_user_find_region(VhostUserMemoryRegion *regions, size_t n,
+                                   VhostUserMemoryRegion *region)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (!memcmp(&regions[i], region, sizeof(*region))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Bring the backend's memory map in line with @regions by removing the
+ * regions that went away or changed, and then adding the new ones.  The
+ * rest of the map stays in place, so the backend does not have to unmap
+ * and remap all of guest memory on every hotplug.
+ */
+static int vhost_user_update_mem_regions(struct vhost_dev *dev,
+                                         VhostUserMemoryRegion *regions,
+                                         int *fds, size_t nregions)
+{
+    VhostUserConn *conn = dev->opaque;
+    unsigned int i, n;
+
+    /* The map is per connection, and only the first queue pair sends it */
+    if (dev->vq_index != 0) {
+        return 0;
+    }
+
+    for (i = 0, n = 0; i < conn->mem_nregions; i++) {
+        VhostUserMemoryRegion *old = &conn->mem_regions[i];
+
+        if (vhost_user_find_region(regions, nregions, old)) {
+            conn->mem_regions[n++] = *old;
+        } else if (vhost_user_send_mem_reg(dev, VHOST_USER_REM_MEM_REG,
+                                           old, -1) < 0) {
+            /* Forget the rest, the backend is going away anyway */
+            conn->mem_nregions = n;
+            return -1;
+        }
+    }
+    conn->mem_nregions = n;
+
+    conn->mem_regions = g_renew(VhostUserMemoryRegion, conn->mem_regions,
+                                nregions);
+    for (i = 0; i < nregions; i++) {
+        if (vhost_user_find_region(conn->mem_regions, n, &regions[i])) {
+            continue;
+        }
+        if (vhost_user_send_mem_reg(dev, VHOST_USER_ADD_MEM_REG,
+                                    &regions[i], fds[i]) < 0) {
+            return -1;
+        }
+        conn->mem_regions[conn->mem_nregions++] = regions[i];
+    }
+
+    return 0;
+}
+
+static int vhost_user_set_mem_table(struct vhost_dev *dev,
+                                    struct vhost_memory *mem)
+{
+    VhostUserConn *conn = dev->opaque;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    size_t fd_num;
+    VhostUserMsg msg = {
+        .request = VHOST_USER_SET_MEM_TABLE,
+        .flags = VHOST_USER_VERSION,
+    };
+
+    if (virtio_has_feature(dev->protocol_features,
+                           VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS)) {
+        VhostUserMemoryRegion *regions;
+        int *reg_fds;
+        int r;
+
+        regions = g_new(VhostUserMemoryRegion, dev->mem->nregions);
+        reg_fds = g_new(int, dev->mem->nregions);
+        fd_num = vhost_user_fill_regions(dev, regions, reg_fds,
+                                         conn->max_mem_slots);
+        r = -1;
+        if (!fd_num) {
+            error_report("Failed initializing vhost-user memory map, "
+                         "consider using -object memory-backend-file "
+                         "share=on");
+        } else {
+            r = vhost_user_update_mem_regions(dev, regions, reg_fds, fd_num);
+        }
+        g_free(regions);
+        g_free(reg_fds);
+        return r;
+    }
+
+    fd_num = vhost_user_fill_regions(dev, msg.payload.memory.regions, fds,
+                                     VHOST_MEMORY_MAX_NREGIONS);
     msg.payload.memory.nregions = fd_num;
 
     if (!fd_num) {
@@ -362,8 +537,9 @@ static int vhost_user_get_vring_base(struct vhost_dev *dev,
 
     vhost_user_write(dev, &msg, NULL, 0);
 
+    /* The caller must not trust the ring state if the backend is gone */
     if (vhost_user_read(dev, &msg) < 0) {
-        return 0;
+        return -1;
     }
 
     if (msg.request != VHOST_USER_GET_VRING_BASE) {
@@ -479,6 +655,12 @@ static int vhost_user_get_u64(struct vhost_dev *dev, int request, uint64_t *u64)
 
 static int vhost_user_get_features(struct vhost_dev *dev, uint64_t *features)
 {
+    VhostUserConn *conn = dev->opaque;
+
+    if (conn->probed) {
+        *features = conn->features;
+        return 0;
+    }
     return vhost_user_get_u64(dev, VHOST_USER_GET_FEATURES, features);
 }
 
@@ -506,43 +688,241 @@ static int vhost_user_reset_device(struct vhost_dev *dev)
     return 0;
 }
 
-static int vhost_user_init(struct vhost_dev *dev, void *opaque)
+static void vhost_user_slave_close(VhostUserConn *conn)
+{
+    if (conn->slave_fd >= 0) {
+        qemu_set_fd_handler(conn->slave_fd, NULL, NULL, NULL);
+        close(conn->slave_fd);
+        conn->slave_fd = -1;
+    }
+}
+
+/* Reads a message header, and the fd that may come with it */
+static ssize_t slave_read_hdr(VhostUserConn *conn, VhostUserMsg *msg,
+                              int *fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = VHOST_USER_HDR_SIZE,
+    };
+    struct msghdr msgh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t size;
+
+    *fd = -1;
+    size = recvmsg(conn->slave_fd, &msgh, 0);
+    if (size < 0) {
+        return size;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    return size;
+}
+
+/* Requests that the backend sends on its own, e.g. IOTLB misses */
+static void slave_read(void *opaque)
+{
+    struct vhost_dev *dev = opaque;
+    VhostUserConn *conn = dev->opaque;
+    VhostUserMsg msg = { 0 };
+    ssize_t size;
+    int fd;
+    int ret = 0;
+
+    size = slave_read_hdr(conn, &msg, &fd);
+    if (size != VHOST_USER_HDR_SIZE) {
+        error_report("Failed to read from slave.");
+        goto err;
+    }
+
+    if (msg.size > VHOST_USER_PAYLOAD_SIZE) {
+        error_report("Failed to read msg header."
+                     " Size %d exceeds the maximum %zu.", msg.size,
+                     VHOST_USER_PAYLOAD_SIZE);
+        goto err;
+    }
+
+    size = read(conn->slave_fd, &msg.payload, msg.size);
+    if (size != msg.size) {
+        error_report("Failed to read payload from slave.");
+        goto err;
+    }
+
+    switch (msg.request) {
+    case VHOST_USER_SLAVE_IOTLB_MSG:
+        vhost_backend_handle_iotlb_msg(dev, &msg.payload.iotlb);
+        break;
+    case VHOST_USER_SLAVE_FS_MAP:
+        ret = conn->fs_map && fd >= 0 ?
+              conn->fs_map(dev, &msg.payload.fs, fd) : -EINVAL;
+        break;
+    case VHOST_USER_SLAVE_FS_UNMAP:
+        ret = conn->fs_unmap ? conn->fs_unmap(dev, &msg.payload.fs) : -EINVAL;
+        break;
+    default:
+        error_report("Received unexpected msg type.");
+        ret = -EINVAL;
+        break;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (msg.flags & VHOST_USER_NEED_REPLY_MASK) {
+        msg.flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+        msg.size = sizeof(msg.payload.u64);
+        msg.payload.u64 = ret;
+        size = VHOST_USER_HDR_SIZE + msg.size;
+        if (write(conn->slave_fd, &msg, size) != size) {
+            error_report("Failed to send reply to slave.");
+            goto err_closed;
+        }
+    }
+    return;
+
+err:
+    if (fd >= 0) {
+        close(fd);
+    }
+err_closed:
+    vhost_user_slave_close(conn);
+}
+
+static int vhost_user_setup_slave_channel(struct vhost_dev *dev,
+                                          VhostUserConn *conn)
+{
+    VhostUserMsg msg = {
+        .request = VHOST_USER_SET_SLAVE_REQ_FD,
+        .flags = VHOST_USER_VERSION,
+    };
+    int sv[2];
+    int ret;
+
+    if (!virtio_has_feature(conn->protocol_features,
+                            VHOST_USER_PROTOCOL_F_SLAVE_REQ)) {
+        return 0;
+    }
+
+    if (socketpair(PF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        error_report("socketpair() failed");
+        return -1;
+    }
+
+    ret = vhost_user_write(dev, &msg, &sv[1], 1);
+    close(sv[1]);
+    if (ret < 0) {
+        close(sv[0]);
+        return ret;
+    }
+
+    conn->slave_fd = sv[0];
+    qemu_set_fd_handler(conn->slave_fd, slave_read, NULL, dev);
+    return 0;
+}
+
+/*
+ * The features are the same for all the queue pairs of a connection, so
+ * they are only asked for the first one.
+ */
+static int vhost_user_probe(struct vhost_dev *dev, VhostUserConn *conn)
 {
     uint64_t features;
     int err;
 
-    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
-
-    dev->opaque = opaque;
+    conn->protocol_features = 0;
+    conn->max_queues = 0;
+    conn->max_mem_slots = VHOST_MEMORY_MAX_NREGIONS;
+    /* A new backend starts with an empty memory map */
+    conn->mem_nregions = 0;
+    vhost_user_slave_close(conn);
 
-    err = vhost_user_get_features(dev, &features);
+    err = vhost_user_get_u64(dev, VHOST_USER_GET_FEATURES, &conn->features);
     if (err < 0) {
         return err;
     }
 
-    if (virtio_has_feature(features, VHOST_USER_F_PROTOCOL_FEATURES)) {
-        dev->backend_features |= 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
-
+    if (virtio_has_feature(conn->features, VHOST_USER_F_PROTOCOL_FEATURES)) {
         err = vhost_user_get_u64(dev, VHOST_USER_GET_PROTOCOL_FEATURES,
                                  &features);
         if (err < 0) {
             return err;
         }
 
-        dev->protocol_features = features & VHOST_USER_PROTOCOL_FEATURE_MASK;
-        err = vhost_user_set_protocol_features(dev, dev->protocol_features);
+        conn->protocol_features = features & VHOST_USER_PROTOCOL_FEATURE_MASK;
+        err = vhost_user_set_protocol_features(dev, conn->protocol_features);
         if (err < 0) {
             return err;
         }
 
         /* query the max queues we support if backend supports Multiple Queue */
-        if (dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_MQ)) {
+        if (conn->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_MQ)) {
             err = vhost_user_get_u64(dev, VHOST_USER_GET_QUEUE_NUM,
-                                     &dev->max_queues);
+                                     &conn->max_queues);
             if (err < 0) {
                 return err;
             }
         }
+
+        if (conn->protocol_features &
+            (1ULL << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS)) {
+            err = vhost_user_get_u64(dev, VHOST_USER_GET_MAX_MEM_SLOTS,
+                                     &conn->max_mem_slots);
+            if (err < 0) {
+                return err;
+            }
+            conn->max_mem_slots = MIN(conn->max_mem_slots,
+                                      VHOST_USER_MAX_RAM_SLOTS);
+        }
+    }
+
+    /* IOTLB misses can only be reported on the slave channel */
+    if (!virtio_has_feature(conn->protocol_features,
+                            VHOST_USER_PROTOCOL_F_SLAVE_REQ)) {
+        conn->features &= ~(1ULL << VIRTIO_F_IOMMU_PLATFORM);
+    }
+
+    err = vhost_user_setup_slave_channel(dev, conn);
+    if (err < 0) {
+        return err;
+    }
+
+    conn->probed = true;
+    return 0;
+}
+
+static int vhost_user_init(struct vhost_dev *dev, void *opaque)
+{
+    VhostUserConn *conn = opaque;
+    int err;
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    dev->opaque = opaque;
+
+    if (dev->vq_index == 0 || !conn->probed) {
+        conn->probed = false;
+        err = vhost_user_probe(dev, conn);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    if (virtio_has_feature(conn->features, VHOST_USER_F_PROTOCOL_FEATURES)) {
+        dev->backend_features |= 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+        dev->protocol_features = conn->protocol_features;
+        dev->max_queues = conn->max_queues;
     }
 
     if (dev->migration_blocker == NULL &&
@@ -556,10 +936,172 @@ static int vhost_user_init(struct vhost_dev *dev, void *opaque)
     return 0;
 }
 
+static int vhost_user_get_config(struct vhost_dev *dev, uint8_t *config,
+                                 uint32_t config_len)
+{
+    VhostUserMsg msg = {
+        .request = VHOST_USER_GET_CONFIG,
+        .flags = VHOST_USER_VERSION,
+        .payload.config.offset = 0,
+        .payload.config.size = config_len,
+        .size = offsetof(VhostUserConfig, region) + config_len,
+    };
+
+    if (!virtio_has_feature(dev->protocol_features,
+                            VHOST_USER_PROTOCOL_F_CONFIG)) {
+        error_report("vhost-user backend lacks the "
+                     "VHOST_USER_PROTOCOL_F_CONFIG feature");
+        return -1;
+    }
+
+    if (config_len > VHOST_USER_MAX_CONFIG_SIZE) {
+        error_report("Config space of %u bytes is too large", config_len);
+        return -1;
+    }
+
+    if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+        return -1;
+    }
+
+    if (vhost_user_read(dev, &msg) < 0) {
+        return -1;
+    }
+
+    if (msg.request != VHOST_USER_GET_CONFIG) {
+        error_report("Received unexpected msg type. Expected %d received %d",
+                     VHOST_USER_GET_CONFIG, msg.request);
+        return -1;
+    }
+
+    if (msg.size != offsetof(VhostUserConfig, region) + config_len ||
+        msg.payload.config.size != config_len) {
+        error_report("Received bad msg size.");
+        return -1;
+    }
+
+    memcpy(config, msg.payload.config.region, config_len);
+
+    return 0;
+}
+
+static int vhost_user_get_inflight(struct vhost_dev *dev, uint16_t queue_size)
+{
+    VhostUserConn *conn = dev->opaque;
+    VhostUserInflightRegion *inflight = &conn->inflight;
+    VhostUserMsg msg = {
+        .request = VHOST_USER_GET_INFLIGHT_FD,
+        .flags = VHOST_USER_VERSION,
+        .payload.inflight.num_queues = conn->nvqs,
+        .payload.inflight.queue_size = queue_size,
+        .size = sizeof(msg.payload.inflight),
+    };
+    void *addr;
+    int fd;
+
+    if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+        return -1;
+    }
+
+    if (vhost_user_read(dev, &msg) < 0) {
+        return -1;
+    }
+
+    if (msg.request != VHOST_USER_GET_INFLIGHT_FD) {
+        error_report("Received unexpected msg type. Expected %d received %d",
+                     VHOST_USER_GET_INFLIGHT_FD, msg.request);
+        return -1;
+    }
+
+    if (msg.size != sizeof(msg.payload.inflight)) {
+        error_report("Received bad msg size.");
+        return -1;
+    }
+
+    /* The backend does not track anything with this ring size */
+    if (!msg.payload.inflight.mmap_size) {
+        return 0;
+    }
+
+    fd = qemu_chr_fe_get_msgfd(conn->chr);
+    if (fd < 0) {
+        error_report("Failed to get the in-flight region fd");
+        return -1;
+    }
+
+    addr = mmap(0, msg.payload.inflight.mmap_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, msg.payload.inflight.mmap_offset);
+    if (addr == MAP_FAILED) {
+        error_report("Failed to map the in-flight region: %s",
+                     strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    inflight->fd = fd;
+    inflight->addr = addr;
+    inflight->size = msg.payload.inflight.mmap_size;
+    inflight->offset = msg.payload.inflight.mmap_offset;
+    inflight->queue_size = queue_size;
+
+    return 0;
+}
+
+/*
+ * Hands the in-flight region to the backend, after getting it from the
+ * backend the first time.  The region is kept across reconnections, so a
+ * backend that restarts finds the descriptors that were in flight.
+ */
+static int vhost_user_set_inflight(struct vhost_dev *dev, uint16_t queue_size)
+{
+    VhostUserConn *conn = dev->opaque;
+    VhostUserInflightRegion *inflight = &conn->inflight;
+    VhostUserMsg msg = {
+        .request = VHOST_USER_SET_INFLIGHT_FD,
+        .flags = VHOST_USER_VERSION,
+        .size = sizeof(msg.payload.inflight),
+    };
+    int r;
+
+    if (dev->vq_index != 0 ||
+        !virtio_has_feature(dev->protocol_features,
+                            VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD)) {
+        return 0;
+    }
+
+    /* Nothing can be in flight if the guest changed the ring size */
+    if (inflight->queue_size != queue_size) {
+        vhost_user_inflight_free(inflight);
+    }
+
+    if (!inflight->addr) {
+        r = vhost_user_get_inflight(dev, queue_size);
+        if (r < 0 || !inflight->addr) {
+            return r;
+        }
+    }
+
+    msg.payload.inflight.mmap_size = inflight->size;
+    msg.payload.inflight.mmap_offset = inflight->offset;
+    msg.payload.inflight.num_queues = conn->nvqs;
+    msg.payload.inflight.queue_size = inflight->queue_size;
+
+    return vhost_user_write(dev, &msg, &inflight->fd, 1);
+}
+
 static int vhost_user_cleanup(struct vhost_dev *dev)
 {
+    VhostUserConn *conn = dev->opaque;
+
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
+    /* The slave channel points to the first queue pair's device */
+    if (dev->vq_index == 0) {
+        vhost_user_slave_close(conn);
+        g_free(conn->mem_regions);
+        conn->mem_regions = NULL;
+        conn->mem_nregions = 0;
+    }
+
     dev->opaque = 0;
 
     return 0;
@@ -574,7 +1116,9 @@ static int vhost_user_get_vq_index(struct vhost_dev *dev, int idx)
 
 static int vhost_user_memslots_limit(struct vhost_dev *dev)
 {
-    return VHOST_MEMORY_MAX_NREGIONS;
+    VhostUserConn *conn = dev->opaque;
+
+    return conn->max_mem_slots;
 }
 
 static bool vhost_user_requires_shm_log(struct vhost_dev *dev)
@@ -611,6 +1155,28 @@ static int vhost_user_migration_done(struct vhost_dev *dev, char* mac_addr)
     return -1;
 }
 
+static int vhost_user_send_device_iotlb_msg(struct vhost_dev *dev,
+                                            struct vhost_iotlb_msg *imsg)
+{
+    VhostUserMsg msg = {
+        .request = VHOST_USER_IOTLB_MSG,
+        .flags = VHOST_USER_VERSION,
+        .size = sizeof(msg.payload.iotlb),
+        .payload.iotlb = *imsg,
+    };
+
+    if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static void vhost_user_set_iotlb_callback(struct vhost_dev *dev, int enabled)
+{
+    /* The slave channel is listened to for as long as it is open */
+}
+
 static bool vhost_user_can_merge(struct vhost_dev *dev,
                                  uint64_t start1, uint64_t size1,
                                  uint64_t start2, uint64_t size2)
@@ -653,4 +1219,8 @@ const VhostOps user_ops = {
         .vhost_requires_shm_log = vhost_user_requires_shm_log,
         .vhost_migration_done = vhost_user_migration_done,
         .vhost_backend_can_merge = vhost_user_can_merge,
+        .vhost_get_config = vhost_user_get_config,
+        .vhost_set_inflight = vhost_user_set_inflight,
+        .vhost_send_device_iotlb_msg = vhost_user_send_device_iotlb_msg,
+        .vhost_set_iotlb_callback = vhost_user_set_iotlb_callback,
 };
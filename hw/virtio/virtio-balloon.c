@@ -15,6 +15,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/iov.h"
+#include "qemu/bitmap.h"
 #include "qemu/timer.h"
 #include "qemu-common.h"
 #include "hw/virtio/virtio.h"
@@ -24,6 +25,8 @@
 #include "hw/virtio/virtio-balloon.h"
 #include "sysemu/kvm.h"
 #include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
+#include "migration/migration.h"
 #include "qapi/visitor.h"
 #include "qapi-event.h"
 #include "trace.h"
@@ -35,17 +38,127 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
-static void balloon_page(void *addr, int deflate)
+#define BALLOON_PAGE_SIZE (1 << VIRTIO_BALLOON_PFN_SHIFT)
+
+/* Contiguous pages of a RAM block, discarded or faulted in with one call */
+typedef struct BalloonRange {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    size_t len;
+} BalloonRange;
+
+static bool balloon_discard_allowed(void)
 {
 #if defined(__linux__)
-    if (!qemu_balloon_is_inhibited() && (!kvm_enabled() ||
-                                         kvm_has_sync_mmu())) {
-        qemu_madvise(addr, TARGET_PAGE_SIZE,
-                deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
-    }
+    return !qemu_balloon_is_inhibited() &&
+           (!kvm_enabled() || kvm_has_sync_mmu());
+#else
+    return false;
 #endif
 }
 
+static void balloon_flush_range(BalloonRange *range, bool deflate)
+{
+    if (!range->len) {
+        return;
+    }
+
+    trace_virtio_balloon_flush_range(range->rb->idstr, range->offset,
+                                     range->len, deflate);
+    if (deflate) {
+        qemu_madvise(ramblock_ptr(range->rb, range->offset), range->len,
+                     QEMU_MADV_WILLNEED);
+    } else {
+        qemu_ram_discard_range(range->rb, range->offset, range->len);
+    }
+    range->len = 0;
+}
+
+static void balloon_pbp_reset(VirtIOBalloon *s)
+{
+    g_free(s->pbp.bitmap);
+    s->pbp.bitmap = NULL;
+    s->pbp.rb = NULL;
+}
+
+/*
+ * Host pages bigger than the balloon pages can only be given back once the
+ * guest ballooned all of their subpages.  Only the host page that is being
+ * ballooned is tracked, as guests normally inflate whole blocks of memory
+ * in order.  Returns true when the host page of @offset is complete.
+ */
+static bool balloon_pbp_add(VirtIOBalloon *s, RAMBlock *rb, ram_addr_t offset,
+                            size_t host_page_size)
+{
+    PartiallyBalloonedPage *pbp = &s->pbp;
+    ram_addr_t base = QEMU_ALIGN_DOWN(offset, host_page_size);
+    long subpages = host_page_size / BALLOON_PAGE_SIZE;
+
+    if (pbp->bitmap && (pbp->rb != rb || pbp->base != base)) {
+        /* Give up on the previous host page, it stays backed */
+        balloon_pbp_reset(s);
+    }
+    if (!pbp->bitmap) {
+        pbp->rb = rb;
+        pbp->base = base;
+        pbp->bitmap = bitmap_new(subpages);
+    }
+
+    set_bit((offset - base) / BALLOON_PAGE_SIZE, pbp->bitmap);
+    if (!bitmap_full(pbp->bitmap, subpages)) {
+        return false;
+    }
+    balloon_pbp_reset(s);
+    return true;
+}
+
+static void balloon_pbp_del(VirtIOBalloon *s, RAMBlock *rb, ram_addr_t offset)
+{
+    PartiallyBalloonedPage *pbp = &s->pbp;
+
+    if (pbp->bitmap && pbp->rb == rb && offset >= pbp->base) {
+        ram_addr_t subpage = (offset - pbp->base) / BALLOON_PAGE_SIZE;
+
+        if (subpage < qemu_ram_pagesize(rb) / BALLOON_PAGE_SIZE) {
+            clear_bit(subpage, pbp->bitmap);
+        }
+    }
+}
+
+/*
+ * Add one balloon page to @range, flushing the range first if the page
+ * does not extend it.
+ */
+static void balloon_page(VirtIOBalloon *s, BalloonRange *range, RAMBlock *rb,
+                         ram_addr_t offset, bool deflate)
+{
+    size_t host_page_size = qemu_ram_pagesize(rb);
+    size_t len = BALLOON_PAGE_SIZE;
+
+    if (host_page_size > BALLOON_PAGE_SIZE) {
+        if (deflate) {
+            /* Huge pages are faulted in whole, nothing to prefetch */
+            balloon_pbp_del(s, rb, offset);
+            return;
+        }
+        if (!balloon_pbp_add(s, rb, offset, host_page_size)) {
+            return;
+        }
+        offset = QEMU_ALIGN_DOWN(offset, host_page_size);
+        len = host_page_size;
+    }
+
+    if (range->len &&
+        (range->rb != rb || range->offset + range->len != offset)) {
+        balloon_flush_range(range, deflate);
+    }
+    if (!range->len) {
+        range->rb = rb;
+        range->offset = offset;
+    }
+    range->len += len;
+}
+
 static const char *balloon_stat_names[] = {
    [VIRTIO_BALLOON_S_SWAP_IN] = "stat-swap-in",
    [VIRTIO_BALLOON_S_SWAP_OUT] = "stat-swap-out",
@@ -213,41 +326,111 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
     VirtQueueElement *elem;
     MemoryRegionSection section;
+    BalloonRange range = { .len = 0 };
+    bool deflate = vq == s->dvq;
+    bool notify = false;
 
     for (;;) {
         size_t offset = 0;
         uint32_t pfn;
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
-            return;
+            break;
         }
 
+        /*
+         * Guests usually send runs of consecutive pfns, so merge them and
+         * give each run back to the host with a single call.
+         */
         while (iov_to_buf(elem->out_sg, elem->out_num, offset, &pfn, 4) == 4) {
             ram_addr_t pa;
-            ram_addr_t addr;
             int p = virtio_ldl_p(vdev, &pfn);
 
             pa = (ram_addr_t) p << VIRTIO_BALLOON_PFN_SHIFT;
             offset += 4;
 
+            if (!balloon_discard_allowed()) {
+                continue;
+            }
+
             /* FIXME: remove get_system_memory(), but how? */
             section = memory_region_find(get_system_memory(), pa, 1);
-            if (!int128_nz(section.size) || !memory_region_is_ram(section.mr))
+            if (!int128_nz(section.size) ||
+                !memory_region_is_ram(section.mr) ||
+                !section.mr->ram_block) {
+                if (section.mr) {
+                    memory_region_unref(section.mr);
+                }
                 continue;
+            }
 
             trace_virtio_balloon_handle_output(memory_region_name(section.mr),
                                                pa);
-            /* Using memory_region_get_ram_ptr is bending the rules a bit, but
-               should be OK because we only want a single page.  */
-            addr = section.offset_within_region;
-            balloon_page(memory_region_get_ram_ptr(section.mr) + addr,
-                         !!(vq == s->dvq));
+            balloon_page(s, &range, section.mr->ram_block,
+                         section.offset_within_region, deflate);
             memory_region_unref(section.mr);
         }
 
         virtqueue_push(vq, elem, offset);
+        g_free(elem);
+        notify = true;
+    }
+
+    balloon_flush_range(&range, deflate);
+    if (notify) {
         virtio_notify(vdev, vq);
+    }
+}
+
+/*
+ * Free page reporting: the guest hands over blocks of free memory that it
+ * will not touch until they are returned, so they can be discarded right
+ * away.  Unlike inflation, the balloon size does not change.
+ */
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtQueueElement *elem;
+    bool notify = false;
+
+    for (;;) {
+        unsigned int i;
+
+        elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            break;
+        }
+
+        for (i = 0; i < elem->in_num && balloon_discard_allowed(); i++) {
+            void *addr = elem->in_sg[i].iov_base;
+            size_t size = elem->in_sg[i].iov_len;
+            ram_addr_t ram_offset, start, end;
+            size_t host_page_size;
+            RAMBlock *rb;
+
+            rb = qemu_ram_block_from_host(addr, false, &ram_offset);
+            if (!rb) {
+                error_report("%s: reported memory is not RAM", __func__);
+                continue;
+            }
+
+            /* Only the host pages that are entirely free can go */
+            host_page_size = qemu_ram_pagesize(rb);
+            start = QEMU_ALIGN_UP(ram_offset, host_page_size);
+            end = QEMU_ALIGN_DOWN(ram_offset + size, host_page_size);
+            if (end > start) {
+                trace_virtio_balloon_handle_report(rb->idstr, start,
+                                                   end - start);
+                qemu_ram_discard_range(rb, start, end - start);
+            }
+        }
+
+        virtqueue_push(vq, elem, 0);
         g_free(elem);
+        notify = true;
+    }
+
+    if (notify) {
+        virtio_notify(vdev, vq);
     }
 }
 
@@ -303,16 +486,149 @@ out:
     }
 }
 
+static bool virtio_balloon_free_page_support(VirtIOBalloon *s)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    return virtio_vdev_has_feature(vdev, VIRTIO_BALLOON_F_FREE_PAGE_HINT);
+}
+
+static size_t virtio_balloon_config_size(VirtIOBalloon *s)
+{
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        return sizeof(struct virtio_balloon_config);
+    }
+    return offsetof(struct virtio_balloon_config, free_page_report_cmd_id);
+}
+
+/*
+ * Free page hinting: while a migration runs, the guest gets a new command
+ * id after each bitmap sync.  It then sends that id on the free page vq,
+ * followed by one buffer per block of free pages and by
+ * VIRTIO_BALLOON_CMD_ID_STOP.  The pages of the buffers are not sent by
+ * the migration unless the guest writes to them again.
+ */
+static void virtio_balloon_handle_free_page_vq(VirtIODevice *vdev,
+                                               VirtQueue *vq)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+    VirtQueueElement *elem;
+    bool notify = false;
+
+    for (;;) {
+        uint32_t id;
+        unsigned int i;
+
+        elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            break;
+        }
+
+        if (elem->out_num &&
+            iov_to_buf(elem->out_sg, elem->out_num, 0, &id, 4) == 4) {
+            id = virtio_ldl_p(vdev, &id);
+            if (id == s->free_page_report_cmd_id &&
+                s->free_page_report_status == FREE_PAGE_REPORT_S_REQUESTED) {
+                s->free_page_report_status = FREE_PAGE_REPORT_S_START;
+            } else if (id == VIRTIO_BALLOON_CMD_ID_STOP &&
+                       s->free_page_report_status ==
+                       FREE_PAGE_REPORT_S_START) {
+                s->free_page_report_status = FREE_PAGE_REPORT_S_STOP;
+            }
+            trace_virtio_balloon_free_page_cmd_id(id,
+                                                  s->free_page_report_status);
+        }
+
+        /* Hints for an older command id may predate the last sync */
+        if (s->free_page_report_status == FREE_PAGE_REPORT_S_START) {
+            for (i = 0; i < elem->in_num; i++) {
+                qemu_guest_free_page_hint(elem->in_sg[i].iov_base,
+                                          elem->in_sg[i].iov_len);
+            }
+        }
+
+        virtqueue_push(vq, elem, 0);
+        g_free(elem);
+        notify = true;
+    }
+
+    if (notify) {
+        virtio_notify(vdev, vq);
+    }
+}
+
+static void virtio_balloon_free_page_start(VirtIOBalloon *s)
+{
+    if (s->free_page_report_cmd_id == UINT32_MAX) {
+        s->free_page_report_cmd_id = VIRTIO_BALLOON_FREE_PAGE_REPORT_CMD_ID_MIN;
+    } else {
+        s->free_page_report_cmd_id++;
+    }
+    s->free_page_report_status = FREE_PAGE_REPORT_S_REQUESTED;
+    virtio_notify_config(VIRTIO_DEVICE(s));
+}
+
+static void virtio_balloon_free_page_set_status(VirtIOBalloon *s,
+                                                uint32_t status)
+{
+    if (s->free_page_report_status != status) {
+        s->free_page_report_status = status;
+        virtio_notify_config(VIRTIO_DEVICE(s));
+    }
+}
+
+static void virtio_balloon_free_page_report_notify(Notifier *n, void *data)
+{
+    VirtIOBalloon *s = container_of(n, VirtIOBalloon, free_page_report_notify);
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    PrecopyNotifyReason *reason = data;
+
+    if (!virtio_balloon_free_page_support(s)) {
+        return;
+    }
+
+    switch (*reason) {
+    case PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC:
+        /* Hints that arrive after the sync could drop newly dirtied pages */
+        virtio_balloon_free_page_set_status(s, FREE_PAGE_REPORT_S_STOP);
+        break;
+    case PRECOPY_NOTIFY_AFTER_BITMAP_SYNC:
+        if (vdev->vm_running) {
+            virtio_balloon_free_page_start(s);
+        }
+        break;
+    case PRECOPY_NOTIFY_COMPLETE:
+    case PRECOPY_NOTIFY_CLEANUP:
+        virtio_balloon_free_page_set_status(s, FREE_PAGE_REPORT_S_DONE);
+        break;
+    }
+}
+
 static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
 {
     VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
-    struct virtio_balloon_config config;
+    struct virtio_balloon_config config = {};
 
     config.num_pages = cpu_to_le32(dev->num_pages);
     config.actual = cpu_to_le32(dev->actual);
 
+    switch (dev->free_page_report_status) {
+    case FREE_PAGE_REPORT_S_REQUESTED:
+    case FREE_PAGE_REPORT_S_START:
+        config.free_page_report_cmd_id =
+            cpu_to_le32(dev->free_page_report_cmd_id);
+        break;
+    case FREE_PAGE_REPORT_S_DONE:
+        config.free_page_report_cmd_id =
+            cpu_to_le32(VIRTIO_BALLOON_CMD_ID_DONE);
+        break;
+    default:
+        config.free_page_report_cmd_id =
+            cpu_to_le32(VIRTIO_BALLOON_CMD_ID_STOP);
+        break;
+    }
+
     trace_virtio_balloon_get_config(config.num_pages, config.actual);
-    memcpy(config_data, &config, sizeof(struct virtio_balloon_config));
+    memcpy(config_data, &config, virtio_balloon_config_size(dev));
 }
 
 static int build_dimm_list(Object *obj, void *opaque)
@@ -356,7 +672,7 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
     uint32_t oldactual = dev->actual;
     ram_addr_t vm_ram_size = get_current_ram_size();
 
-    memcpy(&config, config_data, sizeof(struct virtio_balloon_config));
+    memcpy(&config, config_data, virtio_balloon_config_size(dev));
     dev->actual = le32_to_cpu(config.actual);
     if (dev->actual != oldactual) {
         qapi_event_send_balloon_change(vm_ram_size -
@@ -409,6 +725,10 @@ static void virtio_balloon_save_device(VirtIODevice *vdev, QEMUFile *f)
 
     qemu_put_be32(f, s->num_pages);
     qemu_put_be32(f, s->actual);
+    if (virtio_balloon_free_page_support(s)) {
+        qemu_put_be32(f, s->free_page_report_cmd_id);
+        qemu_put_be32(f, s->free_page_report_status);
+    }
 }
 
 static int virtio_balloon_load(QEMUFile *f, void *opaque, int version_id)
@@ -426,6 +746,10 @@ static int virtio_balloon_load_device(VirtIODevice *vdev, QEMUFile *f,
 
     s->num_pages = qemu_get_be32(f);
     s->actual = qemu_get_be32(f);
+    if (virtio_balloon_free_page_support(s)) {
+        s->free_page_report_cmd_id = qemu_get_be32(f);
+        s->free_page_report_status = qemu_get_be32(f);
+    }
     return 0;
 }
 
@@ -436,7 +760,7 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     int ret;
 
     virtio_init(vdev, "virtio-balloon", VIRTIO_ID_BALLOON,
-                sizeof(struct virtio_balloon_config));
+                virtio_balloon_config_size(s));
 
     ret = qemu_add_balloon_handler(virtio_balloon_to_target,
                                    virtio_balloon_stat, s);
@@ -451,6 +775,22 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
 
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        s->free_page_vq = virtio_add_queue(vdev, VIRTQUEUE_MAX_SIZE,
+                                           virtio_balloon_handle_free_page_vq);
+        s->free_page_report_status = FREE_PAGE_REPORT_S_STOP;
+        s->free_page_report_cmd_id =
+            VIRTIO_BALLOON_FREE_PAGE_REPORT_CMD_ID_MIN - 1;
+        s->free_page_report_notify.notify =
+            virtio_balloon_free_page_report_notify;
+        precopy_add_notifier(&s->free_page_report_notify);
+    }
+
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_REPORTING)) {
+        s->reporting_vq = virtio_add_queue(vdev, 32,
+                                           virtio_balloon_handle_report);
+    }
+
     reset_stats(s);
 
     register_savevm(dev, "virtio-balloon", -1, 1,
@@ -462,7 +802,11 @@ static void virtio_balloon_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
 
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        precopy_remove_notifier(&s->free_page_report_notify);
+    }
     balloon_stats_destroy_timer(s);
+    balloon_pbp_reset(s);
     qemu_remove_balloon_handler(s);
     unregister_savevm(dev, "virtio-balloon", s);
     virtio_cleanup(vdev);
@@ -476,6 +820,8 @@ static void virtio_balloon_device_reset(VirtIODevice *vdev)
         g_free(s->stats_vq_elem);
         s->stats_vq_elem = NULL;
     }
+    s->free_page_report_status = FREE_PAGE_REPORT_S_STOP;
+    balloon_pbp_reset(s);
 }
 
 static void virtio_balloon_instance_init(Object *obj)
@@ -494,6 +840,10 @@ static void virtio_balloon_instance_init(Object *obj)
 static Property virtio_balloon_properties[] = {
     DEFINE_PROP_BIT("deflate-on-oom", VirtIOBalloon, host_features,
                     VIRTIO_BALLOON_F_DEFLATE_ON_OOM, false),
+    DEFINE_PROP_BIT("free-page-hint", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_FREE_PAGE_HINT, false),
+    DEFINE_PROP_BIT("free-page-reporting", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_REPORTING, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
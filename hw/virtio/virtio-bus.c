@@ -57,6 +57,15 @@ void virtio_bus_device_plugged(VirtIODevice *vdev, Error **errp)
     assert(vdc->get_features != NULL);
     vdev->host_features = vdc->get_features(vdev, vdev->host_features,
                                             errp);
+
+    if (virtio_host_has_feature(vdev, VIRTIO_F_IOMMU_PLATFORM)) {
+        if (klass->get_dma_as == NULL) {
+            virtio_clear_feature(&vdev->host_features,
+                                 VIRTIO_F_IOMMU_PLATFORM);
+        } else {
+            virtio_set_dma_as(vdev, klass->get_dma_as(qbus->parent));
+        }
+    }
     if (klass->post_plugged != NULL) {
         klass->post_plugged(qbus->parent, errp);
     }
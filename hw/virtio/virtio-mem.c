@@ -0,0 +1,618 @@
+/*
+ * Virtio MEM device
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * A virtio-mem device exposes one memory backend to the guest as a region
+ * of physical memory that is split into blocks.  The guest plugs and
+ * unplugs blocks on request of the host, which only has to change the
+ * requested size.  Unplugged blocks are discarded, so that their memory is
+ * given back to the host right away.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "qemu/error-report.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "hw/qdev-properties.h"
+#include "hw/virtio/virtio.h"
+#include "hw/virtio/virtio-bus.h"
+#include "hw/virtio/virtio-mem.h"
+#include "sysemu/balloon.h"
+#include "sysemu/kvm.h"
+#include "sysemu/numa.h"
+#include "sysemu/sysemu.h"
+#include "exec/ram_addr.h"
+#include "migration/migration.h"
+#include "trace.h"
+
+/*
+ * Let the usable region extend beyond the requested size, so that the
+ * guest can plug blocks elsewhere when the blocks it unplugged before are
+ * in use again.
+ */
+#define VIRTIO_MEM_USABLE_EXTENT (2 * (128 * 1024 * 1024))
+
+static MemoryRegion *virtio_mem_get_memory_region(VirtIOMEM *vmem)
+{
+    return host_memory_backend_get_memory(vmem->memdev, &error_abort);
+}
+
+static uint64_t virtio_mem_region_size(VirtIOMEM *vmem)
+{
+    return memory_region_size(virtio_mem_get_memory_region(vmem));
+}
+
+/*
+ * Unplugging is not possible while the host relies on all of RAM staying
+ * in place, for example with postcopy or background snapshots.
+ */
+static bool virtio_mem_is_busy(void)
+{
+    return qemu_balloon_is_inhibited();
+}
+
+static int virtio_mem_discard_range(VirtIOMEM *vmem, uint64_t offset,
+                                    uint64_t size)
+{
+    MemoryRegion *mr = virtio_mem_get_memory_region(vmem);
+
+    trace_virtio_mem_discard_range(vmem->addr + offset, size);
+    return qemu_ram_discard_range(mr->ram_block, offset, size);
+}
+
+static bool virtio_mem_valid_range(VirtIOMEM *vmem, uint64_t gpa,
+                                   uint64_t size)
+{
+    if (gpa & (vmem->block_size - 1)) {
+        return false;
+    }
+    if (!size || gpa + size < gpa) {
+        return false;
+    }
+    if (gpa < vmem->addr || gpa >= vmem->addr + vmem->usable_region_size) {
+        return false;
+    }
+    if (gpa + size > vmem->addr + vmem->usable_region_size) {
+        return false;
+    }
+    return true;
+}
+
+/* Return true if all blocks in the range are plugged, or all unplugged */
+static bool virtio_mem_test_bitmap(VirtIOMEM *vmem, uint64_t gpa,
+                                   uint64_t size, bool plugged)
+{
+    unsigned long first_bit = (gpa - vmem->addr) / vmem->block_size;
+    unsigned long last_bit = first_bit + size / vmem->block_size - 1;
+    unsigned long found_bit;
+
+    if (plugged) {
+        found_bit = find_next_zero_bit(vmem->bitmap, last_bit + 1, first_bit);
+    } else {
+        found_bit = find_next_bit(vmem->bitmap, last_bit + 1, first_bit);
+    }
+    return found_bit > last_bit;
+}
+
+static void virtio_mem_set_bitmap(VirtIOMEM *vmem, uint64_t gpa,
+                                  uint64_t size, bool plugged)
+{
+    unsigned long bit = (gpa - vmem->addr) / vmem->block_size;
+    unsigned long nbits = size / vmem->block_size;
+
+    if (plugged) {
+        bitmap_set(vmem->bitmap, bit, nbits);
+    } else {
+        bitmap_clear(vmem->bitmap, bit, nbits);
+    }
+}
+
+static void virtio_mem_resize_usable_region(VirtIOMEM *vmem,
+                                            uint64_t requested_size,
+                                            bool can_shrink)
+{
+    uint64_t region_size = virtio_mem_region_size(vmem);
+    uint64_t newsize = 0;
+
+    if (requested_size) {
+        newsize = MIN(region_size, requested_size + VIRTIO_MEM_USABLE_EXTENT);
+        newsize = QEMU_ALIGN_UP(newsize, vmem->block_size);
+    }
+
+    /* The guest may still be using blocks in the current usable region */
+    if (newsize < vmem->usable_region_size && !can_shrink) {
+        return;
+    }
+    vmem->usable_region_size = newsize;
+}
+
+static uint16_t virtio_mem_state_change_request(VirtIOMEM *vmem,
+                                                uint64_t gpa,
+                                                uint16_t nb_blocks,
+                                                bool plug)
+{
+    uint64_t size = nb_blocks * vmem->block_size;
+
+    if (!virtio_mem_valid_range(vmem, gpa, size)) {
+        return VIRTIO_MEM_RESP_ERROR;
+    }
+
+    if (plug && vmem->size + size > vmem->requested_size) {
+        return VIRTIO_MEM_RESP_NACK;
+    }
+
+    /* All blocks must be in the opposite state */
+    if (!virtio_mem_test_bitmap(vmem, gpa, size, !plug)) {
+        return VIRTIO_MEM_RESP_ERROR;
+    }
+
+    if (!plug) {
+        if (virtio_mem_is_busy()) {
+            return VIRTIO_MEM_RESP_BUSY;
+        }
+        if (virtio_mem_discard_range(vmem, gpa - vmem->addr, size)) {
+            return VIRTIO_MEM_RESP_ERROR;
+        }
+    }
+
+    virtio_mem_set_bitmap(vmem, gpa, size, plug);
+    if (plug) {
+        vmem->size += size;
+    } else {
+        vmem->size -= size;
+    }
+    return VIRTIO_MEM_RESP_ACK;
+}
+
+static int virtio_mem_unplug_all(VirtIOMEM *vmem)
+{
+    if (vmem->size) {
+        if (virtio_mem_discard_range(vmem, 0, virtio_mem_region_size(vmem))) {
+            return -EBUSY;
+        }
+        bitmap_clear(vmem->bitmap, 0, vmem->bitmap_size);
+        vmem->size = 0;
+    }
+
+    /* Nothing is plugged, the usable region can shrink now */
+    virtio_mem_resize_usable_region(vmem, vmem->requested_size, true);
+    return 0;
+}
+
+static uint16_t virtio_mem_state_request(VirtIOMEM *vmem, uint64_t gpa,
+                                         uint16_t nb_blocks)
+{
+    uint64_t size = nb_blocks * vmem->block_size;
+
+    if (!virtio_mem_valid_range(vmem, gpa, size)) {
+        return VIRTIO_MEM_RESP_ERROR;
+    }
+
+    if (virtio_mem_test_bitmap(vmem, gpa, size, true)) {
+        return VIRTIO_MEM_STATE_PLUGGED;
+    } else if (virtio_mem_test_bitmap(vmem, gpa, size, false)) {
+        return VIRTIO_MEM_STATE_UNPLUGGED;
+    }
+    return VIRTIO_MEM_STATE_MIXED;
+}
+
+static void virtio_mem_send_response(VirtIOMEM *vmem, VirtQueueElement *elem,
+                                     struct virtio_mem_resp *resp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(vmem);
+
+    iov_from_buf(elem->in_sg, elem->in_num, 0, resp, sizeof(*resp));
+    virtqueue_push(vmem->vq, elem, sizeof(*resp));
+    virtio_notify(vdev, vmem->vq);
+}
+
+static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIOMEM *vmem = VIRTIO_MEM(vdev);
+    struct virtio_mem_req req;
+    struct virtio_mem_resp resp;
+    VirtQueueElement *elem;
+    uint64_t gpa;
+    uint16_t nb_blocks;
+    uint16_t type;
+
+    for (;;) {
+        elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            return;
+        }
+
+        if (iov_to_buf(elem->out_sg, elem->out_num, 0, &req, sizeof(req)) <
+            sizeof(req) || iov_size(elem->in_sg, elem->in_num) <
+            sizeof(struct virtio_mem_resp)) {
+            error_report("virtio-mem: invalid request size");
+            exit(1);
+        }
+
+        type = le16_to_cpu(req.type);
+        memset(&resp, 0, sizeof(resp));
+        switch (type) {
+        case VIRTIO_MEM_REQ_PLUG:
+        case VIRTIO_MEM_REQ_UNPLUG:
+            gpa = le64_to_cpu(req.u.plug.addr);
+            nb_blocks = le16_to_cpu(req.u.plug.nb_blocks);
+            resp.type = virtio_mem_state_change_request(vmem, gpa, nb_blocks,
+                                                        type ==
+                                                        VIRTIO_MEM_REQ_PLUG);
+            trace_virtio_mem_state_change_request(gpa, nb_blocks, type,
+                                                  resp.type);
+            break;
+        case VIRTIO_MEM_REQ_UNPLUG_ALL:
+            if (virtio_mem_is_busy()) {
+                resp.type = VIRTIO_MEM_RESP_BUSY;
+            } else if (virtio_mem_unplug_all(vmem)) {
+                resp.type = VIRTIO_MEM_RESP_ERROR;
+            } else {
+                resp.type = VIRTIO_MEM_RESP_ACK;
+            }
+            trace_virtio_mem_unplug_all_request(resp.type);
+            break;
+        case VIRTIO_MEM_REQ_STATE:
+            gpa = le64_to_cpu(req.u.state.addr);
+            nb_blocks = le16_to_cpu(req.u.state.nb_blocks);
+            resp.u.state.state = virtio_mem_state_request(vmem, gpa,
+                                                          nb_blocks);
+            if (resp.u.state.state == VIRTIO_MEM_RESP_ERROR) {
+                resp.type = VIRTIO_MEM_RESP_ERROR;
+                resp.u.state.state = 0;
+            } else {
+                resp.type = VIRTIO_MEM_RESP_ACK;
+            }
+            resp.u.state.state = cpu_to_le16(resp.u.state.state);
+            break;
+        default:
+            resp.type = VIRTIO_MEM_RESP_ERROR;
+            break;
+        }
+
+        resp.type = cpu_to_le16(resp.type);
+        virtio_mem_send_response(vmem, elem, &resp);
+        g_free(elem);
+    }
+}
+
+static void virtio_mem_get_config(VirtIODevice *vdev, uint8_t *config_data)
+{
+    VirtIOMEM *vmem = VIRTIO_MEM(vdev);
+    struct virtio_mem_config *config = (void *) config_data;
+
+    memset(config, 0, sizeof(*config));
+    config->block_size = cpu_to_le64(vmem->block_size);
+    config->node_id = cpu_to_le16(vmem->node);
+    config->addr = cpu_to_le64(vmem->addr);
+    config->region_size = cpu_to_le64(virtio_mem_region_size(vmem));
+    config->usable_region_size = cpu_to_le64(vmem->usable_region_size);
+    config->plugged_size = cpu_to_le64(vmem->size);
+    config->requested_size = cpu_to_le64(vmem->requested_size);
+}
+
+static uint64_t virtio_mem_get_features(VirtIODevice *vdev, uint64_t features,
+                                        Error **errp)
+{
+    /* On PC machines the NUMA node ids are the proximity domains */
+    if (nb_numa_nodes) {
+        virtio_add_feature(&features, VIRTIO_MEM_F_ACPI_PXM);
+    }
+    return features;
+}
+
+/* A rebooted guest starts with all memory unplugged */
+static void virtio_mem_system_reset(void *opaque)
+{
+    VirtIOMEM *vmem = VIRTIO_MEM(opaque);
+
+    virtio_mem_unplug_all(vmem);
+}
+
+static const VMStateDescription vmstate_virtio_mem_state = {
+    .name = "virtio-mem-state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(usable_region_size, VirtIOMEM),
+        VMSTATE_UINT64(size, VirtIOMEM),
+        VMSTATE_UINT64(requested_size, VirtIOMEM),
+        VMSTATE_BITMAP(bitmap, VirtIOMEM, 0, bitmap_size),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static void virtio_mem_save(QEMUFile *f, void *opaque)
+{
+    virtio_save(VIRTIO_DEVICE(opaque), f);
+}
+
+static void virtio_mem_save_device(VirtIODevice *vdev, QEMUFile *f)
+{
+    vmstate_save_state(f, &vmstate_virtio_mem_state, VIRTIO_MEM(vdev), NULL);
+}
+
+static int virtio_mem_load(QEMUFile *f, void *opaque, int version_id)
+{
+    if (version_id != 1) {
+        return -EINVAL;
+    }
+
+    return virtio_load(VIRTIO_DEVICE(opaque), f, version_id);
+}
+
+static int virtio_mem_load_device(VirtIODevice *vdev, QEMUFile *f,
+                                  int version_id)
+{
+    VirtIOMEM *vmem = VIRTIO_MEM(vdev);
+    uint64_t region_size = virtio_mem_region_size(vmem);
+    int ret;
+
+    ret = vmstate_load_state(f, &vmstate_virtio_mem_state, vmem, 1);
+    if (ret) {
+        return ret;
+    }
+    if (vmem->size > region_size || vmem->usable_region_size > region_size) {
+        error_report("virtio-mem: migrated sizes exceed the region size");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void virtio_mem_device_realize(DeviceState *dev, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    VirtIOMEM *vmem = VIRTIO_MEM(dev);
+    uint64_t region_size;
+    MemoryRegion *mr;
+
+    if (!vmem->memdev) {
+        error_setg(errp, "'" VIRTIO_MEM_MEMDEV_PROP "' property is not set");
+        return;
+    }
+    mr = virtio_mem_get_memory_region(vmem);
+    if (memory_region_is_mapped(mr)) {
+        char *path = object_get_canonical_path_component(OBJECT(vmem->memdev));
+        error_setg(errp, "can't use already busy memdev: %s", path);
+        g_free(path);
+        return;
+    }
+    if (!qdev_get_hotplug_handler(dev)) {
+        error_setg(errp, "virtio-mem is not supported by this machine");
+        return;
+    }
+    if ((nb_numa_nodes > 0 && vmem->node >= nb_numa_nodes) ||
+        (!nb_numa_nodes && vmem->node)) {
+        error_setg(errp, "'" VIRTIO_MEM_NODE_PROP "' property has value %"
+                   PRIu32 " which exceeds the number of numa nodes: %d",
+                   vmem->node, nb_numa_nodes ? nb_numa_nodes : 1);
+        return;
+    }
+    if (kvm_enabled() && !kvm_has_sync_mmu()) {
+        error_setg(errp, "virtio-mem needs KVM with a synchronous MMU");
+        return;
+    }
+
+    if (!is_power_of_2(vmem->block_size) ||
+        vmem->block_size < qemu_real_host_page_size ||
+        vmem->block_size < memory_region_get_alignment(mr) ||
+        vmem->block_size > VIRTIO_MEM_MAX_BLOCK_SIZE) {
+        error_setg(errp, "'" VIRTIO_MEM_BLOCK_SIZE_PROP "' must be a power of"
+                   " two between the page size of the memdev and 0x%llx",
+                   VIRTIO_MEM_MAX_BLOCK_SIZE);
+        return;
+    }
+    region_size = memory_region_size(mr);
+    if (region_size & (vmem->block_size - 1)) {
+        error_setg(errp, "memdev size must be a multiple of '"
+                   VIRTIO_MEM_BLOCK_SIZE_PROP "' (0x%" PRIx64 ")",
+                   vmem->block_size);
+        return;
+    }
+    if (vmem->requested_size > region_size ||
+        vmem->requested_size & (vmem->block_size - 1)) {
+        error_setg(errp, "'" VIRTIO_MEM_REQUESTED_SIZE_PROP "' must be a"
+                   " multiple of '" VIRTIO_MEM_BLOCK_SIZE_PROP "' and not"
+                   " exceed the memdev size");
+        return;
+    }
+
+    /* All of the memory starts unplugged */
+    if (virtio_mem_discard_range(vmem, 0, region_size)) {
+        error_setg(errp, "cannot discard the memory of the memdev");
+        return;
+    }
+
+    vmem->bitmap_size = region_size / vmem->block_size;
+    vmem->bitmap = bitmap_new(vmem->bitmap_size);
+    vmem->size = 0;
+    virtio_mem_resize_usable_region(vmem, vmem->requested_size, true);
+
+    virtio_init(vdev, "virtio-mem", VIRTIO_ID_MEM,
+                sizeof(struct virtio_mem_config));
+    vmem->vq = virtio_add_queue(vdev, 128, virtio_mem_handle_request);
+
+    vmstate_register_ram(mr, dev);
+    qemu_register_reset(virtio_mem_system_reset, vmem);
+    register_savevm(dev, "virtio-mem", -1, 1,
+                    virtio_mem_save, virtio_mem_load, vmem);
+}
+
+static void virtio_mem_device_unrealize(DeviceState *dev, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    VirtIOMEM *vmem = VIRTIO_MEM(dev);
+    MemoryRegion *mr = virtio_mem_get_memory_region(vmem);
+
+    unregister_savevm(dev, "virtio-mem", vmem);
+    qemu_unregister_reset(virtio_mem_system_reset, vmem);
+
+    /* Mapped by the machine when the device was plugged */
+    if (memory_region_is_mapped(mr)) {
+        numa_unset_mem_node_id(vmem->addr, memory_region_size(mr),
+                               vmem->node);
+        memory_region_del_subregion(mr->container, mr);
+    }
+    vmstate_unregister_ram(mr, dev);
+
+    virtio_cleanup(vdev);
+    g_free(vmem->bitmap);
+}
+
+static void virtio_mem_get_size(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    VirtIOMEM *vmem = VIRTIO_MEM(obj);
+    uint64_t value = vmem->size;
+
+    visit_type_size(v, name, &value, errp);
+}
+
+static void virtio_mem_get_requested_size(Object *obj, Visitor *v,
+                                          const char *name, void *opaque,
+                                          Error **errp)
+{
+    VirtIOMEM *vmem = VIRTIO_MEM(obj);
+    uint64_t value = vmem->requested_size;
+
+    visit_type_size(v, name, &value, errp);
+}
+
+static void virtio_mem_set_requested_size(Object *obj, Visitor *v,
+                                          const char *name, void *opaque,
+                                          Error **errp)
+{
+    VirtIOMEM *vmem = VIRTIO_MEM(obj);
+    Error *local_err = NULL;
+    uint64_t value;
+
+    visit_type_size(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    /* Checked at realize time */
+    if (!DEVICE(obj)->realized) {
+        vmem->requested_size = value;
+        goto out;
+    }
+
+    if (value > virtio_mem_region_size(vmem)) {
+        error_setg(&local_err, "'%s' cannot exceed the memdev size (0x%"
+                   PRIx64 ")", name, virtio_mem_region_size(vmem));
+        goto out;
+    }
+    if (value & (vmem->block_size - 1)) {
+        error_setg(&local_err, "'%s' has to be a multiple of '"
+                   VIRTIO_MEM_BLOCK_SIZE_PROP "' (0x%" PRIx64 ")", name,
+                   vmem->block_size);
+        goto out;
+    }
+
+    if (value != vmem->requested_size) {
+        virtio_mem_resize_usable_region(vmem, value, false);
+        vmem->requested_size = value;
+        trace_virtio_mem_set_requested_size(value);
+        virtio_notify_config(VIRTIO_DEVICE(vmem));
+    }
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void virtio_mem_get_block_size(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    VirtIOMEM *vmem = VIRTIO_MEM(obj);
+    uint64_t value = vmem->block_size;
+
+    visit_type_size(v, name, &value, errp);
+}
+
+static void virtio_mem_set_block_size(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    VirtIOMEM *vmem = VIRTIO_MEM(obj);
+    Error *local_err = NULL;
+    uint64_t value;
+
+    if (DEVICE(obj)->realized) {
+        error_setg(&local_err, "'%s' cannot be changed", name);
+        goto out;
+    }
+
+    visit_type_size(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    vmem->block_size = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void virtio_mem_instance_init(Object *obj)
+{
+    VirtIOMEM *vmem = VIRTIO_MEM(obj);
+
+    vmem->block_size = VIRTIO_MEM_DEFAULT_BLOCK_SIZE;
+
+    object_property_add(obj, VIRTIO_MEM_SIZE_PROP, "size",
+                        virtio_mem_get_size, NULL, NULL, NULL, &error_abort);
+    object_property_add(obj, VIRTIO_MEM_REQUESTED_SIZE_PROP, "size",
+                        virtio_mem_get_requested_size,
+                        virtio_mem_set_requested_size, NULL, NULL,
+                        &error_abort);
+    object_property_add(obj, VIRTIO_MEM_BLOCK_SIZE_PROP, "size",
+                        virtio_mem_get_block_size, virtio_mem_set_block_size,
+                        NULL, NULL, &error_abort);
+    object_property_add_link(obj, VIRTIO_MEM_MEMDEV_PROP, TYPE_MEMORY_BACKEND,
+                             (Object **)&vmem->memdev,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, &error_abort);
+}
+
+static Property virtio_mem_properties[] = {
+    DEFINE_PROP_UINT64(VIRTIO_MEM_ADDR_PROP, VirtIOMEM, addr, 0),
+    DEFINE_PROP_UINT32(VIRTIO_MEM_NODE_PROP, VirtIOMEM, node, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void virtio_mem_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    VirtioDeviceClass *vdc = VIRTIO_DEVICE_CLASS(klass);
+
+    dc->props = virtio_mem_properties;
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+    vdc->realize = virtio_mem_device_realize;
+    vdc->unrealize = virtio_mem_device_unrealize;
+    vdc->get_config = virtio_mem_get_config;
+    vdc->get_features = virtio_mem_get_features;
+    vdc->save = virtio_mem_save_device;
+    vdc->load = virtio_mem_load_device;
+}
+
+static const TypeInfo virtio_mem_info = {
+    .name = TYPE_VIRTIO_MEM,
+    .parent = TYPE_VIRTIO_DEVICE,
+    .instance_size = sizeof(VirtIOMEM),
+    .instance_init = virtio_mem_instance_init,
+    .class_init = virtio_mem_class_init,
+};
+
+static void virtio_register_types(void)
+{
+    type_register_static(&virtio_mem_info);
+}
+
+type_init(virtio_register_types)
@@ -48,6 +48,8 @@ static void chr_read(void *opaque, const void *buf, size_t size)
     size_t len;
     int offset;
 
+    vrng->request_pending = false;
+
     if (!is_guest_ready(vrng)) {
         return;
     }
@@ -87,6 +89,13 @@ static void virtio_rng_process(VirtIORNG *vrng)
         return;
     }
 
+    /* The outstanding request was sized for all buffers available at the
+     * time; chr_read() asks again for whatever the guest added since.
+     */
+    if (vrng->request_pending) {
+        return;
+    }
+
     if (vrng->activate_timer) {
         timer_mod(vrng->rate_limit_timer,
                   qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + vrng->conf.period_ms);
@@ -104,6 +113,7 @@ static void virtio_rng_process(VirtIORNG *vrng)
 
     size = MIN(vrng->quota_remaining, size);
     if (size) {
+        vrng->request_pending = true;
         rng_backend_request_entropy(vrng->rng, size, chr_read, vrng);
     }
 }
@@ -21,6 +21,7 @@
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
+#include "sysemu/dma.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -57,6 +58,50 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+typedef struct VRingPackedDesc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingPackedDescEvent
+{
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
+/* A completion queued by virtqueue_fill() on a packed ring */
+typedef struct VRingPackedUsedElem
+{
+    uint16_t id;
+    uint32_t len;
+    unsigned int ndescs;
+} VRingPackedUsedElem;
+
+/*
+ * With VIRTIO_F_RING_PACKED, vring.desc is the descriptor ring, vring.avail
+ * the driver event suppression area and vring.used the device one.  Both
+ * sides walk the descriptor ring in order; last_avail_idx and used_idx are
+ * positions in it, and their wrap counters toggle each time they wrap.
+ */
+/*
+ * The three areas of a virtqueue, translated once.  They are rebuilt by
+ * the main thread whenever the rings move or the memory map changes, and
+ * accessed within an RCU critical section.
+ */
+typedef struct VRingCaches
+{
+    struct rcu_head rcu;
+    MemoryRegionCache desc;
+    MemoryRegionCache avail;
+    MemoryRegionCache used;
+} VRingCaches;
+
+/* Freed elements kept by each queue for reuse by virtqueue_pop() */
+#define VIRTQUEUE_ELEM_POOL_SIZE 64
+
 typedef struct VRing
 {
     unsigned int num;
@@ -88,6 +133,15 @@ struct VirtQueue
     /* Notification enabled? */
     bool notification;
 
+    /* Packed ring only */
+    bool last_avail_wrap_counter;
+    bool used_wrap_counter;
+    VRingPackedUsedElem *used_elems;
+
+    VRingCaches *caches;
+    void *elem_pool[VIRTQUEUE_ELEM_POOL_SIZE];
+    unsigned int elem_pool_len;
+
     uint16_t queue_index;
 
     int inuse;
@@ -100,6 +154,66 @@ struct VirtQueue
     QLIST_ENTRY(VirtQueue) node;
 };
 
+static bool virtio_queue_packed(VirtQueue *vq)
+{
+    return virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+}
+
+static void virtio_free_caches(VRingCaches *caches)
+{
+    address_space_cache_destroy(&caches->desc);
+    address_space_cache_destroy(&caches->avail);
+    address_space_cache_destroy(&caches->used);
+    g_free(caches);
+}
+
+/* Called by the main thread whenever the rings or the memory map change */
+static void virtio_queue_update_caches(VirtQueue *vq)
+{
+    VRingCaches *old = vq->caches;
+    VRingCaches *new = NULL;
+    hwaddr avail_size, used_size;
+    bool packed = virtio_queue_packed(vq);
+
+    if (vq->vring.desc && vq->vring.num) {
+        if (packed) {
+            avail_size = used_size = sizeof(VRingPackedDescEvent);
+        } else {
+            /* Both include the event index of the other side */
+            avail_size = offsetof(VRingAvail, ring[vq->vring.num + 1]);
+            used_size = offsetof(VRingUsed, ring[vq->vring.num]) +
+                        sizeof(uint16_t);
+        }
+
+        new = g_new0(VRingCaches, 1);
+        /* The device marks descriptors used in the packed ring itself */
+        address_space_cache_init(&new->desc, vq->vdev->dma_as,
+                                 vq->vring.desc,
+                                 vq->vring.num * sizeof(VRingDesc), packed);
+        address_space_cache_init(&new->avail, vq->vdev->dma_as,
+                                 vq->vring.avail, avail_size, false);
+        address_space_cache_init(&new->used, vq->vdev->dma_as,
+                                 vq->vring.used, used_size, true);
+    }
+
+    atomic_rcu_set(&vq->caches, new);
+    if (old) {
+        call_rcu(old, virtio_free_caches, rcu);
+    }
+}
+
+static void virtio_memory_listener_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.num) {
+            virtio_queue_update_caches(&vdev->vq[i]);
+        }
+    }
+}
+
 /* virt queue functions */
 void virtio_queue_update_rings(VirtIODevice *vdev, int n)
 {
@@ -113,39 +227,190 @@ void virtio_queue_update_rings(VirtIODevice *vdev, int n)
     vring->used = vring_align(vring->avail +
                               offsetof(VRingAvail, ring[vring->num]),
                               vring->align);
+    virtio_queue_update_caches(&vdev->vq[n]);
 }
 
-static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
+/*
+ * The ring accessors below do nothing, or read zeroes, while the queue is
+ * not set up.
+ */
+static uint16_t vring_avail_lduw(VirtQueue *vq, hwaddr offset)
+{
+    VRingCaches *caches;
+    uint16_t val = 0;
+
+    rcu_read_lock();
+    caches = atomic_rcu_read(&vq->caches);
+    if (caches) {
+        val = virtio_lduw_phys_cached(vq->vdev, &caches->avail, offset);
+    }
+    rcu_read_unlock();
+    return val;
+}
+
+static uint16_t vring_used_lduw(VirtQueue *vq, hwaddr offset)
+{
+    VRingCaches *caches;
+    uint16_t val = 0;
+
+    rcu_read_lock();
+    caches = atomic_rcu_read(&vq->caches);
+    if (caches) {
+        val = virtio_lduw_phys_cached(vq->vdev, &caches->used, offset);
+    }
+    rcu_read_unlock();
+    return val;
+}
+
+static void vring_used_stw(VirtQueue *vq, hwaddr offset, uint16_t val)
+{
+    VRingCaches *caches;
+
+    rcu_read_lock();
+    caches = atomic_rcu_read(&vq->caches);
+    if (caches) {
+        virtio_stw_phys_cached(vq->vdev, &caches->used, offset, val);
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Reads entry @i of the descriptor table at @desc_pa, which is either the
+ * ring itself or an indirect table, into @buf.
+ */
+static void vring_desc_read_raw(VirtQueue *vq, void *buf, size_t size,
+                                hwaddr desc_pa, int i)
+{
+    VRingCaches *caches;
+
+    rcu_read_lock();
+    caches = atomic_rcu_read(&vq->caches);
+    if (desc_pa == vq->vring.desc && caches) {
+        address_space_read_cached(&caches->desc, i * size, buf, size);
+    } else {
+        address_space_read(vq->vdev->dma_as, desc_pa + i * size,
+                           MEMTXATTRS_UNSPECIFIED, buf, size);
+    }
+    rcu_read_unlock();
+}
+
+static void vring_desc_read(VirtQueue *vq, VRingDesc *desc,
                             hwaddr desc_pa, int i)
 {
-    address_space_read(&address_space_memory, desc_pa + i * sizeof(VRingDesc),
-                       MEMTXATTRS_UNSPECIFIED, (void *)desc, sizeof(VRingDesc));
+    VirtIODevice *vdev = vq->vdev;
+
+    vring_desc_read_raw(vq, desc, sizeof(VRingDesc), desc_pa, i);
     virtio_tswap64s(vdev, &desc->addr);
     virtio_tswap32s(vdev, &desc->len);
     virtio_tswap16s(vdev, &desc->flags);
     virtio_tswap16s(vdev, &desc->next);
 }
 
+static uint16_t vring_packed_desc_flags(VirtQueue *vq, hwaddr desc_pa, int i)
+{
+    VRingCaches *caches;
+    hwaddr offset = i * sizeof(VRingPackedDesc) +
+                    offsetof(VRingPackedDesc, flags);
+    uint16_t flags;
+
+    rcu_read_lock();
+    caches = atomic_rcu_read(&vq->caches);
+    if (desc_pa == vq->vring.desc && caches) {
+        flags = virtio_lduw_phys_cached(vq->vdev, &caches->desc, offset);
+    } else {
+        flags = virtio_lduw_phys(vq->vdev, desc_pa + offset);
+    }
+    rcu_read_unlock();
+    return flags;
+}
+
+static void vring_packed_desc_read(VirtQueue *vq, VRingPackedDesc *desc,
+                                   hwaddr desc_pa, int i)
+{
+    VirtIODevice *vdev = vq->vdev;
+
+    vring_desc_read_raw(vq, desc, sizeof(VRingPackedDesc), desc_pa, i);
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->id);
+    virtio_tswap16s(vdev, &desc->flags);
+}
+
+static bool vring_packed_desc_is_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+
+    return avail != used && avail == wrap_counter;
+}
+
+static void vring_packed_advance(VirtQueue *vq, uint16_t *idx, bool *wrap,
+                                 unsigned int n)
+{
+    *idx += n;
+    if (*idx >= vq->vring.num) {
+        *idx -= vq->vring.num;
+        *wrap = !*wrap;
+    }
+}
+
+/* Reads the driver event suppression area */
+static void vring_packed_event_read(VirtQueue *vq, VRingPackedDescEvent *e)
+{
+    e->flags = vring_avail_lduw(vq, offsetof(VRingPackedDescEvent, flags));
+    /* Make sure flags is seen before off_wrap */
+    smp_rmb();
+    e->off_wrap = vring_avail_lduw(vq, offsetof(VRingPackedDescEvent,
+                                                off_wrap));
+}
+
+/* Ask the driver for a kick once it makes last_avail_idx available */
+static void vring_packed_set_avail_event(VirtQueue *vq)
+{
+    uint16_t off_wrap = vq->last_avail_idx |
+        vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+
+    vring_used_stw(vq, offsetof(VRingPackedDescEvent, off_wrap), off_wrap);
+    smp_wmb();
+    vring_used_stw(vq, offsetof(VRingPackedDescEvent, flags),
+                   VRING_PACKED_EVENT_FLAG_DESC);
+}
+
+static void virtio_queue_packed_set_notification(VirtQueue *vq, int enable)
+{
+    hwaddr offset = offsetof(VRingPackedDescEvent, flags);
+
+    if (!enable) {
+        vring_used_stw(vq, offset, VRING_PACKED_EVENT_FLAG_DISABLE);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+    } else {
+        vring_used_stw(vq, offset, VRING_PACKED_EVENT_FLAG_ENABLE);
+    }
+}
+
+static int virtio_queue_packed_empty(VirtQueue *vq)
+{
+    uint16_t flags = vring_packed_desc_flags(vq, vq->vring.desc,
+                                             vq->last_avail_idx);
+
+    return !vring_packed_desc_is_avail(flags, vq->last_avail_wrap_counter);
+}
+
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    vq->shadow_avail_idx = virtio_lduw_phys(vq->vdev, pa);
+    vq->shadow_avail_idx = vring_avail_lduw(vq, offsetof(VRingAvail, idx));
     return vq->shadow_avail_idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_get_used_event(VirtQueue *vq)
@@ -156,59 +421,59 @@ static inline uint16_t vring_get_used_event(VirtQueue *vq)
 static inline void vring_used_write(VirtQueue *vq, VRingUsedElem *uelem,
                                     int i)
 {
-    hwaddr pa;
+    VRingCaches *caches;
+
     virtio_tswap32s(vq->vdev, &uelem->id);
     virtio_tswap32s(vq->vdev, &uelem->len);
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i]);
-    address_space_write(&address_space_memory, pa, MEMTXATTRS_UNSPECIFIED,
-                       (void *)uelem, sizeof(VRingUsedElem));
+    rcu_read_lock();
+    caches = atomic_rcu_read(&vq->caches);
+    if (caches) {
+        address_space_write_cached(&caches->used,
+                                   offsetof(VRingUsed, ring[i]),
+                                   uelem, sizeof(VRingUsedElem));
+    }
+    rcu_read_unlock();
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_used_lduw(vq, offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, idx), val);
     vq->used_idx = val;
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    hwaddr offset = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, offset, vring_used_lduw(vq, offset) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    hwaddr offset = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, offset, vring_used_lduw(vq, offset) & ~mask);
 }
 
 static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, ring[vq->vring.num]), val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
     vq->notification = enable;
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (virtio_queue_packed(vq)) {
+        virtio_queue_packed_set_notification(vq, enable);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
@@ -230,6 +495,10 @@ int virtio_queue_ready(VirtQueue *vq)
  * guest has added some buffers. */
 int virtio_queue_empty(VirtQueue *vq)
 {
+    if (virtio_queue_packed(vq)) {
+        return virtio_queue_packed_empty(vq);
+    }
+
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return 0;
     }
@@ -247,23 +516,33 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
     for (i = 0; i < elem->in_num; i++) {
         size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
 
-        cpu_physical_memory_unmap(elem->in_sg[i].iov_base,
-                                  elem->in_sg[i].iov_len,
-                                  1, size);
+        dma_memory_unmap(vq->vdev->dma_as, elem->in_sg[i].iov_base,
+                         elem->in_sg[i].iov_len,
+                         DMA_DIRECTION_FROM_DEVICE, size);
 
         offset += size;
     }
 
     for (i = 0; i < elem->out_num; i++)
-        cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
-                                  elem->out_sg[i].iov_len,
-                                  0, elem->out_sg[i].iov_len);
+        dma_memory_unmap(vq->vdev->dma_as, elem->out_sg[i].iov_base,
+                         elem->out_sg[i].iov_len,
+                         DMA_DIRECTION_TO_DEVICE,
+                         elem->out_sg[i].iov_len);
 }
 
 void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
                        unsigned int len)
 {
-    vq->last_avail_idx--;
+    if (virtio_queue_packed(vq)) {
+        if (vq->last_avail_idx < elem->ndescs) {
+            vq->last_avail_idx += vq->vring.num;
+            vq->last_avail_wrap_counter = !vq->last_avail_wrap_counter;
+        }
+        vq->last_avail_idx -= elem->ndescs;
+    } else {
+        vq->last_avail_idx--;
+    }
+    vq->inuse--;
     virtqueue_unmap_sg(vq, elem, len);
 }
 
@@ -276,6 +555,15 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 
     virtqueue_unmap_sg(vq, elem, len);
 
+    if (virtio_queue_packed(vq)) {
+        /* Written back by virtqueue_flush(), in order */
+        assert(idx < vq->vring.num);
+        vq->used_elems[idx].id = elem->index;
+        vq->used_elems[idx].len = len;
+        vq->used_elems[idx].ndescs = elem->ndescs;
+        return;
+    }
+
     idx = (idx + vq->used_idx) % vq->vring.num;
 
     uelem.id = elem->index;
@@ -283,9 +571,77 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     vring_used_write(vq, &uelem, idx);
 }
 
+static void vring_packed_used_write(VirtQueue *vq, VRingPackedUsedElem *uelem,
+                                    uint16_t i, bool wrap, bool write_flags)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc);
+    VRingCaches *caches;
+    uint16_t flags = 0;
+
+    if (wrap) {
+        flags |= (1 << VRING_PACKED_DESC_F_AVAIL) |
+                 (1 << VRING_PACKED_DESC_F_USED);
+    }
+    if (uelem->len) {
+        flags |= VRING_DESC_F_WRITE;
+    }
+
+    rcu_read_lock();
+    caches = atomic_rcu_read(&vq->caches);
+    if (caches) {
+        virtio_stl_phys_cached(vq->vdev, &caches->desc,
+                               off + offsetof(VRingPackedDesc, len),
+                               uelem->len);
+        virtio_stw_phys_cached(vq->vdev, &caches->desc,
+                               off + offsetof(VRingPackedDesc, id),
+                               uelem->id);
+        if (write_flags) {
+            /* Make sure id and len are written before the descriptor is used */
+            smp_wmb();
+            virtio_stw_phys_cached(vq->vdev, &caches->desc,
+                                   off + offsetof(VRingPackedDesc, flags),
+                                   flags);
+        }
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * The used elements go to the descriptor ring in order, each one in the
+ * slot of the first descriptor it used.  The flags of the first one are
+ * written last, so that the driver sees the whole batch at once.
+ */
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    uint16_t head = vq->used_idx;
+    bool head_wrap = vq->used_wrap_counter;
+    unsigned int i;
+
+    if (!count) {
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        vring_packed_used_write(vq, &vq->used_elems[i], vq->used_idx,
+                                vq->used_wrap_counter, i != 0);
+        vring_packed_advance(vq, &vq->used_idx, &vq->used_wrap_counter,
+                             vq->used_elems[i].ndescs);
+    }
+    vring_packed_used_write(vq, &vq->used_elems[0], head, head_wrap, true);
+
+    vq->inuse -= count;
+}
+
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
     uint16_t old, new;
+
+    if (virtio_queue_packed(vq)) {
+        trace_virtqueue_flush(vq, count);
+        virtqueue_packed_flush(vq, count);
+        return;
+    }
+
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
@@ -340,7 +696,7 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
+static unsigned virtqueue_read_next_desc(VirtQueue *vq, VRingDesc *desc,
                                          hwaddr desc_pa, unsigned int max)
 {
     unsigned int next;
@@ -360,10 +716,84 @@ static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
         exit(1);
     }
 
-    vring_desc_read(vdev, desc, desc_pa, next);
+    vring_desc_read(vq, desc, desc_pa, next);
     return next;
 }
 
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                             unsigned int *in_bytes,
+                                             unsigned int *out_bytes,
+                                             unsigned max_in_bytes,
+                                             unsigned max_out_bytes)
+{
+    uint16_t idx = vq->last_avail_idx;
+    bool wrap = vq->last_avail_wrap_counter;
+    unsigned int in_total = 0, out_total = 0, seen = 0;
+
+    /* Stop after one lap, the driver cannot make more descriptors available */
+    while (seen < vq->vring.num &&
+           vring_packed_desc_is_avail(vring_packed_desc_flags(vq,
+                                                              vq->vring.desc,
+                                                              idx), wrap)) {
+        unsigned int max = vq->vring.num, n = 0;
+        hwaddr desc_pa = vq->vring.desc;
+        bool indirect = false;
+        VRingPackedDesc desc;
+
+        /* Make sure the descriptor is read after its flags */
+        smp_rmb();
+        vring_packed_desc_read(vq, &desc, desc_pa, idx);
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (!desc.len || desc.len % sizeof(VRingPackedDesc)) {
+                error_report("Invalid size for indirect buffer table");
+                exit(1);
+            }
+            indirect = true;
+            max = desc.len / sizeof(VRingPackedDesc);
+            desc_pa = desc.addr;
+            vring_packed_desc_read(vq, &desc, desc_pa, 0);
+        }
+
+        for (;;) {
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
+            } else {
+                out_total += desc.len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                goto done;
+            }
+
+            n++;
+            if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            if (n >= max) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+            if (indirect) {
+                vring_packed_desc_read(vq, &desc, desc_pa, n);
+            } else {
+                vring_packed_desc_read(vq, &desc, desc_pa,
+                                       (idx + n) % vq->vring.num);
+            }
+        }
+
+        n = indirect ? 1 : n;
+        seen += n;
+        vring_packed_advance(vq, &idx, &wrap, n);
+    }
+done:
+    if (in_bytes) {
+        *in_bytes = in_total;
+    }
+    if (out_bytes) {
+        *out_bytes = out_total;
+    }
+}
+
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                                unsigned int *out_bytes,
                                unsigned max_in_bytes, unsigned max_out_bytes)
@@ -371,11 +801,16 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     unsigned int idx;
     unsigned int total_bufs, in_total, out_total;
 
+    if (virtio_queue_packed(vq)) {
+        virtqueue_packed_get_avail_bytes(vq, in_bytes, out_bytes,
+                                         max_in_bytes, max_out_bytes);
+        return;
+    }
+
     idx = vq->last_avail_idx;
 
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
-        VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
         VRingDesc desc;
         hwaddr desc_pa;
@@ -385,7 +820,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vq, &desc, desc_pa, i);
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
             if (desc.len % sizeof(VRingDesc)) {
@@ -404,7 +839,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             max = desc.len / sizeof(VRingDesc);
             desc_pa = desc.addr;
             num_bufs = i = 0;
-            vring_desc_read(vdev, &desc, desc_pa, i);
+            vring_desc_read(vq, &desc, desc_pa, i);
         }
 
         do {
@@ -422,7 +857,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+        } while ((i = virtqueue_read_next_desc(vq, &desc,
+                                               desc_pa, max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -447,7 +883,8 @@ int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
     return in_bytes <= in_total && out_bytes <= out_total;
 }
 
-static void virtqueue_map_desc(unsigned int *p_num_sg, hwaddr *addr, struct iovec *iov,
+static void virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
+                               hwaddr *addr, struct iovec *iov,
                                unsigned int max_num_sg, bool is_write,
                                hwaddr pa, size_t sz)
 {
@@ -455,14 +892,21 @@ static void virtqueue_map_desc(unsigned int *p_num_sg, hwaddr *addr, struct iove
     assert(num_sg <= max_num_sg);
 
     while (sz) {
-        hwaddr len = sz;
+        dma_addr_t len = sz;
 
         if (num_sg == max_num_sg) {
             error_report("virtio: too many write descriptors in indirect table");
             exit(1);
         }
 
-        iov[num_sg].iov_base = cpu_physical_memory_map(pa, &len, is_write);
+        iov[num_sg].iov_base = dma_memory_map(vdev->dma_as, pa, &len,
+                                              is_write ?
+                                              DMA_DIRECTION_FROM_DEVICE :
+                                              DMA_DIRECTION_TO_DEVICE);
+        if (!iov[num_sg].iov_base) {
+            error_report("virtio: bogus descriptor or out of resources");
+            exit(1);
+        }
         iov[num_sg].iov_len = len;
         addr[num_sg] = pa;
 
@@ -473,12 +917,12 @@ static void virtqueue_map_desc(unsigned int *p_num_sg, hwaddr *addr, struct iove
     *p_num_sg = num_sg;
 }
 
-static void virtqueue_map_iovec(struct iovec *sg, hwaddr *addr,
-                                unsigned int *num_sg, unsigned int max_size,
-                                int is_write)
+static void virtqueue_map_iovec(VirtIODevice *vdev, struct iovec *sg,
+                                hwaddr *addr, unsigned int *num_sg,
+                                unsigned int max_size, int is_write)
 {
     unsigned int i;
-    hwaddr len;
+    dma_addr_t len;
 
     /* Note: this function MUST validate input, some callers
      * are passing in num_sg values received over the network.
@@ -494,7 +938,10 @@ static void virtqueue_map_iovec(struct iovec *sg, hwaddr *addr,
 
     for (i = 0; i < *num_sg; i++) {
         len = sg[i].iov_len;
-        sg[i].iov_base = cpu_physical_memory_map(addr[i], &len, is_write);
+        sg[i].iov_base = dma_memory_map(vdev->dma_as, addr[i], &len,
+                                        is_write ?
+                                        DMA_DIRECTION_FROM_DEVICE :
+                                        DMA_DIRECTION_TO_DEVICE);
         if (!sg[i].iov_base) {
             error_report("virtio: error trying to map MMIO memory");
             exit(1);
@@ -506,17 +953,22 @@ static void virtqueue_map_iovec(struct iovec *sg, hwaddr *addr,
     }
 }
 
-void virtqueue_map(VirtQueueElement *elem)
+void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem)
 {
-    virtqueue_map_iovec(elem->in_sg, elem->in_addr, &elem->in_num,
+    virtqueue_map_iovec(vdev, elem->in_sg, elem->in_addr, &elem->in_num,
                         VIRTQUEUE_MAX_SIZE, 1);
-    virtqueue_map_iovec(elem->out_sg, elem->out_addr, &elem->out_num,
+    virtqueue_map_iovec(vdev, elem->out_sg, elem->out_addr, &elem->out_num,
                         VIRTQUEUE_MAX_SIZE, 0);
 }
 
-void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+/*
+ * Lays out @elem, of @sz bytes followed by its arrays for @out_num and
+ * @in_num buffers.  Returns the size of the whole, and only computes it
+ * if @elem is NULL.
+ */
+static size_t virtqueue_layout_element(VirtQueueElement *elem, size_t sz,
+                                       unsigned out_num, unsigned in_num)
 {
-    VirtQueueElement *elem;
     size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
     size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
     size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
@@ -524,46 +976,177 @@ void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
     size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
     size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
 
+    if (elem) {
+        elem->out_num = out_num;
+        elem->in_num = in_num;
+        elem->in_addr = (void *)elem + in_addr_ofs;
+        elem->out_addr = (void *)elem + out_addr_ofs;
+        elem->in_sg = (void *)elem + in_sg_ofs;
+        elem->out_sg = (void *)elem + out_sg_ofs;
+    }
+    return out_sg_end;
+}
+
+void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+{
+    size_t size = virtqueue_layout_element(NULL, sz, out_num, in_num);
+    VirtQueueElement *elem;
+
     assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
-    elem->out_num = out_num;
-    elem->in_num = in_num;
-    elem->in_addr = (void *)elem + in_addr_ofs;
-    elem->out_addr = (void *)elem + out_addr_ofs;
-    elem->in_sg = (void *)elem + in_sg_ofs;
-    elem->out_sg = (void *)elem + out_sg_ofs;
+    elem = g_malloc(size);
+    elem->alloc_size = size;
+    virtqueue_layout_element(elem, sz, out_num, in_num);
     return elem;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+/* Reuses the last element given back to @vq if it is large enough */
+static VirtQueueElement *virtqueue_alloc_pooled_element(VirtQueue *vq,
+                                                        size_t sz,
+                                                        unsigned out_num,
+                                                        unsigned in_num)
 {
-    unsigned int i, head, max;
+    size_t size = virtqueue_layout_element(NULL, sz, out_num, in_num);
+    VirtQueueElement *elem;
+
+    if (vq->elem_pool_len) {
+        elem = vq->elem_pool[vq->elem_pool_len - 1];
+        if (elem->alloc_size >= size) {
+            vq->elem_pool_len--;
+            virtqueue_layout_element(elem, sz, out_num, in_num);
+            return elem;
+        }
+    }
+    return virtqueue_alloc_element(sz, out_num, in_num);
+}
+
+void virtqueue_free_element(VirtQueue *vq, void *elem)
+{
+    if (vq->elem_pool_len < VIRTQUEUE_ELEM_POOL_SIZE) {
+        vq->elem_pool[vq->elem_pool_len++] = elem;
+    } else {
+        g_free(elem);
+    }
+}
+
+static void virtqueue_free_pool(VirtQueue *vq)
+{
+    while (vq->elem_pool_len) {
+        g_free(vq->elem_pool[--vq->elem_pool_len]);
+    }
+}
+
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+{
+    unsigned int i, n, max;
     hwaddr desc_pa = vq->vring.desc;
-    VirtIODevice *vdev = vq->vdev;
     VirtQueueElement *elem;
     unsigned out_num, in_num;
     hwaddr addr[VIRTQUEUE_MAX_SIZE];
     struct iovec iov[VIRTQUEUE_MAX_SIZE];
-    VRingDesc desc;
+    VRingPackedDesc desc;
+    bool indirect = false;
+    uint16_t id;
 
-    if (virtio_queue_empty(vq)) {
+    if (virtio_queue_packed_empty(vq)) {
         return NULL;
     }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
+    /* Make sure the descriptor is read after its flags */
     smp_rmb();
 
+    out_num = in_num = 0;
+    max = vq->vring.num;
+
+    vring_packed_desc_read(vq, &desc, desc_pa, vq->last_avail_idx);
+    id = desc.id;
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (!desc.len || desc.len % sizeof(VRingPackedDesc)) {
+            error_report("Invalid size for indirect buffer table");
+            exit(1);
+        }
+
+        /* loop over the indirect descriptor table */
+        indirect = true;
+        max = desc.len / sizeof(VRingPackedDesc);
+        desc_pa = desc.addr;
+        vring_packed_desc_read(vq, &desc, desc_pa, 0);
+    }
+
+    /* Collect all the descriptors; the buffer id is in the last one */
+    n = 0;
+    for (;;) {
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            virtqueue_map_desc(vq->vdev, &in_num, addr + out_num,
+                               iov + out_num, VIRTQUEUE_MAX_SIZE - out_num,
+                               true, desc.addr, desc.len);
+        } else {
+            if (in_num) {
+                error_report("Incorrect order for descriptors");
+                exit(1);
+            }
+            virtqueue_map_desc(vq->vdev, &out_num, addr, iov,
+                               VIRTQUEUE_MAX_SIZE, false,
+                               desc.addr, desc.len);
+        }
+
+        n++;
+        if (!(desc.flags & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        /* If we've got too many, that implies a descriptor loop. */
+        if (n >= max) {
+            error_report("Looped descriptor");
+            exit(1);
+        }
+        if (indirect) {
+            vring_packed_desc_read(vq, &desc, desc_pa, n);
+        } else {
+            vring_packed_desc_read(vq, &desc, desc_pa,
+                                   (vq->last_avail_idx + n) % vq->vring.num);
+            id = desc.id;
+        }
+    }
+
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_alloc_pooled_element(vq, sz, out_num, in_num);
+    elem->index = id;
+    elem->ndescs = indirect ? 1 : n;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
+
+    vring_packed_advance(vq, &vq->last_avail_idx, &vq->last_avail_wrap_counter,
+                         elem->ndescs);
+
+    vq->inuse++;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+    return elem;
+}
+
+/* Pops the head at last_avail_idx, which the caller knows is available */
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+{
+    unsigned int i, head, max;
+    hwaddr desc_pa = vq->vring.desc;
+    VirtQueueElement *elem;
+    unsigned out_num, in_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingDesc desc;
+
     /* When we start there are none of either input nor output. */
     out_num = in_num = 0;
 
     max = vq->vring.num;
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
 
-    vring_desc_read(vdev, &desc, desc_pa, i);
+    vring_desc_read(vq, &desc, desc_pa, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
         if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
@@ -574,20 +1157,21 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         max = desc.len / sizeof(VRingDesc);
         desc_pa = desc.addr;
         i = 0;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vq, &desc, desc_pa, i);
     }
 
     /* Collect all the descriptors */
     do {
         if (desc.flags & VRING_DESC_F_WRITE) {
-            virtqueue_map_desc(&in_num, addr + out_num, iov + out_num,
-                               VIRTQUEUE_MAX_SIZE - out_num, true, desc.addr, desc.len);
+            virtqueue_map_desc(vq->vdev, &in_num, addr + out_num,
+                               iov + out_num, VIRTQUEUE_MAX_SIZE - out_num,
+                               true, desc.addr, desc.len);
         } else {
             if (in_num) {
                 error_report("Incorrect order for descriptors");
                 exit(1);
             }
-            virtqueue_map_desc(&out_num, addr, iov,
+            virtqueue_map_desc(vq->vdev, &out_num, addr, iov,
                                VIRTQUEUE_MAX_SIZE, false, desc.addr, desc.len);
         }
 
@@ -596,11 +1180,12 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+    } while ((i = virtqueue_read_next_desc(vq, &desc, desc_pa, max)) != max);
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_pooled_element(vq, sz, out_num, in_num);
     elem->index = head;
+    elem->ndescs = 1;
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -616,6 +1201,57 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     return elem;
 }
 
+/*
+ * Pops up to @max elements of @sz bytes into @elems and returns how many
+ * were popped.  The avail index is read at most once for the batch, and
+ * the avail event is updated once at the end.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int n = 0, avail;
+
+    rcu_read_lock();
+    if (virtio_queue_packed(vq)) {
+        while (n < max && (elems[n] = virtqueue_packed_pop(vq, sz))) {
+            n++;
+        }
+        if (n && vq->notification &&
+            virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+            vring_packed_set_avail_event(vq);
+        }
+        goto out;
+    }
+
+    avail = (uint16_t)(vq->shadow_avail_idx - vq->last_avail_idx);
+    if (avail < max) {
+        avail = virtqueue_num_heads(vq, vq->last_avail_idx);
+    }
+    /* Needed after reading the avail index, see virtqueue_num_heads() */
+    smp_rmb();
+
+    while (n < MIN(avail, max)) {
+        elems[n++] = virtqueue_split_pop(vq, sz);
+    }
+    if (n && virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+out:
+    rcu_read_unlock();
+    return n;
+}
+
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    void *elem;
+
+    if (!virtqueue_pop_batch(vq, sz, &elem, 1)) {
+        return NULL;
+    }
+    return elem;
+}
+
 /* Reading and writing a structure directly to QEMUFile is *awful*, but
  * it is what QEMU has always done by mistake.  We can change it sooner
  * or later by bumping the version number of the affected vm states.
@@ -633,7 +1269,7 @@ typedef struct VirtQueueElementOld {
     struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
 } VirtQueueElementOld;
 
-void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
 {
     VirtQueueElement *elem;
     VirtQueueElementOld data;
@@ -643,6 +1279,10 @@ void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
 
     elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
     elem->index = data.index;
+    elem->ndescs = 1;
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        elem->ndescs = qemu_get_be32(f);
+    }
 
     for (i = 0; i < elem->in_num; i++) {
         elem->in_addr[i] = data.in_addr[i];
@@ -664,11 +1304,12 @@ void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
         elem->out_sg[i].iov_len = data.out_sg[i].iov_len;
     }
 
-    virtqueue_map(elem);
+    virtqueue_map(vdev, elem);
     return elem;
 }
 
-void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
+                                VirtQueueElement *elem)
 {
     VirtQueueElementOld data;
     int i;
@@ -697,6 +1338,9 @@ void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
         data.out_sg[i].iov_len = elem->out_sg[i].iov_len;
     }
     qemu_put_buffer(f, (uint8_t *)&data, sizeof(VirtQueueElementOld));
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        qemu_put_be32(f, elem->ndescs);
+    }
 }
 
 /* virtio device */
@@ -806,7 +1450,10 @@ void virtio_reset(void *opaque)
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
+        virtio_queue_update_caches(&vdev->vq[i]);
     }
 }
 
@@ -1016,6 +1663,7 @@ void virtio_queue_set_rings(VirtIODevice *vdev, int n, hwaddr desc,
     vdev->vq[n].vring.desc = desc;
     vdev->vq[n].vring.avail = avail;
     vdev->vq[n].vring.used = used;
+    virtio_queue_update_caches(&vdev->vq[n]);
 }
 
 void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
@@ -1029,6 +1677,7 @@ void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
         return;
     }
     vdev->vq[n].vring.num = num;
+    virtio_queue_update_caches(&vdev->vq[n]);
 }
 
 VirtQueue *virtio_vector_first_queue(VirtIODevice *vdev, uint16_t vector)
@@ -1141,6 +1790,7 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.num_default = queue_size;
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
+    vdev->vq[i].used_elems = g_new0(VRingPackedUsedElem, VIRTQUEUE_MAX_SIZE);
 
     return &vdev->vq[i];
 }
@@ -1153,6 +1803,10 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
 
     vdev->vq[n].vring.num = 0;
     vdev->vq[n].vring.num_default = 0;
+    g_free(vdev->vq[n].used_elems);
+    vdev->vq[n].used_elems = NULL;
+    virtio_queue_update_caches(&vdev->vq[n]);
+    virtqueue_free_pool(&vdev->vq[n]);
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -1162,6 +1816,35 @@ void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
+static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VRingPackedDescEvent e;
+    uint16_t old, new;
+    int off;
+    bool v;
+
+    vring_packed_event_read(vq, &e);
+
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+
+    if (e.flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (e.flags == VRING_PACKED_EVENT_FLAG_ENABLE ||
+               !virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        return true;
+    }
+
+    /* The event position is in the lap of its wrap counter */
+    off = e.off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+    if (vq->used_wrap_counter != e.off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+    return !v || vring_need_event(off, new, old);
+}
+
 bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     uint16_t old, new;
@@ -1174,6 +1857,10 @@ bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
         return true;
     }
 
+    if (virtio_queue_packed(vq)) {
+        return virtio_packed_should_notify(vdev, vq);
+    }
+
     if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
     }
@@ -1232,6 +1919,13 @@ static bool virtio_virtqueue_needed(void *opaque)
     return virtio_host_has_feature(vdev, VIRTIO_F_VERSION_1);
 }
 
+static bool virtio_packed_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
+}
+
 static bool virtio_ringsize_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -1278,6 +1972,30 @@ static const VMStateDescription vmstate_virtio_virtqueues = {
     }
 };
 
+static const VMStateDescription vmstate_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(last_avail_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT16(used_idx, struct VirtQueue),
+        VMSTATE_BOOL(used_wrap_counter, struct VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_packed_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, struct VirtIODevice,
+                      VIRTIO_QUEUE_MAX, 0, vmstate_packed_virtqueue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_ringsize = {
     .name = "ringsize_state",
     .version_id = 1,
@@ -1381,6 +2099,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_device_endian,
         &vmstate_virtio_64bit_features,
         &vmstate_virtio_virtqueues,
+        &vmstate_virtio_packed_virtqueues,
         &vmstate_virtio_ringsize,
         &vmstate_virtio_extra_state,
         NULL
@@ -1441,12 +2160,20 @@ static int virtio_set_features_nocheck(VirtIODevice *vdev, uint64_t val)
 {
     VirtioDeviceClass *k = VIRTIO_DEVICE_GET_CLASS(vdev);
     bool bad = (val & ~(vdev->host_features)) != 0;
+    int i;
 
     val &= vdev->host_features;
     if (k->set_features) {
         k->set_features(vdev, val);
     }
     vdev->guest_features = val;
+
+    /* The size of the avail area depends on the ring layout */
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.num) {
+            virtio_queue_update_caches(&vdev->vq[i]);
+        }
+    }
     return bad ? -1 : 0;
 }
 
@@ -1581,7 +2308,11 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
     }
 
     for (i = 0; i < num; i++) {
-        if (vdev->vq[i].vring.desc) {
+        if (vdev->vq[i].vring.desc &&
+            virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+            /* The subsection restored the rest of the ring state */
+            vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
+        } else if (vdev->vq[i].vring.desc) {
             uint16_t nheads;
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
@@ -1603,7 +2334,17 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    memory_listener_unregister(&vdev->listener);
     qemu_del_vm_change_state_handler(vdev->vmstate);
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        g_free(vdev->vq[i].used_elems);
+        virtqueue_free_pool(&vdev->vq[i]);
+        if (vdev->vq[i].caches) {
+            call_rcu(vdev->vq[i].caches, virtio_free_caches, rcu);
+        }
+    }
     g_free(vdev->config);
     g_free(vdev->vq);
     g_free(vdev->vector_queues);
@@ -1665,6 +2406,8 @@ void virtio_init(VirtIODevice *vdev, const char *name,
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
         vdev->vq[i].queue_index = i;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
     }
 
     vdev->name = name;
@@ -1678,6 +2421,25 @@ void virtio_init(VirtIODevice *vdev, const char *name,
                                                      vdev);
     vdev->device_endian = virtio_default_endian();
     vdev->use_guest_notifier_mask = true;
+    vdev->dma_as = &address_space_memory;
+
+    vdev->listener = (MemoryListener) {
+        .commit = virtio_memory_listener_commit,
+        /* After the dispatch tables are rebuilt */
+        .priority = 10,
+    };
+    memory_listener_register(&vdev->listener, vdev->dma_as);
+}
+
+void virtio_set_dma_as(VirtIODevice *vdev, AddressSpace *as)
+{
+    if (vdev->dma_as == as) {
+        return;
+    }
+
+    memory_listener_unregister(&vdev->listener);
+    vdev->dma_as = as;
+    memory_listener_register(&vdev->listener, as);
 }
 
 hwaddr virtio_queue_get_desc_addr(VirtIODevice *vdev, int n)
@@ -1707,31 +2469,85 @@ hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_queue_packed(&vdev->vq[n])) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingAvail, ring) +
         sizeof(uint16_t) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_queue_packed(&vdev->vq[n])) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingUsed, ring) +
         sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_ring_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_queue_packed(&vdev->vq[n])) {
+        /* The areas are not contiguous, the device writes to the ring */
+        return virtio_queue_get_desc_size(vdev, n);
+    }
     return vdev->vq[n].vring.used - vdev->vq[n].vring.desc +
 	    virtio_queue_get_used_size(vdev, n);
 }
 
-uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
+/*
+ * For packed rings, bit 15 holds the wrap counter and the high 16 bits the
+ * used index and its wrap counter, like the vring base of vhost.
+ */
+unsigned int virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
 {
-    return vdev->vq[n].last_avail_idx;
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (virtio_queue_packed(vq)) {
+        unsigned int avail = vq->last_avail_idx |
+            vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+        unsigned int used = vq->used_idx |
+            vq->used_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+
+        return avail | used << 16;
+    }
+    return vq->last_avail_idx;
+}
+
+void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n,
+                                     unsigned int idx)
+{
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (virtio_queue_packed(vq)) {
+        vq->last_avail_idx = idx & 0x7fff;
+        vq->last_avail_wrap_counter = !!(idx & 0x8000);
+        vq->used_idx = (idx >> 16) & 0x7fff;
+        vq->used_wrap_counter = !!(idx & 0x80000000);
+        vq->shadow_avail_idx = vq->last_avail_idx;
+        return;
+    }
+    vq->last_avail_idx = idx;
+    vq->shadow_avail_idx = idx;
 }
 
-void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
+/*
+ * Used when the backend of a vhost device went away without telling where
+ * it stopped: restart from the last buffer it has used, so that the buffers
+ * that were in flight are processed again rather than lost.  Packed rings
+ * do not record the length of the used chains, so they keep the last
+ * state that is known.
+ */
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
 {
-    vdev->vq[n].last_avail_idx = idx;
-    vdev->vq[n].shadow_avail_idx = idx;
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (!vq->vring.desc || virtio_queue_packed(vq)) {
+        return;
+    }
+    vq->used_idx = vring_used_idx(vq);
+    vq->last_avail_idx = vq->used_idx;
+    vq->shadow_avail_idx = vq->last_avail_idx;
 }
 
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
@@ -1786,12 +2602,29 @@ static void virtio_queue_host_notifier_read(EventNotifier *n)
     }
 }
 
+/* Check the avail ring directly, so that aio_poll can pick up new
+ * requests without waiting for the guest's notification.  */
+static bool virtio_queue_host_notifier_aio_poll(void *opaque)
+{
+    EventNotifier *n = opaque;
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    if (!vq->vring.desc || virtio_queue_empty(vq)) {
+        return false;
+    }
+
+    virtio_queue_notify_vq(vq);
+    return true;
+}
+
 void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
                                                 bool assign, bool set_handler)
 {
     if (assign && set_handler) {
         aio_set_event_notifier(ctx, &vq->host_notifier, true,
                                virtio_queue_host_notifier_read);
+        aio_set_event_notifier_poll(ctx, &vq->host_notifier,
+                                    virtio_queue_host_notifier_aio_poll);
     } else {
         aio_set_event_notifier(ctx, &vq->host_notifier, true, NULL);
     }
@@ -41,12 +41,37 @@ struct BlockAIOCB {
 
 void *qemu_aio_get(const AIOCBInfo *aiocb_info, BlockDriverState *bs,
                    BlockCompletionFunc *cb, void *opaque);
+
+/* Number of AIOCBs that qemu_aio_get could not take from its cache */
+extern uint64_t qemu_aio_alloc_count;
 void qemu_aio_unref(void *p);
 void qemu_aio_ref(void *p);
 
 typedef struct AioHandler AioHandler;
+typedef struct BHListSlice BHListSlice;
+typedef QSLIST_HEAD(, QEMUBH) QEMUBHList;
 typedef void QEMUBHFunc(void *opaque);
+
+/* Scheduled bottom halves with a higher priority (lower value) run first */
+typedef enum QEMUBHPriority {
+    QEMU_BH_PRIO_HIGH,          /* I/O completions */
+    QEMU_BH_PRIO_NORMAL,
+    QEMU_BH_PRIO_MAX,
+} QEMUBHPriority;
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
+
+/* Dispatch time buckets: below 10us, 100us, 1ms, 10ms, 100ms and above */
+#define AIO_STATS_BUCKETS 6
+
+/* Dispatch time accounting for all the handlers with the same name */
+typedef struct AioHandlerStats {
+    const char *name;
+    uint64_t count;
+    int64_t total_ns;
+    int64_t max_ns;
+    uint64_t histogram[AIO_STATS_BUCKETS];
+} AioHandlerStats;
 
 struct AioContext {
     GSource source;
@@ -88,16 +113,16 @@ struct AioContext {
      */
     uint32_t notify_me;
 
-    /* lock to protect between bh's adders and deleter */
-    QemuMutex bh_lock;
-
-    /* Anchor of the list of Bottom Halves belonging to the context */
-    struct QEMUBH *first_bh;
+    /* Bottom halves waiting for aio_bh_poll, one list per priority.  Any
+     * thread can push to them with atomic operations, while aio_bh_poll
+     * takes each list as a whole.  Unscheduled BHs are not on any list.
+     */
+    QEMUBHList bh_list[QEMU_BH_PRIO_MAX];
 
-    /* A simple lock used to protect the first_bh list, and ensure that
-     * no callbacks are removed while we're walking and dispatching callbacks.
+    /* Lists taken by aio_bh_poll calls that have not finished running them.
+     * Nested aio_bh_poll calls keep running them, like the outer ones.
      */
-    int walking_bh;
+    QSIMPLEQ_HEAD(, BHListSlice) bh_slice_list;
 
     /* Used by aio_notify.
      *
@@ -129,6 +154,25 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+    /* Adaptive polling, see aio_context_set_poll_params.  poll_ns is the
+     * current length of the polling window, which is adjusted between 0
+     * and poll_max_ns depending on how long aio_poll had to wait for
+     * events.
+     */
+    int64_t poll_max_ns;
+    int64_t poll_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Dispatch time accounting, see aio_stats_account.  The table maps
+     * handler names to AioHandlerStats and is protected by stats_lock;
+     * the statistics themselves are only written by the thread that runs
+     * the event loop.
+     */
+    QemuMutex stats_lock;
+    GHashTable *stats;
+    AioHandlerStats *timer_stats;
 };
 
 /**
@@ -177,8 +221,14 @@ void aio_context_release(AioContext *ctx);
  * Bottom halves are lightweight callbacks whose invocation is guaranteed
  * to be wait-free, thread-safe and signal-safe.  The #QEMUBH structure
  * is opaque and must be allocated prior to its use.
+ *
+ * @name is used for dispatch time accounting.  aio_bh_new uses the
+ * name of the callback.
  */
-QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque);
+QEMUBH *aio_bh_new_full(AioContext *ctx, QEMUBHFunc *cb, void *opaque,
+                        const char *name);
+#define aio_bh_new(ctx, cb, opaque) \
+    aio_bh_new_full((ctx), (cb), (opaque), stringify(cb))
 
 /**
  * aio_notify: Force processing of pending events.
@@ -221,6 +271,11 @@ void aio_bh_call(QEMUBH *bh);
 /**
  * aio_bh_poll: Poll bottom halves for an AioContext.
  *
+ * Only the bottom halves that were scheduled when aio_bh_poll starts are
+ * run, in order of priority and then in the order they were scheduled.
+ * The cost is proportional to the number of scheduled bottom halves,
+ * not to the number of existing ones.
+ *
  * These are internal functions used by the QEMU main loop.
  * And notice that multiple occurrences of aio_bh_poll cannot
  * be called concurrently
@@ -233,14 +288,27 @@ int aio_bh_poll(AioContext *ctx);
  * Scheduling a bottom half interrupts the main loop and causes the
  * execution of the callback that was passed to qemu_bh_new.
  *
- * Bottom halves that are scheduled from a bottom half handler are instantly
- * invoked.  This can create an infinite loop if a bottom half handler
- * schedules itself.
+ * Bottom halves that are scheduled from a bottom half handler are invoked
+ * on the next iteration of the event loop.  A bottom half handler that
+ * schedules itself thus keeps the event loop busy.
  *
  * @bh: The bottom half to be scheduled.
  */
 void qemu_bh_schedule(QEMUBH *bh);
 
+/**
+ * qemu_bh_set_priority: Set the priority of a bottom half.
+ *
+ * Bottom halves start with %QEMU_BH_PRIO_NORMAL.  Those that complete
+ * I/O requests should use %QEMU_BH_PRIO_HIGH, so that they are not
+ * delayed by housekeeping work.  The new priority takes effect the next
+ * time the bottom half is scheduled.
+ *
+ * @bh: The bottom half.
+ * @prio: The new priority.
+ */
+void qemu_bh_set_priority(QEMUBH *bh, QEMUBHPriority prio);
+
 /**
  * qemu_bh_cancel: Cancel execution of a bottom half.
  *
@@ -308,13 +376,22 @@ bool aio_poll(AioContext *ctx, bool blocking);
  *
  * Code that invokes AIO completion functions should rely on this function
  * instead of qemu_set_fd_handler[2].
+ *
+ * @read_name and @write_name are used for dispatch time accounting;
+ * aio_set_fd_handler uses the names of the callbacks.
  */
-void aio_set_fd_handler(AioContext *ctx,
-                        int fd,
-                        bool is_external,
-                        IOHandler *io_read,
-                        IOHandler *io_write,
-                        void *opaque);
+void aio_set_fd_handler_full(AioContext *ctx,
+                             int fd,
+                             bool is_external,
+                             IOHandler *io_read,
+                             IOHandler *io_write,
+                             void *opaque,
+                             const char *read_name,
+                             const char *write_name);
+#define aio_set_fd_handler(ctx, fd, is_external, io_read, io_write, opaque) \
+    aio_set_fd_handler_full((ctx), (fd), (is_external), (io_read),         \
+                            (io_write), (opaque),                          \
+                            stringify(io_read), stringify(io_write))
 
 /* Register an event notifier and associated callbacks.  Behaves very similarly
  * to event_notifier_set_handler.  Unlike event_notifier_set_handler, these callbacks
@@ -323,10 +400,29 @@ void aio_set_fd_handler(AioContext *ctx,
  * Code that invokes AIO completion functions should rely on this function
  * instead of event_notifier_set_handler.
  */
-void aio_set_event_notifier(AioContext *ctx,
-                            EventNotifier *notifier,
-                            bool is_external,
-                            EventNotifierHandler *io_read);
+void aio_set_event_notifier_full(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 bool is_external,
+                                 EventNotifierHandler *io_read,
+                                 const char *name);
+#define aio_set_event_notifier(ctx, notifier, is_external, io_read)    \
+    aio_set_event_notifier_full((ctx), (notifier), (is_external),      \
+                                (io_read), stringify(io_read))
+
+/* Set a function that checks, without a system call, whether the handler
+ * registered for @fd with aio_set_fd_handler has work to do.  If so, the
+ * function should do it and return true.
+ *
+ * Before blocking, aio_poll calls such functions in a loop for a short
+ * while, if all handlers in the AioContext have one.  This avoids the
+ * latency of waking up from poll() when events come in quickly.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
+
+/* Likewise for a handler registered with aio_set_event_notifier.  */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
 
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
@@ -442,4 +538,67 @@ static inline bool aio_node_check(AioContext *ctx, bool is_external)
  */
 void aio_context_setup(AioContext *ctx, Error **errp);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds; 0 disables polling
+ * @grow: how much to multiply the polling window by when events arrive
+ *        soon after it ends, or 0 for the default
+ * @shrink: how much to divide the polling window by when events arrive
+ *          too late to be caught by polling, or 0 to reset it
+ *
+ * Configure the busy polling done by aio_poll before blocking.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
+/* Dispatch time accounting is disabled unless aio_stats_enabled is set.
+ * Handlers that run for at least aio_stats_slow_ns, if nonzero, are
+ * traced, and reported the first time they reach a new maximum.
+ */
+extern bool aio_stats_enabled;
+extern int64_t aio_stats_slow_ns;
+
+/**
+ * aio_stats_start:
+ *
+ * Returns the start time for aio_stats_account, or 0 if dispatch time
+ * accounting is disabled.
+ */
+static inline int64_t aio_stats_start(void)
+{
+    return atomic_read(&aio_stats_enabled) ? get_clock() : 0;
+}
+
+/**
+ * aio_stats_account:
+ * @ctx: the aio context
+ * @stats: cached pointer to the statistics for @name, or NULL
+ * @name: the name of the handler; it must stay valid as long as @ctx
+ * @start: the value returned by aio_stats_start before the handler ran
+ *
+ * Account the time spent in a handler since @start.
+ */
+void aio_stats_account(AioContext *ctx, AioHandlerStats **stats,
+                       const char *name, int64_t start);
+
+/**
+ * aio_stats_foreach:
+ * @ctx: the aio context
+ * @fn: function called with a snapshot of each handler's statistics
+ * @opaque: passed to @fn
+ */
+void aio_stats_foreach(AioContext *ctx,
+                       void (*fn)(const AioHandlerStats *stats, void *opaque),
+                       void *opaque);
+
+/**
+ * aio_stats_reset:
+ * @ctx: the aio context
+ *
+ * Clear the dispatch time statistics of @ctx.
+ */
+void aio_stats_reset(AioContext *ctx);
+
 #endif
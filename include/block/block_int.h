@@ -40,6 +40,7 @@
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
+#define BLOCK_FLAG_EXTL2            16
 
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
@@ -57,6 +58,11 @@
 #define BLOCK_OPT_NOCOW             "nocow"
 #define BLOCK_OPT_OBJECT_SIZE       "object_size"
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
+#define BLOCK_OPT_EXTL2             "extended_l2"
+#define BLOCK_OPT_JOURNAL_SIZE      "journal_size"
+#define BLOCK_OPT_DEDUP_INDEX_SIZE  "dedup_index_size"
+#define BLOCK_OPT_DATA_FILE         "data_file"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -85,6 +91,16 @@ typedef struct BdrvTrackedRequest {
     struct BdrvTrackedRequest *waiting_for;
 } BdrvTrackedRequest;
 
+/* Describes a finished write to the after-write notifiers */
+typedef struct BdrvWriteResult {
+    BdrvTrackedRequest *req;
+    int64_t offset;
+    unsigned int bytes;
+    QEMUIOVector *qiov;         /* NULL if the data is not available */
+    BdrvRequestFlags flags;
+    int ret;
+} BdrvWriteResult;
+
 struct BlockDriver {
     const char *format_name;
     int instance_size;
@@ -169,6 +185,25 @@ struct BlockDriver {
         int64_t sector_num, int nb_sectors, int *pnum,
         BlockDriverState **file);
 
+    /*
+     * Copy a range of sectors from @bs to @dst without passing the data
+     * through a buffer in QEMU.  Format drivers translate the source offset
+     * and pass the request down with bdrv_co_copy_range_from(); protocol
+     * drivers hand it over to the destination with bdrv_co_copy_range_to().
+     * Return -ENOTSUP if the copy cannot be offloaded; the caller then
+     * falls back to a read followed by a write.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_from)(BlockDriverState *bs,
+        int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+        int nb_sectors);
+    /*
+     * The destination side of a copy offload: @bs is the destination node
+     * and @src is the protocol node that the data is copied from.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_to)(BlockDriverState *bs,
+        BlockDriverState *src, int64_t src_sector, int64_t dst_sector,
+        int nb_sectors);
+
     /*
      * Invalidate any cached meta-data.
      */
@@ -190,6 +225,10 @@ struct BlockDriver {
 
     const char *protocol_name;
     int (*bdrv_truncate)(BlockDriverState *bs, int64_t offset);
+    /* Grow the image to @offset and preallocate the new area according to
+     * @prealloc, which is never PREALLOC_MODE_OFF */
+    int (*bdrv_truncate_prealloc)(BlockDriverState *bs, int64_t offset,
+                                  PreallocMode prealloc, Error **errp);
 
     int64_t (*bdrv_getlength)(BlockDriverState *bs);
     bool has_variable_length;
@@ -214,6 +253,9 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    /* Fills the metadata cache fields of @stats */
+    void (*bdrv_get_cache_stats)(BlockDriverState *bs,
+                                 BlockDeviceStats *stats);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -305,6 +347,19 @@ struct BlockDriver {
      */
     void (*bdrv_drain)(BlockDriverState *bs);
 
+    /**
+     * Persistent dirty bitmaps: check whether a new bitmap could be stored
+     * in the image, and drop the stored copy of a bitmap that is removed.
+     * Drivers load their bitmaps on open and store them on inactivation.
+     */
+    bool (*bdrv_can_store_new_dirty_bitmap)(BlockDriverState *bs,
+                                            const char *name,
+                                            uint32_t granularity,
+                                            Error **errp);
+    void (*bdrv_remove_persistent_dirty_bitmap)(BlockDriverState *bs,
+                                                const char *name,
+                                                Error **errp);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -364,6 +419,32 @@ struct BdrvChild {
     QLIST_ENTRY(BdrvChild) next_parent;
 };
 
+/* Settings of a single member of a throttling group.  The group limits are
+ * shared by all members, these settings decide how the members share them.
+ *
+ * - weight: members with pending requests get throughput in proportion to
+ *   their weight.  Capacity that a member does not use remains available
+ *   to the others.
+ *
+ * - latency_target: if the oldest throttled request of a member has waited
+ *   longer than this (in milliseconds), the member is served first
+ *   regardless of its weight.  0 disables the target.
+ *
+ * - burst_credit: how many bytes of its share a member that was idle may
+ *   catch up on, ahead of the other members.
+ */
+typedef struct ThrottleGroupMemberConfig {
+    unsigned weight;
+    uint64_t latency_target;
+    uint64_t burst_credit;
+} ThrottleGroupMemberConfig;
+
+/* A request that waits in the queue of a group member */
+typedef struct ThrottleGroupWaiter {
+    int64_t start;              /* when it was queued */
+    QSIMPLEQ_ENTRY(ThrottleGroupWaiter) next;
+} ThrottleGroupWaiter;
+
 /*
  * Note: the function bdrv_append() copies and swaps contents of
  * BlockDriverStates, so if you add new fields to this struct, please
@@ -407,6 +488,9 @@ struct BlockDriverState {
     /* Callback before write request is processed */
     NotifierWithReturnList before_write_notifiers;
 
+    /* Callback after write request was processed, gets a BdrvWriteResult */
+    NotifierWithReturnList after_write_notifiers;
+
     /* number of in-flight serialising requests */
     unsigned int serialising_in_flight;
 
@@ -421,11 +505,18 @@ struct BlockDriverState {
     ThrottleState *throttle_state;
     ThrottleTimers throttle_timers;
     unsigned       pending_reqs[2];
+    QSIMPLEQ_HEAD(, ThrottleGroupWaiter) throttle_waiters[2];
+    ThrottleGroupMemberConfig throttle_member_cfg;
+    uint64_t       throttle_vtime[2]; /* service received, scaled by weight */
     QLIST_ENTRY(BlockDriverState) round_robin;
 
     /* Offset after the highest byte written to */
     uint64_t wr_highest_offset;
 
+    /* Requests that needed bounce buffers; updated with atomic operations
+     * because protocol drivers may bounce in worker threads. */
+    BlockBounceStats bounce_stats;
+
     /* I/O Limits */
     BlockLimits bl;
 
@@ -487,6 +578,7 @@ struct BlockBackendRootState {
 
     char *throttle_group;
     ThrottleState *throttle_state;
+    ThrottleGroupMemberConfig throttle_member_cfg;
 };
 
 static inline BlockDriverState *backing_bs(BlockDriverState *bs)
@@ -529,6 +621,19 @@ void bdrv_set_io_limits(BlockDriverState *bs,
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier);
 
+/**
+ * bdrv_add_after_write_notifier:
+ *
+ * Register a callback that is invoked with a #BdrvWriteResult after the data
+ * of a write request has been written (or writing it failed), but before the
+ * request is completed.  Every write that invoked the before-write notifiers
+ * invokes the after-write notifiers, too.  Zero writes have
+ * %BDRV_REQ_ZERO_WRITE set in the flags, and writes whose data is not
+ * available (such as offloaded copies) neither have the flag nor a qiov.
+ */
+void bdrv_add_after_write_notifier(BlockDriverState *bs,
+                                   NotifierWithReturn *notifier);
+
 /**
  * bdrv_detach_aio_context:
  *
@@ -649,6 +754,7 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
  * @granularity: The chosen granularity for the dirty bitmap.
  * @buf_size: The amount of data that can be in flight at one time.
  * @mode: Whether to collapse all images in the chain to the target.
+ * @copy_mode: When to copy guest writes to the target.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @unmap: Whether to unmap target where source sectors only contain zeroes.
@@ -664,7 +770,8 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   const char *replaces,
                   int64_t speed, uint32_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, MirrorCopyMode copy_mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap,
                   BlockCompletionFunc *cb,
@@ -26,6 +26,7 @@
 #define BLOCKJOB_H 1
 
 #include "block/block.h"
+#include "qemu/ratelimit.h"
 
 /**
  * BlockJobDriver:
@@ -251,6 +252,28 @@ void block_job_completed(BlockJob *job, int ret);
  */
 void block_job_set_speed(BlockJob *job, int64_t speed, Error **errp);
 
+/**
+ * block_job_set_global_speed:
+ * @speed: The new value, in bytes per second, or 0 for unlimited.
+ * @errp: Error object.
+ *
+ * Set a bandwidth budget that is shared by all block jobs, on top of
+ * the speed of each job.
+ */
+void block_job_set_global_speed(int64_t speed, Error **errp);
+
+/**
+ * block_job_ratelimit:
+ * @job: The job that is about to copy data.
+ * @limit: The rate limit of @job, only used if the job has a speed set.
+ * @n: Number of sectors that are about to be copied.
+ *
+ * Account @n sectors against both the rate limit of @job and the budget
+ * shared by all block jobs.  Returns how many nanoseconds the job should
+ * sleep before copying them.
+ */
+int64_t block_job_ratelimit(BlockJob *job, RateLimit *limit, uint64_t n);
+
 /**
  * block_job_cancel:
  * @job: The job to be canceled.
@@ -28,6 +28,9 @@
 #include "qemu/throttle.h"
 #include "block/block_int.h"
 
+#define THROTTLE_GROUP_DEFAULT_WEIGHT 100
+#define THROTTLE_GROUP_MAX_WEIGHT     10000
+
 const char *throttle_group_get_name(BlockDriverState *bs);
 
 ThrottleState *throttle_group_incref(const char *name);
@@ -36,6 +39,14 @@ void throttle_group_unref(ThrottleState *ts);
 void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg);
 void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg);
 
+void throttle_group_member_config_init(ThrottleGroupMemberConfig *cfg);
+bool throttle_group_member_config_is_valid(ThrottleGroupMemberConfig *cfg,
+                                           Error **errp);
+void throttle_group_set_member_config(BlockDriverState *bs,
+                                      ThrottleGroupMemberConfig *cfg);
+void throttle_group_get_member_config(BlockDriverState *bs,
+                                      ThrottleGroupMemberConfig *cfg);
+
 void throttle_group_register_bs(BlockDriverState *bs, const char *groupname);
 void throttle_group_unregister_bs(BlockDriverState *bs);
 
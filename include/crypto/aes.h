@@ -65,4 +65,18 @@ extern const uint32_t AES_Te0[256], AES_Te1[256], AES_Te2[256],
 extern const uint32_t AES_Td0[256], AES_Td1[256], AES_Td2[256],
                       AES_Td3[256], AES_Td4[256];
 
+/*
+ * One round on a 16-byte state in FIPS-197 byte order, done in place with
+ * the AES instructions of the host.  enc and dec have the semantics of
+ * the x86 AESENC/AESDEC instructions, or AESENCLAST/AESDECLAST if @last;
+ * imc is AESIMC.  aes_host_funcs is NULL if the host lacks them.
+ */
+typedef struct AESHostFuncs {
+    void (*enc)(uint8_t *st, const uint8_t *rk, bool last);
+    void (*dec)(uint8_t *st, const uint8_t *rk, bool last);
+    void (*imc)(uint8_t *st);
+} AESHostFuncs;
+
+extern const AESHostFuncs *aes_host_funcs;
+
 #endif
@@ -319,4 +319,26 @@ int qcrypto_tls_session_get_key_size(QCryptoTLSSession *sess,
  */
 char *qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess);
 
+/**
+ * qcrypto_tls_session_enable_ktls:
+ * @sess: the TLS session object
+ * @fd: the TCP socket carrying the session
+ * @tx: set to true if sending was offloaded to the kernel
+ * @rx: set to true if receiving was offloaded to the kernel
+ *
+ * Once the handshake is complete, try to hand the session
+ * keys over to the kernel TLS implementation of @fd. For
+ * each direction that is offloaded, application data must
+ * from then on be sent or received with plain writes or
+ * reads of @fd instead of qcrypto_tls_session_write() or
+ * qcrypto_tls_session_read().
+ *
+ * This is only done for TLS 1.2 sessions using AES-GCM,
+ * on hosts whose kernel supports it; in any other case
+ * both @tx and @rx are set to false and the session is
+ * left unchanged.
+ */
+void qcrypto_tls_session_enable_ktls(QCryptoTLSSession *sess, int fd,
+                                     bool *tx, bool *rx);
+
 #endif /* QCRYPTO_TLS_SESSION_H__ */
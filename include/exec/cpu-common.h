@@ -136,6 +136,22 @@ typedef int (RAMBlockIterFunc)(const char *block_name, void *host_addr,
 
 int qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque);
 
+/*
+ * Lets code outside the memory core track the host memory that backs guest
+ * RAM, e.g. to map it for DMA.  Called with the iothread lock held.
+ */
+typedef struct RAMBlockNotifier {
+    void (*ram_block_added)(struct RAMBlockNotifier *n, void *host,
+                            size_t size);
+    void (*ram_block_removed)(struct RAMBlockNotifier *n, void *host,
+                              size_t size);
+    QLIST_ENTRY(RAMBlockNotifier) next;
+} RAMBlockNotifier;
+
+/* ram_block_added is called right away for the blocks that already exist */
+void ram_block_notifier_add(RAMBlockNotifier *n);
+void ram_block_notifier_remove(RAMBlockNotifier *n);
+
 #endif
 
 #endif /* !CPU_COMMON_H */
@@ -27,6 +27,7 @@
 #include "tcg-target.h"
 #ifndef CONFIG_USER_ONLY
 #include "exec/hwaddr.h"
+#include "qemu/thread.h"
 #endif
 #include "exec/memattrs.h"
 
@@ -63,6 +64,23 @@ typedef uint64_t target_ulong;
 #define CPU_TLB_ENTRY_BITS 5
 #endif
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* The TLB of each MMU mode is allocated separately and resized at flush
+ * time, between 1 << CPU_TLB_DYN_MIN_BITS and 1 << CPU_TLB_DYN_MAX_BITS
+ * entries, depending on how much of it was used since the last resize.
+ * The TCG backend loads the table and its mask from env.
+ */
+#define CPU_TLB_DYN_MIN_BITS 6
+#define CPU_TLB_DYN_DEFAULT_BITS 8
+
+#if HOST_LONG_BITS == 32
+/* Make sure we do not require a double-word shift for the TLB load */
+#define CPU_TLB_DYN_MAX_BITS MIN(16, 32 - TARGET_PAGE_BITS)
+#else
+#define CPU_TLB_DYN_MAX_BITS MIN(22, TARGET_LONG_BITS - TARGET_PAGE_BITS)
+#endif
+
+#else
 /* TCG_TARGET_TLB_DISPLACEMENT_BITS is used in CPU_TLB_BITS to ensure that
  * the TLB is not unnecessarily small, but still small enough for the
  * TLB lookup instruction sequence used by the TCG target.
@@ -94,6 +112,7 @@ typedef uint64_t target_ulong;
          NB_MMU_MODES <= 8 ? 3 : 4))
 
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+#endif /* TCG_TARGET_IMPLEMENTS_DYN_TLB */
 
 typedef struct CPUTLBEntry {
     /* bit TARGET_LONG_BITS to TARGET_PAGE_BITS : virtual address
@@ -128,15 +147,57 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+/* Slow path counters, reported by "info jit".  Hits in the inline fast
+ * path generated by the TCG backend are not counted.
+ */
+typedef struct CPUTLBStats {
+    size_t miss;            /* slow path entered with a TLB mismatch */
+    size_t victim_hit;      /* ... and the entry was in the victim TLB */
+    size_t fill;            /* entries installed by tlb_set_page */
+    size_t flush_full;
+    size_t flush_part;      /* flushes of a subset of the MMU modes */
+    size_t flush_page;
+    size_t resize;
+} CPUTLBStats;
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* The tables are owned by the CPU for its whole lifetime, so CPU reset must
+ * not clear them: targets stop their reset memset at end_reset_fields,
+ * before CPU_COMMON, and rely on tlb_flush() instead.
+ */
+typedef struct CPUTLBDesc {
+    /* Largest number of used entries seen in the current window */
+    size_t window_max_entries;
+    int64_t window_begin_ns;
+    /* Entries filled since the last flush of this MMU mode */
+    size_t n_used_entries;
+} CPUTLBDesc;
+
+#define CPU_COMMON_TLB_TABLES                                           \
+    /* tlb_mask[i] is (number of entries - 1) << CPU_TLB_ENTRY_BITS */  \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];                               \
+    CPUIOTLBEntry *iotlb[NB_MMU_MODES];                                 \
+    CPUTLBDesc tlb_d[NB_MMU_MODES];                                     \
+    /* Protects the table pointers against tlb_reset_dirty */           \
+    QemuSpin tlb_lock;                                                  \
+
+#else
+#define CPU_COMMON_TLB_TABLES                                           \
+    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                    \
+
+#endif
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
-    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPU_COMMON_TLB_TABLES                                               \
     CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
-    CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                    \
     CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
     target_ulong tlb_flush_addr;                                        \
     target_ulong tlb_flush_mask;                                        \
     target_ulong vtlb_index;                                            \
+    CPUTLBStats tlb_stats;                                              \
 
 #else
 
@@ -78,9 +78,13 @@ void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
+void tb_tier_up(CPUState *cpu, TranslationBlock *tb);
+extern int tcg_tier_threshold;
 void cpu_exec_init(CPUState *cpu, Error **errp);
 void QEMU_NORETURN cpu_loop_exit(CPUState *cpu);
 void QEMU_NORETURN cpu_loop_exit_restore(CPUState *cpu, uintptr_t pc);
+void QEMU_NORETURN cpu_loop_exit_atomic(CPUState *cpu, uintptr_t pc);
+void cpu_exec_step_atomic(CPUState *cpu);
 
 #if !defined(CONFIG_USER_ONLY)
 void cpu_reloading_memory_map(void);
@@ -113,6 +117,18 @@ void cpu_address_space_init(CPUState *cpu, AddressSpace *as, int asidx);
  */
 AddressSpace *cpu_get_address_space(CPUState *cpu, int asidx);
 /* cputlb.c */
+/**
+ * tlb_init:
+ * @cpu: CPU whose TLB should be initialized
+ *
+ * Allocate the TLB of @cpu when its size is not fixed at build time.
+ */
+void tlb_init(CPUState *cpu);
+/**
+ * tlb_destroy:
+ * @cpu: CPU whose TLB should be freed
+ */
+void tlb_destroy(CPUState *cpu);
 /**
  * tlb_flush_page:
  * @cpu: CPU whose TLB should be flushed
@@ -211,8 +227,8 @@ static inline void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+#define CODE_GEN_HTABLE_BITS     15
+#define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
 /* Estimated block size for TB allocation.  */
 /* ??? The following is based on a 2015 survey of x86_64 host output.
@@ -245,11 +261,13 @@ struct TranslationBlock {
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
 #define CF_IGNORE_ICOUNT 0x40000 /* Do not generate icount code */
+#define CF_TIER0       0x80000 /* Unoptimized, counts down to tier up */
+#define CF_TIER1       0x100000 /* Retranslation of a hot CF_TIER0 TB */
+#define CF_INVALID     0x200000 /* Removed by tb_phys_invalidate */
+#define CF_PARTIAL     0x400000 /* Truncated to the end of the icount budget */
 
     void *tc_ptr;    /* pointer to the translated code */
     uint8_t *tc_search;  /* pointer to search data */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* original tb when cflags has CF_NOCACHE */
     struct TranslationBlock *orig_tb;
     /* first and second physical page containing code. The lower bit
@@ -271,29 +289,53 @@ struct TranslationBlock {
        jmp_first */
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
+
+    /* Number of executions left before a CF_TIER0 TB is retranslated.  */
+    int32_t tier_countdown;
 };
 
 #include "qemu/thread.h"
+#include "qemu/qht.h"
 
 typedef struct TBContext TBContext;
 
+/* The code buffer is divided into regions, which are filled in turn.
+   When the last one is full, the oldest region is evicted and reused,
+   so that a full buffer does not require a full tb_flush.  */
+#define TB_REGIONS_MAX 8
+
+typedef struct TBRegion {
+    TranslationBlock *tbs;  /* descriptors of the TBs in this region */
+    int nb_tbs;
+    int max_tbs;
+    void *start;
+    void *end;
+    void *code_ptr;         /* end of the code, unless current region */
+} TBRegion;
+
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
-    int nb_tbs;
+    struct qht htable;
+    TBRegion regions[TB_REGIONS_MAX];
+    int nb_regions;         /* 0 until the first TB is allocated */
+    int cur_region;
+    size_t region_size;
     /* any access to the tbs or the page table must use this lock */
     QemuMutex tb_lock;
 
     /* statistics */
-    int tb_flush_count;
+    unsigned tb_flush_count;
+    unsigned tb_evict_count;
     int tb_phys_invalidate_count;
-
-    int tb_invalidated_flag;
+    unsigned tb_gen_count;
+    int64_t tb_gen_time;    /* in ns, spent in tb_gen_code */
+    unsigned tb_tier_up_count;
 };
 
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUState *cpu);
+void tb_evict(CPUState *cpu);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
 #if defined(USE_DIRECT_JUMP)
@@ -311,8 +353,9 @@ void ppc_tb_set_jmp_target(uintptr_t jmp_addr, uintptr_t addr);
 #elif defined(__i386__) || defined(__x86_64__)
 static inline void tb_set_jmp_target1(uintptr_t jmp_addr, uintptr_t addr)
 {
-    /* patch the branch destination */
-    stl_le_p((void*)jmp_addr, addr - (jmp_addr + 4));
+    /* patch the branch destination; the displacement is 4-byte aligned
+     * by tcg_out_op, so this store is atomic wrt. other vCPU threads */
+    atomic_set((int32_t *)jmp_addr, addr - (jmp_addr + 4));
     /* no need to flush icache explicitly */
 }
 #elif defined(__s390x__)
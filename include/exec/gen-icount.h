@@ -21,6 +21,20 @@ static inline void gen_tb_start(TranslationBlock *tb)
     tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
     tcg_temp_free_i32(flag);
 
+    if (tb->cflags & CF_TIER0) {
+        /* Once hot, leave before executing anything so that the
+           TB can be retranslated (see tb_tier_up).  */
+        TCGv_ptr ptr = tcg_const_ptr(&tb->tier_countdown);
+        TCGv_i32 n = tcg_temp_new_i32();
+
+        tcg_gen_ld_i32(n, ptr, 0);
+        tcg_gen_subi_i32(n, n, 1);
+        tcg_gen_st_i32(n, ptr, 0);
+        tcg_gen_brcondi_i32(TCG_COND_LT, n, 0, exitreq_label);
+        tcg_temp_free_i32(n);
+        tcg_temp_free_ptr(ptr);
+    }
+
     if (!(tb->cflags & CF_USE_ICOUNT)) {
         return;
     }
@@ -21,11 +21,18 @@
 
 #ifndef CONFIG_USER_ONLY
 typedef struct AddressSpaceDispatch AddressSpaceDispatch;
+typedef struct FlatView FlatView;
 
 void address_space_init_dispatch(AddressSpace *as);
 void address_space_unregister(AddressSpace *as);
 void address_space_destroy_dispatch(AddressSpace *as);
 
+/* The dispatch tree that the first address space to use @view built for it;
+ * address spaces with the same FlatView share it.
+ */
+AddressSpaceDispatch *flatview_get_dispatch(FlatView *view);
+void flatview_set_dispatch(FlatView *view, AddressSpaceDispatch *d);
+
 extern const MemoryRegionOps unassigned_mem_ops;
 
 bool memory_region_access_valid(MemoryRegion *mr, hwaddr addr,
@@ -221,10 +221,10 @@ struct MemoryListener {
                         bool match_data, uint64_t data, EventNotifier *e);
     void (*eventfd_del)(MemoryListener *listener, MemoryRegionSection *section,
                         bool match_data, uint64_t data, EventNotifier *e);
-    void (*coalesced_mmio_add)(MemoryListener *listener, MemoryRegionSection *section,
-                               hwaddr addr, hwaddr len);
-    void (*coalesced_mmio_del)(MemoryListener *listener, MemoryRegionSection *section,
-                               hwaddr addr, hwaddr len);
+    void (*coalesced_io_add)(MemoryListener *listener, MemoryRegionSection *section,
+                             hwaddr addr, hwaddr len);
+    void (*coalesced_io_del)(MemoryListener *listener, MemoryRegionSection *section,
+                             hwaddr addr, hwaddr len);
     /* Lower = earlier (during add), later (during del) */
     unsigned priority;
     AddressSpace *address_space_filter;
@@ -249,6 +249,8 @@ struct AddressSpace {
     struct MemoryRegionIoeventfd *ioeventfds;
     struct AddressSpaceDispatch *dispatch;
     struct AddressSpaceDispatch *next_dispatch;
+    /* The view that the listeners are being told about, during an update */
+    struct FlatView *next_map;
     MemoryListener dispatch_listener;
 
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
@@ -1326,6 +1328,21 @@ MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
                                       hwaddr *xlat, hwaddr *len,
                                       bool is_write);
 
+/* address_space_get_iotlb_entry: translate an address through the IOMMUs
+ * of an address space, and return the whole mapping that contains it.
+ * Should be called from an RCU critical section.
+ *
+ * The entry's @target_as is NULL if the access is not allowed.  If @as
+ * has no IOMMU, the entry maps the target page that contains @addr
+ * one-to-one.
+ *
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @is_write: indicates the transfer direction
+ */
+IOMMUTLBEntry address_space_get_iotlb_entry(AddressSpace *as, hwaddr addr,
+                                            bool is_write);
+
 /* address_space_access_valid: check for validity of accessing an address
  * space range
  *
@@ -1373,6 +1390,99 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/* MemoryRegionCache: a range of an address space, translated once
+ *
+ * Devices that access the same small area many times, such as a
+ * descriptor ring, translate it once with address_space_cache_init() and
+ * then access it with address_space_read_cached() and
+ * address_space_write_cached(), which are a memcpy when the whole range
+ * is RAM.  Otherwise they fall back to address_space_read() and
+ * address_space_write().
+ *
+ * The cache holds a reference to the memory region, so the host pointer
+ * stays valid until address_space_cache_destroy().  It does not follow
+ * changes of the memory map though: users that must, rebuild their caches
+ * from the commit hook of a #MemoryListener.
+ */
+typedef struct MemoryRegionCache {
+    uint8_t *ptr;
+    MemoryRegion *mr;
+    /* RAM address of @ptr */
+    ram_addr_t ram_addr;
+    AddressSpace *as;
+    hwaddr addr;
+    hwaddr len;
+    bool is_write;
+} MemoryRegionCache;
+
+/* address_space_cache_init: translate a range of an address space
+ *
+ * Returns true if the range is mapped directly to RAM.
+ *
+ * @cache: #MemoryRegionCache to be filled
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @len: length of the range
+ * @is_write: whether the range will be written to; the range is read from
+ * in any case
+ */
+bool address_space_cache_init(MemoryRegionCache *cache, AddressSpace *as,
+                              hwaddr addr, hwaddr len, bool is_write);
+
+/* address_space_cache_destroy: release the reference taken by
+ * address_space_cache_init()
+ *
+ * @cache: the #MemoryRegionCache
+ */
+void address_space_cache_destroy(MemoryRegionCache *cache);
+
+/* Internal functions, part of the implementation of the cached accessors */
+void address_space_cache_invalidate(MemoryRegionCache *cache, hwaddr addr,
+                                    hwaddr access_len);
+void address_space_read_cached_slow(MemoryRegionCache *cache, hwaddr addr,
+                                    void *buf, int len);
+void address_space_write_cached_slow(MemoryRegionCache *cache, hwaddr addr,
+                                     const void *buf, int len);
+
+/* address_space_read_cached: read from a cached range
+ *
+ * @cache: the #MemoryRegionCache
+ * @addr: offset within the range
+ * @buf: buffer with the data transferred
+ * @len: length of the data transferred
+ */
+static inline void address_space_read_cached(MemoryRegionCache *cache,
+                                             hwaddr addr, void *buf, int len)
+{
+    assert(addr < cache->len && len <= cache->len - addr);
+    if (likely(cache->ptr)) {
+        memcpy(buf, cache->ptr + addr, len);
+    } else {
+        address_space_read_cached_slow(cache, addr, buf, len);
+    }
+}
+
+/* address_space_write_cached: write to a cached range, which must have
+ * been initialized with @is_write
+ *
+ * @cache: the #MemoryRegionCache
+ * @addr: offset within the range
+ * @buf: buffer with the data transferred
+ * @len: length of the data transferred
+ */
+static inline void address_space_write_cached(MemoryRegionCache *cache,
+                                              hwaddr addr, const void *buf,
+                                              int len)
+{
+    assert(addr < cache->len && len <= cache->len - addr);
+    if (likely(cache->ptr)) {
+        memcpy(cache->ptr + addr, buf, len);
+        address_space_cache_invalidate(cache, addr, len);
+    } else {
+        address_space_write_cached_slow(cache, addr, buf, len);
+    }
+}
+
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
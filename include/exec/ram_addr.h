@@ -36,6 +36,16 @@ struct RAMBlock {
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
     int fd;
+    /* Where the block is in the file of an x-mapped-ram migration */
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
+    /* The pages of the block written to that file, non-zero ones only */
+    unsigned long *file_bmap;
+    /* Host pages not yet read from that file by an x-lazy-restore */
+    unsigned long *lazy_bmap;
+    /* Pages found dirty and pages sent by the last outgoing migration */
+    uint64_t mig_dirty_pages;
+    uint64_t mig_sent_pages;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -109,6 +119,9 @@ int qemu_get_ram_fd(ram_addr_t addr);
 void qemu_set_ram_fd(ram_addr_t addr, int fd);
 void *qemu_get_ram_block_host_ptr(ram_addr_t addr);
 void qemu_ram_free(RAMBlock *block);
+bool qemu_ram_is_shared(RAMBlock *rb);
+size_t qemu_ram_pagesize(RAMBlock *rb);
+int qemu_ram_discard_range(RAMBlock *rb, uint64_t start, size_t length);
 
 int qemu_ram_resize(ram_addr_t base, ram_addr_t newsize, Error **errp);
 
@@ -0,0 +1,65 @@
+/*
+ * Persistent translation cache for user-mode emulation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef TB_CACHE_H
+#define TB_CACHE_H
+
+extern bool tb_cache_active;
+
+/* Whether TBs with these cflags are loaded from and saved to the cache.  */
+static inline bool tb_cache_enabled(int cflags)
+{
+    return tb_cache_active && (cflags & ~CF_TIER1) == 0;
+}
+
+/**
+ * tb_cache_init:
+ * @dir: directory holding the cache files
+ * @exec_path: the guest executable, which selects the cache file
+ * @cpu_model: the guest CPU model, which the translation depends on
+ *
+ * Open the cache file for @exec_path, if any, and start recording the
+ * blocks translated in this run.  Must be called after the prologue
+ * has been generated.
+ */
+void tb_cache_init(const char *dir, const char *exec_path,
+                   const char *cpu_model);
+
+/**
+ * tb_cache_restore:
+ * @tb: the TB being translated, with pc, cs_base, flags and cflags set
+ * @buf: where the host code goes in code_gen_buffer
+ * @code_size: set to the size of the host code
+ * @search_size: set to the size of the search data following the code
+ *
+ * Look for a cached translation of @tb whose guest code matches the
+ * current guest memory.  If one is found, copy and relocate it to @buf,
+ * fill in the rest of @tb and return true.
+ */
+bool tb_cache_restore(TranslationBlock *tb, void *buf,
+                      int *code_size, int *search_size);
+
+/**
+ * tb_cache_record:
+ * @tb: a TB that has just been generated
+ * @code_size: the size of its host code
+ * @search_size: the size of its search data
+ *
+ * Queue @tb to be written out by tb_cache_save(), unless the backend
+ * could not make its code relocatable.
+ */
+void tb_cache_record(TranslationBlock *tb, int code_size, int search_size);
+
+/**
+ * tb_cache_save:
+ *
+ * Write the cache file back with the blocks recorded in this run added.
+ * Called when the process exits; the cache is disabled afterwards.
+ */
+void tb_cache_save(void);
+
+#endif
@@ -3,6 +3,10 @@
 
 #define HW_COMPAT_2_5 \
     {\
+        .driver   = "virtio-net-device",\
+        .property = "x-sw-gso",\
+        .value    = "off",\
+    },{\
         .driver   = "isa-fdc",\
         .property = "fallback",\
         .value    = "144",\
@@ -23,6 +27,14 @@
         .driver   = "vmxnet3",\
         .property = "x-disable-pcie",\
         .value    = "on",\
+    },{\
+        .driver   = "virtio-blk-device",\
+        .property = "discard",\
+        .value    = "off",\
+    },{\
+        .driver   = "virtio-blk-device",\
+        .property = "write-zeroes",\
+        .value    = "off",\
     },
 
 #define HW_COMPAT_2_4 \
@@ -40,6 +40,8 @@ void msi_uninit(struct PCIDevice *dev);
 void msi_reset(PCIDevice *dev);
 void msi_notify(PCIDevice *dev, unsigned int vector);
 void msi_send_message(PCIDevice *dev, MSIMessage msg);
+bool msi_irqfd_send(PCIDevice *dev, unsigned int vector, MSIMessage msg);
+void msi_irqfd_release(PCIDevice *dev);
 void msi_write_config(PCIDevice *dev, uint32_t addr, uint32_t val, int len);
 unsigned int msi_nr_vectors_allocated(const PCIDevice *dev);
 
@@ -307,6 +307,11 @@ struct PCIDevice {
     MSIVectorUseNotifier msix_vector_use_notifier;
     MSIVectorReleaseNotifier msix_vector_release_notifier;
     MSIVectorPollNotifier msix_vector_poll_notifier;
+
+    /* KVM routes and irqfds for MSI and MSI-X vectors, see msi_irqfd_send */
+    struct PCIMSIIrqfd *msi_irqfd;
+    unsigned msi_irqfd_nr;
+    bool msi_irqfd_failed;
 };
 
 void pci_register_bar(PCIDevice *pci_dev, int region_num,
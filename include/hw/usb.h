@@ -451,6 +451,7 @@ void usb_ep_set_max_packet_size(USBDevice *dev, int pid, int ep,
                                 uint16_t raw);
 void usb_ep_set_max_streams(USBDevice *dev, int pid, int ep, uint8_t raw);
 void usb_ep_set_halted(USBDevice *dev, int pid, int ep, bool halted);
+void usb_ep_set_pipeline(USBDevice *dev, int pid, int ep, bool enabled);
 USBPacket *usb_ep_find_packet_by_id(USBDevice *dev, int pid, int ep,
                                     uint64_t id);
 
@@ -25,6 +25,7 @@
 #include "exec/memory.h"
 #include "qemu/queue.h"
 #include "qemu/notify.h"
+#include "sysemu/sysemu.h"
 #ifdef CONFIG_LINUX
 #include <linux/vfio.h>
 #endif
@@ -69,6 +70,15 @@ typedef struct VFIOAddressSpace {
 
 struct VFIOGroup;
 
+/* A mapping of guest RAM in the host IOMMU */
+typedef struct VFIODMARange {
+    hwaddr iova;
+    hwaddr size;
+    void *vaddr;
+    bool readonly;
+    QLIST_ENTRY(VFIODMARange) next;
+} VFIODMARange;
+
 typedef struct VFIOContainer {
     VFIOAddressSpace *space;
     int fd; /* /dev/vfio/vfio, empowered by the attached groups */
@@ -82,6 +92,15 @@ typedef struct VFIOContainer {
      */
     hwaddr min_iova, max_iova;
     uint64_t iova_pgsizes;
+    /* RAM added in the current memory transaction, of VFIODMARange */
+    GArray *pending;
+    QLIST_HEAD(, VFIODMARange) dma_list;
+    /* bytes mapped on behalf of a guest IOMMU */
+    uint64_t giommu_mapped;
+    /* a migration tracks the pages that the devices write to */
+    bool dirty_log;
+    bool dirty_pages_started;
+    Notifier dirty_sync_notify;
     QLIST_HEAD(, VFIOGuestIOMMU) giommu_list;
     QLIST_HEAD(, VFIOGroup) group_list;
     QLIST_ENTRY(VFIOContainer) next;
@@ -96,6 +115,16 @@ typedef struct VFIOGuestIOMMU {
 
 typedef struct VFIODeviceOps VFIODeviceOps;
 
+typedef struct VFIOMigration {
+    struct VFIODevice *vbasedev;
+    DeviceState *dev;
+    VMChangeStateEntry *vm_state;
+    Notifier migration_state;
+    VFIORegion region;
+    uint32_t device_state;
+    uint64_t pending_bytes;
+} VFIOMigration;
+
 typedef struct VFIODevice {
     QLIST_ENTRY(VFIODevice) next;
     struct VFIOGroup *group;
@@ -110,6 +139,8 @@ typedef struct VFIODevice {
     unsigned int num_irqs;
     unsigned int num_regions;
     unsigned int flags;
+    VFIOMigration *migration;
+    Error *migration_blocker;
 } VFIODevice;
 
 struct VFIODeviceOps {
@@ -154,5 +185,9 @@ extern QLIST_HEAD(vfio_as_head, VFIOAddressSpace) vfio_address_spaces;
 #ifdef CONFIG_LINUX
 int vfio_get_region_info(VFIODevice *vbasedev, int index,
                          struct vfio_region_info **info);
+int vfio_get_dev_region_info(VFIODevice *vbasedev, uint32_t type,
+                             uint32_t subtype, struct vfio_region_info **info);
+bool vfio_migration_probe(VFIODevice *vbasedev, Object *obj);
+void vfio_migration_finalize(VFIODevice *vbasedev);
 #endif
 #endif /* !HW_VFIO_VFIO_COMMON_H */
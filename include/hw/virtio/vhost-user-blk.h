@@ -0,0 +1,34 @@
+/*
+ * vhost-user-blk host device
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef VHOST_USER_BLK_H
+#define VHOST_USER_BLK_H
+
+#include "standard-headers/linux/virtio_blk.h"
+#include "qemu-common.h"
+#include "hw/qdev.h"
+#include "hw/virtio/vhost.h"
+#include "hw/virtio/vhost-user.h"
+
+#define TYPE_VHOST_USER_BLK "vhost-user-blk"
+#define VHOST_USER_BLK(obj) \
+        OBJECT_CHECK(VHostUserBlk, (obj), TYPE_VHOST_USER_BLK)
+
+typedef struct VHostUserBlk {
+    VirtIODevice parent_obj;
+    CharDriverState *chardev;
+    uint16_t num_queues;
+    uint32_t queue_size;
+    /* Read from the backend at realize time */
+    struct virtio_blk_config blkcfg;
+    VhostUserConn *conn;
+    struct vhost_dev dev;
+    Error *migration_blocker;
+} VHostUserBlk;
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * vhost-user-fs host device
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef VHOST_USER_FS_H
+#define VHOST_USER_FS_H
+
+#include "standard-headers/linux/virtio_fs.h"
+#include "qemu-common.h"
+#include "hw/qdev.h"
+#include "hw/virtio/vhost.h"
+#include "hw/virtio/vhost-user.h"
+
+#define TYPE_VHOST_USER_FS "vhost-user-fs-device"
+#define VHOST_USER_FS(obj) \
+        OBJECT_CHECK(VHostUserFS, (obj), TYPE_VHOST_USER_FS)
+
+typedef struct VHostUserFS {
+    VirtIODevice parent_obj;
+    CharDriverState *chardev;
+    char *tag;
+    uint16_t num_request_queues;
+    uint32_t queue_size;
+    /* Size of the DAX window, 0 if the guest must not map files */
+    uint64_t cache_size;
+    /* The window, an inaccessible mapping where the backend maps files */
+    void *cache_ptr;
+    MemoryRegion cache;
+    VhostUserConn *conn;
+    struct vhost_dev dev;
+    Error *migration_blocker;
+} VHostUserFS;
+
+#endif
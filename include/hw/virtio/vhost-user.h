@@ -0,0 +1,98 @@
+/*
+ * vhost-user connection state
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_VIRTIO_VHOST_USER_H
+#define HW_VIRTIO_VHOST_USER_H
+
+#include "sysemu/char.h"
+
+/* Shared memory where the backend tracks the descriptors it is processing */
+typedef struct VhostUserInflightRegion {
+    int fd;
+    void *addr;
+    uint64_t size;
+    uint64_t offset;
+    uint16_t queue_size;
+} VhostUserInflightRegion;
+
+/*
+ * A vhost-user-fs backend asks for file ranges to be mapped into, or
+ * removed from, the DAX window with up to VHOST_USER_FS_SLAVE_ENTRIES
+ * ranges per message.  Unused entries have a zero length.
+ */
+#define VHOST_USER_FS_SLAVE_ENTRIES 8
+#define VHOST_USER_FS_FLAG_MAP_R (1ULL << 0)
+#define VHOST_USER_FS_FLAG_MAP_W (1ULL << 1)
+
+typedef struct VhostUserFSSlaveMsg {
+    /* VHOST_USER_FS_FLAG_* */
+    uint64_t flags[VHOST_USER_FS_SLAVE_ENTRIES];
+    /* Offset into the file */
+    uint64_t fd_offset[VHOST_USER_FS_SLAVE_ENTRIES];
+    /* Offset into the DAX window */
+    uint64_t c_offset[VHOST_USER_FS_SLAVE_ENTRIES];
+    uint64_t len[VHOST_USER_FS_SLAVE_ENTRIES];
+} VhostUserFSSlaveMsg;
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+struct vhost_dev;
+
+/*
+ * One connection to a backend, shared by the vhost devices of all the queue
+ * pairs of a netdev.  It is the opaque of the vhost devices, and is owned
+ * by the netdev.
+ */
+typedef struct VhostUserConn {
+    CharDriverState *chr;
+    /* Number of virtqueues, for all the queue pairs */
+    int nvqs;
+    /*
+     * What the backend reported to the first queue pair; cleared when the
+     * backend disconnects, so that it is asked again after reconnecting.
+     */
+    bool probed;
+    uint64_t features;
+    uint64_t protocol_features;
+    uint64_t max_queues;
+    /*
+     * With VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS, the regions that the
+     * backend has mapped, so that only the changes are sent to it.
+     */
+    uint64_t max_mem_slots;
+    VhostUserMemoryRegion *mem_regions;
+    unsigned int mem_nregions;
+    /* Survives reconnections, so that a new backend can resume */
+    VhostUserInflightRegion inflight;
+    /* Where the backend sends requests of its own, or -1 */
+    int slave_fd;
+    /*
+     * Set by devices with a DAX window; they return 0 or a negative
+     * errno, which is sent back to the backend.  The fd is only valid
+     * during the call.
+     */
+    int (*fs_map)(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm, int fd);
+    int (*fs_unmap)(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm);
+} VhostUserConn;
+
+static inline void vhost_user_inflight_free(VhostUserInflightRegion *inflight)
+{
+    if (inflight->addr) {
+        munmap(inflight->addr, inflight->size);
+        close(inflight->fd);
+        inflight->addr = NULL;
+        inflight->fd = -1;
+    }
+}
+
+#endif
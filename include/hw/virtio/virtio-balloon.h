@@ -31,9 +31,30 @@ typedef struct virtio_balloon_stat_modern {
        uint64_t val;
 } VirtIOBalloonStatModern;
 
+/* Commands ids of free page hinting, STOP and DONE are below */
+#define VIRTIO_BALLOON_FREE_PAGE_REPORT_CMD_ID_MIN 0x80000000
+
+enum virtio_balloon_free_page_report_status {
+    FREE_PAGE_REPORT_S_STOP = 0,
+    /* A new command id was given to the guest */
+    FREE_PAGE_REPORT_S_REQUESTED = 1,
+    /* The guest started reporting its free pages for that id */
+    FREE_PAGE_REPORT_S_START = 2,
+    /* The migration ended, the guest may use its free pages again */
+    FREE_PAGE_REPORT_S_DONE = 3,
+};
+
+/* The host page that the guest is ballooning piecewise */
+typedef struct PartiallyBalloonedPage {
+    RAMBlock *rb;
+    ram_addr_t base;
+    /* one bit per balloon page, NULL when no page is tracked */
+    unsigned long *bitmap;
+} PartiallyBalloonedPage;
+
 typedef struct VirtIOBalloon {
     VirtIODevice parent_obj;
-    VirtQueue *ivq, *dvq, *svq;
+    VirtQueue *ivq, *dvq, *svq, *free_page_vq, *reporting_vq;
     uint32_t num_pages;
     uint32_t actual;
     uint64_t stats[VIRTIO_BALLOON_S_NR];
@@ -43,6 +64,10 @@ typedef struct VirtIOBalloon {
     int64_t stats_last_update;
     int64_t stats_poll_interval;
     uint32_t host_features;
+    uint32_t free_page_report_cmd_id;
+    uint32_t free_page_report_status;
+    Notifier free_page_report_notify;
+    PartiallyBalloonedPage pbp;
 } VirtIOBalloon;
 
 #endif
@@ -70,6 +70,11 @@ typedef struct VirtioBusClass {
      */
     void (*device_unplugged)(DeviceState *d);
     int (*query_nvectors)(DeviceState *d);
+    /*
+     * The address space of the transport's DMA, which goes through the
+     * platform IOMMU, if any.  Used when VIRTIO_F_IOMMU_PLATFORM is on.
+     */
+    AddressSpace *(*get_dma_as)(DeviceState *d);
     /*
      * Does the transport have variable vring alignment?
      * (ie can it ever call virtio_queue_set_align()?)
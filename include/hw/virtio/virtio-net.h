@@ -30,16 +30,66 @@
  * and latency. */
 #define TX_BURST 256
 
+/* Number of TX requests popped from the virtqueue at once */
+#define VIRTIO_NET_TX_BATCH 32
+
+/*
+ * Notification coalescing, like ethtool's rx-usecs and rx-frames: a
+ * notification is delayed by at most usecs, and is sent as soon as frames
+ * buffers are used.  usecs == 0 disables coalescing, frames == 0 means
+ * that there is no limit on the number of buffers.
+ */
+typedef struct VirtIONetCoalParams {
+    uint32_t usecs;
+    uint32_t frames;
+} VirtIONetCoalParams;
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    VirtIONetCoalParams rx_coal;
+    VirtIONetCoalParams tx_coal;
+    /* Offer TSO and checksum offload with backends that lack vnet_hdr */
+    bool sw_gso;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 << 10))
 
+/* Limits of the RSS configuration that the guest can program */
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
+
+/* Receive-side scaling and hash reporting, as programmed by the guest */
+typedef struct VirtIONetRss {
+    /* Steer packets to the receive queue that their hash selects */
+    bool redirect;
+    /* Report the hash in the vnet header (VIRTIO_NET_F_HASH_REPORT) */
+    bool populate_hash;
+    /* VIRTIO_NET_RSS_HASH_TYPE_* */
+    uint32_t hash_types;
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    /* A power of 2 */
+    uint16_t indirections_len;
+    uint16_t *indirections_table;
+    /* For packets that have none of the hash types */
+    uint16_t default_queue;
+} VirtIONetRss;
+
+/* Coalescing state of one virtqueue */
+typedef struct VirtIONetCoal {
+    VirtQueue *vq;
+    const VirtIONetCoalParams *params;
+    QEMUTimer *timer;
+    /* Buffers used since the last notification */
+    uint32_t pending;
+    /* When the last notification was sent, in QEMU_CLOCK_VIRTUAL ns */
+    int64_t last;
+    struct VirtIONet *n;
+} VirtIONetCoal;
+
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
@@ -49,6 +99,10 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    /* RX entries filled but not yet flushed, within a batch */
+    unsigned int rx_pending;
+    VirtIONetCoal rx_coal;
+    VirtIONetCoal tx_coal;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -64,7 +118,7 @@ typedef struct VirtIONet {
     uint32_t has_vnet_hdr;
     size_t host_hdr_len;
     size_t guest_hdr_len;
-    uint32_t host_features;
+    uint64_t host_features;
     uint8_t has_ufo;
     int mergeable_rx_bufs;
     uint8_t promisc;
@@ -95,6 +149,16 @@ typedef struct VirtIONet {
     QEMUTimer *announce_timer;
     int announce_counter;
     bool needs_vnet_hdr_swap;
+    /* The net_conf ones, until the guest changes them */
+    VirtIONetCoalParams rx_coal;
+    VirtIONetCoalParams tx_coal;
+    VirtIONetRss rss;
+    /* Failover: the device passed through while this one is on standby */
+    DeviceListener primary_listener;
+    Notifier migration_state;
+    QemuOpts *primary_opts;
+    DeviceState *primary_dev;
+    bool primary_pending;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -45,6 +45,8 @@ typedef struct VirtIORNG {
     QEMUTimer *rate_limit_timer;
     int64_t quota_remaining;
     bool activate_timer;
+    /* A backend request is in flight, guest kicks need not add another */
+    bool request_pending;
 } VirtIORNG;
 
 #endif
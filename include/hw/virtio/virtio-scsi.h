@@ -53,9 +53,23 @@ struct VirtIOSCSIConf {
     char *wwpn;
     uint32_t boot_tpgt;
     IOThread *iothread;
+    char *iothreads;
 };
 
 struct VirtIOSCSI;
+struct VirtIOSCSIReq;
+
+/* One of the AioContexts that command queues and LUNs are spread over.
+ * Requests popped from a command queue in another context are handed
+ * over through @reqs and run by @bh in the context of their LUN.
+ */
+typedef struct VirtIOSCSIContext {
+    struct VirtIOSCSI *s;
+    AioContext *ctx;
+    QEMUBH *bh;
+    QemuMutex lock;
+    QTAILQ_HEAD(, VirtIOSCSIReq) reqs;
+} VirtIOSCSIContext;
 
 typedef struct VirtIOSCSICommon {
     VirtIODevice parent_obj;
@@ -82,8 +96,14 @@ typedef struct VirtIOSCSI {
     int resetting;
     bool events_dropped;
 
+    /* Serializes each virtqueue between the contexts that pop and push */
+    QemuMutex *vq_locks;
+
     /* Fields for dataplane below */
-    AioContext *ctx; /* one iothread per virtio-scsi-pci for now */
+    AioContext *ctx; /* control and event queues */
+    VirtIOSCSIContext *ctxs; /* command queues and LUNs */
+    uint32_t num_ctxs;
+    uint32_t next_lun_ctx;
 
     QTAILQ_HEAD(, VirtIOSCSIBlkChangeNotifier) insert_notifiers;
     QTAILQ_HEAD(, VirtIOSCSIBlkChangeNotifier) remove_notifiers;
@@ -148,7 +168,14 @@ void virtio_scsi_free_req(VirtIOSCSIReq *req);
 void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
                             uint32_t event, uint32_t reason);
 
+void virtio_scsi_run_forwarded(void *opaque);
+
 void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread);
+void virtio_scsi_set_iothreads(VirtIOSCSI *s, Error **errp);
+void virtio_scsi_clear_iothreads(VirtIOSCSI *s);
+AioContext *virtio_scsi_vq_ctx(VirtIOSCSI *s, VirtQueue *vq);
+AioContext *virtio_scsi_next_lun_ctx(VirtIOSCSI *s);
+VirtIOSCSIContext *virtio_scsi_find_ctx(VirtIOSCSI *s, AioContext *ctx);
 void virtio_scsi_dataplane_start(VirtIOSCSI *s);
 void virtio_scsi_dataplane_stop(VirtIOSCSI *s);
 void virtio_scsi_dataplane_notify(VirtIODevice *vdev, VirtIOSCSIReq *req);
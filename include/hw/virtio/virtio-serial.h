@@ -78,6 +78,13 @@ typedef struct VirtIOSerialPortClass {
      */
     ssize_t (*have_data)(VirtIOSerialPort *port, const uint8_t *buf,
                          ssize_t len);
+
+    /*
+     * Optional: like have_data, for the data of several elements at
+     * once.  If set, it is used instead of have_data.
+     */
+    ssize_t (*have_datav)(VirtIOSerialPort *port, const struct iovec *iov,
+                          int iovcnt);
 } VirtIOSerialPortClass;
 
 /*
@@ -48,6 +48,9 @@ struct QIOChannelTLS {
     QIOChannel parent;
     QIOChannel *master;
     QCryptoTLSSession *session;
+    /* Directions whose records are handled by the kernel of the master */
+    bool ktls_tx;
+    bool ktls_rx;
 };
 
 /**
@@ -61,6 +61,9 @@ struct QIOChannelWebsock {
     Buffer rawinput;
     Buffer rawoutput;
     size_t payload_remain;
+    /* Bytes at the start of rawoutput that belong to the frame whose
+     * header is in encoutput */
+    size_t payload_out;
     QIOChannelWebsockMask mask;
     guint io_tag;
     Error *io_err;
@@ -42,8 +42,11 @@ typedef enum QIOChannelFeature QIOChannelFeature;
 enum QIOChannelFeature {
     QIO_CHANNEL_FEATURE_FD_PASS  = (1 << 0),
     QIO_CHANNEL_FEATURE_SHUTDOWN = (1 << 1),
+    QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY = (1 << 2),
 };
 
+#define QIO_CHANNEL_WRITE_FLAG_ZERO_COPY 0x1
+
 
 typedef enum QIOChannelShutdown QIOChannelShutdown;
 
@@ -57,6 +60,21 @@ typedef gboolean (*QIOChannelFunc)(QIOChannel *ioc,
                                    GIOCondition condition,
                                    gpointer data);
 
+/**
+ * QIOChannelMsg:
+ * @iov: the array of memory regions of the message
+ * @niov: the length of the @iov array
+ * @len: filled with the number of bytes transferred
+ *
+ * One element of a batch for qio_channel_readv_batch()
+ * and qio_channel_writev_batch().
+ */
+typedef struct QIOChannelMsg {
+    struct iovec *iov;
+    size_t niov;
+    size_t len;
+} QIOChannelMsg;
+
 /**
  * QIOChannel:
  *
@@ -103,6 +121,7 @@ struct QIOChannelClass {
                          size_t niov,
                          int *fds,
                          size_t nfds,
+                         int flags,
                          Error **errp);
     ssize_t (*io_readv)(QIOChannel *ioc,
                         const struct iovec *iov,
@@ -130,6 +149,8 @@ struct QIOChannelClass {
                      off_t offset,
                      int whence,
                      Error **errp);
+    int (*io_flush)(QIOChannel *ioc,
+                    Error **errp);
 };
 
 /* General I/O handling functions */
@@ -234,6 +255,110 @@ ssize_t qio_channel_writev_full(QIOChannel *ioc,
                                 size_t nfds,
                                 Error **errp);
 
+/**
+ * qio_channel_writev_full_flags:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to write data from
+ * @niov: the length of the @iov array
+ * @fds: an array of file handles to send
+ * @nfds: number of file handles in @fds
+ * @flags: write flags (QIO_CHANNEL_WRITE_FLAG_*)
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Behaves as qio_channel_writev_full() but accepts @flags.
+ *
+ * If @flags contains QIO_CHANNEL_WRITE_FLAG_ZERO_COPY, the
+ * channel sends the data straight from the memory regions in
+ * @iov instead of copying it.  The caller then must not
+ * modify or free them until qio_channel_flush() returns.
+ * It is an error to pass this flag unless
+ * qio_channel_has_feature() returns a true value for the
+ * QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY constant.
+ *
+ * Returns: the number of bytes sent, or -1 on error,
+ * or QIO_CHANNEL_ERR_BLOCK if no data is can be sent
+ * and the channel is non-blocking
+ */
+ssize_t qio_channel_writev_full_flags(QIOChannel *ioc,
+                                      const struct iovec *iov,
+                                      size_t niov,
+                                      int *fds,
+                                      size_t nfds,
+                                      int flags,
+                                      Error **errp);
+
+/**
+ * qio_channel_readv_batch:
+ * @ioc: the channel object
+ * @msgs: the array of messages to read data into
+ * @nmsgs: the length of the @msgs array
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Read data from the IO channel into the memory regions
+ * of all the messages in @msgs, in order, with a single
+ * call to the channel implementation (a single recvmsg()
+ * for sockets).  At most IOV_MAX memory regions are used
+ * in total.  The @len field of each message is updated with the
+ * number of bytes stored in it; the messages after the
+ * first one that is not completely filled have @len 0.
+ *
+ * As with qio_channel_readv_full(), it is not required
+ * for all messages to be filled with data.
+ *
+ * Returns: the total number of bytes read, or -1 on error,
+ * or QIO_CHANNEL_ERR_BLOCK if no data is available
+ * and the channel is non-blocking
+ */
+ssize_t qio_channel_readv_batch(QIOChannel *ioc,
+                                QIOChannelMsg *msgs,
+                                size_t nmsgs,
+                                Error **errp);
+
+/**
+ * qio_channel_writev_batch:
+ * @ioc: the channel object
+ * @msgs: the array of messages to write data from
+ * @nmsgs: the length of the @msgs array
+ * @flags: write flags (QIO_CHANNEL_WRITE_FLAG_*)
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Write the memory regions of all the messages in @msgs
+ * to the IO channel, in order, with a single call to the
+ * channel implementation (a single sendmsg() for sockets).
+ * At most IOV_MAX memory regions are used in total.  The @len
+ * field of each message is updated with the number of
+ * bytes sent from it.  @flags has the same meaning as
+ * for qio_channel_writev_full_flags().
+ *
+ * As with qio_channel_writev_full(), it is not required
+ * for all messages to be fully sent.
+ *
+ * Returns: the total number of bytes sent, or -1 on error,
+ * or QIO_CHANNEL_ERR_BLOCK if no data is can be sent
+ * and the channel is non-blocking
+ */
+ssize_t qio_channel_writev_batch(QIOChannel *ioc,
+                                 QIOChannelMsg *msgs,
+                                 size_t nmsgs,
+                                 int flags,
+                                 Error **errp);
+
+/**
+ * qio_channel_flush:
+ * @ioc: the channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Wait until all the data written with the flag
+ * QIO_CHANNEL_WRITE_FLAG_ZERO_COPY has been sent, so
+ * that the caller can reuse the memory it came from.
+ * This is a no-op for channels that never take
+ * ownership of the caller's memory.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int qio_channel_flush(QIOChannel *ioc,
+                      Error **errp);
+
 /**
  * qio_channel_readv:
  * @ioc: the channel object
@@ -0,0 +1,32 @@
+/*
+ * Background snapshots: write-protection of RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_BACKGROUND_SNAPSHOT_H
+#define QEMU_BACKGROUND_SNAPSHOT_H
+
+/* Return true if the host can write-protect RAM for background snapshots */
+bool background_snapshot_supported_by_host(void);
+
+/*
+ * Populate all of RAM, since only the pages that are present can be
+ * write-protected.  Called with the VM running, before it is stopped.
+ */
+void background_snapshot_prepare(void);
+
+/*
+ * Write-protect all of RAM; a write to a page that is not saved yet
+ * queues it on @ms and waits until background_snapshot_unprotect().
+ */
+int background_snapshot_protect(MigrationState *ms);
+
+/* Allow writes to a page once it is saved */
+void background_snapshot_unprotect(void *host, size_t length);
+
+/* Remove the write-protection of all RAM */
+void background_snapshot_cleanup(void);
+
+#endif
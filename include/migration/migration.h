@@ -91,6 +91,8 @@ struct MigrationIncomingState {
     bool           have_fault_thread;
     QemuThread     fault_thread;
     QemuSemaphore  fault_thread_sem;
+    /* Faults are served from the file rather than requested from the source */
+    bool           lazy_restore;
 
     bool           have_listen_thread;
     QemuThread     listen_thread;
@@ -169,8 +171,17 @@ struct MigrationState
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(src_page_requests, MigrationSrcPageRequest) src_page_requests;
+    /* Pages around the requested ones, sent after them */
+    struct src_page_requests src_page_prefetch;
     /* The RAMBlock used in the last src_page_request */
     RAMBlock *last_req_rb;
+
+    /* Destination of the additional x-multifd connections */
+    char *multifd_host_port;
+    /* Connection carrying requested pages during postcopy */
+    QEMUFile *postcopy_preempt_file;
+    /* Device state of a background snapshot, written after RAM */
+    QEMUFile *background_snapshot_devices;
 };
 
 void migrate_set_state(int *state, int old_state, int new_state);
@@ -189,6 +200,14 @@ void tcp_start_incoming_migration(const char *host_port, Error **errp);
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp);
 
+int tcp_multifd_channel_connect(MigrationState *s, Error **errp);
+
+bool tcp_zerocopy_supported(void);
+int tcp_zerocopy_enable(int fd, Error **errp);
+ssize_t tcp_zerocopy_writev(int fd, struct iovec *iov, unsigned int iovcnt,
+                            uint64_t *pending);
+int tcp_zerocopy_flush(int fd, uint64_t *pending, bool block);
+
 void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
@@ -197,6 +216,17 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *path, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp);
+
+int file_pages_start(QEMUFile *f, bool write);
+void file_pages_queue(void *host, size_t len, off_t offset);
+int file_pages_flush(void);
+void file_pages_stop(void);
+int file_pages_open(void);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
@@ -209,6 +239,19 @@ int migrate_fd_close(MigrationState *s);
 
 void add_migration_state_change_notifier(Notifier *notify);
 void remove_migration_state_change_notifier(Notifier *notify);
+
+typedef enum PrecopyNotifyReason {
+    PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC,
+    PRECOPY_NOTIFY_AFTER_BITMAP_SYNC,
+    /* The last sync is done, with the VM stopped */
+    PRECOPY_NOTIFY_COMPLETE,
+    /* The migration ended, successfully or not */
+    PRECOPY_NOTIFY_CLEANUP,
+} PrecopyNotifyReason;
+
+void precopy_add_notifier(Notifier *n);
+void precopy_remove_notifier(Notifier *n);
+void qemu_guest_free_page_hint(void *addr, size_t len);
 MigrationState *migrate_init(const MigrationParams *params);
 bool migration_in_setup(MigrationState *);
 bool migration_has_finished(MigrationState *);
@@ -223,9 +266,21 @@ void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+int migrate_multifd_send_threads_create(MigrationState *s);
+void migrate_multifd_send_threads_shutdown(void);
+void migrate_multifd_send_threads_join(void);
+void migrate_multifd_recv_threads_create(void);
+int migrate_multifd_recv_new_channel(int fd);
+bool migrate_multifd_recv_has_all_channels(void);
+void migrate_multifd_recv_threads_join(void);
+int migrate_postcopy_preempt_channel_create(MigrationState *s);
+int migrate_postcopy_preempt_new_channel(int fd);
+bool migrate_postcopy_preempt_recv_pending(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+MigrationIterationStatsList *ram_get_iteration_stats(void);
+RamBlockMigrationStatsList *ram_get_block_stats(void);
 void free_xbzrle_decoded_buf(void);
 
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
@@ -250,6 +305,11 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
                       uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
+void ram_postcopy_preempt_recv_start(MigrationIncomingState *mis);
+void ram_postcopy_preempt_recv_cleanup(MigrationIncomingState *mis);
+int ram_lazy_restore_fault(MigrationIncomingState *mis, RAMBlock *rb,
+                           ram_addr_t offset);
+bool ram_lazy_restore_keep_mis(void);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -266,6 +326,7 @@ void migrate_add_blocker(Error *reason);
 void migrate_del_blocker(Error *reason);
 
 bool migrate_postcopy_ram(void);
+bool migrate_postcopy_preempt(void);
 bool migrate_zero_blocks(void);
 
 bool migrate_auto_converge(void);
@@ -280,9 +341,19 @@ int64_t migrate_xbzrle_cache_size(void);
 int64_t xbzrle_cache_resize(int64_t new_size);
 
 bool migrate_use_compression(void);
+bool migrate_use_compression_zstd(void);
 int migrate_compress_level(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
+bool migrate_use_multifd(void);
+bool migrate_use_zero_copy_send(void);
+bool migrate_mapped_ram(void);
+bool migrate_use_direct_io(void);
+bool migrate_lazy_restore(void);
+bool migrate_background_snapshot(void);
+bool migrate_dirty_bitmaps(void);
+bool migrate_ignore_shared(void);
+int migrate_multifd_channels(void);
 bool migrate_use_events(void);
 
 /* Sending on the return path - generic and then for each message type */
@@ -22,6 +22,11 @@ bool postcopy_ram_supported_by_host(void);
  */
 int postcopy_ram_enable_notify(MigrationIncomingState *mis);
 
+/*
+ * Stop the fault thread and the notifications of postcopy_ram_enable_notify.
+ */
+int postcopy_ram_disable_notify(MigrationIncomingState *mis);
+
 /*
  * Initialise postcopy-ram, setting the RAM to a state where we can go into
  * postcopy later; must be called prior to any precopy.
@@ -211,6 +211,11 @@ struct VMStateDescription {
     int (*post_load)(void *opaque, int version_id);
     void (*pre_save)(void *opaque);
     bool (*needed)(void *opaque);
+    /*
+     * Set for devices that are hot-unplugged before migration instead of
+     * being migrated; returns true until the guest has let go of them.
+     */
+    bool (*dev_unplug_pending)(void *opaque);
     VMStateField *fields;
     const VMStateDescription **subsections;
 };
@@ -12,6 +12,7 @@ void hmp_info_qom_tree(Monitor *mon, const QDict *dict);
 void qmp_device_add(QDict *qdict, QObject **ret_data, Error **errp);
 
 int qdev_device_help(QemuOpts *opts);
+/* Returns NULL without setting @errp if the device is hidden */
 DeviceState *qdev_device_add(QemuOpts *opts, Error **errp);
 
 #endif
@@ -344,4 +344,8 @@ eth_parse_ipv6_hdr(struct iovec *pkt, int pkt_frags,
                    size_t ip6hdr_off, uint8_t *l4proto,
                    size_t *full_hdr_len);
 
+uint32_t
+eth_toeplitz_hash(const uint8_t *key, size_t key_len,
+                  const uint8_t *input, size_t input_len);
+
 #endif
@@ -0,0 +1,29 @@
+/*
+ * Software segmentation offload
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_NET_GSO_H
+#define QEMU_NET_GSO_H
+
+#include "net/net.h"
+#include "standard-headers/linux/virtio_net.h"
+
+/*
+ * Send a packet whose offloads are described by the virtio-net header
+ * @hdr, in host byte order, to a backend that cannot take the header:
+ * TCP super-packets are cut into gso_size segments and partial checksums
+ * are completed before the packets are sent from @nc.
+ *
+ * Returns like qemu_sendv_packet_async() does for the last segment, which
+ * is the only one that @sent_cb is called for.  Packets that cannot be
+ * segmented are dropped, and reported as sent.
+ */
+ssize_t net_gso_sendv_packet_async(NetClientState *nc,
+                                   const struct virtio_net_hdr *hdr,
+                                   const struct iovec *iov, int iovcnt,
+                                   NetPacketSent *sent_cb);
+
+#endif
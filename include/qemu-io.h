@@ -38,12 +38,30 @@ typedef struct cmdinfo {
     helpfunc_t  help;
 } cmdinfo_t;
 
+typedef struct QemuIOBenchParams {
+    int depth;              /* requests in flight */
+    int64_t bufsize;        /* bytes per request, a multiple of 512 */
+    int64_t offset;         /* start of the area to benchmark */
+    bool random;            /* random instead of sequential offsets */
+    int write_pct;          /* percentage of requests that are writes */
+    int64_t duration_ns;
+    bool iothread;          /* submit requests from a separate thread */
+    bool csv;               /* print results in machine-readable form */
+} QemuIOBenchParams;
+
+#define QEMUIO_BENCH_PARAMS_DEFAULT {                   \
+    .depth = 1,                                         \
+    .bufsize = 4096,                                    \
+    .duration_ns = 10 * NANOSECONDS_PER_SECOND,         \
+}
+
 extern bool qemuio_misalign;
 
 bool qemuio_command(BlockBackend *blk, const char *cmd);
 
 void qemuio_add_command(const cmdinfo_t *ci);
 int qemuio_command_usage(const cmdinfo_t *ci);
+int qemuio_bench(BlockBackend *blk, const QemuIOBenchParams *params);
 void qemuio_complete_command(const char *input,
                              void (*fn)(const char *cmd, void *opaque),
                              void *opaque);
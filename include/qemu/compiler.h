@@ -17,6 +17,8 @@
 
 #define QEMU_NORETURN __attribute__ ((__noreturn__))
 
+#define QEMU_ALIGNED(X) __attribute__((aligned(X)))
+
 #if QEMU_GNUC_PREREQ(3, 4)
 #define QEMU_WARN_UNUSED_RESULT __attribute__((warn_unused_result))
 #else
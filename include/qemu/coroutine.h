@@ -95,6 +95,20 @@ Coroutine *coroutine_fn qemu_coroutine_self(void);
  */
 bool qemu_in_coroutine(void);
 
+/**
+ * Make the coroutine pool bigger by @additional_pool_size coroutines
+ *
+ * Devices call this with the number of requests they can have in flight,
+ * so that their coroutines are reused instead of being allocated and
+ * freed all the time.
+ */
+void qemu_coroutine_increase_pool_batch_size(unsigned int additional_pool_size);
+
+/**
+ * Undo qemu_coroutine_increase_pool_batch_size()
+ */
+void qemu_coroutine_decrease_pool_batch_size(unsigned int removing_pool_size);
+
 
 
 /**
@@ -0,0 +1,98 @@
+/*
+ * Run-time detection of host x86 CPU features
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_CPUID_H
+#define QEMU_CPUID_H
+
+#if !defined(__i386__) && !defined(__x86_64__)
+#error "cpuid.h is only usable on x86 hosts"
+#endif
+
+#include <cpuid.h>
+
+/* Older versions of cpuid.h lack some of the bits */
+#ifndef bit_SSE4_2
+#define bit_SSE4_2  (1 << 20)
+#endif
+#ifndef bit_AES
+#define bit_AES     (1 << 25)
+#endif
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE (1 << 27)
+#endif
+#ifndef bit_AVX
+#define bit_AVX     (1 << 28)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2    (1 << 5)
+#endif
+#ifndef bit_AVX512F
+#define bit_AVX512F (1 << 16)
+#endif
+
+/* XCR0 bits that the OS sets if it saves the corresponding registers */
+#define XCR0_AVX    0x06    /* XMM, YMM */
+#define XCR0_AVX512 0xe6    /* XMM, YMM, opmask, ZMM_Hi256, Hi16_ZMM */
+
+static inline int host_cpuid_ecx(void)
+{
+    int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 1) {
+        return 0;
+    }
+    __cpuid(1, a, b, c, d);
+    return c;
+}
+
+static inline int host_cpuid7_ebx(void)
+{
+    int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return 0;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return b;
+}
+
+/* Returns the low bits of XCR0, or 0 if AVX state is not usable at all */
+static inline int host_xcr0(void)
+{
+    int c = host_cpuid_ecx();
+    int a, d;
+
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return 0;
+    }
+    asm("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return a;
+}
+
+static inline bool host_has_sse4_2(void)
+{
+    return host_cpuid_ecx() & bit_SSE4_2;
+}
+
+static inline bool host_has_aes(void)
+{
+    return host_cpuid_ecx() & bit_AES;
+}
+
+static inline bool host_has_avx2(void)
+{
+    return (host_xcr0() & XCR0_AVX) == XCR0_AVX &&
+           (host_cpuid7_ebx() & bit_AVX2);
+}
+
+static inline bool host_has_avx512f(void)
+{
+    return (host_xcr0() & XCR0_AVX512) == XCR0_AVX512 &&
+           (host_cpuid7_ebx() & bit_AVX512F);
+}
+
+#endif
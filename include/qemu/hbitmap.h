@@ -145,6 +145,116 @@ void hbitmap_reset_all(HBitmap *hb);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_next_zero:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to look at.
+ * @end: Bit after the last one to look at.
+ *
+ * Return the first bit in [@start, @end) that is not set, or -1 if all of
+ * them are set.  The search proceeds one word at a time.
+ */
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t end);
+
+/**
+ * hbitmap_next_dirty_area:
+ * @hb: HBitmap to operate on.
+ * @start: In input, the first bit to look at; in output, the first bit of
+ *         the area that was found.
+ * @end: Bit after the last one to look at.
+ * @count: In input, the maximum length of the area; in output, its length.
+ *
+ * Find the next range of consecutive set bits in [@start, @end).
+ *
+ * Return whether an area was found.
+ */
+bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
+                             uint64_t end, uint64_t *count);
+
+/**
+ * hbitmap_serialization_granularity:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the granularity, in elements, of the ranges that can be passed to
+ * the serialization functions.  Ranges must start at a multiple of it, and
+ * their length must be a multiple of it unless they extend to the end of
+ * the bitmap.
+ */
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb);
+
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ * @start: First element of the range.
+ * @count: Number of elements in the range.
+ *
+ * Return the number of bytes hbitmap_serialize_part() needs for the range.
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_serialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer to store the serialized bits in.
+ * @start: First element of the range.
+ * @count: Number of elements in the range.
+ *
+ * Store the bits for the range in @buf, one bit per granularity-sized group
+ * of elements, in little-endian bit and byte order.
+ */
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer with bits stored by hbitmap_serialize_part().
+ * @start: First element of the range.
+ * @count: Number of elements in the range.
+ * @finish: Whether to call hbitmap_deserialize_finish() afterwards.
+ *
+ * Load the bits for the range from @buf.  Only the bottom level of the
+ * bitmap is updated, so the bitmap must not be used until
+ * hbitmap_deserialize_finish() has been called.
+ */
+void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
+                              uint64_t start, uint64_t count,
+                              bool finish);
+
+/**
+ * hbitmap_deserialize_zeroes:
+ * @hb: HBitmap to operate on.
+ * @start: First element of the range.
+ * @count: Number of elements in the range.
+ * @finish: Whether to call hbitmap_deserialize_finish() afterwards.
+ *
+ * Like hbitmap_deserialize_part(), for a range with all bits clear.
+ */
+void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
+                                bool finish);
+
+/**
+ * hbitmap_deserialize_ones:
+ * @hb: HBitmap to operate on.
+ * @start: First element of the range.
+ * @count: Number of elements in the range.
+ * @finish: Whether to call hbitmap_deserialize_finish() afterwards.
+ *
+ * Like hbitmap_deserialize_part(), for a range with all bits set.
+ */
+void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
+                              bool finish);
+
+/**
+ * hbitmap_deserialize_finish:
+ * @hb: HBitmap to operate on.
+ *
+ * Rebuild the upper levels and the bit count of the bitmap after its bottom
+ * level has been loaded with the hbitmap_deserialize_* functions.
+ */
+void hbitmap_deserialize_finish(HBitmap *hb);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
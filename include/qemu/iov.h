@@ -83,6 +83,14 @@ iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
 size_t iov_memset(const struct iovec *iov, const unsigned int iov_cnt,
                   size_t offset, int fillc, size_t bytes);
 
+/*
+ * Checks whether the `bytes' bytes of the iovec starting at byte offset
+ * `offset' are all zero.  As with iov_memset, it is okay to use a large
+ * value for `bytes' to mean "up to the end".
+ */
+bool iov_is_zero(const struct iovec *iov, const unsigned int iov_cnt,
+                 size_t offset, size_t bytes);
+
 /*
  * Send/recv data from/to iovec buffers directly
  *
@@ -197,13 +197,22 @@ typedef int IOCanReadHandler(void *opaque);
  * during one.
  *
  * @opaque: A pointer-sized value that is passed to @fd_read and @fd_write.
+ *
+ * The names of @fd_read and @fd_write are used for dispatch time
+ * accounting; qemu_set_fd_handler_full lets the caller pass them.
  */
-void qemu_set_fd_handler(int fd,
-                         IOHandler *fd_read,
-                         IOHandler *fd_write,
-                         void *opaque);
+void qemu_set_fd_handler_full(int fd,
+                              IOHandler *fd_read,
+                              IOHandler *fd_write,
+                              void *opaque,
+                              const char *read_name,
+                              const char *write_name);
+#define qemu_set_fd_handler(fd, fd_read, fd_write, opaque)             \
+    qemu_set_fd_handler_full((fd), (fd_read), (fd_write), (opaque),    \
+                             stringify(fd_read), stringify(fd_write))
 
 GSource *iohandler_get_g_source(void);
+AioContext *iohandler_get_aio_context(void);
 #ifdef CONFIG_POSIX
 /**
  * qemu_add_child_watch: Register a child process for reaping.
@@ -267,7 +276,9 @@ void qemu_mutex_unlock_iothread(void);
 
 void qemu_fd_register(int fd);
 
-QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque);
+QEMUBH *qemu_bh_new_full(QEMUBHFunc *cb, void *opaque, const char *name);
+#define qemu_bh_new(cb, opaque) \
+    qemu_bh_new_full((cb), (opaque), stringify(cb))
 void qemu_bh_schedule_idle(QEMUBH *bh);
 
 #endif
@@ -158,6 +158,32 @@ void *qemu_anon_ram_alloc(size_t size, uint64_t *align);
 void qemu_vfree(void *ptr);
 void qemu_anon_ram_free(void *ptr, size_t size);
 
+/**
+ * qemu_alloc_stack:
+ * @sz: pointer to a size_t holding the requested usable stack size
+ *
+ * Allocate memory that can be used as a stack, for instance for
+ * coroutines.  The memory is only committed when it is touched, and an
+ * inaccessible guard page below the stack turns overflows into a fault.
+ * If the memory cannot be allocated, this function aborts like
+ * g_malloc().
+ *
+ * On return, *sz is the size of the allocation including the guard page,
+ * which is what qemu_free_stack() expects.
+ *
+ * Returns: pointer to (the lowest address of) the stack memory.
+ */
+void *qemu_alloc_stack(size_t *sz);
+
+/**
+ * qemu_free_stack:
+ * @stack: stack to free
+ * @sz: size of stack in bytes, as returned by qemu_alloc_stack()
+ *
+ * Free a stack allocated via qemu_alloc_stack().
+ */
+void qemu_free_stack(void *stack, size_t sz);
+
 #define QEMU_MADV_INVALID -1
 
 #if defined(CONFIG_MADVISE)
@@ -320,7 +346,11 @@ unsigned long qemu_getauxval(unsigned long type);
 
 void qemu_set_tty_echo(int fd, bool echo);
 
-void os_mem_prealloc(int fd, char *area, size_t sz);
+/*
+ * Touch every page of @area, which is backed by @fd, from up to
+ * @max_threads threads; exits if the host runs out of memory.
+ */
+void os_mem_prealloc(int fd, char *area, size_t sz, int max_threads);
 
 int qemu_read_password(char *buf, int buf_size);
 
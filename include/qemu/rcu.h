@@ -118,6 +118,13 @@ struct rcu_head {
 
 extern void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
 
+/*
+ * Start a grace period for the callbacks queued so far without waiting
+ * for more of them to pile up.  Useful after an update that frees large
+ * data structures, such as a memory topology change.
+ */
+extern void call_rcu_expedite(void);
+
 /* The operands of the minus operator must have the same type,
  * which must be the one that we specify in the cast.
  */
@@ -0,0 +1,47 @@
+/*
+ * Userspace drivers for PCI devices assigned with VFIO
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_VFIO_HELPERS_H
+#define QEMU_VFIO_HELPERS_H
+
+#include "qemu/event_notifier.h"
+
+typedef struct QEMUVFIOState QEMUVFIOState;
+
+/*
+ * Bind the PCI device @device (e.g. "0000:01:00.0") to a new VFIO
+ * container, and enable bus mastering.  The device must already be bound
+ * to the vfio-pci kernel driver.
+ */
+QEMUVFIOState *qemu_vfio_open_pci(const char *device, Error **errp);
+void qemu_vfio_close(QEMUVFIOState *s);
+
+/*
+ * Make [@host, @host + @size) accessible to the device, and return its
+ * I/O virtual address in @iova.  @host and @size must be page aligned.
+ *
+ * Memory that is already covered by a permanent mapping is not mapped
+ * again.  Otherwise, a @temporary mapping stays until the next call to
+ * qemu_vfio_dma_reset_temporary, and a permanent one until
+ * qemu_vfio_dma_unmap.  Returns -ENOMEM when the IOVA space is exhausted;
+ * resetting the temporary mappings then frees some of it.
+ */
+int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
+                      bool temporary, uint64_t *iova);
+int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s);
+void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host);
+
+void *qemu_vfio_pci_map_bar(QEMUVFIOState *s, int index,
+                            uint64_t offset, uint64_t size, Error **errp);
+void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
+                             uint64_t offset, uint64_t size);
+
+/* Signal @e when the first vector of interrupt @irq_type fires */
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
+                           int irq_type, Error **errp);
+
+#endif
@@ -220,6 +220,8 @@ struct CPUWatchpoint {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
+struct KVMVcpuStats;
 
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
@@ -263,8 +265,13 @@ struct kvm_run;
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @kvm_dirty_gfns: Dirty ring of the vCPU, if KVM dirty ring is in use.
+ * @kvm_fetch_index: Index of the next dirty ring entry to collect.
+ * @kvm_stats: Exit and halt polling statistics of the vCPU for KVM.
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
+ * @pending_tlb_flush: A full TLB flush requested by another vCPU is
+ *                     queued and has not run yet.
  *
  * State of one CPU core or thread.
  */
@@ -298,6 +305,7 @@ struct CPUState {
 
     QemuMutex work_mutex;
     struct qemu_work_item *queued_work_first, *queued_work_last;
+    bool pending_tlb_flush;
 
     CPUAddressSpace *cpu_ases;
     int num_ases;
@@ -330,6 +338,9 @@ struct CPUState {
     bool kvm_vcpu_dirty;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
+    struct KVMVcpuStats *kvm_stats;
 
     /* TODO Move common fields from CPUArchState here. */
     int cpu_index; /* used by alpha TCG */
@@ -345,6 +356,15 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    int throttle_percentage;
+
+    /* Pages dirtied by this vcpu, and the rate in bytes per second at which
+     * it dirtied them recently.  Only maintained by accelerators that can
+     * attribute dirty pages to vcpus, see kvm_dirty_ring_enabled().
+     */
+    uint64_t dirty_pages;
+    uint64_t dirty_pages_prev;
+    uint64_t dirty_rate;
 
     /* Note that this is accessed at the start of every TB via a negative
        offset from AREG0.  Leave this field at the end so as to make the
@@ -365,6 +385,15 @@ extern struct CPUTailQ cpus;
 
 extern __thread CPUState *current_cpu;
 
+/**
+ * qemu_tcg_mttcg_enabled:
+ * Check whether we are running MultiThread TCG or not.
+ *
+ * Returns: %true if we are in MTTCG mode %false otherwise.
+ */
+extern bool mttcg_enabled;
+#define qemu_tcg_mttcg_enabled() (mttcg_enabled)
+
 /**
  * cpu_paging_enabled:
  * @cpu: The CPU whose state is to be inspected.
@@ -613,6 +642,20 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
  */
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * async_safe_run_on_cpu:
+ * @cpu: The vCPU to run on.
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution on the vCPU @cpu asynchronously,
+ * at a point where no other TCG vCPU is executing guest code.  This makes
+ * it safe to modify state that other vCPUs use from generated code, such
+ * as the translation buffer.
+ */
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data);
+
 /**
  * qemu_get_cpu:
  * @index: The CPUState@cpu_index value of the CPU to obtain.
@@ -650,7 +693,8 @@ void cpu_throttle_set(int new_throttle_pct);
 /**
  * cpu_throttle_stop:
  *
- * Stops the vcpu throttling started by cpu_throttle_set.
+ * Stops the vcpu throttling started by cpu_throttle_set and
+ * cpu_throttle_set_vcpu.
  */
 void cpu_throttle_stop(void);
 
@@ -661,6 +705,26 @@ void cpu_throttle_stop(void);
  */
 bool cpu_throttle_active(void);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vCPU to throttle.
+ * @new_throttle_pct: Percent of sleep time. Valid range is 1 to 99.
+ *
+ * Like cpu_throttle_set, but throttles only @cpu.  If all vcpus are
+ * throttled too, @cpu sleeps for the higher of the two percentages.  The
+ * throttling remains in effect until cpu_throttle_stop is called.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
+/**
+ * cpu_throttle_get_vcpu_percentage:
+ * @cpu: The vCPU to query.
+ *
+ * Returns: The throttle percentage set for @cpu with cpu_throttle_set_vcpu,
+ * or 0 if @cpu is not throttled by itself.
+ */
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu);
+
 /**
  * cpu_throttle_get_percentage:
  *
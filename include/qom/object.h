@@ -379,6 +379,8 @@ struct ObjectClass
     ObjectUnparent *unparent;
 
     GHashTable *properties;
+    GHashTable *properties_cache;
+    unsigned int properties_cache_gen;
 };
 
 /**
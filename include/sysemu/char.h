@@ -57,6 +57,8 @@ struct CharDriverState {
     QemuMutex chr_write_lock;
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    int (*chr_writev)(struct CharDriverState *s, const struct iovec *iov,
+                      int iovcnt);
     int (*chr_sync_read)(struct CharDriverState *s,
                          const uint8_t *buf, int len);
     GSource *(*chr_add_watch)(struct CharDriverState *s, GIOCondition cond);
@@ -85,6 +87,7 @@ struct CharDriverState {
     int avail_connections;
     int is_mux;
     guint fd_in_tag;
+    GMainContext *context;  /* where input is read, NULL for the main loop */
     QemuOpts *opts;
     bool replay;
     QTAILQ_ENTRY(CharDriverState) next;
@@ -226,6 +229,21 @@ int qemu_chr_fe_add_watch(CharDriverState *s, GIOCondition cond,
  */
 int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_writev:
+ *
+ * Write data from several buffers to a character backend, like
+ * @qemu_chr_fe_write.  Backends that support it send all the buffers
+ * with a single system call.  This function is thread-safe.
+ *
+ * @iov the buffers
+ * @iovcnt the number of buffers
+ *
+ * Returns: the number of bytes consumed
+ */
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov,
+                       int iovcnt);
+
 /**
  * @qemu_chr_fe_write_all:
  *
@@ -377,6 +395,18 @@ void qemu_chr_be_write_impl(CharDriverState *s, uint8_t *buf, int len);
  */
 void qemu_chr_be_event(CharDriverState *s, int event);
 
+/**
+ * @qemu_chr_fe_set_context:
+ *
+ * Read the input of the backend from @context instead of the main loop.
+ * Must be called before qemu_chr_add_handlers(); the handlers are then
+ * called from the thread that runs @context.  Backends that do not read
+ * from a file descriptor keep calling them from the main loop.
+ *
+ * @context the GMainContext to use, or NULL for the main loop
+ */
+void qemu_chr_fe_set_context(CharDriverState *s, GMainContext *context);
+
 void qemu_chr_add_handlers(CharDriverState *s,
                            IOCanReadHandler *fd_can_read,
                            IOReadHandler *fd_read,
@@ -53,8 +53,9 @@ struct HostMemoryBackend {
 
     /* protected */
     uint64_t size;
-    bool merge, dump;
+    bool merge, dump, hugepages;
     bool prealloc, force_prealloc;
+    uint32_t prealloc_threads;
     DECLARE_BITMAP(host_nodes, MAX_NODES + 1);
     HostMemPolicy policy;
 
@@ -64,4 +65,9 @@ struct HostMemoryBackend {
 MemoryRegion *host_memory_backend_get_memory(HostMemoryBackend *backend,
                                              Error **errp);
 
+/* How much of the backend's memory is resident, shared and merged, or
+ * NULL if the host cannot tell.
+ */
+MemdevUsage *host_memory_backend_get_usage(HostMemoryBackend *backend);
+
 #endif
@@ -15,9 +15,14 @@ struct numa_addr_range {
     QLIST_ENTRY(numa_addr_range) entry;
 };
 
+#define MAX_HOST_CPUS 1024
+
 typedef struct node_info {
     uint64_t node_mem;
     DECLARE_BITMAP(node_cpu, MAX_CPUMASK_BITS);
+    /* Host CPUs that run the node's vCPUs and IOThreads, if has_host_cpus */
+    DECLARE_BITMAP(host_cpus, MAX_HOST_CPUS);
+    bool has_host_cpus;
     struct HostMemoryBackend *node_memdev;
     bool present;
     QLIST_HEAD(, numa_addr_range) addr; /* List to store address ranges */
@@ -31,5 +36,7 @@ extern QemuOptsList qemu_numa_opts;
 void numa_set_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node);
 void numa_unset_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node);
 uint32_t numa_get_node(ram_addr_t addr, Error **errp);
+void numa_bind_thread(QemuThread *thread, int node);
+intList *numa_query_thread_host_cpus(QemuThread *thread);
 
 #endif
@@ -52,6 +52,9 @@ void replay_start(void);
 void replay_finish(void);
 /*! Adds replay blocker with the specified error description */
 void replay_add_blocker(Error *reason);
+/*! Creates the initial snapshot in record mode or loads it in replay
+    mode, and starts the timer for periodic snapshots. */
+void replay_vmstate_init(void);
 
 /* Processing the instructions */
 
@@ -0,0 +1,36 @@
+/*
+ * Statistics providers and subscriptions
+ *
+ * Copyright (c) 2016 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef SYSEMU_STATS_H
+#define SYSEMU_STATS_H
+
+#include "qemu-common.h"
+
+typedef struct StatsSampler StatsSampler;
+
+/*
+ * A provider reports the current value of each of its counters with
+ * stats_add().  It is called from the main loop with the BQL held, and
+ * should read counters in place rather than stop or kick vCPUs or
+ * I/O threads; readers may see slightly old values.
+ */
+typedef void StatsProviderFunc(StatsSampler *s, void *opaque);
+
+/*
+ * Register a provider for the counters named "@name.*".  @name must be
+ * a constant string.
+ */
+void stats_register_provider(const char *name, StatsProviderFunc *fn,
+                             void *opaque);
+
+/* Report counter "<provider>.<fmt...>" with value @value */
+void stats_add(StatsSampler *s, uint64_t value, const char *fmt, ...)
+    GCC_FMT_ATTR(3, 4);
+
+#endif
@@ -28,6 +28,8 @@
 /* in ms */
 #define GUI_REFRESH_INTERVAL_DEFAULT    30
 #define GUI_REFRESH_INTERVAL_IDLE     3000
+/* Listener does not need refreshes at all, e.g. nobody is watching */
+#define GUI_REFRESH_INTERVAL_OFF      UINT64_MAX
 
 /* Color number is match to standard vga palette */
 enum qemu_color_names {
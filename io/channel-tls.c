@@ -20,6 +20,7 @@
 
 #include "qemu/osdep.h"
 #include "io/channel-tls.h"
+#include "io/channel-socket.h"
 #include "trace.h"
 
 
@@ -144,6 +145,24 @@ static gboolean qio_channel_tls_handshake_io(QIOChannel *ioc,
                                              GIOCondition condition,
                                              gpointer user_data);
 
+/* Let the kernel run the record layer when the master is a socket, so
+ * that bulk data is encrypted and decrypted without copies through
+ * gnutls.
+ */
+static void qio_channel_tls_enable_ktls(QIOChannelTLS *ioc)
+{
+    QIOChannelSocket *sioc;
+
+    if (!object_dynamic_cast(OBJECT(ioc->master), TYPE_QIO_CHANNEL_SOCKET)) {
+        return;
+    }
+    sioc = QIO_CHANNEL_SOCKET(ioc->master);
+
+    qcrypto_tls_session_enable_ktls(ioc->session, sioc->fd,
+                                    &ioc->ktls_tx, &ioc->ktls_rx);
+    trace_qio_channel_tls_ktls(ioc, ioc->ktls_tx, ioc->ktls_rx);
+}
+
 static void qio_channel_tls_handshake_task(QIOChannelTLS *ioc,
                                            QIOTask *task)
 {
@@ -166,6 +185,7 @@ static void qio_channel_tls_handshake_task(QIOChannelTLS *ioc,
             goto cleanup;
         }
         trace_qio_channel_tls_credentials_allow(ioc);
+        qio_channel_tls_enable_ktls(ioc);
         qio_task_complete(task);
     } else {
         GIOCondition condition;
@@ -244,6 +264,11 @@ static ssize_t qio_channel_tls_readv(QIOChannel *ioc,
     size_t i;
     ssize_t got = 0;
 
+    if (tioc->ktls_rx) {
+        /* Alert records, e.g. close_notify, fail the read with EIO */
+        return qio_channel_readv(tioc->master, iov, niov, errp);
+    }
+
     for (i = 0 ; i < niov ; i++) {
         ssize_t ret = qcrypto_tls_session_read(tioc->session,
                                                iov[i].iov_base,
@@ -275,12 +300,17 @@ static ssize_t qio_channel_tls_writev(QIOChannel *ioc,
                                       size_t niov,
                                       int *fds,
                                       size_t nfds,
+                                      int flags,
                                       Error **errp)
 {
     QIOChannelTLS *tioc = QIO_CHANNEL_TLS(ioc);
     size_t i;
     ssize_t done = 0;
 
+    if (tioc->ktls_tx) {
+        return qio_channel_writev(tioc->master, iov, niov, errp);
+    }
+
     for (i = 0 ; i < niov ; i++) {
         ssize_t ret = qcrypto_tls_session_write(tioc->session,
                                                 iov[i].iov_base,
@@ -21,8 +21,14 @@
 #include "qemu/osdep.h"
 #include "io/channel-websock.h"
 #include "crypto/hash.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
 #include "trace.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 /* Max amount to allow in rawinput/rawoutput buffers */
 #define QIO_CHANNEL_WEBSOCK_MAX_BUFFER 8192
@@ -327,42 +333,82 @@ static gboolean qio_channel_websock_handshake_io(QIOChannel *ioc,
 }
 
 
-static void qio_channel_websock_encode(QIOChannelWebsock *ioc)
+typedef union QIOChannelWebsockFrameHeader {
+    char buf[QIO_CHANNEL_WEBSOCK_HEADER_LEN_64_BIT];
+    QIOChannelWebsockHeader ws;
+} QIOChannelWebsockFrameHeader;
+
+/* Fill in the header of an unmasked frame carrying @payload_len bytes,
+ * returning its length.
+ */
+static size_t qio_channel_websock_encode_header(
+    QIOChannelWebsockFrameHeader *header, size_t payload_len)
 {
     size_t header_size;
-    union {
-        char buf[QIO_CHANNEL_WEBSOCK_HEADER_LEN_64_BIT];
-        QIOChannelWebsockHeader ws;
-    } header;
-
-    if (!ioc->rawoutput.offset) {
-        return;
-    }
 
-    header.ws.b0 = (1 << QIO_CHANNEL_WEBSOCK_HEADER_SHIFT_FIN) |
+    header->ws.b0 = (1 << QIO_CHANNEL_WEBSOCK_HEADER_SHIFT_FIN) |
         (QIO_CHANNEL_WEBSOCK_OPCODE_BINARY_FRAME &
          QIO_CHANNEL_WEBSOCK_HEADER_FIELD_OPCODE);
-    if (ioc->rawoutput.offset <
-        QIO_CHANNEL_WEBSOCK_PAYLOAD_LEN_THRESHOLD_7_BIT) {
-        header.ws.b1 = (uint8_t)ioc->rawoutput.offset;
+    if (payload_len < QIO_CHANNEL_WEBSOCK_PAYLOAD_LEN_THRESHOLD_7_BIT) {
+        header->ws.b1 = (uint8_t)payload_len;
         header_size = QIO_CHANNEL_WEBSOCK_HEADER_LEN_7_BIT;
-    } else if (ioc->rawoutput.offset <
+    } else if (payload_len <
                QIO_CHANNEL_WEBSOCK_PAYLOAD_LEN_THRESHOLD_16_BIT) {
-        header.ws.b1 = QIO_CHANNEL_WEBSOCK_PAYLOAD_LEN_MAGIC_16_BIT;
-        header.ws.u.s16.l16 = cpu_to_be16((uint16_t)ioc->rawoutput.offset);
+        header->ws.b1 = QIO_CHANNEL_WEBSOCK_PAYLOAD_LEN_MAGIC_16_BIT;
+        header->ws.u.s16.l16 = cpu_to_be16((uint16_t)payload_len);
         header_size = QIO_CHANNEL_WEBSOCK_HEADER_LEN_16_BIT;
     } else {
-        header.ws.b1 = QIO_CHANNEL_WEBSOCK_PAYLOAD_LEN_MAGIC_64_BIT;
-        header.ws.u.s64.l64 = cpu_to_be64(ioc->rawoutput.offset);
+        header->ws.b1 = QIO_CHANNEL_WEBSOCK_PAYLOAD_LEN_MAGIC_64_BIT;
+        header->ws.u.s64.l64 = cpu_to_be64(payload_len);
         header_size = QIO_CHANNEL_WEBSOCK_HEADER_LEN_64_BIT;
     }
-    header_size -= QIO_CHANNEL_WEBSOCK_HEADER_LEN_MASK;
+    return header_size - QIO_CHANNEL_WEBSOCK_HEADER_LEN_MASK;
+}
+
+
+/* Start a frame for everything in rawoutput.  Only the header is
+ * copied to encoutput; the payload is sent straight from rawoutput.
+ */
+static void qio_channel_websock_encode(QIOChannelWebsock *ioc)
+{
+    QIOChannelWebsockFrameHeader header;
+    size_t header_size;
 
-    buffer_reserve(&ioc->encoutput, header_size + ioc->rawoutput.offset);
+    if (!ioc->rawoutput.offset) {
+        return;
+    }
+
+    header_size = qio_channel_websock_encode_header(&header,
+                                                    ioc->rawoutput.offset);
+    buffer_reserve(&ioc->encoutput, header_size);
     buffer_append(&ioc->encoutput, header.buf, header_size);
-    buffer_append(&ioc->encoutput, ioc->rawoutput.buffer,
-                  ioc->rawoutput.offset);
-    buffer_reset(&ioc->rawoutput);
+    ioc->payload_out = ioc->rawoutput.offset;
+}
+
+
+/* XOR @len bytes from @src with the frame mask into @dst */
+static void qio_channel_websock_unmask(uint8_t *dst, const uint8_t *src,
+                                       size_t len,
+                                       QIOChannelWebsockMask mask)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128i mask128 = _mm_set1_epi32(mask.u);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(v, mask128));
+    }
+#else
+    uint64_t mask64 = ((uint64_t)mask.u << 32) | mask.u;
+
+    for (; i + 8 <= len; i += 8) {
+        stq_he_p(dst + i, ldq_he_p(src + i) ^ mask64);
+    }
+#endif
+    for (; i < len; i++) {
+        dst[i] = src[i] ^ mask.c[i % 4];
+    }
 }
 
 
@@ -443,9 +489,7 @@ static ssize_t qio_channel_websock_decode_header(QIOChannelWebsock *ioc,
 static ssize_t qio_channel_websock_decode_payload(QIOChannelWebsock *ioc,
                                                   Error **errp)
 {
-    size_t i;
     size_t payload_len;
-    uint32_t *payload32;
 
     if (!ioc->payload_remain) {
         error_setg(errp,
@@ -468,19 +512,12 @@ static ssize_t qio_channel_websock_decode_payload(QIOChannelWebsock *ioc,
 
     ioc->payload_remain -= payload_len;
 
-    /* unmask frame */
-    /* process 1 frame (32 bit op) */
-    payload32 = (uint32_t *)ioc->encinput.buffer;
-    for (i = 0; i < payload_len / 4; i++) {
-        payload32[i] ^= ioc->mask.u;
-    }
-    /* process the remaining bytes (if any) */
-    for (i *= 4; i < payload_len; i++) {
-        ioc->encinput.buffer[i] ^= ioc->mask.c[i % 4];
-    }
-
+    /* unmask while copying the payload out of the frame */
     buffer_reserve(&ioc->rawinput, payload_len);
-    buffer_append(&ioc->rawinput, ioc->encinput.buffer, payload_len);
+    qio_channel_websock_unmask(buffer_end(&ioc->rawinput),
+                               ioc->encinput.buffer, payload_len,
+                               ioc->mask);
+    ioc->rawinput.offset += payload_len;
     buffer_advance(&ioc->encinput, payload_len);
     return payload_len;
 }
@@ -587,18 +624,38 @@ static ssize_t qio_channel_websock_read_wire(QIOChannelWebsock *ioc,
 }
 
 
+/* Account for @ret bytes of the pending frame having been sent */
+static void qio_channel_websock_advance(QIOChannelWebsock *ioc, size_t ret)
+{
+    size_t hdr = MIN(ret, ioc->encoutput.offset);
+
+    buffer_advance(&ioc->encoutput, hdr);
+    buffer_advance(&ioc->rawoutput, ret - hdr);
+    ioc->payload_out -= ret - hdr;
+}
+
+
 static ssize_t qio_channel_websock_write_wire(QIOChannelWebsock *ioc,
                                               Error **errp)
 {
     ssize_t ret;
     ssize_t done = 0;
-    qio_channel_websock_encode(ioc);
+    struct iovec iov[2];
 
-    while (ioc->encoutput.offset > 0) {
-        ret = qio_channel_write(ioc->master,
-                                (char *)ioc->encoutput.buffer,
-                                ioc->encoutput.offset,
-                                errp);
+    for (;;) {
+        if (!ioc->encoutput.offset && !ioc->payload_out) {
+            if (!ioc->rawoutput.offset) {
+                break;
+            }
+            qio_channel_websock_encode(ioc);
+        }
+
+        /* header and payload go out together, without joining them */
+        iov[0].iov_base = ioc->encoutput.buffer;
+        iov[0].iov_len = ioc->encoutput.offset;
+        iov[1].iov_base = ioc->rawoutput.buffer;
+        iov[1].iov_len = ioc->payload_out;
+        ret = qio_channel_writev(ioc->master, iov, 2, errp);
         if (ret < 0) {
             if (ret == QIO_CHANNEL_ERR_BLOCK &&
                 done > 0) {
@@ -607,13 +664,58 @@ static ssize_t qio_channel_websock_write_wire(QIOChannelWebsock *ioc,
                 return ret;
             }
         }
-        buffer_advance(&ioc->encoutput, ret);
+        qio_channel_websock_advance(ioc, ret);
         done += ret;
     }
     return done;
 }
 
 
+/* With nothing queued, send a frame for up to @len bytes of @iov straight
+ * from the caller's memory.  Whatever the master does not take is copied
+ * to encoutput and rawoutput as the pending frame.
+ */
+static ssize_t qio_channel_websock_write_direct(QIOChannelWebsock *ioc,
+                                                const struct iovec *iov,
+                                                size_t niov,
+                                                size_t len,
+                                                Error **errp)
+{
+    QIOChannelWebsockFrameHeader header;
+    size_t header_size = qio_channel_websock_encode_header(&header, len);
+    struct iovec *wiov = g_new(struct iovec, niov + 1);
+    size_t wniov;
+    ssize_t ret;
+
+    wiov[0].iov_base = header.buf;
+    wiov[0].iov_len = header_size;
+    wniov = 1 + iov_copy(wiov + 1, niov, iov, niov, 0, len);
+
+    ret = qio_channel_writev(ioc->master, wiov, wniov, errp);
+    g_free(wiov);
+    if (ret == QIO_CHANNEL_ERR_BLOCK) {
+        ret = 0;
+    } else if (ret < 0) {
+        return ret;
+    }
+
+    if (ret < header_size) {
+        buffer_reserve(&ioc->encoutput, header_size - ret);
+        buffer_append(&ioc->encoutput, header.buf + ret, header_size - ret);
+        ret = 0;
+    } else {
+        ret -= header_size;
+    }
+    if (ret < len) {
+        buffer_reserve(&ioc->rawoutput, len - ret);
+        iov_to_buf(iov, niov, ret, buffer_end(&ioc->rawoutput), len - ret);
+        ioc->rawoutput.offset += len - ret;
+        ioc->payload_out = len - ret;
+    }
+    return len;
+}
+
+
 static void qio_channel_websock_flush_free(gpointer user_data)
 {
     QIOChannelWebsock *wioc = QIO_CHANNEL_WEBSOCK(user_data);
@@ -670,7 +772,7 @@ static void qio_channel_websock_set_watch(QIOChannelWebsock *ioc)
         return;
     }
 
-    if (ioc->encoutput.offset) {
+    if (ioc->encoutput.offset || ioc->rawoutput.offset) {
         cond |= G_IO_OUT;
     }
     if (ioc->encinput.offset < QIO_CHANNEL_WEBSOCK_MAX_BUFFER &&
@@ -741,6 +843,7 @@ static ssize_t qio_channel_websock_writev(QIOChannel *ioc,
                                           size_t niov,
                                           int *fds,
                                           size_t nfds,
+                                          int flags,
                                           Error **errp)
 {
     QIOChannelWebsock *wioc = QIO_CHANNEL_WEBSOCK(ioc);
@@ -758,6 +861,21 @@ static ssize_t qio_channel_websock_writev(QIOChannel *ioc,
         return -1;
     }
 
+    if (!wioc->encoutput.offset && !wioc->rawoutput.offset) {
+        done = iov_size(iov, niov);
+        if (done == 0) {
+            return 0;
+        }
+        done = qio_channel_websock_write_direct(
+            wioc, iov, niov, MIN(done, QIO_CHANNEL_WEBSOCK_MAX_BUFFER), errp);
+        if (done < 0) {
+            qio_channel_websock_unset_watch(wioc);
+            return -1;
+        }
+        qio_channel_websock_set_watch(wioc);
+        return done;
+    }
+
     for (i = 0; i < niov; i++) {
         size_t want = iov[i].iov_len;
         if ((want + wioc->rawoutput.offset) > QIO_CHANNEL_WEBSOCK_MAX_BUFFER) {
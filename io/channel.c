@@ -21,6 +21,7 @@
 #include "qemu/osdep.h"
 #include "io/channel.h"
 #include "qemu/coroutine.h"
+#include "qemu/iov.h"
 
 bool qio_channel_has_feature(QIOChannel *ioc,
                              QIOChannelFeature feature)
@@ -55,6 +56,32 @@ ssize_t qio_channel_writev_full(QIOChannel *ioc,
                                 int *fds,
                                 size_t nfds,
                                 Error **errp)
+{
+    return qio_channel_writev_full_flags(ioc, iov, niov, fds, nfds, 0, errp);
+}
+
+
+static int qio_channel_check_write_flags(QIOChannel *ioc,
+                                         int flags,
+                                         Error **errp)
+{
+    if ((flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) &&
+        !(ioc->features & (1 << QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY))) {
+        error_setg_errno(errp, EINVAL,
+                         "Channel does not support zero copy writes");
+        return -1;
+    }
+    return 0;
+}
+
+
+ssize_t qio_channel_writev_full_flags(QIOChannel *ioc,
+                                      const struct iovec *iov,
+                                      size_t niov,
+                                      int *fds,
+                                      size_t nfds,
+                                      int flags,
+                                      Error **errp)
 {
     QIOChannelClass *klass = QIO_CHANNEL_GET_CLASS(ioc);
 
@@ -64,8 +91,110 @@ ssize_t qio_channel_writev_full(QIOChannel *ioc,
                          "Channel does not support file descriptor passing");
         return -1;
     }
+    if (qio_channel_check_write_flags(ioc, flags, errp) < 0) {
+        return -1;
+    }
+
+    return klass->io_writev(ioc, iov, niov, fds, nfds, flags, errp);
+}
+
+
+/*
+ * Gather the memory regions of @msgs, up to IOV_MAX of them, into a
+ * newly allocated array whose length is stored in @niov.
+ */
+static struct iovec *qio_channel_batch_iov(QIOChannelMsg *msgs,
+                                           size_t nmsgs,
+                                           size_t *niov)
+{
+    struct iovec *iov;
+    size_t i, total = 0;
+
+    for (i = 0; i < nmsgs; i++) {
+        total += msgs[i].niov;
+        msgs[i].len = 0;
+    }
+    total = MIN(total, IOV_MAX);
+
+    iov = g_new(struct iovec, total);
+    *niov = 0;
+    for (i = 0; i < nmsgs && *niov < total; i++) {
+        size_t n = MIN(msgs[i].niov, total - *niov);
+
+        memcpy(iov + *niov, msgs[i].iov, n * sizeof(*iov));
+        *niov += n;
+    }
+    return iov;
+}
+
+
+/* Split the @done bytes transferred across the messages, in order */
+static void qio_channel_batch_done(QIOChannelMsg *msgs,
+                                   size_t nmsgs,
+                                   size_t done)
+{
+    size_t i;
+
+    for (i = 0; i < nmsgs && done; i++) {
+        msgs[i].len = MIN(done, iov_size(msgs[i].iov, msgs[i].niov));
+        done -= msgs[i].len;
+    }
+}
+
+
+ssize_t qio_channel_readv_batch(QIOChannel *ioc,
+                                QIOChannelMsg *msgs,
+                                size_t nmsgs,
+                                Error **errp)
+{
+    QIOChannelClass *klass = QIO_CHANNEL_GET_CLASS(ioc);
+    size_t niov;
+    struct iovec *iov = qio_channel_batch_iov(msgs, nmsgs, &niov);
+    ssize_t ret;
+
+    ret = klass->io_readv(ioc, iov, niov, NULL, NULL, errp);
+    if (ret > 0) {
+        qio_channel_batch_done(msgs, nmsgs, ret);
+    }
+    g_free(iov);
+    return ret;
+}
+
+
+ssize_t qio_channel_writev_batch(QIOChannel *ioc,
+                                 QIOChannelMsg *msgs,
+                                 size_t nmsgs,
+                                 int flags,
+                                 Error **errp)
+{
+    QIOChannelClass *klass = QIO_CHANNEL_GET_CLASS(ioc);
+    struct iovec *iov;
+    size_t niov;
+    ssize_t ret;
+
+    if (qio_channel_check_write_flags(ioc, flags, errp) < 0) {
+        return -1;
+    }
+
+    iov = qio_channel_batch_iov(msgs, nmsgs, &niov);
+    ret = klass->io_writev(ioc, iov, niov, NULL, 0, flags, errp);
+    if (ret > 0) {
+        qio_channel_batch_done(msgs, nmsgs, ret);
+    }
+    g_free(iov);
+    return ret;
+}
+
 
-    return klass->io_writev(ioc, iov, niov, fds, nfds, errp);
+int qio_channel_flush(QIOChannel *ioc,
+                      Error **errp)
+{
+    QIOChannelClass *klass = QIO_CHANNEL_GET_CLASS(ioc);
+
+    if (!klass->io_flush) {
+        return 0;
+    }
+    return klass->io_flush(ioc, errp);
 }
 
 
@@ -49,14 +49,23 @@ GSource *iohandler_get_g_source(void)
     return aio_get_g_source(iohandler_ctx);
 }
 
-void qemu_set_fd_handler(int fd,
-                         IOHandler *fd_read,
-                         IOHandler *fd_write,
-                         void *opaque)
+AioContext *iohandler_get_aio_context(void)
 {
     iohandler_init();
-    aio_set_fd_handler(iohandler_ctx, fd, false,
-                       fd_read, fd_write, opaque);
+    return iohandler_ctx;
+}
+
+void qemu_set_fd_handler_full(int fd,
+                              IOHandler *fd_read,
+                              IOHandler *fd_write,
+                              void *opaque,
+                              const char *read_name,
+                              const char *write_name)
+{
+    iohandler_init();
+    aio_set_fd_handler_full(iohandler_ctx, fd, false,
+                            fd_read, fd_write, opaque,
+                            read_name, write_name);
 }
 
 /* reaping of zombies.  right now we're not passing the status to
@@ -17,9 +17,12 @@
 #include "qemu/module.h"
 #include "block/aio.h"
 #include "sysemu/iothread.h"
+#include "sysemu/numa.h"
 #include "qmp-commands.h"
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
+#include "qemu/main-loop.h"
+#include "qapi/visitor.h"
 
 typedef ObjectClass IOThreadClass;
 
@@ -28,6 +31,16 @@ typedef ObjectClass IOThreadClass;
 #define IOTHREAD_CLASS(klass) \
    OBJECT_CLASS_CHECK(IOThreadClass, klass, TYPE_IOTHREAD)
 
+/* Benchmark results from 2016 on NVMe SSD drives show max polling times
+ * around 16-32 microseconds yield IOPS improvements for both iodepth=1 and
+ * iodepth=32 workloads.
+ */
+#ifdef CONFIG_POSIX
+#define IOTHREAD_POLL_MAX_NS_DEFAULT 32768ULL
+#else
+#define IOTHREAD_POLL_MAX_NS_DEFAULT 0ULL
+#endif
+
 static void *iothread_run(void *opaque)
 {
     IOThread *iothread = opaque;
@@ -54,6 +67,14 @@ static void *iothread_run(void *opaque)
     return NULL;
 }
 
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->numa_node = -1;
+}
+
 static void iothread_instance_finalize(Object *obj)
 {
     IOThread *iothread = IOTHREAD(obj);
@@ -83,6 +104,18 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
         return;
     }
 
+    aio_context_set_poll_params(iothread->ctx,
+                                iothread->poll_max_ns,
+                                iothread->poll_grow,
+                                iothread->poll_shrink,
+                                &local_error);
+    if (local_error) {
+        error_propagate(errp, local_error);
+        aio_context_unref(iothread->ctx);
+        iothread->ctx = NULL;
+        return;
+    }
+
     qemu_mutex_init(&iothread->init_done_lock);
     qemu_cond_init(&iothread->init_done_cond);
 
@@ -96,6 +129,11 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
     g_free(thread_name);
     g_free(name);
 
+    /* At startup the NUMA options are not parsed yet, and the thread is
+     * bound later by numa_post_machine_init().
+     */
+    numa_bind_thread(&iothread->thread, iothread->numa_node);
+
     /* Wait for initialization to complete */
     qemu_mutex_lock(&iothread->init_done_lock);
     while (iothread->thread_id == -1) {
@@ -105,10 +143,122 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
     qemu_mutex_unlock(&iothread->init_done_lock);
 }
 
+typedef struct {
+    const char *name;
+    ptrdiff_t offset; /* field's byte offset in IOThread struct */
+} PollParamInfo;
+
+static PollParamInfo poll_max_ns_info = {
+    "poll-max-ns", offsetof(IOThread, poll_max_ns),
+};
+static PollParamInfo poll_grow_info = {
+    "poll-grow", offsetof(IOThread, poll_grow),
+};
+static PollParamInfo poll_shrink_info = {
+    "poll-shrink", offsetof(IOThread, poll_shrink),
+};
+
+static void iothread_get_poll_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    PollParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+
+    visit_type_int64(v, name, field, errp);
+}
+
+static void iothread_set_poll_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    PollParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    if (value < 0) {
+        error_setg(&local_err, "%s value must be in range [0, %"PRId64"]",
+                   info->name, INT64_MAX);
+        goto out;
+    }
+
+    *field = value;
+
+    if (iothread->ctx) {
+        aio_context_set_poll_params(iothread->ctx,
+                                    iothread->poll_max_ns,
+                                    iothread->poll_grow,
+                                    iothread->poll_shrink,
+                                    &local_err);
+    }
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void iothread_get_numa_node(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    visit_type_int64(v, name, &iothread->numa_node, errp);
+}
+
+static void iothread_set_numa_node(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    if (iothread->ctx) {
+        error_setg(&local_err, "numa-node cannot be changed");
+        goto out;
+    }
+    if (value < -1 || value >= MAX_NODES) {
+        error_setg(&local_err, "numa-node value must be in range [-1, %d]",
+                   MAX_NODES - 1);
+        goto out;
+    }
+
+    iothread->numa_node = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
     ucc->complete = iothread_complete;
+
+    object_class_property_add(klass, "poll-max-ns", "int",
+                              iothread_get_poll_param,
+                              iothread_set_poll_param,
+                              NULL, &poll_max_ns_info, &error_abort);
+    object_class_property_add(klass, "poll-grow", "int",
+                              iothread_get_poll_param,
+                              iothread_set_poll_param,
+                              NULL, &poll_grow_info, &error_abort);
+    object_class_property_add(klass, "poll-shrink", "int",
+                              iothread_get_poll_param,
+                              iothread_set_poll_param,
+                              NULL, &poll_shrink_info, &error_abort);
+    object_class_property_add(klass, "numa-node", "int",
+                              iothread_get_numa_node,
+                              iothread_set_numa_node,
+                              NULL, NULL, &error_abort);
 }
 
 static const TypeInfo iothread_info = {
@@ -116,6 +266,7 @@ static const TypeInfo iothread_info = {
     .parent = TYPE_OBJECT,
     .class_init = iothread_class_init,
     .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
     .instance_finalize = iothread_instance_finalize,
     .interfaces = (InterfaceInfo[]) {
         {TYPE_USER_CREATABLE},
@@ -155,6 +306,10 @@ static int query_one_iothread(Object *object, void *opaque)
     info = g_new0(IOThreadInfo, 1);
     info->id = iothread_get_id(iothread);
     info->thread_id = iothread->thread_id;
+    if (iothread->numa_node >= 0) {
+        info->host_cpus = numa_query_thread_host_cpus(&iothread->thread);
+        info->has_host_cpus = info->host_cpus != NULL;
+    }
 
     elem = g_new0(IOThreadInfoList, 1);
     elem->value = info;
@@ -174,3 +329,106 @@ IOThreadInfoList *qmp_query_iothreads(Error **errp)
     object_child_foreach(container, query_one_iothread, &prev);
     return head;
 }
+
+static void query_one_handler(const AioHandlerStats *stats, void *opaque)
+{
+    EventLoopHandlerStatsList **prev = opaque;
+    EventLoopHandlerStatsList *elem;
+    EventLoopHandlerStats *info;
+    intList **hist;
+    int i;
+
+    info = g_new0(EventLoopHandlerStats, 1);
+    info->name = g_strdup(stats->name);
+    info->count = stats->count;
+    info->total_ns = stats->total_ns;
+    info->max_ns = stats->max_ns;
+    hist = &info->histogram;
+    for (i = 0; i < AIO_STATS_BUCKETS; i++) {
+        *hist = g_new0(intList, 1);
+        (*hist)->value = stats->histogram[i];
+        hist = &(*hist)->next;
+    }
+
+    elem = g_new0(EventLoopHandlerStatsList, 1);
+    elem->value = info;
+    elem->next = *prev;
+    *prev = elem;
+}
+
+static void query_one_event_loop(EventLoopStatsList ***prev,
+                                 const char *name, AioContext *ctx)
+{
+    EventLoopStatsList *elem;
+    EventLoopStats *info;
+
+    info = g_new0(EventLoopStats, 1);
+    info->event_loop = g_strdup(name);
+    aio_stats_foreach(ctx, query_one_handler, &info->handlers);
+
+    elem = g_new0(EventLoopStatsList, 1);
+    elem->value = info;
+    **prev = elem;
+    *prev = &elem->next;
+}
+
+static int query_one_iothread_event_loop(Object *object, void *opaque)
+{
+    IOThread *iothread;
+    char *id;
+
+    iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
+    if (!iothread) {
+        return 0;
+    }
+
+    id = iothread_get_id(iothread);
+    query_one_event_loop(opaque, id, iothread->ctx);
+    g_free(id);
+    return 0;
+}
+
+EventLoopStatsList *qmp_query_event_loop_stats(Error **errp)
+{
+    EventLoopStatsList *head = NULL;
+    EventLoopStatsList **prev = &head;
+    Object *container = object_get_objects_root();
+
+    query_one_event_loop(&prev, "main", qemu_get_aio_context());
+    query_one_event_loop(&prev, "iohandler", iohandler_get_aio_context());
+    object_child_foreach(container, query_one_iothread_event_loop, &prev);
+    return head;
+}
+
+static int reset_one_iothread_stats(Object *object, void *opaque)
+{
+    IOThread *iothread;
+
+    iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
+    if (iothread) {
+        aio_stats_reset(iothread->ctx);
+    }
+    return 0;
+}
+
+void qmp_set_event_loop_stats(bool enable, bool has_slow_threshold_us,
+                              int64_t slow_threshold_us,
+                              bool has_reset, bool reset, Error **errp)
+{
+    if (has_slow_threshold_us) {
+        if (slow_threshold_us < 0) {
+            error_setg(errp, "slow-threshold-us must not be negative");
+            return;
+        }
+        atomic_set(&aio_stats_slow_ns, slow_threshold_us * SCALE_US);
+    }
+
+    if (has_reset && reset) {
+        aio_stats_reset(qemu_get_aio_context());
+        aio_stats_reset(iohandler_get_aio_context());
+        object_child_foreach(object_get_objects_root(),
+                             reset_one_iothread_stats, NULL);
+    }
+
+    atomic_set(&aio_stats_enabled, enable);
+}
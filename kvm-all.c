@@ -21,6 +21,7 @@
 
 #include "qemu-common.h"
 #include "qemu/atomic.h"
+#include "qemu/timer.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
@@ -36,8 +37,11 @@
 #include "qemu/event_notifier.h"
 #include "trace.h"
 #include "hw/irq.h"
+#include "sysemu/stats.h"
 
 #include "hw/boards.h"
+#include "qapi/error.h"
+#include "qmp-commands.h"
 
 /* This check must be after config-host.h is included */
 #ifdef CONFIG_EVENTFD
@@ -61,6 +65,9 @@
 
 #define KVM_MSI_HASHTAB_SIZE    256
 
+/* How often the dirty rings are collected when no vCPU filled its ring */
+#define KVM_DIRTY_RING_REAP_INTERVAL_US (1000 * 1000)
+
 struct KVMState
 {
     AccelState parent_obj;
@@ -69,6 +76,7 @@ struct KVMState
     int fd;
     int vmfd;
     int coalesced_mmio;
+    int coalesced_pio;
     struct kvm_coalesced_mmio_ring *coalesced_mmio_ring;
     bool coalesced_flush_in_progress;
     int broken_set_mem_region;
@@ -94,6 +102,12 @@ struct KVMState
     QTAILQ_HEAD(msi_hashtab, KVMMSIRoute) msi_hashtab[KVM_MSI_HASHTAB_SIZE];
 #endif
     KVMMemoryListener memory_listener;
+    QLIST_HEAD(, KVMMemoryListener) kml_list;
+    /* Number of entries in the dirty ring of each vCPU, 0 if not in use */
+    uint32_t dirty_ring_size;
+    QemuThread dirty_ring_reaper;
+    /* Halt polling limit of the VM, or -1 for the host default */
+    int64_t halt_poll_ns;
 };
 
 KVMState *kvm_state;
@@ -237,6 +251,289 @@ static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot)
     return kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, &mem);
 }
 
+/*
+ * vCPU statistics
+ *
+ * kvm_cpu_exec() counts the exits of each vCPU and the time it spends in
+ * and out of KVM_RUN.  The halt polling statistics are read from the
+ * binary stats fd of the vCPU, if the kernel has one.
+ */
+
+#define KVM_EXIT_REASON_MAX 32
+
+static const char *const kvm_exit_reason_names[KVM_EXIT_REASON_MAX] = {
+    [KVM_EXIT_UNKNOWN] = "unknown",
+    [KVM_EXIT_EXCEPTION] = "exception",
+    [KVM_EXIT_IO] = "io",
+    [KVM_EXIT_HYPERCALL] = "hypercall",
+    [KVM_EXIT_DEBUG] = "debug",
+    [KVM_EXIT_HLT] = "hlt",
+    [KVM_EXIT_MMIO] = "mmio",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "irq-window-open",
+    [KVM_EXIT_SHUTDOWN] = "shutdown",
+    [KVM_EXIT_FAIL_ENTRY] = "fail-entry",
+    [KVM_EXIT_INTR] = "intr",
+    [KVM_EXIT_SET_TPR] = "set-tpr",
+    [KVM_EXIT_TPR_ACCESS] = "tpr-access",
+    [KVM_EXIT_S390_SIEIC] = "s390-sieic",
+    [KVM_EXIT_S390_RESET] = "s390-reset",
+    [KVM_EXIT_DCR] = "dcr",
+    [KVM_EXIT_NMI] = "nmi",
+    [KVM_EXIT_INTERNAL_ERROR] = "internal-error",
+    [KVM_EXIT_OSI] = "osi",
+    [KVM_EXIT_PAPR_HCALL] = "papr-hcall",
+    [KVM_EXIT_S390_UCONTROL] = "s390-ucontrol",
+    [KVM_EXIT_WATCHDOG] = "watchdog",
+    [KVM_EXIT_S390_TSCH] = "s390-tsch",
+    [KVM_EXIT_EPR] = "epr",
+    [KVM_EXIT_SYSTEM_EVENT] = "system-event",
+    [KVM_EXIT_S390_STSI] = "s390-stsi",
+    [KVM_EXIT_IOAPIC_EOI] = "ioapic-eoi",
+    [KVM_EXIT_HYPERV] = "hyperv",
+    [KVM_EXIT_DIRTY_RING_FULL] = "dirty-ring-full",
+};
+
+enum {
+    KVM_HALT_STAT_ATTEMPTED_POLL,
+    KVM_HALT_STAT_SUCCESSFUL_POLL,
+    KVM_HALT_STAT_POLL_INVALID,
+    KVM_HALT_STAT_WAKEUP,
+    KVM_HALT_STAT_POLL_SUCCESS_NS,
+    KVM_HALT_STAT_POLL_FAIL_NS,
+    KVM_HALT_STAT_WAIT_NS,
+    KVM_HALT_STAT__MAX,
+};
+
+static const char *const kvm_halt_stat_names[KVM_HALT_STAT__MAX] = {
+    [KVM_HALT_STAT_ATTEMPTED_POLL] = "halt_attempted_poll",
+    [KVM_HALT_STAT_SUCCESSFUL_POLL] = "halt_successful_poll",
+    [KVM_HALT_STAT_POLL_INVALID] = "halt_poll_invalid",
+    [KVM_HALT_STAT_WAKEUP] = "halt_wakeup",
+    [KVM_HALT_STAT_POLL_SUCCESS_NS] = "halt_poll_success_ns",
+    [KVM_HALT_STAT_POLL_FAIL_NS] = "halt_poll_fail_ns",
+    [KVM_HALT_STAT_WAIT_NS] = "halt_wait_ns",
+};
+
+typedef struct KVMVcpuStats {
+    /* Only written by the vCPU thread; readers may see slightly old values */
+    uint64_t exits[KVM_EXIT_REASON_MAX];
+    uint64_t other_exits;
+    uint64_t run_ns;
+    uint64_t user_ns;
+    int64_t last_exit;
+
+    /* Binary stats fd, and where the halt statistics are in it, or -1 */
+    int fd;
+    off_t halt_offset[KVM_HALT_STAT__MAX];
+} KVMVcpuStats;
+
+static void kvm_init_vcpu_stats(CPUState *cpu)
+{
+    KVMVcpuStats *stats = g_new0(KVMVcpuStats, 1);
+    struct kvm_stats_header header;
+    struct kvm_stats_desc *desc;
+    uint8_t *descs = NULL;
+    size_t desc_size;
+    int fd, i, j;
+
+    stats->fd = -1;
+    for (j = 0; j < KVM_HALT_STAT__MAX; j++) {
+        stats->halt_offset[j] = -1;
+    }
+    cpu->kvm_stats = stats;
+
+    /*
+     * Get the fd now, from the vCPU thread: later, KVM_GET_STATS_FD would
+     * wait for KVM_RUN to return, which may take long for a halted vCPU.
+     */
+    if (kvm_check_extension(cpu->kvm_state, KVM_CAP_BINARY_STATS_FD) <= 0) {
+        return;
+    }
+    fd = kvm_vcpu_ioctl(cpu, KVM_GET_STATS_FD, NULL);
+    if (fd < 0) {
+        return;
+    }
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        goto fail;
+    }
+    desc_size = sizeof(*desc) + header.name_size;
+    descs = g_malloc(desc_size * header.num_desc);
+    if (pread(fd, descs, desc_size * header.num_desc, header.desc_offset) !=
+        desc_size * header.num_desc) {
+        goto fail;
+    }
+
+    for (i = 0; i < header.num_desc; i++) {
+        desc = (struct kvm_stats_desc *)(descs + i * desc_size);
+        for (j = 0; j < KVM_HALT_STAT__MAX; j++) {
+            if (!strncmp(desc->name, kvm_halt_stat_names[j],
+                         header.name_size)) {
+                stats->halt_offset[j] = header.data_offset + desc->offset;
+            }
+        }
+    }
+
+    g_free(descs);
+    stats->fd = fd;
+    return;
+
+fail:
+    g_free(descs);
+    close(fd);
+}
+
+static uint64_t kvm_vcpu_halt_stat(KVMVcpuStats *stats, int stat)
+{
+    uint64_t value;
+
+    if (stats->halt_offset[stat] < 0 ||
+        pread(stats->fd, &value, sizeof(value), stats->halt_offset[stat]) !=
+        sizeof(value)) {
+        return 0;
+    }
+    return value;
+}
+
+/* vcpu.<index>.* counters; read in place, without run_on_cpu() */
+static void kvm_vcpu_stats_collect(StatsSampler *s, void *opaque)
+{
+    CPUState *cpu;
+    uint64_t total;
+    int i;
+
+    CPU_FOREACH(cpu) {
+        KVMVcpuStats *stats = cpu->kvm_stats;
+
+        if (!stats) {
+            continue;
+        }
+        total = stats->other_exits;
+        for (i = 0; i < KVM_EXIT_REASON_MAX; i++) {
+            total += stats->exits[i];
+            if (stats->exits[i] && kvm_exit_reason_names[i]) {
+                stats_add(s, stats->exits[i], "%d.exits.%s",
+                          cpu->cpu_index, kvm_exit_reason_names[i]);
+            }
+        }
+        stats_add(s, total, "%d.exits", cpu->cpu_index);
+        stats_add(s, stats->run_ns, "%d.run-ns", cpu->cpu_index);
+        stats_add(s, stats->user_ns, "%d.user-ns", cpu->cpu_index);
+    }
+}
+
+static VcpuStats *kvm_vcpu_get_stats(CPUState *cpu)
+{
+    KVMVcpuStats *stats = cpu->kvm_stats;
+    VcpuStats *info = g_new0(VcpuStats, 1);
+    VcpuExitCountList *head = NULL, *cur_item = NULL, *item;
+    VcpuHaltPollStats *halt;
+    int i;
+
+    info->cpu_index = cpu->cpu_index;
+    info->thread_id = cpu->thread_id;
+    info->run_ns = stats->run_ns;
+    info->user_ns = stats->user_ns;
+
+    for (i = 0; i <= KVM_EXIT_REASON_MAX; i++) {
+        uint64_t count = i < KVM_EXIT_REASON_MAX ? stats->exits[i]
+                                                 : stats->other_exits;
+        const char *reason;
+
+        if (!count) {
+            continue;
+        }
+        reason = i < KVM_EXIT_REASON_MAX ? kvm_exit_reason_names[i] : NULL;
+
+        item = g_new0(VcpuExitCountList, 1);
+        item->value = g_new0(VcpuExitCount, 1);
+        item->value->reason = g_strdup(reason ? reason : "other");
+        item->value->count = count;
+        if (!cur_item) {
+            head = cur_item = item;
+        } else {
+            cur_item->next = item;
+            cur_item = item;
+        }
+    }
+    info->exits = head;
+
+    if (stats->fd >= 0) {
+        halt = g_new0(VcpuHaltPollStats, 1);
+        halt->attempted_poll =
+            kvm_vcpu_halt_stat(stats, KVM_HALT_STAT_ATTEMPTED_POLL);
+        halt->successful_poll =
+            kvm_vcpu_halt_stat(stats, KVM_HALT_STAT_SUCCESSFUL_POLL);
+        halt->poll_invalid =
+            kvm_vcpu_halt_stat(stats, KVM_HALT_STAT_POLL_INVALID);
+        halt->wakeup = kvm_vcpu_halt_stat(stats, KVM_HALT_STAT_WAKEUP);
+        halt->poll_success_ns =
+            kvm_vcpu_halt_stat(stats, KVM_HALT_STAT_POLL_SUCCESS_NS);
+        halt->poll_fail_ns =
+            kvm_vcpu_halt_stat(stats, KVM_HALT_STAT_POLL_FAIL_NS);
+        halt->wait_ns = kvm_vcpu_halt_stat(stats, KVM_HALT_STAT_WAIT_NS);
+        info->has_halt_poll = true;
+        info->halt_poll = halt;
+    }
+
+    return info;
+}
+
+VcpuStatsList *qmp_query_vcpu_stats(Error **errp)
+{
+    VcpuStatsList *head = NULL, *cur_item = NULL, *info;
+    CPUState *cpu;
+
+    if (!kvm_enabled()) {
+        error_setg(errp, "vCPU statistics need KVM");
+        return NULL;
+    }
+
+    CPU_FOREACH(cpu) {
+        info = g_new0(VcpuStatsList, 1);
+        info->value = kvm_vcpu_get_stats(cpu);
+        if (!cur_item) {
+            head = cur_item = info;
+        } else {
+            cur_item->next = info;
+            cur_item = info;
+        }
+    }
+
+    return head;
+}
+
+static int kvm_set_halt_poll_ns(KVMState *s, uint32_t max_ns)
+{
+    int ret;
+
+    if (kvm_vm_check_extension(s, KVM_CAP_HALT_POLL) <= 0) {
+        return -ENOSYS;
+    }
+    ret = kvm_vm_enable_cap(s, KVM_CAP_HALT_POLL, 0, max_ns);
+    if (ret < 0) {
+        return ret;
+    }
+    s->halt_poll_ns = max_ns;
+    trace_kvm_set_halt_poll_ns(max_ns);
+    return 0;
+}
+
+void qmp_set_kvm_halt_poll(uint32_t max_ns, Error **errp)
+{
+    int ret;
+
+    if (!kvm_enabled()) {
+        error_setg(errp, "Halt polling needs KVM");
+        return;
+    }
+
+    ret = kvm_set_halt_poll_ns(kvm_state, max_ns);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Cannot set the halt polling limit");
+    }
+}
+
 int kvm_init_vcpu(CPUState *cpu)
 {
     KVMState *s = kvm_state;
@@ -275,6 +572,22 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->dirty_ring_size *
+                                   sizeof(struct kvm_dirty_gfn),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            cpu->kvm_dirty_gfns = NULL;
+            ret = -errno;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+    }
+
+    kvm_init_vcpu_stats(cpu);
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -374,6 +687,149 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
     return 0;
 }
 
+static KVMMemoryListener *kvm_memory_listener_by_as_id(KVMState *s,
+                                                        int as_id)
+{
+    KVMMemoryListener *kml;
+
+    QLIST_FOREACH(kml, &s->kml_list, next) {
+        if (kml->as_id == as_id) {
+            return kml;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Collects the entries that the kernel pushed to the dirty ring of @cpu and
+ * marks the pages dirty in qemu's dirty bitmap.  The collected entries are
+ * only recycled by the KVM_RESET_DIRTY_RINGS ioctl.  Returns the number of
+ * collected entries.
+ */
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    uint32_t ring_mask = s->dirty_ring_size - 1;
+    uint32_t last_slot = UINT32_MAX;
+    uint32_t count = 0;
+    struct kvm_dirty_gfn *gfn;
+    KVMMemoryListener *kml;
+    KVMSlot *mem = NULL;
+    ram_addr_t start = 0;
+    uint64_t offset;
+
+    for (;;) {
+        gfn = &cpu->kvm_dirty_gfns[cpu->kvm_fetch_index & ring_mask];
+
+        /* Read slot and offset only after the entry is marked dirty */
+        if (!(atomic_mb_read(&gfn->flags) & KVM_DIRTY_GFN_F_DIRTY)) {
+            break;
+        }
+
+        /* Entries of the same slot usually come in batches */
+        if (gfn->slot != last_slot) {
+            last_slot = gfn->slot;
+            kml = kvm_memory_listener_by_as_id(s, gfn->slot >> 16);
+            mem = NULL;
+            if (kml && (gfn->slot & 0xffff) < s->nr_slots) {
+                mem = &kml->slots[gfn->slot & 0xffff];
+                if (mem->memory_size == 0 ||
+                    !qemu_ram_addr_from_host(mem->ram, &start)) {
+                    mem = NULL;
+                }
+            }
+        }
+
+        offset = gfn->offset * getpagesize();
+        if (mem && offset < mem->memory_size) {
+            cpu_physical_memory_set_dirty_range(start + offset, getpagesize(),
+                                                DIRTY_CLIENTS_NOCODE);
+        }
+
+        atomic_mb_set(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+        cpu->kvm_fetch_index++;
+        count++;
+    }
+
+    cpu->dirty_pages += count;
+    return count;
+}
+
+/*
+ * Collects the dirty rings of all vCPUs and lets the kernel reuse the
+ * collected entries.  Must be called with the iothread lock held.
+ *
+ * Pages that a running vCPU dirtied may still be buffered in the processor
+ * and only reach the ring at the next exit.  This does not matter for
+ * migration, because the vCPUs are stopped before the last sync.
+ */
+static void kvm_dirty_ring_reap(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+    int ret;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->kvm_dirty_gfns) {
+            total += kvm_dirty_ring_reap_one(s, cpu);
+        }
+    }
+
+    if (total) {
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        if (ret < 0) {
+            fprintf(stderr, "%s: resetting the dirty rings failed: %s\n",
+                    __func__, strerror(-ret));
+            abort();
+        }
+        trace_kvm_dirty_ring_reap(total);
+    }
+}
+
+/* Updates the dirty rate of each vCPU over the last @elapsed_us */
+static void kvm_dirty_ring_update_rates(int64_t elapsed_us)
+{
+    CPUState *cpu;
+    uint64_t bytes;
+
+    if (elapsed_us <= 0) {
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        bytes = (cpu->dirty_pages - cpu->dirty_pages_prev) * getpagesize();
+        cpu->dirty_rate = muldiv64(bytes, 1000000, elapsed_us);
+        cpu->dirty_pages_prev = cpu->dirty_pages;
+    }
+}
+
+/*
+ * The rings of the vCPUs are collected periodically, so that they rarely
+ * fill up and the final sync of a migration has little left to do.  This
+ * also measures how fast each vCPU dirties memory.
+ */
+static void *kvm_dirty_ring_reaper_thread(void *opaque)
+{
+    KVMState *s = opaque;
+    int64_t last = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    int64_t now;
+
+    rcu_register_thread();
+
+    for (;;) {
+        g_usleep(KVM_DIRTY_RING_REAP_INTERVAL_US);
+
+        qemu_mutex_lock_iothread();
+        kvm_dirty_ring_reap(s);
+        now = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        kvm_dirty_ring_update_rates(now - last);
+        last = now;
+        qemu_mutex_unlock_iothread();
+    }
+
+    return NULL;
+}
+
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
 /**
@@ -382,6 +838,10 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
  * memory_region_set_dirty().  This means all bits are set
  * to dirty.
  *
+ * If the dirty ring is in use, the kernel does not maintain the bitmap;
+ * the rings of all vCPUs are collected instead, whose cost does not depend
+ * on the size of the logged region.
+ *
  * @start_add: start of logged region.
  * @end_addr: end of logged region.
  */
@@ -396,6 +856,11 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + int128_get64(section->size);
 
+    if (s->dirty_ring_size) {
+        kvm_dirty_ring_reap(s);
+        return 0;
+    }
+
     d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
@@ -457,6 +922,40 @@ static void kvm_coalesce_mmio_region(MemoryListener *listener,
     }
 }
 
+static void kvm_coalesce_pio_add(MemoryListener *listener,
+                                 MemoryRegionSection *section,
+                                 hwaddr start, hwaddr size)
+{
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        (void)kvm_vm_ioctl(s, KVM_REGISTER_COALESCED_MMIO, &zone);
+    }
+}
+
+static void kvm_coalesce_pio_del(MemoryListener *listener,
+                                 MemoryRegionSection *section,
+                                 hwaddr start, hwaddr size)
+{
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        (void)kvm_vm_ioctl(s, KVM_UNREGISTER_COALESCED_MMIO, &zone);
+    }
+}
+
 static void kvm_uncoalesce_mmio_region(MemoryListener *listener,
                                        MemoryRegionSection *secion,
                                        hwaddr start, hwaddr size)
@@ -895,6 +1394,7 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
+    QLIST_INSERT_HEAD(&s->kml_list, kml, next);
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
@@ -913,6 +1413,8 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 static MemoryListener kvm_io_listener = {
     .eventfd_add = kvm_io_ioeventfd_add,
     .eventfd_del = kvm_io_ioeventfd_del,
+    .coalesced_io_add = kvm_coalesce_pio_add,
+    .coalesced_io_del = kvm_coalesce_pio_del,
     .priority = 10,
 };
 
@@ -1495,6 +1997,7 @@ static int kvm_init(MachineState *ms)
 #ifdef KVM_CAP_SET_GUEST_DEBUG
     QTAILQ_INIT(&s->kvm_sw_breakpoints);
 #endif
+    QLIST_INIT(&s->kml_list);
     s->vmfd = -1;
     s->fd = qemu_open("/dev/kvm", O_RDWR);
     if (s->fd == -1) {
@@ -1593,6 +2096,10 @@ static int kvm_init(MachineState *ms)
     }
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
+    /* PIO entries share the ring with MMIO ones */
+    if (s->coalesced_mmio) {
+        s->coalesced_pio = kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
+    }
 
     s->broken_set_mem_region = 1;
     ret = kvm_check_extension(s, KVM_CAP_JOIN_MEMORY_REGIONS_WORKS);
@@ -1642,6 +2149,43 @@ static int kvm_init(MachineState *ms)
     kvm_ioeventfd_any_length_allowed =
         (kvm_check_extension(s, KVM_CAP_IOEVENTFD_ANY_LENGTH) > 0);
 
+    /* The dirty ring must be enabled before the vCPUs are created */
+    s->dirty_ring_size = machine_kvm_dirty_ring_size(ms);
+    if (s->dirty_ring_size) {
+        uint64_t ring_bytes = (uint64_t)s->dirty_ring_size *
+                              sizeof(struct kvm_dirty_gfn);
+
+        ret = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+        if (ret <= 0) {
+            error_report("kvm does not support the dirty ring, "
+                         "using the dirty bitmap");
+            s->dirty_ring_size = 0;
+        } else if (ring_bytes > ret) {
+            error_report("kvm_dirty_ring_size too large, kvm supports at "
+                         "most %zu entries", ret / sizeof(struct kvm_dirty_gfn));
+            ret = -EINVAL;
+            goto err;
+        } else {
+            ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+            if (ret < 0) {
+                error_report("Enabling the kvm dirty ring failed: %s",
+                             strerror(-ret));
+                goto err;
+            }
+        }
+    }
+
+    s->halt_poll_ns = -1;
+    if (machine_kvm_halt_poll_ns(ms) >= 0) {
+        ret = kvm_set_halt_poll_ns(s, machine_kvm_halt_poll_ns(ms));
+        if (ret < 0) {
+            error_report("Setting kvm_halt_poll_ns failed: %s",
+                         ret == -ENOSYS ? "not supported by the host kernel"
+                                        : strerror(-ret));
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init(ms, s);
     if (ret < 0) {
         goto err;
@@ -1652,13 +2196,14 @@ static int kvm_init(MachineState *ms)
     }
 
     kvm_state = s;
+    stats_register_provider("vcpu", kvm_vcpu_stats_collect, NULL);
 
     if (kvm_eventfds_allowed) {
         s->memory_listener.listener.eventfd_add = kvm_mem_ioeventfd_add;
         s->memory_listener.listener.eventfd_del = kvm_mem_ioeventfd_del;
     }
-    s->memory_listener.listener.coalesced_mmio_add = kvm_coalesce_mmio_region;
-    s->memory_listener.listener.coalesced_mmio_del = kvm_uncoalesce_mmio_region;
+    s->memory_listener.listener.coalesced_io_add = kvm_coalesce_mmio_region;
+    s->memory_listener.listener.coalesced_io_del = kvm_uncoalesce_mmio_region;
 
     kvm_memory_listener_register(s, &s->memory_listener,
                                  &address_space_memory, 0);
@@ -1667,6 +2212,12 @@ static int kvm_init(MachineState *ms)
 
     s->many_ioeventfds = kvm_check_many_ioeventfds();
 
+    if (s->dirty_ring_size) {
+        qemu_thread_create(&s->dirty_ring_reaper, "kvm-reaper",
+                           kvm_dirty_ring_reaper_thread, s,
+                           QEMU_THREAD_DETACHED);
+    }
+
     cpu_interrupt_handler = kvm_handle_interrupt;
 
     return 0;
@@ -1729,30 +2280,51 @@ static int kvm_handle_internal_error(CPUState *cpu, struct kvm_run *run)
     return -1;
 }
 
+/* Can be called without the iothread lock; it is only taken if the ring has
+ * entries, which is rare on the vCPU fast path.
+ */
 void kvm_flush_coalesced_mmio_buffer(void)
 {
     KVMState *s = kvm_state;
+    struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
+    bool locked;
 
-    if (s->coalesced_flush_in_progress) {
+    if (!ring || atomic_read(&ring->first) == atomic_read(&ring->last)) {
         return;
     }
 
-    s->coalesced_flush_in_progress = true;
+    locked = qemu_mutex_iothread_locked();
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+
+    if (!s->coalesced_flush_in_progress) {
+        s->coalesced_flush_in_progress = true;
 
-    if (s->coalesced_mmio_ring) {
-        struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
-        while (ring->first != ring->last) {
+        while (ring->first != atomic_read(&ring->last)) {
             struct kvm_coalesced_mmio *ent;
 
+            smp_rmb();
             ent = &ring->coalesced_mmio[ring->first];
 
-            cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
+            if (ent->pio == 1) {
+                address_space_rw(&address_space_io, ent->phys_addr,
+                                 MEMTXATTRS_UNSPECIFIED, ent->data,
+                                 ent->len, true);
+            } else {
+                cpu_physical_memory_write(ent->phys_addr, ent->data,
+                                          ent->len);
+            }
             smp_wmb();
             ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
         }
+
+        s->coalesced_flush_in_progress = false;
     }
 
-    s->coalesced_flush_in_progress = false;
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 static void do_kvm_cpu_synchronize_state(void *arg)
@@ -1801,6 +2373,8 @@ void kvm_cpu_synchronize_post_init(CPUState *cpu)
 int kvm_cpu_exec(CPUState *cpu)
 {
     struct kvm_run *run = cpu->kvm_run;
+    KVMVcpuStats *stats = cpu->kvm_stats;
+    int64_t entry;
     int ret, run_ret;
 
     DPRINTF("kvm_cpu_exec()\n");
@@ -1811,6 +2385,7 @@ int kvm_cpu_exec(CPUState *cpu)
     }
 
     qemu_mutex_unlock_iothread();
+    stats->last_exit = get_clock();
 
     do {
         MemTxAttrs attrs;
@@ -1831,13 +2406,18 @@ int kvm_cpu_exec(CPUState *cpu)
             qemu_cpu_kick_self();
         }
 
+        entry = get_clock();
+        stats->user_ns += entry - stats->last_exit;
         run_ret = kvm_vcpu_ioctl(cpu, KVM_RUN, 0);
+        stats->last_exit = get_clock();
+        stats->run_ns += stats->last_exit - entry;
 
         attrs = kvm_arch_post_run(cpu, run);
 
         if (run_ret < 0) {
             if (run_ret == -EINTR || run_ret == -EAGAIN) {
                 DPRINTF("io window exit\n");
+                stats->exits[KVM_EXIT_INTR]++;
                 ret = EXCP_INTERRUPT;
                 break;
             }
@@ -1856,6 +2436,11 @@ int kvm_cpu_exec(CPUState *cpu)
         }
 
         trace_kvm_run_exit(cpu->cpu_index, run->exit_reason);
+        if (run->exit_reason < KVM_EXIT_REASON_MAX) {
+            stats->exits[run->exit_reason]++;
+        } else {
+            stats->other_exits++;
+        }
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             DPRINTF("handle_io\n");
@@ -1881,6 +2466,14 @@ int kvm_cpu_exec(CPUState *cpu)
             DPRINTF("irq_window_open\n");
             ret = EXCP_INTERRUPT;
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            DPRINTF("dirty ring full\n");
+            /* KVM_RUN fails until the ring has been collected */
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_SHUTDOWN:
             DPRINTF("shutdown\n");
             qemu_system_reset_request();
@@ -1923,6 +2516,7 @@ int kvm_cpu_exec(CPUState *cpu)
         }
     } while (ret == 0);
 
+    stats->user_ns += get_clock() - stats->last_exit;
     qemu_mutex_lock_iothread();
 
     if (ret < 0) {
@@ -2084,6 +2678,11 @@ int kvm_has_many_ioeventfds(void)
     return kvm_state->many_ioeventfds;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_enabled() && kvm_state->dirty_ring_size;
+}
+
 int kvm_has_gsi_routing(void)
 {
 #ifdef KVM_CAP_IRQ_ROUTING
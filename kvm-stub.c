@@ -15,6 +15,8 @@
 #include "hw/hw.h"
 #include "cpu.h"
 #include "sysemu/kvm.h"
+#include "qapi/error.h"
+#include "qmp-commands.h"
 
 #ifndef CONFIG_USER_ONLY
 #include "hw/pci/msi.h"
@@ -69,6 +71,22 @@ int kvm_has_many_ioeventfds(void)
     return 0;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return false;
+}
+
+VcpuStatsList *qmp_query_vcpu_stats(Error **errp)
+{
+    error_setg(errp, "vCPU statistics need KVM");
+    return NULL;
+}
+
+void qmp_set_kvm_halt_poll(uint32_t max_ns, Error **errp)
+{
+    error_setg(errp, "Halt polling needs KVM");
+}
+
 void kvm_setup_guest_memory(void *start, size_t size)
 {
 }
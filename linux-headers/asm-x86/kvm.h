@@ -45,6 +45,8 @@
 #define __KVM_HAVE_XCRS
 #define __KVM_HAVE_READONLY_MEM
 
+#define KVM_DIRTY_LOG_PAGE_OFFSET 64
+
 /* Architectural interrupt line count. */
 #define KVM_NR_INTERRUPTS 256
 
@@ -194,13 +194,88 @@ struct vfio_region_info {
 #define VFIO_REGION_INFO_FLAG_READ	(1 << 0) /* Region supports read */
 #define VFIO_REGION_INFO_FLAG_WRITE	(1 << 1) /* Region supports write */
 #define VFIO_REGION_INFO_FLAG_MMAP	(1 << 2) /* Region supports mmap */
+#define VFIO_REGION_INFO_FLAG_CAPS	(1 << 3) /* Info supports caps */
 	__u32	index;		/* Region index */
-	__u32	resv;		/* Reserved for alignment */
+	__u32	cap_offset;	/* Offset within info struct of first cap */
 	__u64	size;		/* Region size (bytes) */
 	__u64	offset;		/* Region offset from start of device fd */
 };
 #define VFIO_DEVICE_GET_REGION_INFO	_IO(VFIO_TYPE, VFIO_BASE + 8)
 
+/*
+ * The capability chain of an info struct.  The caps follow the struct,
+ * each header gives the offset of the next one from the start of the
+ * struct, 0 ending the chain.
+ */
+struct vfio_info_cap_header {
+	__u16	id;		/* Identifies capability */
+	__u16	version;	/* Version specific to the capability ID */
+	__u32	next;		/* Offset of next capability */
+};
+
+/*
+ * The region type capability allows regions unique to a specific device
+ * or class of devices to be exposed.  This helps solve the problem for
+ * vfio bus drivers of defining which region indexes correspond to which
+ * region on the device, without needing to resort to static indexes, as
+ * done by vfio-pci.  For instance, if we were to go back in time, we might
+ * remove VFIO_PCI_VGA_REGION_INDEX and let vfio-pci simply define that
+ * all host bridge regions are exposed via the region type capability.
+ */
+#define VFIO_REGION_INFO_CAP_TYPE	2
+
+struct vfio_region_info_cap_type {
+	struct vfio_info_cap_header header;
+	__u32 type;	/* global per bus driver */
+	__u32 subtype;	/* type specific */
+};
+
+/*
+ * The migration region of a device.  The region starts with a struct
+ * vfio_device_migration_info; the device state data is read or written
+ * at data_offset within the region.
+ */
+#define VFIO_REGION_TYPE_MIGRATION		(3)
+#define VFIO_REGION_SUBTYPE_MIGRATION		(1)
+
+/*
+ * device_state: the user sets the state of the device with a combination
+ * of the RUNNING, SAVING and RESUMING bits.  SAVING without RUNNING stops
+ * the device and saves its final state, RESUMING loads a state into a
+ * stopped device.  SAVING | RESUMING is an error state that only a reset
+ * leaves.
+ *
+ * pending_bytes: while SAVING, the amount of state that is left.  Reading
+ * it starts a new iteration, i.e. lets the device fill data_offset and
+ * data_size.
+ *
+ * data_size: while SAVING, the amount of data at data_offset; while
+ * RESUMING, written by the user with the amount of data that it wrote at
+ * data_offset.
+ */
+struct vfio_device_migration_info {
+	__u32 device_state;	/* VFIO device state */
+#define VFIO_DEVICE_STATE_STOP		(0)
+#define VFIO_DEVICE_STATE_RUNNING	(1 << 0)
+#define VFIO_DEVICE_STATE_SAVING	(1 << 1)
+#define VFIO_DEVICE_STATE_RESUMING	(1 << 2)
+#define VFIO_DEVICE_STATE_MASK		(VFIO_DEVICE_STATE_RUNNING | \
+					 VFIO_DEVICE_STATE_SAVING |  \
+					 VFIO_DEVICE_STATE_RESUMING)
+
+#define VFIO_DEVICE_STATE_VALID(state) \
+	(state & VFIO_DEVICE_STATE_RESUMING ? \
+	(state & VFIO_DEVICE_STATE_MASK) == VFIO_DEVICE_STATE_RESUMING : 1)
+
+#define VFIO_DEVICE_STATE_IS_ERROR(state) \
+	((state & VFIO_DEVICE_STATE_MASK) == (VFIO_DEVICE_STATE_SAVING | \
+					      VFIO_DEVICE_STATE_RESUMING))
+	__u32 reserved;
+	__u64 pending_bytes;
+	__u64 data_offset;
+	__u64 data_size;
+};
+
 /**
  * VFIO_DEVICE_GET_IRQ_INFO - _IOWR(VFIO_TYPE, VFIO_BASE + 9,
  *				    struct vfio_irq_info)
@@ -442,6 +517,40 @@ struct vfio_iommu_type1_dma_unmap {
 
 #define VFIO_IOMMU_UNMAP_DMA _IO(VFIO_TYPE, VFIO_BASE + 14)
 
+/**
+ * VFIO_IOMMU_DIRTY_PAGES - _IOWR(VFIO_TYPE, VFIO_BASE + 17,
+ *                                     struct vfio_iommu_type1_dirty_bitmap)
+ *
+ * START makes the IOMMU track the pages that devices write to, STOP ends
+ * the tracking.  GET_BITMAP, followed by a struct
+ * vfio_iommu_type1_dirty_bitmap_get in data, fills a bitmap with the pages
+ * of a mapped IOVA range that were dirtied since the last call, and clears
+ * their dirty state.  The range must start and end on mapping boundaries.
+ * Pages pinned for a device without page tracking always read as dirty.
+ */
+struct vfio_bitmap {
+	__u64        pgsize;	/* page size for bitmap in bytes */
+	__u64        size;	/* in bytes */
+	__u64       *data;	/* one bit per page */
+};
+
+struct vfio_iommu_type1_dirty_bitmap {
+	__u32        argsz;
+	__u32        flags;
+#define VFIO_IOMMU_DIRTY_PAGES_FLAG_START	(1 << 0)
+#define VFIO_IOMMU_DIRTY_PAGES_FLAG_STOP	(1 << 1)
+#define VFIO_IOMMU_DIRTY_PAGES_FLAG_GET_BITMAP	(1 << 2)
+	__u8         data[];
+};
+
+struct vfio_iommu_type1_dirty_bitmap_get {
+	__u64              iova;	/* IO virtual address */
+	__u64              size;	/* Size of iova range */
+	struct vfio_bitmap bitmap;
+};
+
+#define VFIO_IOMMU_DIRTY_PAGES             _IO(VFIO_TYPE, VFIO_BASE + 17)
+
 /*
  * IOCTLs to enable/disable IOMMU container usage.
  * No parameters are supported.
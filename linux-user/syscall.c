@@ -103,6 +103,8 @@ int __clone2(int (*fn)(void *), void *child_stack_base,
 #include "uname.h"
 
 #include "qemu.h"
+#include "exec/tb-cache.h"
+#include "tcg.h"
 
 #define CLONE_NPTL_FLAGS2 (CLONE_SETTLS | \
     CLONE_PARENT_SETTID | CLONE_CHILD_SETTID | CLONE_CHILD_CLEARTID)
@@ -4664,6 +4666,14 @@ static int do_fork(CPUArchState *env, unsigned int flags, abi_ulong newsp,
         new_thread_info info;
         pthread_attr_t attr;
 
+        /* If this is our first additional thread, code translated so far
+         * assumed a single vCPU; switch to host atomics and flush it.
+         */
+        if (!parallel_cpus) {
+            parallel_cpus = true;
+            tb_flush(cpu);
+        }
+
         ts = g_new0(TaskState, 1);
         init_task_state(ts);
         /* we create a new CPU instance. */
@@ -5845,6 +5855,107 @@ static target_timer_t get_timer_id(abi_long arg)
     return timerid;
 }
 
+/* When the guest and the host use the same syscall ABI (numbers, word
+ * size, endianness and structure layouts), the syscalls listed in
+ * syscall_direct.list are handed to the host kernel without converting
+ * their arguments: guest pointers are only checked and translated.
+ */
+#if !defined(DEBUG_REMAP) && \
+    ((defined(TARGET_X86_64) && defined(__x86_64__) && !defined(__ILP32__)) || \
+     (defined(TARGET_AARCH64) && defined(__aarch64__) && \
+      !defined(TARGET_WORDS_BIGENDIAN) && !defined(HOST_WORDS_BIGENDIAN)))
+#define SYSCALL_DIRECT
+#endif
+
+#ifdef SYSCALL_DIRECT
+enum {
+    DA_KIND_VAL,
+    DA_KIND_PATH,
+    DA_KIND_IN,
+    DA_KIND_OUT,
+};
+
+typedef struct DirectArg {
+    uint8_t kind;
+    uint16_t size;
+} DirectArg;
+
+typedef struct DirectSyscall {
+    bool direct;
+    int host_nr;
+    DirectArg args[6];
+} DirectSyscall;
+
+#define DA_VAL          { DA_KIND_VAL, 0 }
+#define DA_PATH         { DA_KIND_PATH, 0 }
+#define DA_IN(type)     { DA_KIND_IN, sizeof(type) }
+#define DA_OUT(type)    { DA_KIND_OUT, sizeof(type) }
+
+#define DIRECT_SYSCALL(target_nr, nr, ...) \
+    [target_nr] = { .direct = true, .host_nr = nr, .args = { __VA_ARGS__ } },
+
+static const DirectSyscall direct_syscalls[] = {
+#include "syscall_direct.list"
+};
+
+#undef DIRECT_SYSCALL
+
+static abi_long do_direct_syscall(const DirectSyscall *ds, abi_long arg1,
+                                  abi_long arg2, abi_long arg3, abi_long arg4,
+                                  abi_long arg5, abi_long arg6)
+{
+    abi_long args[6] = { arg1, arg2, arg3, arg4, arg5, arg6 };
+    void *strings[6] = { NULL };
+    long host_args[6];
+    abi_long ret;
+    int i;
+
+    for (i = 0; i < 6; i++) {
+        const DirectArg *da = &ds->args[i];
+
+        switch (da->kind) {
+        case DA_KIND_PATH:
+            strings[i] = lock_user_string(args[i]);
+            if (!strings[i]) {
+                ret = -TARGET_EFAULT;
+                goto out;
+            }
+            host_args[i] = (long)path(strings[i]);
+            break;
+        case DA_KIND_IN:
+        case DA_KIND_OUT:
+            /* Leave NULL to the kernel, it knows which ones are optional */
+            if (!args[i]) {
+                host_args[i] = 0;
+            } else if (!access_ok(da->kind == DA_KIND_IN ? VERIFY_READ
+                                                         : VERIFY_WRITE,
+                                  args[i], da->size)) {
+                ret = -TARGET_EFAULT;
+                goto out;
+            } else {
+                host_args[i] = (long)g2h(args[i]);
+            }
+            break;
+        default:
+            host_args[i] = args[i];
+            break;
+        }
+    }
+
+    ret = get_errno(syscall(ds->host_nr, host_args[0], host_args[1],
+                            host_args[2], host_args[3], host_args[4],
+                            host_args[5]));
+
+out:
+    for (i = 0; i < 6; i++) {
+        if (strings[i]) {
+            unlock_user(strings[i], args[i], 0);
+        }
+    }
+    return ret;
+}
+#endif
+
 /* do_syscall() should always have a single exit point at the end so
    that actions, such as logging of syscall results, can be performed.
    All errnos that do_syscall() returns must be -TARGET_<errcode>. */
@@ -5865,6 +5976,15 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
     if(do_strace)
         print_syscall(num, arg1, arg2, arg3, arg4, arg5, arg6);
 
+#ifdef SYSCALL_DIRECT
+    if (num >= 0 && num < ARRAY_SIZE(direct_syscalls) &&
+        direct_syscalls[num].direct) {
+        ret = do_direct_syscall(&direct_syscalls[num],
+                                arg1, arg2, arg3, arg4, arg5, arg6);
+        goto fail;
+    }
+#endif
+
     switch(num) {
     case TARGET_NR_exit:
         /* In old applications this may be used to implement _exit(2).
@@ -5895,6 +6015,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #ifdef TARGET_GPROF
         _mcleanup();
 #endif
+        tb_cache_save();
         gdb_exit(cpu_env, arg1);
         _exit(arg1);
         ret = 0; /* avoid warning */
@@ -7829,6 +7950,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #ifdef TARGET_GPROF
         _mcleanup();
 #endif
+        tb_cache_save();
         gdb_exit(cpu_env, arg1);
         ret = get_errno(exit_group(arg1));
         break;
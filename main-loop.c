@@ -117,6 +117,9 @@ static int qemu_signal_init(void)
 static AioContext *qemu_aio_context;
 static QEMUBH *qemu_notify_bh;
 
+/* The main loop timers are accounted together with the main AioContext */
+static AioHandlerStats *main_loop_timer_stats;
+
 static void notify_event_cb(void *opaque)
 {
     /* No need to do anything; this bottom half is only used to
@@ -479,7 +482,7 @@ int main_loop_wait(int nonblocking)
 {
     int ret;
     uint32_t timeout = UINT32_MAX;
-    int64_t timeout_ns;
+    int64_t timeout_ns, start;
 
     if (nonblocking) {
         timeout = 0;
@@ -510,14 +513,18 @@ int main_loop_wait(int nonblocking)
     /* CPU thread can infinitely wait for event after
        missing the warp */
     qemu_start_warp_timer();
-    qemu_clock_run_all_timers();
+    start = aio_stats_start();
+    if (qemu_clock_run_all_timers()) {
+        aio_stats_account(qemu_aio_context, &main_loop_timer_stats,
+                          "main-loop-timers", start);
+    }
 
     return ret;
 }
 
 /* Functions to operate on the main QEMU AioContext.  */
 
-QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
+QEMUBH *qemu_bh_new_full(QEMUBHFunc *cb, void *opaque, const char *name)
 {
-    return aio_bh_new(qemu_aio_context, cb, opaque);
+    return aio_bh_new_full(qemu_aio_context, cb, opaque, name);
 }
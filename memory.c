@@ -216,7 +216,6 @@ static bool memory_region_ioeventfd_equal(MemoryRegionIoeventfd a,
 }
 
 typedef struct FlatRange FlatRange;
-typedef struct FlatView FlatView;
 
 /* Range of memory in the global map.  Addresses are absolute. */
 struct FlatRange {
@@ -237,6 +236,8 @@ struct FlatView {
     FlatRange *ranges;
     unsigned nr;
     unsigned nr_allocated;
+    /* Not a reference, the users of the tree also hold the view */
+    AddressSpaceDispatch *dispatch;
 };
 
 typedef struct AddressSpaceOps AddressSpaceOps;
@@ -259,6 +260,17 @@ static void flatview_init(FlatView *view)
     view->ranges = NULL;
     view->nr = 0;
     view->nr_allocated = 0;
+    view->dispatch = NULL;
+}
+
+AddressSpaceDispatch *flatview_get_dispatch(FlatView *view)
+{
+    return view->dispatch;
+}
+
+void flatview_set_dispatch(FlatView *view, AddressSpaceDispatch *d)
+{
+    view->dispatch = d;
 }
 
 /* Insert a range into a given position.  Caller is responsible for maintaining
@@ -289,15 +301,30 @@ static void flatview_destroy(FlatView *view)
     g_free(view);
 }
 
-static void flatview_ref(FlatView *view)
+/*
+ * Fails once the last reference is gone: readers can still see a view
+ * that several address spaces dropped, but it is on its way out.
+ */
+static bool flatview_ref(FlatView *view)
 {
-    atomic_inc(&view->ref);
+    unsigned ref = atomic_read(&view->ref);
+
+    while (ref) {
+        unsigned old = atomic_cmpxchg(&view->ref, ref, ref + 1);
+
+        if (old == ref) {
+            return true;
+        }
+        ref = old;
+    }
+    return false;
 }
 
+/* Views are shared between address spaces, so destroy them after RCU */
 static void flatview_unref(FlatView *view)
 {
     if (atomic_fetch_dec(&view->ref) == 1) {
-        flatview_destroy(view);
+        call_rcu(view, flatview_destroy, rcu);
     }
 }
 
@@ -713,6 +740,61 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     return view;
 }
 
+/*
+ * Skip the aliases and single-child containers at the top of an address
+ * space that do not change what it renders to, so that address spaces
+ * that are just a window on the same region (typically a PCI device's
+ * bus master alias of system memory) can share one FlatView.  Returns
+ * NULL if nothing is enabled.
+ */
+static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
+{
+    if (!mr || mr->addr) {
+        return mr;
+    }
+
+    while (mr->enabled) {
+        if (mr->readonly) {
+            return mr;
+        }
+        if (mr->alias) {
+            if (!mr->alias_offset && !mr->alias->addr &&
+                int128_ge(mr->size, mr->alias->size)) {
+                /* The alias is included in its entirety */
+                mr = mr->alias;
+                continue;
+            }
+        } else if (!mr->terminates) {
+            unsigned int found = 0;
+            MemoryRegion *child, *next = NULL;
+
+            QTAILQ_FOREACH(child, &mr->subregions, subregions_link) {
+                if (child->enabled) {
+                    if (++found > 1) {
+                        next = NULL;
+                        break;
+                    }
+                    if (!child->addr && int128_ge(mr->size, child->size)) {
+                        /* The only enabled child, included in its entirety */
+                        next = child;
+                    }
+                }
+            }
+            if (found == 0) {
+                return NULL;
+            }
+            if (next) {
+                mr = next;
+                continue;
+            }
+        }
+
+        return mr;
+    }
+
+    return NULL;
+}
+
 static void address_space_add_del_ioeventfds(AddressSpace *as,
                                              MemoryRegionIoeventfd *fds_new,
                                              unsigned fds_new_nb,
@@ -767,8 +849,9 @@ static FlatView *address_space_get_flatview(AddressSpace *as)
     FlatView *view;
 
     rcu_read_lock();
-    view = atomic_rcu_read(&as->current_map);
-    flatview_ref(view);
+    do {
+        view = atomic_rcu_read(&as->current_map);
+    } while (!flatview_ref(view));
     rcu_read_unlock();
     return view;
 }
@@ -875,17 +958,31 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
-static void address_space_update_topology(AddressSpace *as)
+/*
+ * @views caches the FlatViews rendered during this update by root, since
+ * many address spaces render to the same one.
+ */
+static void address_space_update_topology(AddressSpace *as,
+                                          GHashTable *views)
 {
+    MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *new_view = g_hash_table_lookup(views, physmr);
+
+    if (!new_view) {
+        new_view = generate_memory_topology(physmr);
+        g_hash_table_insert(views, physmr, new_view);
+    }
+    flatview_ref(new_view);
 
+    as->next_map = new_view;
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
+    as->next_map = NULL;
 
     /* Writes are protected by the BQL.  */
     atomic_rcu_set(&as->current_map, new_view);
-    call_rcu(old_view, flatview_unref, rcu);
+    flatview_unref(old_view);
 
     /* Note that all the old MemoryRegions are still alive up to this
      * point.  This relieves most MemoryListeners from the need to
@@ -918,13 +1015,21 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
+            GHashTable *views;
+
+            views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                          (GDestroyNotify)flatview_unref);
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_topology(as);
+                address_space_update_topology(as, views);
             }
 
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            g_hash_table_destroy(views);
+
+            /* Old FlatViews and dispatch tables can be big, free them soon */
+            call_rcu_expedite();
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -1690,7 +1795,7 @@ static void memory_region_update_coalesced_range_as(MemoryRegion *mr, AddressSpa
                 .size = fr->addr.size,
             };
 
-            MEMORY_LISTENER_CALL(coalesced_mmio_del, Reverse, &section,
+            MEMORY_LISTENER_CALL(coalesced_io_del, Reverse, &section,
                                  int128_get64(fr->addr.start),
                                  int128_get64(fr->addr.size));
             QTAILQ_FOREACH(cmr, &mr->coalesced, link) {
@@ -1701,7 +1806,7 @@ static void memory_region_update_coalesced_range_as(MemoryRegion *mr, AddressSpa
                     continue;
                 }
                 tmp = addrrange_intersection(tmp, fr->addr);
-                MEMORY_LISTENER_CALL(coalesced_mmio_add, Forward, &section,
+                MEMORY_LISTENER_CALL(coalesced_io_add, Forward, &section,
                                      int128_get64(tmp.start),
                                      int128_get64(tmp.size));
             }
@@ -2162,6 +2267,7 @@ static void listener_add_address_space(MemoryListener *listener,
     }
 
     view = address_space_get_flatview(as);
+    as->next_map = view;
     FOR_EACH_FLAT_RANGE(fr, view) {
         MemoryRegionSection section = {
             .mr = fr->mr,
@@ -2178,6 +2284,7 @@ static void listener_add_address_space(MemoryListener *listener,
             listener->region_add(listener, &section);
         }
     }
+    as->next_map = NULL;
     if (listener->commit) {
         listener->commit(listener);
     }
@@ -2276,9 +2383,13 @@ void address_space_destroy(AddressSpace *as)
     if (as->ref_count) {
         return;
     }
-    /* Flush out anything from MemoryListeners listening in on this */
+    /* Flush out anything from MemoryListeners listening in on this.  This
+     * also makes sure that no other address space keeps using a dispatch
+     * tree built for this one.
+     */
     memory_region_transaction_begin();
     as->root = NULL;
+    memory_region_update_pending = true;
     memory_region_transaction_commit();
     QTAILQ_REMOVE(&address_spaces, as, address_spaces_link);
     address_space_unregister(as);
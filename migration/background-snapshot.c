@@ -0,0 +1,342 @@
+/*
+ * Background snapshots: write-protection of RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * A background snapshot saves RAM while the guest runs, but as it was when
+ * the snapshot started: all of RAM is write-protected with userfaultfd, a
+ * write to a page that is not saved yet blocks until the migration thread
+ * has saved it, and each page is unprotected once saved.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "migration/background-snapshot.h"
+#include "sysemu/balloon.h"
+#include "qemu/error-report.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "trace.h"
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <asm/types.h> /* for __u64 */
+#endif
+
+#if defined(__linux__) && defined(__NR_userfaultfd) && defined(CONFIG_EVENTFD)
+#include <sys/eventfd.h>
+#include <linux/userfaultfd.h>
+
+static struct {
+    MigrationState *ms;
+    int userfault_fd;
+    /* To tell the fault thread to quit */
+    int quit_fd;
+    QemuThread fault_thread;
+    bool have_fault_thread;
+} bg_snapshot = {
+    .userfault_fd = -1,
+    .quit_fd = -1,
+};
+
+static int bg_snapshot_open_ufd(void)
+{
+    struct uffdio_api api_struct;
+    int ufd;
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (ufd == -1) {
+        return -1;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+    if (ioctl(ufd, UFFDIO_API, &api_struct) ||
+        !(api_struct.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+        close(ufd);
+        return -1;
+    }
+
+    return ufd;
+}
+
+bool background_snapshot_supported_by_host(void)
+{
+    long pagesize = getpagesize();
+    struct uffdio_register reg_struct;
+    void *testarea;
+    bool ret = false;
+    int ufd;
+
+    ufd = bg_snapshot_open_ufd();
+    if (ufd == -1) {
+        error_report("%s: userfaultfd write-protection not available",
+                     __func__);
+        return false;
+    }
+
+    testarea = mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                                    MAP_ANONYMOUS, -1, 0);
+    if (testarea == MAP_FAILED) {
+        error_report("%s: Failed to map test area: %s", __func__,
+                     strerror(errno));
+        close(ufd);
+        return false;
+    }
+
+    reg_struct.range.start = (uintptr_t)testarea;
+    reg_struct.range.len = pagesize;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(ufd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("%s: userfault register: %s", __func__, strerror(errno));
+    } else if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_WRITEPROTECT))) {
+        error_report("%s: anonymous memory cannot be write-protected",
+                     __func__);
+    } else {
+        ret = true;
+    }
+
+    munmap(testarea, pagesize);
+    close(ufd);
+    return ret;
+}
+
+static int bg_snapshot_change_protection(void *host, size_t length, bool wp)
+{
+    struct uffdio_writeprotect wp_struct;
+
+    wp_struct.range.start = (uintptr_t)host;
+    wp_struct.range.len = length;
+    /* Removing the protection also wakes up the writers */
+    wp_struct.mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+
+    if (ioctl(bg_snapshot.userfault_fd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        error_report("%s: %s host: %p length: %zu", __func__,
+                     strerror(errno), host, length);
+        return -errno;
+    }
+
+    return 0;
+}
+
+static int populate_range(const char *block_name, void *host_addr,
+                          ram_addr_t offset, ram_addr_t length, void *opaque)
+{
+    long pagesize = getpagesize();
+    volatile uint8_t *p = host_addr;
+    ram_addr_t i;
+
+    for (i = 0; i < length; i += pagesize) {
+        (void)p[i];
+    }
+
+    return 0;
+}
+
+void background_snapshot_prepare(void)
+{
+    qemu_ram_foreach_block(populate_range, NULL);
+}
+
+static int protect_range(const char *block_name, void *host_addr,
+                         ram_addr_t offset, ram_addr_t length, void *opaque)
+{
+    struct uffdio_register reg_struct;
+
+    trace_background_snapshot_protect_range(block_name, host_addr, length);
+
+    reg_struct.range.start = (uintptr_t)host_addr;
+    reg_struct.range.len = length;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_WP;
+
+    if (ioctl(bg_snapshot.userfault_fd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("%s userfault register: %s", __func__, strerror(errno));
+        return -1;
+    }
+
+    return bg_snapshot_change_protection(host_addr, length, true);
+}
+
+static int unprotect_range(const char *block_name, void *host_addr,
+                           ram_addr_t offset, ram_addr_t length, void *opaque)
+{
+    struct uffdio_range range_struct;
+
+    bg_snapshot_change_protection(host_addr, length, false);
+
+    range_struct.start = (uintptr_t)host_addr;
+    range_struct.len = length;
+    if (ioctl(bg_snapshot.userfault_fd, UFFDIO_UNREGISTER, &range_struct)) {
+        error_report("%s: userfault unregister %s", __func__, strerror(errno));
+    }
+
+    return 0;
+}
+
+/*
+ * Queue the pages the guest writes to, so that the migration thread saves
+ * them next.
+ */
+static void *bg_snapshot_fault_thread(void *opaque)
+{
+    size_t hostpagesize = getpagesize();
+    struct uffd_msg msg;
+    int ret;
+
+    rcu_register_thread();
+
+    while (true) {
+        ram_addr_t rb_offset;
+        ram_addr_t in_raspace;
+        struct pollfd pfd[2];
+        RAMBlock *rb;
+
+        pfd[0].fd = bg_snapshot.userfault_fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = bg_snapshot.quit_fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: userfault poll: %s", __func__, strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        ret = read(bg_snapshot.userfault_fd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && errno == EAGAIN) {
+                continue;
+            }
+            error_report("%s: Failed to read userfault message", __func__);
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT ||
+            !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+            continue;
+        }
+
+        rb = qemu_ram_block_from_host(
+                 (void *)(uintptr_t)msg.arg.pagefault.address,
+                 true, &in_raspace, &rb_offset);
+        if (!rb) {
+            error_report("%s: Fault outside guest: %" PRIx64, __func__,
+                         (uint64_t)msg.arg.pagefault.address);
+            break;
+        }
+
+        rb_offset &= ~(hostpagesize - 1);
+        trace_background_snapshot_fault(qemu_ram_get_idstr(rb), rb_offset);
+        ram_save_queue_pages(bg_snapshot.ms, qemu_ram_get_idstr(rb),
+                             rb_offset, hostpagesize);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+int background_snapshot_protect(MigrationState *ms)
+{
+    bg_snapshot.ms = ms;
+    bg_snapshot.userfault_fd = bg_snapshot_open_ufd();
+    if (bg_snapshot.userfault_fd == -1) {
+        error_report("%s: Failed to open userfault fd", __func__);
+        return -1;
+    }
+    bg_snapshot.quit_fd = eventfd(0, EFD_CLOEXEC);
+    if (bg_snapshot.quit_fd == -1) {
+        error_report("%s: Opening quit fd: %s", __func__, strerror(errno));
+        return -1;
+    }
+
+    /* A page the balloon discards would not be write-protected anymore */
+    qemu_balloon_inhibit(true);
+
+    if (qemu_ram_foreach_block(protect_range, NULL)) {
+        return -1;
+    }
+
+    qemu_thread_create(&bg_snapshot.fault_thread, "snapshot/fault",
+                       bg_snapshot_fault_thread, NULL, QEMU_THREAD_JOINABLE);
+    bg_snapshot.have_fault_thread = true;
+
+    return 0;
+}
+
+void background_snapshot_unprotect(void *host, size_t length)
+{
+    bg_snapshot_change_protection(host, length, false);
+}
+
+void background_snapshot_cleanup(void)
+{
+    uint64_t tmp64 = 1;
+
+    if (bg_snapshot.userfault_fd == -1) {
+        return;
+    }
+
+    qemu_ram_foreach_block(unprotect_range, NULL);
+
+    if (bg_snapshot.have_fault_thread) {
+        if (write(bg_snapshot.quit_fd, &tmp64, 8) == 8) {
+            qemu_thread_join(&bg_snapshot.fault_thread);
+        } else {
+            error_report("%s: incrementing quit fd: %s", __func__,
+                         strerror(errno));
+        }
+        bg_snapshot.have_fault_thread = false;
+    }
+    if (bg_snapshot.quit_fd != -1) {
+        close(bg_snapshot.quit_fd);
+        bg_snapshot.quit_fd = -1;
+    }
+    close(bg_snapshot.userfault_fd);
+    bg_snapshot.userfault_fd = -1;
+
+    qemu_balloon_inhibit(false);
+}
+
+#else
+/* No target OS support, stubs just fail */
+bool background_snapshot_supported_by_host(void)
+{
+    error_report("%s: No OS support", __func__);
+    return false;
+}
+
+void background_snapshot_prepare(void)
+{
+}
+
+int background_snapshot_protect(MigrationState *ms)
+{
+    assert(0);
+    return -1;
+}
+
+void background_snapshot_unprotect(void *host, size_t length)
+{
+    assert(0);
+}
+
+void background_snapshot_cleanup(void)
+{
+}
+
+#endif
@@ -0,0 +1,528 @@
+/*
+ * Block dirty bitmap migration
+ *
+ * Copyright (c) 2016 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The named dirty bitmaps of the block devices are sent when the source VM
+ * is stopped, so that their content is final.  With postcopy-ram this
+ * happens after the destination has started: the destination creates each
+ * bitmap as soon as the setup section arrives, freezes it and records the
+ * guest writes in its successor, and merges the two once the content has
+ * been received.  Without postcopy the bitmaps are sent during the downtime,
+ * skipping the chunks that have no dirty bit.
+ *
+ * Only the bitmaps that exist when the migration starts are migrated; a
+ * bitmap that is released or replaced in the meantime is dropped on the
+ * destination as well.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "block/block.h"
+#include "block/dirty-bitmap.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/queue.h"
+#include "migration/block.h"
+#include "migration/migration.h"
+#include "sysemu/block-backend.h"
+#include "trace.h"
+
+#define DIRTY_BITMAP_MIG_FLAG_EOS       0x01
+#define DIRTY_BITMAP_MIG_FLAG_START     0x02
+#define DIRTY_BITMAP_MIG_FLAG_BITS      0x04
+#define DIRTY_BITMAP_MIG_FLAG_COMPLETE  0x08
+#define DIRTY_BITMAP_MIG_FLAG_DROP      0x10
+
+/* Bytes of serialized bitmap sent at a time */
+#define DIRTY_BITMAP_MIG_CHUNK_SIZE     (64 * 1024)
+
+typedef struct DirtyBitmapMigBitmapState {
+    /* Written during setup phase.  */
+    BlockDriverState *bs;
+    char *node_name;
+    char *name;
+    uint32_t id;
+    uint32_t granularity;
+    int64_t total_sectors;
+    int64_t sectors_per_chunk;
+
+    /* Only used by migration thread.  */
+    int64_t cur_sector;
+    bool completed;
+
+    QSIMPLEQ_ENTRY(DirtyBitmapMigBitmapState) entry;
+} DirtyBitmapMigBitmapState;
+
+typedef struct DirtyBitmapMigState {
+    QSIMPLEQ_HEAD(dbms_list, DirtyBitmapMigBitmapState) dbms_list;
+    uint8_t *buf;
+} DirtyBitmapMigState;
+
+typedef struct DirtyBitmapLoadBitmapState {
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    int64_t total_sectors;
+} DirtyBitmapLoadBitmapState;
+
+static DirtyBitmapMigState dirty_bitmap_mig_state;
+
+/* Bitmaps being received, indexed by the id chosen by the source */
+static GPtrArray *dirty_bitmap_load_bitmaps;
+
+static void put_name(QEMUFile *f, const char *name)
+{
+    int len = strlen(name);
+
+    assert(len < 256);
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (const uint8_t *)name, len);
+}
+
+static void get_name(QEMUFile *f, char *name)
+{
+    int len = qemu_get_byte(f);
+
+    qemu_get_buffer(f, (uint8_t *)name, len);
+    name[len] = '\0';
+}
+
+/* Called with iothread lock taken.  */
+static void init_dirty_bitmap_migration(QEMUFile *f)
+{
+    DirtyBitmapMigState *s = &dirty_bitmap_mig_state;
+    DirtyBitmapMigBitmapState *dbms;
+    BdrvDirtyBitmap *bitmap;
+    BlockDriverState *bs;
+    const char *node_name;
+    uint32_t id = 0;
+
+    for (bs = bdrv_next(NULL); bs; bs = bdrv_next(bs)) {
+        node_name = bdrv_get_device_or_node_name(bs);
+        if (!node_name[0] || strlen(node_name) > 255) {
+            continue;
+        }
+
+        for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+             bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+            const char *name = bdrv_dirty_bitmap_name(bitmap);
+
+            if (!name || strlen(name) > 255) {
+                continue;
+            }
+            if (bdrv_dirty_bitmap_frozen(bitmap)) {
+                error_report("Dirty bitmap '%s' of '%s' is in use by a job "
+                             "and will not be migrated", name, node_name);
+                continue;
+            }
+
+            dbms = g_new0(DirtyBitmapMigBitmapState, 1);
+            dbms->bs = bs;
+            dbms->node_name = g_strdup(node_name);
+            dbms->name = g_strdup(name);
+            dbms->id = id++;
+            dbms->granularity = bdrv_dirty_bitmap_granularity(bitmap);
+            dbms->total_sectors = bdrv_dirty_bitmap_size(bitmap);
+            dbms->sectors_per_chunk = (int64_t)DIRTY_BITMAP_MIG_CHUNK_SIZE *
+                8 * (dbms->granularity >> BDRV_SECTOR_BITS);
+            bdrv_ref(bs);
+
+            qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_START);
+            qemu_put_be32(f, dbms->id);
+            put_name(f, dbms->node_name);
+            put_name(f, dbms->name);
+            qemu_put_be32(f, dbms->granularity);
+            qemu_put_be64(f, dbms->total_sectors);
+            qemu_put_byte(f, bdrv_dirty_bitmap_enabled(bitmap));
+
+            trace_dirty_bitmap_save_start(dbms->node_name, dbms->name,
+                                          dbms->id);
+            QSIMPLEQ_INSERT_TAIL(&s->dbms_list, dbms, entry);
+        }
+    }
+}
+
+/* Returns the bitmap of @dbms if it is still the one that was announced.
+ * Called with iothread lock taken.
+ */
+static BdrvDirtyBitmap *dirty_bitmap_mig_lookup(
+    DirtyBitmapMigBitmapState *dbms)
+{
+    BdrvDirtyBitmap *bitmap = bdrv_find_dirty_bitmap(dbms->bs, dbms->name);
+
+    if (!bitmap || bdrv_dirty_bitmap_frozen(bitmap) ||
+        bdrv_dirty_bitmap_granularity(bitmap) != dbms->granularity ||
+        bdrv_dirty_bitmap_size(bitmap) != dbms->total_sectors) {
+        return NULL;
+    }
+    return bitmap;
+}
+
+/* Sends the next chunk of @dbms that has dirty bits, or the completion
+ * record if there is none left.  Called with iothread lock taken.
+ */
+static void send_bitmap_chunk(QEMUFile *f, DirtyBitmapMigBitmapState *dbms)
+{
+    uint8_t *buf = dirty_bitmap_mig_state.buf;
+    BdrvDirtyBitmap *bitmap = dirty_bitmap_mig_lookup(dbms);
+    int64_t nr_sectors;
+    uint64_t size;
+
+    if (!bitmap) {
+        trace_dirty_bitmap_save_drop(dbms->node_name, dbms->name);
+        qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_DROP);
+        qemu_put_be32(f, dbms->id);
+        dbms->completed = true;
+        return;
+    }
+
+    while (dbms->cur_sector < dbms->total_sectors) {
+        nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
+                         dbms->sectors_per_chunk);
+        size = bdrv_dirty_bitmap_serialization_size(bitmap, dbms->cur_sector,
+                                                    nr_sectors);
+        assert(size <= DIRTY_BITMAP_MIG_CHUNK_SIZE);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, dbms->cur_sector,
+                                         nr_sectors);
+        dbms->cur_sector += nr_sectors;
+
+        /* The destination starts from an empty bitmap */
+        if (!buffer_is_zero(buf, size)) {
+            qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_BITS);
+            qemu_put_be32(f, dbms->id);
+            qemu_put_be64(f, dbms->cur_sector - nr_sectors);
+            qemu_put_be64(f, nr_sectors);
+            qemu_put_be64(f, size);
+            qemu_put_buffer(f, buf, size);
+            return;
+        }
+    }
+
+    trace_dirty_bitmap_save_complete(dbms->node_name, dbms->name);
+    qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_COMPLETE);
+    qemu_put_be32(f, dbms->id);
+    dbms->completed = true;
+}
+
+/* Returns true when all the bitmaps have been sent.  */
+static bool send_bitmap_chunks(QEMUFile *f, bool complete)
+{
+    DirtyBitmapMigBitmapState *dbms;
+
+    QSIMPLEQ_FOREACH(dbms, &dirty_bitmap_mig_state.dbms_list, entry) {
+        while (!dbms->completed) {
+            if (!complete && qemu_file_rate_limit(f)) {
+                return false;
+            }
+            send_bitmap_chunk(f, dbms);
+        }
+    }
+    return true;
+}
+
+static void dirty_bitmap_mig_cleanup(void *opaque)
+{
+    DirtyBitmapMigState *s = &dirty_bitmap_mig_state;
+    DirtyBitmapMigBitmapState *dbms;
+
+    while ((dbms = QSIMPLEQ_FIRST(&s->dbms_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&s->dbms_list, entry);
+        bdrv_unref(dbms->bs);
+        g_free(dbms->node_name);
+        g_free(dbms->name);
+        g_free(dbms);
+    }
+
+    g_free(s->buf);
+    s->buf = NULL;
+}
+
+static int dirty_bitmap_save_setup(QEMUFile *f, void *opaque)
+{
+    DirtyBitmapMigState *s = &dirty_bitmap_mig_state;
+
+    s->buf = g_malloc(DIRTY_BITMAP_MIG_CHUNK_SIZE);
+
+    qemu_mutex_lock_iothread();
+    init_dirty_bitmap_migration(f);
+    qemu_mutex_unlock_iothread();
+
+    qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+    return 0;
+}
+
+/* The content is only final once the source is stopped, so nothing is
+ * sent here before postcopy.
+ */
+static int dirty_bitmap_save_iterate(QEMUFile *f, void *opaque)
+{
+    bool done = true;
+
+    if (migration_in_postcopy(migrate_get_current())) {
+        qemu_mutex_lock_iothread();
+        done = send_bitmap_chunks(f, false);
+        qemu_mutex_unlock_iothread();
+    }
+
+    qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+    return done;
+}
+
+/* Called with iothread lock taken.  */
+static int dirty_bitmap_save_complete_precopy(QEMUFile *f, void *opaque)
+{
+    send_bitmap_chunks(f, true);
+    qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+    return 0;
+}
+
+static int dirty_bitmap_save_complete_postcopy(QEMUFile *f, void *opaque)
+{
+    qemu_mutex_lock_iothread();
+    send_bitmap_chunks(f, true);
+    qemu_mutex_unlock_iothread();
+
+    qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+    return 0;
+}
+
+static void dirty_bitmap_save_pending(QEMUFile *f, void *opaque,
+                                      uint64_t max_size,
+                                      uint64_t *non_postcopiable_pending,
+                                      uint64_t *postcopiable_pending)
+{
+    DirtyBitmapMigBitmapState *dbms;
+    uint64_t pending = 0;
+
+    QSIMPLEQ_FOREACH(dbms, &dirty_bitmap_mig_state.dbms_list, entry) {
+        int64_t sectors_per_byte = (dbms->granularity >> BDRV_SECTOR_BITS) * 8;
+
+        if (!dbms->completed) {
+            pending += DIV_ROUND_UP(dbms->total_sectors - dbms->cur_sector,
+                                    sectors_per_byte);
+        }
+    }
+
+    trace_dirty_bitmap_save_pending(pending, max_size);
+    if (migrate_postcopy_ram()) {
+        *postcopiable_pending += pending;
+    } else {
+        *non_postcopiable_pending += pending;
+    }
+}
+
+static DirtyBitmapLoadBitmapState *dirty_bitmap_load_get(uint32_t id)
+{
+    if (!dirty_bitmap_load_bitmaps || id >= dirty_bitmap_load_bitmaps->len) {
+        return NULL;
+    }
+    return g_ptr_array_index(dirty_bitmap_load_bitmaps, id);
+}
+
+static int dirty_bitmap_load_start(QEMUFile *f, uint32_t id)
+{
+    DirtyBitmapLoadBitmapState *dbls;
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    Error *local_err = NULL;
+    char node_name[256];
+    char name[256];
+    uint32_t granularity;
+    int64_t total_sectors;
+    bool enabled;
+
+    get_name(f, node_name);
+    get_name(f, name);
+    granularity = qemu_get_be32(f);
+    total_sectors = qemu_get_be64(f);
+    enabled = qemu_get_byte(f);
+
+    if (id == 0) {
+        if (dirty_bitmap_load_bitmaps) {
+            g_ptr_array_free(dirty_bitmap_load_bitmaps, true);
+        }
+        dirty_bitmap_load_bitmaps = g_ptr_array_new_with_free_func(g_free);
+    }
+    if (!dirty_bitmap_load_bitmaps || id != dirty_bitmap_load_bitmaps->len) {
+        error_report("Unexpected dirty bitmap id %" PRIu32, id);
+        return -EINVAL;
+    }
+
+    bs = bdrv_lookup_bs(node_name, node_name, &local_err);
+    if (!bs) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+    if (granularity < BDRV_SECTOR_SIZE ||
+        (granularity & (granularity - 1)) != 0) {
+        error_report("Invalid granularity %" PRIu32 " for dirty bitmap '%s'",
+                     granularity, name);
+        return -EINVAL;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, &local_err);
+    if (!bitmap) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+    if (bdrv_dirty_bitmap_size(bitmap) != total_sectors) {
+        error_report("Size mismatch for dirty bitmap '%s' of '%s'",
+                     name, node_name);
+        bdrv_release_dirty_bitmap(bs, bitmap);
+        return -EINVAL;
+    }
+    if (!enabled) {
+        bdrv_disable_dirty_bitmap(bitmap);
+    }
+
+    /* Guest writes go to the successor until the content has arrived */
+    if (bdrv_dirty_bitmap_create_successor(bs, bitmap, &local_err) < 0) {
+        error_report_err(local_err);
+        bdrv_release_dirty_bitmap(bs, bitmap);
+        return -EINVAL;
+    }
+
+    dbls = g_new0(DirtyBitmapLoadBitmapState, 1);
+    dbls->bs = bs;
+    dbls->bitmap = bitmap;
+    dbls->total_sectors = total_sectors;
+    g_ptr_array_add(dirty_bitmap_load_bitmaps, dbls);
+
+    trace_dirty_bitmap_load_start(node_name, name, id);
+    return 0;
+}
+
+static int dirty_bitmap_load_bits(QEMUFile *f,
+                                  DirtyBitmapLoadBitmapState *dbls)
+{
+    uint64_t start = qemu_get_be64(f);
+    uint64_t nr_sectors = qemu_get_be64(f);
+    uint64_t size = qemu_get_be64(f);
+    uint8_t *buf;
+
+    if (start >= dbls->total_sectors ||
+        start % bdrv_dirty_bitmap_serialization_align(dbls->bitmap) ||
+        nr_sectors > dbls->total_sectors - start ||
+        size != bdrv_dirty_bitmap_serialization_size(dbls->bitmap, start,
+                                                     nr_sectors)) {
+        error_report("Invalid chunk for dirty bitmap '%s'",
+                     bdrv_dirty_bitmap_name(dbls->bitmap));
+        return -EINVAL;
+    }
+
+    buf = g_malloc(size);
+    qemu_get_buffer(f, buf, size);
+    bdrv_dirty_bitmap_deserialize_part(dbls->bitmap, buf, start, nr_sectors,
+                                       false);
+    g_free(buf);
+    return 0;
+}
+
+static void dirty_bitmap_load_complete(DirtyBitmapLoadBitmapState *dbls)
+{
+    bdrv_dirty_bitmap_deserialize_finish(dbls->bitmap);
+    bdrv_reclaim_dirty_bitmap(dbls->bs, dbls->bitmap, &error_abort);
+}
+
+static void dirty_bitmap_load_drop(DirtyBitmapLoadBitmapState *dbls)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = bdrv_reclaim_dirty_bitmap(dbls->bs, dbls->bitmap, &error_abort);
+    bdrv_release_dirty_bitmap(dbls->bs, bitmap);
+}
+
+static int dirty_bitmap_load_one(QEMUFile *f, int flags)
+{
+    DirtyBitmapLoadBitmapState *dbls;
+    uint32_t id = qemu_get_be32(f);
+
+    if (flags & DIRTY_BITMAP_MIG_FLAG_START) {
+        return dirty_bitmap_load_start(f, id);
+    }
+
+    dbls = dirty_bitmap_load_get(id);
+    if (!dbls || !dbls->bitmap) {
+        error_report("Unknown dirty bitmap id %" PRIu32, id);
+        return -EINVAL;
+    }
+
+    if (flags & DIRTY_BITMAP_MIG_FLAG_BITS) {
+        return dirty_bitmap_load_bits(f, dbls);
+    }
+
+    if (flags & DIRTY_BITMAP_MIG_FLAG_COMPLETE) {
+        trace_dirty_bitmap_load_complete(bdrv_dirty_bitmap_name(dbls->bitmap));
+        dirty_bitmap_load_complete(dbls);
+    } else {
+        trace_dirty_bitmap_load_drop(bdrv_dirty_bitmap_name(dbls->bitmap));
+        dirty_bitmap_load_drop(dbls);
+    }
+    dbls->bitmap = NULL;
+    return 0;
+}
+
+static int dirty_bitmap_load(QEMUFile *f, void *opaque, int version_id)
+{
+    /* In postcopy this runs in the listen thread, next to the guest */
+    bool locked = qemu_mutex_iothread_locked();
+    int flags;
+    int ret = 0;
+
+    if (version_id != 1) {
+        return -EINVAL;
+    }
+
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    do {
+        flags = qemu_get_byte(f);
+
+        if (flags & (DIRTY_BITMAP_MIG_FLAG_START | DIRTY_BITMAP_MIG_FLAG_BITS |
+                     DIRTY_BITMAP_MIG_FLAG_COMPLETE |
+                     DIRTY_BITMAP_MIG_FLAG_DROP)) {
+            ret = dirty_bitmap_load_one(f, flags);
+        } else if (flags != DIRTY_BITMAP_MIG_FLAG_EOS) {
+            error_report("Unknown dirty bitmap migration flags: %#x", flags);
+            ret = -EINVAL;
+        }
+        if (!ret) {
+            ret = qemu_file_get_error(f);
+        }
+    } while (!ret && flags != DIRTY_BITMAP_MIG_FLAG_EOS);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+
+    return ret;
+}
+
+static bool dirty_bitmap_is_active(void *opaque)
+{
+    return migrate_dirty_bitmaps();
+}
+
+static SaveVMHandlers savevm_dirty_bitmap_handlers = {
+    .save_live_setup = dirty_bitmap_save_setup,
+    .save_live_iterate = dirty_bitmap_save_iterate,
+    .save_live_complete_precopy = dirty_bitmap_save_complete_precopy,
+    .save_live_complete_postcopy = dirty_bitmap_save_complete_postcopy,
+    .save_live_pending = dirty_bitmap_save_pending,
+    .load_state = dirty_bitmap_load,
+    .cleanup = dirty_bitmap_mig_cleanup,
+    .is_active = dirty_bitmap_is_active,
+};
+
+void dirty_bitmap_mig_init(void)
+{
+    QSIMPLEQ_INIT(&dirty_bitmap_mig_state.dbms_list);
+
+    register_savevm_live(NULL, "dirty-bitmap", 0, 1,
+                         &savevm_dirty_bitmap_handlers,
+                         &dirty_bitmap_mig_state);
+}
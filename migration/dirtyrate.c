@@ -0,0 +1,294 @@
+/*
+ * Dirty page rate estimation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The rate is estimated without dirty logging, so that it can be measured
+ * at any time without affecting a migration or the guest: a random sample
+ * of the pages of each RAMBlock is hashed at the start and at the end of
+ * the measurement, and the share of pages whose hash changed is
+ * extrapolated to the whole RAMBlock.  A page written several times only
+ * counts once, so the result is a lower bound for short measurements.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "exec/ram_addr.h"
+#include "migration/migration.h"
+#include "qmp-commands.h"
+#include "trace.h"
+
+#define DIRTYRATE_MAX_CALC_TIME         60
+#define DIRTYRATE_MIN_SAMPLE_PAGES      128
+#define DIRTYRATE_MAX_SAMPLE_PAGES      4096
+#define DIRTYRATE_DEFAULT_SAMPLE_PAGES  512
+
+/* Bound on the number of iterations of a predicted migration */
+#define DIRTYRATE_MAX_ITERATIONS        100
+
+typedef struct DirtyRateBlock {
+    char idstr[256];
+    uint64_t size;
+    unsigned int nb_samples;
+    uint64_t *offsets;
+    uint32_t *hashes;
+    int64_t dirty_rate;
+} DirtyRateBlock;
+
+static struct {
+    /* Written by the measuring thread, everything else by the monitor */
+    int status;
+    int64_t calc_time;
+    int64_t sample_pages;
+    QemuThread thread;
+    bool have_thread;
+    DirtyRateBlock *blocks;
+    int nb_blocks;
+    int64_t dirty_rate;
+} dirty_rate_state;
+
+static uint32_t dirty_rate_hash_page(RAMBlock *block, uint64_t offset)
+{
+    return crc32(0, block->host + offset, TARGET_PAGE_SIZE);
+}
+
+/*
+ * Picks and hashes the sample pages.
+ * Called within an RCU critical section.
+ */
+static void dirty_rate_sample_blocks(void)
+{
+    RAMBlock *block;
+    int n = 0, i;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        n++;
+    }
+    dirty_rate_state.blocks = g_new0(DirtyRateBlock, n);
+
+    n = 0;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        DirtyRateBlock *b = &dirty_rate_state.blocks[n];
+        uint64_t nb_pages = block->used_length >> TARGET_PAGE_BITS;
+
+        if (!nb_pages || !block->host) {
+            continue;
+        }
+        n++;
+
+        pstrcpy(b->idstr, sizeof(b->idstr), block->idstr);
+        b->size = block->used_length;
+        b->nb_samples = MAX(1, dirty_rate_state.sample_pages *
+                               block->used_length >> 30);
+        b->nb_samples = MIN(b->nb_samples, nb_pages);
+        b->offsets = g_new(uint64_t, b->nb_samples);
+        b->hashes = g_new(uint32_t, b->nb_samples);
+
+        for (i = 0; i < b->nb_samples; i++) {
+            uint64_t r = (uint64_t)g_random_int() << 32 | g_random_int();
+
+            b->offsets[i] = (r % nb_pages) << TARGET_PAGE_BITS;
+            b->hashes[i] = dirty_rate_hash_page(block, b->offsets[i]);
+        }
+    }
+    dirty_rate_state.nb_blocks = n;
+}
+
+/*
+ * Compares the sample pages with their hashes and computes the dirty
+ * rates, given the @elapsed_ms since they were hashed.  Called within an
+ * RCU critical section.
+ */
+static void dirty_rate_compare_blocks(int64_t elapsed_ms)
+{
+    int64_t total = 0;
+    int n, i;
+
+    for (n = 0; n < dirty_rate_state.nb_blocks; n++) {
+        DirtyRateBlock *b = &dirty_rate_state.blocks[n];
+        RAMBlock *block = qemu_ram_block_by_name(b->idstr);
+        uint64_t dirty = 0;
+
+        if (!block || !block->host || block->used_length != b->size) {
+            b->dirty_rate = -1;
+            continue;
+        }
+
+        for (i = 0; i < b->nb_samples; i++) {
+            if (dirty_rate_hash_page(block, b->offsets[i]) != b->hashes[i]) {
+                dirty++;
+            }
+        }
+
+        b->dirty_rate = (double)dirty * (b->size >> TARGET_PAGE_BITS) /
+                        b->nb_samples * 1000 / MAX(elapsed_ms, 1);
+        total += b->dirty_rate;
+    }
+
+    dirty_rate_state.dirty_rate = total;
+}
+
+static void *dirty_rate_thread(void *opaque)
+{
+    int64_t start;
+
+    rcu_register_thread();
+
+    rcu_read_lock();
+    start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    dirty_rate_sample_blocks();
+    rcu_read_unlock();
+
+    g_usleep(dirty_rate_state.calc_time * G_USEC_PER_SEC);
+
+    rcu_read_lock();
+    dirty_rate_compare_blocks(qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start);
+    rcu_read_unlock();
+
+    trace_dirty_rate_measured(dirty_rate_state.dirty_rate);
+    atomic_mb_set(&dirty_rate_state.status, DIRTY_RATE_STATUS_MEASURED);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void dirty_rate_free_blocks(void)
+{
+    int n;
+
+    for (n = 0; n < dirty_rate_state.nb_blocks; n++) {
+        g_free(dirty_rate_state.blocks[n].offsets);
+        g_free(dirty_rate_state.blocks[n].hashes);
+    }
+    g_free(dirty_rate_state.blocks);
+    dirty_rate_state.blocks = NULL;
+    dirty_rate_state.nb_blocks = 0;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    if (atomic_mb_read(&dirty_rate_state.status) ==
+        DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "A dirty rate measurement is already in progress");
+        return;
+    }
+    if (calc_time < 1 || calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, "Parameter 'calc-time' expects a value between 1 "
+                   "and %d", DIRTYRATE_MAX_CALC_TIME);
+        return;
+    }
+    if (!has_sample_pages) {
+        sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < DIRTYRATE_MIN_SAMPLE_PAGES ||
+               sample_pages > DIRTYRATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, "Parameter 'sample-pages' expects a value between "
+                   "%d and %d", DIRTYRATE_MIN_SAMPLE_PAGES,
+                   DIRTYRATE_MAX_SAMPLE_PAGES);
+        return;
+    }
+
+    if (dirty_rate_state.have_thread) {
+        qemu_thread_join(&dirty_rate_state.thread);
+        dirty_rate_state.have_thread = false;
+    }
+    dirty_rate_free_blocks();
+
+    dirty_rate_state.calc_time = calc_time;
+    dirty_rate_state.sample_pages = sample_pages;
+    dirty_rate_state.dirty_rate = 0;
+    atomic_mb_set(&dirty_rate_state.status, DIRTY_RATE_STATUS_MEASURING);
+
+    qemu_thread_create(&dirty_rate_state.thread, "dirtyrate",
+                       dirty_rate_thread, NULL, QEMU_THREAD_JOINABLE);
+    dirty_rate_state.have_thread = true;
+}
+
+/*
+ * Predicts a precopy migration of all RAM at @bandwidth bytes/s: every
+ * iteration sends the pages dirtied during the previous one, until they
+ * can be sent within the downtime limit.
+ */
+static void dirty_rate_predict(DirtyRateInfo *info, int64_t bandwidth)
+{
+    double dirty_bytes_rate = (double)dirty_rate_state.dirty_rate *
+                              TARGET_PAGE_SIZE;
+    double limit = (double)bandwidth * migrate_max_downtime() / 1e9;
+    double total = 0, remaining, time = 0;
+    int n, i;
+
+    for (n = 0; n < dirty_rate_state.nb_blocks; n++) {
+        total += dirty_rate_state.blocks[n].size;
+    }
+
+    info->has_converges = true;
+    info->converges = false;
+    remaining = total;
+    for (i = 0; i < DIRTYRATE_MAX_ITERATIONS; i++) {
+        double pass = remaining / bandwidth;
+
+        if (remaining <= limit) {
+            info->converges = true;
+            info->has_expected_total_time = true;
+            info->expected_total_time = (time + pass) * 1000;
+            info->has_expected_downtime = true;
+            info->expected_downtime = pass * 1000;
+            return;
+        }
+        time += pass;
+        remaining = MIN(total, dirty_bytes_rate * pass);
+    }
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(bool has_bandwidth, int64_t bandwidth,
+                                    Error **errp)
+{
+    DirtyRateInfo *info;
+    RamBlockDirtyRateList *head = NULL, **tail = &head;
+    int n;
+
+    if (has_bandwidth && bandwidth <= 0) {
+        error_setg(errp, "Parameter 'bandwidth' expects a positive value");
+        return NULL;
+    }
+
+    info = g_new0(DirtyRateInfo, 1);
+    info->status = atomic_mb_read(&dirty_rate_state.status);
+    info->calc_time = dirty_rate_state.calc_time;
+    info->sample_pages = dirty_rate_state.sample_pages;
+    info->page_size = TARGET_PAGE_SIZE;
+
+    if (info->status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirty_rate_state.dirty_rate;
+
+    for (n = 0; n < dirty_rate_state.nb_blocks; n++) {
+        DirtyRateBlock *b = &dirty_rate_state.blocks[n];
+        RamBlockDirtyRateList *entry = g_new0(RamBlockDirtyRateList, 1);
+
+        entry->value = g_new0(RamBlockDirtyRate, 1);
+        entry->value->id_str = g_strdup(b->idstr);
+        entry->value->size = b->size;
+        entry->value->dirty_rate = b->dirty_rate;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    info->has_blocks = true;
+    info->blocks = head;
+
+    if (has_bandwidth) {
+        dirty_rate_predict(info, bandwidth);
+    }
+
+    return info;
+}
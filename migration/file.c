@@ -0,0 +1,304 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The migration stream is written to the file like with the fd: transport.
+ * With the x-mapped-ram capability the RAM pages are not part of the stream:
+ * each page has a fixed offset in the file (see ram.c), so the pages are
+ * read and written by a pool of threads, in any order, with O_DIRECT if
+ * x-direct-io is enabled.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+
+/* O_DIRECT requests must be aligned on the logical block size of the disk */
+#define FILE_PAGES_DIRECT_ALIGN 4096
+
+/* Bound on the queued requests per thread, to bound memory usage */
+#define FILE_PAGES_MAX_PENDING  64
+
+typedef struct FilePagesReq {
+    void *host;
+    size_t len;
+    off_t offset;
+    QSIMPLEQ_ENTRY(FilePagesReq) next;
+} FilePagesReq;
+
+static char *file_migration_path;
+
+static struct {
+    int fd;
+    /* -1 unless x-direct-io is enabled */
+    int direct_fd;
+    bool write;
+    QemuThread *threads;
+    int nb_threads;
+    QemuMutex lock;
+    /* signalled when requests are queued, or to quit */
+    QemuCond work_cond;
+    /* signalled whenever a request completes */
+    QemuCond done_cond;
+    QSIMPLEQ_HEAD(, FilePagesReq) reqs;
+    /* queued or in progress */
+    int pending;
+    /* first error, as -errno */
+    int error;
+    bool quit;
+} file_pages;
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    int fd;
+
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+    g_free(file_migration_path);
+    file_migration_path = g_strdup(path);
+
+    s->to_dst_file = qemu_fdopen(fd, "wb");
+    migrate_fd_connect(s);
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler(qemu_get_fd(f), NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+void file_start_incoming_migration(const char *path, Error **errp)
+{
+    QEMUFile *f;
+    int fd;
+
+    fd = qemu_open(path, O_RDONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+    g_free(file_migration_path);
+    file_migration_path = g_strdup(path);
+
+    f = qemu_fdopen(fd, "rb");
+    qemu_set_fd_handler(fd, file_accept_incoming_migration, NULL, f);
+}
+
+static int file_pages_do_io(FilePagesReq *req)
+{
+    uint8_t *host = req->host;
+    size_t done = 0;
+    ssize_t len;
+    int fd = file_pages.direct_fd;
+
+    if (((uintptr_t)req->host | req->len | req->offset) &
+        (FILE_PAGES_DIRECT_ALIGN - 1)) {
+        fd = -1;
+    }
+    if (fd < 0) {
+        fd = file_pages.fd;
+    }
+
+    while (done < req->len) {
+        if (file_pages.write) {
+            len = pwrite(fd, host + done, req->len - done, req->offset + done);
+        } else {
+            len = pread(fd, host + done, req->len - done, req->offset + done);
+        }
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && fd == file_pages.direct_fd) {
+                /* The file system wants a larger alignment for O_DIRECT */
+                fd = file_pages.fd;
+                continue;
+            }
+            return -errno;
+        }
+        if (len == 0) {
+            return -EIO;
+        }
+        done += len;
+    }
+    return 0;
+}
+
+static void *file_pages_thread(void *opaque)
+{
+    FilePagesReq *req;
+    int ret;
+
+    qemu_mutex_lock(&file_pages.lock);
+    while (true) {
+        while (!file_pages.quit && QSIMPLEQ_EMPTY(&file_pages.reqs)) {
+            qemu_cond_wait(&file_pages.work_cond, &file_pages.lock);
+        }
+        if (file_pages.quit) {
+            break;
+        }
+        req = QSIMPLEQ_FIRST(&file_pages.reqs);
+        QSIMPLEQ_REMOVE_HEAD(&file_pages.reqs, next);
+        qemu_mutex_unlock(&file_pages.lock);
+
+        ret = file_pages_do_io(req);
+        g_free(req);
+
+        qemu_mutex_lock(&file_pages.lock);
+        if (ret < 0 && !file_pages.error) {
+            file_pages.error = ret;
+        }
+        file_pages.pending--;
+        qemu_cond_broadcast(&file_pages.done_cond);
+    }
+    qemu_mutex_unlock(&file_pages.lock);
+
+    return NULL;
+}
+
+/*
+ * Starts the threads that read (@write false) or write the pages of a
+ * file: migration whose stream is @f.
+ */
+int file_pages_start(QEMUFile *f, bool write)
+{
+    int i;
+
+    file_pages.fd = qemu_get_fd(f);
+    if (file_pages.fd < 0 || !file_migration_path) {
+        return -EINVAL;
+    }
+    file_pages.direct_fd = -1;
+#ifdef O_DIRECT
+    if (migrate_use_direct_io()) {
+        file_pages.direct_fd = qemu_open(file_migration_path,
+                                         (write ? O_WRONLY : O_RDONLY) |
+                                         O_DIRECT);
+        if (file_pages.direct_fd < 0) {
+            int ret = -errno;
+
+            error_report("failed to open '%s' with O_DIRECT: %s",
+                         file_migration_path, strerror(-ret));
+            return ret;
+        }
+    }
+#endif
+    file_pages.write = write;
+    file_pages.pending = 0;
+    file_pages.error = 0;
+    file_pages.quit = false;
+    QSIMPLEQ_INIT(&file_pages.reqs);
+    qemu_mutex_init(&file_pages.lock);
+    qemu_cond_init(&file_pages.work_cond);
+    qemu_cond_init(&file_pages.done_cond);
+
+    file_pages.nb_threads = migrate_multifd_channels();
+    file_pages.threads = g_new0(QemuThread, file_pages.nb_threads);
+    for (i = 0; i < file_pages.nb_threads; i++) {
+        qemu_thread_create(&file_pages.threads[i], "file pages",
+                           file_pages_thread, NULL, QEMU_THREAD_JOINABLE);
+    }
+    return 0;
+}
+
+/*
+ * Queues the transfer of @len bytes at @host from or to @offset in the
+ * file.  The memory must stay valid until file_pages_flush().
+ */
+void file_pages_queue(void *host, size_t len, off_t offset)
+{
+    FilePagesReq *req = g_new(FilePagesReq, 1);
+
+    req->host = host;
+    req->len = len;
+    req->offset = offset;
+
+    qemu_mutex_lock(&file_pages.lock);
+    while (file_pages.pending >=
+           FILE_PAGES_MAX_PENDING * file_pages.nb_threads) {
+        qemu_cond_wait(&file_pages.done_cond, &file_pages.lock);
+    }
+    QSIMPLEQ_INSERT_TAIL(&file_pages.reqs, req, next);
+    file_pages.pending++;
+    qemu_cond_signal(&file_pages.work_cond);
+    qemu_mutex_unlock(&file_pages.lock);
+}
+
+/*
+ * Waits for the queued transfers.  Returns 0, or -errno if any of them
+ * failed since the threads were started.
+ */
+int file_pages_flush(void)
+{
+    int ret;
+
+    qemu_mutex_lock(&file_pages.lock);
+    while (file_pages.pending) {
+        qemu_cond_wait(&file_pages.done_cond, &file_pages.lock);
+    }
+    ret = file_pages.error;
+    qemu_mutex_unlock(&file_pages.lock);
+
+    return ret;
+}
+
+/*
+ * Opens the file of the incoming migration again, for reads of pages after
+ * the stream is closed.  Returns a file descriptor or -errno.
+ */
+int file_pages_open(void)
+{
+    int fd;
+
+    if (!file_migration_path) {
+        return -EINVAL;
+    }
+    fd = qemu_open(file_migration_path, O_RDONLY);
+    return fd < 0 ? -errno : fd;
+}
+
+void file_pages_stop(void)
+{
+    FilePagesReq *req;
+    int i;
+
+    if (!file_pages.threads) {
+        return;
+    }
+
+    qemu_mutex_lock(&file_pages.lock);
+    file_pages.quit = true;
+    qemu_cond_broadcast(&file_pages.work_cond);
+    qemu_mutex_unlock(&file_pages.lock);
+
+    for (i = 0; i < file_pages.nb_threads; i++) {
+        qemu_thread_join(&file_pages.threads[i]);
+    }
+    while ((req = QSIMPLEQ_FIRST(&file_pages.reqs))) {
+        QSIMPLEQ_REMOVE_HEAD(&file_pages.reqs, next);
+        g_free(req);
+    }
+    g_free(file_pages.threads);
+    file_pages.threads = NULL;
+
+    if (file_pages.direct_fd >= 0) {
+        qemu_close(file_pages.direct_fd);
+        file_pages.direct_fd = -1;
+    }
+    qemu_mutex_destroy(&file_pages.lock);
+    qemu_cond_destroy(&file_pages.work_cond);
+    qemu_cond_destroy(&file_pages.done_cond);
+}
@@ -27,6 +27,7 @@
 #include "qemu/rcu.h"
 #include "migration/block.h"
 #include "migration/postcopy-ram.h"
+#include "migration/background-snapshot.h"
 #include "qemu/thread.h"
 #include "qmp-commands.h"
 #include "trace.h"
@@ -34,6 +35,7 @@
 #include "qom/cpu.h"
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
+#include "sysemu/stats.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
 
@@ -42,6 +44,9 @@
 #define BUFFER_DELAY     100
 #define XFER_LIMIT_RATIO (1000 / BUFFER_DELAY)
 
+/* How often to check whether the guest has ejected failover devices */
+#define UNPLUG_POLL_MS   100
+
 /* Default compression thread count */
 #define DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT 8
 /* Default decompression thread count, usually decompression is at
@@ -52,6 +57,8 @@
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT 10
+/* Default number of additional connections for RAM pages with x-multifd */
+#define DEFAULT_MIGRATE_X_MULTIFD_CHANNELS 2
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -91,6 +98,8 @@ MigrationState *migrate_get_current(void)
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL,
         .parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT,
+        .parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                DEFAULT_MIGRATE_X_MULTIFD_CHANNELS,
     };
 
     if (!once) {
@@ -122,6 +131,7 @@ MigrationIncomingState *migration_incoming_state_new(QEMUFile* f)
 
 void migration_incoming_state_destroy(void)
 {
+    ram_postcopy_preempt_recv_cleanup(NULL);
     qemu_event_destroy(&mis_current->main_thread_load_event);
     loadvm_free_handlers(mis_current);
     g_free(mis_current);
@@ -301,6 +311,12 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p;
 
+    if (migrate_mapped_ram() && !strstart(uri, "file:", NULL) &&
+        strcmp(uri, "defer")) {
+        error_setg(errp, "x-mapped-ram can only be used with file: URIs");
+        return;
+    }
+
     qapi_event_send_migration(MIGRATION_STATUS_SETUP, &error_abort);
     if (!strcmp(uri, "defer")) {
         deferred_incoming_migration(errp);
@@ -317,6 +333,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
 #endif
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
@@ -335,6 +353,7 @@ static void process_incoming_migration_bh(void *opaque)
                           MIGRATION_STATUS_FAILED);
         error_report_err(local_err);
         migrate_decompress_threads_join();
+        migrate_multifd_recv_threads_join();
         exit(EXIT_FAILURE);
     }
 
@@ -359,6 +378,7 @@ static void process_incoming_migration_bh(void *opaque)
         runstate_set(global_state_get_runstate());
     }
     migrate_decompress_threads_join();
+    migrate_multifd_recv_threads_join();
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
@@ -367,7 +387,9 @@ static void process_incoming_migration_bh(void *opaque)
     migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
                       MIGRATION_STATUS_COMPLETED);
     qemu_bh_delete(mis->bh);
-    migration_incoming_state_destroy();
+    if (!ram_lazy_restore_keep_mis()) {
+        migration_incoming_state_destroy();
+    }
 }
 
 static void process_incoming_migration_co(void *opaque)
@@ -412,6 +434,7 @@ static void process_incoming_migration_co(void *opaque)
                           MIGRATION_STATUS_FAILED);
         error_report("load of migration failed: %s", strerror(-ret));
         migrate_decompress_threads_join();
+        migrate_multifd_recv_threads_join();
         exit(EXIT_FAILURE);
     }
 
@@ -525,6 +548,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
     params->x_cpu_throttle_increment =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    params->x_multifd_channels =
+            s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
 
     return params;
 }
@@ -547,6 +572,27 @@ static bool migration_is_setup_or_active(int state)
     }
 }
 
+static void migration_stats_collect(StatsSampler *stats, void *opaque)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state != MIGRATION_STATUS_ACTIVE &&
+        s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        return;
+    }
+
+    stats_add(stats, ram_bytes_transferred(), "ram.transferred");
+    stats_add(stats, ram_bytes_remaining(), "ram.remaining");
+    stats_add(stats, ram_bytes_total(), "ram.total");
+    stats_add(stats, s->dirty_pages_rate, "ram.dirty-pages-rate");
+    stats_add(stats, s->dirty_sync_count, "ram.dirty-sync-count");
+}
+
+static void __attribute__((constructor)) migration_stats_init(void)
+{
+    stats_register_provider("migration", migration_stats_collect, NULL);
+}
+
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
     if (migrate_use_xbzrle()) {
@@ -682,6 +728,17 @@ MigrationInfo *qmp_query_migrate(Error **errp)
     return info;
 }
 
+MigrationTelemetry *qmp_query_migrate_telemetry(Error **errp)
+{
+    MigrationTelemetry *info = g_new0(MigrationTelemetry, 1);
+
+    info->iterations = ram_get_iteration_stats();
+    info->blocks = ram_get_block_stats();
+    info->devices = qemu_savevm_get_save_times();
+
+    return info;
+}
+
 void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                                   Error **errp)
 {
@@ -710,6 +767,119 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_postcopy_preempt() && !migrate_postcopy_ram()) {
+        error_report("x-postcopy-preempt requires postcopy-ram");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_PREEMPT] =
+            false;
+    }
+
+#ifndef CONFIG_ZSTD
+    if (migrate_use_compression_zstd()) {
+        error_report("x-compress-zstd is not supported by this build");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_COMPRESS_ZSTD] = false;
+    }
+#endif
+
+    if (migrate_use_multifd()) {
+        /* The multifd channels write into RAM without atomic copies, and
+         * the pages they carry are neither compressed nor XBZRLE encoded.
+         */
+        if (migrate_postcopy_ram() || migrate_use_compression() ||
+            migrate_use_xbzrle()) {
+            error_report("x-multifd is not currently compatible with "
+                         "postcopy-ram, compression or xbzrle");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD] = false;
+        }
+    }
+
+    if (migrate_mapped_ram()) {
+        /* The pages are read from the file directly into RAM, outside of
+         * the stream that carries compressed or XBZRLE encoded pages.
+         */
+        if (migrate_postcopy_ram() || migrate_use_compression() ||
+            migrate_use_xbzrle() || migrate_use_multifd()) {
+            error_report("x-mapped-ram is not currently compatible with "
+                         "postcopy-ram, compression, xbzrle or x-multifd");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM] = false;
+        }
+    }
+
+    if (migrate_use_direct_io()) {
+#ifdef O_DIRECT
+        if (!migrate_mapped_ram()) {
+            error_report("x-direct-io requires x-mapped-ram");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_DIRECT_IO] = false;
+        }
+#else
+        error_report("x-direct-io is not supported on this host");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_DIRECT_IO] = false;
+#endif
+    }
+
+    if (migrate_lazy_restore()) {
+        if (!migrate_mapped_ram()) {
+            error_report("x-lazy-restore requires x-mapped-ram");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_LAZY_RESTORE] =
+                false;
+        } else if (!postcopy_ram_supported_by_host()) {
+            error_report("x-lazy-restore is not supported on this host");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_LAZY_RESTORE] =
+                false;
+        }
+    }
+
+    if (migrate_use_zero_copy_send()) {
+        if (!migrate_use_multifd()) {
+            error_report("x-zero-copy-send requires x-multifd");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND] =
+                false;
+        } else if (!tcp_zerocopy_supported()) {
+            error_report("x-zero-copy-send is not supported on this host");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND] =
+                false;
+        }
+    }
+
+    if (migrate_background_snapshot()) {
+        /* Every page is saved once, as a plain page, from the migration
+         * thread, so that it can be unprotected right after.
+         */
+        if (migrate_postcopy_ram() || migrate_use_compression() ||
+            migrate_use_xbzrle() || migrate_use_multifd() ||
+            migrate_mapped_ram()) {
+            error_report("x-background-snapshot is not currently compatible "
+                         "with postcopy-ram, compression, xbzrle, x-multifd "
+                         "or x-mapped-ram");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_BACKGROUND_SNAPSHOT]
+                = false;
+        } else if (migrate_dirty_bitmaps()) {
+            /* The bitmaps would be saved as of the end */
+            error_report("x-background-snapshot is not compatible with "
+                         "x-dirty-bitmaps");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_BACKGROUND_SNAPSHOT]
+                = false;
+        } else if (!background_snapshot_supported_by_host()) {
+            error_report("x-background-snapshot is not supported on this "
+                         "host");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_BACKGROUND_SNAPSHOT]
+                = false;
+        }
+    }
+
+    if (migrate_ignore_shared()) {
+        /* These would discard, write out or write-protect the shared
+         * blocks, whose pages are never sent.
+         */
+        if (migrate_postcopy_ram() || migrate_mapped_ram() ||
+            migrate_background_snapshot()) {
+            error_report("x-ignore-shared is not compatible with "
+                         "postcopy-ram, x-mapped-ram or "
+                         "x-background-snapshot");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED] =
+                false;
+        }
+    }
 }
 
 void qmp_migrate_set_parameters(bool has_compress_level,
@@ -721,7 +891,9 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 bool has_x_cpu_throttle_initial,
                                 int64_t x_cpu_throttle_initial,
                                 bool has_x_cpu_throttle_increment,
-                                int64_t x_cpu_throttle_increment, Error **errp)
+                                int64_t x_cpu_throttle_increment,
+                                bool has_x_multifd_channels,
+                                int64_t x_multifd_channels, Error **errp)
 {
     MigrationState *s = migrate_get_current();
 
@@ -756,6 +928,17 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "x_cpu_throttle_increment",
                    "an integer in the range of 1 to 99");
     }
+    if (has_x_multifd_channels &&
+            (x_multifd_channels < 1 || x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_multifd_channels && migration_is_setup_or_active(s->state)) {
+        error_setg(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
 
     if (has_compress_level) {
         s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
@@ -776,6 +959,10 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                                                     x_cpu_throttle_increment;
     }
+    if (has_x_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                                                    x_multifd_channels;
+    }
 }
 
 void qmp_migrate_start_postcopy(Error **errp)
@@ -829,6 +1016,11 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_mutex_lock_iothread();
 
         migrate_compress_threads_join();
+        migrate_multifd_send_threads_join();
+        if (s->postcopy_preempt_file) {
+            qemu_fclose(s->postcopy_preempt_file);
+            s->postcopy_preempt_file = NULL;
+        }
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
     }
@@ -881,6 +1073,10 @@ static void migrate_fd_cancel(MigrationState *s)
      */
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
+        migrate_multifd_send_threads_shutdown();
+        if (s->postcopy_preempt_file) {
+            qemu_file_shutdown(s->postcopy_preempt_file);
+        }
     }
 }
 
@@ -948,10 +1144,14 @@ MigrationState *migrate_init(const MigrationParams *params)
     s->postcopy_after_devices = false;
     s->migration_thread_running = false;
     s->last_req_rb = NULL;
+    g_free(s->multifd_host_port);
+    s->multifd_host_port = NULL;
 
     migrate_set_state(&s->state, MIGRATION_STATUS_NONE, MIGRATION_STATUS_SETUP);
 
     QSIMPLEQ_INIT(&s->src_page_requests);
+    QSIMPLEQ_INIT(&s->src_page_prefetch);
+    s->postcopy_preempt_file = NULL;
 
     s->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     return s;
@@ -1023,6 +1223,21 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_multifd() && !strstart(uri, "tcp:", NULL)) {
+        error_setg(errp, "x-multifd can only be used with tcp: URIs");
+        return;
+    }
+
+    if (migrate_postcopy_preempt() && !strstart(uri, "tcp:", NULL)) {
+        error_setg(errp, "x-postcopy-preempt can only be used with tcp: URIs");
+        return;
+    }
+
+    if (migrate_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "x-mapped-ram can only be used with file: URIs");
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -1038,6 +1253,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
@@ -1128,6 +1345,15 @@ bool migrate_postcopy_ram(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_PREEMPT];
+}
+
 bool migrate_auto_converge(void)
 {
     MigrationState *s;
@@ -1155,6 +1381,15 @@ bool migrate_use_compression(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
 }
 
+bool migrate_use_compression_zstd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_COMPRESS_ZSTD];
+}
+
 int migrate_compress_level(void)
 {
     MigrationState *s;
@@ -1182,6 +1417,87 @@ int migrate_decompress_threads(void)
     return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM];
+}
+
+bool migrate_use_direct_io(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_DIRECT_IO];
+}
+
+bool migrate_lazy_restore(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_LAZY_RESTORE];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_dirty_bitmaps(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_DIRTY_BITMAPS];
+}
+
+bool migrate_ignore_shared(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -1540,6 +1856,74 @@ fail:
     return -1;
 }
 
+/*
+ * Starts a background snapshot: the VM only stops while the state of the
+ * devices is saved and RAM is write-protected, RAM is saved afterwards
+ * with the VM running.
+ */
+static int background_snapshot_start(MigrationState *s)
+{
+    int64_t time_at_stop;
+    bool was_running;
+    QEMUFile *fb;
+    int ret;
+
+    /* Faulting in the pages can take a while, do it with the VM running */
+    background_snapshot_prepare();
+
+    qemu_mutex_lock_iothread();
+    time_at_stop = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    was_running = runstate_is_running();
+    ret = global_state_store();
+    if (!ret && was_running) {
+        ret = vm_stop(RUN_STATE_SAVE_VM);
+    }
+    if (ret >= 0) {
+        fb = qemu_bufopen("w", NULL);
+        if (!fb) {
+            ret = -ENOMEM;
+        } else {
+            s->background_snapshot_devices = fb;
+            qemu_savevm_state_complete_precopy_non_iterable(fb, false);
+            ret = qemu_file_get_error(fb);
+        }
+    }
+    if (ret >= 0) {
+        ret = background_snapshot_protect(s);
+    }
+    if (was_running) {
+        vm_start();
+    }
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - time_at_stop;
+    qemu_mutex_unlock_iothread();
+
+    trace_background_snapshot_start(ret, s->downtime);
+    return ret;
+}
+
+/*
+ * Completes a background snapshot: saves the rest of RAM, with the VM
+ * still running, and appends the device state.  Called without the
+ * iothread lock, which a vCPU or device blocked on a write-protected page
+ * may hold.
+ */
+static void background_snapshot_complete(MigrationState *s)
+{
+    const QEMUSizedBuffer *qsb;
+    uint8_t *buf;
+    size_t len;
+
+    qemu_savevm_state_complete_precopy(s->to_dst_file, true);
+
+    qsb = qemu_buf_get(s->background_snapshot_devices);
+    len = qsb_get_length(qsb);
+    buf = g_malloc(len);
+    qsb_get_buffer(qsb, 0, len, buf);
+    qemu_put_buffer(s->to_dst_file, buf, len);
+    g_free(buf);
+    qemu_fflush(s->to_dst_file);
+}
+
 /**
  * migration_completion: Used by migration_thread when there's not much left.
  *   The caller 'breaks' the loop when this returns.
@@ -1555,7 +1939,9 @@ static void migration_completion(MigrationState *s, int current_active_state,
 {
     int ret;
 
-    if (s->state == MIGRATION_STATUS_ACTIVE) {
+    if (migrate_background_snapshot()) {
+        background_snapshot_complete(s);
+    } else if (s->state == MIGRATION_STATUS_ACTIVE) {
         qemu_mutex_lock_iothread();
         *start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
@@ -1655,6 +2041,26 @@ static void *migration_thread(void *opaque)
 
     qemu_savevm_state_begin(s->to_dst_file, &s->params);
 
+    /* Wait for the guest to eject the devices that are unplugged instead */
+    while (s->state == MIGRATION_STATUS_SETUP) {
+        bool pending;
+
+        qemu_mutex_lock_iothread();
+        pending = qemu_savevm_state_guest_unplug_pending();
+        qemu_mutex_unlock_iothread();
+        if (!pending) {
+            break;
+        }
+        trace_migration_thread_wait_unplug();
+        g_usleep(UNPLUG_POLL_MS * 1000);
+    }
+
+    if (migrate_background_snapshot() && background_snapshot_start(s) < 0) {
+        error_report("Failed to start the background snapshot");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+    }
+
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
     current_active_state = MIGRATION_STATUS_ACTIVE;
     migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
@@ -1740,19 +2146,30 @@ static void *migration_thread(void *opaque)
     cpu_throttle_stop();
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
+    if (migrate_background_snapshot()) {
+        /* Before taking the lock, which a blocked writer may hold */
+        background_snapshot_cleanup();
+        if (s->background_snapshot_devices) {
+            qemu_fclose(s->background_snapshot_devices);
+            s->background_snapshot_devices = NULL;
+        }
+    }
+
     qemu_mutex_lock_iothread();
     qemu_savevm_state_cleanup();
     if (s->state == MIGRATION_STATUS_COMPLETED) {
         uint64_t transferred_bytes = qemu_ftell(s->to_dst_file);
         s->total_time = end_time - s->total_time;
-        if (!entered_postcopy) {
+        if (!entered_postcopy && !migrate_background_snapshot()) {
             s->downtime = end_time - start_time;
         }
         if (s->total_time) {
             s->mbps = (((double) transferred_bytes * 8.0) /
                        ((double) s->total_time)) / 1000;
         }
-        runstate_set(RUN_STATE_POSTMIGRATE);
+        if (!migrate_background_snapshot()) {
+            runstate_set(RUN_STATE_POSTMIGRATE);
+        }
     } else {
         if (old_vm_running && !entered_postcopy) {
             vm_start();
@@ -1791,6 +2208,22 @@ void migrate_fd_connect(MigrationState *s)
         }
     }
 
+    if (migrate_multifd_send_threads_create(s)) {
+        error_report("Unable to open multifd channels");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+
+    if (migrate_postcopy_preempt_channel_create(s)) {
+        error_report("Unable to open postcopy preempt channel");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+
     migrate_compress_threads_create();
     qemu_thread_create(&s->thread, "migration", migration_thread, s,
                        QEMU_THREAD_JOINABLE);
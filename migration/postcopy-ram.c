@@ -279,6 +279,39 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    /* The preempt thread places pages until the source ends the channel */
+    ram_postcopy_preempt_recv_cleanup(mis);
+
+    if (postcopy_ram_disable_notify(mis)) {
+        return -1;
+    }
+
+    if (enable_mlock) {
+        if (os_mlock() < 0) {
+            error_report("mlock: %s", strerror(errno));
+            /*
+             * It doesn't feel right to fail at this point, we have a valid
+             * VM state.
+             */
+        }
+    }
+
+    postcopy_state_set(POSTCOPY_INCOMING_END);
+    migrate_send_rp_shut(mis, qemu_file_get_error(mis->from_src_file) != 0);
+
+    if (mis->postcopy_tmp_page) {
+        munmap(mis->postcopy_tmp_page, getpagesize());
+        mis->postcopy_tmp_page = NULL;
+    }
+    trace_postcopy_ram_incoming_cleanup_exit();
+    return 0;
+}
+
+/*
+ * Undo postcopy_ram_enable_notify, once all the pages have been placed.
+ */
+int postcopy_ram_disable_notify(MigrationIncomingState *mis)
+{
     if (mis->have_fault_thread) {
         uint64_t tmp64;
 
@@ -306,24 +339,6 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 
     qemu_balloon_inhibit(false);
 
-    if (enable_mlock) {
-        if (os_mlock() < 0) {
-            error_report("mlock: %s", strerror(errno));
-            /*
-             * It doesn't feel right to fail at this point, we have a valid
-             * VM state.
-             */
-        }
-    }
-
-    postcopy_state_set(POSTCOPY_INCOMING_END);
-    migrate_send_rp_shut(mis, qemu_file_get_error(mis->from_src_file) != 0);
-
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, getpagesize());
-        mis->postcopy_tmp_page = NULL;
-    }
-    trace_postcopy_ram_incoming_cleanup_exit();
     return 0;
 }
 
@@ -471,6 +486,14 @@ static void *postcopy_ram_fault_thread(void *opaque)
                                                 qemu_ram_get_idstr(rb),
                                                 rb_offset);
 
+        if (mis->lazy_restore) {
+            /* There is no source, the page is in the file */
+            if (ram_lazy_restore_fault(mis, rb, rb_offset)) {
+                break;
+            }
+            continue;
+        }
+
         /*
          * Send the request to the source - we want to request one
          * of our host page sizes (which is >= TPS)
@@ -655,6 +678,12 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
     return -1;
 }
 
+int postcopy_ram_disable_notify(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
+
 int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
 {
     assert(0);
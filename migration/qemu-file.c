@@ -22,7 +22,6 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
-#include <zlib.h>
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
@@ -535,6 +534,56 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Returns the offset in the underlying file of the next byte that @f reads
+ * or writes, or -errno if @f is not backed by a seekable file.  Unlike
+ * qemu_ftell(), this is not affected by qemu_file_update_transfer().
+ */
+int64_t qemu_file_get_offset(QEMUFile *f)
+{
+    int fd = qemu_get_fd(f);
+    off_t offset;
+
+    if (fd < 0) {
+        return -EINVAL;
+    }
+    qemu_fflush(f);
+    offset = lseek(fd, 0, SEEK_CUR);
+    if (offset < 0) {
+        return -errno;
+    }
+    if (!qemu_file_is_writable(f)) {
+        offset -= f->buf_size - f->buf_index;
+    }
+    return offset;
+}
+
+/*
+ * Moves @f, which must be backed by a seekable file, to @offset in the
+ * file; data buffered for reading is dropped.  On failure the error is
+ * also set on @f.
+ */
+int qemu_file_set_offset(QEMUFile *f, int64_t offset)
+{
+    int fd = qemu_get_fd(f);
+    int ret = 0;
+
+    if (fd < 0) {
+        ret = -EINVAL;
+    } else {
+        qemu_fflush(f);
+        if (lseek(fd, offset, SEEK_SET) < 0) {
+            ret = -errno;
+        }
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
@@ -561,6 +610,16 @@ void qemu_file_reset_rate_limit(QEMUFile *f)
     f->bytes_xfer = 0;
 }
 
+/*
+ * Account for @size bytes that were sent on behalf of @f through another
+ * channel, so that they count against the rate limit and position of @f.
+ */
+void qemu_file_update_transfer(QEMUFile *f, size_t size)
+{
+    f->bytes_xfer += size;
+    f->pos += size;
+}
+
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
     qemu_put_byte(f, v >> 8);
@@ -607,44 +666,6 @@ uint64_t qemu_get_be64(QEMUFile *f)
     return v;
 }
 
-/* compress size bytes of data start at p with specific compression
- * level and store the compressed data to the buffer of f.
- */
-
-ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level)
-{
-    ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
-
-    if (blen < compressBound(size)) {
-        return 0;
-    }
-    if (compress2(f->buf + f->buf_index + sizeof(int32_t), (uLongf *)&blen,
-                  (Bytef *)p, size, level) != Z_OK) {
-        error_report("Compress Failed!");
-        return 0;
-    }
-    qemu_put_be32(f, blen);
-    f->buf_index += blen;
-    return blen + sizeof(int32_t);
-}
-
-/* Put the data in the buffer of f_src to the buffer of f_des, and
- * then reset the buf_index of f_src to 0.
- */
-
-int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src)
-{
-    int len = 0;
-
-    if (f_src->buf_index > 0) {
-        len = f_src->buf_index;
-        qemu_put_buffer(f_des, f_src->buf, f_src->buf_index);
-        f_src->buf_index = 0;
-    }
-    return len;
-}
-
 /*
  * Get a string whose length is determined by a single preceding byte
  * A preallocated 256 byte buffer must be passed in.
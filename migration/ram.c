@@ -27,6 +27,9 @@
  */
 #include "qemu/osdep.h"
 #include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
 #include "qapi-event.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
@@ -34,12 +37,14 @@
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
 #include "migration/postcopy-ram.h"
+#include "migration/background-snapshot.h"
 #include "exec/address-spaces.h"
 #include "migration/page_cache.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
+#include "sysemu/kvm.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -65,12 +70,16 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
+
+/* Size of the aligned window sent after each postcopy page request */
+#define POSTCOPY_PREFETCH_SIZE (64 * 1024)
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
-    return buffer_find_nonzero_offset(p, size) == size;
+    return buffer_is_zero(p, size);
 }
 
 /* struct contains XBZRLE cache and a static page
@@ -249,146 +258,664 @@ static struct BitmapRcu {
     unsigned long *unsentmap;
 } *migration_bitmap_rcu;
 
-struct CompressParam {
-    bool start;
-    bool done;
-    QEMUFile *file;
-    QemuMutex mutex;
-    QemuCond cond;
+/* Multi-threaded compression: the migration thread hands the pages to the
+ * compression threads in batches of COMPRESS_BATCH_PAGES pages of one
+ * RAMBlock.  Each thread has a ring of COMPRESS_RING_SIZE batches; the
+ * migration thread fills the batch at 'head', the thread compresses the
+ * batches before 'head' and advances 'tail', and the migration thread sends
+ * the compressed batches before 'tail'.  Each index is written by a single
+ * thread, so a semaphore post per batch is the only synchronization needed.
+ * The load side uses the same scheme to decompress pages.
+ */
+#define COMPRESS_BATCH_PAGES    32
+#define COMPRESS_RING_SIZE      4
+
+/* Largest page header: offset, idstr length and idstr, compressed length */
+#define COMPRESS_PAGE_HEADER_MAX (8 + 1 + 255 + 4)
+
+typedef struct CompressCtx {
+    bool zstd;
+    bool ready;
+    int level;
+    z_stream zstream;
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zstd_cctx;
+    ZSTD_DCtx *zstd_dctx;
+#endif
+} CompressCtx;
+
+typedef struct CompressBatch {
     RAMBlock *block;
-    ram_addr_t offset;
+    int nb_pages;
+    /* with RAM_SAVE_FLAG_CONTINUE */
+    ram_addr_t offsets[COMPRESS_BATCH_PAGES];
+    /* the pages ready to be sent, headers included */
+    uint8_t *out;
+    size_t out_len;
+} CompressBatch;
+
+struct CompressParam {
+    QemuThread thread;
+    /* posted for each batch to compress */
+    QemuSemaphore sem;
+    CompressCtx ctx;
+    CompressBatch ring[COMPRESS_RING_SIZE];
+    /* written by the migration thread */
+    unsigned int head;
+    /* written by the compression thread */
+    unsigned int tail;
+    /* next batch to send, only used by the migration thread */
+    unsigned int sent;
 };
 typedef struct CompressParam CompressParam;
 
-struct DecompressParam {
-    bool start;
-    QemuMutex mutex;
-    QemuCond cond;
-    void *des;
+typedef struct DecompressBatch {
+    int nb_pages;
+    void *des[COMPRESS_BATCH_PAGES];
+    int len[COMPRESS_BATCH_PAGES];
+    /* page i is at compbuf + i * page_compress_bound() */
     uint8_t *compbuf;
-    int len;
+} DecompressBatch;
+
+struct DecompressParam {
+    QemuThread thread;
+    /* posted for each batch to decompress */
+    QemuSemaphore sem;
+    CompressCtx ctx;
+    DecompressBatch ring[COMPRESS_RING_SIZE];
+    /* written by the loading thread */
+    unsigned int head;
+    /* written by the decompression thread */
+    unsigned int tail;
 };
 typedef struct DecompressParam DecompressParam;
 
 static CompressParam *comp_param;
-static QemuThread *compress_threads;
-/* comp_done_cond is used to wake up the migration thread when
- * one of the compression threads has finished the compression.
- * comp_done_lock is used to co-work with comp_done_cond.
- */
-static QemuMutex *comp_done_lock;
-static QemuCond *comp_done_cond;
-/* The empty QEMUFileOps will be used by file in CompressParam */
-static const QEMUFileOps empty_ops = { };
+static int comp_thread_count;
+/* the thread whose batch is being filled */
+static int comp_next;
+/* posted by the compression threads whenever they finish a batch */
+static QemuSemaphore comp_done_sem;
+/* compresses the first page of each block in the migration thread */
+static CompressCtx comp_main_ctx;
+static uint8_t *comp_main_buf;
 
 static bool compression_switch;
 static bool quit_comp_thread;
 static bool quit_decomp_thread;
 static DecompressParam *decomp_param;
-static QemuThread *decompress_threads;
+static int decomp_thread_count;
+static int decomp_next;
+static QemuSemaphore decomp_done_sem;
 
-static int do_compress_ram_page(CompressParam *param);
-
-static void *do_data_compress(void *opaque)
+/* Largest size of a compressed page */
+static size_t page_compress_bound(void)
 {
-    CompressParam *param = opaque;
+    size_t bound = compressBound(TARGET_PAGE_SIZE);
 
-    while (!quit_comp_thread) {
-        qemu_mutex_lock(&param->mutex);
-        /* Re-check the quit_comp_thread in case of
-         * terminate_compression_threads is called just before
-         * qemu_mutex_lock(&param->mutex) and after
-         * while(!quit_comp_thread), re-check it here can make
-         * sure the compression thread terminate as expected.
-         */
-        while (!param->start && !quit_comp_thread) {
-            qemu_cond_wait(&param->cond, &param->mutex);
+#ifdef CONFIG_ZSTD
+    bound = MAX(bound, ZSTD_compressBound(TARGET_PAGE_SIZE));
+#endif
+    return bound;
+}
+
+/* The contexts are kept for the whole migration: setting up a zlib stream
+ * costs more than compressing a page.
+ */
+static void compress_ctx_init(CompressCtx *ctx, bool decompress)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->zstd = migrate_use_compression_zstd();
+    ctx->level = migrate_compress_level();
+#ifdef CONFIG_ZSTD
+    if (ctx->zstd) {
+        if (decompress) {
+            ctx->zstd_dctx = ZSTD_createDCtx();
+            ctx->ready = ctx->zstd_dctx != NULL;
+        } else {
+            ctx->zstd_cctx = ZSTD_createCCtx();
+            ctx->ready = ctx->zstd_cctx != NULL;
         }
-        if (!quit_comp_thread) {
-            do_compress_ram_page(param);
+        return;
+    }
+#endif
+    if (decompress) {
+        ctx->ready = inflateInit(&ctx->zstream) == Z_OK;
+    } else {
+        ctx->ready = deflateInit(&ctx->zstream, ctx->level) == Z_OK;
+    }
+}
+
+static void compress_ctx_destroy(CompressCtx *ctx, bool decompress)
+{
+#ifdef CONFIG_ZSTD
+    if (ctx->zstd) {
+        ZSTD_freeCCtx(ctx->zstd_cctx);
+        ZSTD_freeDCtx(ctx->zstd_dctx);
+        return;
+    }
+#endif
+    if (ctx->ready) {
+        if (decompress) {
+            inflateEnd(&ctx->zstream);
+        } else {
+            deflateEnd(&ctx->zstream);
         }
-        param->start = false;
-        qemu_mutex_unlock(&param->mutex);
+    }
+}
 
-        qemu_mutex_lock(comp_done_lock);
-        param->done = true;
-        qemu_cond_signal(comp_done_cond);
-        qemu_mutex_unlock(comp_done_lock);
+/* Returns the size of the compressed page, or -1 if it does not fit into
+ * @dest_size bytes or on error.
+ */
+static ssize_t compress_data(CompressCtx *ctx, uint8_t *dest,
+                             size_t dest_size, const uint8_t *src)
+{
+    if (!ctx->ready) {
+        return -1;
+    }
+#ifdef CONFIG_ZSTD
+    if (ctx->zstd) {
+        size_t ret = ZSTD_compressCCtx(ctx->zstd_cctx, dest, dest_size,
+                                       src, TARGET_PAGE_SIZE,
+                                       MAX(ctx->level, 1));
+        return ZSTD_isError(ret) ? -1 : ret;
+    }
+#endif
+    if (deflateReset(&ctx->zstream) != Z_OK) {
+        return -1;
+    }
+    ctx->zstream.next_in = (Bytef *)src;
+    ctx->zstream.avail_in = TARGET_PAGE_SIZE;
+    ctx->zstream.next_out = dest;
+    ctx->zstream.avail_out = dest_size;
+    if (deflate(&ctx->zstream, Z_FINISH) != Z_STREAM_END) {
+        return -1;
     }
+    return dest_size - ctx->zstream.avail_out;
+}
 
-    return NULL;
+/* Returns 0 if @len bytes at @src decompress to a whole page, else -1 */
+static int decompress_data(CompressCtx *ctx, void *dest,
+                           const uint8_t *src, int len)
+{
+    if (!ctx->ready) {
+        return -1;
+    }
+#ifdef CONFIG_ZSTD
+    if (ctx->zstd) {
+        size_t ret = ZSTD_decompressDCtx(ctx->zstd_dctx, dest,
+                                         TARGET_PAGE_SIZE, src, len);
+        return ZSTD_isError(ret) || ret != TARGET_PAGE_SIZE ? -1 : 0;
+    }
+#endif
+    if (inflateReset(&ctx->zstream) != Z_OK) {
+        return -1;
+    }
+    ctx->zstream.next_in = (Bytef *)src;
+    ctx->zstream.avail_in = len;
+    ctx->zstream.next_out = dest;
+    ctx->zstream.avail_out = TARGET_PAGE_SIZE;
+    if (inflate(&ctx->zstream, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return 0;
 }
 
-static inline void terminate_compression_threads(void)
+static size_t compress_page(CompressCtx *ctx, uint8_t *buf,
+                            RAMBlock *block, ram_addr_t offset);
+
+static void *do_data_compress(void *opaque)
 {
-    int idx, thread_count;
+    CompressParam *param = opaque;
+    CompressBatch *batch;
+    int i;
 
-    thread_count = migrate_compress_threads();
-    quit_comp_thread = true;
-    for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        qemu_cond_signal(&comp_param[idx].cond);
-        qemu_mutex_unlock(&comp_param[idx].mutex);
+    while (true) {
+        qemu_sem_wait(&param->sem);
+        if (atomic_read(&quit_comp_thread)) {
+            break;
+        }
+        batch = &param->ring[param->tail % COMPRESS_RING_SIZE];
+        batch->out_len = 0;
+        for (i = 0; i < batch->nb_pages; i++) {
+            batch->out_len += compress_page(&param->ctx,
+                                            batch->out + batch->out_len,
+                                            batch->block, batch->offsets[i]);
+        }
+        atomic_mb_set(&param->tail, param->tail + 1);
+        qemu_sem_post(&comp_done_sem);
     }
+
+    return NULL;
 }
 
 void migrate_compress_threads_join(void)
 {
-    int i, thread_count;
+    int i, j;
 
-    if (!migrate_use_compression()) {
+    if (!comp_param) {
         return;
     }
-    terminate_compression_threads();
-    thread_count = migrate_compress_threads();
-    for (i = 0; i < thread_count; i++) {
-        qemu_thread_join(compress_threads + i);
-        qemu_fclose(comp_param[i].file);
-        qemu_mutex_destroy(&comp_param[i].mutex);
-        qemu_cond_destroy(&comp_param[i].cond);
-    }
-    qemu_mutex_destroy(comp_done_lock);
-    qemu_cond_destroy(comp_done_cond);
-    g_free(compress_threads);
+    atomic_set(&quit_comp_thread, true);
+    for (i = 0; i < comp_thread_count; i++) {
+        qemu_sem_post(&comp_param[i].sem);
+    }
+    for (i = 0; i < comp_thread_count; i++) {
+        qemu_thread_join(&comp_param[i].thread);
+        qemu_sem_destroy(&comp_param[i].sem);
+        compress_ctx_destroy(&comp_param[i].ctx, false);
+        for (j = 0; j < COMPRESS_RING_SIZE; j++) {
+            g_free(comp_param[i].ring[j].out);
+        }
+    }
+    qemu_sem_destroy(&comp_done_sem);
+    compress_ctx_destroy(&comp_main_ctx, false);
+    g_free(comp_main_buf);
     g_free(comp_param);
-    g_free(comp_done_cond);
-    g_free(comp_done_lock);
-    compress_threads = NULL;
+    comp_main_buf = NULL;
     comp_param = NULL;
-    comp_done_cond = NULL;
-    comp_done_lock = NULL;
 }
 
 void migrate_compress_threads_create(void)
 {
-    int i, thread_count;
+    size_t page_size = COMPRESS_PAGE_HEADER_MAX + page_compress_bound();
+    int i, j;
 
     if (!migrate_use_compression()) {
         return;
     }
     quit_comp_thread = false;
     compression_switch = true;
-    thread_count = migrate_compress_threads();
-    compress_threads = g_new0(QemuThread, thread_count);
-    comp_param = g_new0(CompressParam, thread_count);
-    comp_done_cond = g_new0(QemuCond, 1);
-    comp_done_lock = g_new0(QemuMutex, 1);
-    qemu_cond_init(comp_done_cond);
-    qemu_mutex_init(comp_done_lock);
-    for (i = 0; i < thread_count; i++) {
-        /* com_param[i].file is just used as a dummy buffer to save data, set
-         * it's ops to empty.
-         */
-        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
-        comp_param[i].done = true;
-        qemu_mutex_init(&comp_param[i].mutex);
-        qemu_cond_init(&comp_param[i].cond);
-        qemu_thread_create(compress_threads + i, "compress",
+    comp_thread_count = migrate_compress_threads();
+    comp_next = 0;
+    comp_param = g_new0(CompressParam, comp_thread_count);
+    qemu_sem_init(&comp_done_sem, 0);
+    compress_ctx_init(&comp_main_ctx, false);
+    comp_main_buf = g_malloc(page_size);
+    for (i = 0; i < comp_thread_count; i++) {
+        qemu_sem_init(&comp_param[i].sem, 0);
+        compress_ctx_init(&comp_param[i].ctx, false);
+        for (j = 0; j < COMPRESS_RING_SIZE; j++) {
+            comp_param[i].ring[j].out = g_malloc(COMPRESS_BATCH_PAGES *
+                                                 page_size);
+        }
+        qemu_thread_create(&comp_param[i].thread, "compress",
                            do_data_compress, comp_param + i,
                            QEMU_THREAD_JOINABLE);
     }
 }
 
+/* Multiple fds: RAM pages are sent in packets over additional channels.
+ * Each packet starts with a header of two be32 fields, the flags and the
+ * number of pages.  If there are pages, the header is followed by the
+ * RAMBlock id (one length byte and the id), one be64 offset for each page
+ * and the data of the pages.  A packet with MULTIFD_FLAG_SYNC is sent on
+ * every channel whenever RAM_SAVE_FLAG_MULTIFD_SYNC is sent on the main
+ * channel; the destination does not continue to load the main channel
+ * until all channels have delivered their pages up to that point.
+ */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* Maximum number of pages sent in one packet */
+#define MULTIFD_PAGES_MAX 128
+
+struct MultiFDPages {
+    RAMBlock *block;
+    uint32_t num;
+    ram_addr_t offset[MULTIFD_PAGES_MAX];
+};
+typedef struct MultiFDPages MultiFDPages;
+
+struct MultiFDSendParams {
+    int id;
+    QemuThread thread;
+    QEMUFile *file;
+    int fd;
+    /* Number of zero copy sends whose pages the kernel may still read */
+    uint64_t zerocopy_pending;
+    /* posted by the migration thread when a packet is ready to be sent */
+    QemuSemaphore sem;
+    /* protects pending */
+    QemuMutex mutex;
+    /* set while the thread owns pages and flags */
+    bool pending;
+    bool quit;
+    uint32_t flags;
+    MultiFDPages pages;
+};
+typedef struct MultiFDSendParams MultiFDSendParams;
+
+static MultiFDSendParams *multifd_send_params;
+static int multifd_send_channels;
+/* Number of send channels that are not pending */
+static QemuSemaphore multifd_channels_ready;
+/* Pages queued by the migration thread for the next packet */
+static MultiFDPages multifd_pages;
+static int multifd_next_channel;
+static bool multifd_send_failed;
+
+/*
+ * With x-zero-copy-send, the header goes through the QEMUFile buffer
+ * while the pages are sent straight from guest memory with MSG_ZEROCOPY.
+ */
+static void multifd_send_packet(MultiFDSendParams *p, MultiFDPages *pages,
+                                uint32_t flags)
+{
+    QEMUFile *f = p->file;
+    RAMBlock *block = pages->block;
+    bool zerocopy = migrate_use_zero_copy_send();
+    struct iovec iov[MULTIFD_PAGES_MAX];
+    ssize_t ret;
+    size_t len;
+    int i;
+
+    if (zerocopy && (flags & MULTIFD_FLAG_SYNC)) {
+        /* Nothing that was sent before the sync may still be in flight */
+        ret = tcp_zerocopy_flush(p->fd, &p->zerocopy_pending, true);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+            return;
+        }
+    }
+
+    qemu_put_be32(f, flags);
+    qemu_put_be32(f, pages->num);
+    if (pages->num) {
+        len = strlen(block->idstr);
+        qemu_put_byte(f, len);
+        qemu_put_buffer(f, (uint8_t *)block->idstr, len);
+        for (i = 0; i < pages->num; i++) {
+            qemu_put_be64(f, pages->offset[i]);
+        }
+        if (!zerocopy) {
+            for (i = 0; i < pages->num; i++) {
+                qemu_put_buffer_async(f, block->host + pages->offset[i],
+                                      TARGET_PAGE_SIZE);
+            }
+        }
+    }
+    qemu_fflush(f);
+
+    if (!zerocopy || !pages->num || qemu_file_get_error(f)) {
+        return;
+    }
+
+    for (i = 0; i < pages->num; i++) {
+        iov[i].iov_base = block->host + pages->offset[i];
+        iov[i].iov_len = TARGET_PAGE_SIZE;
+    }
+    ret = tcp_zerocopy_writev(p->fd, iov, pages->num, &p->zerocopy_pending);
+    if (ret >= 0) {
+        ret = tcp_zerocopy_flush(p->fd, &p->zerocopy_pending, false);
+    }
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+
+    qemu_put_be32(p->file, MULTIFD_MAGIC);
+    qemu_put_be32(p->file, MULTIFD_VERSION);
+    qemu_put_be32(p->file, p->id);
+    qemu_fflush(p->file);
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+
+        multifd_send_packet(p, &p->pages, p->flags);
+
+        qemu_mutex_lock(&p->mutex);
+        p->pending = false;
+        qemu_mutex_unlock(&p->mutex);
+
+        if (qemu_file_get_error(p->file)) {
+            atomic_set(&multifd_send_failed, true);
+            qemu_sem_post(&multifd_channels_ready);
+            break;
+        }
+        qemu_sem_post(&multifd_channels_ready);
+    }
+
+    return NULL;
+}
+
+int migrate_multifd_send_threads_create(MigrationState *s)
+{
+    int i, thread_count;
+    Error *local_err = NULL;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_send_channels = thread_count;
+    multifd_send_params = g_new0(MultiFDSendParams, thread_count);
+    multifd_send_failed = false;
+    multifd_next_channel = 0;
+    memset(&multifd_pages, 0, sizeof(multifd_pages));
+    qemu_sem_init(&multifd_channels_ready, 0);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_params[i];
+        int fd;
+
+        fd = tcp_multifd_channel_connect(s, &local_err);
+        if (fd < 0) {
+            error_report_err(local_err);
+            migrate_multifd_send_threads_join();
+            return -1;
+        }
+
+        if (migrate_use_zero_copy_send() &&
+            tcp_zerocopy_enable(fd, &local_err) < 0) {
+            error_report_err(local_err);
+            closesocket(fd);
+            migrate_multifd_send_threads_join();
+            return -1;
+        }
+
+        p->id = i;
+        p->fd = fd;
+        p->file = qemu_fopen_socket(fd, "wb");
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        qemu_thread_create(&p->thread, "multifd_send",
+                           multifd_send_thread, p, QEMU_THREAD_JOINABLE);
+        qemu_sem_post(&multifd_channels_ready);
+    }
+
+    return 0;
+}
+
+/* Makes the send threads fail if they are blocked on the network */
+void migrate_multifd_send_threads_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send_params) {
+        return;
+    }
+    for (i = 0; i < multifd_send_channels; i++) {
+        if (multifd_send_params[i].file) {
+            qemu_file_shutdown(multifd_send_params[i].file);
+        }
+    }
+}
+
+void migrate_multifd_send_threads_join(void)
+{
+    int i;
+
+    if (!multifd_send_params) {
+        return;
+    }
+    for (i = 0; i < multifd_send_channels; i++) {
+        MultiFDSendParams *p = &multifd_send_params[i];
+
+        if (!p->file) {
+            break;
+        }
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+        qemu_thread_join(&p->thread);
+        qemu_fclose(p->file);
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+    }
+    qemu_sem_destroy(&multifd_channels_ready);
+    g_free(multifd_send_params);
+    multifd_send_params = NULL;
+}
+
+/*
+ * Hands a packet with @pages to the next channel that is not busy, waiting
+ * for one if needed.  Returns -1 if a channel failed.
+ */
+static int multifd_send_pages(MultiFDPages *pages)
+{
+    int i, thread_count = multifd_send_channels;
+    MultiFDSendParams *p;
+
+    qemu_sem_wait(&multifd_channels_ready);
+    if (atomic_read(&multifd_send_failed)) {
+        return -1;
+    }
+
+    for (i = multifd_next_channel; ; i = (i + 1) % thread_count) {
+        p = &multifd_send_params[i];
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending) {
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    p->pending = true;
+    p->flags = 0;
+    p->pages = *pages;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    multifd_next_channel = (i + 1) % thread_count;
+    return 0;
+}
+
+/*
+ * Queues the page at @offset in @block for one of the channels, and sends
+ * the queued pages once there are enough of them.
+ */
+static int multifd_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    int ret;
+
+    if (multifd_pages.num && multifd_pages.block != block) {
+        ret = multifd_send_pages(&multifd_pages);
+        multifd_pages.num = 0;
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    multifd_pages.block = block;
+    multifd_pages.offset[multifd_pages.num++] = offset;
+
+    if (multifd_pages.num == MULTIFD_PAGES_MAX) {
+        ret = multifd_send_pages(&multifd_pages);
+        multifd_pages.num = 0;
+        return ret;
+    }
+    return 0;
+}
+
+/*
+ * Sends the queued pages and a sync packet on every channel, and the sync
+ * marker on the main channel @f.  Returns -1 if a channel failed.  The pages of a RAMBlock that are handed
+ * to the channels must not be freed before this is called, so it has to
+ * be called within the RCU critical section that found the pages.
+ */
+static int multifd_send_sync(QEMUFile *f, uint64_t *bytes_transferred)
+{
+    int i, thread_count;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+
+    if (multifd_pages.num) {
+        if (multifd_send_pages(&multifd_pages) < 0) {
+            return -1;
+        }
+        multifd_pages.num = 0;
+    }
+
+    /* Wait until no channel is busy, so that the sync packet comes after
+     * all pages on each channel */
+    thread_count = multifd_send_channels;
+    for (i = 0; i < thread_count; i++) {
+        qemu_sem_wait(&multifd_channels_ready);
+    }
+    if (atomic_read(&multifd_send_failed)) {
+        return -1;
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->pending = true;
+        p->flags = MULTIFD_FLAG_SYNC;
+        p->pages.num = 0;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    *bytes_transferred += 8;
+    return 0;
+}
+
+/**
+ * save_page_header_buf: Write page header to a buffer
+ *
+ * Same as save_page_header(), for pages that are prepared outside of the
+ * migration stream.
+ *
+ * @buf: buffer with room for at least 8 + 1 + 255 bytes
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ *          in the lower bits, it contains flags
+ */
+static size_t save_page_header_buf(uint8_t *buf, RAMBlock *block,
+                                   ram_addr_t offset)
+{
+    size_t size, len;
+
+    stq_be_p(buf, offset);
+    size = 8;
+
+    if (!(offset & RAM_SAVE_FLAG_CONTINUE)) {
+        len = strlen(block->idstr);
+        buf[size] = len;
+        memcpy(buf + size + 1, block->idstr, len);
+        size += 1 + len;
+    }
+    return size;
+}
+
 /**
  * save_page_header: Write page header to wire
  *
@@ -423,13 +950,44 @@ static size_t save_page_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
  * migration. Some workloads dirty memory way too fast and will not effectively
  * converge, even with auto-converge.
  */
-static void mig_throttle_guest_down(void)
+static void mig_throttle_guest_down(uint64_t bytes_xfer_period,
+                                    int64_t period_ms)
 {
     MigrationState *s = migrate_get_current();
     uint64_t pct_initial =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
     uint64_t pct_icrement =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    uint64_t budget;
+    CPUState *cpu;
+    bool throttled = false;
+    int nr_cpus = 0;
+    int pct;
+
+    /* If we know how fast each vcpu dirties memory, only slow down those
+     * that dirty it faster than their share of half the bandwidth.  If
+     * the dirtying is spread evenly, throttle all of them as usual. */
+    if (kvm_dirty_ring_enabled() && period_ms > 0) {
+        CPU_FOREACH(cpu) {
+            nr_cpus++;
+        }
+        budget = bytes_xfer_period * 1000 / period_ms / 2 / nr_cpus;
+
+        CPU_FOREACH(cpu) {
+            if (cpu->dirty_rate <= budget) {
+                continue;
+            }
+            pct = cpu_throttle_get_vcpu_percentage(cpu);
+            pct = pct ? pct + pct_icrement : pct_initial;
+            trace_migration_throttle_vcpu(cpu->cpu_index, cpu->dirty_rate,
+                                          budget, pct);
+            cpu_throttle_set_vcpu(cpu, pct);
+            throttled = true;
+        }
+        if (throttled) {
+            return;
+        }
+    }
 
     /* We have not started throttling yet. Let's start it. */
     if (!cpu_throttle_active()) {
@@ -548,6 +1106,12 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
  * Returns: byte offset within memory region of the start of a dirty page
  */
 static inline
+/* Blocks whose pages are not sent, because the destination maps them too */
+static bool ramblock_is_ignored(RAMBlock *rb)
+{
+    return migrate_ignore_shared() && qemu_ram_is_shared(rb);
+}
+
 ram_addr_t migration_bitmap_find_dirty(RAMBlock *rb,
                                        ram_addr_t start,
                                        ram_addr_t *ram_addr_abs)
@@ -560,6 +1124,11 @@ ram_addr_t migration_bitmap_find_dirty(RAMBlock *rb,
 
     unsigned long next;
 
+    if (ramblock_is_ignored(rb)) {
+        *ram_addr_abs = size << TARGET_PAGE_BITS;
+        return rb_size;
+    }
+
     bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
     if (ram_bulk_stage && nr > base) {
         next = nr + 1;
@@ -577,20 +1146,220 @@ static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
     int nr = addr >> TARGET_PAGE_BITS;
     unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
 
+    /* Free page hints clear bits from the main thread */
+    qemu_mutex_lock(&migration_bitmap_mutex);
     ret = test_and_clear_bit(nr, bitmap);
 
     if (ret) {
         migration_dirty_pages--;
     }
+    qemu_mutex_unlock(&migration_bitmap_mutex);
     return ret;
 }
 
-static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
+static NotifierList precopy_notifier_list =
+    NOTIFIER_LIST_INITIALIZER(precopy_notifier_list);
+
+/*
+ * Registers @n to be called with a PrecopyNotifyReason as the data at the
+ * bitmap syncs and at the end of precopy migrations.  Migrations that can
+ * switch to postcopy do not call it, since a page skipped by the source
+ * must not be requested by the destination.
+ */
+void precopy_add_notifier(Notifier *n)
+{
+    notifier_list_add(&precopy_notifier_list, n);
+}
+
+void precopy_remove_notifier(Notifier *n)
+{
+    notifier_remove(n);
+}
+
+static void precopy_notify(PrecopyNotifyReason reason)
+{
+    if (migrate_postcopy_ram()) {
+        return;
+    }
+    notifier_list_notify(&precopy_notifier_list, &reason);
+}
+
+/*
+ * Clears the pages of @len bytes at @addr, which the guest reported free,
+ * from the migration bitmap so that they are not sent.  If the guest uses
+ * them again, dirty logging marks them and the next sync sends them.
+ * Called with the iothread lock.
+ */
+void qemu_guest_free_page_hint(void *addr, size_t len)
+{
+    RAMBlock *block;
+    ram_addr_t ram_addr, offset;
+    unsigned long *bitmap;
+    uint64_t cleared = 0;
+    size_t used;
+
+    rcu_read_lock();
+    if (!migration_bitmap_rcu) {
+        rcu_read_unlock();
+        return;
+    }
+
+    for (; len > 0; len -= used, addr += used) {
+        unsigned long start, npages, i;
+
+        block = qemu_ram_block_from_host(addr, false, &ram_addr, &offset);
+        if (!block || offset >= block->used_length) {
+            /* Not guest RAM, or a hint that races with a resize */
+            break;
+        }
+        used = MIN(len, block->used_length - offset);
+
+        /* Only whole target pages are free */
+        start = DIV_ROUND_UP(ram_addr, TARGET_PAGE_SIZE);
+        npages = ((ram_addr + used) >> TARGET_PAGE_BITS) - start;
+
+        qemu_mutex_lock(&migration_bitmap_mutex);
+        bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+        for (i = start; i < start + npages; i++) {
+            if (test_and_clear_bit(i, bitmap)) {
+                migration_dirty_pages--;
+                cleared++;
+            }
+        }
+        qemu_mutex_unlock(&migration_bitmap_mutex);
+    }
+    rcu_read_unlock();
+
+    trace_qemu_guest_free_page_hint(cleared);
+}
+
+static uint64_t migration_bitmap_sync_range(ram_addr_t start,
+                                            ram_addr_t length)
 {
     unsigned long *bitmap;
+    uint64_t num_dirty;
+
     bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    migration_dirty_pages +=
-        cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+    num_dirty = cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+    migration_dirty_pages += num_dirty;
+    return num_dirty;
+}
+
+/* Number of iterations kept for query-migrate-telemetry */
+#define MIGRATION_TELEMETRY_ITERATIONS 64
+
+/*
+ * Statistics of the iterations of the current or last outgoing migration.
+ * An iteration starts with a bitmap sync and ends with the next one.
+ */
+static struct {
+    /* Protects the ring against query-migrate-telemetry */
+    QemuMutex lock;
+    MigrationIterationStats ring[MIGRATION_TELEMETRY_ITERATIONS];
+    uint64_t nb_done;
+    /* The iteration in progress, if started */
+    MigrationIterationStats cur;
+    bool started;
+    int64_t start_time;
+    uint64_t start_pages;
+    uint64_t start_bytes;
+} iteration_stats;
+
+static uint64_t ram_pages_transferred(void)
+{
+    return acct_info.dup_pages + acct_info.norm_pages +
+           acct_info.xbzrle_pages;
+}
+
+/*
+ * Starts an iteration after a bitmap sync that took @sync_time us and
+ * found @dirty_pages newly dirtied pages.
+ */
+static void iteration_stats_start(int64_t sync_time, uint64_t dirty_pages)
+{
+    MigrationIterationStats *it = &iteration_stats.cur;
+
+    memset(it, 0, sizeof(*it));
+    it->iteration = bitmap_sync_count;
+    it->sync_time = sync_time;
+    it->dirty_pages = dirty_pages;
+    it->remaining_pages = migration_dirty_pages;
+    iteration_stats.start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    iteration_stats.start_pages = ram_pages_transferred();
+    iteration_stats.start_bytes = ram_bytes_transferred();
+    iteration_stats.started = true;
+}
+
+static void iteration_stats_end(void)
+{
+    MigrationIterationStats *it = &iteration_stats.cur;
+
+    if (!iteration_stats.started) {
+        return;
+    }
+    iteration_stats.started = false;
+
+    it->duration = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                   iteration_stats.start_time;
+    it->pages = ram_pages_transferred() - iteration_stats.start_pages;
+    it->bytes = ram_bytes_transferred() - iteration_stats.start_bytes;
+    it->mbps = it->duration ? (double)it->bytes * 8 / it->duration / 1000 : 0;
+    trace_migration_iteration_stats(it->iteration, it->sync_time,
+                                    it->duration, it->dirty_pages,
+                                    it->pages, it->bytes, it->mbps);
+
+    qemu_mutex_lock(&iteration_stats.lock);
+    iteration_stats.ring[iteration_stats.nb_done++ %
+                         MIGRATION_TELEMETRY_ITERATIONS] = *it;
+    qemu_mutex_unlock(&iteration_stats.lock);
+}
+
+/* Returns the last iterations that ended, oldest first */
+MigrationIterationStatsList *ram_get_iteration_stats(void)
+{
+    MigrationIterationStatsList *head = NULL, **tail = &head;
+    uint64_t i;
+
+    qemu_mutex_lock(&iteration_stats.lock);
+    i = iteration_stats.nb_done > MIGRATION_TELEMETRY_ITERATIONS ?
+        iteration_stats.nb_done - MIGRATION_TELEMETRY_ITERATIONS : 0;
+    for (; i < iteration_stats.nb_done; i++) {
+        MigrationIterationStatsList *entry;
+
+        entry = g_new0(MigrationIterationStatsList, 1);
+        entry->value = g_memdup(&iteration_stats.ring[
+                                    i % MIGRATION_TELEMETRY_ITERATIONS],
+                                sizeof(MigrationIterationStats));
+        *tail = entry;
+        tail = &entry->next;
+    }
+    qemu_mutex_unlock(&iteration_stats.lock);
+
+    return head;
+}
+
+/* Returns the pages found dirty and sent per RAMBlock */
+RamBlockMigrationStatsList *ram_get_block_stats(void)
+{
+    RamBlockMigrationStatsList *head = NULL, **tail = &head;
+    RAMBlock *block;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        RamBlockMigrationStatsList *entry;
+
+        entry = g_new0(RamBlockMigrationStatsList, 1);
+        entry->value = g_new0(RamBlockMigrationStats, 1);
+        entry->value->id_str = g_strdup(block->idstr);
+        entry->value->size = block->used_length;
+        entry->value->dirty_pages = atomic_read(&block->mig_dirty_pages);
+        entry->value->sent_pages = atomic_read(&block->mig_sent_pages);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    rcu_read_unlock();
+
+    return head;
 }
 
 /* Fix me: there are too many global variables used in migration process. */
@@ -616,7 +1385,11 @@ static void migration_bitmap_sync(void)
     MigrationState *s = migrate_get_current();
     int64_t end_time;
     int64_t bytes_xfer_now;
+    int64_t sync_start;
 
+    iteration_stats_end();
+    precopy_notify(PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC);
+    sync_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     bitmap_sync_count++;
 
     if (!bytes_xfer_prev) {
@@ -633,13 +1406,27 @@ static void migration_bitmap_sync(void)
     qemu_mutex_lock(&migration_bitmap_mutex);
     rcu_read_lock();
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->offset, block->used_length);
+        uint64_t num_dirty;
+
+        if (ramblock_is_ignored(block)) {
+            continue;
+        }
+        num_dirty = migration_bitmap_sync_range(block->offset,
+                                                block->used_length);
+        if (num_dirty) {
+            atomic_set(&block->mig_dirty_pages,
+                       block->mig_dirty_pages + num_dirty);
+            trace_migration_bitmap_sync_block(block->idstr, num_dirty);
+        }
     }
     rcu_read_unlock();
     qemu_mutex_unlock(&migration_bitmap_mutex);
 
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
+    iteration_stats_start(qemu_clock_get_us(QEMU_CLOCK_REALTIME) - sync_start,
+                          migration_dirty_pages - num_dirty_pages_init);
+    precopy_notify(PRECOPY_NOTIFY_AFTER_BITMAP_SYNC);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -659,7 +1446,8 @@ static void migration_bitmap_sync(void)
                (dirty_rate_high_cnt++ >= 2)) {
                     trace_migration_throttle();
                     dirty_rate_high_cnt = 0;
-                    mig_throttle_guest_down();
+                    mig_throttle_guest_down(bytes_xfer_now - bytes_xfer_prev,
+                                            end_time - start_time);
              }
              bytes_xfer_prev = bytes_xfer_now;
         }
@@ -736,7 +1524,8 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     ram_addr_t current_addr;
     uint8_t *p;
     int ret;
-    bool send_async = true;
+    /* A background snapshot unprotects the page as soon as it returns */
+    bool send_async = !migrate_background_snapshot();
     RAMBlock *block = pss->block;
     ram_addr_t offset = pss->offset;
 
@@ -804,102 +1593,112 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     return pages;
 }
 
-static int do_compress_ram_page(CompressParam *param)
+/*
+ * Writes the page at @offset of @block to @buf, header included, in the
+ * format of the migration stream.  The page is sent uncompressed if the
+ * compression fails.  Returns the number of bytes written, at most
+ * COMPRESS_PAGE_HEADER_MAX + page_compress_bound().
+ */
+static size_t compress_page(CompressCtx *ctx, uint8_t *buf,
+                            RAMBlock *block, ram_addr_t offset)
 {
-    int bytes_sent, blen;
-    uint8_t *p;
-    RAMBlock *block = param->block;
-    ram_addr_t offset = param->offset;
-
-    p = block->host + (offset & TARGET_PAGE_MASK);
-
-    bytes_sent = save_page_header(param->file, block, offset |
-                                  RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(param->file, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
-    bytes_sent += blen;
-
-    return bytes_sent;
+    uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
+    size_t header;
+    ssize_t len;
+
+    header = save_page_header_buf(buf, block,
+                                  offset | RAM_SAVE_FLAG_COMPRESS_PAGE);
+    len = compress_data(ctx, buf + header + 4, page_compress_bound(), p);
+    if (len < 0) {
+        header = save_page_header_buf(buf, block,
+                                      offset | RAM_SAVE_FLAG_PAGE);
+        memcpy(buf + header, p, TARGET_PAGE_SIZE);
+        return header + TARGET_PAGE_SIZE;
+    }
+    stl_be_p(buf + header, len);
+    return header + 4 + len;
 }
 
-static inline void start_compression(CompressParam *param)
+static uint64_t bytes_transferred;
+
+/* Sends the batches that @param has finished compressing */
+static void compress_send_done(QEMUFile *f, CompressParam *param)
 {
-    param->done = false;
-    qemu_mutex_lock(&param->mutex);
-    param->start = true;
-    qemu_cond_signal(&param->cond);
-    qemu_mutex_unlock(&param->mutex);
+    unsigned int tail = atomic_mb_read(&param->tail);
+    CompressBatch *batch;
+
+    while (param->sent != tail) {
+        batch = &param->ring[param->sent % COMPRESS_RING_SIZE];
+        qemu_put_buffer(f, batch->out, batch->out_len);
+        bytes_transferred += batch->out_len;
+        batch->nb_pages = 0;
+        param->sent++;
+    }
 }
 
-static inline void start_decompression(DecompressParam *param)
+/* Hands the batch being filled over to the compression thread */
+static void compress_queue_batch(CompressParam *param)
 {
-    qemu_mutex_lock(&param->mutex);
-    param->start = true;
-    qemu_cond_signal(&param->cond);
-    qemu_mutex_unlock(&param->mutex);
+    atomic_mb_set(&param->head, param->head + 1);
+    qemu_sem_post(&param->sem);
 }
 
-static uint64_t bytes_transferred;
-
 static void flush_compressed_data(QEMUFile *f)
 {
-    int idx, len, thread_count;
+    CompressParam *param;
+    int idx;
 
-    if (!migrate_use_compression()) {
+    if (!comp_param) {
         return;
     }
-    thread_count = migrate_compress_threads();
-    for (idx = 0; idx < thread_count; idx++) {
-        if (!comp_param[idx].done) {
-            qemu_mutex_lock(comp_done_lock);
-            while (!comp_param[idx].done && !quit_comp_thread) {
-                qemu_cond_wait(comp_done_cond, comp_done_lock);
-            }
-            qemu_mutex_unlock(comp_done_lock);
+    for (idx = 0; idx < comp_thread_count; idx++) {
+        param = &comp_param[idx];
+        if (param->head - param->sent < COMPRESS_RING_SIZE &&
+            param->ring[param->head % COMPRESS_RING_SIZE].nb_pages) {
+            compress_queue_batch(param);
         }
-        if (!quit_comp_thread) {
-            len = qemu_put_qemu_file(f, comp_param[idx].file);
-            bytes_transferred += len;
+    }
+    for (idx = 0; idx < comp_thread_count; idx++) {
+        param = &comp_param[idx];
+        compress_send_done(f, param);
+        while (param->sent != param->head) {
+            qemu_sem_wait(&comp_done_sem);
+            compress_send_done(f, param);
         }
     }
+    comp_next = 0;
 }
 
-static inline void set_compress_params(CompressParam *param, RAMBlock *block,
-                                       ram_addr_t offset)
-{
-    param->block = block;
-    param->offset = offset;
-}
-
+/*
+ * Adds a page to the batch being filled, and queues the batch once it is
+ * full.  All the pages of a batch belong to the same block because the
+ * batches are flushed when the block changes.
+ */
 static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
-                                           ram_addr_t offset,
-                                           uint64_t *bytes_transferred)
+                                           ram_addr_t offset)
 {
-    int idx, thread_count, bytes_xmit = -1, pages = -1;
+    CompressParam *param = &comp_param[comp_next];
+    CompressBatch *batch;
+    int idx;
 
-    thread_count = migrate_compress_threads();
-    qemu_mutex_lock(comp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (comp_param[idx].done) {
-                bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
-                set_compress_params(&comp_param[idx], block, offset);
-                start_compression(&comp_param[idx]);
-                pages = 1;
-                acct_info.norm_pages++;
-                *bytes_transferred += bytes_xmit;
-                break;
-            }
-        }
-        if (pages > 0) {
-            break;
-        } else {
-            qemu_cond_wait(comp_done_cond, comp_done_lock);
-        }
+    for (idx = 0; idx < comp_thread_count; idx++) {
+        compress_send_done(f, &comp_param[idx]);
+    }
+    while (param->head - param->sent == COMPRESS_RING_SIZE) {
+        qemu_sem_wait(&comp_done_sem);
+        compress_send_done(f, param);
     }
-    qemu_mutex_unlock(comp_done_lock);
 
-    return pages;
+    batch = &param->ring[param->head % COMPRESS_RING_SIZE];
+    batch->block = block;
+    batch->offsets[batch->nb_pages++] = offset;
+    if (batch->nb_pages == COMPRESS_BATCH_PAGES) {
+        compress_queue_batch(param);
+        comp_next = (comp_next + 1) % comp_thread_count;
+    }
+    acct_info.norm_pages++;
+
+    return 1;
 }
 
 /**
@@ -955,21 +1754,20 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
             flush_compressed_data(f);
             pages = save_zero_page(f, block, offset, p, bytes_transferred);
             if (pages == -1) {
-                set_compress_params(&comp_param[0], block, offset);
                 /* Use the qemu thread to compress the data to make sure the
                  * first page is sent out before other pages
                  */
-                bytes_xmit = do_compress_ram_page(&comp_param[0]);
+                bytes_xmit = compress_page(&comp_main_ctx, comp_main_buf,
+                                           block, offset);
                 acct_info.norm_pages++;
-                qemu_put_qemu_file(f, comp_param[0].file);
+                qemu_put_buffer(f, comp_main_buf, bytes_xmit);
                 *bytes_transferred += bytes_xmit;
                 pages = 1;
             }
         } else {
             pages = save_zero_page(f, block, offset, p, bytes_transferred);
             if (pages == -1) {
-                pages = compress_page_with_multi_thread(f, block, offset,
-                                                        bytes_transferred);
+                pages = compress_page_with_multi_thread(f, block, offset);
             }
         }
     }
@@ -977,6 +1775,527 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
     return pages;
 }
 
+/**
+ * ram_save_multifd_page: send the given page with the multifd channels
+ *
+ * Zero pages are sent on the main channel, other pages are queued for
+ * the multifd channels.  Unlike ram_save_page(), this keeps
+ * last_sent_block up to date itself because the main channel does not
+ * see the pages that go to the multifd channels.
+ *
+ * Returns: Number of pages written, < 0 on error.
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_multifd_page(QEMUFile *f, PageSearchStatus *pss,
+                                 uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
+    int pages;
+
+    if (block == last_sent_block) {
+        offset |= RAM_SAVE_FLAG_CONTINUE;
+    }
+    pages = save_zero_page(f, block, offset, block->host + pss->offset,
+                           bytes_transferred);
+    if (pages > 0) {
+        last_sent_block = block;
+        return pages;
+    }
+
+    if (multifd_queue_page(block, pss->offset) < 0) {
+        return -1;
+    }
+    /* Count the page against the rate limit of the main channel */
+    qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+
+    return 1;
+}
+
+/* x-mapped-ram: the file has a fixed area for each RAMBlock, holding a
+ * bitmap of the pages present followed by all the pages of the block at
+ * their offset.  Both are aligned so that they can be accessed with
+ * O_DIRECT, and the stream goes on after the area.
+ */
+#define MAPPED_RAM_ALIGN        (1 * 1024 * 1024)
+/* Largest read or write of consecutive pages */
+#define MAPPED_RAM_MAX_RUN      (1 * 1024 * 1024)
+
+/* Consecutive pages not yet queued for writing */
+static struct {
+    RAMBlock *block;
+    ram_addr_t offset;
+    size_t len;
+} mapped_ram_run;
+
+static size_t mapped_ram_bitmap_size(RAMBlock *block)
+{
+    return DIV_ROUND_UP(block->used_length >> TARGET_PAGE_BITS, 8);
+}
+
+static bool mapped_ram_test_bit(const uint8_t *bitmap, uint64_t page)
+{
+    return bitmap[page / 8] & (1 << (page % 8));
+}
+
+/*
+ * Writes the offsets of the area of @block to the stream, and moves the
+ * stream after the area.
+ */
+static void mapped_ram_setup_block(QEMUFile *f, RAMBlock *block)
+{
+    int64_t offset = qemu_file_get_offset(f);
+
+    if (offset < 0) {
+        qemu_file_set_error(f, offset);
+        return;
+    }
+    /* The area comes after the two offsets */
+    block->bitmap_offset = QEMU_ALIGN_UP(offset + 16, MAPPED_RAM_ALIGN);
+    block->pages_offset = QEMU_ALIGN_UP(block->bitmap_offset +
+                                        mapped_ram_bitmap_size(block),
+                                        MAPPED_RAM_ALIGN);
+    g_free(block->file_bmap);
+    block->file_bmap = bitmap_new(block->used_length >> TARGET_PAGE_BITS);
+
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    qemu_file_set_offset(f, block->pages_offset + block->used_length);
+}
+
+static void mapped_ram_queue_run(void)
+{
+    if (mapped_ram_run.len) {
+        file_pages_queue(mapped_ram_run.block->host + mapped_ram_run.offset,
+                         mapped_ram_run.len,
+                         mapped_ram_run.block->pages_offset +
+                         mapped_ram_run.offset);
+        mapped_ram_run.len = 0;
+    }
+}
+
+/**
+ * ram_save_mapped_page: write the given page at its offset in the file
+ *
+ * Zero pages are not written, only left out of the bitmap of the block.
+ * Consecutive pages are written together by the file: page threads.
+ *
+ * Returns: Number of pages written, < 0 on error.
+ *
+ * @f: QEMUFile of the stream, used for rate limiting
+ * @pss: block and offset of the page
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_mapped_page(QEMUFile *f, PageSearchStatus *pss,
+                                uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
+
+    if (!block->file_bmap) {
+        error_report("RAM block %s was added during migration", block->idstr);
+        return -EINVAL;
+    }
+    if (is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+        clear_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        acct_info.dup_pages++;
+        return 1;
+    }
+    set_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+
+    if (mapped_ram_run.len &&
+        (mapped_ram_run.block != block ||
+         mapped_ram_run.offset + mapped_ram_run.len != offset ||
+         mapped_ram_run.len == MAPPED_RAM_MAX_RUN)) {
+        mapped_ram_queue_run();
+    }
+    if (!mapped_ram_run.len) {
+        mapped_ram_run.block = block;
+        mapped_ram_run.offset = offset;
+    }
+    mapped_ram_run.len += TARGET_PAGE_SIZE;
+
+    /* Count the page against the rate limit of the stream */
+    qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+
+    return 1;
+}
+
+/*
+ * Waits until the pages are in the file.  Called at the end of each
+ * iteration, so that two writes of the same page are never in flight.
+ */
+static void mapped_ram_flush(QEMUFile *f)
+{
+    int ret;
+
+    if (!migrate_mapped_ram()) {
+        return;
+    }
+    mapped_ram_queue_run();
+    ret = file_pages_flush();
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+}
+
+/* Writes the bitmaps of the pages present.  Called within an RCU critical
+ * section.
+ */
+static void mapped_ram_save_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+    uint64_t nb_pages, page;
+    uint8_t *bitmap;
+    int ret;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!block->file_bmap) {
+            continue;
+        }
+        nb_pages = block->used_length >> TARGET_PAGE_BITS;
+        bitmap = g_malloc0(mapped_ram_bitmap_size(block));
+        for (page = find_first_bit(block->file_bmap, nb_pages);
+             page < nb_pages;
+             page = find_next_bit(block->file_bmap, nb_pages, page + 1)) {
+            bitmap[page / 8] |= 1 << (page % 8);
+        }
+        file_pages_queue(bitmap, mapped_ram_bitmap_size(block),
+                         block->bitmap_offset);
+        ret = file_pages_flush();
+        g_free(bitmap);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+            return;
+        }
+    }
+}
+
+/* x-lazy-restore: the pages are not read while the stream is loaded.  Each
+ * RAMBlock is emptied and registered with userfaultfd like for postcopy,
+ * and its host pages are read from the file when the postcopy fault thread
+ * reports an access, or by a thread that reads them all in the background,
+ * going on after the last page that faulted.
+ */
+static struct {
+    MigrationIncomingState *mis;
+    int fd;
+    /* Protects the lazy_bmaps, remaining and the hint */
+    QemuMutex lock;
+    /* Host pages not yet read */
+    uint64_t remaining;
+    /* Where the background reads go on after a fault */
+    RAMBlock *hint_block;
+    ram_addr_t hint_offset;
+    /* Page buffer of the fault thread */
+    void *fault_buf;
+    bool running;
+    /* The incoming state is only destroyed once the restore is done */
+    bool destroy_mis;
+} lazy_restore;
+
+/*
+ * Empties @block and records which of its pages are in the file, rather
+ * than reading them.
+ */
+static int mapped_ram_lazy_block(RAMBlock *block, const uint8_t *bitmap,
+                                 uint64_t pages_offset)
+{
+    uint64_t nb_pages = block->used_length >> TARGET_PAGE_BITS;
+    uint64_t nb_host_pages = block->used_length / getpagesize();
+    uint64_t page;
+
+    g_free(block->file_bmap);
+    block->file_bmap = bitmap_new(nb_pages);
+    for (page = 0; page < nb_pages; page++) {
+        if (mapped_ram_test_bit(bitmap, page)) {
+            set_bit(page, block->file_bmap);
+        }
+    }
+    g_free(block->lazy_bmap);
+    block->lazy_bmap = bitmap_new(nb_host_pages);
+    bitmap_set(block->lazy_bmap, 0, nb_host_pages);
+    lazy_restore.remaining += nb_host_pages;
+    block->pages_offset = pages_offset;
+
+    /* Pages are placed one host page at a time */
+    qemu_madvise(block->host, block->used_length, QEMU_MADV_NOHUGEPAGE);
+    return postcopy_ram_discard_range(migration_incoming_get_current(),
+                                      block->host, block->used_length);
+}
+
+/*
+ * Reads the host page at @offset of @block from the file into @buf and
+ * places it, unless it is already being read.
+ */
+static int ram_lazy_restore_page(RAMBlock *block, ram_addr_t offset,
+                                 uint8_t *buf)
+{
+    size_t host_page_size = getpagesize();
+    uint64_t first = offset >> TARGET_PAGE_BITS;
+    uint64_t last = (offset + host_page_size) >> TARGET_PAGE_BITS;
+    uint64_t page;
+    bool present = false;
+    size_t done = 0;
+    ssize_t len;
+
+    qemu_mutex_lock(&lazy_restore.lock);
+    if (!test_bit(offset / host_page_size, block->lazy_bmap)) {
+        /* The other thread places it, and that wakes up the faulting one */
+        qemu_mutex_unlock(&lazy_restore.lock);
+        return 0;
+    }
+    clear_bit(offset / host_page_size, block->lazy_bmap);
+    lazy_restore.remaining--;
+    qemu_mutex_unlock(&lazy_restore.lock);
+
+    for (page = first; page < last; page++) {
+        present |= test_bit(page, block->file_bmap);
+    }
+    if (!present) {
+        return postcopy_place_page_zero(lazy_restore.mis,
+                                        block->host + offset);
+    }
+
+    while (done < host_page_size) {
+        len = pread(lazy_restore.fd, buf + done, host_page_size - done,
+                    block->pages_offset + offset + done);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            error_report("x-lazy-restore: cannot read %s/" RAM_ADDR_FMT ": %s",
+                         block->idstr, offset,
+                         len < 0 ? strerror(errno) : "end of file");
+            return -EIO;
+        }
+        done += len;
+    }
+    /* Pages that became zero after they were written are only cleared in
+     * the bitmap.
+     */
+    for (page = first; page < last; page++) {
+        if (!test_bit(page, block->file_bmap)) {
+            memset(buf + ((page - first) << TARGET_PAGE_BITS), 0,
+                   TARGET_PAGE_SIZE);
+        }
+    }
+
+    return postcopy_place_page(lazy_restore.mis, block->host + offset, buf);
+}
+
+/*
+ * Called by the postcopy fault thread for an access to the host page at
+ * @offset of @rb.
+ */
+int ram_lazy_restore_fault(MigrationIncomingState *mis, RAMBlock *rb,
+                           ram_addr_t offset)
+{
+    int ret;
+
+    trace_ram_lazy_restore_fault(rb->idstr, offset);
+    ret = ram_lazy_restore_page(rb, offset, lazy_restore.fault_buf);
+
+    qemu_mutex_lock(&lazy_restore.lock);
+    lazy_restore.hint_block = rb;
+    lazy_restore.hint_offset = offset + getpagesize();
+    qemu_mutex_unlock(&lazy_restore.lock);
+
+    return ret;
+}
+
+static void ram_lazy_restore_finish(void)
+{
+    MigrationIncomingState *mis = lazy_restore.mis;
+    RAMBlock *block;
+    bool destroy;
+
+    postcopy_ram_disable_notify(mis);
+    mis->lazy_restore = false;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_free(block->lazy_bmap);
+        block->lazy_bmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+    rcu_read_unlock();
+    close(lazy_restore.fd);
+    qemu_vfree(lazy_restore.fault_buf);
+    lazy_restore.fault_buf = NULL;
+    trace_ram_lazy_restore_done();
+
+    qemu_mutex_lock(&lazy_restore.lock);
+    lazy_restore.running = false;
+    destroy = lazy_restore.destroy_mis;
+    qemu_mutex_unlock(&lazy_restore.lock);
+
+    if (destroy) {
+        migration_incoming_state_destroy();
+    }
+}
+
+static void *ram_lazy_restore_thread(void *opaque)
+{
+    size_t host_page_size = getpagesize();
+    uint8_t *buf = qemu_memalign(host_page_size, host_page_size);
+    RAMBlock *block;
+    uint64_t nb_host_pages, hpage = 0;
+
+    rcu_register_thread();
+    /* The RAMBlocks cannot go away while the guest is being restored */
+    rcu_read_lock();
+    block = QLIST_FIRST_RCU(&ram_list.blocks);
+    while (true) {
+        qemu_mutex_lock(&lazy_restore.lock);
+        if (!lazy_restore.remaining) {
+            qemu_mutex_unlock(&lazy_restore.lock);
+            break;
+        }
+        if (lazy_restore.hint_block) {
+            block = lazy_restore.hint_block;
+            hpage = lazy_restore.hint_offset / host_page_size;
+            lazy_restore.hint_block = NULL;
+        }
+        nb_host_pages = block->used_length / host_page_size;
+        if (block->lazy_bmap) {
+            hpage = find_next_bit(block->lazy_bmap, nb_host_pages, hpage);
+        } else {
+            hpage = nb_host_pages;
+        }
+        qemu_mutex_unlock(&lazy_restore.lock);
+
+        if (hpage >= nb_host_pages) {
+            block = QLIST_NEXT_RCU(block, next);
+            if (!block) {
+                block = QLIST_FIRST_RCU(&ram_list.blocks);
+            }
+            hpage = 0;
+            continue;
+        }
+        if (ram_lazy_restore_page(block, hpage * host_page_size, buf)) {
+            /* The guest cannot go on without its memory */
+            exit(EXIT_FAILURE);
+        }
+        hpage++;
+    }
+    rcu_read_unlock();
+    qemu_vfree(buf);
+
+    ram_lazy_restore_finish();
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Starts serving the faults on the RAMBlocks prepared by
+ * mapped_ram_lazy_block, and reading their pages in the background.
+ */
+static int ram_lazy_restore_start(void)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    QemuThread thread;
+    int ret;
+
+    ret = file_pages_open();
+    if (ret < 0) {
+        error_report("x-lazy-restore: cannot open the file: %s",
+                     strerror(-ret));
+        return ret;
+    }
+    lazy_restore.fd = ret;
+    lazy_restore.mis = mis;
+    lazy_restore.fault_buf = qemu_memalign(getpagesize(), getpagesize());
+    lazy_restore.hint_block = NULL;
+    lazy_restore.destroy_mis = false;
+    qemu_mutex_init(&lazy_restore.lock);
+
+    mis->lazy_restore = true;
+    if (postcopy_ram_enable_notify(mis)) {
+        return -EINVAL;
+    }
+
+    trace_ram_lazy_restore_start(lazy_restore.remaining);
+    lazy_restore.running = true;
+    qemu_thread_create(&thread, "lazy restore", ram_lazy_restore_thread,
+                       NULL, QEMU_THREAD_DETACHED);
+    return 0;
+}
+
+/*
+ * Called once the incoming stream is loaded.  Returns true if a lazy
+ * restore still needs the incoming state, and will destroy it when done.
+ */
+bool ram_lazy_restore_keep_mis(void)
+{
+    bool keep;
+
+    if (!lazy_restore.mis) {
+        return false;
+    }
+    qemu_mutex_lock(&lazy_restore.lock);
+    keep = lazy_restore.running;
+    lazy_restore.destroy_mis = keep;
+    qemu_mutex_unlock(&lazy_restore.lock);
+
+    return keep;
+}
+
+/*
+ * Reads the pages of @block from the file and moves the stream after its
+ * area.  With x-lazy-restore, only records where they are.
+ */
+static int mapped_ram_load_block(QEMUFile *f, RAMBlock *block)
+{
+    uint64_t nb_pages = block->used_length >> TARGET_PAGE_BITS;
+    uint64_t bitmap_offset = qemu_get_be64(f);
+    uint64_t pages_offset = qemu_get_be64(f);
+    uint8_t *bitmap = g_malloc(mapped_ram_bitmap_size(block));
+    uint64_t page, run;
+    int ret;
+
+    file_pages_queue(bitmap, mapped_ram_bitmap_size(block), bitmap_offset);
+    ret = file_pages_flush();
+
+    if (!ret && migrate_lazy_restore()) {
+        ret = mapped_ram_lazy_block(block, bitmap, pages_offset);
+        /* Nothing to read now */
+        nb_pages = 0;
+    }
+    for (page = 0; !ret && page < nb_pages; page += run) {
+        run = 1;
+        if (!mapped_ram_test_bit(bitmap, page)) {
+            continue;
+        }
+        while (page + run < nb_pages &&
+               run < MAPPED_RAM_MAX_RUN / TARGET_PAGE_SIZE &&
+               mapped_ram_test_bit(bitmap, page + run)) {
+            run++;
+        }
+        file_pages_queue(block->host + (page << TARGET_PAGE_BITS),
+                         run << TARGET_PAGE_BITS,
+                         pages_offset + (page << TARGET_PAGE_BITS));
+    }
+    if (!ret) {
+        ret = file_pages_flush();
+    }
+    g_free(bitmap);
+
+    if (!ret) {
+        ret = qemu_file_set_offset(f, pages_offset + block->used_length);
+    }
+    return ret;
+}
+
 /*
  * Find the next dirty page and update any state associated with
  * the search process.
@@ -1033,22 +2352,31 @@ static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
 }
 
 /*
- * Helper for 'get_queued_page' - gets a page off the queue
+ * Helper for 'get_queued_page' - gets a page off the queue; pages that
+ * the destination requested come before the pages prefetched around them
  *      ms:      MigrationState in
  * *offset:      Used to return the offset within the RAMBlock
  * ram_addr_abs: global offset in the dirty/sent bitmaps
+ * *urgent:      Set to true if the destination requested the page
  *
  * Returns:      block (or NULL if none available)
  */
 static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
-                              ram_addr_t *ram_addr_abs)
+                              ram_addr_t *ram_addr_abs, bool *urgent)
 {
     RAMBlock *block = NULL;
+    struct src_page_requests *queue = NULL;
 
     qemu_mutex_lock(&ms->src_page_req_mutex);
     if (!QSIMPLEQ_EMPTY(&ms->src_page_requests)) {
-        struct MigrationSrcPageRequest *entry =
-                                QSIMPLEQ_FIRST(&ms->src_page_requests);
+        queue = &ms->src_page_requests;
+        *urgent = true;
+    } else if (!QSIMPLEQ_EMPTY(&ms->src_page_prefetch)) {
+        queue = &ms->src_page_prefetch;
+        *urgent = false;
+    }
+    if (queue) {
+        struct MigrationSrcPageRequest *entry = QSIMPLEQ_FIRST(queue);
         block = entry->rb;
         *offset = entry->offset;
         *ram_addr_abs = (entry->offset + entry->rb->offset) &
@@ -1059,7 +2387,7 @@ static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
             entry->offset += TARGET_PAGE_SIZE;
         } else {
             memory_region_unref(block->mr);
-            QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+            QSIMPLEQ_REMOVE_HEAD(queue, next_req);
             g_free(entry);
         }
     }
@@ -1075,18 +2403,19 @@ static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
  *      ms:      MigrationState in
  *     pss:      PageSearchStatus structure updated with found block/offset
  * ram_addr_abs: global offset in the dirty/sent bitmaps
+ *   *urgent:    Set to true if the destination requested the page
  *
  * Returns:      true if a queued page is found
  */
 static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
-                            ram_addr_t *ram_addr_abs)
+                            ram_addr_t *ram_addr_abs, bool *urgent)
 {
     RAMBlock  *block;
     ram_addr_t offset;
     bool dirty;
 
     do {
-        block = unqueue_page(ms, &offset, ram_addr_abs);
+        block = unqueue_page(ms, &offset, ram_addr_abs, urgent);
         /*
          * We're sending this page, and since it's postcopy nothing else
          * will dirty it, and we must make sure it doesn't get sent again
@@ -1152,6 +2481,11 @@ void flush_page_queue(MigrationState *ms)
         QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
         g_free(mspr);
     }
+    QSIMPLEQ_FOREACH_SAFE(mspr, &ms->src_page_prefetch, next_req, next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&ms->src_page_prefetch, next_req);
+        g_free(mspr);
+    }
     rcu_read_unlock();
 }
 
@@ -1205,9 +2539,24 @@ int ram_save_queue_pages(MigrationState *ms, const char *rbname,
     new_entry->offset = start;
     new_entry->len = len;
 
+    /*
+     * The guest is likely to touch the pages around the requested ones
+     * soon, so send them next.  The requested pages themselves are skipped
+     * because they are not dirty anymore when the prefetch is processed.
+     */
+    ram_addr_t window = MAX(POSTCOPY_PREFETCH_SIZE, qemu_host_page_size);
+    struct MigrationSrcPageRequest *prefetch_entry =
+        g_malloc0(sizeof(struct MigrationSrcPageRequest));
+    prefetch_entry->rb = ramblock;
+    prefetch_entry->offset = QEMU_ALIGN_DOWN(start, window);
+    prefetch_entry->len = MIN(QEMU_ALIGN_UP(start + len, window),
+                              ramblock->used_length) - prefetch_entry->offset;
+
+    memory_region_ref(ramblock->mr);
     memory_region_ref(ramblock->mr);
     qemu_mutex_lock(&ms->src_page_req_mutex);
     QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
+    QSIMPLEQ_INSERT_TAIL(&ms->src_page_prefetch, prefetch_entry, next_req);
     qemu_mutex_unlock(&ms->src_page_req_mutex);
     rcu_read_unlock();
 
@@ -1246,6 +2595,10 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
             res = ram_save_compressed_page(f, pss,
                                            last_stage,
                                            bytes_transferred);
+        } else if (migrate_use_multifd()) {
+            res = ram_save_multifd_page(f, pss, bytes_transferred);
+        } else if (migrate_mapped_ram()) {
+            res = ram_save_mapped_page(f, pss, bytes_transferred);
         } else {
             res = ram_save_page(f, pss, last_stage,
                                 bytes_transferred);
@@ -1254,15 +2607,17 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
         if (res < 0) {
             return res;
         }
+        atomic_set(&pss->block->mig_sent_pages,
+                   pss->block->mig_sent_pages + 1);
         unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
         if (unsentmap) {
             clear_bit(dirty_ram_abs >> TARGET_PAGE_BITS, unsentmap);
         }
         /* Only update last_sent_block if a block was actually sent; xbzrle
          * might have decided the page was identical so didn't bother writing
-         * to the stream.
+         * to the stream.  ram_save_multifd_page() updates it itself.
          */
-        if (res > 0) {
+        if (res > 0 && !migrate_use_multifd()) {
             last_sent_block = pss->block;
         }
     }
@@ -1294,6 +2649,8 @@ static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
                               ram_addr_t dirty_ram_abs)
 {
     int tmppages, pages = 0;
+    ram_addr_t start = pss->offset & qemu_host_page_mask;
+
     do {
         tmppages = ram_save_target_page(ms, f, pss, last_stage,
                                         bytes_transferred, dirty_ram_abs);
@@ -1307,8 +2664,81 @@ static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
     } while (pss->offset & (qemu_host_page_size - 1));
 
     /* The offset we leave with is the last one we looked at */
-    pss->offset -= TARGET_PAGE_SIZE;
-    return pages;
+    pss->offset -= TARGET_PAGE_SIZE;
+
+    if (pages && migrate_background_snapshot()) {
+        /* The page is in the stream, the guest may write to it again */
+        background_snapshot_unprotect(pss->block->host + start,
+                                      qemu_host_page_size);
+    }
+    return pages;
+}
+
+/**
+ * ram_save_preempt_page: Send a host page requested by the destination
+ *                        over the postcopy preempt channel, so that it
+ *                        does not wait behind the background pages queued
+ *                        on the main channel.
+ *
+ * Returns: Number of target pages written.
+ *
+ * @ms: MigrationState holding the preempt channel
+ * @f: the main QEMUFile, used to report errors
+ * @pss: search status; offset must be host page aligned and is updated to
+ *       the last target page of the host page
+ * @dirty_ram_abs: Address of the start of the page in ram_addr_t space
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_preempt_page(MigrationState *ms, QEMUFile *f,
+                                 PageSearchStatus *pss,
+                                 ram_addr_t dirty_ram_abs,
+                                 uint64_t *bytes_transferred)
+{
+    QEMUFile *pf = ms->postcopy_preempt_file;
+    unsigned long *unsentmap;
+    ram_addr_t offset = pss->offset;
+    ram_addr_t addr;
+    int pages = 0;
+    int ret;
+
+    unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
+    for (addr = dirty_ram_abs; addr < dirty_ram_abs + qemu_host_page_size;
+         addr += TARGET_PAGE_SIZE) {
+        if (migration_bitmap_clear_dirty(addr)) {
+            pages++;
+        }
+        if (unsentmap) {
+            clear_bit(addr >> TARGET_PAGE_BITS, unsentmap);
+        }
+    }
+
+    /* The offset we leave with is the last one we looked at */
+    pss->offset += qemu_host_page_size - TARGET_PAGE_SIZE;
+    if (!pages) {
+        return 0;
+    }
+    atomic_set(&pss->block->mig_sent_pages,
+               pss->block->mig_sent_pages + pages);
+
+    /* The whole host page is sent even if only some of its target pages
+     * are dirty, because the destination places host pages atomically.
+     */
+    *bytes_transferred += save_page_header(pf, pss->block,
+                                           offset | RAM_SAVE_FLAG_PAGE);
+    qemu_put_buffer(pf, memory_region_get_ram_ptr(pss->block->mr) + offset,
+                    qemu_host_page_size);
+    qemu_fflush(pf);
+    ret = qemu_file_get_error(pf);
+    if (ret) {
+        qemu_file_set_error(f, ret);
+        return 0;
+    }
+
+    *bytes_transferred += qemu_host_page_size;
+    acct_info.norm_pages += qemu_host_page_size / TARGET_PAGE_SIZE;
+    trace_ram_save_preempt_page(pss->block->idstr, (uint64_t)offset);
+
+    return qemu_host_page_size / TARGET_PAGE_SIZE;
 }
 
 /**
@@ -1333,7 +2763,7 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     PageSearchStatus pss;
     MigrationState *ms = migrate_get_current();
     int pages = 0;
-    bool again, found;
+    bool again, found, urgent = false;
     ram_addr_t dirty_ram_abs; /* Address of the start of the dirty page in
                                  ram_addr_t space */
 
@@ -1347,14 +2777,19 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
 
     do {
         again = true;
-        found = get_queued_page(ms, &pss, &dirty_ram_abs);
+        found = get_queued_page(ms, &pss, &dirty_ram_abs, &urgent);
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
+            urgent = false;
             found = find_dirty_block(f, &pss, &again, &dirty_ram_abs);
         }
 
-        if (found) {
+        if (found && urgent && ms->postcopy_preempt_file &&
+            !(pss.offset & ~qemu_host_page_mask)) {
+            pages = ram_save_preempt_page(ms, f, &pss, dirty_ram_abs,
+                                          bytes_transferred);
+        } else if (found) {
             pages = ram_save_host_page(ms, f, &pss,
                                        last_stage, bytes_transferred,
                                        dirty_ram_abs);
@@ -1425,9 +2860,17 @@ static void ram_migration_cleanup(void *opaque)
      * no writing race against this migration_bitmap
      */
     struct BitmapRcu *bitmap = migration_bitmap_rcu;
+
+    /* A failed or cancelled migration ends in the middle of an iteration */
+    iteration_stats_end();
+    if (!migrate_background_snapshot()) {
+        precopy_notify(PRECOPY_NOTIFY_CLEANUP);
+    }
     atomic_rcu_set(&migration_bitmap_rcu, NULL);
     if (bitmap) {
-        memory_global_dirty_log_stop();
+        if (!migrate_background_snapshot()) {
+            memory_global_dirty_log_stop();
+        }
         call_rcu(bitmap, migration_bitmap_free, rcu);
     }
 
@@ -1441,6 +2884,18 @@ static void ram_migration_cleanup(void *opaque)
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    if (migrate_mapped_ram()) {
+        RAMBlock *block;
+
+        file_pages_stop();
+        rcu_read_lock();
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            g_free(block->file_bmap);
+            block->file_bmap = NULL;
+        }
+        rcu_read_unlock();
+    }
 }
 
 static void reset_ram_globals(void)
@@ -1944,17 +3399,52 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
      */
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
-    memory_global_dirty_log_start();
-    migration_bitmap_sync();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        block->mig_dirty_pages = block->used_length >> TARGET_PAGE_BITS;
+        block->mig_sent_pages = 0;
+        if (ramblock_is_ignored(block)) {
+            bitmap_clear(migration_bitmap_rcu->bmap,
+                         block->offset >> TARGET_PAGE_BITS,
+                         block->mig_dirty_pages);
+            migration_dirty_pages -= block->mig_dirty_pages;
+            block->mig_dirty_pages = 0;
+        }
+    }
+    qemu_mutex_lock(&iteration_stats.lock);
+    iteration_stats.nb_done = 0;
+    iteration_stats.started = false;
+    qemu_mutex_unlock(&iteration_stats.lock);
+
+    /* A background snapshot saves every page once, as it was when RAM was
+     * write-protected, so it does not need to track dirty pages.
+     */
+    if (!migrate_background_snapshot()) {
+        memory_global_dirty_log_start();
+        migration_bitmap_sync();
+    } else {
+        iteration_stats_start(0, migration_dirty_pages);
+    }
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
 
+    if (migrate_mapped_ram()) {
+        mapped_ram_run.len = 0;
+        if (file_pages_start(f, true) < 0) {
+            rcu_read_unlock();
+            error_report("Failed to start writing RAM to the file");
+            return -1;
+        }
+    }
+
     qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
 
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        if (migrate_mapped_ram()) {
+            mapped_ram_setup_block(f, block);
+        }
     }
 
     rcu_read_unlock();
@@ -2013,6 +3503,10 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    mapped_ram_flush(f);
+    if (multifd_send_sync(f, &bytes_transferred) < 0) {
+        qemu_file_set_error(f, -EIO);
+    }
     rcu_read_unlock();
 
     /*
@@ -2032,13 +3526,15 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     return pages_sent;
 }
 
-/* Called with iothread lock */
+/* Called with iothread lock, except for background snapshots */
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     rcu_read_lock();
 
-    if (!migration_in_postcopy(migrate_get_current())) {
+    if (!migration_in_postcopy(migrate_get_current()) &&
+        !migrate_background_snapshot()) {
         migration_bitmap_sync();
+        precopy_notify(PRECOPY_NOTIFY_COMPLETE);
     }
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
@@ -2057,10 +3553,28 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    mapped_ram_flush(f);
+    if (migrate_mapped_ram()) {
+        mapped_ram_save_bitmaps(f);
+    }
+    if (multifd_send_sync(f, &bytes_transferred) < 0) {
+        qemu_file_set_error(f, -EIO);
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+    iteration_stats_end();
 
     rcu_read_unlock();
 
+    /* Let the destination's preempt thread finish before the main stream
+     * ends, since the postcopy cleanup on the destination waits for it.
+     */
+    if (migrate_get_current()->postcopy_preempt_file) {
+        QEMUFile *pf = migrate_get_current()->postcopy_preempt_file;
+
+        qemu_put_be64(pf, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(pf);
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     return 0;
@@ -2075,7 +3589,7 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
     remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
 
     if (!migration_in_postcopy(migrate_get_current()) &&
-        remaining_size < max_size) {
+        !migrate_background_snapshot() && remaining_size < max_size) {
         qemu_mutex_lock_iothread();
         rcu_read_lock();
         migration_bitmap_sync();
@@ -2186,25 +3700,28 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
-
-    while (!quit_decomp_thread) {
-        qemu_mutex_lock(&param->mutex);
-        while (!param->start && !quit_decomp_thread) {
-            qemu_cond_wait(&param->cond, &param->mutex);
-            pagesize = TARGET_PAGE_SIZE;
-            if (!quit_decomp_thread) {
-                /* uncompress() will return failed in some case, especially
-                 * when the page is dirted when doing the compression, it's
-                 * not a problem because the dirty page will be retransferred
-                 * and uncompress() won't break the data in other pages.
-                 */
-                uncompress((Bytef *)param->des, &pagesize,
-                           (const Bytef *)param->compbuf, param->len);
-            }
-            param->start = false;
+    size_t bound = page_compress_bound();
+    DecompressBatch *batch;
+    int i;
+
+    while (true) {
+        qemu_sem_wait(&param->sem);
+        if (atomic_read(&quit_decomp_thread)) {
+            break;
+        }
+        batch = &param->ring[param->tail % COMPRESS_RING_SIZE];
+        for (i = 0; i < batch->nb_pages; i++) {
+            /* decompression will fail in some case, especially when the
+             * page is dirted when doing the compression, it's not a
+             * problem because the dirty page will be retransferred and
+             * it won't break the data in other pages.
+             */
+            decompress_data(&param->ctx, batch->des[i],
+                            batch->compbuf + i * bound, batch->len[i]);
         }
-        qemu_mutex_unlock(&param->mutex);
+        batch->nb_pages = 0;
+        atomic_mb_set(&param->tail, param->tail + 1);
+        qemu_sem_post(&decomp_done_sem);
     }
 
     return NULL;
@@ -2212,65 +3729,319 @@ static void *do_data_decompress(void *opaque)
 
 void migrate_decompress_threads_create(void)
 {
-    int i, thread_count;
+    size_t bound = page_compress_bound();
+    int i, j;
 
-    thread_count = migrate_decompress_threads();
-    decompress_threads = g_new0(QemuThread, thread_count);
-    decomp_param = g_new0(DecompressParam, thread_count);
+    decomp_thread_count = migrate_decompress_threads();
+    decomp_next = 0;
+    decomp_param = g_new0(DecompressParam, decomp_thread_count);
     quit_decomp_thread = false;
-    for (i = 0; i < thread_count; i++) {
-        qemu_mutex_init(&decomp_param[i].mutex);
-        qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
-        qemu_thread_create(decompress_threads + i, "decompress",
+    qemu_sem_init(&decomp_done_sem, 0);
+    for (i = 0; i < decomp_thread_count; i++) {
+        qemu_sem_init(&decomp_param[i].sem, 0);
+        compress_ctx_init(&decomp_param[i].ctx, true);
+        for (j = 0; j < COMPRESS_RING_SIZE; j++) {
+            decomp_param[i].ring[j].compbuf =
+                g_malloc0(COMPRESS_BATCH_PAGES * bound);
+        }
+        qemu_thread_create(&decomp_param[i].thread, "decompress",
                            do_data_decompress, decomp_param + i,
                            QEMU_THREAD_JOINABLE);
     }
 }
 
 void migrate_decompress_threads_join(void)
+{
+    int i, j;
+
+    if (!decomp_param) {
+        return;
+    }
+    atomic_set(&quit_decomp_thread, true);
+    for (i = 0; i < decomp_thread_count; i++) {
+        qemu_sem_post(&decomp_param[i].sem);
+    }
+    for (i = 0; i < decomp_thread_count; i++) {
+        qemu_thread_join(&decomp_param[i].thread);
+        qemu_sem_destroy(&decomp_param[i].sem);
+        compress_ctx_destroy(&decomp_param[i].ctx, true);
+        for (j = 0; j < COMPRESS_RING_SIZE; j++) {
+            g_free(decomp_param[i].ring[j].compbuf);
+        }
+    }
+    qemu_sem_destroy(&decomp_done_sem);
+    g_free(decomp_param);
+    decomp_param = NULL;
+}
+
+struct MultiFDRecvParams {
+    QemuThread thread;
+    QEMUFile *file;
+    /* posted by the thread when it received a sync packet */
+    QemuSemaphore sem_sync;
+    /* posted by the main thread to let the thread continue after a sync */
+    QemuSemaphore sem;
+    bool quit;
+};
+typedef struct MultiFDRecvParams MultiFDRecvParams;
+
+static MultiFDRecvParams *multifd_recv_params;
+/* Number of channels expected and number of channels connected so far */
+static int multifd_recv_nb_channels;
+static int multifd_recv_channels;
+static bool multifd_recv_failed;
+
+/*
+ * Receives one packet from @f.  Returns 1 if it was a sync packet, 0 if it
+ * only had pages and -1 on error.
+ */
+static int multifd_recv_packet(QEMUFile *f)
+{
+    void *host[MULTIFD_PAGES_MAX];
+    RAMBlock *block;
+    uint32_t flags, num;
+    ram_addr_t offset;
+    char id[256];
+    uint8_t len;
+    int i, ret = 0;
+
+    flags = qemu_get_be32(f);
+    num = qemu_get_be32(f);
+    if (qemu_file_get_error(f)) {
+        return -1;
+    }
+    if (num > MULTIFD_PAGES_MAX) {
+        error_report("multifd: too many pages in a packet: %" PRIu32, num);
+        return -1;
+    }
+
+    if (num) {
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+
+        rcu_read_lock();
+        block = qemu_ram_block_by_name(id);
+        if (!block) {
+            error_report("multifd: can't find block %s", id);
+            ret = -1;
+            goto out;
+        }
+        for (i = 0; i < num; i++) {
+            offset = qemu_get_be64(f);
+            host[i] = host_from_ram_block_offset(block, offset);
+            if (!host[i] || (offset & ~TARGET_PAGE_MASK)) {
+                error_report("multifd: illegal RAM offset " RAM_ADDR_FMT,
+                             offset);
+                ret = -1;
+                goto out;
+            }
+        }
+        for (i = 0; i < num; i++) {
+            qemu_get_buffer(f, host[i], TARGET_PAGE_SIZE);
+        }
+out:
+        rcu_read_unlock();
+    }
+
+    if (ret == 0 && qemu_file_get_error(f)) {
+        ret = -1;
+    }
+    if (ret == 0 && (flags & MULTIFD_FLAG_SYNC)) {
+        ret = 1;
+    }
+    return ret;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    QEMUFile *f = p->file;
+    int ret;
+
+    rcu_register_thread();
+    qemu_file_set_blocking(f, true);
+
+    if (qemu_get_be32(f) != MULTIFD_MAGIC ||
+        qemu_get_be32(f) != MULTIFD_VERSION) {
+        error_report("multifd: invalid channel header");
+        goto out;
+    }
+    /* The channel number is only informational */
+    qemu_get_be32(f);
+
+    while (!atomic_read(&p->quit)) {
+        ret = multifd_recv_packet(f);
+        if (ret < 0) {
+            break;
+        }
+        if (ret > 0) {
+            qemu_sem_post(&p->sem_sync);
+            qemu_sem_wait(&p->sem);
+        }
+    }
+
+out:
+    /* Make sure that the main thread does not wait for this channel.  The
+     * source closes the channels at the end of migration, so this is not
+     * necessarily an error unless another sync is expected.
+     */
+    atomic_set(&multifd_recv_failed, true);
+    qemu_sem_post(&p->sem_sync);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void migrate_multifd_recv_threads_create(void)
+{
+    int i, thread_count;
+
+    thread_count = migrate_multifd_channels();
+    multifd_recv_nb_channels = thread_count;
+    multifd_recv_params = g_new0(MultiFDRecvParams, thread_count);
+    multifd_recv_channels = 0;
+    multifd_recv_failed = false;
+    for (i = 0; i < thread_count; i++) {
+        qemu_sem_init(&multifd_recv_params[i].sem_sync, 0);
+        qemu_sem_init(&multifd_recv_params[i].sem, 0);
+    }
+}
+
+/*
+ * Starts receiving pages from the connected socket @fd.  Returns -1 if
+ * there are already enough channels.
+ */
+int migrate_multifd_recv_new_channel(int fd)
+{
+    MultiFDRecvParams *p;
+
+    if (multifd_recv_channels == multifd_recv_nb_channels) {
+        error_report("multifd: too many channels");
+        return -1;
+    }
+
+    p = &multifd_recv_params[multifd_recv_channels++];
+    p->file = qemu_fopen_socket(fd, "rb");
+    qemu_thread_create(&p->thread, "multifd_recv", multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+bool migrate_multifd_recv_has_all_channels(void)
+{
+    return multifd_recv_channels == multifd_recv_nb_channels;
+}
+
+void migrate_multifd_recv_threads_join(void)
+{
+    int i;
+
+    if (!multifd_recv_params) {
+        return;
+    }
+    for (i = 0; i < multifd_recv_nb_channels; i++) {
+        MultiFDRecvParams *p = &multifd_recv_params[i];
+
+        if (p->file) {
+            atomic_set(&p->quit, true);
+            qemu_file_shutdown(p->file);
+            qemu_sem_post(&p->sem);
+            qemu_thread_join(&p->thread);
+            qemu_fclose(p->file);
+        }
+        qemu_sem_destroy(&p->sem_sync);
+        qemu_sem_destroy(&p->sem);
+    }
+    g_free(multifd_recv_params);
+    multifd_recv_params = NULL;
+}
+
+/*
+ * Waits until all channels received the pages that were sent before the
+ * sync marker on the main channel, then lets them continue.
+ */
+static int multifd_recv_sync(void)
 {
     int i, thread_count;
 
-    quit_decomp_thread = true;
-    thread_count = migrate_decompress_threads();
+    if (!multifd_recv_params) {
+        error_report("multifd: sync marker without x-multifd");
+        return -EINVAL;
+    }
+
+    thread_count = multifd_recv_nb_channels;
     for (i = 0; i < thread_count; i++) {
-        qemu_mutex_lock(&decomp_param[i].mutex);
-        qemu_cond_signal(&decomp_param[i].cond);
-        qemu_mutex_unlock(&decomp_param[i].mutex);
+        qemu_sem_wait(&multifd_recv_params[i].sem_sync);
+    }
+    if (atomic_read(&multifd_recv_failed)) {
+        error_report("multifd: a channel failed");
+        return -EIO;
     }
     for (i = 0; i < thread_count; i++) {
-        qemu_thread_join(decompress_threads + i);
-        qemu_mutex_destroy(&decomp_param[i].mutex);
-        qemu_cond_destroy(&decomp_param[i].cond);
-        g_free(decomp_param[i].compbuf);
+        qemu_sem_post(&multifd_recv_params[i].sem);
     }
-    g_free(decompress_threads);
-    g_free(decomp_param);
-    decompress_threads = NULL;
-    decomp_param = NULL;
+
+    return 0;
 }
 
+static void decompress_queue_batch(DecompressParam *param)
+{
+    atomic_mb_set(&param->head, param->head + 1);
+    qemu_sem_post(&param->sem);
+}
+
+/*
+ * Reads a compressed page into the batch being filled, and queues the batch
+ * once it is full.
+ */
 static void decompress_data_with_multi_threads(QEMUFile *f,
                                                void *host, int len)
 {
-    int idx, thread_count;
+    DecompressParam *param = &decomp_param[decomp_next];
+    DecompressBatch *batch;
 
-    thread_count = migrate_decompress_threads();
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (!decomp_param[idx].start) {
-                qemu_get_buffer(f, decomp_param[idx].compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                start_decompression(&decomp_param[idx]);
-                break;
-            }
+    while (param->head - atomic_mb_read(&param->tail) == COMPRESS_RING_SIZE) {
+        qemu_sem_wait(&decomp_done_sem);
+    }
+
+    batch = &param->ring[param->head % COMPRESS_RING_SIZE];
+    qemu_get_buffer(f, batch->compbuf +
+                    batch->nb_pages * page_compress_bound(), len);
+    batch->des[batch->nb_pages] = host;
+    batch->len[batch->nb_pages] = len;
+    if (++batch->nb_pages == COMPRESS_BATCH_PAGES) {
+        decompress_queue_batch(param);
+        decomp_next = (decomp_next + 1) % decomp_thread_count;
+    }
+}
+
+/*
+ * Waits until all the pages received so far are decompressed.  The source
+ * sends a page at most once between two RAM_SAVE_FLAG_EOS, so this is
+ * enough to keep an older copy of a page from overwriting a newer one.
+ */
+static void wait_for_decompress_done(void)
+{
+    DecompressParam *param;
+    int idx;
+
+    if (!decomp_param) {
+        return;
+    }
+    for (idx = 0; idx < decomp_thread_count; idx++) {
+        param = &decomp_param[idx];
+        if (param->head - atomic_mb_read(&param->tail) < COMPRESS_RING_SIZE &&
+            param->ring[param->head % COMPRESS_RING_SIZE].nb_pages) {
+            decompress_queue_batch(param);
         }
-        if (idx < thread_count) {
-            break;
+    }
+    for (idx = 0; idx < decomp_thread_count; idx++) {
+        param = &decomp_param[idx];
+        while (atomic_mb_read(&param->tail) != param->head) {
+            qemu_sem_wait(&decomp_done_sem);
         }
     }
+    decomp_next = 0;
 }
 
 /*
@@ -2284,6 +4055,150 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
     return postcopy_ram_incoming_init(mis, ram_pages);
 }
 
+/*
+ * The postcopy preempt channel is an additional connection on which the
+ * source sends the host pages that the destination requested, so that
+ * they are not queued behind the background pages on the main connection.
+ * Each message is a page header and one whole host page; the stream ends
+ * with RAM_SAVE_FLAG_EOS.
+ */
+
+/* Opens the preempt channel on the source */
+int migrate_postcopy_preempt_channel_create(MigrationState *s)
+{
+    Error *local_err = NULL;
+    int fd;
+
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    fd = tcp_multifd_channel_connect(s, &local_err);
+    if (fd < 0) {
+        error_report_err(local_err);
+        return -1;
+    }
+    s->postcopy_preempt_file = qemu_fopen_socket(fd, "wb");
+    return 0;
+}
+
+static QEMUFile *postcopy_preempt_recv_file;
+static QemuThread postcopy_preempt_recv_thread;
+static bool postcopy_preempt_recv_running;
+
+/* Accepts the preempt channel on the destination */
+int migrate_postcopy_preempt_new_channel(int fd)
+{
+    if (!migrate_postcopy_preempt() || postcopy_preempt_recv_file) {
+        error_report("postcopy: unexpected connection");
+        return -1;
+    }
+
+    postcopy_preempt_recv_file = qemu_fopen_socket(fd, "rb");
+    return postcopy_preempt_recv_file ? 0 : -1;
+}
+
+/* True while the destination still waits for the preempt channel */
+bool migrate_postcopy_preempt_recv_pending(void)
+{
+    return migrate_postcopy_preempt() && !postcopy_preempt_recv_file;
+}
+
+static void *postcopy_preempt_recv_thread_fn(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    QEMUFile *f = postcopy_preempt_recv_file;
+    void *buf = qemu_memalign(qemu_host_page_size, qemu_host_page_size);
+    int ret = 0;
+
+    while (!ret) {
+        ram_addr_t addr;
+        RAMBlock *block;
+        void *host;
+        int flags;
+        char id[256];
+        uint8_t len;
+
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        ret = qemu_file_get_error(f);
+        if (ret || flags == RAM_SAVE_FLAG_EOS) {
+            break;
+        }
+        if (flags != RAM_SAVE_FLAG_PAGE) {
+            error_report("postcopy preempt: bad flags %#x", flags);
+            ret = -EINVAL;
+            break;
+        }
+
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        qemu_get_buffer(f, buf, qemu_host_page_size);
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            break;
+        }
+
+        rcu_read_lock();
+        block = qemu_ram_block_by_name(id);
+        host = block ? host_from_ram_block_offset(block, addr) : NULL;
+        rcu_read_unlock();
+        if (!host || ((uintptr_t)host & ~qemu_host_page_mask)) {
+            error_report("postcopy preempt: illegal page %s/" RAM_ADDR_FMT,
+                         id, addr);
+            ret = -EINVAL;
+            break;
+        }
+
+        trace_ram_postcopy_preempt_recv_page(id, (uint64_t)addr);
+        ret = postcopy_place_page(mis, host, buf);
+    }
+
+    if (ret) {
+        qemu_file_set_error(mis->from_src_file, ret);
+    }
+    qemu_vfree(buf);
+    return NULL;
+}
+
+/* Starts placing the pages of the preempt channel, once postcopy listens */
+void ram_postcopy_preempt_recv_start(MigrationIncomingState *mis)
+{
+    if (!postcopy_preempt_recv_file || postcopy_preempt_recv_running) {
+        return;
+    }
+
+    qemu_thread_create(&postcopy_preempt_recv_thread, "postcopy/preempt",
+                       postcopy_preempt_recv_thread_fn, mis,
+                       QEMU_THREAD_JOINABLE);
+    postcopy_preempt_recv_running = true;
+}
+
+/*
+ * Waits for the source to end the preempt channel and closes it.  If the
+ * main stream failed, or there is no @mis yet, the source may never end it,
+ * so the connection is shut down first.
+ */
+void ram_postcopy_preempt_recv_cleanup(MigrationIncomingState *mis)
+{
+    if (!postcopy_preempt_recv_file) {
+        return;
+    }
+
+    if (!mis || qemu_file_get_error(mis->from_src_file)) {
+        qemu_file_shutdown(postcopy_preempt_recv_file);
+    }
+    if (postcopy_preempt_recv_running) {
+        qemu_thread_join(&postcopy_preempt_recv_thread);
+        postcopy_preempt_recv_running = false;
+    }
+    qemu_fclose(postcopy_preempt_recv_file);
+    postcopy_preempt_recv_file = NULL;
+}
+
 /*
  * Called in postcopy mode by ram_load().
  * rcu_read_lock is taken prior to this being called.
@@ -2460,6 +4375,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         case RAM_SAVE_FLAG_MEM_SIZE:
             /* Synchronize RAM block list */
             total_ram_bytes = addr;
+            if (migrate_mapped_ram()) {
+                ret = file_pages_start(f, false);
+            }
             while (!ret && total_ram_bytes) {
                 RAMBlock *block;
                 char id[256];
@@ -2483,6 +4401,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                     }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = mapped_ram_load_block(f, block);
+                    }
                 } else {
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
@@ -2491,6 +4412,12 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                 total_ram_bytes -= length;
             }
+            if (migrate_mapped_ram()) {
+                file_pages_stop();
+            }
+            if (!ret && migrate_lazy_restore()) {
+                ret = ram_lazy_restore_start();
+            }
             break;
 
         case RAM_SAVE_FLAG_COMPRESS:
@@ -2504,7 +4431,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 || len > page_compress_bound()) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
@@ -2520,8 +4447,12 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
+            wait_for_decompress_done();
             break;
         default:
             if (flags & RAM_SAVE_FLAG_HOOK) {
@@ -2556,5 +4487,6 @@ static SaveVMHandlers savevm_ram_handlers = {
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
+    qemu_mutex_init(&iteration_stats.lock);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
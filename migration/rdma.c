@@ -46,6 +46,12 @@
 
 #define RDMA_REG_CHUNK_SHIFT 20 /* 1 MB */
 
+/*
+ * With dynamic registration, ask the destination to register up to this
+ * many chunks in the round trip that registers the chunk needed now.
+ */
+#define RDMA_REG_BATCH_CHUNKS 32
+
 /*
  * This is only for non-live state being migrated.
  * Instead of RDMA_WRITE messages, we use RDMA_SEND
@@ -65,12 +71,15 @@
  * Capabilities for negotiation.
  */
 #define RDMA_CAPABILITY_PIN_ALL 0x01
+/* the destination replies to every request of a REGISTER_REQUEST */
+#define RDMA_CAPABILITY_REG_BATCH 0x02
 
 /*
  * Add the other flags above to this list of known capabilities
  * as they are introduced.
  */
-static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL;
+static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL |
+                                     RDMA_CAPABILITY_REG_BATCH;
 
 #define CHECK_ERROR_STATE() \
     do { \
@@ -321,6 +330,12 @@ typedef struct RDMAContext {
 
     bool pin_all;
 
+    /* the device supports on-demand paging memory regions */
+    bool odp;
+
+    /* several chunks can be registered with one REGISTER_REQUEST */
+    bool reg_batch;
+
     /*
      * infiniband-specific variables for opening the device
      * and maintaining connection state and so forth.
@@ -625,15 +640,11 @@ static int qemu_rdma_init_ram_blocks(RDMAContext *rdma)
  * Note: If used outside of cleanup, the caller must ensure that the destination
  * block structures are also updated
  */
-static int rdma_delete_block(RDMAContext *rdma, RDMALocalBlock *block)
+/*
+ * Deregisters the memory of a block, unpinning it.
+ */
+static void rdma_release_block(RDMAContext *rdma, RDMALocalBlock *block)
 {
-    RDMALocalBlocks *local = &rdma->local_ram_blocks;
-    RDMALocalBlock *old = local->block;
-    int x;
-
-    if (rdma->blockmap) {
-        g_hash_table_remove(rdma->blockmap, (void *)(uintptr_t)block->offset);
-    }
     if (block->pmr) {
         int j;
 
@@ -653,6 +664,18 @@ static int rdma_delete_block(RDMAContext *rdma, RDMALocalBlock *block)
         rdma->total_registrations--;
         block->mr = NULL;
     }
+}
+
+static int rdma_delete_block(RDMAContext *rdma, RDMALocalBlock *block)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    RDMALocalBlock *old = local->block;
+    int x;
+
+    if (rdma->blockmap) {
+        g_hash_table_remove(rdma->blockmap, (void *)(uintptr_t)block->offset);
+    }
+    rdma_release_block(rdma, block);
 
     g_free(block->transit_bitmap);
     block->transit_bitmap = NULL;
@@ -1004,11 +1027,28 @@ err_resolve_create_id:
     return ret;
 }
 
+#ifdef CONFIG_RDMA_ODP
+static bool qemu_rdma_has_odp(struct ibv_context *verbs)
+{
+    struct ibv_device_attr_ex attr;
+
+    memset(&attr, 0, sizeof(attr));
+    if (ibv_query_device_ex(verbs, NULL, &attr)) {
+        return false;
+    }
+    return attr.odp_caps.general_caps & IBV_ODP_SUPPORT;
+}
+#endif
+
 /*
  * Create protection domain and completion queues
  */
 static int qemu_rdma_alloc_pd_cq(RDMAContext *rdma)
 {
+#ifdef CONFIG_RDMA_ODP
+    rdma->odp = qemu_rdma_has_odp(rdma->verbs);
+#endif
+
     /* allocate pd */
     rdma->pd = ibv_alloc_pd(rdma->verbs);
     if (!rdma->pd) {
@@ -1074,6 +1114,27 @@ static int qemu_rdma_alloc_qp(RDMAContext *rdma)
     return 0;
 }
 
+/*
+ * Registers @len bytes at @addr.  If they cannot be pinned, e.g. because
+ * of the locked memory limit, and the device supports it, falls back to an
+ * on-demand paging registration: nothing is pinned and the device faults
+ * the pages in as they are accessed.
+ */
+static struct ibv_mr *qemu_rdma_reg_mr(RDMAContext *rdma, void *addr,
+                                       size_t len, int access)
+{
+    struct ibv_mr *mr;
+
+    mr = ibv_reg_mr(rdma->pd, addr, len, access);
+#ifdef CONFIG_RDMA_ODP
+    if (!mr && rdma->odp) {
+        trace_qemu_rdma_reg_mr_odp(addr, len, errno);
+        mr = ibv_reg_mr(rdma->pd, addr, len, access | IBV_ACCESS_ON_DEMAND);
+    }
+#endif
+    return mr;
+}
+
 static int qemu_rdma_reg_whole_ram_blocks(RDMAContext *rdma)
 {
     int i;
@@ -1081,7 +1142,7 @@ static int qemu_rdma_reg_whole_ram_blocks(RDMAContext *rdma)
 
     for (i = 0; i < local->nb_blocks; i++) {
         local->block[i].mr =
-            ibv_reg_mr(rdma->pd,
+            qemu_rdma_reg_mr(rdma,
                     local->block[i].local_host_addr,
                     local->block[i].length,
                     IBV_ACCESS_LOCAL_WRITE |
@@ -1174,7 +1235,7 @@ static int qemu_rdma_register_and_get_keys(RDMAContext *rdma,
 
         trace_qemu_rdma_register_and_get_keys(len, chunk_start);
 
-        block->pmr[chunk] = ibv_reg_mr(rdma->pd,
+        block->pmr[chunk] = qemu_rdma_reg_mr(rdma,
                 chunk_start, len,
                 (rkey ? (IBV_ACCESS_LOCAL_WRITE |
                         IBV_ACCESS_REMOTE_WRITE) : 0));
@@ -1840,6 +1901,44 @@ static int qemu_rdma_exchange_recv(RDMAContext *rdma, RDMAControlHeader *head,
     return 0;
 }
 
+/*
+ * Fills @reg with requests for the chunks of a RAM block that follow
+ * @chunk and are neither registered nor zero, so that the destination
+ * registers them in the same round trip as @chunk instead of one round
+ * trip each.  Returns the number of requests.
+ */
+static int qemu_rdma_batch_registrations(RDMALocalBlock *block,
+                                         int current_index, uint64_t chunk,
+                                         RDMARegister *reg)
+{
+    uint64_t last = MIN(chunk + RDMA_REG_BATCH_CHUNKS, block->nb_chunks);
+    int count = 0;
+
+    if (!block->is_ram_block) {
+        return 0;
+    }
+
+    for (chunk++; chunk < last; chunk++) {
+        uint8_t *start = ram_chunk_start(block, chunk);
+        size_t len = ram_chunk_end(block, chunk) - start;
+
+        if (block->remote_keys[chunk]) {
+            continue;
+        }
+        if (buffer_is_zero(start, len)) {
+            continue;
+        }
+
+        reg[count].current_index = current_index;
+        reg[count].key.current_addr = block->offset +
+                                      (chunk << RDMA_REG_CHUNK_SHIFT);
+        reg[count].chunks = 0;
+        count++;
+    }
+
+    return count;
+}
+
 /*
  * Write an actual chunk of memory using RDMA.
  *
@@ -1853,11 +1952,12 @@ static int qemu_rdma_write_one(QEMUFile *f, RDMAContext *rdma,
     struct ibv_sge sge;
     struct ibv_send_wr send_wr = { 0 };
     struct ibv_send_wr *bad_wr;
-    int reg_result_idx, ret, count = 0;
+    int reg_result_idx, ret, count = 0, nb_reg, i;
     uint64_t chunk, chunks;
     uint8_t *chunk_start, *chunk_end;
     RDMALocalBlock *block = &(rdma->local_ram_blocks.block[current_index]);
-    RDMARegister reg;
+    RDMARegister reg[RDMA_REG_BATCH_CHUNKS];
+    uint64_t reg_chunk[RDMA_REG_BATCH_CHUNKS];
     RDMARegisterResult *reg_result;
     RDMAControlHeader resp = { .type = RDMA_CONTROL_REGISTER_RESULT };
     RDMAControlHeader head = { .len = sizeof(RDMARegister),
@@ -1924,10 +2024,7 @@ retry:
              * memset() + madvise() the entire chunk without RDMA.
              */
 
-            if (can_use_buffer_find_nonzero_offset((void *)(uintptr_t)sge.addr,
-                                                   length)
-                   && buffer_find_nonzero_offset((void *)(uintptr_t)sge.addr,
-                                                    length) == length) {
+            if (buffer_is_zero((void *)(uintptr_t)sge.addr, length)) {
                 RDMACompress comp = {
                                         .offset = current_addr,
                                         .value = 0,
@@ -1955,21 +2052,37 @@ retry:
             }
 
             /*
-             * Otherwise, tell other side to register.
+             * Otherwise, tell other side to register, along with the
+             * chunks that we are likely to write next.
              */
-            reg.current_index = current_index;
+            reg[0].current_index = current_index;
             if (block->is_ram_block) {
-                reg.key.current_addr = current_addr;
+                reg[0].key.current_addr = current_addr;
             } else {
-                reg.key.chunk = chunk;
+                reg[0].key.chunk = chunk;
+            }
+            reg[0].chunks = chunks;
+            nb_reg = 1;
+            if (rdma->reg_batch) {
+                nb_reg += qemu_rdma_batch_registrations(block, current_index,
+                                                        chunk + chunks,
+                                                        &reg[1]);
+            }
+            reg_chunk[0] = chunk;
+            for (i = 1; i < nb_reg; i++) {
+                reg_chunk[i] = (reg[i].key.current_addr - block->offset) >>
+                               RDMA_REG_CHUNK_SHIFT;
             }
-            reg.chunks = chunks;
 
             trace_qemu_rdma_write_one_sendreg(chunk, sge.length, current_index,
-                                              current_addr);
+                                              current_addr, nb_reg);
 
-            register_to_network(rdma, &reg);
-            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
+            for (i = 0; i < nb_reg; i++) {
+                register_to_network(rdma, &reg[i]);
+            }
+            head.repeat = nb_reg;
+            head.len = nb_reg * sizeof(RDMARegister);
+            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) reg,
                                     &resp, &reg_result_idx, NULL);
             if (ret < 0) {
                 return ret;
@@ -1983,16 +2096,25 @@ retry:
                 return -EINVAL;
             }
 
+            if (resp.repeat != nb_reg) {
+                error_report("rdma: got %d registration results for %d "
+                             "requests", resp.repeat, nb_reg);
+                return -EINVAL;
+            }
+
             reg_result = (RDMARegisterResult *)
                     rdma->wr_data[reg_result_idx].control_curr;
 
-            network_to_result(reg_result);
+            for (i = 0; i < nb_reg; i++) {
+                network_to_result(&reg_result[i]);
 
-            trace_qemu_rdma_write_one_recvregres(block->remote_keys[chunk],
-                                                 reg_result->rkey, chunk);
+                trace_qemu_rdma_write_one_recvregres(
+                        block->remote_keys[reg_chunk[i]], reg_result[i].rkey,
+                        reg_chunk[i]);
 
-            block->remote_keys[chunk] = reg_result->rkey;
-            block->remote_host_addr = reg_result->host_addr;
+                block->remote_keys[reg_chunk[i]] = reg_result[i].rkey;
+            }
+            block->remote_host_addr = reg_result[0].host_addr;
         } else {
             /* already registered before */
             if (qemu_rdma_register_and_get_keys(rdma, block, sge.addr,
@@ -2349,6 +2471,7 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
         trace_qemu_rdma_connect_pin_all_requested();
         cap.flags |= RDMA_CAPABILITY_PIN_ALL;
     }
+    cap.flags |= RDMA_CAPABILITY_REG_BATCH;
 
     caps_to_network(&cap);
 
@@ -2390,6 +2513,8 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
 
     trace_qemu_rdma_connect_pin_all_outcome(rdma->pin_all);
 
+    rdma->reg_batch = cap.flags & RDMA_CAPABILITY_REG_BATCH;
+
     rdma_ack_cm_event(cm_event);
 
     ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
@@ -2833,6 +2958,9 @@ static int qemu_rdma_accept(RDMAContext *rdma)
     if (cap.flags & RDMA_CAPABILITY_PIN_ALL) {
         rdma->pin_all = true;
     }
+    if (cap.flags & RDMA_CAPABILITY_REG_BATCH) {
+        rdma->reg_batch = true;
+    }
 
     rdma->cm_id = cm_event->id;
     verbs = cm_event->id->verbs;
@@ -3071,6 +3199,9 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque)
             trace_qemu_rdma_registration_handle_register(head.repeat);
 
             reg_resp.repeat = head.repeat;
+            if (rdma->reg_batch) {
+                reg_resp.len = head.repeat * sizeof(RDMARegisterResult);
+            }
             registers = (RDMARegister *) rdma->wr_data[idx].control_curr;
 
             for (count = 0; count < head.repeat; count++) {
@@ -3360,6 +3491,20 @@ static int qemu_rdma_registration_stop(QEMUFile *f, void *opaque,
         goto err;
     }
 
+    if (flags == RAM_CONTROL_FINISH) {
+        RDMALocalBlocks *local = &rdma->local_ram_blocks;
+        int i;
+
+        /*
+         * All the writes have completed and no RAM is sent after this, so
+         * unpin it now rather than when the migration is cleaned up.
+         */
+        for (i = 0; i < local->nb_blocks; i++) {
+            rdma_release_block(rdma, &local->block[i]);
+        }
+        trace_qemu_rdma_registration_stop_release(rdma->total_registrations);
+    }
+
     return 0;
 err:
     rdma->error_state = ret;
@@ -262,6 +262,8 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* Microseconds spent saving it during the current migration */
+    int64_t save_time;
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -869,7 +871,9 @@ bool qemu_savevm_state_blocked(Error **errp)
     SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
-        if (se->vmsd && se->vmsd->unmigratable) {
+        if (se->vmsd && se->vmsd->unmigratable &&
+            !(se->vmsd->dev_unplug_pending &&
+              se->vmsd->dev_unplug_pending(se->opaque))) {
             error_setg(errp, "State blocked by non-migratable device '%s'",
                        se->idstr);
             return true;
@@ -878,6 +882,19 @@ bool qemu_savevm_state_blocked(Error **errp)
     return false;
 }
 
+bool qemu_savevm_state_guest_unplug_pending(void)
+{
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (se->vmsd && se->vmsd->dev_unplug_pending &&
+            se->vmsd->dev_unplug_pending(se->opaque)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static bool enforce_config_section(void)
 {
     MachineState *machine = MACHINE(qdev_get_machine());
@@ -897,14 +914,51 @@ void qemu_savevm_state_header(QEMUFile *f)
 
 }
 
+static void savevm_account_time(SaveStateEntry *se, int64_t start)
+{
+    int64_t elapsed = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+
+    se->save_time += elapsed;
+    trace_savevm_section_save_time(se->idstr, se->section_id, elapsed);
+}
+
+/*
+ * Returns the time spent saving each device during the current or last
+ * migration, for query-migrate-telemetry.
+ */
+DeviceSaveTimeList *qemu_savevm_get_save_times(void)
+{
+    DeviceSaveTimeList *head = NULL, **tail = &head;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        DeviceSaveTimeList *entry;
+
+        if (!se->save_time) {
+            continue;
+        }
+        entry = g_new0(DeviceSaveTimeList, 1);
+        entry->value = g_new0(DeviceSaveTime, 1);
+        entry->value->id_str = g_strdup(se->idstr);
+        entry->value->instance_id = se->instance_id;
+        entry->value->save_time = se->save_time;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
 void qemu_savevm_state_begin(QEMUFile *f,
                              const MigrationParams *params)
 {
     SaveStateEntry *se;
+    int64_t start;
     int ret;
 
     trace_savevm_state_begin();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        se->save_time = 0;
         if (!se->ops || !se->ops->set_params) {
             continue;
         }
@@ -922,7 +976,9 @@ void qemu_savevm_state_begin(QEMUFile *f,
         }
         save_section_header(f, se, QEMU_VM_SECTION_START);
 
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         ret = se->ops->save_live_setup(f, se->opaque);
+        savevm_account_time(se, start);
         save_section_footer(f, se);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
@@ -940,6 +996,7 @@ void qemu_savevm_state_begin(QEMUFile *f,
 int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy)
 {
     SaveStateEntry *se;
+    int64_t start;
     int ret = 1;
 
     trace_savevm_state_iterate();
@@ -968,7 +1025,9 @@ int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy)
 
         save_section_header(f, se, QEMU_VM_SECTION_PART);
 
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         ret = se->ops->save_live_iterate(f, se->opaque);
+        savevm_account_time(se, start);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
 
@@ -1003,6 +1062,7 @@ static bool should_send_vmdesc(void)
 void qemu_savevm_state_complete_postcopy(QEMUFile *f)
 {
     SaveStateEntry *se;
+    int64_t start;
     int ret;
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
@@ -1019,7 +1079,9 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
 
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         ret = se->ops->save_live_complete_postcopy(f, se->opaque);
+        savevm_account_time(se, start);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
         if (ret < 0) {
@@ -1032,48 +1094,20 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
-void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
+/*
+ * Saves the state of the devices that are not iterable, followed by the
+ * end of the stream unless @in_postcopy.
+ */
+void qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
+                                                     bool in_postcopy)
 {
     QJSON *vmdesc;
     int vmdesc_len;
     SaveStateEntry *se;
-    int ret;
-    bool in_postcopy = migration_in_postcopy(migrate_get_current());
-
-    trace_savevm_state_complete_precopy();
+    int64_t start;
 
     cpu_synchronize_all_states();
 
-    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
-        if (!se->ops ||
-            (in_postcopy && se->ops->save_live_complete_postcopy) ||
-            (in_postcopy && !iterable_only) ||
-            !se->ops->save_live_complete_precopy) {
-            continue;
-        }
-
-        if (se->ops && se->ops->is_active) {
-            if (!se->ops->is_active(se->opaque)) {
-                continue;
-            }
-        }
-        trace_savevm_section_start(se->idstr, se->section_id);
-
-        save_section_header(f, se, QEMU_VM_SECTION_END);
-
-        ret = se->ops->save_live_complete_precopy(f, se->opaque);
-        trace_savevm_section_end(se->idstr, se->section_id, ret);
-        save_section_footer(f, se);
-        if (ret < 0) {
-            qemu_file_set_error(f, ret);
-            return;
-        }
-    }
-
-    if (iterable_only) {
-        return;
-    }
-
     vmdesc = qjson_new();
     json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
     json_start_array(vmdesc, "devices");
@@ -1094,7 +1128,9 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         json_prop_int(vmdesc, "instance_id", se->instance_id);
 
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         vmstate_save(f, se, vmdesc);
+        savevm_account_time(se, start);
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
 
@@ -1120,6 +1156,50 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
     qemu_fflush(f);
 }
 
+void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
+{
+    SaveStateEntry *se;
+    int64_t start;
+    int ret;
+    bool in_postcopy = migration_in_postcopy(migrate_get_current());
+
+    trace_savevm_state_complete_precopy();
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (!se->ops ||
+            (in_postcopy && se->ops->save_live_complete_postcopy) ||
+            (in_postcopy && !iterable_only) ||
+            !se->ops->save_live_complete_precopy) {
+            continue;
+        }
+
+        if (se->ops && se->ops->is_active) {
+            if (!se->ops->is_active(se->opaque)) {
+                continue;
+            }
+        }
+        trace_savevm_section_start(se->idstr, se->section_id);
+
+        save_section_header(f, se, QEMU_VM_SECTION_END);
+
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        ret = se->ops->save_live_complete_precopy(f, se->opaque);
+        savevm_account_time(se, start);
+        trace_savevm_section_end(se->idstr, se->section_id, ret);
+        save_section_footer(f, se);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+            return;
+        }
+    }
+
+    if (iterable_only) {
+        return;
+    }
+
+    qemu_savevm_state_complete_precopy_non_iterable(f, in_postcopy);
+}
+
 /* Give an estimate of the amount left to be transferred,
  * the result is split into the amount for units that can and
  * for units that can't do postcopy.
@@ -1483,6 +1563,7 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
     if (postcopy_ram_enable_notify(mis)) {
         return -1;
     }
+    ram_postcopy_preempt_recv_start(mis);
 
     if (mis->have_listen_thread) {
         error_report("CMD_POSTCOPY_RAM_LISTEN already has a listen thread");
@@ -1963,24 +2044,23 @@ int qemu_loadvm_state(QEMUFile *f)
     return ret;
 }
 
-void hmp_savevm(Monitor *mon, const QDict *qdict)
+int save_vmstate(const char *name)
 {
     BlockDriverState *bs, *bs1;
     QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
-    int ret;
+    int ret = -1;
     QEMUFile *f;
     int saved_vm_running;
     uint64_t vm_state_size;
     qemu_timeval tv;
     struct tm tm;
-    const char *name = qdict_get_try_str(qdict, "name");
     Error *local_err = NULL;
     AioContext *aio_context;
 
     if (!bdrv_all_can_snapshot(&bs)) {
-        monitor_printf(mon, "Device '%s' is writable but does not "
-                       "support snapshots.\n", bdrv_get_device_name(bs));
-        return;
+        error_report("Device '%s' is writable but does not "
+                     "support snapshots.", bdrv_get_device_name(bs));
+        return ret;
     }
 
     /* Delete old snapshots of the same name */
@@ -1988,13 +2068,13 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
         error_reportf_err(local_err,
                           "Error while deleting snapshot on device '%s': ",
                           bdrv_get_device_name(bs1));
-        return;
+        return ret;
     }
 
     bs = bdrv_all_find_vmstate_bs();
     if (bs == NULL) {
-        monitor_printf(mon, "No block device can accept snapshots\n");
-        return;
+        error_report("No block device can accept snapshots");
+        return ret;
     }
     aio_context = bdrv_get_aio_context(bs);
 
@@ -2002,8 +2082,8 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
 
     ret = global_state_store();
     if (ret) {
-        monitor_printf(mon, "Error saving global state\n");
-        return;
+        error_report("Error saving global state");
+        return ret;
     }
     vm_stop(RUN_STATE_SAVE_VM);
 
@@ -2034,7 +2114,8 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
     /* save the VM state */
     f = qemu_fopen_bdrv(bs, 1);
     if (!f) {
-        monitor_printf(mon, "Could not open VM state file\n");
+        error_report("Could not open VM state file");
+        ret = -1;
         goto the_end;
     }
     ret = qemu_savevm_state(f, &local_err);
@@ -2047,8 +2128,8 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
 
     ret = bdrv_all_create_snapshot(sn, bs, vm_state_size, &bs);
     if (ret < 0) {
-        monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                       bdrv_get_device_name(bs));
+        error_report("Error while creating snapshot on '%s'",
+                     bdrv_get_device_name(bs));
     }
 
  the_end:
@@ -2056,6 +2137,12 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
     if (saved_vm_running) {
         vm_start();
     }
+    return ret;
+}
+
+void hmp_savevm(Monitor *mon, const QDict *qdict)
+{
+    save_vmstate(qdict_get_try_str(qdict, "name"));
 }
 
 void qmp_xen_save_devices_state(const char *filename, Error **errp)
@@ -15,8 +15,13 @@
 
 #include "qemu/osdep.h"
 
+#ifdef CONFIG_LINUX
+#include <linux/errqueue.h>
+#endif
+
 #include "qemu-common.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "qemu/sockets.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
@@ -50,9 +55,167 @@ static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    g_free(s->multifd_host_port);
+    s->multifd_host_port = g_strdup(host_port);
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
+/*
+ * Opens one of the additional x-multifd or x-postcopy-preempt connections.
+ * They are only opened once the main connection is established, so that
+ * the destination accepts the main connection first.
+ */
+int tcp_multifd_channel_connect(MigrationState *s, Error **errp)
+{
+    return inet_connect(s->multifd_host_port, errp);
+}
+
+#if defined(CONFIG_LINUX) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define TCP_ZEROCOPY
+#endif
+
+bool tcp_zerocopy_supported(void)
+{
+#ifdef TCP_ZEROCOPY
+    return true;
+#else
+    return false;
+#endif
+}
+
+int tcp_zerocopy_enable(int fd, Error **errp)
+{
+#ifdef TCP_ZEROCOPY
+    int v = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) < 0) {
+        error_setg_errno(errp, errno, "Could not enable zero copy send");
+        return -1;
+    }
+    return 0;
+#else
+    error_setg(errp, "Zero copy send is not supported on this host");
+    return -1;
+#endif
+}
+
+/*
+ * Reads the completion notifications of the zero copy sends on @fd and
+ * decreases *@pending, the number of sends whose data the kernel may still
+ * read, accordingly.  If @block is true, waits until *@pending is 0, i.e.
+ * until the memory that was sent can be modified or freed without
+ * affecting the data on the wire.
+ *
+ * Returns 0 on success and -errno on failure.
+ */
+int tcp_zerocopy_flush(int fd, uint64_t *pending, bool block)
+{
+#ifdef TCP_ZEROCOPY
+    while (*pending) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+        struct msghdr msg = {
+            .msg_control    = control,
+            .msg_controllen = sizeof(control),
+        };
+        struct sock_extended_err *serr;
+        struct cmsghdr *cm;
+        GPollFD pfd;
+        ssize_t ret;
+
+        ret = recvmsg(fd, &msg, MSG_ERRQUEUE);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -errno;
+            }
+            if (!block) {
+                return 0;
+            }
+
+            /* A non-empty error queue is reported as G_IO_ERR */
+            pfd.fd = fd;
+            pfd.events = G_IO_ERR;
+            pfd.revents = 0;
+            TFR(ret = g_poll(&pfd, 1, -1 /* no timeout */));
+            if (pfd.revents & G_IO_HUP) {
+                return -EPIPE;
+            }
+            continue;
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (!cm || cm->cmsg_len < CMSG_LEN(sizeof(*serr))) {
+            return -EIO;
+        }
+        serr = (struct sock_extended_err *) CMSG_DATA(cm);
+        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno) {
+            return -EIO;
+        }
+
+        /* ee_info and ee_data are the first and last completed send */
+        *pending -= MIN(*pending, serr->ee_data - serr->ee_info + 1);
+    }
+    return 0;
+#else
+    abort();
+#endif
+}
+
+/*
+ * Sends all data in @iov on the blocking socket @fd with MSG_ZEROCOPY.
+ * The memory must not be modified before tcp_zerocopy_flush() returned
+ * with *@pending == 0, or the modified data may be sent.  @iov is
+ * modified.
+ *
+ * Returns the number of bytes sent or -errno on failure.
+ */
+ssize_t tcp_zerocopy_writev(int fd, struct iovec *iov, unsigned int iovcnt,
+                            uint64_t *pending)
+{
+#ifdef TCP_ZEROCOPY
+    size_t size = iov_size(iov, iovcnt);
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < size) {
+        struct msghdr msg = {
+            .msg_iov    = iov,
+            .msg_iovlen = iovcnt,
+        };
+
+        ret = sendmsg(fd, &msg, MSG_ZEROCOPY);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS) {
+                /* Too many notifications are outstanding */
+                ret = tcp_zerocopy_flush(fd, pending, true);
+                if (ret < 0) {
+                    return ret;
+                }
+                continue;
+            }
+            return -errno;
+        }
+
+        (*pending)++;
+        done += ret;
+        iov_discard_front(&iov, &iovcnt, ret);
+    }
+
+    return done;
+#else
+    abort();
+#endif
+}
+
+/* The main connection, held back until all x-multifd connections or the
+ * x-postcopy-preempt connection arrived */
+static QEMUFile *tcp_incoming_file;
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
@@ -64,28 +227,62 @@ static void tcp_accept_incoming_migration(void *opaque)
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c < 0 && errno == EINTR);
-    qemu_set_fd_handler(s, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
     if (c < 0) {
         error_report("could not accept migration connection (%s)",
                      strerror(errno));
-        return;
+        goto out;
     }
 
-    f = qemu_fopen_socket(c, "rb");
-    if (f == NULL) {
-        error_report("could not qemu_fopen socket");
-        goto out;
+    if (tcp_incoming_file) {
+        int ret;
+
+        if (migrate_use_multifd()) {
+            ret = migrate_multifd_recv_new_channel(c);
+        } else {
+            ret = migrate_postcopy_preempt_new_channel(c);
+        }
+        if (ret < 0) {
+            closesocket(c);
+            goto out;
+        }
+    } else {
+        tcp_incoming_file = qemu_fopen_socket(c, "rb");
+        if (tcp_incoming_file == NULL) {
+            error_report("could not qemu_fopen socket");
+            closesocket(c);
+            goto out;
+        }
+        if (migrate_use_multifd()) {
+            migrate_multifd_recv_threads_create();
+        }
+    }
+
+    if ((migrate_use_multifd() && !migrate_multifd_recv_has_all_channels()) ||
+        migrate_postcopy_preempt_recv_pending()) {
+        /* Wait for the next connection */
+        return;
     }
 
+    qemu_set_fd_handler(s, NULL, NULL, NULL);
+    closesocket(s);
+
+    f = tcp_incoming_file;
+    tcp_incoming_file = NULL;
     process_incoming_migration(f);
     return;
 
 out:
-    closesocket(c);
+    qemu_set_fd_handler(s, NULL, NULL, NULL);
+    closesocket(s);
+    if (tcp_incoming_file) {
+        qemu_fclose(tcp_incoming_file);
+        tcp_incoming_file = NULL;
+        migrate_multifd_recv_threads_join();
+        ram_postcopy_preempt_recv_cleanup(NULL);
+    }
 }
 
 void tcp_start_incoming_migration(const char *host_port, Error **errp)
@@ -75,6 +75,90 @@ static void *vmstate_base_addr(void *opaque, VMStateField *field, bool alloc)
     return base_addr;
 }
 
+/*
+ * Arrays of plain integers are transferred with one buffer copy instead of
+ * one call of VMStateInfo.get()/put() per element.  Returns true if this is
+ * possible for the @n_elems elements of @size bytes of @field.
+ */
+static bool vmstate_can_bulk(VMStateField *field, int n_elems, int size)
+{
+    const VMStateInfo *info = field->info;
+
+    if (n_elems <= 1 ||
+        (field->flags & (VMS_STRUCT | VMS_ARRAY_OF_POINTER | VMS_VBUFFER))) {
+        return false;
+    }
+
+    switch (size) {
+    case 1:
+        return info == &vmstate_info_int8 || info == &vmstate_info_uint8;
+    case 2:
+        return info == &vmstate_info_int16 || info == &vmstate_info_uint16;
+    case 4:
+        return info == &vmstate_info_int32 || info == &vmstate_info_uint32;
+    case 8:
+        return info == &vmstate_info_int64 || info == &vmstate_info_uint64;
+    default:
+        return false;
+    }
+}
+
+/* Converts @n integers of @size bytes between host and big endian order */
+static void vmstate_bswap_bulk(void *dest, const void *src, int size, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        switch (size) {
+        case 1:
+            ((uint8_t *)dest)[i] = ((const uint8_t *)src)[i];
+            break;
+        case 2:
+            ((uint16_t *)dest)[i] = cpu_to_be16(((const uint16_t *)src)[i]);
+            break;
+        case 4:
+            ((uint32_t *)dest)[i] = cpu_to_be32(((const uint32_t *)src)[i]);
+            break;
+        case 8:
+            ((uint64_t *)dest)[i] = cpu_to_be64(((const uint64_t *)src)[i]);
+            break;
+        }
+    }
+}
+
+static void vmstate_put_bulk(QEMUFile *f, void *base_addr, int size,
+                             int n_elems)
+{
+#ifdef HOST_WORDS_BIGENDIAN
+    qemu_put_buffer(f, base_addr, size * n_elems);
+#else
+    uint64_t buf[32];
+    int chunk = sizeof(buf) / size;
+    int i, n;
+
+    if (size == 1) {
+        qemu_put_buffer(f, base_addr, n_elems);
+        return;
+    }
+    for (i = 0; i < n_elems; i += n) {
+        n = MIN(chunk, n_elems - i);
+        vmstate_bswap_bulk(buf, base_addr + i * size, size, n);
+        qemu_put_buffer(f, (uint8_t *)buf, n * size);
+    }
+#endif
+}
+
+static void vmstate_get_bulk(QEMUFile *f, void *base_addr, int size,
+                             int n_elems)
+{
+    qemu_get_buffer(f, base_addr, size * n_elems);
+#ifndef HOST_WORDS_BIGENDIAN
+    if (size > 1) {
+        vmstate_bswap_bulk(base_addr, base_addr, size, n_elems);
+    }
+#endif
+}
+
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
@@ -112,27 +196,36 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             int i, n_elems = vmstate_n_elems(opaque, field);
             int size = vmstate_size(opaque, field);
 
-            for (i = 0; i < n_elems; i++) {
-                void *addr = base_addr + size * i;
-
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    addr = *(void **)addr;
-                }
-                if (field->flags & VMS_STRUCT) {
-                    ret = vmstate_load_state(f, field->vmsd, addr,
-                                             field->vmsd->version_id);
-                } else {
-                    ret = field->info->get(f, addr, size);
-
-                }
-                if (ret >= 0) {
-                    ret = qemu_file_get_error(f);
-                }
+            if (vmstate_can_bulk(field, n_elems, size)) {
+                vmstate_get_bulk(f, base_addr, size, n_elems);
+                ret = qemu_file_get_error(f);
                 if (ret < 0) {
-                    qemu_file_set_error(f, ret);
                     trace_vmstate_load_field_error(field->name, ret);
                     return ret;
                 }
+            } else {
+                for (i = 0; i < n_elems; i++) {
+                    void *addr = base_addr + size * i;
+
+                    if (field->flags & VMS_ARRAY_OF_POINTER) {
+                        addr = *(void **)addr;
+                    }
+                    if (field->flags & VMS_STRUCT) {
+                        ret = vmstate_load_state(f, field->vmsd, addr,
+                                                 field->vmsd->version_id);
+                    } else {
+                        ret = field->info->get(f, addr, size);
+
+                    }
+                    if (ret >= 0) {
+                        ret = qemu_file_get_error(f);
+                    }
+                    if (ret < 0) {
+                        qemu_file_set_error(f, ret);
+                        trace_vmstate_load_field_error(field->name, ret);
+                        return ret;
+                    }
+                }
             }
         } else if (field->flags & VMS_MUST_EXIST) {
             error_report("Input validation failed: %s/%s",
@@ -316,27 +409,36 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
             int64_t old_offset, written_bytes;
             QJSON *vmdesc_loop = vmdesc;
 
-            for (i = 0; i < n_elems; i++) {
-                void *addr = base_addr + size * i;
-
-                vmsd_desc_field_start(vmsd, vmdesc_loop, field, i, n_elems);
-                old_offset = qemu_ftell_fast(f);
-
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    addr = *(void **)addr;
-                }
-                if (field->flags & VMS_STRUCT) {
-                    vmstate_save_state(f, field->vmsd, addr, vmdesc_loop);
-                } else {
-                    field->info->put(f, addr, size);
-                }
-
-                written_bytes = qemu_ftell_fast(f) - old_offset;
-                vmsd_desc_field_end(vmsd, vmdesc_loop, field, written_bytes, i);
-
-                /* Compressed arrays only care about the first element */
-                if (vmdesc_loop && vmsd_can_compress(field)) {
-                    vmdesc_loop = NULL;
+            if (vmstate_can_bulk(field, n_elems, size) &&
+                (!vmdesc || vmsd_can_compress(field))) {
+                /* A compressed description only covers the first element */
+                vmsd_desc_field_start(vmsd, vmdesc, field, 0, n_elems);
+                vmstate_put_bulk(f, base_addr, size, n_elems);
+                vmsd_desc_field_end(vmsd, vmdesc, field, size, 0);
+            } else {
+                for (i = 0; i < n_elems; i++) {
+                    void *addr = base_addr + size * i;
+
+                    vmsd_desc_field_start(vmsd, vmdesc_loop, field, i, n_elems);
+                    old_offset = qemu_ftell_fast(f);
+
+                    if (field->flags & VMS_ARRAY_OF_POINTER) {
+                        addr = *(void **)addr;
+                    }
+                    if (field->flags & VMS_STRUCT) {
+                        vmstate_save_state(f, field->vmsd, addr, vmdesc_loop);
+                    } else {
+                        field->info->put(f, addr, size);
+                    }
+
+                    written_bytes = qemu_ftell_fast(f) - old_offset;
+                    vmsd_desc_field_end(vmsd, vmdesc_loop, field,
+                                        written_bytes, i);
+
+                    /* Compressed arrays only care about the first element */
+                    if (vmdesc_loop && vmsd_can_compress(field)) {
+                        vmdesc_loop = NULL;
+                    }
                 }
             }
         } else {
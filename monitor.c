@@ -64,9 +64,6 @@
 #include "trace.h"
 #include "trace/control.h"
 #include "monitor/hmp-target.h"
-#ifdef CONFIG_TRACE_SIMPLE
-#include "trace/simple.h"
-#endif
 #include "exec/memory.h"
 #include "qmp-commands.h"
 #include "hmp.h"
@@ -137,6 +134,8 @@ typedef struct mon_cmd_t {
      */
     struct mon_cmd_t *sub_table;
     void (*command_completion)(ReadLineState *rs, int nb_args, const char *str);
+    /* QMP only: safe to run in the monitor I/O thread, without the BQL */
+    bool oob;
 } mon_cmd_t;
 
 /* file descriptors passed via SCM_RIGHTS */
@@ -165,8 +164,13 @@ struct MonFdset {
     QLIST_ENTRY(MonFdset) next;
 };
 
+/* A request read by the monitor I/O thread, run later in the main loop */
+typedef struct QMPRequest {
+    QObject *req;               /* parsed request, NULL on a parse error */
+    bool closed;                /* not a request: the client went away */
+} QMPRequest;
+
 typedef struct {
-    QObject *id;
     JSONMessageParser parser;
     /*
      * When a client connects, we're in capabilities negotiation mode.
@@ -174,8 +178,22 @@ typedef struct {
      * mode.
      */
     bool in_command_mode;       /* are we in command mode? */
+
+    /*
+     * With MONITOR_USE_OOB, input is read and parsed in the monitor
+     * I/O thread.  Commands marked oob run there directly, the rest
+     * are queued for @bh, which runs them in the main loop with the
+     * BQL held.
+     */
+    bool use_io_thread;
+    QemuMutex queue_lock;       /* protects @queue */
+    GQueue *queue;              /* QMPRequest entries */
+    QEMUBH *bh;
 } MonitorQMP;
 
+/* Stop reading from the client when this many requests are pending */
+#define QMP_REQ_QUEUE_LEN_MAX 8
+
 /*
  * To prevent flooding clients, events can be throttled. The
  * throttling is calculated globally, rather than per-Monitor
@@ -231,7 +249,10 @@ static mon_cmd_t info_cmds[];
 
 static const mon_cmd_t qmp_cmds[];
 
-Monitor *cur_mon;
+__thread Monitor *cur_mon;
+
+/* Monitor I/O thread, shared by all monitors using MONITOR_USE_OOB */
+static GMainContext *mon_io_context;
 
 static QEMUClockType event_clock_type = QEMU_CLOCK_REALTIME;
 
@@ -412,8 +433,8 @@ static QDict *build_qmp_error_dict(Error *err)
     return qobject_to_qdict(obj);
 }
 
-static void monitor_protocol_emitter(Monitor *mon, QObject *data,
-                                     Error *err)
+static void monitor_protocol_emitter(Monitor *mon, QObject *id,
+                                     QObject *data, Error *err)
 {
     QDict *qmp;
 
@@ -434,9 +455,9 @@ static void monitor_protocol_emitter(Monitor *mon, QObject *data,
         qmp = build_qmp_error_dict(err);
     }
 
-    if (mon->qmp.id) {
-        qdict_put_obj(qmp, "id", mon->qmp.id);
-        mon->qmp.id = NULL;
+    if (id) {
+        qobject_incref(id);
+        qdict_put_obj(qmp, "id", id);
     }
 
     monitor_json_emitter(mon, QOBJECT(qmp));
@@ -910,23 +931,23 @@ static void hmp_trace_event(Monitor *mon, const QDict *qdict)
     }
 }
 
-#ifdef CONFIG_TRACE_SIMPLE
+#if defined(CONFIG_TRACE_SIMPLE) || defined(CONFIG_TRACE_RING)
 static void hmp_trace_file(Monitor *mon, const QDict *qdict)
 {
     const char *op = qdict_get_try_str(qdict, "op");
     const char *arg = qdict_get_try_str(qdict, "arg");
 
     if (!op) {
-        st_print_trace_file_status((FILE *)mon, &monitor_fprintf);
+        trace_file_print_status((FILE *)mon, &monitor_fprintf);
     } else if (!strcmp(op, "on")) {
-        st_set_trace_file_enabled(true);
+        trace_file_set_enabled(true);
     } else if (!strcmp(op, "off")) {
-        st_set_trace_file_enabled(false);
+        trace_file_set_enabled(false);
     } else if (!strcmp(op, "flush")) {
-        st_flush_trace_buffer();
+        trace_file_flush();
     } else if (!strcmp(op, "set")) {
         if (arg) {
-            st_set_trace_file(arg);
+            trace_init_file(arg);
         }
     } else {
         monitor_printf(mon, "unexpected argument \"%s\"\n", op);
@@ -3591,8 +3612,15 @@ cleanup:
 static int monitor_can_read(void *opaque)
 {
     Monitor *mon = opaque;
+    bool full = false;
 
-    return (mon->suspend_cnt == 0) ? 1 : 0;
+    if (mon->qmp.use_io_thread) {
+        qemu_mutex_lock(&mon->qmp.queue_lock);
+        full = g_queue_get_length(mon->qmp.queue) >= QMP_REQ_QUEUE_LEN_MAX;
+        qemu_mutex_unlock(&mon->qmp.queue_lock);
+    }
+
+    return (mon->suspend_cnt == 0 && !full) ? 1 : 0;
 }
 
 static bool invalid_qmp_mode(const Monitor *mon, const mon_cmd_t *cmd,
@@ -3864,19 +3892,20 @@ static QDict *qmp_check_input_obj(QObject *input_obj, Error **errp)
     return input_dict;
 }
 
-static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
+/* Takes ownership of @obj */
+static void monitor_qmp_dispatch(Monitor *mon, QObject *obj)
 {
     Error *local_err = NULL;
-    QObject *obj, *data;
+    QObject *id, *data;
     QDict *input, *args;
     const mon_cmd_t *cmd;
     const char *cmd_name;
-    Monitor *mon = cur_mon;
+    Monitor *old_mon = cur_mon;
 
+    cur_mon = mon;
     args = input = NULL;
-    data = NULL;
+    id = data = NULL;
 
-    obj = json_parser_parse(tokens, NULL);
     if (!obj) {
         // FIXME: should be triggered in json_parser_parse()
         error_setg(&local_err, QERR_JSON_PARSING);
@@ -3889,8 +3918,7 @@ static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
         goto err_out;
     }
 
-    mon->qmp.id = qdict_get(input, "id");
-    qobject_incref(mon->qmp.id);
+    id = qdict_get(input, "id");
 
     cmd_name = qdict_get_str(input, "execute");
     trace_handle_qmp_command(mon, cmd_name);
@@ -3920,22 +3948,85 @@ static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
     cmd->mhandler.cmd_new(args, &data, &local_err);
 
 err_out:
-    monitor_protocol_emitter(mon, data, local_err);
+    monitor_protocol_emitter(mon, id, data, local_err);
     qobject_decref(data);
     error_free(local_err);
     QDECREF(input);
     QDECREF(args);
+    cur_mon = old_mon;
 }
 
-static void monitor_qmp_read(void *opaque, const uint8_t *buf, int size)
+static bool qmp_request_is_oob(QObject *obj)
 {
-    Monitor *old_mon = cur_mon;
+    const mon_cmd_t *cmd;
+    const char *cmd_name;
 
-    cur_mon = opaque;
+    if (!obj || qobject_type(obj) != QTYPE_QDICT) {
+        return false;
+    }
+    cmd_name = qdict_get_try_str(qobject_to_qdict(obj), "execute");
+    if (!cmd_name) {
+        return false;
+    }
+    cmd = qmp_find_cmd(cmd_name);
+    return cmd && cmd->oob;
+}
 
-    json_message_parser_feed(&cur_mon->qmp.parser, (const char *) buf, size);
+static void monitor_qmp_queue(Monitor *mon, QMPRequest *req)
+{
+    qemu_mutex_lock(&mon->qmp.queue_lock);
+    g_queue_push_tail(mon->qmp.queue, req);
+    qemu_mutex_unlock(&mon->qmp.queue_lock);
+    qemu_bh_schedule(mon->qmp.bh);
+}
 
-    cur_mon = old_mon;
+static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
+{
+    Monitor *mon = container_of(parser, Monitor, qmp.parser);
+    QObject *obj = json_parser_parse(tokens, NULL);
+    QMPRequest *req;
+
+    if (!mon->qmp.use_io_thread || qmp_request_is_oob(obj)) {
+        monitor_qmp_dispatch(mon, obj);
+        return;
+    }
+
+    req = g_new0(QMPRequest, 1);
+    req->req = obj;
+    monitor_qmp_queue(mon, req);
+}
+
+/* Runs the requests queued by the monitor I/O thread */
+static void monitor_qmp_bh(void *opaque)
+{
+    Monitor *mon = opaque;
+    QMPRequest *req;
+
+    for (;;) {
+        qemu_mutex_lock(&mon->qmp.queue_lock);
+        req = g_queue_pop_head(mon->qmp.queue);
+        qemu_mutex_unlock(&mon->qmp.queue_lock);
+        if (!req) {
+            break;
+        }
+        if (req->closed) {
+            mon_refcount--;
+            monitor_fdsets_cleanup();
+        } else {
+            monitor_qmp_dispatch(mon, req->req);
+        }
+        g_free(req);
+    }
+
+    /* The I/O thread may have stopped reading because the queue was full */
+    g_main_context_wakeup(mon_io_context);
+}
+
+static void monitor_qmp_read(void *opaque, const uint8_t *buf, int size)
+{
+    Monitor *mon = opaque;
+
+    json_message_parser_feed(&mon->qmp.parser, (const char *) buf, size);
 }
 
 static void monitor_read(void *opaque, const uint8_t *buf, int size)
@@ -3984,11 +4075,15 @@ void monitor_resume(Monitor *mon)
         readline_show_prompt(mon->rs);
 }
 
-static QObject *get_qmp_greeting(void)
+static QObject *get_qmp_greeting(Monitor *mon)
 {
     QObject *ver = NULL;
 
     qmp_marshal_query_version(NULL, &ver, NULL);
+    if (mon->qmp.use_io_thread) {
+        return qobject_from_jsonf("{'QMP':{'version': %p,"
+                                  "'capabilities': ['oob']}}", ver);
+    }
     return qobject_from_jsonf("{'QMP':{'version': %p,'capabilities': []}}",ver);
 }
 
@@ -4000,7 +4095,7 @@ static void monitor_qmp_event(void *opaque, int event)
     switch (event) {
     case CHR_EVENT_OPENED:
         mon->qmp.in_command_mode = false;
-        data = get_qmp_greeting();
+        data = get_qmp_greeting(mon);
         monitor_json_emitter(mon, data);
         qobject_decref(data);
         mon_refcount++;
@@ -4008,6 +4103,14 @@ static void monitor_qmp_event(void *opaque, int event)
     case CHR_EVENT_CLOSED:
         json_message_parser_destroy(&mon->qmp.parser);
         json_message_parser_init(&mon->qmp.parser, handle_qmp_command);
+        if (mon->qmp.use_io_thread) {
+            /* fd sets belong to the main loop, let the BH clean them up */
+            QMPRequest *req = g_new0(QMPRequest, 1);
+
+            req->closed = true;
+            monitor_qmp_queue(mon, req);
+            break;
+        }
         mon_refcount--;
         monitor_fdsets_cleanup();
         break;
@@ -4115,6 +4218,36 @@ static void __attribute__((constructor)) monitor_lock_init(void)
     qemu_mutex_init(&monitor_lock);
 }
 
+static void *monitor_io_thread(void *opaque)
+{
+    for (;;) {
+        g_main_context_iteration(mon_io_context, TRUE);
+    }
+    return NULL;
+}
+
+static void monitor_io_thread_init(void)
+{
+    QemuThread thread;
+
+    if (mon_io_context) {
+        return;
+    }
+    mon_io_context = g_main_context_new();
+    qemu_thread_create(&thread, "mon_iothread", monitor_io_thread,
+                       NULL, QEMU_THREAD_DETACHED);
+}
+
+static void monitor_qmp_init_oob(Monitor *mon)
+{
+    monitor_io_thread_init();
+    mon->qmp.use_io_thread = true;
+    qemu_mutex_init(&mon->qmp.queue_lock);
+    mon->qmp.queue = g_queue_new();
+    mon->qmp.bh = qemu_bh_new(monitor_qmp_bh, mon);
+    qemu_chr_fe_set_context(mon->chr, mon_io_context);
+}
+
 void monitor_init(CharDriverState *chr, int flags)
 {
     static int is_first_init = 1;
@@ -4140,10 +4273,14 @@ void monitor_init(CharDriverState *chr, int flags)
     }
 
     if (monitor_is_qmp(mon)) {
+        /* Input may arrive as soon as the handlers are added */
+        json_message_parser_init(&mon->qmp.parser, handle_qmp_command);
+        if (flags & MONITOR_USE_OOB) {
+            monitor_qmp_init_oob(mon);
+        }
         qemu_chr_add_handlers(chr, monitor_can_read, monitor_qmp_read,
                               monitor_qmp_event, mon);
         qemu_chr_fe_set_echo(chr, true);
-        json_message_parser_init(&mon->qmp.parser, handle_qmp_command);
     } else {
         qemu_chr_add_handlers(chr, monitor_can_read, monitor_read,
                               monitor_event, mon);
@@ -4239,6 +4376,9 @@ QemuOptsList qemu_mon_opts = {
         },{
             .name = "pretty",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "x-oob",
+            .type = QEMU_OPT_BOOL,
         },
         { /* end of list */ }
     },
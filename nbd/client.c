@@ -19,7 +19,7 @@
 #include "qemu/osdep.h"
 #include "nbd-internal.h"
 
-static int nbd_errno_to_system_errno(int err)
+int nbd_errno_to_system_errno(int err)
 {
     switch (err) {
     case NBD_SUCCESS:
@@ -349,10 +349,167 @@ static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
 }
 
 
+static int nbd_drop(QIOChannel *ioc, size_t size)
+{
+    uint8_t buffer[512];
+
+    while (size > 0) {
+        size_t count = MIN(sizeof(buffer), size);
+
+        if (read_sync(ioc, buffer, count) != count) {
+            return -1;
+        }
+        size -= count;
+    }
+    return 0;
+}
+
+static int nbd_send_option_request(QIOChannel *ioc, uint32_t opt,
+                                   uint32_t len, const void *data,
+                                   Error **errp)
+{
+    uint64_t magic = cpu_to_be64(NBD_OPTS_MAGIC);
+    uint32_t be_opt = cpu_to_be32(opt);
+    uint32_t be_len = cpu_to_be32(len);
+
+    if (write_sync(ioc, &magic, sizeof(magic)) != sizeof(magic) ||
+        write_sync(ioc, &be_opt, sizeof(be_opt)) != sizeof(be_opt) ||
+        write_sync(ioc, &be_len, sizeof(be_len)) != sizeof(be_len) ||
+        (len && write_sync(ioc, (void *)data, len) != len)) {
+        error_setg(errp, "Failed to send option %x", opt);
+        return -1;
+    }
+    return 0;
+}
+
+/* Read the header of a reply to option @opt.  The payload, @len bytes,
+ * is left on the wire.
+ */
+static int nbd_receive_option_reply(QIOChannel *ioc, uint32_t opt,
+                                    uint32_t *type, uint32_t *len,
+                                    Error **errp)
+{
+    uint64_t magic;
+    uint32_t reply_opt;
+
+    if (read_sync(ioc, &magic, sizeof(magic)) != sizeof(magic) ||
+        read_sync(ioc, &reply_opt, sizeof(reply_opt)) != sizeof(reply_opt) ||
+        read_sync(ioc, type, sizeof(*type)) != sizeof(*type) ||
+        read_sync(ioc, len, sizeof(*len)) != sizeof(*len)) {
+        error_setg(errp, "Failed to read reply to option %x", opt);
+        return -1;
+    }
+    if (be64_to_cpu(magic) != NBD_REP_MAGIC) {
+        error_setg(errp, "Unexpected option reply magic");
+        return -1;
+    }
+    reply_opt = be32_to_cpu(reply_opt);
+    if (reply_opt != opt) {
+        error_setg(errp, "Unexpected option type %x expected %x",
+                   reply_opt, opt);
+        return -1;
+    }
+    *type = be32_to_cpu(*type);
+    *len = be32_to_cpu(*len);
+    return 0;
+}
+
+/* Returns 1 if the server agreed to send structured replies, 0 if it
+ * refused, -1 on communication failure.
+ */
+static int nbd_request_structured_reply(QIOChannel *ioc, Error **errp)
+{
+    uint32_t type, len;
+
+    TRACE("Requesting structured replies");
+    if (nbd_send_option_request(ioc, NBD_OPT_STRUCTURED_REPLY, 0, NULL,
+                                errp) < 0 ||
+        nbd_receive_option_reply(ioc, NBD_OPT_STRUCTURED_REPLY, &type, &len,
+                                 errp) < 0) {
+        return -1;
+    }
+    if (nbd_drop(ioc, len) < 0) {
+        error_setg(errp, "Failed to read structured reply option payload");
+        return -1;
+    }
+    if (type != NBD_REP_ACK || len != 0) {
+        TRACE("Server refused structured replies (%x)", type);
+        return 0;
+    }
+    return 1;
+}
+
+/* Select the "base:allocation" meta context for export @name.  Returns 1
+ * and sets *@context_id if the server selected it, 0 if not, -1 on
+ * communication failure.
+ */
+static int nbd_request_base_allocation(QIOChannel *ioc, const char *name,
+                                       uint32_t *context_id, Error **errp)
+{
+    const char *query = NBD_META_CONTEXT_BASE_ALLOCATION;
+    uint32_t name_len = strlen(name);
+    uint32_t query_len = strlen(query);
+    uint32_t len = 4 + name_len + 4 + 4 + query_len;
+    uint8_t *buf = g_malloc(len);
+    uint8_t *p = buf;
+    int found = 0;
+
+    stl_be_p(p, name_len);
+    memcpy(p + 4, name, name_len);
+    p += 4 + name_len;
+    stl_be_p(p, 1);
+    stl_be_p(p + 4, query_len);
+    memcpy(p + 8, query, query_len);
+
+    TRACE("Requesting meta context '%s'", query);
+    if (nbd_send_option_request(ioc, NBD_OPT_SET_META_CONTEXT, len, buf,
+                                errp) < 0) {
+        g_free(buf);
+        return -1;
+    }
+    g_free(buf);
+
+    while (1) {
+        uint32_t type;
+        uint32_t id;
+        char reply_name[32];
+
+        if (nbd_receive_option_reply(ioc, NBD_OPT_SET_META_CONTEXT,
+                                     &type, &len, errp) < 0) {
+            return -1;
+        }
+        if (type != NBD_REP_META_CONTEXT) {
+            if (nbd_drop(ioc, len) < 0) {
+                error_setg(errp, "Failed to read meta context payload");
+                return -1;
+            }
+            /* NBD_REP_ACK or an error both end the list */
+            return found;
+        }
+        if (len < sizeof(id) || len - sizeof(id) >= sizeof(reply_name)) {
+            error_setg(errp, "Invalid meta context reply length %" PRIu32,
+                       len);
+            return -1;
+        }
+        if (read_sync(ioc, &id, sizeof(id)) != sizeof(id) ||
+            read_sync(ioc, reply_name, len - sizeof(id)) != len - sizeof(id)) {
+            error_setg(errp, "Failed to read meta context reply");
+            return -1;
+        }
+        reply_name[len - sizeof(id)] = '\0';
+        if (!strcmp(reply_name, query)) {
+            *context_id = be32_to_cpu(id);
+            found = 1;
+        }
+    }
+}
+
+
 int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint32_t *flags,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
                           QIOChannel **outioc,
-                          off_t *size, Error **errp)
+                          off_t *size, struct nbd_extensions *ext,
+                          Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
@@ -366,6 +523,10 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint32_t *flags,
     if (outioc) {
         *outioc = NULL;
     }
+    if (ext) {
+        ext->structured_reply = false;
+        ext->base_allocation = false;
+    }
     if (tlscreds && !outioc) {
         error_setg(errp, "Output I/O channel required for TLS");
         goto fail;
@@ -458,6 +619,25 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint32_t *flags,
             if (nbd_receive_query_exports(ioc, name, errp) < 0) {
                 goto fail;
             }
+
+            if (ext) {
+                rc = nbd_request_structured_reply(ioc, errp);
+                if (rc < 0) {
+                    rc = -EINVAL;
+                    goto fail;
+                }
+                ext->structured_reply = rc;
+                if (ext->structured_reply) {
+                    rc = nbd_request_base_allocation(ioc, name,
+                                                     &ext->context_id, errp);
+                    if (rc < 0) {
+                        rc = -EINVAL;
+                        goto fail;
+                    }
+                    ext->base_allocation = rc;
+                }
+                rc = -EINVAL;
+            }
         }
         /* write the export name */
         magic = cpu_to_be64(magic);
@@ -651,16 +831,16 @@ ssize_t nbd_send_request(QIOChannel *ioc, struct nbd_request *request)
 
 ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(ioc, buf, sizeof(buf));
+    ret = read_sync(ioc, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
@@ -669,13 +849,42 @@ ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
+
+       Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload that follows
      */
 
     magic = be32_to_cpup((uint32_t*)buf);
-    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
+    reply->magic = magic;
     reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
 
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        ret = read_sync(ioc, buf + NBD_REPLY_SIZE,
+                        NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE);
+        if (ret != NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return ret < 0 ? ret : -EINVAL;
+        }
+        reply->error = 0;
+        reply->flags = be16_to_cpup((uint16_t*)(buf + 4));
+        reply->type = be16_to_cpup((uint16_t*)(buf + 6));
+        reply->length = be32_to_cpup((uint32_t*)(buf + 16));
+
+        TRACE("Got reply chunk: "
+              "{ .flags = %x, .type = %d, handle = %" PRIu64 ", length = %u }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
+    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
     reply->error = nbd_errno_to_system_errno(reply->error);
+    reply->flags = NBD_REPLY_FLAG_DONE;
+    reply->type = NBD_REPLY_TYPE_NONE;
+    reply->length = 0;
 
     TRACE("Got reply: "
           "{ magic = 0x%x, .error = %d, handle = %" PRIu64" }",
@@ -88,6 +88,9 @@ struct NBDClient {
 
     bool can_read;
 
+    bool structured_reply;  /* NBD_OPT_STRUCTURED_REPLY was negotiated */
+    bool base_allocation;   /* "base:allocation" meta context selected */
+
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
@@ -189,12 +192,12 @@ static ssize_t nbd_negotiate_drop_sync(QIOChannel *ioc, size_t size)
 
 */
 
-static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+static int nbd_negotiate_send_rep_len(QIOChannel *ioc, uint32_t type,
+                                      uint32_t opt, uint32_t len)
 {
     uint64_t magic;
-    uint32_t len;
 
-    TRACE("Reply opt=%x type=%x", type, opt);
+    TRACE("Reply opt=%x type=%x len=%u", type, opt, len);
 
     magic = cpu_to_be64(NBD_REP_MAGIC);
     if (nbd_negotiate_write(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -211,7 +214,7 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
         LOG("write failed (rep type)");
         return -EINVAL;
     }
-    len = cpu_to_be32(0);
+    len = cpu_to_be32(len);
     if (nbd_negotiate_write(ioc, &len, sizeof(len)) != sizeof(len)) {
         LOG("write failed (rep data length)");
         return -EINVAL;
@@ -219,6 +222,11 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
     return 0;
 }
 
+static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+{
+    return nbd_negotiate_send_rep_len(ioc, type, opt, 0);
+}
+
 static int nbd_negotiate_send_rep_list(QIOChannel *ioc, NBDExport *exp)
 {
     uint64_t magic, name_len;
@@ -315,6 +323,137 @@ fail:
 }
 
 
+static int nbd_negotiate_handle_structured_reply(NBDClient *client,
+                                                 uint32_t length)
+{
+    if (length) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID,
+                                      NBD_OPT_STRUCTURED_REPLY);
+    }
+
+    TRACE("Enabling structured replies");
+    client->structured_reply = true;
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                  NBD_OPT_STRUCTURED_REPLY);
+}
+
+static int nbd_negotiate_send_meta_context(QIOChannel *ioc, uint32_t opt,
+                                           uint32_t context_id,
+                                           const char *name)
+{
+    uint32_t name_len = strlen(name);
+
+    if (nbd_negotiate_send_rep_len(ioc, NBD_REP_META_CONTEXT, opt,
+                                   sizeof(context_id) + name_len) < 0) {
+        return -EINVAL;
+    }
+    context_id = cpu_to_be32(context_id);
+    if (nbd_negotiate_write(ioc, &context_id, sizeof(context_id)) !=
+        sizeof(context_id) ||
+        nbd_negotiate_write(ioc, (char *)name, name_len) != name_len) {
+        LOG("write failed (meta context)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Does query @q of length @len ask for "base:allocation"?  A list
+ * request may also ask for the whole "base:" namespace.
+ */
+static bool nbd_meta_query_base_allocation(const char *q, uint32_t len,
+                                           bool list)
+{
+    const char *ctx = NBD_META_CONTEXT_BASE_ALLOCATION;
+
+    if (len == strlen(ctx) && !memcmp(q, ctx, len)) {
+        return true;
+    }
+    return list && len == strlen("base:") && !memcmp(q, "base:", len);
+}
+
+static int nbd_negotiate_handle_meta_context(NBDClient *client, uint32_t opt,
+                                             uint32_t length)
+{
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. +3]    number of queries
+        then for each query:
+        [ 0 ..   3]   query length
+        [ 4 ..  xx]   query
+     */
+    bool list = opt == NBD_OPT_LIST_META_CONTEXT;
+    bool base_allocation = false;
+    uint32_t name_len, nb_queries, i;
+    uint8_t *buf, *p, *end;
+    int ret;
+
+    if (!client->structured_reply || length > 4096) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID, opt);
+    }
+
+    buf = g_malloc(length);
+    if (nbd_negotiate_read(client->ioc, buf, length) != length) {
+        LOG("read failed");
+        g_free(buf);
+        return -EIO;
+    }
+    p = buf;
+    end = buf + length;
+
+    if (end - p < 4 || (name_len = ldl_be_p(p)) > end - p - 4) {
+        goto invalid;
+    }
+    p += 4 + name_len;
+    if (end - p < 4) {
+        goto invalid;
+    }
+    nb_queries = ldl_be_p(p);
+    p += 4;
+
+    /* An empty query list asks for every context the server knows */
+    if (nb_queries == 0) {
+        base_allocation = list;
+    }
+    for (i = 0; i < nb_queries; i++) {
+        uint32_t query_len;
+
+        if (end - p < 4 || (query_len = ldl_be_p(p)) > end - p - 4) {
+            goto invalid;
+        }
+        if (nbd_meta_query_base_allocation((char *)p + 4, query_len, list)) {
+            base_allocation = true;
+        }
+        p += 4 + query_len;
+    }
+    g_free(buf);
+
+    if (base_allocation) {
+        ret = nbd_negotiate_send_meta_context(client->ioc, opt,
+                                              NBD_META_ID_BASE_ALLOCATION,
+                                              NBD_META_CONTEXT_BASE_ALLOCATION);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (!list) {
+        TRACE("base:allocation %s", base_allocation ? "selected" : "cleared");
+        client->base_allocation = base_allocation;
+    }
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, opt);
+
+invalid:
+    g_free(buf);
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID, opt);
+}
+
+
 static QIOChannel *nbd_negotiate_handle_starttls(NBDClient *client,
                                                  uint32_t length)
 {
@@ -479,11 +618,37 @@ static int nbd_negotiate_options(NBDClient *client)
                                            clientflags);
                 }
                 return -EINVAL;
+
+            case NBD_OPT_STRUCTURED_REPLY:
+                ret = nbd_negotiate_handle_structured_reply(client, length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
+            case NBD_OPT_LIST_META_CONTEXT:
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_handle_meta_context(client, clientflags,
+                                                        length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
             default:
+                /* Unknown options are not fatal, the client may go on
+                 * without them.
+                 */
                 TRACE("Unsupported option 0x%x", clientflags);
-                nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_UNSUP,
-                                       clientflags);
-                return -EINVAL;
+                if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+                    return -EIO;
+                }
+                ret = nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_UNSUP,
+                                             clientflags);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
             }
         } else {
             /*
@@ -512,8 +677,12 @@ static coroutine_fn int nbd_negotiate(NBDClientNewData *data)
     NBDClient *client = data->client;
     char buf[8 + 8 + 8 + 128];
     int rc;
+    /* All clients of an export share its BlockBackend, so a flush from
+     * one of them covers writes completed by the others.
+     */
     const int myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
+                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                         NBD_FLAG_CAN_MULTI_CONN);
     bool oldStyle;
 
     /* Old style negotiation header without options
@@ -952,6 +1121,205 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+/* Send one structured reply chunk; @hdr is the fixed part of the payload
+ * for the chunk type and @data its variable part.
+ */
+static ssize_t nbd_co_send_chunk(NBDClient *client, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 void *hdr, size_t hdr_len,
+                                 void *data, size_t data_len)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    struct iovec iov[] = {
+        { .iov_base = buf, .iov_len = sizeof(buf) },
+        { .iov_base = hdr, .iov_len = hdr_len },
+        { .iov_base = data, .iov_len = data_len },
+    };
+    size_t len = sizeof(buf) + hdr_len + data_len;
+    ssize_t ret;
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload that follows
+     */
+    stl_be_p(buf, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(buf + 4, flags);
+    stw_be_p(buf + 6, type);
+    stq_be_p(buf + 8, handle);
+    stl_be_p(buf + 16, hdr_len + data_len);
+
+    TRACE("Sending chunk type %d, %zu byte(s)", type, hdr_len + data_len);
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    qio_channel_set_cork(client->ioc, true);
+    ret = nbd_wr_syncv(client->ioc, iov, ARRAY_SIZE(iov), 0, len, false);
+    qio_channel_set_cork(client->ioc, false);
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return ret == len ? 0 : -EIO;
+}
+
+static ssize_t nbd_co_send_chunk_error(NBDClient *client, uint64_t handle,
+                                       int error)
+{
+    uint8_t buf[4 + 2];
+
+    /* NBD_REPLY_TYPE_ERROR payload: error, message length (no message) */
+    stl_be_p(buf, system_errno_to_nbd_errno(error));
+    stw_be_p(buf + 4, 0);
+    return nbd_co_send_chunk(client, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, buf, sizeof(buf), NULL, 0);
+}
+
+/* Serve a READ as a sequence of data and hole chunks, so that zeroed
+ * areas of the export do not go over the wire.  Returns a negative errno
+ * if the request failed before its last chunk was sent; the caller is
+ * then responsible for terminating the reply.
+ */
+static int nbd_co_send_sparse_read(NBDRequest *req,
+                                   struct nbd_request *request)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    int64_t sector_num = (request->from + exp->dev_offset) / BDRV_SECTOR_SIZE;
+    int nb_sectors = request->len / BDRV_SECTOR_SIZE;
+    int done = 0;
+
+    if (nb_sectors == 0) {
+        return nbd_co_send_chunk(client, request->handle,
+                                 NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE,
+                                 NULL, 0, NULL, 0);
+    }
+
+    while (done < nb_sectors) {
+        BlockDriverState *file;
+        uint8_t hdr[8 + 4];
+        uint64_t offset = request->from + done * BDRV_SECTOR_SIZE;
+        uint16_t flags;
+        int64_t status;
+        int pnum;
+        int ret;
+
+        status = bdrv_get_block_status_above(bs, NULL, sector_num + done,
+                                             nb_sectors - done, &pnum, &file);
+        if (status < 0) {
+            return status;
+        }
+        if (pnum <= 0) {
+            return -EIO;
+        }
+
+        flags = done + pnum == nb_sectors ? NBD_REPLY_FLAG_DONE : 0;
+        stq_be_p(hdr, offset);
+        if (status & BDRV_BLOCK_ZERO) {
+            /* NBD_REPLY_TYPE_OFFSET_HOLE payload: offset, hole size */
+            stl_be_p(hdr + 8, pnum * BDRV_SECTOR_SIZE);
+            ret = nbd_co_send_chunk(client, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_HOLE,
+                                    hdr, sizeof(hdr), NULL, 0);
+        } else {
+            /* NBD_REPLY_TYPE_OFFSET_DATA payload: offset, data */
+            uint8_t *data = req->data + done * BDRV_SECTOR_SIZE;
+
+            ret = blk_read(exp->blk, sector_num + done, data, pnum);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return ret;
+            }
+            ret = nbd_co_send_chunk(client, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_DATA,
+                                    hdr, 8, data, pnum * BDRV_SECTOR_SIZE);
+        }
+        if (ret < 0) {
+            /* The connection is gone, there's no point in an error chunk */
+            return -EPIPE;
+        }
+        done += pnum;
+    }
+
+    return 0;
+}
+
+/* Maximum number of descriptors in a NBD_REPLY_TYPE_BLOCK_STATUS chunk */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 256
+
+static int nbd_co_send_block_status(NBDRequest *req,
+                                    struct nbd_request *request)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    unsigned max_extents = request->type & NBD_CMD_FLAG_REQ_ONE ?
+                           1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    struct nbd_extent *extents = g_new(struct nbd_extent, max_extents);
+    uint64_t offset = request->from + exp->dev_offset;
+    uint64_t end = offset + request->len;
+    unsigned nb_extents = 0, i;
+    uint32_t context_id;
+    int ret;
+
+    while (offset < end) {
+        int64_t sector_num = offset / BDRV_SECTOR_SIZE;
+        int nb_sectors = DIV_ROUND_UP(end, BDRV_SECTOR_SIZE) - sector_num;
+        BlockDriverState *file;
+        int64_t status;
+        uint32_t length, flags;
+        int pnum;
+
+        status = bdrv_get_block_status_above(bs, NULL, sector_num, nb_sectors,
+                                             &pnum, &file);
+        if (status < 0) {
+            g_free(extents);
+            return status;
+        }
+        if (pnum <= 0) {
+            break;
+        }
+
+        length = MIN((sector_num + pnum) * BDRV_SECTOR_SIZE, end) - offset;
+        flags = (status & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+                (status & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+
+        if (nb_extents && extents[nb_extents - 1].flags == flags) {
+            extents[nb_extents - 1].length += length;
+        } else if (nb_extents < max_extents) {
+            extents[nb_extents].length = length;
+            extents[nb_extents].flags = flags;
+            nb_extents++;
+        } else {
+            break;
+        }
+        offset += length;
+    }
+
+    if (nb_extents == 0) {
+        g_free(extents);
+        return -EIO;
+    }
+
+    for (i = 0; i < nb_extents; i++) {
+        extents[i].length = cpu_to_be32(extents[i].length);
+        extents[i].flags = cpu_to_be32(extents[i].flags);
+    }
+    context_id = cpu_to_be32(NBD_META_ID_BASE_ALLOCATION);
+    ret = nbd_co_send_chunk(client, request->handle, NBD_REPLY_FLAG_DONE,
+                            NBD_REPLY_TYPE_BLOCK_STATUS,
+                            &context_id, sizeof(context_id),
+                            extents, nb_extents * sizeof(extents[0]));
+    g_free(extents);
+    return ret < 0 ? -EPIPE : 0;
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -1038,12 +1406,12 @@ static void nbd_trip(void *opaque)
 
     reply.handle = request.handle;
     reply.error = 0;
+    command = request.type & NBD_CMD_MASK_COMMAND;
 
     if (ret < 0) {
         reply.error = -ret;
         goto error_reply;
     }
-    command = request.type & NBD_CMD_MASK_COMMAND;
     if (command != NBD_CMD_DISC && (request.from + request.len) > exp->size) {
             LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
             ", Offset: %" PRIu64 "\n",
@@ -1074,6 +1442,19 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            ret = nbd_co_send_sparse_read(req, &request);
+            if (ret == -EPIPE) {
+                goto out;
+            }
+            if (ret < 0) {
+                reply.error = -ret;
+                goto error_reply;
+            }
+            TRACE("Read %u byte(s)", request.len);
+            break;
+        }
+
         ret = blk_read(exp->blk,
                        (request.from + exp->dev_offset) / BDRV_SECTOR_SIZE,
                        req->data, request.len / BDRV_SECTOR_SIZE);
@@ -1149,11 +1530,38 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+        if (!client->base_allocation) {
+            LOG("no meta context was selected");
+            goto invalid_request;
+        }
+        ret = nbd_co_send_block_status(req, &request);
+        if (ret == -EPIPE) {
+            goto out;
+        }
+        if (ret < 0) {
+            LOG("block status failed");
+            reply.error = -ret;
+            goto error_reply;
+        }
+        break;
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
         reply.error = EINVAL;
     error_reply:
+        /* A READ must not get a simple reply once structured replies
+         * are in use.
+         */
+        if (client->structured_reply &&
+            (command == NBD_CMD_READ || command == NBD_CMD_BLOCK_STATUS)) {
+            if (nbd_co_send_chunk_error(client, reply.handle,
+                                        reply.error) < 0) {
+                goto out;
+            }
+            break;
+        }
         if (nbd_co_send_reply(req, &reply, 0) < 0) {
             goto out;
         }
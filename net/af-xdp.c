@@ -0,0 +1,405 @@
+/*
+ * AF_XDP network backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Each queue of the netdev is an AF_XDP socket bound to one queue of a
+ * host network interface.  Packets are exchanged with the kernel through
+ * a UMEM, an area of frames shared with it, and four rings: the fill and
+ * rx rings for received frames, the tx and completion rings for sent
+ * ones.  With native XDP the driver may DMA directly into the UMEM.
+ */
+
+#include "qemu/osdep.h"
+#include <net/if.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <xdp/xsk.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+
+/* Number of frames taken from the rx and completion rings at a time */
+#define AF_XDP_BATCH_SIZE 64
+
+typedef struct AFXDPState {
+    NetClientState      nc;
+
+    struct xsk_socket   *xsk;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    struct xsk_ring_cons cq;
+    struct xsk_ring_prod fq;
+
+    char                ifname[IFNAMSIZ];
+    bool                read_poll;
+    bool                write_poll;
+    uint32_t            outstanding_tx;
+
+    /* Free frames of the UMEM, as a stack of their addresses */
+    uint64_t            *pool;
+    uint32_t            n_pool;
+    char                *buffer;
+    size_t              buffer_size;
+    struct xsk_umem     *umem;
+} AFXDPState;
+
+static void af_xdp_send(void *opaque);
+static void af_xdp_writable(void *opaque);
+
+static void af_xdp_update_fd_handler(AFXDPState *s)
+{
+    qemu_set_fd_handler(xsk_socket__fd(s->xsk),
+                        s->read_poll ? af_xdp_send : NULL,
+                        s->write_poll ? af_xdp_writable : NULL,
+                        s);
+}
+
+static void af_xdp_read_poll(AFXDPState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_write_poll(AFXDPState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_poll(NetClientState *nc, bool enable)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    if (s->read_poll != enable || s->write_poll != enable) {
+        s->write_poll = enable;
+        s->read_poll  = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+/* Give the frames of the packets the kernel has sent back to the pool */
+static void af_xdp_complete_tx(AFXDPState *s)
+{
+    uint32_t idx = 0;
+    uint32_t done, i;
+
+    done = xsk_ring_cons__peek(&s->cq, AF_XDP_BATCH_SIZE, &idx);
+    for (i = 0; i < done; i++) {
+        s->pool[s->n_pool++] = *xsk_ring_cons__comp_addr(&s->cq, idx++);
+    }
+    if (done) {
+        xsk_ring_cons__release(&s->cq, done);
+        s->outstanding_tx -= done;
+    }
+}
+
+/* Hand up to @n free frames to the kernel for reception */
+static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
+{
+    uint32_t idx = 0;
+    uint32_t i;
+
+    n = MIN(n, s->n_pool);
+    if (!n || xsk_ring_prod__reserve(&s->fq, n, &idx) != n) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        *xsk_ring_prod__fill_addr(&s->fq, idx++) = s->pool[--s->n_pool];
+    }
+    xsk_ring_prod__submit(&s->fq, n);
+
+    if (xsk_ring_prod__needs_wakeup(&s->fq)) {
+        /* Wake up the kernel so that it uses the new frames */
+        recvfrom(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+
+static void af_xdp_writable(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    af_xdp_complete_tx(s);
+    af_xdp_write_poll(s, false);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static ssize_t af_xdp_receive_iov(NetClientState *nc,
+                                  const struct iovec *iov, int iovcnt)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    struct xdp_desc *desc;
+    size_t size = iov_size(iov, iovcnt);
+    uint32_t idx = 0;
+    uint64_t addr;
+
+    if (size > XSK_UMEM__DEFAULT_FRAME_SIZE) {
+        /* Drop */
+        return size;
+    }
+
+    af_xdp_complete_tx(s);
+    if (!s->n_pool || !xsk_ring_prod__reserve(&s->tx, 1, &idx)) {
+        /* Retried once the kernel has sent some packets */
+        af_xdp_write_poll(s, true);
+        return 0;
+    }
+
+    addr = s->pool[--s->n_pool];
+    iov_to_buf(iov, iovcnt, 0, xsk_umem__get_data(s->buffer, addr), size);
+    desc = xsk_ring_prod__tx_desc(&s->tx, idx);
+    desc->addr = addr;
+    desc->len = size;
+    xsk_ring_prod__submit(&s->tx, 1);
+    s->outstanding_tx++;
+
+    if (xsk_ring_prod__needs_wakeup(&s->tx)) {
+        sendto(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+
+    return size;
+}
+
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_xdp_receive_iov(nc, &iov, 1);
+}
+
+static void af_xdp_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    af_xdp_read_poll(s, true);
+}
+
+static void af_xdp_send(void *opaque)
+{
+    AFXDPState *s = opaque;
+    uint32_t idx = 0;
+    uint32_t n, i;
+    ssize_t ret;
+
+    n = xsk_ring_cons__peek(&s->rx, AF_XDP_BATCH_SIZE, &idx);
+    if (!n) {
+        return;
+    }
+
+    qemu_net_batch_begin(&s->nc);
+    for (i = 0; i < n; i++, idx++) {
+        const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&s->rx, idx);
+
+        ret = qemu_send_packet_async(&s->nc,
+                                     xsk_umem__get_data(s->buffer, desc->addr),
+                                     desc->len, af_xdp_send_completed);
+        /* A queued packet is a copy, so the frame can be reused anyway */
+        s->pool[s->n_pool++] = desc->addr;
+        if (ret == 0) {
+            af_xdp_read_poll(s, false);
+            i++;
+            break;
+        }
+    }
+    qemu_net_batch_end(&s->nc);
+
+    /* The rest stays in the rx ring until the peer can receive again */
+    if (i < n) {
+        xsk_ring_cons__cancel(&s->rx, n - i);
+    }
+    xsk_ring_cons__release(&s->rx, i);
+    af_xdp_fq_refill(s, i);
+}
+
+static void af_xdp_cleanup(NetClientState *nc)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    if (s->xsk) {
+        af_xdp_poll(nc, false);
+        xsk_socket__delete(s->xsk);
+        s->xsk = NULL;
+    }
+    if (s->umem) {
+        xsk_umem__delete(s->umem);
+        s->umem = NULL;
+    }
+    g_free(s->pool);
+    s->pool = NULL;
+    qemu_vfree(s->buffer);
+    s->buffer = NULL;
+}
+
+static int af_xdp_umem_create(AFXDPState *s, Error **errp)
+{
+    struct xsk_umem_config config = {
+        .fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE,
+        .frame_headroom = 0,
+    };
+    uint32_t n_descs;
+    int ret;
+    int64_t i;
+
+    /* Enough frames to fill all four rings */
+    n_descs = (XSK_RING_PROD__DEFAULT_NUM_DESCS +
+               XSK_RING_CONS__DEFAULT_NUM_DESCS) * 2;
+    s->buffer_size = (size_t)n_descs * XSK_UMEM__DEFAULT_FRAME_SIZE;
+    s->buffer = qemu_memalign(getpagesize(), s->buffer_size);
+    memset(s->buffer, 0, s->buffer_size);
+
+    ret = xsk_umem__create(&s->umem, s->buffer, s->buffer_size,
+                           &s->fq, &s->cq, &config);
+    if (ret) {
+        error_setg_errno(errp, -ret, "failed to create the UMEM for '%s'",
+                         s->ifname);
+        return -1;
+    }
+
+    /* The lowest frames are at the top of the stack */
+    s->pool = g_new(uint64_t, n_descs);
+    for (i = n_descs - 1; i >= 0; i--) {
+        s->pool[s->n_pool++] = i * XSK_UMEM__DEFAULT_FRAME_SIZE;
+    }
+
+    af_xdp_fq_refill(s, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+    return 0;
+}
+
+static int af_xdp_socket_create(AFXDPState *s,
+                                const NetdevAFXDPOptions *opts,
+                                int queue, Error **errp)
+{
+    struct xsk_socket_config cfg = {
+        .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .bind_flags = XDP_USE_NEED_WAKEUP,
+        .xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST,
+    };
+    static const uint32_t modes[] = { XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE };
+    bool force_copy = opts->has_force_copy && opts->force_copy;
+    int ret = -EINVAL;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(modes); i++) {
+        if (opts->has_mode &&
+            (opts->mode == AFXDP_MODE_NATIVE) != (i == 0)) {
+            continue;
+        }
+        cfg.xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST | modes[i];
+
+        /* Only native XDP can do zero-copy; fall back to copies */
+        if (modes[i] == XDP_FLAGS_DRV_MODE && !force_copy) {
+            cfg.bind_flags = XDP_USE_NEED_WAKEUP | XDP_ZEROCOPY;
+            ret = xsk_socket__create(&s->xsk, s->ifname, queue, s->umem,
+                                     &s->rx, &s->tx, &cfg);
+            if (!ret) {
+                break;
+            }
+        }
+        cfg.bind_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+        ret = xsk_socket__create(&s->xsk, s->ifname, queue, s->umem,
+                                 &s->rx, &s->tx, &cfg);
+        if (!ret) {
+            break;
+        }
+    }
+
+    if (ret) {
+        s->xsk = NULL;
+        error_setg_errno(errp, -ret, "failed to create an AF_XDP socket for "
+                         "queue %d of '%s'", queue, s->ifname);
+        return -1;
+    }
+
+    snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+             "af-xdp: ifname=%s queue=%d mode=%s%s", s->ifname, queue,
+             cfg.xdp_flags & XDP_FLAGS_DRV_MODE ? "native" : "skb",
+             cfg.bind_flags & XDP_ZEROCOPY ? " zero-copy" : "");
+    return 0;
+}
+
+static NetClientInfo net_af_xdp_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_AF_XDP,
+    .size = sizeof(AFXDPState),
+    .receive = af_xdp_receive,
+    .receive_iov = af_xdp_receive_iov,
+    .poll = af_xdp_poll,
+    .cleanup = af_xdp_cleanup,
+};
+
+/*
+ * ... -netdev af-xdp,id=...,ifname=...[,queues=n]
+ *
+ * Queue i of the netdev is bound to queue start-queue + i of the host
+ * interface, so that with a multiqueue virtio-net each guest queue maps
+ * to one NIC queue.
+ */
+int net_init_af_xdp(const NetClientOptions *opts,
+                    const char *name, NetClientState *peer, Error **errp)
+{
+    const NetdevAFXDPOptions *af_xdp_opts = opts->u.af_xdp;
+    NetClientState *nc, *nc0 = NULL;
+    AFXDPState *s;
+    int64_t queues, start_queue, i;
+
+    if (!if_nametoindex(af_xdp_opts->ifname)) {
+        error_setg_errno(errp, errno, "failed to get the index of '%s'",
+                         af_xdp_opts->ifname);
+        return -1;
+    }
+
+    queues = af_xdp_opts->has_queues ? af_xdp_opts->queues : 1;
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_setg(errp, "queues must be between 1 and %d", MAX_QUEUE_NUM);
+        return -1;
+    }
+    if (queues > 1 && peer) {
+        error_setg(errp, "Multiqueue af-xdp cannot be used with QEMU vlans");
+        return -1;
+    }
+    start_queue = af_xdp_opts->has_start_queue ? af_xdp_opts->start_queue : 0;
+    if (start_queue < 0 || start_queue > INT_MAX - queues) {
+        error_setg(errp, "start-queue is out of range");
+        return -1;
+    }
+
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_af_xdp_info, peer, "af-xdp", name);
+        nc->queue_index = i;
+        if (!nc0) {
+            nc0 = nc;
+        }
+
+        s = DO_UPCAST(AFXDPState, nc, nc);
+        pstrcpy(s->ifname, sizeof(s->ifname), af_xdp_opts->ifname);
+
+        if (af_xdp_umem_create(s, errp) ||
+            af_xdp_socket_create(s, af_xdp_opts, start_queue + i, errp)) {
+            /* Deletes all the queues created so far */
+            qemu_del_net_client(nc0);
+            return -1;
+        }
+
+        /* Initially only poll for reads */
+        af_xdp_read_poll(s, true);
+    }
+
+    return 0;
+}
@@ -17,25 +17,186 @@
 
 #include "qemu/osdep.h"
 #include "qemu-common.h"
+#include "qemu/bswap.h"
 #include "net/checksum.h"
+#if defined CONFIG_AVX2_OPT && QEMU_GNUC_PREREQ(4, 9)
+#include "qemu/cpuid.h"
+#endif
 
 #define PROTO_TCP  6
 #define PROTO_UDP 17
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+/*
+ * The ones' complement sum does not depend on the byte order, as long as
+ * the result is swapped at the end (RFC 1071).  So all the functions
+ * below add host-endian words, and net_checksum_add_cont converts the
+ * folded sum to big endian.
+ *
+ * The vector versions add 16-bit words into 32-bit lanes, two words per
+ * lane for each 16 bytes.  Lanes are flushed to the 64-bit result before
+ * they can overflow.
+ */
+#define CSUM_VEC_FLUSH_BYTES (16 * 0x8000)
+
+static uint64_t net_checksum_add_int(const uint8_t *buf, size_t len)
 {
-    uint32_t sum = 0;
+    uint64_t sum = 0;
+    uint8_t tail[2];
+
+    for (; len >= 16; len -= 16, buf += 16) {
+        sum += (uint64_t)ldl_he_p(buf) + ldl_he_p(buf + 4) +
+               ldl_he_p(buf + 8) + ldl_he_p(buf + 12);
+    }
+    for (; len >= 4; len -= 4, buf += 4) {
+        sum += ldl_he_p(buf);
+    }
+    if (len >= 2) {
+        sum += lduw_he_p(buf);
+        buf += 2;
+        len -= 2;
+    }
+    if (len) {
+        /* An odd byte is the high half of a big-endian word */
+        tail[0] = *buf;
+        tail[1] = 0;
+        sum += lduw_he_p(tail);
+    }
+    return sum;
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static uint64_t net_checksum_add_sse2(const uint8_t *buf, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t sum = 0;
+    uint32_t lanes[4];
+
+    while (len) {
+        size_t n = MIN(len, CSUM_VEC_FLUSH_BYTES);
+        __m128i acc = zero;
+
+        for (len -= n; n; n -= 16, buf += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)buf);
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+        }
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    return sum;
+}
+#endif
+
+#if defined CONFIG_AVX2_OPT && QEMU_GNUC_PREREQ(4, 9)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static uint64_t net_checksum_add_avx2(const uint8_t *buf, size_t len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t sum = 0;
+    uint32_t lanes[8];
     int i;
 
-    for (i = seq; i < seq + len; i++) {
-        if (i & 1) {
-            sum += (uint32_t)buf[i - seq];
-        } else {
-            sum += (uint32_t)buf[i - seq] << 8;
+    while (len) {
+        size_t n = MIN(len, CSUM_VEC_FLUSH_BYTES);
+        __m256i acc = zero;
+
+        for (len -= n; n; n -= 32, buf += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)buf);
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+        }
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        for (i = 0; i < 8; i++) {
+            sum += lanes[i];
         }
     }
     return sum;
 }
+#pragma GCC pop_options
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+
+static uint64_t net_checksum_add_neon(const uint8_t *buf, size_t len)
+{
+    uint64_t sum = 0;
+
+    while (len) {
+        size_t n = MIN(len, CSUM_VEC_FLUSH_BYTES);
+        uint32x4_t acc = vdupq_n_u32(0);
+        uint64x2_t acc64;
+
+        for (len -= n; n; n -= 16, buf += 16) {
+            acc = vpadalq_u16(acc, vld1q_u16((const uint16_t *)buf));
+        }
+        acc64 = vpaddlq_u32(acc);
+        sum += vgetq_lane_u64(acc64, 0) + vgetq_lane_u64(acc64, 1);
+    }
+    return sum;
+}
+#endif
+
+typedef struct NetChecksumAccel {
+    /* Adds the words in @buf; @len is a multiple of @granule */
+    uint64_t (*fn)(const uint8_t *buf, size_t len);
+    size_t granule;
+} NetChecksumAccel;
+
+static NetChecksumAccel net_checksum_accel;
+
+static void __attribute__((constructor)) net_checksum_init(void)
+{
+#if defined(__SSE2__)
+    net_checksum_accel = (NetChecksumAccel) { net_checksum_add_sse2, 16 };
+#endif
+#if defined CONFIG_AVX2_OPT && QEMU_GNUC_PREREQ(4, 9)
+    if (host_has_avx2()) {
+        net_checksum_accel = (NetChecksumAccel) { net_checksum_add_avx2, 32 };
+    }
+#endif
+#if defined(__aarch64__)
+    net_checksum_accel = (NetChecksumAccel) { net_checksum_add_neon, 16 };
+#endif
+}
+
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    uint64_t sum = 0;
+    uint16_t res;
+
+    if (len <= 0) {
+        return 0;
+    }
+
+    /* Short buffers, such as headers, are not worth the vector setup */
+    if (net_checksum_accel.fn && len >= 4 * net_checksum_accel.granule) {
+        size_t n = QEMU_ALIGN_DOWN(len, net_checksum_accel.granule);
+
+        sum = net_checksum_accel.fn(buf, n);
+        buf += n;
+        len -= n;
+    }
+    sum += net_checksum_add_int(buf, len);
+
+    /* Fold to 16 bits */
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    res = be16_to_cpu(sum);
+    /* A chunk starting at an odd position has its bytes swapped */
+    if (seq & 1) {
+        res = bswap16(res);
+    }
+    return res;
+}
 
 uint16_t net_checksum_finish(uint32_t sum)
 {
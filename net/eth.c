@@ -216,3 +216,35 @@ bool eth_parse_ipv6_hdr(struct iovec *pkt, int pkt_frags,
     *l4proto = ext_hdr.ip6r_nxt;
     return true;
 }
+
+/*
+ * Toeplitz hash, as used for receive-side scaling: every set bit of the
+ * input XORs in the 32 bits of the key that start at the same position.
+ * A key shorter than input_len + 4 bytes is padded with zeroes.
+ */
+uint32_t
+eth_toeplitz_hash(const uint8_t *key, size_t key_len,
+                  const uint8_t *input, size_t input_len)
+{
+    uint32_t hash = 0;
+    uint32_t window = 0;
+    size_t i;
+    int bit;
+
+    for (i = 0; i < 4; i++) {
+        window = (window << 8) | (i < key_len ? key[i] : 0);
+    }
+
+    for (i = 0; i < input_len; i++) {
+        uint8_t next = i + 4 < key_len ? key[i + 4] : 0;
+
+        for (bit = 7; bit >= 0; bit--) {
+            if (input[i] & (1 << bit)) {
+                hash ^= window;
+            }
+            window = (window << 1) | ((next >> bit) & 1);
+        }
+    }
+
+    return hash;
+}
@@ -0,0 +1,190 @@
+/*
+ * Software segmentation offload
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Guests keep TSO and checksum offload on even when the backend cannot
+ * take a virtio-net header (socket, l2tpv3, slirp...): the super-packet
+ * crosses the guest/host boundary once, and is only cut into MTU-sized
+ * segments here, right before the backend write.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/iov.h"
+#include "net/checksum.h"
+#include "net/eth.h"
+#include "net/gso.h"
+
+#define TCP_FLAG_FIN    0x01
+#define TCP_FLAG_PSH    0x08
+#define TCP_FLAG_CWR    0x80
+
+/* Complete the checksum that starts at csum_start, as a NIC would */
+static bool net_gso_do_csum(const struct virtio_net_hdr *hdr,
+                            uint8_t *buf, size_t size)
+{
+    uint16_t csum;
+
+    if (hdr->csum_start + hdr->csum_offset + sizeof(csum) > size) {
+        return false;
+    }
+
+    /* The field holds the checksum of the pseudo header */
+    csum = cpu_to_be16(net_checksum_finish(
+               net_checksum_add(size - hdr->csum_start,
+                                buf + hdr->csum_start)));
+    memcpy(buf + hdr->csum_start + hdr->csum_offset, &csum, sizeof(csum));
+    return true;
+}
+
+static uint32_t net_gso_ip6_pseudo_hdr_csum(const struct ip6_header *ip6,
+                                            uint32_t len)
+{
+    uint8_t tail[8] = { 0 };
+
+    stl_be_p(tail, len);
+    tail[7] = IP_PROTO_TCP;
+
+    return net_checksum_add(2 * sizeof(struct in6_address),
+                            (uint8_t *)&ip6->ip6_src) +
+           net_checksum_add(sizeof(tail), tail);
+}
+
+/*
+ * Cut the TCP super-packet in @buf into segments of hdr->gso_size bytes
+ * of payload, and send them.
+ */
+static ssize_t net_gso_tcp(NetClientState *nc,
+                           const struct virtio_net_hdr *hdr,
+                           uint8_t *buf, size_t size, NetPacketSent *sent_cb)
+{
+    size_t l2len, l3len, l4len, hdrlen, offset, chunk;
+    struct ip_header *ip = NULL;
+    struct ip6_header *ip6 = NULL;
+    struct tcp_hdr *tcp;
+    uint8_t *seg;
+    uint32_t seq, sum;
+    uint16_t id = 0;
+    uint8_t flags;
+    ssize_t ret = size;
+    int i;
+
+    if (size < ETH_MAX_L2_HDR_LEN || !hdr->gso_size) {
+        return -EINVAL;
+    }
+    l2len = eth_get_l2_hdr_length(buf);
+
+    if ((hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) ==
+        VIRTIO_NET_HDR_GSO_TCPV4) {
+        ip = (struct ip_header *)(buf + l2len);
+        if (size < l2len + sizeof(*ip) ||
+            eth_get_l3_proto(buf, l2len) != ETH_P_IP ||
+            ip->ip_p != IP_PROTO_TCP) {
+            return -EINVAL;
+        }
+        l3len = IP_HDR_GET_LEN(ip);
+        id = be16_to_cpu(ip->ip_id);
+    } else {
+        ip6 = (struct ip6_header *)(buf + l2len);
+        if (size < l2len + sizeof(*ip6) ||
+            eth_get_l3_proto(buf, l2len) != ETH_P_IPV6 ||
+            ip6->ip6_nxt != IP_PROTO_TCP) {
+            /* No extension headers, like Linux's own TSO */
+            return -EINVAL;
+        }
+        l3len = sizeof(*ip6);
+    }
+
+    if (size < l2len + l3len + sizeof(*tcp)) {
+        return -EINVAL;
+    }
+    tcp = (struct tcp_hdr *)(buf + l2len + l3len);
+    l4len = tcp->th_off * 4;
+    hdrlen = l2len + l3len + l4len;
+    if (l4len < sizeof(*tcp) || hdrlen >= size) {
+        return -EINVAL;
+    }
+
+    seq = be32_to_cpu(tcp->th_seq);
+    flags = tcp->th_flags;
+
+    seg = g_malloc(hdrlen + hdr->gso_size);
+    memcpy(seg, buf, hdrlen);
+    ip = ip ? (struct ip_header *)(seg + l2len) : NULL;
+    ip6 = ip6 ? (struct ip6_header *)(seg + l2len) : NULL;
+    tcp = (struct tcp_hdr *)(seg + l2len + l3len);
+
+    for (offset = hdrlen, i = 0; offset < size; offset += chunk, i++) {
+        chunk = MIN(hdr->gso_size, size - offset);
+        memcpy(seg + hdrlen, buf + offset, chunk);
+
+        tcp->th_seq = cpu_to_be32(seq + offset - hdrlen);
+        tcp->th_flags = flags;
+        if (offset + chunk < size) {
+            tcp->th_flags &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+        }
+        if (i > 0) {
+            tcp->th_flags &= ~TCP_FLAG_CWR;
+        }
+
+        if (ip) {
+            ip->ip_len = cpu_to_be16(l3len + l4len + chunk);
+            ip->ip_id = cpu_to_be16(id + i);
+            eth_fix_ip4_checksum(ip, l3len);
+            sum = eth_calc_pseudo_hdr_csum(ip, l4len + chunk);
+        } else {
+            ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = cpu_to_be16(l4len + chunk);
+            sum = net_gso_ip6_pseudo_hdr_csum(ip6, l4len + chunk);
+        }
+        tcp->th_sum = 0;
+        sum += net_checksum_add(l4len + chunk, (uint8_t *)tcp);
+        tcp->th_sum = cpu_to_be16(net_checksum_finish(sum));
+
+        ret = qemu_send_packet_async(nc, seg, hdrlen + chunk,
+                                     offset + chunk < size ? NULL : sent_cb);
+    }
+
+    g_free(seg);
+    return ret;
+}
+
+ssize_t net_gso_sendv_packet_async(NetClientState *nc,
+                                   const struct virtio_net_hdr *hdr,
+                                   const struct iovec *iov, int iovcnt,
+                                   NetPacketSent *sent_cb)
+{
+    size_t size = iov_size(iov, iovcnt);
+    uint8_t *buf;
+    ssize_t ret;
+
+    if (hdr->gso_type == VIRTIO_NET_HDR_GSO_NONE &&
+        !(hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        return qemu_sendv_packet_async(nc, iov, iovcnt, sent_cb);
+    }
+
+    /* The data is copied if the packets have to be queued */
+    buf = g_malloc(size);
+    iov_to_buf(iov, iovcnt, 0, buf, size);
+
+    switch (hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+    case VIRTIO_NET_HDR_GSO_NONE:
+        ret = net_gso_do_csum(hdr, buf, size) ?
+              qemu_send_packet_async(nc, buf, size, sent_cb) : -EINVAL;
+        break;
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+        /* Every segment gets its own checksum, no need for the first one */
+        ret = net_gso_tcp(nc, hdr, buf, size, sent_cb);
+        break;
+    default:
+        ret = -EINVAL;
+        break;
+    }
+
+    g_free(buf);
+    return ret < 0 ? size : ret;
+}
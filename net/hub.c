@@ -15,65 +15,212 @@
 #include "qemu/osdep.h"
 #include "monitor/monitor.h"
 #include "net/net.h"
+#include "net/eth.h"
 #include "clients.h"
 #include "hub.h"
 #include "qemu/iov.h"
+#include "qemu/timer.h"
 
 /*
- * A hub broadcasts incoming packets to all its ports except the source port.
+ * A hub forwards incoming packets to the other ports.  Like a learning
+ * switch, it remembers the port behind each source MAC address and sends
+ * unicast packets for a known address to that port only; broadcast,
+ * multicast and unknown unicast packets are flooded to all ports.  Ports
+ * connected to a dump client see all packets.
+ *
  * Hubs can be used to provide independent network segments, also confusingly
  * named the QEMU 'vlan' feature.
  */
 
+/* Maximum number of learned addresses per hub */
+#define NET_HUB_FDB_MAX     4096
+
+/* Learned addresses expire after this many milliseconds without traffic */
+#define NET_HUB_FDB_AGE_MS  (300 * 1000)
+
+/* A full table is searched for expired addresses at most this often */
+#define NET_HUB_FDB_SWEEP_MS 1000
+
 typedef struct NetHub NetHub;
 
+typedef struct NetHubPortStats {
+    uint64_t rx_packets;        /* received from the peer */
+    uint64_t rx_bytes;
+    uint64_t rx_flooded;        /* ...and sent to all other ports */
+    uint64_t rx_filtered;       /* ...and not forwarded at all */
+    uint64_t tx_packets;        /* forwarded to the peer */
+    uint64_t tx_bytes;
+} NetHubPortStats;
+
 typedef struct NetHubPort {
     NetClientState nc;
     QLIST_ENTRY(NetHubPort) next;
     NetHub *hub;
     int id;
+    NetHubPortStats stats;
 } NetHubPort;
 
+/* Forwarding database entry */
+typedef struct NetHubFdbEntry {
+    uint64_t mac;
+    NetHubPort *port;
+    int64_t last_seen;
+} NetHubFdbEntry;
+
 struct NetHub {
     int id;
     QLIST_ENTRY(NetHub) next;
     int num_ports;
     QLIST_HEAD(, NetHubPort) ports;
+    /* MAC address -> NetHubFdbEntry */
+    GHashTable *fdb;
+    int64_t fdb_last_sweep;
 };
 
 static QLIST_HEAD(, NetHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
 
-static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
-                               const uint8_t *buf, size_t len)
+static uint64_t net_hub_mac(const uint8_t *addr)
 {
-    NetHubPort *port;
+    uint64_t mac = 0;
 
-    QLIST_FOREACH(port, &hub->ports, next) {
-        if (port == source_port) {
-            continue;
+    memcpy(&mac, addr, ETH_ALEN);
+    return mac;
+}
+
+static gboolean net_hub_fdb_entry_is_stale(gpointer key, gpointer value,
+                                           gpointer opaque)
+{
+    NetHubFdbEntry *entry = value;
+    int64_t now = *(int64_t *)opaque;
+
+    return now - entry->last_seen > NET_HUB_FDB_AGE_MS;
+}
+
+static void net_hub_learn(NetHub *hub, NetHubPort *port, const uint8_t *addr,
+                          int64_t now)
+{
+    uint64_t mac = net_hub_mac(addr);
+    NetHubFdbEntry *entry;
+
+    if (addr[0] & 1) {
+        /* Multicast source addresses are bogus */
+        return;
+    }
+
+    entry = g_hash_table_lookup(hub->fdb, &mac);
+    if (!entry) {
+        if (g_hash_table_size(hub->fdb) >= NET_HUB_FDB_MAX) {
+            /* Stale entries are otherwise only dropped by lookups */
+            if (now - hub->fdb_last_sweep < NET_HUB_FDB_SWEEP_MS) {
+                return;
+            }
+            hub->fdb_last_sweep = now;
+            g_hash_table_foreach_remove(hub->fdb, net_hub_fdb_entry_is_stale,
+                                        &now);
+            if (g_hash_table_size(hub->fdb) >= NET_HUB_FDB_MAX) {
+                return;
+            }
         }
+        entry = g_new(NetHubFdbEntry, 1);
+        entry->mac = mac;
+        g_hash_table_insert(hub->fdb, &entry->mac, entry);
+    }
+    entry->port = port;
+    entry->last_seen = now;
+}
+
+/* Returns the port behind @addr, or NULL if the packet must be flooded */
+static NetHubPort *net_hub_lookup(NetHub *hub, const uint8_t *addr,
+                                  int64_t now)
+{
+    uint64_t mac = net_hub_mac(addr);
+    NetHubFdbEntry *entry;
 
-        qemu_send_packet(&port->nc, buf, len);
+    if (addr[0] & 1) {
+        return NULL;
     }
-    return len;
+
+    entry = g_hash_table_lookup(hub->fdb, &mac);
+    if (!entry) {
+        return NULL;
+    }
+    if (now - entry->last_seen > NET_HUB_FDB_AGE_MS) {
+        g_hash_table_remove(hub->fdb, &mac);
+        return NULL;
+    }
+    return entry->port;
+}
+
+static gboolean net_hub_fdb_entry_is_port(gpointer key, gpointer value,
+                                          gpointer opaque)
+{
+    NetHubFdbEntry *entry = value;
+
+    return entry->port == opaque;
+}
+
+/* Dump clients record all traffic on the hub, not just their own */
+static bool net_hub_port_sees_all(NetHubPort *port)
+{
+    return port->nc.peer &&
+           port->nc.peer->info->type == NET_CLIENT_OPTIONS_KIND_DUMP;
 }
 
 static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
                                    const struct iovec *iov, int iovcnt)
 {
-    NetHubPort *port;
+    NetHubPort *port, *dest = NULL;
+    NetPacketBuf *shared = NULL;
     ssize_t len = iov_size(iov, iovcnt);
+    uint8_t addrs[2 * ETH_ALEN];
+
+    source_port->stats.rx_packets++;
+    source_port->stats.rx_bytes += len;
 
+    if (iov_to_buf(iov, iovcnt, 0, addrs, sizeof(addrs)) == sizeof(addrs)) {
+        int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+        net_hub_learn(hub, source_port, addrs + ETH_ALEN, now);
+        dest = net_hub_lookup(hub, addrs, now);
+    }
+
+    if (dest == source_port) {
+        source_port->stats.rx_filtered++;
+    } else if (!dest) {
+        source_port->stats.rx_flooded++;
+    }
+
+    /*
+     * Ports that can take the packet right away get it straight from @iov.
+     * Ports that have to queue it share a single copy, which is made the
+     * first time it is needed.
+     */
     QLIST_FOREACH(port, &hub->ports, next) {
-        if (port == source_port) {
+        if (port == source_port ||
+            (dest && port != dest && !net_hub_port_sees_all(port))) {
             continue;
         }
 
-        qemu_sendv_packet(&port->nc, iov, iovcnt);
+        port->stats.tx_packets++;
+        port->stats.tx_bytes += len;
+        qemu_sendv_packet_shared(&port->nc, iov, iovcnt, &shared);
     }
+
+    qemu_net_packet_buf_unref(shared);
     return len;
 }
 
+static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
+                               const uint8_t *buf, size_t len)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = len,
+    };
+
+    return net_hub_receive_iov(hub, source_port, &iov, 1);
+}
+
 static NetHub *net_hub_new(int id)
 {
     NetHub *hub;
@@ -82,6 +229,9 @@ static NetHub *net_hub_new(int id)
     hub->id = id;
     hub->num_ports = 0;
     QLIST_INIT(&hub->ports);
+    hub->fdb = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                     NULL, g_free);
+    hub->fdb_last_sweep = 0;
 
     QLIST_INSERT_HEAD(&hubs, hub, next);
 
@@ -127,6 +277,8 @@ static void net_hub_port_cleanup(NetClientState *nc)
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
 
+    g_hash_table_foreach_remove(port->hub->fdb, net_hub_fdb_entry_is_port,
+                                port);
     QLIST_REMOVE(port, next);
 }
 
@@ -156,6 +308,7 @@ static NetHubPort *net_hub_port_new(NetHub *hub, const char *name)
     port = DO_UPCAST(NetHubPort, nc, nc);
     port->id = id;
     port->hub = hub;
+    memset(&port->stats, 0, sizeof(port->stats));
 
     QLIST_INSERT_HEAD(&hub->ports, port, next);
 
@@ -244,8 +397,11 @@ void net_hub_info(Monitor *mon)
     NetHubPort *port;
 
     QLIST_FOREACH(hub, &hubs, next) {
-        monitor_printf(mon, "hub %d\n", hub->id);
+        monitor_printf(mon, "hub %d (%u learned addresses)\n", hub->id,
+                       g_hash_table_size(hub->fdb));
         QLIST_FOREACH(port, &hub->ports, next) {
+            NetHubPortStats *stats = &port->stats;
+
             monitor_printf(mon, " \\ %s", port->nc.name);
             if (port->nc.peer) {
                 monitor_printf(mon, ": ");
@@ -253,6 +409,13 @@ void net_hub_info(Monitor *mon)
             } else {
                 monitor_printf(mon, "\n");
             }
+            monitor_printf(mon, "   rx %" PRIu64 " packets %" PRIu64
+                           " bytes (%" PRIu64 " flooded, %" PRIu64
+                           " filtered), tx %" PRIu64 " packets %" PRIu64
+                           " bytes\n",
+                           stats->rx_packets, stats->rx_bytes,
+                           stats->rx_flooded, stats->rx_filtered,
+                           stats->tx_packets, stats->tx_bytes);
         }
     }
 }
@@ -64,6 +64,9 @@ const char *host_net_devices[] = {
 #ifdef CONFIG_NETMAP
     "netmap",
 #endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp",
+#endif
 #ifdef CONFIG_SLIRP
     "user",
 #endif
@@ -626,9 +629,39 @@ void qemu_purge_queued_packets(NetClientState *nc)
     qemu_net_queue_purge(nc->peer->incoming_queue, nc);
 }
 
+static void qemu_net_receive_batch_end(NetClientState *nc)
+{
+    assert(nc->receive_batch > 0);
+    if (--nc->receive_batch == 0 && nc->info->flush_batch) {
+        nc->info->flush_batch(nc);
+    }
+}
+
+/*
+ * A sender that delivers several packets in a row brackets them with
+ * qemu_net_batch_begin() and qemu_net_batch_end().  Until the batch ends,
+ * its peer may defer the work it would otherwise do for every packet,
+ * such as notifying the guest, to its flush_batch callback.
+ */
+void qemu_net_batch_begin(NetClientState *nc)
+{
+    if (nc->peer) {
+        nc->peer->receive_batch++;
+    }
+}
+
+void qemu_net_batch_end(NetClientState *nc)
+{
+    if (nc->peer && nc->peer->receive_batch) {
+        qemu_net_receive_batch_end(nc->peer);
+    }
+}
+
 static
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
 {
+    bool flushed;
+
     nc->receive_disabled = 0;
 
     if (nc->peer && nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_HUBPORT) {
@@ -636,7 +669,12 @@ void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
             qemu_notify_event();
         }
     }
-    if (qemu_net_queue_flush(nc->incoming_queue)) {
+
+    nc->receive_batch++;
+    flushed = qemu_net_queue_flush(nc->incoming_queue);
+    qemu_net_receive_batch_end(nc);
+
+    if (flushed) {
         /* We emptied the queue successfully, signal to the IO thread to repoll
          * the file descriptor (for tap, for example).
          */
@@ -795,6 +833,43 @@ qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
     return qemu_sendv_packet_async(nc, iov, iovcnt, NULL);
 }
 
+/*
+ * Send the same packet from several clients.  If the receiver cannot take
+ * it right away, the queued copy is shared through @shared with the other
+ * senders; the caller drops its reference with qemu_net_packet_buf_unref()
+ * once all of them have been sent.
+ */
+ssize_t qemu_sendv_packet_shared(NetClientState *sender,
+                                 const struct iovec *iov, int iovcnt,
+                                 NetPacketBuf **shared)
+{
+    NetQueue *queue;
+    int ret;
+
+    if (sender->link_down || !sender->peer) {
+        return iov_size(iov, iovcnt);
+    }
+
+    /* Let filters handle the packet first */
+    ret = filter_receive_iov(sender, NET_FILTER_DIRECTION_TX, sender,
+                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, NULL);
+    if (ret) {
+        return ret;
+    }
+
+    ret = filter_receive_iov(sender->peer, NET_FILTER_DIRECTION_RX, sender,
+                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, NULL);
+    if (ret) {
+        return ret;
+    }
+
+    queue = sender->peer->incoming_queue;
+
+    return qemu_net_queue_send_iov_shared(queue, sender,
+                                          QEMU_NET_PACKET_FLAG_NONE,
+                                          iov, iovcnt, shared, NULL);
+}
+
 NetClientState *qemu_find_netdev(const char *id)
 {
     NetClientState *nc;
@@ -968,6 +1043,9 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND__MAX])(
 #endif
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_OPTIONS_KIND_NETMAP]    = net_init_netmap,
+#endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_OPTIONS_KIND_AF_XDP]    = net_init_af_xdp,
 #endif
         [NET_CLIENT_OPTIONS_KIND_DUMP]      = net_init_dump,
 #ifdef CONFIG_NET_BRIDGE
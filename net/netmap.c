@@ -274,6 +274,7 @@ static void netmap_send(void *opaque)
 
     /* Keep sending while there are available packets into the netmap
        RX ring and the forwarding path towards the peer is open. */
+    qemu_net_batch_begin(&s->nc);
     while (!nm_ring_empty(ring)) {
         uint32_t i;
         uint32_t idx;
@@ -308,6 +309,7 @@ static void netmap_send(void *opaque)
             break;
         }
     }
+    qemu_net_batch_end(&s->nc);
 }
 
 /* Flush and close. */
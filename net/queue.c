@@ -25,6 +25,7 @@
 #include "net/queue.h"
 #include "qemu/queue.h"
 #include "net/net.h"
+#include "qemu/iov.h"
 
 /* The delivery handler may only return zero if it will call
  * qemu_net_queue_flush() when it determines that it is once again able
@@ -46,9 +47,52 @@ struct NetPacket {
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    /* If non-NULL, the data is in here instead of data[] */
+    NetPacketBuf *shared;
     uint8_t data[0];
 };
 
+/* Packet data that is queued for several receivers at once */
+struct NetPacketBuf {
+    int refcnt;
+    size_t size;
+    uint8_t data[0];
+};
+
+static NetPacketBuf *net_packet_buf_new(const struct iovec *iov, int iovcnt)
+{
+    size_t size = iov_size(iov, iovcnt);
+    NetPacketBuf *buf = g_malloc(sizeof(NetPacketBuf) + size);
+
+    buf->refcnt = 1;
+    buf->size = iov_to_buf(iov, iovcnt, 0, buf->data, size);
+    return buf;
+}
+
+static NetPacketBuf *net_packet_buf_ref(NetPacketBuf *buf)
+{
+    buf->refcnt++;
+    return buf;
+}
+
+void qemu_net_packet_buf_unref(NetPacketBuf *buf)
+{
+    if (buf && --buf->refcnt == 0) {
+        g_free(buf);
+    }
+}
+
+static inline const uint8_t *net_packet_data(NetPacket *packet)
+{
+    return packet->shared ? packet->shared->data : packet->data;
+}
+
+static void net_packet_free(NetPacket *packet)
+{
+    qemu_net_packet_buf_unref(packet->shared);
+    g_free(packet);
+}
+
 struct NetQueue {
     void *opaque;
     uint32_t nq_maxlen;
@@ -84,7 +128,7 @@ void qemu_del_net_queue(NetQueue *queue)
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+        net_packet_free(packet);
     }
 
     g_free(queue);
@@ -107,6 +151,7 @@ static void qemu_net_queue_append(NetQueue *queue,
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
+    packet->shared = NULL;
     memcpy(packet->data, buf, size);
 
     queue->nq_count++;
@@ -136,6 +181,7 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     packet->sent_cb = sent_cb;
     packet->flags = flags;
     packet->size = 0;
+    packet->shared = NULL;
 
     for (i = 0; i < iovcnt; i++) {
         size_t len = iov[i].iov_len;
@@ -148,6 +194,39 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
 
+/*
+ * Queue a packet without copying it, taking a reference to @shared.  If
+ * *@shared is NULL, it is first created from @iov and returned to the caller,
+ * who must drop its own reference when done with it.
+ */
+static void qemu_net_queue_append_shared(NetQueue *queue,
+                                         NetClientState *sender,
+                                         unsigned flags,
+                                         const struct iovec *iov,
+                                         int iovcnt,
+                                         NetPacketBuf **shared,
+                                         NetPacketSent *sent_cb)
+{
+    NetPacket *packet;
+
+    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        return; /* drop if queue full and no callback */
+    }
+    if (!*shared) {
+        *shared = net_packet_buf_new(iov, iovcnt);
+    }
+
+    packet = g_malloc(sizeof(NetPacket));
+    packet->sender = sender;
+    packet->sent_cb = sent_cb;
+    packet->flags = flags;
+    packet->size = (*shared)->size;
+    packet->shared = net_packet_buf_ref(*shared);
+
+    queue->nq_count++;
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+}
+
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
                                       NetClientState *sender,
                                       unsigned flags,
@@ -232,6 +311,38 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/*
+ * Like qemu_net_queue_send_iov(), but if the packet has to be queued, share
+ * its data with the other queues that the same @shared is passed to.
+ */
+ssize_t qemu_net_queue_send_iov_shared(NetQueue *queue,
+                                       NetClientState *sender,
+                                       unsigned flags,
+                                       const struct iovec *iov,
+                                       int iovcnt,
+                                       NetPacketBuf **shared,
+                                       NetPacketSent *sent_cb)
+{
+    ssize_t ret;
+
+    if (queue->delivering || !qemu_can_send_packet(sender)) {
+        qemu_net_queue_append_shared(queue, sender, flags, iov, iovcnt,
+                                     shared, sent_cb);
+        return 0;
+    }
+
+    ret = qemu_net_queue_deliver_iov(queue, sender, flags, iov, iovcnt);
+    if (ret == 0) {
+        qemu_net_queue_append_shared(queue, sender, flags, iov, iovcnt,
+                                     shared, sent_cb);
+        return 0;
+    }
+
+    qemu_net_queue_flush(queue);
+
+    return ret;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -243,7 +354,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            net_packet_free(packet);
         }
     }
 }
@@ -261,7 +372,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
         ret = qemu_net_queue_deliver(queue,
                                      packet->sender,
                                      packet->flags,
-                                     packet->data,
+                                     net_packet_data(packet),
                                      packet->size);
         if (ret == 0) {
             queue->nq_count++;
@@ -273,7 +384,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        net_packet_free(packet);
     }
     return true;
 }
@@ -12,6 +12,7 @@
 #include "clients.h"
 #include "net/vhost_net.h"
 #include "net/vhost-user.h"
+#include "hw/virtio/vhost-user.h"
 #include "sysemu/char.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
@@ -21,6 +22,8 @@
 typedef struct VhostUserState {
     NetClientState nc;
     CharDriverState *chr;
+    /* Shared by all the queues, freed with the first one */
+    VhostUserConn *conn;
     VHostNetState *vhost_net;
 } VhostUserState;
 
@@ -69,6 +72,7 @@ static int vhost_user_start(int queues, NetClientState *ncs[])
     int i;
 
     options.backend_type = VHOST_BACKEND_TYPE_USER;
+    options.busyloop_timeout = 0;
 
     for (i = 0; i < queues; i++) {
         assert (ncs[i]->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
@@ -79,7 +83,7 @@ static int vhost_user_start(int queues, NetClientState *ncs[])
         }
 
         options.net_backend = ncs[i];
-        options.opaque      = s->chr;
+        options.opaque      = s->conn;
         s->vhost_net = vhost_net_init(&options);
         if (!s->vhost_net) {
             error_report("failed to init vhost_net for queue %d", i);
@@ -140,6 +144,10 @@ static void vhost_user_cleanup(NetClientState *nc)
         vhost_net_cleanup(s->vhost_net);
         s->vhost_net = NULL;
     }
+    if (nc->queue_index == 0) {
+        vhost_user_inflight_free(&s->conn->inflight);
+        g_free(s->conn);
+    }
 
     qemu_purge_queued_packets(nc);
 }
@@ -184,14 +192,18 @@ static void net_vhost_user_event(void *opaque, int event)
     trace_vhost_user_event(s->chr->label, event);
     switch (event) {
     case CHR_EVENT_OPENED:
+        /* After a reconnection, the link going up restarts the rings */
         if (vhost_user_start(queues, ncs) < 0) {
-            exit(1);
+            error_report("vhost-user backend %s failed to start, "
+                         "keeping the link down", s->chr->label);
+            break;
         }
         qmp_set_link(name, true, &err);
         break;
     case CHR_EVENT_CLOSED:
         qmp_set_link(name, false, &err);
         vhost_user_stop(queues, ncs);
+        s->conn->probed = false;
         break;
     }
 
@@ -206,11 +218,18 @@ static int net_vhost_user_init(NetClientState *peer, const char *device,
 {
     NetClientState *nc;
     VhostUserState *s;
+    VhostUserConn *conn;
     int i;
 
     assert(name);
     assert(queues > 0);
 
+    conn = g_new0(VhostUserConn, 1);
+    conn->chr = chr;
+    conn->nvqs = queues * 2;
+    conn->inflight.fd = -1;
+    conn->slave_fd = -1;
+
     for (i = 0; i < queues; i++) {
         nc = qemu_new_net_client(&net_vhost_user_info, peer, device, name);
 
@@ -221,6 +240,7 @@ static int net_vhost_user_init(NetClientState *peer, const char *device,
 
         s = DO_UPCAST(VhostUserState, nc, nc);
         s->chr = chr;
+        s->conn = conn;
     }
 
     qemu_chr_add_handlers(chr, NULL, NULL, net_vhost_user_event, nc[0].name);
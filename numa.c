@@ -37,6 +37,8 @@
 #include "hw/mem/pc-dimm.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
+#include "sysemu/iothread.h"
+#include "sysemu/kvm.h"
 
 QemuOptsList qemu_numa_opts = {
     .name = "numa",
@@ -172,6 +174,17 @@ static void numa_node_parse(NumaNodeOptions *node, QemuOpts *opts, Error **errp)
         bitmap_set(numa_info[nodenr].node_cpu, cpus->value, 1);
     }
 
+    for (cpus = node->host_cpus; cpus; cpus = cpus->next) {
+        if (cpus->value >= MAX_HOST_CPUS) {
+            error_setg(errp, "Host CPU index (%" PRIu16 ")"
+                       " should be smaller than %d",
+                       cpus->value, MAX_HOST_CPUS);
+            return;
+        }
+        bitmap_set(numa_info[nodenr].host_cpus, cpus->value, 1);
+        numa_info[nodenr].has_host_cpus = true;
+    }
+
     if (node->has_mem && node->has_memdev) {
         error_setg(errp, "qemu: cannot specify both mem= and memdev=");
         return;
@@ -389,6 +402,56 @@ void parse_numa_opts(MachineClass *mc)
     }
 }
 
+/* Run @thread on the host CPUs of guest node @node, if it has any */
+void numa_bind_thread(QemuThread *thread, int node)
+{
+    int ret;
+
+    if (node < 0 || node >= nb_numa_nodes || !numa_info[node].has_host_cpus) {
+        return;
+    }
+
+    ret = qemu_thread_set_affinity(thread, numa_info[node].host_cpus,
+                                   MAX_HOST_CPUS);
+    if (ret < 0) {
+        error_report("Cannot bind thread to the host CPUs of node %d: %s",
+                     node, strerror(-ret));
+    }
+}
+
+/* The host CPUs that @thread can run on, for QMP */
+intList *numa_query_thread_host_cpus(QemuThread *thread)
+{
+    DECLARE_BITMAP(host_cpus, MAX_HOST_CPUS);
+    intList *head = NULL, **prev = &head;
+    unsigned long cpu;
+
+    if (qemu_thread_get_affinity(thread, host_cpus, MAX_HOST_CPUS) < 0) {
+        return NULL;
+    }
+
+    for (cpu = find_first_bit(host_cpus, MAX_HOST_CPUS); cpu < MAX_HOST_CPUS;
+         cpu = find_next_bit(host_cpus, MAX_HOST_CPUS, cpu + 1)) {
+        intList *elem = g_new0(intList, 1);
+
+        elem->value = cpu;
+        *prev = elem;
+        prev = &elem->next;
+    }
+    return head;
+}
+
+static int numa_bind_iothread(Object *obj, void *opaque)
+{
+    IOThread *iothread;
+
+    iothread = (IOThread *)object_dynamic_cast(obj, TYPE_IOTHREAD);
+    if (iothread) {
+        numa_bind_thread(&iothread->thread, iothread->numa_node);
+    }
+    return 0;
+}
+
 void numa_post_machine_init(void)
 {
     CPUState *cpu;
@@ -400,7 +463,16 @@ void numa_post_machine_init(void)
                 cpu->numa_node = i;
             }
         }
+        /* With TCG, all vCPUs share one thread; only KVM ones are bound */
+        if (kvm_enabled()) {
+            numa_bind_thread(cpu->thread, cpu->numa_node);
+        }
     }
+
+    /* IOThreads are created before the NUMA options are parsed.  Their
+     * thread pool workers inherit the binding when they are spawned.
+     */
+    object_child_foreach(object_get_objects_root(), numa_bind_iothread, NULL);
 }
 
 static void allocate_system_memory_nonnuma(MemoryRegion *mr, Object *owner,
@@ -484,6 +556,10 @@ static void numa_stat_memory_devices(uint64_t node_mem[])
             case MEMORY_DEVICE_INFO_KIND_DIMM:
                 node_mem[value->u.dimm->node] += value->u.dimm->size;
                 break;
+            case MEMORY_DEVICE_INFO_KIND_VIRTIO_MEM:
+                node_mem[value->u.virtio_mem->node] +=
+                    value->u.virtio_mem->size;
+                break;
             default:
                 break;
             }
@@ -522,6 +598,8 @@ static int query_memdev(Object *obj, void *opaque)
                                                    &error_abort);
         m->value->dump = object_property_get_bool(obj, "dump",
                                                   &error_abort);
+        m->value->hugepages = object_property_get_bool(obj, "hugepages",
+                                                       &error_abort);
         m->value->prealloc = object_property_get_bool(obj,
                                                       "prealloc",
                                                       &error_abort);
@@ -532,6 +610,8 @@ static int query_memdev(Object *obj, void *opaque)
         object_property_get_uint16List(obj, "host-nodes",
                                        &m->value->host_nodes,
                                        &error_abort);
+        m->value->usage = host_memory_backend_get_usage(MEMORY_BACKEND(obj));
+        m->value->has_usage = m->value->usage != NULL;
 
         m->next = *list;
         *list = m;
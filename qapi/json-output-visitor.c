@@ -0,0 +1,238 @@
+/*
+ * JSON Output Visitor
+ *
+ * Copyright (C) 2016 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/json-output-visitor.h"
+#include "qapi/visitor-impl.h"
+#include "qemu/queue.h"
+#include "qemu-common.h"
+#include "qapi/qmp/qjson.h"
+
+typedef struct JsonStackEntry
+{
+    int count;          /* members or elements written so far */
+    bool is_list_head;
+    QSLIST_ENTRY(JsonStackEntry) node;
+} JsonStackEntry;
+
+struct JsonOutputVisitor
+{
+    Visitor visitor;
+    QString *str;
+    /* Containers that haven't yet been finished, innermost first */
+    QSLIST_HEAD(, JsonStackEntry) stack;
+};
+
+static JsonOutputVisitor *to_jov(Visitor *v)
+{
+    return container_of(v, JsonOutputVisitor, visitor);
+}
+
+/* Write whatever has to precede the next value: a separator, and the
+ * member name when inside an object. */
+static void json_output_prefix(JsonOutputVisitor *jov, const char *name)
+{
+    JsonStackEntry *e = QSLIST_FIRST(&jov->stack);
+
+    if (!e) {
+        /* FIXME we should require the user to reset the visitor, rather
+         * than throwing away the previous root */
+        QDECREF(jov->str);
+        jov->str = qstring_new();
+        return;
+    }
+
+    if (e->count++) {
+        qstring_append(jov->str, ", ");
+    }
+    if (!e->is_list_head) {
+        assert(name);
+        qjson_append_string(jov->str, name);
+        qstring_append(jov->str, ": ");
+    }
+}
+
+static void json_output_push(JsonOutputVisitor *jov, bool is_list)
+{
+    JsonStackEntry *e = g_new0(JsonStackEntry, 1);
+
+    e->is_list_head = is_list;
+    QSLIST_INSERT_HEAD(&jov->stack, e, node);
+}
+
+static void json_output_pop(JsonOutputVisitor *jov)
+{
+    JsonStackEntry *e = QSLIST_FIRST(&jov->stack);
+
+    assert(e);
+    QSLIST_REMOVE_HEAD(&jov->stack, node);
+    g_free(e);
+}
+
+static void json_output_start_struct(Visitor *v, const char *name,
+                                     void **obj, size_t unused, Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_prefix(jov, name);
+    qstring_append_chr(jov->str, '{');
+    json_output_push(jov, false);
+}
+
+static void json_output_end_struct(Visitor *v, Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_pop(jov);
+    qstring_append_chr(jov->str, '}');
+}
+
+static void json_output_start_list(Visitor *v, const char *name, Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_prefix(jov, name);
+    qstring_append_chr(jov->str, '[');
+    json_output_push(jov, true);
+}
+
+static GenericList *json_output_next_list(Visitor *v, GenericList **listp,
+                                          size_t size)
+{
+    GenericList *list = *listp;
+    JsonOutputVisitor *jov = to_jov(v);
+    JsonStackEntry *e = QSLIST_FIRST(&jov->stack);
+
+    assert(e && e->is_list_head);
+    if (!e->count) {
+        /* Nothing written yet: @list is the first element */
+        return list;
+    }
+
+    return list ? list->next : NULL;
+}
+
+static void json_output_end_list(Visitor *v)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_pop(jov);
+    qstring_append_chr(jov->str, ']');
+}
+
+static void json_output_type_int64(Visitor *v, const char *name,
+                                   int64_t *obj, Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_prefix(jov, name);
+    qstring_append_int(jov->str, *obj);
+}
+
+static void json_output_type_uint64(Visitor *v, const char *name,
+                                    uint64_t *obj, Error **errp)
+{
+    /* FIXME: like the QMP output visitor, values larger than INT64_MAX
+     * come out as negative */
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_prefix(jov, name);
+    qstring_append_int(jov->str, *obj);
+}
+
+static void json_output_type_bool(Visitor *v, const char *name, bool *obj,
+                                  Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_prefix(jov, name);
+    qstring_append(jov->str, *obj ? "true" : "false");
+}
+
+static void json_output_type_str(Visitor *v, const char *name, char **obj,
+                                 Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_prefix(jov, name);
+    qjson_append_string(jov->str, *obj ? *obj : "");
+}
+
+static void json_output_type_number(Visitor *v, const char *name,
+                                    double *obj, Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_prefix(jov, name);
+    qjson_append_number(jov->str, *obj);
+}
+
+static void json_output_type_any(Visitor *v, const char *name,
+                                 QObject **obj, Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+    QString *json = qobject_to_json(*obj);
+
+    json_output_prefix(jov, name);
+    qstring_append_len(jov->str, qstring_get_str(json),
+                       qstring_get_length(json));
+    QDECREF(json);
+}
+
+QString *json_output_get_qstring(JsonOutputVisitor *jov)
+{
+    /* FIXME: we should require that a visit occurred, and that it is
+     * complete (no starts without a matching end) */
+    if (!qstring_get_length(jov->str)) {
+        return qstring_from_str("null");
+    }
+    QINCREF(jov->str);
+    return jov->str;
+}
+
+Visitor *json_output_get_visitor(JsonOutputVisitor *v)
+{
+    return &v->visitor;
+}
+
+void json_output_visitor_cleanup(JsonOutputVisitor *v)
+{
+    while (!QSLIST_EMPTY(&v->stack)) {
+        json_output_pop(v);
+    }
+
+    QDECREF(v->str);
+    g_free(v);
+}
+
+JsonOutputVisitor *json_output_visitor_new(void)
+{
+    JsonOutputVisitor *v;
+
+    v = g_malloc0(sizeof(*v));
+
+    v->visitor.start_struct = json_output_start_struct;
+    v->visitor.end_struct = json_output_end_struct;
+    v->visitor.start_list = json_output_start_list;
+    v->visitor.next_list = json_output_next_list;
+    v->visitor.end_list = json_output_end_list;
+    v->visitor.type_enum = output_type_enum;
+    v->visitor.type_int64 = json_output_type_int64;
+    v->visitor.type_uint64 = json_output_type_uint64;
+    v->visitor.type_bool = json_output_type_bool;
+    v->visitor.type_str = json_output_type_str;
+    v->visitor.type_number = json_output_type_number;
+    v->visitor.type_any = json_output_type_any;
+
+    v->str = qstring_new();
+    QSLIST_INIT(&v->stack);
+
+    return v;
+}
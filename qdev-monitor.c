@@ -551,6 +551,10 @@ DeviceState *qdev_device_add(QemuOpts *opts, Error **errp)
         return NULL;
     }
 
+    if (qdev_should_hide_device(opts)) {
+        return NULL;
+    }
+
     /* find driver */
     dc = qdev_get_device_class(&driver, errp);
     if (!dc) {
@@ -793,8 +797,11 @@ void qmp_device_add(QDict *qdict, QObject **ret_data, Error **errp)
     }
     dev = qdev_device_add(opts, &local_err);
     if (!dev) {
-        error_propagate(errp, local_err);
-        qemu_opts_del(opts);
+        /* A hidden device is created later from the same options */
+        if (local_err) {
+            error_propagate(errp, local_err);
+            qemu_opts_del(opts);
+        }
         return;
     }
     object_unref(OBJECT(dev));
@@ -34,6 +34,7 @@
 #include "qapi/qmp-output-visitor.h"
 #include "qapi-visit.h"
 #include "qemu/base64.h"
+#include "qemu/iov.h"
 #include "io/channel-socket.h"
 #include "io/channel-file.h"
 #include "io/channel-tls.h"
@@ -291,6 +292,41 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
     return ret;
 }
 
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov, int iovcnt)
+{
+    int ret, done = 0;
+    int i;
+
+    if (!s->chr_writev || s->replay) {
+        /* One write per buffer, until one of them is short */
+        for (i = 0; i < iovcnt; i++) {
+            ret = qemu_chr_fe_write(s, iov[i].iov_base, iov[i].iov_len);
+            if (ret < 0) {
+                return done ? done : ret;
+            }
+            done += ret;
+            if (ret < iov[i].iov_len) {
+                break;
+            }
+        }
+        return done;
+    }
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    ret = s->chr_writev(s, iov, iovcnt);
+
+    for (i = 0; i < iovcnt && done < ret; i++) {
+        size_t len = MIN(iov[i].iov_len, ret - done);
+
+        qemu_chr_fe_write_log(s, iov[i].iov_base, len);
+        done += len;
+    }
+
+    qemu_mutex_unlock(&s->chr_write_lock);
+
+    return ret;
+}
+
 int qemu_chr_fe_write_all(CharDriverState *s, const uint8_t *buf, int len)
 {
     int offset;
@@ -444,6 +480,13 @@ void qemu_chr_fe_printf(CharDriverState *s, const char *fmt, ...)
 
 static void remove_fd_in_watch(CharDriverState *chr);
 
+void qemu_chr_fe_set_context(CharDriverState *s, GMainContext *context)
+{
+    /* The watch is added again by qemu_chr_add_handlers() */
+    remove_fd_in_watch(s);
+    s->context = context;
+}
+
 void qemu_chr_add_handlers(CharDriverState *s,
                            IOCanReadHandler *fd_can_read,
                            IOReadHandler *fd_read,
@@ -836,6 +879,7 @@ typedef struct IOWatchPoll
     IOCanReadHandler *fd_can_read;
     GSourceFunc fd_read;
     void *opaque;
+    GMainContext *context;
 } IOWatchPoll;
 
 static IOWatchPoll *io_watch_poll_from_source(GSource *source)
@@ -856,7 +900,7 @@ static gboolean io_watch_poll_prepare(GSource *source, gint *timeout_)
         iwp->src = qio_channel_create_watch(
             iwp->ioc, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL);
         g_source_set_callback(iwp->src, iwp->fd_read, iwp->opaque, NULL);
-        g_source_attach(iwp->src, NULL);
+        g_source_attach(iwp->src, iwp->context);
     } else {
         g_source_destroy(iwp->src);
         g_source_unref(iwp->src);
@@ -903,7 +947,8 @@ static GSourceFuncs io_watch_poll_funcs = {
 static guint io_add_watch_poll(QIOChannel *ioc,
                                IOCanReadHandler *fd_can_read,
                                QIOChannelFunc fd_read,
-                               gpointer user_data)
+                               gpointer user_data,
+                               GMainContext *context)
 {
     IOWatchPoll *iwp;
     int tag;
@@ -914,20 +959,21 @@ static guint io_add_watch_poll(QIOChannel *ioc,
     iwp->ioc = ioc;
     iwp->fd_read = (GSourceFunc) fd_read;
     iwp->src = NULL;
+    iwp->context = context;
 
-    tag = g_source_attach(&iwp->parent, NULL);
+    tag = g_source_attach(&iwp->parent, context);
     g_source_unref(&iwp->parent);
     return tag;
 }
 
-static void io_remove_watch_poll(guint tag)
+static void io_remove_watch_poll(guint tag, GMainContext *context)
 {
     GSource *source;
     IOWatchPoll *iwp;
 
     g_return_if_fail (tag > 0);
 
-    source = g_main_context_find_source_by_id(NULL, tag);
+    source = g_main_context_find_source_by_id(context, tag);
     g_return_if_fail (source != NULL);
 
     iwp = io_watch_poll_from_source(source);
@@ -942,44 +988,60 @@ static void io_remove_watch_poll(guint tag)
 static void remove_fd_in_watch(CharDriverState *chr)
 {
     if (chr->fd_in_tag) {
-        io_remove_watch_poll(chr->fd_in_tag);
+        io_remove_watch_poll(chr->fd_in_tag, chr->context);
         chr->fd_in_tag = 0;
     }
 }
 
 
-static int io_channel_send_full(QIOChannel *ioc,
-                                const void *buf, size_t len,
-                                int *fds, size_t nfds)
+static int io_channel_sendv_full(QIOChannel *ioc,
+                                 const struct iovec *iov, unsigned niov,
+                                 int *fds, size_t nfds)
 {
+    size_t len = iov_size(iov, niov);
     size_t offset = 0;
+    struct iovec *local_iov, *cur;
+
+    cur = local_iov = g_new(struct iovec, niov);
+    memcpy(local_iov, iov, niov * sizeof(*iov));
 
     while (offset < len) {
         ssize_t ret = 0;
-        struct iovec iov = { .iov_base = (char *)buf + offset,
-                             .iov_len = len - offset };
 
         ret = qio_channel_writev_full(
-            ioc, &iov, 1,
+            ioc, cur, niov,
             fds, nfds, NULL);
         if (ret == QIO_CHANNEL_ERR_BLOCK) {
             if (offset) {
-                return offset;
+                break;
             }
 
+            g_free(local_iov);
             errno = EAGAIN;
             return -1;
         } else if (ret < 0) {
+            g_free(local_iov);
             errno = EINVAL;
             return -1;
         }
 
         offset += ret;
+        iov_discard_front(&cur, &niov, ret);
     }
 
+    g_free(local_iov);
     return offset;
 }
 
+static int io_channel_send_full(QIOChannel *ioc,
+                                const void *buf, size_t len,
+                                int *fds, size_t nfds)
+{
+    struct iovec iov = { .iov_base = (char *)buf, .iov_len = len };
+
+    return io_channel_sendv_full(ioc, &iov, 1, fds, nfds);
+}
+
 
 #ifndef _WIN32
 static int io_channel_send(QIOChannel *ioc, const void *buf, size_t len)
@@ -1002,6 +1064,15 @@ static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return io_channel_send(s->ioc_out, buf, len);
 }
 
+/* Called with chr_write_lock held.  */
+static int fd_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                         int iovcnt)
+{
+    FDCharDriver *s = chr->opaque;
+
+    return io_channel_sendv_full(s->ioc_out, iov, iovcnt, NULL, 0);
+}
+
 static gboolean fd_chr_read(QIOChannel *chan, GIOCondition cond, void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -1055,7 +1126,8 @@ static void fd_chr_update_read_handler(CharDriverState *chr)
     if (s->ioc_in) {
         chr->fd_in_tag = io_add_watch_poll(s->ioc_in,
                                            fd_chr_read_poll,
-                                           fd_chr_read, chr);
+                                           fd_chr_read, chr,
+                                           chr->context);
     }
 }
 
@@ -1094,6 +1166,7 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out,
     chr->opaque = s;
     chr->chr_add_watch = fd_chr_add_watch;
     chr->chr_write = fd_chr_write;
+    chr->chr_writev = fd_chr_writev;
     chr->chr_update_read_handler = fd_chr_update_read_handler;
     chr->chr_close = fd_chr_close;
 
@@ -1403,7 +1476,8 @@ static void pty_chr_state(CharDriverState *chr, int connected)
         if (!chr->fd_in_tag) {
             chr->fd_in_tag = io_add_watch_poll(s->ioc,
                                                pty_chr_read_poll,
-                                               pty_chr_read, chr);
+                                               pty_chr_read, chr,
+                                               chr->context);
         }
     }
 }
@@ -2550,7 +2624,8 @@ static void udp_chr_update_read_handler(CharDriverState *chr)
     if (s->ioc) {
         chr->fd_in_tag = io_add_watch_poll(s->ioc,
                                            udp_chr_read_poll,
-                                           udp_chr_read, chr);
+                                           udp_chr_read, chr,
+                                           chr->context);
     }
 }
 
@@ -2669,6 +2744,30 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     }
 }
 
+/* Called with chr_write_lock held.  */
+static int tcp_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+    if (s->connected) {
+        int ret = io_channel_sendv_full(s->ioc, iov, iovcnt,
+                                        s->write_msgfds,
+                                        s->write_msgfds_num);
+
+        /* free the written msgfds, no matter what */
+        if (s->write_msgfds_num) {
+            g_free(s->write_msgfds);
+            s->write_msgfds = 0;
+            s->write_msgfds_num = 0;
+        }
+
+        return ret;
+    } else {
+        /* XXX: indicate an error ? */
+        return iov_size(iov, iovcnt);
+    }
+}
+
 static int tcp_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -2840,6 +2939,10 @@ static void tcp_chr_disconnect(CharDriverState *chr)
         return;
     }
 
+    /* The input may be read in another thread than the output is
+     * written, see qemu_chr_fe_set_context().
+     */
+    qemu_mutex_lock(&chr->chr_write_lock);
     s->connected = 0;
     if (s->listen_ioc) {
         s->listen_tag = qio_channel_add_watch(
@@ -2851,6 +2954,7 @@ static void tcp_chr_disconnect(CharDriverState *chr)
     s->sioc = NULL;
     object_unref(OBJECT(s->ioc));
     s->ioc = NULL;
+    qemu_mutex_unlock(&chr->chr_write_lock);
     g_free(chr->filename);
     chr->filename = SocketAddress_to_str("disconnected:", s->addr,
                                          s->is_listen, s->is_telnet);
@@ -2920,7 +3024,8 @@ static void tcp_chr_connect(void *opaque)
     if (s->ioc) {
         chr->fd_in_tag = io_add_watch_poll(s->ioc,
                                            tcp_chr_read_poll,
-                                           tcp_chr_read, chr);
+                                           tcp_chr_read, chr,
+                                           chr->context);
     }
     qemu_chr_be_generic_open(chr);
 }
@@ -2937,7 +3042,8 @@ static void tcp_chr_update_read_handler(CharDriverState *chr)
     if (s->ioc) {
         chr->fd_in_tag = io_add_watch_poll(s->ioc,
                                            tcp_chr_read_poll,
-                                           tcp_chr_read, chr);
+                                           tcp_chr_read, chr,
+                                           chr->context);
     }
 }
 
@@ -4391,6 +4497,7 @@ static CharDriverState *qmp_chardev_open_socket(const char *id,
 
     chr->opaque = s;
     chr->chr_write = tcp_chr_write;
+    chr->chr_writev = tcp_chr_writev;
     chr->chr_sync_read = tcp_chr_sync_read;
     chr->chr_close = tcp_chr_close;
     chr->get_msgfds = tcp_get_msgfds;
@@ -36,6 +36,8 @@
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/qapi.h"
+#include "qemu/timer.h"
+#include "qemu-io.h"
 #include <getopt.h>
 
 #define QEMU_IMG_VERSION "qemu-img version " QEMU_VERSION QEMU_PKGVERSION \
@@ -51,6 +53,7 @@ enum {
     OPTION_BACKING_CHAIN = 257,
     OPTION_OBJECT = 258,
     OPTION_IMAGE_OPTS = 259,
+    OPTION_PREALLOCATION = 260,
 };
 
 typedef enum OutputFormat {
@@ -138,6 +141,14 @@ static void QEMU_NORETURN help(void)
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
            "\n"
+           "Parameters to convert subcommand:\n"
+           "  '-m' specifies how many coroutines work in parallel during the convert\n"
+           "       process (defaults to 8)\n"
+           "  '-W' allows the target to be written out of order instead of sequentially\n"
+           "  '-C' offloads the data copy to the storage where possible (e.g. with\n"
+           "       copy_file_range() between files on the same file system). Data\n"
+           "       ranges are not scanned for zeroes in this case\n"
+           "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
            "       '-r leaks' repairs only cluster leaks, whereas '-r all' fixes all\n"
@@ -972,6 +983,11 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
         *pnum = 0;
         return 0;
     }
+    /* Unallocated clusters are usually read as a whole */
+    if (buffer_is_zero(buf, n * 512)) {
+        *pnum = n;
+        return 0;
+    }
     is_zero = buffer_is_zero(buf, 512);
     for(i = 1; i < n; i++) {
         buf += 512;
@@ -1103,6 +1119,70 @@ static int check_empty_sectors(BlockBackend *blk, int64_t sect_num,
     return 0;
 }
 
+/* Size of the requests that compare_read() keeps in flight on each image */
+#define COMPARE_REQ_SECTORS     ((256 * 1024) >> BDRV_SECTOR_BITS)
+
+typedef struct CompareRead {
+    int ret;
+    int *in_flight;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} CompareRead;
+
+static void compare_read_cb(void *opaque, int ret)
+{
+    CompareRead *req = opaque;
+
+    req->ret = ret;
+    (*req->in_flight)--;
+}
+
+/*
+ * Reads the same range of two images into buf1 and buf2.  All of it is read
+ * at once, in COMPARE_REQ_SECTORS requests, rather than one image after the
+ * other.  Returns 0 on success, or the index (1 or 2) of the image whose read
+ * failed with *err set to the negative errno.
+ */
+static int compare_read(BlockBackend *blk1, BlockBackend *blk2,
+                        int64_t sector_num, int nb_sectors,
+                        uint8_t *buf1, uint8_t *buf2, int *err)
+{
+    int nb_reqs = DIV_ROUND_UP(nb_sectors, COMPARE_REQ_SECTORS);
+    CompareRead *reqs = g_new0(CompareRead, 2 * nb_reqs);
+    int in_flight = 0;
+    int i, ret = 0;
+
+    for (i = 0; i < 2 * nb_reqs; i++) {
+        CompareRead *req = &reqs[i];
+        BlockBackend *blk = i < nb_reqs ? blk1 : blk2;
+        uint8_t *buf = i < nb_reqs ? buf1 : buf2;
+        int64_t offset = (int64_t)(i % nb_reqs) * COMPARE_REQ_SECTORS;
+        int n = MIN(nb_sectors - offset, COMPARE_REQ_SECTORS);
+
+        req->in_flight = &in_flight;
+        req->iov.iov_base = buf + sectors_to_bytes(offset);
+        req->iov.iov_len = sectors_to_bytes(n);
+        qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+
+        in_flight++;
+        blk_aio_readv(blk, sector_num + offset, &req->qiov, n,
+                      compare_read_cb, req);
+    }
+    while (in_flight > 0) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+
+    for (i = 0; i < 2 * nb_reqs; i++) {
+        if (reqs[i].ret < 0) {
+            *err = reqs[i].ret;
+            ret = i < nb_reqs ? 1 : 2;
+            break;
+        }
+    }
+    g_free(reqs);
+    return ret;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -1119,6 +1199,7 @@ static int img_compare(int argc, char **argv)
     uint8_t *buf1 = NULL, *buf2 = NULL;
     int pnum1, pnum2;
     int allocated1, allocated2;
+    bool zero1, zero2;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
@@ -1297,38 +1378,35 @@ static int img_compare(int argc, char **argv)
                 goto out;
             }
         }
-        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
+        /* Unallocated in the whole chain reads as zeroes too */
+        zero1 = (status1 & BDRV_BLOCK_ZERO) || !allocated1;
+        zero2 = (status2 & BDRV_BLOCK_ZERO) || !allocated2;
+
+        if (zero1 && zero2) {
             nb_sectors = MIN(pnum1, pnum2);
-        } else if (allocated1 == allocated2) {
-            if (allocated1) {
-                ret = blk_read(blk1, sector_num, buf1, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64 " of %s:"
-                                 " %s", sectors_to_bytes(sector_num), filename1,
-                                 strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = blk_read(blk2, sector_num, buf2, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s", sectors_to_bytes(sector_num),
-                                 filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
-                if (ret || pnum != nb_sectors) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            sectors_to_bytes(
-                                ret ? sector_num : sector_num + pnum));
-                    ret = 1;
-                    goto out;
-                }
+        } else if (!zero1 && !zero2) {
+            int err;
+
+            ret = compare_read(blk1, blk2, sector_num, nb_sectors,
+                               buf1, buf2, &err);
+            if (ret) {
+                error_report("Error while reading offset %" PRId64 " of %s:"
+                             " %s", sectors_to_bytes(sector_num),
+                             ret == 1 ? filename1 : filename2, strerror(-err));
+                ret = 4;
+                goto out;
+            }
+            ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
+            if (ret || pnum != nb_sectors) {
+                qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                        sectors_to_bytes(
+                            ret ? sector_num : sector_num + pnum));
+                ret = 1;
+                goto out;
             }
         } else {
 
-            if (allocated1) {
+            if (!zero1) {
                 ret = check_empty_sectors(blk1, sector_num, nb_sectors,
                                           filename1, buf1, quiet);
             } else {
@@ -1418,6 +1496,8 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
+#define MAX_COROUTINES 16
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1425,24 +1505,37 @@ typedef struct ImgConvertState {
     int64_t src_cur_offset;
     int64_t total_sectors;
     int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
     bool target_has_backing;
+    bool wr_in_order;
+    bool copy_range;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
 } ImgConvertState;
 
-static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
 {
-    assert(sector_num >= s->src_cur_offset);
-    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
-        s->src_cur_offset += s->src_sectors[s->src_cur];
-        s->src_cur++;
-        assert(s->src_cur < s->src_num);
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
     }
 }
 
@@ -1451,7 +1544,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     int64_t ret;
     int n;
 
-    convert_select_part(s, sector_num);
+    convert_select_part(s, sector_num, &s->src_cur, &s->src_cur_offset);
 
     assert(s->total_sectors > sector_num);
     n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
@@ -1503,30 +1596,33 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
-static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                        uint8_t *buf)
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
 {
     int n;
     int ret;
-
-    if (s->status == BLK_ZERO || s->status == BLK_BACKING_FILE) {
-        return 0;
-    }
+    struct iovec iov;
+    QEMUIOVector qiov;
 
     assert(nb_sectors <= s->buf_sectors);
     while (nb_sectors > 0) {
         BlockBackend *blk;
-        int64_t bs_sectors;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
 
         /* In the case of compression with multiple source files, we can get a
          * nb_sectors that spreads into the next part. So we must be able to
          * read across multiple BDSes for one convert_read() call. */
-        convert_select_part(s, sector_num);
-        blk = s->src[s->src_cur];
-        bs_sectors = s->src_sectors[s->src_cur];
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
 
-        n = MIN(nb_sectors, bs_sectors - (sector_num - s->src_cur_offset));
-        ret = blk_read(blk, sector_num - s->src_cur_offset, buf, n);
+        ret = blk_co_readv(blk, sector_num - src_cur_offset, n, &qiov);
         if (ret < 0) {
             return ret;
         }
@@ -1539,15 +1635,27 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                         const uint8_t *buf)
+/* Returns true if a compressed cluster can be left out of the target */
+static bool convert_zero_cluster(ImgConvertState *s, const uint8_t *buf,
+                                 int nb_sectors)
+{
+    return s->has_zero_init && s->min_sparse &&
+           buffer_is_zero(buf, nb_sectors * BDRV_SECTOR_SIZE);
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
 {
     int ret;
+    struct iovec iov;
+    QEMUIOVector qiov;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
 
-        switch (s->status) {
+        switch (status) {
         case BLK_BACKING_FILE:
             /* If we have a backing file, leave clusters unallocated that are
              * unallocated in the source image, so that the backing file is
@@ -1557,17 +1665,29 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
 
         case BLK_DATA:
             /* We must always write compressed clusters as a whole, so don't
-             * try to find zeroed parts in the buffer. We can only save the
-             * write if the buffer is completely zeroed and we're allowed to
+             * try to find zeroed parts in a cluster. We can only save the
+             * write if a cluster is completely zeroed and we're allowed to
              * keep the target sparse. */
             if (s->compressed) {
-                if (s->has_zero_init && s->min_sparse &&
-                    buffer_is_zero(buf, n * BDRV_SECTOR_SIZE))
-                {
+                n = MIN(n, s->cluster_sectors);
+                if (convert_zero_cluster(s, buf, n)) {
                     assert(!s->target_has_backing);
                     break;
                 }
 
+                /* Pass all following non-zero clusters at once, so that
+                 * they can be compressed in parallel */
+                while (n < nb_sectors) {
+                    int len = MIN(s->cluster_sectors, nb_sectors - n);
+                    if (convert_zero_cluster(s, buf + n * BDRV_SECTOR_SIZE,
+                                             len)) {
+                        break;
+                    }
+                    n += len;
+                }
+
+                /* Compressed writes are only used with wr_in_order, so
+                 * there is no other request in flight on the target. */
                 ret = blk_write_compressed(s->target, sector_num, buf, n);
                 if (ret < 0) {
                     return ret;
@@ -1581,7 +1701,11 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (!s->min_sparse ||
                 is_allocated_sectors_min(buf, n, &n, s->min_sparse))
             {
-                ret = blk_write(s->target, sector_num, buf, n);
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = blk_co_writev(s->target, sector_num, n, &qiov);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1593,7 +1717,7 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (s->has_zero_init) {
                 break;
             }
-            ret = blk_write_zeroes(s->target, sector_num, n, 0);
+            ret = blk_co_write_zeroes(s->target, sector_num, n, 0);
             if (ret < 0) {
                 return ret;
             }
@@ -1608,12 +1732,162 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_do_copy(ImgConvertState *s)
+static int coroutine_fn convert_co_copy_range(ImgConvertState *s,
+                                              int64_t sector_num,
+                                              int nb_sectors)
 {
-    uint8_t *buf = NULL;
-    int64_t sector_num, allocated_done;
-    int ret;
     int n;
+    int ret;
+
+    while (nb_sectors > 0) {
+        BlockBackend *blk;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
+
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+
+        ret = blk_co_copy_range(blk, sector_num - src_cur_offset,
+                                s->target, sector_num, n, 0);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    return 0;
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf = NULL;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+        bool copy_range;
+
+        /* The block status query may yield, so it is serialised; every other
+         * coroutine keeps its own read and write in flight meanwhile. */
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            break;
+        }
+        /* Save the current sector and status to local variables, and let the
+         * other coroutines continue beyond this request */
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        copy_range = s->copy_range && status == BLK_DATA;
+        if (status == BLK_DATA) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                s->allocated_sectors, 0);
+        }
+
+        if (status == BLK_DATA && !copy_range) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* keep writes in order */
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        if (s->ret == -EINPROGRESS && copy_range) {
+            ret = convert_co_copy_range(s, sector_num, n);
+            if (ret == -ENOTSUP) {
+                /* The copy cannot be offloaded between these images, so
+                 * bounce this and all following requests through the buffer */
+                s->copy_range = false;
+                copy_range = false;
+                ret = convert_co_read(s, sector_num, n, buf);
+                if (ret < 0) {
+                    error_report("error while reading sector %" PRId64
+                                 ": %s", sector_num, strerror(-ret));
+                    s->ret = ret;
+                }
+            } else if (ret < 0) {
+                error_report("error while copying sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->ret == -EINPROGRESS && !copy_range) {
+            ret = convert_co_write(s, sector_num, n, buf, status);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* Reenter the coroutine that may be waiting for this write to
+             * complete.  A coroutine that is still running its own write has
+             * wait_sector_num == -1, so it is never entered from here. */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int ret, i, n;
+    int64_t sector_num = 0;
 
     /* Check whether we have zero initialisation or can get it efficiently */
     s->has_zero_init = s->min_sparse && !s->target_has_backing
@@ -1629,26 +1903,23 @@ static int convert_do_copy(ImgConvertState *s)
         }
     }
 
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /* Allocate buffer for copied data. For compressed images, only whole
+     * clusters can be copied; passing many of them at once lets the target
+     * driver compress them in parallel. */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
-            ret = -EINVAL;
-            goto fail;
+            return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors, s->cluster_sectors);
     }
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
     /* Calculate allocated sectors for progress */
     s->allocated_sectors = 0;
-    sector_num = 0;
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
-            ret = n;
-            goto fail;
+            return n;
         }
         if (s->status == BLK_DATA) {
             s->allocated_sectors += n;
@@ -1657,54 +1928,32 @@ static int convert_do_copy(ImgConvertState *s)
     }
 
     /* Do the copy */
-    s->src_cur = 0;
-    s->src_cur_offset = 0;
     s->sector_next_status = 0;
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->allocated_done = 0;
+    s->ret = -EINPROGRESS;
 
-    sector_num = 0;
-    allocated_done = 0;
-
-    while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
-        if (n < 0) {
-            ret = n;
-            goto fail;
-        }
-        if (s->status == BLK_DATA) {
-            allocated_done += n;
-            qemu_progress_print(100.0 * allocated_done / s->allocated_sectors,
-                                0);
-        }
-
-        ret = convert_read(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while reading sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
-
-        ret = convert_write(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while writing sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i], s);
+    }
 
-        sector_num += n;
+    while (s->running_coroutines) {
+        main_loop_wait(false);
     }
 
-    if (s->compressed) {
+    if (s->ret == 0 && s->compressed) {
         /* signal EOF to align */
         ret = blk_write_compressed(s->target, 0, NULL, 0);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     }
 
-    ret = 0;
-fail:
-    qemu_vfree(buf);
-    return ret;
+    return s->ret;
 }
 
 static int img_convert(int argc, char **argv)
@@ -1731,6 +1980,9 @@ static int img_convert(int argc, char **argv)
     QemuOpts *sn_opts = NULL;
     ImgConvertState state;
     bool image_opts = false;
+    bool wr_in_order = true;
+    bool copy_range = false;
+    long num_coroutines = 8;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1746,7 +1998,7 @@ static int img_convert(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn",
+        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnm:WC",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1838,6 +2090,21 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        case 'W':
+            wr_in_order = false;
+            break;
+        case 'C':
+            copy_range = true;
+            break;
         case OPTION_OBJECT:
             opts = qemu_opts_parse_noisily(&qemu_object_opts,
                                            optarg, true);
@@ -1858,6 +2125,18 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (!wr_in_order && compress) {
+        error_report("Out of order write and compress are mutually exclusive");
+        ret = -1;
+        goto fail_getopt;
+    }
+
+    if (copy_range && compress) {
+        error_report("Copy offloading and compression are mutually exclusive");
+        ret = -1;
+        goto fail_getopt;
+    }
+
     /* Initialize before goto out */
     if (quiet) {
         progress = 0;
@@ -2090,6 +2369,13 @@ static int img_convert(int argc, char **argv)
         cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
+    /* Compressed clusters are appended to the image, so they must be written
+     * in order */
+    if (compress) {
+        wr_in_order = true;
+        copy_range = false;
+    }
+
     state = (ImgConvertState) {
         .src                = blk,
         .src_sectors        = bs_sectors,
@@ -2101,6 +2387,9 @@ static int img_convert(int argc, char **argv)
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
         .buf_sectors        = bufsectors,
+        .wr_in_order        = wr_in_order,
+        .copy_range         = copy_range,
+        .num_coroutines     = num_coroutines,
     };
     ret = convert_do_copy(&state);
 
@@ -2426,29 +2715,53 @@ static void dump_map_entry(OutputFormat output_format, MapEntry *e,
     }
 }
 
+/* Last range found unallocated in one file of the backing chain */
+typedef struct MapUnallocRange {
+    BlockDriverState *bs;
+    int64_t start;
+    int64_t end;
+} MapUnallocRange;
+
+/*
+ * @unalloc has an entry for each depth of the chain.  Without it, a large
+ * unallocated range of the top files would be queried again for each of the
+ * extents that the base file has within it.
+ */
 static int get_block_status(BlockDriverState *bs, int64_t sector_num,
-                            int nb_sectors, MapEntry *e)
+                            int nb_sectors, MapEntry *e, GArray *unalloc)
 {
     int64_t ret;
     int depth;
-    BlockDriverState *file;
+    BlockDriverState *file = NULL;
     bool has_offset;
-
-    /* As an optimization, we could cache the current range of unallocated
-     * clusters in each file of the chain, and avoid querying the same
-     * range repeatedly.
-     */
+    MapUnallocRange *range;
 
     depth = 0;
     for (;;) {
-        ret = bdrv_get_block_status(bs, sector_num, nb_sectors, &nb_sectors,
-                                    &file);
-        if (ret < 0) {
-            return ret;
+        if (depth >= unalloc->len) {
+            g_array_set_size(unalloc, depth + 1);
         }
-        assert(nb_sectors);
-        if (ret & (BDRV_BLOCK_ZERO|BDRV_BLOCK_DATA)) {
-            break;
+        range = &g_array_index(unalloc, MapUnallocRange, depth);
+
+        if (range->bs == bs && sector_num >= range->start &&
+            sector_num < range->end) {
+            nb_sectors = MIN(nb_sectors, range->end - sector_num);
+            ret = 0;
+        } else {
+            ret = bdrv_get_block_status(bs, sector_num, nb_sectors,
+                                        &nb_sectors, &file);
+            if (ret < 0) {
+                return ret;
+            }
+            assert(nb_sectors);
+            if (ret & (BDRV_BLOCK_ZERO|BDRV_BLOCK_DATA)) {
+                break;
+            }
+            *range = (MapUnallocRange) {
+                .bs = bs,
+                .start = sector_num,
+                .end = sector_num + nb_sectors,
+            };
         }
         bs = backing_bs(bs);
         if (bs == NULL) {
@@ -2506,6 +2819,7 @@ static int img_map(int argc, char **argv)
     const char *filename, *fmt, *output;
     int64_t length;
     MapEntry curr = { .length = 0 }, next;
+    GArray *unalloc;
     int ret = 0;
     Error *local_err = NULL;
     bool image_opts = false;
@@ -2583,6 +2897,7 @@ static int img_map(int argc, char **argv)
         printf("%-16s%-16s%-16s%s\n", "Offset", "Length", "Mapped to", "File");
     }
 
+    unalloc = g_array_new(false, true, sizeof(MapUnallocRange));
     length = blk_getlength(blk);
     while (curr.start + curr.length < length) {
         int64_t nsectors_left;
@@ -2594,7 +2909,7 @@ static int img_map(int argc, char **argv)
         /* Probe up to 1 GiB at a time.  */
         nsectors_left = DIV_ROUND_UP(length, BDRV_SECTOR_SIZE) - sector_num;
         n = MIN(1 << (30 - BDRV_SECTOR_BITS), nsectors_left);
-        ret = get_block_status(bs, sector_num, n, &next);
+        ret = get_block_status(bs, sector_num, n, &next, unalloc);
 
         if (ret < 0) {
             error_report("Could not read file metadata: %s", strerror(-ret));
@@ -2615,6 +2930,7 @@ static int img_map(int argc, char **argv)
     dump_map_entry(output_format, &curr, NULL);
 
 out:
+    g_array_free(unalloc, true);
     blk_unref(blk);
     return ret < 0;
 }
@@ -3125,6 +3441,7 @@ static int img_resize(int argc, char **argv)
     BlockBackend *blk = NULL;
     QemuOpts *param;
     Error *local_err = NULL;
+    PreallocMode prealloc = PREALLOC_MODE_OFF;
 
     static QemuOptsList resize_options = {
         .name = "resize_options",
@@ -3157,6 +3474,7 @@ static int img_resize(int argc, char **argv)
             {"help", no_argument, 0, 'h'},
             {"object", required_argument, 0, OPTION_OBJECT},
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
+            {"preallocation", required_argument, 0, OPTION_PREALLOCATION},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, "f:hq",
@@ -3186,6 +3504,15 @@ static int img_resize(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_PREALLOCATION:
+            prealloc = qapi_enum_parse(PreallocMode_lookup, optarg,
+                                       PREALLOC_MODE__MAX, PREALLOC_MODE__MAX,
+                                       NULL);
+            if (prealloc == PREALLOC_MODE__MAX) {
+                error_report("Invalid preallocation mode '%s'", optarg);
+                return 1;
+            }
+            break;
         }
     }
     if (optind != argc - 1) {
@@ -3245,7 +3572,12 @@ static int img_resize(int argc, char **argv)
         goto out;
     }
 
-    ret = blk_truncate(blk, total_size);
+    ret = blk_truncate_prealloc(blk, total_size, prealloc, &err);
+    if (err) {
+        error_report_err(err);
+        goto out;
+    }
+
     switch (ret) {
     case 0:
         qprintf(quiet, "Image resized.\n");
@@ -3444,6 +3776,168 @@ out_no_progress:
     return 0;
 }
 
+static int img_bench(int argc, char **argv)
+{
+    QemuIOBenchParams params = QEMUIO_BENCH_PARAMS_DEFAULT;
+    const char *fmt = NULL, *filename, *cache;
+    BlockBackend *blk = NULL;
+    Error *local_err = NULL;
+    bool image_opts = false;
+    bool native_aio = false;
+    int c, ret = 0;
+    int flags;
+
+    cache = BDRV_DEFAULT_CACHE;
+    for (;;) {
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"object", required_argument, 0, OPTION_OBJECT},
+            {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "hCd:f:im:no:rs:t:T:",
+                        long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+        case '?':
+            help();
+            break;
+        case 'C':
+            params.csv = true;
+            break;
+        case 'd':
+        {
+            long depth;
+
+            if (qemu_strtol(optarg, NULL, 0, &depth) ||
+                depth <= 0 || depth > INT_MAX) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            params.depth = depth;
+            break;
+        }
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'i':
+            params.iothread = true;
+            break;
+        case 'm':
+        {
+            long pct;
+
+            if (qemu_strtol(optarg, NULL, 0, &pct) || pct < 0 || pct > 100) {
+                error_report("Invalid write percentage specified");
+                return 1;
+            }
+            params.write_pct = pct;
+            break;
+        }
+        case 'n':
+            native_aio = true;
+            break;
+        case 'o':
+        {
+            char *end;
+
+            params.offset = qemu_strtosz_suffix(optarg, &end,
+                                                QEMU_STRTOSZ_DEFSUFFIX_B);
+            if (params.offset < 0 || *end ||
+                (params.offset & ~BDRV_SECTOR_MASK)) {
+                error_report("Invalid offset specified");
+                return 1;
+            }
+            break;
+        }
+        case 'r':
+            params.random = true;
+            break;
+        case 's':
+        {
+            char *end;
+
+            params.bufsize = qemu_strtosz_suffix(optarg, &end,
+                                                 QEMU_STRTOSZ_DEFSUFFIX_B);
+            if (params.bufsize <= 0 || *end || params.bufsize > INT_MAX ||
+                (params.bufsize & ~BDRV_SECTOR_MASK)) {
+                error_report("Invalid request size specified");
+                return 1;
+            }
+            break;
+        }
+        case 't':
+            cache = optarg;
+            break;
+        case 'T':
+        {
+            long secs;
+
+            if (qemu_strtol(optarg, NULL, 0, &secs) ||
+                secs <= 0 || secs > INT_MAX) {
+                error_report("Invalid duration specified");
+                return 1;
+            }
+            params.duration_ns = secs * NANOSECONDS_PER_SECOND;
+            break;
+        }
+        case OPTION_OBJECT: {
+            QemuOpts *opts;
+            opts = qemu_opts_parse_noisily(&qemu_object_opts,
+                                           optarg, true);
+            if (!opts) {
+                return 1;
+            }
+        }   break;
+        case OPTION_IMAGE_OPTS:
+            image_opts = true;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        error_exit("Expecting one image file name");
+    }
+    filename = argv[argc - 1];
+
+    if (qemu_opts_foreach(&qemu_object_opts,
+                          user_creatable_add_opts_foreach,
+                          NULL, &local_err)) {
+        error_report_err(local_err);
+        return 1;
+    }
+
+    flags = BDRV_O_FLAGS;
+    if (params.write_pct) {
+        flags |= BDRV_O_RDWR;
+    }
+    if (native_aio) {
+        flags |= BDRV_O_NATIVE_AIO;
+    }
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        return 1;
+    }
+
+    blk = img_open("image", image_opts, filename, fmt, flags, true, false);
+    if (!blk) {
+        return 1;
+    }
+
+    ret = qemuio_bench(blk, &params);
+    if (ret < 0) {
+        error_report("Benchmark failed: %s", strerror(-ret));
+    }
+
+    blk_unref(blk);
+    return ret < 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
@@ -36,6 +36,8 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off|split controls accelerated irqchip support (default=off)\n"
     "                vmport=on|off|auto controls emulation of vmport (default: auto)\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
+    "                kvm_dirty_ring_size=n entries in the KVM dirty ring of each vCPU (default: 0)\n"
+    "                kvm_halt_poll_ns=n longest time in ns that KVM polls a halted vCPU\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
     "                iommu=on|off controls emulated Intel IOMMU (VT-d) support (default=off)\n"
@@ -67,6 +69,20 @@ value based on accel. For accel=xen the default is off otherwise the default
 is on.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm_dirty_ring_size=@var{n}
+Track the pages dirtied by each vCPU in a ring of @var{n} entries instead of
+the dirty bitmap of each memory slot, if the host kernel supports it.
+@var{n} must be a power of two; the default of 0 uses the dirty bitmap.
+With the dirty ring, the cost of collecting dirty pages during live migration
+depends on the number of pages that were written rather than on the size of
+the guest memory.
+@item kvm_halt_poll_ns=@var{n}
+Let KVM poll a halted vCPU for at most @var{n} nanoseconds before it
+yields the host CPU, instead of the limit set for the whole host by the
+halt_poll_ns module parameter.  Polling shortens the wakeup latency of
+the vCPU at the cost of host CPU time; 0 disables polling.  Needs
+KVM_CAP_HALT_POLL.  The limit can be changed at runtime with the
+@code{set-kvm-halt-poll} QMP command.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
@@ -91,6 +107,27 @@ ETEXI
 HXCOMM Deprecated by -machine
 DEF("M", HAS_ARG, QEMU_OPTION_M, "", QEMU_ARCH_ALL)
 
+DEF("accel", HAS_ARG, QEMU_OPTION_accel,
+    "-accel [accel=]accelerator[,thread=single|multi]\n"
+    "                select accelerator ('-accel help for list')\n"
+    "                thread=single|multi (enable multi-threaded TCG)\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -accel @var{name}[,prop=@var{value}[,...]]
+@findex -accel
+This is used to enable an accelerator. Depending on the target architecture,
+kvm, xen, or tcg can be available. By default, tcg is used. If there is more
+than one accelerator specified, the next one is used if the previous one fails
+to initialize.
+@table @option
+@item thread=single|multi
+Controls number of TCG threads. When the TCG is multi-threaded there will be
+one thread per vCPU, therefore taking advantage of additional host cores.
+The default is to use a single thread which round-robins between all vCPUs.
+Multi-threaded TCG cannot be combined with @option{-icount}.
+@end table
+ETEXI
+
 DEF("cpu", HAS_ARG, QEMU_OPTION_cpu,
     "-cpu cpu        select CPU ('-cpu help' for list)\n", QEMU_ARCH_ALL)
 STEXI
@@ -122,11 +159,12 @@ specifies the maximum number of hotpluggable CPUs.
 ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n"
-    "-numa node[,memdev=id][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
+    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node][,host-cpus=cpu[-cpu]]\n"
+    "-numa node[,memdev=id][,cpus=cpu[-cpu]][,nodeid=node][,host-cpus=cpu[-cpu]]\n",
+    QEMU_ARCH_ALL)
 STEXI
-@item -numa node[,mem=@var{size}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}]
-@itemx -numa node[,memdev=@var{id}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}]
+@item -numa node[,mem=@var{size}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}][,host-cpus=@var{cpu[-cpu]}]
+@itemx -numa node[,memdev=@var{id}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}][,host-cpus=@var{cpu[-cpu]}]
 @findex -numa
 Simulate a multi node NUMA system. If @samp{mem}, @samp{memdev}
 and @samp{cpus} are omitted, resources are split equally. Also, note
@@ -138,6 +176,11 @@ to specify the memory backend for the @samp{memdev} suboption.
 
 @samp{mem} and @samp{memdev} are mutually exclusive.  Furthermore, if one
 node uses @samp{memdev}, all of them have to use it.
+
+@samp{host-cpus} binds the VCPU threads of the node, and the IOThreads whose
+@samp{numa-node} property is the node, to the given host CPUs.  It can be
+repeated to give several ranges.  Use the @samp{host-nodes} property of the
+memory backend to place the node's memory on the matching host node.
 ETEXI
 
 DEF("add-fd", HAS_ARG, QEMU_OPTION_add_fd,
@@ -521,7 +564,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -564,7 +607,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.  Unlike native Linux AIO, io_uring does not require @option{cache.direct=on}.  With @option{file.io-uring-sqpoll=on}, a kernel thread polls for new requests, which saves system calls at the cost of CPU time.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -1395,7 +1438,10 @@ achieved using the @code{acl} monitor command.
 Enable lossy compression methods (gradient, JPEG, ...). If this
 option is set, VNC client may receive lossy framebuffer updates
 depending on its encoding settings. Enabling this option can save
-a lot of bandwidth at the expense of quality.
+a lot of bandwidth at the expense of quality.  When QEMU is built
+with libx264 and the client supports the Open H.264 encoding, screen
+areas that the guest updates at video rates are sent as an H.264
+stream; this needs adaptive encodings, see @option{non-adaptive}.
 
 @item non-adaptive
 
@@ -1577,6 +1623,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev tap,id=str[,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile]\n"
     "         [,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off]\n"
     "         [,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
+    "         [,poll-us=n]\n"
     "                configure a host TAP network backend with ID 'str'\n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                to configure it and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1596,6 +1643,8 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
     "                use 'vhostfds=x:y:...:z to connect to multiple already opened vhost net devices\n"
     "                use 'queues=n' to specify the number of queues to be created for multiqueue TAP\n"
+    "                use 'poll-us=n' to specify the maximum number of microseconds that could be\n"
+    "                spent on busy polling for vhost net\n"
     "-netdev bridge,id=str[,br=bridge][,helper=helper]\n"
     "                configure a host TAP network backend with ID 'str' that is\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
@@ -1649,6 +1698,14 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+#endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m]\n"
+    "                attach to queues m to m+n-1 of the host network interface 'name'\n"
+    "                with AF_XDP sockets ('mode' is how XDP is attached; zero-copy is\n"
+    "                used with native XDP when the driver supports it, unless\n"
+    "                'force-copy' is on)\n"
 #endif
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -1673,6 +1730,9 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
 #endif
 #ifdef CONFIG_NETMAP
     "netmap|"
+#endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp|"
 #endif
     "socket][,vlan=n][,option][,option][,...]\n"
     "                old way to initialize a host network interface\n"
@@ -2070,6 +2130,24 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
+@item -netdev af-xdp,id=@var{id},ifname=@var{name}[,mode=native|skb][,force-copy=on|off][,queues=@var{n}][,start-queue=@var{m}]
+Attach to queues @var{m} to @var{m}+@var{n}-1 of the host network interface
+@var{name}, with one AF_XDP socket per queue.  Packets bypass the host
+network stack.  With @option{mode=native} the XDP program runs in the network
+driver, and packets are not copied by the kernel if the driver supports it,
+unless @option{force-copy=on}; @option{mode=skb} works with any driver.  By
+default native mode is used if possible.  With @var{n} greater than 1, each
+queue of a multiqueue virtio-net device uses one queue of the interface; the
+interface must steer the traffic of the guest to these queues.  This option
+is only available if QEMU has been compiled with AF_XDP support.
+
+Example:
+@example
+ethtool -L eth0 combined 4
+qemu-system-x86_64 linux.img -netdev af-xdp,id=n0,ifname=eth0,queues=4 \
+        -device virtio-net-pci,netdev=n0,mq=on,vectors=10
+@end example
+
 @item -netdev hubport,id=@var{id},hubid=@var{hubid}
 
 Create a hub port on QEMU "vlan" @var{hubid}.
@@ -2078,6 +2156,12 @@ The hubport netdev lets you connect a NIC to a QEMU "vlan" instead of a single
 netdev.  @code{-net} and @code{-device} with parameter @option{vlan} create the
 required hub automatically.
 
+The hub learns the MAC addresses behind its ports and sends unicast packets
+for a known address only to the port that it was seen on, like a switch.
+Broadcast, multicast and unknown unicast packets go to all ports, and
+@option{-net dump} clients see all packets.  @code{info network} shows the
+packet counters of each port.
+
 @item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off][,queues=n]
 
 Establish a vhost-user netdev, backed by a chardev @var{id}. The chardev should
@@ -2469,6 +2553,12 @@ stalled requests and force a reestablishment of the session. The timeout
 is specified in seconds. The default is 0 which means no timeout. Libiscsi
 1.15.0 or greater is required for this feature.
 
+The @option{sessions} parameter opens several sessions to the same LUN
+(default 1, at most 16).  Reads and writes are spread over the sessions, and
+large requests are split at the target's optimal transfer length so that
+they use all of them at once.  Other commands, such as SCSI passthrough,
+only use the first session, so do not combine this with SCSI reservations.
+
 Example (without authentication):
 @example
 qemu-system-i386 -iscsi initiator-name=iqn.2001-04.com.example:my-initiator \
@@ -2495,7 +2585,7 @@ DEF("iscsi", HAS_ARG, QEMU_OPTION_iscsi,
     "-iscsi [user=user][,password=password]\n"
     "       [,header-digest=CRC32C|CR32C-NONE|NONE-CRC32C|NONE\n"
     "       [,initiator-name=initiator-iqn][,id=target-iqn]\n"
-    "       [,timeout=timeout]\n"
+    "       [,timeout=timeout][,sessions=n]\n"
     "                iSCSI session parameters\n", QEMU_ARCH_ALL)
 STEXI
 
@@ -2605,7 +2695,9 @@ The full URL when passing options to the driver explicitly.
 The amount of data to read ahead with each range request to the remote server.
 This value may optionally have the suffix 'T', 'G', 'M', 'K', 'k' or 'b'. If it
 does not have a suffix, it will be assumed to be in bytes. The value must be a
-multiple of 512 bytes. It defaults to 256k.
+multiple of 512 bytes. It defaults to 256k.  When the guest reads sequentially,
+the amount read ahead doubles with each request, up to 4M or the configured
+value if larger.
 
 @item sslverify
 Whether to verify the remote server's certificate when connecting over SSL. It
@@ -3062,11 +3154,18 @@ Like -qmp but uses pretty JSON formatting.
 ETEXI
 
 DEF("mon", HAS_ARG, QEMU_OPTION_mon, \
-    "-mon [chardev=]name[,mode=readline|control][,default]\n", QEMU_ARCH_ALL)
+    "-mon [chardev=]name[,mode=readline|control][,default][,x-oob=on|off]\n",
+    QEMU_ARCH_ALL)
 STEXI
-@item -mon [chardev=]name[,mode=readline|control][,default]
+@item -mon [chardev=]name[,mode=readline|control][,default][,x-oob=on|off]
 @findex -mon
 Setup monitor on chardev @var{name}.
+@option{x-oob=on} (experimental, QMP only) reads the monitor input in a
+separate thread, so that a small set of commands such as
+@code{query-status} are answered even while the main loop is busy.
+Their responses can overtake those of commands sent earlier; clients
+should match responses using the @code{id} member.  Not supported on
+multiplexed chardevs.
 ETEXI
 
 DEF("debugcon", HAS_ARG, QEMU_OPTION_debugcon, \
@@ -3300,11 +3399,12 @@ ETEXI
 
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
     "-icount [shift=N|auto][,align=on|off][,sleep=on|off,rr=record|replay,rrfile=<filename>]\n" \
+    "        [,rrsnapshot=<name>][,rrperiod=<secs>][,rrseek=<insn>][,rrcompress=on|off]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
     "                instruction, enable aligning the host and virtual clocks\n" \
     "                or disable real time cpu sleeping\n", QEMU_ARCH_ALL)
 STEXI
-@item -icount [shift=@var{N}|auto][,rr=record|replay,rrfile=@var{filename}]
+@item -icount [shift=@var{N}|auto][,rr=record|replay,rrfile=@var{filename},rrsnapshot=@var{snapshot},rrperiod=@var{secs},rrseek=@var{insn},rrcompress=on|off]
 @findex -icount
 Enable virtual instruction counter.  The virtual cpu will execute one
 instruction every 2^@var{N} ns of virtual time.  If @code{auto} is specified
@@ -3336,7 +3436,17 @@ when the shift value is high (how high depends on the host machine).
 
 When @option{rr} option is specified deterministic record/replay is enabled.
 Replay log is written into @var{filename} file in record mode and
-read from this file in replay mode.
+read from this file in replay mode.  With @option{rrcompress=on} the log
+is gzip compressed while recording; compressed logs are detected
+automatically when replaying.
+
+Option @option{rrsnapshot} creates a VM snapshot named @var{snapshot} at
+the start of recording, and loads it at the start of replaying.  With
+@option{rrperiod}, more snapshots named @var{snapshot}-@var{insn} are
+taken every @var{secs} seconds of virtual time while recording, where
+@var{insn} is the number of instructions executed so far.  In replay
+mode, @option{rrseek} starts from the latest of those snapshots taken
+at or before instruction @var{insn}, instead of from the beginning.
 ETEXI
 
 DEF("watchdog", HAS_ARG, QEMU_OPTION_watchdog, \
@@ -3449,6 +3559,17 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("perfmap", 0, QEMU_OPTION_perfmap, \
+    "-perfmap        write the translated code symbols to /tmp/perf-PID.map\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -perfmap
+@findex -perfmap
+Write the addresses of the translated code to @file{/tmp/perf-@var{pid}.map},
+so that @command{perf report} can attribute the time spent in it to the guest
+code.  Only useful with TCG.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming tcp:[host]:port[,to=maxport][,ipv4][,ipv6]\n" \
     "-incoming rdma:host:port[,ipv4][,ipv6]\n" \
@@ -3457,8 +3578,9 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "                specified protocol and socket address\n" \
     "-incoming fd:fd\n" \
     "-incoming exec:cmdline\n" \
-    "                accept incoming migration on given file descriptor\n" \
-    "                or from given external command\n" \
+    "-incoming file:path\n" \
+    "                accept incoming migration on given file descriptor,\n" \
+    "                from given external command or from given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -3477,6 +3599,9 @@ Accept incoming migration from a given filedescriptor.
 @item -incoming exec:@var{cmdline}
 Accept incoming migration as an output from specified external command.
 
+@item -incoming file:@var{path}
+Accept incoming migration from a file saved with a file: migration.
+
 @item -incoming defer
 Wait for the URI to be specified via migrate_incoming.  The monitor can
 be used to change settings (such as migration parameters) prior to issuing
@@ -3728,7 +3853,7 @@ property must be set.  These objects are placed in the
 
 @table @option
 
-@item -object memory-backend-file,id=@var{id},size=@var{size},mem-path=@var{dir},share=@var{on|off}
+@item -object memory-backend-file,id=@var{id},size=@var{size},mem-path=@var{dir},share=@var{on|off},prealloc=@var{on|off},prealloc-threads=@var{n}
 
 Creates a memory file backend object, which can be used to back
 the guest RAM with huge pages. The @option{id} parameter is a
@@ -3740,6 +3865,13 @@ the path to either a shared memory or huge page filesystem mount.
 The @option{share} boolean option determines whether the memory
 region is marked as private to QEMU, or shared. The latter allows
 a co-operating external process to access the QEMU memory region.
+The @option{prealloc} option allocates all of the memory up front, from
+@option{prealloc-threads} threads, by default one per vCPU.
+The @option{merge}, @option{dump} and @option{hugepages} boolean options
+respectively let KSM merge the memory (by default as in @option{mem-merge}),
+include it in core dumps (by default as in @option{dump-guest-core}) and
+back it with transparent huge pages (default on).  They are also available
+for @option{memory-backend-ram}.
 
 @item -object rng-random,id=@var{id},filename=@var{/dev/random}
 
@@ -3914,6 +4046,17 @@ contents of @code{iv.b64} to the second secret
          data=$SECRET,iv=$(<iv.b64)
 @end example
 
+@item -object iothread,id=@var{id}[,poll-max-ns=@var{ns}][,poll-grow=@var{factor}][,poll-shrink=@var{divisor}]
+
+Creates a dedicated event loop thread that devices can be assigned to.
+Before waiting for events, the thread busy polls for up to @var{ns}
+nanoseconds (32768 by default, 0 disables polling).  Polling is done
+only while all event sources in the thread support it, for example
+virtqueues and native AIO completions.  The polling window adapts to how
+soon events arrive: it is multiplied by @var{factor} (2 by default) when
+a longer window would have caught an event, and divided by @var{divisor}
+when even the maximum window would not have (by default it is reset).
+
 @end table
 
 ETEXI
@@ -62,12 +62,19 @@ static QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
  * used by different AioContexts / threads. Each clock also has
  * a list of the QEMUTimerLists associated with it, in order that
  * reenabling the clock can call all the notifiers.
+ *
+ * The active timers are kept in a binary min-heap, so that arming and
+ * deleting a timer is O(log n) and the next deadline is at the top.
+ * Timers with the same expire time fire in the order they were armed.
  */
 
 struct QEMUTimerList {
     QEMUClock *clock;
     QemuMutex active_timers_lock;
-    QEMUTimer *active_timers;
+    QEMUTimer **active_timers;
+    int nr_active;
+    int active_size;
+    uint64_t seq;
     QLIST_ENTRY(QEMUTimerList) list;
     QEMUTimerListNotifyCB *notify_cb;
     void *notify_opaque;
@@ -94,6 +101,12 @@ static bool timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
     return timer_head && (timer_head->expire_time <= current_time);
 }
 
+/* The timer that expires first, or NULL */
+static QEMUTimer *timerlist_first(QEMUTimerList *timer_list)
+{
+    return timer_list->nr_active ? timer_list->active_timers[0] : NULL;
+}
+
 QEMUTimerList *timerlist_new(QEMUClockType type,
                              QEMUTimerListNotifyCB *cb,
                              void *opaque)
@@ -118,6 +131,7 @@ void timerlist_free(QEMUTimerList *timer_list)
         QLIST_REMOVE(timer_list, list);
     }
     qemu_mutex_destroy(&timer_list->active_timers_lock);
+    g_free(timer_list->active_timers);
     g_free(timer_list);
 }
 
@@ -174,7 +188,7 @@ void qemu_clock_enable(QEMUClockType type, bool enabled)
 
 bool timerlist_has_timers(QEMUTimerList *timer_list)
 {
-    return !!timer_list->active_timers;
+    return atomic_read(&timer_list->nr_active) > 0;
 }
 
 bool qemu_clock_has_timers(QEMUClockType type)
@@ -188,11 +202,11 @@ bool timerlist_expired(QEMUTimerList *timer_list)
     int64_t expire_time;
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->nr_active) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return false;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timerlist_first(timer_list)->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     return expire_time < qemu_clock_get_ns(timer_list->clock->type);
@@ -223,11 +237,11 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
      * the caller should notice the change and there is no race condition.
      */
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->nr_active) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return -1;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timerlist_first(timer_list)->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     delta = expire_time - qemu_clock_get_ns(timer_list->clock->type);
@@ -352,43 +366,131 @@ void timer_free(QEMUTimer *ts)
     g_free(ts);
 }
 
-static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+static bool timer_before(QEMUTimer *a, QEMUTimer *b)
 {
-    QEMUTimer **pt, *t;
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
+}
 
-    ts->expire_time = -1;
-    pt = &timer_list->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
+static void timerlist_heap_set(QEMUTimerList *timer_list, int i,
+                               QEMUTimer *ts)
+{
+    timer_list->active_timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timerlist_sift_up(QEMUTimerList *timer_list, int i)
+{
+    QEMUTimer *ts = timer_list->active_timers[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        QEMUTimer *p = timer_list->active_timers[parent];
+
+        if (!timer_before(ts, p)) {
             break;
         }
-        pt = &t->next;
+        timerlist_heap_set(timer_list, i, p);
+        i = parent;
     }
+    timerlist_heap_set(timer_list, i, ts);
 }
 
-static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
-                                QEMUTimer *ts, int64_t expire_time)
+static void timerlist_sift_down(QEMUTimerList *timer_list, int i)
 {
-    QEMUTimer **pt, *t;
+    QEMUTimer *ts = timer_list->active_timers[i];
+    int n = timer_list->nr_active;
 
-    /* add the timer in the sorted list */
-    pt = &timer_list->active_timers;
     for (;;) {
-        t = *pt;
-        if (!timer_expired_ns(t, expire_time)) {
+        int child = 2 * i + 1;
+        QEMUTimer *c;
+
+        if (child >= n) {
+            break;
+        }
+        c = timer_list->active_timers[child];
+        if (child + 1 < n &&
+            timer_before(timer_list->active_timers[child + 1], c)) {
+            c = timer_list->active_timers[++child];
+        }
+        if (!timer_before(c, ts)) {
             break;
         }
-        pt = &t->next;
+        timerlist_heap_set(timer_list, i, c);
+        i = child;
+    }
+    timerlist_heap_set(timer_list, i, ts);
+}
+
+static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    int i = ts->heap_index;
+    QEMUTimer *last;
+
+    if (ts->expire_time == -1) {
+        return;
+    }
+    ts->expire_time = -1;
+
+    atomic_set(&timer_list->nr_active, timer_list->nr_active - 1);
+    last = timer_list->active_timers[timer_list->nr_active];
+    if (last != ts) {
+        timerlist_heap_set(timer_list, i, last);
+        timerlist_sift_up(timer_list, i);
+        timerlist_sift_down(timer_list, last->heap_index);
     }
+}
+
+/* Arms a timer, or moves it if it is already pending.  Returns true if
+ * it is now the first timer to expire.
+ */
+static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
+                                QEMUTimer *ts, int64_t expire_time)
+{
+    bool pending = ts->expire_time != -1;
+
     ts->expire_time = MAX(expire_time, 0);
-    ts->next = *pt;
-    *pt = ts;
+    ts->seq = timer_list->seq++;
+
+    if (!pending) {
+        if (timer_list->nr_active == timer_list->active_size) {
+            timer_list->active_size = MAX(timer_list->active_size * 2, 16);
+            timer_list->active_timers = g_renew(QEMUTimer *,
+                                                timer_list->active_timers,
+                                                timer_list->active_size);
+        }
+        timerlist_heap_set(timer_list, timer_list->nr_active, ts);
+        atomic_set(&timer_list->nr_active, timer_list->nr_active + 1);
+    }
+
+    /* A moved timer got a new sequence number, so it never ties */
+    timerlist_sift_up(timer_list, ts->heap_index);
+    timerlist_sift_down(timer_list, ts->heap_index);
+
+    return ts->heap_index == 0;
+}
 
-    return pt == &timer_list->active_timers;
+/* Returns true if a timer other than @ts expires at the same time, looking
+ * at the subtree of the heap rooted at @i.  Only the timers that expire no
+ * later than @ts are visited.
+ */
+static bool timerlist_has_tie(QEMUTimerList *timer_list, int i,
+                              QEMUTimer *ts)
+{
+    QEMUTimer *t;
+
+    if (i >= timer_list->nr_active) {
+        return false;
+    }
+    t = timer_list->active_timers[i];
+    if (t->expire_time > ts->expire_time) {
+        return false;
+    }
+    if (t != ts && t->expire_time == ts->expire_time) {
+        return true;
+    }
+    return timerlist_has_tie(timer_list, 2 * i + 1, ts) ||
+           timerlist_has_tie(timer_list, 2 * i + 2, ts);
 }
 
 static void timerlist_rearm(QEMUTimerList *timer_list)
@@ -420,8 +522,17 @@ void timer_mod_ns(QEMUTimer *ts, int64_t expire_time)
     bool rearm;
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    timer_del_locked(timer_list, ts);
-    rearm = timer_mod_ns_locked(timer_list, ts, expire_time);
+    if (ts->expire_time == MAX(expire_time, 0) &&
+        !timerlist_has_tie(timer_list, 0, ts)) {
+        /* Devices such as the APIC and HPET often re-arm a pending timer
+           with the deadline it already has.  Nothing moves in the heap
+           then, and there is no need to kick the thread waiting on it.
+           If another timer has the same deadline, re-arming still has
+           to move this one behind it.  */
+        rearm = false;
+    } else {
+        rearm = timer_mod_ns_locked(timer_list, ts, expire_time);
+    }
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     if (rearm) {
@@ -439,9 +550,6 @@ void timer_mod_anticipate_ns(QEMUTimer *ts, int64_t expire_time)
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
     if (ts->expire_time == -1 || ts->expire_time > expire_time) {
-        if (ts->expire_time != -1) {
-            timer_del_locked(timer_list, ts);
-        }
         rearm = timer_mod_ns_locked(timer_list, ts, expire_time);
     } else {
         rearm = false;
@@ -482,7 +590,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     void *opaque;
 
     qemu_event_reset(&timer_list->timers_done_ev);
-    if (!timer_list->clock->enabled || !timer_list->active_timers) {
+    if (!timer_list->clock->enabled || !timer_list->nr_active) {
         goto out;
     }
 
@@ -510,16 +618,14 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     current_time = qemu_clock_get_ns(timer_list->clock->type);
     for(;;) {
         qemu_mutex_lock(&timer_list->active_timers_lock);
-        ts = timer_list->active_timers;
+        ts = timerlist_first(timer_list);
         if (!timer_expired_ns(ts, current_time)) {
             qemu_mutex_unlock(&timer_list->active_timers_lock);
             break;
         }
 
         /* remove timer from the list before calling the callback */
-        timer_list->active_timers = ts->next;
-        ts->next = NULL;
-        ts->expire_time = -1;
+        timer_del_locked(timer_list, ts);
         cb = ts->cb;
         opaque = ts->opaque;
         qemu_mutex_unlock(&timer_list->active_timers_lock);
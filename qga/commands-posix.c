@@ -216,13 +216,32 @@ typedef enum {
     RW_STATE_WRITING,
 } RwState;
 
+/* Bytes read at a time by guest-file-transfer */
+#define GUEST_FILE_TRANSFER_CHUNK (256 * 1024)
+
+typedef struct GuestFileTransfer {
+    int port_fd;
+    guint watch;
+    bool to_host;
+    bool active;
+    int64_t remaining;      /* -1 to copy until EOF */
+    int64_t count;          /* bytes written to the destination */
+    GChecksum *checksum;    /* of the bytes written */
+    char *error;
+    uint8_t *buf;
+    size_t pos, len;        /* data of buf still to be written */
+} GuestFileTransfer;
+
 typedef struct GuestFileHandle {
     uint64_t id;
     FILE *fh;
     RwState state;
+    GuestFileTransfer *transfer;
     QTAILQ_ENTRY(GuestFileHandle) next;
 } GuestFileHandle;
 
+static void guest_file_transfer_free(GuestFileTransfer *xfer);
+
 static struct {
     QTAILQ_HEAD(, GuestFileHandle) filehandles;
 } guest_file_state = {
@@ -429,6 +448,11 @@ void qmp_guest_file_close(int64_t handle, Error **errp)
         return;
     }
 
+    if (gfh->transfer) {
+        guest_file_transfer_free(gfh->transfer);
+        gfh->transfer = NULL;
+    }
+
     ret = fclose(gfh->fh);
     if (ret == EOF) {
         error_setg_errno(errp, errno, "failed to close handle");
@@ -609,6 +633,203 @@ void qmp_guest_file_flush(int64_t handle, Error **errp)
     }
 }
 
+static void guest_file_transfer_stop(GuestFileTransfer *xfer,
+                                     const char *error, int err)
+{
+    if (error) {
+        xfer->error = err ? g_strdup_printf("%s: %s", error, strerror(err))
+                          : g_strdup(error);
+        slog("guest-file-transfer failed: %s", xfer->error);
+    } else {
+        slog("guest-file-transfer done, %" PRId64 " bytes", xfer->count);
+    }
+
+    if (xfer->watch) {
+        g_source_remove(xfer->watch);
+        xfer->watch = 0;
+    }
+    close(xfer->port_fd);
+    xfer->port_fd = -1;
+    g_free(xfer->buf);
+    xfer->buf = NULL;
+    xfer->active = false;
+}
+
+static void guest_file_transfer_free(GuestFileTransfer *xfer)
+{
+    if (xfer->active) {
+        guest_file_transfer_stop(xfer, "cancelled", 0);
+    }
+    g_checksum_free(xfer->checksum);
+    g_free(xfer->error);
+    g_free(xfer);
+}
+
+/*
+ * Called from the main loop when the port can be read (from-host) or
+ * written (to-host).  The file is always ready, so each call reads a
+ * chunk if the previous one has been written, and writes what it can.
+ */
+static gboolean guest_file_transfer_cb(GIOChannel *chan, GIOCondition cond,
+                                       gpointer opaque)
+{
+    GuestFileHandle *gfh = opaque;
+    GuestFileTransfer *xfer = gfh->transfer;
+    int in_fd = xfer->to_host ? fileno(gfh->fh) : xfer->port_fd;
+    int out_fd = xfer->to_host ? xfer->port_fd : fileno(gfh->fh);
+    size_t size;
+    ssize_t ret;
+
+    if (xfer->to_host && (cond & (G_IO_HUP | G_IO_ERR))) {
+        guest_file_transfer_stop(xfer, "port disconnected", 0);
+        return FALSE;
+    }
+
+    if (xfer->pos == xfer->len) {
+        size = GUEST_FILE_TRANSFER_CHUNK;
+        if (xfer->remaining >= 0) {
+            size = MIN(size, xfer->remaining);
+        }
+        if (size == 0) {
+            guest_file_transfer_stop(xfer, NULL, 0);
+            return FALSE;
+        }
+
+        ret = read(in_fd, xfer->buf, size);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return TRUE;
+            }
+            guest_file_transfer_stop(xfer, "failed to read", errno);
+            return FALSE;
+        }
+        if (ret == 0) {
+            if (xfer->remaining > 0) {
+                guest_file_transfer_stop(xfer, "unexpected end of file", 0);
+            } else {
+                guest_file_transfer_stop(xfer, NULL, 0);
+            }
+            return FALSE;
+        }
+        xfer->pos = 0;
+        xfer->len = ret;
+    }
+
+    ret = write(out_fd, xfer->buf + xfer->pos, xfer->len - xfer->pos);
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return TRUE;
+        }
+        guest_file_transfer_stop(xfer, "failed to write", errno);
+        return FALSE;
+    }
+    g_checksum_update(xfer->checksum, xfer->buf + xfer->pos, ret);
+    xfer->pos += ret;
+    xfer->count += ret;
+    if (xfer->remaining >= 0) {
+        xfer->remaining -= ret;
+    }
+
+    if (xfer->remaining == 0 && xfer->pos == xfer->len) {
+        guest_file_transfer_stop(xfer, NULL, 0);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void qmp_guest_file_transfer(int64_t handle, const char *port,
+                             GuestFileTransferDirection direction,
+                             bool has_count, int64_t count, Error **errp)
+{
+    GuestFileHandle *gfh = guest_file_handle_find(handle, errp);
+    GuestFileTransfer *xfer;
+    bool to_host = direction == GUEST_FILE_TRANSFER_DIRECTION_TO_HOST;
+    GIOChannel *chan;
+    int port_fd;
+
+    slog("guest-file-transfer called, handle: %" PRId64 ", port: %s",
+         handle, port);
+    if (!gfh) {
+        return;
+    }
+    if (gfh->transfer && gfh->transfer->active) {
+        error_setg(errp, "a transfer is already running on handle '%"
+                   PRId64 "'", handle);
+        return;
+    }
+    if (has_count ? count < 0 : !to_host) {
+        error_setg(errp, "a valid count is required for from-host");
+        return;
+    }
+
+    /* the copy uses the file descriptor, so empty the stdio buffer and
+     * move the file position to where the stream is */
+    if (gfh->state != RW_STATE_NEW &&
+        fseek(gfh->fh, 0, SEEK_CUR) == -1 && errno != ESPIPE) {
+        error_setg_errno(errp, errno, "failed to seek file");
+        return;
+    }
+    gfh->state = RW_STATE_NEW;
+
+    port_fd = qemu_open(port, (to_host ? O_WRONLY : O_RDONLY) | O_NOCTTY);
+    if (port_fd < 0) {
+        error_setg_errno(errp, errno, "failed to open port '%s'", port);
+        return;
+    }
+    qemu_set_nonblock(port_fd);
+
+    if (gfh->transfer) {
+        guest_file_transfer_free(gfh->transfer);
+    }
+    xfer = g_new0(GuestFileTransfer, 1);
+    xfer->port_fd = port_fd;
+    xfer->to_host = to_host;
+    xfer->active = true;
+    xfer->remaining = has_count ? count : -1;
+    xfer->checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    xfer->buf = g_malloc(GUEST_FILE_TRANSFER_CHUNK);
+    gfh->transfer = xfer;
+
+    chan = g_io_channel_unix_new(port_fd);
+    xfer->watch = g_io_add_watch(chan, (to_host ? G_IO_OUT : G_IO_IN) |
+                                 G_IO_HUP | G_IO_ERR,
+                                 guest_file_transfer_cb, gfh);
+    g_io_channel_unref(chan);
+}
+
+GuestFileTransferStatus *qmp_guest_file_transfer_status(int64_t handle,
+                                                        Error **errp)
+{
+    GuestFileHandle *gfh = guest_file_handle_find(handle, errp);
+    GuestFileTransfer *xfer;
+    GuestFileTransferStatus *status;
+    GChecksum *checksum;
+
+    if (!gfh) {
+        return NULL;
+    }
+    xfer = gfh->transfer;
+    if (!xfer) {
+        error_setg(errp, "no transfer on handle '%" PRId64 "'", handle);
+        return NULL;
+    }
+
+    /* the checksum cannot be updated once it has been read */
+    checksum = g_checksum_copy(xfer->checksum);
+
+    status = g_new0(GuestFileTransferStatus, 1);
+    status->active = xfer->active;
+    status->count = xfer->count;
+    status->sha256 = g_strdup(g_checksum_get_string(checksum));
+    if (xfer->error) {
+        status->has_error = true;
+        status->error = g_strdup(xfer->error);
+    }
+    g_checksum_free(checksum);
+
+    return status;
+}
+
 /* linux-specific implementations. avoid this if at all possible. */
 #if defined(__linux__)
 
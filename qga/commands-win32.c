@@ -1415,6 +1415,20 @@ GuestMemoryBlockInfo *qmp_guest_get_memory_block_info(Error **errp)
     return NULL;
 }
 
+void qmp_guest_file_transfer(int64_t handle, const char *port,
+                             GuestFileTransferDirection direction,
+                             bool has_count, int64_t count, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+GuestFileTransferStatus *qmp_guest_file_transfer_status(int64_t handle,
+                                                        Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
 /* add unsupported commands to the blacklist */
 GList *ga_command_blacklist_init(GList *blacklist)
 {
@@ -1424,7 +1438,8 @@ GList *ga_command_blacklist_init(GList *blacklist)
         "guest-get-memory-blocks", "guest-set-memory-blocks",
         "guest-get-memory-block-size",
         "guest-fsfreeze-freeze-list",
-        "guest-fstrim", NULL};
+        "guest-fstrim", "guest-file-transfer",
+        "guest-file-transfer-status", NULL};
     char **p = (char **)list_unsupported;
 
     while (*p) {
@@ -1054,7 +1054,7 @@ EQMP
 
     {
         .name       = "block_resize",
-        .args_type  = "device:s?,node-name:s?,size:o",
+        .args_type  = "device:s?,node-name:s?,size:o,preallocation:s?",
         .mhandler.cmd_new = qmp_marshal_block_resize,
     },
 
@@ -1069,6 +1069,8 @@ Arguments:
 - "device": the device's ID, must be unique (json-string)
 - "node-name": the node name in the block driver state graph (json-string)
 - "size": new size
+- "preallocation": how to preallocate the added area, one of "off",
+                   "metadata", "falloc" or "full" (json-string, optional)
 
 Example:
 
@@ -1284,6 +1286,18 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_block_job_set_speed,
     },
 
+    {
+        .name       = "block-job-set-global-speed",
+        .args_type  = "speed:o",
+        .mhandler.cmd_new = qmp_marshal_block_job_set_global_speed,
+    },
+
+    {
+        .name       = "block-set-metadata-cache-budget",
+        .args_type  = "size:o",
+        .mhandler.cmd_new = qmp_marshal_block_set_metadata_cache_budget,
+    },
+
     {
         .name       = "block-job-cancel",
         .args_type  = "device:B,force:b?",
@@ -1400,7 +1414,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_block_dirty_bitmap_add,
     },
 
@@ -1417,6 +1431,8 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": store the bitmap in the image file, so that it survives a
+                restart of QEMU (json-bool, optional, default false)
 
 Example:
 
@@ -1633,7 +1649,7 @@ EQMP
                       "node-name:s?,replaces:s?,"
                       "on-source-error:s?,on-target-error:s?,"
                       "unmap:b?,"
-                      "granularity:i?,buf-size:i?",
+                      "granularity:i?,buf-size:i?,copy-mode:s?",
         .mhandler.cmd_new = qmp_marshal_drive_mirror,
     },
 
@@ -1674,6 +1690,10 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "unmap": whether the target sectors should be discarded where source has only
   zeroes. (json-bool, optional, default true)
+- "copy-mode": when to copy data to the destination; "background" copies
+  it in the background only, "write-blocking" additionally writes data
+  that the guest writes to the source to the destination before the guest
+  write completes (MirrorCopyMode, optional, default "background")
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -1695,7 +1715,7 @@ EQMP
         .name       = "blockdev-mirror",
         .args_type  = "sync:s,device:B,target:B,replaces:s?,speed:i?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "granularity:i?,buf-size:i?",
+                      "granularity:i?,buf-size:i?,copy-mode:s?",
         .mhandler.cmd_new = qmp_marshal_blockdev_mirror,
     },
 
@@ -1725,6 +1745,8 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "on-target-error": the action to take on an error on the target
   (BlockdevOnError, default 'report')
+- "copy-mode": when to copy data to the destination (MirrorCopyMode,
+  optional, default "background")
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -2033,7 +2055,7 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?,iops_size:l?,group:s?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?,iops_size:l?,group:s?,weight:l?,latency_target:l?,burst_credit:l?",
         .mhandler.cmd_new = qmp_marshal_block_set_io_throttle,
     },
 
@@ -2066,6 +2088,12 @@ Arguments:
 - "iops_wr_max_length": maximum length of the @iops_wr_max burst period, in seconds (json-int, optional)
 - "iops_size":  I/O size in bytes when limiting (json-int, optional)
 - "group": throttle group name (json-string, optional)
+- "weight": share of the group limits relative to the other members,
+            between 1 and 10000 (json-int, optional)
+- "latency_target": time in milliseconds after which throttled requests
+                    are served before those of other members (json-int, optional)
+- "burst_credit": bytes that can be submitted ahead of the device's share
+                  after it has been idle (json-int, optional)
 
 Example:
 
@@ -2086,6 +2114,43 @@ Example:
                                                "iops_size": 0 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,boundaries-write:q?,boundaries-flush:q?,clear:b?",
+        .mhandler.cmd_new = qmp_marshal_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Set up the latency histograms of a block device, or remove them.  The
+histograms are counted from zero again after each call.  They are
+reported by query-blockstats.
+
+Arguments:
+
+- "device": device name (json-string)
+- "boundaries": bin boundaries in nanoseconds, in increasing order; the
+                default is 10us to 10s in steps of 1, 2 and 5
+                (json-array of json-int, optional)
+- "boundaries-read": bin boundaries for reads (json-array of json-int,
+                     optional)
+- "boundaries-write": bin boundaries for writes (json-array of json-int,
+                      optional)
+- "boundaries-flush": bin boundaries for flushes (json-array of json-int,
+                      optional)
+- "clear": remove the histograms (json-bool, optional)
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "virtio0",
+                    "boundaries": [ 100000, 1000000, 10000000 ] } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -2273,6 +2338,7 @@ EQMP
         .name       = "query-version",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_query_version,
+        .oob        = true,
     },
 
 SQMP
@@ -2310,6 +2376,7 @@ EQMP
         .name       = "query-commands",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_query_commands,
+        .oob        = true,
     },
 
 SQMP
@@ -2721,6 +2788,22 @@ Each json-object contain the following:
         - "avg_wr_queue_depth": average number of pending write
                                 operations in the defined interval
                                 (json-number).
+    - "rd_latency_histogram": latency histogram of reads, set up with
+                              block-latency-histogram-set
+                              (json-object, optional), containing:
+        - "boundaries": bin boundaries in nanoseconds (json-array)
+        - "bins": number of operations in each bin (json-array)
+    - "wr_latency_histogram": same for writes (json-object, optional)
+    - "flush_latency_histogram": same for flushes (json-object, optional)
+    - "l2-cache": L2 table cache of a qcow2 node (json-object, optional),
+                  containing:
+        - "hits": lookups that found the table in the cache (json-int)
+        - "misses": lookups that had to load the table (json-int)
+        - "size": bytes the cache may currently hold (json-int)
+        - "max-size": configured size of the cache in bytes (json-int)
+        - "used": bytes of tables held by the cache (json-int)
+    - "refcount-cache": same for the refcount block cache (json-object,
+                        optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2853,6 +2936,8 @@ Return a json-array. Each CPU is represented by a json-object, which contains:
      "pc" and "npc": sparc (json-int)
      "PC": mips (json-int)
 - "thread_id": ID of the underlying host thread (json-int)
+- "host-cpus": host CPUs the thread can run on, if the CPU's NUMA node
+               has host-cpus (json-array of json-int, optional)
 
 Example:
 
@@ -2888,6 +2973,213 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_cpus,
     },
 
+SQMP
+query-vcpu-dirty-rate
+---------------------
+
+Show how fast each CPU dirties guest memory.  This is only available with
+the KVM dirty ring (-machine kvm_dirty_ring_size=n).
+
+Return a json-array. Each CPU is represented by a json-object, which contains:
+
+- "cpu-index": CPU index (json-int)
+- "dirty-rate": bytes dirtied per second over the last second (json-int)
+- "throttle-percentage": percentage of time the CPU is throttled by itself
+                         during auto-converge, or 0 (json-int)
+
+Example:
+
+-> { "execute": "query-vcpu-dirty-rate" }
+<- {
+      "return":[
+         {
+            "cpu-index":0,
+            "dirty-rate":524288000,
+            "throttle-percentage":20
+         },
+         {
+            "cpu-index":1,
+            "dirty-rate":8192,
+            "throttle-percentage":0
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-vcpu-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_vcpu_stats,
+    },
+
+SQMP
+query-vcpu-stats
+----------------
+
+Show where each CPU spends its time.  This is only available with KVM.
+
+Return a json-array. Each CPU is represented by a json-object, which contains:
+
+- "cpu-index": CPU index (json-int)
+- "thread-id": ID of the CPU's host thread (json-int)
+- "run-ns": time spent in KVM_RUN (json-int)
+- "user-ns": time spent handling exits in QEMU (json-int)
+- "exits": json-array of json-objects with the "reason" (json-string) and
+           "count" (json-int) of the exits from KVM_RUN
+- "halt-poll": halt polling statistics of KVM, if the kernel provides
+               them (json-object, optional):
+    - "attempted-poll": halts for which KVM polled (json-int)
+    - "successful-poll": halts that polling ended (json-int)
+    - "poll-invalid": halts for which polling was skipped (json-int)
+    - "wakeup": wakeups from a halt (json-int)
+    - "poll-success-ns": time spent in successful polls (json-int)
+    - "poll-fail-ns": time spent in failed polls (json-int)
+    - "wait-ns": time spent sleeping after polling (json-int)
+
+Example:
+
+-> { "execute": "query-vcpu-stats" }
+<- {
+      "return":[
+         {
+            "cpu-index":0,
+            "thread-id":3134,
+            "run-ns":9836204117,
+            "user-ns":183503272,
+            "exits":[
+               { "reason":"io", "count":48233 },
+               { "reason":"mmio", "count":130411 },
+               { "reason":"intr", "count":2087 }
+            ],
+            "halt-poll":{
+               "attempted-poll":51620,
+               "successful-poll":40911,
+               "poll-invalid":0,
+               "wakeup":61783,
+               "poll-success-ns":310682911,
+               "poll-fail-ns":250321006,
+               "wait-ns":8120392330
+            }
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "set-kvm-halt-poll",
+        .args_type  = "max-ns:i",
+        .mhandler.cmd_new = qmp_marshal_set_kvm_halt_poll,
+    },
+
+SQMP
+set-kvm-halt-poll
+-----------------
+
+Set the longest time that KVM polls a halted CPU of this VM before it
+yields the host CPU.
+
+Arguments:
+
+- "max-ns": the limit in nanoseconds, 0 disables polling (json-int)
+
+Example:
+
+-> { "execute": "set-kvm-halt-poll", "arguments": { "max-ns": 50000 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-stats",
+        .args_type  = "prefixes:q?",
+        .mhandler.cmd_new = qmp_marshal_query_stats,
+    },
+
+SQMP
+query-stats
+-----------
+
+Read statistics counters, without interrupting the CPUs.
+
+Arguments:
+
+- "prefixes": only return the counters with these names, or below them in
+              the dotted hierarchy (json-array of json-string, optional)
+
+Return a json-array of json-objects with the "name" (json-string) and the
+"value" (json-int) of each counter.
+
+Example:
+
+-> { "execute": "query-stats", "arguments": { "prefixes": [ "block.drive0" ] } }
+<- { "return": [ { "name": "block.drive0.rd_bytes", "value": 4718592 },
+                 { "name": "block.drive0.wr_bytes", "value": 81920 },
+                 { "name": "block.drive0.rd_ops", "value": 1152 },
+                 { "name": "block.drive0.wr_ops", "value": 20 },
+                 { "name": "block.drive0.flush_ops", "value": 3 } ] }
+
+EQMP
+
+    {
+        .name       = "stats-subscribe",
+        .args_type  = "prefixes:q?,interval:i",
+        .mhandler.cmd_new = qmp_marshal_stats_subscribe,
+    },
+
+SQMP
+stats-subscribe
+---------------
+
+Send a STATS event every "interval" milliseconds with the counters that
+changed since the previous event.  The first event has all the counters.
+
+Arguments:
+
+- "prefixes": counters to report, as in query-stats (json-array of
+              json-string, optional)
+- "interval": time between events in milliseconds, at least 100 (json-int)
+
+Return the ID of the subscription (json-int).
+
+Example:
+
+-> { "execute": "stats-subscribe",
+     "arguments": { "prefixes": [ "block", "vcpu" ], "interval": 1000 } }
+<- { "return": 0 }
+
+EQMP
+
+    {
+        .name       = "stats-unsubscribe",
+        .args_type  = "id:i",
+        .mhandler.cmd_new = qmp_marshal_stats_unsubscribe,
+    },
+
+SQMP
+stats-unsubscribe
+-----------------
+
+Cancel a subscription created with stats-subscribe.
+
+Arguments:
+
+- "id": the ID of the subscription (json-int)
+
+Example:
+
+-> { "execute": "stats-unsubscribe", "arguments": { "id": 0 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-vcpu-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_vcpu_dirty_rate,
+    },
+
 SQMP
 query-iothreads
 ---------------
@@ -2902,6 +3194,8 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "host-cpus": host CPUs the thread can run on, if the iothread has a
+               numa-node (json-array of json-int, optional)
 
 Example:
 
@@ -2927,6 +3221,72 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_iothreads,
     },
 
+SQMP
+query-event-loop-stats
+----------------------
+
+Return the dispatch time statistics of the main loop and of each iothread,
+collected while enabled with set-event-loop-stats.
+
+Return a json-array. Each event loop is represented by a json-object, which
+contains:
+
+- "event-loop": "main", "iohandler" or the id of an iothread (json-str)
+- "handlers": a json-array of json-objects, each with:
+     - "name": name of the handler's callback (json-str)
+     - "count": number of invocations (json-int)
+     - "total-ns": total time spent in the handler (json-int)
+     - "max-ns": longest invocation (json-int)
+     - "histogram": invocations that took less than 10us, 100us, 1ms,
+                    10ms, 100ms and longer (json-array of json-int)
+
+Example:
+
+-> { "execute": "query-event-loop-stats" }
+<- { "return": [
+       { "event-loop": "main",
+         "handlers": [
+           { "name": "virtio_queue_host_notifier_read", "count": 1042,
+             "total-ns": 5130021, "max-ns": 81342,
+             "histogram": [ 1003, 38, 1, 0, 0, 0 ] } ] },
+       { "event-loop": "iothread0",
+         "handlers": [] } ] }
+
+EQMP
+
+    {
+        .name       = "query-event-loop-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_event_loop_stats,
+    },
+
+SQMP
+set-event-loop-stats
+--------------------
+
+Enable or disable collection of event loop dispatch time statistics.
+
+Arguments:
+
+- "enable": whether to collect the statistics (json-bool)
+- "slow-threshold-us": report handlers that run for at least this many
+                       microseconds, 0 to disable (json-int, optional)
+- "reset": clear the statistics collected so far (json-bool, optional)
+
+Example:
+
+-> { "execute": "set-event-loop-stats",
+     "arguments": { "enable": true, "slow-threshold-us": 10000 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "set-event-loop-stats",
+        .args_type  = "enable:b,slow-threshold-us:i?,reset:b?",
+        .mhandler.cmd_new = qmp_marshal_set_event_loop_stats,
+    },
+
 SQMP
 query-pci
 ---------
@@ -3200,12 +3560,47 @@ Example:
 -> { "execute": "query-status" }
 <- { "return": { "running": true, "singlestep": false, "status": "running" } }
 
+EQMP
+
+    {
+        .name       = "query-startup-timing",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_startup_timing,
+    },
+
+SQMP
+query-startup-timing
+--------------------
+
+Show when QEMU reached each phase of its startup.
+
+Return a json-array of json-objects, one for each phase reached so far:
+
+- "phase": one of "accel", "machine-init", "devices", "machine-done",
+           "reset", "vm-start" and "first-vcpu-run" (json-string)
+- "time-ns": nanoseconds since QEMU started (json-int)
+
+Example:
+
+-> { "execute": "query-startup-timing" }
+<- { "return": [
+        { "phase": "accel", "time-ns": 6120391 },
+        { "phase": "machine-init", "time-ns": 18450222 },
+        { "phase": "devices", "time-ns": 21002761 },
+        { "phase": "machine-done", "time-ns": 24386104 },
+        { "phase": "reset", "time-ns": 25113877 },
+        { "phase": "vm-start", "time-ns": 25230519 },
+        { "phase": "first-vcpu-run", "time-ns": 25319046 }
+     ]
+   }
+
 EQMP
     
     {
         .name       = "query-status",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_query_status,
+        .oob        = true,
     },
 
 SQMP
@@ -3419,6 +3814,7 @@ EQMP
         .name       = "query-name",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_query_name,
+        .oob        = true,
     },
 
 SQMP
@@ -3442,6 +3838,7 @@ EQMP
         .name       = "query-uuid",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_query_uuid,
+        .oob        = true,
     },
 
 SQMP
@@ -3671,6 +4068,66 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_migrate,
     },
 
+SQMP
+query-migrate-telemetry
+-----------------------
+
+Detailed statistics of the current or last outgoing migration.
+
+Return a json-object with the following information:
+
+- "iterations": json-array with the last 64 iterations that ended, oldest
+                first; an iteration starts with a sync of the dirty bitmap
+     - "iteration": number of the iteration (json-int)
+     - "sync-time": time of the dirty bitmap sync in us (json-int)
+     - "duration": length of the iteration in ms (json-int)
+     - "dirty-pages": pages found dirty by the sync (json-int)
+     - "remaining-pages": pages to send after the sync (json-int)
+     - "pages": pages sent during the iteration (json-int)
+     - "bytes": bytes of RAM sent during the iteration (json-int)
+     - "mbps": throughput of the iteration in megabits/sec (json-double)
+- "blocks": json-array with the statistics of each RAMBlock
+     - "id-str": name of the RAMBlock (json-string)
+     - "size": size of the RAMBlock in bytes (json-int)
+     - "dirty-pages": pages to send, including the ones dirtied again
+                      (json-int)
+     - "sent-pages": pages sent (json-int)
+- "devices": json-array with the time spent saving each device state
+     - "id-str": name of the section (json-string)
+     - "instance-id": instance of the section (json-int)
+     - "save-time": time spent in its save handlers in us (json-int)
+
+Example:
+
+-> { "execute": "query-migrate-telemetry" }
+<- { "return": {
+        "iterations": [
+           { "iteration": 1, "sync-time": 2130, "duration": 4012,
+             "dirty-pages": 0, "remaining-pages": 1048576,
+             "pages": 1048576, "bytes": 3765123072, "mbps": 7507.7 },
+           { "iteration": 2, "sync-time": 1874, "duration": 612,
+             "dirty-pages": 143360, "remaining-pages": 143360,
+             "pages": 143360, "bytes": 587202560, "mbps": 7675.8 }
+        ],
+        "blocks": [
+           { "id-str": "pc.ram", "size": 4294967296,
+             "dirty-pages": 1191936, "sent-pages": 1191936 }
+        ],
+        "devices": [
+           { "id-str": "ram", "instance-id": 0, "save-time": 4598231 },
+           { "id-str": "cpu", "instance-id": 0, "save-time": 46 }
+        ]
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-migrate-telemetry",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_migrate_telemetry,
+    },
+
 SQMP
 migrate-set-capabilities
 ------------------------
@@ -3684,6 +4141,21 @@ Enable/Disable migration capabilities
 - "compress": use multiple compression threads to accelerate live migration
 - "events": generate events for each migration state change
 - "postcopy-ram": postcopy mode for live migration
+- "x-multifd": send RAM pages over several connections
+- "x-zero-copy-send": send the pages of the x-multifd connections with
+                      MSG_ZEROCOPY
+- "x-postcopy-preempt": send requested postcopy pages over an additional
+                        connection
+- "x-compress-zstd": compress pages with zstd instead of zlib
+- "x-mapped-ram": write pages at fixed offsets of the file of a file:
+                  migration
+- "x-direct-io": access the pages of x-mapped-ram with O_DIRECT
+- "x-lazy-restore": read the pages of x-mapped-ram on demand after the guest
+                    starts
+- "x-background-snapshot": save the guest as of the start of the migration,
+                           while it keeps running
+- "x-dirty-bitmaps": migrate the named dirty bitmaps of the block devices
+- "x-ignore-shared": do not send the RAM blocks that are mapped shared
 
 Arguments:
 
@@ -3714,6 +4186,16 @@ Query current migration capabilities
          - "compress": Multiple compression threads state (json-bool)
          - "events": Migration state change event state (json-bool)
          - "postcopy-ram": postcopy ram state (json-bool)
+         - "x-multifd": multiple connections state (json-bool)
+         - "x-zero-copy-send": zero copy send state (json-bool)
+         - "x-postcopy-preempt": postcopy preempt channel state (json-bool)
+         - "x-compress-zstd": zstd compression state (json-bool)
+         - "x-mapped-ram": mapped RAM state (json-bool)
+         - "x-direct-io": direct I/O state (json-bool)
+         - "x-lazy-restore": lazy restore state (json-bool)
+         - "x-background-snapshot": background snapshot state (json-bool)
+         - "x-dirty-bitmaps": dirty bitmap migration state (json-bool)
+         - "x-ignore-shared": shared RAM skipping state (json-bool)
 
 Arguments:
 
@@ -3727,7 +4209,17 @@ Example:
      {"state": false, "capability": "zero-blocks"},
      {"state": false, "capability": "compress"},
      {"state": true, "capability": "events"},
-     {"state": false, "capability": "postcopy-ram"}
+     {"state": false, "capability": "postcopy-ram"},
+     {"state": false, "capability": "x-multifd"},
+     {"state": false, "capability": "x-zero-copy-send"},
+     {"state": false, "capability": "x-postcopy-preempt"},
+     {"state": false, "capability": "x-compress-zstd"},
+     {"state": false, "capability": "x-mapped-ram"},
+     {"state": false, "capability": "x-direct-io"},
+     {"state": false, "capability": "x-lazy-restore"},
+     {"state": false, "capability": "x-background-snapshot"},
+     {"state": false, "capability": "x-dirty-bitmaps"},
+     {"state": false, "capability": "x-ignore-shared"}
    ]}
 
 EQMP
@@ -3751,6 +4243,8 @@ Set migration parameters
                            throttled for auto-converge (json-int)
 - "x-cpu-throttle-increment": set throttle increasing percentage for
                              auto-converge (json-int)
+- "x-multifd-channels": set the number of additional connections used to
+                        send RAM pages with x-multifd (json-int)
 
 Arguments:
 
@@ -3764,7 +4258,7 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?,x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?,x-multifd-channels:i?",
         .mhandler.cmd_new = qmp_marshal_migrate_set_parameters,
     },
 SQMP
@@ -3781,6 +4275,8 @@ Query current migration parameters
                                       throttled (json-int)
          - "x-cpu-throttle-increment" : throttle increasing percentage for
                                         auto-converge (json-int)
+         - "x-multifd-channels" : number of additional connections used to
+                                  send RAM pages (json-int)
 
 Arguments:
 
@@ -3793,7 +4289,8 @@ Example:
          "x-cpu-throttle-increment": 10,
          "compress-threads": 8,
          "compress-level": 1,
-         "x-cpu-throttle-initial": 20
+         "x-cpu-throttle-initial": 20,
+         "x-multifd-channels": 2
       }
    }
 
@@ -3805,6 +4302,87 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_migrate_parameters,
     },
 
+SQMP
+calc-dirty-rate
+---------------
+
+Start measuring how fast the guest dirties its memory, without starting a
+migration.  The result is returned by query-dirty-rate.
+
+Arguments:
+
+- "calc-time": length of the measurement in seconds, between 1 and 60
+               (json-int)
+- "sample-pages": number of pages sampled per GiB of guest memory, between
+                  128 and 4096 (json-int, optional, default 512)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 2 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i,sample-pages:i?",
+        .mhandler.cmd_new = qmp_marshal_calc_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Return the result of the last dirty page rate measurement.
+
+Arguments:
+
+- "bandwidth": migration bandwidth in bytes per second; if given, predict a
+               migration at this bandwidth with the current downtime limit
+               (json-int, optional)
+
+Return a json-object with the following information:
+
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "calc-time": length of the measurement in seconds (json-int)
+- "sample-pages": number of pages sampled per GiB (json-int)
+- "page-size": size of the pages counted by the dirty rates (json-int)
+- "dirty-rate": pages dirtied per second (json-int, optional)
+- "blocks": json-array with the dirty rate of each RAMBlock (optional)
+     - "id-str": name of the RAMBlock (json-string)
+     - "size": size of the RAMBlock in bytes (json-int)
+     - "dirty-rate": pages dirtied per second, or -1 (json-int)
+- "converges": whether the migration is expected to complete (json-bool,
+               optional)
+- "expected-total-time": expected migration time in ms (json-int, optional)
+- "expected-downtime": expected downtime in ms (json-int, optional)
+
+Example:
+
+-> { "execute": "query-dirty-rate",
+     "arguments": { "bandwidth": 1073741824 } }
+<- { "return": {
+        "status": "measured",
+        "calc-time": 2,
+        "sample-pages": 512,
+        "page-size": 4096,
+        "dirty-rate": 12800,
+        "blocks": [ { "id-str": "pc.ram", "size": 4294967296,
+                      "dirty-rate": 12800 } ],
+        "converges": true,
+        "expected-total-time": 4195,
+        "expected-downtime": 195
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "bandwidth:i?",
+        .mhandler.cmd_new = qmp_marshal_query_dirty_rate,
+    },
+
 SQMP
 query-balloon
 -------------
@@ -4524,6 +5102,11 @@ query-memdev
 
 Show memory devices information.
 
+"usage" is only present if the host can report how much of the backend's
+memory is resident ("resident"), shared with other mappings ("shared"),
+backed by transparent huge pages ("anon-hugepages") and merged by KSM
+("merged", only on recent Linux hosts).  All of them are in bytes.
+
 
 Example (1):
 
@@ -4533,14 +5116,21 @@ Example (1):
          "size": 536870912,
          "merge": false,
          "dump": true,
+         "hugepages": true,
          "prealloc": false,
          "host-nodes": [0, 1],
-         "policy": "bind"
+         "policy": "bind",
+         "usage": {
+           "resident": 134217728,
+           "shared": 0,
+           "anon-hugepages": 132120576
+         }
        },
        {
          "size": 536870912,
          "merge": false,
          "dump": true,
+         "hugepages": true,
          "prealloc": true,
          "host-nodes": [2, 3],
          "policy": "preferred"
@@ -4574,6 +5164,17 @@ Example:
                         "size": 1073741824,
                         "slot": 0},
                    "type": "dimm"
+                 },
+                 { "data":
+                      { "block-size": 2097152,
+                        "id": "vm0",
+                        "max-size": 8589934592,
+                        "memaddr": 6442450944,
+                        "memdev": "/objects/memY",
+                        "node": 0,
+                        "requested-size": 2147483648,
+                        "size": 2147483648 },
+                   "type": "virtio-mem"
                  } ] }
 EQMP
 
@@ -4599,6 +5200,38 @@ Example:
    ]}
 EQMP
 
+    {
+        .name       = "query-vfio",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_vfio,
+    },
+
+SQMP
+query-vfio
+----------
+
+Show the host IOMMU mappings of the VFIO containers.  Guest RAM that is
+adjacent is mapped, and pinned, at once.
+
+Return a json-array of json-objects, one per container, each with:
+
+- "groups": IOMMU groups in the container (json-array of json-int)
+- "mapped": bytes of guest RAM mapped directly (json-int)
+- "mappings": number of mappings of guest RAM (json-int)
+- "guest-iommu": whether a guest IOMMU decides what is mapped (json-bool)
+- "guest-iommu-mapped": bytes mapped for the guest IOMMU (json-int)
+
+Example:
+
+-> { "execute": "query-vfio" }
+<- { "return": [ { "groups": [ 15, 16 ],
+                   "mapped": 68719476736,
+                   "mappings": 3,
+                   "guest-iommu": false,
+                   "guest-iommu-mapped": 0 } ] }
+
+EQMP
+
 #if defined TARGET_I386
     {
         .name       = "rtc-reset-reinjection",
@@ -62,6 +62,11 @@ struct TypeImpl
     const char *parent;
     TypeImpl *parent_type;
 
+    /* Filled by type_initialize: ancestors[depth] is the type itself and
+       ancestors[0] the root of its hierarchy.  */
+    int depth;
+    TypeImpl **ancestors;
+
     ObjectClass *class;
 
     int num_interfaces;
@@ -70,6 +75,9 @@ struct TypeImpl
 
 static Type type_interface;
 
+/* Bumped whenever a class property is added, see object_class_property_find */
+static unsigned int class_properties_gen = 1;
+
 static GHashTable *type_table_get(void)
 {
     static GHashTable *type_table;
@@ -205,6 +213,12 @@ static bool type_is_ancestor(TypeImpl *type, TypeImpl *target_type)
 {
     assert(target_type);
 
+    /* Once both types are initialized, this is a single lookup */
+    if (type && type->ancestors && target_type->ancestors) {
+        return target_type->depth <= type->depth &&
+               type->ancestors[target_type->depth] == target_type;
+    }
+
     /* Check if target_type is a direct ancestor of type */
     while (type) {
         if (type == target_type) {
@@ -275,6 +289,8 @@ static void type_initialize(TypeImpl *ti)
         g_assert_cmpint(parent->class_size, <=, ti->class_size);
         memcpy(ti->class, parent->class, parent->class_size);
         ti->class->interfaces = NULL;
+        ti->class->properties_cache = NULL;
+        ti->class->properties_cache_gen = 0;
         ti->class->properties = g_hash_table_new_full(
             g_str_hash, g_str_equal, g_free, object_property_free);
 
@@ -306,6 +322,14 @@ static void type_initialize(TypeImpl *ti)
             g_str_hash, g_str_equal, g_free, object_property_free);
     }
 
+    ti->depth = parent ? parent->depth + 1 : 0;
+    ti->ancestors = g_new(TypeImpl *, ti->depth + 1);
+    if (parent) {
+        memcpy(ti->ancestors, parent->ancestors,
+               ti->depth * sizeof(TypeImpl *));
+    }
+    ti->ancestors[ti->depth] = ti;
+
     ti->class->type = ti;
 
     while (parent) {
@@ -971,6 +995,7 @@ object_class_property_add(ObjectClass *klass,
     prop->opaque = opaque;
 
     g_hash_table_insert(klass->properties, g_strdup(name), prop);
+    class_properties_gen++;
 
     return prop;
 }
@@ -1015,21 +1040,51 @@ ObjectProperty *object_property_iter_next(ObjectPropertyIterator *iter)
     return val;
 }
 
-ObjectProperty *object_class_property_find(ObjectClass *klass, const char *name,
-                                           Error **errp)
+static ObjectProperty *object_class_property_lookup(ObjectClass *klass,
+                                                    const char *name)
 {
     ObjectProperty *prop;
     ObjectClass *parent_klass;
 
     parent_klass = object_class_get_parent(klass);
     if (parent_klass) {
-        prop = object_class_property_find(parent_klass, name, NULL);
+        prop = object_class_property_lookup(parent_klass, name);
         if (prop) {
             return prop;
         }
     }
 
-    prop = g_hash_table_lookup(klass->properties, name);
+    return g_hash_table_lookup(klass->properties, name);
+}
+
+ObjectProperty *object_class_property_find(ObjectClass *klass, const char *name,
+                                           Error **errp)
+{
+    ObjectProperty *prop;
+    gpointer value;
+
+    /* The walk up the parent classes is cached per class, misses included.
+     * Adding a class property anywhere bumps class_properties_gen, which
+     * empties every cache on its next use.
+     */
+    if (klass->properties_cache_gen != class_properties_gen) {
+        if (klass->properties_cache) {
+            g_hash_table_remove_all(klass->properties_cache);
+        } else {
+            klass->properties_cache = g_hash_table_new_full(
+                g_str_hash, g_str_equal, g_free, NULL);
+        }
+        klass->properties_cache_gen = class_properties_gen;
+    }
+
+    if (g_hash_table_lookup_extended(klass->properties_cache, name,
+                                     NULL, &value)) {
+        prop = value;
+    } else {
+        prop = object_class_property_lookup(klass, name);
+        g_hash_table_insert(klass->properties_cache, g_strdup(name), prop);
+    }
+
     if (!prop) {
         error_setg(errp, "Property '.%s' not found", name);
     }
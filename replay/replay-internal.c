@@ -17,7 +17,7 @@
 #include "sysemu/sysemu.h"
 
 unsigned int replay_data_kind = -1;
-static unsigned int replay_has_unread_data;
+unsigned int replay_has_unread_data;
 
 /* Mutex to protect reading and writing events to the log.
    replay_data_kind and replay_has_unread_data are also protected
@@ -27,12 +27,12 @@ static unsigned int replay_has_unread_data;
 static QemuMutex lock;
 
 /* File for replay writing */
-FILE *replay_file;
+gzFile replay_file;
 
 void replay_put_byte(uint8_t byte)
 {
     if (replay_file) {
-        putc(byte, replay_file);
+        gzputc(replay_file, byte);
     }
 }
 
@@ -65,7 +65,7 @@ void replay_put_array(const uint8_t *buf, size_t size)
 {
     if (replay_file) {
         replay_put_dword(size);
-        fwrite(buf, 1, size, replay_file);
+        gzwrite(replay_file, buf, size);
     }
 }
 
@@ -73,7 +73,7 @@ uint8_t replay_get_byte(void)
 {
     uint8_t byte = 0;
     if (replay_file) {
-        byte = getc(replay_file);
+        byte = gzgetc(replay_file);
     }
     return byte;
 }
@@ -115,7 +115,7 @@ void replay_get_array(uint8_t *buf, size_t *size)
 {
     if (replay_file) {
         *size = replay_get_dword();
-        if (fread(buf, 1, *size, replay_file) != *size) {
+        if (gzread(replay_file, buf, *size) != *size) {
             error_report("replay read error");
         }
     }
@@ -126,7 +126,7 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
     if (replay_file) {
         *size = replay_get_dword();
         *buf = g_malloc(*size);
-        if (fread(*buf, 1, *size, replay_file) != *size) {
+        if (gzread(replay_file, *buf, *size) != *size) {
             error_report("replay read error");
         }
     }
@@ -135,11 +135,14 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
 void replay_check_error(void)
 {
     if (replay_file) {
-        if (feof(replay_file)) {
+        int errnum;
+
+        gzerror(replay_file, &errnum);
+        if (gzeof(replay_file)) {
             error_report("replay file is over");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_PAUSED);
-        } else if (ferror(replay_file)) {
+        } else if (errnum != Z_OK) {
             error_report("replay file is over or something goes wrong");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_INTERNAL_ERROR);
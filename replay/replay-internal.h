@@ -12,6 +12,7 @@
  *
  */
 
+#include <zlib.h>
 
 enum ReplayEvents {
     /* for instruction event */
@@ -61,13 +62,24 @@ typedef struct ReplayState {
     uint64_t current_step;
     /*! Number of instructions to be executed before other events happen. */
     int instructions_count;
+    /*! Copies of replay_data_kind and replay_has_unread_data for vmstate */
+    uint32_t data_kind;
+    uint32_t has_unread_data;
+    /*! Position in the log (uncompressed) at the time of the snapshot */
+    uint64_t file_offset;
 } ReplayState;
 extern ReplayState replay_state;
 
 extern unsigned int replay_data_kind;
+extern unsigned int replay_has_unread_data;
 
-/* File for replay writing */
-extern FILE *replay_file;
+/* File for replay writing, possibly gzip compressed */
+extern gzFile replay_file;
+
+/* Snapshot options */
+extern char *replay_snapshot;
+extern uint64_t replay_snapshot_period;
+extern int64_t replay_seek_step;
 
 void replay_put_byte(uint8_t byte);
 void replay_put_event(uint8_t event);
@@ -145,6 +157,11 @@ void replay_add_input_event(struct InputEvent *event);
 /*! Adds input sync event to the queue */
 void replay_add_input_sync_event(void);
 
+/* VM state operations */
+
+/*! Registers replay VMState. */
+void replay_vmstate_register(void);
+
 /* Character devices */
 
 /*! Called to run char device read event. */
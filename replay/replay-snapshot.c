@@ -0,0 +1,171 @@
+/*
+ * replay-snapshot.c
+ *
+ * Copyright (c) 2010-2016 Institute for System Programming
+ *                         of the Russian Academy of Sciences.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "sysemu/replay.h"
+#include "replay-internal.h"
+#include "sysemu/sysemu.h"
+#include "migration/vmstate.h"
+#include "block/snapshot.h"
+#include "qemu/timer.h"
+#include "qemu/error-report.h"
+
+/* Timer for periodic snapshots while recording */
+static QEMUTimer *replay_snapshot_timer;
+
+static void replay_pre_save(void *opaque)
+{
+    ReplayState *state = opaque;
+
+    /* Flush the executed instructions, so that the log position
+       matches the state of the CPUs. */
+    replay_save_instructions();
+    replay_mutex_lock();
+    state->data_kind = replay_data_kind;
+    state->has_unread_data = replay_has_unread_data;
+    state->file_offset = gztell(replay_file);
+    replay_mutex_unlock();
+}
+
+static int replay_post_load(void *opaque, int version_id)
+{
+    ReplayState *state = opaque;
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        error_report("Replay: cannot load a snapshot while recording");
+        return -EINVAL;
+    }
+
+    replay_mutex_lock();
+    if (gzseek(replay_file, state->file_offset, SEEK_SET) < 0) {
+        replay_mutex_unlock();
+        error_report("Replay: cannot seek to the snapshot position");
+        return -EINVAL;
+    }
+    replay_data_kind = state->data_kind;
+    replay_has_unread_data = state->has_unread_data;
+    /* Snapshots taken while recording have no event fetched yet */
+    replay_fetch_data_kind();
+    replay_mutex_unlock();
+    return 0;
+}
+
+static const VMStateDescription vmstate_replay = {
+    .name = "replay",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = replay_pre_save,
+    .post_load = replay_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT64_ARRAY(cached_clock, ReplayState, REPLAY_CLOCK_COUNT),
+        VMSTATE_UINT64(current_step, ReplayState),
+        VMSTATE_INT32(instructions_count, ReplayState),
+        VMSTATE_UINT32(data_kind, ReplayState),
+        VMSTATE_UINT32(has_unread_data, ReplayState),
+        VMSTATE_UINT64(file_offset, ReplayState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+void replay_vmstate_register(void)
+{
+    vmstate_register(NULL, 0, &vmstate_replay, &replay_state);
+}
+
+/* Periodic snapshots are named after the instruction they were taken at */
+static char *replay_snapshot_name(uint64_t step)
+{
+    return g_strdup_printf("%s-%" PRIu64, replay_snapshot, step);
+}
+
+static void replay_snapshot_timer_cb(void *opaque)
+{
+    /* The timer also exists during replay, so that both runs see the
+       same timer events, but snapshots are only taken while recording. */
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        char *name = replay_snapshot_name(replay_get_current_step());
+
+        if (save_vmstate(name) < 0) {
+            error_report("Replay: could not create snapshot %s", name);
+        }
+        g_free(name);
+    }
+    timer_mod(replay_snapshot_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+              replay_snapshot_period * NANOSECONDS_PER_SECOND);
+}
+
+/* Return the name of the latest snapshot taken at or before @step */
+static char *replay_find_snapshot(int64_t step)
+{
+    BlockDriverState *bs = bdrv_all_find_vmstate_bs();
+    QEMUSnapshotInfo *sn_tab = NULL;
+    char *prefix = g_strdup_printf("%s-", replay_snapshot);
+    char *best = g_strdup(replay_snapshot);
+    uint64_t best_step = 0;
+    int i, nb_sns = 0;
+
+    if (bs) {
+        nb_sns = bdrv_snapshot_list(bs, &sn_tab);
+    }
+    for (i = 0; i < nb_sns; i++) {
+        const char *end;
+        uint64_t sn_step;
+
+        if (!g_str_has_prefix(sn_tab[i].name, prefix) ||
+            qemu_strtoull(sn_tab[i].name + strlen(prefix), &end, 10,
+                          &sn_step) < 0 || *end ||
+            sn_step > step || sn_step < best_step) {
+            continue;
+        }
+        g_free(best);
+        best = g_strdup(sn_tab[i].name);
+        best_step = sn_step;
+    }
+
+    g_free(sn_tab);
+    g_free(prefix);
+    return best;
+}
+
+void replay_vmstate_init(void)
+{
+    if (!replay_snapshot) {
+        return;
+    }
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        if (save_vmstate(replay_snapshot) < 0) {
+            error_report("Could not create snapshot for icount record");
+            exit(1);
+        }
+    } else if (replay_mode == REPLAY_MODE_PLAY) {
+        char *name = replay_seek_step == -1
+            ? g_strdup(replay_snapshot)
+            : replay_find_snapshot(replay_seek_step);
+
+        if (load_vmstate(name) != 0) {
+            error_report("Could not load snapshot %s for icount replay",
+                         name);
+            exit(1);
+        }
+        g_free(name);
+    }
+
+    if (replay_snapshot_period) {
+        replay_snapshot_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                             replay_snapshot_timer_cb, NULL);
+        timer_mod(replay_snapshot_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  replay_snapshot_period * NANOSECONDS_PER_SECOND);
+    }
+}
@@ -20,14 +20,18 @@
 
 /* Current version of the replay mechanism.
    Increase it when file format changes. */
-#define REPLAY_VERSION              0xe02003
-/* Size of replay log header */
-#define HEADER_SIZE                 (sizeof(uint32_t) + sizeof(uint64_t))
+#define REPLAY_VERSION              0xe02004
 
 ReplayMode replay_mode = REPLAY_MODE_NONE;
 
 /* Name of replay file  */
 static char *replay_filename;
+/* Snapshot to create at start, and prefix of the periodic ones */
+char *replay_snapshot;
+/* Virtual seconds between periodic snapshots, 0 to disable */
+uint64_t replay_snapshot_period;
+/* Instruction to seek to at start, or -1 */
+int64_t replay_seek_step = -1;
 ReplayState replay_state;
 static GSList *replay_blockers;
 
@@ -206,14 +210,15 @@ out:
     return res;
 }
 
-static void replay_enable(const char *fname, int mode)
+static void replay_enable(const char *fname, int mode, bool compress)
 {
     const char *fmode = NULL;
     assert(!replay_file);
 
     switch (mode) {
     case REPLAY_MODE_RECORD:
-        fmode = "wb";
+        /* fast compression keeps the overhead of recording low */
+        fmode = compress ? "wb1" : "wbT";
         break;
     case REPLAY_MODE_PLAY:
         fmode = "rb";
@@ -227,11 +232,13 @@ static void replay_enable(const char *fname, int mode)
 
     replay_mutex_init();
 
-    replay_file = fopen(fname, fmode);
+    /* gzopen transparently reads uncompressed logs as well */
+    replay_file = gzopen(fname, fmode);
     if (replay_file == NULL) {
         fprintf(stderr, "Replay: open %s: %s\n", fname, strerror(errno));
         exit(1);
     }
+    gzbuffer(replay_file, 1 << 16);
 
     replay_filename = g_strdup(fname);
 
@@ -240,21 +247,25 @@ static void replay_enable(const char *fname, int mode)
     replay_state.instructions_count = 0;
     replay_state.current_step = 0;
 
-    /* skip file header for RECORD and check it for PLAY */
+    /* Write file header for RECORD and check it for PLAY.  The header
+     * is written upfront, because a compressed log cannot be rewound,
+     * and so that a log cut short by a crash can still be replayed.
+     */
     if (replay_mode == REPLAY_MODE_RECORD) {
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
+        replay_put_dword(REPLAY_VERSION);
+        replay_put_qword(0);
     } else if (replay_mode == REPLAY_MODE_PLAY) {
         unsigned int version = replay_get_dword();
         if (version != REPLAY_VERSION) {
             fprintf(stderr, "Replay: invalid input log file version\n");
             exit(1);
         }
-        /* go to the beginning */
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
+        replay_get_qword();
         replay_fetch_data_kind();
     }
 
     replay_init_events();
+    replay_vmstate_register();
 }
 
 void replay_configure(QemuOpts *opts)
@@ -290,7 +301,20 @@ void replay_configure(QemuOpts *opts)
         exit(1);
     }
 
-    replay_enable(fname, mode);
+    replay_snapshot = g_strdup(qemu_opt_get(opts, "rrsnapshot"));
+    replay_snapshot_period = qemu_opt_get_number(opts, "rrperiod", 0);
+    replay_seek_step = qemu_opt_get_number(opts, "rrseek", -1);
+    if ((replay_snapshot_period || replay_seek_step != -1) &&
+        !replay_snapshot) {
+        error_report("rrperiod and rrseek require rrsnapshot");
+        exit(1);
+    }
+    if (replay_seek_step != -1 && mode != REPLAY_MODE_PLAY) {
+        error_report("rrseek is only valid in replay mode");
+        exit(1);
+    }
+
+    replay_enable(fname, mode, qemu_opt_get_bool(opts, "rrcompress", false));
 
     loc_pop(&loc);
 }
@@ -310,8 +334,6 @@ void replay_start(void)
         exit(1);
     }
 
-    /* Timer for snapshotting will be set up here. */
-
     replay_enable_events();
 }
 
@@ -328,19 +350,17 @@ void replay_finish(void)
         if (replay_mode == REPLAY_MODE_RECORD) {
             /* write end event */
             replay_put_event(EVENT_END);
-
-            /* write header */
-            fseek(replay_file, 0, SEEK_SET);
-            replay_put_dword(REPLAY_VERSION);
         }
 
-        fclose(replay_file);
+        gzclose(replay_file);
         replay_file = NULL;
     }
     if (replay_filename) {
         g_free(replay_filename);
         replay_filename = NULL;
     }
+    g_free(replay_snapshot);
+    replay_snapshot = NULL;
 
     replay_finish_events();
     replay_mutex_destroy();
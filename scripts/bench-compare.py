@@ -0,0 +1,64 @@
+#!/usr/bin/env python
+#
+# Compare two runs of "make bench BENCH_OPTIONS=--json"
+#
+# This work is licensed under the terms of the GNU GPL, version 2.  See
+# the COPYING file in the top-level directory.
+#
+# Usage: bench-compare.py [--threshold=PERCENT] OLD.json NEW.json
+#
+# Prints the change of the median time of each benchmark found in both
+# files.  Exits with status 1 if any benchmark got slower by more than
+# PERCENT (default 5), so that the script can gate upgrades.
+
+import json
+import sys
+import getopt
+
+def load(filename):
+    results = {}
+    with open(filename) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith('{'):
+                continue
+            r = json.loads(line)
+            results[(r['suite'], r['name'])] = r
+    return results
+
+def main(args):
+    threshold = 5.0
+    opts, args = getopt.getopt(args, 't:', ['threshold='])
+    for opt, arg in opts:
+        threshold = float(arg)
+    if len(args) != 2:
+        sys.stderr.write('Usage: bench-compare.py [--threshold=PERCENT] '
+                         'OLD.json NEW.json\n')
+        return 2
+
+    old, new = load(args[0]), load(args[1])
+    regressions = 0
+    for key in sorted(set(old) & set(new)):
+        o = old[key]['ns']['median']
+        n = new[key]['ns']['median']
+        change = (n - o) * 100.0 / o if o else 0.0
+        # Changes within the noise of either run are not reported
+        noise = max(old[key]['ns']['stddev'] * 100.0 / o if o else 0.0,
+                    new[key]['ns']['stddev'] * 100.0 / n if n else 0.0)
+        mark = ''
+        if change > threshold and change > noise:
+            mark = '  REGRESSION'
+            regressions += 1
+        elif -change > threshold and -change > noise:
+            mark = '  improvement'
+        print('%-16s %-40s %12.1f -> %12.1f ns  %+6.1f%%%s' %
+              (key[0], key[1], o, n, change, mark))
+
+    for key in sorted(set(old) ^ set(new)):
+        print('%-16s %-40s only in %s' %
+              (key[0], key[1], args[0] if key in old else args[1]))
+
+    return 1 if regressions else 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,173 @@
+#!/usr/bin/env python
+#
+# Pretty-printer for ring trace backend binary trace files
+#
+# Copyright (c) 2016 Red Hat, Inc.
+#
+# This work is licensed under the terms of the GNU GPL, version 2.  See
+# the COPYING file in the top-level directory.
+#
+# For help see docs/tracing.txt
+#
+# The records of all threads are merged in timestamp order, and passed
+# to simpletrace.Analyzer objects as (event_num, timestamp_ns, tid, args...)
+# tuples, so analyzers written for simpletrace.py work unchanged.
+
+import struct
+import heapq
+import inspect
+from tracetool import _read_events, Event
+from tracetool.backend.simple import is_string
+from simpletrace import Analyzer
+
+header_magic    = 0x52494e4754524331
+header_version  = 1
+chunk_magic     = 0x52494e474348554e
+dropped_event_id = 0xfffffffffffffffe
+
+log_header_fmt = '=QQQ'
+chunk_header_fmt = '=QQQQQQ'
+rec_header_fmt = '=QII'
+
+def read_struct(fobj, fmt):
+    size = struct.calcsize(fmt)
+    data = fobj.read(size)
+    if len(data) != size:
+        return None
+    return struct.unpack(fmt, data)
+
+def parse_record(edict, data, off, tid, to_ns):
+    '''Deserialize the record at data[off:] into a tuple'''
+    ticks, event_id, length = struct.unpack_from(rec_header_fmt, data, off)
+    rec = (event_id, to_ns(ticks), tid)
+    pos = off + struct.calcsize(rec_header_fmt)
+    for type, name in edict[event_id].args:
+        if is_string(type):
+            (slen,) = struct.unpack_from('=L', data, pos)
+            rec = rec + (data[pos + 4:pos + 4 + slen],)
+            pos += 4 + slen
+        else:
+            (value,) = struct.unpack_from('=Q', data, pos)
+            rec = rec + (value,)
+            pos += 8
+    return rec, off + length
+
+def read_trace(edict, fobj):
+    '''Return a list of record tuples for each thread'''
+    header = read_struct(fobj, log_header_fmt)
+    if header is None or header[0] != header_magic:
+        raise ValueError('Not a valid ring trace file!')
+    if header[1] != header_version:
+        raise ValueError('Unknown version of ring trace format!')
+
+    chunks = []
+    while True:
+        chunk = read_struct(fobj, chunk_header_fmt)
+        if chunk is None:
+            break
+        if chunk[0] != chunk_magic:
+            raise ValueError('Corrupted ring trace file!')
+        data = fobj.read(chunk[5])
+        chunks.append((chunk, data))
+    if not chunks:
+        return []
+
+    # Convert ticks to nanoseconds using the first and last clock samples
+    first, last = chunks[0][0], chunks[-1][0]
+    if last[2] != first[2]:
+        scale = float(last[3] - first[3]) / (last[2] - first[2])
+    else:
+        scale = 1.0
+    to_ns = lambda ticks: int(first[3] + (ticks - first[2]) * scale)
+
+    threads = {}
+    for chunk, data in chunks:
+        tid = chunk[1]
+        recs = threads.setdefault(tid, [])
+        if chunk[4]:
+            recs.append((dropped_event_id, to_ns(chunk[2]), tid, chunk[4]))
+        off = 0
+        while off < len(data):
+            rec, off = parse_record(edict, data, off, tid, to_ns)
+            recs.append(rec)
+    return threads.values()
+
+def process(events, log, analyzer):
+    """Invoke an analyzer on each event of a ring trace file, in time order."""
+    if isinstance(events, str):
+        events = _read_events(open(events, 'r'))
+    if isinstance(log, str):
+        log = open(log, 'rb')
+
+    dropped_event = Event.build("Dropped_Event(uint64_t num_events_dropped)")
+    edict = {dropped_event_id: dropped_event}
+    for num, event in enumerate(events):
+        edict[num] = event
+
+    def build_fn(analyzer, event):
+        fn = getattr(analyzer, event.name, None)
+        if fn is None:
+            return analyzer.catchall
+
+        event_argcount = len(event.args)
+        fn_argcount = len(inspect.getargspec(fn)[0]) - 1
+        if fn_argcount == event_argcount + 1:
+            # Include timestamp as first argument
+            return lambda _, rec: fn(*((rec[1:2],) + rec[3:3 + event_argcount]))
+        elif fn_argcount == event_argcount + 2:
+            # Include timestamp and thread id
+            return lambda _, rec: fn(*rec[1:3 + event_argcount])
+        else:
+            # Just arguments, no timestamp or thread id
+            return lambda _, rec: fn(*rec[3:3 + event_argcount])
+
+    # Each thread's records are already in order, merge them
+    merged = heapq.merge(*[[(rec[1], i, rec) for i, rec in enumerate(recs)]
+                           for recs in read_trace(edict, log)])
+
+    analyzer.begin()
+    fn_cache = {}
+    for _, _, rec in merged:
+        event_num = rec[0]
+        event = edict[event_num]
+        if event_num not in fn_cache:
+            fn_cache[event_num] = build_fn(analyzer, event)
+        fn_cache[event_num](event, rec)
+    analyzer.end()
+
+def run(analyzer):
+    """Execute an analyzer on a trace file given on the command-line."""
+    import sys
+
+    if len(sys.argv) != 3:
+        sys.stderr.write('usage: %s <trace-events> <trace-file>\n' %
+                         sys.argv[0])
+        sys.exit(1)
+
+    events = _read_events(open(sys.argv[1], 'r'))
+    process(events, sys.argv[2], analyzer)
+
+if __name__ == '__main__':
+    class Formatter(Analyzer):
+        def __init__(self):
+            self.last_timestamp = None
+
+        def catchall(self, event, rec):
+            timestamp = rec[1]
+            if self.last_timestamp is None:
+                self.last_timestamp = timestamp
+            delta_ns = timestamp - self.last_timestamp
+            self.last_timestamp = timestamp
+
+            fields = [event.name, '%0.3f' % (delta_ns / 1000.0),
+                      'tid=%d' % rec[2]]
+            i = 3
+            for type, name in event.args:
+                if is_string(type):
+                    fields.append('%s=%s' % (name, rec[i]))
+                else:
+                    fields.append('%s=0x%x' % (name, rec[i]))
+                i += 1
+            print ' '.join(fields)
+
+    run(Formatter())
@@ -46,5 +46,6 @@ extern int tcp_keepintvl;
 
 int if_encap(Slirp *slirp, struct mbuf *ifm);
 ssize_t slirp_send(struct socket *so, const void *buf, size_t len, int flags);
+ssize_t slirp_sendv(struct socket *so, const struct iovec *iov, int iovcnt);
 
 #endif
@@ -18,7 +18,8 @@
 #include "qemu/osdep.h"
 #include <slirp.h>
 
-#define MBUF_THRESH 30
+/* Maximum number of unused mbufs kept around for reuse */
+#define MBUF_THRESH 256
 
 /*
  * Find a nice value for msize
@@ -58,15 +59,14 @@ void m_cleanup(Slirp *slirp)
  * Get an mbuf from the free list, if there are none
  * malloc one
  *
- * Because fragmentation can occur if we alloc new mbufs and
- * free old mbufs, we mark all mbufs above mbuf_thresh as M_DOFREE,
- * which tells m_free to actually free() it
+ * Freed mbufs go back to the free list, so that a busy connection
+ * does not malloc and free() one per packet; only when more than
+ * MBUF_THRESH are unused does m_free actually free() them
  */
 struct mbuf *
 m_get(Slirp *slirp)
 {
 	register struct mbuf *m;
-	int flags = 0;
 
 	DEBUG_CALL("m_get");
 
@@ -74,17 +74,16 @@ m_get(Slirp *slirp)
 		m = (struct mbuf *)malloc(SLIRP_MSIZE);
 		if (m == NULL) goto end_error;
 		slirp->mbuf_alloced++;
-		if (slirp->mbuf_alloced > MBUF_THRESH)
-			flags = M_DOFREE;
 		m->slirp = slirp;
 	} else {
 		m = slirp->m_freelist.m_next;
 		remque(m);
+		slirp->mbuf_free--;
 	}
 
 	/* Insert it in the used list */
 	insque(m,&slirp->m_usedlist);
-	m->m_flags = (flags | M_USEDLIST);
+	m->m_flags = M_USEDLIST;
 
 	/* Initialise it */
 	m->m_size = SLIRP_MSIZE - offsetof(struct mbuf, m_dat);
@@ -118,11 +117,15 @@ m_free(struct mbuf *m)
 	/*
 	 * Either free() it or put it on the free list
 	 */
-	if (m->m_flags & M_DOFREE) {
+	if (m->m_flags & M_FREELIST) {
+		/* Already free */
+	} else if ((m->m_flags & M_DOFREE) ||
+		   m->slirp->mbuf_free >= MBUF_THRESH) {
 		m->slirp->mbuf_alloced--;
 		free(m);
-	} else if ((m->m_flags & M_FREELIST) == 0) {
+	} else {
 		insque(m,&m->slirp->m_freelist);
+		m->slirp->mbuf_free++;
 		m->m_flags = M_FREELIST; /* Clobber other flags */
 	}
   } /* if(m) */
@@ -25,6 +25,7 @@
 #include "qemu-common.h"
 #include "qemu/timer.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "sysemu/char.h"
 #include "slirp.h"
 #include "hw/hw.h"
@@ -988,6 +989,30 @@ ssize_t slirp_send(struct socket *so, const void *buf, size_t len, int flags)
     return send(so->s, buf, len, flags);
 }
 
+ssize_t slirp_sendv(struct socket *so, const struct iovec *iov, int iovcnt)
+{
+    if (so->s == -1 && so->extra) {
+        ssize_t total = 0;
+        int i;
+
+        /* Stop at the first element the chardev did not take completely */
+        for (i = 0; i < iovcnt; i++) {
+            int ret = qemu_chr_fe_write(so->extra, iov[i].iov_base,
+                                        iov[i].iov_len);
+            if (ret < 0) {
+                return total ? total : ret;
+            }
+            total += ret;
+            if (ret < iov[i].iov_len) {
+                break;
+            }
+        }
+        return total;
+    }
+
+    return writev(so->s, iov, iovcnt);
+}
+
 static struct socket *
 slirp_find_ctl_socket(Slirp *slirp, struct in_addr guest_addr, int guest_port)
 {
@@ -199,6 +199,7 @@ struct Slirp {
     /* mbuf states */
     struct mbuf m_freelist, m_usedlist;
     int mbuf_alloced;
+    int mbuf_free;
 
     /* if states */
     struct mbuf if_fastq;   /* fast queue (for interactive data) */
@@ -390,7 +390,7 @@ sowrite(struct socket *so)
 	/* Check if there's urgent data to send, and if so, send it */
 
 #ifdef HAVE_READV
-	nn = writev(so->s, (const struct iovec *)iov, n);
+	nn = slirp_sendv(so, iov, n);
 
 	DEBUG_MISC((dfd, "  ... wrote nn = %d bytes\n", nn));
 #else
@@ -185,9 +185,13 @@ tcp_respond(struct tcpcb *tp, struct tcpiphdr *ti, struct mbuf *m,
 	ti->ti_x2 = 0;
 	ti->ti_off = sizeof (struct tcphdr) >> 2;
 	ti->ti_flags = flags;
-	if (tp)
+	if (tp) {
+		/* The receive buffer is rounded up to a multiple of the MSS
+		 * and can exceed what the window field can carry.  */
+		if (win > (long)TCP_MAXWIN << tp->rcv_scale)
+			win = (long)TCP_MAXWIN << tp->rcv_scale;
 		ti->ti_win = htons((uint16_t) (win >> tp->rcv_scale));
-	else
+	} else
 		ti->ti_win = htons((uint16_t)win);
 	ti->ti_urp = 0;
 	ti->ti_sum = 0;
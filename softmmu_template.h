@@ -125,9 +125,11 @@
     int vidx;                                                                 \
     CPUIOTLBEntry tmpiotlb;                                                   \
     CPUTLBEntry tmptlb;                                                       \
+    env->tlb_stats.miss++;                                                    \
     for (vidx = CPU_VTLB_SIZE-1; vidx >= 0; --vidx) {                         \
         if (env->tlb_v_table[mmu_idx][vidx].ty == (addr & TARGET_PAGE_MASK)) {\
             /* found entry in victim tlb, swap tlb and iotlb */               \
+            env->tlb_stats.victim_hit++;                                      \
             tmptlb = env->tlb_table[mmu_idx][index];                          \
             env->tlb_table[mmu_idx][index] = env->tlb_v_table[mmu_idx][vidx]; \
             env->tlb_v_table[mmu_idx][vidx] = tmptlb;                         \
@@ -151,6 +153,7 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
     CPUState *cpu = ENV_GET_CPU(env);
     hwaddr physaddr = iotlbentry->addr;
     MemoryRegion *mr = iotlb_to_region(cpu, physaddr, iotlbentry->attrs);
+    bool locked = false;
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     cpu->mem_io_pc = retaddr;
@@ -159,17 +162,55 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
     }
 
     cpu->mem_io_vaddr = addr;
+    /* With multi-threaded TCG the vCPU runs without the iothread lock */
+    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
     memory_region_dispatch_read(mr, physaddr, &val, 1 << SHIFT,
                                 iotlbentry->attrs);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
     return val;
 }
 #endif
 
+#if DATA_SIZE > 1
+/* Make sure the TLB maps the page containing ADDR, filling it (and thus
+   raising any fault) if needed.  Return the host address of ADDR if the
+   page is plain RAM that can be accessed directly, NULL otherwise.  */
+static inline void *glue(glue(tlb_host_addr, SUFFIX), MMUSUFFIX)
+    (CPUArchState *env, target_ulong addr, unsigned mmu_idx, bool is_store,
+     uintptr_t retaddr)
+{
+    int index = tlb_index(env, mmu_idx, addr);
+    target_ulong tlb_addr = is_store ? env->tlb_table[mmu_idx][index].addr_write
+                                     : env->tlb_table[mmu_idx][index].ADDR_READ;
+
+    if ((addr & TARGET_PAGE_MASK)
+        != (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        if (is_store ? !VICTIM_TLB_HIT(addr_write)
+                     : !VICTIM_TLB_HIT(ADDR_READ)) {
+            tlb_fill(ENV_GET_CPU(env), addr,
+                     is_store ? MMU_DATA_STORE : READ_ACCESS_TYPE,
+                     mmu_idx, retaddr);
+        }
+        tlb_addr = is_store ? env->tlb_table[mmu_idx][index].addr_write
+                            : env->tlb_table[mmu_idx][index].ADDR_READ;
+    }
+    if (tlb_addr & ~TARGET_PAGE_MASK) {
+        return NULL;
+    }
+    return (void *)((uintptr_t)addr + env->tlb_table[mmu_idx][index].addend);
+}
+#endif
+
 WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr,
                             TCGMemOpIdx oi, uintptr_t retaddr)
 {
     unsigned mmu_idx = get_mmuidx(oi);
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     uintptr_t haddr;
     DATA_TYPE res;
@@ -219,6 +260,25 @@ WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr,
             cpu_unaligned_access(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
                                  mmu_idx, retaddr);
         }
+#if DATA_SIZE > 1
+        /* If the access crosses into a second RAM page, copy the two
+           parts from the host and assemble the value in one go.  */
+        addr2 = (addr + DATA_SIZE - 1) & TARGET_PAGE_MASK;
+        if (addr2 != (addr & TARGET_PAGE_MASK)) {
+            uint8_t *h1, *h2, buf[DATA_SIZE];
+            unsigned n1 = addr2 - addr;
+
+            h1 = glue(glue(tlb_host_addr, SUFFIX), MMUSUFFIX)
+                (env, addr, mmu_idx, false, retaddr);
+            h2 = glue(glue(tlb_host_addr, SUFFIX), MMUSUFFIX)
+                (env, addr2, mmu_idx, false, retaddr);
+            if (h1 && h2) {
+                memcpy(buf, h1, n1);
+                memcpy(buf + n1, h2, DATA_SIZE - n1);
+                return glue(glue(ld, LSUFFIX), _le_p)(buf);
+            }
+        }
+#endif
         addr1 = addr & ~(DATA_SIZE - 1);
         addr2 = addr1 + DATA_SIZE;
         /* Note the adjustment at the beginning of the function.
@@ -253,7 +313,7 @@ WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr,
                             TCGMemOpIdx oi, uintptr_t retaddr)
 {
     unsigned mmu_idx = get_mmuidx(oi);
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     uintptr_t haddr;
     DATA_TYPE res;
@@ -303,6 +363,23 @@ WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr,
             cpu_unaligned_access(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
                                  mmu_idx, retaddr);
         }
+        /* If the access crosses into a second RAM page, copy the two
+           parts from the host and assemble the value in one go.  */
+        addr2 = (addr + DATA_SIZE - 1) & TARGET_PAGE_MASK;
+        if (addr2 != (addr & TARGET_PAGE_MASK)) {
+            uint8_t *h1, *h2, buf[DATA_SIZE];
+            unsigned n1 = addr2 - addr;
+
+            h1 = glue(glue(tlb_host_addr, SUFFIX), MMUSUFFIX)
+                (env, addr, mmu_idx, false, retaddr);
+            h2 = glue(glue(tlb_host_addr, SUFFIX), MMUSUFFIX)
+                (env, addr2, mmu_idx, false, retaddr);
+            if (h1 && h2) {
+                memcpy(buf, h1, n1);
+                memcpy(buf + n1, h2, DATA_SIZE - n1);
+                return glue(glue(ld, LSUFFIX), _be_p)(buf);
+            }
+        }
         addr1 = addr & ~(DATA_SIZE - 1);
         addr2 = addr1 + DATA_SIZE;
         /* Note the adjustment at the beginning of the function.
@@ -358,6 +435,7 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
     CPUState *cpu = ENV_GET_CPU(env);
     hwaddr physaddr = iotlbentry->addr;
     MemoryRegion *mr = iotlb_to_region(cpu, physaddr, iotlbentry->attrs);
+    bool locked = false;
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     if (mr != &io_mem_rom && mr != &io_mem_notdirty && !cpu->can_do_io) {
@@ -366,15 +444,22 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
 
     cpu->mem_io_vaddr = addr;
     cpu->mem_io_pc = retaddr;
+    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
     memory_region_dispatch_write(mr, physaddr, val, 1 << SHIFT,
                                  iotlbentry->attrs);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
                        TCGMemOpIdx oi, uintptr_t retaddr)
 {
     unsigned mmu_idx = get_mmuidx(oi);
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     uintptr_t haddr;
 
@@ -414,12 +499,36 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
     if (DATA_SIZE > 1
         && unlikely((addr & ~TARGET_PAGE_MASK) + DATA_SIZE - 1
                      >= TARGET_PAGE_SIZE)) {
+#if DATA_SIZE > 1
+        target_ulong addr2;
+#endif
         int i;
     do_unaligned_access:
         if ((get_memop(oi) & MO_AMASK) == MO_ALIGN) {
             cpu_unaligned_access(ENV_GET_CPU(env), addr, MMU_DATA_STORE,
                                  mmu_idx, retaddr);
         }
+#if DATA_SIZE > 1
+        /* If both pages are RAM, store the two parts directly.  Both
+           pages are looked up first, so a fault on either one leaves
+           memory untouched.  */
+        addr2 = (addr + DATA_SIZE - 1) & TARGET_PAGE_MASK;
+        if (addr2 != (addr & TARGET_PAGE_MASK)) {
+            uint8_t *h1, *h2, buf[DATA_SIZE];
+            unsigned n1 = addr2 - addr;
+
+            h1 = glue(glue(tlb_host_addr, SUFFIX), MMUSUFFIX)
+                (env, addr, mmu_idx, true, retaddr);
+            h2 = glue(glue(tlb_host_addr, SUFFIX), MMUSUFFIX)
+                (env, addr2, mmu_idx, true, retaddr);
+            if (h1 && h2) {
+                glue(glue(st, SUFFIX), _le_p)(buf, val);
+                memcpy(h1, buf, n1);
+                memcpy(h2, buf + n1, DATA_SIZE - n1);
+                return;
+            }
+        }
+#endif
         /* XXX: not efficient, but simple */
         /* Note: relies on the fact that tlb_fill() does not remove the
          * previous page from the TLB cache.  */
@@ -454,7 +563,7 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
                        TCGMemOpIdx oi, uintptr_t retaddr)
 {
     unsigned mmu_idx = get_mmuidx(oi);
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     uintptr_t haddr;
 
@@ -494,12 +603,32 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
     if (DATA_SIZE > 1
         && unlikely((addr & ~TARGET_PAGE_MASK) + DATA_SIZE - 1
                      >= TARGET_PAGE_SIZE)) {
+        target_ulong addr2;
         int i;
     do_unaligned_access:
         if ((get_memop(oi) & MO_AMASK) == MO_ALIGN) {
             cpu_unaligned_access(ENV_GET_CPU(env), addr, MMU_DATA_STORE,
                                  mmu_idx, retaddr);
         }
+        /* If both pages are RAM, store the two parts directly.  Both
+           pages are looked up first, so a fault on either one leaves
+           memory untouched.  */
+        addr2 = (addr + DATA_SIZE - 1) & TARGET_PAGE_MASK;
+        if (addr2 != (addr & TARGET_PAGE_MASK)) {
+            uint8_t *h1, *h2, buf[DATA_SIZE];
+            unsigned n1 = addr2 - addr;
+
+            h1 = glue(glue(tlb_host_addr, SUFFIX), MMUSUFFIX)
+                (env, addr, mmu_idx, true, retaddr);
+            h2 = glue(glue(tlb_host_addr, SUFFIX), MMUSUFFIX)
+                (env, addr2, mmu_idx, true, retaddr);
+            if (h1 && h2) {
+                glue(glue(st, SUFFIX), _be_p)(buf, val);
+                memcpy(h1, buf, n1);
+                memcpy(h2, buf + n1, DATA_SIZE - n1);
+                return;
+            }
+        }
         /* XXX: not efficient, but simple */
         /* Note: relies on the fact that tlb_fill() does not remove the
          * previous page from the TLB cache.  */
@@ -536,7 +665,7 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
 void probe_write(CPUArchState *env, target_ulong addr, int mmu_idx,
                  uintptr_t retaddr)
 {
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
 
     if ((addr & TARGET_PAGE_MASK)
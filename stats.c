@@ -0,0 +1,240 @@
+/*
+ * Statistics providers and subscriptions
+ *
+ * Copyright (c) 2016 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Subsystems register providers that report named counters.  Clients
+ * either read them once with query-stats, or subscribe with
+ * stats-subscribe and receive STATS events with the counters that
+ * changed since the previous event.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/queue.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "qapi-event.h"
+#include "qmp-commands.h"
+#include "sysemu/stats.h"
+
+/* Shortest interval between two STATS events of a subscription */
+#define STATS_MIN_INTERVAL_MS 100
+
+typedef struct StatsProvider {
+    const char *name;
+    StatsProviderFunc *fn;
+    void *opaque;
+    QTAILQ_ENTRY(StatsProvider) next;
+} StatsProvider;
+
+typedef struct StatsSubscription {
+    int64_t id;
+    strList *prefixes;      /* NULL to report every counter */
+    int64_t interval_ms;
+    QEMUTimer *timer;
+    GHashTable *last;       /* counter name -> last value sent */
+    QTAILQ_ENTRY(StatsSubscription) next;
+} StatsSubscription;
+
+struct StatsSampler {
+    const char *provider;
+    strList *prefixes;
+    GHashTable *last;       /* NULL to report unchanged counters too */
+    StatsCounterList *head;
+    StatsCounterList **tail;
+};
+
+static QTAILQ_HEAD(, StatsProvider) stats_providers =
+    QTAILQ_HEAD_INITIALIZER(stats_providers);
+static QTAILQ_HEAD(, StatsSubscription) stats_subscriptions =
+    QTAILQ_HEAD_INITIALIZER(stats_subscriptions);
+static int64_t stats_next_id;
+
+void stats_register_provider(const char *name, StatsProviderFunc *fn,
+                             void *opaque)
+{
+    StatsProvider *p = g_new0(StatsProvider, 1);
+
+    p->name = name;
+    p->fn = fn;
+    p->opaque = opaque;
+    QTAILQ_INSERT_TAIL(&stats_providers, p, next);
+}
+
+/* Is @name equal to @prefix, or below it in the dotted hierarchy? */
+static bool stats_name_has_prefix(const char *name, const char *prefix)
+{
+    size_t len = strlen(prefix);
+
+    return !strncmp(name, prefix, len) &&
+           (name[len] == '\0' || name[len] == '.');
+}
+
+static bool stats_name_wanted(const char *name, strList *prefixes)
+{
+    strList *p;
+
+    if (!prefixes) {
+        return true;
+    }
+    for (p = prefixes; p; p = p->next) {
+        if (stats_name_has_prefix(name, p->value)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Can @provider report any counter selected by @prefixes? */
+static bool stats_provider_wanted(StatsProvider *provider, strList *prefixes)
+{
+    strList *p;
+
+    if (!prefixes) {
+        return true;
+    }
+    for (p = prefixes; p; p = p->next) {
+        if (stats_name_has_prefix(provider->name, p->value) ||
+            stats_name_has_prefix(p->value, provider->name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void stats_add(StatsSampler *s, uint64_t value, const char *fmt, ...)
+{
+    StatsCounterList *item;
+    uint64_t *last;
+    char *name, *suffix;
+    va_list ap;
+
+    va_start(ap, fmt);
+    suffix = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    name = g_strconcat(s->provider, ".", suffix, NULL);
+    g_free(suffix);
+
+    if (!stats_name_wanted(name, s->prefixes)) {
+        g_free(name);
+        return;
+    }
+
+    if (s->last) {
+        last = g_hash_table_lookup(s->last, name);
+        if (last && *last == value) {
+            g_free(name);
+            return;
+        }
+        if (!last) {
+            last = g_new(uint64_t, 1);
+            g_hash_table_insert(s->last, g_strdup(name), last);
+        }
+        *last = value;
+    }
+
+    item = g_new0(StatsCounterList, 1);
+    item->value = g_new0(StatsCounter, 1);
+    item->value->name = name;
+    item->value->value = value;
+    *s->tail = item;
+    s->tail = &item->next;
+}
+
+static StatsCounterList *stats_collect(strList *prefixes, GHashTable *last)
+{
+    StatsSampler s = {
+        .prefixes = prefixes,
+        .last = last,
+    };
+    StatsProvider *p;
+
+    s.tail = &s.head;
+    QTAILQ_FOREACH(p, &stats_providers, next) {
+        if (stats_provider_wanted(p, prefixes)) {
+            s.provider = p->name;
+            p->fn(&s, p->opaque);
+        }
+    }
+    return s.head;
+}
+
+StatsCounterList *qmp_query_stats(bool has_prefixes, strList *prefixes,
+                                  Error **errp)
+{
+    return stats_collect(has_prefixes ? prefixes : NULL, NULL);
+}
+
+static void stats_subscription_tick(void *opaque)
+{
+    StatsSubscription *sub = opaque;
+    StatsCounterList *counters;
+
+    counters = stats_collect(sub->prefixes, sub->last);
+    if (counters) {
+        qapi_event_send_stats(sub->id, counters, &error_abort);
+        qapi_free_StatsCounterList(counters);
+    }
+
+    timer_mod(sub->timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + sub->interval_ms);
+}
+
+int64_t qmp_stats_subscribe(bool has_prefixes, strList *prefixes,
+                            int64_t interval, Error **errp)
+{
+    StatsSubscription *sub;
+    strList *p, **tail;
+
+    if (interval < STATS_MIN_INTERVAL_MS) {
+        error_setg(errp, "Parameter 'interval' must be at least %d",
+                   STATS_MIN_INTERVAL_MS);
+        return -1;
+    }
+
+    sub = g_new0(StatsSubscription, 1);
+    sub->id = stats_next_id++;
+    sub->interval_ms = interval;
+    sub->last = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                      g_free, g_free);
+    tail = &sub->prefixes;
+    for (p = has_prefixes ? prefixes : NULL; p; p = p->next) {
+        *tail = g_new0(strList, 1);
+        (*tail)->value = g_strdup(p->value);
+        tail = &(*tail)->next;
+    }
+
+    sub->timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                              stats_subscription_tick, sub);
+    timer_mod(sub->timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
+    QTAILQ_INSERT_TAIL(&stats_subscriptions, sub, next);
+
+    return sub->id;
+}
+
+void qmp_stats_unsubscribe(int64_t id, Error **errp)
+{
+    StatsSubscription *sub;
+
+    QTAILQ_FOREACH(sub, &stats_subscriptions, next) {
+        if (sub->id == id) {
+            break;
+        }
+    }
+    if (!sub) {
+        error_setg(errp, "Statistics subscription %" PRId64 " not found",
+                   id);
+        return;
+    }
+
+    QTAILQ_REMOVE(&stats_subscriptions, sub, next);
+    timer_del(sub->timer);
+    timer_free(sub->timer);
+    g_hash_table_destroy(sub->last);
+    qapi_free_strList(sub->prefixes);
+    g_free(sub);
+}
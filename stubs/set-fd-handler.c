@@ -2,10 +2,12 @@
 #include "qemu-common.h"
 #include "qemu/main-loop.h"
 
-void qemu_set_fd_handler(int fd,
-                         IOHandler *fd_read,
-                         IOHandler *fd_write,
-                         void *opaque)
+void qemu_set_fd_handler_full(int fd,
+                              IOHandler *fd_read,
+                              IOHandler *fd_write,
+                              void *opaque,
+                              const char *read_name,
+                              const char *write_name)
 {
     abort();
 }
@@ -52,6 +52,22 @@ void HELPER(crypto_aese)(CPUARMState *env, uint32_t rd, uint32_t rm,
     rk.l[0] ^= st.l[0];
     rk.l[1] ^= st.l[1];
 
+#ifndef HOST_WORDS_BIGENDIAN
+    if (aes_host_funcs) {
+        /* AESENCLAST/AESDECLAST with a zero round key */
+        static const uint8_t zero[16];
+
+        if (decrypt) {
+            aes_host_funcs->dec(rk.bytes, zero, true);
+        } else {
+            aes_host_funcs->enc(rk.bytes, zero, true);
+        }
+        env->vfp.regs[rd] = make_float64(rk.l[0]);
+        env->vfp.regs[rd + 1] = make_float64(rk.l[1]);
+        return;
+    }
+#endif
+
     /* combine ShiftRows operation and sbox substitution */
     for (i = 0; i < 16; i++) {
         CR_ST_BYTE(st, i) = sbox[decrypt][CR_ST_BYTE(rk, shift[decrypt][i])];
@@ -205,6 +221,24 @@ void HELPER(crypto_aesmc)(CPUARMState *env, uint32_t rd, uint32_t rm,
 
     assert(decrypt < 2);
 
+#ifndef HOST_WORDS_BIGENDIAN
+    if (aes_host_funcs) {
+        static const uint8_t zero[16];
+
+        if (decrypt) {
+            aes_host_funcs->imc(st.bytes);
+        } else {
+            /* Only MixColumns remains once the other steps of AESENC
+               are undone by an AESDECLAST.  */
+            aes_host_funcs->dec(st.bytes, zero, true);
+            aes_host_funcs->enc(st.bytes, zero, false);
+        }
+        env->vfp.regs[rd] = make_float64(st.l[0]);
+        env->vfp.regs[rd + 1] = make_float64(st.l[1]);
+        return;
+    }
+#endif
+
     for (i = 0; i < 16; i += 4) {
         CR_ST_WORD(st, i >> 2) =
             mc[decrypt][CR_ST_BYTE(st, i)] ^
@@ -120,6 +120,11 @@ static inline int default_exception_el(DisasContext *s)
 #define DISAS_HVC 8
 #define DISAS_SMC 9
 #define DISAS_YIELD 10
+/* CPU state was modified dynamically and the PC is already up to date:
+ * exit to the main loop, e.g. because interrupts may have been unmasked.
+ * DISAS_JUMP only changes the PC, and may chain to the next TB.
+ */
+#define DISAS_EXIT 11
 
 #ifdef TARGET_AARCH64
 void a64_translate_init(void);
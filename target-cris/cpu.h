@@ -165,6 +165,9 @@ typedef struct CPUCRISState {
 	 */
         TLBSet tlbsets[2][4][16];
 
+    /* Fields up to this point are cleared by a CPU reset */
+    struct {} end_reset_fields;
+
 	CPU_COMMON
 
     /* Members from load_info on are preserved across resets.  */
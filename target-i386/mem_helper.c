@@ -22,39 +22,6 @@
 #include "exec/helper-proto.h"
 #include "exec/cpu_ldst.h"
 
-/* broken thread support */
-
-#if defined(CONFIG_USER_ONLY)
-QemuMutex global_cpu_lock;
-
-void helper_lock(void)
-{
-    qemu_mutex_lock(&global_cpu_lock);
-}
-
-void helper_unlock(void)
-{
-    qemu_mutex_unlock(&global_cpu_lock);
-}
-
-void helper_lock_init(void)
-{
-    qemu_mutex_init(&global_cpu_lock);
-}
-#else
-void helper_lock(void)
-{
-}
-
-void helper_unlock(void)
-{
-}
-
-void helper_lock_init(void)
-{
-}
-#endif
-
 void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
 {
     uint64_t d;
@@ -104,6 +71,149 @@ void helper_cmpxchg16b(CPUX86State *env, target_ulong a0)
 }
 #endif
 
+#ifndef CONFIG_USER_ONLY
+/* Number of whole elements of 1 << OT bytes that a forward string
+   operation can access starting at linear address ADDR, whose offset
+   register is REG, without leaving the page or wrapping REG.  */
+static target_ulong rep_bulk_limit(target_ulong addr, target_ulong reg,
+                                   int ot, int aflag)
+{
+    target_ulong n = (TARGET_PAGE_SIZE - (addr & ~TARGET_PAGE_MASK)) >> ot;
+
+    if (aflag != MO_64) {
+        uint64_t mask = aflag == MO_16 ? 0xffff : 0xffffffff;
+
+        n = MIN(n, (mask + 1 - (reg & mask)) >> ot);
+    }
+    return n;
+}
+
+/* Add DELTA to REG with the update rules of an AFLAG-sized register */
+static void rep_add_reg(CPUX86State *env, int reg, int aflag,
+                        target_ulong delta)
+{
+    target_ulong val = env->regs[reg] + delta;
+
+    switch (aflag) {
+    case MO_16:
+        env->regs[reg] = (env->regs[reg] & ~0xffff) | (val & 0xffff);
+        break;
+#ifdef TARGET_X86_64
+    case MO_32:
+        env->regs[reg] = (uint32_t)val;
+        break;
+#endif
+    default:
+        env->regs[reg] = val;
+        break;
+    }
+}
+
+static target_ulong rep_count(CPUX86State *env, int aflag)
+{
+    switch (aflag) {
+    case MO_16:
+        return env->regs[R_ECX] & 0xffff;
+#ifdef TARGET_X86_64
+    case MO_32:
+        return (uint32_t)env->regs[R_ECX];
+#endif
+    default:
+        return env->regs[R_ECX];
+    }
+}
+
+/* Do the part of a forward REP MOVS that lies within the current source
+   and destination pages with a single memcpy.  Only RAM pages that are
+   already in the TLB qualify: I/O, watchpoints and not-dirty pages (which
+   may hold translated code) have no direct host address and are left to
+   the element-by-element loop, as are backward or overlapping copies.  */
+void helper_rep_movs(CPUX86State *env, target_ulong dst, target_ulong src,
+                     uint32_t ot, uint32_t aflag)
+{
+    int mmu_idx = cpu_mmu_index(env, false);
+    target_ulong n, len;
+    uint8_t *hdst, *hsrc;
+
+    if (env->df != 1) {
+        return;
+    }
+    n = rep_count(env, aflag);
+    n = MIN(n, rep_bulk_limit(dst, env->regs[R_EDI], ot, aflag));
+    n = MIN(n, rep_bulk_limit(src, env->regs[R_ESI], ot, aflag));
+    if (n == 0) {
+        return;
+    }
+
+    hdst = tlb_vaddr_to_host(env, dst, MMU_DATA_STORE, mmu_idx);
+    hsrc = tlb_vaddr_to_host(env, src, MMU_DATA_LOAD, mmu_idx);
+    len = n << ot;
+    if (!hdst || !hsrc || (hdst < hsrc + len && hsrc < hdst + len)) {
+        return;
+    }
+
+    memcpy(hdst, hsrc, len);
+    rep_add_reg(env, R_ESI, aflag, len);
+    rep_add_reg(env, R_EDI, aflag, len);
+    rep_add_reg(env, R_ECX, aflag, -n);
+}
+
+/* Same as helper_rep_movs, for REP STOS */
+void helper_rep_stos(CPUX86State *env, target_ulong dst,
+                     uint32_t ot, uint32_t aflag)
+{
+    int mmu_idx = cpu_mmu_index(env, false);
+    target_ulong val = env->regs[R_EAX];
+    target_ulong n, i;
+    uint8_t *hdst;
+
+    if (env->df != 1) {
+        return;
+    }
+    n = rep_count(env, aflag);
+    n = MIN(n, rep_bulk_limit(dst, env->regs[R_EDI], ot, aflag));
+    if (n == 0) {
+        return;
+    }
+
+    hdst = tlb_vaddr_to_host(env, dst, MMU_DATA_STORE, mmu_idx);
+    if (!hdst) {
+        return;
+    }
+
+    switch (ot) {
+    case MO_8:
+        memset(hdst, val, n);
+        break;
+    case MO_16:
+        for (i = 0; i < n; i++) {
+            stw_le_p(hdst + i * 2, val);
+        }
+        break;
+    case MO_32:
+        if (val == 0) {
+            memset(hdst, 0, n * 4);
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            stl_le_p(hdst + i * 4, val);
+        }
+        break;
+    default:
+        if (val == 0) {
+            memset(hdst, 0, n * 8);
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            stq_le_p(hdst + i * 8, val);
+        }
+        break;
+    }
+    rep_add_reg(env, R_EDI, aflag, n << ot);
+    rep_add_reg(env, R_ECX, aflag, -n);
+}
+#endif
+
 void helper_boundw(CPUX86State *env, target_ulong a0, int v)
 {
     int low, high;
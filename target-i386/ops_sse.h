@@ -2213,6 +2213,13 @@ void glue(helper_aesdec, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+#ifndef HOST_WORDS_BIGENDIAN
+    if (aes_host_funcs) {
+        aes_host_funcs->dec(d->_b_ZMMReg, rk._b_ZMMReg, false);
+        return;
+    }
+#endif
+
     for (i = 0 ; i < 4 ; i++) {
         d->L(i) = rk.L(i) ^ bswap32(AES_Td0[st.B(AES_ishifts[4*i+0])] ^
                                     AES_Td1[st.B(AES_ishifts[4*i+1])] ^
@@ -2227,6 +2234,13 @@ void glue(helper_aesdeclast, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+#ifndef HOST_WORDS_BIGENDIAN
+    if (aes_host_funcs) {
+        aes_host_funcs->dec(d->_b_ZMMReg, rk._b_ZMMReg, true);
+        return;
+    }
+#endif
+
     for (i = 0; i < 16; i++) {
         d->B(i) = rk.B(i) ^ (AES_isbox[st.B(AES_ishifts[i])]);
     }
@@ -2238,6 +2252,13 @@ void glue(helper_aesenc, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+#ifndef HOST_WORDS_BIGENDIAN
+    if (aes_host_funcs) {
+        aes_host_funcs->enc(d->_b_ZMMReg, rk._b_ZMMReg, false);
+        return;
+    }
+#endif
+
     for (i = 0 ; i < 4 ; i++) {
         d->L(i) = rk.L(i) ^ bswap32(AES_Te0[st.B(AES_shifts[4*i+0])] ^
                                     AES_Te1[st.B(AES_shifts[4*i+1])] ^
@@ -2252,6 +2273,13 @@ void glue(helper_aesenclast, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+#ifndef HOST_WORDS_BIGENDIAN
+    if (aes_host_funcs) {
+        aes_host_funcs->enc(d->_b_ZMMReg, rk._b_ZMMReg, true);
+        return;
+    }
+#endif
+
     for (i = 0; i < 16; i++) {
         d->B(i) = rk.B(i) ^ (AES_sbox[st.B(AES_shifts[i])]);
     }
@@ -2263,6 +2291,15 @@ void glue(helper_aesimc, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     int i;
     Reg tmp = *s;
 
+#ifndef HOST_WORDS_BIGENDIAN
+    if (aes_host_funcs) {
+        aes_host_funcs->imc(tmp._b_ZMMReg);
+        d->ZMM_Q(0) = tmp.ZMM_Q(0);
+        d->ZMM_Q(1) = tmp.ZMM_Q(1);
+        return;
+    }
+#endif
+
     for (i = 0 ; i < 4 ; i++) {
         d->L(i) = bswap32(AES_imc[tmp.B(4*i+0)][0] ^
                           AES_imc[tmp.B(4*i+1)][1] ^
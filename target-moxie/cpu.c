@@ -43,7 +43,7 @@ static void moxie_cpu_reset(CPUState *s)
 
     mcc->parent_reset(s);
 
-    memset(env, 0, sizeof(CPUMoxieState));
+    memset(env, 0, offsetof(CPUMoxieState, irq));
     env->pc = 0x1000;
 
     tlb_flush(s, 1);
@@ -53,6 +53,7 @@ typedef struct CPUMoxieState {
     uint32_t cc_a;                /* reg a for condition code calculation */
     uint32_t cc_b;                /* reg b for condition code calculation */
 
+    /* Fields from here on are preserved across CPU reset. */
     void *irq[8];
 
     CPU_COMMON
@@ -300,8 +300,6 @@ typedef struct CPUOpenRISCState {
                                  in solt so far.  */
     uint32_t btaken;          /* the SR_F bit */
 
-    CPU_COMMON
-
     /* Fields from here on are preserved across CPU reset. */
 #ifndef CONFIG_USER_ONLY
     CPUOpenRISCTLBContext * tlb;
@@ -314,6 +312,8 @@ typedef struct CPUOpenRISCState {
     uint32_t picsr;         /* Interrupt contrl register*/
 #endif
     void *irq[32];          /* Interrupt irq input */
+
+    CPU_COMMON
 } CPUOpenRISCState;
 
 /**
@@ -135,9 +135,12 @@ typedef struct CPUS390XState {
     uint64_t gbea;
     uint64_t pp;
 
+    /* Fields up to this point are cleared by a CPU reset */
+    struct {} end_reset_fields;
+
     CPU_COMMON
 
-    /* reset does memset(0) up to here */
+    /* Fields from here on are preserved across CPU reset. */
 
     uint32_t cpu_num;
     uint32_t machine_type;
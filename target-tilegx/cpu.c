@@ -82,7 +82,7 @@ static void tilegx_cpu_reset(CPUState *s)
 
     tcc->parent_reset(s);
 
-    memset(env, 0, sizeof(CPUTLGState));
+    memset(env, 0, offsetof(CPUTLGState, end_reset_fields));
     tlb_flush(s, 1);
 }
 
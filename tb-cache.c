@@ -0,0 +1,546 @@
+/*
+ * Persistent translation cache for user-mode emulation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The blocks translated during a run are appended to a cache file when
+ * the process exits, and copied back into code_gen_buffer when a later
+ * run of the same executable is about to translate a block at the same
+ * guest PC, instead of translating it again.
+ *
+ * A cache file belongs to one guest executable and is only used by the
+ * same emulator binary, with the same CPU model, guest_base and prologue,
+ * on a host with the same CPU features as far as the backend uses them.
+ * Within the file, a block is looked up by pc, cs_base, flags and
+ * parallel_cpus, and is only used if the guest code it was translated
+ * from is identical to what is in memory now.  Thus shared libraries
+ * mapped at the same address in each run benefit too, and stale entries
+ * are simply ignored.
+ *
+ * The host code of each block is stored along with the references that
+ * the backend recorded to addresses outside of the block, so that it can
+ * be relocated to wherever code_gen_ptr happens to be.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+#include "qemu-common.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "exec/cpu_ldst.h"
+#include "tcg.h"
+#include "qemu/log.h"
+#include "exec/tb-cache.h"
+
+#if defined(TARGET_TB_RELOCATABLE) && TCG_TARGET_IMPLEMENTS_CODE_RELOCS \
+    && defined(USE_DIRECT_JUMP)
+#define TB_CACHE_SUPPORTED
+#endif
+
+bool tb_cache_active;
+
+#ifdef TB_CACHE_SUPPORTED
+
+#define TB_CACHE_MAGIC    "QEMUTBC"
+#define TB_CACHE_VERSION  3
+
+/* Stop recording new blocks once the file would grow beyond this.  */
+#define TB_CACHE_MAX_SIZE (64 * 1024 * 1024)
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t prologue_size;
+    /* The emulator binary that generated the code.  */
+    uint64_t host_dev;
+    uint64_t host_ino;
+    uint64_t host_size;
+    uint64_t host_mtime;
+    uint64_t guest_base;
+    /* The host instructions the backend may use.  */
+    uint32_t host_features;
+    uint32_t reserved;
+    char cpu_model[32];
+    /* Followed by a copy of the prologue, padded to 8 bytes,
+       and then by the entries.  */
+} TBCacheHeader;
+
+enum {
+    TB_CACHE_RELOC_HOST,        /* pc-relative, into the emulator binary */
+    TB_CACHE_RELOC_PROLOGUE,    /* pc-relative, into the prologue */
+    TB_CACHE_RELOC_TB,          /* absolute, the TB itself */
+};
+
+typedef struct TBCacheReloc {
+    uint32_t offset;
+    uint32_t type;
+    /* Offset from the start of the binary or the prologue,
+       or the addend to the TB address.  */
+    int64_t value;
+} TBCacheReloc;
+
+typedef struct TBCacheEntry {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint32_t flags;
+    uint16_t size;
+    uint16_t nb_relocs;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint32_t code_size;
+    uint32_t search_size;
+    /* parallel_cpus when translated, which selects atomic or plain
+       accesses for the guest's atomic operations.  */
+    uint32_t parallel;
+    uint32_t reserved;
+    /* Followed by the relocations, the guest code, and the host code
+       and search data, padded to 8 bytes.  */
+} TBCacheEntry;
+
+typedef struct TBCacheKey {
+    target_ulong pc;
+    target_ulong cs_base;
+    uint32_t flags;
+    bool parallel;
+} TBCacheKey;
+
+static char *tb_cache_path;
+static TBCacheHeader tb_cache_header;
+
+/* Base address for TB_CACHE_RELOC_HOST.  */
+#define TB_CACHE_HOST_BASE ((uintptr_t)tb_cache_init)
+
+/* The cache file loaded at startup, and the offset of its first entry.
+   The mapping only extends over the entries found to be well-formed.  */
+static void *tb_cache_map;
+static size_t tb_cache_map_size;
+static size_t tb_cache_map_entries;
+
+/* Maps a guest pc to the GSList of its loaded entries.  */
+static GHashTable *tb_cache_index;
+
+/* The entries recorded in this run, and the set of their TBCacheKeys.  */
+static GByteArray *tb_cache_new;
+static GHashTable *tb_cache_recorded;
+
+static size_t tb_cache_prologue_size(void)
+{
+    return tcg_ctx.code_gen_buffer - tcg_ctx.code_gen_prologue;
+}
+
+static size_t tb_cache_entries_offset(void)
+{
+    return sizeof(TBCacheHeader) + ROUND_UP(tb_cache_prologue_size(), 8);
+}
+
+static const TBCacheReloc *entry_relocs(const TBCacheEntry *e)
+{
+    return (const TBCacheReloc *)(e + 1);
+}
+
+static const uint8_t *entry_guest_code(const TBCacheEntry *e)
+{
+    return (const uint8_t *)(entry_relocs(e) + e->nb_relocs);
+}
+
+static const uint8_t *entry_host_code(const TBCacheEntry *e)
+{
+    return entry_guest_code(e) + e->size;
+}
+
+static size_t entry_length(const TBCacheEntry *e)
+{
+    return ROUND_UP(sizeof(TBCacheEntry)
+                    + e->nb_relocs * sizeof(TBCacheReloc)
+                    + e->size + e->code_size + e->search_size, 8);
+}
+
+static guint tb_cache_key_hash(gconstpointer p)
+{
+    const TBCacheKey *k = p;
+
+    return (guint)k->pc ^ (guint)k->cs_base ^ k->flags ^ k->parallel;
+}
+
+static gboolean tb_cache_key_equal(gconstpointer a, gconstpointer b)
+{
+    const TBCacheKey *ka = a;
+    const TBCacheKey *kb = b;
+
+    return ka->pc == kb->pc && ka->cs_base == kb->cs_base
+        && ka->flags == kb->flags && ka->parallel == kb->parallel;
+}
+
+static bool tb_cache_entry_valid(const TBCacheEntry *e, size_t avail)
+{
+    const TBCacheReloc *r;
+    int i;
+
+    if (avail < sizeof(TBCacheEntry) || entry_length(e) > avail
+        || e->size == 0 || e->code_size == 0) {
+        return false;
+    }
+    r = entry_relocs(e);
+    for (i = 0; i < e->nb_relocs; i++) {
+        if (r[i].offset + 8 > e->code_size) {
+            return false;
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        if (e->tb_jmp_offset[i] != 0xffff
+            && e->tb_jmp_offset[i] + 4 > e->code_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void tb_cache_load(void)
+{
+    size_t prologue_size = tb_cache_prologue_size();
+    struct stat st;
+    size_t ofs;
+    void *map;
+    int fd;
+
+    fd = open(tb_cache_path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < tb_cache_entries_offset()) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    if (memcmp(map, &tb_cache_header, sizeof(TBCacheHeader)) != 0
+        || memcmp(map + sizeof(TBCacheHeader), tcg_ctx.code_gen_prologue,
+                  prologue_size) != 0) {
+        munmap(map, st.st_size);
+        return;
+    }
+
+    ofs = tb_cache_entries_offset();
+    while (ofs < st.st_size) {
+        const TBCacheEntry *e = map + ofs;
+        gpointer key;
+
+        if (!tb_cache_entry_valid(e, st.st_size - ofs)) {
+            break;
+        }
+        key = (gpointer)(uintptr_t)e->pc;
+        g_hash_table_insert(tb_cache_index, key,
+                            g_slist_prepend(g_hash_table_lookup(tb_cache_index,
+                                                                key),
+                                            (gpointer)e));
+        ofs += entry_length(e);
+    }
+
+    tb_cache_map = map;
+    tb_cache_map_size = st.st_size;
+    tb_cache_map_entries = ofs;
+}
+
+void tb_cache_init(const char *dir, const char *exec_path,
+                   const char *cpu_model)
+{
+    TBCacheHeader *h = &tb_cache_header;
+    struct stat st;
+
+    /* Single-stepping and logging change what is translated
+       without changing the TB flags.  */
+    if (singlestep || qemu_loglevel) {
+        return;
+    }
+
+    if (stat("/proc/self/exe", &st) < 0) {
+        return;
+    }
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, TB_CACHE_MAGIC, sizeof(TB_CACHE_MAGIC));
+    h->version = TB_CACHE_VERSION;
+    h->prologue_size = tb_cache_prologue_size();
+    h->host_dev = st.st_dev;
+    h->host_ino = st.st_ino;
+    h->host_size = st.st_size;
+    h->host_mtime = st.st_mtime;
+    h->guest_base = guest_base;
+    h->host_features = tcg_target_host_features();
+    pstrcpy(h->cpu_model, sizeof(h->cpu_model), cpu_model);
+
+    if (stat(exec_path, &st) < 0) {
+        return;
+    }
+    tb_cache_path = g_strdup_printf("%s/%s-%" PRIx64 "-%" PRIx64
+                                    "-%" PRIx64 ".tbc", dir, TARGET_NAME,
+                                    (uint64_t)st.st_ino,
+                                    (uint64_t)st.st_size,
+                                    (uint64_t)st.st_mtime);
+
+    tb_cache_index = g_hash_table_new(NULL, NULL);
+    tb_cache_new = g_byte_array_new();
+    tb_cache_recorded = g_hash_table_new_full(tb_cache_key_hash,
+                                              tb_cache_key_equal,
+                                              g_free, NULL);
+    tb_cache_load();
+    tb_cache_active = true;
+}
+
+/* Check the guest code of a cached entry against the guest memory.  */
+static bool tb_cache_guest_code_matches(const TBCacheEntry *e)
+{
+    if (page_check_range(e->pc, e->size, PAGE_READ) < 0) {
+        return false;
+    }
+    return memcmp(g2h(e->pc), entry_guest_code(e), e->size) == 0;
+}
+
+/* Apply the relocations of a cached entry, whose code is now at BUF, and
+   which will be used by TB.  Return false if some reference is no longer
+   reachable from BUF.  */
+static bool tb_cache_relocate(const TBCacheEntry *e, TranslationBlock *tb,
+                              void *buf)
+{
+    const TBCacheReloc *r = entry_relocs(e);
+    int i;
+
+    for (i = 0; i < e->nb_relocs; i++) {
+        void *p = buf + r[i].offset;
+        uintptr_t target;
+        intptr_t disp;
+
+        switch (r[i].type) {
+        case TB_CACHE_RELOC_HOST:
+            target = TB_CACHE_HOST_BASE + r[i].value;
+            goto do_pc32;
+        case TB_CACHE_RELOC_PROLOGUE:
+            target = (uintptr_t)tcg_ctx.code_gen_prologue + r[i].value;
+        do_pc32:
+            disp = target - ((uintptr_t)p + 4);
+            if (disp != (int32_t)disp) {
+                return false;
+            }
+            stl_he_p(p, disp);
+            break;
+        case TB_CACHE_RELOC_TB:
+            stq_he_p(p, (uintptr_t)tb + r[i].value);
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+bool tb_cache_restore(TranslationBlock *tb, void *buf,
+                      int *code_size, int *search_size)
+{
+    GSList *l;
+
+    if (!tb_cache_enabled(tb->cflags)) {
+        return false;
+    }
+
+    l = g_hash_table_lookup(tb_cache_index, (gpointer)(uintptr_t)tb->pc);
+    for (; l != NULL; l = l->next) {
+        const TBCacheEntry *e = l->data;
+        size_t len = e->code_size + e->search_size;
+
+        if (e->cs_base != tb->cs_base || e->flags != tb->flags
+            || e->parallel != parallel_cpus
+            || !tb_cache_guest_code_matches(e)) {
+            continue;
+        }
+        if ((void *)buf + len > tcg_ctx.code_gen_highwater) {
+            /* Let the normal path flush the buffer.  */
+            return false;
+        }
+
+        memcpy(buf, entry_host_code(e), len);
+        if (!tb_cache_relocate(e, tb, buf)) {
+            continue;
+        }
+        flush_icache_range((uintptr_t)buf, (uintptr_t)buf + e->code_size);
+
+        tb->size = e->size;
+        tb->tb_next_offset[0] = e->tb_next_offset[0];
+        tb->tb_next_offset[1] = e->tb_next_offset[1];
+        tb->tb_jmp_offset[0] = e->tb_jmp_offset[0];
+        tb->tb_jmp_offset[1] = e->tb_jmp_offset[1];
+        *code_size = e->code_size;
+        *search_size = e->search_size;
+        return true;
+    }
+    return false;
+}
+
+/* Convert a reference recorded by the backend to the file format.  */
+static bool tb_cache_convert_reloc(TBCacheReloc *out, const TCGCodeReloc *r,
+                                   TranslationBlock *tb)
+{
+    uintptr_t prologue = (uintptr_t)tcg_ctx.code_gen_prologue;
+    uintptr_t buffer = (uintptr_t)tcg_ctx.code_gen_buffer;
+
+    out->offset = r->offset;
+    switch (r->type) {
+    case TCG_CODE_RELOC_PC32:
+        if (r->target >= prologue && r->target < buffer) {
+            out->type = TB_CACHE_RELOC_PROLOGUE;
+            out->value = r->target - prologue;
+        } else if (r->target >= buffer
+                   && r->target < buffer + tcg_ctx.code_gen_buffer_size) {
+            /* Another TB; cannot happen before chaining.  */
+            return false;
+        } else {
+            out->type = TB_CACHE_RELOC_HOST;
+            out->value = r->target - TB_CACHE_HOST_BASE;
+        }
+        return true;
+    case TCG_CODE_RELOC_ABS64:
+        /* Only exit_tb refers to the TB, possibly plus the exit index.  */
+        if (r->target - (uintptr_t)tb > TB_EXIT_MASK) {
+            return false;
+        }
+        out->type = TB_CACHE_RELOC_TB;
+        out->value = r->target - (uintptr_t)tb;
+        return true;
+    default:
+        return false;
+    }
+}
+
+void tb_cache_record(TranslationBlock *tb, int code_size, int search_size)
+{
+    TBCacheEntry e;
+    TBCacheKey *key;
+    size_t start;
+    int i;
+
+    if (!tb_cache_enabled(tb->cflags) || tcg_ctx.code_relocs_failed
+        || tb_cache_map_entries + tb_cache_new->len > TB_CACHE_MAX_SIZE) {
+        return;
+    }
+
+    /* Record each block only once, even if re-translated after a flush.  */
+    key = g_new(TBCacheKey, 1);
+    key->pc = tb->pc;
+    key->cs_base = tb->cs_base;
+    key->flags = tb->flags;
+    key->parallel = parallel_cpus;
+    if (g_hash_table_lookup_extended(tb_cache_recorded, key, NULL, NULL)) {
+        g_free(key);
+        return;
+    }
+    g_hash_table_insert(tb_cache_recorded, key, NULL);
+
+    memset(&e, 0, sizeof(e));
+    e.pc = tb->pc;
+    e.cs_base = tb->cs_base;
+    e.flags = tb->flags;
+    e.parallel = parallel_cpus;
+    e.size = tb->size;
+    e.nb_relocs = tcg_ctx.nb_code_relocs;
+    e.tb_next_offset[0] = tb->tb_next_offset[0];
+    e.tb_next_offset[1] = tb->tb_next_offset[1];
+    e.tb_jmp_offset[0] = tb->tb_jmp_offset[0];
+    e.tb_jmp_offset[1] = tb->tb_jmp_offset[1];
+    e.code_size = code_size;
+    e.search_size = search_size;
+
+    start = tb_cache_new->len;
+    g_byte_array_append(tb_cache_new, (const guint8 *)&e, sizeof(e));
+    for (i = 0; i < tcg_ctx.nb_code_relocs; i++) {
+        TBCacheReloc r;
+
+        if (!tb_cache_convert_reloc(&r, &tcg_ctx.code_relocs[i], tb)) {
+            g_byte_array_set_size(tb_cache_new, start);
+            return;
+        }
+        g_byte_array_append(tb_cache_new, (const guint8 *)&r, sizeof(r));
+    }
+    g_byte_array_append(tb_cache_new, g2h(tb->pc), tb->size);
+    g_byte_array_append(tb_cache_new, tb->tc_ptr, code_size + search_size);
+    g_byte_array_set_size(tb_cache_new, start + entry_length(&e));
+}
+
+void tb_cache_save(void)
+{
+    static const uint8_t zero[8];
+    size_t prologue_size;
+    char *tmp;
+    bool ok;
+    int fd;
+
+    if (!tb_cache_active) {
+        return;
+    }
+
+    tb_lock();
+    tb_cache_active = false;
+    if (tb_cache_new->len == 0) {
+        tb_unlock();
+        return;
+    }
+
+    /* Write a new file and rename it over the old one, so that
+       concurrent runs always see a complete file.  */
+    tmp = g_strdup_printf("%s.XXXXXX", tb_cache_path);
+    fd = mkstemp(tmp);
+    if (fd >= 0) {
+        prologue_size = tb_cache_prologue_size();
+        ok = qemu_write_full(fd, &tb_cache_header, sizeof(TBCacheHeader))
+                 == sizeof(TBCacheHeader)
+             && qemu_write_full(fd, tcg_ctx.code_gen_prologue, prologue_size)
+                 == prologue_size
+             && qemu_write_full(fd, zero, -prologue_size & 7)
+                 == (-prologue_size & 7);
+        if (ok && tb_cache_map) {
+            size_t ofs = tb_cache_entries_offset();
+            size_t len = tb_cache_map_entries - ofs;
+
+            ok = qemu_write_full(fd, tb_cache_map + ofs, len) == len;
+        }
+        if (ok) {
+            ok = qemu_write_full(fd, tb_cache_new->data, tb_cache_new->len)
+                 == tb_cache_new->len;
+        }
+        close(fd);
+        if (!ok || rename(tmp, tb_cache_path) < 0) {
+            unlink(tmp);
+        }
+    }
+    g_free(tmp);
+    tb_unlock();
+}
+
+#else
+
+void tb_cache_init(const char *dir, const char *exec_path,
+                   const char *cpu_model)
+{
+    fprintf(stderr, "qemu: warning: the translation cache is not "
+            "supported for this host and target\n");
+}
+
+bool tb_cache_restore(TranslationBlock *tb, void *buf,
+                      int *code_size, int *search_size)
+{
+    return false;
+}
+
+void tb_cache_record(TranslationBlock *tb, int code_size, int search_size)
+{
+}
+
+void tb_cache_save(void)
+{
+}
+
+#endif
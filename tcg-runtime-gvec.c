@@ -0,0 +1,199 @@
+/*
+ * Generic vectorized operation runtime
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "tcg-gvec-desc.h"
+
+/* This file is compiled once, and thus we can't include the standard
+   "exec/helper-proto.h", which has includes that are target specific.  */
+
+#include "exec/helper-head.h"
+
+#define DEF_HELPER_FLAGS_3(name, flags, ret, t1, t2, t3) \
+  dh_ctype(ret) HELPER(name) (dh_ctype(t1), dh_ctype(t2), dh_ctype(t3));
+#define DEF_HELPER_FLAGS_4(name, flags, ret, t1, t2, t3, t4) \
+  dh_ctype(ret) HELPER(name) (dh_ctype(t1), dh_ctype(t2), dh_ctype(t3), \
+                              dh_ctype(t4));
+
+/* The remaining helpers are defined in tcg-runtime.c and cpu-exec.c.  */
+#define DEF_HELPER_FLAGS_1(name, flags, ret, t1)
+#define DEF_HELPER_FLAGS_2(name, flags, ret, t1, t2)
+
+#include "tcg-runtime.h"
+
+
+/* Virtually all hosts support 16-byte vectors.  Those that don't can emulate
+   them via GCC's generic vector extension.  This turns out to be simpler and
+   more reliable than getting the compiler to autovectorize.
+
+   In tcg-op-gvec.c, we asserted that the size of the data is a multiple
+   of 16, but the guest register files only guarantee 8-byte alignment,
+   so the vector types are declared with reduced alignment.  */
+
+#ifdef CONFIG_VECTOR16
+typedef uint8_t vec8 __attribute__((vector_size(16), aligned(8)));
+typedef uint16_t vec16 __attribute__((vector_size(16), aligned(8)));
+typedef uint32_t vec32 __attribute__((vector_size(16), aligned(8)));
+typedef uint64_t vec64 __attribute__((vector_size(16), aligned(8)));
+
+typedef int8_t svec8 __attribute__((vector_size(16), aligned(8)));
+typedef int16_t svec16 __attribute__((vector_size(16), aligned(8)));
+typedef int32_t svec32 __attribute__((vector_size(16), aligned(8)));
+typedef int64_t svec64 __attribute__((vector_size(16), aligned(8)));
+
+/* A vector comparison already produces all-ones or all-zeros lanes.  */
+#define DO_CMP0(X)  X
+#else
+typedef uint8_t vec8;
+typedef uint16_t vec16;
+typedef uint32_t vec32;
+typedef uint64_t vec64;
+
+typedef int8_t svec8;
+typedef int16_t svec16;
+typedef int32_t svec32;
+typedef int64_t svec64;
+
+/* A scalar comparison produces 0 or 1; widen that to 0 or -1.  */
+#define DO_CMP0(X)  -(X)
+#endif
+
+/* Clear the bytes of the destination between OPRSZ and MAXSZ.  */
+static inline void clear_high(void *d, intptr_t oprsz, uint32_t desc)
+{
+    intptr_t maxsz = simd_maxsz(desc);
+
+    if (unlikely(maxsz > oprsz)) {
+        memset(d + oprsz, 0, maxsz - oprsz);
+    }
+}
+
+void HELPER(gvec_mov)(void *d, void *a, uint32_t desc)
+{
+    intptr_t oprsz = simd_oprsz(desc);
+
+    memmove(d, a, oprsz);
+    clear_high(d, oprsz, desc);
+}
+
+void HELPER(gvec_not)(void *d, void *a, uint32_t desc)
+{
+    intptr_t oprsz = simd_oprsz(desc);
+    intptr_t i;
+
+    for (i = 0; i < oprsz; i += sizeof(vec64)) {
+        *(vec64 *)(d + i) = ~*(vec64 *)(a + i);
+    }
+    clear_high(d, oprsz, desc);
+}
+
+#define DO_2(NAME, TYPE, OP)                                            \
+void HELPER(NAME)(void *d, void *a, uint32_t desc)                      \
+{                                                                       \
+    intptr_t oprsz = simd_oprsz(desc);                                  \
+    intptr_t i;                                                         \
+                                                                        \
+    for (i = 0; i < oprsz; i += sizeof(TYPE)) {                         \
+        *(TYPE *)(d + i) = OP *(TYPE *)(a + i);                         \
+    }                                                                   \
+    clear_high(d, oprsz, desc);                                         \
+}
+
+DO_2(gvec_neg8, vec8, -)
+DO_2(gvec_neg16, vec16, -)
+DO_2(gvec_neg32, vec32, -)
+DO_2(gvec_neg64, vec64, -)
+
+#undef DO_2
+
+#define DO_3(NAME, TYPE, OP)                                            \
+void HELPER(NAME)(void *d, void *a, void *b, uint32_t desc)             \
+{                                                                       \
+    intptr_t oprsz = simd_oprsz(desc);                                  \
+    intptr_t i;                                                         \
+                                                                        \
+    for (i = 0; i < oprsz; i += sizeof(TYPE)) {                         \
+        *(TYPE *)(d + i) = *(TYPE *)(a + i) OP *(TYPE *)(b + i);        \
+    }                                                                   \
+    clear_high(d, oprsz, desc);                                         \
+}
+
+DO_3(gvec_add8, vec8, +)
+DO_3(gvec_add16, vec16, +)
+DO_3(gvec_add32, vec32, +)
+DO_3(gvec_add64, vec64, +)
+
+DO_3(gvec_sub8, vec8, -)
+DO_3(gvec_sub16, vec16, -)
+DO_3(gvec_sub32, vec32, -)
+DO_3(gvec_sub64, vec64, -)
+
+DO_3(gvec_and, vec64, &)
+DO_3(gvec_or, vec64, |)
+DO_3(gvec_xor, vec64, ^)
+DO_3(gvec_andc, vec64, & ~)
+DO_3(gvec_orc, vec64, | ~)
+
+#undef DO_3
+
+#define DO_SHIFT(NAME, TYPE, OP)                                        \
+void HELPER(NAME)(void *d, void *a, uint32_t desc)                      \
+{                                                                       \
+    intptr_t oprsz = simd_oprsz(desc);                                  \
+    int shift = simd_data(desc);                                        \
+    intptr_t i;                                                         \
+                                                                        \
+    for (i = 0; i < oprsz; i += sizeof(TYPE)) {                         \
+        *(TYPE *)(d + i) = *(TYPE *)(a + i) OP shift;                   \
+    }                                                                   \
+    clear_high(d, oprsz, desc);                                         \
+}
+
+DO_SHIFT(gvec_shl8i, vec8, <<)
+DO_SHIFT(gvec_shl16i, vec16, <<)
+DO_SHIFT(gvec_shl32i, vec32, <<)
+DO_SHIFT(gvec_shl64i, vec64, <<)
+
+DO_SHIFT(gvec_shr8i, vec8, >>)
+DO_SHIFT(gvec_shr16i, vec16, >>)
+DO_SHIFT(gvec_shr32i, vec32, >>)
+DO_SHIFT(gvec_shr64i, vec64, >>)
+
+DO_SHIFT(gvec_sar8i, svec8, >>)
+DO_SHIFT(gvec_sar16i, svec16, >>)
+DO_SHIFT(gvec_sar32i, svec32, >>)
+DO_SHIFT(gvec_sar64i, svec64, >>)
+
+#undef DO_SHIFT
+
+#define DO_CMP1(NAME, TYPE, OP)                                         \
+void HELPER(NAME)(void *d, void *a, void *b, uint32_t desc)             \
+{                                                                       \
+    intptr_t oprsz = simd_oprsz(desc);                                  \
+    intptr_t i;                                                         \
+                                                                        \
+    for (i = 0; i < oprsz; i += sizeof(TYPE)) {                         \
+        *(TYPE *)(d + i) = DO_CMP0(*(TYPE *)(a + i) OP *(TYPE *)(b + i)); \
+    }                                                                   \
+    clear_high(d, oprsz, desc);                                         \
+}
+
+#define DO_CMP2(SZ)                             \
+    DO_CMP1(gvec_eq##SZ, vec##SZ, ==)           \
+    DO_CMP1(gvec_ne##SZ, vec##SZ, !=)           \
+    DO_CMP1(gvec_lt##SZ, svec##SZ, <)           \
+    DO_CMP1(gvec_le##SZ, svec##SZ, <=)          \
+    DO_CMP1(gvec_ltu##SZ, vec##SZ, <)           \
+    DO_CMP1(gvec_leu##SZ, vec##SZ, <=)
+
+DO_CMP2(8)
+DO_CMP2(16)
+DO_CMP2(32)
+DO_CMP2(64)
+
+#undef DO_CMP1
+#undef DO_CMP2
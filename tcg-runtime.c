@@ -32,6 +32,13 @@
 #define DEF_HELPER_FLAGS_2(name, flags, ret, t1, t2) \
   dh_ctype(ret) HELPER(name) (dh_ctype(t1), dh_ctype(t2));
 
+/* The target specific helpers are defined in cpu-exec.c.  */
+#define DEF_HELPER_FLAGS_1(name, flags, ret, t1)
+
+/* The vector helpers are defined in tcg-runtime-gvec.c.  */
+#define DEF_HELPER_FLAGS_3(name, flags, ret, t1, t2, t3)
+#define DEF_HELPER_FLAGS_4(name, flags, ret, t1, t2, t3, t4)
+
 #include "tcg-runtime.h"
 
 
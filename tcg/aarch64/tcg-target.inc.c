@@ -360,6 +360,9 @@ typedef enum {
     I3510_EOR       = 0x4a000000,
     I3510_EON       = 0x4a200000,
     I3510_ANDS      = 0x6a000000,
+
+    /* System instructions.  */
+    NOP             = 0xd503201f,
 } AArch64Insn;
 
 static inline uint32_t tcg_in32(TCGContext *s)
@@ -797,6 +800,19 @@ static inline void tcg_out_goto(TCGContext *s, tcg_insn_unit *target)
     tcg_out_insn(s, 3206, B, offset);
 }
 
+/* Branch to TARGET, which may be anywhere in the code buffer (for instance
+   the epilogue, from a TB at the far end of a large buffer).  */
+static inline void tcg_out_goto_long(TCGContext *s, tcg_insn_unit *target)
+{
+    ptrdiff_t offset = target - s->code_ptr;
+    if (offset == sextract64(offset, 0, 26)) {
+        tcg_out_insn(s, 3206, B, offset);
+    } else {
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, (intptr_t)target);
+        tcg_out_insn(s, 3207, BR, TCG_REG_TMP);
+    }
+}
+
 static inline void tcg_out_goto_noaddr(TCGContext *s)
 {
     /* We pay attention here to not modify the branch target by reading from
@@ -830,13 +846,31 @@ static inline void tcg_out_call(TCGContext *s, tcg_insn_unit *target)
     }
 }
 
+/* goto_tb is an 8-byte aligned pair of instructions followed by BR TMP.
+   A target within the +-128MB range of B is reached with B + NOP, anything
+   else in the +-4GB range of ADRP with ADRP + ADD.  Both instructions are
+   replaced with a single 64-bit store, so a vCPU running the code sees
+   either the old or the new pair.  */
 void aarch64_tb_set_jmp_target(uintptr_t jmp_addr, uintptr_t addr)
 {
-    tcg_insn_unit *code_ptr = (tcg_insn_unit *)jmp_addr;
-    tcg_insn_unit *target = (tcg_insn_unit *)addr;
+    ptrdiff_t offset = addr - jmp_addr;
+    tcg_insn_unit i1, i2;
+    uint64_t pair;
 
-    reloc_pc26(code_ptr, target);
-    flush_icache_range(jmp_addr, jmp_addr + 4);
+    if (offset == sextract64(offset, 0, 28)) {
+        i1 = I3206_B | ((offset >> 2) & 0x3ffffff);
+        i2 = NOP;
+    } else {
+        offset = (addr >> 12) - (jmp_addr >> 12);
+        assert(offset == sextract64(offset, 0, 21));
+        i1 = I3406_ADRP | (offset & 3) << 29 | (offset & 0x1ffffc) << (5 - 2)
+             | TCG_REG_TMP;
+        i2 = I3401_ADDI | TCG_TYPE_I64 << 31 | (addr & 0xfff) << 10
+             | TCG_REG_TMP << 5 | TCG_REG_TMP;
+    }
+    pair = (uint64_t)i2 << 32 | i1;
+    atomic_set((uint64_t *)jmp_addr, pair);
+    flush_icache_range(jmp_addr, jmp_addr + 8);
 }
 
 static inline void tcg_out_goto_label(TCGContext *s, TCGLabel *l)
@@ -1287,7 +1321,7 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
     switch (opc) {
     case INDEX_op_exit_tb:
         tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_X0, a0);
-        tcg_out_goto(s, tb_ret_addr);
+        tcg_out_goto_long(s, tb_ret_addr);
         break;
 
     case INDEX_op_goto_tb:
@@ -1295,10 +1329,17 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
 #error "USE_DIRECT_JUMP required for aarch64"
 #endif
         assert(s->tb_jmp_offset != NULL); /* consistency for USE_DIRECT_JUMP */
+        /* The pair patched by aarch64_tb_set_jmp_target must be 8-byte
+           aligned so that it can be replaced atomically.  */
+        if ((uintptr_t)s->code_ptr & 7) {
+            tcg_out32(s, NOP);
+        }
         s->tb_jmp_offset[a0] = tcg_current_code_size(s);
-        /* actual branch destination will be patched by
-           aarch64_tb_set_jmp_target later, beware retranslation. */
-        tcg_out_goto_noaddr(s);
+        /* The actual destination is patched in later by
+           aarch64_tb_set_jmp_target; until then skip to the exit path.  */
+        tcg_out_insn(s, 3206, B, 3);
+        tcg_out32(s, NOP);
+        tcg_out_insn(s, 3207, BR, TCG_REG_TMP);
         s->tb_next_offset[a0] = tcg_current_code_size(s);
         break;
 
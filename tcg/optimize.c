@@ -44,6 +44,44 @@ struct tcg_temp_info {
 static struct tcg_temp_info temps[TCG_MAX_TEMPS];
 static TCGTempSet temps_used;
 
+/* What is known about a global or local temp on entry to a label.  */
+struct tcg_label_entry {
+    uint16_t temp;
+    bool is_const;
+    tcg_target_ulong val;
+    tcg_target_ulong mask;
+};
+
+struct tcg_label_info {
+    /* Set once the label has been seen while looking for loops.  */
+    bool defined;
+    /* The label is also branched to from after its definition.  */
+    bool loop;
+    /* The intersection of the state at each branch to the label seen
+       so far, or -1 if there has been no such branch yet.  */
+    int nb_entries;
+    struct tcg_label_entry *entries;
+};
+
+static struct tcg_label_info *labels;
+
+/* Whether the current op can be reached by falling through.  */
+static bool bb_reachable;
+
+/* A value loaded from, or stored to, a fixed offset from a fixed
+   register (i.e. env) that is still held in TEMP.  */
+struct tcg_load_info {
+    TCGOpcode opc;
+    TCGArg base;
+    intptr_t ofs;
+    TCGArg temp;
+};
+
+#define MAX_LOADS 32
+
+static struct tcg_load_info loads[MAX_LOADS];
+static int nb_loads;
+
 static inline bool temp_is_const(TCGArg arg)
 {
     return temps[arg].is_const;
@@ -71,6 +109,29 @@ static void reset_all_temps(int nb_temps)
     bitmap_zero(temps_used.l, nb_temps);
 }
 
+/* Reset everything which does not persist across the end of a basic
+   block, i.e. the normal temps.  */
+static void reset_bb_temps(TCGContext *s)
+{
+    int i, j;
+
+    for (i = find_next_bit(temps_used.l, s->nb_temps, s->nb_globals);
+         i < s->nb_temps;
+         i = find_next_bit(temps_used.l, s->nb_temps, i + 1)) {
+        if (!s->temps[i].temp_local) {
+            reset_temp(i);
+        }
+    }
+
+    for (i = j = 0; i < nb_loads; i++) {
+        TCGArg t = loads[i].temp;
+        if (t < s->nb_globals || s->temps[t].temp_local) {
+            loads[j++] = loads[i];
+        }
+    }
+    nb_loads = j;
+}
+
 /* Initialize and activate a temporary.  */
 static void init_temp_info(TCGArg temp)
 {
@@ -254,6 +315,283 @@ static void tcg_opt_gen_mov(TCGContext *s, TCGOp *op, TCGArg *args,
     args[1] = src;
 }
 
+/* Allocate the label state, and find the labels which are the target
+   of a backward branch, whose state on entry cannot be known from the
+   branches before them.  */
+static void init_label_info(TCGContext *s)
+{
+    int i, oi;
+
+    labels = tcg_malloc(sizeof(struct tcg_label_info) * s->nb_labels);
+    for (i = 0; i < s->nb_labels; i++) {
+        labels[i] = (struct tcg_label_info){ .nb_entries = -1 };
+    }
+
+    for (oi = s->gen_first_op_idx; oi >= 0; oi = s->gen_op_buf[oi].next) {
+        TCGOp *op = &s->gen_op_buf[oi];
+        TCGArg *args = &s->gen_opparam_buf[op->args];
+        TCGLabel *l;
+
+        switch (op->opc) {
+        case INDEX_op_set_label:
+            labels[arg_label(args[0])->id].defined = true;
+            continue;
+        case INDEX_op_br:
+            l = arg_label(args[0]);
+            break;
+        CASE_OP_32_64(brcond):
+            l = arg_label(args[3]);
+            break;
+        case INDEX_op_brcond2_i32:
+            l = arg_label(args[5]);
+            break;
+        default:
+            continue;
+        }
+        if (labels[l->id].defined) {
+            labels[l->id].loop = true;
+        }
+    }
+}
+
+/* Return true if we know something about TEMP that we could pass on
+   across a label.  */
+static bool temp_is_known(TCGContext *s, TCGArg temp)
+{
+    return test_bit(temp, temps_used.l)
+        && (temp < s->nb_globals || s->temps[temp].temp_local)
+        && (temps[temp].is_const || temps[temp].mask != -1);
+}
+
+/* Merge the current state of the globals and local temps into the state
+   on entry to label L.  */
+static void record_branch(TCGContext *s, TCGLabel *l)
+{
+    struct tcg_label_info *li = &labels[l->id];
+    int i, j;
+
+    if (li->loop) {
+        return;
+    }
+
+    if (li->nb_entries < 0) {
+        int n = 0;
+
+        for (i = 0; i < s->nb_temps; i++) {
+            n += temp_is_known(s, i);
+        }
+        li->entries = tcg_malloc(sizeof(struct tcg_label_entry) * n);
+        li->nb_entries = 0;
+        for (i = 0; i < s->nb_temps; i++) {
+            if (temp_is_known(s, i)) {
+                li->entries[li->nb_entries++] = (struct tcg_label_entry){
+                    .temp = i,
+                    .is_const = temps[i].is_const,
+                    .val = temps[i].val,
+                    .mask = temps[i].mask,
+                };
+            }
+        }
+        return;
+    }
+
+    for (i = j = 0; i < li->nb_entries; i++) {
+        struct tcg_label_entry e = li->entries[i];
+
+        if (!temp_is_known(s, e.temp)) {
+            continue;
+        }
+        if (!(e.is_const && temps[e.temp].is_const
+              && e.val == temps[e.temp].val)) {
+            e.is_const = false;
+            e.mask |= temps[e.temp].mask;
+            if (e.mask == -1) {
+                continue;
+            }
+        }
+        li->entries[j++] = e;
+    }
+    li->nb_entries = j;
+}
+
+/* Set up the state on entry to label L.  */
+static void enter_label(TCGContext *s, TCGLabel *l)
+{
+    struct tcg_label_info *li = &labels[l->id];
+    int i;
+
+    if (li->loop || (li->nb_entries < 0 && !bb_reachable)) {
+        reset_all_temps(s->nb_temps);
+        nb_loads = 0;
+        bb_reachable = true;
+        return;
+    }
+    if (li->nb_entries < 0) {
+        /* Only reached by falling through; nothing is lost
+           except what dies at the end of any basic block.  */
+        reset_bb_temps(s);
+        return;
+    }
+
+    if (bb_reachable) {
+        record_branch(s, l);
+    }
+    reset_all_temps(s->nb_temps);
+    nb_loads = 0;
+    bb_reachable = true;
+    for (i = 0; i < li->nb_entries; i++) {
+        struct tcg_label_entry *e = &li->entries[i];
+
+        init_temp_info(e->temp);
+        temps[e->temp].is_const = e->is_const;
+        temps[e->temp].val = e->val;
+        temps[e->temp].mask = e->mask;
+    }
+}
+
+/* Update the state after OP, which ends a basic block.  */
+static void finish_bb(TCGContext *s, TCGOpcode opc, TCGArg *args)
+{
+    switch (opc) {
+    case INDEX_op_set_label:
+        enter_label(s, arg_label(args[0]));
+        return;
+    CASE_OP_32_64(brcond):
+        record_branch(s, arg_label(args[3]));
+        reset_bb_temps(s);
+        return;
+    case INDEX_op_brcond2_i32:
+        record_branch(s, arg_label(args[5]));
+        reset_bb_temps(s);
+        return;
+    case INDEX_op_br:
+        record_branch(s, arg_label(args[0]));
+        break;
+    default:
+        break;
+    }
+
+    reset_all_temps(s->nb_temps);
+    nb_loads = 0;
+    /* Execution continues after goto_tb until the jump is patched.  */
+    if (opc != INDEX_op_goto_tb) {
+        bb_reachable = false;
+    }
+}
+
+/* Return the access size of a load or store op, or 0 for other ops.  */
+static int ldst_size(TCGOpcode opc)
+{
+    switch (opc) {
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(st8):
+        return 1;
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+    CASE_OP_32_64(st16):
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static void add_load(TCGOpcode opc, TCGArg base, intptr_t ofs, TCGArg temp)
+{
+    if (nb_loads == MAX_LOADS) {
+        memmove(loads, loads + 1, sizeof(loads[0]) * (MAX_LOADS - 1));
+        nb_loads--;
+    }
+    loads[nb_loads++] = (struct tcg_load_info){
+        .opc = opc, .base = base, .ofs = ofs, .temp = temp
+    };
+}
+
+/* Track the values of the fields of env held in temps, so that loads
+   from env can be replaced by a copy of the temp.  Nothing but explicit
+   stores and helper calls modify env during a TB: memory accesses do
+   not even reload the globals.  Return true if OP has been replaced.  */
+static bool optimize_env_access(TCGContext *s, TCGOp *op, TCGArg *args,
+                                int nb_oargs)
+{
+    TCGOpcode opc = op->opc;
+    int size = ldst_size(opc);
+    TCGArg src = -1;
+    int i, j;
+
+    if (opc == INDEX_op_call) {
+        nb_loads = 0;
+        return false;
+    }
+
+    if (size && nb_oargs == 1 && s->temps[args[1]].fixed_reg) {
+        /* A load from env.  */
+        for (i = 0; i < nb_loads; i++) {
+            if (loads[i].opc == opc && loads[i].base == args[1]
+                && loads[i].ofs == (intptr_t)args[2]) {
+                src = loads[i].temp;
+                break;
+            }
+        }
+    }
+
+    /* Forget the values held in the outputs, which are overwritten.  */
+    for (i = 0; i < nb_oargs; i++) {
+        if (args[i] == src) {
+            continue;
+        }
+        for (j = 0; j < nb_loads; j++) {
+            if (loads[j].temp == args[i]) {
+                loads[j--] = loads[--nb_loads];
+            }
+        }
+    }
+
+    if (src != -1) {
+        tcg_opt_gen_mov(s, op, args, args[0], src);
+        return true;
+    }
+    if (size == 0) {
+        return false;
+    }
+    if (nb_oargs == 1) {
+        if (s->temps[args[1]].fixed_reg) {
+            add_load(opc, args[1], args[2], args[0]);
+        }
+        return false;
+    }
+
+    /* A store, which may alias anything unless it is to env.  */
+    if (!s->temps[args[1]].fixed_reg) {
+        nb_loads = 0;
+        return false;
+    }
+    for (j = 0; j < nb_loads; j++) {
+        if (loads[j].base != args[1]
+            || (loads[j].ofs < (intptr_t)args[2] + size
+                && (intptr_t)args[2] < loads[j].ofs
+                                       + ldst_size(loads[j].opc))) {
+            loads[j--] = loads[--nb_loads];
+        }
+    }
+    /* Later loads of the full value can use the stored temp.  */
+    if (opc == INDEX_op_st_i32) {
+        add_load(INDEX_op_ld_i32, args[1], args[2], args[0]);
+    } else if (opc == INDEX_op_st_i64) {
+        add_load(INDEX_op_ld_i64, args[1], args[2], args[0]);
+    }
+    return false;
+}
+
 static TCGArg do_constant_folding_2(TCGOpcode op, TCGArg x, TCGArg y)
 {
     uint64_t l64, h64;
@@ -583,6 +921,9 @@ void tcg_optimize(TCGContext *s)
     nb_temps = s->nb_temps;
     nb_globals = s->nb_globals;
     reset_all_temps(nb_temps);
+    nb_loads = 0;
+    bb_reachable = true;
+    init_label_info(s);
 
     for (oi = s->gen_first_op_idx; oi >= 0; oi = oi_next) {
         tcg_target_ulong mask, partmask, affected;
@@ -622,6 +963,11 @@ void tcg_optimize(TCGContext *s)
             }
         }
 
+        /* Eliminate redundant loads from env */
+        if (optimize_env_access(s, op, args, nb_oargs)) {
+            continue;
+        }
+
         /* For commutative operations make constant second argument */
         switch (opc) {
         CASE_OP_32_64(add):
@@ -1092,9 +1438,9 @@ void tcg_optimize(TCGContext *s)
             tmp = do_constant_folding_cond(opc, args[0], args[1], args[2]);
             if (tmp != 2) {
                 if (tmp) {
-                    reset_all_temps(nb_temps);
                     op->opc = INDEX_op_br;
                     args[0] = args[3];
+                    finish_bb(s, INDEX_op_br, args);
                 } else {
                     tcg_op_remove(s, op);
                 }
@@ -1166,9 +1512,9 @@ void tcg_optimize(TCGContext *s)
             if (tmp != 2) {
                 if (tmp) {
             do_brcond_true:
-                    reset_all_temps(nb_temps);
                     op->opc = INDEX_op_br;
                     args[0] = args[5];
+                    finish_bb(s, INDEX_op_br, args);
                 } else {
             do_brcond_false:
                     tcg_op_remove(s, op);
@@ -1179,12 +1525,12 @@ void tcg_optimize(TCGContext *s)
                 /* Simplify LT/GE comparisons vs zero to a single compare
                    vs the high word of the input.  */
             do_brcond_high:
-                reset_all_temps(nb_temps);
                 op->opc = INDEX_op_brcond_i32;
                 args[0] = args[1];
                 args[1] = args[3];
                 args[2] = args[4];
                 args[3] = args[5];
+                finish_bb(s, INDEX_op_brcond_i32, args);
             } else if (args[4] == TCG_COND_EQ) {
                 /* Simplify EQ comparisons where one of the pairs
                    can be simplified.  */
@@ -1203,11 +1549,11 @@ void tcg_optimize(TCGContext *s)
                     goto do_default;
                 }
             do_brcond_low:
-                reset_all_temps(nb_temps);
                 op->opc = INDEX_op_brcond_i32;
                 args[1] = args[2];
                 args[2] = args[4];
                 args[3] = args[5];
+                finish_bb(s, INDEX_op_brcond_i32, args);
             } else if (args[4] == TCG_COND_NE) {
                 /* Simplify NE comparisons where one of the pairs
                    can be simplified.  */
@@ -1309,11 +1655,11 @@ void tcg_optimize(TCGContext *s)
         do_default:
             /* Default case: we know nothing about operation (or were unable
                to compute the operation result) so no propagation is done.
-               We trash everything if the operation is the end of a basic
-               block, otherwise we only trash the output args.  "mask" is
+               At the end of a basic block see finish_bb, otherwise we
+               only trash the output args.  "mask" is
                the non-zero bits mask for the first output arg.  */
             if (def->flags & TCG_OPF_BB_END) {
-                reset_all_temps(nb_temps);
+                finish_bb(s, opc, args);
             } else {
         do_reset_output:
                 for (i = 0; i < nb_oargs; i++) {
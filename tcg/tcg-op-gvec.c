@@ -0,0 +1,906 @@
+/*
+ * Generic vector operation expansion
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "tcg.h"
+#include "tcg-op.h"
+#include "tcg-op-gvec.h"
+#include "tcg-gvec-desc.h"
+
+/* Vectors of up to this many bytes are expanded inline.  */
+#define MAX_UNROLL  32
+
+/* Verify vector size and alignment rules.  OFS should be the OR of all
+   of the operand offsets so that we can check them all at once.  */
+static void check_size_align(uint32_t oprsz, uint32_t maxsz, uint32_t ofs)
+{
+    uint32_t opr_align = oprsz >= 16 ? 15 : 7;
+    uint32_t max_align = maxsz >= 16 || oprsz >= 16 ? 15 : 7;
+
+    tcg_debug_assert(oprsz > 0);
+    tcg_debug_assert(oprsz <= maxsz);
+    tcg_debug_assert(maxsz <= (8 << SIMD_MAXSZ_BITS));
+    tcg_debug_assert((oprsz & opr_align) == 0);
+    tcg_debug_assert((maxsz & max_align) == 0);
+    tcg_debug_assert((ofs & 7) == 0);
+}
+
+/* Verify vector overlap rules for two operands.  */
+static void check_overlap_2(uint32_t d, uint32_t a, uint32_t s)
+{
+    tcg_debug_assert(d == a || d + s <= a || a + s <= d);
+}
+
+/* Verify vector overlap rules for three operands.  */
+static void check_overlap_3(uint32_t d, uint32_t a, uint32_t b, uint32_t s)
+{
+    check_overlap_2(d, a, s);
+    check_overlap_2(d, b, s);
+    check_overlap_2(a, b, s);
+}
+
+/* Create a descriptor from components.  */
+uint32_t simd_desc(uint32_t oprsz, uint32_t maxsz, int32_t data)
+{
+    uint32_t desc = 0;
+
+    tcg_debug_assert(oprsz % 8 == 0 && oprsz <= (8 << SIMD_OPRSZ_BITS));
+    tcg_debug_assert(maxsz % 8 == 0 && maxsz <= (8 << SIMD_MAXSZ_BITS));
+    tcg_debug_assert(data == sextract32(data, 0, SIMD_DATA_BITS));
+
+    oprsz = (oprsz / 8) - 1;
+    maxsz = (maxsz / 8) - 1;
+    desc = deposit32(desc, SIMD_OPRSZ_SHIFT, SIMD_OPRSZ_BITS, oprsz);
+    desc = deposit32(desc, SIMD_MAXSZ_SHIFT, SIMD_MAXSZ_BITS, maxsz);
+    desc = deposit32(desc, SIMD_DATA_SHIFT, SIMD_DATA_BITS, data);
+
+    return desc;
+}
+
+/* Generate a call to a gvec-style helper with two vector operands.  */
+void tcg_gen_gvec_2_ool(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                        uint32_t oprsz, uint32_t maxsz, int32_t data,
+                        gen_helper_gvec_2 *fn)
+{
+    TCGv_ptr a0, a1;
+    TCGv_i32 desc = tcg_const_i32(simd_desc(oprsz, maxsz, data));
+
+    a0 = tcg_temp_new_ptr();
+    a1 = tcg_temp_new_ptr();
+
+    tcg_gen_addi_ptr(a0, env, dofs);
+    tcg_gen_addi_ptr(a1, env, aofs);
+
+    fn(a0, a1, desc);
+
+    tcg_temp_free_ptr(a0);
+    tcg_temp_free_ptr(a1);
+    tcg_temp_free_i32(desc);
+}
+
+/* Generate a call to a gvec-style helper with three vector operands.  */
+void tcg_gen_gvec_3_ool(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                        uint32_t bofs, uint32_t oprsz, uint32_t maxsz,
+                        int32_t data, gen_helper_gvec_3 *fn)
+{
+    TCGv_ptr a0, a1, a2;
+    TCGv_i32 desc = tcg_const_i32(simd_desc(oprsz, maxsz, data));
+
+    a0 = tcg_temp_new_ptr();
+    a1 = tcg_temp_new_ptr();
+    a2 = tcg_temp_new_ptr();
+
+    tcg_gen_addi_ptr(a0, env, dofs);
+    tcg_gen_addi_ptr(a1, env, aofs);
+    tcg_gen_addi_ptr(a2, env, bofs);
+
+    fn(a0, a1, a2, desc);
+
+    tcg_temp_free_ptr(a0);
+    tcg_temp_free_ptr(a1);
+    tcg_temp_free_ptr(a2);
+    tcg_temp_free_i32(desc);
+}
+
+/* Store IN to the SIZE bytes at DOFS.  */
+static void do_dup_store(TCGv_ptr env, uint32_t dofs, uint32_t size,
+                         TCGv_i64 in)
+{
+    uint32_t i;
+
+    for (i = 0; i < size; i += 8) {
+        tcg_gen_st_i64(in, env, dofs + i);
+    }
+}
+
+/* Clear the SIZE bytes at DOFS.  */
+static void expand_clr(TCGv_ptr env, uint32_t dofs, uint32_t size)
+{
+    if (size) {
+        TCGv_i64 zero = tcg_const_i64(0);
+        do_dup_store(env, dofs, size, zero);
+        tcg_temp_free_i64(zero);
+    }
+}
+
+/* Expand OPSZ bytes worth of two-operand operations using i64 elements.  */
+static void expand_2_i64(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                         uint32_t oprsz, void (*fni)(TCGv_i64, TCGv_i64))
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, env, aofs + i);
+        fni(t0, t0);
+        tcg_gen_st_i64(t0, env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+}
+
+/* Likewise, with a constant operand.  */
+static void expand_2i_i64(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                          uint32_t oprsz, int64_t c,
+                          void (*fni)(TCGv_i64, TCGv_i64, int64_t))
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, env, aofs + i);
+        fni(t0, t0, c);
+        tcg_gen_st_i64(t0, env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+}
+
+/* Expand OPSZ bytes worth of three-operand operations using i64 elements.  */
+static void expand_3_i64(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                         uint32_t bofs, uint32_t oprsz,
+                         void (*fni)(TCGv_i64, TCGv_i64, TCGv_i64))
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, env, aofs + i);
+        tcg_gen_ld_i64(t1, env, bofs + i);
+        fni(t0, t0, t1);
+        tcg_gen_st_i64(t0, env, dofs + i);
+    }
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t0);
+}
+
+/* Expand a vector two-operand operation.  */
+void tcg_gen_gvec_2(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                    uint32_t oprsz, uint32_t maxsz, const GVecGen2 *g)
+{
+    check_size_align(oprsz, maxsz, dofs | aofs);
+    check_overlap_2(dofs, aofs, maxsz);
+
+    if (g->fni8 && oprsz <= MAX_UNROLL) {
+        expand_2_i64(env, dofs, aofs, oprsz, g->fni8);
+        expand_clr(env, dofs + oprsz, maxsz - oprsz);
+    } else {
+        tcg_debug_assert(oprsz >= 16);
+        tcg_gen_gvec_2_ool(env, dofs, aofs, oprsz, maxsz, 0, g->fno);
+    }
+}
+
+/* Expand a vector operation with a constant operand.  */
+void tcg_gen_gvec_2i(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                     uint32_t oprsz, uint32_t maxsz, int64_t c,
+                     const GVecGen2i *g)
+{
+    check_size_align(oprsz, maxsz, dofs | aofs);
+    check_overlap_2(dofs, aofs, maxsz);
+
+    if (g->fni8 && oprsz <= MAX_UNROLL) {
+        expand_2i_i64(env, dofs, aofs, oprsz, c, g->fni8);
+        expand_clr(env, dofs + oprsz, maxsz - oprsz);
+    } else {
+        tcg_debug_assert(oprsz >= 16);
+        tcg_gen_gvec_2_ool(env, dofs, aofs, oprsz, maxsz, c, g->fno);
+    }
+}
+
+/* Expand a vector three-operand operation.  */
+void tcg_gen_gvec_3(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                    uint32_t bofs, uint32_t oprsz, uint32_t maxsz,
+                    const GVecGen3 *g)
+{
+    check_size_align(oprsz, maxsz, dofs | aofs | bofs);
+    check_overlap_3(dofs, aofs, bofs, maxsz);
+
+    if (g->fni8 && oprsz <= MAX_UNROLL) {
+        expand_3_i64(env, dofs, aofs, bofs, oprsz, g->fni8);
+        expand_clr(env, dofs + oprsz, maxsz - oprsz);
+    } else {
+        tcg_debug_assert(oprsz >= 16);
+        tcg_gen_gvec_3_ool(env, dofs, aofs, bofs, oprsz, maxsz, 0, g->fno);
+    }
+}
+
+/*
+ * Expand specific vector operations.
+ */
+
+void tcg_gen_gvec_mov(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen2 g = {
+        .fni8 = tcg_gen_mov_i64,
+        .fno = gen_helper_gvec_mov,
+    };
+
+    if (dofs != aofs) {
+        tcg_gen_gvec_2(env, dofs, aofs, oprsz, maxsz, &g);
+    } else {
+        check_size_align(oprsz, maxsz, dofs);
+        expand_clr(env, dofs + oprsz, maxsz - oprsz);
+    }
+}
+
+/* Replicate the low 1 << VECE bytes of IN into all of OUT.  */
+static void gen_dup_i64(unsigned vece, TCGv_i64 out, TCGv_i64 in)
+{
+    switch (vece) {
+    case MO_8:
+        tcg_gen_ext8u_i64(out, in);
+        tcg_gen_muli_i64(out, out, 0x0101010101010101ull);
+        break;
+    case MO_16:
+        tcg_gen_ext16u_i64(out, in);
+        tcg_gen_muli_i64(out, out, 0x0001000100010001ull);
+        break;
+    case MO_32:
+        tcg_gen_deposit_i64(out, in, in, 32, 32);
+        break;
+    case MO_64:
+        tcg_gen_mov_i64(out, in);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+void tcg_gen_gvec_dup_i32(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                          uint32_t oprsz, uint32_t maxsz, TCGv_i32 in)
+{
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    tcg_debug_assert(vece <= MO_32);
+    tcg_gen_extu_i32_i64(t, in);
+    tcg_gen_gvec_dup_i64(env, vece, dofs, oprsz, maxsz, t);
+    tcg_temp_free_i64(t);
+}
+
+void tcg_gen_gvec_dup_i64(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                          uint32_t oprsz, uint32_t maxsz, TCGv_i64 in)
+{
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    check_size_align(oprsz, maxsz, dofs);
+    gen_dup_i64(vece, t, in);
+    do_dup_store(env, dofs, oprsz, t);
+    expand_clr(env, dofs + oprsz, maxsz - oprsz);
+    tcg_temp_free_i64(t);
+}
+
+void tcg_gen_gvec_dup_mem(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                          uint32_t aofs, uint32_t oprsz, uint32_t maxsz)
+{
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    switch (vece) {
+    case MO_8:
+        tcg_gen_ld8u_i64(t, env, aofs);
+        break;
+    case MO_16:
+        tcg_gen_ld16u_i64(t, env, aofs);
+        break;
+    case MO_32:
+        tcg_gen_ld32u_i64(t, env, aofs);
+        break;
+    case MO_64:
+        tcg_gen_ld_i64(t, env, aofs);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    tcg_gen_gvec_dup_i64(env, vece, dofs, oprsz, maxsz, t);
+    tcg_temp_free_i64(t);
+}
+
+void tcg_gen_gvec_dupi(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t oprsz, uint32_t maxsz, uint64_t c)
+{
+    TCGv_i64 t = tcg_const_i64(dup_const(vece, c));
+
+    check_size_align(oprsz, maxsz, dofs);
+    do_dup_store(env, dofs, oprsz, t);
+    expand_clr(env, dofs + oprsz, maxsz - oprsz);
+    tcg_temp_free_i64(t);
+}
+
+void tcg_gen_gvec_not(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen2 g = {
+        .fni8 = tcg_gen_not_i64,
+        .fno = gen_helper_gvec_not,
+    };
+    tcg_gen_gvec_2(env, dofs, aofs, oprsz, maxsz, &g);
+}
+
+/* Perform a vector addition using normal addition and a mask.  The mask
+   should be the sign bit of each lane.  This 6-operation form is more
+   efficient than separate additions when there are 4 or more lanes in
+   the 64-bit operation.  */
+static void gen_addv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andc_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+void tcg_gen_vec_add8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m = tcg_const_i64(dup_const(MO_8, 0x80));
+    gen_addv_mask(d, a, b, m);
+    tcg_temp_free_i64(m);
+}
+
+void tcg_gen_vec_add16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m = tcg_const_i64(dup_const(MO_16, 0x8000));
+    gen_addv_mask(d, a, b, m);
+    tcg_temp_free_i64(m);
+}
+
+void tcg_gen_vec_add32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, a, ~0xffffffffull);
+    tcg_gen_add_i64(t2, a, b);
+    tcg_gen_add_i64(t1, t1, b);
+    tcg_gen_deposit_i64(d, t1, t2, 0, 32);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+void tcg_gen_gvec_add(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen3 g[4] = {
+        { .fni8 = tcg_gen_vec_add8_i64,
+          .fno = gen_helper_gvec_add8 },
+        { .fni8 = tcg_gen_vec_add16_i64,
+          .fno = gen_helper_gvec_add16 },
+        { .fni8 = tcg_gen_vec_add32_i64,
+          .fno = gen_helper_gvec_add32 },
+        { .fni8 = tcg_gen_add_i64,
+          .fno = gen_helper_gvec_add64 },
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    tcg_gen_gvec_3(env, dofs, aofs, bofs, oprsz, maxsz, &g[vece]);
+}
+
+/* Perform a vector subtraction using normal subtraction and a mask.
+   Compare gen_addv_mask above.  */
+static void gen_subv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_or_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+void tcg_gen_vec_sub8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m = tcg_const_i64(dup_const(MO_8, 0x80));
+    gen_subv_mask(d, a, b, m);
+    tcg_temp_free_i64(m);
+}
+
+void tcg_gen_vec_sub16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m = tcg_const_i64(dup_const(MO_16, 0x8000));
+    gen_subv_mask(d, a, b, m);
+    tcg_temp_free_i64(m);
+}
+
+void tcg_gen_vec_sub32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, b, ~0xffffffffull);
+    tcg_gen_sub_i64(t2, a, b);
+    tcg_gen_sub_i64(t1, a, t1);
+    tcg_gen_deposit_i64(d, t1, t2, 0, 32);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+void tcg_gen_gvec_sub(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen3 g[4] = {
+        { .fni8 = tcg_gen_vec_sub8_i64,
+          .fno = gen_helper_gvec_sub8 },
+        { .fni8 = tcg_gen_vec_sub16_i64,
+          .fno = gen_helper_gvec_sub16 },
+        { .fni8 = tcg_gen_vec_sub32_i64,
+          .fno = gen_helper_gvec_sub32 },
+        { .fni8 = tcg_gen_sub_i64,
+          .fno = gen_helper_gvec_sub64 },
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    tcg_gen_gvec_3(env, dofs, aofs, bofs, oprsz, maxsz, &g[vece]);
+}
+
+/* Perform a vector negation using normal negation and a mask.
+   Compare gen_subv_mask above.  */
+static void gen_negv_mask(TCGv_i64 d, TCGv_i64 b, TCGv_i64 m)
+{
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andc_i64(t3, m, b);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_sub_i64(d, m, t2);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+void tcg_gen_vec_neg8_i64(TCGv_i64 d, TCGv_i64 b)
+{
+    TCGv_i64 m = tcg_const_i64(dup_const(MO_8, 0x80));
+    gen_negv_mask(d, b, m);
+    tcg_temp_free_i64(m);
+}
+
+void tcg_gen_vec_neg16_i64(TCGv_i64 d, TCGv_i64 b)
+{
+    TCGv_i64 m = tcg_const_i64(dup_const(MO_16, 0x8000));
+    gen_negv_mask(d, b, m);
+    tcg_temp_free_i64(m);
+}
+
+void tcg_gen_vec_neg32_i64(TCGv_i64 d, TCGv_i64 b)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, b, ~0xffffffffull);
+    tcg_gen_neg_i64(t2, b);
+    tcg_gen_neg_i64(t1, t1);
+    tcg_gen_deposit_i64(d, t1, t2, 0, 32);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+void tcg_gen_gvec_neg(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen2 g[4] = {
+        { .fni8 = tcg_gen_vec_neg8_i64,
+          .fno = gen_helper_gvec_neg8 },
+        { .fni8 = tcg_gen_vec_neg16_i64,
+          .fno = gen_helper_gvec_neg16 },
+        { .fni8 = tcg_gen_vec_neg32_i64,
+          .fno = gen_helper_gvec_neg32 },
+        { .fni8 = tcg_gen_neg_i64,
+          .fno = gen_helper_gvec_neg64 },
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    tcg_gen_gvec_2(env, dofs, aofs, oprsz, maxsz, &g[vece]);
+}
+
+/* The logical operations are independent of the element size.  */
+
+void tcg_gen_gvec_and(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen3 g = {
+        .fni8 = tcg_gen_and_i64,
+        .fno = gen_helper_gvec_and,
+    };
+    tcg_gen_gvec_3(env, dofs, aofs, bofs, oprsz, maxsz, &g);
+}
+
+void tcg_gen_gvec_or(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                     uint32_t aofs, uint32_t bofs,
+                     uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen3 g = {
+        .fni8 = tcg_gen_or_i64,
+        .fno = gen_helper_gvec_or,
+    };
+    tcg_gen_gvec_3(env, dofs, aofs, bofs, oprsz, maxsz, &g);
+}
+
+void tcg_gen_gvec_xor(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen3 g = {
+        .fni8 = tcg_gen_xor_i64,
+        .fno = gen_helper_gvec_xor,
+    };
+    tcg_gen_gvec_3(env, dofs, aofs, bofs, oprsz, maxsz, &g);
+}
+
+void tcg_gen_gvec_andc(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, uint32_t bofs,
+                       uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen3 g = {
+        .fni8 = tcg_gen_andc_i64,
+        .fno = gen_helper_gvec_andc,
+    };
+    tcg_gen_gvec_3(env, dofs, aofs, bofs, oprsz, maxsz, &g);
+}
+
+void tcg_gen_gvec_orc(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen3 g = {
+        .fni8 = tcg_gen_orc_i64,
+        .fno = gen_helper_gvec_orc,
+    };
+    tcg_gen_gvec_3(env, dofs, aofs, bofs, oprsz, maxsz, &g);
+}
+
+/* Return the all-ones value of one lane of size VECE.  */
+static inline uint64_t lane_mask(unsigned vece)
+{
+    return vece == MO_64 ? -1ull : (1ull << (8 << vece)) - 1;
+}
+
+/* Shift each lane of A by C, with the lanes packed into 64 bits,
+   masking off the bits that cross into the neighbouring lane.  */
+
+static void gen_shli_vec(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    uint64_t mask = dup_const(vece, lane_mask(vece) << c);
+
+    tcg_gen_shli_i64(d, a, c);
+    tcg_gen_andi_i64(d, d, mask);
+}
+
+static void gen_shri_vec(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    uint64_t mask = dup_const(vece, lane_mask(vece) >> c);
+
+    tcg_gen_shri_i64(d, a, c);
+    tcg_gen_andi_i64(d, d, mask);
+}
+
+static void gen_sari_vec(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    uint64_t s_mask = dup_const(vece, (1ull << ((8 << vece) - 1)) >> c);
+    uint64_t c_mask = dup_const(vece, lane_mask(vece) >> c);
+    TCGv_i64 s = tcg_temp_new_i64();
+
+    tcg_gen_shri_i64(d, a, c);
+    tcg_gen_andi_i64(s, d, s_mask);           /* isolate (shifted) sign bit */
+    tcg_gen_muli_i64(s, s, (2ll << c) - 2);   /* replicate isolated signs */
+    tcg_gen_andi_i64(d, d, c_mask);           /* clear out bits above sign */
+    tcg_gen_or_i64(d, d, s);                  /* include sign extension */
+
+    tcg_temp_free_i64(s);
+}
+
+void tcg_gen_vec_shl8i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    gen_shli_vec(MO_8, d, a, c);
+}
+
+void tcg_gen_vec_shl16i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    gen_shli_vec(MO_16, d, a, c);
+}
+
+void tcg_gen_vec_shl32i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    gen_shli_vec(MO_32, d, a, c);
+}
+
+void tcg_gen_vec_shr8i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    gen_shri_vec(MO_8, d, a, c);
+}
+
+void tcg_gen_vec_shr16i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    gen_shri_vec(MO_16, d, a, c);
+}
+
+void tcg_gen_vec_shr32i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    gen_shri_vec(MO_32, d, a, c);
+}
+
+void tcg_gen_vec_sar8i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    gen_sari_vec(MO_8, d, a, c);
+}
+
+void tcg_gen_vec_sar16i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    gen_sari_vec(MO_16, d, a, c);
+}
+
+void tcg_gen_vec_sar32i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    gen_sari_vec(MO_32, d, a, c);
+}
+
+static void gen_shl64i(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    tcg_gen_shli_i64(d, a, c);
+}
+
+static void gen_shr64i(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    tcg_gen_shri_i64(d, a, c);
+}
+
+static void gen_sar64i(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    tcg_gen_sari_i64(d, a, c);
+}
+
+void tcg_gen_gvec_shli(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, int64_t shift,
+                       uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen2i g[4] = {
+        { .fni8 = tcg_gen_vec_shl8i_i64,
+          .fno = gen_helper_gvec_shl8i },
+        { .fni8 = tcg_gen_vec_shl16i_i64,
+          .fno = gen_helper_gvec_shl16i },
+        { .fni8 = tcg_gen_vec_shl32i_i64,
+          .fno = gen_helper_gvec_shl32i },
+        { .fni8 = gen_shl64i,
+          .fno = gen_helper_gvec_shl64i },
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    tcg_debug_assert(shift >= 0 && shift < (8 << vece));
+    if (shift == 0) {
+        tcg_gen_gvec_mov(env, vece, dofs, aofs, oprsz, maxsz);
+    } else {
+        tcg_gen_gvec_2i(env, dofs, aofs, oprsz, maxsz, shift, &g[vece]);
+    }
+}
+
+void tcg_gen_gvec_shri(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, int64_t shift,
+                       uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen2i g[4] = {
+        { .fni8 = tcg_gen_vec_shr8i_i64,
+          .fno = gen_helper_gvec_shr8i },
+        { .fni8 = tcg_gen_vec_shr16i_i64,
+          .fno = gen_helper_gvec_shr16i },
+        { .fni8 = tcg_gen_vec_shr32i_i64,
+          .fno = gen_helper_gvec_shr32i },
+        { .fni8 = gen_shr64i,
+          .fno = gen_helper_gvec_shr64i },
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    tcg_debug_assert(shift >= 0 && shift < (8 << vece));
+    if (shift == 0) {
+        tcg_gen_gvec_mov(env, vece, dofs, aofs, oprsz, maxsz);
+    } else {
+        tcg_gen_gvec_2i(env, dofs, aofs, oprsz, maxsz, shift, &g[vece]);
+    }
+}
+
+void tcg_gen_gvec_sari(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, int64_t shift,
+                       uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen2i g[4] = {
+        { .fni8 = tcg_gen_vec_sar8i_i64,
+          .fno = gen_helper_gvec_sar8i },
+        { .fni8 = tcg_gen_vec_sar16i_i64,
+          .fno = gen_helper_gvec_sar16i },
+        { .fni8 = tcg_gen_vec_sar32i_i64,
+          .fno = gen_helper_gvec_sar32i },
+        { .fni8 = gen_sar64i,
+          .fno = gen_helper_gvec_sar64i },
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    tcg_debug_assert(shift >= 0 && shift < (8 << vece));
+    if (shift == 0) {
+        tcg_gen_gvec_mov(env, vece, dofs, aofs, oprsz, maxsz);
+    } else {
+        tcg_gen_gvec_2i(env, dofs, aofs, oprsz, maxsz, shift, &g[vece]);
+    }
+}
+
+/* Expand a comparison one element at a time.  This is used for vectors
+   small enough that the out-of-line call would dominate.  */
+static void expand_cmp_elt(TCGv_ptr env, TCGCond cond, unsigned vece,
+                           uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                           uint32_t oprsz)
+{
+    uint32_t i, esz = 1 << vece;
+
+    if (vece == MO_64) {
+        TCGv_i64 t0 = tcg_temp_new_i64();
+        TCGv_i64 t1 = tcg_temp_new_i64();
+
+        for (i = 0; i < oprsz; i += 8) {
+            tcg_gen_ld_i64(t0, env, aofs + i);
+            tcg_gen_ld_i64(t1, env, bofs + i);
+            tcg_gen_setcond_i64(cond, t0, t0, t1);
+            tcg_gen_neg_i64(t0, t0);
+            tcg_gen_st_i64(t0, env, dofs + i);
+        }
+        tcg_temp_free_i64(t1);
+        tcg_temp_free_i64(t0);
+    } else {
+        TCGv_i32 t0 = tcg_temp_new_i32();
+        TCGv_i32 t1 = tcg_temp_new_i32();
+        bool sign = !is_unsigned_cond(cond);
+
+        for (i = 0; i < oprsz; i += esz) {
+            switch (vece) {
+            case MO_8:
+                if (sign) {
+                    tcg_gen_ld8s_i32(t0, env, aofs + i);
+                    tcg_gen_ld8s_i32(t1, env, bofs + i);
+                } else {
+                    tcg_gen_ld8u_i32(t0, env, aofs + i);
+                    tcg_gen_ld8u_i32(t1, env, bofs + i);
+                }
+                break;
+            case MO_16:
+                if (sign) {
+                    tcg_gen_ld16s_i32(t0, env, aofs + i);
+                    tcg_gen_ld16s_i32(t1, env, bofs + i);
+                } else {
+                    tcg_gen_ld16u_i32(t0, env, aofs + i);
+                    tcg_gen_ld16u_i32(t1, env, bofs + i);
+                }
+                break;
+            default:
+                tcg_gen_ld_i32(t0, env, aofs + i);
+                tcg_gen_ld_i32(t1, env, bofs + i);
+                break;
+            }
+            tcg_gen_setcond_i32(cond, t0, t0, t1);
+            tcg_gen_neg_i32(t0, t0);
+            switch (vece) {
+            case MO_8:
+                tcg_gen_st8_i32(t0, env, dofs + i);
+                break;
+            case MO_16:
+                tcg_gen_st16_i32(t0, env, dofs + i);
+                break;
+            default:
+                tcg_gen_st_i32(t0, env, dofs + i);
+                break;
+            }
+        }
+        tcg_temp_free_i32(t1);
+        tcg_temp_free_i32(t0);
+    }
+}
+
+void tcg_gen_gvec_cmp(TCGv_ptr env, TCGCond cond, unsigned vece,
+                      uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    static gen_helper_gvec_3 * const eq_fn[4] = {
+        gen_helper_gvec_eq8, gen_helper_gvec_eq16,
+        gen_helper_gvec_eq32, gen_helper_gvec_eq64
+    };
+    static gen_helper_gvec_3 * const ne_fn[4] = {
+        gen_helper_gvec_ne8, gen_helper_gvec_ne16,
+        gen_helper_gvec_ne32, gen_helper_gvec_ne64
+    };
+    static gen_helper_gvec_3 * const lt_fn[4] = {
+        gen_helper_gvec_lt8, gen_helper_gvec_lt16,
+        gen_helper_gvec_lt32, gen_helper_gvec_lt64
+    };
+    static gen_helper_gvec_3 * const le_fn[4] = {
+        gen_helper_gvec_le8, gen_helper_gvec_le16,
+        gen_helper_gvec_le32, gen_helper_gvec_le64
+    };
+    static gen_helper_gvec_3 * const ltu_fn[4] = {
+        gen_helper_gvec_ltu8, gen_helper_gvec_ltu16,
+        gen_helper_gvec_ltu32, gen_helper_gvec_ltu64
+    };
+    static gen_helper_gvec_3 * const leu_fn[4] = {
+        gen_helper_gvec_leu8, gen_helper_gvec_leu16,
+        gen_helper_gvec_leu32, gen_helper_gvec_leu64
+    };
+    static gen_helper_gvec_3 * const * const fns[16] = {
+        [TCG_COND_EQ] = eq_fn,
+        [TCG_COND_NE] = ne_fn,
+        [TCG_COND_LT] = lt_fn,
+        [TCG_COND_LE] = le_fn,
+        [TCG_COND_LTU] = ltu_fn,
+        [TCG_COND_LEU] = leu_fn,
+    };
+
+    check_size_align(oprsz, maxsz, dofs | aofs | bofs);
+    check_overlap_3(dofs, aofs, bofs, maxsz);
+    tcg_debug_assert(vece <= MO_64);
+
+    if (cond == TCG_COND_NEVER || cond == TCG_COND_ALWAYS) {
+        tcg_gen_gvec_dupi(env, MO_64, dofs, oprsz, maxsz,
+                          -(cond == TCG_COND_ALWAYS));
+        return;
+    }
+
+    /* Inline expansion is a setcond per element; only use it when
+       there are few enough elements.  */
+    if (oprsz == 8 || (vece == MO_64 && oprsz <= MAX_UNROLL)) {
+        expand_cmp_elt(env, cond, vece, dofs, aofs, bofs, oprsz);
+        expand_clr(env, dofs + oprsz, maxsz - oprsz);
+        return;
+    }
+
+    /* The helpers implement only half of the conditions;
+       swap the operands for the others.  */
+    if (fns[cond] == NULL) {
+        uint32_t tmp = aofs;
+        aofs = bofs;
+        bofs = tmp;
+        cond = tcg_swap_cond(cond);
+    }
+    tcg_debug_assert(fns[cond] != NULL);
+    tcg_gen_gvec_3_ool(env, dofs, aofs, bofs, oprsz, maxsz, 0,
+                       fns[cond][vece]);
+}
@@ -251,6 +251,23 @@ TCGLabel *gen_new_label(void)
     return l;
 }
 
+/* Record that the field about to be emitted at code_ptr refers to TARGET.
+   Only called by the backend when code_relocs_enabled is set.  */
+static __attribute__((unused)) void
+tcg_out_code_reloc(TCGContext *s, TCGCodeRelocType type, uintptr_t target)
+{
+    TCGCodeReloc *r;
+
+    if (s->nb_code_relocs == TCG_MAX_CODE_RELOCS) {
+        s->code_relocs_failed = true;
+        return;
+    }
+    r = &s->code_relocs[s->nb_code_relocs++];
+    r->offset = tcg_current_code_size(s);
+    r->type = type;
+    r->target = target;
+}
+
 #include "tcg-target.inc.c"
 
 /* pool based memory allocation */
@@ -1329,22 +1346,74 @@ static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps,
     }
 }
 
+/* liveness analysis: temps that are live across a call should stay out of
+   the call-clobbered registers, so that the call does not spill them. */
+static void tcg_la_cross_call(TCGContext *s, uint8_t *dead_temps,
+                              TCGRegSet *temp_pref)
+{
+    int i;
+
+    for (i = 0; i < s->nb_temps; i++) {
+        if (!dead_temps[i]) {
+            TCGRegSet set;
+
+            tcg_regset_andnot(set, temp_pref[i],
+                              tcg_target_call_clobber_regs);
+            if (set == 0) {
+                tcg_regset_andnot(set,
+                                  tcg_target_available_regs[s->temps[i].type],
+                                  tcg_target_call_clobber_regs);
+            }
+            temp_pref[i] = set;
+        }
+    }
+}
+
+/* liveness analysis: record the preference of the outputs of op OI, which
+   is whatever their next use asked for, and forget it since the outputs
+   are redefined here. */
+static inline void tcg_la_output_pref(TCGContext *s, int oi,
+                                      const TCGArg *args, int nb_oargs,
+                                      TCGRegSet *temp_pref)
+{
+    int i;
+
+    for (i = 0; i < nb_oargs; i++) {
+        TCGArg arg = args[i];
+
+        if (i < 2) {
+            s->op_output_pref[oi][i] = temp_pref[arg];
+        }
+        temp_pref[arg] = tcg_target_available_regs[s->temps[arg].type];
+    }
+}
+
 /* Liveness analysis : update the opc_dead_args array to tell if a
    given input arguments is dead. Instructions updating dead
    temporaries are removed. */
 static void tcg_liveness_analysis(TCGContext *s)
 {
     uint8_t *dead_temps, *mem_temps;
+    TCGRegSet *temp_pref;
     int oi, oi_prev, nb_ops;
 
     nb_ops = s->gen_next_op_idx;
     s->op_dead_args = tcg_malloc(nb_ops * sizeof(uint16_t));
     s->op_sync_args = tcg_malloc(nb_ops * sizeof(uint8_t));
+    s->op_output_pref = tcg_malloc(nb_ops * sizeof(*s->op_output_pref));
+    memset(s->op_output_pref, 0, nb_ops * sizeof(*s->op_output_pref));
     
     dead_temps = tcg_malloc(s->nb_temps);
     mem_temps = tcg_malloc(s->nb_temps);
     tcg_la_func_end(s, dead_temps, mem_temps);
 
+    /* Walking backwards, temp_pref[] holds the registers that the next use
+       of each temp would like it to be in.  */
+    temp_pref = tcg_malloc(s->nb_temps * sizeof(TCGRegSet));
+    for (oi = 0; oi < s->nb_temps; oi++) {
+        temp_pref[oi] = tcg_target_available_regs[s->temps[oi].type];
+    }
+
     for (oi = s->gen_last_op_idx; oi >= 0; oi = oi_prev) {
         int i, nb_iargs, nb_oargs;
         TCGOpcode opc_new, opc_new2;
@@ -1381,6 +1450,8 @@ static void tcg_liveness_analysis(TCGContext *s)
                 } else {
                 do_not_remove_call:
 
+                    tcg_la_output_pref(s, oi, args, nb_oargs, temp_pref);
+
                     /* output args are dead */
                     dead_args = 0;
                     sync_args = 0;
@@ -1406,6 +1477,9 @@ static void tcg_liveness_analysis(TCGContext *s)
                         memset(dead_temps, 1, s->nb_globals);
                     }
 
+                    /* whatever is still live here survives the call */
+                    tcg_la_cross_call(s, dead_temps, temp_pref);
+
                     /* record arguments that die in this helper */
                     for (i = nb_oargs; i < nb_iargs + nb_oargs; i++) {
                         arg = args[i];
@@ -1415,10 +1489,20 @@ static void tcg_liveness_analysis(TCGContext *s)
                             }
                         }
                     }
-                    /* input arguments are live for preceding opcodes */
+                    /* input arguments are live for preceding opcodes;
+                       those passed in registers would like to be
+                       computed there */
                     for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
+                        int r = i - nb_oargs;
+
                         arg = args[i];
                         dead_temps[arg] = 0;
+                        if (arg != TCG_CALL_DUMMY_ARG &&
+                            r < ARRAY_SIZE(tcg_target_call_iarg_regs)) {
+                            tcg_regset_clear(temp_pref[arg]);
+                            tcg_regset_set_reg(temp_pref[arg],
+                                               tcg_target_call_iarg_regs[r]);
+                        }
                     }
                     s->op_dead_args[oi] = dead_args;
                     s->op_sync_args[oi] = sync_args;
@@ -1531,6 +1615,8 @@ static void tcg_liveness_analysis(TCGContext *s)
                 tcg_op_remove(s, op);
             } else {
             do_not_remove:
+                tcg_la_output_pref(s, oi, args, nb_oargs, temp_pref);
+
                 /* output args are dead */
                 dead_args = 0;
                 sync_args = 0;
@@ -1561,10 +1647,28 @@ static void tcg_liveness_analysis(TCGContext *s)
                         dead_args |= (1 << i);
                     }
                 }
-                /* input arguments are live for preceding opcodes */
+                /* input arguments are live for preceding opcodes, and
+                   would like to be in a register accepted here; a mov
+                   passes on the preference of its output instead */
                 for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
+                    const TCGOpDef *ndef = &tcg_op_defs[opc];
+                    TCGType type;
+                    TCGRegSet set;
+
                     arg = args[i];
                     dead_temps[arg] = 0;
+                    if (opc == INDEX_op_mov_i32 || opc == INDEX_op_mov_i64) {
+                        set = s->op_output_pref[oi][0];
+                    } else if (ndef->flags & TCG_OPF_NOT_PRESENT) {
+                        continue;
+                    } else {
+                        set = ndef->args_ct[i].u.regs;
+                    }
+                    type = s->temps[arg].type;
+                    tcg_regset_and(set, set, tcg_target_available_regs[type]);
+                    if (set != 0) {
+                        temp_pref[arg] = set;
+                    }
                 }
                 s->op_dead_args[oi] = dead_args;
                 s->op_sync_args[oi] = sync_args;
@@ -1583,6 +1687,8 @@ static void tcg_liveness_analysis(TCGContext *s)
     memset(s->op_dead_args, 0, nb_ops * sizeof(uint16_t));
     s->op_sync_args = tcg_malloc(nb_ops * sizeof(uint8_t));
     memset(s->op_sync_args, 0, nb_ops * sizeof(uint8_t));
+    s->op_output_pref = tcg_malloc(nb_ops * sizeof(*s->op_output_pref));
+    memset(s->op_output_pref, 0, nb_ops * sizeof(*s->op_output_pref));
 }
 #endif
 
@@ -1712,29 +1818,47 @@ static void tcg_reg_free(TCGContext *s, TCGReg reg, TCGRegSet allocated_regs)
     }
 }
 
-/* Allocate a register belonging to reg1 & ~reg2 */
+/* Allocate a register belonging to desired_regs & ~allocated_regs, trying
+   the ones in preferred_regs first */
 static TCGReg tcg_reg_alloc(TCGContext *s, TCGRegSet desired_regs,
-                            TCGRegSet allocated_regs, bool rev)
+                            TCGRegSet allocated_regs,
+                            TCGRegSet preferred_regs, bool rev)
 {
-    int i, n = ARRAY_SIZE(tcg_target_reg_alloc_order);
+    int i, j, n = ARRAY_SIZE(tcg_target_reg_alloc_order);
     const int *order;
     TCGReg reg;
-    TCGRegSet reg_ct;
+    TCGRegSet reg_ct[2];
 
-    tcg_regset_andnot(reg_ct, desired_regs, allocated_regs);
+    tcg_regset_andnot(reg_ct[1], desired_regs, allocated_regs);
+    tcg_regset_and(reg_ct[0], reg_ct[1], preferred_regs);
     order = rev ? indirect_reg_alloc_order : tcg_target_reg_alloc_order;
 
-    /* first try free registers */
-    for(i = 0; i < n; i++) {
+    /* first try free registers, preferred ones first; skip the preferred
+       pass if it would not narrow the choice */
+    j = (reg_ct[0] == 0 || reg_ct[0] == reg_ct[1]);
+    for (; j < 2; j++) {
+        for (i = 0; i < n; i++) {
+            reg = order[i];
+            if (tcg_regset_test_reg(reg_ct[j], reg) &&
+                s->reg_to_temp[reg] == NULL) {
+                return reg;
+            }
+        }
+    }
+
+    /* then spill, preferring a register whose temp is already coherent
+       with memory since that costs no store */
+    for (i = 0; i < n; i++) {
         reg = order[i];
-        if (tcg_regset_test_reg(reg_ct, reg) && s->reg_to_temp[reg] == NULL)
+        if (tcg_regset_test_reg(reg_ct[1], reg) &&
+            s->reg_to_temp[reg]->mem_coherent) {
+            tcg_reg_free(s, reg, allocated_regs);
             return reg;
+        }
     }
-
-    /* XXX: do better spill choice */
-    for(i = 0; i < n; i++) {
+    for (i = 0; i < n; i++) {
         reg = order[i];
-        if (tcg_regset_test_reg(reg_ct, reg)) {
+        if (tcg_regset_test_reg(reg_ct[1], reg)) {
             tcg_reg_free(s, reg, allocated_regs);
             return reg;
         }
@@ -1743,6 +1867,38 @@ static TCGReg tcg_reg_alloc(TCGContext *s, TCGRegSet desired_regs,
     tcg_abort();
 }
 
+/* Free call-clobbered register 'reg' before a helper call.  A value still
+   live after the call is moved to a free call-saved register if there is
+   one, which is cheaper than storing it and loading it back.  */
+static void tcg_reg_free_for_call(TCGContext *s, TCGReg reg,
+                                  TCGRegSet allocated_regs)
+{
+    TCGTemp *ts = s->reg_to_temp[reg];
+    TCGRegSet saved_regs;
+    int i;
+
+    if (ts == NULL) {
+        return;
+    }
+
+    tcg_regset_andnot(saved_regs, tcg_target_available_regs[ts->type],
+                      tcg_target_call_clobber_regs);
+    tcg_regset_andnot(saved_regs, saved_regs, allocated_regs);
+    for (i = 0; i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
+        TCGReg r = tcg_target_reg_alloc_order[i];
+
+        if (tcg_regset_test_reg(saved_regs, r) && s->reg_to_temp[r] == NULL) {
+            tcg_out_mov(s, ts->type, r, reg);
+            s->reg_to_temp[reg] = NULL;
+            s->reg_to_temp[r] = ts;
+            ts->reg = r;
+            return;
+        }
+    }
+
+    tcg_reg_free(s, reg, allocated_regs);
+}
+
 /* Make sure the temporary is in a register.  If needed, allocate the register
    from DESIRED while avoiding ALLOCATED.  */
 static void temp_load(TCGContext *s, TCGTemp *ts, TCGRegSet desired_regs,
@@ -1754,12 +1910,14 @@ static void temp_load(TCGContext *s, TCGTemp *ts, TCGRegSet desired_regs,
     case TEMP_VAL_REG:
         return;
     case TEMP_VAL_CONST:
-        reg = tcg_reg_alloc(s, desired_regs, allocated_regs, ts->indirect_base);
+        reg = tcg_reg_alloc(s, desired_regs, allocated_regs, 0,
+                            ts->indirect_base);
         tcg_out_movi(s, ts->type, reg, ts->val);
         ts->mem_coherent = 0;
         break;
     case TEMP_VAL_MEM:
-        reg = tcg_reg_alloc(s, desired_regs, allocated_regs, ts->indirect_base);
+        reg = tcg_reg_alloc(s, desired_regs, allocated_regs, 0,
+                            ts->indirect_base);
         if (ts->indirect_reg) {
             tcg_regset_set_reg(allocated_regs, reg);
             temp_load(s, ts->mem_base,
@@ -1926,7 +2084,7 @@ static void tcg_reg_alloc_movi(TCGContext *s, const TCGArg *args,
 
 static void tcg_reg_alloc_mov(TCGContext *s, const TCGOpDef *def,
                               const TCGArg *args, uint16_t dead_args,
-                              uint8_t sync_args)
+                              uint8_t sync_args, const TCGRegSet *output_pref)
 {
     TCGRegSet allocated_regs;
     TCGTemp *ts, *ots;
@@ -1996,7 +2154,8 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOpDef *def,
                    input one. */
                 tcg_regset_set_reg(allocated_regs, ts->reg);
                 ots->reg = tcg_reg_alloc(s, tcg_target_available_regs[otype],
-                                         allocated_regs, ots->indirect_base);
+                                         allocated_regs, output_pref[0],
+                                         ots->indirect_base);
             }
             tcg_out_mov(s, otype, ots->reg, ts->reg);
         }
@@ -2012,7 +2171,7 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOpDef *def,
 static void tcg_reg_alloc_op(TCGContext *s, 
                              const TCGOpDef *def, TCGOpcode opc,
                              const TCGArg *args, uint16_t dead_args,
-                             uint8_t sync_args)
+                             uint8_t sync_args, const TCGRegSet *output_pref)
 {
     TCGRegSet allocated_regs;
     int i, k, nb_iargs, nb_oargs;
@@ -2081,7 +2240,7 @@ static void tcg_reg_alloc_op(TCGContext *s,
         allocate_in_reg:
             /* allocate a new register matching the constraint 
                and move the temporary register into it */
-            reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs,
+            reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs, 0,
                                 ts->indirect_base);
             tcg_out_mov(s, ts->type, reg, ts->reg);
         }
@@ -2132,6 +2291,7 @@ static void tcg_reg_alloc_op(TCGContext *s,
                     goto oarg_end;
                 }
                 reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs,
+                                    i < 2 ? output_pref[i] : 0,
                                     ts->indirect_base);
             }
             tcg_regset_set_reg(allocated_regs, reg);
@@ -2262,7 +2422,7 @@ static void tcg_reg_alloc_call(TCGContext *s, int nb_oargs, int nb_iargs,
     /* clobber call registers */
     for (i = 0; i < TCG_TARGET_NB_REGS; i++) {
         if (tcg_regset_test_reg(tcg_target_call_clobber_regs, i)) {
-            tcg_reg_free(s, i, allocated_regs);
+            tcg_reg_free_for_call(s, i, allocated_regs);
         }
     }
 
@@ -2363,7 +2523,9 @@ int tcg_gen_code(TCGContext *s, tcg_insn_unit *gen_code_buf)
 #endif
 
 #ifdef USE_TCG_OPTIMIZATIONS
-    tcg_optimize(s);
+    if (!s->optimize_disabled) {
+        tcg_optimize(s);
+    }
 #endif
 
 #ifdef CONFIG_PROFILER
@@ -2389,6 +2551,8 @@ int tcg_gen_code(TCGContext *s, tcg_insn_unit *gen_code_buf)
 
     s->code_buf = gen_code_buf;
     s->code_ptr = gen_code_buf;
+    s->nb_code_relocs = 0;
+    s->code_relocs_failed = false;
 
     tcg_out_tb_init(s);
 
@@ -2409,7 +2573,8 @@ int tcg_gen_code(TCGContext *s, tcg_insn_unit *gen_code_buf)
         switch (opc) {
         case INDEX_op_mov_i32:
         case INDEX_op_mov_i64:
-            tcg_reg_alloc_mov(s, def, args, dead_args, sync_args);
+            tcg_reg_alloc_mov(s, def, args, dead_args, sync_args,
+                              s->op_output_pref[oi]);
             break;
         case INDEX_op_movi_i32:
         case INDEX_op_movi_i64:
@@ -2449,7 +2614,8 @@ int tcg_gen_code(TCGContext *s, tcg_insn_unit *gen_code_buf)
             /* Note: in order to speed up the code, it would be much
                faster to have specialized register allocator functions for
                some common argument patterns */
-            tcg_reg_alloc_op(s, def, opc, args, dead_args, sync_args);
+            tcg_reg_alloc_op(s, def, opc, args, dead_args, sync_args,
+                             s->op_output_pref[oi]);
             break;
         }
 #ifndef NDEBUG
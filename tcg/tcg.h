@@ -42,6 +42,15 @@
 # endif
 #endif
 
+/* Oversized TCG guests make things like MTTCG hard
+ * as we can't use atomics for cputlb updates.
+ */
+#if defined(TARGET_LONG_BITS) && TARGET_LONG_BITS > TCG_TARGET_REG_BITS
+#define TCG_OVERSIZED_GUEST 1
+#else
+#define TCG_OVERSIZED_GUEST 0
+#endif
+
 #if TCG_TARGET_REG_BITS == 32
 typedef int32_t tcg_target_long;
 typedef uint32_t tcg_target_ulong;
@@ -497,6 +506,27 @@ typedef struct TCGOp {
     signed next     : 16;
 } TCGOp;
 
+/* A reference from generated code to a host address outside the TB,
+   recorded for the persistent translation cache (see tb-cache.c).  */
+typedef enum TCGCodeRelocType {
+    TCG_CODE_RELOC_PC32,     /* 32-bit displacement from the end of field */
+    TCG_CODE_RELOC_ABS64,    /* 64-bit absolute address */
+} TCGCodeRelocType;
+
+typedef struct TCGCodeReloc {
+    uint32_t offset;         /* of the field, from the start of the TB code */
+    TCGCodeRelocType type;
+    uintptr_t target;
+} TCGCodeReloc;
+
+#define TCG_MAX_CODE_RELOCS 64
+
+#if TCG_TARGET_IMPLEMENTS_CODE_RELOCS
+/* The optional host instructions the backend chose to use, as a bitmask.
+   Code generated on a host with different features may not run here.  */
+uint32_t tcg_target_host_features(void);
+#endif
+
 QEMU_BUILD_BUG_ON(NB_OPS > 0xff);
 QEMU_BUILD_BUG_ON(OPC_BUF_SIZE >= 0x7fff);
 QEMU_BUILD_BUG_ON(OPPARAM_BUF_SIZE >= 0x7fff);
@@ -514,12 +544,27 @@ struct TCGContext {
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset; /* != NULL if USE_DIRECT_JUMP */
 
+    /* Relocation recording for the persistent translation cache.  When
+       enabled, the backend must emit position-independent code apart from
+       the references it records; if it cannot, it sets code_relocs_failed.  */
+    bool code_relocs_enabled;
+    bool code_relocs_failed;
+    int nb_code_relocs;
+    TCGCodeReloc code_relocs[TCG_MAX_CODE_RELOCS];
+
+    /* Skip the optimizer, for the first translation of a TB when tiered
+       translation is enabled.  */
+    bool optimize_disabled;
+
     /* liveness analysis */
     uint16_t *op_dead_args; /* for each operation, each bit tells if the
                                corresponding argument is dead */
     uint8_t *op_sync_args;  /* for each operation, each bit tells if the
                                corresponding output argument needs to be
                                sync to memory. */
+    TCGRegSet (*op_output_pref)[2]; /* for each operation, the registers
+                                       wanted by the next use of its first
+                                       two outputs; 0 if none. */
     
     TCGRegSet reserved_regs;
     intptr_t current_frame_offset;
@@ -531,6 +576,10 @@ struct TCGContext {
 
     GHashTable *helpers;
 
+    /* The env pointer global, for helpers emitted by common code such
+       as the atomic operations.  Set by the front end.  */
+    TCGv_env tcg_env;
+
 #ifdef CONFIG_PROFILER
     /* profiling info */
     int64_t tb_count1;
@@ -567,6 +616,7 @@ struct TCGContext {
        extension that allows arithmetic on void*.  */
     int code_gen_max_blocks;
     void *code_gen_prologue;
+    void *code_gen_epilogue;
     void *code_gen_buffer;
     size_t code_gen_buffer_size;
     void *code_gen_ptr;
@@ -594,6 +644,7 @@ struct TCGContext {
 };
 
 extern TCGContext tcg_ctx;
+extern bool parallel_cpus;
 
 /* The number of opcodes emitted so far.  */
 static inline int tcg_op_buf_count(void)
@@ -616,6 +667,7 @@ void tcg_pool_delete(TCGContext *s);
 void tb_lock(void);
 void tb_unlock(void);
 void tb_lock_reset(void);
+bool tb_lock_recursive(void);
 
 static inline void *tcg_malloc(int size)
 {
@@ -0,0 +1,76 @@
+/*
+ * Coroutine benchmarks
+ *
+ * These supersede the perf_* cases of tests/test-coroutine.c for tracking
+ * numbers across commits.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/coroutine.h"
+#include "bench.h"
+
+static void coroutine_fn empty_coroutine(void *opaque)
+{
+}
+
+/* Create, enter and terminate a coroutine (served from the pool) */
+static void bench_lifecycle(uint64_t iters, void *opaque)
+{
+    while (iters--) {
+        qemu_coroutine_enter(qemu_coroutine_create(empty_coroutine), NULL);
+    }
+}
+
+static void coroutine_fn yield_forever(void *opaque)
+{
+    for (;;) {
+        qemu_coroutine_yield();
+    }
+}
+
+/* One round trip: enter the coroutine and let it yield back */
+static void bench_yield(uint64_t iters, void *opaque)
+{
+    Coroutine *co = opaque;
+
+    while (iters--) {
+        qemu_coroutine_enter(co, NULL);
+    }
+}
+
+static void coroutine_fn nest(void *opaque)
+{
+    unsigned *depth = opaque;
+
+    if (--*depth) {
+        qemu_coroutine_enter(qemu_coroutine_create(nest), depth);
+    }
+}
+
+/* Create a chain of 16 coroutines, each entered from the previous one */
+static void bench_nesting(uint64_t iters, void *opaque)
+{
+    unsigned depth;
+
+    while (iters--) {
+        depth = 16;
+        qemu_coroutine_enter(qemu_coroutine_create(nest), &depth);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Coroutine *co = qemu_coroutine_create(yield_forever);
+
+    qemu_coroutine_enter(co, NULL);
+
+    bench_add("/coroutine/lifecycle", bench_lifecycle, NULL);
+    bench_add("/coroutine/yield", bench_yield, co);
+    bench_add("/coroutine/nesting/16", bench_nesting, NULL);
+
+    return bench_main(argc, argv);
+}
@@ -0,0 +1,101 @@
+/*
+ * HBitmap benchmarks
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/hbitmap.h"
+#include "bench.h"
+
+/* One bit per 64k cluster of a 1 TB disk */
+#define BITMAP_SIZE     (1 << 24)
+
+typedef struct HBitmapBench {
+    const char *name;
+    int stride;                 /* every stride-th bit is set */
+    HBitmap *hb;
+} HBitmapBench;
+
+static HBitmapBench iter_benches[] = {
+    { "/hbitmap/iter/empty", 0 },
+    { "/hbitmap/iter/sparse", 4096 },
+    { "/hbitmap/iter/1%", 100 },
+    { "/hbitmap/iter/full", 1 },
+};
+
+/* Walk the whole bitmap once per iteration */
+static void bench_iter(uint64_t iters, void *opaque)
+{
+    HBitmapBench *b = opaque;
+    HBitmapIter hbi;
+    int64_t bit;
+
+    while (iters--) {
+        hbitmap_iter_init(&hbi, b->hb, 0);
+        while ((bit = hbitmap_iter_next(&hbi)) >= 0) {
+            bench_consume(bit);
+        }
+    }
+}
+
+static uint64_t *random_bits;
+#define RANDOM_BITS     4096
+
+static void bench_set_reset(uint64_t iters, void *opaque)
+{
+    HBitmap *hb = opaque;
+    uint64_t i;
+
+    for (i = 0; i < iters; i++) {
+        uint64_t bit = random_bits[i % RANDOM_BITS];
+
+        hbitmap_set(hb, bit, 16);
+        hbitmap_reset(hb, bit, 16);
+    }
+}
+
+static void bench_get(uint64_t iters, void *opaque)
+{
+    HBitmap *hb = opaque;
+    uint64_t i;
+
+    for (i = 0; i < iters; i++) {
+        bench_consume(hbitmap_get(hb, random_bits[i % RANDOM_BITS]));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    GRand *rand = g_rand_new_with_seed(1);
+    HBitmap *hb;
+    int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(iter_benches); i++) {
+        HBitmapBench *b = &iter_benches[i];
+
+        b->hb = hbitmap_alloc(BITMAP_SIZE, 0);
+        if (b->stride == 1) {
+            hbitmap_set(b->hb, 0, BITMAP_SIZE);
+        } else if (b->stride) {
+            for (j = 0; j < BITMAP_SIZE; j += b->stride) {
+                hbitmap_set(b->hb, j, 1);
+            }
+        }
+        bench_add(b->name, bench_iter, b);
+    }
+
+    random_bits = g_new(uint64_t, RANDOM_BITS);
+    for (i = 0; i < RANDOM_BITS; i++) {
+        random_bits[i] = g_rand_int_range(rand, 0, BITMAP_SIZE - 16);
+    }
+    g_rand_free(rand);
+
+    hb = hbitmap_alloc(BITMAP_SIZE, 0);
+    bench_add("/hbitmap/set-reset/16", bench_set_reset, hb);
+    bench_add("/hbitmap/get/sparse", bench_get, iter_benches[1].hb);
+
+    return bench_main(argc, argv);
+}
@@ -0,0 +1,95 @@
+/*
+ * qcow2 cluster lookup benchmarks
+ *
+ * The image is metadata-preallocated, so every lookup goes through the L1
+ * and L2 tables; the "l2-miss" case opens it with the smallest L2 cache.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/main-loop.h"
+#include "block/block.h"
+#include "sysemu/block-backend.h"
+#include "bench.h"
+
+#define IMAGE_SIZE      (4ULL << 30)
+#define CLUSTER_SIZE    65536
+#define NB_LOOKUPS      4096
+
+typedef struct Qcow2Bench {
+    BlockBackend *blk;
+    int64_t *sectors;           /* NB_LOOKUPS offsets to look up */
+} Qcow2Bench;
+
+static void bench_lookup(uint64_t iters, void *opaque)
+{
+    Qcow2Bench *b = opaque;
+    BlockDriverState *bs = blk_bs(b->blk);
+    BlockDriverState *file;
+    uint64_t i;
+    int pnum;
+
+    for (i = 0; i < iters; i++) {
+        bench_consume(bdrv_get_block_status(bs, b->sectors[i % NB_LOOKUPS],
+                                            1, &pnum, &file));
+    }
+}
+
+static Qcow2Bench *qcow2_bench_new(const char *filename, const char *l2_cache,
+                                   bool sequential, GRand *rand)
+{
+    Qcow2Bench *b = g_new(Qcow2Bench, 1);
+    QDict *options = qdict_new();
+    int i;
+
+    qdict_put(options, "driver", qstring_from_str("qcow2"));
+    if (l2_cache) {
+        qdict_put(options, "l2-cache-size", qstring_from_str(l2_cache));
+    }
+    b->blk = blk_new_open("bench", filename, NULL, options, 0, &error_abort);
+
+    b->sectors = g_new(int64_t, NB_LOOKUPS);
+    for (i = 0; i < NB_LOOKUPS; i++) {
+        int64_t cluster = sequential ? i :
+            g_rand_int_range(rand, 0, IMAGE_SIZE / CLUSTER_SIZE);
+
+        b->sectors[i] = cluster * (CLUSTER_SIZE / BDRV_SECTOR_SIZE);
+    }
+    return b;
+}
+
+int main(int argc, char **argv)
+{
+    GRand *rand = g_rand_new_with_seed(1);
+    char create_options[] = "preallocation=metadata";
+    char *filename;
+    int fd, ret;
+
+    qemu_init_main_loop(&error_abort);
+    bdrv_init();
+
+    fd = g_file_open_tmp("bench-qcow2-XXXXXX", &filename, NULL);
+    assert(fd >= 0);
+    close(fd);
+    bdrv_img_create(filename, "qcow2", NULL, NULL, create_options,
+                    IMAGE_SIZE, 0, &error_abort, true);
+
+    bench_add("/qcow2/lookup/sequential",
+              bench_lookup, qcow2_bench_new(filename, NULL, true, rand));
+    bench_add("/qcow2/lookup/random",
+              bench_lookup, qcow2_bench_new(filename, NULL, false, rand));
+    bench_add("/qcow2/lookup/random-l2-miss",
+              bench_lookup, qcow2_bench_new(filename, "131072", false, rand));
+    g_rand_free(rand);
+
+    ret = bench_main(argc, argv);
+    unlink(filename);
+    g_free(filename);
+    return ret;
+}
@@ -0,0 +1,90 @@
+/*
+ * JSON parser and formatter benchmarks
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/qmp/qobject.h"
+#include "qapi/qmp/qstring.h"
+#include "qapi/qmp/qjson.h"
+#include "bench.h"
+
+typedef struct JsonBench {
+    char *json;
+    QObject *obj;
+} JsonBench;
+
+/* A typical QMP command */
+static const char qmp_command[] =
+    "{ \"execute\": \"blockdev-snapshot-sync\", \"arguments\": "
+    "{ \"device\": \"drive-virtio-disk0\", "
+    "\"snapshot-file\": \"/var/lib/images/snap-0001.qcow2\", "
+    "\"format\": \"qcow2\", \"mode\": \"absolute-paths\" }, "
+    "\"id\": \"libvirt-1234\" }";
+
+/* Something like the reply to query-blockstats for a VM with 32 disks */
+static char *make_blockstats_reply(void)
+{
+    GString *s = g_string_new("{ \"return\": [");
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        g_string_append_printf(s, "%s{ \"device\": \"drive-virtio-disk%d\", "
+            "\"stats\": { \"rd_bytes\": %d, \"wr_bytes\": %d, "
+            "\"rd_operations\": %d, \"wr_operations\": %d, "
+            "\"flush_operations\": %d, \"wr_total_time_ns\": %d, "
+            "\"rd_total_time_ns\": %d, \"flush_total_time_ns\": %d, "
+            "\"wr_highest_offset\": %d, \"idle_time_ns\": %d, "
+            "\"invalid_rd_operations\": 0, \"failed_rd_operations\": 0, "
+            "\"account_invalid\": true, \"account_failed\": true, "
+            "\"timed_stats\": [] } }",
+            i ? ", " : "", i, 1000000 * i, 2000000 * i, 1000 * i, 2000 * i,
+            10 * i, 123456 * i, 654321 * i, 1111 * i, 4096 * i, 99999 * i);
+    }
+    g_string_append(s, "] }");
+    return g_string_free(s, false);
+}
+
+static void bench_parse(uint64_t iters, void *opaque)
+{
+    JsonBench *b = opaque;
+
+    while (iters--) {
+        qobject_decref(qobject_from_json(b->json));
+    }
+}
+
+static void bench_format(uint64_t iters, void *opaque)
+{
+    JsonBench *b = opaque;
+
+    while (iters--) {
+        QDECREF(qobject_to_json(b->obj));
+    }
+}
+
+static void json_bench_add(const char *what, char *json)
+{
+    JsonBench *b = g_new(JsonBench, 1);
+    char *name;
+
+    b->json = json;
+    b->obj = qobject_from_json(json);
+    assert(b->obj);
+
+    name = g_strdup_printf("/qjson/parse/%s", what);
+    bench_add_bytes(name, bench_parse, b, strlen(json));
+    name = g_strdup_printf("/qjson/format/%s", what);
+    bench_add(name, bench_format, b);
+}
+
+int main(int argc, char **argv)
+{
+    json_bench_add("qmp-command", g_strdup(qmp_command));
+    json_bench_add("blockstats-reply", make_blockstats_reply());
+
+    return bench_main(argc, argv);
+}
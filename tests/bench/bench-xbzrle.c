@@ -0,0 +1,102 @@
+/*
+ * XBZRLE encoder and decoder benchmarks
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "include/migration/migration.h"
+#include "bench.h"
+
+#define PAGE_SIZE 4096
+
+typedef struct XbzrleBench {
+    const char *encode_name;
+    const char *decode_name;
+    int dirty_bytes;            /* number of changed bytes */
+    int run_len;                /* ...in runs of this length */
+    uint8_t *old_page;
+    uint8_t *new_page;
+    uint8_t *encoded;
+    int encoded_len;
+    uint8_t *decoded;
+} XbzrleBench;
+
+static XbzrleBench xbzrle_benches[] = {
+    { "/xbzrle/encode/unchanged", NULL, 0, 1 },
+    { "/xbzrle/encode/1-byte", "/xbzrle/decode/1-byte", 1, 1 },
+    { "/xbzrle/encode/1%-scattered", "/xbzrle/decode/1%-scattered", 40, 1 },
+    { "/xbzrle/encode/10%-runs", "/xbzrle/decode/10%-runs", 400, 16 },
+    { "/xbzrle/encode/50%-runs", NULL, 2048, 64 },
+};
+
+static void bench_encode(uint64_t iters, void *opaque)
+{
+    XbzrleBench *x = opaque;
+
+    while (iters--) {
+        bench_consume(xbzrle_encode_buffer(x->old_page, x->new_page,
+                                           PAGE_SIZE, x->encoded, PAGE_SIZE));
+    }
+}
+
+static void bench_decode(uint64_t iters, void *opaque)
+{
+    XbzrleBench *x = opaque;
+
+    /* Decoding patches the page in place, so it can be repeated */
+    while (iters--) {
+        bench_consume(xbzrle_decode_buffer(x->encoded, x->encoded_len,
+                                           x->decoded, PAGE_SIZE));
+    }
+}
+
+static void xbzrle_setup(XbzrleBench *x, GRand *rand)
+{
+    int i, j;
+
+    x->old_page = g_malloc(PAGE_SIZE);
+    x->new_page = g_malloc(PAGE_SIZE);
+    x->encoded = g_malloc(PAGE_SIZE);
+    x->decoded = g_malloc(PAGE_SIZE);
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        x->old_page[i] = g_rand_int(rand);
+    }
+    memcpy(x->new_page, x->old_page, PAGE_SIZE);
+
+    /* Spread the runs evenly over the page */
+    for (i = 0; i < x->dirty_bytes / x->run_len; i++) {
+        int start = i * (PAGE_SIZE / (x->dirty_bytes / x->run_len));
+
+        for (j = start; j < start + x->run_len; j++) {
+            x->new_page[j] = ~x->old_page[j];
+        }
+    }
+
+    x->encoded_len = xbzrle_encode_buffer(x->old_page, x->new_page, PAGE_SIZE,
+                                          x->encoded, PAGE_SIZE);
+    memcpy(x->decoded, x->old_page, PAGE_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+    GRand *rand = g_rand_new_with_seed(1);
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(xbzrle_benches); i++) {
+        XbzrleBench *x = &xbzrle_benches[i];
+
+        xbzrle_setup(x, rand);
+        bench_add_bytes(x->encode_name, bench_encode, x, PAGE_SIZE);
+        if (x->decode_name) {
+            assert(x->encoded_len > 0);
+            bench_add_bytes(x->decode_name, bench_decode, x, PAGE_SIZE);
+        }
+    }
+    g_rand_free(rand);
+
+    return bench_main(argc, argv);
+}
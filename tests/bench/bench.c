@@ -0,0 +1,254 @@
+/*
+ * Micro-benchmark harness
+ *
+ * Results are reported in nanoseconds per iteration.  The median of the
+ * samples is the figure to compare across commits; the spread shows how
+ * much it can be trusted.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <getopt.h>
+#include <math.h>
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "bench.h"
+
+#define BENCH_DEFAULT_SAMPLES   11
+#define BENCH_DEFAULT_SAMPLE_MS 20
+
+/* Calibration and warmup together take about this many samples */
+#define BENCH_WARMUP_SAMPLES    5
+
+typedef struct Bench {
+    const char *name;
+    BenchFunc *fn;
+    void *opaque;
+    uint64_t bytes;
+} Bench;
+
+typedef struct BenchStats {
+    uint64_t iters;
+    double min, median, mean, max, stddev;
+} BenchStats;
+
+volatile uint64_t bench_sink;
+
+static GPtrArray *benches;
+static const char *suite;
+static int samples = BENCH_DEFAULT_SAMPLES;
+static int64_t sample_ns = BENCH_DEFAULT_SAMPLE_MS * SCALE_MS;
+static bool json;
+
+void bench_add_bytes(const char *name, BenchFunc *fn, void *opaque,
+                     uint64_t bytes)
+{
+    Bench *b = g_new(Bench, 1);
+
+    if (!benches) {
+        benches = g_ptr_array_new_with_free_func(g_free);
+    }
+    *b = (Bench) {
+        .name   = name,
+        .fn     = fn,
+        .opaque = opaque,
+        .bytes  = bytes,
+    };
+    g_ptr_array_add(benches, b);
+}
+
+void bench_add(const char *name, BenchFunc *fn, void *opaque)
+{
+    bench_add_bytes(name, fn, opaque, 0);
+}
+
+static int64_t bench_time(Bench *b, uint64_t iters)
+{
+    int64_t start = get_clock();
+
+    b->fn(iters, b->opaque);
+    return get_clock() - start;
+}
+
+/* Find an iteration count that makes a sample last about sample_ns */
+static uint64_t bench_calibrate(Bench *b)
+{
+    int64_t deadline = get_clock() + BENCH_WARMUP_SAMPLES * sample_ns;
+    uint64_t iters = 1;
+    int64_t ns;
+
+    for (;;) {
+        ns = bench_time(b, iters);
+        if (ns >= sample_ns / 4 || iters >= (UINT64_MAX >> 4)) {
+            break;
+        }
+        iters *= 2;
+    }
+    iters = MAX(1, (uint64_t)((double)iters * sample_ns / MAX(ns, 1)));
+
+    /* Warm up caches and branch predictors for the rest of the time */
+    while (get_clock() < deadline) {
+        bench_time(b, iters);
+    }
+    return iters;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void bench_run(Bench *b, BenchStats *stats)
+{
+    double *ns_per_iter = g_new(double, samples);
+    double sum = 0, sq = 0;
+    int i;
+
+    stats->iters = bench_calibrate(b);
+    for (i = 0; i < samples; i++) {
+        ns_per_iter[i] = (double)bench_time(b, stats->iters) / stats->iters;
+        sum += ns_per_iter[i];
+    }
+
+    stats->mean = sum / samples;
+    for (i = 0; i < samples; i++) {
+        sq += (ns_per_iter[i] - stats->mean) * (ns_per_iter[i] - stats->mean);
+    }
+    stats->stddev = samples > 1 ? sqrt(sq / (samples - 1)) : 0;
+
+    qsort(ns_per_iter, samples, sizeof(double), compare_double);
+    stats->min = ns_per_iter[0];
+    stats->max = ns_per_iter[samples - 1];
+    stats->median = samples & 1 ? ns_per_iter[samples / 2] :
+        (ns_per_iter[samples / 2 - 1] + ns_per_iter[samples / 2]) / 2;
+    g_free(ns_per_iter);
+}
+
+static void bench_report(Bench *b, BenchStats *stats)
+{
+    /* bytes per nanosecond is GB/s, report MB/s */
+    double mbps = b->bytes ? b->bytes * 1000.0 / stats->median : 0;
+
+    if (json) {
+        printf("{\"suite\": \"%s\", \"name\": \"%s\", \"samples\": %d, "
+               "\"iterations\": %" PRIu64 ", \"ns\": {\"min\": %.3f, "
+               "\"median\": %.3f, \"mean\": %.3f, \"max\": %.3f, "
+               "\"stddev\": %.3f}",
+               suite, b->name, samples, stats->iters, stats->min,
+               stats->median, stats->mean, stats->max, stats->stddev);
+        if (b->bytes) {
+            printf(", \"bytes\": %" PRIu64 ", \"mb_per_s\": %.1f",
+                   b->bytes, mbps);
+        }
+        printf("}\n");
+    } else {
+        printf("%-40s %12.1f ns  +-%5.1f%%  [%.1f .. %.1f]",
+               b->name, stats->median,
+               stats->mean ? 100 * stats->stddev / stats->mean : 0,
+               stats->min, stats->max);
+        if (b->bytes) {
+            printf("  %9.1f MB/s", mbps);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+static bool bench_selected(Bench *b, char **patterns, int n)
+{
+    int i;
+
+    if (n == 0) {
+        return true;
+    }
+    for (i = 0; i < n; i++) {
+        if (g_pattern_match_simple(patterns[i], b->name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void usage(void)
+{
+    printf("Usage: %s [OPTION]... [PATTERN]...\n"
+           "Run the benchmarks whose names match one of the glob PATTERNs, "
+           "or all of them.\n\n"
+           "  -j, --json          print one JSON object per benchmark\n"
+           "  -l, --list          list the benchmarks and exit\n"
+           "  -n, --samples=N     take N samples (default %d)\n"
+           "  -t, --time=MS       make each sample last MS milliseconds "
+           "(default %d)\n"
+           "  -h, --help          display this help and exit\n",
+           suite, BENCH_DEFAULT_SAMPLES, BENCH_DEFAULT_SAMPLE_MS);
+}
+
+int bench_main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "json", no_argument, NULL, 'j' },
+        { "list", no_argument, NULL, 'l' },
+        { "samples", required_argument, NULL, 'n' },
+        { "time", required_argument, NULL, 't' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    bool list = false;
+    BenchStats stats;
+    unsigned i;
+    int c;
+
+    suite = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+
+    while ((c = getopt_long(argc, argv, "jln:t:h", long_options,
+                            NULL)) != -1) {
+        switch (c) {
+        case 'j':
+            json = true;
+            break;
+        case 'l':
+            list = true;
+            break;
+        case 'n':
+            samples = atoi(optarg);
+            if (samples <= 0) {
+                fprintf(stderr, "%s: invalid number of samples '%s'\n",
+                        suite, optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            sample_ns = (int64_t)atoi(optarg) * SCALE_MS;
+            if (sample_ns <= 0) {
+                fprintf(stderr, "%s: invalid sample time '%s'\n",
+                        suite, optarg);
+                return 1;
+            }
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            return 1;
+        }
+    }
+
+    for (i = 0; benches && i < benches->len; i++) {
+        Bench *b = g_ptr_array_index(benches, i);
+
+        if (!bench_selected(b, argv + optind, argc - optind)) {
+            continue;
+        }
+        if (list) {
+            printf("%s\n", b->name);
+            continue;
+        }
+        bench_run(b, &stats);
+        bench_report(b, &stats);
+    }
+    return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Micro-benchmark harness
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * Run @iters iterations of the measured operation.  Setup that should not
+ * be measured belongs outside, e.g. before bench_main() is called.
+ */
+typedef void BenchFunc(uint64_t iters, void *opaque);
+
+/* Register a benchmark, named like a GTest path ("/xbzrle/encode/1%") */
+void bench_add(const char *name, BenchFunc *fn, void *opaque);
+
+/* Same, and also report the throughput for @bytes bytes per iteration */
+void bench_add_bytes(const char *name, BenchFunc *fn, void *opaque,
+                     uint64_t bytes);
+
+/*
+ * Parse the command line and run the registered benchmarks.  Each one is
+ * warmed up, calibrated so that a sample takes a fixed time, and sampled
+ * several times; the statistics are printed as a table, or as one JSON
+ * object per line with --json.  Returns the exit status for main().
+ */
+int bench_main(int argc, char **argv);
+
+/* Keep the compiler from optimizing away the result of an operation */
+extern volatile uint64_t bench_sink;
+
+static inline void bench_consume(uint64_t value)
+{
+    bench_sink += value;
+}
+
+#endif
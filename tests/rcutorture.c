@@ -159,6 +159,63 @@ static void *rcu_update_perf_test(void *arg)
     return NULL;
 }
 
+/*
+ * call_rcu throughput test.  Each thread keeps at most RCU_CB_PERF_MAX
+ * callbacks in flight, so that memory use stays bounded.
+ */
+
+#define RCU_CB_PERF_MAX 100000
+
+struct rcu_cb_perf {
+    struct rcu_head rcu;
+    long *n_reclaimed;
+};
+
+static void rcu_cb_perf_reclaim(struct rcu_head *head)
+{
+    struct rcu_cb_perf *p = container_of(head, struct rcu_cb_perf, rcu);
+
+    atomic_inc(p->n_reclaimed);
+    g_free(p);
+}
+
+static void *rcu_call_perf_test(void *arg)
+{
+    long n_updates_local = 0;
+    long n_reclaimed = 0;
+    struct rcu_cb_perf *p;
+
+    rcu_register_thread();
+
+    *(struct rcu_reader_data **)arg = &rcu_reader;
+    atomic_inc(&nthreadsrunning);
+    while (goflag == GOFLAG_INIT) {
+        g_usleep(1000);
+    }
+    while (goflag == GOFLAG_RUN) {
+        if (n_updates_local - atomic_read(&n_reclaimed) >= RCU_CB_PERF_MAX) {
+            g_usleep(1000);
+            continue;
+        }
+        p = g_new(struct rcu_cb_perf, 1);
+        p->n_reclaimed = &n_reclaimed;
+        call_rcu1(&p->rcu, rcu_cb_perf_reclaim);
+        n_updates_local++;
+    }
+
+    /* n_reclaimed lives on our stack, wait for the callbacks.  */
+    call_rcu_expedite();
+    while (atomic_read(&n_reclaimed) < n_updates_local) {
+        g_usleep(1000);
+    }
+    qemu_mutex_lock(&counts_mutex);
+    n_updates += n_updates_local;
+    qemu_mutex_unlock(&counts_mutex);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
 static void perftestinit(void)
 {
     nthreadsrunning = 0;
@@ -217,6 +274,17 @@ static void uperftest(int nupdaters, int duration)
     perftestrun(i, duration, 0, nupdaters);
 }
 
+static void cbperftest(int nupdaters, int duration)
+{
+    int i;
+
+    perftestinit();
+    for (i = 0; i < nupdaters; i++) {
+        create_thread(rcu_call_perf_test);
+    }
+    perftestrun(i, duration, 0, nupdaters);
+}
+
 /*
  * Stress test.
  */
@@ -418,7 +486,8 @@ static void gtest_stress_10_5(void)
 
 static void usage(int argc, char *argv[])
 {
-    fprintf(stderr, "Usage: %s [nreaders [ perf | stress ] ]\n", argv[0]);
+    fprintf(stderr, "Usage: %s [nreaders [ perf | rperf | uperf | cbperf | "
+            "stress ] [duration] ]\n", argv[0]);
     exit(-1);
 }
 
@@ -452,6 +521,8 @@ int main(int argc, char *argv[])
         rperftest(nreaders, duration);
     } else if (strcmp(argv[2], "uperf") == 0) {
         uperftest(nreaders, duration);
+    } else if (strcmp(argv[2], "cbperf") == 0) {
+        cbperftest(nreaders, duration);
     } else if (strcmp(argv[2], "perf") == 0) {
         perftest(nreaders, duration);
     }
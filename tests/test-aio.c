@@ -16,6 +16,7 @@
 #include "qemu/timer.h"
 #include "qemu/sockets.h"
 #include "qemu/error-report.h"
+#include "qapi/error.h"
 
 static AioContext *ctx;
 
@@ -311,6 +312,37 @@ static void test_bh_flush(void)
     qemu_bh_delete(data.bh);
 }
 
+static int bh_order;
+
+static void bh_order_cb(void *opaque)
+{
+    BHTestData *data = opaque;
+    data->n = ++bh_order;
+}
+
+static void test_bh_priority(void)
+{
+    BHTestData normal = { .n = 0 };
+    BHTestData high = { .n = 0 };
+
+    bh_order = 0;
+    normal.bh = aio_bh_new(ctx, bh_order_cb, &normal);
+    high.bh = aio_bh_new(ctx, bh_order_cb, &high);
+    qemu_bh_set_priority(high.bh, QEMU_BH_PRIO_HIGH);
+
+    /* The high priority BH runs first even if it was scheduled last */
+    qemu_bh_schedule(normal.bh);
+    qemu_bh_schedule(high.bh);
+
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(high.n, ==, 1);
+    g_assert_cmpint(normal.n, ==, 2);
+
+    g_assert(!aio_poll(ctx, false));
+    qemu_bh_delete(normal.bh);
+    qemu_bh_delete(high.bh);
+}
+
 static void test_set_event_notifier(void)
 {
     EventNotifierTestData data = { .n = 0, .active = 0 };
@@ -399,6 +431,44 @@ static void test_aio_external_client(void)
     }
 }
 
+#ifndef _WIN32
+static int poll_pending;
+
+static bool poll_test_cb(void *opaque)
+{
+    if (poll_pending == 0) {
+        return false;
+    }
+    poll_pending--;
+    return true;
+}
+
+static void test_poll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 1 };
+    event_notifier_init(&data.e, false);
+    set_event_notifier(ctx, &data.e, event_ready_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, poll_test_cb);
+    aio_context_set_poll_params(ctx, 10000000, 0, 0, &error_abort);
+
+    /* The polling window starts empty, so this goes through poll() */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+
+    /* The event came quickly, so the window grew and polling finds work */
+    poll_pending = 1;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(poll_pending, ==, 0);
+    g_assert_cmpint(data.n, ==, 1);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    set_event_notifier(ctx, &data.e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e);
+}
+#endif
+
 static void test_wait_event_notifier_noflush(void)
 {
     EventNotifierTestData data = { .n = 0 };
@@ -504,6 +574,100 @@ static void test_timer_schedule(void)
     timer_del(&data.timer);
 }
 
+typedef struct TimerOrderData {
+    QEMUTimer timer;
+    int64_t expire;
+    int armed;                  /* order of the last timer_mod */
+} TimerOrderData;
+
+static TimerOrderData *last_fired;
+static int timers_fired;
+
+static void timer_order_cb(void *opaque)
+{
+    TimerOrderData *t = opaque;
+
+    if (last_fired) {
+        g_assert_cmpint(last_fired->expire, <=, t->expire);
+        if (last_fired->expire == t->expire) {
+            g_assert_cmpint(last_fired->armed, <, t->armed);
+        }
+    }
+    last_fired = t;
+    timers_fired++;
+}
+
+static void test_timer_order(void)
+{
+    QEMUTimerList *tl = timerlist_new(QEMU_CLOCK_REALTIME, NULL, NULL);
+    TimerOrderData *t = g_new0(TimerOrderData, 1000);
+    int i, armed = 0, pending = 0;
+
+    g_random_set_seed(1);
+    for (i = 0; i < 1000; i++) {
+        timer_init_tl(&t[i].timer, tl, SCALE_NS, timer_order_cb, &t[i]);
+        t[i].expire = g_random_int_range(0, 100);
+        t[i].armed = armed++;
+        timer_mod_ns(&t[i].timer, t[i].expire);
+    }
+
+    /* Move some timers, delete others */
+    for (i = 0; i < 1000; i += 3) {
+        t[i].expire = g_random_int_range(0, 100);
+        t[i].armed = armed++;
+        timer_mod_ns(&t[i].timer, t[i].expire);
+    }
+    for (i = 1; i < 1000; i += 7) {
+        timer_del(&t[i].timer);
+    }
+    for (i = 0; i < 1000; i++) {
+        pending += timer_pending(&t[i].timer);
+    }
+
+    last_fired = NULL;
+    timers_fired = 0;
+    g_assert(timerlist_run_timers(tl));
+    g_assert_cmpint(timers_fired, ==, pending);
+    g_assert(!timerlist_has_timers(tl));
+
+    for (i = 0; i < 1000; i++) {
+        timer_deinit(&t[i].timer);
+    }
+    g_free(t);
+    timerlist_free(tl);
+}
+
+static void perf_timer_mod(void)
+{
+    QEMUTimerList *tl = timerlist_new(QEMU_CLOCK_REALTIME, NULL, NULL);
+    const int ntimers = 10000, maxcycles = 10000000;
+    QEMUTimer *t = g_new0(QEMUTimer, ntimers);
+    int64_t far = INT64_MAX / 2;
+    double duration;
+    int i;
+
+    for (i = 0; i < ntimers; i++) {
+        timer_init_tl(&t[i], tl, SCALE_NS, timer_order_cb, NULL);
+        timer_mod_ns(&t[i], far + g_random_int());
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < maxcycles; i++) {
+        timer_mod_ns(&t[i % ntimers], far + g_random_int());
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("timer_mod %d iterations with %d timers: %f s\n",
+                   maxcycles, ntimers, duration);
+
+    for (i = 0; i < ntimers; i++) {
+        timer_del(&t[i]);
+        timer_deinit(&t[i]);
+    }
+    g_free(t);
+    timerlist_free(tl);
+}
+
 /* Now the same tests, using the context as a GSource.  They are
  * very similar to the ones above, with g_main_context_iteration
  * replacing aio_poll.  However:
@@ -851,12 +1015,20 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/bh/callback-delete/one",  test_bh_delete_from_cb);
     g_test_add_func("/aio/bh/callback-delete/many", test_bh_delete_from_cb_many);
     g_test_add_func("/aio/bh/flush",                test_bh_flush);
+    g_test_add_func("/aio/bh/priority",             test_bh_priority);
     g_test_add_func("/aio/event/add-remove",        test_set_event_notifier);
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
+#ifndef _WIN32
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+#endif
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/timer/order",             test_timer_order);
+    if (g_test_perf()) {
+        g_test_add_func("/aio/timer/perf-mod",      perf_timer_mod);
+    }
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
     g_test_add_func("/aio-gsource/bh/schedule",             test_source_bh_schedule);
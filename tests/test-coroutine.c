@@ -366,6 +366,59 @@ static void perf_cost(void)
                    (unsigned long)(1000000000.0 * duration / maxcycles));
 }
 
+/*
+ * Memory benchmark
+ */
+
+static bool get_mem_pages(unsigned long *size, unsigned long *resident)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    bool ok;
+
+    if (!f) {
+        return false;
+    }
+    ok = fscanf(f, "%lu %lu", size, resident) == 2;
+    fclose(f);
+    return ok;
+}
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+static void perf_memory(void)
+{
+    const unsigned int max = 10000;
+    unsigned long size0, res0, size1, res1;
+    unsigned long pagesz = getpagesize();
+    Coroutine **co = g_new(Coroutine *, max);
+    unsigned int i;
+
+    if (!get_mem_pages(&size0, &res0)) {
+        g_test_message("Memory usage not available\n");
+        g_free(co);
+        return;
+    }
+
+    /* Keep all of them alive at the same time, like in-flight requests */
+    for (i = 0; i < max; i++) {
+        co[i] = qemu_coroutine_create(yield_once);
+        qemu_coroutine_enter(co[i], NULL);
+    }
+    g_assert(get_mem_pages(&size1, &res1));
+    for (i = 0; i < max; i++) {
+        qemu_coroutine_enter(co[i], NULL);
+    }
+    g_free(co);
+
+    g_test_message("Memory %u coroutines: %lu KB virtual, %lu KB resident "
+                   "per coroutine\n", max,
+                   (size1 - size0) * pagesz / 1024 / max,
+                   (res1 - res0) * pagesz / 1024 / max);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -382,6 +435,7 @@ int main(int argc, char **argv)
         g_test_add_func("/perf/yield", perf_yield);
         g_test_add_func("/perf/function-call", perf_baseline);
         g_test_add_func("/perf/cost", perf_cost);
+        g_test_add_func("/perf/memory", perf_memory);
     }
     return g_test_run();
 }
@@ -0,0 +1,60 @@
+/*
+ * QEMU crc32c test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/crc32c.h"
+
+/* Bit at a time, to check the table and the hardware implementations */
+static uint32_t crc32c_ref(uint32_t crc, const uint8_t *data, size_t len)
+{
+    int i;
+
+    while (len--) {
+        crc ^= *data++;
+        for (i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+        }
+    }
+    return crc ^ 0xffffffff;
+}
+
+static void test_crc32c_check_value(void)
+{
+    const uint8_t *check = (const uint8_t *)"123456789";
+
+    g_assert_cmphex(crc32c(0xffffffff, check, 9), ==, 0xe3069283);
+}
+
+static void test_crc32c_alignment(void)
+{
+    uint8_t buf[256 + 16];
+    size_t a, len;
+
+    for (a = 0; a < sizeof(buf); a++) {
+        buf[a] = g_test_rand_int();
+    }
+
+    for (a = 0; a < 16; a++) {
+        for (len = 0; len <= 256; len++) {
+            uint32_t crc = g_test_rand_int();
+
+            g_assert_cmphex(crc32c(crc, buf + a, len), ==,
+                            crc32c_ref(crc, buf + a, len));
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/crc32c/check-value", test_crc32c_check_value);
+    g_test_add_func("/crc32c/alignment", test_crc32c_alignment);
+
+    return g_test_run();
+}
@@ -11,6 +11,7 @@
 
 #include "qemu/osdep.h"
 #include <glib.h>
+#include "qemu-common.h"
 #include "qemu/hbitmap.h"
 
 #define LOG_BITS_PER_LONG          (BITS_PER_LONG == 32 ? 5 : 6)
@@ -414,6 +415,172 @@ static void test_hbitmap_granularity(TestHBitmapData *data,
     g_assert_cmpint(hbitmap_count(data->hb), ==, 2);
 }
 
+static void test_hbitmap_next_dirty_area(TestHBitmapData *data,
+                                         const void *unused)
+{
+    uint64_t start, count;
+
+    hbitmap_test_init(data, L2, 0);
+    start = 0;
+    count = L2;
+    g_assert(!hbitmap_next_dirty_area(data->hb, &start, L2, &count));
+
+    hbitmap_test_set(data, 10, 20);
+    hbitmap_test_set(data, L1 + 5, 1);
+    start = 0;
+    count = L2;
+    g_assert(hbitmap_next_dirty_area(data->hb, &start, L2, &count));
+    g_assert_cmpint(start, ==, 10);
+    g_assert_cmpint(count, ==, 20);
+
+    /* Starting in the middle of an area, and with a maximum length */
+    start = 15;
+    count = 8;
+    g_assert(hbitmap_next_dirty_area(data->hb, &start, L2, &count));
+    g_assert_cmpint(start, ==, 15);
+    g_assert_cmpint(count, ==, 8);
+
+    start = 30;
+    count = L2;
+    g_assert(hbitmap_next_dirty_area(data->hb, &start, L2, &count));
+    g_assert_cmpint(start, ==, L1 + 5);
+    g_assert_cmpint(count, ==, 1);
+
+    /* An area past @end is not found */
+    start = 30;
+    count = L2;
+    g_assert(!hbitmap_next_dirty_area(data->hb, &start, L1 + 5, &count));
+}
+
+static void test_hbitmap_next_dirty_area_granularity(TestHBitmapData *data,
+                                                     const void *unused)
+{
+    uint64_t start, count;
+
+    hbitmap_test_init(data, L2, 3);
+    hbitmap_test_set(data, 17, 1);
+    hbitmap_test_set(data, 24, 1);
+    start = 0;
+    count = L2;
+    g_assert(hbitmap_next_dirty_area(data->hb, &start, L2, &count));
+    g_assert_cmpint(start, ==, 16);
+    g_assert_cmpint(count, ==, 16);
+
+    /* The last group may be cut by @end */
+    start = 0;
+    count = L2;
+    g_assert(hbitmap_next_dirty_area(data->hb, &start, 28, &count));
+    g_assert_cmpint(start, ==, 16);
+    g_assert_cmpint(count, ==, 12);
+}
+
+static void test_hbitmap_next_zero(TestHBitmapData *data,
+                                   const void *unused)
+{
+    hbitmap_test_init(data, L2, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2), ==, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 5, 5), ==, -1);
+
+    hbitmap_test_set(data, 0, L1 + 3);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2), ==, L1 + 3);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 7, L2), ==, L1 + 3);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1 + 5, L2), ==, L1 + 5);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L1 + 3), ==, -1);
+
+    /* The last bit of the bitmap */
+    hbitmap_test_set(data, L1 + 3, L2 - L1 - 4);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2), ==, L2 - 1);
+    hbitmap_test_set(data, L2 - 1, 1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2), ==, -1);
+}
+
+static void test_hbitmap_next_zero_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    hbitmap_test_init(data, L2, 2);
+    hbitmap_test_set(data, 0, 9);
+    /* Bits 8-11 are one group */
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2), ==, 12);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 13, L2), ==, 13);
+}
+
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    HBitmap *b = hbitmap_alloc(L3, 0);
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set(data, 10, 100);
+    hbitmap_test_set(data, L2 + 7, 1);
+
+    hbitmap_set(b, 50, 100);
+    hbitmap_set(b, L3 - 20, 20);
+    hbitmap_set(b, L2 + 7, 1);
+
+    g_assert(hbitmap_merge(data->hb, b));
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 140 + 1 + 20);
+    g_assert(hbitmap_get(data->hb, 149));
+    g_assert(!hbitmap_get(data->hb, 150));
+    g_assert(hbitmap_get(data->hb, L3 - 1));
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L3 - 20, L3), ==, -1);
+    hbitmap_free(b);
+
+    /* Different sizes are not merged */
+    b = hbitmap_alloc(L2, 0);
+    g_assert(!hbitmap_merge(data->hb, b));
+    hbitmap_free(b);
+}
+
+/* Run with -m perf to get timings of iteration and merge on big bitmaps */
+static void test_hbitmap_perf(TestHBitmapData *data,
+                              const void *unused)
+{
+    const uint64_t size = 1ULL << 28;
+    HBitmap *b;
+    HBitmapIter hbi;
+    uint64_t i, start, count, n;
+
+    if (!g_test_perf()) {
+        return;
+    }
+
+    /* A 16 TiB disk tracked at 64 KiB granularity, with one dirty bit
+     * every 256 MiB in the first bitmap and dense areas in the second.
+     */
+    data->hb = hbitmap_alloc(size, 0);
+    for (i = 0; i < size; i += 4096) {
+        hbitmap_set(data->hb, i, 1);
+    }
+    b = hbitmap_alloc(size, 0);
+    for (i = 0; i < size; i += 1 << 20) {
+        hbitmap_set(b, i, 1 << 19);
+    }
+
+    g_test_timer_start();
+    hbitmap_iter_init(&hbi, data->hb, 0);
+    for (n = 0; hbitmap_iter_next(&hbi) >= 0; n++) {
+        /* nothing */
+    }
+    g_test_minimized_result(g_test_timer_elapsed(),
+                            "iterate %" PRIu64 " sparse bits", n);
+
+    g_test_timer_start();
+    start = 0;
+    count = size;
+    for (n = 0; hbitmap_next_dirty_area(b, &start, size, &count); n++) {
+        start += count;
+        count = size;
+    }
+    g_test_minimized_result(g_test_timer_elapsed(),
+                            "find %" PRIu64 " dense areas", n);
+
+    g_test_timer_start();
+    hbitmap_merge(data->hb, b);
+    g_test_minimized_result(g_test_timer_elapsed(), "merge");
+
+    hbitmap_free(b);
+}
+
 static void test_hbitmap_iter_granularity(TestHBitmapData *data,
                                           const void *unused)
 {
@@ -635,6 +802,87 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+static void test_hbitmap_serialize_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    hbitmap_test_init(data, L3, 0);
+    g_assert_cmpint(hbitmap_serialization_granularity(data->hb), ==, 64);
+    hbitmap_free(data->hb);
+
+    data->hb = hbitmap_alloc(L3, 4);
+    g_assert_cmpint(hbitmap_serialization_granularity(data->hb), ==, 64 << 4);
+}
+
+static void test_hbitmap_serialize_layout(TestHBitmapData *data,
+                                          const void *unused)
+{
+    uint8_t buf[16];
+    int i;
+
+    hbitmap_test_init(data, 128, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, 9, 2);
+    hbitmap_test_set(data, 127, 1);
+
+    g_assert_cmpint(hbitmap_serialization_size(data->hb, 0, 128), ==, 16);
+    hbitmap_serialize_part(data->hb, buf, 0, 128);
+
+    /* Bit N of the bitmap is bit N % 8 of byte N / 8 */
+    g_assert_cmpint(buf[0], ==, 0x01);
+    g_assert_cmpint(buf[1], ==, 0x06);
+    for (i = 2; i < 15; i++) {
+        g_assert_cmpint(buf[i], ==, 0);
+    }
+    g_assert_cmpint(buf[15], ==, 0x80);
+}
+
+static void test_hbitmap_serialize_roundtrip(TestHBitmapData *data,
+                                             const void *unused)
+{
+    HBitmap *hb;
+    uint64_t size = L3 + 17;
+    uint64_t chunk;
+    uint64_t start, bytes, i;
+    uint8_t *buf;
+
+    hbitmap_test_init(data, size, 0);
+    hbitmap_test_set(data, 3, L1);
+    hbitmap_test_set(data, L2 + 5, L2);
+    hbitmap_test_set(data, size - 3, 3);
+
+    /* Transfer the bitmap in pieces of two serialization units */
+    chunk = 2 * hbitmap_serialization_granularity(data->hb);
+    hb = hbitmap_alloc(size, 0);
+    for (start = 0; start < size; start += chunk) {
+        uint64_t count = MIN(chunk, size - start);
+
+        bytes = hbitmap_serialization_size(data->hb, start, count);
+        buf = g_malloc(bytes);
+        hbitmap_serialize_part(data->hb, buf, start, count);
+        for (i = 0; i < bytes && !buf[i]; i++) {
+            /* look for a set bit */
+        }
+        if (i == bytes) {
+            hbitmap_deserialize_zeroes(hb, start, count, false);
+        } else {
+            hbitmap_deserialize_part(hb, buf, start, count, false);
+        }
+        g_free(buf);
+    }
+    hbitmap_deserialize_finish(hb);
+
+    g_assert_cmpint(hbitmap_count(hb), ==, hbitmap_count(data->hb));
+    for (i = 0; i < size; i++) {
+        g_assert_cmpint(hbitmap_get(hb, i), ==, hbitmap_get(data->hb, i));
+    }
+
+    /* Loading all ones must not set bits beyond the end of the bitmap */
+    hbitmap_deserialize_ones(hb, 0, size, true);
+    g_assert_cmpint(hbitmap_count(hb), ==, size);
+
+    hbitmap_free(hb);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -662,6 +910,15 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/next_dirty_area/general",
+                     test_hbitmap_next_dirty_area);
+    hbitmap_test_add("/hbitmap/next_dirty_area/granularity",
+                     test_hbitmap_next_dirty_area_granularity);
+    hbitmap_test_add("/hbitmap/next_zero/general", test_hbitmap_next_zero);
+    hbitmap_test_add("/hbitmap/next_zero/granularity",
+                     test_hbitmap_next_zero_granularity);
+    hbitmap_test_add("/hbitmap/merge", test_hbitmap_merge);
+    hbitmap_test_add("/hbitmap/perf", test_hbitmap_perf);
 
     hbitmap_test_add("/hbitmap/truncate/nop", test_hbitmap_truncate_nop);
     hbitmap_test_add("/hbitmap/truncate/grow/negligible",
@@ -684,6 +941,13 @@ int main(int argc, char **argv)
                      test_hbitmap_truncate_grow_large);
     hbitmap_test_add("/hbitmap/truncate/shrink/large",
                      test_hbitmap_truncate_shrink_large);
+
+    hbitmap_test_add("/hbitmap/serialize/granularity",
+                     test_hbitmap_serialize_granularity);
+    hbitmap_test_add("/hbitmap/serialize/layout",
+                     test_hbitmap_serialize_layout);
+    hbitmap_test_add("/hbitmap/serialize/roundtrip",
+                     test_hbitmap_serialize_roundtrip);
     g_test_run();
 
     return 0;
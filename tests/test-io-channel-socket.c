@@ -493,6 +493,68 @@ static void test_io_channel_unix_fd_pass(void)
     }
     g_free(fdrecv);
 }
+
+
+static void test_io_channel_unix_batch(void)
+{
+    SocketAddress *listen_addr = g_new0(SocketAddress, 1);
+    SocketAddress *connect_addr = g_new0(SocketAddress, 1);
+    QIOChannel *src, *dst;
+    char hdr[4] = "HDR", body[12] = "Hello World";
+    char rhdr[4], rbody[12], rtail[8];
+    struct iovec iosend[2] = {
+        { .iov_base = hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = body, .iov_len = sizeof(body) },
+    };
+    struct iovec iorecv[3] = {
+        { .iov_base = rhdr, .iov_len = sizeof(rhdr) },
+        { .iov_base = rbody, .iov_len = sizeof(rbody) },
+        { .iov_base = rtail, .iov_len = sizeof(rtail) },
+    };
+    QIOChannelMsg msgsend[2] = {
+        { .iov = &iosend[0], .niov = 1 },
+        { .iov = &iosend[1], .niov = 1 },
+    };
+    QIOChannelMsg msgrecv[2] = {
+        { .iov = &iorecv[0], .niov = 2 },
+        { .iov = &iorecv[2], .niov = 1 },
+    };
+
+#define TEST_SOCKET "test-io-channel-socket.sock"
+    listen_addr->type = SOCKET_ADDRESS_KIND_UNIX;
+    listen_addr->u.q_unix = g_new0(UnixSocketAddress, 1);
+    listen_addr->u.q_unix->path = g_strdup(TEST_SOCKET);
+
+    connect_addr->type = SOCKET_ADDRESS_KIND_UNIX;
+    connect_addr->u.q_unix = g_new0(UnixSocketAddress, 1);
+    connect_addr->u.q_unix->path = g_strdup(TEST_SOCKET);
+
+    test_io_channel_setup_sync(listen_addr, connect_addr, &src, &dst);
+
+    g_assert_cmpint(qio_channel_writev_batch(src, msgsend,
+                                             G_N_ELEMENTS(msgsend),
+                                             0, &error_abort),
+                    ==, sizeof(hdr) + sizeof(body));
+    g_assert_cmpint(msgsend[0].len, ==, sizeof(hdr));
+    g_assert_cmpint(msgsend[1].len, ==, sizeof(body));
+    g_assert(qio_channel_flush(src, &error_abort) == 0);
+
+    /* A UNIX socket hands over the whole sendmsg() at once */
+    g_assert_cmpint(qio_channel_readv_batch(dst, msgrecv,
+                                            G_N_ELEMENTS(msgrecv),
+                                            &error_abort),
+                    ==, sizeof(hdr) + sizeof(body));
+    g_assert_cmpint(msgrecv[0].len, ==, sizeof(hdr) + sizeof(body));
+    g_assert_cmpint(msgrecv[1].len, ==, 0);
+    g_assert(memcmp(hdr, rhdr, sizeof(hdr)) == 0);
+    g_assert(memcmp(body, rbody, sizeof(body)) == 0);
+
+    object_unref(OBJECT(src));
+    object_unref(OBJECT(dst));
+    qapi_free_SocketAddress(listen_addr);
+    qapi_free_SocketAddress(connect_addr);
+    unlink(TEST_SOCKET);
+}
 #endif /* _WIN32 */
 
 
@@ -564,6 +626,8 @@ int main(int argc, char **argv)
                     test_io_channel_unix_async);
     g_test_add_func("/io/channel/socket/unix-fd-pass",
                     test_io_channel_unix_fd_pass);
+    g_test_add_func("/io/channel/socket/unix-batch",
+                    test_io_channel_unix_batch);
 #endif /* _WIN32 */
 
     return g_test_run();
@@ -399,6 +399,29 @@ static void test_discard_back(void)
     iov_free(iov, iov_cnt);
 }
 
+static void test_is_zero(void)
+{
+    struct iovec *iov;
+    unsigned int iov_cnt, i;
+    size_t size, offset;
+
+    iov_random(&iov, &iov_cnt);
+    size = iov_size(iov, iov_cnt);
+    iov_memset(iov, iov_cnt, 0, 0, size);
+    g_assert(iov_is_zero(iov, iov_cnt, 0, size));
+    g_assert(iov_is_zero(iov, iov_cnt, 0, -1));
+
+    /* A non-zero byte is found only if it is in the range */
+    for (i = 0; i < size; i++) {
+        iov_memset(iov, iov_cnt, i, 1, 1);
+        offset = g_test_rand_int_range(0, size);
+        g_assert(iov_is_zero(iov, iov_cnt, offset, -1) == (i < offset));
+        g_assert(iov_is_zero(iov, iov_cnt, 0, offset) == (i >= offset));
+        iov_memset(iov, iov_cnt, i, 0, 1);
+    }
+    iov_free(iov, iov_cnt);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -407,5 +430,6 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/iov/io", test_io);
     g_test_add_func("/basic/iov/discard-front", test_discard_front);
     g_test_add_func("/basic/iov/discard-back", test_discard_back);
+    g_test_add_func("/basic/iov/is-zero", test_is_zero);
     return g_test_run();
 }
@@ -0,0 +1,249 @@
+/*
+ * JSON Output Visitor unit-tests.
+ *
+ * Copyright (C) 2016 Red Hat Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+
+#include "qemu-common.h"
+#include "qapi/json-output-visitor.h"
+#include "test-qapi-types.h"
+#include "test-qapi-visit.h"
+#include "qapi/qmp/types.h"
+
+typedef struct TestOutputVisitorData {
+    JsonOutputVisitor *jov;
+    Visitor *ov;
+} TestOutputVisitorData;
+
+static void visitor_output_setup(TestOutputVisitorData *data,
+                                 const void *unused)
+{
+    data->jov = json_output_visitor_new();
+    g_assert(data->jov != NULL);
+
+    data->ov = json_output_get_visitor(data->jov);
+    g_assert(data->ov != NULL);
+}
+
+static void visitor_output_teardown(TestOutputVisitorData *data,
+                                    const void *unused)
+{
+    json_output_visitor_cleanup(data->jov);
+    data->jov = NULL;
+    data->ov = NULL;
+}
+
+static void check_output(TestOutputVisitorData *data, const char *expected)
+{
+    QString *str = json_output_get_qstring(data->jov);
+
+    g_assert_cmpstr(qstring_get_str(str), ==, expected);
+    QDECREF(str);
+}
+
+static void test_visitor_out_int(TestOutputVisitorData *data,
+                                 const void *unused)
+{
+    int64_t value = -42;
+
+    visit_type_int(data->ov, NULL, &value, &error_abort);
+    check_output(data, "-42");
+}
+
+static void test_visitor_out_number(TestOutputVisitorData *data,
+                                    const void *unused)
+{
+    double value = 3.14;
+
+    visit_type_number(data->ov, NULL, &value, &error_abort);
+    check_output(data, "3.14");
+}
+
+static void test_visitor_out_string(TestOutputVisitorData *data,
+                                    const void *unused)
+{
+    char *string = (char *) "a \"quoted\"\tstring\\ \xc3\xa9";
+
+    visit_type_str(data->ov, NULL, &string, &error_abort);
+    check_output(data, "\"a \\\"quoted\\\"\\tstring\\\\ \\u00E9\"");
+}
+
+static void test_visitor_out_no_string(TestOutputVisitorData *data,
+                                       const void *unused)
+{
+    char *string = NULL;
+
+    /* A null string should return "" */
+    visit_type_str(data->ov, NULL, &string, &error_abort);
+    check_output(data, "\"\"");
+}
+
+static void test_visitor_out_enum(TestOutputVisitorData *data,
+                                  const void *unused)
+{
+    EnumOne e = ENUM_ONE_VALUE2;
+
+    visit_type_EnumOne(data->ov, "unused", &e, &error_abort);
+    check_output(data, "\"value2\"");
+}
+
+static void test_visitor_out_struct(TestOutputVisitorData *data,
+                                    const void *unused)
+{
+    TestStruct test_struct = { .integer = 42,
+                               .boolean = false,
+                               .string = (char *) "foo"};
+    TestStruct *p = &test_struct;
+
+    visit_type_TestStruct(data->ov, NULL, &p, &error_abort);
+    check_output(data,
+                 "{\"integer\": 42, \"boolean\": false, \"string\": \"foo\"}");
+}
+
+static void test_visitor_out_list(TestOutputVisitorData *data,
+                                  const void *unused)
+{
+    TestStructList *p, *head = NULL;
+    int i;
+
+    for (i = 2; i >= 0; i--) {
+        p = g_malloc0(sizeof(*p));
+        p->value = g_malloc0(sizeof(*p->value));
+        p->value->integer = i;
+        p->value->boolean = i & 1;
+        p->value->string = g_strdup("x");
+
+        p->next = head;
+        head = p;
+    }
+
+    visit_type_TestStructList(data->ov, NULL, &head, &error_abort);
+    check_output(data,
+                 "[{\"integer\": 0, \"boolean\": false, \"string\": \"x\"}, "
+                 "{\"integer\": 1, \"boolean\": true, \"string\": \"x\"}, "
+                 "{\"integer\": 2, \"boolean\": false, \"string\": \"x\"}]");
+
+    qapi_free_TestStructList(head);
+}
+
+static void test_visitor_out_empty_list(TestOutputVisitorData *data,
+                                        const void *unused)
+{
+    intList *head = NULL;
+
+    visit_type_intList(data->ov, NULL, &head, &error_abort);
+    check_output(data, "[]");
+}
+
+static void test_visitor_out_struct_nested(TestOutputVisitorData *data,
+                                           const void *unused)
+{
+    UserDefTwo *ud2 = g_malloc0(sizeof(*ud2));
+
+    ud2->string0 = g_strdup("s0");
+    ud2->dict1 = g_malloc0(sizeof(*ud2->dict1));
+    ud2->dict1->string1 = g_strdup("s1");
+    ud2->dict1->dict2 = g_malloc0(sizeof(*ud2->dict1->dict2));
+    ud2->dict1->dict2->userdef = g_new0(UserDefOne, 1);
+    ud2->dict1->dict2->userdef->string = g_strdup("u");
+    ud2->dict1->dict2->userdef->integer = 7;
+    ud2->dict1->dict2->string = g_strdup("s2");
+
+    visit_type_UserDefTwo(data->ov, "unused", &ud2, &error_abort);
+    check_output(data,
+                 "{\"string0\": \"s0\", \"dict1\": {\"string1\": \"s1\", "
+                 "\"dict2\": {\"userdef\": {\"integer\": 7, "
+                 "\"string\": \"u\"}, \"string\": \"s2\"}}}");
+
+    qapi_free_UserDefTwo(ud2);
+}
+
+static void test_visitor_out_any(TestOutputVisitorData *data,
+                                 const void *unused)
+{
+    QDict *qdict = qdict_new();
+    QObject *qobj;
+
+    qdict_put(qdict, "boolean", qbool_from_bool(true));
+    qobj = QOBJECT(qdict);
+    visit_type_any(data->ov, NULL, &qobj, &error_abort);
+    check_output(data, "{\"boolean\": true}");
+
+    QDECREF(qdict);
+}
+
+/* The output must match what the QMP output visitor + qobject_to_json()
+ * produce, modulo member order (a single member here) */
+static void test_visitor_out_same_as_qobject(TestOutputVisitorData *data,
+                                             const void *unused)
+{
+    int64_t values[] = { 0, -1, INT64_MAX, INT64_MIN };
+    QList *qlist = qlist_new();
+    intList *head = NULL, **tail = &head;
+    QString *json;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(values); i++) {
+        *tail = g_new0(intList, 1);
+        (*tail)->value = values[i];
+        tail = &(*tail)->next;
+        qlist_append(qlist, qint_from_int(values[i]));
+    }
+
+    visit_type_intList(data->ov, NULL, &head, &error_abort);
+    json = qobject_to_json(QOBJECT(qlist));
+    check_output(data, qstring_get_str(json));
+
+    QDECREF(json);
+    QDECREF(qlist);
+    qapi_free_intList(head);
+}
+
+static void output_visitor_test_add(const char *testpath,
+                                    TestOutputVisitorData *data,
+                                    void (*test_func)(TestOutputVisitorData *data, const void *user_data))
+{
+    g_test_add(testpath, TestOutputVisitorData, data, visitor_output_setup,
+               test_func, visitor_output_teardown);
+}
+
+int main(int argc, char **argv)
+{
+    TestOutputVisitorData out_visitor_data;
+
+    g_test_init(&argc, &argv, NULL);
+
+    output_visitor_test_add("/visitor/json/int",
+                            &out_visitor_data, test_visitor_out_int);
+    output_visitor_test_add("/visitor/json/number",
+                            &out_visitor_data, test_visitor_out_number);
+    output_visitor_test_add("/visitor/json/string",
+                            &out_visitor_data, test_visitor_out_string);
+    output_visitor_test_add("/visitor/json/no-string",
+                            &out_visitor_data, test_visitor_out_no_string);
+    output_visitor_test_add("/visitor/json/enum",
+                            &out_visitor_data, test_visitor_out_enum);
+    output_visitor_test_add("/visitor/json/struct",
+                            &out_visitor_data, test_visitor_out_struct);
+    output_visitor_test_add("/visitor/json/struct-nested",
+                            &out_visitor_data, test_visitor_out_struct_nested);
+    output_visitor_test_add("/visitor/json/list",
+                            &out_visitor_data, test_visitor_out_list);
+    output_visitor_test_add("/visitor/json/empty-list",
+                            &out_visitor_data, test_visitor_out_empty_list);
+    output_visitor_test_add("/visitor/json/any",
+                            &out_visitor_data, test_visitor_out_any);
+    output_visitor_test_add("/visitor/json/same-as-qobject",
+                            &out_visitor_data,
+                            test_visitor_out_same_as_qobject);
+
+    g_test_run();
+
+    return 0;
+}
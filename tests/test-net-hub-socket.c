@@ -0,0 +1,167 @@
+/*
+ * QTest testcase for hub forwarding through socket net clients
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "qemu-common.h"
+#include "qemu/sockets.h"
+#include "qemu/iov.h"
+
+#define FRAME_LEN   1514
+#define NUM_FRAMES  64
+
+#ifndef _WIN32
+
+/*
+ * Three stream socket clients on one hub.  The frames sent into the first
+ * one are flooded to the other two through qemu_sendv_packet_shared().
+ */
+static int hub_fds[3][2];
+
+/* A non-zero @bufsize shrinks the socket buffers of the second client */
+static void hub_start(int bufsize)
+{
+    char *cmdline;
+    int i, ret;
+
+    for (i = 0; i < 3; i++) {
+        ret = socketpair(PF_UNIX, SOCK_STREAM, 0, hub_fds[i]);
+        g_assert_cmpint(ret, !=, -1);
+    }
+    if (bufsize) {
+        setsockopt(hub_fds[1][1], SOL_SOCKET, SO_SNDBUF,
+                   &bufsize, sizeof(bufsize));
+        setsockopt(hub_fds[1][0], SOL_SOCKET, SO_RCVBUF,
+                   &bufsize, sizeof(bufsize));
+    }
+
+    cmdline = g_strdup_printf("-net socket,vlan=0,fd=%d "
+                              "-net socket,vlan=0,fd=%d "
+                              "-net socket,vlan=0,fd=%d",
+                              hub_fds[0][1], hub_fds[1][1], hub_fds[2][1]);
+    qtest_start(cmdline);
+    g_free(cmdline);
+}
+
+static void hub_end(void)
+{
+    int i;
+
+    qtest_end();
+    for (i = 0; i < 3; i++) {
+        close(hub_fds[i][0]);
+        close(hub_fds[i][1]);
+    }
+}
+
+static void fill_frame(uint8_t *frame, int n)
+{
+    memset(frame, 0xff, 6);
+    frame[6] = 0x52;
+    frame[7] = 0x54;
+    frame[8] = 0x00;
+    frame[9] = 0x12;
+    frame[10] = 0x34;
+    frame[11] = 0x56;
+    memset(frame + 12, n, FRAME_LEN - 12);
+}
+
+static void send_frame(int fd, int n)
+{
+    uint8_t frame[FRAME_LEN];
+    uint32_t len = htonl(sizeof(frame));
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        }, {
+            .iov_base = frame,
+            .iov_len = sizeof(frame),
+        },
+    };
+    int ret;
+
+    fill_frame(frame, n);
+    ret = iov_send(fd, iov, 2, 0, sizeof(len) + sizeof(frame));
+    g_assert_cmpint(ret, ==, sizeof(len) + sizeof(frame));
+}
+
+static void recv_frame(int fd, int n)
+{
+    uint8_t frame[FRAME_LEN], expected[FRAME_LEN];
+    uint32_t len;
+    int ret;
+
+    ret = qemu_recv(fd, &len, sizeof(len), MSG_WAITALL);
+    g_assert_cmpint(ret, ==, sizeof(len));
+    g_assert_cmpint(ntohl(len), ==, sizeof(frame));
+
+    ret = qemu_recv(fd, frame, sizeof(frame), MSG_WAITALL);
+    g_assert_cmpint(ret, ==, sizeof(frame));
+
+    fill_frame(expected, n);
+    g_assert(memcmp(frame, expected, sizeof(frame)) == 0);
+}
+
+static void test_hub_flood(void)
+{
+    int i;
+
+    hub_start(0);
+
+    for (i = 0; i < NUM_FRAMES; i++) {
+        send_frame(hub_fds[0][0], i);
+    }
+    for (i = 0; i < NUM_FRAMES; i++) {
+        recv_frame(hub_fds[1][0], i);
+        recv_frame(hub_fds[2][0], i);
+    }
+
+    hub_end();
+}
+
+/*
+ * The second client is not read until all frames went out to the third,
+ * so its socket fills up.  The hub then queues the frames for it, and the
+ * queued copies are shared with the ports that could not take them either.
+ * They must arrive intact and in order once the socket is drained.
+ */
+static void test_hub_flood_busy(void)
+{
+    uint32_t len;
+    int i;
+
+    hub_start(4096);
+
+    for (i = 0; i < NUM_FRAMES; i++) {
+        send_frame(hub_fds[0][0], i);
+    }
+    for (i = 0; i < NUM_FRAMES; i++) {
+        recv_frame(hub_fds[2][0], i);
+    }
+    for (i = 0; i < NUM_FRAMES; i++) {
+        recv_frame(hub_fds[1][0], i);
+    }
+
+    /* Nothing came back to the sender */
+    g_assert_cmpint(qemu_recv(hub_fds[0][0], &len, sizeof(len),
+                              MSG_DONTWAIT), ==, -1);
+
+    hub_end();
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+#ifndef _WIN32
+    qtest_add_func("/net/hub/socket/flood", test_hub_flood);
+    qtest_add_func("/net/hub/socket/flood-busy", test_hub_flood_busy);
+#endif
+    return g_test_run();
+}
@@ -0,0 +1,360 @@
+/*
+ * Hub net client tests
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qemu/iov.h"
+#include "qemu/timer.h"
+#include "net/net.h"
+#include "net/queue.h"
+#include "net/hub.h"
+
+/*
+ * net/hub.c and net/queue.c are linked in as they are.  The parts of
+ * net/net.c that they use are replaced by the minimal versions below:
+ * no filters, no vlan bookkeeping, and the VM is always running.  The
+ * real net/net.c side of the shared buffer path is covered by the
+ * test-net-hub-socket qtest.
+ */
+
+static int64_t test_clock_ms = 1000 * 1000;
+
+int64_t qemu_clock_get_ns(QEMUClockType type)
+{
+    return test_clock_ms * SCALE_MS;
+}
+
+static ssize_t test_deliver(NetClientState *sender, unsigned flags,
+                            const struct iovec *iov, int iovcnt,
+                            void *opaque)
+{
+    NetClientState *nc = opaque;
+    ssize_t ret;
+
+    if (nc->info->receive_iov) {
+        ret = nc->info->receive_iov(nc, iov, iovcnt);
+    } else {
+        uint8_t buf[2048];
+        size_t len = iov_to_buf(iov, iovcnt, 0, buf, sizeof(buf));
+
+        ret = nc->info->receive(nc, buf, len);
+    }
+    if (ret == 0) {
+        nc->receive_disabled = 1;
+    }
+    return ret;
+}
+
+NetClientState *qemu_new_net_client(NetClientInfo *info,
+                                    NetClientState *peer,
+                                    const char *model,
+                                    const char *name)
+{
+    NetClientState *nc = g_malloc0(info->size);
+
+    nc->info = info;
+    nc->model = g_strdup(model);
+    nc->name = g_strdup(name);
+    if (peer) {
+        nc->peer = peer;
+        peer->peer = nc;
+    }
+    nc->incoming_queue = qemu_new_net_queue(test_deliver, nc);
+    QTAILQ_INIT(&nc->filters);
+    return nc;
+}
+
+int qemu_can_send_packet(NetClientState *sender)
+{
+    if (!sender->peer) {
+        return 1;
+    }
+    if (sender->peer->receive_disabled) {
+        return 0;
+    }
+    return !sender->peer->info->can_receive ||
+           sender->peer->info->can_receive(sender->peer);
+}
+
+ssize_t qemu_sendv_packet_shared(NetClientState *sender,
+                                 const struct iovec *iov, int iovcnt,
+                                 NetPacketBuf **shared)
+{
+    if (sender->link_down || !sender->peer) {
+        return iov_size(iov, iovcnt);
+    }
+    return qemu_net_queue_send_iov_shared(sender->peer->incoming_queue,
+                                          sender, QEMU_NET_PACKET_FLAG_NONE,
+                                          iov, iovcnt, shared, NULL);
+}
+
+void print_net_client(Monitor *mon, NetClientState *nc)
+{
+}
+
+/* A client on a hub port that records what it receives */
+typedef struct TestClient {
+    NetClientState nc;
+    bool busy;
+    int packets;
+    uint8_t last[64];
+    size_t last_len;
+} TestClient;
+
+static int test_client_can_receive(NetClientState *nc)
+{
+    TestClient *c = DO_UPCAST(TestClient, nc, nc);
+
+    return !c->busy;
+}
+
+static ssize_t test_client_receive(NetClientState *nc, const uint8_t *buf,
+                                   size_t size)
+{
+    TestClient *c = DO_UPCAST(TestClient, nc, nc);
+
+    if (c->busy) {
+        return 0;
+    }
+    c->packets++;
+    c->last_len = MIN(size, sizeof(c->last));
+    memcpy(c->last, buf, c->last_len);
+    return size;
+}
+
+static NetClientInfo test_nic_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_NIC,
+    .size = sizeof(TestClient),
+    .can_receive = test_client_can_receive,
+    .receive = test_client_receive,
+};
+
+static NetClientInfo test_dump_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_DUMP,
+    .size = sizeof(TestClient),
+    .can_receive = test_client_can_receive,
+    .receive = test_client_receive,
+};
+
+static TestClient *test_client_new(int hub_id, NetClientInfo *info,
+                                   const char *name)
+{
+    NetClientState *port = net_hub_add_port(hub_id, NULL);
+    NetClientState *nc = qemu_new_net_client(info, port, "test", name);
+
+    return DO_UPCAST(TestClient, nc, nc);
+}
+
+static void test_client_reset(TestClient **clients, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        clients[i]->packets = 0;
+        clients[i]->last_len = 0;
+    }
+}
+
+/* Let a busy client take its queued packets */
+static void test_client_unblock(TestClient *c)
+{
+    c->busy = false;
+    c->nc.receive_disabled = 0;
+    qemu_net_queue_flush(c->nc.incoming_queue);
+}
+
+static const uint8_t mac_bcast[ETH_ALEN] = { 0xff, 0xff, 0xff,
+                                             0xff, 0xff, 0xff };
+
+static void test_mac(uint8_t *mac, int n)
+{
+    mac[0] = 0x52;
+    mac[1] = 0x54;
+    mac[2] = 0x00;
+    mac[3] = n >> 16;
+    mac[4] = n >> 8;
+    mac[5] = n;
+}
+
+/* Send a frame from @c into its hub port */
+static void test_send(TestClient *c, const uint8_t *dst, const uint8_t *src,
+                      uint8_t payload)
+{
+    uint8_t frame[60];
+    struct iovec iov = {
+        .iov_base = frame,
+        .iov_len = sizeof(frame),
+    };
+    NetPacketBuf *shared = NULL;
+
+    memset(frame, payload, sizeof(frame));
+    memcpy(frame, dst, ETH_ALEN);
+    memcpy(frame + ETH_ALEN, src, ETH_ALEN);
+    qemu_sendv_packet_shared(&c->nc, &iov, 1, &shared);
+    qemu_net_packet_buf_unref(shared);
+}
+
+static void test_hub_learning(void)
+{
+    TestClient *c[3];
+    uint8_t mac_a[ETH_ALEN], mac_b[ETH_ALEN], mac_x[ETH_ALEN];
+
+    c[0] = test_client_new(1, &test_nic_info, "a");
+    c[1] = test_client_new(1, &test_nic_info, "b");
+    c[2] = test_client_new(1, &test_nic_info, "c");
+    test_mac(mac_a, 1);
+    test_mac(mac_b, 2);
+    test_mac(mac_x, 99);
+
+    /* Broadcasts are flooded, but not sent back to the source */
+    test_send(c[0], mac_bcast, mac_a, 1);
+    g_assert_cmpint(c[0]->packets, ==, 0);
+    g_assert_cmpint(c[1]->packets, ==, 1);
+    g_assert_cmpint(c[2]->packets, ==, 1);
+    g_assert_cmpint(c[1]->last_len, ==, 60);
+    g_assert(memcmp(c[1]->last + ETH_ALEN, mac_a, ETH_ALEN) == 0);
+
+    /* a was learned from the broadcast, so the reply only goes to a */
+    test_client_reset(c, 3);
+    test_send(c[1], mac_a, mac_b, 2);
+    g_assert_cmpint(c[0]->packets, ==, 1);
+    g_assert_cmpint(c[1]->packets, ==, 0);
+    g_assert_cmpint(c[2]->packets, ==, 0);
+    g_assert_cmpint(c[0]->last[ETH_HLEN], ==, 2);
+
+    test_client_reset(c, 3);
+    test_send(c[0], mac_b, mac_a, 3);
+    g_assert_cmpint(c[0]->packets, ==, 0);
+    g_assert_cmpint(c[1]->packets, ==, 1);
+    g_assert_cmpint(c[2]->packets, ==, 0);
+
+    /* Unknown unicast is flooded */
+    test_client_reset(c, 3);
+    test_send(c[0], mac_x, mac_a, 4);
+    g_assert_cmpint(c[0]->packets, ==, 0);
+    g_assert_cmpint(c[1]->packets, ==, 1);
+    g_assert_cmpint(c[2]->packets, ==, 1);
+
+    /* An address that moves is learned on its new port */
+    test_client_reset(c, 3);
+    test_send(c[2], mac_bcast, mac_b, 5);
+    test_client_reset(c, 3);
+    test_send(c[0], mac_b, mac_a, 6);
+    g_assert_cmpint(c[1]->packets, ==, 0);
+    g_assert_cmpint(c[2]->packets, ==, 1);
+}
+
+static void test_hub_dump(void)
+{
+    TestClient *c[3];
+    uint8_t mac_a[ETH_ALEN], mac_b[ETH_ALEN];
+
+    c[0] = test_client_new(2, &test_nic_info, "a");
+    c[1] = test_client_new(2, &test_nic_info, "b");
+    c[2] = test_client_new(2, &test_dump_info, "dump");
+    test_mac(mac_a, 1);
+    test_mac(mac_b, 2);
+
+    test_send(c[0], mac_bcast, mac_a, 1);
+    test_send(c[1], mac_bcast, mac_b, 2);
+    g_assert_cmpint(c[2]->packets, ==, 2);
+
+    /* Unicast between learned addresses still reaches the dump client */
+    test_client_reset(c, 3);
+    test_send(c[0], mac_b, mac_a, 3);
+    test_send(c[1], mac_a, mac_b, 4);
+    g_assert_cmpint(c[0]->packets, ==, 1);
+    g_assert_cmpint(c[1]->packets, ==, 1);
+    g_assert_cmpint(c[2]->packets, ==, 2);
+    g_assert_cmpint(c[2]->last[ETH_HLEN], ==, 4);
+}
+
+static void test_hub_shared_queue(void)
+{
+    TestClient *c[4];
+    uint8_t mac_a[ETH_ALEN];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        char name[8];
+
+        snprintf(name, sizeof(name), "c%d", i);
+        c[i] = test_client_new(3, &test_nic_info, name);
+    }
+    test_mac(mac_a, 1);
+
+    /*
+     * c1..c3 cannot receive, so the flooded packets are queued for all
+     * three of them with one shared copy each.  Each copy must survive
+     * until the last port has taken it, and be released once; run the
+     * test under valgrind to check the latter.
+     */
+    c[1]->busy = c[2]->busy = c[3]->busy = true;
+    test_send(c[0], mac_bcast, mac_a, 0x11);
+    test_send(c[0], mac_bcast, mac_a, 0x22);
+    for (i = 1; i < 4; i++) {
+        g_assert_cmpint(c[i]->packets, ==, 0);
+    }
+
+    test_client_unblock(c[1]);
+    g_assert_cmpint(c[1]->packets, ==, 2);
+    g_assert_cmpint(c[1]->last[ETH_HLEN], ==, 0x22);
+
+    /* Drop what c2's hub port queued, as when the port is removed */
+    qemu_net_queue_purge(c[2]->nc.incoming_queue, c[2]->nc.peer);
+    test_client_unblock(c[2]);
+    g_assert_cmpint(c[2]->packets, ==, 0);
+
+    test_client_unblock(c[3]);
+    g_assert_cmpint(c[3]->packets, ==, 2);
+    g_assert_cmpint(c[3]->last_len, ==, 60);
+    g_assert_cmpint(c[3]->last[ETH_HLEN], ==, 0x22);
+    g_assert_cmpint(c[3]->last[59], ==, 0x22);
+}
+
+static void test_hub_fdb_expire(void)
+{
+    TestClient *c[3];
+    uint8_t mac[ETH_ALEN], mac_new[ETH_ALEN];
+    int i;
+
+    c[0] = test_client_new(4, &test_nic_info, "a");
+    c[1] = test_client_new(4, &test_nic_info, "b");
+    c[2] = test_client_new(4, &test_nic_info, "c");
+
+    /* Fill the forwarding database with addresses behind a */
+    for (i = 0; i < 4096; i++) {
+        test_mac(mac, 0x10000 + i);
+        test_send(c[0], mac_bcast, mac, 1);
+    }
+
+    /* A full table does not learn new addresses... */
+    test_mac(mac_new, 1);
+    test_send(c[1], mac_bcast, mac_new, 2);
+    test_client_reset(c, 3);
+    test_send(c[0], mac_new, mac, 3);
+    g_assert_cmpint(c[1]->packets, ==, 1);
+    g_assert_cmpint(c[2]->packets, ==, 1);
+
+    /* ...until its entries have expired */
+    test_clock_ms += 301 * 1000;
+    test_send(c[1], mac_bcast, mac_new, 4);
+    test_client_reset(c, 3);
+    test_send(c[0], mac_new, mac, 5);
+    g_assert_cmpint(c[1]->packets, ==, 1);
+    g_assert_cmpint(c[2]->packets, ==, 0);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/hub/learning", test_hub_learning);
+    g_test_add_func("/net/hub/dump", test_hub_dump);
+    g_test_add_func("/net/hub/shared-queue", test_hub_shared_queue);
+    g_test_add_func("/net/hub/fdb-expire", test_hub_fdb_expire);
+    return g_test_run();
+}
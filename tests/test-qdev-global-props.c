@@ -27,6 +27,7 @@
 
 #include "hw/qdev.h"
 #include "qom/object.h"
+#include "qapi/error.h"
 #include "qapi/visitor.h"
 
 
@@ -280,6 +281,30 @@ static void test_dynamic_globalprop_nouser(void)
     g_test_trap_assert_stdout("");
 }
 
+/* QOM casts and property lookups dominate creating and realizing a
+ * device with no realize function of its own.
+ */
+static void perf_create_realize(void)
+{
+    unsigned int i, max;
+    double duration;
+
+    max = 100000;
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        Object *obj = object_new(TYPE_STATIC_PROPS);
+
+        object_property_set_bool(obj, true, "realized", &error_abort);
+        g_assert_cmpuint(STATIC_TYPE(obj)->prop1, ==, PROP_DEFAULT);
+        object_unparent(obj);
+        object_unref(obj);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Create and realize %u devices: %f s\n", max, duration);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -311,6 +336,10 @@ int main(int argc, char **argv)
     g_test_add_func("/qdev/properties/dynamic/global/nouser",
                     test_dynamic_globalprop_nouser);
 
+    if (g_test_perf()) {
+        g_test_add_func("/qdev/perf/create-realize", perf_create_realize);
+    }
+
     g_test_run();
 
     return 0;
@@ -579,6 +579,83 @@ static void test_qga_file_write_read(gconstpointer fix)
     g_free(cmd);
 }
 
+static void test_qga_file_transfer(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    const char helloworld[] = "Hello World!\n";
+    gchar *cmd, *path, *port, *sum, *data;
+    QDict *ret, *val;
+    int64_t id;
+    gsize len;
+    bool active = true;
+
+    path = g_build_filename(fixture->test_dir, "foo", NULL);
+    g_assert(g_file_set_contents(path, helloworld, -1, NULL));
+    /* a regular file stands in for the virtio-serial port */
+    port = g_build_filename(fixture->test_dir, "port", NULL);
+    g_assert(g_file_set_contents(port, "", 0, NULL));
+
+    /* open */
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-open',"
+                 " 'arguments': { 'path': 'foo', 'mode': 'r' } }");
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    id = qdict_get_int(ret, "return");
+    QDECREF(ret);
+
+    /* transfer */
+    cmd = g_strdup_printf("{'execute': 'guest-file-transfer',"
+                          " 'arguments': { 'handle': %" PRId64 ","
+                          " 'port': '%s', 'direction': 'to-host' } }",
+                          id, port);
+    ret = qmp_fd(fixture->fd, cmd);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    QDECREF(ret);
+    g_free(cmd);
+
+    /* wait for the end */
+    cmd = g_strdup_printf("{'execute': 'guest-file-transfer-status',"
+                          " 'arguments': { 'handle': %" PRId64 "} }",
+                          id);
+    while (active) {
+        ret = qmp_fd(fixture->fd, cmd);
+        g_assert_nonnull(ret);
+        qmp_assert_no_error(ret);
+        val = qdict_get_qdict(ret, "return");
+        active = qdict_get_bool(val, "active");
+        if (!active) {
+            sum = g_compute_checksum_for_string(G_CHECKSUM_SHA256,
+                                                helloworld, -1);
+            g_assert(!qdict_haskey(val, "error"));
+            g_assert_cmpint(qdict_get_int(val, "count"), ==,
+                            strlen(helloworld));
+            g_assert_cmpstr(qdict_get_str(val, "sha256"), ==, sum);
+            g_free(sum);
+        }
+        QDECREF(ret);
+    }
+    g_free(cmd);
+
+    /* check content */
+    g_assert(g_file_get_contents(port, &data, &len, NULL));
+    g_assert_cmpint(len, ==, strlen(helloworld));
+    g_assert_cmpstr(data, ==, helloworld);
+    g_free(data);
+
+    /* close */
+    cmd = g_strdup_printf("{'execute': 'guest-file-close',"
+                          " 'arguments': {'handle': %" PRId64 "} }",
+                          id);
+    ret = qmp_fd(fixture->fd, cmd);
+    QDECREF(ret);
+    g_free(cmd);
+
+    unlink(port);
+    g_free(port);
+    g_free(path);
+}
+
 static void test_qga_get_time(gconstpointer fix)
 {
     const TestFixture *fixture = fix;
@@ -846,6 +923,7 @@ int main(int argc, char **argv)
                          test_qga_get_memory_blocks);
     g_test_add_data_func("/qga/file-ops", &fix, test_qga_file_ops);
     g_test_add_data_func("/qga/file-write-read", &fix, test_qga_file_write_read);
+    g_test_add_data_func("/qga/file-transfer", &fix, test_qga_file_transfer);
     g_test_add_data_func("/qga/get-time", &fix, test_qga_get_time);
     g_test_add_data_func("/qga/invalid-cmd", &fix, test_qga_invalid_cmd);
     g_test_add_data_func("/qga/fsfreeze-status", &fix,
@@ -626,6 +626,52 @@ static void test_groups(void)
     g_assert(bdrv3->throttle_state == NULL);
 }
 
+static void test_group_members(void)
+{
+    ThrottleGroupMemberConfig cfg1, cfg2;
+    BlockDriverState *bdrv1, *bdrv2;
+
+    bdrv1 = bdrv_new();
+    bdrv2 = bdrv_new();
+
+    throttle_group_register_bs(bdrv1, "bar");
+    throttle_group_register_bs(bdrv2, "bar");
+
+    /* Members start with the default weight */
+    throttle_group_get_member_config(bdrv1, &cfg1);
+    g_assert_cmpint(cfg1.weight, ==, THROTTLE_GROUP_DEFAULT_WEIGHT);
+    g_assert_cmpint(cfg1.latency_target, ==, 0);
+    g_assert_cmpint(cfg1.burst_credit, ==, 0);
+    g_assert(throttle_group_member_config_is_valid(&cfg1, NULL));
+
+    /* Setting the config of a member only affects that member */
+    cfg1.weight = 400;
+    cfg1.latency_target = 20;
+    cfg1.burst_credit = 1 << 20;
+    throttle_group_set_member_config(bdrv1, &cfg1);
+
+    throttle_group_get_member_config(bdrv1, &cfg2);
+    g_assert(!memcmp(&cfg1, &cfg2, sizeof(cfg1)));
+    throttle_group_get_member_config(bdrv2, &cfg2);
+    g_assert_cmpint(cfg2.weight, ==, THROTTLE_GROUP_DEFAULT_WEIGHT);
+
+    /* Both members start at the same virtual time */
+    g_assert(bdrv1->throttle_vtime[0] == bdrv2->throttle_vtime[0]);
+    g_assert(bdrv1->throttle_vtime[1] == bdrv2->throttle_vtime[1]);
+
+    cfg2.weight = 0;
+    g_assert(!throttle_group_member_config_is_valid(&cfg2, NULL));
+    cfg2.weight = THROTTLE_GROUP_MAX_WEIGHT + 1;
+    g_assert(!throttle_group_member_config_is_valid(&cfg2, NULL));
+    cfg2.weight = THROTTLE_GROUP_MAX_WEIGHT;
+    g_assert(throttle_group_member_config_is_valid(&cfg2, NULL));
+    cfg2.burst_credit = THROTTLE_VALUE_MAX + 1;
+    g_assert(!throttle_group_member_config_is_valid(&cfg2, NULL));
+
+    throttle_group_unregister_bs(bdrv1);
+    throttle_group_unregister_bs(bdrv2);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -649,6 +695,7 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/group_members",      test_group_members);
     return g_test_run();
 }
 
@@ -293,6 +293,64 @@ static void test_simple_primitive(void)
 }
 #undef FIELD_EQUAL
 
+/* Arrays of integers are transferred in bulk */
+
+typedef struct TestArray {
+    uint8_t  u8[3];
+    uint16_t u16[2];
+    uint32_t u32[2];
+    int64_t  i64[2];
+} TestArray;
+
+TestArray obj_array = {
+    .u8 = { 1, 2, 130 },
+    .u16 = { 512, 3 },
+    .u32 = { 70000, 4 },
+    .i64 = { 12121212, -12121212 },
+};
+
+static const VMStateDescription vmstate_simple_array = {
+    .name = "simple/array",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8_ARRAY(u8, TestArray, 3),
+        VMSTATE_UINT16_ARRAY(u16, TestArray, 2),
+        VMSTATE_UINT32_ARRAY(u32, TestArray, 2),
+        VMSTATE_INT64_ARRAY(i64, TestArray, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+uint8_t wire_simple_array[] = {
+    /* u8 */    0x01, 0x02, 0x82,
+    /* u16 */   0x02, 0x00, 0x00, 0x03,
+    /* u32 */   0x00, 0x01, 0x11, 0x70, 0x00, 0x00, 0x00, 0x04,
+    /* i64 */   0x00, 0x00, 0x00, 0x00, 0x00, 0xb8, 0xf4, 0x7c,
+                0xff, 0xff, 0xff, 0xff, 0xff, 0x47, 0x0b, 0x84,
+    QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+};
+
+static void obj_array_copy(void *target, void *source)
+{
+    memcpy(target, source, sizeof(TestArray));
+}
+
+static void test_simple_array(void)
+{
+    TestArray obj, obj_clone;
+
+    memset(&obj, 0, sizeof(obj));
+    save_vmstate(&vmstate_simple_array, &obj_array);
+
+    compare_vmstate(wire_simple_array, sizeof(wire_simple_array));
+
+    SUCCESS(load_vmstate(&vmstate_simple_array, &obj, &obj_clone,
+                         obj_array_copy, 1, wire_simple_array,
+                         sizeof(wire_simple_array)));
+    SUCCESS(memcmp(&obj, &obj_array, sizeof(obj)));
+}
+
 typedef struct TestStruct {
     uint32_t a, b, c, e;
     uint64_t d, f;
@@ -489,6 +547,7 @@ int main(int argc, char **argv)
 
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/vmstate/simple/primitive", test_simple_primitive);
+    g_test_add_func("/vmstate/simple/array", test_simple_array);
     g_test_add_func("/vmstate/versioned/load/v1", test_load_v1);
     g_test_add_func("/vmstate/versioned/load/v2", test_load_v2);
     g_test_add_func("/vmstate/field_exists/load/noskip", test_load_noskip);
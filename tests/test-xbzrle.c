@@ -173,6 +173,50 @@ static void test_encode_decode(void)
     }
 }
 
+/* Runs of random length anywhere in the page, including at its end */
+static void encode_decode_runs(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE * 2);
+    int i, j, len, dlen, rc;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, PAGE_SIZE);
+
+    for (i = g_test_rand_int_range(0, 64); i < PAGE_SIZE; i += len) {
+        len = g_test_rand_int_range(1, 80);
+        for (j = i; j < i + len && j < PAGE_SIZE; j++) {
+            new[j] = old[j] + 1;
+        }
+        i += len;
+        len = g_test_rand_int_range(1, 80);
+    }
+
+    dlen = xbzrle_encode_buffer(old, new, PAGE_SIZE, compressed,
+                                PAGE_SIZE * 2);
+    g_assert(dlen > 0);
+
+    rc = xbzrle_decode_buffer(compressed, dlen, old, PAGE_SIZE);
+    g_assert(rc <= PAGE_SIZE);
+    g_assert(memcmp(old, new, PAGE_SIZE) == 0);
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+}
+
+static void test_encode_decode_runs(void)
+{
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        encode_decode_runs();
+    }
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -185,6 +229,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_runs", test_encode_decode_runs);
 
     return g_test_run();
 }
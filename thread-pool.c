@@ -26,6 +26,7 @@
 static void do_spawn_thread(ThreadPool *pool);
 
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolWorker ThreadPoolWorker;
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -36,84 +37,193 @@ enum ThreadState {
 struct ThreadPoolElement {
     BlockAIOCB common;
     ThreadPool *pool;
+    ThreadPoolWorker *worker;
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /* Moving state out of THREAD_QUEUED is protected by worker->lock.
+     * After that, only the thread that runs the request can write to it.
+     * Reads and writes of state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Access to this list is protected by worker->lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
+enum WorkerState {
+    WORKER_NONE,        /* free slot */
+    WORKER_NEW,         /* takes requests, but the thread is not created yet */
+    WORKER_RUNNING,
+};
+
+/* Each worker has its own queue, so that submitting a request only
+ * contends with the one worker that will run it.  Workers that run out
+ * of requests steal from the tail of the other queues before sleeping.
+ */
+struct ThreadPoolWorker {
+    ThreadPool *pool;
+    QemuSemaphore sem;
+
+    /* state is written with both pool->lock and lock taken.  */
+    enum WorkerState state;
+
+    /* The following variables are protected by lock.  */
+    QemuMutex lock;
+    QTAILQ_HEAD(ThreadPoolRequests, ThreadPoolElement) requests;
+    int queued;
+    bool sleeping;
+};
+
 struct ThreadPool {
     AioContext *ctx;
     QEMUBH *completion_bh;
     QemuMutex lock;
     QemuCond worker_stopped;
-    QemuSemaphore sem;
     int max_threads;
     QEMUBH *new_thread_bh;
+    ThreadPoolWorker *workers;
 
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    int next_worker;
+
+    /* Number of sleeping workers, changed with their worker->lock taken */
+    int idle_threads;
 
     /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
     int cur_threads;
-    int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     bool stopping;
 };
 
-static void *worker_thread(void *opaque)
+static void thread_pool_run(ThreadPool *pool, ThreadPoolElement *req)
 {
-    ThreadPool *pool = opaque;
+    int ret;
 
-    qemu_mutex_lock(&pool->lock);
-    pool->pending_threads--;
-    do_spawn_thread(pool);
+    ret = req->func(req->arg);
+
+    req->ret = ret;
+    /* Write ret before state.  */
+    smp_wmb();
+    req->state = THREAD_DONE;
+
+    qemu_bh_schedule(pool->completion_bh);
+}
+
+/* Takes the last request of another worker's queue.  Busy queues are
+ * skipped rather than waited for, the worker that owns them is running.
+ */
+static ThreadPoolElement *thread_pool_steal(ThreadPool *pool,
+                                            ThreadPoolWorker *self)
+{
+    int start = self - pool->workers;
+    int i;
 
-    while (!pool->stopping) {
+    for (i = 1; i < pool->max_threads; i++) {
+        ThreadPoolWorker *w = &pool->workers[(start + i) % pool->max_threads];
         ThreadPoolElement *req;
+
+        if (!atomic_read(&w->queued) || qemu_mutex_trylock(&w->lock)) {
+            continue;
+        }
+        req = QTAILQ_LAST(&w->requests, ThreadPoolRequests);
+        if (req) {
+            QTAILQ_REMOVE(&w->requests, req, reqs);
+            w->queued--;
+            req->state = THREAD_ACTIVE;
+        }
+        qemu_mutex_unlock(&w->lock);
+
+        if (req) {
+            return req;
+        }
+    }
+    return NULL;
+}
+
+/* Runs requests until the worker has been idle for 10 seconds or the pool
+ * is stopping.  Called and returns with w->lock taken.
+ */
+static void worker_run(ThreadPoolWorker *w)
+{
+    ThreadPool *pool = w->pool;
+
+    while (!atomic_read(&pool->stopping)) {
+        ThreadPoolElement *req = QTAILQ_FIRST(&w->requests);
         int ret;
 
-        do {
-            pool->idle_threads++;
-            qemu_mutex_unlock(&pool->lock);
-            ret = qemu_sem_timedwait(&pool->sem, 10000);
-            qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
-            break;
+        if (req) {
+            QTAILQ_REMOVE(&w->requests, req, reqs);
+            w->queued--;
+            req->state = THREAD_ACTIVE;
+            qemu_mutex_unlock(&w->lock);
+        } else {
+            qemu_mutex_unlock(&w->lock);
+            req = thread_pool_steal(pool, w);
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
+        if (req) {
+            thread_pool_run(pool, req);
+            qemu_mutex_lock(&w->lock);
+            continue;
+        }
+
+        qemu_mutex_lock(&w->lock);
+        if (!QTAILQ_EMPTY(&w->requests)) {
+            continue;
+        }
 
-        ret = req->func(req->arg);
+        w->sleeping = true;
+        atomic_inc(&pool->idle_threads);
+        qemu_mutex_unlock(&w->lock);
+        ret = qemu_sem_timedwait(&w->sem, 10000);
+        qemu_mutex_lock(&w->lock);
+        if (w->sleeping) {
+            w->sleeping = false;
+            atomic_dec(&pool->idle_threads);
+        }
 
-        req->ret = ret;
-        /* Write ret before state.  */
-        smp_wmb();
-        req->state = THREAD_DONE;
+        if (ret == -1 && QTAILQ_EMPTY(&w->requests)) {
+            return;
+        }
+    }
+}
 
-        qemu_mutex_lock(&pool->lock);
+static void *worker_thread(void *opaque)
+{
+    ThreadPoolWorker *w = opaque;
+    ThreadPool *pool = w->pool;
 
-        qemu_bh_schedule(pool->completion_bh);
+    qemu_mutex_lock(&pool->lock);
+    pool->pending_threads--;
+    do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
+
+    qemu_mutex_lock(&w->lock);
+    for (;;) {
+        worker_run(w);
+
+        /* Retake the locks in the right order.  A request may come in
+         * meanwhile, then the slot cannot be given back yet.
+         */
+        qemu_mutex_unlock(&w->lock);
+        qemu_mutex_lock(&pool->lock);
+        qemu_mutex_lock(&w->lock);
+        if (pool->stopping || QTAILQ_EMPTY(&w->requests)) {
+            break;
+        }
+        qemu_mutex_unlock(&pool->lock);
     }
 
+    w->state = WORKER_NONE;
+    qemu_mutex_unlock(&w->lock);
+
     pool->cur_threads--;
     qemu_cond_signal(&pool->worker_stopped);
     qemu_mutex_unlock(&pool->lock);
@@ -123,16 +233,30 @@ static void *worker_thread(void *opaque)
 static void do_spawn_thread(ThreadPool *pool)
 {
     QemuThread t;
+    ThreadPoolWorker *w;
+    int i;
 
     /* Runs with lock taken.  */
     if (!pool->new_threads) {
         return;
     }
 
+    for (i = 0; i < pool->max_threads; i++) {
+        if (pool->workers[i].state == WORKER_NEW) {
+            break;
+        }
+    }
+    assert(i < pool->max_threads);
+    w = &pool->workers[i];
+
+    qemu_mutex_lock(&w->lock);
+    w->state = WORKER_RUNNING;
+    qemu_mutex_unlock(&w->lock);
+
     pool->new_threads--;
     pool->pending_threads++;
 
-    qemu_thread_create(&t, "worker", worker_thread, pool, QEMU_THREAD_DETACHED);
+    qemu_thread_create(&t, "worker", worker_thread, w, QEMU_THREAD_DETACHED);
 }
 
 static void spawn_thread_bh_fn(void *opaque)
@@ -144,8 +268,27 @@ static void spawn_thread_bh_fn(void *opaque)
     qemu_mutex_unlock(&pool->lock);
 }
 
-static void spawn_thread(ThreadPool *pool)
+/* Reserves a worker slot, which takes requests right away.  Runs with lock
+ * taken.
+ */
+static ThreadPoolWorker *spawn_thread(ThreadPool *pool)
 {
+    ThreadPoolWorker *w = NULL;
+    int i;
+
+    for (i = 0; i < pool->max_threads; i++) {
+        if (pool->workers[i].state == WORKER_NONE) {
+            w = &pool->workers[i];
+            break;
+        }
+    }
+    assert(w);
+
+    qemu_mutex_lock(&w->lock);
+    w->state = WORKER_NEW;
+    w->sleeping = false;
+    qemu_mutex_unlock(&w->lock);
+
     pool->cur_threads++;
     pool->new_threads++;
     /* If there are threads being created, they will spawn new workers, so
@@ -158,6 +301,35 @@ static void spawn_thread(ThreadPool *pool)
     if (!pool->pending_threads) {
         qemu_bh_schedule(pool->new_thread_bh);
     }
+    return w;
+}
+
+/* Prefers a sleeping worker, otherwise goes round-robin over the busy
+ * ones.  The result is only a hint, the worker may exit before its lock
+ * is taken.
+ */
+static ThreadPoolWorker *thread_pool_pick_worker(ThreadPool *pool)
+{
+    ThreadPoolWorker *busy = NULL;
+    int i, n = pool->max_threads;
+
+    for (i = 0; i < n; i++) {
+        int idx = (pool->next_worker + i) % n;
+        ThreadPoolWorker *w = &pool->workers[idx];
+
+        if (atomic_read(&w->state) == WORKER_NONE) {
+            continue;
+        }
+        if (atomic_read(&w->sleeping)) {
+            pool->next_worker = (idx + 1) % n;
+            return w;
+        }
+        if (!busy) {
+            busy = w;
+            pool->next_worker = (idx + 1) % n;
+        }
+    }
+    return busy;
 }
 
 static void thread_pool_completion_bh(void *opaque)
@@ -197,25 +369,23 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
     ThreadPool *pool = elem->pool;
+    ThreadPoolWorker *w = elem->worker;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    qemu_mutex_lock(&pool->lock);
-    if (elem->state == THREAD_QUEUED &&
-        /* No thread has yet started working on elem. we can try to "steal"
-         * the item from the worker if we can get a signal from the
-         * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
-         */
-        qemu_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
+    /* A queued request stays on the queue of the worker it was submitted
+     * to, until a worker takes it under that lock.
+     */
+    qemu_mutex_lock(&w->lock);
+    if (elem->state == THREAD_QUEUED) {
+        QTAILQ_REMOVE(&w->requests, elem, reqs);
+        w->queued--;
         qemu_bh_schedule(pool->completion_bh);
 
-        elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        elem->state = THREAD_DONE;
     }
-
-    qemu_mutex_unlock(&pool->lock);
+    qemu_mutex_unlock(&w->lock);
 }
 
 static AioContext *thread_pool_get_aio_context(BlockAIOCB *acb)
@@ -236,6 +406,8 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
+    ThreadPoolWorker *w;
+    bool wake;
 
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
@@ -247,13 +419,50 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    w = NULL;
+    if (atomic_read(&pool->idle_threads) == 0) {
+        qemu_mutex_lock(&pool->lock);
+        if (pool->cur_threads < pool->max_threads) {
+            w = spawn_thread(pool);
+        }
+        qemu_mutex_unlock(&pool->lock);
+    }
+
+    for (;;) {
+        if (!w) {
+            w = thread_pool_pick_worker(pool);
+        }
+        if (!w) {
+            /* All workers exited after idle_threads was read */
+            qemu_mutex_lock(&pool->lock);
+            w = spawn_thread(pool);
+            qemu_mutex_unlock(&pool->lock);
+        }
+        qemu_mutex_lock(&w->lock);
+        if (w->state != WORKER_NONE) {
+            break;
+        }
+        qemu_mutex_unlock(&w->lock);
+        w = NULL;
+    }
+
+    req->worker = w;
+    QTAILQ_INSERT_TAIL(&w->requests, req, reqs);
+    w->queued++;
+
+    /* Only the first request queued to a sleeping worker wakes it up, so
+     * a burst of submissions costs one wakeup per worker.
+     */
+    wake = w->sleeping;
+    if (wake) {
+        w->sleeping = false;
+        atomic_dec(&pool->idle_threads);
+    }
+    qemu_mutex_unlock(&w->lock);
+
+    if (wake) {
+        qemu_sem_post(&w->sem);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
-    qemu_sem_post(&pool->sem);
     return &req->common;
 }
 
@@ -287,6 +496,8 @@ void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
 
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
+    int i;
+
     if (!ctx) {
         ctx = qemu_get_aio_context();
     }
@@ -294,14 +505,24 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     memset(pool, 0, sizeof(*pool));
     pool->ctx = ctx;
     pool->completion_bh = aio_bh_new(ctx, thread_pool_completion_bh, pool);
+    qemu_bh_set_priority(pool->completion_bh, QEMU_BH_PRIO_HIGH);
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
-    qemu_sem_init(&pool->sem, 0);
     pool->max_threads = 64;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
+    pool->workers = g_new0(ThreadPoolWorker, pool->max_threads);
+    for (i = 0; i < pool->max_threads; i++) {
+        ThreadPoolWorker *w = &pool->workers[i];
+
+        w->pool = pool;
+        w->state = WORKER_NONE;
+        qemu_mutex_init(&w->lock);
+        qemu_sem_init(&w->sem, 0);
+        QTAILQ_INIT(&w->requests);
+    }
+
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -313,6 +534,8 @@ ThreadPool *thread_pool_new(AioContext *ctx)
 
 void thread_pool_free(ThreadPool *pool)
 {
+    int i;
+
     if (!pool) {
         return;
     }
@@ -323,20 +546,38 @@ void thread_pool_free(ThreadPool *pool)
 
     /* Stop new threads from spawning */
     qemu_bh_delete(pool->new_thread_bh);
+    for (i = 0; i < pool->max_threads; i++) {
+        ThreadPoolWorker *w = &pool->workers[i];
+
+        if (w->state == WORKER_NEW) {
+            qemu_mutex_lock(&w->lock);
+            w->state = WORKER_NONE;
+            qemu_mutex_unlock(&w->lock);
+        }
+    }
     pool->cur_threads -= pool->new_threads;
     pool->new_threads = 0;
 
     /* Wait for worker threads to terminate */
-    pool->stopping = true;
+    atomic_set(&pool->stopping, true);
     while (pool->cur_threads > 0) {
-        qemu_sem_post(&pool->sem);
+        for (i = 0; i < pool->max_threads; i++) {
+            if (pool->workers[i].state == WORKER_RUNNING) {
+                qemu_sem_post(&pool->workers[i].sem);
+            }
+        }
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
     }
 
     qemu_mutex_unlock(&pool->lock);
 
+    for (i = 0; i < pool->max_threads; i++) {
+        qemu_sem_destroy(&pool->workers[i].sem);
+        qemu_mutex_destroy(&pool->workers[i].lock);
+    }
+    g_free(pool->workers);
+
     qemu_bh_delete(pool->completion_bh);
-    qemu_sem_destroy(&pool->sem);
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
     g_free(pool);
@@ -12,6 +12,9 @@
 #ifdef CONFIG_TRACE_SIMPLE
 #include "trace/simple.h"
 #endif
+#ifdef CONFIG_TRACE_RING
+#include "trace/ring.h"
+#endif
 #ifdef CONFIG_TRACE_FTRACE
 #include "trace/ftrace.h"
 #endif
@@ -178,6 +181,9 @@ void trace_init_file(const char *file)
 {
 #ifdef CONFIG_TRACE_SIMPLE
     st_set_trace_file(file);
+#elif defined CONFIG_TRACE_RING
+    /* As with the log backend, the simple backend takes precedence */
+    rt_set_trace_file(file);
 #elif defined CONFIG_TRACE_LOG
     /* If both the simple and the log backends are enabled, "-trace file"
      * only applies to the simple backend; use "-D" for the log backend.
@@ -203,6 +209,13 @@ bool trace_init_backends(void)
     }
 #endif
 
+#ifdef CONFIG_TRACE_RING
+    if (!rt_init()) {
+        fprintf(stderr, "failed to initialize ring tracing backend.\n");
+        return false;
+    }
+#endif
+
 #ifdef CONFIG_TRACE_FTRACE
     if (!ftrace_init()) {
         fprintf(stderr, "failed to initialize ftrace backend.\n");
@@ -212,3 +225,32 @@ bool trace_init_backends(void)
 
     return true;
 }
+
+#if defined(CONFIG_TRACE_SIMPLE) || defined(CONFIG_TRACE_RING)
+void trace_file_print_status(FILE *stream, fprintf_function stream_printf)
+{
+#ifdef CONFIG_TRACE_SIMPLE
+    st_print_trace_file_status(stream, stream_printf);
+#else
+    rt_print_trace_file_status(stream, stream_printf);
+#endif
+}
+
+void trace_file_set_enabled(bool enable)
+{
+#ifdef CONFIG_TRACE_SIMPLE
+    st_set_trace_file_enabled(enable);
+#else
+    rt_set_trace_file_enabled(enable);
+#endif
+}
+
+void trace_file_flush(void)
+{
+#ifdef CONFIG_TRACE_SIMPLE
+    st_flush_trace_buffer();
+#else
+    rt_flush_trace_buffer();
+#endif
+}
+#endif
@@ -182,6 +182,20 @@ void trace_init_events(const char *file);
  */
 void trace_init_file(const char *file);
 
+#if defined(CONFIG_TRACE_SIMPLE) || defined(CONFIG_TRACE_RING)
+/**
+ * trace_file_print_status:
+ * trace_file_set_enabled:
+ * trace_file_flush:
+ *
+ * Control the output file of the backend that trace_init_file() applies
+ * to, for the "trace-file" monitor command.
+ */
+void trace_file_print_status(FILE *stream, fprintf_function stream_printf);
+void trace_file_set_enabled(bool enable);
+void trace_file_flush(void);
+#endif
+
 /**
  * trace_list_events:
  *
@@ -0,0 +1,332 @@
+/*
+ * Per-thread ring buffer trace backend
+ *
+ * Copyright (c) 2016 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * Each thread that emits trace events gets its own ring buffer, so
+ * recording an event takes no lock and no atomic read-modify-write:
+ * the thread is the only producer of its ring, and the writeout thread
+ * the only consumer.  Timestamps are raw host CPU ticks (the TSC on
+ * x86); every chunk written to the file carries a tick/nanosecond pair
+ * so that scripts/ringtrace.py can convert them and merge the threads.
+ *
+ * File format, all fields in host byte order:
+ *
+ *   header:  u64 magic, u64 version, u64 pid
+ *   chunk:   u64 chunk magic, u64 thread id, u64 ticks, u64 ns,
+ *            u64 records dropped since the previous chunk, u64 length
+ *            followed by @length bytes of records
+ *   record:  u64 ticks, u32 event id, u32 length (a multiple of 8)
+ *            followed by the arguments, as in the simple backend
+ */
+
+#include "qemu/osdep.h"
+#include <pthread.h>
+#include "qemu/timer.h"
+#include "qemu/atomic.h"
+#include "trace.h"
+#include "trace/control.h"
+#include "trace/ring.h"
+
+#define RING_HEADER_MAGIC 0x52494e4754524331ULL   /* "RINGTRC1" */
+#define RING_HEADER_VERSION 1
+#define RING_CHUNK_MAGIC 0x52494e474348554eULL    /* "RINGCHUN" */
+
+enum {
+    RING_BUF_LEN = 256 * 1024,      /* per thread, must be a power of 2 */
+    RING_WRITEOUT_INTERVAL_US = 100 * 1000,
+};
+
+typedef struct {
+    uint64_t ticks;
+    uint32_t event;
+    uint32_t length;
+    uint64_t arguments[];
+} RingRecordHeader;
+
+typedef struct {
+    uint64_t magic;
+    uint64_t tid;
+    uint64_t ticks;
+    uint64_t ns;
+    uint64_t dropped;
+    uint64_t length;
+} RingChunkHeader;
+
+struct TraceRing {
+    uint8_t *buf;
+    unsigned int head;      /* written by the owner thread only */
+    unsigned int tail;      /* written by the writeout thread only */
+    unsigned int dropped;   /* written by the owner thread only */
+    unsigned int dropped_written;
+    bool busy;              /* a record is being written (signal safety) */
+    bool exited;            /* the owner thread is gone */
+    uint64_t tid;
+    TraceRing *next;
+};
+
+/* Protects ring_list and the trace file */
+static CompatGMutex ring_lock;
+static TraceRing *ring_list;
+static pthread_key_t ring_key;
+static __thread TraceRing *ring_self;
+
+static FILE *trace_fp;
+static char *trace_file_name;
+static uint32_t trace_pid;
+
+static void ring_thread_exit(void *opaque)
+{
+    TraceRing *ring = opaque;
+
+    /* Events traced from here on get a new ring.  The writeout thread
+     * frees this one once it is drained. */
+    ring_self = NULL;
+    atomic_mb_set(&ring->exited, true);
+}
+
+static TraceRing *ring_get(void)
+{
+    TraceRing *ring = ring_self;
+
+    if (likely(ring)) {
+        return ring;
+    }
+
+    /* First event of this thread; use malloc, g_malloc can be traced */
+    ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+    ring->buf = malloc(RING_BUF_LEN);
+    if (!ring->buf) {
+        free(ring);
+        return NULL;
+    }
+    ring->tid = qemu_get_thread_id();
+
+    g_mutex_lock(&ring_lock);
+    ring->next = ring_list;
+    ring_list = ring;
+    g_mutex_unlock(&ring_lock);
+
+    pthread_setspecific(ring_key, ring);
+    ring_self = ring;
+    return ring;
+}
+
+static unsigned int ring_write(TraceRing *ring, unsigned int idx,
+                               const void *data, size_t size)
+{
+    unsigned int off = idx & (RING_BUF_LEN - 1);
+    size_t first = MIN(size, RING_BUF_LEN - off);
+
+    memcpy(ring->buf + off, data, first);
+    memcpy(ring->buf, (const uint8_t *)data + first, size - first);
+    return idx + size;
+}
+
+int ring_record_start(RingTraceRecord *rec, TraceEventID event,
+                      size_t datasize)
+{
+    TraceRing *ring = ring_get();
+    RingRecordHeader hdr;
+    uint32_t len = QEMU_ALIGN_UP(sizeof(hdr) + datasize, 8);
+
+    if (!ring || ring->busy) {
+        return -ENOSPC;
+    }
+    if (len > RING_BUF_LEN - (ring->head - atomic_read(&ring->tail))) {
+        /* Ring full, event dropped */
+        ring->dropped++;
+        return -ENOSPC;
+    }
+
+    ring->busy = true;
+    hdr.ticks = cpu_get_host_ticks();
+    hdr.event = event;
+    hdr.length = len;
+    rec->ring = ring;
+    rec->start = ring->head;
+    rec->off = ring_write(ring, ring->head, &hdr, sizeof(hdr));
+    return 0;
+}
+
+void ring_record_write_u64(RingTraceRecord *rec, uint64_t val)
+{
+    rec->off = ring_write(rec->ring, rec->off, &val, sizeof(val));
+}
+
+void ring_record_write_str(RingTraceRecord *rec, const char *s, uint32_t slen)
+{
+    rec->off = ring_write(rec->ring, rec->off, &slen, sizeof(slen));
+    rec->off = ring_write(rec->ring, rec->off, s, slen);
+}
+
+void ring_record_finish(RingTraceRecord *rec)
+{
+    TraceRing *ring = rec->ring;
+
+    /* The record contents must be visible before the new head */
+    smp_wmb();
+    atomic_set(&ring->head, QEMU_ALIGN_UP(rec->off, 8));
+    ring->busy = false;
+}
+
+/* Write out the records of @ring; called with ring_lock held */
+static void ring_drain(TraceRing *ring, int64_t ticks, int64_t ns)
+{
+    unsigned int head = atomic_read(&ring->head);
+    unsigned int tail = ring->tail;
+    unsigned int dropped = atomic_read(&ring->dropped);
+    unsigned int off = tail & (RING_BUF_LEN - 1);
+    size_t len = head - tail;
+    size_t first = MIN(len, RING_BUF_LEN - off);
+    RingChunkHeader chunk;
+    size_t unused __attribute__ ((unused));
+
+    if (!len && dropped == ring->dropped_written) {
+        return;
+    }
+
+    /* Read the records only after seeing the new head */
+    smp_rmb();
+    if (trace_fp) {
+        chunk.magic = RING_CHUNK_MAGIC;
+        chunk.tid = ring->tid;
+        chunk.ticks = ticks;
+        chunk.ns = ns;
+        chunk.dropped = dropped - ring->dropped_written;
+        chunk.length = len;
+        unused = fwrite(&chunk, sizeof(chunk), 1, trace_fp);
+        unused = fwrite(ring->buf + off, first, 1, trace_fp);
+        unused = fwrite(ring->buf, len - first, 1, trace_fp);
+    }
+    ring->dropped_written = dropped;
+
+    /* Let the owner reuse the space only after it has been copied */
+    smp_mb();
+    atomic_set(&ring->tail, head);
+}
+
+static void ring_drain_all(void)
+{
+    TraceRing **p, *ring;
+    int64_t ticks = cpu_get_host_ticks();
+    int64_t ns = get_clock();
+
+    g_mutex_lock(&ring_lock);
+    p = &ring_list;
+    while ((ring = *p)) {
+        bool exited = atomic_mb_read(&ring->exited);
+
+        ring_drain(ring, ticks, ns);
+        if (exited) {
+            *p = ring->next;
+            free(ring->buf);
+            free(ring);
+        } else {
+            p = &ring->next;
+        }
+    }
+    if (trace_fp) {
+        fflush(trace_fp);
+    }
+    g_mutex_unlock(&ring_lock);
+}
+
+static gpointer writeout_thread(gpointer opaque)
+{
+    for (;;) {
+        g_usleep(RING_WRITEOUT_INTERVAL_US);
+        ring_drain_all();
+    }
+    return NULL;
+}
+
+void rt_flush_trace_buffer(void)
+{
+    ring_drain_all();
+}
+
+void rt_set_trace_file_enabled(bool enable)
+{
+    if (enable == !!trace_fp) {
+        return; /* no change */
+    }
+
+    ring_drain_all();
+
+    g_mutex_lock(&ring_lock);
+    if (enable) {
+        uint64_t header[3] = {
+            RING_HEADER_MAGIC, RING_HEADER_VERSION, trace_pid
+        };
+
+        trace_fp = fopen(trace_file_name, "wb");
+        if (trace_fp && fwrite(header, sizeof(header), 1, trace_fp) != 1) {
+            fclose(trace_fp);
+            trace_fp = NULL;
+        }
+    } else {
+        fclose(trace_fp);
+        trace_fp = NULL;
+    }
+    g_mutex_unlock(&ring_lock);
+}
+
+/**
+ * Set the name of a trace file
+ *
+ * @file        The trace file name or NULL for the default name-<pid> set at
+ *              config time
+ */
+void rt_set_trace_file(const char *file)
+{
+    rt_set_trace_file_enabled(false);
+
+    g_free(trace_file_name);
+
+    if (!file) {
+        trace_file_name = g_strdup_printf(CONFIG_TRACE_FILE, (pid_t)getpid());
+    } else {
+        trace_file_name = g_strdup_printf("%s", file);
+    }
+
+    rt_set_trace_file_enabled(true);
+}
+
+void rt_print_trace_file_status(FILE *stream, fprintf_function stream_printf)
+{
+    stream_printf(stream, "Trace file \"%s\" %s.\n",
+                  trace_file_name, trace_fp ? "on" : "off");
+}
+
+bool rt_init(void)
+{
+    GThread *thread;
+    sigset_t set, oldset;
+
+    trace_pid = getpid();
+    if (pthread_key_create(&ring_key, ring_thread_exit)) {
+        fprintf(stderr, "warning: unable to initialize ring trace backend\n");
+        return false;
+    }
+
+    /* Don't let the writeout thread steal signals, as in the simple
+     * backend */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    thread = g_thread_new("trace-ring", writeout_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (!thread) {
+        fprintf(stderr, "warning: unable to initialize ring trace backend\n");
+        return false;
+    }
+
+    atexit(rt_flush_trace_buffer);
+    return true;
+}
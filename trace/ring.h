@@ -0,0 +1,60 @@
+/*
+ * Per-thread ring buffer trace backend
+ *
+ * Copyright (c) 2016 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef TRACE_RING_H
+#define TRACE_RING_H
+
+
+#include "trace/generated-events.h"
+
+
+void rt_print_trace_file_status(FILE *stream, fprintf_function stream_printf);
+void rt_set_trace_file_enabled(bool enable);
+void rt_set_trace_file(const char *file);
+bool rt_init(void);
+void rt_flush_trace_buffer(void);
+
+typedef struct TraceRing TraceRing;
+
+typedef struct {
+    TraceRing *ring;
+    unsigned int start;
+    unsigned int off;
+} RingTraceRecord;
+
+#define RING_MAX_TRACE_STRLEN 512
+
+/**
+ * Claim space for a record in the ring buffer of the calling thread
+ *
+ * @arglen  number of bytes required for arguments
+ *
+ * Returns 0 on success, or -ENOSPC if the record was dropped.
+ */
+int ring_record_start(RingTraceRecord *rec, TraceEventID id, size_t arglen);
+
+/**
+ * Append a 64-bit argument to a trace record
+ */
+void ring_record_write_u64(RingTraceRecord *rec, uint64_t val);
+
+/**
+ * Append a string argument to a trace record
+ */
+void ring_record_write_str(RingTraceRecord *rec, const char *s, uint32_t slen);
+
+/**
+ * Publish a trace record to the writeout thread
+ *
+ * Don't append any more arguments to the trace record after calling this.
+ */
+void ring_record_finish(RingTraceRecord *rec);
+
+#endif /* TRACE_RING_H */
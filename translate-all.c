@@ -32,6 +32,7 @@
 #include "tcg.h"
 #if defined(CONFIG_USER_ONLY)
 #include "qemu.h"
+#include "exec/tb-cache.h"
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
 #include <sys/param.h>
 #if __FreeBSD_version >= 700104
@@ -120,37 +121,60 @@ static void *l1_map[V_L1_SIZE];
 /* code generation context */
 TCGContext tcg_ctx;
 
+/* True if other vCPUs may run concurrently with the one being translated
+ * for, so that guest atomic operations must be atomic on the host too.
+ */
+bool parallel_cpus;
+
+/* If non-zero, TBs are first translated without optimization and
+   retranslated after executing this many times.  */
+int tcg_tier_threshold;
+
+/* Symbols for the generated code, in the format read by perf(1).  */
+static FILE *perf_map_file;
+
 /* translation block context */
-#ifdef CONFIG_USER_ONLY
 __thread int have_tb_lock;
-#endif
 
+/* tb_lock protects the code generation context, the TB hash tables and
+ * the per-page TB lists.  With multi-threaded TCG several vCPU threads
+ * may translate or invalidate code at the same time, so it is taken for
+ * system emulation as well as for user-mode emulation.
+ */
 void tb_lock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(!have_tb_lock);
     qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
     have_tb_lock++;
-#endif
 }
 
 void tb_unlock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(have_tb_lock);
     have_tb_lock--;
     qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
-#endif
 }
 
 void tb_lock_reset(void)
 {
-#ifdef CONFIG_USER_ONLY
     if (have_tb_lock) {
         qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
         have_tb_lock = 0;
     }
-#endif
+}
+
+/* Take tb_lock unless the calling thread already holds it, which happens
+ * when a guest memory write is emulated while translating (for example a
+ * page table walk that updates accessed bits).  Returns true if the caller
+ * must release the lock with tb_unlock().
+ */
+bool tb_lock_recursive(void)
+{
+    if (have_tb_lock) {
+        return false;
+    }
+    tb_lock();
+    return true;
 }
 
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
@@ -300,6 +324,8 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
 bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
 {
     TranslationBlock *tb;
+    bool locked = tb_lock_recursive();
+    bool found = false;
 
     tb = tb_find_pc(retaddr);
     if (tb) {
@@ -310,9 +336,13 @@ bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
             tb_phys_invalidate(tb, -1);
             tb_free(tb);
         }
-        return true;
+        found = true;
     }
-    return false;
+
+    if (locked) {
+        tb_unlock();
+    }
+    return found;
 }
 
 void page_size_init(void)
@@ -399,8 +429,9 @@ static void page_init(void)
 #endif
 }
 
-/* If alloc=1:
- * Called with mmap_lock held for user-mode emulation.
+/* Lookups are lock-free, and so is the allocation of missing levels:
+ * when two threads race to fill the same slot, the loser frees its
+ * copy.  The flags in the PageDesc are still protected by mmap_lock.
  */
 static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
 {
@@ -416,11 +447,17 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
         void **p = atomic_rcu_read(lp);
 
         if (p == NULL) {
+            void **existing;
+
             if (!alloc) {
                 return NULL;
             }
             p = g_new0(void *, V_L2_SIZE);
-            atomic_rcu_set(lp, p);
+            existing = atomic_cmpxchg(lp, NULL, p);
+            if (unlikely(existing)) {
+                g_free(p);
+                p = existing;
+            }
         }
 
         lp = p + ((index >> (i * V_L2_BITS)) & (V_L2_SIZE - 1));
@@ -428,11 +465,17 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
 
     pd = atomic_rcu_read(lp);
     if (pd == NULL) {
+        PageDesc *existing;
+
         if (!alloc) {
             return NULL;
         }
         pd = g_new0(PageDesc, V_L2_SIZE);
-        atomic_rcu_set(lp, pd);
+        existing = atomic_cmpxchg(lp, NULL, pd);
+        if (unlikely(existing)) {
+            g_free(pd);
+            pd = existing;
+        }
     }
 
     return pd + (index & (V_L2_SIZE - 1));
@@ -465,7 +508,8 @@ static inline PageDesc *page_find(tb_page_addr_t index)
 #elif defined(__powerpc64__)
 # define MAX_CODE_GEN_BUFFER_SIZE  (2ul * 1024 * 1024 * 1024)
 #elif defined(__aarch64__)
-# define MAX_CODE_GEN_BUFFER_SIZE  (128ul * 1024 * 1024)
+  /* goto_tb uses ADRP when B cannot reach, for a +- 4GB range.  */
+# define MAX_CODE_GEN_BUFFER_SIZE  (2ul * 1024 * 1024 * 1024)
 #elif defined(__arm__)
 # define MAX_CODE_GEN_BUFFER_SIZE  (16u * 1024 * 1024)
 #elif defined(__s390x__)
@@ -735,6 +779,13 @@ static inline void code_gen_alloc(size_t tb_size)
     qemu_mutex_init(&tcg_ctx.tb_ctx.tb_lock);
 }
 
+static void tb_htable_init(void)
+{
+    unsigned int mode = QHT_MODE_AUTO_RESIZE;
+
+    qht_init(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE, mode);
+}
+
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
    (in bytes) allocated to the translation buffer. Zero means default
    size. */
@@ -742,6 +793,7 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     page_init();
+    tb_htable_init();
     code_gen_alloc(tb_size);
 #if defined(CONFIG_SOFTMMU)
     /* There's no guest base to take into account, so go ahead and
@@ -755,30 +807,107 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Regions smaller than this would be evicted too often to be useful.  */
+#define TB_REGION_MIN_SIZE (256 * 1024)
+
+/* Divide the code buffer and the TB descriptors between the regions.
+   This is done when the first TB is allocated after a flush, because
+   the prologue is only carved out of the buffer by tcg_prologue_init.  */
+static void tb_regions_init(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t size = tcg_ctx.code_gen_buffer_size;
+    int i, n, max_tbs;
+
+    n = MAX(MIN(size / TB_REGION_MIN_SIZE, TB_REGIONS_MAX), 1);
+    ctx->region_size = QEMU_ALIGN_DOWN(size / n, CODE_GEN_ALIGN);
+    max_tbs = tcg_ctx.code_gen_max_blocks / n;
+    for (i = 0; i < n; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        r->tbs = ctx->tbs + i * max_tbs;
+        r->nb_tbs = 0;
+        r->max_tbs = max_tbs;
+        r->start = tcg_ctx.code_gen_buffer + i * ctx->region_size;
+        r->end = r->start + ctx->region_size;
+        r->code_ptr = r->start;
+    }
+    ctx->nb_regions = n;
+    ctx->cur_region = 0;
+    tcg_ctx.code_gen_ptr = ctx->regions[0].start;
+    tcg_ctx.code_gen_highwater = ctx->regions[0].end - 1024;
+}
+
+static void *tb_region_code_end(int i)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+
+    return i == ctx->cur_region ? tcg_ctx.code_gen_ptr
+                                : ctx->regions[i].code_ptr;
+}
+
+#if !defined(CONFIG_USER_ONLY) || defined(DEBUG_FLUSH)
+static int tb_count(void)
+{
+    int i, n = 0;
+
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions; i++) {
+        n += tcg_ctx.tb_ctx.regions[i].nb_tbs;
+    }
+    return n;
+}
+
+static size_t tb_code_size(void)
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions; i++) {
+        size += tb_region_code_end(i) - tcg_ctx.tb_ctx.regions[i].start;
+    }
+    return size;
+}
+#endif
+
+/* Allocate a new translation block in the current region.  Return NULL
+   if the region has run out of TB descriptors; the caller then evicts
+   the next region.  */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
     TranslationBlock *tb;
+    TBRegion *r;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks) {
+    if (unlikely(ctx->nb_regions == 0)) {
+        tb_regions_init();
+    }
+    r = &ctx->regions[ctx->cur_region];
+    if (r->nb_tbs >= r->max_tbs) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    /* Not linked yet; see do_tb_evict.  */
+    tb->page_addr[0] = -1;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
+
+    if (ctx->nb_regions == 0) {
+        return;
+    }
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    r = &ctx->regions[ctx->cur_region];
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
-        tcg_ctx.tb_ctx.nb_tbs--;
+        r->nb_tbs--;
     }
 }
 
@@ -822,91 +951,183 @@ static void page_flush_tb(void)
     }
 }
 
-/* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUState *cpu)
+/* flush all the translation blocks, unless another flush already
+ * happened since @tb_flush_req was sampled */
+static void do_tb_flush(CPUState *cpu, unsigned int tb_flush_req)
 {
+    bool locked = tb_lock_recursive();
+
+    if (tcg_ctx.tb_ctx.tb_flush_count != tb_flush_req) {
+        goto done;
+    }
+
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
-           tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.tb_ctx.nb_tbs > 0 ?
-           ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)) /
-           tcg_ctx.tb_ctx.nb_tbs : 0);
+           (unsigned long)tb_code_size(), tb_count(), tb_count() > 0 ?
+           (unsigned long)tb_code_size() / tb_count() : 0);
 #endif
     if ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)
         > tcg_ctx.code_gen_buffer_size) {
         cpu_abort(cpu, "Internal error: code buffer overflow\n");
     }
-    tcg_ctx.tb_ctx.nb_tbs = 0;
+    /* tb_alloc will start over from the first region.  */
+    tcg_ctx.tb_ctx.nb_regions = 0;
 
     CPU_FOREACH(cpu) {
         memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0, sizeof(tcg_ctx.tb_ctx.tb_phys_hash));
+    qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
-    tcg_ctx.tb_ctx.tb_flush_count++;
+    atomic_mb_set(&tcg_ctx.tb_ctx.tb_flush_count,
+                  tcg_ctx.tb_ctx.tb_flush_count + 1);
+
+done:
+    if (locked) {
+        tb_unlock();
+    }
 }
 
-#ifdef DEBUG_TB_CHECK
+#ifndef CONFIG_USER_ONLY
+static void do_tb_flush_safe_work(void *data)
+{
+    do_tb_flush(current_cpu ? current_cpu : first_cpu, (uintptr_t)data);
+}
+#endif
 
-static void tb_invalidate_check(target_ulong address)
+/* With MTTCG other vCPUs may be executing code from the buffer, so the
+ * flush is deferred until all of them have left cpu_exec.
+ */
+void tb_flush(CPUState *cpu)
 {
-    TranslationBlock *tb;
-    int i;
+    unsigned int tb_flush_req = atomic_mb_read(&tcg_ctx.tb_ctx.tb_flush_count);
 
-    address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
-        }
+#ifndef CONFIG_USER_ONLY
+    if (qemu_tcg_mttcg_enabled()) {
+        async_safe_run_on_cpu(cpu, do_tb_flush_safe_work,
+                              (void *)(uintptr_t)tb_flush_req);
+        return;
     }
+#endif
+    do_tb_flush(cpu, tb_flush_req);
 }
 
-/* verify that all the pages have correct rights for code */
-static void tb_page_check(void)
+/* Make room in the code buffer by invalidating the TBs of the region
+ * after the current one, which is the oldest, and moving on to it.
+ * Unless the buffer has been flushed or another region evicted since
+ * @tb_evict_req was sampled.
+ */
+static void do_tb_evict(CPUState *cpu, unsigned int tb_evict_req)
 {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    bool locked = tb_lock_recursive();
+    TBRegion *r;
+    int i;
+
+    if (ctx->tb_evict_count != tb_evict_req || ctx->nb_regions == 0) {
+        goto done;
+    }
+    if (ctx->nb_regions == 1) {
+        do_tb_flush(cpu, ctx->tb_flush_count);
+        goto done;
+    }
+
+    ctx->regions[ctx->cur_region].code_ptr = tcg_ctx.code_gen_ptr;
+    ctx->cur_region = (ctx->cur_region + 1) % ctx->nb_regions;
+    r = &ctx->regions[ctx->cur_region];
+
+    for (i = 0; i < r->nb_tbs; i++) {
+        TranslationBlock *tb = &r->tbs[i];
+
+        /* Skip TBs that are already invalid, and those whose translation
+           was abandoned before tb_link_page.  */
+        if (!(tb->cflags & CF_INVALID) && tb->page_addr[0] != -1) {
+            tb_phys_invalidate(tb, -1);
         }
     }
+    r->nb_tbs = 0;
+    r->code_ptr = r->start;
+
+    tcg_ctx.code_gen_ptr = r->start;
+    tcg_ctx.code_gen_highwater = r->end - 1024;
+    atomic_mb_set(&ctx->tb_evict_count, ctx->tb_evict_count + 1);
+
+done:
+    if (locked) {
+        tb_unlock();
+    }
 }
 
+#ifndef CONFIG_USER_ONLY
+static void do_tb_evict_safe_work(void *data)
+{
+    do_tb_evict(current_cpu ? current_cpu : first_cpu, (uintptr_t)data);
+}
 #endif
 
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+/* As for tb_flush, with MTTCG the eviction is deferred until all vCPUs
+ * have left cpu_exec, because they may be executing the evicted code.
+ */
+void tb_evict(CPUState *cpu)
 {
-    TranslationBlock *tb1;
+    unsigned int tb_evict_req = atomic_mb_read(&tcg_ctx.tb_ctx.tb_evict_count);
 
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
-        }
-        ptb = &tb1->phys_hash_next;
+#ifndef CONFIG_USER_ONLY
+    if (qemu_tcg_mttcg_enabled()) {
+        async_safe_run_on_cpu(cpu, do_tb_evict_safe_work,
+                              (void *)(uintptr_t)tb_evict_req);
+        return;
+    }
+#endif
+    do_tb_evict(cpu, tb_evict_req);
+}
+
+#ifdef DEBUG_TB_CHECK
+
+static void
+do_tb_invalidate_check(struct qht *ht, void *p, uint32_t hash, void *userp)
+{
+    TranslationBlock *tb = p;
+    target_ulong addr = *(target_ulong *)userp;
+
+    if (!(addr + TARGET_PAGE_SIZE <= tb->pc || addr >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx
+               " PC=%08lx size=%04x\n", addr, (long)tb->pc, tb->size);
+    }
+}
+
+static void tb_invalidate_check(target_ulong address)
+{
+    address &= TARGET_PAGE_MASK;
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_invalidate_check, &address);
+}
+
+static void
+do_tb_page_check(struct qht *ht, void *p, uint32_t hash, void *userp)
+{
+    TranslationBlock *tb = p;
+    int flags1, flags2;
+
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+               (long)tb->pc, tb->size, flags1, flags2);
     }
 }
 
+/* verify that all the pages have correct rights for code */
+static void tb_page_check(void)
+{
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_page_check, NULL);
+}
+
+#endif
+
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -966,13 +1187,19 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     CPUState *cpu;
     PageDesc *p;
     unsigned int h, n1;
+    uint32_t hash;
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
+    if (tb->cflags & CF_INVALID) {
+        return;
+    }
+    tb->cflags |= CF_INVALID;
+
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    hash = tb_hash_func(phys_pc, tb->pc, tb->flags);
+    qht_remove(&tcg_ctx.tb_ctx.htable, tb, hash);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -986,13 +1213,11 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         invalidate_page_bitmap(p);
     }
 
-    tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
-
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (cpu->tb_jmp_cache[h] == tb) {
-            cpu->tb_jmp_cache[h] = NULL;
+        if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
+            atomic_set(&cpu->tb_jmp_cache[h], NULL);
         }
     }
 
@@ -1058,6 +1283,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     target_ulong virt_page2;
     tcg_insn_unit *gen_code_buf;
     int gen_code_size, search_size;
+    int64_t gen_start = get_clock();
 #ifdef CONFIG_PROFILER
     int64_t ti;
 #endif
@@ -1070,13 +1296,22 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
  buffer_overflow:
-        /* flush must be done */
-        tb_flush(cpu);
+        if (tb) {
+            /* Give back the descriptor, it is not linked anywhere.  */
+            tb_free(tb);
+        }
+        tb_evict(cpu);
+#ifndef CONFIG_USER_ONLY
+        if (qemu_tcg_mttcg_enabled()) {
+            /* The eviction is pending until every vCPU is out of the
+             * execution loop; leave it and retry the translation.  */
+            cpu->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(cpu);
+        }
+#endif
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         assert(tb != NULL);
-        /* Don't forget to invalidate previous TB info.  */
-        tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
     }
 
     gen_code_buf = tcg_ctx.code_gen_ptr;
@@ -1085,6 +1320,22 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->flags = flags;
     tb->cflags = cflags;
 
+#ifdef CONFIG_USER_ONLY
+    if (tb_cache_restore(tb, gen_code_buf, &gen_code_size, &search_size)) {
+        goto restored;
+    }
+#endif
+
+    if (tcg_tier_threshold && cflags == 0) {
+        cflags = CF_TIER0;
+        tb->cflags = cflags;
+        tb->tier_countdown = tcg_tier_threshold;
+    }
+    tcg_ctx.optimize_disabled = cflags & CF_TIER0;
+#ifdef CONFIG_USER_ONLY
+    tcg_ctx.code_relocs_enabled = tb_cache_enabled(cflags);
+#endif
+
 #ifdef CONFIG_PROFILER
     tcg_ctx.tb_count1++; /* includes aborted translations because of
                        exceptions */
@@ -1128,6 +1379,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if (unlikely(search_size < 0)) {
         goto buffer_overflow;
     }
+#ifdef CONFIG_USER_ONLY
+    tb_cache_record(tb, gen_code_size, search_size);
+#endif
 
 #ifdef CONFIG_PROFILER
     tcg_ctx.code_time += profile_getclock();
@@ -1145,6 +1399,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     }
 #endif
 
+#ifdef CONFIG_USER_ONLY
+ restored:
+#endif
     tcg_ctx.code_gen_ptr = (void *)
         ROUND_UP((uintptr_t)gen_code_buf + gen_code_size + search_size,
                  CODE_GEN_ALIGN);
@@ -1156,9 +1413,62 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+
+    if (perf_map_file) {
+        fprintf(perf_map_file, "%" PRIxPTR " %x guest-" TARGET_FMT_lx "\n",
+                (uintptr_t)tb->tc_ptr, gen_code_size, tb->pc);
+    }
+    tcg_ctx.tb_ctx.tb_gen_count++;
+    tcg_ctx.tb_ctx.tb_gen_time += get_clock() - gen_start;
     return tb;
 }
 
+/* Start writing /tmp/perf-PID.map, so that perf(1) can attribute samples
+   in the generated code to the guest code.  Must be called after the
+   prologue has been generated.  Note that perf only knows about the last
+   TB at each address, for TBs flushed from the code buffer.  */
+void tcg_perf_map_init(void)
+{
+    char *path = g_strdup_printf("/tmp/perf-%d.map", getpid());
+
+    perf_map_file = fopen(path, "w");
+    if (perf_map_file == NULL) {
+        fprintf(stderr, "qemu: could not open %s: %s\n",
+                path, strerror(errno));
+    } else {
+        /* User mode exits with _exit(), which would lose buffered lines.  */
+        setvbuf(perf_map_file, NULL, _IOLBF, 0);
+        fprintf(perf_map_file, "%" PRIxPTR " %tx tcg-prologue\n",
+                (uintptr_t)tcg_ctx.code_gen_prologue,
+                tcg_ctx.code_gen_buffer - tcg_ctx.code_gen_prologue);
+    }
+    g_free(path);
+}
+
+/* Retranslate TB, which has become hot, with the optimizer enabled.
+   The TBs jumping to it are unchained, and find the new TB on their
+   next lookup.  */
+void tb_tier_up(CPUState *cpu, TranslationBlock *tb)
+{
+#ifdef CONFIG_USER_ONLY
+    mmap_lock();
+#endif
+    tb_lock();
+    /* Another vCPU may have got there first.  */
+    if ((tb->cflags & (CF_TIER0 | CF_INVALID)) == CF_TIER0
+        && tb->tier_countdown < 0) {
+        /* The old code may still be running on other vCPUs.  */
+        atomic_set(&tb->tier_countdown, INT32_MAX);
+        tb_phys_invalidate(tb, -1);
+        tb_gen_code(cpu, tb->pc, tb->cs_base, tb->flags, CF_TIER1);
+        tcg_ctx.tb_ctx.tb_tier_up_count++;
+    }
+    tb_unlock();
+#ifdef CONFIG_USER_ONLY
+    mmap_unlock();
+#endif
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1170,11 +1480,17 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
  */
 void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end)
 {
+    bool locked = tb_lock_recursive();
+
     while (start < end) {
         tb_invalidate_phys_page_range(start, end, 0);
         start &= TARGET_PAGE_MASK;
         start += TARGET_PAGE_SIZE;
     }
+
+    if (locked) {
+        tb_unlock();
+    }
 }
 
 /*
@@ -1469,14 +1785,7 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
+    uint32_t h;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1498,6 +1807,11 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
         tb_reset_jump(tb, 1);
     }
 
+    /* add in the hash table last, so that lock-free lookups only
+     * ever see fully initialized TBs */
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags);
+    qht_insert(&tcg_ctx.tb_ctx.htable, tb, h);
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
@@ -1507,23 +1821,29 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int m_min, m_max, m, i;
     uintptr_t v;
     TranslationBlock *tb;
+    TBRegion *r;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
+        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_buffer +
+                  ctx->nb_regions * ctx->region_size) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    /* Within a region, the TBs are sorted by tc_ptr.  */
+    i = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) / ctx->region_size;
+    r = &ctx->regions[i];
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)tb_region_code_end(i)) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1533,7 +1853,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 #if !defined(CONFIG_USER_ONLY)
@@ -1552,7 +1872,9 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr)
     }
     ram_addr = (memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK)
         + addr;
+    tb_lock();
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
+    tb_unlock();
     rcu_read_unlock();
 }
 #endif /* !defined(CONFIG_USER_ONLY) */
@@ -1561,6 +1883,7 @@ void tb_check_watchpoint(CPUState *cpu)
 {
     TranslationBlock *tb;
 
+    tb_lock();
     tb = tb_find_pc(cpu->mem_io_pc);
     if (tb) {
         /* We can use retranslation to find the PC.  */
@@ -1578,6 +1901,7 @@ void tb_check_watchpoint(CPUState *cpu)
         addr = get_page_addr_code(env, pc);
         tb_invalidate_phys_range(addr, addr + 1);
     }
+    tb_unlock();
 }
 
 #ifndef CONFIG_USER_ONLY
@@ -1593,6 +1917,7 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     target_ulong pc, cs_base;
     uint64_t flags;
 
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (!tb) {
         cpu_abort(cpu, "cpu_io_recompile: could not find TB for pc=%p",
@@ -1669,64 +1994,84 @@ void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    int nb_tbs = tb_count();
+    size_t code_size = tb_code_size();
     TranslationBlock *tb;
+    struct qht_stats hst;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions; i++) {
+        for (j = 0; j < tcg_ctx.tb_ctx.regions[i].nb_tbs; j++) {
+            tb = &tcg_ctx.tb_ctx.regions[i].tbs[j];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_highwater - tcg_ctx.code_gen_buffer);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                code_size, tcg_ctx.code_gen_buffer_size);
     cpu_fprintf(f, "TB count            %d/%d\n",
-            tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
+            nb_tbs, tcg_ctx.code_gen_max_blocks);
+    cpu_fprintf(f, "TB regions          %d (current %d)\n",
+                tcg_ctx.tb_ctx.nb_regions, tcg_ctx.tb_ctx.cur_region);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
-            tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
-                    tcg_ctx.tb_ctx.nb_tbs : 0,
+            nb_tbs ? target_code_size / nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            nb_tbs ? code_size / nb_tbs : 0,
+            target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
-            tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
-                                    tcg_ctx.tb_ctx.nb_tbs : 0);
+            nb_tbs ? (cross_page * 100) / nb_tbs : 0);
     cpu_fprintf(f, "direct jump count   %d (%d%%) (2 jumps=%d %d%%)\n",
                 direct_jmp_count,
-                tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp_count * 100) /
-                        tcg_ctx.tb_ctx.nb_tbs : 0,
+                nb_tbs ? (direct_jmp_count * 100) / nb_tbs : 0,
                 direct_jmp2_count,
-                tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
-                        tcg_ctx.tb_ctx.nb_tbs : 0);
+                nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
+
+    qht_statistics(&tcg_ctx.tb_ctx.htable, &hst);
+    cpu_fprintf(f, "TB hash buckets     %zu/%zu (%0.2f%% head buckets used)\n",
+                hst.used_head_buckets, hst.head_buckets,
+                hst.head_buckets ?
+                (double)hst.used_head_buckets / hst.head_buckets * 100 : 0);
+    cpu_fprintf(f, "TB hash avg chain   %0.3f buckets, max %zu\n",
+                hst.used_head_buckets ?
+                (double)hst.chain_buckets / hst.used_head_buckets : 0,
+                hst.max_chain);
     cpu_fprintf(f, "\nStatistics:\n");
-    cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB flush count      %u\n",
+                atomic_read(&tcg_ctx.tb_ctx.tb_flush_count));
+    cpu_fprintf(f, "TB evict count      %u\n",
+                atomic_read(&tcg_ctx.tb_ctx.tb_evict_count));
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB translate count  %u (%u tiered up)\n",
+                tcg_ctx.tb_ctx.tb_gen_count,
+                tcg_ctx.tb_ctx.tb_tier_up_count);
+    cpu_fprintf(f, "TB translate time   %0.3f ms (%0.1f us/TB)\n",
+                tcg_ctx.tb_ctx.tb_gen_time / 1e6,
+                tcg_ctx.tb_ctx.tb_gen_count ?
+                tcg_ctx.tb_ctx.tb_gen_time / 1e3 /
+                tcg_ctx.tb_ctx.tb_gen_count : 0);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    dump_tlb_info(f, cpu_fprintf);
     tcg_dump_info(f, cpu_fprintf);
 }
 
@@ -1871,7 +2216,7 @@ int page_get_flags(target_ulong address)
    on PAGE_WRITE.  The mmap_lock should already be held.  */
 void page_set_flags(target_ulong start, target_ulong end, int flags)
 {
-    target_ulong addr, len;
+    target_ulong addr, len, n;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -1888,19 +2233,34 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
         flags |= PAGE_WRITE_ORG;
     }
 
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        PageDesc *p = page_find_alloc(addr >> TARGET_PAGE_BITS, 1);
-
-        /* If the write protection bit is set, then we invalidate
-           the code inside.  */
-        if (!(p->flags & PAGE_WRITE) &&
-            (flags & PAGE_WRITE) &&
-            p->first_tb) {
-            tb_invalidate_phys_page(addr, 0, NULL, false);
+    for (addr = start, len = end - start; len != 0; ) {
+        tb_page_addr_t index = addr >> TARGET_PAGE_BITS;
+        PageDesc *p;
+
+        /* Walk l1_map once for each bottom-level array of PageDescs.  */
+        n = V_L2_SIZE - (index & (V_L2_SIZE - 1));
+        n = MIN(n, len >> TARGET_PAGE_BITS);
+
+        /* Clearing the flags of pages that never had any (e.g. unmapping
+           part of a reservation) needs no PageDescs at all.  */
+        p = page_find_alloc(index, flags != 0);
+        if (!p) {
+            addr += n << TARGET_PAGE_BITS;
+            len -= n << TARGET_PAGE_BITS;
+            continue;
+        }
+
+        for (; n != 0; n--, p++,
+             len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
+            /* If the write protection bit is set, then we invalidate
+               the code inside.  */
+            if (!(p->flags & PAGE_WRITE) &&
+                (flags & PAGE_WRITE) &&
+                p->first_tb) {
+                tb_invalidate_phys_page(addr, 0, NULL, false);
+            }
+            p->flags = flags;
         }
-        p->flags = flags;
     }
 }
 
@@ -2003,6 +2363,12 @@ int page_unprotect(target_ulong address, uintptr_t pc, void *puc)
         mmap_unlock();
         return 1;
     }
+    if ((p->flags & PAGE_WRITE_ORG) && (p->flags & PAGE_WRITE)) {
+        /* Another thread faulted on the same page and got here first;
+           it already invalidated the code and made the page writable.  */
+        mmap_unlock();
+        return 1;
+    }
     mmap_unlock();
     return 0;
 }
@@ -189,7 +189,7 @@ static void text_console_update_cursor(void *opaque);
 
 static void gui_update(void *opaque)
 {
-    uint64_t interval = GUI_REFRESH_INTERVAL_IDLE;
+    uint64_t interval = GUI_REFRESH_INTERVAL_OFF;
     uint64_t dcl_interval;
     DisplayState *ds = opaque;
     DisplayChangeListener *dcl;
@@ -206,6 +206,10 @@ static void gui_update(void *opaque)
             interval = dcl_interval;
         }
     }
+    /* Unless every listener is switched off, refresh at least this often */
+    if (interval != GUI_REFRESH_INTERVAL_OFF) {
+        interval = MIN(interval, GUI_REFRESH_INTERVAL_IDLE);
+    }
     if (ds->update_interval != interval) {
         ds->update_interval = interval;
         for (i = 0; i < nb_consoles; i++) {
@@ -216,7 +220,9 @@ static void gui_update(void *opaque)
         trace_console_refresh(interval);
     }
     ds->last_update = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    timer_mod(ds->gui_timer, ds->last_update + interval);
+    if (interval != GUI_REFRESH_INTERVAL_OFF) {
+        timer_mod(ds->gui_timer, ds->last_update + interval);
+    }
 }
 
 static void gui_setup_refresh(DisplayState *ds)
@@ -241,6 +247,9 @@ static void gui_setup_refresh(DisplayState *ds)
     if (need_timer && ds->gui_timer == NULL) {
         ds->gui_timer = timer_new_ms(QEMU_CLOCK_REALTIME, gui_update, ds);
         timer_mod(ds->gui_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
+    } else if (need_timer && ds->update_interval == GUI_REFRESH_INTERVAL_OFF) {
+        /* A new listener may want refreshes again */
+        timer_mod(ds->gui_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
     }
     if (!need_timer && ds->gui_timer != NULL) {
         timer_del(ds->gui_timer);
@@ -0,0 +1,197 @@
+/*
+ * QEMU VNC display driver: Open H.264 encoding
+ *
+ * Areas of the screen that the guest updates at video rates are sent
+ * as a single rectangle encoded with libx264, which costs far less CPU
+ * and bandwidth than compressing every frame with tight or zrle.  The
+ * rectangle keeps the same geometry while the video stays inside it,
+ * because clients keep one decoder context per rectangle.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "vnc.h"
+
+/* Update frequency, in Hz, above which an area is treated as video */
+#define VNC_H264_MIN_FREQ       10
+/* Smallest number of VNC_STAT_RECT blocks worth starting a stream for */
+#define VNC_H264_MIN_RECTS      4
+
+/* Open H.264 rectangle flags */
+#define VNC_H264_FLAG_RESET_CONTEXT       1
+#define VNC_H264_FLAG_RESET_ALL_CONTEXTS  2
+
+bool vnc_h264_find_region(VncState *vs, VncRect *r)
+{
+    VncDisplay *vd = vs->vd;
+    int width = pixman_image_get_width(vd->server);
+    int height = pixman_image_get_height(vd->server);
+    int x, y, x0 = width, y0 = height, x1 = 0, y1 = 0, hot = 0;
+
+    for (y = 0; y < height; y += VNC_STAT_RECT) {
+        for (x = 0; x < width; x += VNC_STAT_RECT) {
+            if (vnc_update_freq(vs, x, y, 0, 0) < VNC_H264_MIN_FREQ) {
+                continue;
+            }
+            x0 = MIN(x0, x);
+            y0 = MIN(y0, y);
+            x1 = MAX(x1, x + VNC_STAT_RECT);
+            y1 = MAX(y1, y + VNC_STAT_RECT);
+            hot++;
+        }
+    }
+
+    if (hot < VNC_H264_MIN_RECTS) {
+        r->w = r->h = 0;
+        return false;
+    }
+
+    /* The dirty map works on chunks of pixels, 4:2:0 needs even sizes */
+    x1 = MIN(x1, width) & ~(VNC_DIRTY_PIXELS_PER_BIT - 1);
+    y1 = MIN(y1, height) & ~1;
+    if (x1 <= x0 || y1 <= y0) {
+        r->w = r->h = 0;
+        return false;
+    }
+
+    /* Keep the current stream as long as the video stays inside it */
+    if (r->w && x0 >= r->x && y0 >= r->y &&
+        x1 <= r->x + r->w && y1 <= r->y + r->h) {
+        return true;
+    }
+
+    r->x = x0;
+    r->y = y0;
+    r->w = x1 - x0;
+    r->h = y1 - y0;
+    return true;
+}
+
+/* Map the tight quality level (0-9, or -1 for lossless) to a x264 CRF */
+static float vnc_h264_crf(uint8_t quality)
+{
+    if (quality > 9) {
+        return 18;
+    }
+    return 40 - quality * 2;
+}
+
+void vnc_h264_clear(VncState *vs)
+{
+    VncH264 *h264 = &vs->h264;
+
+    if (h264->enc) {
+        x264_picture_clean(&h264->pic);
+        x264_encoder_close(h264->enc);
+        h264->enc = NULL;
+    }
+}
+
+static bool vnc_h264_open(VncState *vs, int x, int y, int w, int h)
+{
+    VncH264 *h264 = &vs->h264;
+    x264_param_t param;
+
+    vnc_h264_clear(vs);
+
+    if (x264_param_default_preset(&param, "ultrafast", "zerolatency") < 0) {
+        return false;
+    }
+    param.i_width = w;
+    param.i_height = h;
+    param.i_csp = X264_CSP_I420;
+    /* Clients are already encoded in parallel by the VNC worker threads */
+    param.i_threads = 1;
+    param.i_log_level = X264_LOG_NONE;
+    param.b_repeat_headers = 1;
+    param.b_annexb = 1;
+    param.rc.i_rc_method = X264_RC_CRF;
+    param.rc.f_rf_constant = vnc_h264_crf(vs->tight.quality);
+    if (x264_param_apply_profile(&param, "baseline") < 0) {
+        return false;
+    }
+
+    h264->enc = x264_encoder_open(&param);
+    if (!h264->enc) {
+        return false;
+    }
+    if (x264_picture_alloc(&h264->pic, X264_CSP_I420, w, h) < 0) {
+        x264_encoder_close(h264->enc);
+        h264->enc = NULL;
+        return false;
+    }
+
+    h264->x = x;
+    h264->y = y;
+    h264->w = w;
+    h264->h = h;
+    h264->quality = vs->tight.quality;
+    return true;
+}
+
+/* Convert the server surface to BT.601 4:2:0 */
+static void vnc_h264_fill_picture(VncState *vs, int x, int y, int w, int h)
+{
+    x264_image_t *img = &vs->h264.pic.img;
+    int i, j;
+
+    for (j = 0; j < h; j++) {
+        uint32_t *row = vnc_server_fb_ptr(vs->vd, x, y + j);
+        uint8_t *py = img->plane[0] + j * img->i_stride[0];
+        uint8_t *pu = img->plane[1] + j / 2 * img->i_stride[1];
+        uint8_t *pv = img->plane[2] + j / 2 * img->i_stride[2];
+
+        for (i = 0; i < w; i++) {
+            int r = (row[i] >> 16) & 0xff;
+            int g = (row[i] >> 8) & 0xff;
+            int b = row[i] & 0xff;
+
+            py[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+            /* Chroma comes from the top left pixel of each 2x2 block */
+            if (!(i & 1) && !(j & 1)) {
+                pu[i / 2] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+                pv[i / 2] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+            }
+        }
+    }
+}
+
+int vnc_h264_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
+{
+    VncH264 *h264 = &vs->h264;
+    x264_picture_t pic_out;
+    x264_nal_t *nals;
+    uint32_t flags = 0;
+    int n_nals, size;
+
+    if (!h264->enc || h264->x != x || h264->y != y ||
+        h264->w != w || h264->h != h || h264->quality != vs->tight.quality) {
+        if (!vnc_h264_open(vs, x, y, w, h)) {
+            return vnc_send_framebuffer_update(vs, x, y, w, h);
+        }
+        flags |= VNC_H264_FLAG_RESET_CONTEXT;
+    }
+
+    vnc_h264_fill_picture(vs, x, y, w, h);
+    h264->pic.i_pts++;
+
+    size = x264_encoder_encode(h264->enc, &nals, &n_nals, &h264->pic,
+                               &pic_out);
+    if (size <= 0) {
+        /* No output for this frame, send it with the regular encoding */
+        vnc_h264_clear(vs);
+        return vnc_send_framebuffer_update(vs, x, y, w, h);
+    }
+
+    vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_OPEN_H264);
+    vnc_write_u32(vs, size);
+    vnc_write_u32(vs, flags);
+    /* x264 returns the payloads of all NAL units back to back */
+    vnc_write(vs, nals[0].p_payload, size);
+
+    /* Resend the area losslessly once the video stops */
+    vnc_sent_lossy_rect(vs, x, y, w, h);
+    return 1;
+}
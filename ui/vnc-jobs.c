@@ -44,28 +44,32 @@
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  *                          if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is held
- * to avoid screen corruption (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not held because the thread works on
- * its own output buffer.
+ * While a VNC worker thread is working, it holds the VncDisplay lock in
+ * shared mode to avoid screen corruption (this does not block vnc_refresh()
+ * because it uses trylock()) but the output lock is not held because the
+ * thread works on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * Several worker threads share the queue.  The jobs of one client are
+ * encoded one at a time and in order, so that its zlib/tight/zrle stream
+ * state stays consistent; different clients are encoded in parallel.
  */
 
+#define VNC_WORKER_THREADS_MAX 8
+
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
+    QemuThread threads[VNC_WORKER_THREADS_MAX];
+    int nr_threads;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
 };
 
 typedef struct VncJobQueue VncJobQueue;
 
-/*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
- */
+/* We use a single global queue */
 static VncJobQueue *queue;
 
 static void vnc_lock_queue(VncJobQueue *queue)
@@ -89,7 +93,8 @@ VncJob *vnc_job_new(VncState *vs)
     return job;
 }
 
-int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
+static int vnc_job_add_entry(VncJob *job, int x, int y, int w, int h,
+                             bool video)
 {
     VncRectEntry *entry = g_new0(VncRectEntry, 1);
 
@@ -97,6 +102,7 @@ int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
     entry->rect.y = y;
     entry->rect.w = w;
     entry->rect.h = h;
+    entry->rect.video = video;
 
     vnc_lock_queue(queue);
     QLIST_INSERT_HEAD(&job->rectangles, entry, next);
@@ -104,6 +110,16 @@ int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
     return 1;
 }
 
+int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
+{
+    return vnc_job_add_entry(job, x, y, w, h, false);
+}
+
+int vnc_job_add_video_rect(VncJob *job, int x, int y, int w, int h)
+{
+    return vnc_job_add_entry(job, x, y, w, h, true);
+}
+
 void vnc_job_push(VncJob *job)
 {
     vnc_lock_queue(queue);
@@ -144,7 +160,7 @@ void vnc_jobs_clear(VncState *vs)
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        if ((job->vs == vs || !vs) && !job->in_progress) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
         }
     }
@@ -204,6 +220,9 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
+#ifdef CONFIG_VNC_H264
+    local->h264 = orig->h264;
+#endif
 }
 
 static void vnc_async_encoding_end(VncState *orig, VncState *local)
@@ -212,9 +231,36 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->zlib = local->zlib;
     orig->hextile = local->hextile;
     orig->zrle = local->zrle;
+#ifdef CONFIG_VNC_H264
+    orig->h264 = local->h264;
+#endif
     orig->lossy_rect = local->lossy_rect;
 }
 
+/*
+ * Find the first job that no other thread is working on and that is
+ * not queued behind another job for the same client.
+ */
+static VncJob *vnc_next_job_locked(VncJobQueue *queue)
+{
+    VncJob *job, *prev;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (job->in_progress) {
+            continue;
+        }
+        QTAILQ_FOREACH(prev, &queue->jobs, next) {
+            if (prev == job || prev->vs == job->vs) {
+                break;
+            }
+        }
+        if (prev == job) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
 static int vnc_worker_thread_loop(VncJobQueue *queue)
 {
     VncJob *job;
@@ -224,11 +270,13 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     int saved_offset;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    while (!(job = vnc_next_job_locked(queue)) && !queue->exit) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
     /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
+    if (job) {
+        job->in_progress = true;
+    }
     vnc_unlock_queue(queue);
 
     if (queue->exit) {
@@ -260,17 +308,24 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    vnc_lock_display_shared(job->vs->vd);
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
         if (job->vs->ioc == NULL) {
-            vnc_unlock_display(job->vs->vd);
+            vnc_unlock_display_shared(job->vs->vd);
             /* Copy persistent encoding data */
             vnc_async_encoding_end(job->vs, &vs);
             goto disconnected;
         }
 
+#ifdef CONFIG_VNC_H264
+        if (entry->rect.video) {
+            n = vnc_h264_send_framebuffer_update(&vs, entry->rect.x,
+                                                 entry->rect.y, entry->rect.w,
+                                                 entry->rect.h);
+        } else
+#endif
         n = vnc_send_framebuffer_update(&vs, entry->rect.x, entry->rect.y,
                                         entry->rect.w, entry->rect.h);
 
@@ -279,7 +334,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         }
         g_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_unlock_display_shared(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
@@ -330,9 +385,14 @@ static void *vnc_worker_thread(void *arg)
 {
     VncJobQueue *queue = arg;
 
-    qemu_thread_get_self(&queue->thread);
-
     while (!vnc_worker_thread_loop(queue)) ;
+
+    vnc_lock_queue(queue);
+    if (--queue->nr_threads) {
+        vnc_unlock_queue(queue);
+        return NULL;
+    }
+    vnc_unlock_queue(queue);
     vnc_queue_clear(queue);
     return NULL;
 }
@@ -345,12 +405,24 @@ static bool vnc_worker_thread_running(void)
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
+#ifdef _SC_NPROCESSORS_ONLN
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    long nr_cpus = 1;
+#endif
+    int i;
 
     if (vnc_worker_thread_running())
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, "vnc_worker", vnc_worker_thread, q,
-                       QEMU_THREAD_DETACHED);
+    q->nr_threads = MAX(1, MIN(nr_cpus, VNC_WORKER_THREADS_MAX));
+    for (i = 0; i < q->nr_threads; i++) {
+        char name[16];
+
+        snprintf(name, sizeof(name), "vnc_worker/%d", i);
+        qemu_thread_create(&q->threads[i], name, vnc_worker_thread, q,
+                           QEMU_THREAD_DETACHED);
+    }
     queue = q; /* Set global queue */
 }
@@ -878,23 +878,19 @@ static void vnc_copy(VncState *vs, int src_x, int src_y, int dst_x, int dst_y, i
     vnc_flush(vs);
 }
 
-static void vnc_dpy_copy(DisplayChangeListener *dcl,
-                         int src_x, int src_y,
-                         int dst_x, int dst_y, int w, int h)
+/*
+ * Move a region of the server surface and tell the clients about it,
+ * with CopyRect where supported.
+ */
+static void vnc_copy_region(VncDisplay *vd, int src_x, int src_y,
+                            int dst_x, int dst_y, int w, int h)
 {
-    VncDisplay *vd = container_of(dcl, VncDisplay, dcl);
     VncState *vs, *vn;
     uint8_t *src_row;
     uint8_t *dst_row;
     int i, x, y, pitch, inc, w_lim, s;
     int cmp_bytes;
 
-    if (!vd->server) {
-        /* no client connected */
-        return;
-    }
-
-    vnc_refresh_server_surface(vd);
     QTAILQ_FOREACH_SAFE(vs, &vd->clients, next, vn) {
         if (vnc_has_feature(vs, VNC_FEATURE_COPYRECT)) {
             vs->force_update = 1;
@@ -959,6 +955,21 @@ static void vnc_dpy_copy(DisplayChangeListener *dcl,
     }
 }
 
+static void vnc_dpy_copy(DisplayChangeListener *dcl,
+                         int src_x, int src_y,
+                         int dst_x, int dst_y, int w, int h)
+{
+    VncDisplay *vd = container_of(dcl, VncDisplay, dcl);
+
+    if (!vd->server) {
+        /* no client connected */
+        return;
+    }
+
+    vnc_refresh_server_surface(vd);
+    vnc_copy_region(vd, src_x, src_y, dst_x, dst_y, w, h);
+}
+
 static void vnc_mouse_set(DisplayChangeListener *dcl,
                           int x, int y, int visible)
 {
@@ -1021,6 +1032,37 @@ static int find_and_clear_dirty_height(VncState *vs,
     return h;
 }
 
+#ifdef CONFIG_VNC_H264
+/*
+ * Send the area where the guest plays video as one H.264 rectangle, so
+ * that the encoder sees the same area in every frame.
+ */
+static int vnc_update_client_video(VncState *vs, VncJob *job)
+{
+    VncRect *r = &vs->video_rect;
+    int y, x0, bits;
+    bool dirty = false;
+
+    if (!vnc_has_feature(vs, VNC_FEATURE_H264) ||
+        !vnc_h264_find_region(vs, r)) {
+        return 0;
+    }
+
+    x0 = r->x / VNC_DIRTY_PIXELS_PER_BIT;
+    bits = r->w / VNC_DIRTY_PIXELS_PER_BIT;
+    for (y = r->y; y < r->y + r->h; y++) {
+        if (find_next_bit(vs->dirty[y], x0 + bits, x0) < x0 + bits) {
+            bitmap_clear(vs->dirty[y], x0, bits);
+            dirty = true;
+        }
+    }
+    if (!dirty) {
+        return 0;
+    }
+    return vnc_job_add_video_rect(job, r->x, r->y, r->w, r->h);
+}
+#endif
+
 static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
 {
     vs->has_dirty += has_dirty;
@@ -1049,6 +1091,10 @@ static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
         height = pixman_image_get_height(vd->server);
         width = pixman_image_get_width(vd->server);
 
+#ifdef CONFIG_VNC_H264
+        n += vnc_update_client_video(vs, job);
+#endif
+
         y = 0;
         for (;;) {
             int x, h;
@@ -1198,6 +1244,9 @@ void vnc_disconnect_finish(VncState *vs)
     vnc_zlib_clear(vs);
     vnc_tight_clear(vs);
     vnc_zrle_clear(vs);
+#ifdef CONFIG_VNC_H264
+    vnc_h264_clear(vs);
+#endif
 
 #ifdef CONFIG_VNC_SASL
     vnc_sasl_client_cleanup(vs);
@@ -1949,6 +1998,10 @@ static void ext_key_event(VncState *vs, int down,
 static void framebuffer_update_request(VncState *vs, int incremental,
                                        int x, int y, int w, int h)
 {
+    if (!vs->need_update) {
+        /* vnc_refresh() backs off until the first request */
+        update_displaychangelistener(&vs->vd->dcl, VNC_REFRESH_INTERVAL_BASE);
+    }
     vs->need_update = 1;
 
     if (incremental) {
@@ -2038,6 +2091,14 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
             vs->features |= VNC_FEATURE_ZYWRLE_MASK;
             vs->vnc_encoding = enc;
             break;
+#ifdef CONFIG_VNC_H264
+        case VNC_ENCODING_OPEN_H264:
+            /* Like JPEG, only used when lossy compression is allowed */
+            if (vs->vd->lossy) {
+                vs->features |= VNC_FEATURE_H264_MASK;
+            }
+            break;
+#endif
         case VNC_ENCODING_DESKTOPRESIZE:
             vs->features |= VNC_FEATURE_RESIZE_MASK;
             break;
@@ -2846,12 +2907,15 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         server_ptr = server_row0 + y * server_stride + x * cmp_bytes;
 
         if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
-            qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
+            /* Only convert the row from its first dirty chunk onwards */
+            int x_px = x * VNC_DIRTY_PIXELS_PER_BIT;
+
+            qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width - x_px,
+                                     x_px, y);
             guest_ptr = (uint8_t *)pixman_image_get_data(tmpbuf);
         } else {
-            guest_ptr = guest_row0 + y * guest_stride;
+            guest_ptr = guest_row0 + y * guest_stride + x * cmp_bytes;
         }
-        guest_ptr += x * cmp_bytes;
 
         for (; x < DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
              x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
@@ -2883,19 +2947,193 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     return has_dirty;
 }
 
+/* Smallest band of dirty rows, and of moved rows, worth a CopyRect */
+#define VNC_SCROLL_MIN_ROWS 32
+
+static uint32_t vnc_row_hash(const uint8_t *p, int len)
+{
+    const uint32_t *w = (const uint32_t *)p;
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < len / 4; i++) {
+        h = (h ^ w[i]) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Look for content that moved vertically between the server surface and
+ * the guest surface, as happens when a terminal or a browser scrolls.
+ * The first band of consecutive dirty rows is hashed row by row on both
+ * surfaces; the shift that most unique rows agree on wins, and the
+ * longest run of rows that really match with that shift is returned as
+ * the region to copy.
+ */
+static bool vnc_detect_scroll(VncDisplay *vd, int *x, int *src_y,
+                              int *dst_y, int *w, int *h)
+{
+    int width = MIN(pixman_image_get_width(vd->guest.fb),
+                    pixman_image_get_width(vd->server));
+    int height = MIN(pixman_image_get_height(vd->guest.fb),
+                     pixman_image_get_height(vd->server));
+    int bits = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
+    int guest_stride = pixman_image_get_stride(vd->guest.fb);
+    int server_stride = pixman_image_get_stride(vd->server);
+    uint8_t *guest_row0 = (uint8_t *)pixman_image_get_data(vd->guest.fb);
+    uint8_t *server_row0 = (uint8_t *)pixman_image_get_data(vd->server);
+    int y, y0, band_h, x0 = bits, x1 = 0, bytes, d, best_d = 0;
+    int run, best_run = 0, best_start = 0;
+    uint32_t *guest_hash, *server_hash;
+    int *votes;
+    GHashTable *rows;
+    VncState *vs;
+    bool copyrect = false;
+
+    if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
+        return false;
+    }
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        copyrect |= vnc_has_feature(vs, VNC_FEATURE_COPYRECT);
+    }
+    if (!copyrect) {
+        return false;
+    }
+
+    /* Find the first band of dirty rows and the columns it covers */
+    for (y0 = 0; y0 < height; y0++) {
+        if (find_first_bit(vd->guest.dirty[y0], bits) < bits) {
+            break;
+        }
+    }
+    for (y = y0; y < height; y++) {
+        unsigned long first = find_first_bit(vd->guest.dirty[y], bits);
+
+        if (first >= bits) {
+            break;
+        }
+        x0 = MIN(x0, first);
+        x1 = MAX(x1, find_last_bit(vd->guest.dirty[y], bits) + 1);
+    }
+    band_h = y - y0;
+    if (band_h < VNC_SCROLL_MIN_ROWS) {
+        return false;
+    }
+
+    *x = x0 * VNC_DIRTY_PIXELS_PER_BIT;
+    *w = MIN(x1 * VNC_DIRTY_PIXELS_PER_BIT, width) - *x;
+    bytes = *w * VNC_SERVER_FB_BYTES;
+
+    guest_hash = g_new(uint32_t, band_h);
+    server_hash = g_new(uint32_t, band_h);
+    votes = g_new0(int, 2 * band_h);
+    rows = g_hash_table_new(NULL, NULL);
+
+    for (y = 0; y < band_h; y++) {
+        gpointer key;
+
+        guest_hash[y] = vnc_row_hash(guest_row0 + (y0 + y) * guest_stride +
+                                     *x * VNC_SERVER_FB_BYTES, bytes);
+        server_hash[y] = vnc_row_hash(server_row0 +
+                                      (y0 + y) * server_stride +
+                                      *x * VNC_SERVER_FB_BYTES, bytes);
+
+        /* Rows that occur more than once (e.g. blank ones) do not vote */
+        key = GUINT_TO_POINTER(server_hash[y]);
+        if (g_hash_table_lookup(rows, key)) {
+            g_hash_table_insert(rows, key, GINT_TO_POINTER(-1));
+        } else {
+            g_hash_table_insert(rows, key, GINT_TO_POINTER(y + 1));
+        }
+    }
+
+    for (y = 0; y < band_h; y++) {
+        int sy = GPOINTER_TO_INT(g_hash_table_lookup(rows,
+                                 GUINT_TO_POINTER(guest_hash[y]))) - 1;
+
+        if (sy >= 0 && sy != y) {
+            d = sy - y;
+            if (++votes[d + band_h] > votes[best_d + band_h]) {
+                best_d = d;
+            }
+        }
+    }
+
+    if (best_d && votes[best_d + band_h] >= VNC_SCROLL_MIN_ROWS / 4) {
+        for (y = MAX(0, -best_d), run = 0;
+             y < band_h && y + best_d < band_h; y++) {
+            int gy = y0 + y, sy = y0 + y + best_d;
+
+            if (guest_hash[y] == server_hash[y + best_d] &&
+                !memcmp(guest_row0 + gy * guest_stride +
+                        *x * VNC_SERVER_FB_BYTES,
+                        server_row0 + sy * server_stride +
+                        *x * VNC_SERVER_FB_BYTES, bytes)) {
+                if (++run > best_run) {
+                    best_run = run;
+                    best_start = y - run + 1;
+                }
+            } else {
+                run = 0;
+            }
+        }
+    }
+
+    g_hash_table_destroy(rows);
+    g_free(votes);
+    g_free(server_hash);
+    g_free(guest_hash);
+
+    if (best_run < VNC_SCROLL_MIN_ROWS) {
+        return false;
+    }
+    *dst_y = y0 + best_start;
+    *src_y = *dst_y + best_d;
+    *h = best_run;
+    return true;
+}
+
 static void vnc_refresh(DisplayChangeListener *dcl)
 {
     VncDisplay *vd = container_of(dcl, VncDisplay, dcl);
     VncState *vs, *vn;
     int has_dirty, rects = 0;
+    int x, src_y, dst_y, w, h;
 
     if (QTAILQ_EMPTY(&vd->clients)) {
+        /* vnc_connect() turns refreshing back on */
+        update_displaychangelistener(&vd->dcl, GUI_REFRESH_INTERVAL_OFF);
+        return;
+    }
+
+    /*
+     * While no client has asked for an update, leave the guest surface
+     * alone and only let vnc_update_client() finish disconnects.
+     */
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        if (vs->need_update) {
+            break;
+        }
+    }
+    if (!vs) {
+        QTAILQ_FOREACH_SAFE(vs, &vd->clients, next, vn) {
+            vnc_update_client(vs, 0, false);
+            /* vs might be free()ed here */
+        }
         update_displaychangelistener(&vd->dcl, VNC_REFRESH_INTERVAL_MAX);
         return;
     }
 
     graphic_hw_update(vd->dcl.con);
 
+    /*
+     * Send scrolled content as a CopyRect before comparing the surfaces;
+     * the moved rows then match the server surface and are skipped.
+     */
+    if (vnc_detect_scroll(vd, &x, &src_y, &dst_y, &w, &h)) {
+        vnc_copy_region(vd, x, src_y, x, dst_y, w, h);
+    }
+
     if (vnc_trylock_display(vd)) {
         update_displaychangelistener(&vd->dcl, VNC_REFRESH_INTERVAL_BASE);
         return;
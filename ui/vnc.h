@@ -38,6 +38,9 @@
 #include "io/channel-socket.h"
 #include "io/channel-tls.h"
 #include <zlib.h>
+#ifdef CONFIG_VNC_H264
+#include <x264.h>
+#endif
 
 #include "keymaps.h"
 #include "vnc-palette.h"
@@ -156,6 +159,8 @@ struct VncDisplay
     kbd_layout_t *kbd_layout;
     int lock_key_sync;
     QemuMutex mutex;
+    /* Encoder threads reading the server surface, protected by mutex */
+    int encoders;
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -227,12 +232,23 @@ typedef struct VncZywrle {
     int buf[VNC_ZRLE_TILE_WIDTH * VNC_ZRLE_TILE_HEIGHT];
 } VncZywrle;
 
+#ifdef CONFIG_VNC_H264
+typedef struct VncH264 {
+    x264_t *enc;
+    x264_picture_t pic;
+    /* Area and quality the encoder was opened for */
+    int x, y, w, h;
+    uint8_t quality;
+} VncH264;
+#endif
+
 struct VncRect
 {
     int x;
     int y;
     int w;
     int h;
+    bool video;     /* encode with the video encoder */
 };
 
 struct VncRectEntry
@@ -244,6 +260,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool in_progress;
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -321,6 +338,11 @@ struct VncState
     VncHextile hextile;
     VncZrle zrle;
     VncZywrle zywrle;
+#ifdef CONFIG_VNC_H264
+    VncH264 h264;
+    /* Video area sent with H.264, only used by the main thread */
+    VncRect video_rect;
+#endif
 
     Notifier mouse_mode_notifier;
 
@@ -377,6 +399,7 @@ enum {
 #define VNC_ENCODING_TRLE                 0x0000000f
 #define VNC_ENCODING_ZRLE                 0x00000010
 #define VNC_ENCODING_ZYWRLE               0x00000011
+#define VNC_ENCODING_OPEN_H264            0x00000032
 #define VNC_ENCODING_COMPRESSLEVEL0       0xFFFFFF00 /* -256 */
 #define VNC_ENCODING_QUALITYLEVEL0        0xFFFFFFE0 /* -32  */
 #define VNC_ENCODING_XCURSOR              0xFFFFFF10 /* -240 */
@@ -428,6 +451,7 @@ enum {
 #define VNC_FEATURE_ZRLE                     9
 #define VNC_FEATURE_ZYWRLE                  10
 #define VNC_FEATURE_LED_STATE               11
+#define VNC_FEATURE_H264                    12
 
 #define VNC_FEATURE_RESIZE_MASK              (1 << VNC_FEATURE_RESIZE)
 #define VNC_FEATURE_HEXTILE_MASK             (1 << VNC_FEATURE_HEXTILE)
@@ -441,6 +465,7 @@ enum {
 #define VNC_FEATURE_ZRLE_MASK                (1 << VNC_FEATURE_ZRLE)
 #define VNC_FEATURE_ZYWRLE_MASK              (1 << VNC_FEATURE_ZYWRLE)
 #define VNC_FEATURE_LED_STATE_MASK           (1 << VNC_FEATURE_LED_STATE)
+#define VNC_FEATURE_H264_MASK                (1 << VNC_FEATURE_H264)
 
 
 /* Client -> Server message IDs */
@@ -576,4 +601,10 @@ int vnc_zrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 int vnc_zywrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 void vnc_zrle_clear(VncState *vs);
 
+#ifdef CONFIG_VNC_H264
+bool vnc_h264_find_region(VncState *vs, VncRect *r);
+int vnc_h264_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
+void vnc_h264_clear(VncState *vs);
+#endif
+
 #endif /* __QEMU_VNC_H */
@@ -23,6 +23,7 @@
 #include "qemu/bitops.h"
 #include "exec/cpu_ldst.h"
 #include "translate-all.h"
+#include "exec/helper-proto.h"
 
 #undef EAX
 #undef ECX
@@ -39,6 +40,12 @@
 
 //#define DEBUG_SIGNAL
 
+/* Host return address of the helper that is accessing guest memory on
+ * behalf of generated code, or 0.  A SIGSEGV raised while it is set is
+ * attributed to the guest instruction that called the helper.
+ */
+__thread uintptr_t helper_retaddr;
+
 static void exception_action(CPUState *cpu)
 {
 #if defined(TARGET_I386)
@@ -74,6 +81,7 @@ void cpu_resume_from_signal(CPUState *cpu, void *puc)
         sigprocmask(SIG_SETMASK, &uc->sc_mask, NULL);
 #endif
     }
+    helper_retaddr = 0;
     cpu->exception_index = -1;
     siglongjmp(cpu->jmp_env, 1);
 }
@@ -94,6 +102,11 @@ static inline int handle_cpu_signal(uintptr_t pc, unsigned long address,
     printf("qemu: SIGSEGV pc=0x%08lx address=%08lx w=%d oldset=0x%08lx\n",
            pc, address, is_write, *(unsigned long *)old_set);
 #endif
+    /* A fault inside an atomic helper is reported at its call site.  */
+    if (helper_retaddr) {
+        pc = helper_retaddr;
+    }
+
     /* XXX: locking issue */
     if (is_write && h2g_valid(address)
         && page_unprotect(h2g(address), pc, puc)) {
@@ -117,6 +130,7 @@ static inline int handle_cpu_signal(uintptr_t pc, unsigned long address,
     }
     /* now we have a real cpu fault */
     cpu_restore_state(cpu, pc);
+    helper_retaddr = 0;
 
     /* we restore the process signal mask as the sigreturn should
        do it (XXX: use sigsetjmp) */
@@ -675,3 +689,38 @@ int cpu_signal_handler(int host_signum, void *pinfo,
 #error host CPU specific signal handler needed
 
 #endif
+
+/* The softmmu versions of these helpers are in cputlb.c.  */
+
+/* Do not allow unaligned operations to proceed.  Return the host address.  */
+static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
+                               TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    TCGMemOp mop = get_memop(oi);
+
+    /* The host cannot perform an unaligned access atomically.  */
+    if (unlikely(addr & ((1 << (mop & MO_SIZE)) - 1))) {
+        cpu_loop_exit_atomic(ENV_GET_CPU(env), retaddr);
+    }
+    helper_retaddr = retaddr;
+    return g2h(addr);
+}
+
+#define EXTRA_ARGS         , TCGMemOpIdx oi
+#define ATOMIC_NAME(X)     HELPER(glue(glue(atomic_ ## X, SUFFIX), END))
+#define ATOMIC_MMU_LOOKUP  atomic_mmu_lookup(env, addr, oi, GETPC())
+#define ATOMIC_MMU_CLEANUP do { helper_retaddr = 0; } while (0)
+
+#define DATA_SIZE 1
+#include "atomic_template.h"
+
+#define DATA_SIZE 2
+#include "atomic_template.h"
+
+#define DATA_SIZE 4
+#include "atomic_template.h"
+
+#ifdef CONFIG_ATOMIC64
+#define DATA_SIZE 8
+#include "atomic_template.h"
+#endif
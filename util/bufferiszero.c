@@ -0,0 +1,292 @@
+/*
+ * Simple C functions to supplement the C library
+ *
+ * Copyright (c) 2006 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#if (defined CONFIG_AVX2_OPT || defined CONFIG_AVX512F_OPT) && \
+    QEMU_GNUC_PREREQ(4, 9)
+#include "qemu/cpuid.h"
+#endif
+
+/*
+ * All the accelerated functions below load the first and last vector of
+ * the buffer with unaligned loads, and go through the rest with aligned
+ * loads.  This way they accept any alignment, as long as the buffer is at
+ * least as large as four vectors; shorter buffers use buffer_zero_int.
+ */
+
+static bool buffer_zero_int(const void *buf, size_t len)
+{
+    if (unlikely(len < 8)) {
+        /* For a very small buffer, simply accumulate all the bytes.  */
+        const unsigned char *p = buf;
+        const unsigned char *e = buf + len;
+        unsigned char t = 0;
+
+        do {
+            t |= *p++;
+        } while (p < e);
+
+        return t == 0;
+    } else {
+        /* Otherwise, use the unaligned memory access functions to
+         * handle the beginning and end of the buffer, with a couple
+         * of loops handling the middle aligned section.
+         */
+        uint64_t t = ldq_he_p(buf);
+        const uint64_t *p = (uint64_t *)(((uintptr_t)buf + 8) & -8);
+        const uint64_t *e = (uint64_t *)(((uintptr_t)buf + len) & -8);
+
+        for (; p + 8 <= e; p += 8) {
+            __builtin_prefetch(p + 8);
+            if (t) {
+                return false;
+            }
+            t = p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7];
+        }
+        while (p < e) {
+            t |= *p++;
+        }
+        t |= ldq_he_p(buf + len - 8);
+
+        return t == 0;
+    }
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static bool buffer_zero_sse2(const void *buf, size_t len)
+{
+    __m128i t = _mm_loadu_si128(buf);
+    __m128i *p = (__m128i *)(((uintptr_t)buf + 5 * 16) & -16);
+    __m128i *e = (__m128i *)(((uintptr_t)buf + len) & -16);
+    __m128i zero = _mm_setzero_si128();
+
+    /* Loop over 16-byte aligned blocks of 64.  */
+    while (likely(p <= e)) {
+        __builtin_prefetch(p);
+        t = _mm_cmpeq_epi8(t, zero);
+        if (unlikely(_mm_movemask_epi8(t) != 0xFFFF)) {
+            return false;
+        }
+        t = p[-4] | p[-3] | p[-2] | p[-1];
+        p += 4;
+    }
+
+    /* Finish the aligned tail.  */
+    t |= e[-3];
+    t |= e[-2];
+    t |= e[-1];
+
+    /* Finish the unaligned tail.  */
+    t |= _mm_loadu_si128(buf + len - 16);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) == 0xFFFF;
+}
+#endif
+
+/*
+ * GCC before version 4.9 has a bug which will cause the target
+ * attribute work incorrectly and failed to compile in some case,
+ * restrict the gcc version to 4.9+ to prevent the failure.
+ */
+
+#if defined CONFIG_AVX2_OPT && QEMU_GNUC_PREREQ(4, 9)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static bool buffer_zero_avx2(const void *buf, size_t len)
+{
+    /* Begin with an unaligned head of 32 bytes.  */
+    __m256i t = _mm256_loadu_si256(buf);
+    __m256i *p = (__m256i *)(((uintptr_t)buf + 5 * 32) & -32);
+    __m256i *e = (__m256i *)(((uintptr_t)buf + len) & -32);
+
+    /* Loop over 32-byte aligned blocks of 128.  */
+    while (p <= e) {
+        __builtin_prefetch(p);
+        if (unlikely(!_mm256_testz_si256(t, t))) {
+            return false;
+        }
+        t = p[-4] | p[-3] | p[-2] | p[-1];
+        p += 4;
+    }
+
+    /* Finish the last block of 128 unaligned.  */
+    t |= _mm256_loadu_si256(buf + len - 4 * 32);
+    t |= _mm256_loadu_si256(buf + len - 3 * 32);
+    t |= _mm256_loadu_si256(buf + len - 2 * 32);
+    t |= _mm256_loadu_si256(buf + len - 1 * 32);
+
+    return _mm256_testz_si256(t, t);
+}
+#pragma GCC pop_options
+#endif
+
+#if defined CONFIG_AVX512F_OPT && QEMU_GNUC_PREREQ(4, 9)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#include <immintrin.h>
+
+static bool buffer_zero_avx512(const void *buf, size_t len)
+{
+    /* Begin with an unaligned head of 64 bytes.  */
+    __m512i t = _mm512_loadu_si512(buf);
+    __m512i *p = (__m512i *)(((uintptr_t)buf + 5 * 64) & -64);
+    __m512i *e = (__m512i *)(((uintptr_t)buf + len) & -64);
+
+    /* Loop over 64-byte aligned blocks of 256.  */
+    while (p <= e) {
+        __builtin_prefetch(p);
+        if (unlikely(_mm512_test_epi64_mask(t, t))) {
+            return false;
+        }
+        t = p[-4] | p[-3] | p[-2] | p[-1];
+        p += 4;
+    }
+
+    /* Finish the last block of 256 unaligned.  */
+    t |= _mm512_loadu_si512(buf + len - 4 * 64);
+    t |= _mm512_loadu_si512(buf + len - 3 * 64);
+    t |= _mm512_loadu_si512(buf + len - 2 * 64);
+    t |= _mm512_loadu_si512(buf + len - 1 * 64);
+
+    return !_mm512_test_epi64_mask(t, t);
+}
+#pragma GCC pop_options
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+
+/* NEON is always available on AArch64, no need for runtime detection */
+static bool buffer_zero_neon(const void *buf, size_t len)
+{
+    uint64x2_t t = vld1q_u64(buf);
+    const uint64_t *p = (uint64_t *)(((uintptr_t)buf + 5 * 16) & -16);
+    const uint64_t *e = (uint64_t *)(((uintptr_t)buf + len) & -16);
+
+    /* Loop over 16-byte aligned blocks of 64.  */
+    while (likely(p <= e)) {
+        __builtin_prefetch(p);
+        if (unlikely(vgetq_lane_u64(t, 0) | vgetq_lane_u64(t, 1))) {
+            return false;
+        }
+        t = vorrq_u64(vorrq_u64(vld1q_u64(p - 8), vld1q_u64(p - 6)),
+                      vorrq_u64(vld1q_u64(p - 4), vld1q_u64(p - 2)));
+        p += 8;
+    }
+
+    /* Finish the aligned tail.  */
+    t = vorrq_u64(t, vorrq_u64(vld1q_u64(e - 6), vld1q_u64(e - 4)));
+    t = vorrq_u64(t, vld1q_u64(e - 2));
+
+    /* Finish the unaligned tail.  */
+    t = vorrq_u64(t, vld1q_u64(buf + len - 16));
+
+    return !(vgetq_lane_u64(t, 0) | vgetq_lane_u64(t, 1));
+}
+#endif
+
+typedef struct BufferZeroAccel {
+    const char *name;
+    bool (*fn)(const void *buf, size_t len);
+    /* Minimum length for fn, which is four vectors */
+    size_t min_len;
+    bool (*supported)(void);
+} BufferZeroAccel;
+
+/* Ordered from the most to the least preferred */
+static const BufferZeroAccel buffer_zero_accels[] = {
+#if defined CONFIG_AVX512F_OPT && QEMU_GNUC_PREREQ(4, 9)
+    { "avx512f", buffer_zero_avx512, 256, host_has_avx512f },
+#endif
+#if defined CONFIG_AVX2_OPT && QEMU_GNUC_PREREQ(4, 9)
+    { "avx2", buffer_zero_avx2, 128, host_has_avx2 },
+#endif
+#if defined(__SSE2__)
+    { "sse2", buffer_zero_sse2, 64, NULL },
+#endif
+#if defined(__aarch64__)
+    { "neon", buffer_zero_neon, 64, NULL },
+#endif
+    { "int", buffer_zero_int, 1, NULL },
+};
+
+static const BufferZeroAccel *buffer_zero_accel =
+    &buffer_zero_accels[ARRAY_SIZE(buffer_zero_accels) - 1];
+
+static void __attribute__((constructor)) init_buffer_zero_accel(void)
+{
+    const BufferZeroAccel *accel = buffer_zero_accels;
+
+    while (accel->supported && !accel->supported()) {
+        accel++;
+    }
+    buffer_zero_accel = accel;
+}
+
+/*
+ * Use a different accelerator for buffer_is_zero, for testing purposes.
+ * Returns the name of the new accelerator, or NULL after the last one;
+ * in that case the best accelerator is selected again.
+ */
+const char *test_buffer_is_zero_next_accel(void)
+{
+    const BufferZeroAccel *accel = buffer_zero_accel + 1;
+
+    while (accel < buffer_zero_accels + ARRAY_SIZE(buffer_zero_accels) &&
+           accel->supported && !accel->supported()) {
+        accel++;
+    }
+    if (accel == buffer_zero_accels + ARRAY_SIZE(buffer_zero_accels)) {
+        init_buffer_zero_accel();
+        return NULL;
+    }
+    buffer_zero_accel = accel;
+    return accel->name;
+}
+
+/*
+ * Checks if a buffer is all zeroes.  The buffer can have any length and
+ * alignment.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    const BufferZeroAccel *accel = buffer_zero_accel;
+
+    if (unlikely(len == 0)) {
+        return true;
+    }
+
+    /* Fetch the beginning of the buffer while we select the accelerator.  */
+    __builtin_prefetch(buf);
+
+    if (likely(len >= accel->min_len)) {
+        return accel->fn(buf, len);
+    }
+    return buffer_zero_int(buf, len);
+}
@@ -28,6 +28,12 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/crc32c.h"
+#if defined(__x86_64__) && QEMU_GNUC_PREREQ(4, 9)
+#include "qemu/cpuid.h"
+#endif
+#if defined(CONFIG_ARM_CRC32_OPT) && defined(CONFIG_LINUX)
+#include <sys/auxv.h>
+#endif
 
 /*
  * This is the CRC-32C table
@@ -105,12 +111,94 @@ static const uint32_t crc32c_table[256] = {
     0xBE2DA0A5L, 0x4C4623A6L, 0x5F16D052L, 0xAD7D5351L
 };
 
+typedef uint32_t CRC32CFunc(uint32_t crc, const uint8_t *data,
+                            unsigned int length);
 
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *data,
+                          unsigned int length)
 {
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
     }
-    return crc^0xffffffff;
+    return crc;
+}
+
+/*
+ * The hardware implementations below compute the same reflected CRC as
+ * the table.  They process single bytes until the data is aligned to
+ * 8 bytes, then 8 bytes per instruction.
+ */
+
+#if defined(__x86_64__) && QEMU_GNUC_PREREQ(4, 9)
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#include <nmmintrin.h>
+
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data,
+                             unsigned int length)
+{
+    uint64_t crc64;
+
+    for (; length && ((uintptr_t)data & 7); length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    crc64 = crc;
+    for (; length >= 8; length -= 8, data += 8) {
+        crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)data);
+    }
+    crc = crc64;
+    for (; length; length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#pragma GCC pop_options
+#endif
+
+#if defined(CONFIG_ARM_CRC32_OPT) && defined(CONFIG_LINUX)
+#pragma GCC push_options
+#pragma GCC target("+crc")
+#include <arm_acle.h>
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+
+static uint32_t crc32c_armv8(uint32_t crc, const uint8_t *data,
+                             unsigned int length)
+{
+    for (; length && ((uintptr_t)data & 7); length--) {
+        crc = __crc32cb(crc, *data++);
+    }
+    for (; length >= 8; length -= 8, data += 8) {
+        crc = __crc32cd(crc, *(const uint64_t *)data);
+    }
+    for (; length; length--) {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+#pragma GCC pop_options
+#endif
+
+static CRC32CFunc *crc32c_fn = crc32c_sw;
+
+static void __attribute__((constructor)) crc32c_init(void)
+{
+#if defined(__x86_64__) && QEMU_GNUC_PREREQ(4, 9)
+    if (host_has_sse4_2()) {
+        crc32c_fn = crc32c_sse42;
+    }
+#endif
+#if defined(CONFIG_ARM_CRC32_OPT) && defined(CONFIG_LINUX)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32c_fn = crc32c_armv8;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    return crc32c_fn(crc, data, length) ^ 0xffffffff;
 }
 
@@ -86,7 +86,8 @@ int event_notifier_get_fd(const EventNotifier *e)
 int event_notifier_set_handler(EventNotifier *e,
                                EventNotifierHandler *handler)
 {
-    qemu_set_fd_handler(e->rfd, (IOHandler *)handler, NULL, e);
+    qemu_set_fd_handler_full(e->rfd, (IOHandler *)handler, NULL, e,
+                             "event_notifier_set_handler", NULL);
     return 0;
 }
 
@@ -13,6 +13,7 @@
 #include <glib.h>
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/bswap.h"
 #include "trace.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
@@ -376,6 +377,229 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t end)
+{
+    const unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t pos, end_pos, word, last_word, res;
+    unsigned long cur;
+
+    if (start >= end) {
+        return -1;
+    }
+
+    pos = start >> hb->granularity;
+    end_pos = MIN(((end - 1) >> hb->granularity) + 1, hb->size);
+    if (pos >= end_pos) {
+        return -1;
+    }
+    word = pos >> BITS_PER_LEVEL;
+    last_word = (end_pos - 1) >> BITS_PER_LEVEL;
+
+    /* Look for a word that is not all ones, ignoring bits before start */
+    cur = ~last_lev[word] & ~((1UL << (pos & (BITS_PER_LONG - 1))) - 1);
+    while (cur == 0) {
+        if (word == last_word) {
+            return -1;
+        }
+        cur = ~last_lev[++word];
+    }
+
+    res = (word << BITS_PER_LEVEL) + ctzl(cur);
+    if (res >= end_pos) {
+        return -1;
+    }
+    return MAX(res << hb->granularity, start);
+}
+
+bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
+                             uint64_t end, uint64_t *count)
+{
+    HBitmapIter hbi;
+    int64_t first, next;
+    uint64_t limit;
+
+    if (*start >= end || *count == 0) {
+        return false;
+    }
+
+    hbitmap_iter_init(&hbi, hb, *start);
+    first = hbitmap_iter_next(&hbi);
+    if (first < 0 || first >= end) {
+        return false;
+    }
+    first = MAX(first, *start);
+    limit = MIN(end, first + *count);
+
+    next = hbitmap_next_zero(hb, first, limit);
+
+    *start = first;
+    *count = (next < 0 ? limit : next) - first;
+    return true;
+}
+
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb)
+{
+    /* Serialize whole 64-bit words, so that the format is the same on
+     * 32-bit and 64-bit hosts. */
+    return 64ULL << hb->granularity;
+}
+
+/* Find the range of bottom-level words covering elements START to
+ * START + COUNT - 1. */
+static void serialization_chunk(const HBitmap *hb,
+                                uint64_t start, uint64_t count,
+                                unsigned long **first_el, uint64_t *el_count)
+{
+    uint64_t last = start + count - 1;
+    uint64_t gran = hbitmap_serialization_granularity(hb);
+
+    assert((start & (gran - 1)) == 0);
+    assert((last >> hb->granularity) < hb->size);
+    if ((last >> hb->granularity) != hb->size - 1) {
+        assert((count & (gran - 1)) == 0);
+    }
+
+    start = (start >> hb->granularity) >> BITS_PER_LEVEL;
+    last = (last >> hb->granularity) >> BITS_PER_LEVEL;
+
+    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *el_count = last - start + 1;
+}
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count)
+{
+    uint64_t el_count;
+    unsigned long *cur;
+
+    if (!count) {
+        return 0;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+
+    return el_count * sizeof(unsigned long);
+}
+
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count)
+{
+    uint64_t el_count;
+    unsigned long *cur, *end;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    end = cur + el_count;
+
+    while (cur != end) {
+        unsigned long el =
+            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+
+        memcpy(buf, &el, sizeof(el));
+        buf += sizeof(el);
+        cur++;
+    }
+}
+
+void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
+                              uint64_t start, uint64_t count,
+                              bool finish)
+{
+    uint64_t el_count;
+    unsigned long *cur, *end;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    end = cur + el_count;
+
+    while (cur != end) {
+        memcpy(cur, buf, sizeof(*cur));
+
+        if (BITS_PER_LONG == 32) {
+            le32_to_cpus((uint32_t *)cur);
+        } else {
+            le64_to_cpus((uint64_t *)cur);
+        }
+
+        buf += sizeof(unsigned long);
+        cur++;
+    }
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
+                                bool finish)
+{
+    uint64_t el_count;
+    unsigned long *first;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &first, &el_count);
+
+    memset(first, 0, el_count * sizeof(unsigned long));
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
+                              bool finish)
+{
+    uint64_t el_count;
+    unsigned long *first;
+    uint64_t last_bit;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &first, &el_count);
+
+    memset(first, 0xff, el_count * sizeof(unsigned long));
+
+    /* Keep the bits beyond the end of the bitmap clear */
+    last_bit = hb->size & (BITS_PER_LONG - 1);
+    if (last_bit && first + el_count ==
+        &hb->levels[HBITMAP_LEVELS - 1][hb->sizes[HBITMAP_LEVELS - 1]]) {
+        first[el_count - 1] &= (1UL << last_bit) - 1;
+    }
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+void hbitmap_deserialize_finish(HBitmap *hb)
+{
+    int64_t i;
+    uint64_t size, prev_size;
+    int lev;
+
+    /* Restore the levels from the penultimate one up to level 0, assuming
+     * that the bottom level is correct */
+    size = MAX((hb->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+    for (lev = HBITMAP_LEVELS - 1; lev-- > 0; ) {
+        prev_size = size;
+        size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+        memset(hb->levels[lev], 0, size * sizeof(unsigned long));
+
+        for (i = 0; i < prev_size; ++i) {
+            if (hb->levels[lev + 1][i]) {
+                hb->levels[lev][i >> BITS_PER_LEVEL] |=
+                    1UL << (i & (BITS_PER_LONG - 1));
+            }
+        }
+    }
+
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    hb->count = hb->size ? hb_count_between(hb, 0, hb->size - 1) : 0;
+}
+
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
@@ -470,6 +694,8 @@ bool hbitmap_merge(HBitmap *a, const HBitmap *b)
 {
     int i;
     uint64_t j;
+    unsigned long *last;
+    const unsigned long *b_last, *b_upper;
 
     if ((a->size != b->size) || (a->granularity != b->granularity)) {
         return false;
@@ -479,15 +705,33 @@ bool hbitmap_merge(HBitmap *a, const HBitmap *b)
         return true;
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /* The upper levels are at most 1/BITS_PER_LONG of the size of the
+     * last one, just OR them; the compiler can vectorize these loops.
      */
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             a->levels[i][j] |= b->levels[i][j];
         }
     }
 
+    /* In the last level, only visit the words that are nonzero in b, as
+     * told by the level above.  This keeps the merge cheap for sparse
+     * bitmaps, and lets us keep the count of a up to date.
+     */
+    last = a->levels[HBITMAP_LEVELS - 1];
+    b_last = b->levels[HBITMAP_LEVELS - 1];
+    b_upper = b->levels[HBITMAP_LEVELS - 2];
+    for (j = 0; j < b->sizes[HBITMAP_LEVELS - 2]; j++) {
+        unsigned long cur = b_upper[j];
+
+        while (cur) {
+            uint64_t k = (j << BITS_PER_LEVEL) + ctzl(cur);
+
+            cur &= cur - 1;
+            a->count += ctpopl(b_last[k] & ~last[k]);
+            last[k] |= b_last[k];
+        }
+    }
+
     return true;
 }
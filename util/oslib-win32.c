@@ -94,6 +94,28 @@ void qemu_anon_ram_free(void *ptr, size_t size)
     }
 }
 
+void *qemu_alloc_stack(size_t *sz)
+{
+    void *ptr;
+    size_t pagesz = getpagesize();
+
+    /* Commit everything but the lowest page, which stays reserved and
+     * faults on access.
+     */
+    *sz = ROUND_UP(*sz, pagesz) + pagesz;
+    ptr = VirtualAlloc(NULL, *sz, MEM_RESERVE, PAGE_NOACCESS);
+    if (!ptr || !VirtualAlloc((char *)ptr + pagesz, *sz - pagesz,
+                              MEM_COMMIT, PAGE_READWRITE)) {
+        abort();
+    }
+    return ptr;
+}
+
+void qemu_free_stack(void *stack, size_t sz)
+{
+    VirtualFree(stack, 0, MEM_RELEASE);
+}
+
 #ifndef CONFIG_LOCALTIME_R
 /* FIXME: add proper locking */
 struct tm *gmtime_r(const time_t *timep, struct tm *result)
@@ -538,7 +560,7 @@ int getpagesize(void)
     return system_info.dwPageSize;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory)
+void os_mem_prealloc(int fd, char *area, size_t memory, int max_threads)
 {
     int i;
     size_t pagesize = getpagesize();
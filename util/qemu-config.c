@@ -167,6 +167,14 @@ static QemuOptsList machine_opts = {
             .name = "kvm_shadow_mem",
             .type = QEMU_OPT_SIZE,
             .help = "KVM shadow MMU size",
+        },{
+            .name = "kvm_dirty_ring_size",
+            .type = QEMU_OPT_NUMBER,
+            .help = "number of entries in the KVM dirty ring of each vCPU",
+        },{
+            .name = "kvm_halt_poll_ns",
+            .type = QEMU_OPT_NUMBER,
+            .help = "longest time in ns that KVM polls a halted vCPU",
         },{
             .name = "kernel",
             .type = QEMU_OPT_STRING,
@@ -17,6 +17,7 @@
 #endif
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
+#include "qemu/bitmap.h"
 #include "qemu/notify.h"
 
 static bool name_threads;
@@ -486,6 +487,52 @@ void qemu_thread_get_self(QemuThread *thread)
     thread->thread = pthread_self();
 }
 
+/* Restrict @thread to the host CPUs set in the @nbits long bitmap */
+int qemu_thread_set_affinity(QemuThread *thread, const unsigned long *host_cpus,
+                             unsigned long nbits)
+{
+#ifdef __linux__
+    unsigned long cpu;
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    for (cpu = find_first_bit(host_cpus, nbits); cpu < nbits;
+         cpu = find_next_bit(host_cpus, nbits, cpu + 1)) {
+        if (cpu >= CPU_SETSIZE) {
+            return -EINVAL;
+        }
+        CPU_SET(cpu, &set);
+    }
+    return -pthread_setaffinity_np(thread->thread, sizeof(set), &set);
+#else
+    return -ENOSYS;
+#endif
+}
+
+int qemu_thread_get_affinity(QemuThread *thread, unsigned long *host_cpus,
+                             unsigned long nbits)
+{
+#ifdef __linux__
+    unsigned long cpu;
+    cpu_set_t set;
+    int err;
+
+    err = pthread_getaffinity_np(thread->thread, sizeof(set), &set);
+    if (err) {
+        return -err;
+    }
+    bitmap_zero(host_cpus, nbits);
+    for (cpu = 0; cpu < nbits && cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            set_bit(cpu, host_cpus);
+        }
+    }
+    return 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
 bool qemu_thread_is_self(QemuThread *thread)
 {
    return pthread_equal(pthread_self(), thread->thread);
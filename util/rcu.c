@@ -172,22 +172,52 @@ void synchronize_rcu(void)
 
 /* Multi-producer, single-consumer queue based on urcu/static/wfqueue.h
  * from liburcu.  Note that head is only used by the consumer.
+ *
+ * Every registered thread gets its own queue, so that call_rcu does not
+ * bounce a cache line shared by all threads; threads that are not
+ * registered fall back to rcu_global_queue.  count is the number of
+ * callbacks that have been fully enqueued and not yet claimed by the
+ * call_rcu thread; batch and batch_node are only used by the call_rcu
+ * thread.
+ */
+typedef struct RCUCallQueue {
+    struct rcu_head dummy;
+    struct rcu_head *head, **tail;
+    int count;
+    int batch;
+    bool orphaned;
+    QLIST_ENTRY(RCUCallQueue) node;
+    QSLIST_ENTRY(RCUCallQueue) batch_node;
+} RCUCallQueue;
+
+typedef QSLIST_HEAD(, RCUCallQueue) RCUCallBatchList;
+
+static RCUCallQueue rcu_global_queue = {
+    .head = &rcu_global_queue.dummy,
+    .tail = &rcu_global_queue.dummy.next,
+};
+
+/* Protected by rcu_queues_lock.  Queues are only freed by the call_rcu
+ * thread, after their thread has unregistered and they have been drained.
  */
-static struct rcu_head dummy;
-static struct rcu_head *head = &dummy, **tail = &dummy.next;
-static int rcu_call_count;
+static QLIST_HEAD(, RCUCallQueue) rcu_queues =
+    QLIST_HEAD_INITIALIZER(rcu_queues);
+static QemuMutex rcu_queues_lock;
+
+static __thread RCUCallQueue *rcu_call_queue;
 static QemuEvent rcu_call_ready_event;
+static bool rcu_call_expedited;
 
-static void enqueue(struct rcu_head *node)
+static void enqueue(RCUCallQueue *q, struct rcu_head *node)
 {
     struct rcu_head **old_tail;
 
     node->next = NULL;
-    old_tail = atomic_xchg(&tail, &node->next);
+    old_tail = atomic_xchg(&q->tail, &node->next);
     atomic_mb_set(old_tail, node);
 }
 
-static struct rcu_head *try_dequeue(void)
+static struct rcu_head *try_dequeue(RCUCallQueue *q)
 {
     struct rcu_head *node, *next;
 
@@ -198,15 +228,15 @@ retry:
      * The tail, because it is the first step in the enqueuing.
      * It is only the next pointers that might be inconsistent.
      */
-    if (head == &dummy && atomic_mb_read(&tail) == &dummy.next) {
+    if (q->head == &q->dummy && atomic_mb_read(&q->tail) == &q->dummy.next) {
         abort();
     }
 
     /* If the head node has NULL in its next pointer, the value is
      * wrong and we need to wait until its enqueuer finishes the update.
      */
-    node = head;
-    next = atomic_mb_read(&head->next);
+    node = q->head;
+    next = atomic_mb_read(&q->head->next);
     if (!next) {
         return NULL;
     }
@@ -216,61 +246,118 @@ retry:
      * dummy node, and the one being removed.  So we do not need to update
      * the tail pointer.
      */
-    head = next;
+    q->head = next;
 
     /* If we dequeued the dummy node, add it back at the end and retry.  */
-    if (node == &dummy) {
-        enqueue(node);
+    if (node == &q->dummy) {
+        enqueue(q, node);
         goto retry;
     }
 
     return node;
 }
 
-static void *call_rcu_thread(void *opaque)
+static RCUCallQueue *rcu_call_queue_new(void)
+{
+    RCUCallQueue *q = g_new0(RCUCallQueue, 1);
+
+    q->head = &q->dummy;
+    q->tail = &q->dummy.next;
+    return q;
+}
+
+static int rcu_call_pending(void)
+{
+    RCUCallQueue *q;
+    int n = 0;
+
+    qemu_mutex_lock(&rcu_queues_lock);
+    QLIST_FOREACH(q, &rcu_queues, node) {
+        n += atomic_read(&q->count);
+    }
+    qemu_mutex_unlock(&rcu_queues_lock);
+    return n;
+}
+
+/* Claim the callbacks that have been enqueued so far, and free the queues
+ * of unregistered threads once they are empty.
+ */
+static void rcu_call_claim(RCUCallBatchList *batches)
+{
+    RCUCallQueue *q, *next;
+
+    qemu_mutex_lock(&rcu_queues_lock);
+    QLIST_FOREACH_SAFE(q, &rcu_queues, node, next) {
+        q->batch = atomic_read(&q->count);
+        if (q->batch) {
+            atomic_sub(&q->count, q->batch);
+            QSLIST_INSERT_HEAD(batches, q, batch_node);
+        } else if (q->orphaned) {
+            /* No producer is left, so the queue only holds the dummy.  */
+            QLIST_REMOVE(q, node);
+            g_free(q);
+        }
+    }
+    qemu_mutex_unlock(&rcu_queues_lock);
+}
+
+static void rcu_call_run(RCUCallQueue *q)
 {
     struct rcu_head *node;
 
+    while (q->batch > 0) {
+        node = try_dequeue(q);
+        while (!node) {
+            qemu_mutex_unlock_iothread();
+            qemu_event_reset(&rcu_call_ready_event);
+            node = try_dequeue(q);
+            if (!node) {
+                qemu_event_wait(&rcu_call_ready_event);
+                node = try_dequeue(q);
+            }
+            qemu_mutex_lock_iothread();
+        }
+
+        q->batch--;
+        node->func(node);
+    }
+}
+
+static void *call_rcu_thread(void *opaque)
+{
     rcu_register_thread();
 
     for (;;) {
+        RCUCallBatchList batches = QSLIST_HEAD_INITIALIZER(batches);
+        RCUCallQueue *q;
         int tries = 0;
-        int n = atomic_read(&rcu_call_count);
+        int n = rcu_call_pending();
 
-        /* Heuristically wait for a decent number of callbacks to pile up.
-         * Fetch rcu_call_count now, we only must process elements that were
-         * added before synchronize_rcu() starts.
+        /* Heuristically wait for a decent number of callbacks to pile up,
+         * unless somebody asked for them to be processed quickly.  The
+         * counts are claimed below, before synchronize_rcu() starts, since
+         * we only must process elements that were added before that.
          */
-        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5)) {
+        while (n == 0 ||
+               (n < RCU_CALL_MIN_SIZE && !atomic_read(&rcu_call_expedited) &&
+                ++tries <= 5)) {
             g_usleep(10000);
             if (n == 0) {
                 qemu_event_reset(&rcu_call_ready_event);
-                n = atomic_read(&rcu_call_count);
+                n = rcu_call_pending();
                 if (n == 0) {
                     qemu_event_wait(&rcu_call_ready_event);
                 }
             }
-            n = atomic_read(&rcu_call_count);
+            n = rcu_call_pending();
         }
 
-        atomic_sub(&rcu_call_count, n);
+        atomic_set(&rcu_call_expedited, false);
+        rcu_call_claim(&batches);
         synchronize_rcu();
         qemu_mutex_lock_iothread();
-        while (n > 0) {
-            node = try_dequeue();
-            while (!node) {
-                qemu_mutex_unlock_iothread();
-                qemu_event_reset(&rcu_call_ready_event);
-                node = try_dequeue();
-                if (!node) {
-                    qemu_event_wait(&rcu_call_ready_event);
-                    node = try_dequeue();
-                }
-                qemu_mutex_lock_iothread();
-            }
-
-            n--;
-            node->func(node);
+        QSLIST_FOREACH(q, &batches, batch_node) {
+            rcu_call_run(q);
         }
         qemu_mutex_unlock_iothread();
     }
@@ -279,9 +366,24 @@ static void *call_rcu_thread(void *opaque)
 
 void call_rcu1(struct rcu_head *node, void (*func)(struct rcu_head *node))
 {
+    RCUCallQueue *q = rcu_call_queue ? rcu_call_queue : &rcu_global_queue;
+
     node->func = func;
-    enqueue(node);
-    atomic_inc(&rcu_call_count);
+    enqueue(q, node);
+
+    /* The call_rcu thread only sleeps on the event when there is nothing
+     * to do, so waking it up is needed only for the first callback.  The
+     * global queue has several producers though, and the consumer might
+     * be waiting for one of them to complete its enqueue.
+     */
+    if (atomic_fetch_inc(&q->count) == 0 || q == &rcu_global_queue) {
+        qemu_event_set(&rcu_call_ready_event);
+    }
+}
+
+void call_rcu_expedite(void)
+{
+    atomic_mb_set(&rcu_call_expedited, true);
     qemu_event_set(&rcu_call_ready_event);
 }
 
@@ -291,6 +393,12 @@ void rcu_register_thread(void)
     qemu_mutex_lock(&rcu_registry_lock);
     QLIST_INSERT_HEAD(&registry, &rcu_reader, node);
     qemu_mutex_unlock(&rcu_registry_lock);
+
+    assert(!rcu_call_queue);
+    rcu_call_queue = rcu_call_queue_new();
+    qemu_mutex_lock(&rcu_queues_lock);
+    QLIST_INSERT_HEAD(&rcu_queues, rcu_call_queue, node);
+    qemu_mutex_unlock(&rcu_queues_lock);
 }
 
 void rcu_unregister_thread(void)
@@ -298,6 +406,14 @@ void rcu_unregister_thread(void)
     qemu_mutex_lock(&rcu_registry_lock);
     QLIST_REMOVE(&rcu_reader, node);
     qemu_mutex_unlock(&rcu_registry_lock);
+
+    /* Pending callbacks are still run; the call_rcu thread frees the
+     * queue once it is empty.
+     */
+    qemu_mutex_lock(&rcu_queues_lock);
+    rcu_call_queue->orphaned = true;
+    qemu_mutex_unlock(&rcu_queues_lock);
+    rcu_call_queue = NULL;
 }
 
 static void rcu_init_complete(void)
@@ -306,6 +422,7 @@ static void rcu_init_complete(void)
 
     qemu_mutex_init(&rcu_registry_lock);
     qemu_mutex_init(&rcu_sync_lock);
+    qemu_mutex_init(&rcu_queues_lock);
     qemu_event_init(&rcu_gp_event, true);
 
     qemu_event_init(&rcu_call_ready_event, false);
@@ -324,10 +441,12 @@ static void rcu_init_lock(void)
 {
     qemu_mutex_lock(&rcu_sync_lock);
     qemu_mutex_lock(&rcu_registry_lock);
+    qemu_mutex_lock(&rcu_queues_lock);
 }
 
 static void rcu_init_unlock(void)
 {
+    qemu_mutex_unlock(&rcu_queues_lock);
     qemu_mutex_unlock(&rcu_registry_lock);
     qemu_mutex_unlock(&rcu_sync_lock);
 }
@@ -335,7 +454,19 @@ static void rcu_init_unlock(void)
 
 void rcu_after_fork(void)
 {
+    RCUCallQueue *q;
+
     memset(&registry, 0, sizeof(registry));
+
+    /* Only this thread survived the fork.  Keep the callbacks that the
+     * others left behind, and let the new call_rcu thread reap the queues.
+     */
+    QLIST_FOREACH(q, &rcu_queues, node) {
+        if (q != &rcu_global_queue) {
+            q->orphaned = true;
+        }
+    }
+    rcu_call_queue = NULL;
     rcu_init_complete();
 }
 
@@ -344,5 +475,6 @@ static void __attribute__((__constructor__)) rcu_init(void)
 #ifdef CONFIG_POSIX
     pthread_atfork(rcu_init_lock, rcu_init_unlock, rcu_init_unlock);
 #endif
+    QLIST_INSERT_HEAD(&rcu_queues, &rcu_global_queue, node);
     rcu_init_complete();
 }
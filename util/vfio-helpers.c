@@ -0,0 +1,457 @@
+/*
+ * Userspace drivers for PCI devices assigned with VFIO
+ *
+ * The DMA mappings follow hw/vfio/common.c, which maps guest memory for
+ * assigned devices; here the mappings are driven by the user of the device
+ * rather than by a MemoryListener, and the IOVAs are chosen by us.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/ioctl.h>
+#include <linux/vfio.h>
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "qemu/vfio-helpers.h"
+#include "standard-headers/linux/pci_regs.h"
+#include "trace.h"
+
+/*
+ * Permanent mappings are allocated upwards from the bottom of the IOVA
+ * space, and temporary ones downwards from the top.  Stay clear of the
+ * first pages, and below 39 bits, which every IOMMU supports.
+ */
+#define QEMU_VFIO_IOVA_MIN 0x10000ULL
+#define QEMU_VFIO_IOVA_MAX (1ULL << 39)
+
+typedef struct {
+    void *host;
+    size_t size;
+    uint64_t iova;
+} IOVAMapping;
+
+struct QEMUVFIOState {
+    /* Protects the mappings, which are also changed by RAM hotplug */
+    QemuMutex lock;
+
+    int container;
+    int group;
+    int device;
+    struct vfio_region_info config_region_info;
+    struct vfio_region_info bar_region_info[6];
+
+    uint64_t low_water_mark;
+    uint64_t high_water_mark;
+
+    /* Permanent mappings, sorted by host address */
+    IOVAMapping *mappings;
+    int nr_mappings;
+};
+
+static int qemu_vfio_find_group(const char *device, Error **errp)
+{
+    char *sysfs_link, *group_path, *group_id, *group_name;
+    int group;
+
+    sysfs_link = g_strdup_printf("/sys/bus/pci/devices/%s/iommu_group",
+                                 device);
+    group_path = g_file_read_link(sysfs_link, NULL);
+    g_free(sysfs_link);
+    if (!group_path) {
+        error_setg(errp, "Device %s has no IOMMU group", device);
+        return -1;
+    }
+
+    group_id = g_path_get_basename(group_path);
+    group_name = g_strdup_printf("/dev/vfio/%s", group_id);
+    g_free(group_id);
+    g_free(group_path);
+    group = open(group_name, O_RDWR);
+    if (group < 0) {
+        error_setg_errno(errp, errno, "Cannot open %s", group_name);
+    }
+    g_free(group_name);
+    return group;
+}
+
+static int qemu_vfio_pci_read_config(QEMUVFIOState *s, void *buf,
+                                     int size, int ofs)
+{
+    ssize_t ret;
+
+    do {
+        ret = pread(s->device, buf, size,
+                    s->config_region_info.offset + ofs);
+    } while (ret < 0 && errno == EINTR);
+    return ret == size ? 0 : -errno;
+}
+
+static int qemu_vfio_pci_write_config(QEMUVFIOState *s, void *buf,
+                                      int size, int ofs)
+{
+    ssize_t ret;
+
+    do {
+        ret = pwrite(s->device, buf, size,
+                     s->config_region_info.offset + ofs);
+    } while (ret < 0 && errno == EINTR);
+    return ret == size ? 0 : -errno;
+}
+
+static int qemu_vfio_init_pci(QEMUVFIOState *s, const char *device,
+                              Error **errp)
+{
+    struct vfio_group_status group_status = {
+        .argsz = sizeof(group_status),
+    };
+    struct vfio_device_info device_info = {
+        .argsz = sizeof(device_info),
+    };
+    uint16_t pci_cmd;
+    int i;
+
+    s->container = open("/dev/vfio/vfio", O_RDWR);
+    if (s->container < 0) {
+        error_setg_errno(errp, errno, "Cannot open /dev/vfio/vfio");
+        return -errno;
+    }
+    if (ioctl(s->container, VFIO_GET_API_VERSION) != VFIO_API_VERSION) {
+        error_setg(errp, "Unknown VFIO API version");
+        return -EINVAL;
+    }
+    if (!ioctl(s->container, VFIO_CHECK_EXTENSION, VFIO_TYPE1_IOMMU)) {
+        error_setg(errp, "VFIO type1 IOMMU is not supported");
+        return -EINVAL;
+    }
+
+    s->group = qemu_vfio_find_group(device, errp);
+    if (s->group < 0) {
+        return -ENODEV;
+    }
+    if (ioctl(s->group, VFIO_GROUP_GET_STATUS, &group_status)) {
+        error_setg_errno(errp, errno, "Cannot get the VFIO group status");
+        return -errno;
+    }
+    if (!(group_status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
+        error_setg(errp, "VFIO group is not viable, are all its devices "
+                   "bound to vfio-pci?");
+        return -EINVAL;
+    }
+
+    if (ioctl(s->group, VFIO_GROUP_SET_CONTAINER, &s->container)) {
+        error_setg_errno(errp, errno, "Cannot add the VFIO group to the "
+                         "container");
+        return -errno;
+    }
+    if (ioctl(s->container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU)) {
+        error_setg_errno(errp, errno, "Cannot set up the VFIO IOMMU");
+        return -errno;
+    }
+
+    s->device = ioctl(s->group, VFIO_GROUP_GET_DEVICE_FD, device);
+    if (s->device < 0) {
+        error_setg_errno(errp, errno, "Cannot get the VFIO device fd");
+        return -errno;
+    }
+    if (ioctl(s->device, VFIO_DEVICE_GET_INFO, &device_info)) {
+        error_setg_errno(errp, errno, "Cannot get the VFIO device info");
+        return -errno;
+    }
+    if (!(device_info.flags & VFIO_DEVICE_FLAGS_PCI) ||
+        device_info.num_regions <= VFIO_PCI_CONFIG_REGION_INDEX) {
+        error_setg(errp, "%s is not a PCI device", device);
+        return -EINVAL;
+    }
+
+    s->config_region_info = (struct vfio_region_info) {
+        .index = VFIO_PCI_CONFIG_REGION_INDEX,
+        .argsz = sizeof(struct vfio_region_info),
+    };
+    if (ioctl(s->device, VFIO_DEVICE_GET_REGION_INFO,
+              &s->config_region_info)) {
+        error_setg_errno(errp, errno, "Cannot get the config space info");
+        return -errno;
+    }
+    for (i = 0; i < ARRAY_SIZE(s->bar_region_info); i++) {
+        s->bar_region_info[i] = (struct vfio_region_info) {
+            .index = VFIO_PCI_BAR0_REGION_INDEX + i,
+            .argsz = sizeof(struct vfio_region_info),
+        };
+        if (ioctl(s->device, VFIO_DEVICE_GET_REGION_INFO,
+                  &s->bar_region_info[i])) {
+            error_setg_errno(errp, errno, "Cannot get the info of BAR %d", i);
+            return -errno;
+        }
+    }
+
+    if (qemu_vfio_pci_read_config(s, &pci_cmd, sizeof(pci_cmd),
+                                  PCI_COMMAND) < 0) {
+        error_setg(errp, "Cannot read the PCI command register");
+        return -EIO;
+    }
+    pci_cmd = cpu_to_le16(le16_to_cpu(pci_cmd) | PCI_COMMAND_MASTER);
+    if (qemu_vfio_pci_write_config(s, &pci_cmd, sizeof(pci_cmd),
+                                   PCI_COMMAND) < 0) {
+        error_setg(errp, "Cannot enable bus mastering");
+        return -EIO;
+    }
+    return 0;
+}
+
+static void qemu_vfio_close_fds(QEMUVFIOState *s)
+{
+    if (s->device >= 0) {
+        close(s->device);
+    }
+    if (s->group >= 0) {
+        close(s->group);
+    }
+    if (s->container >= 0) {
+        close(s->container);
+    }
+}
+
+QEMUVFIOState *qemu_vfio_open_pci(const char *device, Error **errp)
+{
+    QEMUVFIOState *s = g_new0(QEMUVFIOState, 1);
+
+    s->container = s->group = s->device = -1;
+    if (qemu_vfio_init_pci(s, device, errp) < 0) {
+        qemu_vfio_close_fds(s);
+        g_free(s);
+        return NULL;
+    }
+    qemu_mutex_init(&s->lock);
+    s->low_water_mark = QEMU_VFIO_IOVA_MIN;
+    s->high_water_mark = QEMU_VFIO_IOVA_MAX;
+    return s;
+}
+
+void *qemu_vfio_pci_map_bar(QEMUVFIOState *s, int index,
+                            uint64_t offset, uint64_t size, Error **errp)
+{
+    void *p;
+
+    assert(index >= 0 && index < ARRAY_SIZE(s->bar_region_info));
+    if (!(s->bar_region_info[index].flags & VFIO_REGION_INFO_FLAG_MMAP) ||
+        offset + size > s->bar_region_info[index].size) {
+        error_setg(errp, "BAR %d cannot be mapped", index);
+        return NULL;
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, s->device,
+             s->bar_region_info[index].offset + offset);
+    if (p == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Failed to map BAR %d", index);
+        return NULL;
+    }
+    return p;
+}
+
+void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
+                             uint64_t offset, uint64_t size)
+{
+    if (bar) {
+        munmap(bar, size);
+    }
+}
+
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
+                           int irq_type, Error **errp)
+{
+    struct vfio_irq_info irq_info = {
+        .argsz = sizeof(irq_info),
+        .index = irq_type,
+    };
+    struct vfio_irq_set *irq_set;
+    size_t irq_set_size;
+    int fd, r;
+
+    if (ioctl(s->device, VFIO_DEVICE_GET_IRQ_INFO, &irq_info)) {
+        error_setg_errno(errp, errno, "Failed to get the device interrupt "
+                         "info");
+        return -errno;
+    }
+    if (!(irq_info.flags & VFIO_IRQ_INFO_EVENTFD) || !irq_info.count) {
+        error_setg(errp, "Device interrupt doesn't support eventfd");
+        return -EINVAL;
+    }
+
+    irq_set_size = sizeof(*irq_set) + sizeof(fd);
+    irq_set = g_malloc0(irq_set_size);
+    *irq_set = (struct vfio_irq_set) {
+        .argsz = irq_set_size,
+        .flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER,
+        .index = irq_info.index,
+        .start = 0,
+        .count = 1,
+    };
+    fd = event_notifier_get_fd(e);
+    memcpy(&irq_set->data, &fd, sizeof(fd));
+
+    r = ioctl(s->device, VFIO_DEVICE_SET_IRQS, irq_set);
+    g_free(irq_set);
+    if (r) {
+        error_setg_errno(errp, errno, "Failed to set up the device "
+                         "interrupt");
+        return -errno;
+    }
+    return 0;
+}
+
+static int qemu_vfio_do_mapping(QEMUVFIOState *s, void *host, size_t size,
+                                uint64_t iova)
+{
+    struct vfio_iommu_type1_dma_map dma_map = {
+        .argsz = sizeof(dma_map),
+        .flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+        .vaddr = (uintptr_t)host,
+        .iova = iova,
+        .size = size,
+    };
+
+    trace_qemu_vfio_do_mapping(s, host, size, iova);
+    if (ioctl(s->container, VFIO_IOMMU_MAP_DMA, &dma_map)) {
+        error_report("VFIO_MAP_DMA: %d", -errno);
+        return -errno;
+    }
+    return 0;
+}
+
+static void qemu_vfio_undo_mapping(QEMUVFIOState *s, uint64_t iova,
+                                   uint64_t size)
+{
+    struct vfio_iommu_type1_dma_unmap unmap = {
+        .argsz = sizeof(unmap),
+        .flags = 0,
+        .iova = iova,
+        .size = size,
+    };
+
+    if (ioctl(s->container, VFIO_IOMMU_UNMAP_DMA, &unmap)) {
+        error_report("VFIO_UNMAP_DMA: %d", -errno);
+    }
+}
+
+/* Return the index of the first mapping that starts above @host */
+static int qemu_vfio_find_mapping(QEMUVFIOState *s, void *host)
+{
+    int lo = 0, hi = s->nr_mappings;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (s->mappings[mid].host <= host) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
+                      bool temporary, uint64_t *iova)
+{
+    IOVAMapping *m;
+    uint64_t iova0;
+    int index, ret = 0;
+
+    assert(((uintptr_t)host & (getpagesize() - 1)) == 0);
+    assert((size & (getpagesize() - 1)) == 0);
+
+    qemu_mutex_lock(&s->lock);
+    index = qemu_vfio_find_mapping(s, host);
+    if (index > 0) {
+        m = &s->mappings[index - 1];
+        if (host + size <= m->host + m->size) {
+            *iova = m->iova + (host - m->host);
+            goto out;
+        }
+    }
+
+    if (s->high_water_mark - s->low_water_mark < size) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    if (temporary) {
+        iova0 = s->high_water_mark - size;
+    } else {
+        iova0 = s->low_water_mark;
+    }
+    ret = qemu_vfio_do_mapping(s, host, size, iova0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (temporary) {
+        s->high_water_mark = iova0;
+    } else {
+        s->low_water_mark = iova0 + size;
+        s->mappings = g_renew(IOVAMapping, s->mappings, s->nr_mappings + 1);
+        memmove(&s->mappings[index + 1], &s->mappings[index],
+                (s->nr_mappings - index) * sizeof(IOVAMapping));
+        s->mappings[index] = (IOVAMapping) {
+            .host = host,
+            .size = size,
+            .iova = iova0,
+        };
+        s->nr_mappings++;
+    }
+    *iova = iova0;
+
+out:
+    qemu_mutex_unlock(&s->lock);
+    return ret;
+}
+
+int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s)
+{
+    qemu_mutex_lock(&s->lock);
+    if (s->high_water_mark < QEMU_VFIO_IOVA_MAX) {
+        trace_qemu_vfio_dma_reset_temporary(s);
+        qemu_vfio_undo_mapping(s, s->high_water_mark,
+                               QEMU_VFIO_IOVA_MAX - s->high_water_mark);
+        s->high_water_mark = QEMU_VFIO_IOVA_MAX;
+    }
+    qemu_mutex_unlock(&s->lock);
+    return 0;
+}
+
+void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host)
+{
+    IOVAMapping *m;
+    int index;
+
+    qemu_mutex_lock(&s->lock);
+    index = qemu_vfio_find_mapping(s, host) - 1;
+    if (index < 0 || s->mappings[index].host != host) {
+        goto out;
+    }
+
+    m = &s->mappings[index];
+    qemu_vfio_undo_mapping(s, m->iova, m->size);
+    /* The IOVA range is only reused if it was the last one */
+    if (m->iova + m->size == s->low_water_mark) {
+        s->low_water_mark = m->iova;
+    }
+    memmove(m, m + 1, (s->nr_mappings - index - 1) * sizeof(IOVAMapping));
+    s->nr_mappings--;
+
+out:
+    qemu_mutex_unlock(&s->lock);
+}
+
+void qemu_vfio_close(QEMUVFIOState *s)
+{
+    qemu_vfio_dma_reset_temporary(s);
+    while (s->nr_mappings) {
+        qemu_vfio_dma_unmap(s, s->mappings[s->nr_mappings - 1].host);
+    }
+    g_free(s->mappings);
+    qemu_mutex_destroy(&s->lock);
+    qemu_vfio_close_fds(s);
+    g_free(s);
+}
@@ -145,6 +145,7 @@ int vga_interface_type = VGA_NONE;
 static int full_screen = 0;
 static int no_frame = 0;
 int no_quit = 0;
+static bool perf_map;
 #ifdef CONFIG_GTK
 static bool grab_on_hover;
 #endif
@@ -458,6 +459,25 @@ static QemuOptsList qemu_mem_opts = {
     },
 };
 
+static QemuOptsList qemu_accel_opts = {
+    .name = "accel",
+    .implied_opt_name = "accel",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_accel_opts.head),
+    .merge_lists = true,
+    .desc = {
+        {
+            .name = "accel",
+            .type = QEMU_OPT_STRING,
+            .help = "Select the type of accelerator",
+        }, {
+            .name = "thread",
+            .type = QEMU_OPT_STRING,
+            .help = "Enable/disable multi-threaded TCG",
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_icount_opts = {
     .name = "icount",
     .implied_opt_name = "shift",
@@ -479,6 +499,18 @@ static QemuOptsList qemu_icount_opts = {
         }, {
             .name = "rrfile",
             .type = QEMU_OPT_STRING,
+        }, {
+            .name = "rrsnapshot",
+            .type = QEMU_OPT_STRING,
+        }, {
+            .name = "rrperiod",
+            .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "rrseek",
+            .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "rrcompress",
+            .type = QEMU_OPT_BOOL,
         },
         { /* end of list */ }
     },
@@ -723,6 +755,47 @@ StatusInfo *qmp_query_status(Error **errp)
     return info;
 }
 
+/* When main() started, and when each startup phase was reached after it */
+static int64_t startup_time;
+static int64_t startup_phase_ns[STARTUP_PHASE__MAX];
+static bool startup_phase_reached[STARTUP_PHASE__MAX];
+
+void qemu_startup_phase(StartupPhase phase)
+{
+    if (startup_phase_reached[phase]) {
+        return;
+    }
+    startup_phase_reached[phase] = true;
+    startup_phase_ns[phase] = get_clock() - startup_time;
+    trace_qemu_startup_phase(StartupPhase_lookup[phase],
+                             startup_phase_ns[phase]);
+}
+
+StartupPhaseTimeList *qmp_query_startup_timing(Error **errp)
+{
+    StartupPhaseTimeList *head = NULL, *cur_item = NULL, *info;
+    int phase;
+
+    for (phase = 0; phase < STARTUP_PHASE__MAX; phase++) {
+        if (!startup_phase_reached[phase]) {
+            continue;
+        }
+        info = g_malloc0(sizeof(*info));
+        info->value = g_malloc0(sizeof(*info->value));
+        info->value->phase = phase;
+        info->value->time_ns = startup_phase_ns[phase];
+
+        if (!cur_item) {
+            head = cur_item = info;
+        } else {
+            cur_item->next = info;
+            cur_item = info;
+        }
+    }
+
+    return head;
+}
+
 static bool qemu_vmstop_requested(RunState *r)
 {
     qemu_mutex_lock(&vmstop_lock);
@@ -764,6 +837,7 @@ void vm_start(void)
         cpu_enable_ticks();
         runstate_set(RUN_STATE_RUNNING);
         vm_state_notify(1, RUN_STATE_RUNNING);
+        qemu_startup_phase(STARTUP_PHASE_VM_START);
         resume_all_vcpus();
     }
 
@@ -2347,8 +2421,11 @@ static int device_init_func(void *opaque, QemuOpts *opts, Error **errp)
 
     dev = qdev_device_add(opts, &err);
     if (!dev) {
-        error_report_err(err);
-        return -1;
+        if (err) {
+            error_report_err(err);
+            return -1;
+        }
+        return 0;
     }
     object_unref(OBJECT(dev));
     return 0;
@@ -2402,6 +2479,10 @@ static int mon_init_func(void *opaque, QemuOpts *opts, Error **errp)
     if (qemu_opt_get_bool(opts, "default", 0))
         flags |= MONITOR_IS_DEFAULT;
 
+    if (qemu_opt_get_bool(opts, "x-oob", false)) {
+        flags |= MONITOR_USE_OOB;
+    }
+
     chardev = qemu_opt_get(opts, "chardev");
     chr = qemu_chr_find(chardev);
     if (chr == NULL) {
@@ -2409,6 +2490,17 @@ static int mon_init_func(void *opaque, QemuOpts *opts, Error **errp)
         exit(1);
     }
 
+    if (flags & MONITOR_USE_OOB) {
+        if (!(flags & MONITOR_USE_CONTROL)) {
+            error_report("x-oob requires a QMP monitor (mode=control)");
+            exit(1);
+        }
+        if (chr->is_mux) {
+            error_report("x-oob is not supported on multiplexed chardevs");
+            exit(1);
+        }
+    }
+
     qemu_chr_fe_claim_no_fail(chr);
     monitor_init(chr, flags);
     return 0;
@@ -2959,6 +3051,7 @@ int main(int argc, char **argv, char **envp)
     DisplayState *ds;
     int cyls, heads, secs, translation;
     QemuOpts *hda_opts = NULL, *opts, *machine_opts, *icount_opts = NULL;
+    QemuOpts *accel_opts = NULL;
     QemuOptsList *olist;
     int optind;
     const char *optarg;
@@ -2984,6 +3077,8 @@ int main(int argc, char **argv, char **envp)
     Error *main_loop_err = NULL;
     Error *err = NULL;
 
+    startup_time = get_clock();
+
     qemu_init_cpu_loop();
     qemu_mutex_lock_iothread();
 
@@ -3018,6 +3113,7 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_msg_opts);
     qemu_add_opts(&qemu_name_opts);
     qemu_add_opts(&qemu_numa_opts);
+    qemu_add_opts(&qemu_accel_opts);
     qemu_add_opts(&qemu_icount_opts);
     qemu_add_opts(&qemu_semihosting_config_opts);
     qemu_add_opts(&qemu_fw_cfg_opts);
@@ -3670,6 +3766,21 @@ int main(int argc, char **argv, char **envp)
                     exit(1);
                 }
                 break;
+            case QEMU_OPTION_accel:
+                accel_opts = qemu_opts_parse_noisily(qemu_find_opts("accel"),
+                                                     optarg, true);
+                if (!accel_opts) {
+                    exit(1);
+                }
+                optarg = qemu_opt_get(accel_opts, "accel");
+                if (optarg) {
+                    char *accel_str = g_strdup_printf("accel=%s", optarg);
+
+                    olist = qemu_find_opts("machine");
+                    qemu_opts_parse_noisily(olist, accel_str, false);
+                    g_free(accel_str);
+                }
+                break;
              case QEMU_OPTION_no_kvm:
                 olist = qemu_find_opts("machine");
                 qemu_opts_parse_noisily(olist, "accel=tcg", false);
@@ -3860,6 +3971,9 @@ int main(int argc, char **argv, char **envp)
                     tcg_tb_size = 0;
                 }
                 break;
+            case QEMU_OPTION_perfmap:
+                perf_map = true;
+                break;
             case QEMU_OPTION_icount:
                 icount_opts = qemu_opts_parse_noisily(qemu_find_opts("icount"),
                                                       optarg, true);
@@ -4322,6 +4436,10 @@ int main(int argc, char **argv, char **envp)
     }
 
     configure_accelerator(current_machine);
+    qemu_startup_phase(STARTUP_PHASE_ACCEL);
+    if (perf_map && tcg_enabled()) {
+        tcg_perf_map_init();
+    }
 
     if (qtest_chrdev) {
         qtest_init(qtest_chrdev, qtest_log, &error_fatal);
@@ -4397,6 +4515,14 @@ int main(int argc, char **argv, char **envp)
         qemu_opts_del(icount_opts);
     }
 
+    if (accel_opts) {
+        if (qemu_opt_get(accel_opts, "thread") && !tcg_enabled()) {
+            error_report("thread= is only supported with the TCG accelerator");
+            exit(1);
+        }
+        qemu_tcg_configure(accel_opts, &error_fatal);
+    }
+
     /* clean up network at qemu process termination */
     atexit(&net_cleanup);
 
@@ -4431,6 +4557,7 @@ int main(int argc, char **argv, char **envp)
 
     blk_mig_init();
     ram_mig_init();
+    dirty_bitmap_mig_init();
 
     /* If the currently selected machine wishes to override the units-per-bus
      * property of its default HBA interface type, do so now. */
@@ -4511,6 +4638,7 @@ int main(int argc, char **argv, char **envp)
     current_machine->cpu_model = cpu_model;
 
     machine_class->init(current_machine);
+    qemu_startup_phase(STARTUP_PHASE_MACHINE_INIT);
 
     realtime_init();
 
@@ -4539,6 +4667,7 @@ int main(int argc, char **argv, char **envp)
                           device_init_func, NULL, NULL)) {
         exit(1);
     }
+    qemu_startup_phase(STARTUP_PHASE_DEVICES);
 
     /* Did we create any drives that we failed to create a device for? */
     drive_check_orphaned();
@@ -4613,6 +4742,7 @@ int main(int argc, char **argv, char **envp)
      * when bus is created by qdev.c */
     qemu_register_reset(qbus_reset_all_fn, sysbus_get_default());
     qemu_run_machine_init_done_notifiers();
+    qemu_startup_phase(STARTUP_PHASE_MACHINE_DONE);
 
     if (rom_check_and_register_reset() != 0) {
         error_report("rom check and register reset failed");
@@ -4626,8 +4756,11 @@ int main(int argc, char **argv, char **envp)
        clock values from the log. */
     replay_checkpoint(CHECKPOINT_RESET);
     qemu_system_reset(VMRESET_SILENT);
+    qemu_startup_phase(STARTUP_PHASE_RESET);
     register_global_state();
-    if (loadvm) {
+    if (replay_mode != REPLAY_MODE_NONE) {
+        replay_vmstate_init();
+    } else if (loadvm) {
         if (load_vmstate(loadvm) < 0) {
             autostart = 0;
         }